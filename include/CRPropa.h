@@ -2,32 +2,61 @@
 #ifndef CRPROPA_H
 #define CRPROPA_H
 
+#include "crpropa/AliasTable.h"
+#include "crpropa/AMRGrid.h"
 #include "crpropa/Candidate.h"
+#include "crpropa/CandidateSnapshot.h"
 #include "crpropa/Common.h"
+#include "crpropa/Convergence.h"
 #include "crpropa/Cosmology.h"
+#include "crpropa/Diagnostics.h"
+#include "crpropa/DintOperator.h"
 #include "crpropa/EmissionMap.h"
 #include "crpropa/Geometry.h"
 #include "crpropa/Grid.h"
 #include "crpropa/GridTools.h"
+#include "crpropa/IntegratorStatistics.h"
+#include "crpropa/InteractionRateEngine.h"
+#include "crpropa/IsotopeSelection.h"
+#include "crpropa/KdTree.h"
+#include "crpropa/MappedGrid.h"
 #include "crpropa/Logging.h"
 #include "crpropa/Module.h"
 #include "crpropa/ModuleList.h"
+#include "crpropa/ModuleList1D.h"
+#include "crpropa/NumericTable.h"
 #include "crpropa/ParticleID.h"
 #include "crpropa/ParticleMass.h"
 #include "crpropa/ParticleState.h"
 #include "crpropa/PhotonBackground.h"
 #include "crpropa/PhotonPropagation.h"
+#include "crpropa/QuantizedGrid.h"
 #include "crpropa/Random.h"
 #include "crpropa/Referenced.h"
+#include "crpropa/RunMetrics.h"
+#include "crpropa/SecondaryAdmission.h"
+#include "crpropa/SlabDecomposition.h"
+#include "crpropa/SobolSequence.h"
 #include "crpropa/Source.h"
+#include "crpropa/SourceArray.h"
+#include "crpropa/SourceCatalog.h"
+#include "crpropa/SourceReweighting.h"
+#include "crpropa/StaticModuleChain.h"
+#include "crpropa/TableRegistry.h"
+#include "crpropa/TargetedEmission.h"
+#include "crpropa/TransferMatrix.h"
+#include "crpropa/TransportSolver1D.h"
+#include "crpropa/Trace.h"
 #include "crpropa/Units.h"
 #include "crpropa/Variant.h"
 #include "crpropa/Vector3.h"
 #include "crpropa/Version.h"
 
 #include "crpropa/module/AdiabaticCooling.h"
+#include "crpropa/module/BatchModule.h"
 #include "crpropa/module/Boundary.h"
 #include "crpropa/module/BreakCondition.h"
+#include "crpropa/module/ContinuousLosses.h"
 #include "crpropa/module/DiffusionSDE.h"
 #include "crpropa/module/EMCascade.h"
 #include "crpropa/module/EMDoublePairProduction.h"
@@ -37,6 +66,10 @@
 #include "crpropa/module/ElasticScattering.h"
 #include "crpropa/module/ElectronPairProduction.h"
 #include "crpropa/module/HDF5Output.h"
+#include "crpropa/module/HistogramOutput.h"
+#include "crpropa/module/NetworkOutput.h"
+#include "crpropa/module/ParquetOutput.h"
+#include "crpropa/module/InteractionSampler.h"
 #include "crpropa/module/NuclearDecay.h"
 #include "crpropa/module/Observer.h"
 #include "crpropa/module/OutputShell.h"
@@ -47,15 +80,26 @@
 #include "crpropa/module/PhotonOutput1D.h"
 #include "crpropa/module/PropagationBP.h"
 #include "crpropa/module/PropagationCK.h"
+#include "crpropa/module/PropagationDP.h"
+#include "crpropa/module/PropagationGC.h"
+#include "crpropa/module/PropagationSmallAngle.h"
 #include "crpropa/module/Redshift.h"
 #include "crpropa/module/RestrictToRegion.h"
+#include "crpropa/module/ShardedOutput.h"
+#include "crpropa/module/ShellCrossingStore.h"
 #include "crpropa/module/SimplePropagation.h"
+#include "crpropa/module/SnapshotCollector.h"
+#include "crpropa/module/SophiaEventLibrary.h"
 #include "crpropa/module/SynchrotronRadiation.h"
+#include "crpropa/module/TerminationConditions.h"
 #include "crpropa/module/TextOutput.h"
+#include "crpropa/module/TrajectoryOutput.h"
 #include "crpropa/module/Tools.h"
+#include "crpropa/module/WeightWindow.h"
 
 #include "crpropa/magneticField/AMRMagneticField.h"
 #include "crpropa/magneticField/ArchimedeanSpiralField.h"
+#include "crpropa/magneticField/CachedMagneticField.h"
 #include "crpropa/magneticField/JF12Field.h"
 #include "crpropa/magneticField/JF12FieldSolenoidal.h"
 #include "crpropa/magneticField/MagneticField.h"
@@ -70,6 +114,7 @@
 #include "crpropa/magneticField/turbulentField/TurbulentField.h"
 
 #include "crpropa/advectionField/AdvectionField.h"
+#include "crpropa/advectionField/AdvectionFieldGrid.h"
 
 #include "crpropa/massDistribution/Density.h"
 #include "crpropa/massDistribution/Nakanishi.h"
@@ -77,6 +122,7 @@
 #include "crpropa/massDistribution/Massdistribution.h"
 #include "crpropa/massDistribution/Ferriere.h"
 #include "crpropa/massDistribution/ConstantDensity.h"
+#include "crpropa/massDistribution/DensityGrid.h"
 
 /** \namespace crpropa
  *  @brief CRPropa is a public astrophysical simulation framework for propagating extraterrestrial ultra-high energy particles.
@@ -0,0 +1,184 @@
+#ifndef CRPROPA_AMRGRID_H
+#define CRPROPA_AMRGRID_H
+
+#include "crpropa/Grid.h"
+#include "crpropa/Units.h"
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace crpropa {
+
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ @class AMRGrid
+ @brief Block-structured adaptive mesh with trilinear interpolation
+
+ The volume is covered by Nx * Ny * Nz root blocks, each of which can be
+ refined into 8 child blocks of half the size, recursively. Every block holds
+ 8^3 cell-centred values, as e.g. the blocks of a FLASH simulation. The
+ blocks form an octree below a regular array of root blocks, so that the
+ lookup of a position descends one level per step without any hashing or
+ allocation. The values are stored in one flat array of bricks, each with a
+ layer of ghost cells around the 8^3 cells, so that the interpolation within
+ the finest block at a position needs no neighbour lookup.
+
+ Blocks are added with setBlock, missing parents are created on the way and
+ new children inherit the values of their parent. After the last block
+ fillGhostCells has to be called, it samples the ghost cells from the finest
+ block at their position. Outside of the volume the grid is periodically
+ continued.
+ */
+template<typename T>
+class AMRGrid: public Referenced {
+public:
+	static const int cells = 8; ///< cells per block along each axis
+	static const int brick = cells + 2; ///< values per brick along each axis, with ghost cells
+
+private:
+	struct Block {
+		int32_t firstChild; // index of the first of the 8 children, -1 for leaves
+		int32_t level;
+	};
+	std::vector<Block> blocks;
+	std::vector<T> values; // one brick of brick^3 values per block
+	size_t Nx, Ny, Nz; // number of root blocks
+	Vector3d origin, blockSize;
+	int maxLevel;
+
+	static size_t brickIndex(int ix, int iy, int iz) {
+		return (size_t(ix + 1) * brick + (iy + 1)) * brick + (iz + 1);
+	}
+	// finest block at a position and the position in the block in [0, 1)
+	size_t findBlock(const Vector3d &position, Vector3d &local) const {
+		Vector3d r = (position - origin) / blockSize;
+		Vector3d fl = r.floor();
+		int ix = periodicIndex(int(fl.x), Nx);
+		int iy = periodicIndex(int(fl.y), Ny);
+		int iz = periodicIndex(int(fl.z), Nz);
+		size_t b = (ix * Ny + iy) * Nz + iz;
+		local = r - fl;
+		while (blocks[b].firstChild >= 0) {
+			local *= 2;
+			int cx = local.x >= 1, cy = local.y >= 1, cz = local.z >= 1;
+			local -= Vector3d(cx, cy, cz);
+			b = blocks[b].firstChild + ((cx << 2) | (cy << 1) | cz);
+		}
+		return b;
+	}
+	void refine(size_t block);
+public:
+	/**
+	 @param origin		lower corner of the volume
+	 @param Nx, Ny, Nz	number of root blocks along each axis
+	 @param blockSize	edge lengths of a root block
+	 */
+	AMRGrid(Vector3d origin, size_t Nx, size_t Ny, size_t Nz, Vector3d blockSize);
+
+	/**
+	 Set the values of a block, creating the block and its parents if needed.
+	 @param level		refinement level, 0 for the root blocks
+	 @param ix, iy, iz	block index at this level starting from the origin
+	 @param v			cells^3 values, z fastest as in Grid
+	 */
+	void setBlock(int level, size_t ix, size_t iy, size_t iz, const T *v);
+	/** Sample the ghost cells of all leaf blocks, required after setBlock */
+	void fillGhostCells();
+
+	Vector3d getOrigin() const {
+		return origin;
+	}
+	size_t getNx() const {
+		return Nx;
+	}
+	size_t getNy() const {
+		return Ny;
+	}
+	size_t getNz() const {
+		return Nz;
+	}
+	Vector3d getBlockSize() const {
+		return blockSize;
+	}
+	size_t getNumberOfBlocks() const {
+		return blocks.size();
+	}
+	int getMaximumLevel() const {
+		return maxLevel;
+	}
+	/** Size of the blocks and values in bytes */
+	size_t getSizeOf() const {
+		return sizeof(Block) * blocks.size() + sizeof(T) * values.size();
+	}
+
+	/** Refinement level of the finest block at a position */
+	int getLevel(const Vector3d &position) const {
+		Vector3d local;
+		return blocks[findBlock(position, local)].level;
+	}
+
+	/** Value of the cell of the finest block at a position */
+	T closestValue(const Vector3d &position) const {
+		Vector3d u;
+		size_t b = findBlock(position, u);
+		int ix = std::min(int(u.x * cells), cells - 1);
+		int iy = std::min(int(u.y * cells), cells - 1);
+		int iz = std::min(int(u.z * cells), cells - 1);
+		return values[b * brick * brick * brick + brickIndex(ix, iy, iz)];
+	}
+
+	/** Trilinear interpolation in the finest block at a position */
+	T interpolate(const Vector3d &position) const {
+		Vector3d u;
+		size_t b = findBlock(position, u);
+		const T *v = &values[b * brick * brick * brick];
+
+		// cell-centred coordinates, the ghost cells shift them by one
+		Vector3d r = u * cells + Vector3d(0.5);
+		int ix = std::min(int(r.x), brick - 2);
+		int iy = std::min(int(r.y), brick - 2);
+		int iz = std::min(int(r.z), brick - 2);
+		double fx = r.x - ix, fX = 1 - fx;
+		double fy = r.y - iy, fY = 1 - fy;
+		double fz = r.z - iz, fZ = 1 - fz;
+
+		const size_t sx = brick * brick, sy = brick;
+		const T *c = v + ix * sx + iy * sy + iz;
+		T b0(0.);
+		b0 += c[0] * (fX * fY * fZ);
+		b0 += c[sx] * (fx * fY * fZ);
+		b0 += c[sy] * (fX * fy * fZ);
+		b0 += c[1] * (fX * fY * fz);
+		b0 += c[sx + 1] * (fx * fY * fz);
+		b0 += c[sy + 1] * (fX * fy * fz);
+		b0 += c[sx + sy] * (fx * fy * fZ);
+		b0 += c[sx + sy + 1] * (fx * fy * fz);
+		return b0;
+	}
+};
+
+typedef AMRGrid<Vector3f> AMRGrid3f;
+typedef AMRGrid<float> AMRGrid1f;
+
+#ifdef CRPROPA_HAVE_HDF5
+/**
+ Load the magnetic field of a FLASH checkpoint or plot file (HDF5) with
+ blocks of 8^3 cells, datasets "refine level", "bounding box" and
+ "magx", "magy", "magz".
+ @param lengthUnit	length unit of the file, cm for FLASH
+ @param fieldUnit	field unit of the file, gauss for FLASH
+ */
+ref_ptr<AMRGrid3f> loadFLASHMagneticField(const std::string &filename,
+		double lengthUnit = centimeter, double fieldUnit = gauss);
+#endif // CRPROPA_HAVE_HDF5
+
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_AMRGRID_H
@@ -0,0 +1,60 @@
+#ifndef CRPROPA_ALIASTABLE_H
+#define CRPROPA_ALIASTABLE_H
+
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+
+namespace crpropa {
+
+class Random;
+
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ @class AliasTable
+ @brief Walker alias table to draw a bin of a discrete distribution in O(1).
+
+ Built once from the bin weights or a cumulative distribution, each draw
+ then costs one random number, independent of the number of bins.
+ Bins with zero weight are never drawn.
+ */
+class AliasTable {
+	std::vector<double> probability; ///< probability to keep the bin, else take the alias
+	std::vector<uint32_t> alias;
+
+public:
+	AliasTable();
+	/// Build from (unnormalized) bin weights
+	AliasTable(const std::vector<double> &weights);
+
+	/// Build from (unnormalized) bin weights
+	void setWeights(const std::vector<double> &weights);
+	/// Build from an (unnormalized) cumulative distribution, without leading
+	/// zero, i.e. the same bins as drawn by Random::randBin(cdf)
+	void setCumulative(const std::vector<double> &cdf);
+
+	/// Draw a random bin
+	size_t sample(Random &random) const;
+	size_t size() const;
+	/// Bytes allocated by the table
+	size_t getMemoryUsage() const;
+};
+
+/**
+ Alias tables for every row of a table of (unnormalized) cumulative
+ distributions, as stored by the interaction modules.
+ */
+std::vector<AliasTable> cumulativeAliasTables(const std::vector<std::vector<double> > &cdfs);
+
+/** Bytes allocated by a vector of alias tables */
+size_t memoryUsage(const std::vector<AliasTable> &tables);
+
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_ALIASTABLE_H
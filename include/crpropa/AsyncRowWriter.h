@@ -0,0 +1,210 @@
+#ifndef CRPROPA_ASYNCROWWRITER_H
+#define CRPROPA_ASYNCROWWRITER_H
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace crpropa {
+/**
+ * \addtogroup Output
+ * @{
+ */
+
+/**
+ @class AsyncRowWriter
+ @brief Bounded lock-free multi-producer queue of fixed-size rows, drained by a dedicated writer thread.
+
+ Producers push rows without locks, the writer thread passes them in order
+ of arrival to the write function. Push blocks while the queue is full
+ (back-pressure). The queue is the bounded MPMC queue of D. Vyukov with a
+ single consumer.
+ */
+template<typename T>
+class AsyncRowWriter {
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T row;
+	};
+
+	std::unique_ptr<Cell[]> cells;
+	size_t mask;
+	char padding0[64];
+	std::atomic<size_t> enqueuePosition;
+	char padding1[64];
+	size_t dequeuePosition; // only used by the writer thread
+
+	std::function<void(const T&)> write;
+	std::function<void()> flush;
+
+	std::atomic<bool> stopping;
+	std::atomic<bool> failed;
+	std::atomic<unsigned long> flushRequested, flushDone;
+	std::string error;
+	std::thread writer;
+
+	bool pop(T &row) {
+		Cell *cell = &cells[dequeuePosition & mask];
+		size_t sequence = cell->sequence.load(std::memory_order_acquire);
+		if (sequence != dequeuePosition + 1)
+			return false;
+		row = std::move(cell->row);
+		cell->sequence.store(dequeuePosition + mask + 1, std::memory_order_release);
+		dequeuePosition++;
+		return true;
+	}
+
+	void handle(const std::function<void()> &f) {
+		if (failed.load(std::memory_order_relaxed))
+			return;
+		try {
+			f();
+		} catch (std::exception &e) {
+			error = e.what();
+			failed.store(true, std::memory_order_release);
+		}
+	}
+
+	void run() {
+		T row;
+		while (true) {
+			if (pop(row)) {
+				handle([&]() { write(row); });
+				continue;
+			}
+			unsigned long requested = flushRequested.load(std::memory_order_acquire);
+			if (requested != flushDone.load(std::memory_order_relaxed)) {
+				handle(flush);
+				flushDone.store(requested, std::memory_order_release);
+				continue;
+			}
+			if (stopping.load(std::memory_order_acquire)) {
+				// rows pushed before stop are drained above
+				if (pop(row)) {
+					handle([&]() { write(row); });
+					continue;
+				}
+				handle(flush);
+				return;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+		}
+	}
+
+	void checkError() const {
+		if (failed.load(std::memory_order_acquire))
+			throw std::runtime_error("AsyncRowWriter: " + error);
+	}
+
+public:
+	/**
+	 @param capacity	number of queued rows, rounded up to a power of two
+	 @param write	called by the writer thread for every row
+	 @param flush	called by the writer thread on sync and at the end
+	 */
+	AsyncRowWriter(size_t capacity, std::function<void(const T&)> write,
+			std::function<void()> flush) :
+			mask(0), enqueuePosition(0), dequeuePosition(0), write(write),
+			flush(flush), stopping(false), failed(false), flushRequested(0),
+			flushDone(0) {
+		size_t size = 2;
+		while (size < capacity)
+			size *= 2;
+		mask = size - 1;
+		cells.reset(new Cell[size]);
+		for (size_t i = 0; i < size; i++)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+		writer = std::thread(&AsyncRowWriter::run, this);
+	}
+
+	~AsyncRowWriter() {
+		stop();
+	}
+
+	/// Bytes of the queue
+	size_t getMemoryUsage() const {
+		return (mask + 1) * sizeof(Cell);
+	}
+
+	/// Drain the queue, flush and join the writer thread
+	void stop() {
+		stopping.store(true, std::memory_order_release);
+		if (writer.joinable())
+			writer.join();
+	}
+
+	/// Queue a row, waits while the queue is full
+	void push(const T &row) {
+		size_t position = enqueuePosition.load(std::memory_order_relaxed);
+		while (true) {
+			Cell *cell = &cells[position & mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			if (sequence == position) {
+				if (enqueuePosition.compare_exchange_weak(position, position + 1,
+						std::memory_order_relaxed)) {
+					cell->row = row;
+					cell->sequence.store(position + 1, std::memory_order_release);
+					return;
+				}
+			} else if (sequence < position) {
+				// full, wait for the writer
+				checkError();
+				std::this_thread::yield();
+				position = enqueuePosition.load(std::memory_order_relaxed);
+			} else {
+				position = enqueuePosition.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	/// Queue a row if the queue is not full and the writer has not failed,
+	/// returns false otherwise without waiting
+	bool tryPush(const T &row) {
+		if (failed.load(std::memory_order_acquire))
+			return false;
+		size_t position = enqueuePosition.load(std::memory_order_relaxed);
+		while (true) {
+			Cell *cell = &cells[position & mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			if (sequence == position) {
+				if (enqueuePosition.compare_exchange_weak(position, position + 1,
+						std::memory_order_relaxed)) {
+					cell->row = row;
+					cell->sequence.store(position + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (sequence < position) {
+				return false;
+			} else {
+				position = enqueuePosition.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	/// Wait until all rows pushed before are written and flush was called
+	void sync() {
+		unsigned long request = flushRequested.fetch_add(1, std::memory_order_acq_rel) + 1;
+		while (flushDone.load(std::memory_order_acquire) < request)
+			std::this_thread::yield();
+		checkError();
+	}
+
+	/// Error of the write or flush function, which stops further writing
+	bool hasFailed() const {
+		return failed.load(std::memory_order_acquire);
+	}
+	const std::string &getError() const {
+		return error;
+	}
+};
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_ASYNCROWWRITER_H
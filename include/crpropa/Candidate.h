@@ -33,13 +33,44 @@ public:
 
 	std::vector<ref_ptr<Candidate> > secondaries; /**< Secondary particles from interactions */
 
-	typedef Loki::AssocVector<std::string, Variant> PropertyMap;
-	PropertyMap properties; /**< Map of property names and their values. */
+	/** Handle of an interned property name, see Candidate::getPropertyKey */
+	typedef uint32_t PropertyKey;
+	typedef Loki::AssocVector<PropertyKey, Variant> PropertyMap;
+
+	/**
+	 Kinematics of the current state at the current redshift, shared by the
+	 interaction modules within a step, see Candidate::getKinematics
+	 */
+	struct Kinematics {
+		double lorentzFactor; /**< Lorentz factor */
+		double redshiftFactor; /**< 1 + z */
+		double localLorentzFactor; /**< Lorentz factor scaled to the photon fields at redshift 0: lorentzFactor * (1 + z) */
+		double lgLocalLorentzFactor; /**< log10(localLorentzFactor) */
+		double rigidity; /**< E / (Z e) [V] */
+
+		/**
+		 Position of lgLocalLorentzFactor in an equidistant tabulation of n
+		 points in [lgMin, lgMax]: index i of the lower point and fraction
+		 in [0, 1) to the next one. False if outside of (lgMin, lgMax).
+		 */
+		bool locate(double lgMin, double lgMax, size_t n, size_t &i, double &fraction) const;
+	};
 
 	/** Parent candidate. 0 if no parent (initial particle). Must not be a ref_ptr to prevent circular referencing. */
 	Candidate *parent;
 
 private:
+	friend class CandidateSnapshot;
+	friend class ParticleCollector;
+
+	/** Property map, shared between clones until one of them modifies it */
+	class SharedProperties: public Referenced {
+	public:
+		PropertyMap values;
+	};
+	ref_ptr<SharedProperties> properties; /**< Map of property keys and their values, 0 if empty */
+	PropertyMap &modifyProperties();
+
 	bool active; /**< Active status */
 	double weight; /**< Weight of the candidate */
 	double redshift; /**< Current simulation time-point in terms of redshift z */
@@ -49,6 +80,23 @@ private:
 
 	static uint64_t nextSerialNumber;
 	uint64_t serialNumber;
+	/** Serial number from the block of the calling thread, refilled from nextSerialNumber */
+	static uint64_t newSerialNumber();
+
+	bool detached; /**< Detached from its parent, the serial numbers below are used */
+	uint64_t sourceSerialNumber;
+	uint64_t createdSerialNumber;
+
+	uint64_t randomStream; /**< Key of the counter-based random stream, 0 if unset */
+	uint64_t randomCounter; /**< Next block of the random stream */
+	uint64_t randomStart; /**< Block of the random stream at the source, restored by restart */
+	uint64_t createdSecondaries; /**< Number of secondaries created, used to derive their streams */
+
+	mutable Kinematics kinematics; /**< Cached kinematics of the state below */
+	mutable int kinematicsId;
+	mutable double kinematicsEnergy; /**< negative if not computed */
+	mutable double kinematicsRedshift;
+	void updateKinematics() const;
 
 public:
 	Candidate(
@@ -75,6 +123,17 @@ public:
 	void setRedshift(double z);
 	double getRedshift() const;
 
+	/**
+	 Kinematics of the current state, computed once and reused until the
+	 particle ID, energy or redshift change, so that the modules of a step
+	 share the Lorentz factor and its logarithm.
+	 */
+	inline const Kinematics &getKinematics() const {
+		if (kinematicsEnergy != current.getEnergy() || kinematicsId != current.getId() || kinematicsRedshift != redshift)
+			updateKinematics();
+		return kinematics;
+	}
+
 	/**
 	 Sets weight of each candidate.
 	 Weights are calculated for each tracked secondary.
@@ -106,21 +165,57 @@ public:
 	bool removeProperty(const std::string &name);
 	bool hasProperty(const std::string &name) const;
 
+	/**
+	 Property access by interned key, avoiding the name lookup.
+	 Obtain the key once with Candidate::getPropertyKey.
+	 */
+	void setProperty(PropertyKey key, const Variant &value);
+	const Variant &getProperty(PropertyKey key) const;
+	bool removeProperty(PropertyKey key);
+	bool hasProperty(PropertyKey key) const;
+	/** Value of the property with a single lookup, NULL if the candidate does not have it */
+	const Variant *findProperty(PropertyKey key) const;
+
+	/**
+	 All properties of the candidate. Clones share the map until one of
+	 them modifies it (copy-on-write), so the reference is only valid until
+	 the next modification.
+	 */
+	const PropertyMap &getProperties() const;
+
+	/**
+	 Interned key of a property name, the name is registered if unknown.
+	 Keys are valid for the lifetime of the process and can be shared
+	 between threads.
+	 */
+	static PropertyKey getPropertyKey(const std::string &name);
+	/** Key of a registered property name, false if the name is unknown */
+	static bool findPropertyKey(const std::string &name, PropertyKey &key);
+	/** Name of a registered property key */
+	static const std::string &getPropertyName(PropertyKey key);
+
 	/**
 	 Add a new candidate to the list of secondaries.
 	 @param id		particle ID of the secondary
 	 @param energy	energy of the secondary
+	 @param weight	weight of the secondary relative to this candidate
 
 	 Adds a new candidate to the list of secondaries of this candidate.
 	 The secondaries Candidate::source and Candidate::previous state are set to the _source_ and _previous_ state of its parent.
 	 The secondaries Candidate::created and Candidate::current state are set to the _current_ state of its parent, except for the secondaries current energy and particle id.
 	 Trajectory length and redshift are copied from the parent.
+	 The weight of the secondary is the weight of the parent times the given weight,
+	 so weights assigned at the source are carried through all generations.
+	 Before, the given weight was taken as it is; modules and plugins that
+	 passed the weight of the parent times a factor now have to pass the factor.
 	 */
 	void addSecondary(Candidate *c);
 	inline void addSecondary(ref_ptr<Candidate> c) { addSecondary(c.get()); };
 	void addSecondary(int id, double energy, double weight = 1);
 	void addSecondary(int id, double energy, Vector3d position, double weight = 1);
 	void clearSecondaries();
+	/** Number of secondaries created so far, including those not admitted */
+	uint64_t getNumberOfCreatedSecondaries() const;
 
 	std::string getDescription() const;
 
@@ -134,23 +229,95 @@ public:
 	/** Serial number of candidate at creation */
 	uint64_t getCreatedSerialNumber() const;
 
-	/** Set the next serial number to use */
+	/**
+	 Remove the link to the parent candidate, e.g. before the parent is
+	 released. The source and creation serial numbers are preserved.
+	 */
+	void detachFromParent();
+
+	/**
+	 Counter-based random stream of the candidate, see Random::setStream.
+	 Secondaries get a stream derived from the stream of their parent and
+	 their creation index, so the streams are independent of the scheduling.
+	 */
+	void setRandomStream(uint64_t key, uint64_t counter = 0);
+	uint64_t getRandomStream() const;
+	void setRandomCounter(uint64_t counter);
+	uint64_t getRandomCounter() const;
+
+	/**
+	 Set the shared serial number counter, the next serial number assigned is
+	 snr + 1. The threads take the serial numbers in blocks of
+	 serialNumberBlockSize, the blocks taken before are discarded.
+	 Call it outside of parallel regions.
+	 */
 	static void setNextSerialNumber(uint64_t snr);
 
-	/** Get the next serial number that will be assigned */
+	/**
+	 Get the shared serial number counter. A block taken from it hands out the
+	 serial numbers first + 1 ... first + serialNumberBlockSize, so no serial
+	 number assigned so far is above it.
+	 */
 	static uint64_t getNextSerialNumber();
 
+	/** Serial numbers a thread takes at once from the shared counter */
+	static const uint64_t serialNumberBlockSize = 4096;
+
 	/**
 	 Create an exact clone of candidate
 	 @param recursive	recursively clone and add the secondaries
 	 */
 	ref_ptr<Candidate> clone(bool recursive = false) const;
 
+	/**
+	 Append the candidate to a buffer, e.g. to migrate it to another
+	 process: the four particle states, the propagation state, the serial
+	 numbers, the random stream and the properties by name. Secondaries and
+	 the parent link are not included.
+	 */
+	void serialize(std::vector<char> &buffer) const;
+	/**
+	 Candidate written by serialize at offset in buffer, the offset is
+	 advanced past it. The candidate is detached with the serial numbers of
+	 the original.
+	 */
+	static ref_ptr<Candidate> deserialize(const std::vector<char> &buffer, size_t &offset);
+
 	/**
 	 Copy the source particle state to the current state
-	 and activate it if inactive, e.g. restart it
+	 and activate it if inactive, e.g. restart it.
+	 The step sizes are reset and the random stream is rewound to the source,
+	 so that with counter-based random numbers the candidate repeats its
+	 propagation. Redshift and weight are kept.
 	*/
 	void restart();
+
+	/**
+	 Candidates are allocated from a thread-local free list.
+	 Dropping the last reference returns the memory to the pool of the
+	 releasing thread instead of the system allocator, so no lock is needed.
+	 */
+	static void *operator new(size_t size);
+	static void operator delete(void *ptr, size_t size);
+
+	/** Maximum number of free candidates kept per thread, 0 disables pooling */
+	static void setPoolCapacity(size_t capacity);
+	static size_t getPoolCapacity();
+
+	/** Number of candidates allocated and not yet released */
+	static size_t getLiveCount();
+	/**
+	 Highest number of live candidates of every thread that allocated
+	 candidates, counted as allocated minus released by the thread, since the
+	 start or the last resetPeakLiveCounts.
+	 */
+	static std::vector<size_t> getPeakLiveCounts();
+	static void resetPeakLiveCounts();
+	/** Number of free candidates kept in the pools of all threads */
+	static size_t getPooledCount();
+
+private:
+	static size_t poolCapacity;
 };
 
 /** @}*/
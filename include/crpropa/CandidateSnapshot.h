@@ -0,0 +1,72 @@
+#ifndef CRPROPA_CANDIDATESNAPSHOT_H
+#define CRPROPA_CANDIDATESNAPSHOT_H
+
+#include "crpropa/Candidate.h"
+
+#include <string>
+#include <vector>
+
+namespace crpropa {
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ @class CandidateSnapshot CandidateSnapshot.h include/crpropa/CandidateSnapshot.h
+ @brief Compact, immutable record of a detected candidate.
+
+ Holds the four particle states, weight, redshift, trajectory length, the
+ serial numbers and a selection of properties, but no secondaries, parent
+ link or propagation state. Used to keep large numbers of detected events
+ in memory at a fraction of the size of a full Candidate clone.
+ */
+class CandidateSnapshot {
+	ParticleState source;
+	ParticleState created;
+	ParticleState current;
+	ParticleState previous;
+	double weight;
+	double redshift;
+	double trajectoryLength;
+	uint64_t serialNumber;
+	uint64_t sourceSerialNumber;
+	uint64_t createdSerialNumber;
+	Candidate::PropertyMap properties;
+
+public:
+	CandidateSnapshot();
+	/**
+	 @param candidate	candidate to record
+	 @param keys		properties to keep, missing ones are skipped
+	 */
+	CandidateSnapshot(const Candidate *candidate,
+			const std::vector<Candidate::PropertyKey> &keys =
+					std::vector<Candidate::PropertyKey>());
+
+	const ParticleState &getSource() const;
+	const ParticleState &getCreated() const;
+	const ParticleState &getCurrent() const;
+	const ParticleState &getPrevious() const;
+	double getWeight() const;
+	double getRedshift() const;
+	double getTrajectoryLength() const;
+	uint64_t getSerialNumber() const;
+	uint64_t getSourceSerialNumber() const;
+	uint64_t getCreatedSerialNumber() const;
+
+	bool hasProperty(const std::string &name) const;
+	const Variant &getProperty(const std::string &name) const;
+	const Candidate::PropertyMap &getProperties() const;
+
+	/**
+	 Rebuild an inactive candidate from the snapshot, e.g. to pass it to an
+	 output. The serial numbers are restored.
+	 */
+	ref_ptr<Candidate> toCandidate() const;
+};
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_CANDIDATESNAPSHOT_H
@@ -1,8 +1,12 @@
 #ifndef CRPROPA_COMMON_H
 #define CRPROPA_COMMON_H
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <string>
 #include <vector>
+#include <stdint.h>
 /**
  @file
  @brief Common helper functions
@@ -17,6 +21,14 @@ namespace crpropa {
 // Returns the full path to a CRPropa data file
 std::string getDataPath(std::string filename);
 
+// Add a directory that is searched for data files before the data path,
+// e.g. for interaction rates computed by the InteractionRateEngine.
+// A file found in an added directory takes precedence over the file of the
+// same name in the data path, the directory added last is searched first.
+// Modules created afterwards thus load these files instead of the shipped
+// tables.
+void addDataSearchPath(std::string path);
+
 // Returns the install prefix
 std::string getInstallPrefix();
 
@@ -31,6 +43,21 @@ T clip(const T& x, const T& lower, const T& upper) {
 	return std::max(lower, std::min(x, upper));
 }
 
+// Bytes allocated by a vector, for the getMemoryUsage of modules and fields
+template <typename T>
+size_t memoryUsage(const std::vector<T> &v) {
+	return v.capacity() * sizeof(T);
+}
+
+// Bytes allocated by a table of vectors
+template <typename T>
+size_t memoryUsage(const std::vector<std::vector<T> > &v) {
+	size_t bytes = v.capacity() * sizeof(std::vector<T>);
+	for (size_t i = 0; i < v.size(); i++)
+		bytes += memoryUsage(v[i]);
+	return bytes;
+}
+
 // Perform linear interpolation on a set of n tabulated data points X[0 .. n-1] -> Y[0 .. n-1]
 // Returns Y[0] if x < X[0] and Y[n-1] if x > X[n-1]
 double interpolate(double x, const std::vector<double>& X,
@@ -49,6 +76,201 @@ double interpolateEquidistant(double x, double lo, double hi,
 
 // Find index of value in a sorted vector X that is closest to x
 size_t closestIndex(double x, const std::vector<double> &X);
+
+// log10(x) with the accuracy of setMathAccuracy, see below
+inline double mathLog10(double x);
+
+/**
+ @class EquidistantAxis
+ @brief Sorted tabulation points with an index lookup in O(1).
+
+ If the points are equidistant (in log10 for Logarithmic axes, where a
+ leading zero is allowed as for redshifts) the index is computed with one
+ multiplication and corrected for rounding. Otherwise the scaled range is split
+ into equidistant guide bins holding the index at their lower edge, from which
+ the lookup walks the few points up to x; only axes with fewer than three points
+ or non-positive points of a Logarithmic axis are searched by bisection.
+ In all cases the result is exactly that of std::upper_bound.
+ */
+template <bool Logarithmic>
+class EquidistantAxis {
+	std::vector<double> X;
+	std::vector<uint32_t> guide; // index at the lower edge of each guide bin
+	size_t first; // first point of the equidistant range
+	double lo, invStep;
+	bool equidistant;
+
+	static double scale(double x) {
+		return Logarithmic ? mathLog10(x) : x;
+	}
+
+	static double unscale(double x) {
+		return Logarithmic ? std::pow(10, x) : x;
+	}
+
+public:
+	EquidistantAxis() : first(0), lo(0), invStep(0), equidistant(false) {
+	}
+
+	EquidistantAxis(const std::vector<double> &x) {
+		assign(x);
+	}
+
+	void assign(const std::vector<double> &x) {
+		X = x;
+		guide.clear();
+		first = (Logarithmic and (X.size() > 2) and (X[0] <= 0)) ? 1 : 0;
+		equidistant = false;
+		if (X.size() < first + 3)
+			return;
+		if (Logarithmic and (X[first] <= 0))
+			return;
+		lo = scale(X[first]);
+		double range = scale(X.back()) - lo;
+		if (not (range > 0))
+			return;
+		double step = range / (X.size() - 1 - first);
+		equidistant = true;
+		for (size_t i = first + 1; i < X.size(); i++) {
+			if (std::fabs(scale(X[i]) - scale(X[i - 1]) - step) > 0.01 * step) {
+				equidistant = false;
+				break;
+			}
+		}
+		if (equidistant) {
+			invStep = 1 / step;
+			return;
+		}
+
+		size_t n = 4 * (X.size() - first);
+		invStep = n / range;
+		guide.resize(n);
+		for (size_t k = 0; k < n; k++)
+			guide[k] = std::upper_bound(X.begin() + first, X.end(),
+					unscale(lo + k / invStep)) - X.begin();
+	}
+
+	/// Index of the first point greater than x, as std::upper_bound
+	size_t upperBound(double x) const {
+		if (not equidistant and guide.empty())
+			return std::upper_bound(X.begin(), X.end(), x) - X.begin();
+		if (not (x >= X[first]))
+			return (x < X[0]) ? 0 : first;
+		if (x >= X.back())
+			return X.size();
+		double p = (scale(x) - lo) * invStep;
+		size_t i;
+		if (equidistant)
+			i = first + std::min(static_cast<size_t>(std::max(p, 0.)), X.size() - 2 - first);
+		else
+			i = std::max(guide[std::min(static_cast<size_t>(std::max(p, 0.)), guide.size() - 1)],
+					static_cast<uint32_t>(first + 1)) - 1;
+		while (X[i + 1] <= x)
+			i++;
+		while (X[i] > x)
+			i--;
+		return i + 1;
+	}
+
+	bool isEquidistant() const {
+		return equidistant;
+	}
+
+	size_t size() const {
+		return X.size();
+	}
+
+	const std::vector<double> &values() const {
+		return X;
+	}
+
+	double operator[](size_t i) const {
+		return X[i];
+	}
+};
+
+// Perform linear interpolation as interpolate on an equidistant axis X
+template <bool Logarithmic>
+double interpolate(double x, const EquidistantAxis<Logarithmic> &X,
+		const std::vector<double> &Y) {
+	size_t i = X.upperBound(x);
+	if (i == 0)
+		return Y.front();
+	if (i == X.size())
+		return Y.back();
+	i--;
+	return Y[i] + (x - X[i]) * (Y[i + 1] - Y[i]) / (X[i + 1] - X[i]);
+}
+
+/**
+ @class EquidistantTable
+ @brief Tabulated function for linear interpolation with an EquidistantAxis.
+ Same results as interpolate(x, X, Y).
+ */
+template <bool Logarithmic>
+class EquidistantTable {
+	EquidistantAxis<Logarithmic> X;
+	std::vector<double> Y;
+
+public:
+	EquidistantTable() {
+	}
+
+	EquidistantTable(const std::vector<double> &x, const std::vector<double> &y) {
+		assign(x, y);
+	}
+
+	void assign(const std::vector<double> &x, const std::vector<double> &y) {
+		X.assign(x);
+		Y = y;
+	}
+
+	double interpolate(double x) const {
+		return crpropa::interpolate(x, X, Y);
+	}
+
+	double operator()(double x) const {
+		return interpolate(x);
+	}
+
+	const EquidistantAxis<Logarithmic> &getAxis() const {
+		return X;
+	}
+
+	const std::vector<double> &getValues() const {
+		return Y;
+	}
+};
+
+typedef EquidistantAxis<false> LinearAxis;
+typedef EquidistantAxis<true> LogAxis;
+typedef EquidistantTable<false> LinearTable;
+typedef EquidistantTable<true> LogTable;
+
+// Perform bilinear interpolation as interpolate2d on equidistant axes X, Y
+// with Z[0 .. n-1*m-1] -> Z[j + i * m]
+template <bool LogX, bool LogY>
+double interpolate2d(double x, double y, const EquidistantAxis<LogX> &X,
+		const EquidistantAxis<LogY> &Y, const std::vector<double> &Z) {
+	if (x > X[X.size() - 1] || x < X[0])
+		return 0;
+	if (y > Y[Y.size() - 1] || y < Y[0])
+		return 0;
+
+	size_t i = std::min(X.upperBound(x), X.size() - 1) - 1;
+	size_t j = std::min(Y.upperBound(y), Y.size() - 1) - 1;
+	size_t m = Y.size();
+
+	double Q11 = Z[j + i * m];
+	double Q12 = Z[j + 1 + i * m];
+	double Q21 = Z[j + (i + 1) * m];
+	double Q22 = Z[j + 1 + (i + 1) * m];
+
+	double R1 = ((X[i+1]-x)/(X[i+1]-X[i]))*Q11+((x-X[i])/(X[i+1]-X[i]))*Q21;
+	double R2 = ((X[i+1]-x)/(X[i+1]-X[i]))*Q12+((x-X[i])/(X[i+1]-X[i]))*Q22;
+
+	return ((Y[j+1]-y)/(Y[j+1]-Y[j]))*R1+((y-Y[j])/(Y[j+1]-Y[j]))*R2;
+}
 /** @}*/
 
 
@@ -66,6 +288,144 @@ inline double pow_integer<0>(double base)
   return 1;
 }
 
+// Accuracy of the elementary functions mathExp, mathLog, mathLog10,
+// mathExp10 and mathPow: IEEEMath evaluates them with the standard library,
+// FastMath with the polynomial kernels fastExp, fastLog, ... below, which are
+// branch-free and vectorize in the batch versions. A global setting,
+// IEEEMath by default, to be changed before a simulation.
+enum MathAccuracy {
+	IEEEMath, FastMath
+};
+void setMathAccuracy(MathAccuracy accuracy);
+MathAccuracy getMathAccuracy();
+extern MathAccuracy g_mathAccuracy;
+
+// exp(x) for |x| <= 708 without checks: 2^k exp(r) with |r| <= ln(2) / 2 and
+// the Taylor series of exp(r) to r^12, whose truncation error is below 2e-16,
+// relative error below 1e-15
+inline double fastExpKernel(double x) {
+	const double shifter = 6755399441055744.; // 1.5 * 2^52, rounds x / ln(2) to the integer k
+	double t = x * 1.4426950408889634 + shifter;
+	double k = t - shifter;
+	double r = (x - k * 6.93147180369123816490e-01) - k * 1.90821492927058770002e-10;
+	double p = 2.087675698786810e-09;
+	p = p * r + 2.505210838544172e-08;
+	p = p * r + 2.755731922398589e-07;
+	p = p * r + 2.755731922398589e-06;
+	p = p * r + 2.480158730158730e-05;
+	p = p * r + 1.984126984126984e-04;
+	p = p * r + 1.388888888888889e-03;
+	p = p * r + 8.333333333333333e-03;
+	p = p * r + 4.166666666666667e-02;
+	p = p * r + 1.666666666666667e-01;
+	p = p * r + 0.5;
+	p = p * r + 1;
+	p = p * r + 1;
+	// 2^k from the low bits of t, which hold k
+	uint64_t bits;
+	std::memcpy(&bits, &t, sizeof(bits));
+	bits = (bits + 1023) << 52;
+	double scale;
+	std::memcpy(&scale, &bits, sizeof(scale));
+	return p * scale;
+}
+
+// log(x) for positive normal x without checks: k ln(2) + log(m) with m in
+// [sqrt(1/2), sqrt(2)) and the series of 2 atanh(s), s = (m - 1) / (m + 1),
+// to s^17, relative error below 1e-15
+inline double fastLogKernel(double x) {
+	const uint64_t sqrtHalf = 0x3fe6a09e667f3bcdULL;
+	uint64_t bits;
+	std::memcpy(&bits, &x, sizeof(bits));
+	uint64_t u = bits - sqrtHalf + (1023ULL << 52); // exponent field k + 1023
+	uint64_t mbits = (u & 0x000fffffffffffffULL) + sqrtHalf;
+	uint64_t kbits = (u >> 52) | 0x4330000000000000ULL; // 2^52 + k + 1023
+	double m, k;
+	std::memcpy(&m, &mbits, sizeof(m));
+	std::memcpy(&k, &kbits, sizeof(k));
+	k -= 4503599627370496. + 1023;
+	double f = m - 1;
+	double s = f / (2 + f);
+	double s2 = s * s;
+	double q = 1. / 17;
+	q = q * s2 + 1. / 15;
+	q = q * s2 + 1. / 13;
+	q = q * s2 + 1. / 11;
+	q = q * s2 + 1. / 9;
+	q = q * s2 + 1. / 7;
+	q = q * s2 + 1. / 5;
+	q = q * s2 + 1. / 3;
+	double logm = 2 * s + 2 * s * (s2 * q);
+	return k * 6.93147180369123816490e-01 + (logm + k * 1.90821492927058770002e-10);
+}
+
+// exp(x), the standard library outside of |x| <= 708
+inline double fastExp(double x) {
+	if (not (std::fabs(x) <= 708))
+		return std::exp(x);
+	return fastExpKernel(x);
+}
+
+// log(x), the standard library for zero, negative, subnormal and non-finite x
+inline double fastLog(double x) {
+	if (not ((x >= 2.2250738585072014e-308) and (x <= 1.7976931348623157e308)))
+		return std::log(x);
+	return fastLogKernel(x);
+}
+
+inline double fastLog10(double x) {
+	if (not ((x >= 2.2250738585072014e-308) and (x <= 1.7976931348623157e308)))
+		return std::log10(x);
+	return fastLogKernel(x) * 0.43429448190325182765;
+}
+
+// 10^x, relative error below 1e-15 (1 + |x|)
+inline double fastExp10(double x) {
+	double y = x * 2.30258509299404568402;
+	if (not (std::fabs(y) <= 708))
+		return std::pow(10., x);
+	return fastExpKernel(y);
+}
+
+// x^y = exp(y log(x)) for positive x, relative error below 1e-15 (1 + |y log(x)|)
+inline double fastPow(double x, double y) {
+	if (not ((x >= 2.2250738585072014e-308) and (x <= 1.7976931348623157e308)))
+		return std::pow(x, y);
+	double e = y * fastLogKernel(x);
+	if (not (std::fabs(e) <= 708))
+		return std::pow(x, y);
+	return fastExpKernel(e);
+}
+
+// The elementary functions with the accuracy of setMathAccuracy
+inline double mathExp(double x) {
+	return (g_mathAccuracy == FastMath) ? fastExp(x) : std::exp(x);
+}
+
+inline double mathLog(double x) {
+	return (g_mathAccuracy == FastMath) ? fastLog(x) : std::log(x);
+}
+
+inline double mathLog10(double x) {
+	return (g_mathAccuracy == FastMath) ? fastLog10(x) : std::log10(x);
+}
+
+inline double mathExp10(double x) {
+	return (g_mathAccuracy == FastMath) ? fastExp10(x) : std::pow(10., x);
+}
+
+inline double mathPow(double x, double y) {
+	return (g_mathAccuracy == FastMath) ? fastPow(x, y) : std::pow(x, y);
+}
+
+// Batch versions y[i] = f(x[i]) for i < n, vectorized with FastMath
+void mathExp(size_t n, const double *x, double *y);
+void mathLog(size_t n, const double *x, double *y);
+void mathLog10(size_t n, const double *x, double *y);
+void mathExp10(size_t n, const double *x, double *y);
+void mathPow(size_t n, const double *x, double exponent, double *y);
+void mathSqrt(size_t n, const double *x, double *y);
+
 // - input:  function over which to integrate, integration limits A and B
 // - output: 8-points Gauß-Legendre integral
 static const double X[8] = {.0950125098, .2816035507, .4580167776, .6178762444, .7554044083, .8656312023, .9445750230, .9894009349};
@@ -0,0 +1,158 @@
+#ifndef CRPROPA_CONVERGENCE_H
+#define CRPROPA_CONVERGENCE_H
+
+#include "crpropa/Module.h"
+#include "crpropa/module/HistogramOutput.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace crpropa {
+
+/**
+ @class ConvergenceObservable
+ @brief Observable of a run with a statistical uncertainty, see ConvergenceCriterion
+ */
+class ConvergenceObservable: public Referenced {
+public:
+	virtual ~ConvergenceObservable() {}
+	/** Current estimate of the observable */
+	virtual double getValue() const = 0;
+	/** Statistical uncertainty (one standard deviation) of the estimate */
+	virtual double getUncertainty() const = 0;
+	virtual std::string getDescription() const = 0;
+	/** Uncertainty over value, infinite as long as the value is 0 */
+	double getRelativeUncertainty() const;
+};
+
+/**
+ @class HistogramBinObservable
+ @brief Summed weight of one or more bins of a HistogramOutput
+
+ The uncertainty is the square root of the summed squared weights, which
+ treats the candidates as independent; candidates of the same cascade that
+ fill the same bins are correlated and make it an underestimate.
+ */
+class HistogramBinObservable: public ConvergenceObservable {
+	ref_ptr<HistogramOutput> output;
+	size_t histogram;
+	std::vector<size_t> bins;
+public:
+	HistogramBinObservable(HistogramOutput *output, size_t histogram, size_t bin);
+	/** Sum of the bins, given by their flat index, see HistogramOutput::getBin */
+	HistogramBinObservable(HistogramOutput *output, size_t histogram, const std::vector<size_t> &bins);
+	double getValue() const;
+	double getUncertainty() const;
+	std::string getDescription() const;
+};
+
+/**
+ @class DetectionCounter
+ @brief Counts the candidates detected by an Observer and passes them on to an action
+
+ Use it as detection action of an Observer (see Observer::onDetection),
+ with the output module as its action. The number of candidates and the sums
+ of the weights and squared weights are updated with atomic operations.
+ */
+class DetectionCounter: public Module {
+	ref_ptr<Module> action;
+	mutable std::atomic<uint64_t> count;
+	mutable std::atomic<double> weights, squaredWeights;
+public:
+	DetectionCounter(Module *action = 0);
+	void process(Candidate *candidate) const;
+	uint64_t getCount() const;
+	/** Summed weights of the counted candidates */
+	double getWeight() const;
+	/** Summed squared weights of the counted candidates */
+	double getSquaredWeight() const;
+	void reset();
+	std::string getDescription() const;
+};
+
+/**
+ @class DetectionCountObservable
+ @brief Weighted number of detections of a DetectionCounter
+ */
+class DetectionCountObservable: public ConvergenceObservable {
+	ref_ptr<DetectionCounter> counter;
+public:
+	DetectionCountObservable(DetectionCounter *counter);
+	double getValue() const;
+	double getUncertainty() const;
+	std::string getDescription() const;
+};
+
+/**
+ @class ConvergenceCriterion
+ @brief Targets of the relative uncertainties and budget of a run, see ModuleList::run(source, criterion)
+
+ The run proceeds in batches of primaries, each run in parallel. After each
+ batch the relative uncertainties of the observables are compared to their
+ targets and the run stops as soon as all are met, or when the budget of
+ primaries or time is used up. The size of the next batch is projected from
+ the target that is furthest from convergence by the 1 / sqrt(N) scaling of
+ the uncertainty, at least the minimum batch size and at most doubling the
+ primaries run so far; with a time budget it is limited to the primaries
+ that fit into the remaining time at the rate of the previous batches.
+ After the run, the achieved precision is reported by getReport.
+ */
+class ConvergenceCriterion: public Referenced {
+	struct Target {
+		ref_ptr<ConvergenceObservable> observable;
+		double relativeUncertainty;
+	};
+	std::vector<Target> targets;
+	size_t maxPrimaries, batchSize;
+	double maxTime;
+
+	// state of the current or last run
+	size_t primaries;
+	double elapsed;
+	bool converged;
+	std::vector<double> achieved;
+
+public:
+	/**
+	 @param maxPrimaries	budget of primaries
+	 @param maxTime			budget of wall-clock time [s], 0 for none
+	 @param batchSize		minimum number of primaries between two checks
+	 */
+	ConvergenceCriterion(size_t maxPrimaries, double maxTime = 0, size_t batchSize = 1000);
+
+	/** Run until the relative uncertainty of the observable is below the target */
+	void addTarget(ConvergenceObservable *observable, double relativeUncertainty);
+	/** Target of the weighted number of detections of the counter */
+	void addTarget(DetectionCounter *counter, double relativeUncertainty);
+	/** Target of the summed weight of a bin of the histogram */
+	void addTarget(HistogramOutput *output, size_t histogram, size_t bin, double relativeUncertainty);
+	size_t getNumberOfTargets() const;
+
+	size_t getMaxPrimaries() const;
+	double getMaxTime() const;
+	size_t getBatchSize() const;
+
+	/** Start a run, called by ModuleList */
+	void start();
+	/**
+	 Update the uncertainties after the given number of primaries in the given
+	 time [s] and return the size of the next batch, 0 to stop. Called by ModuleList.
+	 */
+	size_t update(size_t primaries, double elapsed);
+
+	/** All targets were met in the last run */
+	bool isConverged() const;
+	/** Primaries run in the last run */
+	size_t getPrimaries() const;
+	/** Wall-clock time of the last run [s] */
+	double getElapsedTime() const;
+	/** Relative uncertainties of the targets achieved in the last run */
+	const std::vector<double> &getRelativeUncertainties() const;
+	/** Achieved precision of the last run, one line per target */
+	std::string getReport() const;
+};
+
+} // namespace crpropa
+
+#endif // CRPROPA_CONVERGENCE_H
@@ -0,0 +1,93 @@
+#ifndef CRPROPA_DIAGNOSTICS_H
+#define CRPROPA_DIAGNOSTICS_H
+
+#include <atomic>
+#include <sstream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace crpropa {
+/**
+ * \addtogroup Tools
+ * @{
+ */
+
+/**
+ @class DiagnosticSite
+ @brief Counter of a diagnostic message at one place of the code, see Diagnostics
+ */
+class DiagnosticSite {
+	std::string name;
+	std::atomic<uint64_t> occurrences;
+	std::atomic<uint64_t> printed;
+	std::atomic<int64_t> nextReport; // steady clock ticks
+	uint64_t summarized; // occurrences at the last summary
+	friend class Diagnostics;
+
+public:
+	/** Register a site, sites are not deleted and usually function-local statics */
+	DiagnosticSite(const std::string &name);
+	/** Count an occurrence, true if its message is to be printed */
+	bool count();
+	/** Print the message of an occurrence counted with count */
+	void print(const std::string &message);
+	const std::string &getName() const;
+	uint64_t getOccurrences() const;
+	uint64_t getPrinted() const;
+};
+
+/**
+ @class Diagnostics
+ @brief Rate-limited, aggregated diagnostic messages of hot paths
+
+ Messages that may occur per candidate or per step, e.g. energies outside of
+ tables, are counted per site with an atomic counter instead of being
+ written each time. The first messages of every site are printed to the
+ log stream (kiss::Logger, at the warning level), then one message per
+ interval with the number of occurrences since the last one. The summary
+ lists the sites with occurrences since the previous summary and is printed
+ at the end of every run of a ModuleList.
+
+ Use the macro CRPROPA_DIAGNOSTIC(name, message), where the message is
+ an expression for an ostream and only evaluated if printed:
+   CRPROPA_DIAGNOSTIC("DintPropagation: energy too high", "log10(E/eV) = " << logE);
+ */
+class Diagnostics {
+public:
+	/**
+	 @param messages	messages printed per site before the rate limit
+	 @param interval	minimum time between the messages of a site after that [s]
+	 The next message of every site beyond the limit is then printed.
+	 */
+	static void setRateLimit(uint64_t messages, double interval);
+	static uint64_t getMessageLimit();
+	static double getInterval();
+
+	/** Occurrences of a site since the start, 0 for unknown sites */
+	static uint64_t getOccurrences(const std::string &name);
+	/** Sites with occurrences since the previous summary, one line each, empty if none */
+	static std::string getSummary();
+	/** Print the summary to the log stream and start the next one */
+	static void printSummary();
+	/** Reset the counters of all sites */
+	static void reset();
+
+	static std::vector<DiagnosticSite *> getSites();
+};
+
+/** @}*/
+
+} // namespace crpropa
+
+#define CRPROPA_DIAGNOSTIC(name, message) \
+	do { \
+		static crpropa::DiagnosticSite crpropaDiagnosticSite(name); \
+		if (crpropaDiagnosticSite.count()) { \
+			std::ostringstream crpropaDiagnosticMessage; \
+			crpropaDiagnosticMessage << message; \
+			crpropaDiagnosticSite.print(crpropaDiagnosticMessage.str()); \
+		} \
+	} while (0)
+
+#endif // CRPROPA_DIAGNOSTICS_H
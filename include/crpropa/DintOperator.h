@@ -0,0 +1,120 @@
+#ifndef CRPROPA_DINTOPERATOR_H
+#define CRPROPA_DINTOPERATOR_H
+
+#include "crpropa/Referenced.h"
+
+#include <string>
+#include <vector>
+
+class DintEMCascade;
+
+namespace crpropa {
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ @class DintInstance
+ @brief Initialized DINT state, taken from and returned to a process-wide cache
+
+ Setting up DINT reads the interaction tables and the energy grids. The
+ instances are kept after use and handed out again for the same backgrounds,
+ magnetic field and cosmology, one thread at a time. Access is thread-safe
+ with OpenMP.
+ */
+class DintInstance {
+	DintEMCascade *dint;
+	std::string key;
+	DintInstance(const DintInstance &);
+	DintInstance &operator=(const DintInstance &);
+public:
+	DintInstance(
+		int IRBFlag,       //!< EBL background 0: high, 1: low, 2: Primack, 4: Stecker'06
+		int RadioFlag,     //!< radio background 0: high, 1: medium, 2: obs, 3: none, 4: Protheroe'96
+		double Bfield      //!< magnetic field strength [T]
+		);
+	~DintInstance();
+	DintEMCascade &operator*();
+	DintEMCascade *operator->();
+
+	/// Number of cached instances not in use
+	static size_t getCacheSize();
+	/// Delete the cached instances not in use
+	static void clearCache();
+};
+
+/**
+ @class DintOperator
+ @brief Linear propagation operators of the DINT cascade per distance bin
+
+ The DINT cascade is linear in the injected spectrum. For the distance
+ binning of EMCascade, the operator of each distance bin propagates a
+ spectrum (photons, electrons and positrons in 170 energy bins) from the
+ centre of the bin to the centre of the next closer bin, as in
+ EMCascade::runCascade. It is calculated once by propagating unit injections
+ in every particle type and energy bin, all of a bin together so that the
+ backgrounds and rates are set up once per redshift step, and the bins in
+ parallel. Saved to a file, the operators fold the distance-energy histograms
+ of any number of runs and sources with matrix-vector products instead of
+ DINT runs. Each bin needs 2 MB; the result equals runCascade up to the
+ convergence tolerance of DINT.
+ */
+class DintOperator: public Referenced {
+	double Dmax;
+	int nD, nE;
+	int IRBFlag, RadioFlag;
+	double Bfield, cutCascade;
+	double h, omegaMatter, omegaLambda;
+	// per distance bin: matrix of the 3 nE output (rows) and input (columns)
+	// bins, in column major order
+	std::vector<std::vector<double> > steps;
+	void checkCosmology() const;
+
+public:
+	DintOperator(
+		double Dmax,            //!< maximum distance [m], see EMCascade::setDistanceBinning
+		int nD,                 //!< number of distance bins
+		int IRBFlag = 4,        //!< EBL background 0: high, 1: low, 2: Primack, 4: Stecker'06
+		int RadioFlag = 4,      //!< radio background 0: high, 1: medium, 2: obs, 3: none, 4: Protheroe'96
+		double Bfield = 1E-13,  //!< magnetic field strength [T], default = 1 nG
+		double cutCascade = 0   //!< a-parameter, see CRPropa 2 paper
+		);
+	/// Operators saved with save
+	DintOperator(const std::string &filename);
+
+	/// Calculates the operators of all distance bins with DINT
+	void build(bool showProgress = false);
+	/// Calculates the operator of one distance bin with DINT
+	void buildStep(int iD);
+	bool isBuilt() const;
+
+	void save(const std::string &filename) const;
+
+	double getMaximumDistance() const;
+	int getNumberOfDistanceBins() const;
+	int getNumberOfEnergyBins() const;
+	int getIRBFlag() const;
+	int getRadioFlag() const;
+	double getMagneticField() const;
+	double getCutCascade() const;
+
+	/// Operator of a distance bin, 3 nE x 3 nE in column major order
+	const std::vector<double> &getStep(int iD) const;
+	void setStep(int iD, const std::vector<double> &step);
+
+	/**
+	 Propagated spectrum (3 nE: photons, electrons, positrons) of the
+	 injection histograms, weighted numbers in 3 nD nE bins: photons,
+	 electrons and positrons, each in distance bins of nE energy bins
+	 */
+	std::vector<double> fold(const std::vector<double> &injection) const;
+	/// Propagated spectrum of a spectrum (3 nE) injected in distance bin iD
+	std::vector<double> propagate(const std::vector<double> &spectrum, int iD) const;
+};
+
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_DINTOPERATOR_H
@@ -3,20 +3,30 @@
 
 #include "Referenced.h"
 #include "Candidate.h"
+#include "AliasTable.h"
+
+#include <atomic>
 
 namespace crpropa {
 
 /**
  @class CylindricalProjectionMap
  @brief 2D histogram of spherical coordinates in equal-area projection
+
+ Once filled, finalize freezes the map: directions are then drawn in O(1)
+ from an alias table and drawing is thread-safe. Before, the cdf is
+ updated on the first draw after filling, by one thread while the others
+ wait. Filling is not thread-safe.
  */
 class CylindricalProjectionMap : public Referenced {
 private:
 	size_t nPhi, nTheta;
 	double sPhi, sTheta;
-	mutable bool dirty;
+	mutable std::atomic<bool> dirty; // cdf outdated, published with release
+	bool finalized;
 	std::vector<double> pdf;
 	mutable std::vector<double> cdf;
+	AliasTable aliasTable;
 
 	/** Calculate the cdf from the pdf */
 	void updateCdf() const;
@@ -35,6 +45,10 @@ public:
 	/** Increment the bin value by weight. */
 	void fillBin(size_t bin, double weight = 1.);
 
+	/** Build the cdf and the alias table, the map cannot be filled afterwards. */
+	void finalize();
+	bool isFinalized() const;
+
 	/** Draw a random vector from the distribution. */
 	Vector3d drawDirection() const;
 
@@ -45,6 +59,8 @@ public:
 	std::vector<double>& getPdf();
 
 	const std::vector<double>& getCdf() const;
+	/** Sum of the bin values, the last value of the cdf */
+	double getSum() const;
 
 	size_t getNPhi();
 	size_t getNTheta();
@@ -61,6 +77,15 @@ public:
  @brief Particle Type and energy binned emission maps.
 
  Use SourceEmissionMap to suppress directions at the source. Use EmissionMapFiller to create EmissionMap from Observer.
+
+ The maps are saved as text, one line per map, or with saveBinary in a
+ binary format, in the byte order of the machine: the magic string
+ "CRPEMAP1", the uint32 version, nPhi, nTheta and nEnergy, the double
+ minimum and maximum energy and the uint64 number of maps, followed per map
+ by the int32 particle id, the uint32 energy bin, nPhi and nTheta, the uint32
+ number of stored bins and the bins: all values as doubles if dense, else
+ pairs of the uint32 bin and its double value. Each map is stored sparse if
+ that is smaller. load and merge read both formats.
  */
 class EmissionMap : public Referenced {
 public:
@@ -116,7 +141,9 @@ public:
 
 	/** Save the content of the maps into a text file */
 	void save(const std::string &filename);
-	/** Load the content of the maps from a text file */
+	/** Save the content of the maps into a binary file, see above */
+	void saveBinary(const std::string &filename) const;
+	/** Load the content of the maps from a text or binary file */
 	void load(const std::string &filename);
 
 	/** Merge other maps, add pdfs */
@@ -125,7 +152,24 @@ public:
 	/** Merge maps from file */
 	void merge(const std::string &filename);
 
+	/**
+	 Merge maps from many files in parallel: every thread reads and sums a
+	 share of the files, the sums of the threads are merged at the end
+	 */
+	void merge(const std::vector<std::string> &filenames);
+
+	/** Finalize all maps for thread-safe drawing, see CylindricalProjectionMap::finalize */
+	void finalize();
+
+	size_t getNPhi() const;
+	size_t getNTheta() const;
+	size_t getNEnergy() const;
+	double getMinimumEnergy() const;
+	double getMaximumEnergy() const;
+
 protected:
+	void loadBinary(const std::string &filename);
+
 	double minEnergy, maxEnergy, logStep;
 	size_t nPhi, nTheta, nEnergy;
 	map_t maps;
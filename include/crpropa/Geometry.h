@@ -36,6 +36,30 @@ class Surface : public Referenced
 		positive on the other. For closed surfaces it is negative on the inside.
 	 */
     virtual Vector3d normal(const Vector3d& point) const = 0;
+	/**
+		Returns the distance along a straight line from a point in the given
+		direction to the next crossing of the surface, infinity if the line does
+		not cross the surface. The default implementation returns the distance of
+		the point to the surface, a lower bound for surfaces with an euclidean
+		distance.
+	 */
+    virtual double distanceAlong(const Vector3d& point, const Vector3d& direction) const;
+	/**
+		Returns the distance of a point to the nearest point of the surface,
+		by default the absolute value of distance.
+	 */
+    virtual double nearestDistance(const Vector3d& point) const;
+	/**
+		Returns true if the surface was crossed between two points, by default
+		if the distance changes its sign and is not zero at the first point.
+	 */
+    virtual bool crossed(const Vector3d& from, const Vector3d& to) const;
+	/**
+		Gives a box that contains the surface and its inside, outside of which
+		the distance is at least the distance to the box. Returns false for
+		unbounded surfaces (default).
+	 */
+    virtual bool getBoundingBox(Vector3d& lower, Vector3d& upper) const;
 		virtual std::string getDescription() const {return "Surface without description.";};
 };
 
@@ -53,6 +77,7 @@ class Plane: public Surface
 		Plane(const Vector3d& _x0, const Vector3d& _n);
     virtual double distance(const Vector3d &x) const;
     virtual Vector3d normal(const Vector3d& point) const;
+    virtual double distanceAlong(const Vector3d& point, const Vector3d& direction) const;
 		virtual std::string getDescription() const;
 };
 
@@ -70,6 +95,8 @@ class Sphere: public Surface
 		Sphere(const Vector3d& _center, double _radius);
     virtual double distance(const Vector3d &point) const;
     virtual Vector3d normal(const Vector3d& point) const;
+    virtual double distanceAlong(const Vector3d& point, const Vector3d& direction) const;
+    virtual bool getBoundingBox(Vector3d& lower, Vector3d& upper) const;
 		virtual std::string getDescription() const;
 };
 
@@ -86,6 +113,58 @@ class ParaxialBox: public Surface
 		ParaxialBox(const Vector3d& _corner, const Vector3d& _size);
     virtual double distance(const Vector3d &point) const;
     virtual Vector3d normal(const Vector3d& point) const;
+    virtual double distanceAlong(const Vector3d& point, const Vector3d& direction) const;
+    virtual bool getBoundingBox(Vector3d& lower, Vector3d& upper) const;
+		virtual std::string getDescription() const;
+};
+
+
+/**
+ @class SurfaceCollection
+ @brief A set of surfaces, queried together through a bounding volume hierarchy.
+
+ The inside of the collection is the union of the insides of its surfaces:
+ distance is the minimum of their distances. nearestDistance is the distance to
+ the nearest surface, distanceAlong the distance to the first crossing of any
+ surface and crossed is true if any surface was crossed, so that a collection
+ can be given to an ObserverSurface or a SurfaceBoundary in place of a single
+ surface.
+ The surfaces with a bounding box are held in a hierarchy of boxes, so that the
+ queries only test the surfaces near the point or the line. Unbounded surfaces,
+ e.g. planes, are tested by every query. Adding a surface rebuilds the hierarchy.
+ */
+class SurfaceCollection: public Surface
+{
+	private:
+		struct Node {
+			Vector3d lower, upper;
+			uint32_t first, count; // surfaces in order of a leaf, count 0 for inner nodes
+			uint32_t left, right;
+		};
+		std::vector<ref_ptr<Surface> > surfaces;
+		std::vector<Vector3d> lowers, uppers;
+		std::vector<uint32_t> unbounded;
+		std::vector<uint32_t> order; // the bounded surfaces by leaf
+		std::vector<Node> nodes;
+
+		void build();
+		uint32_t buildNode(uint32_t first, uint32_t count);
+	public:
+		SurfaceCollection();
+		void add(Surface *surface);
+		size_t size() const;
+		Surface *get(size_t i) const;
+		/** Index of the nearest surface (in the order of add), -1 if empty */
+		long nearestSurface(const Vector3d& point) const;
+		/** Index of the surface crossed first between two points, -1 if none */
+		long crossedSurface(const Vector3d& from, const Vector3d& to) const;
+		virtual double distance(const Vector3d &point) const;
+		/** The normal of the nearest surface */
+		virtual Vector3d normal(const Vector3d& point) const;
+		virtual double distanceAlong(const Vector3d& point, const Vector3d& direction) const;
+		virtual double nearestDistance(const Vector3d& point) const;
+		virtual bool crossed(const Vector3d& from, const Vector3d& to) const;
+		virtual bool getBoundingBox(Vector3d& lower, Vector3d& upper) const;
 		virtual std::string getDescription() const;
 };
 
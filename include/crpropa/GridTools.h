@@ -3,6 +3,7 @@
 
 #include "crpropa/Grid.h"
 #include "crpropa/magneticField/MagneticField.h"
+#include "crpropa/advectionField/AdvectionField.h"
 #include <string>
 #include <array>
 
@@ -20,6 +21,8 @@
  In the files the grid points are stored from (0, 0, 0) to (Nx, Ny, Nz) with the z-index changing the fastest.
  Vector components are stored per grid point in xyz-order.
  In case of plain-text files the vector components are separated by a blank or tab and grid points are stored one per line.
+ The grid files of writeGrid / readGrid3f / readGrid1f additionally store the shape, origin, spacing
+ and reflective flag and hold the values in compressed tiles with checksums.
  All functions offer a conversion factor that is multiplied to all values.
  */
 
@@ -52,9 +55,25 @@ void scaleGrid(ref_ptr<Grid3f> grid, double a);
 /** Fill vector grid from provided magnetic field */
 void fromMagneticField(ref_ptr<Grid3f> grid, ref_ptr<MagneticField> field);
 
+/** Fill vector grid with the unit vectors of the provided magnetic field, zero where the field vanishes */
+void fromMagneticFieldDirection(ref_ptr<Grid3f> grid, ref_ptr<MagneticField> field);
+
 /** Fill scalar grid from provided magnetic field */
 void fromMagneticFieldStrength(ref_ptr<Grid1f> grid, ref_ptr<MagneticField> field);
 
+/** Fill vector grid from provided advection field */
+void fromAdvectionField(ref_ptr<Grid3f> grid, ref_ptr<AdvectionField> field);
+
+/** Fill scalar grid with the divergence of provided advection field */
+void fromAdvectionFieldDivergence(ref_ptr<Grid1f> grid, ref_ptr<AdvectionField> field);
+
+/**
+ Fill scalar grid with the divergence of a vector grid of the same shape, by
+ central differences at the grid points, periodic or, for a reflective grid,
+ one-sided at its edges. The grid points are computed in parallel.
+ */
+void computeDivergence(ref_ptr<Grid3f> grid, ref_ptr<Grid1f> divergence);
+
 /** Load a Grid3f from a binary file with single precision */
 void loadGrid(ref_ptr<Grid3f> grid, std::string filename,
 		double conversion = 1);
@@ -87,6 +106,85 @@ void dumpGridToTxt(ref_ptr<Grid3f> grid, std::string filename,
 void dumpGridToTxt(ref_ptr<Grid1f> grid, std::string filename,
 		double conversion = 1);
 
+/**
+ Write a grid to a self-describing grid file
+
+ The file stores the shape, origin, spacing and reflective flag of the grid
+ and its values in independently compressed tiles of 64^3 points, each with
+ a CRC-32 checksum. The tiles are compressed in parallel. Without zlib, or
+ for a compression level of 0, the tiles are stored uncompressed.
+ @param grid			grid to write
+ @param filename		name of the file
+ @param conversion		factor multiplied to all values
+ @param compressionLevel	zlib compression level, 0 to 9
+ */
+void writeGrid(ref_ptr<Grid3f> grid, std::string filename,
+		double conversion = 1, int compressionLevel = 1);
+
+/** Write a Grid1f to a self-describing grid file, see writeGrid(ref_ptr<Grid3f>, ...) */
+void writeGrid(ref_ptr<Grid1f> grid, std::string filename,
+		double conversion = 1, int compressionLevel = 1);
+
+/** Read a Grid3f from a grid file written by writeGrid, the checksums are verified */
+ref_ptr<Grid3f> readGrid3f(std::string filename, double conversion = 1);
+
+/** Read a Grid1f from a grid file written by writeGrid, the checksums are verified */
+ref_ptr<Grid1f> readGrid1f(std::string filename, double conversion = 1);
+
+/**
+ Read the region of nx * ny * nz points from point (ix, iy, iz) of a grid file.
+ Only the tiles that overlap with the region are read, the origin of the
+ returned grid is that of the region.
+ */
+ref_ptr<Grid3f> readGrid3f(std::string filename, size_t ix, size_t iy, size_t iz,
+		size_t nx, size_t ny, size_t nz, double conversion = 1);
+
+/** Read a region of a Grid1f from a grid file, see readGrid3f */
+ref_ptr<Grid1f> readGrid1f(std::string filename, size_t ix, size_t iy, size_t iz,
+		size_t nx, size_t ny, size_t nz, double conversion = 1);
+
+#ifdef CRPROPA_HAVE_HDF5
+/**
+ Dump a Grid3f to a chunked HDF5 dataset of shape (Nx, Ny, Nz, 3)
+
+ The origin, spacing and reflective flag are stored as attributes of the
+ dataset, an existing file is overwritten.
+ @param grid			grid to dump
+ @param filename		name of the file
+ @param dataset			name of the dataset
+ @param conversion		factor multiplied to all values
+ @param compressionLevel	deflate level of the chunks, 0 for no compression
+ */
+void dumpGridHDF5(ref_ptr<Grid3f> grid, std::string filename, std::string dataset = "grid",
+		double conversion = 1, int compressionLevel = 0);
+
+/** Dump a Grid1f to a chunked HDF5 dataset of shape (Nx, Ny, Nz), see dumpGridHDF5(ref_ptr<Grid3f>, ...) */
+void dumpGridHDF5(ref_ptr<Grid1f> grid, std::string filename, std::string dataset = "grid",
+		double conversion = 1, int compressionLevel = 0);
+
+/**
+ Load a Grid3f from an HDF5 dataset of shape (Nx, Ny, Nz, 3) and any floating point type.
+ The dataset and grid size have to match.
+ */
+void loadGridHDF5(ref_ptr<Grid3f> grid, std::string filename, std::string dataset = "grid",
+		double conversion = 1);
+
+/** Load a Grid1f from an HDF5 dataset of shape (Nx, Ny, Nz), see loadGridHDF5(ref_ptr<Grid3f>, ...) */
+void loadGridHDF5(ref_ptr<Grid1f> grid, std::string filename, std::string dataset = "grid",
+		double conversion = 1);
+
+/**
+ Load the sub-volume of a dataset that starts at point (ix, iy, iz) and has the size of the grid.
+ Only this region is read from the file, the origin of the grid is left unchanged.
+ */
+void loadGridHDF5(ref_ptr<Grid3f> grid, std::string filename, std::string dataset,
+		size_t ix, size_t iy, size_t iz, double conversion = 1);
+
+/** Load a sub-volume of a dataset into a Grid1f, see loadGridHDF5(ref_ptr<Grid3f>, ..., ix, iy, iz, ...) */
+void loadGridHDF5(ref_ptr<Grid1f> grid, std::string filename, std::string dataset,
+		size_t ix, size_t iy, size_t iz, double conversion = 1);
+#endif // CRPROPA_HAVE_HDF5
+
 #ifdef CRPROPA_HAVE_FFTW3F
 /**
  Calculate the omnidirectional power spectrum E(k) for a given turbulent field
@@ -0,0 +1,71 @@
+#ifndef CRPROPA_INTEGRATORSTATISTICS_H
+#define CRPROPA_INTEGRATORSTATISTICS_H
+
+#include "crpropa/Candidate.h"
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace crpropa {
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ @class IntegratorStatistics
+ @brief Counters of the step size control of a propagation module
+ */
+struct IntegratorStatistics {
+	uint64_t acceptedSteps; ///< steps taken
+	uint64_t rejectedSteps; ///< trial steps rejected by the error control
+	uint64_t fieldEvaluations; ///< evaluations of the magnetic field
+	uint64_t minimumSteps; ///< steps taken at the minimum step size with the error above the tolerance
+
+	IntegratorStatistics();
+	IntegratorStatistics &operator +=(const IntegratorStatistics &s);
+	std::string getDescription() const;
+};
+
+/**
+ @class IntegratorCounters
+ @brief IntegratorStatistics of a module, counted per thread while enabled
+
+ Every thread adds to its own counters, which are summed by getTotal.
+ Optionally the counters of each candidate are accumulated in its properties
+ <name>.acceptedSteps, <name>.rejectedSteps, <name>.fieldEvaluations and
+ <name>.minimumSteps.
+ */
+class IntegratorCounters {
+	struct ThreadCounters {
+		IntegratorStatistics statistics;
+		char padding[64];
+	};
+	std::vector<ThreadCounters> threads;
+	bool enabled;
+	bool properties;
+	Candidate::PropertyKey keys[4];
+
+public:
+	IntegratorCounters();
+	/**
+	 Enable the counting, which also resets the counters.
+	 @param name			prefix of the candidate properties
+	 @param enable			count the steps
+	 @param asProperties	accumulate the counters of each candidate in its properties
+	 */
+	void enable(const std::string &name, bool enable, bool asProperties);
+	bool isEnabled() const {
+		return enabled;
+	}
+	/** Add the counters of one step, called by the thread propagating the candidate */
+	void record(Candidate *candidate, const IntegratorStatistics &step);
+	IntegratorStatistics getTotal() const;
+	void reset();
+};
+
+/** @}*/
+} // namespace crpropa
+
+#endif // CRPROPA_INTEGRATORSTATISTICS_H
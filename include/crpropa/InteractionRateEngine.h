@@ -0,0 +1,81 @@
+#ifndef CRPROPA_INTERACTIONRATEENGINE_H
+#define CRPROPA_INTERACTIONRATEENGINE_H
+
+#include "crpropa/PhotonBackground.h"
+
+#include <string>
+#include <vector>
+
+namespace crpropa {
+/**
+ * \addtogroup PhotonFields
+ * @{
+ */
+
+/**
+ @class InteractionRateEngine
+ @brief Computes the interaction rate tables of a photon field at runtime.
+
+ The tables are written in the format and directory layout of the CRPropa
+ data files, into a cache directory keyed by a hash of the photon field
+ density, so that they are only computed once per field. After install()
+ the interaction modules find them via getDataPath, for a field name
+ without precomputed data files.
+
+ Supported are EMPairProduction and EMInverseComptonScattering (rates and
+ cumulative rates for the secondaries), the energy loss rate of
+ ElectronPairProduction and the nucleon rates of PhotoPionProduction,
+ redshift dependent if the field is. For a SpatialPhotonField the tables of
+ the EM modules are computed for each of its cell fields. The pair spectrum of
+ ElectronPairProduction, the photon sampling of SOPHIA and the
+ PhotoDisintegration cross sections are not derived from the field.
+
+ All tables are computed in parallel over the energy and redshift bins.
+ */
+class InteractionRateEngine {
+	ref_ptr<PhotonField> photonField;
+	std::string cacheDirectory;
+	double epsMin, epsMax; ///< photon energy range [J]
+	std::vector<double> redshifts; ///< redshifts of the redshift dependent tables
+
+	std::string path(const std::string &module, const std::string &file) const;
+	// I(x) = int_x^epsMax n(eps) / eps^2 deps on a log grid, for the field at redshift z
+	void photonIntegral(double z, std::vector<double> &eps, std::vector<double> &integral) const;
+	void computeEMRates(const std::string &module, bool pairProduction) const;
+	// engines for the distinct cell fields of a SpatialPhotonField, none otherwise
+	std::vector<InteractionRateEngine> cellEngines() const;
+
+public:
+	/**
+	 @param photonField		photon field to compute the rates for
+	 @param cacheDirectory	directory of the rate cache, created if needed
+	 */
+	InteractionRateEngine(ref_ptr<PhotonField> photonField,
+			std::string cacheDirectory = "crpropa_rate_cache");
+
+	/// Photon energy range [J] to integrate over, by default from the photon field
+	void setPhotonEnergyRange(double epsMin, double epsMax);
+	/// Redshifts of the redshift dependent tables, by default 0 - 6 in steps of 0.1
+	void setRedshifts(const std::vector<double> &redshifts);
+
+	/// Hash of the photon field density and the engine settings
+	std::string getFieldHash() const;
+	/// Directory containing the tables of this field
+	std::string getDirectory() const;
+
+	/// Compute the tables unless cached
+	void computeEMPairProduction() const;
+	void computeEMInverseComptonScattering() const;
+	void computeElectronPairProduction() const;
+	void computePhotoPionProduction() const;
+	void computeAll() const;
+
+	/// Make the tables available to the interaction modules
+	void install() const;
+};
+
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_INTERACTIONRATEENGINE_H
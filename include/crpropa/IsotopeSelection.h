@@ -0,0 +1,65 @@
+#ifndef CRPROPA_ISOTOPESELECTION_H
+#define CRPROPA_ISOTOPESELECTION_H
+
+#include "crpropa/PhotonBackground.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace crpropa {
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ @class IsotopeSelection
+ @brief Nuclei reachable from the primaries of a simulation, to which the nuclear interaction tables are restricted.
+
+ The selection is the closure of the primaries over the photodisintegration
+ channels of the added photon fields, the nuclear decay channels and the
+ loss of a nucleon in photopion production, including the emitted light
+ nuclei. It is computed from the branching and decay tables at the first
+ query, so the primaries and fields are to be added before the run.
+ PhotoDisintegration and NuclearDecay only load the tables of the selected
+ nuclei, see their setIsotopeSelection. Nuclei outside of the selection do
+ not interact with these modules.
+ */
+class IsotopeSelection: public Referenced {
+	std::vector<int> primaries;
+	std::vector<std::string> fields; // names of the photon fields
+	mutable std::vector<bool> selected; // [Z * 31 + N]
+	mutable std::unique_ptr<std::once_flag> computed;
+
+	void compute() const;
+	void require() const;
+
+public:
+	IsotopeSelection();
+	/** @param primaries	particle ids of the injected nuclei */
+	IsotopeSelection(const std::vector<int> &primaries);
+
+	void addPrimary(int id);
+	/** Follow the photodisintegration channels of the field, added by PhotoDisintegration::setIsotopeSelection */
+	void addPhotonField(ref_ptr<PhotonField> field);
+
+	/** True if the nucleus with Z protons and N neutrons is reachable */
+	bool contains(int Z, int N) const;
+	/** True if the nucleus is reachable, other particles are not */
+	bool contains(int id) const;
+	/** Number of selected nuclei */
+	size_t size() const;
+	/** Particle ids of the selected nuclei */
+	std::vector<int> getIsotopes() const;
+	/** Identifies the selection in the keys of the TableRegistry */
+	std::string getKey() const;
+	std::string getDescription() const;
+};
+
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_ISOTOPESELECTION_H
@@ -0,0 +1,53 @@
+#ifndef CRPROPA_KDTREE_H
+#define CRPROPA_KDTREE_H
+
+#include "crpropa/Vector3.h"
+
+#include <limits>
+#include <vector>
+#include <stdint.h>
+
+namespace crpropa {
+
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ @class KdTree
+ @brief Balanced k-d tree of points for nearest point queries.
+
+ The points are kept in the order of add and the tree is rebuilt on each add,
+ so it is meant to be filled once and queried often. A query descends to the
+ cell of the point and only visits the other cells that can hold a closer
+ point, which costs O(log n) for evenly spread points.
+ */
+class KdTree {
+	std::vector<Vector3d> points;
+	std::vector<uint32_t> order; // points of the tree, the median of a range is its node
+	std::vector<uint8_t> axes; // split axis of the node at the same position of order
+
+	void build(size_t begin, size_t end);
+	void nearest(const Vector3d &point, size_t begin, size_t end,
+			double &distance2, long &index) const;
+public:
+	KdTree();
+	KdTree(const std::vector<Vector3d> &points);
+	void add(const Vector3d &point);
+	void setPoints(const std::vector<Vector3d> &points);
+	size_t size() const;
+	bool empty() const;
+	const Vector3d &getPoint(size_t i) const;
+	const std::vector<Vector3d> &getPoints() const;
+	/// Index of the nearest point (in the order of add), -1 if empty
+	long nearestPoint(const Vector3d &point) const;
+	/// Distance to the nearest point, the maximum double if empty
+	double nearestDistance(const Vector3d &point) const;
+};
+
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_KDTREE_H
@@ -0,0 +1,178 @@
+#ifndef CRPROPA_MAPPEDGRID_H
+#define CRPROPA_MAPPEDGRID_H
+
+#include "crpropa/Grid.h"
+
+#include <string>
+
+namespace crpropa {
+
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ @class MappedGrid
+ @brief Read-only grid of single precision values mapped from a file
+
+ The values are not read but mapped read-only (copy-on-write), so that
+ opening a grid is instant, only the touched pages are read and all
+ processes on a node share the pages of the file.
+ The conversion factor that loadGrid multiplies into every value is applied
+ after the interpolation instead.
+
+ Two file layouts are supported:
+ - files written with save(), with a header of the shape, origin, spacing
+   and boundary that is validated on mapping; the values follow at offset 128
+ - raw files of dumpGrid, without a header, whose geometry is given by
+   GridProperties and checked against the file size
+ Interpolation and the closest value follow the Grid of the same geometry.
+ */
+template<typename T>
+class MappedGrid: public Referenced {
+	const T *data;
+	void *mapping;
+	size_t mappingSize;
+	double factor;
+	size_t Nx, Ny, Nz;
+	Vector3d origin, gridOrigin, spacing;
+	bool reflective;
+
+	void map(const std::string &filename, size_t offset);
+public:
+	/** Map a grid saved with save(), values are multiplied by factor */
+	MappedGrid(const std::string &filename, double factor = 1);
+	/** Map a raw file of dumpGrid with the given geometry */
+	MappedGrid(const std::string &filename, const GridProperties &properties, double factor = 1);
+	~MappedGrid();
+
+	/** Offset of the values in files written by save and create */
+	static const size_t dataOffset = 128;
+
+	/** Save a grid with a header, which can be mapped with the constructor */
+	static void save(const Grid<T> &grid, const std::string &filename);
+	/**
+	 Create a file with the header of a grid of the given geometry and zero
+	 values, which are then written in place at dataOffset, e.g. in slabs
+	 for grids that do not fit into memory
+	 */
+	static void create(const std::string &filename, const GridProperties &properties);
+
+	/** Grid with the converted values */
+	ref_ptr<Grid<T> > toGrid() const;
+	/** Read all pages of the values into memory, e.g. in a background thread ahead of use */
+	void prefetch() const;
+
+	Vector3d getOrigin() const {
+		return origin;
+	}
+	size_t getNx() const {
+		return Nx;
+	}
+	size_t getNy() const {
+		return Ny;
+	}
+	size_t getNz() const {
+		return Nz;
+	}
+	Vector3d getSpacing() const {
+		return spacing;
+	}
+	void setReflective(bool b) {
+		reflective = b;
+	}
+	bool isReflective() const {
+		return reflective;
+	}
+	void setFactor(double f) {
+		factor = f;
+	}
+	double getFactor() const {
+		return factor;
+	}
+	/** Size of the mapped values in bytes */
+	size_t getSizeOf() const {
+		return sizeof(T) * Nx * Ny * Nz;
+	}
+
+	/** Value of a grid point as stored in the file, without the factor */
+	const T &getStored(size_t ix, size_t iy, size_t iz) const {
+		return data[ix * Ny * Nz + iy * Nz + iz];
+	}
+
+	/** Converted value of a grid point */
+	T get(size_t ix, size_t iy, size_t iz) const {
+		return getStored(ix, iy, iz) * factor;
+	}
+
+	/** Value of a grid point that is closest to a given position */
+	T closestValue(const Vector3d &position) const {
+		Vector3d r = (position - gridOrigin) / spacing;
+		int ix = round(r.x);
+		int iy = round(r.y);
+		int iz = round(r.z);
+		if (reflective) {
+			int nx = Nx, ny = Ny, nz = Nz;
+			while ((ix < 0) or (ix > nx))
+				ix = 2 * nx * (ix > nx) - ix;
+			while ((iy < 0) or (iy > ny))
+				iy = 2 * ny * (iy > ny) - iy;
+			while ((iz < 0) or (iz > nz))
+				iz = 2 * nz * (iz > nz) - iz;
+			// the reflection at the upper edge is the last grid point
+			ix = std::min(ix, nx - 1);
+			iy = std::min(iy, ny - 1);
+			iz = std::min(iz, nz - 1);
+		} else {
+			ix = ((ix % int(Nx)) + int(Nx)) % int(Nx);
+			iy = ((iy % int(Ny)) + int(Ny)) % int(Ny);
+			iz = ((iz % int(Nz)) + int(Nz)) % int(Nz);
+		}
+		return get(ix, iy, iz);
+	}
+
+	/** Trilinear interpolation as in Grid::interpolate */
+	T interpolate(const Vector3d &position) const {
+		Vector3d r = (position - gridOrigin) / spacing;
+
+		int ix, iX, iy, iY, iz, iZ;
+		if (reflective) {
+			reflectiveClamp(r.x, Nx, ix, iX);
+			reflectiveClamp(r.y, Ny, iy, iY);
+			reflectiveClamp(r.z, Nz, iz, iZ);
+		} else {
+			periodicClamp(r.x, Nx, ix, iX);
+			periodicClamp(r.y, Ny, iy, iY);
+			periodicClamp(r.z, Nz, iz, iZ);
+		}
+
+		double fx = r.x - floor(r.x);
+		double fX = 1 - fx;
+		double fy = r.y - floor(r.y);
+		double fY = 1 - fy;
+		double fz = r.z - floor(r.z);
+		double fZ = 1 - fz;
+
+		// interpolation of the stored values, converted once
+		T b(0.);
+		b += getStored(ix, iy, iz) * (fX * fY * fZ);
+		b += getStored(iX, iy, iz) * (fx * fY * fZ);
+		b += getStored(ix, iY, iz) * (fX * fy * fZ);
+		b += getStored(ix, iy, iZ) * (fX * fY * fz);
+		b += getStored(iX, iy, iZ) * (fx * fY * fz);
+		b += getStored(ix, iY, iZ) * (fX * fy * fz);
+		b += getStored(iX, iY, iz) * (fx * fy * fZ);
+		b += getStored(iX, iY, iZ) * (fx * fy * fz);
+		return b * factor;
+	}
+};
+
+typedef MappedGrid<Vector3f> MappedGrid3f;
+typedef MappedGrid<float> MappedGrid1f;
+
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_MAPPEDGRID_H
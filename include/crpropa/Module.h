@@ -2,15 +2,32 @@
 #define CRPROPA_MODULE_H
 
 #include "crpropa/Candidate.h"
+#include "crpropa/IntegratorStatistics.h"
 #include "crpropa/Referenced.h"
 #include "crpropa/Common.h"
 
 #include <string>
+#include <vector>
 
 namespace crpropa {
 
 class Candidate;
 
+/**
+ Classes of particles, combined as bit mask in Module::getParticleClasses
+ */
+enum ParticleClass {
+	PhotonClass = 1, ///< photons
+	ElectronClass = 2, ///< electrons and positrons
+	NucleusClass = 4, ///< nuclei including single nucleons
+	NeutrinoClass = 8, ///< neutrinos
+	OtherClass = 16, ///< all other particles
+	AllParticleClasses = 31
+};
+
+/** Particle class of a particle id */
+ParticleClass particleClass(int id);
+
 /**
  @class Module
  @brief Abstract base class for modules
@@ -23,18 +40,83 @@ public:
 	}
 	virtual std::string getDescription() const;
 	void setDescription(const std::string &description);
+	/**
+	 Load what the module needs before the first candidate, e.g. the tables
+	 of the interaction modules, which are otherwise loaded on first use.
+	 ModuleList::run prepares its modules once before the run, modules
+	 holding other modules prepare these with prepareModules.
+	 The default does nothing.
+	 */
+	virtual void prepare();
 	virtual void process(Candidate *candidate) const = 0;
 	inline void process(ref_ptr<Candidate> candidate) const {
 		process(candidate.get());
 	}
+	/**
+	 Process a batch of candidates.
+	 The default calls process for each candidate. Modules can override this to
+	 avoid the virtual dispatch per candidate and to vectorize their kernels.
+	 */
+	virtual void processBatch(Candidate **candidates, size_t count) const;
+	/**
+	 Bit mask of the ParticleClass values the module acts on. ModuleList only
+	 calls process for candidates of these classes. The default acts on all.
+	 */
+	virtual unsigned int getParticleClasses() const;
+	/**
+	 Modules with stochastic interactions implement getInteractionRate and
+	 performStochasticInteraction, so that InteractionSampler can sample the
+	 interactions of several modules at once.
+	 */
+	virtual bool hasInteractionRate() const;
+	/**
+	 Total rate [1/m] per comoving distance of the stochastic interactions of
+	 the candidate in its current state, 0 if it cannot interact.
+	 */
+	virtual double getInteractionRate(const Candidate *candidate) const;
+	/** Perform one stochastic interaction, selecting the channel at random */
+	virtual void performStochasticInteraction(Candidate *candidate) const;
+	/**
+	 Modules with continuous energy losses implement getEnergyLossRate, so
+	 that ContinuousLosses can integrate the losses of several modules at once.
+	 */
+	virtual bool hasEnergyLossRate() const;
+	/**
+	 Energy loss rate -dE/dx [J/m] per comoving distance of the candidate at
+	 its current position, evaluated at the energy E [J] and redshift z.
+	 Negative values are energy gains.
+	 */
+	virtual double getEnergyLossRate(const Candidate *candidate, double E, double z) const;
+	/**
+	 Propagation modules that record the counters of their step size control
+	 return true and the counters summed over all threads. ModuleList reports
+	 them with its profile.
+	 */
+	virtual bool getIntegratorStatistics(IntegratorStatistics &statistics) const;
+	/**
+	 Bytes held by the module: interaction tables, fields and output buffers.
+	 Tables shared between instances are counted by each of them. The default
+	 is 0, ModuleList reports the modules with getMemoryReport.
+	 */
+	virtual size_t getMemoryUsage() const;
 };
 
+/**
+ Prepare the modules concurrently, as OpenMP tasks of the current team or of
+ a new one. Modules holding other modules prepare these as further tasks.
+ After all modules are prepared, the errors are rethrown as a single
+ std::runtime_error with one line per failed module.
+ */
+void prepareModules(const std::vector<Module *> &modules);
+
 
 /**
  @class AbstractCondition
  @brief Abstract Module providing common features for conditional modules.
  */
 class AbstractCondition: public Module {
+	// evaluates the conditions of several modules and rejects with theirs
+	friend class TerminationConditions;
 protected:
 	ref_ptr<Module> rejectAction, acceptAction;
 	bool makeRejectedInactive, makeAcceptedInactive;
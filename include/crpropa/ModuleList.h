@@ -2,14 +2,47 @@
 #define CRPROPA_MODULE_LIST_H
 
 #include "crpropa/Candidate.h"
+#include "crpropa/Convergence.h"
 #include "crpropa/Module.h"
+#include "crpropa/RunMetrics.h"
+#include "crpropa/SecondaryAdmission.h"
+#include "crpropa/SlabDecomposition.h"
 #include "crpropa/Source.h"
+#include "crpropa/module/Output.h"
+#include "crpropa/module/HDF5Output.h"
 
+#include <functional>
 #include <list>
 #include <sstream>
 
 namespace crpropa {
 
+/**
+ @class ModuleProfile
+ @brief Profile of a single module in a ModuleList, reduced over all threads
+ */
+struct ModuleProfile {
+	std::string module; ///< description of the module
+	uint64_t calls; ///< number of candidates processed
+	uint64_t ticks; ///< time stamp counter ticks spent in process
+	uint64_t secondaries; ///< number of secondaries created
+	uint64_t limits; ///< number of steps whose next step size was changed last by the module
+	bool hasIntegrator; ///< the module recorded integrator statistics
+	IntegratorStatistics integrator; ///< counters of the step size control, see Module::getIntegratorStatistics
+};
+
+/**
+ @class PrimaryCostEstimate
+ @brief Estimate of the relative computing cost of a primary, used by the
+ cost-aware schedule of ModuleList. The default is mass number times energy
+ in EeV, derive from this class for a better estimate of a specific setup.
+ */
+class PrimaryCostEstimate: public Referenced {
+public:
+	virtual ~PrimaryCostEstimate() {}
+	virtual double getCost(const Candidate *candidate) const;
+};
+
 /**
  @class ModuleList
  @brief The simulation itself: A list of simulation modules
@@ -18,23 +51,237 @@ class ModuleList: public Module {
 public:
 	typedef std::list<ref_ptr<Module> > module_list_t;
 	typedef std::vector<ref_ptr<Candidate> > candidate_vector_t;
+	typedef std::function<ref_ptr<Candidate>(size_t)> candidate_function_t;
+
+	/** OpenMP schedules of the primary loop */
+	enum Schedule {
+		ScheduleDefault, ///< OMP_SCHEDULE configured at build time
+		ScheduleStatic,
+		ScheduleDynamic,
+		ScheduleGuided,
+		ScheduleCostAware ///< primaries sorted by estimated cost, largest first, scheduled dynamically
+	};
 
 	ModuleList();
 	virtual ~ModuleList();
 	void setShowProgress(bool show = true); ///< activate a progress bar
+	/**
+	 Write the live counters of the runs to the status file of the metrics,
+	 for monitoring in batch systems instead of the progress bar. The
+	 reporter thread is started and stopped by every run, see RunMetrics.
+	 */
+	void setMetrics(RunMetrics *metrics);
+	ref_ptr<RunMetrics> getMetrics() const;
+	/**
+	 Draw the random numbers of every candidate from its own counter-based
+	 stream (see Random::setStream) instead of the per-thread generators.
+	 The stream of the i-th primary of a run is derived from the seed and i,
+	 the streams of the secondaries from their parents, so the results do not
+	 depend on the number of threads or the scheduling. Candidates passed to
+	 run(candidate) without a stream use their serial number.
+	 */
+	void setCounterBasedRandom(bool enable = true, uint64_t seed = 0);
+	bool getCounterBasedRandom() const;
+	/**
+	 Propagate the secondaries of a candidate as OpenMP tasks, so that idle
+	 threads can steal the work of large cascades. The order given by
+	 secondariesFirst is kept for each candidate.
+	 */
+	void setParallelSecondaries(bool parallel = true);
+	bool getParallelSecondaries() const;
+	/**
+	 Bounded-memory cascade mode: secondaries are detached from their parent
+	 and released as soon as they are inactive, so that the memory is bounded
+	 by the active part of the cascade instead of the full tree.
+	 Candidate::secondaries is empty after the run, use output modules to
+	 record the secondaries.
+	 */
+	void setStreamSecondaries(bool stream = true);
+	bool getStreamSecondaries() const;
+	/**
+	 Profile the modules: every thread counts the ticks spent in each module,
+	 the calls and the created secondaries as well as the steps and primaries
+	 of the list. The module that changed the next step size last in a step,
+	 i.e. that limited it, is counted as well; steps in which no module
+	 changed it are not attributed. The counters are reduced and
+	 printed at the end of each run, together with the integrator statistics
+	 of the propagation modules recording them. Enabling the profiling resets
+	 the counters.
+	 */
+	void setProfiling(bool profile = true);
+	bool getProfiling() const;
+	void resetProfile();
+	std::vector<ModuleProfile> getProfile() const; ///< per-module profile reduced over all threads
+	uint64_t getProfiledSteps() const; ///< number of steps through the whole list
+	uint64_t getProfiledPrimaries() const; ///< number of primaries run
+	std::string getProfileReport(bool json = false) const; ///< profile as table or JSON
+
+	/** Bytes held by the modules, see Module::getMemoryUsage */
+	size_t getMemoryUsage() const;
+	/**
+	 Memory held by each module and by the candidates: the live and pooled
+	 candidates and the peak of live candidates of every thread, see
+	 Candidate::getPeakLiveCounts. Candidates count sizeof(Candidate)
+	 without their properties and secondaries vectors.
+	 */
+	std::string getMemoryReport(bool json = false) const;
+	/**
+	 Print a line with the memory of the modules and candidates every given
+	 number of seconds while running, checked by the first thread after each
+	 primary. 0 (default) disables the line.
+	 */
+	void setMemoryReportInterval(double seconds);
+	double getMemoryReportInterval() const;
+
+	/**
+	 Select the schedule of the primaries at runtime. The imbalance of the
+	 thread busy times of each run is kept, see getLoadImbalance, and printed
+	 with the progress bar or profiling.
+	 @param schedule	schedule type
+	 @param chunkSize	chunk size of static, dynamic and guided, 0 for the OpenMP default
+	 */
+	void setSchedule(Schedule schedule, int chunkSize = 0);
+	Schedule getSchedule() const;
+	void setCostEstimate(PrimaryCostEstimate *estimate); ///< cost estimate used by ScheduleCostAware
+	/**
+	 Draw the primaries of run(source, count) in blocks and run each block in
+	 the Morton order of the source positions, so that the primaries of a
+	 thread start close to each other and share the cached cells of large
+	 grids. Off by default, as the blocks are drawn in parallel chunks,
+	 which changes the sequence of random numbers. Ignored by
+	 ScheduleCostAware, which orders the blocks by cost.
+	 @param enable		order the primaries
+	 @param blockSize	number of primaries drawn and ordered together
+	 */
+	void setLocalityOrder(bool enable = true, size_t blockSize = 16384);
+	bool getLocalityOrder() const;
+	double getLoadImbalance() const; ///< maximum over mean busy time of the threads in the last run
+
+	/**
+	 Policy consulted by Candidate::addSecondary while the modules of this
+	 list run, 0 (default) admits all secondaries. Nested lists without a
+	 policy of their own use the policy of the enclosing list.
+	 */
+	void setSecondaryAdmission(SecondaryAdmission *admission);
+	SecondaryAdmission *getSecondaryAdmission() const;
 
 	void add(Module* module);
 	void remove(std::size_t i);
 	std::size_t size() const;
 	ref_ptr<Module> operator[](const std::size_t i);
 
-	void process(Candidate* candidate) const; ///< call process in all modules
+	/**
+	 Rebuild the cached module chains of the particle classes. Called by add,
+	 remove and the run methods, call it after changing the particle classes
+	 of a module in the list.
+	 */
+	void updateDispatch();
+	/** Prepare all modules concurrently, called once by the run methods, see prepareModules */
+	void prepare();
+
+	void process(Candidate* candidate) const; ///< call process in all modules acting on the particle class
 	void process(ref_ptr<Candidate> candidate) const; ///< call process in all modules
+	void processBatch(Candidate **candidates, size_t count) const; ///< call processBatch in all modules
 
 	void run(Candidate* candidate, bool recursive = true, bool secondariesFirst = false); ///< run simulation for a single candidate
 	void run(ref_ptr<Candidate> candidate, bool recursive = true, bool secondariesFirst = false); ///< run simulation for a single candidate
 	void run(const candidate_vector_t *candidates, bool recursive = true, bool secondariesFirst = false); ///< run simulation for a candidate vector
 	void run(SourceInterface* source, size_t count, bool recursive = true, bool secondariesFirst = false); ///< run simulation for a number of candidates from the given source
+	/**
+	 Run the simulation for candidates from the source in batches until the
+	 targets of the relative uncertainties of the criterion are met or its
+	 budget is used up, see ConvergenceCriterion. The achieved precision is
+	 kept by the criterion and printed at the end with showProgress.
+	 Checkpoints, if enabled, are written after every batch, batches larger
+	 than the checkpoint interval are split.
+	 */
+	void run(SourceInterface* source, ConvergenceCriterion *criterion, bool recursive = true, bool secondariesFirst = false);
+
+	/**
+	 Run the simulation in batches: all active candidates of a batch are
+	 advanced one step through each module before the next step is taken.
+	 Secondaries are propagated in batches after their parents finished.
+	 @param candidates	candidates to propagate
+	 @param batchSize	number of candidates advanced together
+	 @param recursive	propagate the secondaries as well
+	 */
+	void runBatch(const candidate_vector_t *candidates, size_t batchSize = 64, bool recursive = true);
+	void runBatch(SourceInterface* source, size_t count, size_t batchSize = 64, bool recursive = true); ///< batched run for a number of candidates from the given source
+	/**
+	 Pass count candidates to an action in parallel, with the schedule, the
+	 progress bar, the metrics and the cancellation by SIGINT and SIGTERM of
+	 the runs. The candidates are taken in segments of segmentSize, 0 for all
+	 at once: those of a segment are obtained from candidateAt in parallel,
+	 ordered by cost for ScheduleCostAware, passed to the action and released
+	 before the next segment. An exception of the action cancels the
+	 remaining candidates and is rethrown. Used by ParticleCollector::reprocess.
+	 */
+	void apply(Module *action, size_t count, const candidate_function_t &candidateAt, size_t segmentSize = 0);
+
+	/**
+	 Write a checkpoint every interval completed primaries of
+	 run(source, count). The checkpoint holds the number of completed
+	 primaries, the random generator states of all threads, the next serial
+	 number and, as flush marker, the number of events and the position of
+	 every checkpoint output. Events written after the last marker belong to
+	 primaries that are repeated by resume, which rewinds the outputs to
+	 their markers.
+	 @param filename	checkpoint file, written atomically via a temporary file
+	 @param interval	number of primaries between checkpoints, 0 disables
+	 */
+	void setCheckpoint(const std::string &filename, size_t interval);
+	/** Output that is flushed and marked at every checkpoint */
+	void addCheckpointOutput(Output *output);
+	/**
+	 Continue an interrupted run(source, count) from the given checkpoint,
+	 in the same or in a new process. The source has to be configured as in
+	 the original run. The checkpoint outputs, added in the same order, are
+	 rewound to their markers before the run continues. In a new process the
+	 files have to be continued instead of created again: a TextOutput in
+	 append mode, TextOutput(filename, type, true), and an HDF5Output, which
+	 opens the existing file, are shortened to their markers. Outputs that
+	 cannot be rewound, e.g. files that were truncated by opening them again,
+	 throw a runtime_error.
+	 */
+	void resume(SourceInterface* source, const std::string &checkpointFile, bool recursive = true, bool secondariesFirst = false);
+
+#ifdef CRPROPA_HAVE_MPI
+	/**
+	 Run the simulation distributed over all MPI ranks. The primaries are
+	 split evenly among the ranks, the random generators of all ranks and
+	 threads are seeded deterministically from the master seed and the serial
+	 numbers of rank r start at r * 2^40. MPI is initialized if necessary.
+	 @param source	source of the primaries, configured identically on all ranks
+	 @param count	total number of primaries of all ranks
+	 @param seed	master seed
+	 */
+	void runDistributed(SourceInterface* source, size_t count, uint32_t seed, bool recursive = true, bool secondariesFirst = false);
+	/**
+	 Run the simulation on a domain decomposed over all MPI ranks, e.g. with
+	 a DistributedMagneticFieldGrid. Every rank draws its share of the
+	 primaries as in runDistributed and propagates the candidates in its
+	 domain. A candidate that leaves the domain after a step is serialized
+	 and migrated to the rank owning its position, secondaries are
+	 propagated independently of their parents. The candidates are exchanged
+	 in collective rounds, so that the run ends exactly when no rank holds a
+	 candidate after a round.
+	 @param source			source of the primaries, configured identically on all ranks
+	 @param count			total number of primaries of all ranks
+	 @param seed			master seed
+	 @param decomposition	owner of every position, with one slab per rank
+	 @param recursive		propagate the secondaries as well
+	 */
+	void runDomainDecomposed(SourceInterface* source, size_t count, uint32_t seed,
+			const SlabDecomposition *decomposition, bool recursive = true);
+	/** Rank of this process, MPI is initialized if necessary */
+	static int getDistributedRank();
+	/** Number of MPI ranks, MPI is initialized if necessary */
+	static int getDistributedSize();
+#ifdef CRPROPA_HAVE_HDF5
+	/** HDF5Output of which the files of all ranks are merged on rank 0 after runDistributed */
+	void setDistributedOutput(HDF5Output *output);
+#endif
+#endif
 
 	std::string getDescription() const;
 	void showModules() const;
@@ -50,6 +297,76 @@ public:
 private:
 	module_list_t modules;
 	bool showProgress;
+	ref_ptr<RunMetrics> metrics;
+	bool parallelSecondaries;
+	bool streamSecondaries;
+
+	std::string checkpointFile;
+	size_t checkpointInterval;
+	std::vector<ref_ptr<Output> > checkpointOutputs;
+
+	// counters of one thread, only written by their own thread
+	struct ThreadProfile {
+		std::vector<uint64_t> calls, ticks, secondaries, limits;
+		uint64_t steps, primaries;
+		char padding[64];
+	};
+	bool profiling;
+	mutable std::vector<ThreadProfile> threadProfiles;
+
+	double memoryReportInterval;
+	double nextMemoryReport; // steady clock time [s], 0 before the first primary
+
+	Schedule schedule;
+	int chunkSize;
+	ref_ptr<PrimaryCostEstimate> costEstimate;
+	ref_ptr<SecondaryAdmission> admission;
+	double loadImbalance;
+	bool localityOrder;
+	size_t localityBlockSize;
+	int previousKind, previousChunkSize;
+	static const size_t costBlockSize = 16384;
+	static const size_t sourceBlockSize = 64; // primaries drawn at once by getCandidates
+
+	// modules in list order and their indices acting on each particle class
+	std::vector<Module*> dispatchModules;
+	std::vector<std::vector<size_t> > dispatchChains;
+
+	bool counterRandom;
+	uint64_t counterSeed;
+	bool orderedOutputs; // the modules contain an ordered output, set by prepare
+#if defined(CRPROPA_HAVE_MPI) && defined(CRPROPA_HAVE_HDF5)
+	ref_ptr<HDF5Output> distributedOutput;
+#endif
+#ifdef CRPROPA_HAVE_MPI
+	void openDistributedOutput(int rank);
+	void closeDistributedOutput(int rank, int nRanks);
+	void propagateDomain(Candidate *candidate, const SlabDecomposition *decomposition, int rank,
+			bool recursive, std::vector<std::vector<char> > &outgoing);
+#endif
+
+	void propagate(Candidate* candidate, bool recursive, bool secondariesFirst);
+	void propagateSecondaries(Candidate* candidate, bool secondariesFirst);
+	void propagateStreaming(Candidate* candidate, bool secondariesFirst);
+	void propagatePending(std::vector<ref_ptr<Candidate> > &pending, bool secondariesFirst);
+	void propagateBatch(Candidate **candidates, size_t count, size_t batchSize, bool recursive);
+	void runSource(SourceInterface* source, size_t count, size_t completed, bool recursive, bool secondariesFirst,
+			ConvergenceCriterion *criterion = 0);
+	void writeCheckpoint(size_t count, size_t completed) const;
+	void runPrimary(Candidate *candidate, bool recursive, std::vector<double> &busy, bool cancelOnError);
+	void reportMemory();
+	ref_ptr<Candidate> nextPrimary(SourceInterface *source, size_t index);
+	void setPrimaryIndex(Candidate *candidate, uint64_t index) const;
+	void nextPrimaries(SourceInterface *source, size_t count, candidate_vector_t &out);
+	void processModules(Candidate *candidate) const;
+	void drawBlock(SourceInterface *source, size_t first, bool bulk, candidate_vector_t &block);
+	void sortByCost(const ref_ptr<Candidate> *candidates, std::vector<size_t> &order) const;
+	static void sortByPosition(const ref_ptr<Candidate> *candidates, std::vector<size_t> &order);
+	void beginSchedule(std::vector<double> &busy);
+	void endSchedule(const std::vector<double> &busy);
+	ThreadProfile *getThreadProfile() const;
+	void prepareProfile();
+	void processBatchProfiled(Candidate **candidates, size_t count, ThreadProfile *profile) const;
 };
 
 /**
@@ -62,6 +379,8 @@ private:
 public:
 
 	ModuleListRunner(ModuleList *mlist);
+	ModuleList *getModuleList() const;
+	void prepare();
 	void process(Candidate *candidate) const; ///< call run of wrapped ModuleList
 	std::string getDescription() const;
 };
@@ -0,0 +1,101 @@
+#ifndef CRPROPA_MODULE_LIST_1D_H
+#define CRPROPA_MODULE_LIST_1D_H
+
+#include "crpropa/ModuleList.h"
+#include "crpropa/Units.h"
+#include "crpropa/module/ContinuousLosses.h"
+#include "crpropa/module/InteractionSampler.h"
+
+#include <map>
+#include <mutex>
+
+namespace crpropa {
+
+/**
+ @class ModuleList1D
+ @brief Batched simulation of one-dimensional propagation
+
+ A specialised module list for 1D simulations, in which the candidates start
+ on the x-axis and move along it. The modules are added as to a ModuleList
+ and are sorted by their role:
+ - SimplePropagation only sets the step limits, the propagation is done here
+ - modules with an interaction rate, e.g. PhotoPionProduction,
+   PhotoDisintegration or NuclearDecay, are sampled together in an
+   InteractionSampler
+ - modules with only an energy loss rate, e.g. Redshift or
+   ElectronPairProduction, are integrated together in ContinuousLosses
+ - all other modules, e.g. Observer, break conditions and outputs, are
+   processed in a ModuleList in the order they were added
+
+ Position, direction, redshift, energy and steps of a batch of candidates are
+ kept in arrays, on which the propagation and the continuous losses are
+ computed for the whole batch. The candidates are updated once per step for
+ the interactions and the remaining modules. As with ContinuousLosses,
+ secondaries of the continuous losses are not created.
+
+ With setLossTables, the total loss rate of each particle type is tabulated
+ once in log10(E) and z, and the losses of a batch are integrated from these
+ tables in one kernel, which runs on the offload device when built with
+ ENABLE_OFFLOAD. The tables are mapped to the device when they are created.
+ Candidates leaving the tables during a step are integrated by the modules.
+ */
+class ModuleList1D: public Referenced {
+	ref_ptr<ContinuousLosses> losses;
+	ref_ptr<InteractionSampler> interactions;
+	ref_ptr<ModuleList> modules;
+	double minStep, maxStep;
+	size_t batchSize;
+
+	// relative loss rates -dE/dx / E in [1/m] of a particle type on
+	// (z, log10(E)), with a last row at z = 0 where Redshift has no losses
+	struct LossTable {
+		std::vector<double> rates;
+		const double *device; // address of the rates on the offload device
+	};
+	double tableZmax, tableEmin, tableEmax;
+	size_t tablePointsPerDecade, tableZPoints;
+	mutable std::map<int, LossTable> lossTables;
+	mutable std::mutex lossTablesMutex;
+
+	const double *getLossTable(int id) const;
+	void unmapLossTables();
+	void integrateLosses(Candidate **candidates, size_t count, const double *step,
+			double *E, double *z, double *next) const;
+	void propagate(Candidate **candidates, size_t count, bool recursive) const;
+public:
+	/** @param batchSize	number of candidates advanced together per thread */
+	ModuleList1D(size_t batchSize = 1024);
+	~ModuleList1D();
+	void add(Module *module);
+	void setBatchSize(size_t batchSize);
+	size_t getBatchSize() const;
+	/**
+	 Integrate the continuous losses with tabulated loss rates, see above.
+	 The tables of all particle types are replaced.
+	 @param zmax			maximum redshift of the tables, 0 to integrate without tables (default)
+	 @param Emin			minimum energy of the tables in [J]
+	 @param Emax			maximum energy of the tables in [J]
+	 @param pointsPerDecade	energy points per decade
+	 @param zPoints			redshift points in [0, zmax]
+	 */
+	void setLossTables(double zmax, double Emin = 1e15 * eV, double Emax = 1e23 * eV,
+			size_t pointsPerDecade = 20, size_t zPoints = 101);
+	/** Number of particle types with loss tables */
+	size_t getNumberOfLossTables() const;
+	double getMinimumStep() const;
+	double getMaximumStep() const;
+	/** Integration of the energy loss modules, e.g. to set its limit */
+	ref_ptr<ContinuousLosses> getContinuousLosses() const;
+	/** Sampling of the interaction modules, e.g. to set its limit */
+	ref_ptr<InteractionSampler> getInteractionSampler() const;
+	/** The remaining modules */
+	ref_ptr<ModuleList> getModuleList() const;
+
+	void run(const ModuleList::candidate_vector_t *candidates, bool recursive = true);
+	void run(SourceInterface *source, size_t count, bool recursive = true);
+	std::string getDescription() const;
+};
+
+} // namespace crpropa
+
+#endif // CRPROPA_MODULE_LIST_1D_H
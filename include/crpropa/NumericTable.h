@@ -0,0 +1,81 @@
+#ifndef CRPROPA_NUMERICTABLE_H
+#define CRPROPA_NUMERICTABLE_H
+
+#include "crpropa/Referenced.h"
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace crpropa {
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ @class NumericTable
+ @brief Table of numbers from a data file, read from text or a memory-mapped binary table.
+
+ Text files contain whitespace separated numbers, lines starting with '#'
+ are comments. The binary format consists of a 64 byte header (magic
+ "CRPTABLE", format version, byte order marker, number of rows and columns,
+ offset of the data) followed by the rectangular table as little-endian
+ doubles, aligned to 64 bytes. Binary tables are mapped read-only, so that
+ processes reading the same table share the memory pages.
+
+ load() prefers the binary table next to a text file (data.txt -> data.bin)
+ unless the text file is newer. The text files are converted at install
+ time with crpropa-convert-tables.
+ */
+class NumericTable: public Referenced {
+	std::vector<double> values; // of text files
+	std::vector<size_t> rowOffset; // of text files, size rows + 1
+	const double *data;
+	size_t nRows, nColumns; // nColumns = 0 for rows of different length
+	void *mapping;
+	size_t mappingSize;
+
+	void readText(const std::string &filename);
+	void readBinary(const std::string &filename);
+	friend bool convertTextTable(const std::string &textFile, const std::string &binaryFile);
+
+	// owns the mapping and data may point into values
+	NumericTable(const NumericTable &);
+	NumericTable &operator=(const NumericTable &);
+public:
+	NumericTable();
+	~NumericTable();
+
+	/// Load a table, from the binary version of the file if available
+	static ref_ptr<NumericTable> load(const std::string &filename);
+	/// Name of the binary table of a text file
+	static std::string binaryName(const std::string &filename);
+
+	size_t rows() const;
+	/// Number of columns, 0 if the rows have different lengths
+	size_t columns() const;
+	size_t rowSize(size_t row) const;
+	const double *row(size_t row) const;
+	double operator()(size_t row, size_t column) const;
+	/// Number of values
+	size_t size() const;
+	/// All values in row-major order
+	const double *begin() const;
+	bool isMapped() const;
+
+	/// Write as binary table, requires rows of equal length
+	void writeBinary(const std::string &filename) const;
+};
+
+/// Convert a text table to a binary table, returns false if its rows differ in length
+bool convertTextTable(const std::string &textFile, const std::string &binaryFile);
+
+/// Convert all text tables (*.txt) in a directory and its subdirectories, returns the number of converted files
+size_t convertDataDirectory(const std::string &directory);
+
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_NUMERICTABLE_H
@@ -0,0 +1,256 @@
+#ifndef CRPROPA_ORDEREDROWSPILL_H
+#define CRPROPA_ORDEREDROWSPILL_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace crpropa {
+/**
+ * \addtogroup Output
+ * @{
+ */
+
+/** Canonical position of an output row: its primary and its place in the tree of the primary */
+struct RowOrderKey {
+	uint64_t primary;
+	uint64_t lineage;
+
+	bool operator<(const RowOrderKey &other) const {
+		return (primary < other.primary) or ((primary == other.primary) and (lineage < other.lineage));
+	}
+};
+
+/**
+ @class OrderedRowSpill
+ @brief Per-thread spill buffers of rows, merged in the order of their keys.
+
+ Every thread collects its keyed rows in a buffer of its own without locking.
+ A full buffer is sorted, stably, and appended as a sorted run to the
+ temporary file of the thread, each row as its key, its size and the bytes
+ in use given by the row size function, e.g. only the characters of a text
+ line. The merge reads all runs and the remaining buffers at once and passes
+ the rows in the order of their keys to the write function, rows of equal
+ keys in the order they were pushed by one thread. The bytes of a row beyond
+ its size are undefined there.
+ */
+template<typename T>
+class OrderedRowSpill {
+	struct Entry {
+		RowOrderKey key;
+		T row;
+	};
+	struct Run {
+		size_t thread;
+		long offset; // in the file of the thread
+		size_t count, bytes;
+	};
+	struct Cursor {
+		std::vector<char> data; // records read from the run
+		size_t position; // in data
+		size_t remaining; // bytes of the run not yet read
+		long offset;
+		Entry entry; // decoded at the position
+	};
+	static const size_t headerBytes = sizeof(RowOrderKey) + sizeof(uint32_t);
+
+	size_t threads, bufferRows;
+	std::function<size_t(const T&)> rowBytes;
+	std::vector<std::vector<Entry> > buffers;
+	std::vector<std::FILE*> files;
+	std::vector<Run> runs;
+	std::mutex runMutex, overflowMutex;
+	std::vector<Entry> overflow; // of threads beyond the number of buffers
+
+	static bool entryLess(const Entry &a, const Entry &b) {
+		return a.key < b.key;
+	}
+
+	void spill(size_t thread) {
+		std::vector<Entry> &buffer = buffers[thread];
+		if (buffer.empty())
+			return;
+		std::stable_sort(buffer.begin(), buffer.end(), entryLess);
+		if (!files[thread]) {
+			files[thread] = std::tmpfile();
+			if (!files[thread])
+				throw std::runtime_error("OrderedRowSpill: cannot create a temporary file");
+		}
+		std::vector<char> data;
+		for (size_t i = 0; i < buffer.size(); i++) {
+			uint32_t n = rowBytes ? rowBytes(buffer[i].row) : sizeof(T);
+			size_t end = data.size();
+			data.resize(end + headerBytes + n);
+			std::memcpy(&data[end], &buffer[i].key, sizeof(RowOrderKey));
+			std::memcpy(&data[end + sizeof(RowOrderKey)], &n, sizeof(uint32_t));
+			std::memcpy(&data[end + headerBytes], &buffer[i].row, n);
+		}
+		std::FILE *file = files[thread];
+		std::fseek(file, 0, SEEK_END);
+		Run run = {thread, std::ftell(file), buffer.size(), data.size()};
+		if (std::fwrite(data.data(), 1, data.size(), file) != data.size())
+			throw std::runtime_error("OrderedRowSpill: cannot write the temporary file");
+		buffer.clear();
+		std::lock_guard<std::mutex> lock(runMutex);
+		runs.push_back(run);
+	}
+
+	// at least bytes of the run at the position of the cursor, false at the end of the run
+	bool load(Cursor &cursor, const Run &run, size_t bytes, size_t readBytes) {
+		size_t available = cursor.data.size() - cursor.position;
+		if (available >= bytes)
+			return true;
+		if ((available == 0) and (cursor.remaining == 0))
+			return false;
+		if (available + cursor.remaining < bytes)
+			throw std::runtime_error("OrderedRowSpill: truncated temporary file");
+		size_t n = std::min(cursor.remaining, std::max(readBytes, bytes - available));
+		cursor.data.erase(cursor.data.begin(), cursor.data.begin() + cursor.position);
+		cursor.position = 0;
+		cursor.data.resize(available + n);
+		std::FILE *file = files[run.thread];
+		std::fseek(file, cursor.offset, SEEK_SET);
+		if (std::fread(&cursor.data[available], 1, n, file) != n)
+			throw std::runtime_error("OrderedRowSpill: cannot read the temporary file");
+		cursor.offset += n;
+		cursor.remaining -= n;
+		return true;
+	}
+
+	// decode the next row of the run, false at its end
+	bool next(Cursor &cursor, const Run &run, size_t readBytes) {
+		if (not load(cursor, run, headerBytes, readBytes))
+			return false;
+		uint32_t n;
+		std::memcpy(&n, &cursor.data[cursor.position + sizeof(RowOrderKey)], sizeof(uint32_t));
+		if ((n > sizeof(T)) or not load(cursor, run, headerBytes + n, readBytes))
+			throw std::runtime_error("OrderedRowSpill: corrupt temporary file");
+		std::memcpy(&cursor.entry.key, &cursor.data[cursor.position], sizeof(RowOrderKey));
+		std::memcpy(&cursor.entry.row, &cursor.data[cursor.position + headerBytes], n);
+		cursor.position += headerBytes + n;
+		return true;
+	}
+
+public:
+	/**
+	 @param threads		number of per-thread buffers
+	 @param bufferRows	rows per buffer before they are spilled
+	 @param rowBytes	leading bytes of a row that are in use, all of T if not given
+	 */
+	OrderedRowSpill(size_t threads, size_t bufferRows,
+			const std::function<size_t(const T&)> &rowBytes = std::function<size_t(const T&)>()) :
+			threads(threads), bufferRows(std::max<size_t>(bufferRows, 1)), rowBytes(rowBytes),
+			buffers(threads), files(threads, 0) {
+	}
+
+	~OrderedRowSpill() {
+		for (size_t i = 0; i < files.size(); i++)
+			if (files[i])
+				std::fclose(files[i]);
+	}
+
+	void push(const RowOrderKey &key, const T &row) {
+		size_t i = 0;
+#ifdef _OPENMP
+		i = omp_get_thread_num();
+#endif
+		Entry entry = {key, row};
+		if (i >= buffers.size()) {
+			std::lock_guard<std::mutex> lock(overflowMutex);
+			overflow.push_back(entry);
+			return;
+		}
+		buffers[i].push_back(entry);
+		if (buffers[i].size() >= bufferRows)
+			spill(i);
+	}
+
+	/** Rows pushed so far, spilled or not */
+	size_t size() {
+		size_t n = overflow.size();
+		for (size_t i = 0; i < buffers.size(); i++)
+			n += buffers[i].size();
+		std::lock_guard<std::mutex> lock(runMutex);
+		for (size_t i = 0; i < runs.size(); i++)
+			n += runs[i].count;
+		return n;
+	}
+
+	/**
+	 Pass all rows in order to write and start over, outside of parallel sections.
+	 Every run is read in pieces of about readBytes.
+	 */
+	void merge(const std::function<void(const T&)> &write, size_t readBytes = 1 << 16) {
+		for (size_t i = 0; i < buffers.size(); i++)
+			spill(i);
+		if (not overflow.empty()) {
+			buffers.push_back(std::vector<Entry>());
+			files.push_back(0);
+			buffers.back().swap(overflow);
+			spill(buffers.size() - 1);
+		}
+
+		// runs of one thread are in the order they were pushed
+		readBytes = std::max<size_t>(readBytes, headerBytes + sizeof(T));
+		std::vector<Cursor> cursors(runs.size());
+		typedef std::pair<RowOrderKey, size_t> Head; // key and run
+		struct Later {
+			bool operator()(const Head &a, const Head &b) const {
+				if (a.first < b.first)
+					return false;
+				if (b.first < a.first)
+					return true;
+				return a.second > b.second;
+			}
+		};
+		std::priority_queue<Head, std::vector<Head>, Later> heads;
+		for (size_t r = 0; r < runs.size(); r++) {
+			cursors[r].position = 0;
+			cursors[r].offset = runs[r].offset;
+			cursors[r].remaining = runs[r].bytes;
+			if (next(cursors[r], runs[r], readBytes))
+				heads.push(Head(cursors[r].entry.key, r));
+		}
+		while (not heads.empty()) {
+			size_t r = heads.top().second;
+			heads.pop();
+			Cursor &cursor = cursors[r];
+			write(cursor.entry.row);
+			if (next(cursor, runs[r], readBytes))
+				heads.push(Head(cursor.entry.key, r));
+			else
+				std::vector<char>().swap(cursor.data);
+		}
+
+		runs.clear();
+		for (size_t i = 0; i < files.size(); i++)
+			if (files[i])
+				std::fclose(files[i]);
+		files.assign(threads, 0);
+		buffers.resize(threads);
+	}
+
+	/** Bytes of the buffers in memory */
+	size_t getMemoryUsage() const {
+		size_t bytes = overflow.capacity() * sizeof(Entry);
+		for (size_t i = 0; i < buffers.size(); i++)
+			bytes += buffers[i].capacity() * sizeof(Entry);
+		return bytes;
+	}
+};
+
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_ORDEREDROWSPILL_H
@@ -3,6 +3,7 @@
 
 #include "crpropa/Common.h"
 #include "crpropa/Referenced.h"
+#include "crpropa/Vector3.h"
 
 #include <vector>
 #include <string>
@@ -32,6 +33,15 @@ public:
 	 */
 	virtual double getPhotonDensity(double ePhoton, double z = 0.) const = 0;
 
+	/**
+	 comoving photon densities [1/m^3] of n photon energies at one redshift,
+	 as getPhotonDensity for each
+	 */
+	virtual void getPhotonDensities(size_t n, const double *ePhoton, double z,
+			double *density) const;
+	std::vector<double> getPhotonDensities(const std::vector<double> &ePhoton,
+			double z = 0.) const;
+
 	/**
 	 returns overall comoving scaling factor
 	 (cf. CRPropa3-data/calc_scaling.py)
@@ -41,6 +51,14 @@ public:
 		return 1.;
 	};
 
+	/**
+	 range of photon energies [J] with non-negligible density, used to
+	 integrate over the field (cf. InteractionRateEngine)
+	 @param z		redshift
+	 */
+	virtual double getMinimumPhotonEnergy(double z = 0.) const;
+	virtual double getMaximumPhotonEnergy(double z = 0.) const;
+
 	bool hasRedshiftDependence() const {
 		return this->isRedshiftDependent;
 	}
@@ -62,12 +80,34 @@ protected:
  The first file must be a list of photon energies [J], named fieldName_photonEnergy.txt
  The second file must be a list of comoving photon field densities [1/m^3], named fieldName_photonDensity.txt
  Optionally, a third file contains redshifts, named fieldName_redshift.txt
+
+ At load time the field is resampled onto a grid uniform in log10(energy) and
+ redshift, fine enough to hold the smallest tabulated step, with the slopes
+ along the energy precomputed. An evaluation then is an index computation and
+ a bilinear interpolation in log10(energy) and redshift, without searching.
+ The densities on the grid points are those of the linear interpolation of the
+ tabulated values, between them they are interpolated linearly in log10(energy).
  */
 class TabularPhotonField: public PhotonField {
 public:
 	TabularPhotonField(const std::string fieldName, const bool isRedshiftDependent = true);
+	/**
+	 Field from tabulated values instead of files
+	 @param photonEnergies	photon energies [J], strictly increasing
+	 @param photonDensity	comoving photon densities [1/m^3], photonDensity[iz + ie * nz]
+	 @param redshifts		redshifts starting with 0, empty if not redshift dependent
+	 */
+	TabularPhotonField(const std::string fieldName,
+			const std::vector<double> &photonEnergies,
+			const std::vector<double> &photonDensity,
+			const std::vector<double> &redshifts = std::vector<double>());
 	double getPhotonDensity(double ePhoton, double z = 0.) const;
+	void getPhotonDensities(size_t n, const double *ePhoton, double z,
+			double *density) const;
+	using PhotonField::getPhotonDensities;
 	double getRedshiftScaling(double z) const;
+	double getMinimumPhotonEnergy(double z = 0.) const;
+	double getMaximumPhotonEnergy(double z = 0.) const;
 
 protected:
 	void readPhotonEnergy(std::string filePath);
@@ -75,11 +115,29 @@ protected:
 	void readRedshift(std::string filePath);
 	void initRedshiftScaling();
 	void checkInputData() const;
+	void init();
+	void resample();
+	// index and fraction of the cell of u on a grid with n points 0, 1, ...
+	static size_t gridCell(double u, size_t n, double &fraction) {
+		if (not (u > 0))
+			u = 0;
+		size_t i = std::min(static_cast<size_t>(u), n - 2);
+		fraction = u - i;
+		return i;
+	}
 
 	std::vector<double> photonEnergies;
 	std::vector<double> photonDensity;
 	std::vector<double> redshifts;
 	std::vector<double> redshiftScalings;
+	LogAxis photonEnergyAxis; // index lookup in photonEnergies
+	LinearAxis redshiftAxis; // index lookup in redshifts
+
+	// resampled field, values and energy slopes at [iz + ie * gridRedshifts]
+	size_t gridEnergies, gridRedshifts;
+	double gridLogEnergyMin, gridLogEnergyInvStep, gridRedshiftInvStep;
+	std::vector<double> gridDensity, gridSlope;
+	std::vector<double> gridScaling; // redshift scaling at the grid redshifts
 };
 
 /**
@@ -194,6 +252,8 @@ class BlackbodyPhotonField: public PhotonField {
 public:
 	BlackbodyPhotonField(const std::string fieldName, const double blackbodyTemperature);
 	double getPhotonDensity(double ePhoton, double z = 0.) const;
+	double getMinimumPhotonEnergy(double z = 0.) const;
+	double getMaximumPhotonEnergy(double z = 0.) const;
 
 protected:
 	double blackbodyTemperature;
@@ -211,10 +271,64 @@ public:
 	CMB() : BlackbodyPhotonField("CMB", 2.73) {}
 };
 
+/**
+ @class SpatialPhotonField
+ @brief Photon field varying with position, given by the fields of grid cells.
+
+ The field is given on a regular grid of cells, each with the spectrum of a
+ photon field of its own, e.g. TabularPhotonFields filled from the cells of an
+ interstellar radiation field map such as those of GALPROP. Between the cell
+ centers the density is interpolated trilinearly, beyond the outer cell
+ centers that of the outer cells is continued. Without a position the density
+ is the mean of all cells.
+
+ EMPairProduction and EMInverseComptonScattering use the rate tables of each
+ cell field (computed by InteractionRateEngine for fields without data files)
+ and interpolate the rates by position in the same way. Cells of the same
+ field share their tables.
+ */
+class SpatialPhotonField: public PhotonField {
+	Vector3d origin; // lower corner of the grid
+	Vector3d spacing; // cell size
+	size_t nx, ny, nz;
+	std::vector<ref_ptr<PhotonField> > cells; // [ix * ny * nz + iy * nz + iz]
+
+	void checkCells() const;
+public:
+	SpatialPhotonField(const std::string fieldName, const Vector3d &origin,
+			const Vector3d &spacing, size_t nx, size_t ny, size_t nz);
+
+	void setCellField(size_t ix, size_t iy, size_t iz, ref_ptr<PhotonField> field);
+	size_t getNumberOfCells() const;
+	size_t cellIndex(size_t ix, size_t iy, size_t iz) const;
+	PhotonField *getCellField(size_t index) const;
+	Vector3d getCellCenter(size_t index) const;
+
+	/**
+	 Cells and trilinear weights for the interpolation at a position:
+	 the 8 (some possibly identical) neighbouring cell centers of the position
+	 */
+	void getCellWeights(const Vector3d &position, size_t index[8], double weight[8]) const;
+
+	/// comoving photon density [1/m^3] at a position
+	double getPhotonDensity(double ePhoton, const Vector3d &position, double z = 0.) const;
+	/// mean comoving photon density [1/m^3] of all cells
+	double getPhotonDensity(double ePhoton, double z = 0.) const;
+	double getRedshiftScaling(double z) const;
+	double getMinimumPhotonEnergy(double z = 0.) const;
+	double getMaximumPhotonEnergy(double z = 0.) const;
+};
+
 
 /**
  @class PhotonFieldSampling
  @brief Reimplementation of SOPHIA photon sampling. Naming and unit conventions are taken from SOPHIA to ease comparisions.
+
+ The constructor tabulates the cumulative distribution of the photon energy,
+ for the CMB against the nucleon energy (10^8 - 10^14 GeV) and for the IRB
+ against the redshift (0 - 5). Photons are drawn from the inverse of the
+ tabulated distributions, interpolated between the neighbouring nodes.
+ Outside of the tabulated range SOPHIA's rejection sampling is used.
  */
 class PhotonFieldSampling {
 public:
@@ -236,6 +350,26 @@ public:
 protected:
 	int bgFlag;
 
+	// tabulated photon energy distribution per node, [0]: proton, [1]: neutron
+	// CMB: nodes in log10(E_in/GeV), IRB: nodes in redshift
+	static const size_t tabPoints = 400; // photon energies per node
+	double tabNodeMin, tabNodeStep;
+	size_t tabNodes;
+	std::vector<double> tabLogEps[2]; // ln(eps/eV) of the node points
+	std::vector<double> tabCDF[2]; // normalized cdf(eps), 0 if no photons above threshold
+
+	void initTables();
+	double nodeCDF(int k, size_t node, double logEps) const;
+	double nodeInverseCDF(int k, size_t node, double u) const;
+
+	// called by: sample_eps
+	// - output: photon energy [eV] from the tables, < 0 if not tabulated
+	double sampleTable(bool onProton, double E_in, double z_in) const;
+
+	// called by: sample_eps
+	// - output: photon energy [eV] from SOPHIA's rejection sampling
+	double sampleRejection(bool onProton, double E_in, double z_in) const;
+
 	// called by: sample_eps
 	// - input: photon energy [eV], redshift
 	// - output: photon density per unit energy [#/(eVcm^3)]
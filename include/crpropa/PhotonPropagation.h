@@ -1,6 +1,9 @@
 #ifndef CRPROPA_PHOTON_PROPAGATION_H
 #define CRPROPA_PHOTON_PROPAGATION_H
 
+#include "crpropa/module/ParticleCollector.h"
+#include "crpropa/DintOperator.h"
+
 #include <string>
 #include <vector>
 
@@ -36,6 +39,50 @@ void DintPropagation(
 	double aCutcascade_Magfield = 0       //!< a-parameter, see CRPropa 2 paper
 	);
 
+/**
+ Calculate the electromagnetic cascade of particles in memory with DINT.
+ The particles are split into groups of neighbouring distances, which are
+ propagated in parallel with one DINT instance per thread.
+ Returns the summed spectrum: 170 energy bins of 0.1 in log10(E/eV) from
+ 10^7 eV, for photons, electrons and positrons in this order.
+ */
+std::vector<double> DintPropagation(
+	const std::vector<int> &ids,          //!< particle ids (22, 11, -11), other particles are ignored
+	const std::vector<double> &energies,  //!< energies [J]
+	const std::vector<double> &distances, //!< comoving distances to the observer [m]
+	const std::vector<double> &weights,   //!< weights, all 1 if empty
+	int IRFlag = 4,                       //!< EBL background 0: high, 1: low, 2: Primack, 4: Stecker'06
+	int RadioFlag = 4,                    //!< radio background 0: high, 1: medium, 2: obs, 3: none, 4: Protheroe'96
+	double magneticFieldStrength = 1E-13, //!< magnetic field strength [T], default = 1 nG
+	double aCutcascade_Magfield = 0       //!< a-parameter, see CRPropa 2 paper
+	);
+
+/**
+ Calculate the electromagnetic cascade of the photons, electrons and
+ positrons in a ParticleCollector, at their distance to the origin
+ */
+std::vector<double> DintPropagation(
+	const ParticleCollector &collector,   //!< collected particles
+	int IRFlag = 4,                       //!< EBL background 0: high, 1: low, 2: Primack, 4: Stecker'06
+	int RadioFlag = 4,                    //!< radio background 0: high, 1: medium, 2: obs, 3: none, 4: Protheroe'96
+	double magneticFieldStrength = 1E-13, //!< magnetic field strength [T], default = 1 nG
+	double aCutcascade_Magfield = 0       //!< a-parameter, see CRPropa 2 paper
+	);
+
+/**
+ Calculate the electromagnetic cascade of particles in memory with
+ precomputed DINT operators. The particles are binned in distance and energy
+ as in EMCascade, particles beyond the maximum distance of the operators are
+ ignored. Returns the summed spectrum as above.
+ */
+std::vector<double> DintPropagation(
+	const std::vector<int> &ids,          //!< particle ids (22, 11, -11), other particles are ignored
+	const std::vector<double> &energies,  //!< energies [J]
+	const std::vector<double> &distances, //!< comoving distances to the observer [m]
+	const std::vector<double> &weights,   //!< weights, all 1 if empty
+	const DintOperator &op                //!< propagation operators per distance bin
+	);
+
 /**
  Propagate photons using EleCa for energies above the crossover energy and DINT below
  */
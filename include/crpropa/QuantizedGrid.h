@@ -0,0 +1,286 @@
+#ifndef CRPROPA_QUANTIZEDGRID_H
+#define CRPROPA_QUANTIZEDGRID_H
+
+#include "crpropa/Grid.h"
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace crpropa {
+
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/** Encodings of the values of a QuantizedGrid */
+enum GridEncoding {
+	GridInt16, ///< 16 bit integers times one scale of the grid
+	GridBlockInt16, ///< 16 bit integers times one scale per block of 8^3 grid points
+	GridFloat16 ///< IEEE 754 half precision times one scale of the grid
+};
+
+/** IEEE 754 half precision to single precision */
+inline float halfToFloat(uint16_t h) {
+	uint32_t sign = uint32_t(h & 0x8000) << 16;
+	uint32_t exponent = (h >> 10) & 0x1f;
+	uint32_t mantissa = h & 0x3ff;
+	if (exponent == 0) {
+		// zero and subnormal numbers
+		float f = ldexp(float(mantissa), -24);
+		return sign ? -f : f;
+	}
+	uint32_t bits = sign | (mantissa << 13);
+	if (exponent == 31)
+		bits |= 0x7f800000; // infinity and NaN
+	else
+		bits |= (exponent + 112) << 23;
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+/** Single precision to IEEE 754 half precision, rounded to nearest even */
+uint16_t floatToHalf(float f);
+
+/** Number of components and conversion of the values of a QuantizedGrid */
+template<typename T>
+struct QuantizedValue;
+
+template<>
+struct QuantizedValue<float> {
+	static const int components = 1;
+	static float fromQuantized(const int16_t *q) {
+		return q[0];
+	}
+	static float fromHalf(const int16_t *q) {
+		return halfToFloat(q[0]);
+	}
+	static float maxAbs(const float &v) {
+		return fabs(v);
+	}
+	static void toQuantized(const float &v, float invScale, int16_t *q) {
+		q[0] = int16_t(round(v * invScale));
+	}
+	static void toHalf(const float &v, float invScale, int16_t *q) {
+		q[0] = floatToHalf(v * invScale);
+	}
+};
+
+template<>
+struct QuantizedValue<Vector3f> {
+	static const int components = 3;
+	static Vector3f fromQuantized(const int16_t *q) {
+		return Vector3f(q[0], q[1], q[2]);
+	}
+	static Vector3f fromHalf(const int16_t *q) {
+		return Vector3f(halfToFloat(q[0]), halfToFloat(q[1]), halfToFloat(q[2]));
+	}
+	static float maxAbs(const Vector3f &v) {
+		return std::max(fabs(v.x), std::max(fabs(v.y), fabs(v.z)));
+	}
+	static void toQuantized(const Vector3f &v, float invScale, int16_t *q) {
+		q[0] = int16_t(round(v.x * invScale));
+		q[1] = int16_t(round(v.y * invScale));
+		q[2] = int16_t(round(v.z * invScale));
+	}
+	static void toHalf(const Vector3f &v, float invScale, int16_t *q) {
+		q[0] = floatToHalf(v.x * invScale);
+		q[1] = floatToHalf(v.y * invScale);
+		q[2] = floatToHalf(v.z * invScale);
+	}
+};
+
+/**
+ @class QuantizedGrid
+ @brief Read-only grid of 16 bit values, decoded on the fly
+
+ Stores the values of a Grid in 16 bits, which halves the memory of a Grid1f
+ or Grid3f and the memory traffic of the interpolation. The values are
+ encoded as
+ - GridInt16: integers times the power of two scale that fits the largest
+   absolute value. Multiples of the scale, e.g. the +-1 of a striated grid,
+   are stored exactly, otherwise the error is below 2^-14 of the largest
+   absolute value.
+ - GridBlockInt16: integers times a power of two scale per block of 8^3 grid
+   points, for grids with a large dynamic range, e.g. of the field strength.
+ - GridFloat16: half-precision numbers times the power of two scale, with a
+   relative error below 2^-11 over a range of 2^30.
+
+ A saved grid can be memory-mapped (read-only, copy-on-write) instead of
+ loaded, so that all processes on a node share the pages of the file.
+ Interpolation and the closest value follow the Grid of the same geometry.
+ */
+template<typename T>
+class QuantizedGrid: public Referenced {
+	std::vector<int16_t> values;
+	std::vector<float> blockScales;
+	const int16_t *data;
+	const float *blockScaleData;
+	void *mapping;
+	size_t mappingSize;
+	GridEncoding encoding;
+	float scale;
+	size_t Nx, Ny, Nz;
+	size_t NBy, NBz; // number of blocks along y and z
+	Vector3d origin, gridOrigin, spacing;
+	bool reflective;
+
+	const int16_t *at(size_t ix, size_t iy, size_t iz) const {
+		return data + QuantizedValue<T>::components * (ix * Ny * Nz + iy * Nz + iz);
+	}
+	float blockScale(size_t ix, size_t iy, size_t iz) const {
+		return blockScaleData[((ix >> 3) * NBy + (iy >> 3)) * NBz + (iz >> 3)];
+	}
+public:
+	/** Encode the values of a grid */
+	QuantizedGrid(const Grid<T> &grid, GridEncoding encoding = GridInt16);
+	/** Memory-map a grid saved with save() */
+	QuantizedGrid(const std::string &filename);
+	~QuantizedGrid();
+
+	/** Save the grid in a binary file, which can be mapped with the constructor */
+	void save(const std::string &filename) const;
+
+	/** Grid with the decoded values */
+	ref_ptr<Grid<T> > toGrid() const;
+
+	Vector3d getOrigin() const {
+		return origin;
+	}
+	size_t getNx() const {
+		return Nx;
+	}
+	size_t getNy() const {
+		return Ny;
+	}
+	size_t getNz() const {
+		return Nz;
+	}
+	Vector3d getSpacing() const {
+		return spacing;
+	}
+	void setReflective(bool b) {
+		reflective = b;
+	}
+	bool isReflective() const {
+		return reflective;
+	}
+	GridEncoding getEncoding() const {
+		return encoding;
+	}
+	/** Scale of the encoded values, the largest of the blocks for GridBlockInt16 */
+	float getScale() const {
+		return scale;
+	}
+	/** True if the values are mapped from a file */
+	bool isMapped() const {
+		return mapping != 0;
+	}
+	/** Number of scaled blocks, 0 unless GridBlockInt16 */
+	size_t getNumberOfBlocks() const {
+		return (encoding == GridBlockInt16) ? ((Nx + 7) / 8) * NBy * NBz : 0;
+	}
+	/** Size of the encoded values in bytes, mapped or not */
+	size_t getSizeOf() const {
+		return sizeof(int16_t) * QuantizedValue<T>::components * Nx * Ny * Nz
+				+ sizeof(float) * getNumberOfBlocks();
+	}
+
+	/** Decoded value of a grid point */
+	T get(size_t ix, size_t iy, size_t iz) const {
+		switch (encoding) {
+		case GridBlockInt16:
+			return QuantizedValue<T>::fromQuantized(at(ix, iy, iz)) * blockScale(ix, iy, iz);
+		case GridFloat16:
+			return QuantizedValue<T>::fromHalf(at(ix, iy, iz)) * scale;
+		default:
+			return QuantizedValue<T>::fromQuantized(at(ix, iy, iz)) * scale;
+		}
+	}
+
+	/** Value of a grid point that is closest to a given position */
+	T closestValue(const Vector3d &position) const {
+		Vector3d r = (position - gridOrigin) / spacing;
+		int ix = round(r.x);
+		int iy = round(r.y);
+		int iz = round(r.z);
+		if (reflective) {
+			int nx = Nx, ny = Ny, nz = Nz;
+			while ((ix < 0) or (ix > nx))
+				ix = 2 * nx * (ix > nx) - ix;
+			while ((iy < 0) or (iy > ny))
+				iy = 2 * ny * (iy > ny) - iy;
+			while ((iz < 0) or (iz > nz))
+				iz = 2 * nz * (iz > nz) - iz;
+			// the reflection at the upper edge is the last grid point
+			ix = std::min(ix, nx - 1);
+			iy = std::min(iy, ny - 1);
+			iz = std::min(iz, nz - 1);
+		} else {
+			ix = ((ix % int(Nx)) + int(Nx)) % int(Nx);
+			iy = ((iy % int(Ny)) + int(Ny)) % int(Ny);
+			iz = ((iz % int(Nz)) + int(Nz)) % int(Nz);
+		}
+		return get(ix, iy, iz);
+	}
+
+	/** Trilinear interpolation as in Grid::interpolate */
+	T interpolate(const Vector3d &position) const {
+		Vector3d r = (position - gridOrigin) / spacing;
+
+		int ix, iX, iy, iY, iz, iZ;
+		if (reflective) {
+			reflectiveClamp(r.x, Nx, ix, iX);
+			reflectiveClamp(r.y, Ny, iy, iY);
+			reflectiveClamp(r.z, Nz, iz, iZ);
+		} else {
+			periodicClamp(r.x, Nx, ix, iX);
+			periodicClamp(r.y, Ny, iy, iY);
+			periodicClamp(r.z, Nz, iz, iZ);
+		}
+
+		double fx = r.x - floor(r.x);
+		double fX = 1 - fx;
+		double fy = r.y - floor(r.y);
+		double fY = 1 - fy;
+		double fz = r.z - floor(r.z);
+		double fZ = 1 - fz;
+
+		T b(0.);
+		if (encoding != GridInt16) {
+			b += get(ix, iy, iz) * (fX * fY * fZ);
+			b += get(iX, iy, iz) * (fx * fY * fZ);
+			b += get(ix, iY, iz) * (fX * fy * fZ);
+			b += get(ix, iy, iZ) * (fX * fY * fz);
+			b += get(iX, iy, iZ) * (fx * fY * fz);
+			b += get(ix, iY, iZ) * (fX * fy * fz);
+			b += get(iX, iY, iz) * (fx * fy * fZ);
+			b += get(iX, iY, iZ) * (fx * fy * fz);
+			return b;
+		}
+
+		// interpolation of the integers, scaled once
+		typedef QuantizedValue<T> Q;
+		b += Q::fromQuantized(at(ix, iy, iz)) * (fX * fY * fZ);
+		b += Q::fromQuantized(at(iX, iy, iz)) * (fx * fY * fZ);
+		b += Q::fromQuantized(at(ix, iY, iz)) * (fX * fy * fZ);
+		b += Q::fromQuantized(at(ix, iy, iZ)) * (fX * fY * fz);
+		b += Q::fromQuantized(at(iX, iy, iZ)) * (fx * fY * fz);
+		b += Q::fromQuantized(at(ix, iY, iZ)) * (fX * fy * fz);
+		b += Q::fromQuantized(at(iX, iY, iz)) * (fx * fy * fZ);
+		b += Q::fromQuantized(at(iX, iY, iZ)) * (fx * fy * fz);
+		return b * scale;
+	}
+};
+
+typedef QuantizedGrid<Vector3f> QuantizedGrid3f;
+typedef QuantizedGrid<float> QuantizedGrid1f;
+
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_QUANTIZEDGRID_H
@@ -106,6 +106,13 @@ protected:
 	uint32_t *pNext;// next value to get from state
 	int left;// number of values left before reload needed
 
+	// counter-based stream, used instead of the state if enabled
+	bool counterBased;
+	uint64_t streamKey;
+	uint64_t streamCounter;
+	uint32_t streamBlock[4];
+	int streamLeft;
+
 //Methods
 public:
 	/// initialize with a simple uint32_t
@@ -147,6 +154,19 @@ public:
 	/// Fisher distributed random number
 	double randFisher(double k);
 
+	// Bulk generation, the loops over the generator state and the transforms
+	// are free of calls and vectorized by the compiler
+	/// Fill with integers in [0,2**32-1], the same numbers as repeated randInt()
+	void fillInt(uint32_t *values, size_t n);
+	/// Fill with uniform real numbers in [min,max)
+	void fillUniform(double *values, size_t n, double min = 0, double max = 1);
+	/// Fill with normal distributed numbers, both of each Box-Muller pair are used
+	void fillNormal(double *values, size_t n, double mean = 0, double sigma = 1);
+	/// Fill with random points on the unit sphere
+	void fillUnitVectors(Vector3d *values, size_t n);
+	/// Fill with numbers of a power law dN/dE ~ E^index in [min,max], the same numbers as repeated randPowerLaw
+	void fillPowerLaw(double *values, size_t n, double index, double min, double max);
+
 	/// Draw a random bin from a (unnormalized) cumulative distribution function, without leading zero.
 	size_t randBin(const std::vector<float> &cdf);
 	size_t randBin(const std::vector<double> &cdf);
@@ -197,9 +217,28 @@ public:
 	friend std::ostream& operator<<( std::ostream& os, const Random& mtrand );
 	friend std::istream& operator>>( std::istream& is, Random& mtrand );
 
+	/// Switch to the counter-based Philox4x32-10 generator of the given
+	/// stream, starting at the given block of four numbers. The numbers only
+	/// depend on key and counter, not on the thread or the previous draws.
+	void setStream(uint64_t key, uint64_t counter = 0);
+	/// Switch back to the Mersenne Twister state
+	void clearStream();
+	bool hasStream() const;
+	uint64_t getStreamKey() const;
+	/// Next block of the stream, the rest of a partly used block is skipped
+	uint64_t getStreamCounter() const;
+	/// Derive the key of an independent stream, e.g. from a seed and an index
+	static uint64_t deriveStreamKey(uint64_t key, uint64_t index);
+
+	/// Generator of the calling thread. Threads beyond the first 256 only
+	/// support counter-based streams, see setStream, and throw otherwise.
 	static Random &instance();
 	static void seedThreads(const uint32_t oneSeed);
 	static std::vector< std::vector<uint32_t> > getSeedThreads();
+	/// Get the generator states (see save) of all threads, e.g. for checkpoints
+	static std::vector< std::vector<uint32_t> > getStateThreads();
+	/// Restore the generator states of the threads from getStateThreads
+	static void setStateThreads(const std::vector< std::vector<uint32_t> > &states);
 
 protected:
 	/// Initialize generator state with seed
@@ -211,6 +250,8 @@ protected:
 	/// Generate N new values in state
 	/// Made clearer and faster by Matthew Bellew (matthew.bellew@home.com)
 	void reload();
+	/// Next number of the counter-based stream
+	uint32_t streamInt();
 	uint32_t hiBit( const uint32_t& u ) const {return u & 0x80000000UL;}
 	uint32_t loBit( const uint32_t& u ) const {return u & 0x00000001UL;}
 	uint32_t loBits( const uint32_t& u ) const {return u & 0x7fffffffUL;}
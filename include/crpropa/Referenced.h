@@ -1,6 +1,7 @@
 #ifndef CRPROPA_REFERENCED_H
 #define CRPROPA_REFERENCED_H
 
+#include <atomic>
 #include <cstddef>
 
 #ifdef DEBUG
@@ -40,17 +41,7 @@ public:
 	}
 
 	inline size_t addReference() const {
-		int newRef;
-#if defined(OPENMP_3_1)
-		#pragma omp atomic capture
-		{newRef = _referenceCount++;}
-#elif defined(__GNUC__)
-		newRef = __sync_add_and_fetch(&_referenceCount, 1);
-#else
-		#pragma omp critical
-		{newRef = _referenceCount++;}
-#endif
-		return newRef;
+		return _referenceCount.fetch_add(1, std::memory_order_relaxed) + 1;
 	}
 
 	inline size_t removeReference() const {
@@ -60,16 +51,7 @@ public:
 					<< "WARNING: Remove reference from Object with NO references: "
 					<< typeid(*this).name() << std::endl;
 #endif
-		int newRef;
-#if defined(OPENMP_3_1)
-		#pragma omp atomic capture
-		{newRef = _referenceCount--;}
-#elif defined(__GNUC__)
-		newRef = __sync_sub_and_fetch(&_referenceCount, 1);
-#else
-		#pragma omp critical
-		{newRef = _referenceCount--;}
-#endif
+		size_t newRef = _referenceCount.fetch_sub(1, std::memory_order_acq_rel) - 1;
 
 		if (newRef == 0) {
 			delete this;
@@ -78,11 +60,31 @@ public:
 	}
 
 	int removeReferenceNoDelete() const {
-		return --_referenceCount;
+		return _referenceCount.fetch_sub(1, std::memory_order_acq_rel) - 1;
+	}
+
+	/**
+	 Non-atomic variants for objects that are confined to one thread,
+	 used by local_ref_ptr. They must not be mixed with concurrent use of
+	 addReference/removeReference on the same object.
+	 */
+	inline size_t addLocalReference() const {
+		size_t newRef = _referenceCount.load(std::memory_order_relaxed) + 1;
+		_referenceCount.store(newRef, std::memory_order_relaxed);
+		return newRef;
+	}
+
+	inline size_t removeLocalReference() const {
+		size_t newRef = _referenceCount.load(std::memory_order_relaxed) - 1;
+		_referenceCount.store(newRef, std::memory_order_relaxed);
+		if (newRef == 0) {
+			delete this;
+		}
+		return newRef;
 	}
 
 	inline size_t getReferenceCount() const {
-		return _referenceCount;
+		return _referenceCount.load(std::memory_order_relaxed);
 	}
 
 protected:
@@ -95,7 +97,7 @@ protected:
 #endif
 	}
 
-	mutable size_t _referenceCount;
+	mutable std::atomic<size_t> _referenceCount;
 };
 
 inline void intrusive_ptr_add_ref(Referenced* p) {
@@ -223,6 +225,78 @@ template<class T> inline T* get_pointer(const ref_ptr<T>& rp) {
 	return rp.get();
 }
 
+/**
+ @class local_ref_ptr
+ @brief Referenced pointer for thread-confined objects
+
+ Same as ref_ptr, but the reference count is changed without atomic
+ read-modify-write operations. Use it only for objects that are never
+ referenced from another thread at the same time, e.g. temporary
+ candidates of a single cascade.
+ */
+template<class T>
+class local_ref_ptr {
+public:
+	typedef T element_type;
+
+	local_ref_ptr() :
+			_ptr(0) {
+	}
+	local_ref_ptr(T* ptr) :
+			_ptr(ptr) {
+		if (_ptr)
+			_ptr->addLocalReference();
+	}
+	local_ref_ptr(const local_ref_ptr& rp) :
+			_ptr(rp._ptr) {
+		if (_ptr)
+			_ptr->addLocalReference();
+	}
+
+	~local_ref_ptr() {
+		if (_ptr)
+			_ptr->removeLocalReference();
+		_ptr = 0;
+	}
+
+	local_ref_ptr& operator =(const local_ref_ptr& rp) {
+		return operator =(rp._ptr);
+	}
+
+	inline local_ref_ptr& operator =(T* ptr) {
+		if (_ptr == ptr)
+			return *this;
+		T* tmp_ptr = _ptr;
+		_ptr = ptr;
+		if (_ptr)
+			_ptr->addLocalReference();
+		if (tmp_ptr)
+			tmp_ptr->removeLocalReference();
+		return *this;
+	}
+
+	operator T*() const {
+		return _ptr;
+	}
+
+	T& operator*() const {
+		return *_ptr;
+	}
+	T* operator->() const {
+		return _ptr;
+	}
+	T* get() const {
+		return _ptr;
+	}
+
+	bool valid() const {
+		return _ptr != 0;
+	}
+
+private:
+	T* _ptr;
+};
+
 template<class T, class Y> inline ref_ptr<T> static_pointer_cast(
 		const ref_ptr<Y>& rp) {
 	return static_cast<T*>(rp.get());
@@ -0,0 +1,108 @@
+#ifndef CRPROPA_RUNMETRICS_H
+#define CRPROPA_RUNMETRICS_H
+
+#include "crpropa/Referenced.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace crpropa {
+/**
+ * \addtogroup Tools
+ * @{
+ */
+
+/**
+ @class RunMetrics
+ @brief Live counters of a run, written periodically to a status file.
+
+ Every thread counts the primaries run, the steps through the module list,
+ the created secondaries, the detections of the observers and the bytes of
+ the rows passed to TextOutput, HDF5Output and NetworkOutput (before
+ compression) in counters of its own, without locks. While a ModuleList runs
+ with setMetrics, a reporter thread sums them every interval and replaces the
+ status file with the totals, the throughput of the last interval, the
+ estimated time to completion and the counters of every thread. Threads
+ without steps in the last interval are reported as stalled.
+
+ The status is written as JSON or in the Prometheus text format, e.g. for the
+ textfile collector of the node exporter.
+ */
+class RunMetrics: public Referenced {
+public:
+	enum Format {
+		JSON, Prometheus
+	};
+
+	/** Counters summed over the threads */
+	struct Counts {
+		uint64_t primaries, steps, secondaries, detections, outputBytes;
+	};
+
+	/**
+	 @param filename	status file, replaced by a rename at every interval
+	 @param interval	seconds between two updates of the file
+	 @param format		JSON or Prometheus text format
+	 */
+	RunMetrics(const std::string &filename, double interval = 10, Format format = JSON);
+	~RunMetrics();
+
+	/** Reset the counters and start the reporter thread for a run of the given number of primaries */
+	void start(size_t primaries);
+	/** Stop the reporter thread and write the final status */
+	void stop();
+	bool isRunning() const;
+
+	/** Counters since the start of the run */
+	Counts getCounts() const;
+	/** Status in the format of the file */
+	std::string getStatus() const;
+	/** Write the status file */
+	void write() const;
+
+	const std::string &getFilename() const;
+	double getInterval() const;
+	Format getFormat() const;
+
+	/** Counters of the process since its start, summed over all threads */
+	static Counts getTotals();
+
+	/** Counting by the calling thread */
+	static void countPrimaries(uint64_t n = 1);
+	static void countSteps(uint64_t n = 1);
+	static void countSecondary();
+	static void countDetection();
+	static void countOutputBytes(uint64_t bytes);
+
+private:
+	std::string filename;
+	double interval;
+	Format format;
+	size_t expected;
+	bool running;
+
+	// counters of the threads at the start of the run and the last update
+	std::vector<Counts> startCounts;
+	mutable std::vector<Counts> lastCounts;
+	double startTime;
+	mutable double lastTime;
+	mutable double rate; // primaries per second in the last interval
+	mutable std::vector<bool> stalled;
+
+	std::thread reporter;
+	mutable std::mutex mutex;
+	std::condition_variable wakeup;
+	bool stopping;
+
+	void report();
+	std::string status(bool update) const;
+};
+/** @} */
+
+} // namespace crpropa
+
+#endif // CRPROPA_RUNMETRICS_H
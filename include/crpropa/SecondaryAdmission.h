@@ -0,0 +1,66 @@
+#ifndef CRPROPA_SECONDARYADMISSION_H
+#define CRPROPA_SECONDARYADMISSION_H
+
+#include "crpropa/Module.h"
+
+#include <map>
+#include <set>
+
+namespace crpropa {
+
+/**
+ @class SecondaryAdmission
+ @brief Decides at creation time which secondaries are propagated.
+
+ While the modules of a ModuleList with an admission policy run,
+ Candidate::addSecondary(id, energy, ...) consults the policy. Rejected
+ secondaries are not allocated: they are discarded or passed to the
+ rejection output as a candidate that is reused by the thread. The random
+ streams of the admitted secondaries are not changed by the rejections.
+ Derive from this class and override admit for other criteria.
+ */
+class SecondaryAdmission: public Referenced {
+	std::map<int, double> minimumEnergies;
+	double minimumEnergy;
+	std::set<int> allowed, denied;
+	ref_ptr<Module> rejectedOutput;
+	Candidate *rejected(Candidate *parent, int id, double energy, double weight) const;
+public:
+	SecondaryAdmission();
+	virtual ~SecondaryAdmission();
+
+	/** Reject secondaries of the particle id below the energy [J] */
+	void setMinimumEnergy(int id, double energy);
+	/** Reject secondaries of the other particle ids below the energy [J], default 0 */
+	void setMinimumEnergy(double energy);
+	/** Admit only allowed particle ids, once any are given */
+	void allow(int id);
+	/** Reject all secondaries of the particle id */
+	void deny(int id);
+	/**
+	 Module processing the rejected secondaries, none by default. It must not
+	 keep a reference to the candidate, e.g. TextOutput but not ParticleCollector.
+	 */
+	void setRejectedOutput(Module *output);
+
+	/** True if the secondary is to be created */
+	virtual bool admit(int id, double energy, double weight) const;
+	/** Pass a rejected secondary of the parent to the rejection output, as by Candidate::addSecondary */
+	void reject(Candidate *parent, int id, double energy, double weight) const;
+	void reject(Candidate *parent, int id, double energy, const Vector3d &position, double weight) const;
+
+	/** Policy of the ModuleList running in this thread, 0 if none */
+	static const SecondaryAdmission *current();
+
+	/** Makes an admission policy the current one of this thread while in scope, 0 keeps the current */
+	class Scope {
+		const SecondaryAdmission *previous;
+	public:
+		Scope(const SecondaryAdmission *admission);
+		~Scope();
+	};
+};
+
+} // namespace crpropa
+
+#endif // CRPROPA_SECONDARYADMISSION_H
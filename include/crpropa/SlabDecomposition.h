@@ -0,0 +1,78 @@
+#ifndef CRPROPA_SLABDECOMPOSITION_H
+#define CRPROPA_SLABDECOMPOSITION_H
+
+#include "crpropa/Referenced.h"
+#include "crpropa/Vector3.h"
+
+namespace crpropa {
+
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ @class SlabDecomposition
+ @brief Decomposition of a periodic grid into slabs along x, one per rank
+
+ The Nx cells of the grid along x are split into nRanks contiguous slabs
+ [getLower(r), getUpper(r)) of nearly equal size. The owner of a position
+ is the rank of the slab that contains its cell, positions outside of the
+ grid are periodically continued, so every position has exactly one owner.
+ Used by DistributedMagneticFieldGrid to keep only one slab per rank and by
+ ModuleList::runDomainDecomposed to migrate the candidates.
+ */
+class SlabDecomposition: public Referenced {
+	double originX, spacingX;
+	size_t Nx;
+	int nRanks;
+public:
+	/**
+	 @param originX		lower edge of the grid along x
+	 @param spacingX	spacing of the grid along x
+	 @param Nx			number of cells along x
+	 @param nRanks		number of slabs, at most Nx
+	 */
+	SlabDecomposition(double originX, double spacingX, size_t Nx, int nRanks);
+
+	double getOriginX() const {
+		return originX;
+	}
+	double getSpacingX() const {
+		return spacingX;
+	}
+	size_t getNx() const {
+		return Nx;
+	}
+	int getNumberOfRanks() const {
+		return nRanks;
+	}
+
+	/** First cell of the slab of a rank */
+	size_t getLower(int rank) const {
+		return size_t(rank) * Nx / nRanks;
+	}
+	/** Cell after the last cell of the slab of a rank */
+	size_t getUpper(int rank) const {
+		return size_t(rank + 1) * Nx / nRanks;
+	}
+
+	/** Cell along x of a position, periodically wrapped into [0, Nx) */
+	size_t getCell(double x) const;
+
+	/** Rank of the slab that contains a cell along x */
+	int getOwnerOfCell(size_t ix) const {
+		return int(((ix + 1) * nRanks - 1) / Nx);
+	}
+
+	/** Rank of the slab that contains a position */
+	int getOwner(const Vector3d &position) const {
+		return getOwnerOfCell(getCell(position.x));
+	}
+};
+
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_SLABDECOMPOSITION_H
@@ -0,0 +1,58 @@
+#ifndef CRPROPA_SOBOLSEQUENCE_H
+#define CRPROPA_SOBOLSEQUENCE_H
+
+#include "crpropa/Referenced.h"
+
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+namespace crpropa {
+
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ @class SobolSequence
+ @brief Scrambled Sobol sequence of quasi-random points in the unit cube
+
+ The points of the Sobol sequence, with the direction numbers of Joe and Kuo
+ (2008), fill the unit cube more evenly than random points: the integral of a
+ smooth function converges almost as 1/N instead of 1/sqrt(N). The digits
+ are scrambled by a hash-based nested uniform scrambling (Burley 2020) with a
+ seed per dimension, which keeps this equidistribution, makes the points
+ unbiased and, with different seeds, gives independent replicas to estimate
+ the error. Each point is computed from its index independently of the other
+ points, up to 2^32 points.
+ */
+class SobolSequence: public Referenced {
+	size_t dimensions;
+	std::vector<uint32_t> directions; // [dimension * 32 + bit]
+	std::vector<uint32_t> seeds; // scrambling per dimension
+	bool scrambled;
+
+public:
+	/** Dimensions with direction numbers */
+	static const size_t maxDimensions = 21;
+
+	/**
+	 @param dimensions	number of dimensions, at most maxDimensions
+	 @param seed		seed of the scrambling
+	 @param scrambled	scramble the digits, else the plain Sobol points
+	 */
+	SobolSequence(size_t dimensions, uint64_t seed = 0, bool scrambled = true);
+
+	/** The point of the index, u[0 .. dimensions) in (0, 1) */
+	void getPoint(uint64_t index, double *u) const;
+	std::vector<double> getPoint(uint64_t index) const;
+	size_t getDimensions() const;
+	bool isScrambled() const;
+};
+
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_SOBOLSEQUENCE_H
@@ -1,10 +1,13 @@
 #ifndef CRPROPA_SOURCE_H
 #define CRPROPA_SOURCE_H
 
+#include "crpropa/AliasTable.h"
 #include "crpropa/Candidate.h"
 #include "crpropa/Grid.h"
 #include "crpropa/EmissionMap.h"
+#include "crpropa/SobolSequence.h"
 
+#include <atomic>
 
 #include <vector>
 
@@ -23,6 +26,22 @@ protected:
 public:
 	virtual void prepareParticle(ParticleState& particle) const {};
 	virtual void prepareCandidate(Candidate& candidate) const;
+	/**
+	 Prepare a block of candidates, by default with prepareCandidate for each.
+	 Features that only draw random numbers override this with bulk draws.
+	 */
+	virtual void prepareCandidates(Candidate **candidates, size_t count) const;
+	/**
+	 Number of uniform numbers the feature takes from the quasi-random points
+	 of a Source, see Source::setQuasiRandom; 0 (the default) if it draws
+	 pseudo-random numbers.
+	 */
+	virtual size_t getQuasiRandomDimensions() const;
+	/**
+	 Prepare the candidate with the uniform numbers u[0 .. getQuasiRandomDimensions())
+	 in place of its random numbers, by default with prepareCandidate.
+	 */
+	virtual void prepareQuasiRandom(Candidate &candidate, const double *u) const;
 	std::string getDescription() const;
 };
 
@@ -34,6 +53,11 @@ public:
 class SourceInterface : public Referenced {
 public:
 	virtual ref_ptr<Candidate> getCandidate() const = 0;
+	/**
+	 Append count new candidates to out, by default by repeated getCandidate.
+	 The random numbers may be drawn in a different order than by getCandidate.
+	 */
+	virtual void getCandidates(size_t count, std::vector<ref_ptr<Candidate> > &out) const;
 	virtual std::string getDescription() const = 0;
 };
 
@@ -43,14 +67,47 @@ public:
 
  This class is a container for source features.
  The source prepares a new candidate by passing it to all its source features
- to be modified accordingly.
+ to be modified accordingly. getCandidates passes whole blocks of candidates
+ to the features, one feature after the other.
+
+ With setQuasiRandom, the features that support it (energy spectrum, particle
+ types, positions, isotropic emission) take their numbers from the points of
+ a scrambled Sobol sequence instead: each feature is allocated its dimensions
+ in the order of adding, and the n-th candidate of the source takes the n-th
+ point. Smooth observables of the primaries, e.g. spectra or low multipoles,
+ then converge almost as 1/N instead of 1/sqrt(N). The propagation stays
+ pseudo-random. With several threads, the candidates take the points in the
+ order they are requested, so the set of points and the result of a run are
+ the same. At most SobolSequence::maxDimensions dimensions are available.
  */
 class Source: public SourceInterface {
 	std::vector<ref_ptr<SourceFeature> > features;
+	ref_ptr<SobolSequence> sequence;
+	std::vector<size_t> offsets; // first dimension of each feature
+	uint64_t seed;
+	mutable std::atomic<uint64_t> nextPoint;
+
+	void allocateDimensions();
 public:
+	Source();
 	void add(SourceFeature* feature);
 	ref_ptr<Candidate> getCandidate() const;
+	void getCandidates(size_t count, std::vector<ref_ptr<Candidate> > &out) const;
 	std::string getDescription() const;
+	const std::vector<ref_ptr<SourceFeature> > &getFeatures() const;
+
+	/**
+	 Prepare the candidates from the points of a scrambled Sobol sequence
+	 @param quasiRandom	use the sequence, else pseudo-random numbers
+	 @param seed		seed of the scrambling
+	 @param firstPoint	index of the point of the next candidate
+	 */
+	void setQuasiRandom(bool quasiRandom, uint64_t seed = 0, uint64_t firstPoint = 0);
+	bool isQuasiRandom() const;
+	/** Dimensions allocated to the features */
+	size_t getQuasiRandomDimensions() const;
+	/** Index of the point of the next candidate */
+	uint64_t getNextPoint() const;
 };
 
 /**
@@ -66,6 +123,7 @@ class SourceList: public SourceInterface {
 public:
 	void add(Source* source, double weight = 1);
 	ref_ptr<Candidate> getCandidate() const;
+	void getCandidates(size_t count, std::vector<ref_ptr<Candidate> > &out) const;
 	std::string getDescription() const;
 };
 
@@ -82,6 +140,7 @@ public:
 	SourceParticleType(int id);
 	void prepareParticle(ParticleState &particle) const;
 	void setDescription();
+	int getId() const;
 };
 
 /**
@@ -95,7 +154,12 @@ public:
 	SourceMultipleParticleTypes();
 	void add(int id, double weight = 1);
 	void prepareParticle(ParticleState &particle) const;
+	size_t getQuasiRandomDimensions() const;
+	void prepareQuasiRandom(Candidate &candidate, const double *u) const;
 	void setDescription();
+	const std::vector<int> &getParticleTypes() const;
+	/** Fractions of the drawn particles of the particle types */
+	std::vector<double> getFractions() const;
 };
 
 /**
@@ -121,7 +185,13 @@ class SourcePowerLawSpectrum: public SourceFeature {
 public:
 	SourcePowerLawSpectrum(double Emin, double Emax, double index);
 	void prepareParticle(ParticleState &particle) const;
+	void prepareCandidates(Candidate **candidates, size_t count) const;
+	size_t getQuasiRandomDimensions() const;
+	void prepareQuasiRandom(Candidate &candidate, const double *u) const;
 	void setDescription();
+	double getMinEnergy() const;
+	double getMaxEnergy() const;
+	double getIndex() const;
 };
 
 /**
@@ -142,6 +212,66 @@ public:
 	void add(int A, int Z, double abundance);
 	void prepareParticle(ParticleState &particle) const;
 	void setDescription();
+	double getMinEnergy() const;
+	double getMaxRigidity() const;
+	double getIndex() const;
+	const std::vector<int> &getNuclei() const;
+	/** Fractions of the drawn particles of the nuclei */
+	std::vector<double> getFractions() const;
+};
+
+/**
+ @class SourceRigidityComposition
+ @brief Multiple nuclei with a common rigidity spectrum, drawn from a joint table
+
+ All nuclei share the spectrum dN/dR in rigidity R = E / Z between Rmin and
+ Rmax, with R in units of energy as for SourceComposition, either a power law R^index with an optional exponential cutoff
+ exp(-R / Rcut) or a tabulated spectrum. The abundance of a nucleus is its
+ fraction of the particles in the full rigidity range. An optional minimum
+ energy removes the particles below it, which changes the composition.
+
+ The spectrum is a power law within each of the logarithmic rigidity bins.
+ A single alias table over all (nucleus, bin) pairs draws the nucleus and the
+ bin at once, the energy within the bin is drawn by inversion: a draw costs
+ the same for any number of nuclei and bins. The table is rebuilt by add and
+ setMinEnergy.
+ */
+class SourceRigidityComposition: public SourceFeature {
+	std::vector<double> rigidity; // bin edges
+	std::vector<double> spectrum; // dN/dR at the bin edges
+	std::vector<double> slope; // power law index within a bin
+	double Emin;
+	std::vector<int> nuclei;
+	std::vector<double> abundances;
+	AliasTable table;
+
+	void setSpectrum(const std::vector<double> &rigidities, const std::vector<double> &values);
+	void update();
+	// lower and upper rigidity of bin j for charge number Z
+	bool binRange(size_t j, int Z, double &lower, double &upper) const;
+public:
+	/**
+	 @param Rmin	minimum rigidity
+	 @param Rmax	maximum rigidity
+	 @param index	spectral index, dN/dR ~ R^index
+	 @param Rcut	rigidity of the exponential cutoff, 0 for none
+	 @param bins	number of logarithmic rigidity bins
+	 */
+	SourceRigidityComposition(double Rmin, double Rmax, double index, double Rcut = 0,
+			size_t bins = 1024);
+	/**
+	 Tabulated spectrum, interpolated as a power law between the points
+	 @param rigidities	increasing rigidities
+	 @param values		positive dN/dR at the rigidities
+	 */
+	SourceRigidityComposition(const std::vector<double> &rigidities,
+			const std::vector<double> &values);
+	void add(int id, double abundance);
+	void add(int A, int Z, double abundance);
+	/// Particles with lower energies are not emitted, 0 by default
+	void setMinEnergy(double Emin);
+	void prepareParticle(ParticleState &particle) const;
+	void setDescription();
 };
 
 /**
@@ -181,6 +311,9 @@ class SourceUniformSphere: public SourceFeature {
 public:
 	SourceUniformSphere(Vector3d center, double radius);
 	void prepareParticle(ParticleState &particle) const;
+	void prepareCandidates(Candidate **candidates, size_t count) const;
+	size_t getQuasiRandomDimensions() const;
+	void prepareQuasiRandom(Candidate &candidate, const double *u) const;
 	void setDescription();
 };
 
@@ -209,6 +342,9 @@ class SourceUniformShell: public SourceFeature {
 public:
 	SourceUniformShell(Vector3d center, double radius);
 	void prepareParticle(ParticleState &particle) const;
+	void prepareCandidates(Candidate **candidates, size_t count) const;
+	size_t getQuasiRandomDimensions() const;
+	void prepareQuasiRandom(Candidate &candidate, const double *u) const;
 	void setDescription();
 };
 
@@ -226,6 +362,9 @@ public:
 	 */
 	SourceUniformBox(Vector3d origin, Vector3d size);
 	void prepareParticle(ParticleState &particle) const;
+	void prepareCandidates(Candidate **candidates, size_t count) const;
+	size_t getQuasiRandomDimensions() const;
+	void prepareQuasiRandom(Candidate &candidate, const double *u) const;
 	void setDescription();
 };
 
@@ -256,6 +395,8 @@ public:
 The origin of the distribution is the Galactic center. The default maximum radius is set 
 to R_max=20 kpc and the default maximum height is Z_max = 5 kpc.
 See G. Case and D. Bhattacharya (1996) for the details of the distribution.
+The radius is drawn from a table of the inverse cumulative distribution of f_r,
+the height from the inverse of the exponential distribution.
 */
 
 class SourceSNRDistribution: public SourceFeature {
@@ -267,6 +408,7 @@ class SourceSNRDistribution: public SourceFeature {
 	double R_max; // maximum radial distance - default 20 kpc 
 		      // (due to the extension of the JF12 field)
 	double Z_max; // maximum distance from galactic plane - default 5 kpc
+	std::vector<double> rTable; // inverse cumulative distribution of f_r
 
 public:
 	SourceSNRDistribution();	
@@ -293,6 +435,7 @@ The z-distribution is a simple exponentially decaying distribution.
 The pulsar distribution is explained in detail in C.-A. Faucher-Giguere
 and V. M. Kaspi, ApJ 643 (May, 2006) 332. The radial distribution is 
 parametrized as in Blasi and Amato, JCAP 1 (Jan., 2012) 10.
+As for SourceSNRDistribution the radius and height are drawn by inversion.
 */
 
 class SourcePulsarDistribution: public SourceFeature {
@@ -305,6 +448,7 @@ class SourcePulsarDistribution: public SourceFeature {
 	double Z_max; // maximum distance from galactic plane - default 5 kpc
 	double r_blur; // relative smearing factor for the radius
 	double theta_blur; // smearing factor for the angle. Unit = [1/length]
+	std::vector<double> rTable; // inverse cumulative distribution of f_r
 
 
 	
@@ -354,15 +498,80 @@ public:
 	 */
 	SourceUniform1D(double minD, double maxD, bool withCosmology=true);
 	void prepareParticle(ParticleState& particle) const;
+	size_t getQuasiRandomDimensions() const;
+	void prepareQuasiRandom(Candidate &candidate, const double *u) const;
+	void setDescription();
+	/** Minimum comoving distance */
+	double getMinDistance() const;
+	/** Maximum comoving distance */
+	double getMaxDistance() const;
+	bool isWithCosmology() const;
+};
+
+/**
+ @class SourceEvolution1D
+ @brief 1D positions and redshifts of an evolving source population, drawn by inverse transform
+
+ The comoving distance D in [minD, maxD] is drawn with the density per D of
+ - the distribution: uniform in the comoving distance, in the light travel
+   distance (factor 1 / (1 + z)) or in the redshift (factor dz/dD),
+ - times the source evolution (1 + z)^m,
+ - times, optionally, the comoving volume factor D^2 of sources in 3D.
+ The inverse of the cumulative distribution is tabulated at construction on
+ an equidistant grid of the probability, together with the redshifts, for
+ the cosmology at construction. Drawing the distance and the redshift is
+ then one lookup and one linear interpolation per candidate, which replaces
+ SourceUniform1D with SourceRedshift1D and a weighting or rejection for the
+ evolution.
+ The position is set to (D, 0, 0).
+ */
+class SourceEvolution1D: public SourceFeature {
+public:
+	enum Distribution {
+		UniformComoving, UniformLightTravel, UniformRedshift
+	};
+
+private:
+	double m, minD, maxD;
+	Distribution distribution;
+	bool comovingVolume;
+	std::vector<double> distances, redshifts; // at equidistant probabilities
+
+public:
+	/**
+	 @param m				index of the source evolution (1 + z)^m
+	 @param minD			minimum comoving distance
+	 @param maxD			maximum comoving distance
+	 @param distribution	distribution of the distances without evolution
+	 @param comovingVolume	include the comoving volume factor D^2
+	 @param bins			number of intervals of the tabulated inverse distribution
+	 */
+	SourceEvolution1D(double m, double minD, double maxD,
+			Distribution distribution = UniformLightTravel, bool comovingVolume = false,
+			size_t bins = 4096);
+	void prepareCandidate(Candidate &candidate) const;
+	size_t getQuasiRandomDimensions() const;
+	void prepareQuasiRandom(Candidate &candidate, const double *u) const;
+	/** Density per comoving distance, not normalized */
+	double getDensity(double distance) const;
+	double getIndex() const;
+	double getMinDistance() const;
+	double getMaxDistance() const;
+	Distribution getDistribution() const;
+	bool hasComovingVolume() const;
 	void setDescription();
 };
 
 /**
  @class SourceDensityGrid
  @brief Random source positions from a density grid
+
+ The cells are drawn from an alias table of the densities in double
+ precision, in O(1) per particle. The density grid is not modified.
  */
 class SourceDensityGrid: public SourceFeature {
 	ref_ptr<Grid1f> grid;
+	AliasTable table;
 public:
 	SourceDensityGrid(ref_ptr<Grid1f> densityGrid);
 	void prepareParticle(ParticleState &particle) const;
@@ -372,9 +581,12 @@ public:
 /**
  @class SourceDensityGrid1D
  @brief Random source positions from a 1D density grid
+
+ As SourceDensityGrid, the density grid is not modified.
  */
 class SourceDensityGrid1D: public SourceFeature {
 	ref_ptr<Grid1f> grid;
+	AliasTable table;
 public:
 	SourceDensityGrid1D(ref_ptr<Grid1f> densityGrid);
 	void prepareParticle(ParticleState &particle) const;
@@ -389,6 +601,9 @@ class SourceIsotropicEmission: public SourceFeature {
 public:
 	SourceIsotropicEmission();
 	void prepareParticle(ParticleState &particle) const;
+	void prepareCandidates(Candidate **candidates, size_t count) const;
+	size_t getQuasiRandomDimensions() const;
+	void prepareQuasiRandom(Candidate &candidate, const double *u) const;
 	void setDescription();
 };
 
@@ -451,6 +666,68 @@ public:
 	void setDescription();
 };
 
+/**
+ @class SourceBiasedEmission
+ @brief Emission biased towards an observer, weighted to represent isotropic emission
+
+ The direction is drawn from a von Mises-Fisher distribution with concentration
+ kappa or uniformly inside a cone with the given half-opening angle around the
+ direction from the source position to the observer. The weight of the candidate
+ is multiplied by the ratio of the isotropic to the biased probability density,
+ and through Candidate::addSecondary carried to all secondaries. Weighted
+ observed quantities then estimate those of SourceIsotropicEmission with fewer
+ primaries when the deflections are small.
+ The Fisher distribution covers all directions. The cone does not, the estimate
+ is only unbiased if no particles emitted outside the cone reach the observer.
+ Add this feature after the position features.
+ */
+class SourceBiasedEmission: public SourceFeature {
+public:
+	enum Shape {
+		Fisher, ///< von Mises-Fisher distribution, parameter kappa
+		Cone ///< uniform inside a cone, parameter half-opening angle [rad]
+	};
+private:
+	Vector3d observer;
+	double parameter;
+	Shape shape;
+public:
+	/**
+	 @param observer	position of the observer
+	 @param parameter	concentration kappa or half-opening angle of the cone
+	 @param shape		distribution of the directions around the axis to the observer
+	 */
+	SourceBiasedEmission(Vector3d observer, double parameter, Shape shape = Fisher);
+	void prepareCandidate(Candidate &candidate) const;
+	/// Ratio of the isotropic to the biased density for a direction at angle cos(theta) to the axis
+	double getWeight(double cosTheta) const;
+	void setDescription();
+};
+
+/**
+ @class SourceTargetedEmission
+ @brief Emission drawn from an EmissionMap, weighted to represent isotropic emission
+
+ The direction is drawn from the map of the particle type and energy of the
+ source, which holds the directions that reach the observer, e.g. filled by
+ TargetedEmission. The weight of the candidate is multiplied by the ratio of
+ the isotropic to the drawn density, so that weighted observed quantities
+ estimate those of SourceIsotropicEmission. The estimate is unbiased if the
+ map is non-zero in all directions that reach the observer. Candidates
+ without a map for their type and energy are made inactive.
+ Add this feature after the particle type and energy features.
+ */
+class SourceTargetedEmission: public SourceFeature {
+	ref_ptr<EmissionMap> emissionMap;
+public:
+	SourceTargetedEmission(EmissionMap *emissionMap);
+	void prepareCandidate(Candidate &candidate) const;
+	/// Ratio of the isotropic to the drawn density in a bin of an equal-area map, 0 for empty bins
+	static double getWeight(const CylindricalProjectionMap &map, size_t bin);
+	void setEmissionMap(EmissionMap *emissionMap);
+	void setDescription();
+};
+
 /**
  @class SourceRedshift
  @brief Discrete redshift (time of emission)
@@ -484,6 +761,9 @@ class SourceRedshiftEvolution: public SourceFeature {
 public:
 	SourceRedshiftEvolution(double m, double zmin, double zmax);
 	void prepareCandidate(Candidate &candidate) const;
+	double getIndex() const;
+	double getMinRedshift() const;
+	double getMaxRedshift() const;
 };
 
 /**
@@ -0,0 +1,75 @@
+#ifndef CRPROPA_SOURCEARRAY_H
+#define CRPROPA_SOURCEARRAY_H
+
+#include "crpropa/Source.h"
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+namespace crpropa {
+/** @addtogroup SourceFeatures
+ *  @{
+ */
+
+/**
+ @class SourceArray
+ @brief Source of given candidates, stored column-wise in external arrays
+
+ Replays candidates, e.g. of measured or externally generated events. The
+ columns are not copied and have to outlive the source: the ids, energies,
+ positions [3 per candidate] and optionally the directions [3 per candidate],
+ redshifts and weights. Without directions the candidates move in -x, without
+ redshifts and weights these are 0 and 1. In Python the source is constructed
+ from NumPy arrays, which are used in place if they are contiguous and of type
+ int32 and float64, and kept alive by the source.
+
+ Every row is handed out once, by getCandidate and getCandidates from any
+ number of threads, so that ModuleList::run(source, size()) runs all rows.
+ With counter based random streams the rows are not bound to the index of
+ the primary.
+ */
+class SourceArray: public SourceInterface {
+	size_t n;
+	const int32_t *id;
+	const double *energy, *position, *direction, *redshift, *weight;
+	mutable std::atomic<size_t> next;
+	ref_ptr<Referenced> owner;
+
+	SourceArray(const SourceArray &);
+	SourceArray &operator=(const SourceArray &);
+public:
+	/**
+	 @param count		number of rows
+	 @param id			particle ids
+	 @param energy		energies in Joule
+	 @param position	positions in meter, 3 per row
+	 @param direction	directions, 3 per row, or NULL
+	 @param redshift	redshifts or NULL
+	 @param weight		weights or NULL
+	 */
+	SourceArray(size_t count, const int32_t *id, const double *energy,
+			const double *position, const double *direction = NULL,
+			const double *redshift = NULL, const double *weight = NULL);
+
+	size_t size() const;
+	/// Number of rows not handed out yet
+	size_t getRemaining() const;
+	/// Hand out all rows again
+	void rewind();
+	/// Object owning the columns, kept alive as long as the source
+	void setOwner(Referenced *owner);
+
+	/// Candidate of row i, independent of the rows handed out
+	ref_ptr<Candidate> getCandidate(size_t i) const;
+	/// Candidate of the next row, throws when all rows are handed out
+	ref_ptr<Candidate> getCandidate() const;
+	/// Candidates of the next count rows, taken at once
+	void getCandidates(size_t count, std::vector<ref_ptr<Candidate> > &out) const;
+	std::string getDescription() const;
+};
+
+/** @}*/
+} // namespace crpropa
+
+#endif // CRPROPA_SOURCEARRAY_H
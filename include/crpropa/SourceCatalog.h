@@ -0,0 +1,99 @@
+#ifndef CRPROPA_SOURCECATALOG_H
+#define CRPROPA_SOURCECATALOG_H
+
+#include "crpropa/AliasTable.h"
+#include "crpropa/Source.h"
+
+#include <string>
+#include <vector>
+
+namespace crpropa {
+/** @addtogroup SourceFeatures
+ *  @{
+ */
+
+/**
+ @class SourceCatalog
+ @brief Source positions, redshifts and spectra from a catalog of many sources
+
+ The catalog is stored column-wise: the positions and optionally a weight
+ (luminosity), a redshift and a power law spectrum dN/dE ~ E^index up to a
+ maximum energy of every source. A source is drawn with an alias table of the
+ weights in O(1), which with the mapped file costs 12 bytes per source.
+
+ The binary format, written by save, is mapped into memory. It consists of a
+ header of 64 bytes with the magic "CRPCAT01", the number of sources and the
+ columns, followed by the x, y and z positions as doubles and the weights,
+ redshifts, indices and maximum energies as floats, each for all sources.
+ With HDF5 the catalog can also be read from the datasets "x", "y", "z",
+ "weight", "redshift", "index" and "Emax" of a file.
+
+ The spectra of the sources start at a common minimum energy. Without the
+ spectrum columns the energy of the particle is not modified, without the
+ redshift column the redshift of the candidate is not modified.
+ */
+class SourceCatalog: public SourceFeature {
+	size_t n;
+	const double *x, *y, *z;
+	const float *weight, *redshift, *index, *eMax;
+	double lengthUnit, energyUnit, minEnergy;
+	AliasTable table;
+
+	void *mapping;
+	size_t mappingSize;
+	std::vector<double> positionData;
+	std::vector<float> columnData;
+
+	void map(const std::string &filename);
+	void loadHDF5(const std::string &filename);
+	void init();
+
+	SourceCatalog(const SourceCatalog &);
+	SourceCatalog &operator=(const SourceCatalog &);
+public:
+	/// columns of the binary format
+	enum Column {
+		Weight = 1,
+		Redshift = 2,
+		Spectrum = 4 ///< the index and the maximum energy
+	};
+
+	/**
+	 @param filename	binary catalog file or, with HDF5, an HDF5 file
+	 @param lengthUnit	unit of the positions in the file
+	 @param energyUnit	unit of the maximum energies in the file
+	 */
+	SourceCatalog(const std::string &filename, double lengthUnit = 1, double energyUnit = 1);
+	~SourceCatalog();
+
+	/**
+	 Write a binary catalog, the optional columns are left out if empty.
+	 The values are written in the units of the file.
+	 */
+	static void save(const std::string &filename, const std::vector<Vector3d> &positions,
+			const std::vector<double> &weights = std::vector<double>(),
+			const std::vector<double> &redshifts = std::vector<double>(),
+			const std::vector<double> &indices = std::vector<double>(),
+			const std::vector<double> &maxEnergies = std::vector<double>());
+
+	/// Lower end of the spectra of all sources, 1 EeV by default
+	void setMinEnergy(double energy);
+	double getMinEnergy() const;
+
+	size_t size() const;
+	Vector3d getPosition(size_t i) const;
+	double getWeight(size_t i) const;
+	bool hasRedshifts() const;
+	bool hasSpectra() const;
+
+	/// Draw a source, set its position and energy
+	void prepareParticle(ParticleState &particle) const;
+	/// Draw a source, set its position, energy and redshift
+	void prepareCandidate(Candidate &candidate) const;
+	void setDescription();
+};
+
+/** @}*/
+} // namespace crpropa
+
+#endif // CRPROPA_SOURCECATALOG_H
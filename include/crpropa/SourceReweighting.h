@@ -0,0 +1,145 @@
+#ifndef CRPROPA_SOURCEREWEIGHTING_H
+#define CRPROPA_SOURCEREWEIGHTING_H
+
+#include "crpropa/Referenced.h"
+#include "crpropa/Source.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace crpropa {
+
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ @class SourceModel
+ @brief Density of the source states of a source model, in particle type, energy and distance
+
+ The density is the product of three parts, each of which is set or not:
+ - the composition, the fractions of the particle types,
+ - the spectrum dN/dE ~ E^index between Emin and Emax, or Z * Rmax, with
+   an optional cutoff exp(1 - E / (Z * Rcut)) above the rigidity Rcut,
+ - the distribution of the comoving source distance D, uniform in the
+   comoving or light travel distance or in the redshift within a range,
+   times the source evolution (1 + z)^m.
+ Parts that are not set do not enter the density. All parts are normalized
+ over their range. The redshift of a source is that of its distance from
+ the origin, as for SourceRedshift1D.
+ */
+class SourceModel: public Referenced {
+public:
+	enum DistanceDistribution {
+		NoDistance, UniformComoving, UniformLightTravel, UniformRedshift
+	};
+
+private:
+	std::vector<int> isotopes;
+	std::vector<double> fractions;
+	bool spectrum;
+	double index, minEnergy, maxEnergy, maxRigidity, cutoffRigidity;
+	DistanceDistribution distances;
+	double minDistance, maxDistance, evolution;
+	double distanceNorm;
+	mutable std::map<int, double> energyNorm; // by charge number
+
+	double distanceBase(double distance) const;
+	double energyShape(double energy, int Z) const;
+	double energyNormalization(int Z) const;
+	void update();
+
+public:
+	SourceModel();
+	/**
+	 Model of the source features that set the particle type, energy and
+	 distance: SourceParticleType, SourceMultipleParticleTypes,
+	 SourcePowerLawSpectrum, SourceComposition, SourceUniform1D,
+	 SourceRedshiftEvolution and SourceEvolution1D without the comoving
+	 volume. SourceEnergy cannot be modeled, other features
+	 are taken to be the same in all models.
+	 */
+	SourceModel(const Source &source);
+
+	/** Add a particle type with its fraction of the emitted particles, normalized over all types */
+	void addIsotope(int id, double fraction = 1);
+	/** Power law dN/dE ~ E^index between minEnergy and maxEnergy */
+	void setSpectrum(double index, double minEnergy, double maxEnergy);
+	/** Upper energy Z * Rmax instead of maxEnergy, 0 for none */
+	void setMaxRigidity(double Rmax);
+	/** Exponential cutoff exp(1 - E / (Z * Rcut)) above Z * Rcut, 0 for none */
+	void setCutoffRigidity(double Rcut);
+	/**
+	 Distribution of the comoving source distance
+	 @param distribution	uniform in the comoving or light travel distance
+	 @param minDistance		minimum comoving distance
+	 @param maxDistance		maximum comoving distance
+	 */
+	void setDistances(DistanceDistribution distribution, double minDistance, double maxDistance);
+	/** Distribution uniform in the redshift between minRedshift and maxRedshift */
+	void setRedshifts(double minRedshift, double maxRedshift);
+	/** Source evolution (1 + z)^m of the distance distribution */
+	void setEvolution(double m);
+
+	bool hasComposition() const;
+	bool hasSpectrum() const;
+	bool hasDistances() const;
+
+	/**
+	 Normalized density of a source state, per energy and comoving distance
+	 for the parts that are set
+	 @param id			particle type
+	 @param energy		energy
+	 @param distance	comoving distance from the origin
+	 */
+	double getDensity(int id, double energy, double distance) const;
+};
+
+/**
+ @class SourceReweighting
+ @brief New weights of the events of an output for other source models
+
+ The events of a TextOutput or HDF5Output file, with the source columns ID0,
+ E0 and, for a distance distribution, the source position X0 (Y0, Z0), were
+ drawn from the original source model. For every target model, the weight
+ of an event is its weight in the file, or 1 without weights, times the
+ ratio of the density of its source state in the target model to that in
+ the original model. Thus one simulation serves a scan over source models,
+ as long as the target models stay within the range of the original model.
+
+ The rows of the file are streamed once for all target models. The text
+ files are read with their units from the header, gzipped text files with
+ zlib, the HDF5 files in all layouts of HDF5Output.
+ */
+class SourceReweighting: public Referenced {
+	ref_ptr<SourceModel> original;
+	std::vector<ref_ptr<SourceModel> > targets;
+	std::vector<std::vector<double> > weights;
+
+	void reweightText(const std::string &filename);
+	void reweightHDF5(const std::string &filename);
+	void addEvent(int id, double energy, double distance, double weight);
+
+public:
+	SourceReweighting(ref_ptr<SourceModel> original);
+	/** Add a target model with the same parts as the original, returns its index */
+	size_t addTarget(ref_ptr<SourceModel> target);
+	size_t getNumberOfTargets() const;
+
+	/** Factor of the weight of an event for a target model */
+	double getFactor(size_t target, int id, double energy, double distance) const;
+	/** Compute the weights of the events of a file for all target models, HDF5 files end with .h5 */
+	void reweight(const std::string &filename);
+	/** Weights of the events of the last file for a target model */
+	const std::vector<double> &getWeights(size_t target = 0) const;
+	/** Copy of a text file with the weights of a target model in the column W */
+	void writeText(const std::string &input, const std::string &output, size_t target = 0) const;
+};
+
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_SOURCEREWEIGHTING_H
@@ -0,0 +1,179 @@
+#ifndef CRPROPA_STATICMODULECHAIN_H
+#define CRPROPA_STATICMODULECHAIN_H
+
+#include "crpropa/Module.h"
+
+#include <sstream>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+namespace crpropa {
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ @class StaticModuleChain
+ @brief Fixed chain of modules, owned by value and called without virtual dispatch
+
+ For fixed production setups compiled as a C++ program or plugin, e.g.
+   StaticModuleChain<SimplePropagation, Redshift, PhotoPionProduction,
+   MinimumEnergy> chain(SimplePropagation(1 * kpc, 10 * Mpc), Redshift(),
+   PhotoPionProduction(new CMB()), MinimumEnergy(1 * EeV));
+ The modules are members of the chain and their process is called with the
+ qualified name of their type, so the per-step loop is a sequence of direct
+ calls that the compiler can inline where the definitions are visible (in
+ the same translation unit or with link time optimization).
+
+ As in ModuleList, a module is only called for candidates of its particle
+ classes (Module::getParticleClasses), and after a module has changed the
+ particle type the classes of the new type apply to the following modules.
+
+ The chain is a Module itself, so it can be added to a ModuleList, whose run
+ loops, schedules and counter-based random numbers are kept, or be run with
+ its own loop. Profiling of the ModuleList sees the chain as a single module.
+ */
+template<typename... Modules>
+class StaticModuleChain: public Module {
+public:
+	typedef std::tuple<Modules...> module_tuple_t;
+	static const size_t numberOfModules = sizeof...(Modules);
+
+	template<size_t I>
+	struct ModuleType {
+		typedef typename std::tuple_element<I, module_tuple_t>::type type;
+	};
+
+private:
+	module_tuple_t modules;
+
+	template<size_t I>
+	using Index = std::integral_constant<size_t, I>;
+
+	template<size_t I>
+	void processFrom(Candidate *candidate, int &id, unsigned int &classes, Index<I>) const {
+		typedef typename ModuleType<I>::type M;
+		const M &module = std::get<I>(modules);
+		if (module.M::getParticleClasses() & classes) {
+			module.M::process(candidate);
+			if (candidate->current.getId() != id) {
+				id = candidate->current.getId();
+				classes = particleClass(id);
+			}
+		}
+		processFrom(candidate, id, classes, Index<I + 1>());
+	}
+
+	void processFrom(Candidate *candidate, int &id, unsigned int &classes, Index<numberOfModules>) const {
+	}
+
+	template<size_t I>
+	void collect(std::vector<Module *> &list, Index<I>) {
+		list.push_back(&std::get<I>(modules));
+		collect(list, Index<I + 1>());
+	}
+
+	void collect(std::vector<Module *> &list, Index<numberOfModules>) {
+	}
+
+	std::vector<Module *> getModules() const {
+		std::vector<Module *> list;
+		const_cast<StaticModuleChain *>(this)->collect(list, Index<0>());
+		return list;
+	}
+
+public:
+	StaticModuleChain() {
+	}
+
+	/** Chain of copies of the given modules */
+	explicit StaticModuleChain(const Modules&... modules) :
+			modules(modules...) {
+	}
+
+	/** Module at position I, e.g. to change its parameters before the run */
+	template<size_t I>
+	typename ModuleType<I>::type &get() {
+		return std::get<I>(modules);
+	}
+
+	template<size_t I>
+	const typename ModuleType<I>::type &get() const {
+		return std::get<I>(modules);
+	}
+
+	size_t size() const {
+		return numberOfModules;
+	}
+
+	void prepare() {
+		prepareModules(getModules());
+	}
+
+	void process(Candidate *candidate) const {
+		int id = candidate->current.getId();
+		unsigned int classes = particleClass(id);
+		processFrom(candidate, id, classes, Index<0>());
+	}
+
+	void processBatch(Candidate **candidates, size_t count) const {
+		for (size_t i = 0; i < count; i++)
+			StaticModuleChain::process(candidates[i]);
+	}
+
+	/**
+	 Propagate a candidate until it is inactive, and its secondaries after it
+	 or, with secondariesFirst, after every step, as ModuleList::run does for
+	 a single candidate without its options.
+	 */
+	void run(Candidate *candidate, bool recursive = true, bool secondariesFirst = false) const {
+		while (candidate->isActive()) {
+			StaticModuleChain::process(candidate);
+			// finished secondaries have propagated their own secondaries already
+			if (recursive and secondariesFirst)
+				for (size_t i = 0; i < candidate->secondaries.size(); i++)
+					if (candidate->secondaries[i]->isActive())
+						run(candidate->secondaries[i], true, true);
+		}
+		if (recursive and not secondariesFirst)
+			for (size_t i = 0; i < candidate->secondaries.size(); i++)
+				run(candidate->secondaries[i], true, false);
+	}
+
+	void run(ref_ptr<Candidate> candidate, bool recursive = true, bool secondariesFirst = false) const {
+		run(candidate.get(), recursive, secondariesFirst);
+	}
+
+	unsigned int getParticleClasses() const {
+		std::vector<Module *> list = getModules();
+		unsigned int classes = 0;
+		for (size_t i = 0; i < list.size(); i++)
+			classes |= list[i]->getParticleClasses();
+		return classes;
+	}
+
+	size_t getMemoryUsage() const {
+		std::vector<Module *> list = getModules();
+		size_t bytes = 0;
+		for (size_t i = 0; i < list.size(); i++)
+			bytes += list[i]->getMemoryUsage();
+		return bytes;
+	}
+
+	std::string getDescription() const {
+		std::vector<Module *> list = getModules();
+		std::stringstream ss;
+		ss << "StaticModuleChain of " << list.size() << " modules\n";
+		for (size_t i = 0; i < list.size(); i++)
+			ss << "  " << list[i]->getDescription() << "\n";
+		return ss.str();
+	}
+};
+
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_STATICMODULECHAIN_H
@@ -0,0 +1,58 @@
+#ifndef CRPROPA_TABLEREGISTRY_H
+#define CRPROPA_TABLEREGISTRY_H
+
+#include "crpropa/Referenced.h"
+
+#include <string>
+
+namespace crpropa {
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ @class TableRegistry
+ @brief Process-wide registry of the immutable tables of the interaction modules.
+
+ Modules constructed for the same photon field and data files share their
+ tables instead of loading a copy each. Entries are keyed by module type,
+ photon field name and data files. A table is kept while any module
+ references it; tables only referenced by the registry are released when
+ the next table is registered, or with releaseUnused().
+ Access is thread-safe with OpenMP.
+ */
+class TableRegistry {
+	static ref_ptr<Referenced> findEntry(const std::string &key);
+	static ref_ptr<Referenced> insertEntry(const std::string &key, ref_ptr<Referenced> table);
+
+public:
+	/// Registry key of the tables of a module for a photon field and data files
+	static std::string key(const std::string &module, const std::string &field,
+			const std::string &files);
+
+	/// Registered table for a key, null if none
+	template<class T>
+	static ref_ptr<T> find(const std::string &key) {
+		return dynamic_cast<T*>(findEntry(key).get());
+	}
+
+	/// Register a table, returns the already registered table if there is one
+	template<class T>
+	static ref_ptr<T> insert(const std::string &key, ref_ptr<T> table) {
+		return dynamic_cast<T*>(insertEntry(key, table).get());
+	}
+
+	/// Release the tables no module references, returns their number
+	static size_t releaseUnused();
+	/// Number of registered tables
+	static size_t size();
+	/// Remove all entries, tables in use stay with their modules
+	static void clear();
+};
+
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_TABLEREGISTRY_H
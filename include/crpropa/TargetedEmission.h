@@ -0,0 +1,109 @@
+#ifndef CRPROPA_TARGETEDEMISSION_H
+#define CRPROPA_TARGETEDEMISSION_H
+
+#include "crpropa/EmissionMap.h"
+#include "crpropa/ModuleList.h"
+#include "crpropa/Source.h"
+#include "crpropa/Units.h"
+
+#include <vector>
+
+namespace crpropa {
+
+class TargetedEmissionRecorder;
+
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ @class TargetedEmission
+ @brief Two-pass workflow: emission maps of a pilot run, then weighted emission towards the observer
+
+ In the pilot run, the recorder (getRecorder) is the detection action of the
+ observer. It fills, per thread and without locking, the emission maps with
+ the directions at the sources of the detected candidates:
+ - Forward: the pilot source emits isotropically from the sources and the
+   source state of every detected candidate is recorded.
+ - Backward: the pilot source emits antiparticles from the observer, which
+   are detected at the sources. The reversed current state, the direction
+   inverted and, for charged particles, the particle id negated, is recorded.
+ The thread maps are merged after the run and smoothed: every bin is
+ replaced by the sum over the bins within the smoothing radius, so that
+ directions next to the recorded ones, which reach the observer as well but
+ were not hit by the pilot, are emitted too. An isotropic fraction mixed
+ into the maps covers all directions, which keeps the forward estimate
+ unbiased at the cost of some variance.
+
+ configure adds SourceTargetedEmission with the maps to the forward source,
+ which draws the directions from the maps and weights the candidates to
+ represent isotropic emission.
+ */
+class TargetedEmission: public Referenced {
+public:
+	enum Direction {
+		Forward, Backward
+	};
+
+private:
+	ref_ptr<EmissionMap> emissionMap; // smoothed
+	ref_ptr<EmissionMap> counts; // merged from the threads
+	ref_ptr<Module> recorder;
+	std::vector<ref_ptr<EmissionMap> > threadMaps;
+	Direction direction;
+	size_t smoothing;
+	double isotropicFraction;
+
+	void createThreadMaps();
+	void record(const Candidate *candidate);
+	friend class TargetedEmissionRecorder;
+
+public:
+	/**
+	 @param nPhi		number of bins for phi (0-2pi)
+	 @param nTheta		number of bins for theta (0-pi)
+	 @param nEnergy		number of logarithmic energy bins
+	 @param minEnergy	lower edge of the energy bins
+	 @param maxEnergy	upper edge of the energy bins
+	 @param direction	direction of the pilot run
+	 */
+	TargetedEmission(size_t nPhi, size_t nTheta, size_t nEnergy,
+			double minEnergy = 0.0001 * EeV, double maxEnergy = 10000 * EeV,
+			Direction direction = Forward);
+	~TargetedEmission();
+
+	/** Detection action of the observer in the pilot run */
+	ref_ptr<Module> getRecorder() const;
+
+	/** Smoothing radius in bins of phi and theta, 1 by default, 0 for none */
+	void setSmoothing(size_t bins);
+	size_t getSmoothing() const;
+	/** Fraction of isotropic emission mixed into every map, 0 by default */
+	void setIsotropicFraction(double fraction);
+	double getIsotropicFraction() const;
+
+	/**
+	 Run the pilot simulation, whose observer has the recorder as detection
+	 action, in parallel for count candidates of the source and finish the maps.
+	 */
+	void runPilot(ModuleList *simulation, SourceInterface *source, size_t count);
+	/**
+	 Merge the thread maps, smooth the maps and finalize them for drawing,
+	 called by runPilot, after a pilot run by other means. The counts of
+	 all pilot runs are kept, so a further pilot run adds to them.
+	 */
+	void finish();
+
+	ref_ptr<EmissionMap> getEmissionMap() const;
+	/** Feature of the forward source emitting from the maps, see SourceTargetedEmission */
+	ref_ptr<SourceFeature> getSourceFeature() const;
+	/** Add the feature to the forward source, after its type and energy features */
+	void configure(Source *source) const;
+};
+
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_TARGETEDEMISSION_H
@@ -0,0 +1,96 @@
+#ifndef CRPROPA_TRACE_H
+#define CRPROPA_TRACE_H
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <typeinfo>
+
+namespace crpropa {
+/**
+ * \addtogroup Tools
+ * @{
+ */
+
+/**
+ @class Trace
+ @brief Timeline of spans of the threads, written as Chrome trace events.
+
+ While tracing, every thread records the spans of the run phases of the
+ ModuleList, the process of every module, the flushes of the outputs, the
+ loading of the interaction tables and the FFTs of the turbulent grids into a
+ buffer of its own. write stores them in the trace event format, which is
+ shown by chrome://tracing and ui.perfetto.dev. Disabled, a span costs a
+ single check of a flag; built with ENABLE_TRACING=OFF no spans are recorded.
+
+ Setting the environment variable CRPROPA_TRACE to a filename traces the
+ whole process and writes the file at its exit.
+ */
+class Trace {
+public:
+	/**
+	 Start recording, dropping the spans of earlier traces.
+	 @param maxEvents	spans recorded per thread, further spans are counted as dropped
+	 */
+	static void start(size_t maxEvents = 1000000);
+	static void stop();
+	static bool isEnabled() {
+		return enabled.load(std::memory_order_relaxed);
+	}
+	/** Write the recorded spans as trace event JSON */
+	static void write(const std::string &filename);
+	static size_t getEventCount();
+	static size_t getDroppedCount();
+
+	/** Nanoseconds of the trace clock */
+	static uint64_t now();
+	/**
+	 Record a span of the calling thread. name and category have to stay
+	 valid until the trace is written, mangled names of type_info are
+	 demangled when written.
+	 */
+	static void record(const char *name, const char *category, uint64_t begin,
+			uint64_t end, bool mangled = false);
+
+private:
+	static std::atomic<bool> enabled;
+};
+
+/**
+ @class TraceSpan
+ @brief Records a span from its construction to its destruction while tracing.
+ */
+class TraceSpan {
+	const char *name, *category;
+	uint64_t begin;
+	bool mangled;
+public:
+	TraceSpan(const char *name, const char *category, bool mangled = false) :
+			name(name), category(category), begin(0), mangled(mangled) {
+		if (Trace::isEnabled())
+			begin = Trace::now();
+	}
+	~TraceSpan() {
+		if (begin != 0)
+			Trace::record(name, category, begin, Trace::now(), mangled);
+	}
+};
+/** @} */
+
+} // namespace crpropa
+
+#ifdef CRPROPA_HAVE_TRACING
+#define CRPROPA_TRACE_CONCAT2(a, b) a ## b
+#define CRPROPA_TRACE_CONCAT(a, b) CRPROPA_TRACE_CONCAT2(a, b)
+/** Trace the rest of the scope as span of the given name and category */
+#define CRPROPA_TRACE_SPAN(name, category) \
+	crpropa::TraceSpan CRPROPA_TRACE_CONCAT(traceSpan, __LINE__)(name, category)
+/** Trace the rest of the scope as span named by the dynamic type of the object */
+#define CRPROPA_TRACE_TYPE_SPAN(object, category) \
+	crpropa::TraceSpan CRPROPA_TRACE_CONCAT(traceSpan, __LINE__)(typeid(object).name(), category, true)
+#else
+#define CRPROPA_TRACE_SPAN(name, category)
+#define CRPROPA_TRACE_TYPE_SPAN(object, category)
+#endif
+
+#endif // CRPROPA_TRACE_H
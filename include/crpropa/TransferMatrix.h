@@ -0,0 +1,158 @@
+#ifndef CRPROPA_TRANSFERMATRIX_H
+#define CRPROPA_TRANSFERMATRIX_H
+
+#include "crpropa/ModuleList.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace crpropa {
+
+class TransferMatrixRecorder;
+
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ @class TransferMatrix
+ @brief Response of a 1D simulation from the injected to the observed nuclei, for fast spectrum and composition fits.
+
+ The simulation, e.g. SimplePropagation, the interactions, MinimumEnergy and
+ an Observer with ObserverPoint, is run once for each cell of injected
+ isotope, energy bin and comoving source distance bin. The primaries start on
+ the x-axis at the distance towards the observer at the origin, with the
+ energy log-uniform in the energy bin, the distance uniform in the distance
+ bin and the redshift at that distance. Distance bins from redshifts are
+ given by redshift2ComovingDistance.
+
+ The recorder (getRecorder) is to be the detection action of the observer.
+ It counts the detected nuclei by mass number and energy, in the same energy
+ bins, for the cell of their primary, taken from the source state of the
+ candidate. Other particles are not counted. For each cell, the transfer
+ matrix then holds the mean detected weight per primary in every observed
+ (mass number, energy) bin, which is stored sparse in single precision.
+
+ The cells are built in parallel and can be resumed from a checkpoint file,
+ see build. With setCounterBasedRandom of the module list, the primaries
+ draw from streams derived from the seed and their cell, so the tensor does
+ not depend on the threads or on the interruptions.
+
+ Folding the tensor with the injected numbers of any source model, e.g. from
+ getInjection, gives the observed numbers in milliseconds.
+ */
+class TransferMatrix: public Referenced {
+public:
+	/** Column and value of a filled bin of the observed (mass number, energy) */
+	struct Entry {
+		uint32_t column;
+		float value;
+	};
+
+private:
+	ref_ptr<ModuleList> simulation;
+	ref_ptr<Module> recorder;
+	std::vector<int> isotopes;
+	std::map<int, size_t> isotopeIndex;
+	size_t nEnergy;
+	double minEnergy, maxEnergy;
+	std::vector<double> distanceEdges;
+	int maxMassNumber;
+	uint64_t seed;
+	double checkpointInterval;
+
+	std::vector<std::vector<Entry> > rows; // by cell, of the done cells
+	std::vector<bool> done;
+	std::vector<size_t> primaries; // number of primaries of the done cells
+	std::vector<std::map<uint32_t, double> > pending; // detected weights of the cells being built
+
+	void initAxes();
+	size_t energyBin(double energy) const;
+	void record(const Candidate *candidate);
+	ref_ptr<Candidate> primary(size_t cell, size_t index) const;
+	void writeFile(const std::string &filename) const;
+	void readFile(const std::string &filename, bool axes);
+	friend class TransferMatrixRecorder;
+
+public:
+	/**
+	 @param simulation		1D simulation of a primary, run recursively
+	 @param isotopes		particle ids of the injected nuclei
+	 @param nEnergy			number of logarithmic energy bins, injected and observed
+	 @param minEnergy		lower edge of the energy bins [J]
+	 @param maxEnergy		upper edge of the energy bins [J]
+	 @param distanceEdges	edges of the comoving source distance bins [m]
+	 */
+	TransferMatrix(ref_ptr<ModuleList> simulation, const std::vector<int> &isotopes,
+			size_t nEnergy, double minEnergy, double maxEnergy,
+			const std::vector<double> &distanceEdges);
+	/** Transfer matrix saved to a file, for folding only */
+	TransferMatrix(const std::string &filename);
+	~TransferMatrix();
+
+	/** Detection action of the observer that counts the detected nuclei */
+	ref_ptr<Module> getRecorder() const;
+
+	/** Seed of the random streams of the primaries, with counter-based random numbers */
+	void setSeed(uint64_t seed);
+	/** Minimum time between the writes of the checkpoint file [s], 60 by default */
+	void setCheckpointInterval(double seconds);
+
+	/**
+	 Run the primaries of the cells not built yet, the cells in parallel.
+	 If the checkpoint file exists, the cells done in it are taken over, and
+	 the done cells are written to it at the checkpoint interval and at the
+	 end, so that an interrupted build resumes from it.
+	 @param primariesPerCell	number of primaries per cell
+	 @param checkpoint			checkpoint file, none if empty
+	 */
+	void build(size_t primariesPerCell, const std::string &checkpoint = "");
+
+	/** Write the done cells in a compact binary format */
+	void save(const std::string &filename) const;
+	/** Take over the done cells of a file with the same bins */
+	void load(const std::string &filename);
+
+	const std::vector<int> &getIsotopes() const;
+	size_t getNumberOfEnergyBins() const;
+	double getMinimumEnergy() const;
+	double getMaximumEnergy() const;
+	const std::vector<double> &getDistanceEdges() const;
+	/** Largest observed mass number, that of the heaviest injected isotope */
+	int getMaximumMassNumber() const;
+	/** Index of the cell of the isotope, energy bin and distance bin */
+	size_t getCell(size_t isotope, size_t energyBin, size_t distanceBin) const;
+	size_t getNumberOfCells() const;
+	size_t getNumberOfDoneCells() const;
+	bool isDone(size_t cell) const;
+	/** Filled observed bins of a cell, the column is (A - 1) * nEnergy + energy bin */
+	const std::vector<Entry> &getRow(size_t cell) const;
+	/** Mean detected weight per primary of the cell in the observed bin */
+	double getValue(size_t cell, int massNumber, size_t energyBin) const;
+
+	/**
+	 Injected numbers per cell of a source model: the isotope fractions at
+	 equal energy times a power law E^-alpha, cut off above the rigidity
+	 Z * maxRigidity by exp(1 - E / (Z * maxRigidity)), and a source density
+	 (1 + z)^evolution per comoving distance, integrated over the cells.
+	 @param fractions		fractions of the isotopes
+	 @param alpha			spectral index
+	 @param maxRigidity		cutoff rigidity, as energy [J] of a proton
+	 @param evolution		index m of the source evolution (1 + z)^m
+	 */
+	std::vector<double> getInjection(const std::vector<double> &fractions,
+			double alpha, double maxRigidity, double evolution = 0) const;
+	/**
+	 Observed numbers [(A - 1) * nEnergy + energy bin] for the injected
+	 numbers per cell. Cells that are not done do not contribute.
+	 */
+	std::vector<double> fold(const std::vector<double> &injected) const;
+};
+
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_TRANSFERMATRIX_H
@@ -0,0 +1,158 @@
+#ifndef CRPROPA_TRANSPORTSOLVER1D_H
+#define CRPROPA_TRANSPORTSOLVER1D_H
+
+#include "crpropa/Module.h"
+#include "crpropa/module/ElectronPairProduction.h"
+#include "crpropa/module/NuclearDecay.h"
+#include "crpropa/module/PhotoDisintegration.h"
+#include "crpropa/module/PhotoPionProduction.h"
+
+#include <map>
+#include <vector>
+
+namespace crpropa {
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ @class TransportSolver1D
+ @brief Deterministic 1D propagation of nuclei, solving the transport equations on a grid
+
+ Instead of sampling candidates, the numbers of all nuclei are kept on a grid
+ of species and logarithmic Lorentz-factor bins and marched in steps of
+ comoving distance from the sources to the observer at the origin, giving
+ the mean spectra that an Observer1D collects from many candidates. The rates
+ are taken from the tables of the interaction modules added, several of
+ each kind for several photon fields:
+ - PhotoDisintegration: all channels, the fragments at the Lorentz factor of
+   the nucleus
+ - NuclearDecay: all decay modes, the products at the Lorentz factor of the
+   nucleus
+ - PhotoPionProduction: as with its continuous loss, nuclei lose a nucleon
+   which carries its energy less the mean inelasticity, nucleons lose that
+   fraction continuously
+ - ElectronPairProduction and Redshift: continuous losses
+ SimplePropagation sets the step to its maximum step, other modules are not
+ supported.
+
+ Each step is split into the interactions and the continuous losses:
+ - In every Lorentz-factor bin, the species are processed from the heavy to
+   the light ones (parents before their products), each removing the fraction
+   1 - exp(-rate * step) of its numbers, injected ones included, and passing it
+   on to its products. The bins are independent and computed in parallel.
+ - The continuous losses move the numbers of every species down the bins with
+   an implicit upwind scheme, which is stable for any step. The species are
+   computed in parallel.
+ The rates are evaluated at the redshift of the middle of the step, which is
+ that of the comoving distance as for SourceRedshift1D with Redshift, and
+ recomputed when it changed by more than the redshift tolerance. The scheme is
+ conservative and of first order in the step; numbers leaving the grid are
+ lost. The energy lost to electromagnetic particles (pair production, pions)
+ and neutrinos (pions) is summed, redshifted to the observer, as a budget for
+ cascade limits; the secondaries themselves are not propagated, and the
+ electrons and neutrinos of decays are not counted.
+ */
+class TransportSolver1D: public Referenced {
+	struct Channel {
+		size_t source; // species index
+		std::vector<size_t> products; // species at the Lorentz factor of the source
+		int ejected; // species of the nucleon ejected by pion production, -1 if none
+		size_t rate; // offset of the rates in channelRates
+		int kind; // photodisintegration, decay or pion production
+		size_t module; // index of the module of its kind
+		double parameter; // rest frame rate of a decay, 1 for pion production on protons
+	};
+	struct Injection {
+		int id;
+		size_t bin;
+		double distance;
+		double weight;
+	};
+
+	std::vector<ref_ptr<PhotoDisintegration> > disintegration;
+	std::vector<ref_ptr<PhotoPionProduction> > pionProduction;
+	std::vector<ref_ptr<ElectronPairProduction> > pairProduction;
+	ref_ptr<NuclearDecay> decay;
+	bool redshift;
+
+	size_t nBins;
+	double minLorentzFactor, maxLorentzFactor;
+	double step, redshiftTolerance;
+	std::vector<Injection> injections;
+
+	std::vector<int> species; // ordered parents before products
+	std::map<int, size_t> speciesIndex;
+	std::vector<Channel> channels; // sorted by source
+	std::vector<size_t> channelBegin; // channels of species s: [channelBegin[s], channelBegin[s + 1])
+	std::vector<double> channelRates; // [rate + bin], per comoving distance
+	std::vector<double> totalRates, lossRates, emLossRates, neutrinoLossRates; // [s * nBins + bin]
+	std::vector<double> numbers; // [s * nBins + bin]
+	double emEnergy, neutrinoEnergy;
+
+	void buildSpecies();
+	void computeRates(double z);
+	void interact(double dx, double z);
+	void loseEnergy(double dx, double z);
+
+public:
+	/**
+	 @param nBins				number of logarithmic Lorentz-factor bins
+	 @param minLorentzFactor	lower edge of the bins
+	 @param maxLorentzFactor	upper edge of the bins
+	 */
+	TransportSolver1D(size_t nBins = 300, double minLorentzFactor = 1e7, double maxLorentzFactor = 1e13);
+
+	/** Take the rates of the module, see above */
+	void add(Module *module);
+	/** Comoving distance per step, 1 Mpc by default */
+	void setStep(double step);
+	double getStep() const;
+	/** Redshift change until the rates are recomputed, 1e-3 by default */
+	void setRedshiftTolerance(double dz);
+	double getRedshiftTolerance() const;
+
+	/** Inject nuclei of the energy at the comoving distance from the observer */
+	void inject(int id, double energy, double distance, double weight = 1);
+	/**
+	 Inject nuclei of a source population with the total weight: a power law
+	 E^index in [minEnergy, maxEnergy], cut off above the rigidity
+	 Z * maxRigidity by exp(1 - E / (Z * maxRigidity)) if maxRigidity > 0, and
+	 a source density (1 + z)^evolution per comoving distance in
+	 [minDistance, maxDistance], injected at the middle of intervals of the step.
+	 */
+	void injectPowerLaw(int id, double index, double minEnergy, double maxEnergy,
+			double minDistance, double maxDistance, double evolution = 0,
+			double maxRigidity = 0, double weight = 1);
+	/** Remove the injected nuclei and the solution */
+	void clear();
+
+	/** Propagate the injected nuclei to the observer */
+	void solve();
+
+	/** Species of the solution, ordered parents before products */
+	const std::vector<int> &getSpecies() const;
+	size_t getNumberOfBins() const;
+	/** Center of the Lorentz-factor bin */
+	double getLorentzFactor(size_t bin) const;
+	/** Observed numbers of the species in the Lorentz-factor bins, 0 if not in the solution */
+	std::vector<double> getSpectrum(int id) const;
+	/**
+	 Observed numbers of all species of the mass number, or of all nuclei for
+	 massNumber = 0, in the energy bins, by the energies of the bin centers
+	 @param edges		edges of the energy bins [J]
+	 @param massNumber	mass number, 0 for all
+	 */
+	std::vector<double> getEnergySpectrum(const std::vector<double> &edges, int massNumber = 0) const;
+	/** Energy lost to electromagnetic particles, at the observer [J] */
+	double getElectromagneticEnergy() const;
+	/** Energy lost to neutrinos, at the observer [J] */
+	double getNeutrinoEnergy() const;
+};
+
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_TRANSPORTSOLVER1D_H
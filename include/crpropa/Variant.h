@@ -12,10 +12,12 @@
 #include <cstring>
 #include <typeinfo>
 #include <sstream>
+#include <locale>
 #include <cstdlib>
 #include <stdexcept>
 #include <limits>
 #include <stdint.h>
+#include <new>
 
 // Helper to set POD type methods to variant
 #define VARIANT_ADD_TYPE_DECL_POD(NAME, TYPE, VALUE) \
@@ -30,20 +32,16 @@
 	bool operator == (const VALUE &a) const { check(TYPE); return data._##NAME == a; } \
 	Variant(const VALUE &a) { data._ ## NAME = a; type = TYPE; }
 
-// Helper to set pointer type methods to variant
-#define VARIANT_ADD_TYPE_DECL_PTR_BASE(NAME, TYPE, VALUE) \
+// Helper to set methods of types constructed in the storage of the variant
+#define VARIANT_ADD_TYPE_DECL_INPLACE(NAME, TYPE, VALUE) \
 	bool is ## NAME() const { return (type == TYPE); } \
-	VALUE &as ## NAME() { check(TYPE); return *data._##NAME; } \
-	const VALUE &as ## NAME() const	{ check(TYPE); return *data._##NAME; } \
+	VALUE &as ## NAME() { check(TYPE); return value ## NAME(); } \
+	const VALUE &as ## NAME() const	{ check(TYPE); return value ## NAME(); } \
 	static Variant from ## NAME(const VALUE &a) { return Variant(a); } \
-
-// Helper to set pointer type methods to variant
-#define VARIANT_ADD_TYPE_DECL_PTR(NAME, TYPE, VALUE) \
-	bool operator != (const VALUE &a) const { check(TYPE); return *data._##NAME != a; } \
-	bool operator == (const VALUE &a) const { check(TYPE); return *data._##NAME == a; } \
-	VARIANT_ADD_TYPE_DECL_PTR_BASE(NAME, TYPE, VALUE) \
-	Variant &operator =(const VALUE &a) { if (type != TYPE) { clear(); data._##NAME = new VALUE; } type = TYPE; (*data._##NAME) = a; return *this; } \
-	Variant(const VALUE &a) { data._ ## NAME = new VALUE(a); type = TYPE; }
+	bool operator != (const VALUE &a) const { check(TYPE); return value ## NAME() != a; } \
+	bool operator == (const VALUE &a) const { check(TYPE); return value ## NAME() == a; } \
+	Variant &operator =(const VALUE &a) { if (type != TYPE) { clear(); new (data._##NAME) VALUE; } type = TYPE; value ## NAME() = a; return *this; } \
+	Variant(const VALUE &a) { new (data._ ## NAME) VALUE(a); type = TYPE; }
 
 namespace crpropa
 {
@@ -55,6 +53,10 @@ namespace crpropa
  Allows storage of multiple data types in one base class. used to construct a
  map of `arbitrarry' data types.
 
+ Strings are constructed in the storage of the variant, so that short strings
+ (within the small string buffer of std::string) are copied without heap
+ allocation. Moving a variant moves its string.
+
  */
 class Variant
 {
@@ -101,6 +103,9 @@ public:
 	~Variant();
 
 	Variant(const Variant& a);
+#ifndef SWIG
+	Variant(Variant &&a) noexcept;
+#endif
 
 	const std::type_info& getTypeInfo() const;
 
@@ -114,7 +119,7 @@ public:
 	static const char *getTypeName(Type type);
 
 	// copy the data to buffer via memcpy. Returns the size of the data
-	size_t copyToBuffer(void* buffer);
+	size_t copyToBuffer(void* buffer) const;
 	/// returns size of used data type in bytes
 	size_t getSize() const;
 
@@ -139,6 +144,10 @@ public:
 		return *this;
 	}
 
+#ifndef SWIG
+	Variant &operator =(Variant &&a) noexcept;
+#endif
+
 	bool isValid()
 	{
 		return (type != TYPE_NONE);
@@ -166,9 +175,11 @@ public:
 
 	VARIANT_ADD_TYPE_DECL_POD(Double, TYPE_DOUBLE, double)
 
-	VARIANT_ADD_TYPE_DECL_PTR(String, TYPE_STRING, std::string)
+	VARIANT_ADD_TYPE_DECL_INPLACE(String, TYPE_STRING, std::string)
 	Variant(const char *s);
 	std::string toString() const;
+	/// Text of the value with the number formatting of a locale
+	std::string toString(const std::locale &locale) const;
 	static Variant fromString(const std::string &str, Type type);
 	operator std::string() const
 	{
@@ -177,10 +188,10 @@ public:
 	bool operator !=(const char *a) const
 	{
 		check(TYPE_STRING);
-		return data._String->compare(a) != 0;
+		return valueString().compare(a) != 0;
 	}
 
-	// clear pointer based data types
+	// clear non-POD data types
 	void clear();
 
 protected:
@@ -199,10 +210,18 @@ protected:
 		uint64_t _UInt64;
 		double _Double;
 		float _Float;
-		std::string *_String;
+		unsigned char _String[sizeof(std::string)]; // storage of a std::string
 	} data;
 
 private:
+	std::string &valueString()
+	{
+		return *reinterpret_cast<std::string *>(data._String);
+	}
+	const std::string &valueString() const
+	{
+		return *reinterpret_cast<const std::string *>(data._String);
+	}
 	void copy(const Variant &a);
 	void check(const Type t) const;
 	void check(const Type t);
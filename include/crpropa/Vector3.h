@@ -7,6 +7,11 @@
 #include <limits>
 #include <algorithm>
 
+#if defined(FAST_VECTORS) && defined(__AVX__) && !defined(SWIG)
+#define CRPROPA_VECTOR3D_AVX
+#include <immintrin.h>
+#endif
+
 namespace crpropa {
 
 /**
@@ -24,7 +29,24 @@ namespace crpropa {
  Angle definitions are
  phi [-pi, pi]: azimuthal angle in the x-y plane, 0 pointing in x-direction
  theta [0, pi]: zenith angle towards the z axis, 0 pointing in z-direction
+
+ With FAST_VECTORS (and USE_SIMD) a Vector3d is padded to four lanes and its
+ arithmetic, dot, cross and getR are specialized to AVX instructions. The
+ padding lane is not part of the vector, it is neither compared nor summed.
+ Code linked against such a build has to be compiled with FAST_VECTORS too.
  */
+template<typename T>
+struct Vector3Lanes {
+	static const int n = 3;
+};
+
+#ifdef CRPROPA_VECTOR3D_AVX
+template<>
+struct Vector3Lanes<double> {
+	static const int n = 4;
+};
+#endif
+
 template<typename T>
 class Vector3 {
 public:
@@ -35,7 +57,11 @@ public:
 			T y;
 			T z;
 		};
+#ifdef SWIG
 		T data[3];
+#else
+		T data[Vector3Lanes<T>::n];
+#endif
 	};
 
 	Vector3() : data{0., 0., 0.} {
@@ -429,6 +455,122 @@ inline Vector3<T> operator *(T f, const Vector3<T> &v) {
 	return Vector3<T>(v.x * f, v.y * f, v.z * f);
 }
 
+#ifdef CRPROPA_VECTOR3D_AVX
+// whole vectors are moved in one register, so that the wide loads do not wait
+// for narrow stores
+template<> inline Vector3<double>::Vector3(const Vector3<double> &v) {
+	_mm256_storeu_pd(data, _mm256_loadu_pd(v.data));
+}
+
+template<> inline Vector3<double>::Vector3(const double &X, const double &Y, const double &Z) {
+	_mm256_storeu_pd(data, _mm256_set_pd(0., Z, Y, X));
+}
+
+template<> inline Vector3<double>::Vector3(double t) {
+	_mm256_storeu_pd(data, _mm256_set_pd(0., t, t, t));
+}
+
+template<> inline Vector3<double> &Vector3<double>::operator =(const Vector3<double> &v) {
+	_mm256_storeu_pd(data, _mm256_loadu_pd(v.data));
+	return *this;
+}
+
+// The lanes are loaded unaligned, as heap allocations are not aligned to 32
+// bytes before C++17. The padding lane may hold any value.
+namespace vector3avx {
+inline __m256d load(const Vector3<double> &v) {
+	return _mm256_loadu_pd(v.data);
+}
+
+inline Vector3<double> store(__m256d a) {
+	Vector3<double> v;
+	_mm256_storeu_pd(v.data, a);
+	return v;
+}
+
+// x + y + z in the order of the scalar sum
+inline double sum(__m256d a) {
+	__m128d lo = _mm256_castpd256_pd128(a);
+	__m128d hi = _mm256_extractf128_pd(a, 1);
+	__m128d xy = _mm_add_sd(lo, _mm_unpackhi_pd(lo, lo));
+	return _mm_cvtsd_f64(_mm_add_sd(xy, hi));
+}
+
+// (y, z, x, .)
+inline __m256d rotate(__m256d a) {
+	__m256d swapped = _mm256_permute2f128_pd(a, a, 0x01); // (z, w, x, y)
+	__m256d zx = _mm256_permute_pd(swapped, 0x1); // (w, z, x, x)
+	__m256d yx = _mm256_permute_pd(a, 0x1); // (y, x, z, z)
+	return _mm256_blend_pd(zx, yx, 0x1);
+}
+}  // namespace vector3avx
+
+template<> inline double Vector3<double>::getR2() const {
+	__m256d a = vector3avx::load(*this);
+	return vector3avx::sum(_mm256_mul_pd(a, a));
+}
+
+template<> inline double Vector3<double>::getR() const {
+	return std::sqrt(getR2());
+}
+
+template<> inline double Vector3<double>::dot(const Vector3<double> &v) const {
+	return vector3avx::sum(_mm256_mul_pd(vector3avx::load(*this), vector3avx::load(v)));
+}
+
+template<> inline Vector3<double> Vector3<double>::cross(const Vector3<double> &v) const {
+	// a x b = (a * b_yzx - a_yzx * b)_yzx
+	__m256d a = vector3avx::load(*this), b = vector3avx::load(v);
+	__m256d c = _mm256_sub_pd(_mm256_mul_pd(a, vector3avx::rotate(b)),
+			_mm256_mul_pd(vector3avx::rotate(a), b));
+	return vector3avx::store(vector3avx::rotate(c));
+}
+
+template<> inline Vector3<double> Vector3<double>::operator +(const Vector3<double> &v) const {
+	return vector3avx::store(_mm256_add_pd(vector3avx::load(*this), vector3avx::load(v)));
+}
+
+template<> inline Vector3<double> Vector3<double>::operator -(const Vector3<double> &v) const {
+	return vector3avx::store(_mm256_sub_pd(vector3avx::load(*this), vector3avx::load(v)));
+}
+
+template<> inline Vector3<double> Vector3<double>::operator *(const Vector3<double> &v) const {
+	return vector3avx::store(_mm256_mul_pd(vector3avx::load(*this), vector3avx::load(v)));
+}
+
+template<> inline Vector3<double> Vector3<double>::operator *(double f) const {
+	return vector3avx::store(_mm256_mul_pd(vector3avx::load(*this), _mm256_set1_pd(f)));
+}
+
+template<> inline Vector3<double> Vector3<double>::operator /(const double &f) const {
+	return vector3avx::store(_mm256_div_pd(vector3avx::load(*this), _mm256_set1_pd(f)));
+}
+
+template<> inline Vector3<double> &Vector3<double>::operator +=(const Vector3<double> &v) {
+	_mm256_storeu_pd(data, _mm256_add_pd(vector3avx::load(*this), vector3avx::load(v)));
+	return *this;
+}
+
+template<> inline Vector3<double> &Vector3<double>::operator -=(const Vector3<double> &v) {
+	_mm256_storeu_pd(data, _mm256_sub_pd(vector3avx::load(*this), vector3avx::load(v)));
+	return *this;
+}
+
+template<> inline Vector3<double> &Vector3<double>::operator *=(const double &f) {
+	_mm256_storeu_pd(data, _mm256_mul_pd(vector3avx::load(*this), _mm256_set1_pd(f)));
+	return *this;
+}
+
+template<> inline Vector3<double> &Vector3<double>::operator /=(const double &f) {
+	_mm256_storeu_pd(data, _mm256_div_pd(vector3avx::load(*this), _mm256_set1_pd(f)));
+	return *this;
+}
+
+inline Vector3<double> operator *(double f, const Vector3<double> &v) {
+	return v * f;
+}
+#endif
+
 typedef Vector3<double> Vector3d;
 typedef Vector3<float> Vector3f;
 
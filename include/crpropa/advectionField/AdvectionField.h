@@ -26,6 +26,22 @@ public:
 	}
 	virtual Vector3d getField(const Vector3d &position) const = 0;
 	virtual double getDivergence(const Vector3d &position) const = 0;
+	/**
+	 Field and divergence at the same position, for callers that need both.
+	 Override to compute the shared terms once, by default getField and
+	 getDivergence are called.
+	 */
+	virtual void getFieldAndDivergence(const Vector3d &position,
+			Vector3d &field, double &divergence) const {
+		field = getField(position);
+		divergence = getDivergence(position);
+	}
+	/** Fields and divergences at count positions */
+	virtual void getFieldsAndDivergences(const Vector3d *positions,
+			Vector3d *fields, double *divergences, size_t count) const {
+		for (size_t i = 0; i < count; i++)
+			getFieldAndDivergence(positions[i], fields[i], divergences[i]);
+	}
 };
 
 
@@ -39,6 +55,10 @@ public:
 	void addField(ref_ptr<AdvectionField> field);
 	Vector3d getField(const Vector3d &position) const;
 	double getDivergence(const Vector3d &position) const;
+	void getFieldAndDivergence(const Vector3d &position, Vector3d &field,
+			double &divergence) const;
+	void getFieldsAndDivergences(const Vector3d *positions, Vector3d *fields,
+			double *divergences, size_t count) const;
 };
 
 
@@ -75,6 +95,8 @@ public:
 	ConstantSphericalAdvectionField(const Vector3d origin, double vWind);
 	Vector3d getField(const Vector3d &position) const;
 	double getDivergence(const Vector3d &position) const;
+	void getFieldAndDivergence(const Vector3d &position, Vector3d &field,
+			double &divergence) const;
 
 	void setOrigin(const Vector3d origin);
 	void setVWind(double vMax);
@@ -110,6 +132,8 @@ public:
 	SphericalAdvectionField(const Vector3d origin, double radius, double vMax, double tau, double alpha);
 	Vector3d getField(const Vector3d &position) const;
 	double getDivergence(const Vector3d &position) const;
+	void getFieldAndDivergence(const Vector3d &position, Vector3d &field,
+			double &divergence) const;
 
 	double getV(const double &r) const;
 
@@ -157,6 +181,8 @@ public:
 
 	Vector3d getField(const Vector3d &position) const;
 	double getDivergence(const Vector3d &position) const;
+	void getFieldAndDivergence(const Vector3d &position, Vector3d &field,
+			double &divergence) const;
 
 	double g(double R) const;
 	double g_prime(double R) const;
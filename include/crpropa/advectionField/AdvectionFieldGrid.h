@@ -0,0 +1,50 @@
+#ifndef CRPROPA_ADVECTIONFIELDGRID_H
+#define CRPROPA_ADVECTIONFIELDGRID_H
+
+#include "crpropa/advectionField/AdvectionField.h"
+#include "crpropa/Grid.h"
+
+#include <string>
+
+namespace crpropa {
+
+/**
+ @class AdvectionFieldGrid
+ @brief Advection field on a cartesian grid, with the divergence on a second grid
+
+ The velocities, e.g. wind or shock profiles from a hydrodynamic simulation,
+ are held by a Grid3f and their divergence by a Grid1f of the same geometry,
+ so that both are trilinear interpolations. Unless given, the divergence is
+ computed from the velocities by finite differences in parallel, see
+ computeDivergence, whenever a velocity grid is set.
+ If both grids share the geometry, layout and boundary conditions and are
+ interpolated trilinearly, getFieldAndDivergence looks up the neighbours once.
+ An analytic field is baked into the grids with fromAdvectionField and
+ fromAdvectionFieldDivergence (GridTools.h).
+ */
+class AdvectionFieldGrid: public AdvectionField {
+	ref_ptr<Grid3f> grid;
+	ref_ptr<Grid1f> divergenceGrid;
+public:
+	/** Velocity grid [m/s], the divergence is computed by finite differences */
+	AdvectionFieldGrid(ref_ptr<Grid3f> grid);
+	/** Velocity grid [m/s] and divergence grid [1/s] of the same geometry */
+	AdvectionFieldGrid(ref_ptr<Grid3f> grid, ref_ptr<Grid1f> divergenceGrid);
+	/** Set the velocity grid and compute its divergence */
+	void setGrid(ref_ptr<Grid3f> grid);
+	/** Set the velocity grid and its divergence */
+	void setGrids(ref_ptr<Grid3f> grid, ref_ptr<Grid1f> divergenceGrid);
+	ref_ptr<Grid3f> getGrid();
+	ref_ptr<Grid1f> getDivergenceGrid();
+
+	Vector3d getField(const Vector3d &position) const;
+	double getDivergence(const Vector3d &position) const;
+	void getFieldAndDivergence(const Vector3d &position, Vector3d &field,
+			double &divergence) const;
+
+	std::string getDescription() const;
+};
+
+} // namespace crpropa
+
+#endif // CRPROPA_ADVECTIONFIELDGRID_H
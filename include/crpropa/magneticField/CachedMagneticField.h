@@ -0,0 +1,79 @@
+#ifndef CRPROPA_CACHEDMAGNETICFIELD_H
+#define CRPROPA_CACHEDMAGNETICFIELD_H
+
+#include "crpropa/magneticField/MagneticField.h"
+#include "crpropa/AMRGrid.h"
+
+#include <string>
+
+namespace crpropa {
+/**
+ * \addtogroup MagneticFields
+ * @{
+ */
+
+/**
+ @class CachedMagneticField
+ @brief Adaptively sampled cache of an expensive magnetic field in a region
+
+ At construction the field is sampled onto an AMRGrid3f that covers the
+ region with Nx * Ny * Nz root blocks of 8^3 cells. A block is refined, up to
+ maxLevel, if the trilinear interpolation of its cells deviates from the field
+ by more than the tolerance at any of the interior cell corners. The blocks of
+ each level are sampled in parallel. Inside of the region the field is then
+ interpolated, outside of it and within half a cell of its faces the
+ original field is evaluated.
+
+ Sampling an analytic model such as JF12Field takes some time, therefore the
+ blocks can be stored in a cache file. The file is loaded if it was written
+ for the same key, which should describe the parameters of the field, and
+ the same region, tolerance and maximum level. Otherwise the field is sampled
+ and the file is (re)written.
+ */
+class CachedMagneticField: public MagneticField {
+	ref_ptr<MagneticField> field;
+	ref_ptr<AMRGrid3f> grid;
+	Vector3d origin, extent, blockSize;
+	size_t Nx, Ny, Nz;
+	double tolerance;
+	int maxLevel;
+
+	struct Leaf {
+		int32_t level;
+		uint64_t ix, iy, iz;
+	};
+	double sampleBlock(const Leaf &block, Vector3f *values) const;
+	void sample(std::vector<Leaf> &leaves, std::vector<Vector3f> &values) const;
+	bool load(const std::string &filename, const std::string &key,
+			std::vector<Leaf> &leaves, std::vector<Vector3f> &values) const;
+	void save(const std::string &filename, const std::string &key,
+			const std::vector<Leaf> &leaves, const std::vector<Vector3f> &values) const;
+public:
+	/**
+	 @param field		field to cache
+	 @param origin		lower corner of the region
+	 @param Nx, Ny, Nz	number of root blocks along each axis
+	 @param blockSize	edge lengths of a root block
+	 @param tolerance	largest accepted deviation of the interpolation, in field units
+	 @param maxLevel	largest refinement level
+	 @param cacheFile	file of the sampled blocks, not used if empty
+	 @param key			description of the field parameters stored in the cache file
+	 */
+	CachedMagneticField(ref_ptr<MagneticField> field, Vector3d origin, size_t Nx,
+			size_t Ny, size_t Nz, Vector3d blockSize, double tolerance, int maxLevel = 4,
+			const std::string &cacheFile = "", const std::string &key = "");
+
+	ref_ptr<MagneticField> getCachedField() const;
+	ref_ptr<AMRGrid3f> getGrid() const;
+	double getTolerance() const;
+
+	Vector3d getField(const Vector3d &position) const;
+	void getFields(const Vector3d *positions, const double *z, Vector3d *fields, size_t count) const;
+	bool getBoundingBox(Vector3d &lower, Vector3d &upper) const;
+};
+
+/** @} */
+
+} // namespace crpropa
+
+#endif // CRPROPA_CACHEDMAGNETICFIELD_H
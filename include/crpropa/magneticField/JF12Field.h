@@ -3,6 +3,7 @@
 
 #include "crpropa/magneticField/MagneticField.h"
 #include "crpropa/Grid.h"
+#include "crpropa/QuantizedGrid.h"
 #include "kiss/logger.h"
 
 namespace crpropa {
@@ -41,6 +42,7 @@ protected:
 	double rArms[8];       // radii where each arm crosses the negative x-axis
 	double pitch;          // pitch angle
 	double sinPitch, cosPitch, tanPitch, cotPitch, tan90MinusPitch;
+	double spiralTurn;     // exp(-2 pi / tan(90 - pitch)): radius ratio of a spiral after one turn
 
 	// Regular field ----------------------------------------------------------
 	// disk
@@ -61,9 +63,11 @@ protected:
 	// Striated field ---------------------------------------------------------
 	double sqrtbeta;       // relative strength of striated field
 	ref_ptr<Grid1f> striatedGrid;
+	ref_ptr<QuantizedGrid1f> quantizedStriatedGrid;
 
 	// Turbulent field --------------------------------------------------------
 	ref_ptr<Grid3f> turbulentGrid;
+	ref_ptr<QuantizedGrid3f> quantizedTurbulentGrid;
 	// disk
 	double bDiskTurb[8]; // field strengths in arms at r=5 kpc
 	double bDiskTurb5;   // field strength at r<5kpc
@@ -96,8 +100,31 @@ public:
 	 */
 	void setTurbulentGrid(ref_ptr<Grid3f> grid);
 
+	/**
+	 * Set a quantized striated grid, e.g. memory-mapped from a file, and
+	 * activate the striated field component. The grid may be shared by
+	 * several fields, it replaces a Grid1f set before.
+	 */
+	void setStriatedGrid(ref_ptr<QuantizedGrid1f> grid);
+
+	/**
+	 * Set a quantized turbulent grid, e.g. memory-mapped from a file, and
+	 * activate the turbulent field component. The grid may be shared by
+	 * several fields, it replaces a Grid3f set before.
+	 */
+	void setTurbulentGrid(ref_ptr<QuantizedGrid3f> grid);
+
+	/**
+	 * Replace the striated and turbulent grids by quantized copies,
+	 * which need half the memory. The striated grid of +-1 is stored exactly,
+	 * the turbulent grid with the given encoding.
+	 */
+	void quantizeGrids(GridEncoding turbulentEncoding = GridInt16);
+
 	ref_ptr<Grid1f> getStriatedGrid();
 	ref_ptr<Grid3f> getTurbulentGrid();
+	ref_ptr<QuantizedGrid1f> getQuantizedStriatedGrid();
+	ref_ptr<QuantizedGrid3f> getQuantizedTurbulentGrid();
 
 	void setUseRegularField(bool use);
 	virtual void setUseStriatedField(bool use);
@@ -115,6 +142,11 @@ public:
 
 	double logisticFunction(const double& x, const double& x0, const double& w) const;
 
+	// Index of the spiral arm at (r, phi), found from the radius where the
+	// spiral through that position crosses the negative x-axis. Returns 8
+	// beyond the outermost arm.
+	int getArmIndex(const double& r, const double& phi) const;
+
 	// Regular field components
 	Vector3d getRegularField(const Vector3d& pos) const;
 	virtual Vector3d getDiskField(const double& r, const double& z, const double& phi, const double& sinPhi, const double& cosPhi) const;
@@ -132,6 +164,10 @@ public:
 
 	// All set field components
 	Vector3d getField(const Vector3d& pos) const;
+	void getFields(const Vector3d *positions, const double *z, Vector3d *fields, size_t count) const;
+
+	// All components vanish beyond 20 kpc from the Galactic center
+	bool getBoundingBox(Vector3d &lower, Vector3d &upper) const;
 };
 
 
@@ -46,6 +46,10 @@ private:
 	double r1s;
 	double r2s;
 
+	// index of the spiral arm of (r, phi) in phi0Arms, and the azimuth phi1 in [-pi, pi)
+	// at which the spiral field line through (r, phi) crosses the r1 - ring
+	int getSpiralArm(const double& r, const double& phi, double& phi1) const;
+
 public:
 /** Constructor
 	@param delta 	Transition width for the disk field such that the magnetic flux of the spiral field lines is redirected between r = 5 kpc and r = 5 kpc + delta as well as r = 20 kpc - delta and r = 20 kpc. The input parameter delta should be non-negative and smaller than 7.5 kpc. The default value is 3 kpc.
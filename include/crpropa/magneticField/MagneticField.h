@@ -5,6 +5,9 @@
 #include "crpropa/Vector3.h"
 #include "crpropa/Referenced.h"
 
+#include <algorithm>
+#include <vector>
+
 #ifdef CRPROPA_HAVE_MUPARSER
 #include "muParser.h"
 #endif
@@ -29,6 +32,52 @@ public:
 	virtual Vector3d getField(const Vector3d &position, double z) const {
 		return getField(position);
 	};
+	/**
+	 Fields at count positions and redshifts, used by batched integrators.
+	 Override for a vectorized evaluation, by default getField is called for each.
+	 */
+	virtual void getFields(const Vector3d *positions, const double *z, Vector3d *fields, size_t count) const {
+		for (size_t i = 0; i < count; i++)
+			fields[i] = getField(positions[i], z[i]);
+	};
+	/**
+	 Fields in single precision, used by the mixed-precision integrators.
+	 Override for fields stored in single precision, by default getFields is
+	 called and the results are converted.
+	 */
+	virtual void getFieldsFloat(const Vector3d *positions, const double *z, Vector3f *fields, size_t count) const {
+		Vector3d buffer[16];
+		for (size_t i = 0; i < count; i += 16) {
+			size_t n = std::min(count - i, size_t(16));
+			getFields(positions + i, z + i, buffer, n);
+			for (size_t j = 0; j < n; j++)
+				fields[i + j] = Vector3f(buffer[j]);
+		}
+	};
+
+	/**
+	 Axis-aligned box outside of which the field is zero, used by
+	 MagneticFieldList to skip the field. Returns false if the field is not
+	 bounded, which is the default.
+	 */
+	virtual bool getBoundingBox(Vector3d &lower, Vector3d &upper) const {
+		return false;
+	}
+
+	/**
+	 Bytes held by the field, e.g. by its grids. Grids shared between fields
+	 are counted by each of them. The default is 0.
+	 */
+	virtual size_t getMemoryUsage() const {
+		return 0;
+	}
+
+	/**
+	 Smallest batch of getFields that is evaluated on the offload device by
+	 the fields that support it, when built with ENABLE_OFFLOAD (default 4096).
+	 */
+	static void setOffloadThreshold(size_t count);
+	static size_t getOffloadThreshold();
 };
 
 /**
@@ -51,17 +100,40 @@ public:
 	bool isReflective();
 	void setReflective(bool reflective);
 	Vector3d getField(const Vector3d &position) const;
+	size_t getMemoryUsage() const;
 };
 
 /**
  @class MagneticFieldList
  @brief Magnetic field decorator implementing a superposition of fields.
+
+ Fields with a bounding box are only evaluated at positions inside of it. The
+ boxes are indexed with a regular grid of cells over their union, so that
+ getField only tests the fields whose box overlaps the cell of the position.
  */
 class MagneticFieldList: public MagneticField {
 	std::vector<ref_ptr<MagneticField> > fields;
+	std::vector<bool> bounded;
+	std::vector<Vector3d> lower, upper; // bounding boxes of the fields
+	static const int indexCells = 8; // cells of the index along each axis
+	Vector3d indexLower, indexCell;
+	std::vector<std::vector<size_t> > index; // fields to test in each cell
+	std::vector<size_t> unbounded; // fields to test outside of the cells
+	void updateIndex();
+	bool inside(size_t f, const Vector3d &position) const {
+		return (not bounded[f]) or ((position.x >= lower[f].x) and (position.x <= upper[f].x)
+				and (position.y >= lower[f].y) and (position.y <= upper[f].y)
+				and (position.z >= lower[f].z) and (position.z <= upper[f].z));
+	}
 public:
+	/** Add a field, bounded by its getBoundingBox if it has one */
 	void addField(ref_ptr<MagneticField> field);
+	/** Add a field that is zero outside of the given box */
+	void addField(ref_ptr<MagneticField> field, const Vector3d &lower, const Vector3d &upper);
 	Vector3d getField(const Vector3d &position) const;
+	Vector3d getField(const Vector3d &position, double z) const;
+	void getFields(const Vector3d *positions, const double *z, Vector3d *fields, size_t count) const;
+	size_t getMemoryUsage() const;
 };
 
 /**
@@ -74,6 +146,7 @@ class MagneticFieldEvolution: public MagneticField {
 public:
 	MagneticFieldEvolution(ref_ptr<MagneticField> field, double m);
 	Vector3d getField(const Vector3d &position, double z = 0) const;
+	size_t getMemoryUsage() const;
 };
 
 /**
@@ -89,6 +162,10 @@ public:
 	Vector3d getField(const Vector3d &position) const {
 		return value;
 	}
+	void getFields(const Vector3d *positions, const double *z, Vector3d *fields, size_t count) const {
+		for (size_t i = 0; i < count; i++)
+			fields[i] = value;
+	}
 };
 
 /**
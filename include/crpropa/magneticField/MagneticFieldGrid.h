@@ -2,7 +2,15 @@
 #define CRPROPA_MAGNETICFIELDGRID_H
 
 #include "crpropa/magneticField/MagneticField.h"
+#include "crpropa/AMRGrid.h"
 #include "crpropa/Grid.h"
+#include "crpropa/MappedGrid.h"
+#include "crpropa/SlabDecomposition.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
 
 namespace crpropa {
 /**
@@ -15,14 +23,194 @@ namespace crpropa {
  @brief Magnetic field on a periodic (or reflective), cartesian grid with trilinear interpolation.
 
  This class wraps a Grid3f to serve as a MagneticField.
+ When built with ENABLE_OFFLOAD, the values of a periodic, linear grid with
+ trilinear interpolation are copied to the offload device by setGrid, and
+ batches of getFields of at least getOffloadThreshold() positions are
+ interpolated there. Values changed afterwards require another setGrid.
+
+ On NUMA systems a read-only grid can be copied to each node with
+ setNumaReplicas, so that each thread interpolates the copy on its own node.
  */
 class MagneticFieldGrid: public MagneticField {
 	ref_ptr<Grid3f> grid;
+	const float *deviceData; // values mapped to the offload device
+	size_t deviceSize;
+	bool numaReplicas;
+	std::vector<ref_ptr<Grid3f> > replicas; // by NUMA node
+	void unmapDevice();
+	void makeReplicas();
+	const Grid3f &localGrid() const;
 public:
 	MagneticFieldGrid(ref_ptr<Grid3f> grid);
+	~MagneticFieldGrid();
 	void setGrid(ref_ptr<Grid3f> grid);
 	ref_ptr<Grid3f> getGrid();
+	/**
+	 Keep a copy of the grid on each NUMA node, read by the threads running on
+	 the node (which are to be bound, e.g. by OMP_PROC_BIND). The copies are
+	 made now and by setGrid, values changed afterwards require another setGrid.
+	 Without several nodes no copies are made.
+	 */
+	void setNumaReplicas(bool b);
+	bool getNumaReplicas() const;
+	Vector3d getField(const Vector3d &position) const;
+	void getFields(const Vector3d *positions, const double *z, Vector3d *fields, size_t count) const;
+	/** Interpolated grid values without conversion to double precision */
+	void getFieldsFloat(const Vector3d *positions, const double *z, Vector3f *fields, size_t count) const;
+	size_t getMemoryUsage() const;
+};
+
+/**
+ @class MappedMagneticFieldGrid
+ @brief Magnetic field on a grid mapped from a file, see MappedGrid.
+
+ Opening the field is instant and the pages of the grid are shared by all
+ processes on a node, e.g. MappedGrid3f("field.grid", gauss).
+ */
+class MappedMagneticFieldGrid: public MagneticField {
+	ref_ptr<MappedGrid3f> grid;
+public:
+	MappedMagneticFieldGrid(ref_ptr<MappedGrid3f> grid);
+	void setGrid(ref_ptr<MappedGrid3f> grid);
+	ref_ptr<MappedGrid3f> getGrid();
+	Vector3d getField(const Vector3d &position) const;
+	void getFields(const Vector3d *positions, const double *z, Vector3d *fields, size_t count) const;
+};
+
+/**
+ @class SnapshotMagneticFieldGrid
+ @brief Time-dependent magnetic field from a series of grid snapshots at given redshifts
+
+ The field at redshift z is interpolated linearly in z between the two
+ snapshots bracketing it, and is that of the first or last snapshot outside
+ of their range. The snapshots are grid files, e.g. written with
+ MappedGrid3f::save from the Grid3f of each output of a cosmological MHD
+ simulation, and mapped on first use, see MappedGrid.
+
+ As the candidates move to lower redshifts, the snapshot below the
+ bracketing ones is mapped and its pages are read by a background thread
+ ahead of use. While the mapped snapshots exceed the memory budget, the
+ least recently used ones are unmapped, never those of the current lookup;
+ threads still interpolating an unmapped snapshot keep it until they are
+ done. The budget should hold the snapshots of all redshifts in flight, at
+ least three, otherwise they are mapped again and again.
+ Snapshots are to be added before the simulation.
+ */
+class SnapshotMagneticFieldGrid: public MagneticField {
+	struct Snapshot {
+		double z;
+		std::string filename;
+		ref_ptr<MappedGrid3f> grid; // 0 if not mapped
+		uint64_t lastUse;
+	};
+	mutable std::vector<Snapshot> snapshots; // ascending in z
+	double factor;
+	size_t memoryBudget;
+	bool prefetching;
+
+	mutable std::mutex mutex; // guards the grids and the use counter
+	mutable uint64_t uses;
+	mutable std::thread prefetcher;
+	mutable std::atomic<bool> prefetched;
+
+	void bracket(double z, size_t &i, size_t &j, double &w) const;
+	ref_ptr<MappedGrid3f> acquire(size_t i) const;
+	void evict(size_t i, size_t j) const;
+	void prefetch(size_t i) const;
+	void load(size_t i) const;
+	void joinPrefetcher() const;
+public:
+	/**
+	 @param factor			conversion factor of the grid values, e.g. gauss
+	 @param memoryBudget	bytes of the mapped snapshots, 0 for no limit
+	 */
+	SnapshotMagneticFieldGrid(double factor = 1, size_t memoryBudget = 0);
+	~SnapshotMagneticFieldGrid();
+	/** Add the snapshot at redshift z from a file written with MappedGrid::save */
+	void addSnapshot(double z, const std::string &filename);
+	size_t getNumberOfSnapshots() const;
+	double getSnapshotRedshift(size_t i) const;
+	void setMemoryBudget(size_t bytes);
+	size_t getMemoryBudget() const;
+	/** Map and read the next snapshot in a background thread, true by default */
+	void setPrefetching(bool b);
+	bool isPrefetching() const;
+	/** Number of snapshots mapped at the moment */
+	size_t getNumberOfMappedSnapshots() const;
+	/** Field at redshift 0 */
+	Vector3d getField(const Vector3d &position) const;
+	Vector3d getField(const Vector3d &position, double z) const;
+	void getFields(const Vector3d *positions, const double *z, Vector3d *fields, size_t count) const;
+	/** Bytes of the mapped snapshots */
+	size_t getMemoryUsage() const;
+};
+
+/**
+ @class AMRMagneticFieldGrid
+ @brief Magnetic field on an adaptive mesh, see AMRGrid.
+
+ Native replacement of the SAGA based AMRMagneticField, e.g. with
+ loadFLASHMagneticField.
+ */
+class AMRMagneticFieldGrid: public MagneticField {
+	ref_ptr<AMRGrid3f> grid;
+public:
+	AMRMagneticFieldGrid(ref_ptr<AMRGrid3f> grid);
+	void setGrid(ref_ptr<AMRGrid3f> grid);
+	ref_ptr<AMRGrid3f> getGrid();
+	Vector3d getField(const Vector3d &position) const;
+	void getFields(const Vector3d *positions, const double *z, Vector3d *fields, size_t count) const;
+	size_t getMemoryUsage() const;
+};
+
+/**
+ @class DistributedMagneticFieldGrid
+ @brief Magnetic field on a periodic grid of which each rank holds one slab
+
+ The grid is decomposed along x into one slab per rank, see
+ SlabDecomposition. Each rank holds only the grid points of its own slab
+ and of ghostLayers planes on either side, so that grids larger than the
+ memory of a node can be distributed over the nodes of a cluster. The
+ field is exact for positions in the slab and within ghostLayers - 1 grid
+ spacings around it; the ghost layers should therefore cover the largest
+ step. With ModuleList::runDomainDecomposed the candidates that leave the
+ slab are migrated to their owning rank.
+ */
+class DistributedMagneticFieldGrid: public MagneticField {
+	ref_ptr<Grid3f> grid; // slab with ghost layers
+	ref_ptr<SlabDecomposition> decomposition;
+	int rank;
+	size_t ghostLayers;
+	double lengthX, lowerX;
+
+	size_t init(const GridProperties &p, int nRanks);
+	double localX(double x) const;
+public:
+	/**
+	 Read the slab of a rank from a raw file of dumpGrid
+	 @param filename	raw file with the values of the whole grid
+	 @param properties	geometry of the whole grid, which has to be periodic
+	 @param rank		rank of this process
+	 @param nRanks		number of ranks
+	 @param ghostLayers	number of grid planes kept on either side of the slab
+	 @param c			conversion factor of the file values, e.g. gauss
+	 */
+	DistributedMagneticFieldGrid(const std::string &filename, const GridProperties &properties,
+			int rank, int nRanks, size_t ghostLayers = 2, double c = 1);
+	/** Slab of a rank of a grid in memory */
+	DistributedMagneticFieldGrid(ref_ptr<Grid3f> grid, int rank, int nRanks, size_t ghostLayers = 2);
+
+	ref_ptr<SlabDecomposition> getDecomposition() const;
+	/** Grid of the slab including the ghost layers */
+	ref_ptr<Grid3f> getLocalGrid() const;
+	int getRank() const;
+	size_t getGhostLayers() const;
+	/** Whether a position is in the slab of this rank */
+	bool isLocal(const Vector3d &position) const;
+
 	Vector3d getField(const Vector3d &position) const;
+	void getFields(const Vector3d *positions, const double *z, Vector3d *fields, size_t count) const;
+	size_t getMemoryUsage() const;
 };
 
 /**
@@ -32,6 +220,9 @@ public:
  This class wraps a Grid3f to serve as a MagneticField.
  The field is modulated on-the-fly with a Grid1f.
  The Grid3f and Grid1f do not need to share the same origin, spacing or size.
+ If they share them and the layout, the trilinear lookups of both grids are
+ fused into one pass, with different boundary conditions only away from the
+ outer half cells of the grid.
  */
 class ModulatedMagneticFieldGrid: public MagneticField {
 	ref_ptr<Grid3f> grid;
@@ -46,7 +237,59 @@ public:
 	ref_ptr<Grid1f> getModulationGrid();
 	void setReflective(bool gridReflective, bool modGridReflective);
 	Vector3d getField(const Vector3d &position) const;
+	size_t getMemoryUsage() const;
 };
+
+/**
+ @class EnsembleMagneticFieldGrid
+ @brief One realization of an ensemble of fields derived from a single periodic grid.
+
+ The realization selected by the seed is the field of the grid, translated by
+ a random offset within the periodic cell and transformed by a random element
+ of its symmetry group: a permutation of the axes (only if the extents of the
+ grid are equal) and reflections of the axes. The field vector is rotated
+ with the positions, B'(x) = R B(R^T (x - o) + o + t) for the grid origin o,
+ so that statistically isotropic, homogeneous turbulence (e.g. from
+ SimpleGridTurbulence) yields statistically equivalent, distinct fields.
+ Reflections invert the helicity, disable them for HelicalGridTurbulence.
+
+ The fields of all realizations share the grid, so that an ensemble costs
+ no further memory and no further FFTs.
+ */
+class EnsembleMagneticFieldGrid: public MagneticField {
+	ref_ptr<Grid3f> grid;
+	uint64_t seed;
+	bool reflections;
+	Vector3d translation;
+	int axes[3]; // axis of the grid for each axis of the field
+	double signs[3];
+	void init();
+	Vector3d toGrid(const Vector3d &position) const;
+	Vector3d fromGrid(const Vector3f &field) const;
+public:
+	/**
+	 @param grid		periodic grid shared by the realizations
+	 @param seed		selects the realization, 0 is the untransformed grid
+	 @param reflections	whether the axes may be reflected
+	 */
+	EnsembleMagneticFieldGrid(ref_ptr<Grid3f> grid, uint64_t seed = 0, bool reflections = true);
+	void setGrid(ref_ptr<Grid3f> grid);
+	ref_ptr<Grid3f> getGrid();
+	void setSeed(uint64_t seed);
+	uint64_t getSeed() const;
+	void setReflections(bool reflections);
+	bool getReflections() const;
+	/** Offset [m] of the realization, added to the positions in the grid frame */
+	Vector3d getTranslation() const;
+	/** Axis of the grid and its sign (+-1) for axis i of the field */
+	int getAxis(int i) const;
+	double getSign(int i) const;
+	Vector3d getField(const Vector3d &position) const;
+	void getFields(const Vector3d *positions, const double *z, Vector3d *fields, size_t count) const;
+	/** Bytes of the grid, which is shared by the realizations */
+	size_t getMemoryUsage() const;
+};
+
 /** @} */
 } // namespace crpropa
 
@@ -38,6 +38,8 @@ class GridTurbulence : public TurbulentField {
 	               const GridProperties &gridProp, unsigned int seed = 0);
 
 	Vector3d getField(const Vector3d &pos) const;
+	/** Bytes of the grid, the FFT buffers are released after the initialization */
+	size_t getMemoryUsage() const;
 
 	/** Return a const reference to the grid */
 	const ref_ptr<Grid3f> &getGrid() const;
@@ -46,11 +48,50 @@ class GridTurbulence : public TurbulentField {
 	// Check the grid properties before the FFT procedure
 	static void checkGridRequirements(ref_ptr<Grid3f> grid, double lMin,
 	                                  double lMax);
-	// Execute inverse discrete FFT in-place for a 3D grid, from complex to real
-	// space
+	static void checkGridRequirements(const GridProperties &gridProp, double lMin,
+	                                  double lMax);
+	// Execute inverse discrete FFT for a 3D grid, from complex to real
+	// space, with one plan per component
 	static void executeInverseFFTInplace(ref_ptr<Grid3f> grid,
 	                                     fftwf_complex *Bkx, fftwf_complex *Bky,
 	                                     fftwf_complex *Bkz);
+	/**
+	 Plan the inverse FFT of all three components of B(k) into the grid in
+	 one batched, multi-threaded transform. Bk holds the x, y and z
+	 components one after another, each n * n * (n / 2 + 1) modes. With a
+	 wisdom file the plan is measured, which overwrites Bk and the grid, so
+	 the modes have to be set after the planning.
+	 */
+	static fftwf_plan planInverseFFT(ref_ptr<Grid3f> grid, fftwf_complex *Bk);
+	/** Execute and destroy a plan of planInverseFFT */
+	static void executeInverseFFT(fftwf_plan plan);
+
+	/**
+	 File to cache the FFTW plans (wisdom) between runs. If set, the plans
+	 are measured once for each grid size and loaded from the file
+	 afterwards, otherwise they are estimated. Empty to disable.
+	 */
+	static void setWisdomFile(const std::string &filename);
+	static std::string getWisdomFile();
+
+	/**
+	 Generate the field of a GridTurbulence out of core, for grids larger
+	 than the memory. The field is written to a file that MappedGrid3f
+	 maps, and is the same as in memory for the same seed up to rounding.
+	 The inverse FFT is split into transforms along y of every x-plane,
+	 which are kept in a scratch file, and transforms along x and z of
+	 blocks of y-rows, written to the output in slabs.
+	 @param spectrum	spectrum of the turbulence
+	 @param gridProp	geometry of the grid
+	 @param filename	output file, the scratch file filename.scratch of
+	 					about 1.5 times its size is removed at the end
+	 @param seed		random seed
+	 @param memoryLimit	approximate memory for the buffers in bytes
+	 */
+	static void generateToFile(const TurbulenceSpectrum &spectrum,
+	                           const GridProperties &gridProp,
+	                           const std::string &filename, unsigned int seed = 0,
+	                           size_t memoryLimit = size_t(1) << 30);
 
 	// Usefull checks for a grid field
 	/** Evaluate the mean vector of all grid points */
@@ -3,6 +3,7 @@
 
 #include "crpropa/Grid.h"
 #include "crpropa/magneticField/turbulentField/TurbulentField.h"
+#include <string>
 #include <vector>
 
 namespace crpropa {
@@ -34,18 +35,20 @@ Furthermore, depending on the exact setting, the implementation is somewhat slow
 
  ## Using the SIMD optimization
  In order to mitigate some of the performance impact that is inherent in this
-method of field generation, an optimized version utilizing data-level
-parallelism through SIMD instructions is provided. More specifically, this
-implementation uses the AVX extension to the x86 instruction set. In order to
-use this optimized version, three conditions need to be met:
-
-1. The `USE_SIMD` option should be explicitly enabled in CMake. Currently,
-this sets GCC flags that tell the compiler to allow SIMD instructions.
-2. One also should enable the `FAST_WAVES` option to tell the compiler that you
-specifically want it to include the SIMD version of PlaneWaveTurbulence.
-3. Finally, the CPU that will actually run the code needs to support the
-required extensions: AVX and everything below. These extensions are relatively
-common, but there may still be processors in use that do not support them.
+method of field generation, optimized kernels utilizing data-level parallelism
+through SIMD instructions are provided for AVX, AVX2 with FMA and AVX-512 on
+x86 and for NEON on 64 bit ARM. They are compiled with the `FAST_WAVES` option
+in CMake (on by default) without any global compiler flags, and the fastest
+kernel that the CPU supports is selected at run time when the field is
+constructed. One build can thus be shared between different machines. The
+kernels evaluate the cosine with a polynomial approximation; setKernel("scalar")
+selects the exact evaluation of the plain implementation.
+
+ ## Offloading
+ When built with the `ENABLE_OFFLOAD` option, the modes are copied to the
+OpenMP offload device (e.g. a GPU) at construction, and batches of getFields
+of at least MagneticField::getOffloadThreshold() positions are evaluated there
+with the exact cosine, independent of the selected kernel.
 
 [GJ99]: https://doi.org/10.1086/307452
 [TD13]: https://doi.org/10.1063/1.4789861
@@ -62,24 +65,15 @@ class PlaneWaveTurbulence : public TurbulentField {
 	std::vector<double> Ak;
 	std::vector<double> k;
 
-	// data for FAST_WAVES
-	int avx_Nm;
+	// data for the SIMD kernels: the arrays of the modes padded with zero
+	// amplitudes to simd_Nm values each, starting at align_offset
+	int simd_Nm;
 	int align_offset;
-	std::vector<double> avx_data;
-	// the following are index bases into the avx_data array.
-	// since each subarray has avx_Nm elements, the start offset
-	// of each subarray can be computed by multiplying the two,
-	// and then adding on the alignment offset.
-	// iAxi is a combined array containing the product of Ak * xi
-	static const int iAxi0 = 0;
-	static const int iAxi1 = 1;
-	static const int iAxi2 = 2;
-	// ikkappa is a combined array containing the product of k * kappa
-	static const int ikkappa0 = 3;
-	static const int ikkappa1 = 4;
-	static const int ikkappa2 = 5;
-	static const int ibeta = 6;
-	static const int itotal = 7;
+	std::vector<double> simd_data;
+	std::string kernelName;
+	Vector3d (*kernel)(const double *data, int n, const Vector3d &pos);
+	void (*fieldsKernel)(const double *data, int n, const Vector3d *positions,
+	                     Vector3d *fields, size_t count);
 
   public:
 	/**
@@ -95,6 +89,7 @@ class PlaneWaveTurbulence : public TurbulentField {
 	*/
 	PlaneWaveTurbulence(const TurbulenceSpectrum &spectrum, int Nm = 64,
 	                    int seed = 0);
+	~PlaneWaveTurbulence();
 
 	/**
 	   Evaluates the field at the given position.
@@ -102,6 +97,26 @@ class PlaneWaveTurbulence : public TurbulentField {
 	   Theoretical runtime is O(Nm), where Nm is the number of wavemodes.
 	*/
 	Vector3d getField(const Vector3d &pos) const;
+
+	/**
+	   Evaluates the field at count positions. The wavemodes are looped over in
+	   blocks that stay in the cache: the SIMD kernels evaluate four positions
+	   per pass over a block of modes from the registers, the scalar kernel
+	   loops over the modes for chunks of positions in the order of getField.
+	*/
+	void getFields(const Vector3d *positions, const double *z, Vector3d *fields,
+	               size_t count) const;
+
+	/**
+	   Select the kernel of getField: "scalar", "avx", "avx2", "avx512" or
+	   "neon". Throws if the kernel is not compiled in or not supported by the
+	   CPU. The constructor selects the fastest supported one.
+	*/
+	void setKernel(const std::string &name);
+	/** Name of the selected kernel */
+	std::string getKernel() const;
+	/** Kernels that are compiled in and supported by the CPU, fastest last */
+	static std::vector<std::string> getSupportedKernels();
 };
 
 /** @} */
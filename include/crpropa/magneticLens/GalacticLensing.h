@@ -0,0 +1,61 @@
+#ifndef CRPROPA_GALACTICLENSING_H
+#define CRPROPA_GALACTICLENSING_H
+
+#include "crpropa/Module.h"
+#include "crpropa/magneticLens/MagneticLens.h"
+
+namespace crpropa {
+/**
+ * \addtogroup MagneticLenses
+ * @{
+ */
+
+/// Galactic propagation by a MagneticLens within the simulation.
+/// A candidate entering the boundary sphere of the lens, i.e. inside the
+/// sphere at the end of a step that began outside, is not propagated through
+/// the Galactic field: its direction is transformed by
+/// MagneticLens::transformCosmicRay at its rigidity E / Z, it is moved to the
+/// observer and handed to the detection action, e.g. an output, and
+/// deactivated. Candidates lost by the lens are deactivated without
+/// detection. Neutral particles keep their direction. The path in the
+/// Galaxy is counted as the straight distance to the observer.
+/// The simulation coordinates are those of the lens, as with LensBuilder,
+/// whose observer and boundary are the defaults. The lens is not owned and
+/// has to outlive the module.
+class GalacticLensing: public Module {
+	MagneticLens *lens;
+	Vector3d center;
+	double radius;
+	Vector3d observer;
+	ref_ptr<Module> detectionAction;
+	bool clone;
+	bool makeInactive;
+
+public:
+	/// @param lens		lens of the Galactic field
+	/// @param center	center of the boundary sphere of the lens
+	/// @param radius	radius of the boundary sphere
+	/// @param observer	position of the observer
+	GalacticLensing(MagneticLens *lens, const Vector3d &center = Vector3d(0.),
+			double radius = 20 * kpc, const Vector3d &observer = Vector3d(-8.5 * kpc, 0, 0));
+
+	void setLens(MagneticLens *lens);
+	void setBoundary(const Vector3d &center, double radius);
+	void setObserverPosition(const Vector3d &position);
+	Vector3d getCenter() const;
+	double getRadius() const;
+	Vector3d getObserverPosition() const;
+
+	/// Module the lensed candidates are handed to, e.g. an output
+	void onDetection(Module *action, bool clone = false);
+	/// Deactivate the lensed candidates after the detection action, true by default
+	void setDeactivateOnDetection(bool deactivate);
+
+	void process(Candidate *candidate) const;
+	std::string getDescription() const;
+};
+
+/** @}*/
+} // namespace crpropa
+
+#endif // CRPROPA_GALACTICLENSING_H
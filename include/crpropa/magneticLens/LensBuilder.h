@@ -0,0 +1,152 @@
+#ifndef LENSBUILDER_HH
+#define LENSBUILDER_HH
+
+#include "crpropa/magneticLens/ModelMatrix.h"
+#include "crpropa/magneticLens/Pixelization.h"
+#include "crpropa/magneticField/MagneticField.h"
+#include "crpropa/module/PropagationCK.h"
+#include "crpropa/Vector3.h"
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+namespace crpropa
+{
+/**
+ * \addtogroup MagneticLenses
+ * @{
+ */
+
+/// Counts of a lens part built in pieces: the number of particles launched
+/// into each observed pixel and, for every (observed pixel, extragalactic
+/// pixel), the number of them reaching the boundary in the extragalactic
+/// pixel. Accumulators of independent jobs are merged by summing the counts,
+/// so a lens part can be built on a job array and refined later with more
+/// particles; the lens part itself is the counts of each observed pixel
+/// divided by the particles launched into it.
+class LensAccumulator
+{
+	ModelMatrixType counts;
+	std::vector<double> launched;
+	double rigidityMin;
+	double rigidityMax;
+
+public:
+	/// Empty accumulator, takes the size and rigidity range of the first
+	/// counts added
+	LensAccumulator();
+	/// Rigidities in Joule
+	LensAccumulator(uint32_t nPix, double rigidityMin, double rigidityMax);
+	/// Reads an accumulator written by save
+	LensAccumulator(const std::string &filename);
+
+	bool empty() const;
+	uint32_t getNumberOfPixels() const;
+	/// Rigidity range in Joule
+	double getMinimumRigidity() const;
+	double getMaximumRigidity() const;
+	/// Particles launched into the observed pixel
+	double getLaunched(uint32_t pixel) const;
+	double getTotalLaunched() const;
+	/// Particles arrived, rows are the observed pixels
+	const ModelMatrixType& getCounts() const;
+
+	/// Adds the counts and launched particles per observed pixel of a job
+	void add(const ModelMatrixType &counts, const std::vector<double> &launched);
+	/// Adds the counts of another accumulator of the same pixelization and
+	/// rigidity range
+	void merge(const LensAccumulator &other);
+	/// Adds the counts of an accumulator file
+	void merge(const std::string &filename);
+
+	/// Writes the counts in a binary format, see the constructor
+	void save(const std::string &filename) const;
+	/// The lens part: the counts of each observed pixel divided by the
+	/// particles launched into it
+	void getLensPart(ModelMatrixType &M) const;
+};
+
+/// Writes the lens file (as read by MagneticLens::loadLens) and a lens part
+/// <lens>_<i>.mldat for every accumulator file, in ascending rigidity. The
+/// rigidity ranges must not overlap. Normalize the lens afterwards, e.g. with
+/// MagneticLens::normalizeLens.
+void writeLens(const std::string &filename, const std::vector<std::string> &accumulators);
+
+/// Generates the lens parts of a MagneticLens by backtracking antiprotons
+/// through a magnetic field.
+/// For every pixel of the observed sky a number of directions, uniformly
+/// distributed in the pixel, are launched from the observer and propagated
+/// with PropagationCK until they leave the boundary sphere, the particles of
+/// a pixel in one batch. The pixel of the final direction is the
+/// extragalactic direction the cosmic ray came from, so that particle adds
+/// 1 / particlesPerPixel to the matrix element
+/// (observed pixel, extragalactic pixel). Particles that do not reach the
+/// boundary within the maximum trajectory length are dropped.
+/// The rigidity of each particle is drawn log-uniformly in its rigidity bin.
+/// The random numbers are counter-based streams derived from the seed, the
+/// bin, the job and the pixel, so the lens does not depend on the number of
+/// threads. Independent jobs of the same bin use different job numbers and
+/// accumulate counts (see LensAccumulator) that are merged later.
+class LensBuilder
+{
+	ref_ptr<PropagationCK> propagation;
+	Pixelization pixelization;
+	std::vector<double> rigidities;
+	Vector3d observer;
+	Vector3d center;
+	double radius;
+	double maxTrajectoryLength;
+	size_t particlesPerPixel;
+	uint64_t seed;
+
+public:
+	/// Rigidities are the bin edges in Joule (E / Z for protons), in
+	/// ascending order, one lens part is created per bin
+	LensBuilder(ref_ptr<MagneticField> field,
+			const std::vector<double> &rigidities, uint8_t healpixOrder = 6);
+
+	/// Position of the observer, default 8.5 kpc from the galactic centre
+	void setObserverPosition(const Vector3d &position);
+	/// Sphere at which the backtracking ends, default 20 kpc around the origin
+	void setBoundary(const Vector3d &center, double radius);
+	/// Particles exceeding this length are dropped, default 1 Mpc
+	void setMaximumTrajectoryLength(double length);
+	void setParticlesPerPixel(size_t n);
+	void setSeed(uint64_t seed);
+
+	const Pixelization& getPixelization() const
+	{
+		return pixelization;
+	}
+	/// The propagation module, e.g. to set its tolerance and step sizes
+	ref_ptr<PropagationCK> getPropagation() const;
+	size_t getNumberOfParts() const;
+	size_t getParticlesPerPixel() const;
+
+	/// Backtracks an antiproton launched from the observer in the given
+	/// direction. Returns the direction at the boundary, or a null vector if
+	/// the particle is lost.
+	Vector3d backtrack(const Vector3d &direction, double rigidity) const;
+	/// Backtracks the candidates together until they leave the boundary.
+	/// Candidates exceeding the maximum trajectory length are deactivated.
+	void backtrack(Candidate **candidates, size_t count) const;
+
+	/// Computes the matrix of the given rigidity bin, the lens part of job 0
+	void buildLensPart(size_t bin, ModelMatrixType &M) const;
+
+	/// Adds the counts of particlesPerPixel particles per pixel of the given
+	/// job to the accumulator, which is empty or of the same rigidity bin
+	void accumulateLensPart(size_t bin, LensAccumulator &accumulator, uint64_t job = 0) const;
+
+	/// Writes the lens file (as read by MagneticLens::loadLens) and the
+	/// matrix of every rigidity bin next to it, named <lens>_<bin>.mldat.
+	/// Parts present from an earlier run are kept, so an interrupted build
+	/// is resumed with the next missing bin.
+	void buildLens(const std::string &filename) const;
+};
+
+/** @}*/
+} // namespace
+
+#endif // LENSBUILDER_HH
@@ -28,19 +28,24 @@
 #include "crpropa/Units.h"
 #include "crpropa/Vector3.h"
 
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <stdexcept>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <stdint.h>
 
 
 namespace crpropa
 {
 
-/// Holds one matrix for the lens and information about the rigidity range
+/// Holds one matrix for the lens and information about the rigidity range.
+/// A matrix given by file is read on first use and may be unloaded again,
+/// the normalizations applied to it are repeated when it is read again.
 class LensPart
 {
 	string _filename;
@@ -49,16 +54,57 @@ class LensPart
 	ModelMatrixType M;
 	double _maximumSumOfColumns;
 	bool _maximumSumOfColumns_calculated;
+	bool _loaded;
+	bool _persistent;
+	bool _columnsNormalized;
+	double _norm;
+	uint64_t _lastAccess;
+	// cumulative sums of the values of each column, in the order of storage
+	std::vector<double> _cumulative;
+	std::unique_ptr<std::once_flag> _cumulativeBuilt;
+
+	void ensureLoaded()
+	{
+		if (!_loaded)
+			loadMatrixFromFile();
+	}
+
+	void buildCumulative()
+	{
+		M.makeCompressed();
+		_cumulative.resize(M.nonZeros());
+		const ModelMatrixType::StorageIndex *outer = M.outerIndexPtr();
+		const double *values = M.valuePtr();
+		for (size_t c = 0; c < (size_t) M.cols(); c++)
+		{
+			double sum = 0;
+			for (size_t k = outer[c]; k < (size_t) outer[c + 1]; k++)
+			{
+				sum += values[k];
+				_cumulative[k] = sum;
+			}
+		}
+	}
+
+	void invalidateCumulative()
+	{
+		_cumulativeBuilt.reset(new std::once_flag);
+		std::vector<double>().swap(_cumulative);
+	}
 
 public:
-	LensPart()
+	LensPart() :
+			_rigidityMin(0), _rigidityMax(0), _maximumSumOfColumns(0), _maximumSumOfColumns_calculated(
+					false), _loaded(false), _persistent(false), _columnsNormalized(false), _norm(1), _lastAccess(
+					0), _cumulativeBuilt(new std::once_flag)
 	{
 	}
 	/// File containing the matrix to be used in the range rigidityMin,
 	/// rigidityMax in Joule
 	LensPart(const std::string &filename, double rigidityMin, double rigidityMax) :
-			_filename(filename), _rigidityMin(rigidityMin), _rigidityMax(rigidityMax), _maximumSumOfColumns_calculated(
-					false), _maximumSumOfColumns(0)
+			_filename(filename), _rigidityMin(rigidityMin), _rigidityMax(rigidityMax), _maximumSumOfColumns(0), _maximumSumOfColumns_calculated(
+					false), _loaded(false), _persistent(false), _columnsNormalized(false), _norm(1), _lastAccess(
+					0), _cumulativeBuilt(new std::once_flag)
 	{
 	}
 
@@ -66,10 +112,48 @@ public:
 	{
 	}
 
-	/// Loads the matrix from file
+	/// Loads the matrix from file and applies the normalizations
 	void loadMatrixFromFile()
 	{
 		deserialize(_filename, M);
+		if (_columnsNormalized)
+			::crpropa::normalizeColumns(M);
+		if (_norm != 1)
+			::crpropa::normalizeMatrix(M, _norm);
+		_loaded = true;
+		invalidateCumulative();
+	}
+
+	/// Frees the matrix if it can be read again from file
+	void unloadMatrix()
+	{
+		if (_persistent or !_loaded)
+			return;
+		ModelMatrixType().swap(M);
+		_loaded = false;
+		invalidateCumulative();
+	}
+
+	/// Returns true if the matrix is in memory
+	bool isLoaded() const
+	{
+		return _loaded;
+	}
+
+	/// Returns true if the matrix was set directly and cannot be unloaded
+	bool isPersistent() const
+	{
+		return _persistent;
+	}
+
+	/// Returns the memory used by the matrix in bytes
+	size_t getMemoryUsage() const
+	{
+		if (!_loaded)
+			return 0;
+		return M.nonZeros() * (sizeof(double) + sizeof(ModelMatrixType::StorageIndex))
+				+ (M.outerSize() + 1) * sizeof(ModelMatrixType::StorageIndex)
+				+ _cumulative.size() * sizeof(double);
 	}
 
 	/// Returns the filename of the matrix
@@ -83,12 +167,33 @@ public:
 	{
 		if (!_maximumSumOfColumns_calculated)
 		{ // lazy calculation of maximum
+			ensureLoaded();
 			_maximumSumOfColumns = maximumOfSumsOfColumns(M);
 			_maximumSumOfColumns_calculated = true;
 		}
 		return _maximumSumOfColumns;
 	}
 
+	/// Divides the matrix by norm
+	void normalizeMatrix(double norm)
+	{
+		_norm *= norm;
+		if (_loaded)
+			::crpropa::normalizeMatrix(M, norm);
+		invalidateCumulative();
+	}
+
+	/// Normalizes all columns of the matrix
+	void normalizeMatrixColumns()
+	{
+		// replaces all previous normalizations
+		_columnsNormalized = true;
+		_norm = 1;
+		if (_loaded)
+			::crpropa::normalizeColumns(M);
+		invalidateCumulative();
+	}
+
 	/// Returns the minimum of the rigidity range for the lenspart in eV
 	double getMinimumRigidity()
 	{
@@ -101,9 +206,12 @@ public:
 		return _rigidityMax / eV;
 	}
 
-	/// Returns the modelmatrix
+	/// Returns the modelmatrix, reading it from file if needed. Not thread
+	/// safe if the matrix is not loaded yet. Changes made through the
+	/// reference are not seen by sampleColumn once it was used.
 	ModelMatrixType& getMatrix()
 	{
+		ensureLoaded();
 		return M;
 	}
 
@@ -111,9 +219,41 @@ public:
 	void setMatrix(const ModelMatrixType& m)
 	{
 		M = m;
+		_loaded = true;
+		_persistent = true;
+		_columnsNormalized = false;
+		_norm = 1;
+		invalidateCumulative();
 	}
 
+	/// Returns the row drawn from column c with the probabilities given by
+	/// the column for a uniform random number rn in [0, 1), or -1 if rn
+	/// exceeds the sum of the column. The cumulative sums are calculated on
+	/// first use, by binary search.
+	int sampleColumn(uint32_t c, double rn)
+	{
+		ensureLoaded();
+		std::call_once(*_cumulativeBuilt, &LensPart::buildCumulative, this);
+		const ModelMatrixType::StorageIndex *outer = M.outerIndexPtr();
+		std::vector<double>::const_iterator begin = _cumulative.begin() + outer[c];
+		std::vector<double>::const_iterator end = _cumulative.begin() + outer[c + 1];
+		std::vector<double>::const_iterator i = std::upper_bound(begin, end, rn);
+		if (i == end)
+			return -1;
+		return M.innerIndexPtr()[outer[c] + (i - begin)];
+	}
 
+	/// Returns the position of the last access in the order of accesses
+	uint64_t getLastAccess() const
+	{
+		return _lastAccess;
+	}
+
+	/// Sets the position of the last access in the order of accesses
+	void setLastAccess(uint64_t access)
+	{
+		_lastAccess = access;
+	}
 };
 
 /// Function to calculate the mean deflection [rad] of the matrix M, given a pixelization
@@ -164,24 +304,40 @@ class MagneticLens
 	double _maximumRigidity;
 	static bool _randomSeeded;
 	double _norm;
+	// maximum memory of the lens parts read from file [bytes], 0 = unlimited
+	size_t _memoryBudget;
+	mutable uint64_t _accessCounter;
+	std::unique_ptr<std::mutex> _mutex;
+
+	// Returns the lens part with rigidity [Joule] without loading it
+	LensPart* _findLensPart(double rigidity) const;
+	// Loads the lens part if needed, marks it as most recently used and
+	// unloads the least recently used parts exceeding the memory budget
+	void _acquire(LensPart *part) const;
+	// Unloads least recently used parts except keep, needs the lock
+	void _evict(const LensPart *keep) const;
+	void _checkMatrixSize(uint32_t rows, uint32_t cols);
 
 public:
 	/// Default constructor
 	MagneticLens() :
-			_pixelization(NULL), _minimumRigidity(DBL_MAX), _maximumRigidity(DBL_MIN), _norm(1)
+			_pixelization(NULL), _minimumRigidity(DBL_MAX), _maximumRigidity(DBL_MIN), _norm(1), _memoryBudget(
+					0), _accessCounter(0), _mutex(new std::mutex)
 	{
 	}
 
 	/// Constructs lens with predefined healpix order
 	MagneticLens(uint8_t healpixorder) :
-			_pixelization(NULL), _minimumRigidity(DBL_MAX), _maximumRigidity(DBL_MIN)
+			_pixelization(NULL), _minimumRigidity(DBL_MAX), _maximumRigidity(DBL_MIN), _norm(1), _memoryBudget(
+					0), _accessCounter(0), _mutex(new std::mutex)
 	{
 		_pixelization = new Pixelization(healpixorder);
 	}
 
 	/// Construct lens and load lens from file
 	MagneticLens(const string &filename) :
-			_pixelization(NULL), _minimumRigidity(DBL_MAX), _maximumRigidity(DBL_MIN)
+			_pixelization(NULL), _minimumRigidity(DBL_MAX), _maximumRigidity(DBL_MIN), _norm(1), _memoryBudget(
+					0), _accessCounter(0), _mutex(new std::mutex)
 	{
 		loadLens(filename);
 	}
@@ -218,6 +374,12 @@ public:
 	/// correct size. Rigidity is given in Joule
 	void transformModelVector(double* model, double rigidity) const;
 
+	/// transforms several model arrays with the given rigidities [Joule] in
+	/// parallel, the models of the same lens part in blocks that share the
+	/// traversal of the matrix. Models of rigidities not covered are unchanged.
+	void transformModelVectors(const std::vector<double*> &models,
+			const std::vector<double> &rigidities) const;
+
 	/// Loads M as part of a lens and use it in given rigidity range with
 	/// rigidities given in Joule
 	void setLensPart(const ModelMatrixType &M, double rigidityMin, double rigidityMax);
@@ -225,8 +387,23 @@ public:
 	/// Loads a lens from a given file, containing lines like
 	/// lensefile.MLDAT rigidityMin rigidityMax
 	/// rigidities are given in logarithmic units [log10(E / eV)]
+	/// The matrices are read on first use of their lens part.
 	void loadLens(const string &filename);
 
+	/// Limits the memory used by the matrices read from file [bytes]. When
+	/// exceeded, the least recently used lens parts are unloaded and read
+	/// again when needed. 0 (default) keeps every matrix once read.
+	void setMemoryBudget(size_t bytes);
+
+	/// Returns the memory budget for the matrices [bytes]
+	size_t getMemoryBudget() const
+	{
+		return _memoryBudget;
+	}
+
+	/// Returns the memory used by the loaded matrices [bytes]
+	size_t getMemoryUsage() const;
+
 	/// Normalizes the lens parts to the maximum of sums of columns of
 	/// every lenspart. By doing this, the lens won't distort the spectrum
 	void normalizeLens();
@@ -260,7 +437,8 @@ public:
 		return _norm;
 	}
 
-	/// Returns iterator to the lens part with rigidity Joule
+	/// Returns the lens part with rigidity Joule, reading its matrix from
+	/// file if not loaded
 	LensPart* getLensPart(double rigidity) const;
 
 	/// Returns all lens parts
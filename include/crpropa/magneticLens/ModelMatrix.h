@@ -49,9 +49,23 @@ namespace crpropa
 	/// (Int, Int, Double) : (column, row, value) triples ...
 	void serialize(const string &filename, const ModelMatrixType &matrix);
 
-	/// Reads a matrix from file
+	/// Reads a matrix from file, written either by serialize or by
+	/// serializeCSC
 	void deserialize(const string &filename, ModelMatrixType &matrix);
 
+	/// Writes the ModelMatrix to disk in the compressed sparse column format:
+	/// Char[8] "CRPCSC1", UInt64 (rows), UInt64 (columns), UInt64 (non zero
+	/// elements), Double[nnz] (values), Int32[columns + 1] (column starts),
+	/// Int32[nnz] (rows). The file can be mapped into memory as it is.
+	void serializeCSC(const string &filename, const ModelMatrixType &matrix);
+
+	/// Reads a matrix written by serializeCSC by mapping the file into memory
+	void deserializeCSC(const string &filename, ModelMatrixType &matrix);
+
+	/// Reads the number of rows and columns of a matrix file written either by
+	/// serialize or by serializeCSC without reading the elements
+	void readMatrixSize(const string &filename, uint32_t &rows, uint32_t &cols);
+
 	/// Normalizes each column j of the matrix so that, \f$ \Vert m_j \Vert_1 = 1 \f$ 
 	void normalizeColumns(ModelMatrixType &matrix);
 
@@ -64,6 +78,10 @@ namespace crpropa
 
 	// matrix vector product with update: model = matrix * model
 	void prod_up(const ModelMatrixType& matrix, double* model);
+
+	// matrix dense matrix product with update of every model: the sparse
+	// matrix is traversed once for all of them
+	void prod_up(const ModelMatrixType& matrix, const std::vector<double*> &models);
 } // namespace parsec
 
 #endif // MODELMATRIX_HH
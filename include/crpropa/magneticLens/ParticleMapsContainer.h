@@ -3,6 +3,8 @@
 
 #include <map>
 #include <vector>
+#include <utility>
+#include "crpropa/AliasTable.h"
 #include "crpropa/magneticLens/Pixelization.h"
 #include "crpropa/magneticLens/MagneticLens.h"
 
@@ -18,10 +20,41 @@ namespace crpropa{
 /// The maps are stored with discrete energies on a logarithmic scale. The
 /// default energy width is 0.02 with an energy bin from 10**17.99 - 10**18.01
 /// eV
+/// The maps are kept in one flat list. A map stores its filled pixels as
+/// long as this needs less memory than the full array of pixels. Random
+/// particles are drawn from alias tables over the particle ids, the maps of
+/// each id and the pixels of each map.
 class ParticleMapsContainer
 {
 	private:
-    std::map< int , std::map <int , double*> > _data;
+		struct ParticleMap
+		{
+			int energyIdx;
+			// (pixel, weight), sorted and unique up to sorted
+			std::vector<std::pair<uint32_t, double> > entries;
+			size_t sorted;
+			// all pixels, used instead of entries once not empty
+			std::vector<double> dense;
+			double weight;
+			// the pixels with weight and the table to draw them
+			std::vector<uint32_t> pixels;
+			AliasTable table;
+			ParticleMap() : energyIdx(0), sorted(0), weight(0)
+			{
+			}
+		};
+
+		struct ParticleMaps
+		{
+			int particleId;
+			std::vector<size_t> maps;
+			double weight;
+			AliasTable table;
+		};
+
+		std::vector<ParticleMap> _maps;
+		// particle id -> energy bin -> position in _maps
+		std::map< int , std::map <int , size_t> > _index;
 		Pixelization _pixelization;
     double _deltaLogE;
     double _bin0lowerEdge;
@@ -30,11 +63,17 @@ class ParticleMapsContainer
 		int energy2Idx(double energy) const;
 		double idx2Energy(int idx) const;
 
+		// returns the map or NULL if not existing
+		ParticleMap *findMap(int particleId, int energyIdx);
+		void addToMap(int particleId, int energyIdx, uint32_t pixel, double weight);
+		// sorts and adds up the entries, switches to dense if smaller
+		void compactMap(ParticleMap &m);
+		void densifyMap(ParticleMap &m);
 
 		// weights of the particles
 		double _sumOfWeights;
-		std::map< int , double > _weightsPID;
-		std::map< int , map<int, double> > _weights_pidEnergy;
+		std::vector<ParticleMaps> _particles;
+		AliasTable _particleTable;
 
 		// lazy update of weights
 		bool _weightsUpToDate;
@@ -53,7 +92,7 @@ class ParticleMapsContainer
     }
 
 		/// returns the map for the particleId with the given energy,. energy in
-		/// Joule
+		/// Joule. The map is stored with all pixels from then on.
 		double *getMap(const int particleId, double energy);
 
 		/// adds a particle to the map container
@@ -63,6 +102,13 @@ class ParticleMapsContainer
 
 		void addParticle(const int particleId, double energy, const Vector3d &v, double weight = 1);
 
+		/// adds the particles to the map container, with the directions
+		/// converted to pixels in blocks. The weights may be empty for weight 1.
+		void addParticles(const std::vector<int> &particleIds, const std::vector<double> &energies,
+				const std::vector<double> &galacticLongitudes,
+				const std::vector<double> &galacticLatitudes,
+				const std::vector<double> &weights = std::vector<double>());
+
 		// returns a vector of all particle ids in th
 		std::vector<int> getParticleIds();
 
@@ -95,8 +141,12 @@ class ParticleMapsContainer
 		{
 			if (!_weightsUpToDate)
 				_updateWeights();
-			return _weights_pidEnergy[pid][energy2Idx(energy)];
+			ParticleMap *m = findMap(pid, energy2Idx(energy));
+			return m ? m->weight : 0;
 		}
+
+		/// returns the memory used by the maps in bytes
+		size_t getMemoryUsage() const;
 };
 
 /** @}*/
@@ -25,6 +25,7 @@
 #define PIXELIZATION_HH
 
 #include "healpix_base/healpix_base.h"
+#include "crpropa/Random.h"
 #include <cmath>
 #include <stdint.h>
 
@@ -61,14 +62,14 @@ class Pixelization
 public:
 	Pixelization()
 	{
-		_healpix = new healpix::T_Healpix_Base<int>(6, healpix::RING);
+		_healpix = new HealpixBase<int>(6, healpix::RING);
 	}
 
 	/// Constructor creating Pixelization with healpix order 6 (about
 	/// 50000 pixels)
 	Pixelization(uint8_t order)
 	{
-		_healpix = new healpix::T_Healpix_Base<int>(order, healpix::RING);
+		_healpix = new HealpixBase<int>(order, healpix::RING);
 	}
 
 	~Pixelization()
@@ -80,6 +81,12 @@ public:
 	/// phi in [-pi, pi], theta in [-pi/2, pi/2]
 	uint32_t direction2Pix(double longitude, double latitude) const;
 
+	/// Returns the numbers of the pixels of n directions. The sine and cosine
+	/// of the latitudes are evaluated in blocks by polynomials that the
+	/// compiler vectorizes.
+	void directions2Pix(size_t n, const double *longitude, const double *latitude,
+			uint32_t *pixel) const;
+
 	/// Returns the number of pixels of the pixelization
 	uint32_t nPix() const
 	{
@@ -102,6 +109,10 @@ public:
 	/// Gives the center of pixel i in longitude [rad] and latitude [rad]
 	void pix2Direction(uint32_t i, double &longitude, double &latitude) const;
 
+	/// Gives the centers of n pixels in longitude [rad] and latitude [rad]
+	void pix2Directions(size_t n, const uint32_t *pixel, double *longitude,
+			double *latitude) const;
+
 	/// Calculate the angle [rad] between the vectors pointing to pixels i and j
 	double angularDistance(uint32_t i, uint32_t j) const;
 
@@ -119,6 +130,13 @@ public:
 
 	void getRandomDirectionInPixel(uint32_t pixel, double &longitude, double &latitude);
 
+	/// Random direction in the pixel, drawn from the given generator
+	void getRandomDirectionInPixel(uint32_t pixel, double &longitude, double &latitude, Random &random) const;
+
+	/// Random directions in n pixels, drawn from the given generator
+	void getRandomDirectionsInPixels(size_t n, const uint32_t *pixel, double *longitude,
+			double *latitude, Random &random) const;
+
 	void getPixelsInCone(double longitude, double latitude,double radius, std::vector<int>& listpix)
 	{
 		healpix::vec3 v;
@@ -129,10 +147,26 @@ public:
 	}
 
 private:
+	// gives access to the conversions between pixels and (z, phi) coordinates
+	template <typename I>
+	class HealpixBase : public healpix::T_Healpix_Base<I>
+	{
+	public:
+		HealpixBase(int order, healpix::Healpix_Ordering_Scheme scheme) :
+				healpix::T_Healpix_Base<I>(order, scheme)
+		{
+		}
+		using healpix::T_Healpix_Base<I>::loc2pix;
+		using healpix::T_Healpix_Base<I>::pix2loc;
+	};
+
 	void spherCo2Vec(double phi, double theta, healpix::vec3 &V) const;
 	void vec2SphereCo(double &phi , double &theta, const healpix::vec3 &V) const;
-	healpix::T_Healpix_Base<int> *_healpix;
-	static healpix::T_Healpix_Base<healpix::int64> _healpix_nest;
+	// longitude and latitude of the (z, phi) coordinates of a pixel
+	static void loc2Direction(double z, double phi, double sth, bool have_sth,
+			double &longitude, double &latitude);
+	HealpixBase<int> *_healpix;
+	static HealpixBase<healpix::int64> _healpix_nest;
 };
 
 
@@ -0,0 +1,64 @@
+#ifndef CRPROPA_DENSITYGRID_H
+#define CRPROPA_DENSITYGRID_H
+
+#include "crpropa/massDistribution/Density.h"
+#include "crpropa/Grid.h"
+
+namespace crpropa {
+
+/**
+ @class DensityGrid
+ @brief Density on a cartesian grid with trilinear interpolation.
+
+ This class wraps Grid1f to serve as a Density, e.g. to replace an analytic
+ model that is evaluated every step by a lookup. Constructed from a Density,
+ the model is evaluated in parallel at the grid points for the HI, HII and H2
+ densities and for its total and nucleon densities, which keeps the activated
+ components of the model (also of a DensityList). Constructed from component
+ grids, all given components are active.
+ Outside of the grid volume all densities are zero.
+ */
+class DensityGrid: public Density {
+	ref_ptr<Grid1f> HIGrid, HIIGrid, H2Grid; ///< component densities, may be null
+	ref_ptr<Grid1f> totalGrid, nucleonGrid; ///< baked getDensity / getNucleonDensity, may be null
+	ref_ptr<Density> model; ///< baked model, null for component grids
+	bool isHI, isHII, isH2;
+	Vector3d lower, upper; ///< grid volume
+
+	bool isInside(const Vector3d &position) const;
+	double value(const ref_ptr<Grid1f> &grid, const Vector3d &position) const;
+public:
+	/** Bake a density model onto grids
+	 @param density		density model to evaluate
+	 @param properties	shape of the grids
+	 */
+	DensityGrid(ref_ptr<Density> density, const GridProperties &properties);
+	/** Densities from component grids of the same shape, null for no component [1/m^3] */
+	DensityGrid(ref_ptr<Grid1f> HI, ref_ptr<Grid1f> HII, ref_ptr<Grid1f> H2);
+
+	double getDensity(const Vector3d &position) const;
+	double getHIDensity(const Vector3d &position) const;
+	double getHIIDensity(const Vector3d &position) const;
+	double getH2Density(const Vector3d &position) const;
+	double getNucleonDensity(const Vector3d &position) const;
+
+	bool getIsForHI();
+	bool getIsForHII();
+	bool getIsForH2();
+
+	ref_ptr<Grid1f> getHIGrid();
+	ref_ptr<Grid1f> getHIIGrid();
+	ref_ptr<Grid1f> getH2Grid();
+
+	/** Error of the interpolated total density against the baked model.
+	 The densities are compared in the middle between the grid points, where
+	 the trilinear interpolation is worst, on an n^3 sample of these points.
+	 @param n	number of sample points along each axis
+	 @return	largest absolute difference relative to the largest model density
+	 */
+	double estimateError(size_t n = 16) const;
+};
+
+}  // namespace crpropa
+
+#endif  // CRPROPA_DENSITYGRID_H
@@ -38,6 +38,8 @@ class AdiabaticCooling: public Module {
 		AdiabaticCooling(ref_ptr<AdvectionField> advectionField);
 		AdiabaticCooling(ref_ptr<AdvectionField> advectionField, double limit);
 		void process(Candidate *c) const;
+		bool hasEnergyLossRate() const;
+		double getEnergyLossRate(const Candidate *candidate, double E, double z) const;
 
 		void setLimit(double l);
 
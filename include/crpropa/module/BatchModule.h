@@ -0,0 +1,66 @@
+#ifndef CRPROPA_BATCHMODULE_H
+#define CRPROPA_BATCHMODULE_H
+
+#include "crpropa/Module.h"
+
+#include <vector>
+#include <stdint.h>
+
+namespace crpropa {
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ @class CandidateBatch
+ @brief Current states of a batch of candidates in contiguous columns.
+
+ The columns are filled from the candidates before BatchModule::processCandidates
+ and the changes are written back afterwards: energy, position [3 per
+ candidate], direction [3 per candidate], id, redshift, active and nextStep,
+ which limits the next step. The trajectory length and current step are only
+ read. In Python the columns are NumPy views, valid during the call.
+ */
+class CandidateBatch {
+	std::vector<Candidate *> candidates;
+public:
+	std::vector<double> energy;
+	std::vector<double> position;
+	std::vector<double> direction;
+	std::vector<int32_t> id;
+	std::vector<double> redshift;
+	std::vector<uint8_t> active;
+	std::vector<double> nextStep;
+	std::vector<double> trajectoryLength;
+	std::vector<double> currentStep;
+
+	/// Fill the columns from the current states of the candidates
+	void fill(Candidate **candidates, size_t count);
+	/// Write changed columns back to the candidates
+	void apply() const;
+	size_t size() const;
+	/// Candidate of a row, e.g. for its properties
+	Candidate *getCandidate(size_t i) const;
+};
+
+/**
+ @class BatchModule
+ @brief Base class for modules processing a batch of candidates at once.
+
+ processBatch (and process, as a batch of one) collect the candidates in a
+ CandidateBatch and call processCandidates once. Derived in Python, the GIL is
+ then taken once per batch instead of once per candidate, e.g. in
+ ModuleList::runBatch.
+ */
+class BatchModule: public Module {
+public:
+	void process(Candidate *candidate) const;
+	void processBatch(Candidate **candidates, size_t count) const;
+	virtual void processCandidates(CandidateBatch &batch) const = 0;
+};
+
+/** @}*/
+} // namespace crpropa
+
+#endif // CRPROPA_BATCHMODULE_H
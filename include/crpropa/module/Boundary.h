@@ -2,6 +2,7 @@
 #define CRPROPA_BOUNDARY_H
 
 #include "crpropa/Module.h"
+#include "crpropa/Geometry.h"
 
 namespace crpropa {
 /**
@@ -60,6 +61,8 @@ public:
  The particle is made inactive and flagged as "Rejected".
  By default the module prevents overshooting the boundary by more than a margin of 0.1 kpc.
  This corresponds to the default minimum step size of the propagation modules (PropagationCK and SimplePropagation).
+ In the event-driven mode, the steps of neutral particles are limited to the
+ distance along their straight line to the boundary instead.
  */
 class CubicBoundary: public AbstractCondition {
 private:
@@ -67,6 +70,7 @@ private:
 	double size;
 	double margin;
 	bool limitStep;
+	bool eventDriven;
 
 public:
 	CubicBoundary();
@@ -76,6 +80,13 @@ public:
 	void setSize(double size);
 	void setMargin(double margin);
 	void setLimitStep(bool limitStep);
+	/** Limit the steps of neutral particles to the exit along their straight line */
+	void setEventDriven(bool eventDriven);
+	Vector3d getOrigin() const;
+	double getSize() const;
+	double getMargin() const;
+	bool getLimitStep() const;
+	bool isEventDriven() const;
 	std::string getDescription() const;
 };
 
@@ -86,6 +97,8 @@ public:
  The particle is made inactive and flagged as "Rejected".
  By default the module prevents overshooting the boundary by more than a margin of 0.1 kpc.
  This corresponds to the default minimum step size of the propagation modules (PropagationCK and SimplePropagation).
+ In the event-driven mode, the steps of neutral particles are limited to the
+ distance along their straight line to the boundary instead.
  */
 class SphericalBoundary: public AbstractCondition {
 private:
@@ -93,6 +106,7 @@ private:
 	double radius;
 	double margin;
 	bool limitStep;
+	bool eventDriven;
 
 public:
 	SphericalBoundary();
@@ -102,6 +116,13 @@ public:
 	void setRadius(double size);
 	void setMargin(double margin);
 	void setLimitStep(bool limitStep);
+	/** Limit the steps of neutral particles to the exit along their straight line */
+	void setEventDriven(bool eventDriven);
+	Vector3d getCenter() const;
+	double getRadius() const;
+	double getMargin() const;
+	bool getLimitStep() const;
+	bool isEventDriven() const;
 	std::string getDescription() const;
 };
 
@@ -162,6 +183,34 @@ public:
 	void setLimitStep(bool limitStep);
 	std::string getDescription() const;
 };
+
+/**
+ @class SurfaceBoundary
+ @brief Flags a particle when leaving the inside of a surface.
+
+ The inside is where the distance of the surface is negative, for a
+ SurfaceCollection the union of the insides of its surfaces.
+ The particle is made inactive and flagged as "Rejected".
+ By default the steps are limited to the distance to the nearest surface plus
+ a margin of 0.1 kpc, in the event-driven mode those of neutral particles to
+ the distance along their straight line to the next surface plus the margin.
+ */
+class SurfaceBoundary: public AbstractCondition {
+private:
+	ref_ptr<Surface> surface;
+	double margin;
+	bool limitStep;
+	bool eventDriven;
+
+public:
+	SurfaceBoundary(Surface *surface);
+	void process(Candidate *candidate) const;
+	void setMargin(double margin);
+	void setLimitStep(bool limitStep);
+	/** Limit the steps of neutral particles to the next surface along their straight line */
+	void setEventDriven(bool eventDriven);
+	std::string getDescription() const;
+};
 /** @}*/
 
 } // namespace crpropa
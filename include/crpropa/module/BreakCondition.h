@@ -2,6 +2,13 @@
 #define CRPROPA_BREAKCONDITION_H
 
 #include "crpropa/Module.h"
+#include "crpropa/KdTree.h"
+#include "crpropa/Geometry.h"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
 
 namespace crpropa {
 /**
@@ -16,16 +23,20 @@ namespace crpropa {
  This modules deactivates the candidate at a given maximum trajectory length.
  In that case the property ("Deactivated", module::description) is set.
  It also limits the candidates next step size to ensure the maximum trajectory length is no exceeded.
+ With observer positions, candidates are also deactivated once the nearest
+ observer is out of reach. The positions are indexed by a k-d tree.
  */
 class MaximumTrajectoryLength: public AbstractCondition {
 	double maxLength;
-	std::vector<Vector3d> observerPositions;
+	KdTree observerPositions;
 public:
 	MaximumTrajectoryLength(double length = 0);
 	void setMaximumTrajectoryLength(double length);
 	double getMaximumTrajectoryLength() const;
 	void addObserverPosition(const Vector3d &position);
 	const std::vector<Vector3d>& getObserverPositions() const;
+	/// Distance to the nearest observer position, the maximum double if none
+	double getNearestObserverDistance(const Vector3d &position) const;
 	std::string getDescription() const;
 	void process(Candidate *candidate) const;
 };
@@ -113,11 +124,110 @@ class MinimumEnergyPerParticleId: public AbstractCondition {
 	std::vector<double> minEnergies;
 	std::vector<int> particleIds;
 	double minEnergyOthers;
+	// thresholds by compact index: elementary particles by id + 100,
+	// nuclei up to Z = 26, N = 30 by Z * 31 + N as in nuclearMass,
+	// NaN if not specified; other ids in a map
+	std::vector<double> elementaryMinEnergies;
+	std::vector<double> nucleusMinEnergies;
+	std::map<int, double> otherMinEnergies;
+	const double *findMinimumEnergy(int id) const;
 public:
 	MinimumEnergyPerParticleId(double minEnergyOthers = 0);
 	void setMinimumEnergyOthers(double energy);
 	double getMinimumEnergyOthers() const;
+	/** Specify the minimum energy of a particle id, the first given for an id is used */
 	void add(int id, double energy);
+	/** Minimum energy applied to the particle id */
+	double getMinimumEnergy(int id) const;
+	std::string getDescription() const;
+	void process(Candidate *candidate) const;
+};
+
+
+/**
+ @class ReachabilityPruning
+ @brief Deactivates candidates that cannot reach an observer above the minimum energy
+
+ The energy of a candidate decreases at least by the continuous losses of the
+ added modules (Module::hasEnergyLossRate) on the way to the nearest observer,
+ which is at least the distance to the nearest observer position or surface
+ away. The candidate is rejected as soon as this distance exceeds the range
+ in which the losses bring its energy down to the minimum energy of its
+ particle id, i.e. when its energy at the observer is bounded below the
+ threshold.
+
+ The range is tabulated per particle id on the first use, in 20 bins per
+ decade up to 1e24 eV, with the smallest loss rate at the bin edges, at the
+ redshift set with setRedshift (default 0). This gives an upper bound for
+ loss rates that grow with the redshift and are monotonic within the bins,
+ as those of ElectronPairProduction, continuous PhotoPionProduction and
+ Redshift. Losses that depend on the position, e.g. SynchrotronRadiation in
+ a structured field, must not be added.
+
+ Secondaries the candidate would have produced are lost with it. They carry
+ less energy but may lose less on the way: if photons or neutrinos from
+ pruned particles are observed, restrict the pruning to the other classes
+ with setParticleClasses. For the 1D observer at x = 0 add the surface
+ Plane(Vector3d(0), Vector3d(1, 0, 0)).
+
+ The number and the weight of the rejected candidates are counted. With
+ setMakeRejectedInactive(false) the candidates are only flagged, once, to
+ validate the pruning, e.g. with an ObserverParticleIdVeto on the flag.
+ */
+class ReachabilityPruning: public AbstractCondition {
+	struct RangeTable {
+		double threshold;       // minimum energy [J]
+		std::vector<double> range; // maximum distance from threshold * 10^(i/20) down to the threshold [m]
+	};
+
+	ref_ptr<MinimumEnergyPerParticleId> thresholds;
+	std::vector<ref_ptr<Module> > losses;
+	std::vector<unsigned int> lossClasses;
+	KdTree observerPositions;
+	std::vector<ref_ptr<Surface> > observerSurfaces;
+	double redshift;
+	unsigned int classes;
+
+	// tables by compact index as in MinimumEnergyPerParticleId, others in a map
+	mutable std::vector<std::atomic<const RangeTable*> > compactTables;
+	mutable std::map<int, const RangeTable*> otherTables;
+	mutable std::vector<std::unique_ptr<RangeTable> > tableStorage;
+	mutable std::mutex tableMutex;
+	mutable unsigned long long prunedCount;
+	mutable double prunedWeight;
+
+	const RangeTable *getTable(int id) const;
+	RangeTable *buildTable(int id) const;
+	void clearTables();
+public:
+	ReachabilityPruning(double minEnergy = 0);
+	~ReachabilityPruning();
+	/** Minimum energy at the observer for all particles */
+	void setMinimumEnergy(double energy);
+	/** Minimum energies at the observer per particle id, e.g. the break condition of the simulation */
+	void setMinimumEnergies(MinimumEnergyPerParticleId *thresholds);
+	/** Add a module with an energy loss rate, throws otherwise */
+	void add(Module *module);
+	void addObserverPosition(const Vector3d &position);
+	void addObserverSurface(Surface *surface);
+	/** Redshift at which the loss rates are evaluated, the lowest of the run */
+	void setRedshift(double z);
+	double getRedshift() const;
+	/** Bit mask of the ParticleClass values to prune, default all */
+	void setParticleClasses(unsigned int classes);
+	unsigned int getParticleClasses() const;
+
+	/** Distance to the nearest observer position or surface, the maximum double if none */
+	double getNearestObserverDistance(const Vector3d &position) const;
+	/** Upper bound of the distance [m] in which a particle loses the energy E [J] down to its minimum energy */
+	double getMaximumRange(int id, double E) const;
+
+	/** Number of rejected candidates */
+	unsigned long long getPrunedCount() const;
+	/** Sum of the weights of the rejected candidates */
+	double getPrunedWeight() const;
+	void resetCounters();
+
 	std::string getDescription() const;
 	void process(Candidate *candidate) const;
 };
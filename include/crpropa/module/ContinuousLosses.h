@@ -0,0 +1,79 @@
+#ifndef CRPROPA_CONTINUOUSLOSSES_H
+#define CRPROPA_CONTINUOUSLOSSES_H
+
+#include "crpropa/Module.h"
+
+#include <vector>
+
+namespace crpropa {
+/**
+ * \addtogroup EnergyLosses
+ * @{
+ */
+
+/**
+ @class ContinuousLosses
+ @brief Integrates the continuous energy losses of several modules at once.
+
+ The loss rates of the added modules (Module::hasEnergyLossRate) are summed
+ to a single dE/dx(E, z), which is integrated over the step with a fourth
+ order Runge-Kutta scheme. Its sub-steps are limited to a change of the
+ energy by the given tolerance, so that the result does not depend on the
+ step size. If a Redshift module is added, the redshift is integrated along
+ and updated as well.
+
+ The next step is limited to a fraction of the energy loss length with
+ respect to the total loss rate. The default of one loss length allows far
+ larger steps than the individual modules with their first order update.
+ A step that needs more than 10000 sub-steps is only integrated in part,
+ which is reported as diagnostic, and the next step is limited to the
+ integrated part.
+
+ The added modules must not be part of the module list themselves. Only
+ their loss rates are used: the secondaries of the losses, e.g. the pairs
+ of ElectronPairProduction or the photons of SynchrotronRadiation, are not
+ created in this mode, also not by ModuleList1D, even if enabled in the
+ added modules.
+ */
+class ContinuousLosses: public Module {
+	std::vector<ref_ptr<Module> > losses;
+	std::vector<unsigned int> lossClasses;
+	bool updateRedshift;
+	double limit;
+	double tolerance;
+
+	double lossRate(const Candidate *candidate, unsigned int particleClass, double E, double z) const;
+public:
+	/**
+	 @param limit		maximum step as fraction of the energy loss length
+	 @param tolerance	maximum relative energy change per Runge-Kutta sub-step
+	 */
+	ContinuousLosses(double limit = 1, double tolerance = 0.05);
+	/** Add a module with an energy loss rate, throws otherwise */
+	void add(Module *module);
+	void setLimit(double limit);
+	double getLimit() const;
+	void setTolerance(double tolerance);
+	double getTolerance() const;
+	/** Number of added modules */
+	size_t size() const;
+	/** Whether the redshift is integrated along, with an added Redshift module */
+	bool updatesRedshift() const;
+	void prepare();
+	void process(Candidate *candidate) const;
+	/**
+	 Integrate the energy and, with a Redshift module, the redshift over a step.
+	 The candidate only provides the particle type to the loss rates.
+	 @return	length integrated, less than the step if the sub-steps ran out
+	 */
+	double integrate(const Candidate *candidate, double step, double &E, double &z) const;
+	/** Total energy loss rate dE/dx in [J/m] of the added modules */
+	double getLossRate(const Candidate *candidate, double E, double z) const;
+	unsigned int getParticleClasses() const;
+	std::string getDescription() const;
+};
+
+/** @}*/
+} // namespace crpropa
+
+#endif // CRPROPA_CONTINUOUSLOSSES_H
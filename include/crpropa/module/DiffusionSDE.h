@@ -13,6 +13,7 @@
 #include "crpropa/advectionField/AdvectionField.h"
 #include "crpropa/Units.h"
 #include "crpropa/Random.h"
+#include "crpropa/Grid.h"
 
 #include "kiss/logger.h"
 
@@ -29,11 +30,24 @@ namespace crpropa {
  * Here an Euler-Mayurama integration scheme is used. The diffusion tensor
  * can be anisotropic with respect to the magnetic field line coordinates.
  * The integration of field lines is done via the CK-algorithm.
+ * Optionally, the advection is integrated with a predictor-corrector step
+ * (weak order 2 for the additive noise of the diffusion), allowing for larger
+ * time steps in strong advection fields.
+ * In batches (ModuleList::setBatchSize), the Gaussian random numbers of all
+ * pseudo-particles are drawn at once.
+ * For expensive field models, the field directions can be precomputed on a
+ * grid, which is then interpolated in the field line integration.
  */
 
 
 class DiffusionSDE : public Module{
 
+public:
+	    enum Scheme {
+		    EulerMaruyama, // Euler-Mayurama step of the advection
+		    WeakOrder2 // Heun predictor-corrector step of the advection
+	    };
+
 private:
 	    ref_ptr<MagneticField> magneticField;
 	    ref_ptr<AdvectionField> advectionField;
@@ -43,6 +57,19 @@ private:
 	    double epsilon; // ratio of parallel and perpendicular diffusion coefficient D_par = epsilon*D_perp
 	    double alpha; // power law index of the energy dependent diffusion coefficient: D\propto E^alpha
 	    double scale; // scaling factor for the diffusion coefficient D = scale*D_0
+	    Scheme scheme; // integration scheme of the advection
+	    ref_ptr<Grid3f> directionGrid; // optional precomputed field directions
+	    Vector3d gridMin, gridMax; // volume covered by the direction grid
+	    mutable IntegratorCounters statistics; // counters of the step size control, if recorded
+
+	    // unit vector of the magnetic field, from the direction grid if available
+	    Vector3d fieldDirection(const Vector3d &pos, double z) const;
+
+	    // performs the step with the standard normal random numbers eta[3]
+	    void integrate(Candidate *candidate, const double eta[]) const;
+
+	    // counters of a step with the given trial steps along the field line
+	    void recordStep(Candidate *candidate, size_t tries, size_t substeps, bool minimum) const;
 
 
 public:
@@ -59,6 +86,7 @@ public:
 	    DiffusionSDE(ref_ptr<crpropa::MagneticField> magneticField, ref_ptr<crpropa::AdvectionField> advectionField, double tolerance = 1e-4, double minStep=(10*pc), double maxStep=(1*kpc), double epsilon=0.1);
 
 	    void process(crpropa::Candidate *candidate) const;
+	    void processBatch(crpropa::Candidate **candidates, size_t count) const;
 
 	    void tryStep(const Vector3d &Pos, Vector3d &POut, Vector3d &PosErr, double z, double propStep ) const;
 	    void driftStep(const Vector3d &Pos, Vector3d &LinProp, double h) const;
@@ -70,15 +98,37 @@ public:
 	    void setEpsilon(double kappa);
 	    void setAlpha(double alpha);
 	    void setScale(double Scale);
+	    void setScheme(Scheme scheme);
 	    void setMagneticField(ref_ptr<crpropa::MagneticField> magneticField);
 	    void setAdvectionField(ref_ptr<crpropa::AdvectionField> advectionField);
 
+	    /** Use precomputed field directions (e.g. from fromMagneticFieldDirection) in the field line integration.
+		Outside the grid volume the magnetic field is evaluated. Pass NULL to evaluate the field everywhere.
+		@param grid	grid of unit vectors of the magnetic field */
+	    void setFieldDirectionGrid(ref_ptr<Grid3f> grid);
+	    /** Precompute the field directions of the magnetic field at z = 0 on a grid
+		@param origin	lower corner of the grid volume
+		@param N	number of grid points per direction
+		@param spacing	spacing of the grid points */
+	    void precomputeFieldDirection(Vector3d origin, size_t N, double spacing);
+	    ref_ptr<Grid3f> getFieldDirectionGrid() const;
+
+	    /** Count the accepted and rejected steps of the field line integration and the field evaluations, see IntegratorCounters
+		@param record		count the steps
+		@param asProperties	also accumulate the counters of each candidate in its properties */
+	    void setRecordStatistics(bool record = true, bool asProperties = false);
+	    bool getIntegratorStatistics(IntegratorStatistics &statistics) const;
+	    void resetStatistics();
+	    /** Bytes held by the magnetic field and the field direction grid */
+	    size_t getMemoryUsage() const;
+
 	    double getMinimumStep() const;
 	    double getMaximumStep() const;
 	    double getTolerance() const;
 	    double getEpsilon() const;
 	    double getAlpha() const;
 	    double getScale() const;
+	    Scheme getScheme() const;
 	    std::string getDescription() const;
 
 };
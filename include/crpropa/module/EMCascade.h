@@ -2,12 +2,24 @@
 #define CRPROPA_EMCASCADE_H
 
 #include "crpropa/Module.h"
+#include "crpropa/DintOperator.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
 
 namespace crpropa {
 
 /**
  @class EMCascade
  @brief Collects and deactivates photons, electrons and positrons. Uses DINT to calculate the EM cascade.
+
+ For a hybrid calculation, only particles below an energy threshold are
+ collected, while the Monte Carlo modules propagate the particles above.
+ The particles are binned in distance and energy with their weights, and
+ the cascade of the collected particles is calculated once at the end,
+ without an intermediate particle file. Every thread fills histograms of its
+ own, which are summed by save and runCascade.
  */
 class EMCascade: public Module {
 private:
@@ -15,11 +27,25 @@ private:
 	int nE, nD;
 	double logEmin, logEmax, dlogE, Dmax, dD;
 
-	// histograms (distance,energy) of photons, electrons and positrons
-	mutable std::vector<uint64_t> photonHist;
-	mutable std::vector<uint64_t> electronHist;
-	mutable std::vector<uint64_t> positronHist;
+	double energyThreshold; // only particles below are collected
+
+	// weighted histograms (distance,energy) of photons, electrons and positrons
+	mutable std::vector<double> photonHist;
+	mutable std::vector<double> electronHist;
+	mutable std::vector<double> positronHist;
+
+	// per thread: the photon, electron and positron histograms, the last
+	// histograms are shared by the threads not known at the first candidate
+	mutable std::vector<std::vector<double> > threadHist;
+	mutable std::unique_ptr<std::once_flag> allocated;
+	mutable std::mutex sharedMutex;
 	void init();
+	void allocate() const;
+	void reduce();
+	void writeCascade(const std::string &filename);
+
+	// propagated spectra of photons, electrons and positrons
+	std::vector<double> cascadeSpectrum[3];
 
 public:
 	EMCascade();
@@ -30,8 +56,13 @@ public:
 		int nD        //!< number of distance bins
 		);
 
+	/** Collect only particles with energies below, by default all */
+	void setEnergyThreshold(double threshold);
+	double getEnergyThreshold() const;
+
 	/** Collect and deactivate photons, electrons and positrons */
 	void process(Candidate *candidate) const;
+	unsigned int getParticleClasses() const;
 
 	/** Save the unpropagated histogram of EM particles */
 	void save(const std::string &filename);
@@ -39,15 +70,31 @@ public:
 	/** Load the unpropagated histogram of EM particles */
 	void load(const std::string &filename);
 
-	/** Calculates the EM cascade with DINT */
+	/** Calculates the EM cascade with DINT, see getCascadeSpectrum for the result */
 	void runCascade(
-		const std::string &filename,  //!< output filename
+		const std::string &filename = "",  //!< output filename, none if empty
 		int IRBFlag = 4,        //!< EBL background 0: high, 1: low, 2: Primack, 4: Stecker'06
 		int RadioFlag = 4,      //!< radio background 0: high, 1: medium, 2: obs, 3: none, 4: Protheroe'96
 		double Bfield = 1E-13,  //!< magnetic field strength [T], default = 1 nG
 		double cutCascade = 0   //!< a-parameter, see CRPropa 2 paper
 		);
 
+	/**
+	 Calculates the EM cascade with the precomputed DINT operators, which
+	 must have the distance binning of this module
+	 */
+	void runCascade(
+		const DintOperator &op,            //!< propagation operators per distance bin
+		const std::string &filename = ""   //!< output filename, none if empty
+		);
+
+	/**
+	 Propagated spectrum of the last runCascade, number of particles per
+	 energy bin of width 0.1 in log10(E/eV) from 10^7 to 10^24 eV
+	 @param id	22 (photons), 11 (electrons) or -11 (positrons)
+	 */
+	const std::vector<double> &getCascadeSpectrum(int id) const;
+
 	std::string getDescription() const;
 };
 
@@ -3,7 +3,10 @@
 
 #include "crpropa/Module.h"
 #include "crpropa/PhotonBackground.h"
+#include "crpropa/AliasTable.h"
 #include <fstream>
+#include <memory>
+#include <mutex>
 
 namespace crpropa {
 
@@ -20,32 +23,68 @@ private:
 	ref_ptr<PhotonField> photonField;
 	bool havePhotons;
 	double limit;
+	double thinning;  //!< weighted sampling of the secondaries, 0: all, 1: maximal thinning
 
 	// tabulated interaction rate 1/lambda(E)
 	std::vector<double> tabEnergy;  //!< electron energy in [J]
 	std::vector<double> tabRate;  //!< interaction rate in [1/m]
+	LogAxis energyAxis;  //!< index lookup in tabEnergy
 	
-	// tabulated CDF(s_kin, E) = cumulative differential interaction rate
-	std::vector<double> tabE;  //!< electron energy in [J]
-	std::vector<double> tabs;  //!< s_kin = s - m^2 in [J**2]
-	std::vector< std::vector<double> > tabCDF;  //!< cumulative interaction rate
+	// tabulated CDF(s_kin, E) = cumulative differential interaction rate,
+	// shared by all instances for the same photon field via the TableRegistry
+	struct Tables: public Referenced {
+		std::vector<double> tabE;  //!< electron energy in [J]
+		std::vector<double> tabs;  //!< s_kin = s - m^2 in [J**2]
+		std::vector< std::vector<double> > tabCDF;  //!< cumulative interaction rate
+		std::vector<AliasTable> tabAlias;  //!< alias tables of the tabCDF rows
+	};
+	ref_ptr<Tables> tables;
+
+	// rates of the cell fields of a SpatialPhotonField, interpolated by position
+	struct CellRates {
+		ref_ptr<PhotonField> field;
+		std::vector<double> tabEnergy;
+		std::vector<double> tabRate;
+		LogAxis energyAxis;
+		ref_ptr<Tables> tables;
+	};
+	const SpatialPhotonField *spatialField;  //!< photonField if spatial, else NULL
+	std::vector<CellRates> cellRates;  //!< one per distinct cell field
+	std::vector<size_t> cellRateIndex;  //!< cellRates of each cell
+
+	mutable std::unique_ptr<std::once_flag> prepared;  //!< reset when the needed tables change
+
+	void loadTables();  //!< load the tables of the field that are needed and missing
+	ref_ptr<Tables> loadCumulativeRate(const std::string &fieldName);
+	void requireTables() const;  //!< load the tables once before their first use
+	const Tables &getTables(const Candidate *candidate) const;
 
 public:
 	EMInverseComptonScattering(
 		ref_ptr<PhotonField> photonField, //!< target photon background
 		bool havePhotons = false,      //!< switch to create secondary photon
-		double limit = 0.1             //!< step size limit as fraction of mean free path
+		double limit = 0.1,            //!< step size limit as fraction of mean free path
+		double thinning = 0            //!< weighted sampling of secondaries (0: all, 1: maximal thinning)
 		);
 
 	void setPhotonField(ref_ptr<PhotonField> photonField);
 	void setHavePhotons(bool havePhotons);
 	void setLimit(double limit);
+	/// Thinning of the secondaries, as in EMPairProduction::setThinning
+	void setThinning(double thinning);
+	double getThinning() const;
 
 	void initRate(std::string filename);
 	void initCumulativeRate(std::string filename);
+	void prepare();
 
 	void process(Candidate *candidate) const;
+	unsigned int getParticleClasses() const;
+	size_t getMemoryUsage() const;
 	void performInteraction(Candidate *candidate) const;
+	bool hasInteractionRate() const;
+	double getInteractionRate(const Candidate *candidate) const;
+	void performStochasticInteraction(Candidate *candidate) const;
 };
 
 } // namespace crpropa
@@ -3,7 +3,10 @@
 
 #include "crpropa/Module.h"
 #include "crpropa/PhotonBackground.h"
+#include "crpropa/AliasTable.h"
 #include <fstream>
+#include <memory>
+#include <mutex>
 
 namespace crpropa {
 /**
@@ -24,32 +27,53 @@ private:
 	ref_ptr<PhotonField> photonField;
 	bool haveElectrons;
 	double limit;
+	double thinning;  //!< weighted sampling of the secondaries, 0: all, 1: maximal thinning
 
 	// tabulated interaction rate 1/lambda(E)
 	std::vector<double> tabEnergy;  //!< electron energy in [J]
 	std::vector<double> tabRate;  //!< interaction rate in [1/m]
+	LogAxis energyAxis;  //!< index lookup in tabEnergy
 	
-	// tabulated CDF(s_kin, E) = cumulative differential interaction rate
-	std::vector<double> tabE;  //!< electron energy in [J]
-	std::vector<double> tabs;  //!< s_kin = s - m^2 in [J**2]
-	std::vector< std::vector<double> > tabCDF;  //!< cumulative interaction rate
+	// tabulated CDF(s_kin, E) = cumulative differential interaction rate,
+	// shared by all instances for the same photon field via the TableRegistry
+	struct Tables: public Referenced {
+		std::vector<double> tabE;  //!< electron energy in [J]
+		std::vector<double> tabs;  //!< s_kin = s - m^2 in [J**2]
+		std::vector< std::vector<double> > tabCDF;  //!< cumulative interaction rate
+		std::vector<AliasTable> tabAlias;  //!< alias tables of the tabCDF rows
+	};
+	ref_ptr<Tables> tables;
+	mutable std::unique_ptr<std::once_flag> prepared;  //!< reset when the needed tables change
+
+	void loadTables();  //!< load the tables of the field not loaded with an init method
+	void requireTables() const;  //!< load the tables once before their first use
 
 public:
 	EMTripletPairProduction(
 		ref_ptr<PhotonField> photonField, //!< target photon background
 		bool haveElectrons = false,    //!< switch to create secondary electron pair
-		double limit = 0.1             //!< step size limit as fraction of mean free path
+		double limit = 0.1,            //!< step size limit as fraction of mean free path
+		double thinning = 0            //!< weighted sampling of secondaries (0: all, 1: maximal thinning)
 		);
 
 	void setPhotonField(ref_ptr<PhotonField> photonField);
 	void setHaveElectrons(bool haveElectrons);
 	void setLimit(double limit);
+	/// Thinning of the secondaries, as in EMPairProduction::setThinning
+	void setThinning(double thinning);
+	double getThinning() const;
 
 	void initRate(std::string filename);
 	void initCumulativeRate(std::string filename);
+	void prepare();
 
 	void process(Candidate *candidate) const;
+	unsigned int getParticleClasses() const;
+	size_t getMemoryUsage() const;
 	void performInteraction(Candidate *candidate) const;
+	bool hasInteractionRate() const;
+	double getInteractionRate(const Candidate *candidate) const;
+	void performStochasticInteraction(Candidate *candidate) const;
 
 };
 /** @}*/
@@ -4,6 +4,8 @@
 #include "crpropa/Module.h"
 #include "crpropa/PhotonBackground.h"
 
+#include <memory>
+#include <mutex>
 #include <vector>
 
 namespace crpropa {
@@ -16,8 +18,18 @@ class ElasticScattering: public Module {
 private:
     ref_ptr<PhotonField> photonField;
 
-    std::vector<double> tabRate; // elastic scattering rate
-    std::vector<std::vector<double> > tabCDF; // CDF as function of background photon energy
+    /** Tables of a photon field, shared by all instances via the TableRegistry */
+    struct Tables: public Referenced {
+        std::vector<double> tabRate; // elastic scattering rate
+        std::vector<std::vector<double> > tabCDF; // CDF as function of background photon energy
+    };
+    ref_ptr<Tables> tables;
+
+    mutable std::unique_ptr<std::once_flag> prepared; // reset when the photon field changes
+
+    void detachTables(); // copy shared tables before modifying them
+    void loadTables(); // load the tables of the field not loaded with an init method
+    void requireTables() const; // load the tables once before their first use
 
     static const double lgmin; // minimum log10(Lorentz-factor)
     static const double lgmax; // maximum log10(Lorentz-factor)
@@ -30,8 +42,14 @@ public:
     ElasticScattering(ref_ptr<PhotonField> photonField);
     void initRate(std::string filename);
     void initCDF(std::string filename);
+    void prepare();
     void setPhotonField(ref_ptr<PhotonField> photonField);
     void process(Candidate *candidate) const;
+    unsigned int getParticleClasses() const;
+    size_t getMemoryUsage() const;
+    bool hasInteractionRate() const;
+    double getInteractionRate(const Candidate *candidate) const;
+    void performStochasticInteraction(Candidate *candidate) const;
 };
 
 } // namespace crpropa
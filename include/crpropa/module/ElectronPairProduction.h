@@ -3,6 +3,10 @@
 
 #include "crpropa/Module.h"
 #include "crpropa/PhotonBackground.h"
+#include "crpropa/AliasTable.h"
+
+#include <memory>
+#include <mutex>
 
 namespace crpropa {
 
@@ -25,9 +29,15 @@ private:
 	ref_ptr<PhotonField> photonField;
 	std::vector<double> tabLossRate; /*< tabulated energy loss rate in [J/m] for protons at z = 0 */
 	std::vector<double> tabLorentzFactor; /*< tabulated Lorentz factor */
+	LogAxis lorentzFactorAxis; /*< index lookup in tabLorentzFactor */
 	std::vector<std::vector<double> > tabSpectrum; /*< electron/positron cdf(Ee|log10(gamma)) for log10(Ee/eV)=7-24 in 170 steps and log10(gamma)=6-13 in 70 steps and*/
+	std::vector<AliasTable> tabSpectrumAlias; /*< alias tables of the tabSpectrum rows */
 	double limit; ///< fraction of energy loss length to limit the next step
 	bool haveElectrons;
+	mutable std::unique_ptr<std::once_flag> prepared; ///< reset when the needed tables change
+
+	void loadTables(); ///< load the tables of the field that are needed and missing
+	void requireTables() const; ///< load the tables once before their first use
 
 public:
 	ElectronPairProduction(ref_ptr<PhotonField> photonField, bool haveElectrons =
@@ -39,7 +49,12 @@ public:
 
 	void initRate(std::string filename);
 	void initSpectrum(std::string filename);
+	void prepare();
 	void process(Candidate *candidate) const;
+	unsigned int getParticleClasses() const;
+	size_t getMemoryUsage() const;
+	bool hasEnergyLossRate() const;
+	double getEnergyLossRate(const Candidate *candidate, double E, double z) const;
 
 	/**
 	 Calculates the energy loss length 1/beta = -E dx/dE in [m]
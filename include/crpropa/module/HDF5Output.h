@@ -5,8 +5,14 @@
 
 
 #include "crpropa/module/Output.h"
+#include "crpropa/AsyncRowWriter.h"
 #include <stdint.h>
 #include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <H5Ipublic.h>
 
@@ -49,8 +55,29 @@ DATASET "OUTPUTTYPE" {
 } } }
 ```
 
+ In the columnar layout the group "CRPROPA3" holds the attributes and one
+ chunked dataset per column instead, named like the members of the compound
+ type. Every numeric column has the attributes "min" and "max" with the
+ extrema of every chunk, which allows readers to skip chunks.
+
+ In the normalized layout the source and creation states are written once
+ into the datasets "SOURCES" and "CREATED" instead of in every row. The rows
+ reference the source by its serial number SN0 and the creation state by its
+ index C1 in "CREATED", whose rows are unique combinations of SN1 and the
+ state. Like the outputs of a cascade, which share the states of their
+ ancestors.
+
+ Every thread collects its rows in a small buffer of its own without locking
+ and hands the full buffer to a shared buffer. The shared buffer is written to
+ the file by the thread that filled it while the other threads continue with
+ a second shared buffer.
  */
 class HDF5Output: public Output {
+public:
+	enum Compression {
+		NoCompression, Deflate, Zstd
+	};
+private:
 
 	typedef struct OutputRow {
 		double D;
@@ -83,18 +110,69 @@ class HDF5Output: public Output {
 		double P1y;
 		double P1z;
 		double weight;
+		uint64_t C1; // index of the creation state in the normalized layout
 		unsigned char propertyBuffer[propertyBufferSize];
 	} OutputRow;
 
+	struct Column {
+		std::string name;
+		size_t offset, size;
+		hid_t type, dset;
+		bool numeric;
+		std::vector<double> min, max; // of every chunk
+	};
+
 	std::string filename;
 
 	hid_t file, sid;
 	hid_t dset, dataspace;
-	mutable std::vector<OutputRow> buffer;
+	std::unique_ptr<std::once_flag> opened;
+	mutable std::vector<OutputRow> buffer, writeBuffer;
+	mutable std::vector<std::vector<OutputRow> > threadBuffers;
+	mutable std::mutex bufferMutex, writeMutex;
+	mutable std::vector<Column> columns;
+
+	bool columnar;
+	bool normalized;
+	hid_t stateSid[2], stateDset[2]; // sources and creation states
+	mutable std::unordered_set<uint64_t> writtenSources;
+	mutable std::unordered_map<std::string, uint64_t> createdIndex;
+	mutable std::vector<OutputRow> stateRows;
+	size_t chunkSize;
+	Compression compression;
+	int compressionLevel;
+	bool shuffle;
 
 	time_t lastFlush;
 	unsigned int flushLimit;
 	unsigned int candidatesSinceFlush;
+
+	bool async;
+	size_t asyncCapacity;
+	std::unique_ptr<AsyncRowWriter<OutputRow> > writer;
+	mutable std::unique_ptr<OrderedRowSpill<OutputRow> > spill; // of the ordered output
+
+	void appendRows(const OutputRow *rows, size_t n) const;
+	void flushThreadBuffers() const;
+	void flushBuffer(bool ifFull = false) const;
+	void writeRows(std::vector<OutputRow> &rows) const;
+	void appendToDataset(hid_t dataset, hid_t type, const OutputRow *rows, hsize_t n) const;
+	void writeStates(std::vector<OutputRow> &rows) const;
+	bool hasSourceColumns() const;
+	bool hasCreatedColumns() const;
+	void insertSourceColumns(hid_t type) const;
+	void insertCreatedColumns(hid_t type) const;
+	void writeColumns(const std::vector<OutputRow> &rows) const;
+	void createRowType();
+	void initBuffers();
+	bool reopen();
+	void createColumns(hid_t plist);
+	void closeColumns();
+	void checkClosed() const;
+	void startWriter();
+	void stopWriter();
+	void writeOrdered() const;
+	void mergeFile(const std::string &filename);
 public:
 	HDF5Output();
 	HDF5Output(const std::string &filename);
@@ -105,15 +183,65 @@ public:
 	herr_t insertStringAttribute(const std::string &key, const std::string &value);
 	herr_t insertDoubleAttribute(const std::string &key, const double &value);
 	std::string getDescription() const;
+	/// Bytes of the row buffers and of the queue of the asynchronous writer,
+	/// approximate while the threads write
+	size_t getMemoryUsage() const;
 
 	/// Force flush after N events. In long running applications with scarse
 	/// output this can be set to 1 or 0 to avoid data corruption. In applications
-	/// with frequent output this should be set to a high number (default)
+	/// with frequent output this should be set to a high number (default).
+	/// Limits below the size of the per-thread buffers apply to every thread.
 	void setFlushLimit(unsigned int N);
 
+	/**
+	 Asynchronous output: the threads queue their rows without locking and
+	 a dedicated writer thread writes them to the file. Threads wait if the
+	 queue is full.
+	 @param async		enable the writer thread
+	 @param capacity	number of rows in the queue
+	 */
+	void setAsync(bool async = true, size_t capacity = 4096);
+	bool isAsync() const;
+
+	/// One dataset per column instead of a compound dataset, to be set before
+	/// the file is opened
+	void setColumnar(bool columnar = true);
+	bool isColumnar() const;
+	/// Write the source and creation states once into separate datasets, to
+	/// be set before the file is opened
+	void setNormalized(bool normalized = true);
+	bool isNormalized() const;
+	/// Rows per chunk of the datasets, 16384 by default
+	void setChunkSize(size_t rows);
+	size_t getChunkSize() const;
+	/**
+	 Filters of the datasets, deflate with level 5 and without shuffle by default
+	 @param method	zstd needs the HDF5 filter plugin with the id 32015
+	 @param level	compression level
+	 @param shuffle	byte shuffle before the compression
+	 */
+	void setCompression(Compression method, int level = 5, bool shuffle = true);
+
 	void open(const std::string &filename);
+	const std::string &getFilename() const;
 	void close();
+	/// Write all buffered rows, within a parallel section only those of the
+	/// calling thread
 	void flush() const;
+	/**
+	 Discard the rows after a checkpoint marker. The file is only created
+	 with the first row, so that ModuleList::resume continues the file of an
+	 interrupted process: it is opened again and shortened to the marker.
+	 Not possible for the columnar and normalized layouts and for ordered
+	 outputs with rows after the marker.
+	 @param rows		number of rows at the marker
+	 @param position	the number of rows as well
+	 @return			false if the output cannot be rewound to the marker
+	 */
+	bool rewind(size_t rows, uint64_t position);
+	/// Append all rows of another file written by an HDF5Output with the
+	/// same columns and properties, e.g. the per-rank files of a distributed run
+	void merge(const std::string &filename);
 
 };
 /** @}*/
@@ -0,0 +1,143 @@
+#ifndef CRPROPA_HISTOGRAMOUTPUT_H
+#define CRPROPA_HISTOGRAMOUTPUT_H
+
+#include "crpropa/Module.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace crpropa {
+/**
+ * \addtogroup Output
+ * @{
+ */
+
+/**
+ @class HistogramOutput
+ @brief Accumulates weighted N-dimensional histograms of the candidates instead of writing them event by event.
+
+ Every histogram has one or more axes, each binning one quantity of the
+ candidate. The candidates are counted with their weight; the weights and the
+ squared weights are summed per bin. Candidates outside the range of any axis
+ are not counted.
+
+ Every thread fills a copy of the histograms of its own, the copies are summed
+ when the histograms are read or saved. Optionally a randomly sampled fraction
+ of the candidates is passed on to an event-level output module.
+
+ Example: energy and mass group spectrum at the observer
+ \code
+ HistogramOutput hist("spectrum.txt");
+ size_t h = hist.addHistogram("spectrum");
+ hist.addAxis(h, HistogramOutput::Energy, 50, 1 * EeV, 1000 * EeV, true);
+ std::vector<double> groups = {1, 2, 5, 23, 39, 57};
+ hist.addAxis(h, HistogramOutput::MassNumber, groups);
+ \endcode
+ */
+class HistogramOutput: public Module {
+public:
+	enum Quantity {
+		Energy, ///< current energy [J]
+		SourceEnergy, ///< energy at the source [J]
+		CreatedEnergy, ///< energy at creation [J]
+		Id, ///< current particle id, binned by a list of ids
+		MassNumber, ///< current mass number
+		ChargeNumber, ///< current charge number
+		Redshift, ///< current redshift
+		TrajectoryLength, ///< trajectory length [m]
+		Direction ///< HEALPix pixel (ring scheme) of the arrival direction, opposite to the momentum
+	};
+
+private:
+	struct Axis {
+		Quantity quantity;
+		std::vector<double> edges; // bin edges, or the ids of an Id axis
+		size_t nBins;
+		bool uniform, logarithmic; // equidistant edges, in log if logarithmic
+		double lower, upper; // range of the equidistant edges
+		size_t nSide; // resolution of a Direction axis
+	};
+	struct Histogram {
+		std::string name;
+		std::vector<Axis> axes;
+		size_t nBins; // product of the bins of all axes
+		size_t offset; // position of the bins in the storage
+	};
+	std::vector<Histogram> histograms;
+	size_t nStored; // bins of all histograms
+
+	// per thread: weights and squared weights of all bins, the last storage
+	// is shared by the threads not known at the first candidate
+	mutable std::vector<std::vector<double> > threadStorage;
+	mutable std::vector<double> total;
+	mutable std::unique_ptr<std::once_flag> allocated;
+	mutable std::mutex sharedMutex, totalMutex;
+	mutable size_t count;
+
+	std::string filename;
+	ref_ptr<Module> eventOutput;
+	double eventFraction;
+
+	void allocate() const;
+	void fill(std::vector<double> &storage, const Candidate *candidate) const;
+	void reduce() const;
+	void addAxis(size_t histogram, const Axis &axis);
+	void checkHistogram(size_t histogram) const;
+	void checkNotFilled() const;
+	void updateDescription();
+
+public:
+	/// Histograms that are only read from memory
+	HistogramOutput();
+	/// Histograms saved to the file when the module is destroyed
+	HistogramOutput(const std::string &filename);
+	~HistogramOutput();
+
+	void process(Candidate *candidate) const;
+
+	/// Add a histogram without axes, returns its index
+	size_t addHistogram(const std::string &name);
+	/// Add an axis of nBins equidistant bins from lower to upper, in
+	/// log(quantity) if logarithmic
+	void addAxis(size_t histogram, Quantity quantity, size_t nBins, double lower,
+			double upper, bool logarithmic = false);
+	/// Add an axis with the given bin edges, e.g. the mass groups of a
+	/// MassNumber axis
+	void addAxis(size_t histogram, Quantity quantity, const std::vector<double> &edges);
+	/// Add an Id axis with one bin per id
+	void addIdAxis(size_t histogram, const std::vector<int> &ids);
+	/// Add a Direction axis of 12 nSide^2 HEALPix pixels
+	void addDirectionAxis(size_t histogram, size_t nSide);
+
+	/// Pass a random fraction of the candidates to an event-level output
+	void setEventOutput(Module *output, double fraction = 1.);
+
+	size_t getNumberOfHistograms() const;
+	size_t getNumberOfAxes(size_t histogram) const;
+	/// Number of bins of the histogram, the index of the last axis runs fastest
+	size_t getNumberOfBins(size_t histogram) const;
+	/// Summed weights of the bins of all threads
+	std::vector<double> getWeights(size_t histogram) const;
+	/// Summed squared weights of the bins of all threads
+	std::vector<double> getSquaredWeights(size_t histogram) const;
+	/// Flat bin index of the candidate in the histogram, -1 if out of range
+	long getBin(size_t histogram, const Candidate *candidate) const;
+	/// Number of processed candidates
+	size_t size() const;
+	/// Clear all bins
+	void clear();
+
+	/// Save the non-empty bins of all histograms to a text file
+	void save(const std::string &filename) const;
+};
+/** @}*/
+
+/// HEALPix pixel (ring scheme) of the direction, with 12 nSide^2 pixels, the
+/// pole is +z and the longitude is counted from +x
+size_t healpixRingPixel(size_t nSide, const Vector3d &direction);
+
+} // namespace crpropa
+
+#endif // CRPROPA_HISTOGRAMOUTPUT_H
@@ -0,0 +1,74 @@
+#ifndef CRPROPA_INTERACTIONSAMPLER_H
+#define CRPROPA_INTERACTIONSAMPLER_H
+
+#include "crpropa/Module.h"
+
+#include <vector>
+
+namespace crpropa {
+/**
+ * \addtogroup EnergyLosses
+ * @{
+ */
+
+/**
+ @class InteractionSampler
+ @brief Samples the stochastic interactions of several modules at once.
+
+ Modules with stochastic interactions (Module::hasInteractionRate) are treated
+ as competing processes: per step the total rate is summed, a single
+ interaction distance is drawn and the interacting module is selected in
+ proportion to its rate. All other modules, e.g. continuous energy losses,
+ are processed first in the order they were added.
+
+ The next step is limited to a fraction of the mean free path with respect
+ to the total rate, instead of the individual rates of every module. The
+ default of one mean free path needs far fewer steps than the interaction
+ modules with their default of 0.1, at the cost of evaluating the rates less
+ frequently along the trajectory.
+
+ In the event-driven mode (setEventDriven), neutral particles jump to their
+ next interaction: an optical depth is drawn once per interaction and is used
+ up along the trajectory with the rates of every step. The next step is
+ limited to the remaining optical depth instead of the fraction of the mean
+ free path, so that, together with observers and boundaries limiting the
+ steps to their distance along the straight line, photons and neutrinos only
+ need a few steps between their events.
+ */
+class InteractionSampler: public Module {
+	std::vector<ref_ptr<Module> > interactions;
+	std::vector<unsigned int> interactionClasses;
+	std::vector<ref_ptr<Module> > continuous;
+	double limit;
+	bool eventDriven;
+
+	double rate(size_t i, const Candidate *candidate, unsigned int particleClass) const;
+	void interact(Candidate *candidate, unsigned int particleClass, double totalRate) const;
+	void processEvents(Candidate *candidate) const;
+public:
+	/**
+	 @param limit	maximum step as fraction of the mean free path
+	 */
+	InteractionSampler(double limit = 1);
+	void add(Module *module);
+	void setLimit(double limit);
+	double getLimit() const;
+	/** Jump to the next interaction of neutral particles instead of limiting their steps to a fraction of the mean free path */
+	void setEventDriven(bool eventDriven);
+	bool isEventDriven() const;
+	/** Number of modules with stochastic interactions */
+	size_t getNumberOfInteractions() const;
+	void prepare();
+	void process(Candidate *candidate) const;
+	/** Sum of the interaction rates in [1/m] of the added modules */
+	double getTotalRate(const Candidate *candidate) const;
+	/** Perform an interaction of a module selected in proportion to its share of the total rate */
+	void performInteraction(Candidate *candidate, double totalRate) const;
+	unsigned int getParticleClasses() const;
+	std::string getDescription() const;
+};
+
+/** @}*/
+} // namespace crpropa
+
+#endif // CRPROPA_INTERACTIONSAMPLER_H
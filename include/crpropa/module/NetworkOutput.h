@@ -0,0 +1,109 @@
+#ifndef CRPROPA_NETWORKOUTPUT_H
+#define CRPROPA_NETWORKOUTPUT_H
+
+#include "crpropa/module/Output.h"
+#include "crpropa/AsyncRowWriter.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace crpropa {
+/**
+ * \addtogroup Output
+ * @{
+ */
+
+/**
+ @class NetworkOutput
+ @brief Streams the candidates as batches of binary records over a TCP connection.
+
+ The selected columns and properties are packed into records without
+ padding, named like the members of HDF5Output. Every thread collects a batch
+ of records of its own, the full batches are queued and sent by a dedicated
+ thread, which also connects to the server. If the queue is full, the batch
+ is dropped by default, such that the simulation does not wait for a slow
+ consumer, or the thread waits with the Block policy.
+
+ Stream format, all integers little endian:
+ - header: the magic string "CRPNET1\0", the uint32 record size and the
+   uint32 length of the schema, which has one line "name\tdtype\n" per
+   column with the numpy type string of the column, e.g. "E\t<f8"
+ - batch: the uint32 number of records, followed by the records
+ */
+class NetworkOutput: public Output {
+public:
+	enum Policy {
+		Drop, ///< drop the batches if the queue is full
+		Block ///< wait until the queue has room
+	};
+
+private:
+	struct Column {
+		int quantity;
+		size_t property; // index of the property
+		size_t offset; // in the record
+	};
+
+	std::string host;
+	int port;
+	int connection; // socket descriptor, -1 if not connected
+	size_t batchSize, queueCapacity;
+	Policy policy;
+
+	mutable std::vector<Column> columns;
+	mutable size_t recordSize;
+	mutable std::string schema;
+
+	// per thread: records not yet queued, the last batch is shared by the
+	// threads not known at the first candidate
+	mutable std::vector<std::string> batches;
+	mutable std::unique_ptr<std::once_flag> started;
+	mutable std::mutex sharedMutex;
+	mutable std::atomic<size_t> dropped;
+	mutable std::unique_ptr<AsyncRowWriter<std::string> > writer;
+
+	void start() const;
+	void compileColumns() const;
+	void writeRecord(const Candidate *candidate, unsigned char *record) const;
+	void append(std::string &batch, const unsigned char *record) const;
+	void queue(std::string &batch) const;
+	void connect();
+	void send(const std::string &data);
+	void disconnect();
+
+public:
+	NetworkOutput(const std::string &host, int port);
+	NetworkOutput(const std::string &host, int port, OutputType outputtype);
+	~NetworkOutput();
+
+	void process(Candidate *candidate) const;
+
+	/// Records of a batch, 1024 by default
+	void setBatchSize(size_t records);
+	size_t getBatchSize() const;
+	/// Batches in the send queue, 64 by default
+	void setQueueCapacity(size_t batches);
+	size_t getQueueCapacity() const;
+	/// What happens if the queue is full, Drop by default
+	void setPolicy(Policy policy);
+	Policy getPolicy() const;
+	/// Number of records that were dropped
+	size_t getDropped() const;
+	/// Bytes of a record
+	size_t getRecordSize() const;
+
+	/// Queue the records of all threads and wait until they are sent, within a
+	/// parallel section only those of the calling thread are queued
+	void flush() const;
+	/// Send all records and close the connection
+	void close();
+	std::string getDescription() const;
+};
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_NETWORKOUTPUT_H
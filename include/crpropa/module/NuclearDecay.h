@@ -2,7 +2,10 @@
 #define CRPROPA_NUCLEARDECAY_H
 
 #include "crpropa/Module.h"
+#include "crpropa/IsotopeSelection.h"
 
+#include <memory>
+#include <mutex>
 #include <vector>
 
 namespace crpropa {
@@ -20,6 +23,7 @@ namespace crpropa {
  The resulting non-hadronic secondary particles (e+, e-, neutrinos, gamma) can optionally be created.
 
  For details on the preprocessing of the NuDat2 data refer to "CRPropa3-data/calc_decay.py".
+ With an IsotopeSelection only the decays of the selected nuclei are loaded.
  */
 class NuclearDecay: public Module {
 private:
@@ -27,13 +31,23 @@ private:
 	bool haveElectrons;
 	bool havePhotons;
 	bool haveNeutrinos;
+	ref_ptr<IsotopeSelection> isotopes; // nuclei to load the decays of, all if null
 	struct DecayMode {
 		int channel; // (#beta- #beta+ #alpha #proton #neutron)
-		double rate; // decay rate in [1/m]
-		std::vector<double> energy; // photon energies of ensuing gamma decays
-		std::vector<double> intensity; // probabilities of ensuing gamma decays
+		double cdf; // cumulative share of the total decay rate of the nucleus
+		size_t gammaBegin, gammaEnd; // range of ensuing gamma decays in the gamma pool
 	};
-	std::vector<std::vector<DecayMode> > decayTable; // decayTable[Z * 31 + N] = vector<DecayMode>
+	// flat tables indexed by Z * 31 + N
+	std::vector<double> totalRate; // total decay rate in [1/m], 0 for stable nuclei
+	std::vector<size_t> modeOffset; // decay modes of nucleus i are [modeOffset[i], modeOffset[i+1])
+	std::vector<DecayMode> decayModes;
+	std::vector<double> gammaEnergy; // photon energies of ensuing gamma decays
+	std::vector<double> gammaIntensity; // probabilities of ensuing gamma decays
+	mutable std::unique_ptr<std::once_flag> prepared;
+
+	void loadTables(); ///< load the decay table
+	void requireTables() const; ///< load the tables once before their first use
+	int sampleChannel(int index) const;
 
 public:
 	NuclearDecay(bool electrons = false, bool photons = false, bool neutrinos = false, double limit = 0.1);
@@ -41,8 +55,17 @@ public:
 	void setHaveElectrons(bool b);
 	void setHavePhotons(bool b);
 	void setHaveNeutrinos(bool b);
+	/** Load only the decays of the nuclei in the selection, null for all */
+	void setIsotopeSelection(ref_ptr<IsotopeSelection> isotopes);
+	ref_ptr<IsotopeSelection> getIsotopeSelection() const;
+	void prepare();
 	void process(Candidate *candidate) const;
+	unsigned int getParticleClasses() const;
+	size_t getMemoryUsage() const;
 	void performInteraction(Candidate *candidate, int channel) const;
+	bool hasInteractionRate() const;
+	double getInteractionRate(const Candidate *candidate) const;
+	void performStochasticInteraction(Candidate *candidate) const;
 	void gammaEmission(Candidate *candidate, int channel) const;
 	void betaDecay(Candidate *candidate, bool isBetaPlus) const;
 	void nucleonEmission(Candidate *candidate, int dA, int dZ) const;
@@ -54,6 +77,16 @@ public:
 	 @param gamma   Lorentz factor of particle
 	 */
 	double meanFreePath(int id, double gamma);
+
+	/**
+	 Decay channels of a nucleus, coded as in performInteraction, and their
+	 rates in the rest frame in [1/m], for deterministic solvers.
+	 Both are empty for stable nuclei.
+	 @param id			PDG particle id
+	 @param channels	decay channels
+	 @param rates		rates of the channels
+	 */
+	void getDecayChannels(int id, std::vector<int> &channels, std::vector<double> &rates) const;
 };
 /** @}*/
 
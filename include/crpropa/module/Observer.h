@@ -11,6 +11,7 @@
 #include "../Referenced.h"
 #include "../Vector3.h"
 #include "../Geometry.h"
+#include "PropagationDP.h"
 
 namespace crpropa {
 
@@ -50,10 +51,16 @@ public:
 	Observer();
 	void add(ObserverFeature *feature);
 	void onDetection(Module *action, bool clone = false);
+	Module *getDetectionAction() const;
 	void process(Candidate *candidate) const;
+	/** Detection state of the candidate from all features, without acting on it */
+	DetectionState checkDetection(Candidate *candidate) const;
+	/** Act on a detection: the features, the action, the flag and the deactivation */
+	void detect(Candidate *candidate) const;
 	std::string getDescription() const;
 	void setFlag(std::string key, std::string value);
 	void setDeactivateOnDetection(bool deactivate);
+	bool getDeactivateOnDetection() const;
 };
 
 
@@ -72,17 +79,78 @@ public:
 /**
  @class ObserverSurface
  @brief Detects particles crossing the durface
+
+ With the dense output of a PropagationDP, the crossing is located within the
+ step and the candidate is moved back onto the surface, instead of limiting the
+ steps to the distance to the surface. The observer then has to follow the
+ propagation module directly.
+ Otherwise the steps are limited to the distance to the surface, in the
+ event-driven mode those of neutral particles to the distance along their
+ straight line to the surface (Surface::distanceAlong).
+ A SurfaceCollection detects particles crossing any of its surfaces.
  */
 class ObserverSurface: public ObserverFeature {
 	private:
 		ref_ptr<Surface> surface;
+		ref_ptr<PropagationDP> propagation;
+		bool eventDriven;
 
 	public:
 		ObserverSurface(Surface* _surface);
+		/** Locate the crossings with the dense output of the propagation module, NULL (default) to limit the steps */
+		void setDenseOutput(PropagationDP *propagation);
+		/** Limit the steps of neutral particles to the crossing along their straight line */
+		void setEventDriven(bool eventDriven);
 		DetectionState checkDetection(Candidate *candidate) const;
 		std::string getDescription() const;
 };
 
+/**
+ @class ObserverSphereArray
+ @brief Detects particles crossing any of many spheres, e.g. the stations of an array
+
+ Behaves as one ObserverSurface(Sphere(center, radius)) per sphere in a single
+ feature: particles are detected when crossing a sphere surface in either
+ direction, and the steps are limited to the distance to the nearest surface.
+ The spheres are indexed by a uniform grid of cells, so each check only tests
+ the spheres in the cells of the step ends and the step limit searches the cells
+ in shells around the particle until the nearest surface is found.
+ Adding a sphere rebuilds the index.
+ */
+class ObserverSphereArray: public ObserverFeature {
+	std::vector<Vector3d> centers;
+	std::vector<double> radii;
+	std::string indexKey;
+	Candidate::PropertyKey indexProperty;
+
+	// cells of the grid hold the spheres whose bounding box overlaps them
+	Vector3d origin;
+	double cellSize;
+	int cells[3];
+	std::vector<uint32_t> cellStart; // offsets into cellSpheres, one per cell and the end
+	std::vector<uint32_t> cellSpheres;
+
+	void updateIndex();
+	bool cellOf(const Vector3d &position, int cell[3]) const;
+	size_t cellIndex(int ix, int iy, int iz) const;
+public:
+	ObserverSphereArray();
+	void add(const Vector3d &center, double radius);
+	size_t size() const;
+	/**
+	 Store the index of the detecting sphere (in the order of add) as an
+	 integer property with this name, none if empty (default)
+	 */
+	void setIndexKey(const std::string &key);
+	/// Distance to the nearest sphere surface, at most maxDistance
+	double nearestDistance(const Vector3d &position,
+			double maxDistance = std::numeric_limits<double>::max()) const;
+	/// Index of a sphere crossed between the two positions, -1 if none
+	long crossedSphere(const Vector3d &previous, const Vector3d &current) const;
+	DetectionState checkDetection(Candidate *candidate) const;
+	std::string getDescription() const;
+};
+
 /**
  @class ObserverSmallSphere
  @brief Detects particles upon entering a sphere
@@ -221,15 +289,37 @@ public:
  @class ObserverTimeEvolution
  @brief Observes the time evolution of the candidates (phase-space elements)
  This observer is very useful if the time evolution of the particle density is needed. It detects all candidates in regular timeintervals and limits the nextStep of candidates to prevent overshooting of detection intervals.
+
+ The detection times are either an equidistant or logarithmic grid, which is
+ not stored and whose next time is computed in O(1), or an arbitrary sorted
+ list, which is searched by bisection. Adding a time to a grid turns it into
+ a list.
  */
 class ObserverTimeEvolution: public ObserverFeature {
+public:
+	enum Scaling {
+		List, Linear, Logarithmic
+	};
 private:
   std::vector<double> detList;
+  Scaling scaling;
+  double tMin, tStep; // first time and spacing, logarithmic for a logarithmic grid
+  size_t nTimes;
+  size_t countTimes(double length) const;
 public:
   ObserverTimeEvolution();
+  /** Equidistant grid of numb times, starting at min with a spacing of dist */
   ObserverTimeEvolution(double min, double dist, double numb);
+  /**
+   Grid of numb times from min to max
+   @param log	logarithmic instead of equidistant spacing, needs min > 0
+   */
+  ObserverTimeEvolution(double min, double max, size_t numb, bool log);
   void addTime(const double &position);
-  const std::vector<double>& getTimes() const;
+  size_t getNumberOfTimes() const;
+  double getTime(size_t i) const;
+  Scaling getScaling() const;
+  std::vector<double> getTimes() const;
   DetectionState checkDetection(Candidate *candidate) const;
   std::string getDescription() const;
 };
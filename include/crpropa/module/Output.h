@@ -2,6 +2,7 @@
 #define CRPROPA_ABSTRACT_OUTPUT_H
 
 #include "crpropa/Module.h"
+#include "crpropa/OrderedRowSpill.h"
 #include "crpropa/Variant.h"
 
 #include <bitset>
@@ -19,19 +20,50 @@ protected:
 	double lengthScale, energyScale;
 	std::bitset<64> fields;
 
+	/// Property column, compiled at enableProperty
 	struct Property
 	{
 		std::string name;
 		std::string comment;
 		Variant defaultValue;
+		Candidate::PropertyKey key; ///< interned name
+		Variant::Type type; ///< type of the column, that of the default value
+		size_t offset; ///< position in a row of the property columns
+		size_t size; ///< bytes in the row, strings have the length of the default value
 	};
 	std::vector<Property> properties;
 
 	bool oneDimensional;
 	mutable size_t count;
+	bool ordered;
+	size_t orderedBufferRows;
+
+	/// Comparison of the filter, in the units of the columns
+	struct FilterCondition {
+		int quantity;
+		int comparison;
+		double value;
+		Candidate::PropertyKey key; ///< of property comparisons
+	};
+	std::vector<FilterCondition> filter;
+	std::string filterExpression;
 
 	void modify();
 
+	/// Value of the property column, the default value if the candidate does not have it
+	const Variant &getPropertyValue(const Candidate *candidate, const Property &property) const;
+	/// Write the property column at its offset in a row, converted to the type of the column
+	void writeProperty(const Candidate *candidate, const Property &property, unsigned char *row) const;
+	/// Bytes of all property columns in a row
+	size_t getPropertyRowSize() const;
+	/// True if the candidate passes the filter, evaluated before a row is built
+	bool passesFilter(const Candidate *candidate) const {
+		return filter.empty() or evaluateFilter(candidate);
+	}
+	bool evaluateFilter(const Candidate *candidate) const;
+	/// Position of the row of a candidate in the ordered output
+	static RowOrderKey getOrderKey(const Candidate *candidate);
+
 public:
 	enum OutputColumn {
 		TrajectoryLengthColumn,
@@ -79,7 +111,49 @@ public:
 	void enableAll();
 	void disableAll();
 	void set1D(bool value);
+	/// Take the columns, properties, scales and filter of another output
+	void copyConfiguration(const Output &other);
+	/**
+	 Write only the candidates passing all comparisons of the expression,
+	 joined by "and" or "&&", e.g. "E >= 10 and E < 100 and ID == 1000010010".
+	 Comparisons are <, <=, >, >=, == and != of a number with E, E0, E1 [energy
+	 scale], ID, ID0, ID1, z, D [length scale], W or an enabled or other
+	 property, candidates without the property do not pass. An empty
+	 expression removes the filter. Filtered candidates are not counted by size.
+	 */
+	void setFilter(const std::string &expression);
+	const std::string &getFilter() const;
+	/**
+	 Ordered output: the rows are written in the order of the index of their
+	 primary, as tagged by the ModuleList in the property PrimaryIndex, and
+	 within a primary in the order of the tree of secondaries, from their
+	 random streams, which does not depend on the threads. The ModuleList
+	 tags its primaries only if it holds an ordered output, directly, as action
+	 of an Observer or in a nested ModuleList, when the run starts. The threads
+	 keep their rows in buffers of their own, which are spilled to temporary
+	 files when full and merged when the output is closed. With counter-based random
+	 numbers two runs give the same file for any number of threads, except for
+	 the serial numbers. Flush does not write the rows before close. To be set
+	 before the first row.
+	 @param ordered		enable the ordered output
+	 @param bufferRows	rows per thread buffer
+	 */
+	void setOrdered(bool ordered = true, size_t bufferRows = 16384);
+	bool isOrdered() const;
 	size_t size() const;
+	/// Write buffered output to the underlying file or stream
+	virtual void flush() const;
+	/// Position of the flushed output, stored as marker by the checkpoints of
+	/// the ModuleList, the number of rows by default
+	virtual uint64_t getCheckpointPosition() const;
+	/**
+	 Discard the rows written after a checkpoint marker. The default only
+	 accepts an output that holds exactly the marked rows.
+	 @param rows		number of rows at the marker
+	 @param position	position at the marker, see getCheckpointPosition
+	 @return			false if the output cannot be rewound to the marker
+	 */
+	virtual bool rewind(size_t rows, uint64_t position);
 
 	void process(Candidate *) const;
 };
@@ -0,0 +1,68 @@
+#ifdef CRPROPA_HAVE_PARQUET
+
+#ifndef CRPROPA_PARQUETOUTPUT_H
+#define CRPROPA_PARQUETOUTPUT_H
+
+#include "crpropa/module/Output.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace crpropa {
+/**
+ * \addtogroup Output
+ * @{
+ */
+
+/**
+ @class ParquetOutput
+ @brief Output to the Apache Parquet format.
+
+ The selected columns and properties are the columns of the file, named like
+ the members of HDF5Output, such that the file can be read directly by
+ pyarrow, pandas or Spark. The output type, the CRPropa version and the
+ scales are stored in the key-value metadata of the schema.
+
+ Every thread collects its rows in a record batch of its own, which is
+ written as a row group when it is full. The particle ids are dictionary
+ encoded, all columns are compressed with zstd.
+ */
+class ParquetOutput: public Output {
+	struct Impl;
+	std::string filename;
+	std::unique_ptr<Impl> impl;
+	std::unique_ptr<std::once_flag> opened;
+	size_t rowGroupSize;
+	int compressionLevel;
+
+	void open();
+	void writeBatch(size_t thread) const;
+public:
+	ParquetOutput(const std::string &filename);
+	ParquetOutput(const std::string &filename, OutputType outputtype);
+	~ParquetOutput();
+
+	void process(Candidate *candidate) const;
+
+	/// Rows of a row group, collected by every thread, 65536 by default
+	void setRowGroupSize(size_t rows);
+	size_t getRowGroupSize() const;
+	/// zstd compression level, 3 by default
+	void setCompressionLevel(int level);
+	int getCompressionLevel() const;
+
+	const std::string &getFilename() const;
+	/// Write the rows of all threads, within a parallel section only those of
+	/// the calling thread
+	void flush() const;
+	void close();
+	std::string getDescription() const;
+};
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_PARQUETOUTPUT_H
+
+#endif // CRPROPA_HAVE_PARQUET
@@ -1,7 +1,10 @@
 #ifndef CRPROPA_PARTICLECOLLECTOR_H
 #define CRPROPA_PARTICLECOLLECTOR_H
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <string>
+#include <stdint.h>
 
 #include "crpropa/Module.h"
 #include "crpropa/ModuleList.h"
@@ -13,17 +16,88 @@ namespace crpropa {
  * @{
  */
 
+/// Particle state of a CompactCandidate
+struct CompactParticleState {
+	double energy;
+	double position[3];
+	float direction[3];
+	int32_t id;
+};
+
+/// Plain record of a candidate kept by ParticleCollector in compact mode, 208 bytes
+struct CompactCandidate {
+	CompactParticleState current, source, created;
+	double weight;
+	double trajectoryLength;
+	float redshift;
+	uint32_t reserved;
+	uint64_t serialNumber, sourceSerialNumber, createdSerialNumber;
+	uint64_t randomStream, randomStart; ///< random stream at the source
+};
+
 /**
  @class ParticleCollector
  @brief A helper ouput mechanism to keep candidates in-memory and directly transfer them to Python
+
+ Within a parallel section every thread collects into a container of its
+ own, the containers are merged when the collector is accessed. Accessed from
+ within a parallel section, only the candidates of the calling thread are
+ merged.
+
+ In compact mode only a CompactCandidate record of the current, source and
+ created state, the weight, redshift, trajectory length and serial numbers is
+ and the random stream at the source are kept per candidate, without
+ properties, secondaries or the previous state.
+ The candidates returned by operator[] and passed by reprocess are then
+ rebuilt from the records, the iterators and getContainer are empty.
+
+ dump writes the Output::Everything columns of TextOutput, dumpBinary the
+ full states of the candidates: the current, previous, source and created
+ particle states, weight, redshift, trajectory length, steps, serial numbers,
+ random stream and the properties. Secondaries and parents are not kept, the
+ loaded candidates are detached with the dumped serial numbers. load reads
+ both formats, the binary one is mapped into memory and decoded in parallel.
+ reprocessDump passes the candidates of a binary dump to a module without
+ collecting them.
+
+ Binary format, in the byte order of the machine:
+ - header of 64 bytes: the magic string "CRPCOL01", the uint32 version, the
+   uint32 size of a record, the uint64 number of candidates and the uint64
+   size of the properties
+ - a record of fixed size per candidate, with the offset and number of its
+   properties
+ - the properties: per property the uint32 length of the name, the name, the
+   uint32 Variant::Type, the uint32 size of the value and the value
  */
 class ParticleCollector: public Module {
 protected:
         typedef std::vector<ref_ptr<Candidate> > tContainer;
         mutable tContainer container;
+        mutable std::vector<CompactCandidate> records;
         std::size_t nBuffer;
 	bool clone;
 	bool recursive;
+	bool compact;
+
+	struct ThreadContainer {
+		tContainer candidates;
+		std::vector<CompactCandidate> records;
+	};
+	mutable std::vector<ThreadContainer> threadContainers;
+	mutable std::unique_ptr<std::once_flag> allocated;
+	mutable std::mutex mergeMutex;
+
+	struct DumpRecord;
+	class DumpMapping;
+
+	void allocate() const;
+	void store(tContainer &candidates, std::vector<CompactCandidate> &records, Candidate *c) const;
+	void merge() const;
+	void reprocessSerial(Module *action) const;
+	std::vector<ref_ptr<Candidate> > restartCandidates(const std::vector<std::size_t> &indices) const;
+	static void toDump(const Candidate *candidate, DumpRecord &record, std::string &properties);
+	static ref_ptr<Candidate> fromDump(const DumpRecord &record, const char *properties, size_t propertiesSize);
+	static CompactCandidate toRecord(const DumpRecord &record);
 
 public:
         ParticleCollector();
@@ -34,18 +108,56 @@ public:
 
         void process(Candidate *candidate) const;
 	void process(ref_ptr<Candidate> c) const;
-	void reprocess(Module *action) const;
+	/**
+	 Pass every candidate, or its clone with clone, to the action in
+	 parallel, see ModuleList::apply. The schedule, progress bar and metrics
+	 are those of the given module list, or of the list of a
+	 ModuleListRunner action, else the defaults of a ModuleList.
+	 @param action		thread-safe module, e.g. a ModuleListRunner of a Galactic simulation
+	 @param segmentSize	candidates rebuilt or cloned at a time, 0 for all at once
+	 @param settings	module list whose run settings are used, optional
+	 */
+	void reprocess(Module *action, std::size_t segmentSize = 0, ModuleList *settings = NULL) const;
 	void dump(const std::string &filename) const;
+	/** Write the full candidate states in the binary format, see above */
+	void dumpBinary(const std::string &filename) const;
+	/** Add the candidates of a text or binary dump, in compact mode only their records */
 	void load(const std::string &filename);
+	/**
+	 Pass the candidates of a binary dump to the module, decoded in parallel
+	 from the file mapped into memory, without keeping them
+	 */
+	static void reprocessDump(const std::string &filename, Module *action);
 
         std::size_t size() const;
 	ref_ptr<Candidate> operator[](const std::size_t i) const;
         void clearContainer();
 
 	std::string getDescription() const;
+	/**
+	 Bytes of the containers and records, including sizeof(Candidate) for
+	 each candidate held, which are also counted by Candidate::getLiveCount.
+	 Approximate while the threads collect.
+	 */
+	size_t getMemoryUsage() const;
 	std::vector<ref_ptr<Candidate> >& getContainer() const;
 	void setClone(bool b);
 	bool getClone() const;
+	/** Keep only a CompactCandidate record per candidate, only possible while empty */
+	void setCompact(bool b);
+	bool getCompact() const;
+	/** Record of candidate i in compact mode */
+	const CompactCandidate &getRecord(const std::size_t i) const;
+	/**
+	 Records of all candidates in compact mode, contiguous in memory, e.g. to
+	 be viewed as a NumPy structured array (getRecordArray in Python). The
+	 reference is invalidated by collecting or clearing.
+	*/
+	const std::vector<CompactCandidate> &getRecords() const;
+	/** Rebuild an inactive candidate from a record */
+	static ref_ptr<Candidate> toCandidate(const CompactCandidate &record);
+	/** Record of the candidate */
+	static CompactCandidate toRecord(const Candidate *candidate);
 
 	/** iterator goodies */
         typedef tContainer::iterator iterator;
@@ -61,6 +173,23 @@ public:
 	*/
 	void getTrajectory(ModuleList *mlist, std::size_t i, Module *output) const;
 	void getTrajectory(ref_ptr<ModuleList> mlist, std::size_t i, ref_ptr<Module> output) const;
+
+	/**
+	 Retrieves the trajectories of the detected particles with the given
+	 indices in parallel, without their secondaries. Every thread passes the
+	 steps to an output of its own, using as many threads as outputs. The
+	 random stream of every particle is rewound to the source, so that with
+	 counter-based random numbers, see ModuleList::setCounterBasedRandom, the
+	 trajectories are those of the simulation.
+	*/
+	void getTrajectories(ModuleList *mlist, const std::vector<std::size_t> &indices,
+			const std::vector<ref_ptr<Module> > &outputs) const;
+	/**
+	 Retrieves the trajectories of the detected particles with the given
+	 indices in parallel, returning a collector with the steps of each
+	*/
+	std::vector<ref_ptr<ParticleCollector> > getTrajectories(ModuleList *mlist,
+			const std::vector<std::size_t> &indices) const;
 };
 /** @}*/
 
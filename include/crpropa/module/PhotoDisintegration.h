@@ -3,9 +3,12 @@
 
 #include "crpropa/Module.h"
 #include "crpropa/PhotonBackground.h"
+#include "crpropa/IsotopeSelection.h"
 
-#include <vector>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 namespace crpropa {
 /**
@@ -16,16 +19,41 @@ namespace crpropa {
 /**
  @class PhotoDisintegration
  @brief Photodisintegration of nuclei by background photons.
+
+ The tables of the photon field are loaded on first use or with prepare(),
+ the photon emission tables only with havePhotons. Tables loaded before with
+ initRate, initBranching or initPhotonEmission are kept. With an
+ IsotopeSelection only the tables of the selected nuclei are loaded.
+
+ For fast first passes setContinuousLoss replaces the sampled channels by
+ the mean loss of nucleons, see there.
  */
 class PhotoDisintegration: public Module {
 private:
 	ref_ptr<PhotonField> photonField;
 	double limit; // fraction of mean free path for limiting the next step
 	bool havePhotons;
+	bool continuousLoss; // mean loss of nucleons instead of sampled channels
+	ref_ptr<IsotopeSelection> isotopes; // nuclei to load the tables of, all if null
 
-	struct Branch {
-		int channel; // number of emitted (n, p, H2, H3, He3, He4)
-		std::vector<double> branchingRatio; // branching ratio as function of nucleus Lorentz factor
+	/** Doubles in one allocation, starting on a cache line */
+	class AlignedTable {
+		std::vector<double> storage;
+		size_t offset;
+	public:
+		AlignedTable();
+		AlignedTable(const AlignedTable &other);
+		AlignedTable &operator=(const AlignedTable &other);
+		void assign(const std::vector<double> &values);
+		const double *data() const;
+		size_t size() const;
+	};
+
+	struct Nucleus {
+		int rate; // offset of the interaction rates in pdRate, -1 if no data
+		int branching; // offset of the branching ratios [l * nBranch + b] in pdBranching
+		int firstBranch; // index of the first channel in pdChannel
+		int nBranch; // number of channels
 	};
 
 	struct PhotonEmission {
@@ -33,13 +61,37 @@ private:
 		std::vector<double> emissionProbability; // emission probability as function of nucleus Lorentz factor
 	};
 
-	std::vector<std::vector<double> > pdRate; // pdRate[Z * 31 + N] = total interaction rate
-	std::vector<std::vector<Branch> > pdBranch; // pdTable[Z * 31 + N] = branching ratios
-	mutable std::map<int, std::vector<PhotonEmission> > pdPhoton; // map of emitted photon energies and photon emission probabilities
+	/** Tables of a photon field, shared by all instances via the TableRegistry */
+	struct Tables: public Referenced {
+		// all tables are indexed by the Lorentz factor bin l, with rows padded to a cache line
+		std::vector<Nucleus> pdNucleus; // pdNucleus[Z * 31 + N]
+		AlignedTable pdRate; // total interaction rates
+		std::vector<int> pdChannel; // number of emitted (n, p, H2, H3, He3, He4) for each branch
+		AlignedTable pdBranching; // branching ratios as function of nucleus Lorentz factor
+		std::vector<size_t> pdPhotonOffset; // photon emissions of branch b: [pdPhotonOffset[b], pdPhotonOffset[b+1])
+		std::vector<double> pdPhotonEnergy; // energy of the emitted photons [J]
+		AlignedTable pdPhotonProbability; // photon emission probabilities as function of nucleus Lorentz factor
+		std::map<int, std::vector<PhotonEmission> > photonEmissions; // emitted photons by parent and daughter, only used to build the tables
+		bool rateLoaded, branchingLoaded, emissionLoaded;
+		bool registered; // loaded from the data files of the field only
+		Tables();
+	};
+	ref_ptr<Tables> tables;
+	mutable std::unique_ptr<std::once_flag> prepared; // reset when the needed tables change
+
+	void detachTables(); // copy shared tables before modifying them
+	void loadTables(); // load the tables of the field that are needed and missing
+	void requireTables() const; // load the tables once before their first use
+	void linkPhotonEmission(); // assign the photon emissions to the branches
+	double interactionRate(const Candidate *candidate, const Nucleus *&nucleus, double &p) const; // rate and tabulation position p, 0 if no data
+	int selectBranch(const Nucleus &nucleus, double p) const; // random branch, index in pdChannel
+	void interact(Candidate *candidate, int branch) const; // disintegrate through the branch, index in pdChannel
+	void processContinuous(Candidate *candidate) const; // mean loss over the current step
 
 	static const double lgmin; // minimum log10(Lorentz-factor)
 	static const double lgmax; // maximum log10(Lorentz-factor)
 	static const size_t nlg; // number of Lorentz-factor steps
+	static const size_t nlgStride; // row length of the tables, nlg padded to a cache line
 
 public:
 	PhotoDisintegration(ref_ptr<PhotonField> photonField, bool havePhotons = false, double limit = 0.1);
@@ -47,13 +99,36 @@ public:
 	void setPhotonField(ref_ptr<PhotonField> photonField);
 	void setHavePhotons(bool havePhotons);
 	void setLimit(double limit);
+	/**
+	 Load only the tables of the nuclei in the selection, null for all.
+	 The photon field is added to the selection, and the tables are reloaded.
+	 */
+	void setIsotopeSelection(ref_ptr<IsotopeSelection> isotopes);
+	ref_ptr<IsotopeSelection> getIsotopeSelection() const;
+	/**
+	 Mean loss approximation (default off). Instead of sampling channels, the
+	 expected numbers of protons and neutrons lost, averaged over the channels
+	 at the tabulated rate, accumulate in the candidate properties
+	 "ContinuousLoss.protons" and "ContinuousLoss.neutrons", shared with
+	 PhotoPionProduction. Whenever one of them reaches one, the nucleus emits
+	 that nucleon with its energy per nucleon. Light fragments are thus emitted
+	 as their nucleons, and no photons are emitted.
+	 */
+	void setContinuousLoss(bool b);
+	bool getContinuousLoss() const;
 
 	void initRate(std::string filename);
 	void initBranching(std::string filename);
 	void initPhotonEmission(std::string filename);
+	void prepare();
 
 	void process(Candidate *candidate) const;
+	unsigned int getParticleClasses() const;
+	size_t getMemoryUsage() const;
 	void performInteraction(Candidate *candidate, int channel) const;
+	bool hasInteractionRate() const;
+	double getInteractionRate(const Candidate *candidate) const;
+	void performStochasticInteraction(Candidate *candidate) const;
 
 	/**
 	 Calculates the loss length E dx/dE in [m] physical distance.
@@ -63,6 +138,20 @@ public:
 	 @param z		redshift
 	 */
 	double lossLength(int id, double gamma, double z = 0);
+
+	/**
+	 Disintegration channels of a nucleus, coded as in performInteraction,
+	 and their rates per comoving distance in [1/m], for deterministic solvers.
+	 The channels do not depend on the Lorentz factor, the rates are 0
+	 outside of the tables. Both are empty if there is no data for the nucleus.
+	 @param	id			PDG particle id
+	 @param gamma		Lorentz factor of particle
+	 @param z			redshift
+	 @param channels	channels of the nucleus
+	 @param rates		rates of the channels
+	 */
+	void getChannelRates(int id, double gamma, double z, std::vector<int> &channels,
+			std::vector<double> &rates) const;
 };
 
 /** @}*/
@@ -3,7 +3,10 @@
 
 #include "crpropa/Module.h"
 #include "crpropa/PhotonBackground.h"
+#include "crpropa/module/SophiaEventLibrary.h"
 
+#include <memory>
+#include <mutex>
 #include <vector>
 
 namespace crpropa {
@@ -21,6 +24,16 @@ struct SophiaEventOutput {
 /**
  @class PhotoPionProduction
  @brief Photo-pion interactions of nuclei with background photons.
+
+ The rate tables of the photon field are loaded on first use or with
+ prepare(), unless loaded before with initRate.
+
+ For fast first passes, e.g. parameter scans in 1D, setContinuousLoss replaces
+ the sampled SOPHIA events by their mean: nucleons lose the mean fraction of
+ their energy per interaction continuously, and nuclei lose a nucleon whenever
+ the expected number of interactions accumulated over the steps reaches one.
+ The pion decay products are then emitted in averaged form, see
+ setContinuousLoss.
  */
 class PhotoPionProduction: public Module {
 protected:
@@ -30,12 +43,33 @@ protected:
 	std::vector<double> tabRedshifts;  ///< redshifts (optional for haveRedshiftDependence)
 	std::vector<double> tabProtonRate; ///< interaction rate in [1/m] for protons
 	std::vector<double> tabNeutronRate; ///< interaction rate in [1/m] for neutrons
+	LogAxis lorentzAxis; ///< index lookup in tabLorentz
+	LinearAxis redshiftAxis; ///< index lookup in tabRedshifts
 	double limit; ///< fraction of mean free path to limit the next step
 	bool havePhotons;
 	bool haveNeutrinos;
 	bool haveElectrons;
 	bool haveAntiNucleons;
 	bool haveRedshiftDependence;
+	double redshiftTolerance; ///< width of the redshift bins of the per-thread rate slices
+	uint64_t rateTableId; ///< identifies the loaded rate tables in the per-thread rate slices
+	ref_ptr<SophiaEventLibrary> eventLibrary; ///< optional pretabulated final states
+	bool continuousLoss; ///< mean energy loss instead of sampled interactions
+	mutable std::unique_ptr<std::once_flag> prepared; ///< reset when the needed tables change
+
+	/// load the rate tables of the field if not loaded with initRate
+	void loadTables();
+	/// load the tables once before their first use
+	void requireTables() const;
+
+	/// interaction rates [1/m] of the protons and neutrons in the candidate
+	void nucleonRates(const Candidate *candidate, double &protonRate, double &neutronRate) const;
+	/// redshift dependent rate from the per-thread slice of the tables at the nearest redshift bin
+	double sliceRate(double gamma, double z, bool onProton) const;
+	/// mean energy loss over the current step, see setContinuousLoss
+	void processContinuous(Candidate *candidate) const;
+	/// averaged secondaries of the pions carrying the energy
+	void emitMeanPionProducts(Candidate *candidate, double energy, const Vector3d &position, int sign) const;
 
 public:
 	PhotoPionProduction(
@@ -53,11 +87,53 @@ public:
 	void setHaveAntiNucleons(bool b);
 	void setHaveRedshiftDependence(bool b);
 	void setLimit(double limit);
+	/**
+	 With redshift dependent rates, each thread keeps the rates interpolated
+	 to the redshifts of the last used bins, the multiples of the tolerance
+	 (default 1e-3). The rates of a candidate are those of the nearest
+	 multiple, up to half the tolerance off, independent of the order of the
+	 candidates. A tolerance of 0 interpolates in both redshift and Lorentz
+	 factor every time.
+	 */
+	void setRedshiftTolerance(double dz);
+	double getRedshiftTolerance() const;
+	/**
+	 Sample the final states from a pretabulated library instead of calling
+	 SOPHIA, which is used for interactions outside the tabulated range.
+	 Pass an invalid pointer (None) to return to exact SOPHIA, the default.
+	 */
+	void setEventLibrary(ref_ptr<SophiaEventLibrary> library);
+	ref_ptr<SophiaEventLibrary> getEventLibrary() const;
+	/**
+	 Continuous energy loss approximation (default off). Instead of sampling
+	 interactions, nucleons lose the mean fraction 1 - m_p / m_Delta of their
+	 energy per interaction, at the tabulated rate over the step. Nuclei keep
+	 the expected numbers of lost protons and neutrons in the candidate
+	 properties "ContinuousLoss.protons" and "ContinuousLoss.neutrons", shared
+	 with PhotoDisintegration, and emit a nucleon whenever one of them reaches
+	 one. The lost energy goes to the secondaries of the mean pion production
+	 at the Delta resonance: with havePhotons a photon of half the energy and
+	 weight 4/3 (p pi0, 2/3), with haveElectrons and haveNeutrinos a positron
+	 and the three neutrinos of a quarter of the energy and weight 1/3 each
+	 (n pi+, 1/3). Fluctuations are lost, as is the conversion of nucleons.
+	 */
+	void setContinuousLoss(bool b);
+	bool getContinuousLoss() const;
+	/** Mean fraction of the nucleon energy lost per interaction, 1 - m_p / m_Delta */
+	double getMeanInelasticity() const;
+	/** Energy per nucleon in the local frame below which SOPHIA has no interactions [J] */
+	double getThresholdEnergy() const;
 	void initRate(std::string filename);
+	void prepare();
 	double nucleonMFP(double gamma, double z, bool onProton) const;
 	double nucleiModification(int A, int X) const;
 	void process(Candidate *candidate) const;
+	unsigned int getParticleClasses() const;
+	size_t getMemoryUsage() const;
 	void performInteraction(Candidate *candidate, bool onProton) const;
+	bool hasInteractionRate() const;
+	double getInteractionRate(const Candidate *candidate) const;
+	void performStochasticInteraction(Candidate *candidate) const;
 
 	/**
 	 Calculates the loss length E dx/dE in [m].
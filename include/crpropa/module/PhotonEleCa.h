@@ -7,6 +7,8 @@
 
 #include <memory>
 #include <fstream>
+#include <string>
+#include <vector>
 
 // forward declaration
 namespace eleca {
@@ -15,19 +17,32 @@ class Propagation;
 
 namespace crpropa {
 
+/**
+ @class PhotonEleCa
+ @brief Propagates photons with EleCa to the observer and writes the particles arriving there.
+
+ The cascades of different candidates are calculated concurrently. Each
+ thread buffers its output, which is written when the buffer is full, on
+ flush and on destruction.
+ */
 class PhotonEleCa: public Module {
 private:
 	std::auto_ptr<eleca::Propagation> propagation;
 	mutable std::ofstream output;
+	mutable std::vector<std::string> buffers; // output per thread
+	static const size_t bufferSize = 1 << 16; // bytes per thread before writing
 	Vector3d observer;
 	bool saveOnlyPhotonEnergies;
 public:
 	PhotonEleCa(const std::string background, const std::string &outputFilename);
 	~PhotonEleCa();
 	void process(Candidate *candidate) const;
+	unsigned int getParticleClasses() const;
 	std::string getDescription() const;
 	void setObserver(const Vector3d &position);
 	void setSaveOnlyPhotonEnergies(bool photonsOnly);
+	/** Write the buffered output of all threads to the file */
+	void flush() const;
 };
 
 } // namespace crpropa
@@ -4,6 +4,11 @@
 #include "crpropa/Module.h"
 
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
 
 namespace crpropa {
 /**
@@ -11,21 +16,73 @@ namespace crpropa {
  * @{
  */
 
+/**
+ @class PhotonOutput1D
+ @brief Output of the photons, electrons and positrons for the propagation with DINT and EleCa.
+
+ Every thread collects the rows in a buffer of its own, which is written as
+ one block when it is full or the output is closed. In the binary format the
+ file starts with a header of the magic string "CRPPH1D", the format version
+ and the size of a record, followed by one Record per particle.
+ */
 class PhotonOutput1D: public Module {
+public:
+	/// Row of the binary format, in the units of the text format
+	struct Record {
+		double energy; ///< [EeV]
+		double distance; ///< comoving distance to the origin [Mpc]
+		double createdEnergy; ///< energy of the parent particle [EeV]
+		double sourceEnergy; ///< energy of the source particle [EeV]
+		double sourceDistance; ///< comoving distance of the source [Mpc]
+		int32_t id;
+		int32_t createdId; ///< id of the parent particle
+		int32_t sourceId; ///< id of the source particle
+		int32_t padding;
+	};
+
 private:
 	std::ostream *out;
 	std::string filename;
 	mutable std::ofstream outfile;
+	bool binary;
+	size_t bufferSize;
+
+	// per thread: rows not yet written, the last buffer is shared by the
+	// threads not known at the first candidate
+	mutable std::vector<std::string> buffers;
+	mutable std::unique_ptr<std::once_flag> allocated;
+	mutable std::mutex sharedMutex, writeMutex;
+
+	void init();
+	void allocate() const;
+	void append(std::string &buffer, const char *row, size_t size) const;
+	void write(std::string &buffer) const;
 
 public:
 	PhotonOutput1D();
 	PhotonOutput1D(std::ostream &out);
 	PhotonOutput1D(const std::string &filename);
+	/// Output to a file in the binary format if binary is true
+	PhotonOutput1D(const std::string &filename, bool binary);
 	~PhotonOutput1D();
 	void process(Candidate *candidate) const;
+	unsigned int getParticleClasses() const;
 	std::string getDescription() const;
+	bool isBinary() const;
+	/// Bytes collected by every thread before they are written, 1 MiB by default
+	void setBufferSize(size_t bytes);
+	size_t getBufferSize() const;
+	/// Write the buffers of all threads, within a parallel section only that
+	/// of the calling thread
+	void flush() const;
 	void close();
 	void gzip();
+
+	/// Read the header of the binary format, returns false and rewinds the
+	/// stream if it does not start with one
+	static bool readBinaryHeader(std::istream &in);
+	/// Read up to n records of the binary format, returns the number read
+	static size_t readRecords(std::istream &in, Record *records, size_t n);
 };
 /** @}*/
 
@@ -56,6 +56,9 @@ private:
 	double tolerance; /** target relative error of the numerical integration */
 	double minStep; /** minimum step size of the propagation */
 	double maxStep; /** maximum step size of the propagation */
+	mutable IntegratorCounters statistics; /** counters of the step size control, if recorded */
+
+	void recordStep(Candidate *candidate, size_t tries, size_t fieldEvaluations, bool minimum) const;
 
 public:
 	/** Default constructor for the Boris push. It is constructed with a fixed step size.
@@ -122,6 +125,14 @@ public:
 	/** set the maximum step for the Boris push
 	 * @param maxStep	   maxStep/c_light is the maximum integration time step */
 	void setMaximumStep(double maxStep);
+	/** count the accepted and rejected steps and the field evaluations, see IntegratorCounters
+	 * @param record	   count the steps
+	 * @param asProperties also accumulate the counters of each candidate in its properties */
+	void setRecordStatistics(bool record = true, bool asProperties = false);
+	bool getIntegratorStatistics(IntegratorStatistics &statistics) const;
+	void resetStatistics();
+	/** Bytes held by the magnetic field */
+	size_t getMemoryUsage() const;
 
 	 /** get functions for the parameters of the class PropagationBP, similar to the set functions */
 	ref_ptr<MagneticField> getField() const;
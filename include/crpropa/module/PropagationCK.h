@@ -20,6 +20,14 @@ namespace crpropa {
  The step size control tries to keep the relative error close to, but smaller than the designated tolerance.
  Additionally a minimum and maximum size for the steps can be set.
  For neutral particles a rectilinear propagation is applied and a next step of the maximum step size proposed.
+ In processBatch, the charged candidates are integrated together in lanes of up to
+ 8 (structure of arrays) with one batched field evaluation per stage, lanes leave the
+ error control independently.
+ With setMixedPrecision, the stage derivatives and the field interpolation of processBatch
+ are computed in single precision in lanes of up to 16, while positions, the sums of the
+ stages and the error control stay in double precision. Fields stored in single precision,
+ e.g. MagneticFieldGrid, are then used without conversion. As the single-precision
+ rounding limits the achievable accuracy, tolerances below 1e-6 keep the double-precision lanes.
  */
 class PropagationCK: public Module {
 public:
@@ -55,11 +63,21 @@ private:
 	double tolerance; /*< target relative error of the numerical integration */
 	double minStep; /*< minimum step size of the propagation */
 	double maxStep; /*< maximum step size of the propagation */
+	bool mixedPrecision; /*< single-precision stages in processBatch */
+	mutable IntegratorCounters statistics;
+
+	void recordStep(Candidate *candidate, size_t tries, bool minimum) const;
+
+	template<typename T, size_t L>
+	void processBatchLanes(Candidate **candidates, size_t count) const;
+	template<typename T, size_t L>
+	void processLanes(Candidate **candidates, size_t count) const;
 
 public:
 	PropagationCK(ref_ptr<MagneticField> field = NULL, double tolerance = 1e-4,
 			double minStep = (0.1 * kpc), double maxStep = (1 * Gpc));
 	void process(Candidate *candidate) const;
+	void processBatch(Candidate **candidates, size_t count) const;
 
 	// derivative of phase point, dY/dt = d/dt(x, u) = (v, du/dt)
 	// du/dt = q*c^2/E * (u x B)
@@ -72,10 +90,19 @@ public:
 	void setTolerance(double tolerance);
 	void setMinimumStep(double minStep);
 	void setMaximumStep(double maxStep);
+	/** Single-precision stage derivatives and fields in processBatch */
+	void setMixedPrecision(bool mixed);
+	/** Count the accepted and rejected steps and the field evaluations, see IntegratorCounters */
+	void setRecordStatistics(bool record = true, bool asProperties = false);
+	bool getIntegratorStatistics(IntegratorStatistics &statistics) const;
+	void resetStatistics();
+	/** Bytes held by the magnetic field */
+	size_t getMemoryUsage() const;
 
 	double getTolerance() const;
 	double getMinimumStep() const;
 	double getMaximumStep() const;
+	bool isMixedPrecision() const;
 	std::string getDescription() const;
 };
 /** @}*/
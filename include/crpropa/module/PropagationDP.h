@@ -0,0 +1,77 @@
+#ifndef CRPROPA_PROPAGATIONDP_H
+#define CRPROPA_PROPAGATIONDP_H
+
+#include "crpropa/module/PropagationCK.h"
+
+namespace crpropa {
+/**
+ * \addtogroup Propagation
+ * @{
+ */
+
+/**
+ @class PropagationDP
+ @brief Rectilinear propagation through magnetic fields using the Dormand-Prince method.
+
+ This module solves the equations of motion of a relativistic charged particle when propagating through a magnetic field.\n
+ It uses the embedded Runge-Kutta 5(4) method with Dormand-Prince coefficients.
+ The field at the end of a step is kept per thread and reused as first stage of
+ the next step of the candidate (first same as last), if the candidate still is at
+ this position and neither the candidate nor the field (setField) was replaced,
+ and as first stage of retried steps. A step then costs 6 field
+ evaluations, a rejected trial 6 as well.\n
+ The step size is controlled by a PI controller, which keeps the absolute
+ direction error close to, but smaller than the designated tolerance and reduces
+ the number of rejected steps. Additionally a minimum and maximum size for the steps can be set.\n
+ The continuous extension of the method provides the phase point anywhere within
+ the last step (dense output), e.g. for ObserverSurface to locate crossings.
+ For neutral particles a rectilinear propagation is applied and a next step of the maximum step size proposed.
+ */
+class PropagationDP: public Module {
+public:
+	typedef PropagationCK::Y Y;
+
+private:
+	ref_ptr<MagneticField> field;
+	uint64_t fieldGeneration; /*< changed by setField, invalidates the kept fields */
+	double tolerance; /*< target relative error of the numerical integration */
+	double minStep; /*< minimum step size of the propagation */
+	double maxStep; /*< maximum step size of the propagation */
+
+	Vector3d getField(const Vector3d &position, double z) const;
+
+public:
+	PropagationDP(ref_ptr<MagneticField> field = NULL, double tolerance = 1e-4,
+			double minStep = (0.1 * kpc), double maxStep = (1 * Gpc));
+	void process(Candidate *candidate) const;
+
+	// derivative of phase point, dY/dt = d/dt(x, u) = (v, du/dt)
+	// du/dt = q*c^2/E * (u x B) for the field B at y.x
+	Y dYdt(const Y &y, const ParticleState &p, const Vector3d &B) const;
+
+	/**
+	 Phase point of the candidate at a fraction of its last step.
+	 @param candidate	candidate last propagated by this module in this thread
+	 @param theta		fraction of the current step, 0: previous, 1: current state
+	 @param position	interpolated position
+	 @param direction	interpolated direction
+	 @return			false if the step is not available (e.g. neutral particles,
+						changed positions), then previous and current state are interpolated linearly
+	 */
+	bool getDenseOutput(const Candidate *candidate, double theta, Vector3d &position, Vector3d &direction) const;
+
+	void setField(ref_ptr<MagneticField> field);
+	void setTolerance(double tolerance);
+	void setMinimumStep(double minStep);
+	void setMaximumStep(double maxStep);
+
+	double getTolerance() const;
+	double getMinimumStep() const;
+	double getMaximumStep() const;
+	std::string getDescription() const;
+};
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_PROPAGATIONDP_H
@@ -0,0 +1,93 @@
+#ifndef CRPROPA_PROPAGATIONGC_H
+#define CRPROPA_PROPAGATIONGC_H
+
+#include "crpropa/module/PropagationBP.h"
+
+namespace crpropa {
+/**
+ * \addtogroup Propagation
+ * @{
+ */
+
+/**
+ @class PropagationGC
+ @brief Guiding-centre propagation through magnetic fields for low-rigidity particles.
+
+ Instead of resolving every gyration, this module integrates the motion of the
+ gyrocentre: the parallel motion along the field line plus the grad-B and
+ curvature drifts, with the magnetic moment (p_perp^2 / B) conserved, so that
+ particles are reflected at magnetic mirrors. The field gradients are obtained
+ by central differences. The candidate position is the guiding centre and its
+ direction keeps the pitch angle to the local field.\n
+ Where the drift approximation breaks down, i.e. where the Larmor radius exceeds
+ the fraction maxLarmorRatio (default 0.1) of the gradient scale B/|grad B| or
+ of the curvature radius of the field lines, the step is handed over to a
+ full-orbit PropagationBP with the same step limits.\n
+ The next step is limited to the fraction tolerance of these scales, between
+ the minimum and maximum size for the steps.
+ For neutral particles a rectilinear propagation is applied and a next step of the maximum step size proposed.
+ */
+class PropagationGC: public Module {
+private:
+	ref_ptr<MagneticField> field;
+	ref_ptr<PropagationBP> fullOrbit; /*< used where the drift approximation breaks down */
+	double tolerance; /*< step size as fraction of the field gradient scale */
+	double minStep; /*< minimum step size of the propagation */
+	double maxStep; /*< maximum step size of the propagation */
+	double maxLarmorRatio; /*< Larmor radius / gradient scale, above which full orbits are integrated */
+
+	Vector3d getField(const Vector3d &position, double z) const;
+
+public:
+	/** Local field quantities at the guiding centre. */
+	struct FieldGeometry {
+		double B; /*< field strength */
+		Vector3d b; /*< unit vector along the field */
+		Vector3d gradB; /*< gradient of the field strength */
+		Vector3d curvature; /*< curvature vector of the field line, (b.grad) b */
+	};
+
+	PropagationGC(ref_ptr<MagneticField> field = NULL, double tolerance = 0.1,
+			double minStep = (0.1 * kpc), double maxStep = (1 * Gpc));
+	void process(Candidate *candidate) const;
+
+	/**
+	 Field strength, direction, gradient and field line curvature at a position.
+	 @param position	position
+	 @param z			redshift
+	 @param delta		spacing of the central differences
+	 @return			false if the field vanishes at the position
+	 */
+	bool fieldGeometry(const Vector3d &position, double z, double delta, FieldGeometry &g) const;
+
+	/**
+	 Velocity of the guiding centre in units of c, parallel motion plus grad-B
+	 and curvature drifts.
+	 @param g		field geometry at the guiding centre
+	 @param p		particle momentum [kg m/s]
+	 @param mu		cosine of the pitch angle
+	 @param q		charge [C]
+	 */
+	Vector3d driftVelocity(const FieldGeometry &g, double p, double mu, double q) const;
+
+	void setField(ref_ptr<MagneticField> field);
+	void setTolerance(double tolerance);
+	void setMinimumStep(double minStep);
+	void setMaximumStep(double maxStep);
+	/** Larmor radius in units of the gradient scale of the field above which the full orbit is integrated */
+	void setMaximumLarmorRatio(double ratio);
+
+	ref_ptr<MagneticField> getField() const;
+	/** Full-orbit propagation used where the drift approximation breaks down, e.g. to set its tolerance */
+	ref_ptr<PropagationBP> getFullOrbitPropagation() const;
+	double getTolerance() const;
+	double getMinimumStep() const;
+	double getMaximumStep() const;
+	double getMaximumLarmorRatio() const;
+	std::string getDescription() const;
+};
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_PROPAGATIONGC_H
@@ -0,0 +1,72 @@
+#ifndef CRPROPA_PROPAGATIONSMALLANGLE_H
+#define CRPROPA_PROPAGATIONSMALLANGLE_H
+
+#include "crpropa/Module.h"
+#include "crpropa/Units.h"
+#include "crpropa/magneticField/turbulentField/TurbulentField.h"
+
+namespace crpropa {
+/**
+ * \addtogroup Propagation
+ * @{
+ */
+
+/**
+ @class PropagationSmallAngle
+ @brief Propagation through turbulent fields by random small-angle deflections
+
+ For Larmor radii r_L = E / (|Z| e c Brms) much larger than the correlation
+ length l_c of the turbulent field, the field is not resolved: a step of
+ length L >> l_c is a straight line with a Gaussian random deflection. The
+ two components of the deflection angle perpendicular to the direction have
+ the variance L l_c / (2 r_L^2) each, for the correlation length as defined
+ by TurbulenceSpectrum::getCorrelationLength (for isotropic turbulence, the
+ integral scale of the transverse components is 3 l_c / 4). The direction
+ diffuses along the step, so the transverse offset of the position is drawn
+ jointly with the deflection (half of the deflection times L, plus an
+ independent part of variance L^3 / 12 of the angular diffusion).
+
+ The steps are the given number of correlation lengths, shortened so that
+ the rms deflection of a step does not exceed the maximum deflection and to
+ the next step proposed by the other modules. Where the deflection over one
+ correlation length l_c / r_L exceeds the maximum deflection, the small-angle
+ condition fails and the step is taken by the fallback propagation, by default
+ a PropagationCK integrating the field itself. Neutral particles propagate on
+ straight lines. Only Brms and l_c of the field are used otherwise, no field
+ is evaluated and no grid is needed.
+ */
+class PropagationSmallAngle: public Module {
+	ref_ptr<TurbulentField> field;
+	ref_ptr<Module> fallback;
+	double correlationLength, brms;
+	double steps; // correlation lengths per step
+	double maxDeflection;
+
+public:
+	/**
+	 @param field			turbulent field, providing Brms and the correlation length
+	 @param steps			correlation lengths per step
+	 @param maxDeflection	maximum rms deflection per step [rad]
+	 */
+	PropagationSmallAngle(ref_ptr<TurbulentField> field, double steps = 1, double maxDeflection = 0.1);
+	void process(Candidate *candidate) const;
+
+	/** Module propagating the candidates where the small-angle condition fails */
+	void setFallback(Module *propagation);
+	Module *getFallback() const;
+	void setSteps(double steps);
+	double getSteps() const;
+	void setMaximumDeflection(double maxDeflection);
+	double getMaximumDeflection() const;
+	/** Larmor radius of the candidate in the rms field [m] */
+	double getLarmorRadius(const Candidate *candidate) const;
+	/** True if the candidate is propagated with random deflections, else by the fallback */
+	bool isSmallAngle(const Candidate *candidate) const;
+	ref_ptr<TurbulentField> getField() const;
+	std::string getDescription() const;
+};
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_PROPAGATIONSMALLANGLE_H
@@ -12,10 +12,15 @@ namespace crpropa {
 /**
  @class Redshift
  @brief Updates redshift and applies adiabatic energy loss according to the traveled distance.
+
+ Added to ContinuousLosses, the adiabatic loss is integrated together with
+ the other losses and the redshift is updated there.
  */
 class Redshift: public Module {
 public:
 	void process(Candidate *candidate) const;
+	bool hasEnergyLossRate() const;
+	double getEnergyLossRate(const Candidate *candidate, double E, double z) const;
 	std::string getDescription() const;
 };
 
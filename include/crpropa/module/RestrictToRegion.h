@@ -23,6 +23,7 @@ private:
 	ref_ptr<Module> module;
 public:
 	RestrictToRegion(Module* _module, Surface* _surface);
+	void prepare();
 	void process(Candidate *candidate) const;
 	std::string getDescription() const;
 };
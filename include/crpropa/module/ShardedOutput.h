@@ -0,0 +1,85 @@
+#ifndef CRPROPA_SHARDEDOUTPUT_H
+#define CRPROPA_SHARDEDOUTPUT_H
+
+#include "crpropa/module/Output.h"
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace crpropa {
+/**
+ * \addtogroup Output
+ * @{
+ */
+
+/**
+ @class ShardedOutput
+ @brief Output of which every thread and MPI rank writes a file of its own
+
+ Instead of a single file written by all threads, every thread writes its
+ rows to a shard, an output of the given format, without any locking. The
+ shard of rank r and thread t of "events.h5" is "events.r<r>.t<t>.h5", it is
+ created with the first row of the thread and takes the columns, properties,
+ scales and filter configured here. Ordered output is not available.
+
+ On close the shards are closed and a manifest, the file name with ".json"
+ appended, lists them with their rows as one logical dataset, which
+ readShardedOutput reads in Python. With MPI initialized and several ranks,
+ close is collective and rank 0 writes the manifest of all ranks.
+
+ Other outputs are sharded by overriding createShard.
+ */
+class ShardedOutput: public Output {
+public:
+	enum Format {
+		Text,
+		HDF5,
+		Parquet
+	};
+
+protected:
+	std::string filename;
+	OutputType outputType;
+	Format format;
+	mutable int rank, nRanks;
+	mutable std::once_flag rankDetected;
+	mutable std::vector<ref_ptr<Output> > shards; // by thread, the last one shared by further threads
+	mutable std::mutex overflowMutex;
+	std::vector<std::string> closedFiles;
+	bool closed;
+
+	void detectRank() const;
+	Output *getShard(size_t i) const;
+	/** Create the output of a shard, override for other outputs */
+	virtual ref_ptr<Output> createShard(const std::string &filename) const;
+	void writeManifest(const std::string &entries) const;
+
+public:
+	/**
+	 @param filename	name of the manifest without ".json", from which the shard names are derived
+	 @param outputType	columns of the shards
+	 @param format		output of the shards, HDF5 and Parquet if available
+	 */
+	ShardedOutput(const std::string &filename, OutputType outputType = Everything, Format format = Text);
+	~ShardedOutput();
+
+	/** Name of the shard of a rank and thread */
+	std::string getShardName(int rank, size_t thread) const;
+	/** Name of the manifest */
+	std::string getManifestName() const;
+	/** Files of the shards written by this rank, available after close */
+	const std::vector<std::string> &getShardFiles() const;
+
+	void process(Candidate *candidate) const;
+	/** Flush the shards, within a parallel section only that of the calling thread */
+	void flush() const;
+	/** Close the shards and write the manifest, collective with MPI */
+	void close();
+	std::string getDescription() const;
+};
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_SHARDEDOUTPUT_H
@@ -0,0 +1,158 @@
+#ifndef CRPROPA_SHELLCROSSINGSTORE_H
+#define CRPROPA_SHELLCROSSINGSTORE_H
+
+#include "crpropa/Module.h"
+#include "crpropa/Vector3.h"
+#include "crpropa/module/Observer.h"
+
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace crpropa {
+/**
+ * \addtogroup Output
+ * @{
+ */
+
+/**
+ @class ShellCrossingRecorder
+ @brief Records every crossing of a set of spherical shells for later observers
+
+ Instead of an Observer, the recorder stores each step crossing one of the
+ shells, in either direction, with the full candidate (the four particle
+ states, weight, redshift, trajectory length, properties and serial numbers,
+ see Candidate::serialize) and its lineage: the serial numbers of the
+ candidate and its ancestors, with the trajectory lengths at which each was
+ created. A ShellCrossingStore then evaluates any number of Observer
+ configurations on the crossings without propagating again.
+
+ A shell is crossed when the distance to its surface changes the sign over
+ the step, as for ObserverSurface(Sphere). As that observer, the recorder
+ limits the steps to the distance to the nearest shell, unless disabled with
+ setLimitStep. The recorder has to take the place of the observer in the
+ module list and does not deactivate the candidates. To obtain the creation
+ lengths, secondaries get the double property "ShellCrossingCreation".
+
+ Every thread writes a binary shard of its own, without locking. The shard
+ of thread t of "crossings.dat" is "crossings.t<t>.dat". On close the
+ shards get an index and the file itself lists the shells and the shards.
+ With MPI, every rank needs a file name of its own.
+ */
+class ShellCrossingRecorder: public Module {
+	struct Shard {
+		std::unique_ptr<std::ofstream> file;
+		std::vector<char> buffer;
+		std::vector<char> index; // footer: offset, source serial, trajectory length, shell per record
+		uint64_t records;
+		uint64_t offset;
+		Shard();
+	};
+
+	std::string filename;
+	std::vector<Vector3d> centers;
+	std::vector<double> radii;
+	bool limitStep;
+	Candidate::PropertyKey creationKey;
+	mutable std::vector<Shard> shards; // by thread, the last one shared by further threads
+	mutable std::mutex overflowMutex;
+	std::vector<std::string> closedFiles;
+	bool closed;
+
+	void write(Shard &shard, const Candidate *candidate, size_t shell, bool outward) const;
+	void flush(Shard &shard) const;
+
+public:
+	/** @param filename	name of the store, from which the shard names are derived */
+	ShellCrossingRecorder(const std::string &filename);
+	~ShellCrossingRecorder();
+
+	/** Add a spherical shell, before the run */
+	void addShell(const Vector3d &center, double radius);
+	size_t getNumberOfShells() const;
+	/** Limit the steps to the distance to the nearest shell (default) */
+	void setLimitStep(bool limitStep);
+
+	/** Name of the shard of a thread */
+	std::string getShardName(size_t thread) const;
+	/** Files of the shards, available after close */
+	const std::vector<std::string> &getShardFiles() const;
+
+	void process(Candidate *candidate) const;
+	/** Write the indices of the shards and the store file */
+	void close();
+	std::string getDescription() const;
+};
+
+/**
+ @class ShellCrossing
+ @brief Crossing of a shell read from a ShellCrossingStore
+ */
+struct ShellCrossing {
+	size_t shell;                        ///< index of the shell, in the order of addShell
+	bool outward;                        ///< crossed from the inside
+	ref_ptr<Candidate> candidate;        ///< candidate at the end of the crossing step
+	std::vector<uint64_t> lineage;       ///< serial numbers of the candidate, its parent, ... up to the primary
+	std::vector<double> creationLengths; ///< trajectory lengths at which these were created [m]
+};
+
+/**
+ @class ShellCrossingStore
+ @brief Crossings written by a ShellCrossingRecorder, to evaluate observers without propagation
+
+ Only the index of the crossings is kept in memory, they are read from the
+ shards when needed. Shards of a recorder that was not closed are indexed by
+ reading them.
+
+ evaluate passes every crossing to an Observer as if it was in the module
+ list: its features check the candidate at the end of the crossing step, with
+ the previous state at its start, and a detection is processed by its
+ detection action. Surfaces other than the recorded shells are not crossed
+ by the stored steps and detect nothing. As in the simulation, a candidate is
+ detected once if the observer deactivates it (default), and its secondaries
+ created after the detection are skipped. The primaries with their
+ secondaries are evaluated in parallel, each in the order of the trajectory
+ length. Crossings located with the dense output of a propagation module are
+ detected at the end of the step.
+ */
+class ShellCrossingStore: public Referenced {
+	struct Entry {
+		uint32_t shard;
+		uint32_t shell;
+		uint64_t offset;
+		uint64_t sourceSerial;
+		double trajectoryLength;
+	};
+
+	std::vector<Vector3d> centers;
+	std::vector<double> radii;
+	std::vector<std::string> shardFiles;
+	std::vector<Entry> entries; // by primary and trajectory length
+
+	void indexShard(uint32_t shard);
+	ShellCrossing read(std::ifstream &file, const Entry &entry) const;
+
+public:
+	/** @param filename	store file written by ShellCrossingRecorder::close */
+	ShellCrossingStore(const std::string &filename);
+
+	/** Number of crossings */
+	size_t size() const;
+	size_t getNumberOfShells() const;
+	Vector3d getShellCenter(size_t shell) const;
+	double getShellRadius(size_t shell) const;
+	const std::vector<std::string> &getShardFiles() const;
+
+	/** Crossing i, ordered by primary and trajectory length */
+	ShellCrossing getCrossing(size_t i) const;
+
+	/** Pass the crossings to the observer in parallel, returns the number of detections */
+	size_t evaluate(Observer *observer) const;
+};
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_SHELLCROSSINGSTORE_H
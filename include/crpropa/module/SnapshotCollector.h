@@ -0,0 +1,51 @@
+#ifndef CRPROPA_SNAPSHOTCOLLECTOR_H
+#define CRPROPA_SNAPSHOTCOLLECTOR_H
+#include <vector>
+#include <string>
+
+#include "crpropa/Module.h"
+#include "crpropa/CandidateSnapshot.h"
+
+namespace crpropa {
+/**
+ * \addtogroup Tools
+ * \addtogroup Output
+ * @{
+ */
+
+/**
+ @class SnapshotCollector
+ @brief In-memory collector of detected events, storing compact CandidateSnapshot records instead of candidate clones
+
+ Only the properties enabled with enableProperty are kept.
+ */
+class SnapshotCollector: public Module {
+protected:
+	typedef std::vector<CandidateSnapshot> tContainer;
+	mutable tContainer container;
+	std::vector<Candidate::PropertyKey> keys;
+
+public:
+	SnapshotCollector();
+	SnapshotCollector(const std::size_t nBuffer);
+
+	void process(Candidate *candidate) const;
+	/** Pass a candidate rebuilt from every snapshot to the module */
+	void reprocess(Module *action) const;
+	void dump(const std::string &filename) const;
+
+	/** Keep the property in the snapshots */
+	void enableProperty(const std::string &name);
+
+	std::size_t size() const;
+	const CandidateSnapshot &operator[](const std::size_t i) const;
+	void clearContainer();
+	const std::vector<CandidateSnapshot> &getContainer() const;
+
+	std::string getDescription() const;
+};
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_SNAPSHOTCOLLECTOR_H
@@ -0,0 +1,86 @@
+#ifndef CRPROPA_SOPHIAEVENTLIBRARY_H
+#define CRPROPA_SOPHIAEVENTLIBRARY_H
+
+#include "crpropa/Referenced.h"
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace crpropa {
+/**
+ * \addtogroup EnergyLosses
+ * @{
+ */
+
+/**
+ @class SophiaEventLibrary
+ @brief Pretabulated SOPHIA final states for PhotoPionProduction.
+
+ For ultra-relativistic nucleons the SOPHIA final state, expressed in energy
+ fractions of the incoming nucleon, depends on the nucleon energy Ein and the
+ photon energy eps only through their product Ein * eps, which fixes the
+ distribution of the center of mass energy. The library therefore stores
+ events binned logarithmically in Ein * eps, separately for protons and
+ neutrons. All events in a bin are equally probable, so sampling picks an
+ event uniformly, after choosing between the two neighbouring bins with
+ linear interpolation in log10(Ein * eps).
+
+ The binary file consists of a header (magic "CRPSOPHL", format version,
+ binning, counts) followed by the event offsets, particle offsets, SOPHIA
+ particle codes (int8) and energy fractions (float) in native byte order.
+ */
+class SophiaEventLibrary: public Referenced {
+	double lgMin, lgMax; ///< range of log10(Ein * eps / GeV^2)
+	uint32_t nBins;
+	std::vector<uint32_t> binEvents; ///< first event of [nature * nBins + bin], nature 0 = proton
+	std::vector<uint32_t> eventParticles; ///< first particle of each event
+	std::vector<int8_t> particleType; ///< SOPHIA particle codes
+	std::vector<float> particleFraction; ///< energy fraction E / Ein of each particle
+
+public:
+	/// Empty library, to be filled with generate() or load()
+	SophiaEventLibrary();
+	/// Load the library from a file written with save()
+	SophiaEventLibrary(const std::string &filename);
+
+	/**
+	 Tabulate events with the exact SOPHIA event generator.
+	 Uses all OpenMP threads if SOPHIA is compiled reentrant.
+	 @param eventsPerBin	number of events per bin and nucleon type
+	 @param nBins		number of bins in log10(Ein * eps / GeV^2)
+	 @param lgMin		lower edge, must be above the pion production threshold (about -1.15)
+	 @param lgMax		upper edge
+	 */
+	void generate(unsigned int eventsPerBin = 1000, unsigned int nBins = 63,
+			double lgMin = -1.1, double lgMax = 5.2);
+	void save(const std::string &filename) const;
+	void load(const std::string &filename);
+
+	/**
+	 Sample a final state in SOPHIA conventions.
+	 Returns false if Ein * eps is outside the tabulated range.
+	 @param nature		0 = proton, 1 = neutron
+	 @param Ein			energy of nucleon in GeV
+	 @param eps			energy of target photon in GeV
+	 @param outPartID	SOPHIA codes of the out-going particles
+	 @param outEnergy	energies of the out-going particles in GeV
+	 @param nParticles	number of out-going particles
+	 */
+	bool sample(int nature, double Ein, double eps, int outPartID[2000],
+			double outEnergy[2000], int &nParticles) const;
+
+	bool empty() const;
+	unsigned int getNumberOfBins() const;
+	size_t getNumberOfEvents() const;
+	size_t getNumberOfParticles() const;
+	double getLgMin() const;
+	double getLgMax() const;
+	/// Bytes of the tabulated events
+	size_t getMemoryUsage() const;
+};
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_SOPHIAEVENTLIBRARY_H
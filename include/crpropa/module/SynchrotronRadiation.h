@@ -19,6 +19,8 @@ namespace crpropa {
  The module limits the next step size to ensure a fractional energy loss dE/E < limit (default = 0.1).
  Optionally, synchrotron photons above a threshold (default E > 10^7 eV) are created as secondary particles.
  Note that the large number of secondary photons per propagation can cause memory problems.
+ With setBinnedEmission, the photons of each step are instead emitted as one
+ weighted secondary per energy bin, conserving the radiated energy.
  */
 class SynchrotronRadiation: public Module {
 private:
@@ -28,13 +30,20 @@ private:
 
 	bool havePhotons; ///< flag for production of secondary photons
 	double secondaryThreshold; ///< threshold energy for secondary photons
+	double thinning; ///< weighted sampling of the secondary photons, 0: all, 1: maximal thinning
 	std::vector<double> tabx; ///< tabulated fraction E_photon/E_critical from 10^-6 to 10^2 in 801 log-spaced steps
 	std::vector<double> tabCDF; ///< tabulated CDF of synchrotron spectrum
 
+	int binsPerDecade; ///< bins per decade of the binned photon emission, 0: individual photons
+	std::vector<double> tabBinX; ///< mean fraction E_photon/E_critical per emission bin
+	std::vector<double> tabBinN; ///< photons per emission bin and radiated energy in units of E_critical
+	void initBinnedEmission();
+	double perpendicularField(const Candidate *candidate, double z) const;
+
 
 public:
-	SynchrotronRadiation(ref_ptr<MagneticField> field, bool havePhotons = false, double limit = 0.1);
-	SynchrotronRadiation(double Brms = 0, bool havePhotons = false, double limit = 0.1);
+	SynchrotronRadiation(ref_ptr<MagneticField> field, bool havePhotons = false, double limit = 0.1, double thinning = 0);
+	SynchrotronRadiation(double Brms = 0, bool havePhotons = false, double limit = 0.1, double thinning = 0);
 
 	void setField(ref_ptr<MagneticField> field);
 	ref_ptr<MagneticField> getField();
@@ -51,8 +60,26 @@ public:
 	void setSecondaryThreshold(double threshold);
 	double getSecondaryThreshold() const;
 
+	/// Photons with the energy fraction f are kept with probability f^thinning and weighted by the inverse
+	void setThinning(double thinning);
+	double getThinning() const;
+
+	/**
+	 Emit the photons of each step as one secondary per energy bin, with the
+	 photon number as weight, instead of individual photons.
+	 Thinning does not apply to the binned emission.
+	 @param binsPerDecade	bins per decade of photon energy, 0: individual photons (default)
+	 */
+	void setBinnedEmission(int binsPerDecade);
+	int getBinnedEmission() const;
+
 	void initSpectrum();
 	void process(Candidate *candidate) const;
+	/** Energy loss only, synchrotron photons are not created this way */
+	bool hasEnergyLossRate() const;
+	double getEnergyLossRate(const Candidate *candidate, double E, double z) const;
+	unsigned int getParticleClasses() const;
+	size_t getMemoryUsage() const;
 	std::string getDescription() const;
 };
 /** @}*/
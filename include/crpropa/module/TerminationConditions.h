@@ -0,0 +1,67 @@
+#ifndef CRPROPA_TERMINATIONCONDITIONS_H
+#define CRPROPA_TERMINATIONCONDITIONS_H
+
+#include "crpropa/Module.h"
+#include "crpropa/KdTree.h"
+#include "crpropa/Vector3.h"
+
+#include <vector>
+#include <stdint.h>
+
+namespace crpropa {
+/**
+ * \addtogroup Condition
+ * @{
+ */
+
+/**
+ @class TerminationConditions
+ @brief Evaluates several break conditions and boundaries in one module.
+
+ The conditions of MaximumTrajectoryLength, MinimumEnergy, MinimumRigidity,
+ MinimumRedshift, MinimumChargeNumber, SphericalBoundary and CubicBoundary
+ modules given to add are evaluated in a single function from one read of the candidate state, and the next step is
+ limited once to the smallest of their limits. Their parameters are read when
+ they are added, later changes to the modules are not seen. A rejected
+ candidate is flagged, made inactive and passed to the reject action of the
+ module that rejected it, as if the module had been processed on its own.
+ Every condition is evaluated, in the order they were added, also after a
+ rejection. Other conditions are processed as they are.
+
+ The rejections are counted per condition.
+ */
+class TerminationConditions: public Module {
+	enum Type {
+		TrajectoryLength, Energy, Rigidity, Redshift, ChargeNumber, Sphere, Cube, Other
+	};
+	struct Condition {
+		Type type;
+		double value; // maximum length, minimum energy, ... radius or size
+		Vector3d point; // center or origin
+		KdTree observers; // observer positions of the trajectory length
+		double margin;
+		bool limitStep;
+		bool eventDriven;
+		ref_ptr<AbstractCondition> module;
+	};
+	std::vector<Condition> conditions;
+	mutable std::vector<uint64_t> rejections;
+public:
+	TerminationConditions();
+	/** Add a condition, evaluated within this module if of a known type */
+	void add(AbstractCondition *condition);
+	size_t size() const;
+	AbstractCondition *get(size_t i) const;
+	/** true if the condition i is evaluated within this module */
+	bool isFused(size_t i) const;
+	/** Number of candidates rejected by the condition i */
+	uint64_t getRejections(size_t i) const;
+	void resetRejections();
+	void process(Candidate *candidate) const;
+	std::string getDescription() const;
+};
+
+/** @}*/
+} // namespace crpropa
+
+#endif // CRPROPA_TERMINATIONCONDITIONS_H
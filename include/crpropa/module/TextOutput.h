@@ -3,8 +3,12 @@
 
 #include "crpropa/module/Output.h"
 #include "crpropa/module/ParticleCollector.h"
+#include "crpropa/AsyncRowWriter.h"
 
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 namespace crpropa {
 /**
@@ -15,6 +19,10 @@ namespace crpropa {
 /**
  @class TextOutput
  @brief Configurable plain text output for cosmic ray information.
+
+ Every thread formats its lines into a buffer of its own, which is written
+ to the stream in blocks. With gzip every thread compresses its blocks
+ itself, the blocks form a single gzip stream.
  */
 class TextOutput: public Output {
 protected:
@@ -23,7 +31,34 @@ protected:
 	std::string filename;
 	bool storeRandomSeeds;
 
-	void printHeader() const;
+	struct TextRow {
+		size_t size;
+		char line[1024];
+	};
+	bool async;
+	size_t asyncCapacity;
+	std::unique_ptr<AsyncRowWriter<TextRow> > writer;
+	mutable std::unique_ptr<OrderedRowSpill<TextRow> > spill; // of the ordered output
+
+	size_t blockSize;
+	mutable std::vector<std::string> threadBuffers;
+	std::string writerBuffer;
+	mutable std::once_flag headerWritten;
+	mutable std::mutex writeMutex;
+
+	bool compress;
+	bool headerPresent; // appended to a file with a header
+	mutable bool gzipStarted;
+	mutable unsigned long gzipCrc, gzipSize;
+
+	void printHeader(std::ostream &out) const;
+	void writeHeader() const;
+	void writeBlock(std::string &text) const;
+	void writeBuffers() const;
+	void writeOrdered() const;
+	void finishGzip() const;
+	void startWriter();
+	void stopWriter();
 
 public:
 	TextOutput();
@@ -32,10 +67,43 @@ public:
 	TextOutput(std::ostream &out, OutputType outputtype);
 	TextOutput(const std::string &filename);
 	TextOutput(const std::string &filename, OutputType outputtype);
+	/**
+	 Output to a file, which in append mode is not truncated: the rows are
+	 appended and the header is only written to an empty file. To continue
+	 the output of an interrupted process with ModuleList::resume, which
+	 truncates the file to the checkpoint marker. Not for compressed files.
+	 @param filename	file name
+	 @param outputtype	type of the output
+	 @param append		append to an existing file
+	 */
+	TextOutput(const std::string &filename, OutputType outputtype, bool append);
 	~TextOutput();
 
 	void enableRandomSeeds() {storeRandomSeeds = true;};
+	/**
+	 Asynchronous output: the threads queue their formatted lines without
+	 locking and a dedicated writer thread writes them to the stream. Threads
+	 wait if the queue is full.
+	 @param async		enable the writer thread
+	 @param capacity	number of lines in the queue
+	 */
+	void setAsync(bool async = true, size_t capacity = 4096);
+	bool isAsync() const;
+	/// Bytes collected by every thread before they are written, 1 MB for
+	/// files and 0, every line, for streams
+	void setBlockSize(size_t bytes);
+	size_t getBlockSize() const;
 	void close();
+	/// Write all buffered lines, within a parallel section only those of the
+	/// calling thread
+	void flush() const;
+	/// Byte position in the stream after flush
+	uint64_t getCheckpointPosition() const;
+	/// Truncate the file to the position of the marker, also a file of an
+	/// earlier process opened in append mode. Not possible for streams,
+	/// compressed and ordered outputs with rows after the marker and files
+	/// that were opened again without append mode, which truncated them.
+	bool rewind(size_t rows, uint64_t position);
 	void gzip();
 
 	void process(Candidate *candidate) const;
@@ -18,6 +18,7 @@ namespace crpropa {
  @brief Module to monitor the simulation performance
 
  Add modules under investigation to this module instead of the ModuleList.
+ See ModuleList::setProfiling for a per-thread profile of all modules.
  */
 class PerformanceModule: public Module {
 private:
@@ -32,6 +33,7 @@ private:
 public:
 	~PerformanceModule();
 	void add(Module* module);
+	void prepare();
 	void process(Candidate* candidate) const;
 	std::string getDescription() const;
 };
@@ -58,12 +60,20 @@ public:
 /**
   @class EmissionMapFiller
   @brief Fill EmissionMap with source particle state
+
+  Each thread fills its own maps, which are added to the EmissionMap on
+  flush, when the EmissionMap is replaced and on destruction.
 */
 class EmissionMapFiller: public Module {
 	ref_ptr<EmissionMap> emissionMap;
+	mutable std::vector<ref_ptr<EmissionMap> > threadMaps; // filled per thread
+	void createThreadMaps();
 public:
 	EmissionMapFiller(EmissionMap *emissionMap);
+	~EmissionMapFiller();
 	void setEmissionMap(EmissionMap *emissionMap);
+	/** Add the maps filled by all threads to the EmissionMap */
+	void flush() const;
 	void process(Candidate* candidate) const;
 	std::string getDescription() const;
 };
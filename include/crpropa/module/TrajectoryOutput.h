@@ -0,0 +1,162 @@
+#ifndef CRPROPA_TRAJECTORYOUTPUT_H
+#define CRPROPA_TRAJECTORYOUTPUT_H
+
+#include "crpropa/module/Output.h"
+#include "crpropa/Vector3.h"
+
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace crpropa {
+/**
+ * \addtogroup Output
+ * @{
+ */
+
+/**
+ @class TrajectoryOutput
+ @brief Compact binary recording of trajectories, delta encoded and compressed.
+
+ Records the columns of the Trajectory3D output type (D, ID, E, X, Y, Z, Px,
+ Py, Pz) of every step. The serial numbers and the source id are written once
+ in a header per trajectory, the id only when it changes. The trajectory
+ length and the position are quantized to the position precision, the energy
+ to the energy precision in log10(E) and the direction octahedrally to 16
+ bits per coordinate. Every point is stored as the differences of these
+ integers to the previous point, as variable-length integers.
+
+ Every thread collects the trajectories in a buffer of its own, which is
+ compressed with zlib (if available) and written as one block when it is
+ full or the output is closed. A block is self-contained, so a trajectory
+ may continue in several blocks.
+
+ With setDecimation, nearly straight runs of steps are reduced online per
+ thread, like the Douglas-Peucker algorithm: a step is only kept if its
+ direction differs by more than the angle tolerance from that of the last
+ kept point, or if a skipped position would deviate by more than the length
+ tolerance from the line between the kept points. The first and last point
+ of a trajectory in a block and the interaction points, at which the id
+ changes or secondaries are created, are always kept.
+
+ File format, all integers little endian:
+ - header: the magic string "CRPTRJ1\0", the uint32 version, the uint32 1 if
+   the blocks are compressed, the double position precision [m], the double
+   energy precision [log10(E / J)] and the uint32 direction scale and padding
+ - block: the uint32 size of the data, the uint32 stored size and the stored
+   (compressed) data, which is a sequence of
+   - 0, trajectory: the serial number, created serial number and source id
+   - 1, id: the id of the following points
+   - 2, point: the differences of D, X, Y, Z, E and the two direction coordinates
+   with all values as unsigned LEB128 integers, the signed ones zigzag encoded.
+
+ The trajectories are read with TrajectoryOutput::read, or in Python with
+ crpropa.readTrajectoryOutput.
+ */
+class TrajectoryOutput: public Output {
+public:
+	/// Step of a trajectory, in SI units
+	struct Point {
+		double trajectoryLength;
+		double energy;
+		Vector3d position;
+		Vector3d direction;
+		int32_t id;
+	};
+
+	/// Points of a candidate, in the order of the steps
+	struct Trajectory {
+		uint64_t serialNumber;
+		uint64_t createdSerialNumber;
+		int32_t sourceId;
+		std::vector<Point> points;
+	};
+
+private:
+	// per thread: the block not yet written and the last point of the open
+	// trajectory, to which the next point is encoded
+	struct Stream {
+		std::string buffer;
+		bool open;
+		uint64_t serialNumber;
+		int32_t id;
+		int64_t last[7];
+
+		// decimation: the last kept point, the positions skipped since and
+		// the last of them, which is kept when the next step is not skipped
+		uint64_t secondaries;
+		Vector3d anchorPosition, anchorDirection;
+		std::vector<Vector3d> skipped;
+		bool pending;
+		int64_t pendingPoint[7];
+		Vector3d pendingDirection;
+	};
+
+	std::string filename;
+	mutable std::ofstream outfile;
+	double positionPrecision, energyPrecision;
+	double angleTolerance, lengthTolerance;
+	size_t bufferSize;
+	bool compress;
+	mutable bool headerWritten;
+
+	// the last stream is shared by the threads not known at the first candidate
+	mutable std::vector<Stream> streams;
+	mutable std::unique_ptr<std::once_flag> allocated;
+	mutable std::mutex sharedMutex, writeMutex;
+
+	void allocate() const;
+	void encode(Stream &stream, const Candidate *candidate) const;
+	bool skip(Stream &stream, const Vector3d &position, const Vector3d &direction) const;
+	void writePoint(Stream &stream, const int64_t *point) const;
+	void writePending(Stream &stream) const;
+	void write(Stream &stream) const;
+	void writeHeader() const;
+
+public:
+	TrajectoryOutput(const std::string &filename);
+	~TrajectoryOutput();
+
+	void process(Candidate *candidate) const;
+
+	/// Quantization of the trajectory length and position [m], 1e-3 pc by default
+	void setPositionPrecision(double length);
+	double getPositionPrecision() const;
+	/// Quantization of log10(E), 1e-6 by default
+	void setEnergyPrecision(double precision);
+	double getEnergyPrecision() const;
+	/**
+	 Keep only the steps needed to reconstruct the trajectories within the
+	 tolerances, see above. A tolerance of 0 disables its criterion, both
+	 disable the decimation (default).
+	 @param angle	tolerance of the direction [rad]
+	 @param length	tolerance of the skipped positions [m]
+	 */
+	void setDecimation(double angle, double length);
+	double getAngleTolerance() const;
+	double getLengthTolerance() const;
+	/// Bytes collected by every thread before they are compressed and written, 1 MiB by default
+	void setBufferSize(size_t bytes);
+	size_t getBufferSize() const;
+	/// Whether the blocks are compressed with zlib, by default if it is available
+	void setCompression(bool compress);
+	bool getCompression() const;
+
+	/// Write the buffers of all threads, within a parallel section only that
+	/// of the calling thread
+	void flush() const;
+	void close();
+	std::string getDescription() const;
+	size_t getMemoryUsage() const;
+
+	/// Read all trajectories of a file, the blocks of each one joined
+	static std::vector<Trajectory> read(const std::string &filename);
+};
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_TRAJECTORYOUTPUT_H
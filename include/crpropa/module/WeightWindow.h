@@ -0,0 +1,86 @@
+#ifndef CRPROPA_WEIGHTWINDOW_H
+#define CRPROPA_WEIGHTWINDOW_H
+
+#include "crpropa/Module.h"
+#include "crpropa/Geometry.h"
+
+#include <limits>
+#include <map>
+#include <vector>
+
+namespace crpropa {
+/**
+ * \addtogroup Condition
+ * @{
+ */
+
+/**
+ @class WeightWindow
+ @brief Russian roulette and splitting of candidates outside of a weight window.
+
+ A candidate with a weight below the lower bound of its window survives with
+ the probability weight / survival weight and then continues with the
+ survival weight, else it is rejected (made inactive by default). A candidate
+ with a weight above the upper bound is split into n = ceil(weight / upper)
+ copies, at most the maximum splitting, which share its weight: the
+ candidate continues with weight / n and n - 1 copies of its current state
+ are added as secondaries, with random streams of their own. The expected
+ weight is conserved in both cases.
+
+ The window is chosen by the particle id and energy, see setWindow. In an
+ importance region the bounds of the window are divided by the importance of
+ the region, the largest if several contain the candidate. Candidates
+ entering a region of importance I > 1, e.g. a sphere around an observer, are
+ thus split into about I copies, while those leaving it are played roulette.
+ */
+class WeightWindow: public AbstractCondition {
+public:
+	/// Weight bounds, the survival weight of the roulette between them
+	struct Window {
+		double lower, upper, survival;
+	};
+
+private:
+	Window window; // of the particles and energies without window
+	std::map<int, std::map<double, Window> > windows; // by id and minimum energy
+	std::vector<ref_ptr<Surface> > regions;
+	std::vector<double> importances;
+	size_t maxSplitting;
+
+	static Window makeWindow(double lower, double upper, double survival);
+
+public:
+	/**
+	 @param lower		lower bound of the weight, 0 disables the roulette
+	 @param upper		upper bound of the weight, infinity disables the splitting
+	 @param survival	weight of the candidates surviving the roulette,
+	 					0 for the mean of the bounds (or the lower bound if unbounded)
+	 */
+	WeightWindow(double lower = 0, double upper = std::numeric_limits<double>::infinity(),
+			double survival = 0);
+
+	/** Window of the particles and energies for which none is set */
+	void setWindow(double lower, double upper, double survival = 0);
+	/** Window of the particle id from the minimum energy [J] up to the next one given */
+	void setWindow(int id, double minEnergy, double lower, double upper, double survival = 0);
+	/** Window applied to the particle id and energy [J], not divided by the importance */
+	Window getWindow(int id, double energy) const;
+
+	/** Divide the window by the importance inside the closed surface */
+	void addImportanceRegion(ref_ptr<Surface> region, double importance);
+	/** Largest importance of the regions containing the position, 1 outside */
+	double getImportance(const Vector3d &position) const;
+
+	/** Maximum number of copies a candidate is split into in one step, 100 by default */
+	void setMaximumSplitting(size_t n);
+	size_t getMaximumSplitting() const;
+
+	void process(Candidate *candidate) const;
+	std::string getDescription() const;
+};
+
+/** @}*/
+
+} // namespace crpropa
+
+#endif // CRPROPA_WEIGHTWINDOW_H
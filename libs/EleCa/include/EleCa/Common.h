@@ -7,9 +7,13 @@ double z2Mpc(double z);
 double Mpc2z(double D);
 double Uniform(double min, double max);
 
-// set the seed for the random generator. If 0, current ime is used
+// set the seed for the random generator. If 0, current ime is used.
+// Each thread draws from its own stream, seeded with seedval + thread number.
+// Restores the default generator after setUniformCallback.
 void setSeed(long int seedval=0);
 
+// draw the random numbers from the given function instead, which has to be
+// thread-safe; 0 restores the default generator
 void setUniformCallback(double (*Uniform)(double min, double max));
 
 
@@ -8,6 +8,10 @@
 
 #include <iostream>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 namespace eleca {
 
 double z2Mpc(double z) {
@@ -33,18 +37,53 @@ double Mpc2z(double D) {
 }
 
 
+// per-thread state of the default generator, (re)seeded lazily after setSeed
+struct UniformState {
+	unsigned short xsubi[3];
+	unsigned int generation;
+};
+static UniformState uniformState = {{0, 0, 0}, 0};
+#pragma omp threadprivate(uniformState)
+
+static long int uniformSeed = 0;
+static unsigned int uniformGeneration = 1;
+static double (*uniformCallback)(double min, double max) = 0;
+
 void setSeed(long int seedval)
 {
 	if (seedval == 0)
 	{ // use system time
 		time(&seedval);
 	}
-	::srand48(seedval);
+	uniformSeed = seedval;
+	uniformCallback = 0;
+#pragma omp atomic
+	uniformGeneration++;
 }
 
+void setUniformCallback(double (*Uniform)(double min, double max)) {
+	uniformCallback = Uniform;
+}
 
 double Uniform(double min, double max) {
-		return min + (max - min) * ::drand48();
+	if (uniformCallback)
+		return uniformCallback(min, max);
+
+	unsigned int generation;
+#pragma omp atomic read
+	generation = uniformGeneration;
+	if (uniformState.generation != generation) {
+		// as srand48, with one stream per thread
+		long int seed = uniformSeed;
+#ifdef _OPENMP
+		seed += omp_get_thread_num();
+#endif
+		uniformState.xsubi[0] = 0x330E;
+		uniformState.xsubi[1] = seed & 0xFFFF;
+		uniformState.xsubi[2] = (seed >> 16) & 0xFFFF;
+		uniformState.generation = generation;
+	}
+	return min + (max - min) * ::erand48(uniformState.xsubi);
 }
 
 } // namespace eleca
@@ -121,16 +121,19 @@ void InitRK() {
 	gRKInitialized = true;
 }
 
+// fill the tables at load time, so that EnergyLoss1D can run concurrently
+static struct RKInitializer {
+	RKInitializer() {
+		InitRK();
+	}
+} gRKInitializer;
+
 //===================================
 
 double EnergyLoss1D(double Energy, double z0, double zfin, double B) {
 
 	double zStep = 2.5e-5;
 
-#pragma omp critical
-	{
-		InitRK();
-	}
 	double k1, k2, k3, k4, k5, k6;
 
 	bool FLAG_PROPAG = 1;
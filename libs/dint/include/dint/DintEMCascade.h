@@ -84,6 +84,9 @@ class DintEMCascade {
 		DiffRate NNTauNeutProtonRate;
 		// rates from neutrino-neutrino interaction
 		DiffRate syncRate;
+		// the synchrotron rates are read and computed once for the field
+		bool syncInitialized;
+		double syncField;
 
 		// Energy Bins
 		dCVector deltaG; // dg used in continuous energy loss calculation
@@ -192,6 +195,18 @@ public:
 		const double aCutcascade_Magfield = 0  //<! parameter describing cutoff of EM cascade due to deflections, see CRPropa2 paper
 		);
 
+	// Propagates several spectra over the same distance. The photon
+	// background and the interaction rates of each redshift step are
+	// computed once for all of them.
+	void propagate(
+		const double start_distance,    //<! start light travel distance [Mpc]
+		const double stop_distance,     //<! stop light travel distance [Mpc]
+		const int nSpectra,             //<! number of spectra
+		Spectrum** apInjectionSpectra,  //<! input spectra
+		Spectrum** pSpectra,            //<! output spectra
+		const double aCutcascade_Magfield = 0  //<! parameter describing cutoff of EM cascade due to deflections, see CRPropa2 paper
+		);
+
 };
 
 
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <iostream>
+#include <vector>
 
 
 DintEMCascade::DintEMCascade(int _aIRFlag, int _aRadioFlag, string _aDirTables,
@@ -45,6 +46,11 @@ DintEMCascade::DintEMCascade(int _aIRFlag, int _aRadioFlag, string _aDirTables,
 	New_dCVector(&otherLoss, NUM_MAIN_BINS);
 	New_dCVector(&continuousLoss, NUM_MAIN_BINS);
 
+	syncInitialized = false;
+	syncField = 0;
+	if (synchrotronSwitch == 1)
+		NewDiffRate(&syncRate, NUM_MAIN_BINS);
+
 	if (ICSSwitch == 1) {
 		NewRawTotalRate(&ICSTotalRate, EM_NUM_MAIN_BINS, NUM_BG_BINS);
 		NewRawDiffRate(&ICSPhotonRate, EM_NUM_MAIN_BINS, NUM_BG_BINS,
@@ -155,6 +161,9 @@ DintEMCascade::~DintEMCascade()
 	DeleteTotalRate(&muonNeutTotalRate);
 	DeleteTotalRate(&tauNeutTotalRate);
 
+	if (synchrotronSwitch == 1)
+		DeleteDiffRate(&syncRate);
+
 	if (ICSSwitch == 1) {
 		DeleteRawDiffRate(&ICSPhotonRate);
 		DeleteRawDiffRate(&ICSScatRate);
@@ -195,6 +204,15 @@ DintEMCascade::~DintEMCascade()
 void DintEMCascade::propagate(const double start_distance,
 		const double stop_distance, Spectrum* apInjectionSpectrum,
 		Spectrum* pSpectrum, const double aCutcascade_Magfield) {
+	propagate(start_distance, stop_distance, 1, &apInjectionSpectrum,
+			&pSpectrum, aCutcascade_Magfield);
+}
+
+
+void DintEMCascade::propagate(const double start_distance,
+		const double stop_distance, const int nSpectra,
+		Spectrum** apInjectionSpectra, Spectrum** pSpectra,
+		const double aCutcascade_Magfield) {
 
 	double convergeParameter = 1.e-8;
 
@@ -207,8 +225,19 @@ void DintEMCascade::propagate(const double start_distance,
 
 	//---- Initialize distance ----
 
-	SetSpectrum(&Q_0, apInjectionSpectrum) ;
-	PrepareSpectra(sourceTypeSwitch, &Q_0, pSpectrum, &spectrumNew, &derivative);
+	// the iterated spectrum of each input, the first is the member
+	std::vector<Spectrum> spectraNew(nSpectra > 1 ? nSpectra - 1 : 0);
+	std::vector<Spectrum*> pSpectraNew(nSpectra);
+	for (int k = 0; k < nSpectra; k++) {
+		if (k == 0) {
+			pSpectraNew[k] = &spectrumNew;
+		} else {
+			NewSpectrum(&spectraNew[k - 1], NUM_MAIN_BINS);
+			pSpectraNew[k] = &spectraNew[k - 1];
+		}
+		SetSpectrum(&Q_0, apInjectionSpectra[k]) ;
+		PrepareSpectra(sourceTypeSwitch, &Q_0, pSpectra[k], pSpectraNew[k], &derivative);
+	}
 
 	//--------- START of actual computation --------
 	//---- initialize indices and parameters ----
@@ -279,14 +308,20 @@ void DintEMCascade::propagate(const double start_distance,
 			double B_loc = 0;
 			if (synchrotronSwitch == 1)
 			{
-				NewDiffRate(&syncRate, NUM_MAIN_BINS);
 				int B_bins = pB_field.dimension;
 				int B_bin = (int)((double)(B_bins)*(propagatingDistance+x)/1.e6/
 						start_distance);
 				B_loc=(pB_field.vector)[B_bin];
-				InitializeSynchrotron(B_loc, &pEnergy, &pEnergyWidth,
-						&synchrotronLoss, &syncRate,
-						aDirTables);
+				// the table is read once, not in every small step
+				if (!syncInitialized || B_loc != syncField)
+				{
+					InitializeDiffRate(&syncRate);
+					InitializeSynchrotron(B_loc, &pEnergy, &pEnergyWidth,
+							&synchrotronLoss, &syncRate,
+							aDirTables);
+					syncInitialized = true;
+					syncField = B_loc;
+				}
 			}
 			//---- compute continuous energy loss for electrons ----
 			ComputeContinuousEnergyLoss(synchrotronSwitch, &synchrotronLoss,
@@ -296,55 +331,56 @@ void DintEMCascade::propagate(const double start_distance,
 			double bkgFactor = 1.;
 			double evolutionFactor = 0;
 
-			AdvanceEMStep(sourceTypeSwitch, PPSwitch, ICSSwitch,
-					TPPSwitch, DPPSwitch, synchrotronSwitch, PPPSwitch,
-					NPPSwitch, neutronDecaySwitch, nucleonToSecondarySwitch,
-					neutrinoNeutrinoSwitch, smallDistanceStep, evolutionFactor,
-					convergeParameter, bkgFactor, &Q_0, &photonLeptonRate,
-					&protonElectronRate, &neutronPositronRate,
-					&protonPositronRate, &neutronElectronRate,
-					&neutronDecayElectronRate, &elNeutElectronRate,
-					&muonNeutElectronRate, &tauNeutElectronRate,
-					&protonPhotonRate, &elNeutPhotonRate, &muonNeutPhotonRate,
-					&tauNeutPhotonRate, &leptonTotalRate, &leptonScatRate,
-					&leptonExchRate, &continuousLoss, &deltaG, &photonTotalRate,
-					&leptonPhotonRate, &syncRate, pSpectrum, &spectrumNew);
-
-			SetEMSpectrum(pSpectrum, &spectrumNew);
-			// update spectrum
-
-			if (aCutcascade_Magfield != 0 && B_loc != 0 )
+			for (int k = 0; k < nSpectra; k++)
 			{
-				// Estimate the effect of B field on the 1D approximation (added E.A. June 2006)
-				bool lEcFlag = 0 ;
-				int lIndex =  0;
-
-				double a_ics = (3.-log10(4.))/4. ;
-				double b_ics = pow(10.,8.-7.*a_ics) ;
-				while (!lEcFlag)
+				Spectrum *pSpectrum = pSpectra[k];
+				AdvanceEMStep(sourceTypeSwitch, PPSwitch, ICSSwitch,
+						TPPSwitch, DPPSwitch, synchrotronSwitch, PPPSwitch,
+						NPPSwitch, neutronDecaySwitch, nucleonToSecondarySwitch,
+						neutrinoNeutrinoSwitch, smallDistanceStep, evolutionFactor,
+						convergeParameter, bkgFactor, &Q_0, &photonLeptonRate,
+						&protonElectronRate, &neutronPositronRate,
+						&protonPositronRate, &neutronElectronRate,
+						&neutronDecayElectronRate, &elNeutElectronRate,
+						&muonNeutElectronRate, &tauNeutElectronRate,
+						&protonPhotonRate, &elNeutPhotonRate, &muonNeutPhotonRate,
+						&tauNeutPhotonRate, &leptonTotalRate, &leptonScatRate,
+						&leptonExchRate, &continuousLoss, &deltaG, &photonTotalRate,
+						&leptonPhotonRate, &syncRate, pSpectrum, pSpectraNew[k]);
+
+				SetEMSpectrum(pSpectrum, pSpectraNew[k]);
+				// update spectrum
+
+				if (aCutcascade_Magfield != 0 && B_loc != 0 )
 				{
-					double lEnergy = (pEnergy.vector)[lIndex] ;
-					// Time scales are computed in parsec
-					double t_sync = 3.84e6/(lEnergy*B_loc*B_loc*ELECTRON_MASS) ;
-					double t_larmor = (1.1e-21)*ELECTRON_MASS*lEnergy/(B_loc*aCutcascade_Magfield) ;
-					double t_ics;
-					if (lEnergy <= 1.e15/ELECTRON_MASS) {
-						t_ics = 4.e2*1.e15/(ELECTRON_MASS*lEnergy) ;
-					} else if (lEnergy <= 1.e18/ELECTRON_MASS) {
-						t_ics = 4.e2*lEnergy*ELECTRON_MASS/1.e15 ;
-					} else if (lEnergy <= 1.e22/ELECTRON_MASS) {
-						t_ics = b_ics*pow(lEnergy*ELECTRON_MASS/1.e15,a_ics) ;
-					} else t_ics = 1.e8*lEnergy*ELECTRON_MASS/1.e22 ;
-					if (t_larmor >= t_sync || t_larmor >= t_ics) lEcFlag = 1 ;
-					// defines the "critical" energy : the e+/- spectrum is set to 0 for E<E_c
-					(pSpectrum->spectrum)[ELECTRON][lIndex]=0 ;
-					(pSpectrum->spectrum)[POSITRON][lIndex]=0 ;
-					lIndex++ ;
+					// Estimate the effect of B field on the 1D approximation (added E.A. June 2006)
+					bool lEcFlag = 0 ;
+					int lIndex =  0;
+
+					double a_ics = (3.-log10(4.))/4. ;
+					double b_ics = pow(10.,8.-7.*a_ics) ;
+					while (!lEcFlag)
+					{
+						double lEnergy = (pEnergy.vector)[lIndex] ;
+						// Time scales are computed in parsec
+						double t_sync = 3.84e6/(lEnergy*B_loc*B_loc*ELECTRON_MASS) ;
+						double t_larmor = (1.1e-21)*ELECTRON_MASS*lEnergy/(B_loc*aCutcascade_Magfield) ;
+						double t_ics;
+						if (lEnergy <= 1.e15/ELECTRON_MASS) {
+							t_ics = 4.e2*1.e15/(ELECTRON_MASS*lEnergy) ;
+						} else if (lEnergy <= 1.e18/ELECTRON_MASS) {
+							t_ics = 4.e2*lEnergy*ELECTRON_MASS/1.e15 ;
+						} else if (lEnergy <= 1.e22/ELECTRON_MASS) {
+							t_ics = b_ics*pow(lEnergy*ELECTRON_MASS/1.e15,a_ics) ;
+						} else t_ics = 1.e8*lEnergy*ELECTRON_MASS/1.e22 ;
+						if (t_larmor >= t_sync || t_larmor >= t_ics) lEcFlag = 1 ;
+						// defines the "critical" energy : the e+/- spectrum is set to 0 for E<E_c
+						(pSpectrum->spectrum)[ELECTRON][lIndex]=0 ;
+						(pSpectrum->spectrum)[POSITRON][lIndex]=0 ;
+						lIndex++ ;
+					}
 				}
-			}
-
-			if (synchrotronSwitch == 1)     // synchrotron == true (on)
-				DeleteDiffRate(&syncRate);
+			} // for k < nSpectra
 
 			x += smallDistanceStep;
 		} // for loopCounter < numSmallSteps
@@ -353,11 +389,14 @@ void DintEMCascade::propagate(const double start_distance,
 
 		//---- redshift bins down ----
 		// Force redshiftdown to use more accurate method, see issue  #174
-		RedshiftDown(-1, redshiftRatio, &pEnergy, pSpectrum, &spectrumNew);
+		for (int k = 0; k < nSpectra; k++)
+			RedshiftDown(-1, redshiftRatio, &pEnergy, pSpectra[k], pSpectraNew[k]);
 
 		//---- prepare for new step ----
 		leftRedshift = rightRedshift;
 	} while ((lastIndex != 1) && (leftRedshift > stopRedshift));
 
+	for (size_t k = 0; k < spectraNew.size(); k++)
+		DeleteSpectrum(&spectraNew[k]);
 }
 
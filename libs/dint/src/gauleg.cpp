@@ -511,22 +511,27 @@ void Gauleg(const double x1, const double x2, double x[], double w[],
 	static std::map<int, double*> __legendreAbcissa;
 	static std::map<int, double*> __legendreWeights;
 
+	// the cache is shared by all threads
+	const double *abcissa, *weights;
+#pragma omp critical(DintGauleg)
+	{
 	if (__legendreAbcissa.find(n) == __legendreAbcissa.end())
 	{
 		__legendreAbcissa[n] =  new double[n];
 		__legendreWeights[n] =  new double[n];
 		legendre_compute_glr ( n, __legendreAbcissa[n], __legendreWeights[n]);
 	}
-
-
+	abcissa = __legendreAbcissa[n];
+	weights = __legendreWeights[n];
+	}
 
   for ( int i = 0; i < n; i++ )
   {
-    x[i] = ( ( x1 + x2 ) + ( x2 - x1 ) * __legendreAbcissa[n][i] ) / 2.0;
+    x[i] = ( ( x1 + x2 ) + ( x2 - x1 ) * abcissa[i] ) / 2.0;
   }
   for ( int i = 0; i < n; i++ )
   {
-    w[i] = ( x2 - x1 ) * __legendreWeights[n][i] / 2.0;
+    w[i] = ( x2 - x1 ) * weights[i] / 2.0;
   }
   return;
 
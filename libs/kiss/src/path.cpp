@@ -96,8 +96,10 @@ bool create_directory_recursive(const std::string &dir, size_t user_permission,
 				seperators, a);
 	}
 
-	// create all non existing parts
+	// create all non existing parts, keeping the root of absolute paths
 	std::string path;
+	if (dir.size() and (dir.find_first_of(seperators) == 0))
+		path = path_seperator;
 	for (size_t i = 0; i < elements.size(); i++) {
 		path += elements[i];
 		path += path_seperator;
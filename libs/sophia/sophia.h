@@ -10,6 +10,22 @@ void sophiaevent_(int& nature,                   // IN:  channel: 0 -> p, 1 -> n
 									int outPartID[2000],           // OUT: list of output particle IDs (see list below)
 									int& nParticles                // OUT: number of output particles
 		);
+
+/*
+ Uniform random number in (0, 1) used by SOPHIA, to be provided by the
+ caller. The COMMON blocks of SOPHIA are thread-private when compiled with
+ OpenMP, so sophiaevent_ can be called concurrently if this function is
+ thread-safe as well.
+*/
+double sophia_rndm_();
+
+/*
+ Total (NDIR = 3) photo-hadronic cross section in mubarn of a proton
+ (NL0 = 13) or neutron (NL0 = 14) at photon energy x in GeV in the nucleon
+ rest frame. The resonance parameters are set by initial_(NL0) first.
+*/
+void initial_(int& L0);
+double crossection_(double& x, int& NDIR, int& NL0);
 }
 
 /*
@@ -140,11 +140,34 @@ using namespace crpropa;   // for usage of namespace in header files, necessary
 %include "crpropa/Units.h"
 %include "crpropa/Common.h"
 %include "crpropa/Cosmology.h"
+%ignore crpropa::PhotonField::getPhotonDensities(size_t, const double *, double, double *) const;
+%ignore crpropa::TabularPhotonField::getPhotonDensities(size_t, const double *, double, double *) const;
+%ignore crpropa::SpatialPhotonField::getCellWeights;
 %include "crpropa/PhotonBackground.h"
+%ignore crpropa::DintInstance;
+%template(DintOperatorRefPtr) crpropa::ref_ptr<crpropa::DintOperator>;
+%include "crpropa/DintOperator.h"
 %include "crpropa/PhotonPropagation.h"
 %template(RandomSeed) std::vector<uint32_t>;
 %template(RandomSeedThreads) std::vector< std::vector<uint32_t> >;
 %include "crpropa/Random.h"
+%include "crpropa/AliasTable.h"
+%ignore crpropa::SobolSequence::getPoint(uint64_t, double *) const;
+%include "crpropa/SobolSequence.h"
+%include "crpropa/KdTree.h"
+%template(NumericTableRefPtr) crpropa::ref_ptr<crpropa::NumericTable>;
+%include "crpropa/NumericTable.h"
+%include "crpropa/TableRegistry.h"
+%template(IsotopeSelectionRefPtr) crpropa::ref_ptr<crpropa::IsotopeSelection>;
+%include "crpropa/IsotopeSelection.h"
+%ignore crpropa::Trace::record;
+%ignore crpropa::TraceSpan;
+%include "crpropa/Trace.h"
+%template(RunMetricsRefPtr) crpropa::ref_ptr<crpropa::RunMetrics>;
+%include "crpropa/RunMetrics.h"
+%ignore crpropa::DiagnosticSite;
+%ignore crpropa::Diagnostics::getSites;
+%include "crpropa/Diagnostics.h"
 %include "crpropa/ParticleState.h"
 %include "crpropa/ParticleID.h"
 %include "crpropa/ParticleMass.h"
@@ -152,8 +175,16 @@ using namespace crpropa;   // for usage of namespace in header files, necessary
 
 %import "crpropa/Variant.h"
 
+%ignore crpropa::Candidate::operator new;
+%ignore crpropa::Candidate::operator delete;
+
 /* override Candidate::getProperty() */
 %ignore crpropa::Candidate::getProperty(const std::string &) const;
+%ignore crpropa::Candidate::getProperty(PropertyKey) const;
+%ignore crpropa::Candidate::setProperty(PropertyKey, const Variant &);
+%ignore crpropa::Candidate::hasProperty(PropertyKey) const;
+%ignore crpropa::Candidate::removeProperty(PropertyKey);
+%ignore crpropa::Candidate::findPropertyKey;
 
 %nothread; /* disable threading for extend*/
 %extend crpropa::Candidate {
@@ -349,6 +380,9 @@ using namespace crpropa;   // for usage of namespace in header files, necessary
 %template(CandidateVector) std::vector< crpropa::ref_ptr<crpropa::Candidate> >;
 %template(CandidateRefPtr) crpropa::ref_ptr<crpropa::Candidate>;
 %include "crpropa/Candidate.h"
+%include "crpropa/CandidateSnapshot.h"
+%template(CandidateSnapshotVector) std::vector<crpropa::CandidateSnapshot>;
+%include "crpropa/IntegratorStatistics.h"
 
 %feature("director") crpropa::Surface;
 %feature("director") crpropa::ClosedSurface;
@@ -360,21 +394,241 @@ using namespace crpropa;   // for usage of namespace in header files, necessary
 %feature("director") crpropa::AbstractCondition;
 %include "crpropa/Module.h"
 
+/* CandidateBatch: the columns as NumPy views, valid during processCandidates */
+%ignore crpropa::CandidateBatch::fill;
+%ignore crpropa::CandidateBatch::energy;
+%ignore crpropa::CandidateBatch::position;
+%ignore crpropa::CandidateBatch::direction;
+%ignore crpropa::CandidateBatch::id;
+%ignore crpropa::CandidateBatch::redshift;
+%ignore crpropa::CandidateBatch::active;
+%ignore crpropa::CandidateBatch::nextStep;
+%ignore crpropa::CandidateBatch::trajectoryLength;
+%ignore crpropa::CandidateBatch::currentStep;
+%template(BatchModuleRefPtr) crpropa::ref_ptr<crpropa::BatchModule>;
+%feature("director") crpropa::BatchModule;
+%include "crpropa/module/BatchModule.h"
+
+#ifdef WITHNUMPY
+%{
+template<typename T>
+static PyObject *batchColumn(std::vector<T> &column, npy_intp rows, int columns, int type) {
+	npy_intp dims[2] = {rows, columns};
+	void *data = column.empty() ? NULL : (void *) &column[0];
+	return PyArray_SimpleNewFromData(columns > 1 ? 2 : 1, dims, type, data);
+}
+%}
+
+%nothread; /* the views are created with the GIL */
+%extend crpropa::CandidateBatch {
+  PyObject *getEnergy() { return batchColumn($self->energy, $self->size(), 1, NPY_DOUBLE); }
+  PyObject *getPosition() { return batchColumn($self->position, $self->size(), 3, NPY_DOUBLE); }
+  PyObject *getDirection() { return batchColumn($self->direction, $self->size(), 3, NPY_DOUBLE); }
+  PyObject *getId() { return batchColumn($self->id, $self->size(), 1, NPY_INT32); }
+  PyObject *getRedshift() { return batchColumn($self->redshift, $self->size(), 1, NPY_DOUBLE); }
+  PyObject *getActive() { return batchColumn($self->active, $self->size(), 1, NPY_BOOL); }
+  PyObject *getNextStep() { return batchColumn($self->nextStep, $self->size(), 1, NPY_DOUBLE); }
+  PyObject *getTrajectoryLength() { return batchColumn($self->trajectoryLength, $self->size(), 1, NPY_DOUBLE); }
+  PyObject *getCurrentStep() { return batchColumn($self->currentStep, $self->size(), 1, NPY_DOUBLE); }
+};
+%thread; /* reenable threading */
+#endif
+
 %implicitconv crpropa::ref_ptr<crpropa::MagneticField>;
 %template(MagneticFieldRefPtr) crpropa::ref_ptr<crpropa::MagneticField>;
+%ignore getFields;
 %include "crpropa/magneticField/MagneticField.h"
 
 %implicitconv crpropa::ref_ptr<crpropa::PhotonField>;
 %template(PhotonFieldRefPtr) crpropa::ref_ptr<crpropa::PhotonField>;
+%include "crpropa/InteractionRateEngine.h"
 
 %implicitconv crpropa::ref_ptr<crpropa::AdvectionField>;
 %template(AdvectionFieldRefPtr) crpropa::ref_ptr<crpropa::AdvectionField>;
+%ignore getFieldAndDivergence;
+%ignore getFieldsAndDivergences;
 %include "crpropa/advectionField/AdvectionField.h"
 
 %implicitconv crpropa::ref_ptr<crpropa::Density>;
 %template(DensityRefPtr) crpropa::ref_ptr<crpropa::Density>;
 %include "crpropa/massDistribution/Density.h"
 
+/* NumPy evaluation of the fields and densities at arrays of positions */
+#ifdef WITHNUMPY
+%{
+// copy of an array of positions of shape (N, 3), or false with the Python error set
+static bool numpyPositions(PyObject *input, std::vector<crpropa::Vector3d> &positions,
+		int &ndim, npy_intp *dims) {
+	PyArrayObject *array = (PyArrayObject *) PyArray_FROMANY(input, NPY_DOUBLE, 1, 2,
+			NPY_ARRAY_IN_ARRAY);
+	if (array == NULL)
+		return false;
+	ndim = PyArray_NDIM(array);
+	for (int i = 0; i < ndim; i++)
+		dims[i] = PyArray_DIM(array, i);
+	if (dims[ndim - 1] != 3) {
+		Py_DECREF(array);
+		PyErr_SetString(PyExc_ValueError, "positions must be of shape (N, 3)");
+		return false;
+	}
+	const double *data = (const double *) PyArray_DATA(array);
+	positions.resize(PyArray_SIZE(array) / 3);
+	for (size_t i = 0; i < positions.size(); i++)
+		positions[i] = crpropa::Vector3d(data[3 * i], data[3 * i + 1], data[3 * i + 2]);
+	Py_DECREF(array);
+	return true;
+}
+
+// calls evaluate(first, count) for blocks of the positions in parallel,
+// without the GIL, which fields derived in Python take back per call
+template<typename Evaluate>
+static bool numpyEvaluate(size_t count, Evaluate evaluate) {
+	const size_t block = 64;
+	long blocks = (count + block - 1) / block;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS
+#pragma omp parallel for schedule(dynamic)
+	for (long b = 0; b < blocks; b++) {
+		try {
+			evaluate(b * block, std::min(block, count - b * block));
+		} catch (std::exception &e) {
+#pragma omp critical(numpyEvaluate)
+			error = e.what();
+		}
+	}
+	Py_END_ALLOW_THREADS
+	if (!error.empty())
+		PyErr_SetString(PyExc_RuntimeError, error.c_str());
+	return error.empty();
+}
+
+static PyObject *numpyVectors(const std::vector<crpropa::Vector3d> &vectors, int ndim,
+		npy_intp *dims) {
+	PyObject *array = PyArray_SimpleNew(ndim, dims, NPY_DOUBLE);
+	if (array == NULL)
+		return NULL;
+	double *data = (double *) PyArray_DATA((PyArrayObject *) array);
+	for (size_t i = 0; i < vectors.size(); i++)
+		for (int k = 0; k < 3; k++)
+			data[3 * i + k] = vectors[i].data[k];
+	return array;
+}
+
+static PyObject *numpyScalars(const std::vector<double> &values, int ndim, npy_intp *dims) {
+	npy_intp n = values.size();
+	PyObject *array = PyArray_SimpleNew(ndim - 1, &n, NPY_DOUBLE);
+	if (array != NULL)
+		std::copy(values.begin(), values.end(), (double *) PyArray_DATA((PyArrayObject *) array));
+	return array;
+}
+
+static PyObject *numpyDensities(const crpropa::Density *density,
+		double (crpropa::Density::*get)(const crpropa::Vector3d &) const, PyObject *input) {
+	std::vector<crpropa::Vector3d> positions;
+	int ndim;
+	npy_intp dims[2];
+	if (!numpyPositions(input, positions, ndim, dims))
+		return NULL;
+	std::vector<double> values(positions.size());
+	const crpropa::Vector3d *x = positions.empty() ? NULL : &positions[0];
+	double *v = values.empty() ? NULL : &values[0];
+	if (!numpyEvaluate(positions.size(), [=](size_t first, size_t n) {
+			for (size_t i = first; i < first + n; i++)
+				v[i] = (density->*get)(x[i]);
+		}))
+		return NULL;
+	return numpyScalars(values, ndim, dims);
+}
+%}
+
+/* the C++ getFields taking pointers is ignored, these are renamed to it */
+%rename(getFields) crpropa::MagneticField::numpyFields;
+%rename(getFields) crpropa::AdvectionField::numpyFields;
+
+%nothread; /* the GIL is released in numpyEvaluate only */
+%extend crpropa::MagneticField {
+  /* Fields at an array of positions of shape (N, 3) at redshift z, evaluated
+     in parallel with the batched getFields */
+  PyObject *numpyFields(PyObject *positions, double z = 0) {
+        std::vector<crpropa::Vector3d> x, fields;
+        int ndim;
+        npy_intp dims[2];
+        if (!numpyPositions(positions, x, ndim, dims))
+                return NULL;
+        fields.resize(x.size());
+        std::vector<double> redshifts(x.size(), z);
+        const crpropa::MagneticField *field = $self;
+        crpropa::Vector3d *px = x.empty() ? NULL : &x[0], *pf = x.empty() ? NULL : &fields[0];
+        const double *pz = x.empty() ? NULL : &redshifts[0];
+        if (!numpyEvaluate(x.size(), [=](size_t first, size_t n) {
+                        field->getFields(px + first, pz + first, pf + first, n);
+                }))
+                return NULL;
+        return numpyVectors(fields, ndim, dims);
+  }
+};
+
+%extend crpropa::AdvectionField {
+  /* Fields at an array of positions of shape (N, 3), evaluated in parallel */
+  PyObject *numpyFields(PyObject *positions) {
+        std::vector<crpropa::Vector3d> x, fields;
+        int ndim;
+        npy_intp dims[2];
+        if (!numpyPositions(positions, x, ndim, dims))
+                return NULL;
+        fields.resize(x.size());
+        std::vector<double> divergences(x.size());
+        const crpropa::AdvectionField *field = $self;
+        crpropa::Vector3d *px = x.empty() ? NULL : &x[0], *pf = x.empty() ? NULL : &fields[0];
+        double *pd = x.empty() ? NULL : &divergences[0];
+        if (!numpyEvaluate(x.size(), [=](size_t first, size_t n) {
+                        field->getFieldsAndDivergences(px + first, pf + first, pd + first, n);
+                }))
+                return NULL;
+        return numpyVectors(fields, ndim, dims);
+  }
+
+  /* Divergences at an array of positions of shape (N, 3), evaluated in parallel */
+  PyObject *getDivergences(PyObject *positions) {
+        std::vector<crpropa::Vector3d> x;
+        int ndim;
+        npy_intp dims[2];
+        if (!numpyPositions(positions, x, ndim, dims))
+                return NULL;
+        std::vector<crpropa::Vector3d> fields(x.size());
+        std::vector<double> divergences(x.size());
+        const crpropa::AdvectionField *field = $self;
+        crpropa::Vector3d *px = x.empty() ? NULL : &x[0], *pf = x.empty() ? NULL : &fields[0];
+        double *pd = x.empty() ? NULL : &divergences[0];
+        if (!numpyEvaluate(x.size(), [=](size_t first, size_t n) {
+                        field->getFieldsAndDivergences(px + first, pf + first, pd + first, n);
+                }))
+                return NULL;
+        return numpyScalars(divergences, ndim, dims);
+  }
+};
+
+%extend crpropa::Density {
+  /* Densities at an array of positions of shape (N, 3), evaluated in parallel */
+  PyObject *getDensities(PyObject *positions) {
+        return numpyDensities($self, &crpropa::Density::getDensity, positions);
+  }
+  PyObject *getHIDensities(PyObject *positions) {
+        return numpyDensities($self, &crpropa::Density::getHIDensity, positions);
+  }
+  PyObject *getHIIDensities(PyObject *positions) {
+        return numpyDensities($self, &crpropa::Density::getHIIDensity, positions);
+  }
+  PyObject *getH2Densities(PyObject *positions) {
+        return numpyDensities($self, &crpropa::Density::getH2Density, positions);
+  }
+  PyObject *getNucleonDensities(PyObject *positions) {
+        return numpyDensities($self, &crpropa::Density::getNucleonDensity, positions);
+  }
+};
+%thread; /* reenable threading */
+#endif
+
 %include "crpropa/Grid.h"
 %include "crpropa/GridTools.h"
 
@@ -397,10 +651,46 @@ using namespace crpropa;   // for usage of namespace in header files, necessary
 %template(Grid1dRefPtr) crpropa::ref_ptr<crpropa::Grid<double> >;
 %template(Grid1d) crpropa::Grid<double>;
 
+%ignore crpropa::QuantizedValue;
+%include "crpropa/QuantizedGrid.h"
+
+%implicitconv crpropa::ref_ptr<crpropa::QuantizedGrid<crpropa::Vector3<float> > >;
+%template(QuantizedGrid3fRefPtr) crpropa::ref_ptr<crpropa::QuantizedGrid<crpropa::Vector3<float> > >;
+%template(QuantizedGrid3f) crpropa::QuantizedGrid<crpropa::Vector3<float> >;
+
+%implicitconv crpropa::ref_ptr<crpropa::QuantizedGrid<float> >;
+%template(QuantizedGrid1fRefPtr) crpropa::ref_ptr<crpropa::QuantizedGrid<float> >;
+%template(QuantizedGrid1f) crpropa::QuantizedGrid<float>;
+
+%include "crpropa/AMRGrid.h"
+
+%implicitconv crpropa::ref_ptr<crpropa::AMRGrid<crpropa::Vector3<float> > >;
+%template(AMRGrid3fRefPtr) crpropa::ref_ptr<crpropa::AMRGrid<crpropa::Vector3<float> > >;
+%template(AMRGrid3f) crpropa::AMRGrid<crpropa::Vector3<float> >;
+
+%implicitconv crpropa::ref_ptr<crpropa::AMRGrid<float> >;
+%template(AMRGrid1fRefPtr) crpropa::ref_ptr<crpropa::AMRGrid<float> >;
+%template(AMRGrid1f) crpropa::AMRGrid<float>;
+
+%include "crpropa/MappedGrid.h"
+
+%implicitconv crpropa::ref_ptr<crpropa::MappedGrid<crpropa::Vector3<float> > >;
+%template(MappedGrid3fRefPtr) crpropa::ref_ptr<crpropa::MappedGrid<crpropa::Vector3<float> > >;
+%template(MappedGrid3f) crpropa::MappedGrid<crpropa::Vector3<float> >;
+
+%implicitconv crpropa::ref_ptr<crpropa::MappedGrid<float> >;
+%template(MappedGrid1fRefPtr) crpropa::ref_ptr<crpropa::MappedGrid<float> >;
+%template(MappedGrid1f) crpropa::MappedGrid<float>;
+
+%implicitconv crpropa::ref_ptr<crpropa::SlabDecomposition>;
+%template(SlabDecompositionRefPtr) crpropa::ref_ptr<crpropa::SlabDecomposition>;
+%include "crpropa/SlabDecomposition.h"
+
 %implicitconv std::pair<std::vector<int>, std::vector<float> >;
 %template(PairIntFloat) std::pair<int, float>;
 %template(PairVector) std::vector<std::pair<int, float> >;
 
+%template(StringVector) std::vector<std::string>;
 %include "crpropa/EmissionMap.h"
 %implicitconv crpropa::ref_ptr<crpropa::EmissionMap>;
 %template(EmissionMapRefPtr) crpropa::ref_ptr<crpropa::EmissionMap>;
@@ -408,6 +698,7 @@ using namespace crpropa;   // for usage of namespace in header files, necessary
 %template(CylindricalProjectionMapRefPtr) crpropa::ref_ptr<crpropa::CylindricalProjectionMap>;
 
 %include "crpropa/magneticField/MagneticFieldGrid.h"
+%include "crpropa/advectionField/AdvectionFieldGrid.h"
 %feature("notabstract") QuimbyMagneticFieldAdapter;
 %include "crpropa/magneticField/QuimbyMagneticField.h"
 %include "crpropa/magneticField/AMRMagneticField.h"
@@ -416,6 +707,8 @@ using namespace crpropa;   // for usage of namespace in header files, necessary
 %include "crpropa/magneticField/PT11Field.h"
 %include "crpropa/magneticField/TF17Field.h"
 %include "crpropa/magneticField/ArchimedeanSpiralField.h"
+%include "crpropa/magneticField/CachedMagneticField.h"
+%template(TurbulentFieldRefPtr) crpropa::ref_ptr<crpropa::TurbulentField>;
 %include "crpropa/magneticField/turbulentField/TurbulentField.h"
 %include "crpropa/magneticField/turbulentField/GridTurbulence.h"
 %include "crpropa/magneticField/turbulentField/SimpleGridTurbulence.h"
@@ -423,13 +716,18 @@ using namespace crpropa;   // for usage of namespace in header files, necessary
 %include "crpropa/magneticField/turbulentField/PlaneWaveTurbulence.h"
 %include "crpropa/module/BreakCondition.h"
 %include "crpropa/module/Boundary.h"
+%include "crpropa/module/TerminationConditions.h"
+%include "crpropa/module/WeightWindow.h"
 
 %feature("director") crpropa::Observer;
 %feature("director") crpropa::ObserverFeature;
 %include "crpropa/module/Observer.h"
 %include "crpropa/module/SimplePropagation.h"
 %include "crpropa/module/PropagationCK.h"
+%include "crpropa/module/PropagationDP.h"
+%include "crpropa/module/PropagationGC.h"
 %include "crpropa/module/PropagationBP.h"
+%include "crpropa/module/PropagationSmallAngle.h"
 
 %ignore crpropa::Output::enableProperty(const std::string &property, const Variant& defaultValue, const std::string &comment = "");
 %extend crpropa::Output{
@@ -508,12 +806,161 @@ using namespace crpropa;   // for usage of namespace in header files, necessary
 %include "crpropa/module/TextOutput.h"
 
 %include "crpropa/module/HDF5Output.h"
+%include "crpropa/module/ParquetOutput.h"
+%include "crpropa/module/HistogramOutput.h"
+%include "crpropa/module/NetworkOutput.h"
+%include "crpropa/module/ShardedOutput.h"
+%pythoncode %{
+def readShardedOutput(manifest):
+    """Read the shards of a ShardedOutput as one dataset.
+
+    Returns a dict of numpy arrays by column name, the rows of all shards
+    concatenated in the order of the manifest, in the units of the output.
+    Text shards are read with numpy, HDF5 shards with h5py and Parquet
+    shards with pyarrow.
+    """
+    import json
+    import os
+    import numpy as np
+
+    with open(manifest) as f:
+        index = json.load(f)
+    directory = os.path.dirname(manifest)
+    columns = {}
+    for shard in index['shards']:
+        path = os.path.join(directory, shard['file'])
+        if shard['rows'] == 0:
+            continue
+        if index['output'] == 'HDF5Output':
+            import h5py
+            with h5py.File(path, 'r') as f:
+                data = f['CRPROPA3'][()]
+                values = dict((name, data[name]) for name in data.dtype.names)
+        elif index['output'] == 'ParquetOutput':
+            import pyarrow.parquet
+            table = pyarrow.parquet.read_table(path)
+            values = dict((name, table.column(name).to_numpy()) for name in table.column_names)
+        else:
+            with open(path) as f:
+                header = f.readline()
+            names = header.lstrip('#').split()
+            data = np.atleast_2d(np.loadtxt(path, comments='#', ndmin=2))
+            values = dict((name, data[:, i]) for i, name in enumerate(names))
+        for name, value in values.items():
+            columns.setdefault(name, []).append(value)
+    return dict((name, np.concatenate(parts)) for name, parts in columns.items())
+%}
+%template(ShellCrossingStoreRefPtr) crpropa::ref_ptr<crpropa::ShellCrossingStore>;
+%include "crpropa/module/ShellCrossingStore.h"
+
+%ignore crpropa::TrajectoryOutput::read;
+%include "crpropa/module/TrajectoryOutput.h"
+%pythoncode %{
+def readTrajectoryOutput(filename):
+    """Read the trajectories of a TrajectoryOutput file.
+
+    Returns a list with a dict per trajectory, with the serial numbers 'SN'
+    and 'SN1', the source id 'ID0' and the columns 'D', 'ID', 'E', 'X', 'Y',
+    'Z', 'Px', 'Py', 'Pz' of its points in SI units, as numpy arrays if
+    numpy is available.
+    """
+    import math
+    import struct
+    import zlib
+
+    with open(filename, 'rb') as f:
+        content = f.read()
+    if content[:8] != b'CRPTRJ1\x00':
+        raise IOError('not a trajectory file: ' + filename)
+    version, compressed, lengthPrecision, energyPrecision, scale, _ = \
+        struct.unpack_from('<IIddII', content, 8)
+    if version != 1:
+        raise IOError('unsupported version of the trajectory format')
+
+    def direction(u, w):
+        x, y = u / float(scale), w / float(scale)
+        z = 1 - abs(x) - abs(y)
+        if z < 0:
+            x, y = (1 - abs(y)) * (1 if x >= 0 else -1), (1 - abs(x)) * (1 if y >= 0 else -1)
+        r = math.sqrt(x * x + y * y + z * z)
+        return x / r, y / r, z / r
+
+    columns = ('D', 'ID', 'E', 'X', 'Y', 'Z', 'Px', 'Py', 'Pz')
+    trajectories = []
+    index = {}
+    offset = 40
+    while offset + 8 <= len(content):
+        size, stored = struct.unpack_from('<II', content, offset)
+        data = content[offset + 8:offset + 8 + stored]
+        offset += 8 + stored
+        if compressed:
+            data = zlib.decompress(data)
+        data = bytearray(data)
+
+        p = [0]
+        def varint():
+            value, shift = 0, 0
+            while True:
+                byte = data[p[0]]
+                p[0] += 1
+                value |= (byte & 0x7f) << shift
+                if not byte & 0x80:
+                    return value
+                shift += 7
+        def signed():
+            value = varint()
+            return (value >> 1) ^ -(value & 1)
+
+        trajectory = None
+        last = [0] * 7
+        while p[0] < len(data):
+            tag = data[p[0]]
+            p[0] += 1
+            if tag == 0:
+                sn = varint()
+                if sn not in index:
+                    index[sn] = len(trajectories)
+                    t = dict((c, []) for c in columns)
+                    t['SN'] = sn
+                    trajectories.append(t)
+                trajectory = trajectories[index[sn]]
+                trajectory['SN1'] = varint()
+                trajectory['ID0'] = signed()
+                last = [0] * 7
+            elif tag == 1:
+                pid = signed()
+            elif tag == 2 and trajectory is not None:
+                for k in range(7):
+                    last[k] += signed()
+                trajectory['D'].append(last[0] * lengthPrecision)
+                trajectory['X'].append(last[1] * lengthPrecision)
+                trajectory['Y'].append(last[2] * lengthPrecision)
+                trajectory['Z'].append(last[3] * lengthPrecision)
+                trajectory['E'].append(10 ** (last[4] * energyPrecision))
+                px, py, pz = direction(last[5], last[6])
+                trajectory['Px'].append(px)
+                trajectory['Py'].append(py)
+                trajectory['Pz'].append(pz)
+                trajectory['ID'].append(pid)
+            else:
+                raise IOError('corrupt block in ' + filename)
+
+    if __WITHNUMPY:
+        for t in trajectories:
+            for c in columns:
+                t[c] = numpy.array(t[c])
+    return trajectories
+%}
 %include "crpropa/module/OutputShell.h"
 %include "crpropa/module/EMCascade.h"
 %include "crpropa/module/PhotonEleCa.h"
 %include "crpropa/module/PhotonOutput1D.h"
+%include "crpropa/module/InteractionSampler.h"
+%include "crpropa/module/ContinuousLosses.h"
 %include "crpropa/module/NuclearDecay.h"
 %include "crpropa/module/ElectronPairProduction.h"
+%template(SophiaEventLibraryRefPtr) crpropa::ref_ptr<crpropa::SophiaEventLibrary>;
+%include "crpropa/module/SophiaEventLibrary.h"
 %include "crpropa/module/PhotoPionProduction.h"
 %include "crpropa/module/PhotoDisintegration.h"
 %include "crpropa/module/ElasticScattering.h"
@@ -534,6 +981,68 @@ using namespace crpropa;   // for usage of namespace in header files, necessary
 %template(SourceFeatureRefPtr) crpropa::ref_ptr<crpropa::SourceFeature>;
 %feature("director") crpropa::SourceFeature;
 %include "crpropa/Source.h"
+%ignore crpropa::SourceArray::SourceArray(size_t, const int32_t *, const double *,
+		const double *, const double *, const double *, const double *);
+%ignore crpropa::SourceArray::setOwner;
+%include "crpropa/SourceArray.h"
+
+#ifdef WITHNUMPY
+%{
+// keeps the arrays of the columns of a SourceArray alive
+class NumpyColumns: public crpropa::Referenced {
+public:
+	std::vector<PyObject *> arrays;
+	~NumpyColumns() {
+		PyGILState_STATE state = PyGILState_Ensure();
+		for (size_t i = 0; i < arrays.size(); i++)
+			Py_XDECREF(arrays[i]);
+		PyGILState_Release(state);
+	}
+	// data of the input as contiguous array of count * width values of the
+	// type, converted if necessary, NULL for None
+	const void *column(PyObject *input, int type, npy_intp count, npy_intp width,
+			const char *name) {
+		if ((input == NULL) or (input == Py_None))
+			return NULL;
+		PyObject *array = PyArray_FROMANY(input, type, 1, 2, NPY_ARRAY_IN_ARRAY);
+		if (array == NULL)
+			throw std::runtime_error(std::string("SourceArray: invalid ") + name);
+		arrays.push_back(array);
+		if (PyArray_SIZE((PyArrayObject *) array) != count * width)
+			throw std::runtime_error(std::string("SourceArray: wrong length of ") + name);
+		return PyArray_DATA((PyArrayObject *) array);
+	}
+};
+%}
+
+%nothread; /* the arrays are converted with the GIL */
+%extend crpropa::SourceArray {
+  /* Source of the rows of NumPy arrays of ids, energies, positions of shape
+     (N, 3) and optionally directions of shape (N, 3), redshifts and weights */
+  SourceArray(PyObject *id, PyObject *energy, PyObject *position,
+                PyObject *direction = NULL, PyObject *redshift = NULL, PyObject *weight = NULL) {
+        crpropa::ref_ptr<NumpyColumns> columns = new NumpyColumns();
+        npy_intp n = PyObject_Length(energy);
+        if (n < 0)
+                throw std::runtime_error("SourceArray: invalid energies");
+        crpropa::SourceArray *source = new crpropa::SourceArray(n,
+                        (const int32_t *) columns->column(id, NPY_INT32, n, 1, "ids"),
+                        (const double *) columns->column(energy, NPY_DOUBLE, n, 1, "energies"),
+                        (const double *) columns->column(position, NPY_DOUBLE, n, 3, "positions"),
+                        (const double *) columns->column(direction, NPY_DOUBLE, n, 3, "directions"),
+                        (const double *) columns->column(redshift, NPY_DOUBLE, n, 1, "redshifts"),
+                        (const double *) columns->column(weight, NPY_DOUBLE, n, 1, "weights"));
+        source->setOwner(columns);
+        return source;
+  }
+};
+%thread; /* reenable threading */
+#endif
+%include "crpropa/SourceCatalog.h"
+
+%template(SourceModelRefPtr) crpropa::ref_ptr<crpropa::SourceModel>;
+%template(SourceReweightingRefPtr) crpropa::ref_ptr<crpropa::SourceReweighting>;
+%include "crpropa/SourceReweighting.h"
 
 %inline %{
 class ModuleListIterator {
@@ -577,9 +1086,46 @@ class ModuleListIterator {
 };
 
 %template(ModuleListRefPtr) crpropa::ref_ptr<crpropa::ModuleList>;
+%template(SecondaryAdmissionRefPtr) crpropa::ref_ptr<crpropa::SecondaryAdmission>;
+%feature("director") crpropa::SecondaryAdmission;
+%ignore crpropa::SecondaryAdmission::Scope;
+%include "crpropa/SecondaryAdmission.h"
+
+%template(ConvergenceObservableRefPtr) crpropa::ref_ptr<crpropa::ConvergenceObservable>;
+%feature("director") crpropa::ConvergenceObservable;
+%template(DetectionCounterRefPtr) crpropa::ref_ptr<crpropa::DetectionCounter>;
+%template(ConvergenceCriterionRefPtr) crpropa::ref_ptr<crpropa::ConvergenceCriterion>;
+%include "crpropa/Convergence.h"
+
+%template(PrimaryCostEstimateRefPtr) crpropa::ref_ptr<crpropa::PrimaryCostEstimate>;
+%feature("director") crpropa::PrimaryCostEstimate;
+%template(ModuleProfileVector) std::vector<crpropa::ModuleProfile>;
+/* the runs release the GIL, modules derived in Python take it per call of
+   process, or once per batch for a BatchModule in runBatch */
+%thread crpropa::ModuleList::run;
+%thread crpropa::ModuleList::runBatch;
+%ignore crpropa::ModuleList::apply;
 %include "crpropa/ModuleList.h"
 
+%template(ModuleList1DRefPtr) crpropa::ref_ptr<crpropa::ModuleList1D>;
+%include "crpropa/ModuleList1D.h"
+
+%template(TransferMatrixRefPtr) crpropa::ref_ptr<crpropa::TransferMatrix>;
+%include "crpropa/TransferMatrix.h"
+
+%template(TargetedEmissionRefPtr) crpropa::ref_ptr<crpropa::TargetedEmission>;
+%thread crpropa::TargetedEmission::runPilot;
+%include "crpropa/TargetedEmission.h"
+
+%template(TransportSolver1DRefPtr) crpropa::ref_ptr<crpropa::TransportSolver1D>;
+%thread crpropa::TransportSolver1D::solve;
+%include "crpropa/TransportSolver1D.h"
+
 %template(ParticleCollectorRefPtr) crpropa::ref_ptr<crpropa::ParticleCollector>;
+%thread crpropa::ParticleCollector::reprocess;
+%template(ParticleCollectorVector) std::vector< crpropa::ref_ptr<crpropa::ParticleCollector> >;
+%template(ModuleVector) std::vector< crpropa::ref_ptr<crpropa::Module> >;
+%template(IndexVector) std::vector<size_t>;
 
 %inline %{
 class ParticleCollectorIterator {
@@ -648,10 +1194,86 @@ class ParticleCollectorIterator {
 
 %include "crpropa/module/ParticleCollector.h"
 
+/* NumPy structured arrays of the compact records of a ParticleCollector */
+#ifdef WITHNUMPY
+%{
+// dtype of crpropa::CompactCandidate
+static PyArray_Descr *compactCandidateDescr() {
+	PyObject *state = Py_BuildValue("[(ss)(ss(i))(ss(i))(ss)]", "energy", "f8",
+			"position", "f8", 3, "direction", "f4", 3, "id", "i4");
+	PyObject *fields = Py_BuildValue("[(sO)(sO)(sO)(ss)(ss)(ss)(ss)(ss)(ss)(ss)(ss)(ss)]",
+			"current", state, "source", state, "created", state,
+			"weight", "f8", "trajectoryLength", "f8", "redshift", "f4", "reserved", "u4",
+			"serialNumber", "u8", "sourceSerialNumber", "u8", "createdSerialNumber", "u8",
+			"randomStream", "u8", "randomStart", "u8");
+	PyArray_Descr *descr = NULL;
+	PyArray_DescrConverter(fields, &descr);
+	Py_XDECREF(fields);
+	Py_XDECREF(state);
+	return descr;
+}
+
+static void releaseParticleCollector(PyObject *capsule) {
+	delete (crpropa::ref_ptr<crpropa::ParticleCollector> *) PyCapsule_GetPointer(capsule, NULL);
+}
+%}
+
+%nothread; /* the array is created with the GIL */
+%extend crpropa::ParticleCollector {
+  /* Structured array of the records, in SI units. In compact mode a read-only
+     view of the records without copying, valid until the collector collects
+     or is cleared; otherwise a copy of the records of the candidates. */
+  PyObject *getRecordArray() {
+        PyArray_Descr *descr = compactCandidateDescr();
+        if (descr == NULL)
+                return NULL;
+        bool compact = $self->getCompact();
+        npy_intp n = $self->size();
+        void *data = NULL;
+        if (compact and (n > 0))
+                data = (void *) &$self->getRecords()[0];
+        PyArrayObject *array = (PyArrayObject *) PyArray_NewFromDescr(&PyArray_Type,
+                        descr, 1, &n, NULL, data, compact ? NPY_ARRAY_C_CONTIGUOUS | NPY_ARRAY_ALIGNED : 0, NULL);
+        if (array == NULL)
+                return NULL;
+        if (PyArray_ITEMSIZE(array) != sizeof(crpropa::CompactCandidate)) {
+                Py_DECREF(array);
+                PyErr_SetString(PyExc_RuntimeError, "ParticleCollector: dtype does not match CompactCandidate");
+                return NULL;
+        }
+
+        if (not compact) {
+                crpropa::CompactCandidate *records = (crpropa::CompactCandidate *) PyArray_DATA(array);
+                for (npy_intp i = 0; i < n; i++)
+                        records[i] = crpropa::ParticleCollector::toRecord((*$self)[i]);
+                return (PyObject *) array;
+        }
+
+        // the view keeps the collector alive
+        PyObject *owner = PyCapsule_New(new crpropa::ref_ptr<crpropa::ParticleCollector>($self), NULL,
+                        releaseParticleCollector);
+        PyArray_SetBaseObject(array, owner);
+        return (PyObject *) array;
+  }
+};
+%thread; /* reenable threading */
+#else
+%extend crpropa::ParticleCollector {
+  PyObject *getRecordArray() {
+        std::cerr << "ERROR: CRPropa was compiled without numpy support!" << std::endl;
+        Py_RETURN_NONE;
+  }
+};
+#endif
+
+%template(SnapshotCollectorRefPtr) crpropa::ref_ptr<crpropa::SnapshotCollector>;
+%include "crpropa/module/SnapshotCollector.h"
+
 %include "crpropa/massDistribution/Density.h"
 %include "crpropa/massDistribution/Nakanishi.h"
 %include "crpropa/massDistribution/Cordes.h"
 %include "crpropa/massDistribution/Ferriere.h"
 %include "crpropa/massDistribution/Massdistribution.h"
 %include "crpropa/massDistribution/ConstantDensity.h"
+%include "crpropa/massDistribution/DensityGrid.h"
 
@@ -13,6 +13,8 @@
 #include "crpropa/magneticLens/Pixelization.h"
 #include "crpropa/magneticLens/MagneticLens.h"
 #include "crpropa/magneticLens/ParticleMapsContainer.h"
+#include "crpropa/magneticLens/LensBuilder.h"
+#include "crpropa/magneticLens/GalacticLensing.h"
 %}
 
 %include "crpropa/magneticLens/ModelMatrix.h"
@@ -36,6 +38,8 @@
 %ignore MagneticLens::transformModelVector(double *,double) const;
 %include "crpropa/magneticLens/MagneticLens.h"
 %template(LenspartVector) std::vector< crpropa::LensPart *>;
+%include "crpropa/magneticLens/LensBuilder.h"
+%include "crpropa/magneticLens/GalacticLensing.h"
 
 #ifdef WITHNUMPY
 %extend crpropa::MagneticLens{
@@ -78,6 +82,8 @@
 %ignore ParticleMapsContainer::getParticleIds;
 %ignore ParticleMapsContainer::getEnergies;
 %ignore ParticleMapsContainer::getRandomParticles;
+%ignore ParticleMapsContainer::addParticles(const std::vector<int> &, const std::vector<double> &, const std::vector<double> &, const std::vector<double> &, const std::vector<double> &);
+%ignore ParticleMapsContainer::addParticles(const std::vector<int> &, const std::vector<double> &, const std::vector<double> &, const std::vector<double> &);
 %include "crpropa/magneticLens/ParticleMapsContainer.h"
 
 #ifdef WITHNUMPY
@@ -193,17 +199,16 @@
       double *galacticLatitudes_dp = (double*) PyArray_DATA(galacticLatitudes_arr);
       double *weights_dp= (double*) PyArray_DATA(weights_arr);
 
+      std::vector<int> ids(arraySize);
       for(size_t i =0; i < arraySize; i++ )
       {
         if (intSize == 32)
         {
-          $self->addParticle(((int32_t*) particleIds_dp)[i], energies_dp[i],
-              galacticLongitudes_dp[i], galacticLatitudes_dp[i], weights_dp[i]);
+          ids[i] = ((int32_t*) particleIds_dp)[i];
         }
         else if (intSize == 64)
         {
-          $self->addParticle(((int64_t*) particleIds_dp)[i], energies_dp[i],
-              galacticLongitudes_dp[i], galacticLatitudes_dp[i], weights_dp[i]);
+          ids[i] = ((int64_t*) particleIds_dp)[i];
         }
         else
         {
@@ -211,6 +216,11 @@
         }
 
       }
+      $self->addParticles(ids,
+          std::vector<double>(energies_dp, energies_dp + arraySize),
+          std::vector<double>(galacticLongitudes_dp, galacticLongitudes_dp + arraySize),
+          std::vector<double>(galacticLatitudes_dp, galacticLatitudes_dp + arraySize),
+          std::vector<double>(weights_dp, weights_dp + arraySize));
       Py_RETURN_TRUE;
     }
 
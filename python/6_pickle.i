@@ -0,0 +1,199 @@
+/* 6. Pickling of the configuration */
+/*
+ * Objects of the configuration classes below (the modules including the
+ * ModuleList, fields, densities, sources, observer features, surfaces,
+ * photon fields and grids) constructed in Python record their constructor
+ * arguments and the configuring calls made on them: methods starting with
+ * set, add, enable, disable, init, remove or clear, assignments to member
+ * variables and the grid functions below. A setter called again replaces
+ * its earlier call with the same leading arguments, so the record keeps the
+ * last value and does not grow. Pickling an object stores this record
+ * instead of the C++ state, and unpickling replays it, so that a configured
+ * ModuleList, with its modules, fields and sources, is shipped to the
+ * workers of multiprocessing, dask or ray in milliseconds. The tables are
+ * loaded there on first use as usual, once per process and shared by the
+ * modules through the TableRegistry; grids mapped with MappedGrid share
+ * their pages between the processes of a node.
+ *
+ * Not recorded, and therefore not picklable, are objects of other classes,
+ * e.g. Candidate, objects returned from C++ (e.g. getModule) except Vector3
+ * and std::vector values, and grids changed value by value with setValue;
+ * save such grids with MappedGrid.save and map them in the workers. Data of
+ * the run, e.g. the candidates of a ParticleCollector, are not part of the
+ * configuration.
+ * Not available with the builtin SWIG interface.
+ */
+
+%pythoncode %{
+
+def _crpropa_rebuild(cls, create, args, kwargs, calls):
+    """Construct an object and replay its configuring calls, see pickling"""
+    kind, base = create
+    if kind == 'function':
+        obj = globals()[base](*args, **kwargs)
+    elif base is cls:
+        obj = cls(*args, **kwargs)
+    else:
+        # Python subclass, constructed by the constructor of its base
+        obj = cls.__new__(cls)
+        base.__init__(obj, *args, **kwargs)
+    for kind, name, args, kwargs in calls:
+        if kind == 'method':
+            getattr(obj, name)(*args, **kwargs)
+        elif kind == 'attribute':
+            setattr(obj, name, args[0])
+        else:
+            globals()[name](obj, *args, **kwargs)
+    return obj
+
+def _crpropa_pickling():
+    import functools
+
+    attribute = '_crpropa_configuration'
+    # base classes of the recorded objects
+    configurable = ('Module', 'MagneticField', 'AdvectionField', 'Density',
+                    'SourceInterface', 'SourceFeature', 'ObserverFeature', 'Surface',
+                    'PhotonField', 'TurbulenceSpectrum', 'GridProperties',
+                    'Grid1f', 'Grid1d', 'Grid3f', 'Grid3d')
+    recorded = ('set', 'add', 'enable', 'disable', 'init', 'remove', 'clear')
+    unrecordable = {
+        'setValue': 'changed value by value with setValue, save it with '
+                    'MappedGrid.save and map it instead'}
+    # functions that configure the object given as first argument
+    mutators = ('loadGrid', 'loadGridFromTxt', 'loadGridHDF5', 'scaleGrid',
+                'fromMagneticField', 'fromMagneticFieldDirection',
+                'fromMagneticFieldStrength', 'initHelicalTurbulence')
+    # functions that create an object from their arguments
+    factories = ('readGrid1f', 'readGrid3f')
+
+    def configuration(obj):
+        return obj.__dict__.get(attribute) if hasattr(obj, '__dict__') else None
+
+    def same(a, b):
+        try:
+            return bool(a == b)
+        except Exception:
+            return a is b # e.g. arrays
+
+    def append(calls, call):
+        """Append a call, replacing an earlier call of the same setter"""
+        kind, name, args, kwargs = call
+        if kind == 'attribute' or name.startswith('set'):
+            key = args[:-1], sorted(kwargs)
+            calls[:] = [c for c in calls if not (c[0] == kind and c[1] == name
+                        and same((c[2][:-1], sorted(c[3])), key))]
+        calls.append(call)
+
+    def record(obj, call):
+        config = configuration(obj)
+        if config is not None:
+            append(config['calls'], call)
+
+    def reduce_ex(self, protocol):
+        config = configuration(self)
+        name = type(self).__name__
+        if config is None:
+            raise TypeError('cannot pickle %s: only objects constructed in Python '
+                            'can be pickled, not objects returned from C++' % name)
+        if config['error']:
+            raise TypeError('cannot pickle %s: %s' % (name, config['error']))
+        state = dict((k, v) for k, v in self.__dict__.items()
+                     if k not in ('this', 'thisown', attribute))
+        args = (type(self), config['create'], config['args'], config['kwargs'], config['calls'])
+        return (_crpropa_rebuild, args, state or None)
+
+    def wrap_init(cls, init):
+        @functools.wraps(init)
+        def __init__(self, *args, **kwargs):
+            init(self, *args, **kwargs)
+            if attribute not in self.__dict__:
+                object.__setattr__(self, attribute, {'create': ('class', cls),
+                    'args': args, 'kwargs': kwargs, 'calls': [], 'error': None})
+        return __init__
+
+    def wrap_method(name, method):
+        @functools.wraps(method)
+        def recorded_method(self, *args, **kwargs):
+            result = method(self, *args, **kwargs)
+            config = configuration(self)
+            if config is None:
+                pass
+            elif name in unrecordable:
+                config['error'] = unrecordable[name]
+            else:
+                append(config['calls'], ('method', name, args, kwargs))
+            return result
+        return recorded_method
+
+    def wrap_property(name, prop):
+        def fset(self, value):
+            prop.fset(self, value)
+            record(self, ('attribute', name, (value,), {}))
+        return property(prop.fget, fset, prop.fdel, prop.__doc__)
+
+    def wrap_mutator(name, function):
+        @functools.wraps(function)
+        def mutator(obj, *args, **kwargs):
+            result = function(obj, *args, **kwargs)
+            record(obj, ('function', name, args, kwargs))
+            return result
+        return mutator
+
+    def wrap_factory(name, function):
+        @functools.wraps(function)
+        def factory(*args, **kwargs):
+            obj = function(*args, **kwargs)
+            if hasattr(obj, '__dict__') and attribute not in obj.__dict__:
+                object.__setattr__(obj, attribute, {'create': ('function', name),
+                    'args': args, 'kwargs': kwargs, 'calls': [], 'error': None})
+            return obj
+        return factory
+
+    def reduce_vector3(self):
+        return (type(self), (self.x, self.y, self.z))
+
+    def reduce_sequence(self):
+        return (type(self), (tuple(self),))
+
+    namespace = globals()
+    bases = tuple(namespace[name] for name in configurable if name in namespace)
+    for cls in list(namespace.values()):
+        if not (isinstance(cls, type) and cls.__module__ == __name__ and hasattr(cls, 'thisown')):
+            continue
+        if cls.__name__.endswith('RefPtr'):
+            continue
+        try:
+            if cls.__name__ in ('Vector3d', 'Vector3f'):
+                cls.__reduce__ = reduce_vector3
+                cls.__reduce_ex__ = lambda self, protocol: reduce_vector3(self)
+                continue
+            if hasattr(cls, 'push_back') and hasattr(cls, '__len__'):
+                cls.__reduce__ = reduce_sequence
+                cls.__reduce_ex__ = lambda self, protocol: reduce_sequence(self)
+                continue
+            if not issubclass(cls, bases):
+                continue
+            for name, member in list(cls.__dict__.items()):
+                if name == '__init__':
+                    cls.__init__ = wrap_init(cls, member)
+                elif isinstance(member, (staticmethod, classmethod)):
+                    continue
+                elif isinstance(member, property) and member.fset and name != 'thisown':
+                    setattr(cls, name, wrap_property(name, member))
+                elif callable(member) and (name.startswith(recorded) or name in unrecordable):
+                    setattr(cls, name, wrap_method(name, member))
+            cls.__reduce_ex__ = reduce_ex
+        except (TypeError, AttributeError):
+            pass # static types of the builtin interface
+
+    for name in mutators:
+        if name in namespace:
+            namespace[name] = wrap_mutator(name, namespace[name])
+    for name in factories:
+        if name in namespace:
+            namespace[name] = wrap_factory(name, namespace[name])
+
+_crpropa_pickling()
+del _crpropa_pickling
+
+%}
@@ -6,6 +6,8 @@
  * 2. SWIG and CRPropa headers
  * 3. Pretty print for Python
  * 4. Magnetic Lens and Particle Maps Container
+ * 5. HepPID
+ * 6. Pickling of the configuration
  *
  */
 
@@ -66,3 +68,4 @@ ParticleMapsContainer.getRandomParticles = ParticleMapsContainer.getRandomPartic
 
 #endif // WITH_GALACTIC_LENSES_
 
+%include "6_pickle.i"
@@ -0,0 +1,205 @@
+#include "crpropa/AMRGrid.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+#ifdef CRPROPA_HAVE_HDF5
+#include <hdf5.h>
+#endif
+
+namespace crpropa {
+
+template<typename T>
+AMRGrid<T>::AMRGrid(Vector3d origin, size_t Nx, size_t Ny, size_t Nz, Vector3d blockSize) :
+		Nx(Nx), Ny(Ny), Nz(Nz), origin(origin), blockSize(blockSize), maxLevel(0) {
+	if ((Nx == 0) or (Ny == 0) or (Nz == 0))
+		throw std::runtime_error("AMRGrid: number of root blocks must be larger than 0");
+	Block root = {-1, 0};
+	blocks.resize(Nx * Ny * Nz, root);
+	values.resize(blocks.size() * brick * brick * brick, T(0.));
+}
+
+template<typename T>
+void AMRGrid<T>::refine(size_t b) {
+	const size_t n = brick * brick * brick;
+	if (blocks.size() + 8 > size_t(std::numeric_limits<int32_t>::max()))
+		throw std::runtime_error("AMRGrid: too many blocks");
+	int32_t first = blocks.size();
+	blocks[b].firstChild = first;
+	Block child = {-1, blocks[b].level + 1};
+	blocks.resize(blocks.size() + 8, child);
+	values.resize(blocks.size() * n);
+	maxLevel = std::max(maxLevel, child.level);
+
+	// the children inherit the cells of their parent
+	for (int c = 0; c < 8; c++) {
+		int ox = ((c >> 2) & 1) * cells / 2, oy = ((c >> 1) & 1) * cells / 2, oz = (c & 1) * cells / 2;
+		T *v = &values[(first + c) * n];
+		const T *p = &values[b * n];
+		for (int ix = 0; ix < cells; ix++)
+			for (int iy = 0; iy < cells; iy++)
+				for (int iz = 0; iz < cells; iz++)
+					v[brickIndex(ix, iy, iz)] = p[brickIndex(ox + ix / 2, oy + iy / 2, oz + iz / 2)];
+	}
+}
+
+template<typename T>
+void AMRGrid<T>::setBlock(int level, size_t ix, size_t iy, size_t iz, const T *v) {
+	if ((level < 0) or (level > 30))
+		throw std::runtime_error("AMRGrid: level out of range");
+	size_t rx = ix >> level, ry = iy >> level, rz = iz >> level;
+	if ((rx >= Nx) or (ry >= Ny) or (rz >= Nz))
+		throw std::runtime_error("AMRGrid: block outside of the grid");
+
+	// descend from the root block, refining where needed
+	size_t b = (rx * Ny + ry) * Nz + rz;
+	for (int l = level - 1; l >= 0; l--) {
+		if (blocks[b].firstChild < 0)
+			refine(b);
+		int cx = (ix >> l) & 1, cy = (iy >> l) & 1, cz = (iz >> l) & 1;
+		b = blocks[b].firstChild + ((cx << 2) | (cy << 1) | cz);
+	}
+
+	T *d = &values[b * brick * brick * brick];
+	for (int jx = 0; jx < cells; jx++)
+		for (int jy = 0; jy < cells; jy++)
+			for (int jz = 0; jz < cells; jz++)
+				d[brickIndex(jx, jy, jz)] = v[(jx * cells + jy) * cells + jz];
+}
+
+template<typename T>
+void AMRGrid<T>::fillGhostCells() {
+	// lower corner of every block
+	std::vector<Vector3d> lower(blocks.size());
+	for (size_t b = 0; b < Nx * Ny * Nz; b++)
+		lower[b] = origin + Vector3d(b / (Ny * Nz), (b / Nz) % Ny, b % Nz) * blockSize;
+	for (size_t b = 0; b < blocks.size(); b++) {
+		if (blocks[b].firstChild < 0)
+			continue;
+		Vector3d half = blockSize / double(1 << (blocks[b].level + 1));
+		for (int c = 0; c < 8; c++)
+			lower[blocks[b].firstChild + c] = lower[b]
+					+ Vector3d((c >> 2) & 1, (c >> 1) & 1, c & 1) * half;
+	}
+
+	// ghost cells of the leaves from the finest cells at their centres, the
+	// interior cells are not modified so the lookups are independent
+	const size_t n = brick * brick * brick;
+#pragma omp parallel for schedule(dynamic, 64)
+	for (long i = 0; i < long(blocks.size()); i++) {
+		size_t b = i;
+		if (blocks[b].firstChild >= 0)
+			continue;
+		Vector3d cell = blockSize / double(cells << blocks[b].level);
+		for (int ix = -1; ix <= cells; ix++)
+			for (int iy = -1; iy <= cells; iy++)
+				for (int iz = -1; iz <= cells; iz++) {
+					bool ghost = (ix < 0) or (iy < 0) or (iz < 0)
+							or (ix == cells) or (iy == cells) or (iz == cells);
+					if (not ghost)
+						continue;
+					Vector3d p = lower[b] + (Vector3d(ix, iy, iz) + Vector3d(0.5)) * cell;
+					values[b * n + brickIndex(ix, iy, iz)] = closestValue(p);
+				}
+	}
+}
+
+template class AMRGrid<float>;
+template class AMRGrid<Vector3f>;
+
+#ifdef CRPROPA_HAVE_HDF5
+// reads a dataset of doubles or integers, converted by HDF5
+template<typename U>
+static std::vector<U> readFLASHDataset(hid_t file, const char *name, hid_t type,
+		std::vector<hsize_t> &dims) {
+	hid_t dset = H5Dopen2(file, name, H5P_DEFAULT);
+	if (dset < 0)
+		throw std::runtime_error(std::string("loadFLASHMagneticField: no dataset ") + name);
+	hid_t space = H5Dget_space(dset);
+	dims.resize(H5Sget_simple_extent_ndims(space));
+	H5Sget_simple_extent_dims(space, &dims[0], NULL);
+	std::vector<U> data(H5Sget_simple_extent_npoints(space));
+	herr_t status = H5Dread(dset, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, &data[0]);
+	H5Sclose(space);
+	H5Dclose(dset);
+	if (status < 0)
+		throw std::runtime_error(std::string("loadFLASHMagneticField: could not read ") + name);
+	return data;
+}
+
+ref_ptr<AMRGrid3f> loadFLASHMagneticField(const std::string &filename,
+		double lengthUnit, double fieldUnit) {
+	hid_t file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+	if (file < 0)
+		throw std::runtime_error("loadFLASHMagneticField: could not open " + filename);
+
+	std::vector<hsize_t> dims, bdims, mdims;
+	std::vector<int> levels;
+	std::vector<double> box, mag[3];
+	try {
+		levels = readFLASHDataset<int>(file, "refine level", H5T_NATIVE_INT, dims);
+		box = readFLASHDataset<double>(file, "bounding box", H5T_NATIVE_DOUBLE, bdims);
+		const char *names[3] = {"magx", "magy", "magz"};
+		for (int d = 0; d < 3; d++)
+			mag[d] = readFLASHDataset<double>(file, names[d], H5T_NATIVE_DOUBLE, mdims);
+	} catch (...) {
+		H5Fclose(file);
+		throw;
+	}
+	H5Fclose(file);
+
+	const int C = AMRGrid3f::cells;
+	size_t nBlocks = levels.size();
+	if ((bdims.size() != 3) or (bdims[0] != nBlocks) or (bdims[1] != 3) or (bdims[2] != 2))
+		throw std::runtime_error("loadFLASHMagneticField: unexpected bounding box in " + filename);
+	if ((mdims.size() != 4) or (mdims[0] != nBlocks) or (mdims[1] != C) or (mdims[2] != C) or (mdims[3] != C))
+		throw std::runtime_error("loadFLASHMagneticField: only blocks of 8^3 cells are supported");
+
+	// the root blocks have refine level 1
+	Vector3d lo(std::numeric_limits<double>::max()), hi(-std::numeric_limits<double>::max()), size;
+	for (size_t b = 0; b < nBlocks; b++) {
+		if (levels[b] != 1)
+			continue;
+		for (int d = 0; d < 3; d++) {
+			lo.data[d] = std::min(lo.data[d], box[6 * b + 2 * d]);
+			hi.data[d] = std::max(hi.data[d], box[6 * b + 2 * d + 1]);
+			size.data[d] = box[6 * b + 2 * d + 1] - box[6 * b + 2 * d];
+		}
+	}
+	if (size.x <= 0)
+		throw std::runtime_error("loadFLASHMagneticField: no root blocks in " + filename);
+	ref_ptr<AMRGrid3f> grid = new AMRGrid3f(lo * lengthUnit, round((hi.x - lo.x) / size.x),
+			round((hi.y - lo.y) / size.y), round((hi.z - lo.z) / size.z), size * lengthUnit);
+
+	// coarse blocks first, so that the refined blocks overwrite the inherited values
+	std::vector<size_t> order(nBlocks);
+	for (size_t b = 0; b < nBlocks; b++)
+		order[b] = b;
+	std::stable_sort(order.begin(), order.end(), [&levels](size_t a, size_t b) {
+		return levels[a] < levels[b];
+	});
+
+	std::vector<Vector3f> v(C * C * C);
+	for (size_t k = 0; k < nBlocks; k++) {
+		size_t b = order[k];
+		int level = levels[b] - 1;
+		size_t index[3];
+		for (int d = 0; d < 3; d++)
+			index[d] = round((box[6 * b + 2 * d] - lo.data[d]) / size.data[d] * (1 << level));
+
+		// FLASH stores the cells of a block x fastest
+		for (int ix = 0; ix < C; ix++)
+			for (int iy = 0; iy < C; iy++)
+				for (int iz = 0; iz < C; iz++) {
+					size_t i = ((b * C + iz) * C + iy) * C + ix;
+					v[(ix * C + iy) * C + iz] = Vector3f(mag[0][i], mag[1][i], mag[2][i]) * fieldUnit;
+				}
+		grid->setBlock(level, index[0], index[1], index[2], &v[0]);
+	}
+	grid->fillGhostCells();
+	return grid;
+}
+#endif // CRPROPA_HAVE_HDF5
+
+} // namespace crpropa
@@ -0,0 +1,103 @@
+#include "crpropa/AliasTable.h"
+#include "crpropa/Random.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace crpropa {
+
+AliasTable::AliasTable() {
+}
+
+AliasTable::AliasTable(const std::vector<double> &weights) {
+	setWeights(weights);
+}
+
+void AliasTable::setWeights(const std::vector<double> &weights) {
+	size_t n = weights.size();
+	if (n == 0)
+		throw std::runtime_error("AliasTable: no bins");
+	if (n > std::numeric_limits<uint32_t>::max())
+		throw std::runtime_error("AliasTable: too many bins");
+
+	double total = 0;
+	for (size_t i = 0; i < n; i++)
+		total += std::max(weights[i], 0.);
+
+	probability.assign(n, 0);
+	alias.assign(n, 0);
+	if (total <= 0)
+		return; // degenerate distribution: always draw the first bin, as randBin
+
+	// Vose's method: pair each underfull bin with an overfull one
+	std::vector<double> scaled(n);
+	std::vector<uint32_t> small, large;
+	for (size_t i = 0; i < n; i++) {
+		scaled[i] = std::max(weights[i], 0.) * n / total;
+		if (scaled[i] < 1)
+			small.push_back(i);
+		else
+			large.push_back(i);
+	}
+	while (not small.empty() and not large.empty()) {
+		uint32_t s = small.back();
+		small.pop_back();
+		uint32_t l = large.back();
+		probability[s] = scaled[s];
+		alias[s] = l;
+		scaled[l] += scaled[s] - 1;
+		if (scaled[l] < 1) {
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+	// remaining bins are full up to rounding
+	size_t heaviest = std::max_element(weights.begin(), weights.end()) - weights.begin();
+	for (size_t k = 0; k < large.size(); k++) {
+		probability[large[k]] = 1;
+		alias[large[k]] = large[k];
+	}
+	for (size_t k = 0; k < small.size(); k++) {
+		uint32_t s = small[k];
+		probability[s] = (weights[s] > 0) ? 1 : 0;
+		alias[s] = (weights[s] > 0) ? s : heaviest;
+	}
+}
+
+void AliasTable::setCumulative(const std::vector<double> &cdf) {
+	std::vector<double> weights(cdf.size());
+	for (size_t i = 0; i < cdf.size(); i++)
+		weights[i] = (i == 0) ? cdf[0] : cdf[i] - cdf[i - 1];
+	setWeights(weights);
+}
+
+size_t AliasTable::sample(Random &random) const {
+	double x = random.randExc() * probability.size();
+	size_t i = x;
+	return (x - i < probability[i]) ? i : alias[i];
+}
+
+size_t AliasTable::size() const {
+	return probability.size();
+}
+
+size_t AliasTable::getMemoryUsage() const {
+	return probability.capacity() * sizeof(double) + alias.capacity() * sizeof(uint32_t);
+}
+
+std::vector<AliasTable> cumulativeAliasTables(const std::vector<std::vector<double> > &cdfs) {
+	std::vector<AliasTable> tables(cdfs.size());
+	for (size_t i = 0; i < cdfs.size(); i++)
+		tables[i].setCumulative(cdfs[i]);
+	return tables;
+}
+
+size_t memoryUsage(const std::vector<AliasTable> &tables) {
+	size_t bytes = tables.capacity() * sizeof(AliasTable);
+	for (size_t i = 0; i < tables.size(); i++)
+		bytes += tables[i].getMemoryUsage();
+	return bytes;
+}
+
+} // namespace crpropa
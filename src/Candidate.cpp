@@ -1,44 +1,183 @@
 #include "crpropa/Candidate.h"
 #include "crpropa/ParticleID.h"
+#include "crpropa/Random.h"
+#include "crpropa/RunMetrics.h"
+#include "crpropa/SecondaryAdmission.h"
 #include "crpropa/Units.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
 #include <stdexcept>
+#include <new>
+#include <functional>
 
 namespace crpropa {
 
+namespace {
+// Free list of released candidate memory, linked through the blocks
+// themselves. Plain thread-local PODs stay valid during thread exit.
+struct FreeBlock {
+	FreeBlock *next;
+};
+thread_local FreeBlock *freeBlocks = 0;
+thread_local size_t nFreeBlocks = 0;
+thread_local bool poolClosed = false;
+
+// allocation counters of a thread, only written by their thread and kept
+// after it ends, so that the other threads can sum them without locking
+struct PoolCounters {
+	std::atomic<int64_t> live; // allocated minus released by this thread
+	std::atomic<int64_t> peak;
+	std::atomic<size_t> pooled;
+	PoolCounters() : live(0), peak(0), pooled(0) {
+	}
+};
+
+struct PoolRegistry {
+	std::mutex mutex;
+	std::vector<PoolCounters *> counters;
+};
+
+PoolRegistry &poolRegistry() {
+	static PoolRegistry *r = new PoolRegistry(); // alive for candidates released at exit
+	return *r;
+}
+
+thread_local PoolCounters *poolCounters = 0;
+
+// serial numbers taken by a thread, discarded when setNextSerialNumber
+// starts a new epoch
+struct SerialNumberBlock {
+	uint64_t next, end, epoch;
+};
+thread_local SerialNumberBlock serialNumberBlock = {0, 0, 0};
+std::atomic<uint64_t> serialNumberEpoch(0);
+
+PoolCounters *getPoolCounters() {
+	if (!poolCounters) {
+		PoolRegistry &r = poolRegistry();
+		std::lock_guard<std::mutex> lock(r.mutex);
+		poolCounters = new PoolCounters();
+		r.counters.push_back(poolCounters);
+	}
+	return poolCounters;
+}
+
+struct PoolGuard {
+	~PoolGuard() {
+		while (freeBlocks) {
+			FreeBlock *b = freeBlocks;
+			freeBlocks = b->next;
+			::operator delete(b);
+		}
+		nFreeBlocks = 0;
+		poolClosed = true;
+		if (poolCounters)
+			poolCounters->pooled.store(0, std::memory_order_relaxed);
+	}
+};
+thread_local PoolGuard poolGuard;
+}
+
+size_t Candidate::poolCapacity = 4096;
+
+void *Candidate::operator new(size_t size) {
+	PoolCounters *counters = getPoolCounters();
+	int64_t live = counters->live.load(std::memory_order_relaxed) + 1;
+	counters->live.store(live, std::memory_order_relaxed);
+	if (live > counters->peak.load(std::memory_order_relaxed))
+		counters->peak.store(live, std::memory_order_relaxed);
+	if ((size == sizeof(Candidate)) && freeBlocks) {
+		FreeBlock *b = freeBlocks;
+		freeBlocks = b->next;
+		nFreeBlocks--;
+		counters->pooled.store(nFreeBlocks, std::memory_order_relaxed);
+		return b;
+	}
+	return ::operator new(size);
+}
+
+void Candidate::operator delete(void *ptr, size_t size) {
+	PoolCounters *counters = getPoolCounters();
+	counters->live.store(counters->live.load(std::memory_order_relaxed) - 1,
+			std::memory_order_relaxed);
+	if ((size != sizeof(Candidate)) || poolClosed
+			|| (nFreeBlocks >= poolCapacity)) {
+		::operator delete(ptr);
+		return;
+	}
+	(void) &poolGuard; // register the cleanup of this thread's pool
+	FreeBlock *b = static_cast<FreeBlock*>(ptr);
+	b->next = freeBlocks;
+	freeBlocks = b;
+	nFreeBlocks++;
+	counters->pooled.store(nFreeBlocks, std::memory_order_relaxed);
+}
+
+void Candidate::setPoolCapacity(size_t capacity) {
+	poolCapacity = capacity;
+}
+
+size_t Candidate::getPoolCapacity() {
+	return poolCapacity;
+}
+
+size_t Candidate::getLiveCount() {
+	PoolRegistry &r = poolRegistry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	int64_t live = 0;
+	for (size_t i = 0; i < r.counters.size(); i++)
+		live += r.counters[i]->live.load(std::memory_order_relaxed);
+	return live > 0 ? live : 0;
+}
+
+std::vector<size_t> Candidate::getPeakLiveCounts() {
+	PoolRegistry &r = poolRegistry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	std::vector<size_t> peaks(r.counters.size());
+	for (size_t i = 0; i < r.counters.size(); i++)
+		peaks[i] = std::max(r.counters[i]->peak.load(std::memory_order_relaxed), int64_t(0));
+	return peaks;
+}
+
+void Candidate::resetPeakLiveCounts() {
+	PoolRegistry &r = poolRegistry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	for (size_t i = 0; i < r.counters.size(); i++)
+		r.counters[i]->peak.store(r.counters[i]->live.load(std::memory_order_relaxed),
+				std::memory_order_relaxed);
+}
+
+size_t Candidate::getPooledCount() {
+	PoolRegistry &r = poolRegistry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	size_t pooled = 0;
+	for (size_t i = 0; i < r.counters.size(); i++)
+		pooled += r.counters[i]->pooled.load(std::memory_order_relaxed);
+	return pooled;
+}
+
 Candidate::Candidate(int id, double E, Vector3d pos, Vector3d dir, double z, double weight) :
-		redshift(z), trajectoryLength(0), weight(1), currentStep(0), nextStep(0), active(true), parent(0) {
+		redshift(z), trajectoryLength(0), weight(1), currentStep(0), nextStep(0), active(true), parent(0),
+		detached(false), sourceSerialNumber(0), createdSerialNumber(0),
+		randomStream(0), randomCounter(0), randomStart(0), createdSecondaries(0),
+		kinematicsId(0), kinematicsEnergy(-1), kinematicsRedshift(0) {
 	ParticleState state(id, E, pos, dir);
 	source = state;
 	created = state;
 	previous = state;
 	current = state;
-
-#if defined(OPENMP_3_1)
-		#pragma omp atomic capture
-		{serialNumber = nextSerialNumber++;}
-#elif defined(__GNUC__)
-		{serialNumber = __sync_add_and_fetch(&nextSerialNumber, 1);}
-#else
-		#pragma omp critical
-		{serialNumber = nextSerialNumber++;}
-#endif
-
+	serialNumber = newSerialNumber();
 }
 
 Candidate::Candidate(const ParticleState &state) :
-		source(state), created(state), current(state), previous(state), redshift(0), trajectoryLength(0), currentStep(0), nextStep(0), active(true), parent(0) {
-
-#if defined(OPENMP_3_1)
-		#pragma omp atomic capture
-		{serialNumber = nextSerialNumber++;}
-#elif defined(__GNUC__)
-		{serialNumber = __sync_add_and_fetch(&nextSerialNumber, 1);}
-#else
-		#pragma omp critical
-		{serialNumber = nextSerialNumber++;}
-#endif
-
+		source(state), created(state), current(state), previous(state), redshift(0), trajectoryLength(0), currentStep(0), nextStep(0), active(true), parent(0),
+		detached(false), sourceSerialNumber(0), createdSerialNumber(0),
+		randomStream(0), randomCounter(0), randomStart(0), createdSecondaries(0),
+		kinematicsId(0), kinematicsEnergy(-1), kinematicsRedshift(0) {
+	serialNumber = newSerialNumber();
 }
 
 bool Candidate::isActive() const {
@@ -53,6 +192,26 @@ double Candidate::getRedshift() const {
 	return redshift;
 }
 
+void Candidate::updateKinematics() const {
+	kinematicsId = current.getId();
+	kinematicsEnergy = current.getEnergy();
+	kinematicsRedshift = redshift;
+	kinematics.lorentzFactor = current.getLorentzFactor();
+	kinematics.redshiftFactor = 1 + redshift;
+	kinematics.localLorentzFactor = kinematics.lorentzFactor * kinematics.redshiftFactor;
+	kinematics.lgLocalLorentzFactor = log10(kinematics.localLorentzFactor);
+	kinematics.rigidity = current.getRigidity();
+}
+
+bool Candidate::Kinematics::locate(double lgMin, double lgMax, size_t n, size_t &i, double &fraction) const {
+	if ((lgLocalLorentzFactor <= lgMin) or (lgLocalLorentzFactor >= lgMax))
+		return false;
+	double p = (lgLocalLorentzFactor - lgMin) / (lgMax - lgMin) * (n - 1);
+	i = std::min(size_t(p), n - 2);
+	fraction = p - i;
+	return true;
+}
+
 double Candidate::getTrajectoryLength() const {
 	return trajectoryLength;
 }
@@ -94,38 +253,164 @@ void Candidate::limitNextStep(double step) {
 	nextStep = std::min(nextStep, step);
 }
 
+namespace {
+// Registry of interned property names. Names are only appended, so readers
+// access the published entries without locking: the names by key in an array
+// and the keys by name in an open-addressing hash table whose slots, once
+// set, never change. Only the insertion of a new name takes a lock.
+const size_t maxPropertyKeys = 4096;
+const size_t propertySlots = 2 * maxPropertyKeys; // power of two
+const std::string *propertyNames[maxPropertyKeys];
+std::atomic<size_t> nPropertyNames(0);
+std::atomic<size_t> propertySlot[propertySlots]; // key + 1, 0 if empty
+
+// function static, as keys are also requested during static initialization
+std::mutex &propertyKeyMutex() {
+	static std::mutex mutex;
+	return mutex;
+}
+
+// probe for the name; returns its slot, or the empty slot it would take
+size_t findPropertySlot(const std::string &name, size_t &entry) {
+	size_t i = std::hash<std::string>()(name) & (propertySlots - 1);
+	while (true) {
+		entry = propertySlot[i].load(std::memory_order_acquire);
+		if (entry == 0 || *propertyNames[entry - 1] == name)
+			return i;
+		i = (i + 1) & (propertySlots - 1);
+	}
+}
+}
+
+bool Candidate::findPropertyKey(const std::string &name, PropertyKey &key) {
+	size_t entry;
+	findPropertySlot(name, entry);
+	if (entry == 0)
+		return false;
+	key = entry - 1;
+	return true;
+}
+
+Candidate::PropertyKey Candidate::getPropertyKey(const std::string &name) {
+	PropertyKey key;
+	if (findPropertyKey(name, key))
+		return key;
+
+	std::lock_guard<std::mutex> lock(propertyKeyMutex());
+	size_t entry;
+	size_t slot = findPropertySlot(name, entry); // again, under the lock
+	if (entry != 0)
+		return entry - 1;
+
+	size_t n = nPropertyNames.load(std::memory_order_relaxed);
+	if (n >= maxPropertyKeys)
+		throw std::runtime_error("Candidate: too many property names");
+	propertyNames[n] = new std::string(name);
+	nPropertyNames.store(n + 1, std::memory_order_release);
+	propertySlot[slot].store(n + 1, std::memory_order_release);
+	return n;
+}
+
+const std::string &Candidate::getPropertyName(PropertyKey key) {
+	if (key >= nPropertyNames.load(std::memory_order_acquire))
+		throw std::runtime_error("Candidate: unknown property key");
+	return *propertyNames[key];
+}
+
+Candidate::PropertyMap &Candidate::modifyProperties() {
+	if (properties.valid() && properties->getReferenceCount() == 1)
+		return properties->values;
+	// first modification after clone: copy the shared map
+	ref_ptr<SharedProperties> copy = new SharedProperties;
+	if (properties.valid())
+		copy->values = properties->values;
+	properties = copy;
+	return properties->values;
+}
+
+const Candidate::PropertyMap &Candidate::getProperties() const {
+	static const PropertyMap empty;
+	if (properties.valid())
+		return properties->values;
+	return empty;
+}
+
 void Candidate::setProperty(const std::string &name, const Variant &value) {
-	properties[name] = value;
+	setProperty(getPropertyKey(name), value);
 }
 
 const Variant &Candidate::getProperty(const std::string &name) const {
-	PropertyMap::const_iterator i = properties.find(name);
-	if (i == properties.end())
+	PropertyKey key;
+	if (!findPropertyKey(name, key) || !hasProperty(key))
 		throw std::runtime_error("Unknown candidate property: " + name);
-	return i->second;
+	return getProperties().find(key)->second;
 }
 
 bool Candidate::removeProperty(const std::string& name) {
-	PropertyMap::iterator i = properties.find(name);
-	if (i == properties.end())
+	PropertyKey key;
+	if (!findPropertyKey(name, key))
 		return false;
-	properties.erase(i);
-	return true;
+	return removeProperty(key);
 }
 
 bool Candidate::hasProperty(const std::string &name) const {
-	PropertyMap::const_iterator i = properties.find(name);
-	if (i == properties.end())
+	PropertyKey key;
+	if (!findPropertyKey(name, key))
+		return false;
+	return hasProperty(key);
+}
+
+void Candidate::setProperty(PropertyKey key, const Variant &value) {
+	modifyProperties()[key] = value;
+}
+
+const Variant *Candidate::findProperty(PropertyKey key) const {
+	const PropertyMap &map = getProperties();
+	PropertyMap::const_iterator i = map.find(key);
+	return (i == map.end()) ? NULL : &i->second;
+}
+
+const Variant &Candidate::getProperty(PropertyKey key) const {
+	const PropertyMap &map = getProperties();
+	PropertyMap::const_iterator i = map.find(key);
+	if (i == map.end())
+		throw std::runtime_error("Unknown candidate property: " + getPropertyName(key));
+	return i->second;
+}
+
+bool Candidate::removeProperty(PropertyKey key) {
+	if (!hasProperty(key))
 		return false;
+	PropertyMap &map = modifyProperties();
+	map.erase(map.find(key));
 	return true;
 }
 
+bool Candidate::hasProperty(PropertyKey key) const {
+	const PropertyMap &map = getProperties();
+	return map.find(key) != map.end();
+}
+
 void Candidate::addSecondary(Candidate *c) {
+	if (c->randomStream == 0)
+		c->setRandomStream(Random::deriveStreamKey(randomStream, createdSecondaries));
+	createdSecondaries++;
 	secondaries.push_back(c);
+	RunMetrics::countSecondary();
 }
 
 void Candidate::addSecondary(int id, double energy, double weight) {
-	ref_ptr<Candidate> secondary = new Candidate;
+	weight *= this->weight;
+	const SecondaryAdmission *admission = SecondaryAdmission::current();
+	if (admission and not admission->admit(id, energy, weight)) {
+		admission->reject(this, id, energy, weight);
+		createdSecondaries++; // keep the streams of the following secondaries
+		return;
+	}
+
+	// constructed in place to save the reference updates of a temporary
+	secondaries.emplace_back(new Candidate);
+	Candidate *secondary = secondaries.back();
 	secondary->setRedshift(redshift);
 	secondary->setTrajectoryLength(trajectoryLength);
 	secondary->setWeight(weight);
@@ -136,11 +421,21 @@ void Candidate::addSecondary(int id, double energy, double weight) {
 	secondary->current.setId(id);
 	secondary->current.setEnergy(energy);
 	secondary->parent = this;
-	secondaries.push_back(secondary);
+	secondary->randomStream = Random::deriveStreamKey(randomStream, createdSecondaries++);
+	RunMetrics::countSecondary();
 }
 
 void Candidate::addSecondary(int id, double energy, Vector3d position, double weight) {
-	ref_ptr<Candidate> secondary = new Candidate;
+	weight *= this->weight;
+	const SecondaryAdmission *admission = SecondaryAdmission::current();
+	if (admission and not admission->admit(id, energy, weight)) {
+		admission->reject(this, id, energy, position, weight);
+		createdSecondaries++; // keep the streams of the following secondaries
+		return;
+	}
+
+	secondaries.emplace_back(new Candidate);
+	Candidate *secondary = secondaries.back();
 	secondary->setRedshift(redshift);
 	secondary->setTrajectoryLength(trajectoryLength - (current.getPosition() - position).getR() );
 	secondary->setWeight(weight);
@@ -153,13 +448,18 @@ void Candidate::addSecondary(int id, double energy, Vector3d position, double we
 	secondary->current.setPosition(position);
 	secondary->created.setPosition(position);
 	secondary->parent = this;
-	secondaries.push_back(secondary);
+	secondary->randomStream = Random::deriveStreamKey(randomStream, createdSecondaries++);
+	RunMetrics::countSecondary();
 }
 
 void Candidate::clearSecondaries() {
 	secondaries.clear();
 }
 
+uint64_t Candidate::getNumberOfCreatedSecondaries() const {
+	return createdSecondaries;
+}
+
 std::string Candidate::getDescription() const {
 	std::stringstream ss;
 	ss << "CosmicRay at z = " << getRedshift() << "\n";
@@ -175,13 +475,20 @@ ref_ptr<Candidate> Candidate::clone(bool recursive) const {
 	cloned->current = current;
 	cloned->previous = previous;
 
-	cloned->properties = properties;
+	cloned->properties = properties; // shared until modified
 	cloned->active = active;
 	cloned->redshift = redshift;
 	cloned->weight = weight;
 	cloned->trajectoryLength = trajectoryLength;
 	cloned->currentStep = currentStep;
 	cloned->nextStep = nextStep;
+	cloned->detached = detached;
+	cloned->sourceSerialNumber = sourceSerialNumber;
+	cloned->createdSerialNumber = createdSerialNumber;
+	cloned->randomStream = randomStream;
+	cloned->randomCounter = randomCounter;
+	cloned->randomStart = randomStart;
+	cloned->createdSecondaries = createdSecondaries;
 	if (recursive) {
 		cloned->secondaries.reserve(secondaries.size());
 		for (size_t i = 0; i < secondaries.size(); i++) {
@@ -193,6 +500,172 @@ ref_ptr<Candidate> Candidate::clone(bool recursive) const {
 	return cloned;
 }
 
+namespace {
+template<typename T>
+void writeValue(std::vector<char> &buffer, const T &value) {
+	const char *p = reinterpret_cast<const char*>(&value);
+	buffer.insert(buffer.end(), p, p + sizeof(T));
+}
+
+template<typename T>
+T readValue(const std::vector<char> &buffer, size_t &offset) {
+	if (offset + sizeof(T) > buffer.size())
+		throw std::runtime_error("Candidate::deserialize: buffer too short");
+	T value;
+	memcpy(&value, &buffer[offset], sizeof(T));
+	offset += sizeof(T);
+	return value;
+}
+
+void writeString(std::vector<char> &buffer, const std::string &s) {
+	writeValue<uint32_t>(buffer, s.size());
+	buffer.insert(buffer.end(), s.begin(), s.end());
+}
+
+std::string readString(const std::vector<char> &buffer, size_t &offset) {
+	uint32_t n = readValue<uint32_t>(buffer, offset);
+	if (offset + n > buffer.size())
+		throw std::runtime_error("Candidate::deserialize: buffer too short");
+	std::string s(buffer.begin() + offset, buffer.begin() + offset + n);
+	offset += n;
+	return s;
+}
+
+void writeState(std::vector<char> &buffer, const ParticleState &state) {
+	writeValue<int32_t>(buffer, state.getId());
+	writeValue(buffer, state.getEnergy());
+	writeValue(buffer, state.getPosition());
+	writeValue(buffer, state.getDirection());
+}
+
+ParticleState readState(const std::vector<char> &buffer, size_t &offset) {
+	int id = readValue<int32_t>(buffer, offset);
+	double energy = readValue<double>(buffer, offset);
+	Vector3d position = readValue<Vector3d>(buffer, offset);
+	Vector3d direction = readValue<Vector3d>(buffer, offset);
+	return ParticleState(id, energy, position, direction);
+}
+
+// properties as name, type and value; the keys are interned per process
+void writeVariant(std::vector<char> &buffer, const Variant &v) {
+	writeValue<int32_t>(buffer, v.getType());
+	if (v.getType() == Variant::TYPE_STRING) {
+		writeString(buffer, v.toString());
+		return;
+	}
+	char value[sizeof(double)];
+	size_t n = v.copyToBuffer(value);
+	buffer.insert(buffer.end(), value, value + n);
+}
+
+Variant readVariant(const std::vector<char> &buffer, size_t &offset) {
+	Variant::Type type = Variant::Type(readValue<int32_t>(buffer, offset));
+	switch (type) {
+	case Variant::TYPE_NONE:
+		return Variant();
+	case Variant::TYPE_BOOL:
+		return Variant(readValue<bool>(buffer, offset));
+	case Variant::TYPE_CHAR:
+		return Variant(readValue<char>(buffer, offset));
+	case Variant::TYPE_UCHAR:
+		return Variant(readValue<unsigned char>(buffer, offset));
+	case Variant::TYPE_INT16:
+		return Variant(readValue<int16_t>(buffer, offset));
+	case Variant::TYPE_UINT16:
+		return Variant(readValue<uint16_t>(buffer, offset));
+	case Variant::TYPE_INT32:
+		return Variant(readValue<int32_t>(buffer, offset));
+	case Variant::TYPE_UINT32:
+		return Variant(readValue<uint32_t>(buffer, offset));
+	case Variant::TYPE_INT64:
+		return Variant(readValue<int64_t>(buffer, offset));
+	case Variant::TYPE_UINT64:
+		return Variant(readValue<uint64_t>(buffer, offset));
+	case Variant::TYPE_FLOAT:
+		return Variant(readValue<float>(buffer, offset));
+	case Variant::TYPE_DOUBLE:
+		return Variant(readValue<double>(buffer, offset));
+	case Variant::TYPE_STRING:
+		return Variant(readString(buffer, offset));
+	}
+	throw std::runtime_error("Candidate::deserialize: unknown property type");
+}
+} // namespace
+
+void Candidate::serialize(std::vector<char> &buffer) const {
+	writeState(buffer, source);
+	writeState(buffer, created);
+	writeState(buffer, current);
+	writeState(buffer, previous);
+	writeValue<uint8_t>(buffer, active);
+	writeValue(buffer, weight);
+	writeValue(buffer, redshift);
+	writeValue(buffer, trajectoryLength);
+	writeValue(buffer, currentStep);
+	writeValue(buffer, nextStep);
+	writeValue(buffer, serialNumber);
+	writeValue(buffer, getSourceSerialNumber());
+	writeValue(buffer, getCreatedSerialNumber());
+	writeValue(buffer, randomStream);
+	writeValue(buffer, randomCounter);
+	writeValue(buffer, randomStart);
+	writeValue(buffer, createdSecondaries);
+
+	const PropertyMap &p = getProperties();
+	writeValue<uint32_t>(buffer, p.size());
+	for (PropertyMap::const_iterator i = p.begin(); i != p.end(); ++i) {
+		writeString(buffer, getPropertyName(i->first));
+		writeVariant(buffer, i->second);
+	}
+}
+
+ref_ptr<Candidate> Candidate::deserialize(const std::vector<char> &buffer, size_t &offset) {
+	ref_ptr<Candidate> c = new Candidate;
+	c->source = readState(buffer, offset);
+	c->created = readState(buffer, offset);
+	c->current = readState(buffer, offset);
+	c->previous = readState(buffer, offset);
+	c->active = readValue<uint8_t>(buffer, offset);
+	c->weight = readValue<double>(buffer, offset);
+	c->redshift = readValue<double>(buffer, offset);
+	c->trajectoryLength = readValue<double>(buffer, offset);
+	c->currentStep = readValue<double>(buffer, offset);
+	c->nextStep = readValue<double>(buffer, offset);
+	c->serialNumber = readValue<uint64_t>(buffer, offset);
+	c->sourceSerialNumber = readValue<uint64_t>(buffer, offset);
+	c->createdSerialNumber = readValue<uint64_t>(buffer, offset);
+	c->detached = true;
+	c->randomStream = readValue<uint64_t>(buffer, offset);
+	c->randomCounter = readValue<uint64_t>(buffer, offset);
+	c->randomStart = readValue<uint64_t>(buffer, offset);
+	c->createdSecondaries = readValue<uint64_t>(buffer, offset);
+
+	uint32_t nProperties = readValue<uint32_t>(buffer, offset);
+	for (uint32_t i = 0; i < nProperties; i++) {
+		std::string name = readString(buffer, offset);
+		c->setProperty(name, readVariant(buffer, offset));
+	}
+	return c;
+}
+
+void Candidate::setRandomStream(uint64_t key, uint64_t counter) {
+	randomStream = key;
+	randomCounter = counter;
+	randomStart = counter;
+}
+
+uint64_t Candidate::getRandomStream() const {
+	return randomStream;
+}
+
+void Candidate::setRandomCounter(uint64_t counter) {
+	randomCounter = counter;
+}
+
+uint64_t Candidate::getRandomCounter() const {
+	return randomCounter;
+}
+
 uint64_t Candidate::getSerialNumber() const {
 	return serialNumber;
 }
@@ -204,6 +677,8 @@ void Candidate::setSerialNumber(const uint64_t snr) {
 uint64_t Candidate::getSourceSerialNumber() const {
 	if (parent)
 		return parent->getSourceSerialNumber();
+	else if (detached)
+		return sourceSerialNumber;
 	else
 		return serialNumber;
 }
@@ -211,12 +686,24 @@ uint64_t Candidate::getSourceSerialNumber() const {
 uint64_t Candidate::getCreatedSerialNumber() const {
 	if (parent)
 		return parent->getSerialNumber();
+	else if (detached)
+		return createdSerialNumber;
 	else
 		return serialNumber;
 }
 
+void Candidate::detachFromParent() {
+	if (!parent)
+		return;
+	sourceSerialNumber = getSourceSerialNumber();
+	createdSerialNumber = getCreatedSerialNumber();
+	detached = true;
+	parent = 0;
+}
+
 void Candidate::setNextSerialNumber(uint64_t snr) {
 	nextSerialNumber = snr;
+	serialNumberEpoch.fetch_add(1);
 }
 
 uint64_t Candidate::getNextSerialNumber() {
@@ -225,11 +712,36 @@ uint64_t Candidate::getNextSerialNumber() {
 
 uint64_t Candidate::nextSerialNumber = 0;
 
+uint64_t Candidate::newSerialNumber() {
+	SerialNumberBlock &block = serialNumberBlock;
+	uint64_t epoch = serialNumberEpoch.load(std::memory_order_relaxed);
+	if ((block.next == block.end) or (block.epoch != epoch)) {
+		uint64_t first;
+#if defined(OPENMP_3_1)
+		#pragma omp atomic capture
+		{first = nextSerialNumber; nextSerialNumber += serialNumberBlockSize;}
+#elif defined(__GNUC__)
+		{first = __sync_fetch_and_add(&nextSerialNumber, serialNumberBlockSize);}
+#else
+		#pragma omp critical
+		{first = nextSerialNumber; nextSerialNumber += serialNumberBlockSize;}
+#endif
+		block.next = first + 1;
+		block.end = first + 1 + serialNumberBlockSize;
+		block.epoch = epoch;
+	}
+	return block.next++;
+}
+
 void Candidate::restart() {
 	setActive(true);
 	setTrajectoryLength(0);
 	previous = source;
 	current = source;
+	currentStep = 0;
+	nextStep = 0;
+	randomCounter = randomStart;
+	createdSecondaries = 0;
 }
 
 } // namespace crpropa
@@ -0,0 +1,107 @@
+#include "crpropa/CandidateSnapshot.h"
+
+#include <stdexcept>
+
+namespace crpropa {
+
+CandidateSnapshot::CandidateSnapshot() :
+		weight(1), redshift(0), trajectoryLength(0), serialNumber(0),
+		sourceSerialNumber(0), createdSerialNumber(0) {
+}
+
+CandidateSnapshot::CandidateSnapshot(const Candidate *candidate,
+		const std::vector<Candidate::PropertyKey> &keys) :
+		source(candidate->source), created(candidate->created),
+		current(candidate->current), previous(candidate->previous),
+		weight(candidate->getWeight()), redshift(candidate->getRedshift()),
+		trajectoryLength(candidate->getTrajectoryLength()),
+		serialNumber(candidate->getSerialNumber()),
+		sourceSerialNumber(candidate->getSourceSerialNumber()),
+		createdSerialNumber(candidate->getCreatedSerialNumber()) {
+	for (size_t i = 0; i < keys.size(); i++)
+		if (candidate->hasProperty(keys[i]))
+			properties[keys[i]] = candidate->getProperty(keys[i]);
+}
+
+const ParticleState &CandidateSnapshot::getSource() const {
+	return source;
+}
+
+const ParticleState &CandidateSnapshot::getCreated() const {
+	return created;
+}
+
+const ParticleState &CandidateSnapshot::getCurrent() const {
+	return current;
+}
+
+const ParticleState &CandidateSnapshot::getPrevious() const {
+	return previous;
+}
+
+double CandidateSnapshot::getWeight() const {
+	return weight;
+}
+
+double CandidateSnapshot::getRedshift() const {
+	return redshift;
+}
+
+double CandidateSnapshot::getTrajectoryLength() const {
+	return trajectoryLength;
+}
+
+uint64_t CandidateSnapshot::getSerialNumber() const {
+	return serialNumber;
+}
+
+uint64_t CandidateSnapshot::getSourceSerialNumber() const {
+	return sourceSerialNumber;
+}
+
+uint64_t CandidateSnapshot::getCreatedSerialNumber() const {
+	return createdSerialNumber;
+}
+
+bool CandidateSnapshot::hasProperty(const std::string &name) const {
+	Candidate::PropertyKey key;
+	if (!Candidate::findPropertyKey(name, key))
+		return false;
+	return properties.find(key) != properties.end();
+}
+
+const Variant &CandidateSnapshot::getProperty(const std::string &name) const {
+	Candidate::PropertyKey key;
+	if (!Candidate::findPropertyKey(name, key))
+		throw std::runtime_error("Unknown snapshot property: " + name);
+	Candidate::PropertyMap::const_iterator i = properties.find(key);
+	if (i == properties.end())
+		throw std::runtime_error("Unknown snapshot property: " + name);
+	return i->second;
+}
+
+const Candidate::PropertyMap &CandidateSnapshot::getProperties() const {
+	return properties;
+}
+
+ref_ptr<Candidate> CandidateSnapshot::toCandidate() const {
+	ref_ptr<Candidate> candidate = new Candidate;
+	candidate->source = source;
+	candidate->created = created;
+	candidate->current = current;
+	candidate->previous = previous;
+	candidate->setWeight(weight);
+	candidate->setRedshift(redshift);
+	candidate->setTrajectoryLength(trajectoryLength);
+	candidate->setActive(false);
+	for (Candidate::PropertyMap::const_iterator i = properties.begin();
+			i != properties.end(); ++i)
+		candidate->setProperty(i->first, i->second);
+	candidate->serialNumber = serialNumber;
+	candidate->sourceSerialNumber = sourceSerialNumber;
+	candidate->createdSerialNumber = createdSerialNumber;
+	candidate->detached = true;
+	return candidate;
+}
+
+} // namespace crpropa
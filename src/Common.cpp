@@ -13,18 +13,22 @@
 
 namespace crpropa {
 
-std::string getDataPath(std::string filename) {
-	static std::string dataPath;
-	if (dataPath.size())
-		return concat_path(dataPath, filename);
+static std::vector<std::string> &dataSearchPaths() {
+	static std::vector<std::string> paths;
+	return paths;
+}
+
+void addDataSearchPath(std::string path) {
+	dataSearchPaths().push_back(path);
+}
 
+static std::string findDataPath() {
 	const char *env_path = getenv("CRPROPA_DATA_PATH");
 	if (env_path) {
 		if (is_directory(env_path)) {
-			dataPath = env_path;
 			KISS_LOG_INFO << "getDataPath: use environment variable, "
-					<< dataPath << std::endl;
-			return concat_path(dataPath, filename);
+					<< env_path << std::endl;
+			return env_path;
 		}
 	}
 
@@ -32,10 +36,9 @@ std::string getDataPath(std::string filename) {
 	{
 		std::string _path = CRPROPA_INSTALL_PREFIX "/share/crpropa";
 		if (is_directory(_path)) {
-			dataPath = _path;
 			KISS_LOG_INFO
-			<< "getDataPath: use install prefix, " << dataPath << std::endl;
-			return concat_path(dataPath, filename);
+			<< "getDataPath: use install prefix, " << _path << std::endl;
+			return _path;
 		}
 	}
 #endif
@@ -43,15 +46,27 @@ std::string getDataPath(std::string filename) {
 	{
 		std::string _path = executable_path() + "../data";
 		if (is_directory(_path)) {
-			dataPath = _path;
-			KISS_LOG_INFO << "getDataPath: use executable path, " << dataPath
+			KISS_LOG_INFO << "getDataPath: use executable path, " << _path
 					<< std::endl;
-			return concat_path(dataPath, filename);
+			return _path;
 		}
 	}
 
-	dataPath = "data";
-	KISS_LOG_INFO << "getDataPath: use default, " << dataPath << std::endl;
+	KISS_LOG_INFO << "getDataPath: use default, data" << std::endl;
+	return "data";
+}
+
+std::string getDataPath(std::string filename) {
+	// the latest added search path takes precedence
+	const std::vector<std::string> &paths = dataSearchPaths();
+	for (size_t i = paths.size(); (i > 0) and filename.size(); i--) {
+		std::string path = concat_path(paths[i - 1], filename);
+		if (std::ifstream(path.c_str()).good())
+			return path;
+	}
+
+	// initialized once, also when called by concurrently prepared modules
+	static const std::string dataPath = findDataPath();
 	return concat_path(dataPath, filename);
 }
 
@@ -121,6 +136,121 @@ double interpolateEquidistant(double x, double lo, double hi,
 	return Y[i] + (p - i) * (Y[i + 1] - Y[i]);
 }
 
+MathAccuracy g_mathAccuracy = IEEEMath;
+
+void setMathAccuracy(MathAccuracy accuracy) {
+	g_mathAccuracy = accuracy;
+}
+
+MathAccuracy getMathAccuracy() {
+	return g_mathAccuracy;
+}
+
+// kernel(x[i]) in vectorized blocks, the arguments outside of the range of
+// the kernel by the standard library afterwards; x and y may be the same
+template<typename Kernel, typename InRange, typename Fallback>
+static void mathBatch(size_t n, const double *x, double *y, Kernel kernel,
+		InRange inRange, Fallback fallback) {
+	const size_t block = 64;
+	double result[block];
+	for (size_t i0 = 0; i0 < n; i0 += block) {
+		size_t m = std::min(block, n - i0);
+#pragma omp simd
+		for (size_t j = 0; j < m; j++)
+			result[j] = kernel(x[i0 + j]);
+		for (size_t j = 0; j < m; j++)
+			y[i0 + j] = inRange(x[i0 + j]) ? result[j] : fallback(x[i0 + j]);
+	}
+}
+
+static const double minNormal = 2.2250738585072014e-308;
+static const double maxNormal = 1.7976931348623157e308;
+
+static bool isPositiveNormal(double x) {
+	return (x >= minNormal) and (x <= maxNormal);
+}
+
+static double clampNormal(double x) {
+	return std::min(std::max(x, minNormal), maxNormal);
+}
+
+void mathExp(size_t n, const double *x, double *y) {
+	if (g_mathAccuracy != FastMath) {
+		for (size_t i = 0; i < n; i++)
+			y[i] = std::exp(x[i]);
+		return;
+	}
+	mathBatch(n, x, y,
+			[](double v) { return fastExpKernel(std::min(std::max(v, -708.), 708.)); },
+			[](double v) { return std::fabs(v) <= 708; },
+			[](double v) { return std::exp(v); });
+}
+
+void mathLog(size_t n, const double *x, double *y) {
+	if (g_mathAccuracy != FastMath) {
+		for (size_t i = 0; i < n; i++)
+			y[i] = std::log(x[i]);
+		return;
+	}
+	mathBatch(n, x, y,
+			[](double v) { return fastLogKernel(clampNormal(v)); },
+			isPositiveNormal,
+			[](double v) { return std::log(v); });
+}
+
+void mathLog10(size_t n, const double *x, double *y) {
+	if (g_mathAccuracy != FastMath) {
+		for (size_t i = 0; i < n; i++)
+			y[i] = std::log10(x[i]);
+		return;
+	}
+	mathBatch(n, x, y,
+			[](double v) { return fastLogKernel(clampNormal(v)) * 0.43429448190325182765; },
+			isPositiveNormal,
+			[](double v) { return std::log10(v); });
+}
+
+void mathExp10(size_t n, const double *x, double *y) {
+	if (g_mathAccuracy != FastMath) {
+		for (size_t i = 0; i < n; i++)
+			y[i] = std::pow(10., x[i]);
+		return;
+	}
+	const double ln10 = 2.30258509299404568402;
+	mathBatch(n, x, y,
+			[ln10](double v) { return fastExpKernel(std::min(std::max(v * ln10, -708.), 708.)); },
+			[ln10](double v) { return std::fabs(v * ln10) <= 708; },
+			[](double v) { return std::pow(10., v); });
+}
+
+void mathPow(size_t n, const double *x, double exponent, double *y) {
+	if (g_mathAccuracy != FastMath) {
+		for (size_t i = 0; i < n; i++)
+			y[i] = std::pow(x[i], exponent);
+		return;
+	}
+	const size_t block = 64;
+	double e[block], result[block];
+	for (size_t i0 = 0; i0 < n; i0 += block) {
+		size_t m = std::min(block, n - i0);
+#pragma omp simd
+		for (size_t j = 0; j < m; j++) {
+			e[j] = exponent * fastLogKernel(clampNormal(x[i0 + j]));
+			result[j] = fastExpKernel(std::min(std::max(e[j], -708.), 708.));
+		}
+		for (size_t j = 0; j < m; j++)
+			if (not (isPositiveNormal(x[i0 + j]) and (std::fabs(e[j]) <= 708)))
+				result[j] = std::pow(x[i0 + j], exponent);
+		std::copy(result, result + m, y + i0);
+	}
+}
+
+void mathSqrt(size_t n, const double *x, double *y) {
+#pragma omp simd
+	for (size_t i = 0; i < n; i++)
+		y[i] = std::sqrt(x[i]);
+}
+
 size_t closestIndex(double x, const std::vector<double> &X) {
 	size_t i1 = std::lower_bound(X.begin(), X.end(), x) - X.begin();
 	if (i1 == 0)
@@ -0,0 +1,234 @@
+#include "crpropa/Convergence.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+namespace crpropa {
+
+double ConvergenceObservable::getRelativeUncertainty() const {
+	double value = getValue();
+	if (value == 0)
+		return std::numeric_limits<double>::infinity();
+	return getUncertainty() / std::fabs(value);
+}
+
+// HistogramBinObservable -----------------------------------------------------
+HistogramBinObservable::HistogramBinObservable(HistogramOutput *output, size_t histogram, size_t bin) :
+		output(output), histogram(histogram), bins(1, bin) {
+	if (bin >= output->getNumberOfBins(histogram))
+		throw std::runtime_error("HistogramBinObservable: bin out of range");
+}
+
+HistogramBinObservable::HistogramBinObservable(HistogramOutput *output, size_t histogram,
+		const std::vector<size_t> &bins) :
+		output(output), histogram(histogram), bins(bins) {
+	if (bins.empty())
+		throw std::runtime_error("HistogramBinObservable: no bins");
+	for (size_t i = 0; i < bins.size(); i++)
+		if (bins[i] >= output->getNumberOfBins(histogram))
+			throw std::runtime_error("HistogramBinObservable: bin out of range");
+}
+
+double HistogramBinObservable::getValue() const {
+	std::vector<double> weights = output->getWeights(histogram);
+	double value = 0;
+	for (size_t i = 0; i < bins.size(); i++)
+		value += weights[bins[i]];
+	return value;
+}
+
+double HistogramBinObservable::getUncertainty() const {
+	std::vector<double> squaredWeights = output->getSquaredWeights(histogram);
+	double variance = 0;
+	for (size_t i = 0; i < bins.size(); i++)
+		variance += squaredWeights[bins[i]];
+	return std::sqrt(variance);
+}
+
+std::string HistogramBinObservable::getDescription() const {
+	std::stringstream ss;
+	ss << "HistogramBinObservable: histogram " << histogram << ", bin";
+	if (bins.size() > 1)
+		ss << "s";
+	for (size_t i = 0; i < bins.size(); i++)
+		ss << " " << bins[i];
+	return ss.str();
+}
+
+// DetectionCounter -----------------------------------------------------------
+static void atomicAdd(std::atomic<double> &sum, double value) {
+	double current = sum.load(std::memory_order_relaxed);
+	while (not sum.compare_exchange_weak(current, current + value, std::memory_order_relaxed))
+		;
+}
+
+DetectionCounter::DetectionCounter(Module *action) :
+		action(action), count(0), weights(0), squaredWeights(0) {
+}
+
+void DetectionCounter::process(Candidate *candidate) const {
+	double w = candidate->getWeight();
+	count.fetch_add(1, std::memory_order_relaxed);
+	atomicAdd(weights, w);
+	atomicAdd(squaredWeights, w * w);
+	if (action.valid())
+		action->process(candidate);
+}
+
+uint64_t DetectionCounter::getCount() const {
+	return count;
+}
+
+double DetectionCounter::getWeight() const {
+	return weights;
+}
+
+double DetectionCounter::getSquaredWeight() const {
+	return squaredWeights;
+}
+
+void DetectionCounter::reset() {
+	count = 0;
+	weights = 0;
+	squaredWeights = 0;
+}
+
+std::string DetectionCounter::getDescription() const {
+	std::stringstream ss;
+	ss << "DetectionCounter";
+	if (action.valid())
+		ss << ", passing the candidates on to: " << action->getDescription();
+	return ss.str();
+}
+
+// DetectionCountObservable ---------------------------------------------------
+DetectionCountObservable::DetectionCountObservable(DetectionCounter *counter) :
+		counter(counter) {
+}
+
+double DetectionCountObservable::getValue() const {
+	return counter->getWeight();
+}
+
+double DetectionCountObservable::getUncertainty() const {
+	return std::sqrt(counter->getSquaredWeight());
+}
+
+std::string DetectionCountObservable::getDescription() const {
+	return "DetectionCountObservable: detected candidates";
+}
+
+// ConvergenceCriterion -------------------------------------------------------
+ConvergenceCriterion::ConvergenceCriterion(size_t maxPrimaries, double maxTime, size_t batchSize) :
+		maxPrimaries(maxPrimaries), batchSize(batchSize), maxTime(maxTime), primaries(0),
+		elapsed(0), converged(false) {
+	if (batchSize == 0)
+		throw std::runtime_error("ConvergenceCriterion: the batch size must be positive");
+	if (maxTime < 0)
+		throw std::runtime_error("ConvergenceCriterion: negative time budget");
+}
+
+void ConvergenceCriterion::addTarget(ConvergenceObservable *observable, double relativeUncertainty) {
+	if (not (relativeUncertainty > 0))
+		throw std::runtime_error("ConvergenceCriterion: the target uncertainty must be positive");
+	Target target;
+	target.observable = observable;
+	target.relativeUncertainty = relativeUncertainty;
+	targets.push_back(target);
+}
+
+void ConvergenceCriterion::addTarget(DetectionCounter *counter, double relativeUncertainty) {
+	addTarget(new DetectionCountObservable(counter), relativeUncertainty);
+}
+
+void ConvergenceCriterion::addTarget(HistogramOutput *output, size_t histogram, size_t bin,
+		double relativeUncertainty) {
+	addTarget(new HistogramBinObservable(output, histogram, bin), relativeUncertainty);
+}
+
+size_t ConvergenceCriterion::getNumberOfTargets() const {
+	return targets.size();
+}
+
+size_t ConvergenceCriterion::getMaxPrimaries() const {
+	return maxPrimaries;
+}
+
+double ConvergenceCriterion::getMaxTime() const {
+	return maxTime;
+}
+
+size_t ConvergenceCriterion::getBatchSize() const {
+	return batchSize;
+}
+
+void ConvergenceCriterion::start() {
+	if (targets.empty())
+		throw std::runtime_error("ConvergenceCriterion: no targets");
+	primaries = 0;
+	elapsed = 0;
+	converged = false;
+	achieved.assign(targets.size(), std::numeric_limits<double>::infinity());
+}
+
+size_t ConvergenceCriterion::update(size_t primaries, double elapsed) {
+	this->primaries = primaries;
+	this->elapsed = elapsed;
+
+	// primaries needed by the target furthest from convergence
+	converged = true;
+	double needed = 0;
+	for (size_t i = 0; i < targets.size(); i++) {
+		achieved[i] = targets[i].observable->getRelativeUncertainty();
+		double ratio = achieved[i] / targets[i].relativeUncertainty;
+		if (ratio > 1)
+			converged = false;
+		needed = std::max(needed, primaries * ratio * ratio);
+	}
+	if (converged or (primaries >= maxPrimaries))
+		return 0;
+	if ((maxTime > 0) and (elapsed >= maxTime))
+		return 0;
+
+	double next = std::max(needed - primaries, double(batchSize));
+	next = std::min(next, double(std::max(primaries, batchSize)));
+	if ((maxTime > 0) and (primaries > 0) and (elapsed > 0))
+		next = std::min(next, std::max(1., (maxTime - elapsed) * primaries / elapsed));
+	return std::min(size_t(std::ceil(next)), maxPrimaries - primaries);
+}
+
+bool ConvergenceCriterion::isConverged() const {
+	return converged;
+}
+
+size_t ConvergenceCriterion::getPrimaries() const {
+	return primaries;
+}
+
+double ConvergenceCriterion::getElapsedTime() const {
+	return elapsed;
+}
+
+const std::vector<double> &ConvergenceCriterion::getRelativeUncertainties() const {
+	return achieved;
+}
+
+std::string ConvergenceCriterion::getReport() const {
+	std::stringstream ss;
+	ss << "crpropa::ConvergenceCriterion: " << (converged ? "converged" : "not converged, budget used up")
+			<< " after " << primaries << " primaries in " << elapsed << " s\n";
+	for (size_t i = 0; i < targets.size(); i++) {
+		const ConvergenceObservable &observable = *targets[i].observable;
+		double value = observable.getValue();
+		ss << "  " << observable.getDescription() << ": " << value << " +- "
+				<< observable.getUncertainty() << ", relative uncertainty "
+				<< ((i < achieved.size()) ? achieved[i] : observable.getRelativeUncertainty())
+				<< " (target " << targets[i].relativeUncertainty << ")\n";
+	}
+	return ss.str();
+}
+
+} // namespace crpropa
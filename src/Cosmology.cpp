@@ -2,6 +2,8 @@
 #include "crpropa/Units.h"
 #include "crpropa/Common.h"
 
+#include <atomic>
+#include <memory>
 #include <vector>
 #include <cmath>
 #include <stdexcept>
@@ -11,6 +13,9 @@ namespace crpropa {
 /**
  @class Cosmology
  @brief Cosmology calculations
+
+ Instances are not changed once published, the index lookups in all tables
+ are O(1) through their EquidistantAxis.
  */
 struct Cosmology {
 	double H0; // Hubble parameter at z=0
@@ -25,6 +30,8 @@ struct Cosmology {
 	std::vector<double> Dc; // comoving distance [m]
 	std::vector<double> Dl; // luminosity distance [m]
 	std::vector<double> Dt; // light travel distance [m]
+	LogAxis zAxis; // index lookup in Z
+	LogAxis dcAxis, dlAxis, dtAxis; // index lookups in Dc, Dl, Dt
 
 	void update() {
 		double dH = c_light / H0; // Hubble distance
@@ -46,6 +53,10 @@ struct Cosmology {
 							* (1 / ((1 + Z[i]) * E[i])
 									+ 1 / ((1 + Z[i - 1]) * E[i - 1])) / 2;
 		}
+		zAxis.assign(Z);
+		dcAxis.assign(Dc);
+		dlAxis.assign(Dl);
+		dtAxis.assign(Dt);
 	}
 
 	Cosmology() {
@@ -79,91 +90,124 @@ const int Cosmology::n = 1000;
 const double Cosmology::zmin = 0.0001;
 const double Cosmology::zmax = 100;
 
-static Cosmology cosmology; // instance is created at runtime
+// The current cosmology is swapped atomically, so that threads propagating
+// meanwhile see either the old or the new tables. Each thread keeps a
+// reference to the instance it reads and takes the new one only after the
+// generation changed, so the lookups take no lock. A replaced instance is
+// freed once no thread refers to it any more.
+static std::shared_ptr<const Cosmology> &publishedCosmology() {
+	static std::shared_ptr<const Cosmology> c(new Cosmology());
+	return c;
+}
+
+static std::atomic<uint64_t> cosmologyGeneration(0);
+
+static inline const Cosmology &cosmology() {
+	static thread_local std::shared_ptr<const Cosmology> c;
+	static thread_local uint64_t generation = 0;
+	uint64_t current = cosmologyGeneration.load(std::memory_order_acquire);
+	if (!c || (generation != current)) {
+		c = std::atomic_load(&publishedCosmology());
+		generation = current;
+	}
+	return *c;
+}
 
 void setCosmologyParameters(double h, double oM) {
-	cosmology.setParameters(h, oM);
+	std::shared_ptr<Cosmology> c(new Cosmology());
+	c->setParameters(h, oM);
+	std::atomic_store(&publishedCosmology(), std::shared_ptr<const Cosmology>(c));
+	cosmologyGeneration.fetch_add(1, std::memory_order_release);
 }
 
 double hubbleRate(double z) {
-	return cosmology.H0
-			* sqrt(cosmology.omegaL + cosmology.omegaM * pow(1 + z, 3));
+	const Cosmology &cosmo = cosmology();
+	return cosmo.H0
+			* sqrt(cosmo.omegaL + cosmo.omegaM * pow_integer<3>(1 + z));
 }
 
 double omegaL() {
-	return cosmology.omegaL;
+	return cosmology().omegaL;
 }
 
 double omegaM() {
-	return cosmology.omegaM;
+	return cosmology().omegaM;
 }
 
 double H0() {
-	return cosmology.H0;
+	return cosmology().H0;
 }
 
 double comovingDistance2Redshift(double d) {
+	const Cosmology &cosmo = cosmology();
 	if (d < 0)
 		throw std::runtime_error("Cosmology: d < 0");
-	if (d > cosmology.Dc.back())
+	if (d > cosmo.Dc.back())
 		throw std::runtime_error("Cosmology: d > dmax");
-	return interpolate(d, cosmology.Dc, cosmology.Z);
+	return interpolate(d, cosmo.dcAxis, cosmo.Z);
 }
 
 double redshift2ComovingDistance(double z) {
+	const Cosmology &cosmo = cosmology();
 	if (z < 0)
 		throw std::runtime_error("Cosmology: z < 0");
-	if (z > cosmology.zmax)
+	if (z > cosmo.zmax)
 		throw std::runtime_error("Cosmology: z > zmax");
-	return interpolate(z, cosmology.Z, cosmology.Dc);
+	return interpolate(z, cosmo.zAxis, cosmo.Dc);
 }
 
 double luminosityDistance2Redshift(double d) {
+	const Cosmology &cosmo = cosmology();
 	if (d < 0)
 		throw std::runtime_error("Cosmology: d < 0");
-	if (d > cosmology.Dl.back())
+	if (d > cosmo.Dl.back())
 		throw std::runtime_error("Cosmology: d > dmax");
-	return interpolate(d, cosmology.Dl, cosmology.Z);
+	return interpolate(d, cosmo.dlAxis, cosmo.Z);
 }
 
 double redshift2LuminosityDistance(double z) {
+	const Cosmology &cosmo = cosmology();
 	if (z < 0)
 		throw std::runtime_error("Cosmology: z < 0");
-	if (z > cosmology.zmax)
+	if (z > cosmo.zmax)
 		throw std::runtime_error("Cosmology: z > zmax");
-	return interpolate(z, cosmology.Z, cosmology.Dl);
+	return interpolate(z, cosmo.zAxis, cosmo.Dl);
 }
 
 double lightTravelDistance2Redshift(double d) {
+	const Cosmology &cosmo = cosmology();
 	if (d < 0)
 		throw std::runtime_error("Cosmology: d < 0");
-	if (d > cosmology.Dt.back())
+	if (d > cosmo.Dt.back())
 		throw std::runtime_error("Cosmology: d > dmax");
-	return interpolate(d, cosmology.Dt, cosmology.Z);
+	return interpolate(d, cosmo.dtAxis, cosmo.Z);
 }
 
 double redshift2LightTravelDistance(double z) {
+	const Cosmology &cosmo = cosmology();
 	if (z < 0)
 		throw std::runtime_error("Cosmology: z < 0");
-	if (z > cosmology.zmax)
+	if (z > cosmo.zmax)
 		throw std::runtime_error("Cosmology: z > zmax");
-	return interpolate(z, cosmology.Z, cosmology.Dt);
+	return interpolate(z, cosmo.zAxis, cosmo.Dt);
 }
 
 double comoving2LightTravelDistance(double d) {
+	const Cosmology &cosmo = cosmology();
 	if (d < 0)
 		throw std::runtime_error("Cosmology: d < 0");
-	if (d > cosmology.Dc.back())
+	if (d > cosmo.Dc.back())
 		throw std::runtime_error("Cosmology: d > dmax");
-	return interpolate(d, cosmology.Dc, cosmology.Dt);
+	return interpolate(d, cosmo.dcAxis, cosmo.Dt);
 }
 
 double lightTravel2ComovingDistance(double d) {
+	const Cosmology &cosmo = cosmology();
 	if (d < 0)
 		throw std::runtime_error("Cosmology: d < 0");
-	if (d > cosmology.Dt.back())
+	if (d > cosmo.Dt.back())
 		throw std::runtime_error("Cosmology: d > dmax");
-	return interpolate(d, cosmology.Dt, cosmology.Dc);
+	return interpolate(d, cosmo.dtAxis, cosmo.Dc);
 }
 
 } // namespace crpropa
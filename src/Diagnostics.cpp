@@ -0,0 +1,173 @@
+#include "crpropa/Diagnostics.h"
+
+#include "kiss/logger.h"
+
+#include <chrono>
+#include <map>
+#include <mutex>
+
+namespace crpropa {
+
+static std::atomic<uint64_t> messageLimit(10);
+static std::atomic<double> reportInterval(10);
+
+static std::mutex &registryMutex() {
+	static std::mutex mutex;
+	return mutex;
+}
+
+static std::vector<DiagnosticSite *> &registry() {
+	static std::vector<DiagnosticSite *> sites;
+	return sites;
+}
+
+static int64_t diagnosticTicks() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int64_t intervalTicks() {
+	return reportInterval.load(std::memory_order_relaxed) * 1e6;
+}
+
+DiagnosticSite::DiagnosticSite(const std::string &name) :
+		name(name), occurrences(0), printed(0), nextReport(0), summarized(0) {
+	std::lock_guard<std::mutex> lock(registryMutex());
+	registry().push_back(this);
+}
+
+bool DiagnosticSite::count() {
+	uint64_t n = occurrences.fetch_add(1, std::memory_order_relaxed) + 1;
+	uint64_t limit = messageLimit.load(std::memory_order_relaxed);
+	if (n <= limit) {
+		if (n == limit)
+			nextReport.store(diagnosticTicks() + intervalTicks(), std::memory_order_relaxed);
+		return true;
+	}
+
+	// one message per interval, claimed by a single thread
+	int64_t now = diagnosticTicks();
+	int64_t next = nextReport.load(std::memory_order_relaxed);
+	if (now < next)
+		return false;
+	return nextReport.compare_exchange_strong(next, now + intervalTicks(), std::memory_order_relaxed);
+}
+
+void DiagnosticSite::print(const std::string &message) {
+	uint64_t n = occurrences.load(std::memory_order_relaxed);
+	uint64_t limit = messageLimit.load(std::memory_order_relaxed);
+	printed.fetch_add(1, std::memory_order_relaxed);
+	std::ostringstream ss;
+	ss << name << ": " << message;
+	if (n == limit)
+		ss << " (further messages are rate limited)";
+	else if (n > limit)
+		ss << " (" << n << " occurrences so far)";
+	std::string line = ss.str();
+
+	// the logger writes its prefix and end of line outside of its lock
+	static std::mutex printMutex;
+	std::lock_guard<std::mutex> lock(printMutex);
+	KISS_LOG_WARNING << line;
+}
+
+const std::string &DiagnosticSite::getName() const {
+	return name;
+}
+
+uint64_t DiagnosticSite::getOccurrences() const {
+	return occurrences.load(std::memory_order_relaxed);
+}
+
+uint64_t DiagnosticSite::getPrinted() const {
+	return printed.load(std::memory_order_relaxed);
+}
+
+void Diagnostics::setRateLimit(uint64_t messages, double interval) {
+	messageLimit = messages;
+	reportInterval = interval;
+	// the next message of every site is due
+	std::lock_guard<std::mutex> lock(registryMutex());
+	for (size_t i = 0; i < registry().size(); i++)
+		registry()[i]->nextReport = 0;
+}
+
+uint64_t Diagnostics::getMessageLimit() {
+	return messageLimit;
+}
+
+double Diagnostics::getInterval() {
+	return reportInterval;
+}
+
+uint64_t Diagnostics::getOccurrences(const std::string &name) {
+	std::lock_guard<std::mutex> lock(registryMutex());
+	uint64_t n = 0;
+	for (size_t i = 0; i < registry().size(); i++)
+		if (registry()[i]->name == name)
+			n += registry()[i]->getOccurrences();
+	return n;
+}
+
+std::string Diagnostics::getSummary() {
+	std::lock_guard<std::mutex> lock(registryMutex());
+
+	// sites of the same name are summed, in the order of registration
+	struct Totals {
+		uint64_t occurrences, summarized, printed;
+	};
+	std::vector<std::string> names;
+	std::map<std::string, Totals> totals;
+	for (size_t i = 0; i < registry().size(); i++) {
+		DiagnosticSite &site = *registry()[i];
+		if (totals.find(site.name) == totals.end()) {
+			names.push_back(site.name);
+			Totals zero = {0, 0, 0};
+			totals[site.name] = zero;
+		}
+		Totals &t = totals[site.name];
+		t.occurrences += site.getOccurrences();
+		t.summarized += site.summarized;
+		t.printed += site.getPrinted();
+	}
+
+	std::ostringstream ss;
+	for (size_t i = 0; i < names.size(); i++) {
+		const Totals &t = totals[names[i]];
+		if (t.occurrences == t.summarized)
+			continue;
+		ss << "crpropa::Diagnostics: " << names[i] << ": " << t.occurrences - t.summarized
+				<< " occurrences since the last summary, " << t.occurrences << " in total, "
+				<< t.printed << " printed\n";
+	}
+	return ss.str();
+}
+
+void Diagnostics::printSummary() {
+	std::string summary = getSummary();
+	if (summary.empty())
+		return;
+	summary.erase(summary.size() - 1);
+	KISS_LOG_WARNING << summary;
+	std::lock_guard<std::mutex> lock(registryMutex());
+	for (size_t i = 0; i < registry().size(); i++)
+		registry()[i]->summarized = registry()[i]->getOccurrences();
+}
+
+void Diagnostics::reset() {
+	std::lock_guard<std::mutex> lock(registryMutex());
+	for (size_t i = 0; i < registry().size(); i++) {
+		DiagnosticSite &site = *registry()[i];
+		site.occurrences = 0;
+		site.printed = 0;
+		site.nextReport = 0;
+		site.summarized = 0;
+	}
+}
+
+std::vector<DiagnosticSite *> Diagnostics::getSites() {
+	std::lock_guard<std::mutex> lock(registryMutex());
+	return registry();
+}
+
+} // namespace crpropa
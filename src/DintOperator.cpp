@@ -0,0 +1,303 @@
+#include "crpropa/DintOperator.h"
+#include "crpropa/Common.h"
+#include "crpropa/Cosmology.h"
+#include "crpropa/ProgressBar.h"
+#include "crpropa/Units.h"
+
+#include "dint/DintEMCascade.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+
+namespace crpropa {
+
+// DintInstance ---------------------------------------------------------------
+typedef std::multimap<std::string, DintEMCascade*> DintCache;
+
+static DintCache &dintCache() {
+	static DintCache cache;
+	return cache;
+}
+
+DintInstance::DintInstance(int IRBFlag, int RadioFlag, double Bfield) : dint(0) {
+	double h = H0() * Mpc / 1000;
+	std::stringstream ss;
+	ss.precision(17);
+	ss << IRBFlag << "|" << RadioFlag << "|" << Bfield << "|" << h << "|" << omegaM() << "|" << omegaL();
+	key = ss.str();
+
+#pragma omp critical(DintInstance)
+	{
+		DintCache::iterator i = dintCache().find(key);
+		if (i != dintCache().end()) {
+			dint = i->second;
+			dintCache().erase(i);
+		}
+	}
+	if (dint == 0)
+		dint = new DintEMCascade(IRBFlag, RadioFlag, getDataPath("dint"), Bfield / gauss, h, omegaM(), omegaL());
+}
+
+DintInstance::~DintInstance() {
+#pragma omp critical(DintInstance)
+	dintCache().insert(std::make_pair(key, dint));
+}
+
+DintEMCascade &DintInstance::operator*() {
+	return *dint;
+}
+
+DintEMCascade *DintInstance::operator->() {
+	return dint;
+}
+
+size_t DintInstance::getCacheSize() {
+	size_t n;
+#pragma omp critical(DintInstance)
+	n = dintCache().size();
+	return n;
+}
+
+void DintInstance::clearCache() {
+#pragma omp critical(DintInstance)
+	{
+		for (DintCache::iterator i = dintCache().begin(); i != dintCache().end(); ++i)
+			delete i->second;
+		dintCache().clear();
+	}
+}
+
+// DintOperator ---------------------------------------------------------------
+// file: Char[8] "CRPDINT1", Int32 (nD, nE, IRBFlag, RadioFlag),
+// Double (Dmax, Bfield, cutCascade, h, omegaM, omegaL), per distance bin
+// UInt8 (built) followed by Double[3 nE x 3 nE] if built
+static const char dintOperatorMagic[8] = {'C', 'R', 'P', 'D', 'I', 'N', 'T', '1'};
+
+DintOperator::DintOperator(double Dmax, int nD, int IRBFlag, int RadioFlag, double Bfield,
+		double cutCascade) :
+		Dmax(Dmax), nD(nD), nE(NUM_MAIN_BINS), IRBFlag(IRBFlag), RadioFlag(RadioFlag),
+		Bfield(Bfield), cutCascade(cutCascade), h(H0() * Mpc / 1000), omegaMatter(omegaM()),
+		omegaLambda(omegaL()), steps(nD > 0 ? nD : 0) {
+	if (not (Dmax > 0) or (nD < 1))
+		throw std::runtime_error("DintOperator: invalid distance binning");
+}
+
+DintOperator::DintOperator(const std::string &filename) {
+	std::ifstream infile(filename.c_str(), std::ios::binary);
+	if (!infile)
+		throw std::runtime_error("DintOperator: could not open " + filename);
+	char magic[8];
+	int32_t ints[4];
+	double doubles[6];
+	infile.read(magic, sizeof(magic));
+	if (!infile or memcmp(magic, dintOperatorMagic, sizeof(magic)) != 0)
+		throw std::runtime_error("DintOperator: not an operator file " + filename);
+	infile.read((char*) ints, sizeof(ints));
+	infile.read((char*) doubles, sizeof(doubles));
+	nD = ints[0];
+	nE = ints[1];
+	IRBFlag = ints[2];
+	RadioFlag = ints[3];
+	Dmax = doubles[0];
+	Bfield = doubles[1];
+	cutCascade = doubles[2];
+	h = doubles[3];
+	omegaMatter = doubles[4];
+	omegaLambda = doubles[5];
+	if (!infile or (nD < 1) or (nE != NUM_MAIN_BINS))
+		throw std::runtime_error("DintOperator: invalid operator file " + filename);
+
+	steps.resize(nD);
+	for (int iD = 0; iD < nD; iD++) {
+		uint8_t built = 0;
+		infile.read((char*) &built, sizeof(built));
+		if (not built)
+			continue;
+		steps[iD].resize(9 * nE * nE);
+		infile.read((char*) &steps[iD][0], steps[iD].size() * sizeof(double));
+	}
+	if (!infile)
+		throw std::runtime_error("DintOperator: error reading " + filename);
+}
+
+void DintOperator::checkCosmology() const {
+	if ((h != H0() * Mpc / 1000) or (omegaMatter != omegaM()) or (omegaLambda != omegaL()))
+		throw std::runtime_error("DintOperator: the cosmology changed since the operator was created");
+}
+
+void DintOperator::build(bool showProgress) {
+	checkCosmology(); // not from within the parallel loop
+	ProgressBar progressbar(nD);
+	if (showProgress)
+		progressbar.start("Build DintOperator");
+
+#pragma omp parallel for schedule(dynamic, 1)
+	for (int iD = 0; iD < nD; iD++) {
+		if (steps[iD].empty())
+			buildStep(iD);
+		if (showProgress) {
+#pragma omp critical(progressbarUpdate)
+			progressbar.update();
+		}
+	}
+}
+
+void DintOperator::buildStep(int iD) {
+	if ((iD < 0) or (iD >= nD))
+		throw std::runtime_error("DintOperator: distance bin out of range");
+	checkCosmology();
+
+	// one unit injection per particle type and energy bin
+	int n = 3 * nE;
+	std::vector<Spectrum> input(n), output(n);
+	std::vector<Spectrum*> pInput(n), pOutput(n);
+	for (int k = 0; k < n; k++) {
+		NewSpectrum(&input[k], NUM_MAIN_BINS);
+		NewSpectrum(&output[k], NUM_MAIN_BINS);
+		InitializeSpectrum(&input[k]);
+		InitializeSpectrum(&output[k]);
+		input[k].spectrum[k / nE][k % nE] = 1;
+		pInput[k] = &input[k];
+		pOutput[k] = &output[k];
+	}
+
+	// from the bin centre to the centre of the next closer bin, see EMCascade::runCascade
+	double dD = Dmax / nD;
+	double D1 = comoving2LightTravelDistance((iD + 0.5) * dD);
+	double D0 = comoving2LightTravelDistance(std::max((iD - 0.5) * dD, 0.));
+	{
+		DintInstance dint(IRBFlag, RadioFlag, Bfield);
+		dint->propagate(D1 / Mpc, D0 / Mpc, n, &pInput[0], &pOutput[0], cutCascade);
+	}
+
+	std::vector<double> step(n * n);
+	for (int k = 0; k < n; k++) {
+		for (int s = 0; s < 3; s++)
+			std::copy(output[k].spectrum[s], output[k].spectrum[s] + nE, &step[k * n + s * nE]);
+		DeleteSpectrum(&input[k]);
+		DeleteSpectrum(&output[k]);
+	}
+	steps[iD].swap(step);
+}
+
+bool DintOperator::isBuilt() const {
+	for (int iD = 0; iD < nD; iD++)
+		if (steps[iD].empty())
+			return false;
+	return true;
+}
+
+void DintOperator::save(const std::string &filename) const {
+	std::ofstream outfile(filename.c_str(), std::ios::binary);
+	if (!outfile)
+		throw std::runtime_error("DintOperator: could not open " + filename);
+	int32_t ints[4] = {nD, nE, IRBFlag, RadioFlag};
+	double doubles[6] = {Dmax, Bfield, cutCascade, h, omegaMatter, omegaLambda};
+	outfile.write(dintOperatorMagic, sizeof(dintOperatorMagic));
+	outfile.write((const char*) ints, sizeof(ints));
+	outfile.write((const char*) doubles, sizeof(doubles));
+	for (int iD = 0; iD < nD; iD++) {
+		uint8_t built = not steps[iD].empty();
+		outfile.write((const char*) &built, sizeof(built));
+		if (built)
+			outfile.write((const char*) &steps[iD][0], steps[iD].size() * sizeof(double));
+	}
+	if (outfile.fail())
+		throw std::runtime_error("DintOperator: error writing " + filename);
+}
+
+double DintOperator::getMaximumDistance() const {
+	return Dmax;
+}
+
+int DintOperator::getNumberOfDistanceBins() const {
+	return nD;
+}
+
+int DintOperator::getNumberOfEnergyBins() const {
+	return nE;
+}
+
+int DintOperator::getIRBFlag() const {
+	return IRBFlag;
+}
+
+int DintOperator::getRadioFlag() const {
+	return RadioFlag;
+}
+
+double DintOperator::getMagneticField() const {
+	return Bfield;
+}
+
+double DintOperator::getCutCascade() const {
+	return cutCascade;
+}
+
+const std::vector<double> &DintOperator::getStep(int iD) const {
+	if ((iD < 0) or (iD >= nD))
+		throw std::runtime_error("DintOperator: distance bin out of range");
+	return steps[iD];
+}
+
+void DintOperator::setStep(int iD, const std::vector<double> &step) {
+	if ((iD < 0) or (iD >= nD))
+		throw std::runtime_error("DintOperator: distance bin out of range");
+	if (step.size() != size_t(9 * nE * nE))
+		throw std::runtime_error("DintOperator: the operator must have 3 nE x 3 nE elements");
+	steps[iD] = step;
+}
+
+std::vector<double> DintOperator::fold(const std::vector<double> &injection) const {
+	if (injection.size() != size_t(3 * nD * nE))
+		throw std::runtime_error("DintOperator: the injection must have 3 nD nE bins");
+	int n = 3 * nE;
+	std::vector<double> spectrum(n, 0), propagated(n);
+
+	// from the farthest bin, adding the particles of each bin on the way
+	for (int iD = nD - 1; iD >= 0; iD--) {
+		double count = 0;
+		for (int s = 0; s < 3; s++) {
+			const double *h = &injection[(s * nD + iD) * nE];
+			for (int iE = 0; iE < nE; iE++) {
+				spectrum[s * nE + iE] += h[iE];
+				count += spectrum[s * nE + iE];
+			}
+		}
+		if (count == 0)
+			continue;
+		if (steps[iD].empty())
+			throw std::runtime_error("DintOperator: operator of a distance bin not built");
+
+		const double *P = &steps[iD][0];
+		std::fill(propagated.begin(), propagated.end(), 0.);
+		for (int k = 0; k < n; k++) {
+			double x = spectrum[k];
+			if (x == 0)
+				continue;
+			const double *column = P + size_t(k) * n;
+			for (int j = 0; j < n; j++)
+				propagated[j] += column[j] * x;
+		}
+		spectrum.swap(propagated);
+	}
+	return spectrum;
+}
+
+std::vector<double> DintOperator::propagate(const std::vector<double> &spectrum, int iD) const {
+	if ((iD < 0) or (iD >= nD))
+		throw std::runtime_error("DintOperator: distance bin out of range");
+	if (spectrum.size() != size_t(3 * nE))
+		throw std::runtime_error("DintOperator: the spectrum must have 3 nE bins");
+	std::vector<double> injection(3 * nD * nE, 0);
+	for (int s = 0; s < 3; s++)
+		std::copy(&spectrum[s * nE], &spectrum[s * nE] + nE, &injection[(s * nD + iD) * nE]);
+	return fold(injection);
+}
+
+} // namespace crpropa
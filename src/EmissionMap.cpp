@@ -2,16 +2,24 @@
 #include "crpropa/Random.h"
 #include "crpropa/Units.h"
 
+#include <algorithm>
+#include <cstring>
 #include <fstream>
+#include <stdexcept>
+#include <stdint.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace crpropa {
 
-CylindricalProjectionMap::CylindricalProjectionMap() : nPhi(360), nTheta(180), dirty(false), pdf(nPhi* nTheta, 0), cdf(nPhi* nTheta, 0) {
+CylindricalProjectionMap::CylindricalProjectionMap() : nPhi(360), nTheta(180), dirty(false), finalized(false), pdf(nPhi* nTheta, 0), cdf(nPhi* nTheta, 0) {
 	sPhi = 2. * M_PI / nPhi;
 	sTheta = 2. / nTheta;
 }
 
-CylindricalProjectionMap::CylindricalProjectionMap(size_t nPhi, size_t nTheta) : nPhi(nPhi), nTheta(nTheta), dirty(false), pdf(nPhi* nTheta, 0), cdf(nPhi* nTheta, 0) {
+CylindricalProjectionMap::CylindricalProjectionMap(size_t nPhi, size_t nTheta) : nPhi(nPhi), nTheta(nTheta), dirty(false), finalized(false), pdf(nPhi* nTheta, 0), cdf(nPhi* nTheta, 0) {
 	sPhi = 2 * M_PI / nPhi;
 	sTheta = 2. / nTheta;
 }
@@ -22,19 +30,45 @@ void CylindricalProjectionMap::fillBin(const Vector3d& direction, double weight)
 }
 
 void CylindricalProjectionMap::fillBin(size_t bin, double weight) {
+	if (finalized)
+		throw std::runtime_error("CylindricalProjectionMap: cannot fill a finalized map");
 	pdf[bin] += weight;
-	dirty = true;
+	dirty.store(true, std::memory_order_release);
+}
+
+void CylindricalProjectionMap::finalize() {
+	updateCdf();
+	aliasTable.setWeights(pdf);
+	finalized = true;
+}
+
+bool CylindricalProjectionMap::isFinalized() const {
+	return finalized;
 }
 
 Vector3d CylindricalProjectionMap::drawDirection() const {
-	if (dirty)
-		updateCdf();
+	Random &random = Random::instance();
+	if (finalized)
+		return directionFromBin(aliasTable.sample(random));
 
-	size_t bin = Random::instance().randBin(cdf);
+	// the cdf written by another thread is visible after the acquire
+	if (dirty.load(std::memory_order_acquire)) {
+#pragma omp critical(CylindricalProjectionMap)
+		updateCdf();
+	}
+	size_t bin = random.randBin(cdf);
 
 	return directionFromBin(bin);
 }
 
+double CylindricalProjectionMap::getSum() const {
+	if (dirty.load(std::memory_order_acquire)) {
+#pragma omp critical(CylindricalProjectionMap)
+		updateCdf();
+	}
+	return cdf.back();
+}
+
 bool CylindricalProjectionMap::checkDirection(const Vector3d &direction) const {
 	size_t bin = binFromDirection(direction);
 	return pdf[bin];
@@ -107,12 +141,12 @@ Vector3d CylindricalProjectionMap::directionFromBin(size_t bin) const {
 }
 
 void CylindricalProjectionMap::updateCdf() const {
-	if (dirty) {
+	if (dirty.load(std::memory_order_acquire)) {
 		cdf[0] = pdf[0];
 		for (size_t i = 1; i < pdf.size(); i++) {
 			cdf[i] = cdf[i-1] + pdf[i];
 		}
-		dirty = false;
+		dirty.store(false, std::memory_order_release);
 	}
 }
 
@@ -232,7 +266,10 @@ void EmissionMap::merge(const EmissionMap *other) {
 			continue;
 
 		std::vector<double> &otherpdf = i->second->getPdf();
-		ref_ptr<CylindricalProjectionMap> cpm = getMap(i->first.first, i->first.second);
+		// the keys hold the energy bin
+		ref_ptr<CylindricalProjectionMap> &cpm = maps[i->first];
+		if (!cpm.valid())
+			cpm = new CylindricalProjectionMap(nPhi, nTheta);
 
 		if (otherpdf.size() != cpm->getPdf().size()) {
 			std::cout << "pdf size mismatch!" << std::endl;
@@ -245,13 +282,177 @@ void EmissionMap::merge(const EmissionMap *other) {
 	}
 }
 
+void EmissionMap::finalize() {
+	for (map_t::iterator i = maps.begin(); i != maps.end(); i++)
+		if (i->second.valid())
+			i->second->finalize();
+}
+
+size_t EmissionMap::getNPhi() const {
+	return nPhi;
+}
+
+size_t EmissionMap::getNTheta() const {
+	return nTheta;
+}
+
+size_t EmissionMap::getNEnergy() const {
+	return nEnergy;
+}
+
+double EmissionMap::getMinimumEnergy() const {
+	return minEnergy;
+}
+
+double EmissionMap::getMaximumEnergy() const {
+	return maxEnergy;
+}
+
 void EmissionMap::merge(const std::string &filename) {
-	EmissionMap em;
+	EmissionMap em(nPhi, nTheta, nEnergy, minEnergy, maxEnergy);
 	em.load(filename);
 	merge(&em);
 }
 
+static const char emissionMapMagic[8] = {'C', 'R', 'P', 'E', 'M', 'A', 'P', '1'};
+static const uint32_t emissionMapVersion = 1;
+
+template<typename T>
+static void writeBinary(std::ostream &out, const T &value) {
+	out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+static T readBinary(std::istream &in, const std::string &filename) {
+	T value;
+	if (!in.read(reinterpret_cast<char*>(&value), sizeof(T)))
+		throw std::runtime_error("EmissionMap: truncated file " + filename);
+	return value;
+}
+
+void EmissionMap::saveBinary(const std::string &filename) const {
+	std::ofstream out(filename.c_str(), std::ios::binary);
+	if (!out)
+		throw std::runtime_error("EmissionMap: could not open " + filename);
+
+	uint64_t n = 0;
+	for (map_t::const_iterator i = maps.begin(); i != maps.end(); i++)
+		if (i->second.valid())
+			n++;
+	out.write(emissionMapMagic, sizeof(emissionMapMagic));
+	writeBinary<uint32_t>(out, emissionMapVersion);
+	writeBinary<uint32_t>(out, nPhi);
+	writeBinary<uint32_t>(out, nTheta);
+	writeBinary<uint32_t>(out, nEnergy);
+	writeBinary(out, minEnergy);
+	writeBinary(out, maxEnergy);
+	writeBinary(out, n);
+
+	for (map_t::const_iterator i = maps.begin(); i != maps.end(); i++) {
+		if (!i->second.valid())
+			continue;
+		const std::vector<double> &pdf = i->second->getPdf();
+		size_t filled = pdf.size() - std::count(pdf.begin(), pdf.end(), 0.);
+		writeBinary<int32_t>(out, i->first.first);
+		writeBinary<uint32_t>(out, i->first.second);
+		writeBinary<uint32_t>(out, i->second->getNPhi());
+		writeBinary<uint32_t>(out, i->second->getNTheta());
+		// sparse if the pairs of bin and value are smaller than the dense map
+		bool sparse = filled * (sizeof(uint32_t) + sizeof(double)) < pdf.size() * sizeof(double);
+		writeBinary<uint32_t>(out, sparse ? filled : pdf.size());
+		if (not sparse) {
+			out.write(reinterpret_cast<const char*>(&pdf[0]), pdf.size() * sizeof(double));
+			continue;
+		}
+		for (size_t k = 0; k < pdf.size(); k++) {
+			if (pdf[k] == 0)
+				continue;
+			writeBinary<uint32_t>(out, k);
+			writeBinary(out, pdf[k]);
+		}
+	}
+	if (!out)
+		throw std::runtime_error("EmissionMap: could not write " + filename);
+}
+
+void EmissionMap::loadBinary(const std::string &filename) {
+	std::ifstream in(filename.c_str(), std::ios::binary);
+	char magic[8];
+	if (!in.read(magic, sizeof(magic)) or (memcmp(magic, emissionMapMagic, sizeof(magic)) != 0))
+		throw std::runtime_error("EmissionMap: " + filename + " is not a binary emission map");
+	if (readBinary<uint32_t>(in, filename) != emissionMapVersion)
+		throw std::runtime_error("EmissionMap: unknown version of " + filename);
+	size_t nPhi_ = readBinary<uint32_t>(in, filename);
+	size_t nTheta_ = readBinary<uint32_t>(in, filename);
+	size_t nEnergy_ = readBinary<uint32_t>(in, filename);
+	double minEnergy_ = readBinary<double>(in, filename);
+	double maxEnergy_ = readBinary<double>(in, filename);
+	if ((nEnergy_ != nEnergy) or (minEnergy_ != minEnergy) or (maxEnergy_ != maxEnergy))
+		throw std::runtime_error("EmissionMap: energy binning of " + filename + " does not match");
+	if (nPhi != nPhi_)
+		std::cout << "Warning: nPhi mismatch: " << nPhi << " " << nPhi_ << std::endl;
+	if (nTheta != nTheta_)
+		std::cout << "Warning: nTheta mismatch: " << nTheta << " " << nTheta_ << std::endl;
+
+	uint64_t n = readBinary<uint64_t>(in, filename);
+	for (uint64_t m = 0; m < n; m++) {
+		key_t key;
+		key.first = readBinary<int32_t>(in, filename);
+		key.second = readBinary<uint32_t>(in, filename);
+		size_t mapNPhi = readBinary<uint32_t>(in, filename);
+		size_t mapNTheta = readBinary<uint32_t>(in, filename);
+		size_t stored = readBinary<uint32_t>(in, filename);
+
+		ref_ptr<CylindricalProjectionMap> cpm = new CylindricalProjectionMap(mapNPhi, mapNTheta);
+		std::vector<double> &pdf = cpm->getPdf();
+		if (stored == pdf.size()) {
+			if (!in.read(reinterpret_cast<char*>(&pdf[0]), pdf.size() * sizeof(double)))
+				throw std::runtime_error("EmissionMap: truncated file " + filename);
+		} else {
+			for (size_t k = 0; k < stored; k++) {
+				size_t bin = readBinary<uint32_t>(in, filename);
+				double value = readBinary<double>(in, filename);
+				if (bin >= pdf.size())
+					throw std::runtime_error("EmissionMap: invalid bin in " + filename);
+				pdf[bin] = value;
+			}
+		}
+		maps[key] = cpm;
+	}
+}
+
+void EmissionMap::merge(const std::vector<std::string> &filenames) {
+	std::string error;
+#pragma omp parallel
+	{
+		EmissionMap sum(nPhi, nTheta, nEnergy, minEnergy, maxEnergy);
+#pragma omp for schedule(dynamic)
+		for (size_t i = 0; i < filenames.size(); i++) {
+			try {
+				sum.merge(filenames[i]);
+			} catch (std::exception &e) {
+#pragma omp critical(EmissionMapMerge)
+				error = e.what();
+			}
+		}
+#pragma omp critical(EmissionMapMerge)
+		merge(&sum);
+	}
+	if (not error.empty())
+		throw std::runtime_error(error);
+}
+
 void EmissionMap::load(const std::string &filename) {
+	{
+		std::ifstream in(filename.c_str(), std::ios::binary);
+		char magic[8] = {0};
+		in.read(magic, sizeof(magic));
+		if (in and (memcmp(magic, emissionMapMagic, sizeof(magic)) == 0)) {
+			loadBinary(filename);
+			return;
+		}
+	}
+
 	std::ifstream in(filename.c_str());
 	in.imbue(std::locale("C"));
 
@@ -1,11 +1,37 @@
+#include <algorithm>
 #include <limits>
 #include <cmath>
+#include <stdexcept>
 #include "kiss/logger.h"
 #include "crpropa/Geometry.h"
 
 #include <iostream>
 namespace crpropa
 {
+double Surface::distanceAlong(const Vector3d& point, const Vector3d& direction) const
+{
+	return fabs(distance(point));
+}
+
+double Surface::nearestDistance(const Vector3d& point) const
+{
+	return fabs(distance(point));
+}
+
+bool Surface::crossed(const Vector3d& from, const Vector3d& to) const
+{
+	double d = distance(from);
+	if (d == 0)
+		return false;
+	return d * distance(to) <= 0;
+}
+
+bool Surface::getBoundingBox(Vector3d& lower, Vector3d& upper) const
+{
+	return false;
+}
+
+
 // Plane ------------------------------------------------------------------
 Plane::Plane(const Vector3d& _x0, const Vector3d& _n) : x0(_x0), n(_n) {};
 
@@ -21,6 +47,15 @@ double Plane::distance(const Vector3d &x) const
 	return n.dot(dX);
 };
 
+double Plane::distanceAlong(const Vector3d& point, const Vector3d& direction) const
+{
+	double d = distance(point);
+	double v = n.dot(direction);
+	if (d * v >= 0) // parallel or moving away
+		return std::numeric_limits<double>::infinity();
+	return -d / v;
+}
+
 std::string Plane::getDescription() const
 {
 	std::stringstream ss;
@@ -51,6 +86,32 @@ Vector3d Sphere::normal(const Vector3d& point) const
   return d.getUnitVector();
 }
 
+double Sphere::distanceAlong(const Vector3d& point, const Vector3d& direction) const
+{
+	// |point + s * direction - center| = radius
+	Vector3d dR = point - center;
+	double a = direction.dot(direction);
+	double b = direction.dot(dR) / a;
+	double c = (dR.dot(dR) - radius * radius) / a;
+	double disc = b * b - c;
+	if (disc < 0)
+		return std::numeric_limits<double>::infinity();
+	double s1 = -b - sqrt(disc);
+	double s2 = -b + sqrt(disc);
+	if (s1 > 0)
+		return s1;
+	if (s2 > 0)
+		return s2;
+	return std::numeric_limits<double>::infinity();
+}
+
+bool Sphere::getBoundingBox(Vector3d& lower, Vector3d& upper) const
+{
+	lower = center - Vector3d(radius);
+	upper = center + Vector3d(radius);
+	return true;
+}
+
 std::string Sphere::getDescription() const
 {
 	std::stringstream ss;
@@ -122,6 +183,37 @@ Vector3d ParaxialBox::normal(const Vector3d& point) const
   return n;
 }
 
+double ParaxialBox::distanceAlong(const Vector3d& point, const Vector3d& direction) const
+{
+	// intersection of the slabs between the faces of each axis
+	double sIn = -std::numeric_limits<double>::infinity();
+	double sOut = std::numeric_limits<double>::infinity();
+	for (int i = 0; i < 3; i++) {
+		double lo = corner.data[i] - point.data[i];
+		double hi = lo + size.data[i];
+		double u = direction.data[i];
+		if (u == 0) {
+			if (lo > 0 or hi < 0) // outside of the slab, never entering
+				return std::numeric_limits<double>::infinity();
+			continue;
+		}
+		double s1 = lo / u;
+		double s2 = hi / u;
+		sIn = std::max(sIn, std::min(s1, s2));
+		sOut = std::min(sOut, std::max(s1, s2));
+	}
+	if (sIn > sOut or sOut <= 0)
+		return std::numeric_limits<double>::infinity();
+	return (sIn > 0) ? sIn : sOut;
+}
+
+bool ParaxialBox::getBoundingBox(Vector3d& lower, Vector3d& upper) const
+{
+	lower = corner;
+	upper = corner + size;
+	return true;
+}
+
 std::string ParaxialBox::getDescription() const
 {
 	std::stringstream ss;
@@ -132,4 +224,305 @@ std::string ParaxialBox::getDescription() const
 };
 
 
+// SurfaceCollection -------------------------------------------------------
+// surfaces per leaf of the hierarchy
+static const uint32_t leafSize = 4;
+
+// euclidean distance of a point to a box, 0 inside
+static double boxDistance(const Vector3d& point, const Vector3d& lower, const Vector3d& upper)
+{
+	double d2 = 0;
+	for (int i = 0; i < 3; i++) {
+		double d = std::max(0., std::max(lower.data[i] - point.data[i], point.data[i] - upper.data[i]));
+		d2 += d * d;
+	}
+	return sqrt(d2);
+}
+
+// distance along a line to the entry into a box up to maxDistance, 0 inside,
+// infinity if the box is not reached before
+static double boxEntry(const Vector3d& point, const Vector3d& direction,
+		const Vector3d& lower, const Vector3d& upper, double maxDistance)
+{
+	double sIn = 0;
+	double sOut = maxDistance;
+	for (int i = 0; i < 3; i++) {
+		double lo = lower.data[i] - point.data[i];
+		double hi = upper.data[i] - point.data[i];
+		double u = direction.data[i];
+		if (u == 0) {
+			if (lo > 0 or hi < 0)
+				return std::numeric_limits<double>::infinity();
+			continue;
+		}
+		double s1 = lo / u;
+		double s2 = hi / u;
+		sIn = std::max(sIn, std::min(s1, s2));
+		sOut = std::min(sOut, std::max(s1, s2));
+	}
+	if (sIn > sOut)
+		return std::numeric_limits<double>::infinity();
+	return sIn;
+}
+
+SurfaceCollection::SurfaceCollection()
+{
+}
+
+void SurfaceCollection::add(Surface *surface)
+{
+	if (not surface)
+		throw std::runtime_error("SurfaceCollection: no surface");
+	Vector3d lower, upper;
+	bool bounded = surface->getBoundingBox(lower, upper);
+	surfaces.push_back(surface);
+	lowers.push_back(lower);
+	uppers.push_back(upper);
+	if (bounded)
+		order.push_back(surfaces.size() - 1);
+	else
+		unbounded.push_back(surfaces.size() - 1);
+	build();
+}
+
+size_t SurfaceCollection::size() const
+{
+	return surfaces.size();
+}
+
+Surface *SurfaceCollection::get(size_t i) const
+{
+	if (i >= surfaces.size())
+		throw std::runtime_error("SurfaceCollection: index out of range");
+	return surfaces[i];
+}
+
+void SurfaceCollection::build()
+{
+	nodes.clear();
+	if (not order.empty())
+		buildNode(0, order.size());
+}
+
+uint32_t SurfaceCollection::buildNode(uint32_t first, uint32_t count)
+{
+	uint32_t index = nodes.size();
+	nodes.push_back(Node());
+	Vector3d lower = lowers[order[first]];
+	Vector3d upper = uppers[order[first]];
+	Vector3d cLower = (lower + upper) / 2;
+	Vector3d cUpper = cLower;
+	for (uint32_t k = first; k < first + count; k++) {
+		const Vector3d &l = lowers[order[k]];
+		const Vector3d &u = uppers[order[k]];
+		Vector3d c = (l + u) / 2;
+		for (int i = 0; i < 3; i++) {
+			lower.data[i] = std::min(lower.data[i], l.data[i]);
+			upper.data[i] = std::max(upper.data[i], u.data[i]);
+			cLower.data[i] = std::min(cLower.data[i], c.data[i]);
+			cUpper.data[i] = std::max(cUpper.data[i], c.data[i]);
+		}
+	}
+	nodes[index].lower = lower;
+	nodes[index].upper = upper;
+	nodes[index].first = first;
+	nodes[index].count = count;
+	nodes[index].left = nodes[index].right = 0;
+	if (count <= leafSize)
+		return index;
+
+	// split at the median of the box centers along the widest axis
+	Vector3d extent = cUpper - cLower;
+	int axis = 0;
+	if (extent.y > extent.data[axis])
+		axis = 1;
+	if (extent.z > extent.data[axis])
+		axis = 2;
+	uint32_t half = count / 2;
+	const std::vector<Vector3d> &l = lowers;
+	const std::vector<Vector3d> &u = uppers;
+	std::nth_element(order.begin() + first, order.begin() + first + half,
+			order.begin() + first + count, [&](uint32_t a, uint32_t b) {
+				return l[a].data[axis] + u[a].data[axis] < l[b].data[axis] + u[b].data[axis];
+			});
+	uint32_t left = buildNode(first, half);
+	uint32_t right = buildNode(first + half, count - half);
+	nodes[index].count = 0;
+	nodes[index].left = left;
+	nodes[index].right = right;
+	return index;
+}
+
+double SurfaceCollection::distance(const Vector3d &point) const
+{
+	double best = std::numeric_limits<double>::infinity();
+	for (size_t k = 0; k < unbounded.size(); k++)
+		best = std::min(best, surfaces[unbounded[k]]->distance(point));
+	if (nodes.empty())
+		return best;
+
+	// the bounded surfaces are at least as far as their boxes outside of them
+	std::vector<uint32_t> stack(1, 0);
+	while (not stack.empty()) {
+		const Node &node = nodes[stack.back()];
+		stack.pop_back();
+		double b = boxDistance(point, node.lower, node.upper);
+		if (b > 0 and b >= best)
+			continue;
+		if (node.count == 0) {
+			stack.push_back(node.left);
+			stack.push_back(node.right);
+			continue;
+		}
+		for (uint32_t k = node.first; k < node.first + node.count; k++)
+			best = std::min(best, surfaces[order[k]]->distance(point));
+	}
+	return best;
+}
+
+long SurfaceCollection::nearestSurface(const Vector3d& point) const
+{
+	long nearest = -1;
+	double best = std::numeric_limits<double>::infinity();
+	for (size_t k = 0; k < unbounded.size(); k++) {
+		double d = surfaces[unbounded[k]]->nearestDistance(point);
+		if (d < best or nearest < 0) {
+			best = d;
+			nearest = unbounded[k];
+		}
+	}
+	if (nodes.empty())
+		return nearest;
+
+	// the nearer child first
+	std::vector<uint32_t> stack(1, 0);
+	while (not stack.empty()) {
+		const Node &node = nodes[stack.back()];
+		stack.pop_back();
+		if (nearest >= 0 and boxDistance(point, node.lower, node.upper) >= best)
+			continue;
+		if (node.count == 0) {
+			const Node &l = nodes[node.left];
+			const Node &r = nodes[node.right];
+			bool leftFirst = boxDistance(point, l.lower, l.upper) <= boxDistance(point, r.lower, r.upper);
+			stack.push_back(leftFirst ? node.right : node.left);
+			stack.push_back(leftFirst ? node.left : node.right);
+			continue;
+		}
+		for (uint32_t k = node.first; k < node.first + node.count; k++) {
+			double d = surfaces[order[k]]->nearestDistance(point);
+			if (d < best or nearest < 0) {
+				best = d;
+				nearest = order[k];
+			}
+		}
+	}
+	return nearest;
+}
+
+double SurfaceCollection::nearestDistance(const Vector3d& point) const
+{
+	long i = nearestSurface(point);
+	if (i < 0)
+		return std::numeric_limits<double>::infinity();
+	return surfaces[i]->nearestDistance(point);
+}
+
+Vector3d SurfaceCollection::normal(const Vector3d& point) const
+{
+	long i = nearestSurface(point);
+	if (i < 0)
+		throw std::runtime_error("SurfaceCollection: no surface");
+	return surfaces[i]->normal(point);
+}
+
+double SurfaceCollection::distanceAlong(const Vector3d& point, const Vector3d& direction) const
+{
+	double best = std::numeric_limits<double>::infinity();
+	for (size_t k = 0; k < unbounded.size(); k++)
+		best = std::min(best, surfaces[unbounded[k]]->distanceAlong(point, direction));
+	if (nodes.empty())
+		return best;
+
+	// the crossings of the bounded surfaces are inside their boxes
+	std::vector<uint32_t> stack(1, 0);
+	while (not stack.empty()) {
+		const Node &node = nodes[stack.back()];
+		stack.pop_back();
+		if (boxEntry(point, direction, node.lower, node.upper, best) >= best)
+			continue;
+		if (node.count == 0) {
+			stack.push_back(node.left);
+			stack.push_back(node.right);
+			continue;
+		}
+		for (uint32_t k = node.first; k < node.first + node.count; k++)
+			best = std::min(best, surfaces[order[k]]->distanceAlong(point, direction));
+	}
+	return best;
+}
+
+long SurfaceCollection::crossedSurface(const Vector3d& from, const Vector3d& to) const
+{
+	Vector3d step = to - from;
+	double length = step.getR();
+	Vector3d direction = (length > 0) ? step / length : step;
+	long first = -1;
+	double best = std::numeric_limits<double>::infinity();
+
+	// of several crossed surfaces the one crossed first along the step
+	std::vector<uint32_t> candidates(unbounded);
+	if (not nodes.empty()) {
+		// the signs of the distances of a bounded surface differ only if the step
+		// meets its box
+		std::vector<uint32_t> stack(1, 0);
+		while (not stack.empty()) {
+			const Node &node = nodes[stack.back()];
+			stack.pop_back();
+			if (boxEntry(from, direction, node.lower, node.upper, length) > length)
+				continue;
+			if (node.count == 0) {
+				stack.push_back(node.left);
+				stack.push_back(node.right);
+				continue;
+			}
+			for (uint32_t k = node.first; k < node.first + node.count; k++)
+				candidates.push_back(order[k]);
+		}
+	}
+	for (size_t k = 0; k < candidates.size(); k++) {
+		const Surface *surface = surfaces[candidates[k]];
+		if (not surface->crossed(from, to))
+			continue;
+		double s = surface->distanceAlong(from, direction);
+		if (first < 0 or s < best or (s == best and (long) candidates[k] < first)) {
+			first = candidates[k];
+			best = s;
+		}
+	}
+	return first;
+}
+
+bool SurfaceCollection::crossed(const Vector3d& from, const Vector3d& to) const
+{
+	return crossedSurface(from, to) >= 0;
+}
+
+bool SurfaceCollection::getBoundingBox(Vector3d& lower, Vector3d& upper) const
+{
+	if (surfaces.empty() or not unbounded.empty())
+		return false;
+	lower = nodes[0].lower;
+	upper = nodes[0].upper;
+	return true;
+}
+
+std::string SurfaceCollection::getDescription() const
+{
+	std::stringstream ss;
+	ss << "SurfaceCollection: " << surfaces.size() << " surfaces, "
+		<< unbounded.size() << " unbounded" << std::endl;
+	return ss.str();
+}
+
 } // namespace
@@ -0,0 +1,246 @@
+#include "crpropa/Grid.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdint.h>
+
+#ifdef FAST_GRIDS
+#include <immintrin.h>
+#endif
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace crpropa {
+
+#ifdef FAST_GRIDS
+// lower neighbors and fractions along one axis of 8 positions
+static inline void floorFraction(const Vector3d *positions, int d, double origin,
+		double spacing, __m256i &lo, __m256 &f) {
+	__m128i l[2];
+	__m128 fr[2];
+	for (int h = 0; h < 2; h++) {
+		const Vector3d *p = positions + 4 * h;
+		__m256d x = _mm256_set_pd(p[3].data[d], p[2].data[d], p[1].data[d], p[0].data[d]);
+		__m256d r = _mm256_div_pd(_mm256_sub_pd(x, _mm256_set1_pd(origin)), _mm256_set1_pd(spacing));
+		__m256d fl = _mm256_floor_pd(r);
+		fr[h] = _mm256_cvtpd_ps(_mm256_sub_pd(r, fl));
+		l[h] = _mm256_cvttpd_epi32(fl);
+	}
+	lo = _mm256_insertf128_si256(_mm256_castsi128_si256(l[0]), l[1], 1);
+	f = _mm256_insertf128_ps(_mm256_castps128_ps256(fr[0]), fr[1], 1);
+}
+#endif // FAST_GRIDS
+
+template<>
+void Grid<Vector3f>::interpolate(const Vector3d *positions, Vector3f *values, size_t count) const {
+	size_t start = 0;
+
+#ifdef FAST_GRIDS
+	// the vector kernel indexes the floats of the grid with 32 bit integers
+	const bool vectorize = (not tricubic) and (not reflective)
+			and (3 * grid.size() <= size_t(std::numeric_limits<int32_t>::max()));
+	const float *data = grid.empty() ? 0 : &grid[0].x;
+	const int n[3] = {int(Nx), int(Ny), int(Nz)};
+	const bool bricked = (layout == GridBricked);
+
+	// along each axis the offsets of the lower and upper neighbors and the
+	// fractions of 8 positions, the index of a corner is the sum of its
+	// offsets and the weight the product of its fractions
+	for (; vectorize and (start + 8 <= count); start += 8) {
+		__m256i off[3][2];
+		__m256 fr[3][2];
+		for (int d = 0; d < 3; d++) {
+			__m256i lo, N = _mm256_set1_epi32(n[d]);
+			floorFraction(positions + start, d, gridOrigin.data[d], spacing.data[d], lo, fr[d][1]);
+			fr[d][0] = _mm256_sub_ps(_mm256_set1_ps(1.f), fr[d][1]);
+
+			// periodic neighbors, the modulo only outside the grid
+			__m256i outside = _mm256_or_si256(_mm256_cmpgt_epi32(_mm256_setzero_si256(), lo),
+					_mm256_cmpgt_epi32(lo, _mm256_sub_epi32(N, _mm256_set1_epi32(1))));
+			if (not _mm256_testz_si256(outside, outside)) {
+				int32_t l[8];
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(l), lo);
+				for (int i = 0; i < 8; i++)
+					l[i] = periodicIndex(l[i], n[d]);
+				lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(l));
+			}
+			__m256i hi = _mm256_add_epi32(lo, _mm256_set1_epi32(1));
+			hi = _mm256_andnot_si256(_mm256_cmpeq_epi32(hi, N), hi);
+
+			for (int k = 0; k < 2; k++) {
+				__m256i i = k ? hi : lo;
+				if (bricked) {
+					// brick offset plus the offset inside the brick
+					int stride[3] = {int(NBy * NBz), int(NBz), 1};
+					int inner[3] = {6, 3, 0};
+					__m256i brick = _mm256_slli_epi32(_mm256_mullo_epi32(
+							_mm256_srli_epi32(i, 3), _mm256_set1_epi32(stride[d])), 9);
+					__m256i cell = _mm256_slli_epi32(_mm256_and_si256(i, _mm256_set1_epi32(7)), inner[d]);
+					off[d][k] = _mm256_or_si256(brick, cell);
+				} else {
+					int stride[3] = {int(Ny * Nz), int(Nz), 1};
+					off[d][k] = _mm256_mullo_epi32(i, _mm256_set1_epi32(stride[d]));
+				}
+			}
+		}
+
+		__m256 bx = _mm256_setzero_ps();
+		__m256 by = _mm256_setzero_ps();
+		__m256 bz = _mm256_setzero_ps();
+		for (int c = 0; c < 8; c++) {
+			int cx = (c >> 2) & 1, cy = (c >> 1) & 1, cz = c & 1;
+			__m256i k = _mm256_add_epi32(_mm256_add_epi32(off[0][cx], off[1][cy]), off[2][cz]);
+			k = _mm256_add_epi32(k, _mm256_add_epi32(k, k)); // 3 floats per value
+			__m256 w = _mm256_mul_ps(_mm256_mul_ps(fr[0][cx], fr[1][cy]), fr[2][cz]);
+			bx = _mm256_fmadd_ps(_mm256_i32gather_ps(data, k, 4), w, bx);
+			by = _mm256_fmadd_ps(_mm256_i32gather_ps(data + 1, k, 4), w, by);
+			bz = _mm256_fmadd_ps(_mm256_i32gather_ps(data + 2, k, 4), w, bz);
+		}
+
+		float b[3][8];
+		_mm256_storeu_ps(b[0], bx);
+		_mm256_storeu_ps(b[1], by);
+		_mm256_storeu_ps(b[2], bz);
+		for (int i = 0; i < 8; i++)
+			values[start + i] = Vector3f(b[0][i], b[1][i], b[2][i]);
+	}
+#endif // FAST_GRIDS
+
+	for (size_t i = start; i < count; i++)
+		values[i] = interpolate(positions[i]);
+}
+
+#ifdef __linux__
+// memory policies and flags of mbind, see linux/mempolicy.h
+static const int mpolBind = 2, mpolInterleave = 3;
+static const unsigned long mpolMoveFlag = 1 << 1;
+
+// the pages lying entirely inside the memory range
+static bool innerPages(void *data, size_t bytes, char *&begin, char *&end) {
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t b = (uintptr_t(data) + page - 1) / page * page;
+	uintptr_t e = (uintptr_t(data) + bytes) / page * page;
+	begin = reinterpret_cast<char*>(b);
+	end = reinterpret_cast<char*>(e);
+	return e > b;
+}
+
+// move the pages to the nodes under the memory policy
+static bool bindPages(char *begin, char *end, int policy, const std::vector<int> &nodes) {
+	const size_t bits = 8 * sizeof(unsigned long);
+	std::vector<unsigned long> mask(*std::max_element(nodes.begin(), nodes.end()) / bits + 1, 0);
+	for (size_t i = 0; i < nodes.size(); i++)
+		mask[nodes[i] / bits] |= 1UL << (nodes[i] % bits);
+	return syscall(SYS_mbind, begin, end - begin, policy, &mask[0], mask.size() * bits + 1,
+			mpolMoveFlag) == 0;
+}
+#endif
+
+std::vector<int> getNumaNodes() {
+	std::vector<int> nodes;
+#ifdef __linux__
+	// list of ranges, e.g. 0-1,4
+	std::ifstream in("/sys/devices/system/node/online");
+	std::string list, range;
+	std::getline(in, list);
+	std::stringstream ranges(list);
+	while (std::getline(ranges, range, ',')) {
+		int first, last;
+		char dash;
+		std::stringstream r(range);
+		if (not (r >> first))
+			continue;
+		if (not (r >> dash >> last))
+			last = first;
+		for (int n = first; n <= last; n++)
+			nodes.push_back(n);
+	}
+#endif
+	if (nodes.empty())
+		nodes.push_back(0);
+	return nodes;
+}
+
+int currentNumaNode() {
+#ifdef __linux__
+	static thread_local int node = -1;
+	if (node < 0) {
+		unsigned int cpu = 0, n = 0;
+		node = (syscall(SYS_getcpu, &cpu, &n, 0) == 0) ? int(n) : 0;
+	}
+	return node;
+#else
+	return 0;
+#endif
+}
+
+bool placeMemory(void *data, size_t bytes, GridPlacement placement) {
+	if (placement == GridPlacementDefault)
+		return true;
+#ifdef __linux__
+	char *begin, *end;
+	if (not innerPages(data, bytes, begin, end))
+		return false;
+	if (placement == GridInterleaved) {
+		std::vector<int> nodes = getNumaNodes();
+		return bindPages(begin, end, mpolInterleave, nodes);
+	}
+
+	// each thread copies its share out in pieces, discards the pages and
+	// writes them back, so that they are faulted in on its node; the pieces
+	// are aligned to huge pages, which can then be faulted in as well
+	const uintptr_t piece = 2 << 20;
+	uintptr_t base = uintptr_t(begin) / piece * piece;
+	long pieces = (uintptr_t(end) - base + piece - 1) / piece;
+	bool placed = true;
+#pragma omp parallel
+	{
+		std::vector<char> buffer(piece);
+#pragma omp for schedule(static)
+		for (long i = 0; i < pieces; i++) {
+			char *p = std::max(begin, reinterpret_cast<char*>(base + i * piece));
+			char *q = std::min(end, reinterpret_cast<char*>(base + (i + 1) * piece));
+			std::memcpy(&buffer[0], p, q - p);
+			if (madvise(p, q - p, MADV_DONTNEED) != 0) {
+#pragma omp atomic write
+				placed = false;
+			}
+			std::memcpy(p, &buffer[0], q - p);
+		}
+	}
+	return placed;
+#else
+	return false;
+#endif
+}
+
+bool placeMemoryOnNode(void *data, size_t bytes, int node) {
+#ifdef __linux__
+	char *begin, *end;
+	if (not innerPages(data, bytes, begin, end))
+		return false;
+	return bindPages(begin, end, mpolBind, std::vector<int>(1, node));
+#else
+	return false;
+#endif
+}
+
+bool adviseHugePages(void *data, size_t bytes, bool enable) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	char *begin, *end;
+	if (not innerPages(data, bytes, begin, end))
+		return false;
+	return madvise(begin, end - begin, enable ? MADV_HUGEPAGE : MADV_NOHUGEPAGE) == 0;
+#else
+	return false;
+#endif
+}
+
+} // namespace crpropa
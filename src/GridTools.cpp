@@ -1,133 +1,283 @@
 #include "crpropa/GridTools.h"
 #include "crpropa/magneticField/MagneticField.h"
+#include "crpropa/advectionField/AdvectionField.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <fstream>
 #include <sstream>
+#include <stdexcept>
+
+#ifdef CRPROPA_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef CRPROPA_HAVE_HDF5
+#include <hdf5.h>
+#endif
 
 namespace crpropa {
 
+// The reductions below run over the values of the grid, independent of the
+// layout, as the padding of the bricked layout is zero. The values are summed
+// in chunks of fixed size and the partial sums in order, so that the results
+// do not depend on the number of threads.
+static const size_t reductionChunk = 1 << 14;
+
+template<typename T, typename F>
+static double sumOf(const std::vector<T> &values, F f) {
+	size_t n = values.size();
+	size_t chunks = (n + reductionChunk - 1) / reductionChunk;
+	std::vector<double> partial(chunks);
+#pragma omp parallel for
+	for (long c = 0; c < long(chunks); c++) {
+		size_t end = std::min(n, (c + 1) * reductionChunk);
+		double sum = 0;
+#pragma omp simd reduction(+:sum)
+		for (size_t i = c * reductionChunk; i < end; i++)
+			sum += f(values[i]);
+		partial[c] = sum;
+	}
+	double sum = 0;
+	for (size_t c = 0; c < chunks; c++)
+		sum += partial[c];
+	return sum;
+}
+
+// as sumOf, for each component of a vector
+template<typename F>
+static Vector3d sumOf3(const std::vector<Vector3f> &values, F f) {
+	size_t n = values.size();
+	size_t chunks = (n + reductionChunk - 1) / reductionChunk;
+	std::vector<Vector3d> partial(chunks);
+#pragma omp parallel for
+	for (long c = 0; c < long(chunks); c++) {
+		size_t end = std::min(n, (c + 1) * reductionChunk);
+		double x = 0, y = 0, z = 0;
+#pragma omp simd reduction(+:x, y, z)
+		for (size_t i = c * reductionChunk; i < end; i++) {
+			const Vector3f &v = values[i];
+			x += f(v.x);
+			y += f(v.y);
+			z += f(v.z);
+		}
+		partial[c] = Vector3d(x, y, z);
+	}
+	Vector3d sum(0.);
+	for (size_t c = 0; c < chunks; c++)
+		sum += partial[c];
+	return sum;
+}
+
+template<typename T>
+static void scaleValues(std::vector<T> &values, double a) {
+	float b = a;
+#pragma omp parallel for simd
+	for (long i = 0; i < long(values.size()); i++)
+		values[i] *= b;
+}
+
 void scaleGrid(ref_ptr<Grid1f> grid, double a) {
-	for (int ix = 0; ix < grid->getNx(); ix++)
-		for (int iy = 0; iy < grid->getNy(); iy++)
-			for (int iz = 0; iz < grid->getNz(); iz++)
-				grid->get(ix, iy, iz) *= a;
+	scaleValues(grid->getGrid(), a);
 }
 
 void scaleGrid(ref_ptr<Grid3f> grid, double a) {
-	for (int ix = 0; ix < grid->getNx(); ix++)
-		for (int iy = 0; iy < grid->getNy(); iy++)
-			for (int iz = 0; iz < grid->getNz(); iz++)
-				grid->get(ix, iy, iz) *= a;
+	scaleValues(grid->getGrid(), a);
+}
+
+static double identity(double v) {
+	return v;
+}
+
+static double square(double v) {
+	return v * v;
 }
 
 Vector3f meanFieldVector(ref_ptr<Grid3f> grid) {
-	size_t Nx = grid->getNx();
-	size_t Ny = grid->getNy();
-	size_t Nz = grid->getNz();
-	Vector3f mean(0.);
-	for (int ix = 0; ix < Nx; ix++)
-		for (int iy = 0; iy < Ny; iy++)
-			for (int iz = 0; iz < Nz; iz++)
-				mean += grid->get(ix, iy, iz);
-	return mean / Nx / Ny / Nz;
+	size_t N = grid->getNx() * grid->getNy() * grid->getNz();
+	return Vector3f(sumOf3(grid->getGrid(), identity) / double(N));
 }
 
 double meanFieldStrength(ref_ptr<Grid3f> grid) {
-	size_t Nx = grid->getNx();
-	size_t Ny = grid->getNy();
-	size_t Nz = grid->getNz();
-	double mean = 0;
-	for (int ix = 0; ix < Nx; ix++)
-		for (int iy = 0; iy < Ny; iy++)
-			for (int iz = 0; iz < Nz; iz++)
-				mean += grid->get(ix, iy, iz).getR();
-	return mean / Nx / Ny / Nz;
+	size_t N = grid->getNx() * grid->getNy() * grid->getNz();
+	return sumOf(grid->getGrid(), [](const Vector3f &v) {
+		return std::sqrt(double(v.x) * v.x + double(v.y) * v.y + double(v.z) * v.z);
+	}) / N;
 }
 
 double meanFieldStrength(ref_ptr<Grid1f> grid) {
-	size_t Nx = grid->getNx();
-	size_t Ny = grid->getNy();
-	size_t Nz = grid->getNz();
-	double mean = 0;
-	for (int ix = 0; ix < Nx; ix++)
-		for (int iy = 0; iy < Ny; iy++)
-			for (int iz = 0; iz < Nz; iz++)
-				mean += grid->get(ix, iy, iz);
-	return mean / Nx / Ny / Nz;
+	size_t N = grid->getNx() * grid->getNy() * grid->getNz();
+	return sumOf(grid->getGrid(), identity) / N;
 }
 
 double rmsFieldStrength(ref_ptr<Grid3f> grid) {
-	size_t Nx = grid->getNx();
-	size_t Ny = grid->getNy();
-	size_t Nz = grid->getNz();
-	double sumV2 = 0;
-	for (int ix = 0; ix < Nx; ix++)
-		for (int iy = 0; iy < Ny; iy++)
-			for (int iz = 0; iz < Nz; iz++)
-				sumV2 += grid->get(ix, iy, iz).getR2();
-	return std::sqrt(sumV2 / Nx / Ny / Nz);
+	size_t N = grid->getNx() * grid->getNy() * grid->getNz();
+	return std::sqrt(sumOf(grid->getGrid(), [](const Vector3f &v) {
+		return double(v.x) * v.x + double(v.y) * v.y + double(v.z) * v.z;
+	}) / N);
 }
 
 double rmsFieldStrength(ref_ptr<Grid1f> grid) {
-	size_t Nx = grid->getNx();
-	size_t Ny = grid->getNy();
-	size_t Nz = grid->getNz();
-	double sumV2 = 0;
-	for (int ix = 0; ix < Nx; ix++)
-		for (int iy = 0; iy < Ny; iy++)
-			for (int iz = 0; iz < Nz; iz++)
-				sumV2 += pow(grid->get(ix, iy, iz), 2);
-	return std::sqrt(sumV2 / Nx / Ny / Nz);
+	size_t N = grid->getNx() * grid->getNy() * grid->getNz();
+	return std::sqrt(sumOf(grid->getGrid(), square) / N);
 }
 
 std::array<float, 3> rmsFieldStrengthPerAxis(ref_ptr<Grid3f> grid) {
-    size_t Nx = grid->getNx();
-    size_t Ny = grid->getNy();
-    size_t Nz = grid->getNz();
-    float sumV2_x = 0;
-    float sumV2_y = 0;
-    float sumV2_z = 0;
-    for (int ix = 0; ix < Nx; ix++)
-        for (int iy = 0; iy < Ny; iy++)
-            for (int iz = 0; iz < Nz; iz++) {
-                sumV2_x += pow(grid->get(ix, iy, iz).x, 2);
-                sumV2_y += pow(grid->get(ix, iy, iz).y, 2);
-                sumV2_z += pow(grid->get(ix, iy, iz).z, 2);
-            }
-    return {
-        std::sqrt(sumV2_x / Nx / Ny / Nz),
-        std::sqrt(sumV2_y / Nx / Ny / Nz),
-        std::sqrt(sumV2_z / Nx / Ny / Nz)
-    };
+	size_t N = grid->getNx() * grid->getNy() * grid->getNz();
+	Vector3d sumV2 = sumOf3(grid->getGrid(), square);
+	return {
+		float(std::sqrt(sumV2.x / N)),
+		float(std::sqrt(sumV2.y / N)),
+		float(std::sqrt(sumV2.z / N))
+	};
 }
 
-void fromMagneticField(ref_ptr<Grid3f> grid, ref_ptr<MagneticField> field) {
-	Vector3d origin = grid->getOrigin();
-	Vector3d spacing = grid->getSpacing();
-	size_t Nx = grid->getNx();
-	size_t Ny = grid->getNy();
-	size_t Nz = grid->getNz();
-	for (size_t ix = 0; ix < Nx; ix++)
-		for (size_t iy = 0; iy < Ny; iy++)
-			for (size_t iz = 0; iz < Nz; iz++) {
-				Vector3d pos = Vector3d(double(ix) + 0.5, double(iy) + 0.5, double(iz) + 0.5) * spacing + origin;
-				Vector3d B = field->getField(pos);
-				grid->get(ix, iy, iz) = B;
+// number of positions per call of MagneticField::getFields
+static const size_t fieldBatch = 4096;
+
+// Sets the grid from the field at the cell centres, converted by the given
+// function. The field is evaluated in parallel, in batches of rows along z.
+template<typename T, typename F>
+static void fromField(Grid<T> &grid, const MagneticField *field, F convert) {
+	Vector3d origin = grid.getOrigin();
+	Vector3d spacing = grid.getSpacing();
+	size_t Ny = grid.getNy();
+	size_t Nz = grid.getNz();
+	size_t rows = grid.getNx() * Ny;
+	size_t batch = std::max(size_t(1), fieldBatch / Nz);
+	long batches = (rows + batch - 1) / batch;
+#pragma omp parallel
+	{
+		std::vector<Vector3d> positions, fields;
+		std::vector<double> z;
+#pragma omp for schedule(dynamic)
+		for (long b = 0; b < batches; b++) {
+			size_t r0 = b * batch, r1 = std::min(rows, r0 + batch);
+			size_t count = (r1 - r0) * Nz;
+			positions.resize(count);
+			fields.resize(count);
+			z.assign(count, 0);
+			for (size_t r = r0, k = 0; r < r1; r++)
+				for (size_t iz = 0; iz < Nz; iz++, k++)
+					positions[k] = Vector3d(double(r / Ny) + 0.5, double(r % Ny) + 0.5,
+							double(iz) + 0.5) * spacing + origin;
+			field->getFields(&positions[0], &z[0], &fields[0], count);
+			for (size_t r = r0, k = 0; r < r1; r++)
+				for (size_t iz = 0; iz < Nz; iz++, k++)
+					grid.get(r / Ny, r % Ny, iz) = convert(fields[k]);
+		}
 	}
 }
 
+void fromMagneticField(ref_ptr<Grid3f> grid, ref_ptr<MagneticField> field) {
+	fromField(*grid, field, [](const Vector3d &b) {
+		return Vector3f(b);
+	});
+}
+
+void fromMagneticFieldDirection(ref_ptr<Grid3f> grid, ref_ptr<MagneticField> field) {
+	fromField(*grid, field, [](const Vector3d &b) {
+		double r = b.getR();
+		return (r > 0) ? Vector3f(b / r) : Vector3f(0.);
+	});
+}
+
 void fromMagneticFieldStrength(ref_ptr<Grid1f> grid, ref_ptr<MagneticField> field) {
-	Vector3d origin = grid->getOrigin();
+	fromField(*grid, field, [](const Vector3d &b) {
+		return float(b.getR());
+	});
+}
+
+// As fromField for the velocity and divergence of an advection field
+template<typename T, typename F>
+static void fromAdvection(Grid<T> &grid, const AdvectionField *field, F convert) {
+	Vector3d origin = grid.getOrigin();
+	Vector3d spacing = grid.getSpacing();
+	size_t Ny = grid.getNy();
+	size_t Nz = grid.getNz();
+	size_t rows = grid.getNx() * Ny;
+	size_t batch = std::max(size_t(1), fieldBatch / Nz);
+	long batches = (rows + batch - 1) / batch;
+#pragma omp parallel
+	{
+		std::vector<Vector3d> positions, fields;
+		std::vector<double> divergences;
+#pragma omp for schedule(dynamic)
+		for (long b = 0; b < batches; b++) {
+			size_t r0 = b * batch, r1 = std::min(rows, r0 + batch);
+			size_t count = (r1 - r0) * Nz;
+			positions.resize(count);
+			fields.resize(count);
+			divergences.resize(count);
+			for (size_t r = r0, k = 0; r < r1; r++)
+				for (size_t iz = 0; iz < Nz; iz++, k++)
+					positions[k] = Vector3d(double(r / Ny) + 0.5, double(r % Ny) + 0.5,
+							double(iz) + 0.5) * spacing + origin;
+			field->getFieldsAndDivergences(&positions[0], &fields[0], &divergences[0], count);
+			for (size_t r = r0, k = 0; r < r1; r++)
+				for (size_t iz = 0; iz < Nz; iz++, k++)
+					grid.get(r / Ny, r % Ny, iz) = convert(fields[k], divergences[k]);
+		}
+	}
+}
+
+void fromAdvectionField(ref_ptr<Grid3f> grid, ref_ptr<AdvectionField> field) {
+	fromAdvection(*grid, field, [](const Vector3d &v, double d) {
+		return Vector3f(v);
+	});
+}
+
+void fromAdvectionFieldDivergence(ref_ptr<Grid1f> grid, ref_ptr<AdvectionField> field) {
+	fromAdvection(*grid, field, [](const Vector3d &v, double d) {
+		return float(d);
+	});
+}
+
+// lower and upper neighbour of grid point i of n along an axis and the
+// inverse of their distance in units of the spacing
+static void differenceStencil(size_t i, size_t n, bool reflective, size_t &lo, size_t &hi,
+		double &inverse) {
+	if (n == 1) {
+		lo = hi = 0;
+		inverse = 0;
+	} else if (not reflective) {
+		lo = (i + n - 1) % n;
+		hi = (i + 1) % n;
+		inverse = 0.5;
+	} else {
+		lo = (i == 0) ? 0 : i - 1;
+		hi = (i == n - 1) ? i : i + 1;
+		inverse = 1. / (hi - lo);
+	}
+}
+
+void computeDivergence(ref_ptr<Grid3f> grid, ref_ptr<Grid1f> divergence) {
+	size_t Nx = grid->getNx(), Ny = grid->getNy(), Nz = grid->getNz();
+	if ((divergence->getNx() != Nx) or (divergence->getNy() != Ny) or (divergence->getNz() != Nz))
+		throw std::runtime_error("computeDivergence: the grids differ in shape");
 	Vector3d spacing = grid->getSpacing();
-	size_t Nx = grid->getNx();
-	size_t Ny = grid->getNy();
-	size_t Nz = grid->getNz();
-	for (size_t ix = 0; ix < Nx; ix++)
-		for (size_t iy = 0; iy < Ny; iy++)
+	bool reflective = grid->isReflective();
+	const Grid3f &v = *grid;
+	Grid1f &d = *divergence;
+
+#pragma omp parallel for schedule(static)
+	for (long ix = 0; ix < long(Nx); ix++) {
+		size_t xlo, xhi, ylo, yhi, zlo, zhi;
+		double fx, fy, fz;
+		differenceStencil(ix, Nx, reflective, xlo, xhi, fx);
+		fx /= spacing.x;
+		for (size_t iy = 0; iy < Ny; iy++) {
+			differenceStencil(iy, Ny, reflective, ylo, yhi, fy);
+			fy /= spacing.y;
 			for (size_t iz = 0; iz < Nz; iz++) {
-				Vector3d pos = Vector3d(double(ix) + 0.5, double(iy) + 0.5, double(iz) + 0.5) * spacing + origin;
-				double s = field->getField(pos).getR();
-				grid->get(ix, iy, iz) = s;
+				differenceStencil(iz, Nz, reflective, zlo, zhi, fz);
+				fz /= spacing.z;
+				d.get(ix, iy, iz) = (v.get(xhi, iy, iz).x - v.get(xlo, iy, iz).x) * fx
+						+ (v.get(ix, yhi, iz).y - v.get(ix, ylo, iz).y) * fy
+						+ (v.get(ix, iy, zhi).z - v.get(ix, iy, zlo).z) * fz;
+			}
+		}
 	}
 }
 
@@ -321,92 +471,514 @@ void dumpGridToTxt(ref_ptr<Grid1f> grid, std::string filename, double c) {
 	fout.close();
 }
 
+// Grid files: a header with the shape, origin, spacing and reflective flag,
+// then a table with the offset, stored size and CRC-32 of every tile of
+// gridFileTile^3 points and finally the compressed tiles. The CRC-32 of the
+// header and table follows the table. Within a tile the points are stored
+// with z fastest, the vector components in xyz-order.
+static const char gridFileMagic[8] = {'C', 'R', 'P', 'G', 'R', 'I', 'D', '1'};
+static const uint32_t gridFileTile = 64;
+
+struct GridFileHeader {
+	char magic[8];
+	uint32_t components, tile;
+	uint64_t N[3];
+	double origin[3], spacing[3];
+	uint8_t reflective, compression, pad[6];
+	uint64_t nTiles;
+};
+
+struct GridFileTile {
+	uint64_t offset, size;
+	uint32_t crc, pad;
+};
+
+static uint32_t gridFileCRC(const void *data, size_t size, uint32_t crc = 0) {
+#ifdef CRPROPA_HAVE_ZLIB
+	const Bytef *p = (const Bytef *) data;
+	// zlib's crc32 takes at most 4 GB per call
+	while (size > 0) {
+		uInt n = std::min(size, size_t(1) << 30);
+		crc = ::crc32(crc, p, n);
+		p += n;
+		size -= n;
+	}
+	return crc;
+#else
+	static uint32_t table[256];
+	static bool initialized = false;
+#pragma omp critical(gridFileCRC)
+	if (!initialized) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+		initialized = true;
+	}
+	const unsigned char *p = (const unsigned char *) data;
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++)
+		crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+#endif
+}
+
+// range of points in each dimension of a tile
+static void gridFileTileRange(const GridFileHeader &h, uint64_t t, size_t lo[3], size_t hi[3]) {
+	size_t T = h.tile;
+	size_t n[3];
+	for (int d = 0; d < 3; d++)
+		n[d] = (h.N[d] + T - 1) / T;
+	size_t index[3] = {size_t(t / (n[1] * n[2])), size_t((t / n[2]) % n[1]), size_t(t % n[2])};
+	for (int d = 0; d < 3; d++) {
+		lo[d] = index[d] * T;
+		hi[d] = std::min(size_t(h.N[d]), lo[d] + T);
+	}
+}
+
+template<typename T>
+static void writeGridFile(Grid<T> &grid, const std::string &filename, double c, int level) {
+	std::ofstream fout(filename.c_str(), std::ios::binary);
+	if (!fout)
+		throw std::runtime_error("writeGrid: could not open " + filename);
+
+	GridFileHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, gridFileMagic, sizeof(h.magic));
+	h.components = sizeof(T) / sizeof(float);
+	h.tile = gridFileTile;
+	h.N[0] = grid.getNx();
+	h.N[1] = grid.getNy();
+	h.N[2] = grid.getNz();
+	Vector3d origin = grid.getOrigin(), spacing = grid.getSpacing();
+	for (int d = 0; d < 3; d++) {
+		h.origin[d] = origin.data[d];
+		h.spacing[d] = spacing.data[d];
+	}
+	h.reflective = grid.isReflective();
+#ifdef CRPROPA_HAVE_ZLIB
+	h.compression = (level > 0) ? 1 : 0;
+#endif
+	h.nTiles = 1;
+	for (int d = 0; d < 3; d++)
+		h.nTiles *= (h.N[d] + h.tile - 1) / h.tile;
+
+	std::vector<GridFileTile> table(h.nTiles);
+	uint64_t offset = sizeof(h) + sizeof(GridFileTile) * h.nTiles + sizeof(uint32_t);
+	fout.seekp(offset);
+
+	// the tiles are compressed in parallel, in batches written in order
+	const long batch = 64;
+	std::vector<std::vector<char> > stored(batch);
+	for (uint64_t t0 = 0; t0 < h.nTiles; t0 += batch) {
+		long n = std::min(uint64_t(batch), h.nTiles - t0);
+		bool failed = false;
+#pragma omp parallel for schedule(dynamic)
+		for (long i = 0; i < n; i++) {
+			size_t lo[3], hi[3];
+			gridFileTileRange(h, t0 + i, lo, hi);
+			std::vector<T> values;
+			values.reserve((hi[0] - lo[0]) * (hi[1] - lo[1]) * (hi[2] - lo[2]));
+			for (size_t ix = lo[0]; ix < hi[0]; ix++)
+				for (size_t iy = lo[1]; iy < hi[1]; iy++)
+					for (size_t iz = lo[2]; iz < hi[2]; iz++)
+						values.push_back(grid.get(ix, iy, iz) * c);
+			size_t size = values.size() * sizeof(T);
+			table[t0 + i].crc = gridFileCRC(&values[0], size);
+			std::vector<char> &out = stored[i];
+#ifdef CRPROPA_HAVE_ZLIB
+			if (h.compression) {
+				uLongf length = compressBound(size);
+				out.resize(length);
+				if (compress2((Bytef *) &out[0], &length, (const Bytef *) &values[0], size, level) != Z_OK) {
+#pragma omp atomic write
+					failed = true;
+				}
+				out.resize(length);
+				continue;
+			}
+#endif
+			out.assign((const char *) &values[0], (const char *) &values[0] + size);
+		}
+		if (failed)
+			throw std::runtime_error("writeGrid: compression failed");
+		for (long i = 0; i < n; i++) {
+			table[t0 + i].offset = offset;
+			table[t0 + i].size = stored[i].size();
+			fout.write(&stored[i][0], stored[i].size());
+			offset += stored[i].size();
+		}
+	}
+
+	uint32_t crc = gridFileCRC(&h, sizeof(h));
+	crc = gridFileCRC(&table[0], sizeof(GridFileTile) * h.nTiles, crc);
+	fout.seekp(0);
+	fout.write((const char *) &h, sizeof(h));
+	fout.write((const char *) &table[0], sizeof(GridFileTile) * h.nTiles);
+	fout.write((const char *) &crc, sizeof(crc));
+	if (!fout)
+		throw std::runtime_error("writeGrid: could not write " + filename);
+}
+
+static void readGridFileHeader(std::ifstream &fin, const std::string &filename,
+		uint32_t components, GridFileHeader &h, std::vector<GridFileTile> &table) {
+	if (!fin)
+		throw std::runtime_error("readGrid: " + filename + " not found");
+	fin.read((char *) &h, sizeof(h));
+	if (!fin || memcmp(h.magic, gridFileMagic, sizeof(h.magic)) != 0)
+		throw std::runtime_error("readGrid: " + filename + " is not a grid file");
+	if (h.components != components)
+		throw std::runtime_error("readGrid: " + filename + " has a different number of components");
+	if ((h.tile == 0) || (h.nTiles > (uint64_t(1) << 40)))
+		throw std::runtime_error("readGrid: " + filename + " is corrupt");
+	table.resize(h.nTiles);
+	uint32_t crc = 0;
+	fin.read((char *) &table[0], sizeof(GridFileTile) * h.nTiles);
+	fin.read((char *) &crc, sizeof(crc));
+	uint32_t expected = gridFileCRC(&h, sizeof(h));
+	expected = gridFileCRC(&table[0], sizeof(GridFileTile) * h.nTiles, expected);
+	if (!fin || (crc != expected))
+		throw std::runtime_error("readGrid: corrupt header in " + filename);
+#ifndef CRPROPA_HAVE_ZLIB
+	if (h.compression)
+		throw std::runtime_error("readGrid: " + filename + " is compressed, CRPropa was built without zlib");
+#endif
+}
+
+template<typename T>
+static ref_ptr<Grid<T> > readGridFile(const std::string &filename, const size_t lower[3],
+		const size_t *count, double c) {
+	std::ifstream fin(filename.c_str(), std::ios::binary);
+	GridFileHeader h;
+	std::vector<GridFileTile> table;
+	readGridFileHeader(fin, filename, sizeof(T) / sizeof(float), h, table);
+
+	size_t lo[3], n[3];
+	for (int d = 0; d < 3; d++) {
+		lo[d] = count ? lower[d] : 0;
+		n[d] = count ? count[d] : h.N[d];
+		if ((n[d] == 0) || (lo[d] + n[d] > h.N[d]))
+			throw std::runtime_error("readGrid: region outside of the grid in " + filename);
+	}
+	Vector3d spacing(h.spacing[0], h.spacing[1], h.spacing[2]);
+	Vector3d origin = Vector3d(h.origin[0], h.origin[1], h.origin[2])
+			+ Vector3d(lo[0], lo[1], lo[2]) * spacing;
+	ref_ptr<Grid<T> > grid = new Grid<T>(origin, n[0], n[1], n[2], spacing);
+	grid->setReflective(h.reflective);
+
+	// only the tiles that overlap with the region
+	std::vector<uint64_t> tiles;
+	for (uint64_t t = 0; t < h.nTiles; t++) {
+		size_t tlo[3], thi[3];
+		gridFileTileRange(h, t, tlo, thi);
+		bool overlap = true;
+		for (int d = 0; d < 3; d++)
+			overlap = overlap && (tlo[d] < lo[d] + n[d]) && (thi[d] > lo[d]);
+		if (overlap)
+			tiles.push_back(t);
+	}
+
+	// read in batches, decompressed and checked in parallel
+	const size_t batch = 64;
+	std::vector<std::vector<char> > stored(batch);
+	for (size_t t0 = 0; t0 < tiles.size(); t0 += batch) {
+		long m = std::min(batch, tiles.size() - t0);
+		for (long i = 0; i < m; i++) {
+			const GridFileTile &tile = table[tiles[t0 + i]];
+			stored[i].resize(tile.size);
+			fin.seekg(tile.offset);
+			fin.read(&stored[i][0], tile.size);
+			if (!fin)
+				throw std::runtime_error("readGrid: " + filename + " is truncated");
+		}
+		bool failed = false;
+#pragma omp parallel for schedule(dynamic)
+		for (long i = 0; i < m; i++) {
+			const GridFileTile &tile = table[tiles[t0 + i]];
+			size_t tlo[3], thi[3];
+			gridFileTileRange(h, tiles[t0 + i], tlo, thi);
+			std::vector<T> values((thi[0] - tlo[0]) * (thi[1] - tlo[1]) * (thi[2] - tlo[2]));
+			size_t size = values.size() * sizeof(T);
+			bool ok = true;
+#ifdef CRPROPA_HAVE_ZLIB
+			if (h.compression) {
+				uLongf length = size;
+				ok = (uncompress((Bytef *) &values[0], &length, (const Bytef *) &stored[i][0],
+						tile.size) == Z_OK) && (length == size);
+			} else
+#endif
+			{
+				ok = (tile.size == size);
+				if (ok)
+					memcpy(&values[0], &stored[i][0], size);
+			}
+			if (!ok || (gridFileCRC(&values[0], size) != tile.crc)) {
+#pragma omp atomic write
+				failed = true;
+				continue;
+			}
+			size_t k = 0;
+			for (size_t ix = tlo[0]; ix < thi[0]; ix++)
+				for (size_t iy = tlo[1]; iy < thi[1]; iy++)
+					for (size_t iz = tlo[2]; iz < thi[2]; iz++, k++) {
+						if ((ix < lo[0]) || (ix >= lo[0] + n[0]) || (iy < lo[1])
+								|| (iy >= lo[1] + n[1]) || (iz < lo[2]) || (iz >= lo[2] + n[2]))
+							continue;
+						grid->get(ix - lo[0], iy - lo[1], iz - lo[2]) = values[k] * c;
+					}
+		}
+		if (failed)
+			throw std::runtime_error("readGrid: checksum mismatch in " + filename);
+	}
+	return grid;
+}
+
+void writeGrid(ref_ptr<Grid3f> grid, std::string filename, double c, int level) {
+	writeGridFile(*grid, filename, c, level);
+}
+
+void writeGrid(ref_ptr<Grid1f> grid, std::string filename, double c, int level) {
+	writeGridFile(*grid, filename, c, level);
+}
+
+ref_ptr<Grid3f> readGrid3f(std::string filename, double c) {
+	return readGridFile<Vector3f>(filename, NULL, NULL, c);
+}
+
+ref_ptr<Grid1f> readGrid1f(std::string filename, double c) {
+	return readGridFile<float>(filename, NULL, NULL, c);
+}
+
+ref_ptr<Grid3f> readGrid3f(std::string filename, size_t ix, size_t iy, size_t iz,
+		size_t nx, size_t ny, size_t nz, double c) {
+	size_t lower[3] = {ix, iy, iz}, count[3] = {nx, ny, nz};
+	return readGridFile<Vector3f>(filename, lower, count, c);
+}
+
+ref_ptr<Grid1f> readGrid1f(std::string filename, size_t ix, size_t iy, size_t iz,
+		size_t nx, size_t ny, size_t nz, double c) {
+	size_t lower[3] = {ix, iy, iz}, count[3] = {nx, ny, nz};
+	return readGridFile<float>(filename, lower, count, c);
+}
+
+#ifdef CRPROPA_HAVE_HDF5
+// closes an HDF5 identifier when leaving the scope
+class H5Handle {
+	hid_t id;
+	herr_t (*close)(hid_t);
+public:
+	H5Handle(hid_t id, herr_t (*close)(hid_t)) : id(id), close(close) {
+	}
+	~H5Handle() {
+		if (id >= 0)
+			close(id);
+	}
+	operator hid_t() const {
+		return id;
+	}
+};
+
+// number of planes along x that are read or written at once
+static const hsize_t hdf5Slab = 32;
+
+template<typename T>
+static void dumpGridHDF5File(Grid<T> &grid, const std::string &filename,
+		const std::string &dataset, double c, int level) {
+	const int components = sizeof(T) / sizeof(float);
+	int rank = (components == 1) ? 3 : 4;
+	hsize_t dims[4] = {grid.getNx(), grid.getNy(), grid.getNz(), hsize_t(components)};
+	hsize_t chunk[4];
+	for (int d = 0; d < 4; d++)
+		chunk[d] = std::min(dims[d], (d < 3) ? hdf5Slab : dims[d]);
+
+	H5Handle file(H5Fcreate(filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT), H5Fclose);
+	if (file < 0)
+		throw std::runtime_error("dumpGridHDF5: could not create " + filename);
+	H5Handle plist(H5Pcreate(H5P_DATASET_CREATE), H5Pclose);
+	H5Pset_chunk(plist, rank, chunk);
+	if ((level > 0) && H5Zfilter_avail(H5Z_FILTER_DEFLATE)) {
+		H5Pset_shuffle(plist);
+		H5Pset_deflate(plist, level);
+	}
+	H5Handle space(H5Screate_simple(rank, dims, NULL), H5Sclose);
+	H5Handle dset(H5Dcreate2(file, dataset.c_str(), H5T_NATIVE_FLOAT, space, H5P_DEFAULT,
+			plist, H5P_DEFAULT), H5Dclose);
+	if (dset < 0)
+		throw std::runtime_error("dumpGridHDF5: could not create " + dataset + " in " + filename);
+
+	// the properties of the grid as attributes
+	Vector3d origin = grid.getOrigin(), spacing = grid.getSpacing();
+	int reflective = grid.isReflective();
+	hsize_t three = 3;
+	H5Handle vspace(H5Screate_simple(1, &three, NULL), H5Sclose);
+	H5Handle sspace(H5Screate(H5S_SCALAR), H5Sclose);
+	H5Handle aorigin(H5Acreate2(dset, "origin", H5T_NATIVE_DOUBLE, vspace, H5P_DEFAULT, H5P_DEFAULT), H5Aclose);
+	H5Awrite(aorigin, H5T_NATIVE_DOUBLE, origin.data);
+	H5Handle aspacing(H5Acreate2(dset, "spacing", H5T_NATIVE_DOUBLE, vspace, H5P_DEFAULT, H5P_DEFAULT), H5Aclose);
+	H5Awrite(aspacing, H5T_NATIVE_DOUBLE, spacing.data);
+	H5Handle areflective(H5Acreate2(dset, "reflective", H5T_NATIVE_INT, sspace, H5P_DEFAULT, H5P_DEFAULT), H5Aclose);
+	H5Awrite(areflective, H5T_NATIVE_INT, &reflective);
+
+	// slabs of planes along x, copied in parallel
+	size_t Ny = dims[1], Nz = dims[2];
+	std::vector<T> buffer;
+	for (hsize_t x0 = 0; x0 < dims[0]; x0 += hdf5Slab) {
+		hsize_t count[4] = {std::min(hdf5Slab, dims[0] - x0), dims[1], dims[2], dims[3]};
+		hsize_t offset[4] = {x0, 0, 0, 0};
+		buffer.resize(count[0] * Ny * Nz);
+#pragma omp parallel for
+		for (long i = 0; i < long(count[0] * Ny); i++)
+			for (size_t iz = 0; iz < Nz; iz++)
+				buffer[i * Nz + iz] = grid.get(x0 + i / Ny, i % Ny, iz) * c;
+		H5Handle memspace(H5Screate_simple(rank, count, NULL), H5Sclose);
+		H5Sselect_hyperslab(space, H5S_SELECT_SET, offset, NULL, count, NULL);
+		if (H5Dwrite(dset, H5T_NATIVE_FLOAT, memspace, space, H5P_DEFAULT, &buffer[0]) < 0)
+			throw std::runtime_error("dumpGridHDF5: could not write " + filename);
+	}
+}
+
+template<typename T>
+static void loadGridHDF5File(Grid<T> &grid, const std::string &filename,
+		const std::string &dataset, const hsize_t lower[3], double c) {
+	const int components = sizeof(T) / sizeof(float);
+	int rank = (components == 1) ? 3 : 4;
+
+	H5Handle file(H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT), H5Fclose);
+	if (file < 0)
+		throw std::runtime_error("loadGridHDF5: could not open " + filename);
+	H5Handle dset(H5Dopen2(file, dataset.c_str(), H5P_DEFAULT), H5Dclose);
+	if (dset < 0)
+		throw std::runtime_error("loadGridHDF5: no dataset " + dataset + " in " + filename);
+	H5Handle space(H5Dget_space(dset), H5Sclose);
+	hsize_t dims[4] = {0, 0, 0, 1};
+	if ((H5Sget_simple_extent_ndims(space) != rank) || (H5Sget_simple_extent_dims(space, dims, NULL) < 0)
+			|| (dims[3] != hsize_t(components)))
+		throw std::runtime_error("loadGridHDF5: dataset " + dataset + " does not match the grid type");
+	size_t Ny = grid.getNy(), Nz = grid.getNz();
+	hsize_t n[3] = {grid.getNx(), Ny, Nz};
+	for (int d = 0; d < 3; d++)
+		if (lower[d] + n[d] > dims[d])
+			throw std::runtime_error("loadGridHDF5: region outside of the dataset " + dataset);
+
+	// the values are converted to float by HDF5
+	std::vector<T> buffer;
+	for (hsize_t x0 = 0; x0 < n[0]; x0 += hdf5Slab) {
+		hsize_t count[4] = {std::min(hdf5Slab, n[0] - x0), n[1], n[2], dims[3]};
+		hsize_t offset[4] = {lower[0] + x0, lower[1], lower[2], 0};
+		buffer.resize(count[0] * Ny * Nz);
+		H5Handle memspace(H5Screate_simple(rank, count, NULL), H5Sclose);
+		H5Sselect_hyperslab(space, H5S_SELECT_SET, offset, NULL, count, NULL);
+		if (H5Dread(dset, H5T_NATIVE_FLOAT, memspace, space, H5P_DEFAULT, &buffer[0]) < 0)
+			throw std::runtime_error("loadGridHDF5: could not read " + filename);
+#pragma omp parallel for
+		for (long i = 0; i < long(count[0] * Ny); i++)
+			for (size_t iz = 0; iz < Nz; iz++)
+				grid.get(x0 + i / Ny, i % Ny, iz) = buffer[i * Nz + iz] * c;
+	}
+}
+
+void dumpGridHDF5(ref_ptr<Grid3f> grid, std::string filename, std::string dataset, double c,
+		int level) {
+	dumpGridHDF5File(*grid, filename, dataset, c, level);
+}
+
+void dumpGridHDF5(ref_ptr<Grid1f> grid, std::string filename, std::string dataset, double c,
+		int level) {
+	dumpGridHDF5File(*grid, filename, dataset, c, level);
+}
+
+void loadGridHDF5(ref_ptr<Grid3f> grid, std::string filename, std::string dataset, double c) {
+	hsize_t lower[3] = {0, 0, 0};
+	loadGridHDF5File(*grid, filename, dataset, lower, c);
+}
+
+void loadGridHDF5(ref_ptr<Grid1f> grid, std::string filename, std::string dataset, double c) {
+	hsize_t lower[3] = {0, 0, 0};
+	loadGridHDF5File(*grid, filename, dataset, lower, c);
+}
+
+void loadGridHDF5(ref_ptr<Grid3f> grid, std::string filename, std::string dataset,
+		size_t ix, size_t iy, size_t iz, double c) {
+	hsize_t lower[3] = {ix, iy, iz};
+	loadGridHDF5File(*grid, filename, dataset, lower, c);
+}
+
+void loadGridHDF5(ref_ptr<Grid1f> grid, std::string filename, std::string dataset,
+		size_t ix, size_t iy, size_t iz, double c) {
+	hsize_t lower[3] = {ix, iy, iz};
+	loadGridHDF5File(*grid, filename, dataset, lower, c);
+}
+#endif // CRPROPA_HAVE_HDF5
+
 #ifdef CRPROPA_HAVE_FFTW3F
 
 std::vector<std::pair<int, float>> gridPowerSpectrum(ref_ptr<Grid3f> grid) {
+	double rms = rmsFieldStrength(grid);
+	size_t n = grid->getNx(); // size of array
+	size_t n2 = n / 2 + 1;
+	size_t N = n * n * n, Nk = n * n * n2;
+
+	// the components of B(x) one after the other, transformed in one plan
+	float *B = (float *)fftwf_malloc(sizeof(float) * 3 * N);
+	fftwf_complex *Bk = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * 3 * Nk);
+	if (!B || !Bk) {
+		fftwf_free(B);
+		fftwf_free(Bk);
+		throw std::runtime_error("gridPowerSpectrum: could not allocate memory");
+	}
+
+#pragma omp parallel for
+	for (long ix = 0; ix < long(n); ix++)
+		for (size_t iy = 0; iy < n; iy++)
+			for (size_t iz = 0; iz < n; iz++) {
+				size_t i = (ix * n + iy) * n + iz;
+				const Vector3f &b = grid->get(ix, iy, iz);
+				B[i] = b.x / rms;
+				B[N + i] = b.y / rms;
+				B[2 * N + i] = b.z / rms;
+			}
 
-  double rms = rmsFieldStrength(grid);
-  size_t n = grid->getNx(); // size of array
-
-  // arrays to hold the complex vector components of the B(k)-field
-  fftwf_complex *Bkx, *Bky, *Bkz;
-  Bkx = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * n * n * n);
-  Bky = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * n * n * n);
-  Bkz = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * n * n * n);
-
-  fftwf_complex *Bx = (fftwf_complex *)Bkx;
-  fftwf_complex *By = (fftwf_complex *)Bky;
-  fftwf_complex *Bz = (fftwf_complex *)Bkz;
-
-  // save to temp
-  int i;
-  for (size_t ix = 0; ix < n; ix++) {
-    for (size_t iy = 0; iy < n; iy++) {
-      for (size_t iz = 0; iz < n; iz++) {
-        i = ix * n * n + iy * n + iz;
-        Vector3<float> &b = grid->get(ix, iy, iz);
-        Bx[i][0] = b.x / rms;
-        By[i][0] = b.y / rms;
-        Bz[i][0] = b.z / rms;
-      }
-    }
-  }
-
-  // in-place, real to complex, inverse Fourier transformation on each component
-  // note that the last elements of B(x) are unused now
-  fftwf_plan plan_x =
-      fftwf_plan_dft_3d(n, n, n, Bx, Bkx, FFTW_FORWARD, FFTW_ESTIMATE);
-  fftwf_execute(plan_x);
-  fftwf_destroy_plan(plan_x);
-
-  fftwf_plan plan_y =
-      fftwf_plan_dft_3d(n, n, n, By, Bky, FFTW_FORWARD, FFTW_ESTIMATE);
-  fftwf_execute(plan_y);
-  fftwf_destroy_plan(plan_y);
-
-  fftwf_plan plan_z =
-      fftwf_plan_dft_3d(n, n, n, Bz, Bkz, FFTW_FORWARD, FFTW_ESTIMATE);
-  fftwf_execute(plan_z);
-  fftwf_destroy_plan(plan_z);
-
-  float power;
-  std::map<size_t, std::pair<float, int>> spectrum;
-  int k;
-
-  for (size_t ix = 0; ix < n; ix++) {
-    for (size_t iy = 0; iy < n; iy++) {
-      for (size_t iz = 0; iz < n; iz++) {
-        i = ix * n * n + iy * n + iz;
-        k = static_cast<int>(
-            std::floor(std::sqrt(ix * ix + iy * iy + iz * iz)));
-        if (k > n / 2. || k == 0)
-          continue;
-        power = ((Bkx[i][0] * Bkx[i][0] + Bkx[i][1] * Bkx[i][1]) +
-                 (Bky[i][0] * Bky[i][0] + Bky[i][1] * Bky[i][1]) +
-                 (Bkz[i][0] * Bkz[i][0] + Bkz[i][1] * Bkz[i][1]));
-        if (spectrum.find(k) == spectrum.end()) {
-          spectrum[k].first = power;
-          spectrum[k].second = 1;
-        } else {
-          spectrum[k].first += power;
-          spectrum[k].second += 1;
-        }
-      }
-    }
-  }
-
-  fftwf_free(Bkx);
-  fftwf_free(Bky);
-  fftwf_free(Bkz);
-
-  std::vector<std::pair<int, float>> points;
-  for (std::map<size_t, std::pair<float, int>>::iterator it = spectrum.begin();
-       it != spectrum.end(); ++it) {
-    points.push_back(
-        std::make_pair(it->first, (it->second).first / (it->second).second));
-  }
-
-  return points;
+	// real to complex, only the modes kz <= n / 2 are needed for the spectrum
+	int dims[3] = {int(n), int(n), int(n)};
+	fftwf_plan plan = fftwf_plan_many_dft_r2c(3, dims, 3, B, NULL, 1, N, Bk, NULL, 1, Nk,
+			FFTW_ESTIMATE);
+	fftwf_execute(plan);
+	fftwf_destroy_plan(plan);
+	fftwf_free(B);
+
+	// bins of |k| per plane of kx, summed in order for a deterministic result
+	std::vector<double> power(n * n2, 0.);
+	std::vector<int> count(n * n2, 0);
+#pragma omp parallel for
+	for (long ix = 0; ix < long(n); ix++)
+		for (size_t iy = 0; iy < n; iy++)
+			for (size_t iz = 0; iz < n2; iz++) {
+				size_t k = std::floor(std::sqrt(double(ix * ix + iy * iy + iz * iz)));
+				if (k > n / 2. || k == 0)
+					continue;
+				size_t i = (ix * n + iy) * n2 + iz;
+				double p = 0;
+				for (int c = 0; c < 3; c++)
+					p += Bk[c * Nk + i][0] * Bk[c * Nk + i][0] + Bk[c * Nk + i][1] * Bk[c * Nk + i][1];
+				power[ix * n2 + k] += p;
+				count[ix * n2 + k] += 1;
+			}
+	fftwf_free(Bk);
+
+	std::vector<std::pair<int, float>> points;
+	for (size_t k = 1; k < n2; k++) {
+		double p = 0;
+		int c = 0;
+		for (size_t ix = 0; ix < n; ix++) {
+			p += power[ix * n2 + k];
+			c += count[ix * n2 + k];
+		}
+		if (c > 0)
+			points.push_back(std::make_pair(int(k), float(p / c)));
+	}
+	return points;
 }
 
 #endif // CRPROPA_HAVE_FFTW3F
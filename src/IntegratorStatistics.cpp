@@ -0,0 +1,82 @@
+#include "crpropa/IntegratorStatistics.h"
+
+#include <sstream>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace crpropa {
+
+IntegratorStatistics::IntegratorStatistics() :
+		acceptedSteps(0), rejectedSteps(0), fieldEvaluations(0), minimumSteps(0) {
+}
+
+IntegratorStatistics &IntegratorStatistics::operator +=(const IntegratorStatistics &s) {
+	acceptedSteps += s.acceptedSteps;
+	rejectedSteps += s.rejectedSteps;
+	fieldEvaluations += s.fieldEvaluations;
+	minimumSteps += s.minimumSteps;
+	return *this;
+}
+
+std::string IntegratorStatistics::getDescription() const {
+	std::stringstream ss;
+	ss << acceptedSteps << " accepted steps, " << rejectedSteps << " rejected, "
+			<< minimumSteps << " at the minimum step above tolerance, "
+			<< fieldEvaluations << " field evaluations";
+	return ss.str();
+}
+
+IntegratorCounters::IntegratorCounters() : enabled(false), properties(false) {
+}
+
+void IntegratorCounters::enable(const std::string &name, bool enable, bool asProperties) {
+	enabled = enable;
+	properties = enable and asProperties;
+	keys[0] = Candidate::getPropertyKey(name + ".acceptedSteps");
+	keys[1] = Candidate::getPropertyKey(name + ".rejectedSteps");
+	keys[2] = Candidate::getPropertyKey(name + ".fieldEvaluations");
+	keys[3] = Candidate::getPropertyKey(name + ".minimumSteps");
+	reset();
+}
+
+void IntegratorCounters::record(Candidate *candidate, const IntegratorStatistics &step) {
+#ifdef _OPENMP
+	size_t i = omp_get_thread_num();
+#else
+	size_t i = 0;
+#endif
+	// threads that were not known when the counters were reset are skipped
+	if (i < threads.size())
+		threads[i].statistics += step;
+
+	if (not properties)
+		return;
+	const uint64_t values[4] = {step.acceptedSteps, step.rejectedSteps,
+			step.fieldEvaluations, step.minimumSteps};
+	for (size_t k = 0; k < 4; k++) {
+		uint64_t sum = values[k];
+		if (candidate->hasProperty(keys[k]))
+			sum += candidate->getProperty(keys[k]).toUInt64();
+		candidate->setProperty(keys[k], Variant::fromUInt64(sum));
+	}
+}
+
+IntegratorStatistics IntegratorCounters::getTotal() const {
+	IntegratorStatistics total;
+	for (size_t i = 0; i < threads.size(); i++)
+		total += threads[i].statistics;
+	return total;
+}
+
+void IntegratorCounters::reset() {
+#ifdef _OPENMP
+	size_t nThreads = omp_in_parallel() ? omp_get_num_threads() : omp_get_max_threads();
+#else
+	size_t nThreads = 1;
+#endif
+	threads.assign(nThreads, ThreadCounters());
+}
+
+} // namespace crpropa
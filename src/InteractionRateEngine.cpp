@@ -0,0 +1,471 @@
+#include "crpropa/InteractionRateEngine.h"
+#include "crpropa/Common.h"
+#include "crpropa/Units.h"
+
+#include "kiss/logger.h"
+#include "kiss/path.h"
+#include "sophia.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+
+#include <unistd.h>
+
+namespace crpropa {
+
+static const int engineVersion = 1; // part of the hash, increase when the tables change
+
+static const double mec2 = mass_electron * c_squared;
+static const double sigmaThomson = 6.6524587e-29 * meter * meter;
+static const double radiusElectron = 2.8179403e-15 * meter;
+static const double alphaFineStructure = 1 / 137.035999;
+
+static const double dlgEps = 0.01; // photon energy grid [log10]
+static const double dlgSFine = 0.01; // integration grid in s [log10]
+
+InteractionRateEngine::InteractionRateEngine(ref_ptr<PhotonField> field,
+		std::string directory) :
+		photonField(field), cacheDirectory(directory) {
+	epsMin = field->getMinimumPhotonEnergy();
+	epsMax = field->getMaximumPhotonEnergy();
+	for (int i = 0; i <= 60; i++)
+		redshifts.push_back(0.1 * i);
+}
+
+void InteractionRateEngine::setPhotonEnergyRange(double min, double max) {
+	if ((min <= 0) or (max <= min))
+		throw std::runtime_error("InteractionRateEngine: invalid photon energy range");
+	epsMin = min;
+	epsMax = max;
+}
+
+void InteractionRateEngine::setRedshifts(const std::vector<double> &z) {
+	if (z.empty() or (z[0] != 0))
+		throw std::runtime_error("InteractionRateEngine: redshifts must start with zero");
+	redshifts = z;
+}
+
+// FNV-1a
+static void hashBytes(uint64_t &hash, const void *data, size_t size) {
+	const unsigned char *bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+}
+
+static void hashValue(uint64_t &hash, double value) {
+	hashBytes(hash, &value, sizeof(value));
+}
+
+std::string InteractionRateEngine::getFieldHash() const {
+	uint64_t hash = 14695981039346656037ULL;
+	std::string name = photonField->getFieldName();
+	hashBytes(hash, name.data(), name.size());
+	hashValue(hash, engineVersion);
+	hashValue(hash, epsMin);
+	hashValue(hash, epsMax);
+	bool redshiftDependent = photonField->hasRedshiftDependence();
+	hashValue(hash, redshiftDependent);
+	size_t nz = redshiftDependent ? redshifts.size() : 1;
+	for (size_t iz = 0; iz < nz; iz++) {
+		hashValue(hash, redshifts[iz]);
+		std::vector<double> eps, integral;
+		photonIntegral(redshifts[iz], eps, integral);
+		std::vector<double> density = photonField->getPhotonDensities(eps, redshifts[iz]);
+		for (size_t i = 0; i < eps.size(); i++)
+			hashValue(hash, density[i]);
+	}
+	char hex[17];
+	snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+	return hex;
+}
+
+std::string InteractionRateEngine::getDirectory() const {
+	return concat_path(cacheDirectory, photonField->getFieldName() + "_" + getFieldHash());
+}
+
+std::string InteractionRateEngine::path(const std::string &module, const std::string &file) const {
+	return concat_path(concat_path(getDirectory(), module), file);
+}
+
+void InteractionRateEngine::photonIntegral(double z, std::vector<double> &eps,
+		std::vector<double> &integral) const {
+	double lgMin = log10(epsMin);
+	size_t n = std::ceil((log10(epsMax) - lgMin) / dlgEps) + 1;
+	eps.resize(n);
+	integral.resize(n);
+	std::vector<double> f(n);
+	for (size_t i = 0; i < n; i++)
+		eps[i] = pow(10, lgMin + i * dlgEps);
+	photonField->getPhotonDensities(n, &eps[0], z, &f[0]);
+	// the photon field is given as eps * dn/deps
+	for (size_t i = 0; i < n; i++)
+		f[i] = f[i] / eps[i] / eps[i];
+	double dln = dlgEps * M_LN10;
+	integral[n - 1] = 0;
+	for (size_t i = n - 1; i > 0; i--)
+		integral[i - 1] = integral[i] + (f[i] + f[i - 1]) / 2 * dln;
+}
+
+// photon field integral I(x) as a function
+class PhotonIntegral {
+	LogAxis axis;
+	std::vector<double> values;
+public:
+	PhotonIntegral(const std::vector<double> &eps, const std::vector<double> &integral) :
+			axis(eps), values(integral) {
+	}
+	double operator()(double x) const {
+		if (x >= axis[axis.size() - 1])
+			return 0;
+		return interpolate(x, axis, values);
+	}
+};
+
+// Breit-Wheeler pair production
+static double sigmaPairProduction(double s) {
+	if (s <= 4 * mec2 * mec2)
+		return 0;
+	double b = sqrt(1 - 4 * mec2 * mec2 / s);
+	return sigmaThomson * 3 / 16 * (1 - b * b)
+			* ((3 - pow_integer<4>(b)) * log((1 + b) / (1 - b)) - 2 * b * (2 - b * b));
+}
+
+// Klein-Nishina
+static double sigmaInverseCompton(double s) {
+	double m2 = mec2 * mec2;
+	double b = (s - m2) / (s + m2);
+	if (b < 1e-3)
+		return sigmaThomson * (1 - 2 * b); // Thomson limit, avoids the cancellation below
+	double A = 2 / b / (1 + b) * (2 + 2 * b - b * b - 2 * b * b * b);
+	double B = (2 - 3 * b * b - b * b * b) / b / b * log((1 + b) / (1 - b));
+	return sigmaThomson * 3 / 8 * m2 / s / b * (A - B);
+}
+
+// Energy loss function of Bethe-Heitler pair production, approximation of
+// Chodorowski et al. 1992, ApJ 400, 181, eq. 3.14 and 3.18
+static double phiPairProduction(double k) {
+	if (k <= 2)
+		return 0;
+	if (k < 25) {
+		static const double c[4] = {0.8048, 0.1459, 1.137e-3, -3.879e-6};
+		double f = 0;
+		for (int i = 0; i < 4; i++)
+			f += c[i] * pow(k - 2, i + 1);
+		return M_PI / 12 * pow_integer<4>(k - 2) / (1 + f);
+	}
+	static const double d[4] = {-86.07, 50.96, -14.45, 8. / 3};
+	static const double f[3] = {2.910, 78.35, 1837};
+	double lnk = log(k);
+	double numerator = 0, denominator = 1;
+	for (int i = 0; i < 4; i++)
+		numerator += d[i] * pow(lnk, i);
+	for (int i = 0; i < 3; i++)
+		denominator -= f[i] * pow(k, -i - 1);
+	return k * numerator / denominator;
+}
+
+// unique among the threads and processes of all nodes sharing the cache
+// directory, e.g. on a network filesystem
+static std::string temporaryName(const std::string &filename) {
+	static std::atomic<unsigned long> counter(0);
+	char host[256] = "";
+	gethostname(host, sizeof(host) - 1);
+	std::stringstream ss;
+	ss << filename << ".tmp." << host << "." << getpid() << "." << counter++ << "."
+			<< std::chrono::steady_clock::now().time_since_epoch().count();
+	return ss.str();
+}
+
+// write to a temporary file first, so that concurrent processes never read partial tables
+static void commitFile(const std::string &tmp, const std::string &filename) {
+	if (std::rename(tmp.c_str(), filename.c_str()) != 0)
+		throw std::runtime_error("InteractionRateEngine: could not write " + filename);
+}
+
+static std::ofstream &openTable(std::ofstream &out, const std::string &tmp) {
+	out.open(tmp.c_str());
+	if (!out.good())
+		throw std::runtime_error("InteractionRateEngine: could not open file " + tmp);
+	out << std::setprecision(8);
+	return out;
+}
+
+static bool exists(const std::string &filename) {
+	return std::ifstream(filename.c_str()).good();
+}
+
+std::vector<InteractionRateEngine> InteractionRateEngine::cellEngines() const {
+	std::vector<InteractionRateEngine> engines;
+	const SpatialPhotonField *spatial = dynamic_cast<const SpatialPhotonField*>(photonField.get());
+	if (not spatial)
+		return engines;
+	std::set<std::string> names;
+	for (size_t i = 0; i < spatial->getNumberOfCells(); i++) {
+		PhotonField *cell = spatial->getCellField(i);
+		if (not names.insert(cell->getFieldName()).second)
+			continue;
+		InteractionRateEngine engine(cell, cacheDirectory);
+		engine.epsMin = epsMin;
+		engine.epsMax = epsMax;
+		engine.redshifts = redshifts;
+		engines.push_back(engine);
+	}
+	return engines;
+}
+
+void InteractionRateEngine::computeEMRates(const std::string &module, bool pairProduction) const {
+	// the EM modules use the rates of the cells of a spatial field
+	std::vector<InteractionRateEngine> cells = cellEngines();
+	if (not cells.empty()) {
+		for (size_t i = 0; i < cells.size(); i++)
+			cells[i].computeEMRates(module, pairProduction);
+		return;
+	}
+
+	std::string name = photonField->getFieldName();
+	std::string rateFile = path(module, "rate_" + name + ".txt");
+	std::string cdfFile = path(module, "cdf_" + name + ".txt");
+	if (exists(rateFile) and exists(cdfFile))
+		return;
+	create_directory_recursive(concat_path(getDirectory(), module));
+
+	std::vector<double> eps, integral;
+	photonIntegral(0, eps, integral);
+	PhotonIntegral I(eps, integral);
+
+	// energies 1 GeV - 100 ZeV, tabulation of the cumulative rate in
+	// s (pair production) or s - (mc^2)^2 (inverse Compton), in eV^2
+	const double lgEMin = 9, dlgE = 0.02;
+	const int nE = 701;
+	const double lgSMin = pairProduction ? 12 : -2, dlgS = 0.1;
+	const int nS = pairProduction ? 141 : 281;
+	double m2 = pairProduction ? 0 : mec2 * mec2;
+
+	std::vector<double> rate(nE);
+	std::vector<std::vector<double> > cdf(nE, std::vector<double>(nS, 0));
+#pragma omp parallel for schedule(dynamic)
+	for (int iE = 0; iE < nE; iE++) {
+		double E = pow(10, lgEMin + iE * dlgE) * eV;
+		double sKinMax = 4 * E * epsMax;
+		double sKinMin = pairProduction ? 4 * mec2 * mec2 : 4 * E * epsMin * 1e-3;
+		if (sKinMax <= sKinMin)
+			continue;
+		// integrate sigma(s) (s - m^2) I((s - m^2) / 4E) ds in ln(s - m^2)
+		int n = std::ceil(log10(sKinMax / sKinMin) / dlgSFine) + 1;
+		double du = log(sKinMax / sKinMin) / (n - 1);
+		double cumulative = 0, previous = 0;
+		int j = 0;
+		for (int k = 0; k < n; k++) {
+			double sKin = sKinMin * exp(k * du);
+			double sigma = pairProduction ? sigmaPairProduction(sKin) : sigmaInverseCompton(sKin + m2);
+			double g = sigma * sKin * sKin * I(sKin / (4 * E));
+			if (k > 0)
+				cumulative += (g + previous) / 2 * du;
+			previous = g;
+			// cumulative rate up to the upper edge of the tabulation bins
+			double edge = pairProduction ? 0 : dlgS / 2;
+			while ((j < nS) and (pow(10, lgSMin + j * dlgS + edge) * eV * eV <= sKin))
+				cdf[iE][j++] = cumulative / (8 * E * E);
+		}
+		for (; j < nS; j++)
+			cdf[iE][j] = cumulative / (8 * E * E);
+		rate[iE] = cumulative / (8 * E * E);
+	}
+
+	// drop the energies below threshold
+	int first = 0;
+	while ((first < nE - 1) and (rate[first] == 0))
+		first++;
+
+	std::string tmp = temporaryName(rateFile);
+	std::ofstream out;
+	openTable(out, tmp) << "# " << module << " interaction rate for " << name << ", computed by InteractionRateEngine\n";
+	out << "# log10(E/eV), 1/lambda [1/Mpc]\n";
+	for (int iE = first; iE < nE; iE++)
+		out << std::fixed << std::setprecision(4) << lgEMin + iE * dlgE << " "
+				<< std::scientific << std::setprecision(8) << rate[iE] * Mpc << "\n";
+	out.close();
+	commitFile(tmp, rateFile);
+
+	tmp = temporaryName(cdfFile);
+	openTable(out, tmp) << "# " << module << " cumulative interaction rate for " << name << ", computed by InteractionRateEngine\n";
+	out << "# first row: log10(" << (pairProduction ? "s" : "s - m_e^2 c^4") << "/eV^2), following rows: log10(E/eV), cumulative rate [1/Mpc]\n";
+	out << std::fixed << std::setprecision(4) << 0.;
+	for (int j = 0; j < nS; j++)
+		out << " " << lgSMin + j * dlgS;
+	out << "\n";
+	for (int iE = first; iE < nE; iE++) {
+		out << std::fixed << std::setprecision(4) << lgEMin + iE * dlgE << std::scientific << std::setprecision(8);
+		for (int j = 0; j < nS; j++)
+			out << " " << cdf[iE][j] * Mpc;
+		out << "\n";
+	}
+	out.close();
+	commitFile(tmp, cdfFile);
+}
+
+void InteractionRateEngine::computeEMPairProduction() const {
+	computeEMRates("EMPairProduction", true);
+}
+
+void InteractionRateEngine::computeEMInverseComptonScattering() const {
+	computeEMRates("EMInverseComptonScattering", false);
+}
+
+void InteractionRateEngine::computeElectronPairProduction() const {
+	std::string name = photonField->getFieldName();
+	std::string file = path("ElectronPairProduction", "lossrate_" + name + ".txt");
+	if (exists(file))
+		return;
+	create_directory_recursive(concat_path(getDirectory(), "ElectronPairProduction"));
+
+	std::vector<double> eps, integral;
+	photonIntegral(0, eps, integral);
+	std::vector<double> density = photonField->getPhotonDensities(eps, 0);
+
+	// relative energy loss rate 1/E dE/dx of protons (Blumenthal 1970, eq. 14)
+	const double lgGammaMin = 6, dlgGamma = 0.02;
+	const int nGamma = 451;
+	std::vector<double> lossRate(nGamma, 0);
+	double dln = dlgEps * M_LN10;
+#pragma omp parallel for schedule(dynamic)
+	for (int i = 0; i < nGamma; i++) {
+		double gamma = pow(10, lgGammaMin + i * dlgGamma);
+		double sum = 0;
+		for (size_t k = 0; k < eps.size(); k++) {
+			double n = density[k];
+			double w = ((k == 0) or (k == eps.size() - 1)) ? 0.5 : 1;
+			sum += w * n * phiPairProduction(2 * gamma * eps[k] / mec2) / eps[k] / eps[k] * dln;
+		}
+		lossRate[i] = alphaFineStructure * radiusElectron * radiusElectron * mass_electron / mass_proton
+				* pow_integer<2>(mec2) * sum / (2 * gamma * gamma);
+	}
+
+	int first = 0;
+	while ((first < nGamma - 1) and (lossRate[first] == 0))
+		first++;
+
+	std::string tmp = temporaryName(file);
+	std::ofstream out;
+	openTable(out, tmp) << "# ElectronPairProduction energy loss rate of protons for " << name << ", computed by InteractionRateEngine\n";
+	out << "# log10(gamma), 1/E dE/dx [1/Mpc]\n";
+	for (int i = first; i < nGamma; i++)
+		out << std::fixed << std::setprecision(4) << lgGammaMin + i * dlgGamma << " "
+				<< std::scientific << std::setprecision(8) << lossRate[i] * Mpc << "\n";
+	out.close();
+	commitFile(tmp, file);
+}
+
+void InteractionRateEngine::computePhotoPionProduction() const {
+	std::string name = photonField->getFieldName();
+	std::string file = path("PhotoPionProduction", "rate_" + name + ".txt");
+	bool redshiftDependent = photonField->hasRedshiftDependence();
+	std::string zName = name;
+	std::string zFile = path("PhotoPionProduction", "rate_" + zName.replace(0, 3, "IRBz") + ".txt");
+	if (exists(file) and (not redshiftDependent or exists(zFile)))
+		return;
+	create_directory_recursive(concat_path(getDirectory(), "PhotoPionProduction"));
+
+	// SOPHIA total cross sections of protons and neutrons, in the nucleon rest frame
+	const double lgEpsPrimeMin = -1, dlgEpsPrime = 0.004; // [GeV]
+	const int nEpsPrime = 3001;
+	std::vector<double> epsPrime(nEpsPrime), sigma[2];
+	for (int nature = 0; nature < 2; nature++) {
+		sigma[nature].resize(nEpsPrime);
+		int L0 = 13 + nature, NDIR = 3;
+		initial_(L0);
+		for (int k = 0; k < nEpsPrime; k++) {
+			double x = pow(10, lgEpsPrimeMin + k * dlgEpsPrime);
+			epsPrime[k] = x * GeV;
+			sigma[nature][k] = crossection_(x, NDIR, L0) * 1e-34 * meter * meter; // mubarn
+		}
+	}
+
+	const double lgGammaMin = 6, dlgGamma = 0.02;
+	const int nGamma = 501;
+	size_t nz = redshiftDependent ? redshifts.size() : 1;
+	std::vector<double> rate(nz * nGamma * 2, 0);
+	std::vector<PhotonIntegral> I;
+	for (size_t iz = 0; iz < nz; iz++) {
+		std::vector<double> eps, integral;
+		photonIntegral(redshifts[iz], eps, integral);
+		I.push_back(PhotonIntegral(eps, integral));
+	}
+
+	// rate = 1 / (2 gamma^2) int eps'^2 sigma(eps') I(eps' / 2 gamma) dln(eps')
+	double du = dlgEpsPrime * M_LN10;
+#pragma omp parallel for schedule(dynamic)
+	for (int k = 0; k < static_cast<int>(nz * nGamma); k++) {
+		size_t iz = k / nGamma;
+		double gamma = pow(10, lgGammaMin + (k % nGamma) * dlgGamma);
+		for (int nature = 0; nature < 2; nature++) {
+			double sum = 0;
+			for (int j = 0; j < nEpsPrime; j++) {
+				double x = epsPrime[j] / (2 * gamma);
+				if (x >= epsMax)
+					break;
+				double w = (j == 0) ? 0.5 : 1;
+				sum += w * epsPrime[j] * epsPrime[j] * sigma[nature][j] * I[iz](x) * du;
+			}
+			rate[2 * k + nature] = sum / (2 * gamma * gamma);
+		}
+	}
+
+	std::string tmp = temporaryName(file);
+	std::ofstream out;
+	openTable(out, tmp) << "# PhotoPionProduction interaction rate for " << name << ", computed by InteractionRateEngine\n";
+	out << "# log10(gamma), 1/lambda_proton [1/Mpc], 1/lambda_neutron [1/Mpc]\n";
+	int first = 0;
+	while ((first < nGamma - 1) and (rate[2 * first] == 0) and (rate[2 * first + 1] == 0))
+		first++;
+	for (int i = first; i < nGamma; i++)
+		out << std::fixed << std::setprecision(4) << lgGammaMin + i * dlgGamma << " "
+				<< std::scientific << std::setprecision(8) << rate[2 * i] * Mpc << " " << rate[2 * i + 1] * Mpc << "\n";
+	out.close();
+	commitFile(tmp, file);
+
+	if (not redshiftDependent)
+		return;
+	tmp = temporaryName(zFile);
+	openTable(out, tmp) << "# PhotoPionProduction redshift dependent interaction rate for " << name << ", computed by InteractionRateEngine\n";
+	out << "# z, log10(gamma), 1/lambda_proton [1/Mpc], 1/lambda_neutron [1/Mpc]\n";
+	for (size_t iz = 0; iz < nz; iz++)
+		for (int i = 0; i < nGamma; i++) {
+			size_t k = iz * nGamma + i;
+			out << std::fixed << std::setprecision(4) << redshifts[iz] << " " << lgGammaMin + i * dlgGamma << " "
+					<< std::scientific << std::setprecision(8) << rate[2 * k] * Mpc << " " << rate[2 * k + 1] * Mpc << "\n";
+		}
+	out.close();
+	commitFile(tmp, zFile);
+}
+
+void InteractionRateEngine::computeAll() const {
+	computeEMPairProduction();
+	computeEMInverseComptonScattering();
+	computeElectronPairProduction();
+	computePhotoPionProduction();
+}
+
+void InteractionRateEngine::install() const {
+	std::vector<InteractionRateEngine> cells = cellEngines();
+	for (size_t i = 0; i < cells.size(); i++)
+		cells[i].install();
+
+	std::string directory = getDirectory();
+	std::string name = photonField->getFieldName();
+	addDataSearchPath(directory);
+	KISS_LOG_INFO << "InteractionRateEngine: using rates of " << name << " in " << directory << std::endl;
+}
+
+} // namespace crpropa
@@ -0,0 +1,218 @@
+#include "crpropa/IsotopeSelection.h"
+#include "crpropa/Common.h"
+#include "crpropa/NumericTable.h"
+#include "crpropa/ParticleID.h"
+#include "crpropa/Trace.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace crpropa {
+
+static const int maxZ = 26, maxN = 30;
+
+// transitions between the tabulated nuclei, indexed by Z * 31 + N
+class IsotopeGraph {
+	std::vector<std::vector<int> > next;
+public:
+	IsotopeGraph() : next((maxZ + 1) * 31) {
+	}
+
+	void add(int Z, int N, int dZ, int dN) {
+		int Zd = Z + dZ, Nd = N + dN;
+		if ((Zd < 0) or (Nd < 0) or (Zd > maxZ) or (Nd > maxN) or (Zd + Nd < 1))
+			return;
+		next[Z * 31 + N].push_back(Zd * 31 + Nd);
+	}
+
+	// emitted nucleus, independent of the parent
+	void emit(int Z, int N, int Ze, int Ne) {
+		add(Z, N, Ze - Z, Ne - N);
+	}
+
+	const std::vector<int> &operator[](int index) const {
+		return next[index];
+	}
+
+	size_t size() const {
+		return next.size();
+	}
+};
+
+IsotopeSelection::IsotopeSelection() : computed(new std::once_flag) {
+}
+
+IsotopeSelection::IsotopeSelection(const std::vector<int> &primaries) :
+		primaries(primaries), computed(new std::once_flag) {
+}
+
+void IsotopeSelection::addPrimary(int id) {
+	primaries.push_back(id);
+	computed.reset(new std::once_flag);
+}
+
+void IsotopeSelection::addPhotonField(ref_ptr<PhotonField> field) {
+	std::string name = field->getFieldName();
+	if (std::find(fields.begin(), fields.end(), name) != fields.end())
+		return;
+	fields.push_back(name);
+	computed.reset(new std::once_flag);
+}
+
+void IsotopeSelection::compute() const {
+	CRPROPA_TRACE_SPAN("IsotopeSelection::compute", "tables");
+	IsotopeGraph graph;
+
+	// photodisintegration: (#n #p #H2 #H3 #He3 #He4) emitted
+	for (size_t f = 0; f < fields.size(); f++) {
+		std::string filename = getDataPath("Photodisintegration/branching_" + fields[f] + ".txt");
+		ref_ptr<NumericTable> table = NumericTable::load(filename);
+		for (size_t r = 0; r < table->rows(); r++) {
+			if (table->rowSize(r) < 3)
+				throw std::runtime_error("IsotopeSelection: incomplete row in " + filename);
+			const double *row = table->row(r);
+			int Z = row[0], N = row[1], channel = row[2];
+			int nN = digit(channel, 100000);
+			int nP = digit(channel, 10000);
+			int nH2 = digit(channel, 1000);
+			int nH3 = digit(channel, 100);
+			int nHe3 = digit(channel, 10);
+			int nHe4 = digit(channel, 1);
+			int dZ = -nP - nH2 - nH3 - 2 * nHe3 - 2 * nHe4;
+			int dN = -nN - nH2 - 2 * nH3 - nHe3 - 2 * nHe4;
+			graph.add(Z, N, dZ, dN);
+			if (nN)
+				graph.emit(Z, N, 0, 1);
+			if (nP)
+				graph.emit(Z, N, 1, 0);
+			if (nH2)
+				graph.emit(Z, N, 1, 1);
+			if (nH3)
+				graph.emit(Z, N, 1, 2);
+			if (nHe3)
+				graph.emit(Z, N, 2, 1);
+			if (nHe4)
+				graph.emit(Z, N, 2, 2);
+		}
+	}
+
+	// nuclear decay: (#beta- #beta+ #alpha #p #n)
+	std::string filename = getDataPath("nuclear_decay.txt");
+	std::ifstream infile(filename.c_str());
+	if (!infile.good())
+		throw std::runtime_error("IsotopeSelection: could not open file " + filename);
+	std::string line;
+	while (std::getline(infile, line)) {
+		std::stringstream stream(line);
+		if (stream.peek() == '#')
+			continue;
+		int Z, N, channel;
+		if (not (stream >> Z >> N >> channel))
+			continue;
+		int nBetaMinus = digit(channel, 10000);
+		int nBetaPlus = digit(channel, 1000);
+		int nAlpha = digit(channel, 100);
+		int nProton = digit(channel, 10);
+		int nNeutron = digit(channel, 1);
+		graph.add(Z, N, nBetaMinus - nBetaPlus - 2 * nAlpha - nProton,
+				nBetaPlus - nBetaMinus - 2 * nAlpha - nNeutron);
+		if (nAlpha)
+			graph.emit(Z, N, 2, 2);
+		if (nProton)
+			graph.emit(Z, N, 1, 0);
+		if (nNeutron)
+			graph.emit(Z, N, 0, 1);
+	}
+
+	// photopion production: loss of a nucleon, or conversion of a free one
+	for (int Z = 0; Z <= maxZ; Z++)
+		for (int N = 0; N <= maxN; N++) {
+			if (Z + N == 1) {
+				graph.add(Z, N, N - Z, Z - N);
+				continue;
+			}
+			graph.add(Z, N, -1, 0);
+			graph.add(Z, N, 0, -1);
+			graph.emit(Z, N, 1, 0);
+			graph.emit(Z, N, 0, 1);
+		}
+	graph.emit(0, 1, 1, 0); // neutron decay
+
+	selected.assign(graph.size(), false);
+	std::vector<int> queue;
+	for (size_t i = 0; i < primaries.size(); i++) {
+		int id = primaries[i];
+		if (not isNucleus(id))
+			continue;
+		int Z = chargeNumber(id), N = massNumber(id) - Z;
+		if ((Z > maxZ) or (N > maxN) or selected[Z * 31 + N])
+			continue;
+		selected[Z * 31 + N] = true;
+		queue.push_back(Z * 31 + N);
+	}
+	while (not queue.empty()) {
+		int index = queue.back();
+		queue.pop_back();
+		const std::vector<int> &next = graph[index];
+		for (size_t i = 0; i < next.size(); i++)
+			if (not selected[next[i]]) {
+				selected[next[i]] = true;
+				queue.push_back(next[i]);
+			}
+	}
+}
+
+void IsotopeSelection::require() const {
+	std::call_once(*computed, &IsotopeSelection::compute, this);
+}
+
+bool IsotopeSelection::contains(int Z, int N) const {
+	if ((Z < 0) or (N < 0) or (Z > maxZ) or (N > maxN))
+		return false;
+	require();
+	return selected[Z * 31 + N];
+}
+
+bool IsotopeSelection::contains(int id) const {
+	if (not isNucleus(id))
+		return false;
+	int Z = chargeNumber(id);
+	return contains(Z, massNumber(id) - Z);
+}
+
+size_t IsotopeSelection::size() const {
+	require();
+	return std::count(selected.begin(), selected.end(), true);
+}
+
+std::vector<int> IsotopeSelection::getIsotopes() const {
+	require();
+	std::vector<int> ids;
+	for (size_t i = 0; i < selected.size(); i++)
+		if (selected[i])
+			ids.push_back(nucleusId(i / 31 + i % 31, i / 31));
+	return ids;
+}
+
+std::string IsotopeSelection::getKey() const {
+	require();
+	// the selection as hexadecimal bit field
+	std::string key = "isotopes:";
+	for (size_t i = 0; i < selected.size(); i += 4) {
+		int nibble = 0;
+		for (size_t j = i; (j < i + 4) and (j < selected.size()); j++)
+			nibble |= selected[j] << (j - i);
+		key += "0123456789abcdef"[nibble];
+	}
+	return key;
+}
+
+std::string IsotopeSelection::getDescription() const {
+	std::stringstream s;
+	s << "IsotopeSelection: " << size() << " nuclei reachable from " << primaries.size() << " primaries";
+	return s.str();
+}
+
+} // namespace crpropa
@@ -0,0 +1,129 @@
+#include "crpropa/KdTree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace crpropa {
+
+namespace {
+struct AxisOrder {
+	const std::vector<Vector3d> &points;
+	int axis;
+	AxisOrder(const std::vector<Vector3d> &points, int axis) :
+			points(points), axis(axis) {
+	}
+	bool operator()(uint32_t a, uint32_t b) const {
+		return points[a].data[axis] < points[b].data[axis];
+	}
+};
+}
+
+KdTree::KdTree() {
+}
+
+KdTree::KdTree(const std::vector<Vector3d> &points) {
+	setPoints(points);
+}
+
+void KdTree::add(const Vector3d &point) {
+	points.push_back(point);
+	setPoints(points);
+}
+
+void KdTree::setPoints(const std::vector<Vector3d> &p) {
+	if (&p != &points)
+		points = p;
+	order.resize(points.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	axes.assign(points.size(), 0);
+	build(0, order.size());
+}
+
+void KdTree::build(size_t begin, size_t end) {
+	if (end - begin < 2)
+		return;
+
+	// split along the axis of the largest extent
+	Vector3d lo = points[order[begin]], hi = lo;
+	for (size_t i = begin + 1; i < end; i++) {
+		const Vector3d &p = points[order[i]];
+		lo.setXYZ(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+		hi.setXYZ(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+	}
+	Vector3d extent = hi - lo;
+	int axis = 0;
+	if (extent.y > extent.data[axis])
+		axis = 1;
+	if (extent.z > extent.data[axis])
+		axis = 2;
+
+	size_t mid = begin + (end - begin) / 2;
+	std::nth_element(order.begin() + begin, order.begin() + mid,
+			order.begin() + end, AxisOrder(points, axis));
+	axes[mid] = axis;
+	build(begin, mid);
+	build(mid + 1, end);
+}
+
+void KdTree::nearest(const Vector3d &point, size_t begin, size_t end,
+		double &distance2, long &index) const {
+	if (begin >= end)
+		return;
+	size_t mid = begin + (end - begin) / 2;
+	const Vector3d &p = points[order[mid]];
+	double d2 = (p - point).getR2();
+	if (d2 < distance2) {
+		distance2 = d2;
+		index = order[mid];
+	}
+	if (end - begin == 1)
+		return;
+
+	// the side of the point first, the other side only if it can be closer
+	double delta = point.data[axes[mid]] - p.data[axes[mid]];
+	if (delta < 0) {
+		nearest(point, begin, mid, distance2, index);
+		if (delta * delta < distance2)
+			nearest(point, mid + 1, end, distance2, index);
+	} else {
+		nearest(point, mid + 1, end, distance2, index);
+		if (delta * delta < distance2)
+			nearest(point, begin, mid, distance2, index);
+	}
+}
+
+size_t KdTree::size() const {
+	return points.size();
+}
+
+bool KdTree::empty() const {
+	return points.empty();
+}
+
+const Vector3d &KdTree::getPoint(size_t i) const {
+	if (i >= points.size())
+		throw std::runtime_error("KdTree: index out of range");
+	return points[i];
+}
+
+const std::vector<Vector3d> &KdTree::getPoints() const {
+	return points;
+}
+
+long KdTree::nearestPoint(const Vector3d &point) const {
+	double distance2 = std::numeric_limits<double>::max();
+	long index = -1;
+	nearest(point, 0, order.size(), distance2, index);
+	return index;
+}
+
+double KdTree::nearestDistance(const Vector3d &point) const {
+	long i = nearestPoint(point);
+	if (i < 0)
+		return std::numeric_limits<double>::max();
+	return (points[i] - point).getR();
+}
+
+} // namespace crpropa
@@ -0,0 +1,179 @@
+#include "crpropa/MappedGrid.h"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace crpropa {
+
+// file header, the values follow at offset 128 so that they are aligned
+struct MappedGridHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t components;
+	uint64_t Nx, Ny, Nz;
+	double origin[3];
+	double spacing[3];
+	uint32_t reflective;
+};
+
+static const char mappedGridMagic[8] = {'C', 'R', 'P', 'M', 'G', 'R', 'I', 'D'};
+static const size_t mappedGridOffset = MappedGrid<float>::dataOffset;
+
+static void writeHeader(std::ofstream &fout, uint32_t components, const GridProperties &p) {
+	MappedGridHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, mappedGridMagic, 8);
+	header.version = 1;
+	header.components = components;
+	header.Nx = p.Nx;
+	header.Ny = p.Ny;
+	header.Nz = p.Nz;
+	for (int i = 0; i < 3; i++) {
+		header.origin[i] = p.origin.data[i];
+		header.spacing[i] = p.spacing.data[i];
+	}
+	header.reflective = p.reflective;
+
+	char head[mappedGridOffset];
+	memset(head, 0, mappedGridOffset);
+	memcpy(head, &header, sizeof(header));
+	fout.write(head, mappedGridOffset);
+}
+
+template<typename T>
+MappedGrid<T>::MappedGrid(const std::string &filename, double factor) :
+		data(0), mapping(0), mappingSize(0), factor(factor) {
+	std::ifstream fin(filename.c_str(), std::ios::binary);
+	if (!fin)
+		throw std::runtime_error("MappedGrid: could not open " + filename);
+	MappedGridHeader header;
+	fin.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if (!fin or (memcmp(header.magic, mappedGridMagic, 8) != 0))
+		throw std::runtime_error("MappedGrid: " + filename + " has no grid header");
+	if ((header.version != 1) or (header.components * sizeof(float) != sizeof(T)))
+		throw std::runtime_error("MappedGrid: " + filename + " has a different version or type");
+	if ((header.Nx == 0) or (header.Ny == 0) or (header.Nz == 0))
+		throw std::runtime_error("MappedGrid: " + filename + " has an empty grid");
+	fin.close();
+
+	Nx = header.Nx;
+	Ny = header.Ny;
+	Nz = header.Nz;
+	origin = Vector3d(header.origin[0], header.origin[1], header.origin[2]);
+	spacing = Vector3d(header.spacing[0], header.spacing[1], header.spacing[2]);
+	gridOrigin = origin + spacing / 2;
+	reflective = header.reflective;
+	map(filename, mappedGridOffset);
+}
+
+template<typename T>
+MappedGrid<T>::MappedGrid(const std::string &filename, const GridProperties &p, double factor) :
+		data(0), mapping(0), mappingSize(0), factor(factor),
+		Nx(p.Nx), Ny(p.Ny), Nz(p.Nz), origin(p.origin), spacing(p.spacing),
+		reflective(p.reflective) {
+	gridOrigin = origin + spacing / 2;
+	map(filename, 0);
+}
+
+template<typename T>
+void MappedGrid<T>::map(const std::string &filename, size_t offset) {
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("MappedGrid: could not open " + filename);
+	mappingSize = offset + getSizeOf();
+	struct stat st;
+	if ((fstat(fd, &st) != 0) or (size_t(st.st_size) != mappingSize)) {
+		close(fd);
+		throw std::runtime_error("MappedGrid: size of " + filename + " does not match the grid");
+	}
+
+	// private mapping: the pages are shared with all processes mapping the file
+	void *m = mmap(0, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		throw std::runtime_error("MappedGrid: could not map " + filename);
+	mapping = m;
+	data = reinterpret_cast<const T*>(static_cast<char*>(m) + offset);
+}
+
+template<typename T>
+MappedGrid<T>::~MappedGrid() {
+	if (mapping)
+		munmap(mapping, mappingSize);
+}
+
+template<typename T>
+const size_t MappedGrid<T>::dataOffset;
+
+template<typename T>
+void MappedGrid<T>::save(const Grid<T> &grid, const std::string &filename) {
+	std::ofstream fout(filename.c_str(), std::ios::binary);
+	if (!fout)
+		throw std::runtime_error("MappedGrid: could not write " + filename);
+	GridProperties p(grid.getOrigin(), grid.getNx(), grid.getNy(), grid.getNz(), grid.getSpacing());
+	p.setReflective(grid.isReflective());
+	writeHeader(fout, sizeof(T) / sizeof(float), p);
+	size_t n = grid.getNx() * grid.getNy() * grid.getNz();
+	if ((n > 0) and (grid.getLayout() == GridLinear))
+		fout.write(reinterpret_cast<const char*>(&grid.get(0, 0, 0)), sizeof(T) * n);
+	else
+		for (size_t ix = 0; ix < grid.getNx(); ix++)
+			for (size_t iy = 0; iy < grid.getNy(); iy++)
+				for (size_t iz = 0; iz < grid.getNz(); iz++)
+					fout.write(reinterpret_cast<const char*>(&grid.get(ix, iy, iz)), sizeof(T));
+	if (!fout)
+		throw std::runtime_error("MappedGrid: could not write " + filename);
+}
+
+template<typename T>
+void MappedGrid<T>::create(const std::string &filename, const GridProperties &p) {
+	if ((p.Nx == 0) or (p.Ny == 0) or (p.Nz == 0))
+		throw std::runtime_error("MappedGrid: cannot create an empty grid");
+	std::ofstream fout(filename.c_str(), std::ios::binary);
+	if (!fout)
+		throw std::runtime_error("MappedGrid: could not write " + filename);
+	writeHeader(fout, sizeof(T) / sizeof(float), p);
+
+	// the values are a hole in the file until they are written
+	fout.seekp(mappedGridOffset + sizeof(T) * p.Nx * p.Ny * p.Nz - 1);
+	fout.put(0);
+	if (!fout)
+		throw std::runtime_error("MappedGrid: could not write " + filename);
+}
+
+template<typename T>
+ref_ptr<Grid<T> > MappedGrid<T>::toGrid() const {
+	ref_ptr<Grid<T> > grid = new Grid<T>(origin, Nx, Ny, Nz, spacing);
+	grid->setReflective(reflective);
+	for (size_t ix = 0; ix < Nx; ix++)
+		for (size_t iy = 0; iy < Ny; iy++)
+			for (size_t iz = 0; iz < Nz; iz++)
+				grid->get(ix, iy, iz) = get(ix, iy, iz);
+	return grid;
+}
+
+template<typename T>
+void MappedGrid<T>::prefetch() const {
+	if (!mapping)
+		return;
+	madvise(mapping, mappingSize, MADV_WILLNEED);
+	// touch one value per page, the sum keeps the reads
+	const volatile char *bytes = static_cast<const char*>(mapping);
+	long pageSize = sysconf(_SC_PAGESIZE);
+	char sum = 0;
+	for (size_t i = 0; i < mappingSize; i += pageSize)
+		sum += bytes[i];
+	(void) sum;
+}
+
+template class MappedGrid<float>;
+template class MappedGrid<Vector3f>;
+
+} // namespace crpropa
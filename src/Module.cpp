@@ -1,7 +1,14 @@
 #include "crpropa/Module.h"
+#include "crpropa/ParticleID.h"
 
+#include <cstdlib>
+#include <stdexcept>
 #include <typeinfo>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 namespace crpropa {
 
 Module::Module() {
@@ -17,6 +24,107 @@ void Module::setDescription(const std::string &d) {
 	description = d;
 }
 
+void Module::prepare() {
+}
+
+void Module::processBatch(Candidate **candidates, size_t count) const {
+	for (size_t i = 0; i < count; i++)
+		process(candidates[i]);
+}
+
+unsigned int Module::getParticleClasses() const {
+	return AllParticleClasses;
+}
+
+bool Module::hasInteractionRate() const {
+	return false;
+}
+
+double Module::getInteractionRate(const Candidate *candidate) const {
+	return 0;
+}
+
+void Module::performStochasticInteraction(Candidate *candidate) const {
+	throw std::runtime_error("Module: " + getDescription() + " has no stochastic interactions");
+}
+
+bool Module::hasEnergyLossRate() const {
+	return false;
+}
+
+double Module::getEnergyLossRate(const Candidate *candidate, double E, double z) const {
+	return 0;
+}
+
+bool Module::getIntegratorStatistics(IntegratorStatistics &statistics) const {
+	return false;
+}
+
+size_t Module::getMemoryUsage() const {
+	return 0;
+}
+
+// first line of the description, followed by the error
+static std::string prepareError(const Module *module, const std::string &what) {
+	std::string description = module->getDescription();
+	return description.substr(0, description.find('\n')) + ": " + what;
+}
+
+// one task per module, waits for them and their tasks
+static void prepareTasks(const std::vector<Module *> &modules, std::vector<std::string> &errors) {
+	for (size_t i = 0; i < modules.size(); i++) {
+		Module *module = modules[i];
+#pragma omp task firstprivate(module) shared(errors)
+		{
+			std::string error;
+			try {
+				module->prepare();
+			} catch (std::exception &e) {
+				error = prepareError(module, e.what());
+			} catch (...) {
+				error = prepareError(module, "unknown error");
+			}
+			if (error.size()) {
+#pragma omp critical(prepareModules)
+				errors.push_back(error);
+			}
+		}
+	}
+#pragma omp taskwait
+}
+
+void prepareModules(const std::vector<Module *> &modules) {
+	std::vector<std::string> errors;
+#ifdef _OPENMP
+	if (not omp_in_parallel()) {
+#pragma omp parallel
+#pragma omp single
+		prepareTasks(modules, errors);
+	} else
+#endif
+		prepareTasks(modules, errors);
+
+	if (errors.empty())
+		return;
+	std::string message = errors[0];
+	for (size_t i = 1; i < errors.size(); i++)
+		message += "\n" + errors[i];
+	throw std::runtime_error(message);
+}
+
+ParticleClass particleClass(int id) {
+	if (id == 22)
+		return PhotonClass;
+	if (id == 11 || id == -11)
+		return ElectronClass;
+	if (isNucleus(id))
+		return NucleusClass;
+	int a = std::abs(id);
+	if (a == 12 || a == 14 || a == 16)
+		return NeutrinoClass;
+	return OtherClass;
+}
+
 AbstractCondition::AbstractCondition() :
 		makeRejectedInactive(true), makeAcceptedInactive(false), rejectFlagKey(
 				"Rejected") {
@@ -0,0 +1,436 @@
+#include "crpropa/ModuleList1D.h"
+#include "crpropa/module/SimplePropagation.h"
+#include "crpropa/Cosmology.h"
+#include "crpropa/Diagnostics.h"
+#include "crpropa/Trace.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace crpropa {
+
+namespace {
+
+// parameters of the tabulated loss integration, copied to the device
+struct LossKernel {
+	double lgEmin, pointsPerDecade, zScale;
+	int nE, nZ;
+	double tolerance, limit;
+	bool redshift;
+	double hubbleScale, omegaM, omegaL; // dz / ds = -hubbleScale * sqrt(omegaL + omegaM * (1 + z)^3)
+};
+
+#ifdef CRPROPA_HAVE_OFFLOAD
+#pragma omp declare target
+#endif
+double positive(double z) {
+	return (z > 0) ? z : 0;
+}
+
+double redshiftRate(const LossKernel &k, double z) {
+	return -k.hubbleScale * sqrt(k.omegaL + k.omegaM * pow(1 + z, 3));
+}
+
+// loss rate -dE/dx in [J/m] of the bilinear interpolation of the table, false outside of it
+bool tableRate(const LossKernel &k, const double *table, double E, double z, double &rate) {
+	if (not (E > 0))
+		return false;
+	double x = (log10(E) - k.lgEmin) * k.pointsPerDecade;
+	if (not (x >= 0) or (x > k.nE - 1))
+		return false;
+	int i = (x < k.nE - 2) ? int(x) : k.nE - 2;
+	double wx = x - i;
+	if (z <= DBL_MIN) {
+		const double *r = table + k.nZ * k.nE;
+		rate = E * (r[i] * (1 - wx) + r[i + 1] * wx);
+		return true;
+	}
+	double y = z * k.zScale;
+	if (y > k.nZ - 1)
+		return false;
+	int j = (y < k.nZ - 2) ? int(y) : k.nZ - 2;
+	double wy = y - j;
+	const double *r0 = table + j * k.nE, *r1 = r0 + k.nE;
+	rate = E * ((1 - wy) * (r0[i] * (1 - wx) + r0[i + 1] * wx)
+			+ wy * (r1[i] * (1 - wx) + r1[i + 1] * wx));
+	return true;
+}
+
+// ContinuousLosses::integrate with the tabulated rates, false if the tables are left
+bool integrateTable(const LossKernel &k, const double *table, double step,
+		double &E, double &z, double &next) {
+	double e = E, zz = z;
+	bool evolve = k.redshift and (zz > DBL_MIN);
+	double s = 0;
+	int n = 0;
+	double b1, b2, b3, b4;
+	while (s < step) {
+		// left to ContinuousLosses::integrate, which reports it
+		if (n == 10000)
+			return false;
+		if (not tableRate(k, table, e, zz, b1))
+			return false;
+		if (b1 == 0 and not evolve)
+			break;
+		double h = step - s;
+		if ((b1 != 0) and (k.tolerance * e / fabs(b1) < h))
+			h = k.tolerance * e / fabs(b1);
+
+		double dz1 = 0, dz2 = 0, dz3 = 0, dz4 = 0;
+		if (evolve)
+			dz1 = redshiftRate(k, zz);
+		double z2 = positive(zz + h / 2 * dz1);
+		if (not tableRate(k, table, e - h / 2 * b1, z2, b2))
+			return false;
+		if (evolve)
+			dz2 = redshiftRate(k, z2);
+		double z3 = positive(zz + h / 2 * dz2);
+		if (not tableRate(k, table, e - h / 2 * b2, z3, b3))
+			return false;
+		if (evolve)
+			dz3 = redshiftRate(k, z3);
+		double z4 = positive(zz + h * dz3);
+		if (not tableRate(k, table, e - h * b3, z4, b4))
+			return false;
+		if (evolve)
+			dz4 = redshiftRate(k, z4);
+
+		e -= h / 6 * (b1 + 2 * b2 + 2 * b3 + b4);
+		if (evolve) {
+			zz = positive(zz + h / 6 * (dz1 + 2 * dz2 + 2 * dz3 + dz4));
+			evolve = zz > DBL_MIN;
+		}
+		s += h;
+		n++;
+	}
+
+	double rate;
+	if (not tableRate(k, table, e, zz, rate))
+		return false;
+	if ((rate != 0) and (k.limit * e / fabs(rate) < next))
+		next = k.limit * e / fabs(rate);
+	E = e;
+	z = zz;
+	return true;
+}
+#ifdef CRPROPA_HAVE_OFFLOAD
+#pragma omp end declare target
+#endif
+
+} // namespace
+
+ModuleList1D::ModuleList1D(size_t batchSize) :
+		losses(new ContinuousLosses), interactions(new InteractionSampler),
+		modules(new ModuleList), minStep(0.1 * kpc), maxStep(1 * Gpc),
+		tableZmax(0), tableEmin(0), tableEmax(0), tablePointsPerDecade(0),
+		tableZPoints(0) {
+	setBatchSize(batchSize);
+}
+
+ModuleList1D::~ModuleList1D() {
+	unmapLossTables();
+}
+
+void ModuleList1D::add(Module *module) {
+	SimplePropagation *propagation = dynamic_cast<SimplePropagation*>(module);
+	if (propagation) {
+		minStep = propagation->getMinimumStep();
+		maxStep = propagation->getMaximumStep();
+	} else if (module->hasInteractionRate())
+		interactions->add(module);
+	else if (module->hasEnergyLossRate())
+		losses->add(module);
+	else
+		modules->add(module);
+}
+
+void ModuleList1D::setBatchSize(size_t batchSize) {
+	if (batchSize == 0)
+		throw std::runtime_error("ModuleList1D: batchSize must be larger than 0");
+	this->batchSize = batchSize;
+}
+
+size_t ModuleList1D::getBatchSize() const {
+	return batchSize;
+}
+
+double ModuleList1D::getMinimumStep() const {
+	return minStep;
+}
+
+double ModuleList1D::getMaximumStep() const {
+	return maxStep;
+}
+
+void ModuleList1D::setLossTables(double zmax, double Emin, double Emax,
+		size_t pointsPerDecade, size_t zPoints) {
+	if (not (zmax >= 0))
+		throw std::runtime_error("ModuleList1D: the maximum redshift of the loss tables must not be negative");
+	if ((zmax > 0) and not ((Emin > 0) and (Emax > Emin)))
+		throw std::runtime_error("ModuleList1D: the loss tables need 0 < Emin < Emax");
+	if ((zmax > 0) and ((pointsPerDecade == 0) or (zPoints < 2)))
+		throw std::runtime_error("ModuleList1D: the loss tables need at least one point per decade and two redshifts");
+	unmapLossTables();
+	tableZmax = zmax;
+	tableEmin = Emin;
+	tableEmax = Emax;
+	tablePointsPerDecade = pointsPerDecade;
+	tableZPoints = zPoints;
+}
+
+size_t ModuleList1D::getNumberOfLossTables() const {
+	std::lock_guard<std::mutex> lock(lossTablesMutex);
+	return lossTables.size();
+}
+
+void ModuleList1D::unmapLossTables() {
+	std::lock_guard<std::mutex> lock(lossTablesMutex);
+#ifdef CRPROPA_HAVE_OFFLOAD
+	std::map<int, LossTable>::iterator it;
+	for (it = lossTables.begin(); it != lossTables.end(); it++) {
+		const double *r = &it->second.rates[0];
+		size_t n = it->second.rates.size();
+#pragma omp target exit data map(delete: r[0:n])
+	}
+#endif
+	lossTables.clear();
+}
+
+const double *ModuleList1D::getLossTable(int id) const {
+	std::lock_guard<std::mutex> lock(lossTablesMutex);
+	std::map<int, LossTable>::iterator it = lossTables.find(id);
+	if (it != lossTables.end())
+		return it->second.device;
+
+	CRPROPA_TRACE_SPAN("ModuleList1D::getLossTable", "tables");
+	size_t nE = size_t(round(log10(tableEmax / tableEmin) * tablePointsPerDecade)) + 1;
+	size_t nZ = tableZPoints;
+	LossTable &table = lossTables[id];
+	table.rates.resize((nZ + 1) * nE);
+	Candidate candidate;
+	candidate.current.setId(id);
+	for (size_t j = 0; j <= nZ; j++) {
+		// the first row is the limit z -> 0, the last one z = 0
+		double z = (j < nZ) ? std::max(j * tableZmax / (nZ - 1), 2 * DBL_MIN) : 0;
+		for (size_t i = 0; i < nE; i++) {
+			double E = tableEmin * pow(10, double(i) / tablePointsPerDecade);
+			table.rates[j * nE + i] = losses->getLossRate(&candidate, E, z) / E;
+		}
+	}
+
+	double *r = &table.rates[0];
+#ifdef CRPROPA_HAVE_OFFLOAD
+	size_t n = table.rates.size();
+#pragma omp target enter data map(to: r[0:n])
+#pragma omp target data use_device_ptr(r)
+	{
+		table.device = r;
+	}
+#else
+	table.device = r;
+#endif
+	return table.device;
+}
+
+void ModuleList1D::integrateLosses(Candidate **candidates, size_t count, const double *step,
+		double *E, double *z, double *next) const {
+	double lossLimit = losses->getLimit();
+	std::vector<char> integrated(count, 0);
+
+	if (tableZmax > 0) {
+		LossKernel k;
+		k.lgEmin = log10(tableEmin);
+		k.pointsPerDecade = tablePointsPerDecade;
+		k.zScale = (tableZPoints - 1) / tableZmax;
+		k.nE = int(round(log10(tableEmax / tableEmin) * tablePointsPerDecade)) + 1;
+		k.nZ = tableZPoints;
+		k.tolerance = losses->getTolerance();
+		k.limit = lossLimit;
+		k.redshift = losses->updatesRedshift();
+		k.hubbleScale = H0() / c_light;
+		k.omegaM = omegaM();
+		k.omegaL = omegaL();
+
+		// tables of the candidates, mostly of few particle types per batch
+		std::vector<const double*> tables(count);
+		int lastId = 0;
+		const double *lastTable = 0;
+		for (size_t i = 0; i < count; i++) {
+			int id = candidates[i]->current.getId();
+			if ((lastTable == 0) or (id != lastId)) {
+				lastTable = getLossTable(id);
+				lastId = id;
+			}
+			tables[i] = lastTable;
+		}
+
+		const double **t = &tables[0];
+		char *done = &integrated[0];
+#ifdef CRPROPA_HAVE_OFFLOAD
+#pragma omp target teams distribute parallel for firstprivate(k) \
+		map(to: t[0:count], step[0:count]) map(tofrom: E[0:count], z[0:count], next[0:count]) \
+		map(from: done[0:count])
+#endif
+		for (size_t i = 0; i < count; i++)
+			done[i] = integrateTable(k, t[i], step[i], E[i], z[i], next[i]);
+	}
+
+	// candidates without or outside of the tables
+	for (size_t i = 0; i < count; i++) {
+		if (integrated[i])
+			continue;
+		double integrated = losses->integrate(candidates[i], step[i], E[i], z[i]);
+		if (integrated < step[i])
+			next[i] = std::min(next[i], integrated);
+		double rate = losses->getLossRate(candidates[i], E[i], z[i]);
+		if (rate != 0)
+			next[i] = std::min(next[i], lossLimit * E[i] / fabs(rate));
+	}
+}
+
+ref_ptr<ContinuousLosses> ModuleList1D::getContinuousLosses() const {
+	return losses;
+}
+
+ref_ptr<InteractionSampler> ModuleList1D::getInteractionSampler() const {
+	return interactions;
+}
+
+ref_ptr<ModuleList> ModuleList1D::getModuleList() const {
+	return modules;
+}
+
+void ModuleList1D::propagate(Candidate **candidates, size_t count, bool recursive) const {
+	bool haveLosses = losses->size() > 0;
+	bool haveInteractions = interactions->getNumberOfInteractions() > 0;
+
+	for (size_t offset = 0; offset < count; offset += batchSize) {
+		size_t n = std::min(batchSize, count - offset);
+		Candidate **batch = candidates + offset;
+
+		// state of the active candidates
+		std::vector<Candidate*> active;
+		std::vector<double> x, dir, z, E, step, next;
+		active.reserve(n);
+		for (size_t i = 0; i < n; i++) {
+			Candidate *c = batch[i];
+			if (not c->isActive())
+				continue;
+			Vector3d p = c->current.getPosition();
+			Vector3d d = c->current.getDirection();
+			if (p.y != 0 or p.z != 0 or d.y != 0 or d.z != 0)
+				throw std::runtime_error("ModuleList1D: candidates have to move along the x-axis");
+			active.push_back(c);
+			x.push_back(p.x);
+			dir.push_back(d.x);
+			z.push_back(c->getRedshift());
+			E.push_back(c->current.getEnergy());
+			next.push_back(c->getNextStep());
+		}
+		step.resize(active.size());
+
+		while (not active.empty()) {
+			size_t m = active.size();
+
+			// rectilinear propagation
+			for (size_t i = 0; i < m; i++) {
+				step[i] = std::min(maxStep, std::max(minStep, next[i]));
+				x[i] += dir[i] * step[i];
+				next[i] = maxStep;
+			}
+
+			// continuous energy losses and redshift
+			if (haveLosses)
+				integrateLosses(&active[0], m, &step[0], &E[0], &z[0], &next[0]);
+
+			// update the candidates
+			for (size_t i = 0; i < m; i++) {
+				Candidate *c = active[i];
+				c->previous = c->current;
+				c->current.setPosition(Vector3d(x[i], 0, 0));
+				c->current.setEnergy(E[i]);
+				c->setRedshift(z[i]);
+				c->setCurrentStep(step[i]);
+				c->setNextStep(next[i]);
+			}
+
+			if (haveInteractions)
+				interactions->processBatch(&active[0], m);
+			modules->processBatch(&active[0], m);
+
+			// continue with the active candidates, which may have been changed by the modules
+			size_t k = 0;
+			for (size_t i = 0; i < m; i++) {
+				Candidate *c = active[i];
+				if (not c->isActive())
+					continue;
+				active[k] = c;
+				x[k] = c->current.getPosition().x;
+				dir[k] = dir[i];
+				z[k] = c->getRedshift();
+				E[k] = c->current.getEnergy();
+				next[k] = c->getNextStep();
+				k++;
+			}
+			active.resize(k);
+		}
+
+		if (not recursive)
+			continue;
+
+		// propagate the next generation of secondaries
+		std::vector<Candidate*> secondaries;
+		for (size_t i = 0; i < n; i++)
+			for (size_t j = 0; j < batch[i]->secondaries.size(); j++)
+				secondaries.push_back(batch[i]->secondaries[j]);
+		if (not secondaries.empty())
+			propagate(&secondaries[0], secondaries.size(), recursive);
+	}
+}
+
+void ModuleList1D::run(const ModuleList::candidate_vector_t *candidates, bool recursive) {
+	size_t count = candidates->size();
+	size_t nBatches = (count + batchSize - 1) / batchSize;
+
+#pragma omp parallel for schedule(dynamic, 1)
+	for (size_t b = 0; b < nBatches; b++) {
+		size_t offset = b * batchSize;
+		size_t n = std::min(batchSize, count - offset);
+		std::vector<Candidate*> batch(n);
+		for (size_t i = 0; i < n; i++)
+			batch[i] = candidates->operator[](offset + i);
+
+		try {
+			propagate(&batch[0], n, recursive);
+		} catch (std::exception &e) {
+			std::cerr << "Exception in crpropa::ModuleList1D::run: " << std::endl;
+			std::cerr << e.what() << std::endl;
+		}
+	}
+	Diagnostics::printSummary();
+}
+
+void ModuleList1D::run(SourceInterface *source, size_t count, bool recursive) {
+	ModuleList::candidate_vector_t candidates;
+	source->getCandidates(count, candidates);
+	run(&candidates, recursive);
+}
+
+std::string ModuleList1D::getDescription() const {
+	std::stringstream ss;
+	ss << "ModuleList1D: batches of " << batchSize << ", step size "
+			<< minStep / kpc << " - " << maxStep / kpc << " kpc";
+	if (tableZmax > 0)
+		ss << ", loss tables up to z = " << tableZmax;
+	ss << "\n";
+	ss << "  " << losses->getDescription() << "\n";
+	ss << "  " << interactions->getDescription() << "\n";
+	ss << modules->getDescription();
+	return ss.str();
+}
+
+} // namespace crpropa
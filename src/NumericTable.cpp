@@ -0,0 +1,263 @@
+#include "crpropa/NumericTable.h"
+
+#include "kiss/path.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace crpropa {
+
+static const char binaryMagic[8] = {'C', 'R', 'P', 'T', 'A', 'B', 'L', 'E'};
+static const uint32_t binaryVersion = 1;
+static const uint32_t byteOrderMarker = 0x01020304;
+static const size_t headerSize = 64;
+
+struct BinaryTableHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint64_t rows;
+	uint64_t columns;
+	uint64_t dataOffset;
+	char reserved[headerSize - 40];
+};
+
+static bool isLittleEndian() {
+	uint32_t one = 1;
+	return *reinterpret_cast<char*>(&one) == 1;
+}
+
+static bool modificationTime(const std::string &filename, time_t &time) {
+	struct stat s;
+	if (stat(filename.c_str(), &s) != 0)
+		return false;
+	time = s.st_mtime;
+	return true;
+}
+
+NumericTable::NumericTable() :
+		data(0), nRows(0), nColumns(0), mapping(0), mappingSize(0) {
+}
+
+NumericTable::~NumericTable() {
+	if (mapping)
+		munmap(mapping, mappingSize);
+}
+
+std::string NumericTable::binaryName(const std::string &filename) {
+	size_t n = filename.size();
+	if (n > 4 && filename.compare(n - 4, 4, ".txt") == 0)
+		return filename.substr(0, n - 4) + ".bin";
+	return filename + ".bin";
+}
+
+ref_ptr<NumericTable> NumericTable::load(const std::string &filename) {
+	ref_ptr<NumericTable> table = new NumericTable();
+	std::string binary = binaryName(filename);
+	time_t textTime, binaryTime;
+	bool hasText = modificationTime(filename, textTime);
+	if (modificationTime(binary, binaryTime)
+			&& (!hasText || binaryTime >= textTime)) {
+		table->readBinary(binary);
+		return table;
+	}
+	table->readText(filename);
+	return table;
+}
+
+void NumericTable::readText(const std::string &filename) {
+	std::ifstream infile(filename.c_str(), std::ios::binary);
+	if (!infile.good())
+		throw std::runtime_error("NumericTable: could not open file " + filename);
+	std::stringstream buffer;
+	buffer << infile.rdbuf();
+	std::string content = buffer.str();
+
+	values.clear();
+	rowOffset.assign(1, 0);
+	const char *p = content.c_str();
+	const char *end = p + content.size();
+	while (p < end) {
+		const char *eol = static_cast<const char*>(memchr(p, '\n', end - p));
+		if (!eol)
+			eol = end;
+		const char *c = p;
+		while (c < eol && (*c == ' ' || *c == '\t'))
+			c++;
+		if (c < eol && *c != '#') {
+			size_t before = values.size();
+			while (true) {
+				char *next;
+				double v = strtod(c, &next);
+				if (next == c || next > eol)
+					break;
+				values.push_back(v);
+				c = next;
+			}
+			if (values.size() > before)
+				rowOffset.push_back(values.size());
+		}
+		p = eol + 1;
+	}
+
+	nRows = rowOffset.size() - 1;
+	nColumns = (nRows > 0) ? rowOffset[1] : 0;
+	for (size_t i = 1; i < nRows; i++)
+		if (rowOffset[i + 1] - rowOffset[i] != nColumns) {
+			nColumns = 0;
+			break;
+		}
+	data = values.empty() ? 0 : &values[0];
+}
+
+void NumericTable::readBinary(const std::string &filename) {
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("NumericTable: could not open file " + filename);
+
+	BinaryTableHeader header;
+	if (read(fd, &header, headerSize) != (ssize_t) headerSize
+			|| memcmp(header.magic, binaryMagic, 8) != 0) {
+		close(fd);
+		throw std::runtime_error("NumericTable: not a binary table " + filename);
+	}
+	if (header.version != binaryVersion || header.byteOrder != byteOrderMarker
+			|| !isLittleEndian()) {
+		close(fd);
+		throw std::runtime_error("NumericTable: unsupported version or byte order of " + filename);
+	}
+
+	nRows = header.rows;
+	nColumns = header.columns;
+	size_t n = nRows * nColumns;
+	size_t fileSize = header.dataOffset + n * sizeof(double);
+	struct stat s;
+	if (fstat(fd, &s) != 0 || (size_t) s.st_size < fileSize) {
+		close(fd);
+		throw std::runtime_error("NumericTable: truncated binary table " + filename);
+	}
+
+	if (n > 0) {
+		void *m = mmap(0, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+		if (m != MAP_FAILED) {
+			mapping = m;
+			mappingSize = fileSize;
+			data = reinterpret_cast<const double*>(static_cast<const char*>(m) + header.dataOffset);
+		} else {
+			// no mapping possible, e.g. on some network file systems
+			values.resize(n);
+			if (pread(fd, &values[0], n * sizeof(double), header.dataOffset) != (ssize_t) (n * sizeof(double))) {
+				close(fd);
+				throw std::runtime_error("NumericTable: could not read " + filename);
+			}
+			data = &values[0];
+		}
+	}
+	close(fd);
+}
+
+size_t NumericTable::rows() const {
+	return nRows;
+}
+
+size_t NumericTable::columns() const {
+	return nColumns;
+}
+
+size_t NumericTable::rowSize(size_t i) const {
+	if (nColumns > 0 || rowOffset.empty())
+		return nColumns;
+	return rowOffset[i + 1] - rowOffset[i];
+}
+
+const double *NumericTable::row(size_t i) const {
+	if (nColumns > 0 || rowOffset.empty())
+		return data + i * nColumns;
+	return data + rowOffset[i];
+}
+
+double NumericTable::operator()(size_t i, size_t j) const {
+	return row(i)[j];
+}
+
+size_t NumericTable::size() const {
+	if (rowOffset.empty())
+		return nRows * nColumns;
+	return rowOffset.back();
+}
+
+const double *NumericTable::begin() const {
+	return data;
+}
+
+bool NumericTable::isMapped() const {
+	return mapping != 0;
+}
+
+void NumericTable::writeBinary(const std::string &filename) const {
+	if (nRows > 0 && nColumns == 0)
+		throw std::runtime_error("NumericTable: rows of different length cannot be written as binary table");
+	if (!isLittleEndian())
+		throw std::runtime_error("NumericTable: binary tables require a little-endian host");
+
+	BinaryTableHeader header;
+	memset(&header, 0, headerSize);
+	memcpy(header.magic, binaryMagic, 8);
+	header.version = binaryVersion;
+	header.byteOrder = byteOrderMarker;
+	header.rows = nRows;
+	header.columns = nColumns;
+	header.dataOffset = headerSize;
+
+	// write to a temporary file first, so that readers never see a partial table
+	std::string tmp = filename + ".tmp";
+	std::ofstream out(tmp.c_str(), std::ios::binary);
+	if (!out.good())
+		throw std::runtime_error("NumericTable: could not write file " + filename);
+	out.write(reinterpret_cast<const char*>(&header), headerSize);
+	out.write(reinterpret_cast<const char*>(data), size() * sizeof(double));
+	out.close();
+	if (!out.good() || std::rename(tmp.c_str(), filename.c_str()) != 0) {
+		std::remove(tmp.c_str());
+		throw std::runtime_error("NumericTable: could not write file " + filename);
+	}
+}
+
+bool convertTextTable(const std::string &textFile, const std::string &binaryFile) {
+	NumericTable table;
+	table.readText(textFile);
+	if (table.rows() == 0 || table.columns() == 0)
+		return false;
+	table.writeBinary(binaryFile);
+	return true;
+}
+
+size_t convertDataDirectory(const std::string &directory) {
+	std::vector<std::string> elements;
+	if (!list_directory(directory, elements))
+		throw std::runtime_error("NumericTable: could not open directory " + directory);
+	size_t converted = 0;
+	for (size_t i = 0; i < elements.size(); i++) {
+		std::string path = concat_path(directory, elements[i]);
+		if (is_directory(path)) {
+			converted += convertDataDirectory(path);
+			continue;
+		}
+		size_t n = path.size();
+		if (n > 4 && path.compare(n - 4, 4, ".txt") == 0)
+			if (convertTextTable(path, NumericTable::binaryName(path)))
+				converted++;
+	}
+	return converted;
+}
+
+} // namespace crpropa
@@ -7,10 +7,67 @@
 #include "HepPID/ParticleIDMethods.hh"
 
 #include <cstdlib>
+#include <cmath>
 #include <sstream>
+#include <vector>
 
 namespace crpropa {
 
+// Masses and charges for setId, which is called for every secondary.
+// The tables are filled on first use, once for all threads.
+namespace {
+
+// nuclei in the ground state with Z <= 26 and N <= 30, indexed by Z * 31 + N
+// as the nuclear mass table, mass NaN where there is no nucleus
+struct NucleusTable {
+	std::vector<double> mass, charge;
+	NucleusTable() : mass(27 * 31, std::nan("")), charge(27 * 31, 0) {
+		for (int Z = 0; Z <= 26; Z++)
+			for (int N = 0; N <= 30; N++) {
+				if (Z + N < 1)
+					continue;
+				mass[Z * 31 + N] = nuclearMass(Z + N, Z);
+				charge[Z * 31 + N] = Z * eplus;
+			}
+	}
+};
+
+const NucleusTable &nucleusTable() {
+	static const NucleusTable table;
+	return table;
+}
+
+// index into the nucleus table for |id| = 10ZZZAAA0, -1 otherwise
+inline int nucleusIndex(int absId) {
+	if ((absId < 1000000000) or (absId >= 1000270000) or (absId % 10 != 0))
+		return -1;
+	int Z = (absId / 10000) % 1000;
+	int N = (absId / 10) % 1000 - Z;
+	if ((N < 0) or (N > 30) or (Z + N < 1))
+		return -1;
+	return Z * 31 + N;
+}
+
+// charges of the other particles with |id| <= maxOtherId, which includes the
+// leptons, photons, mesons and light baryons, NaN for the nuclei among them
+const int maxOtherId = 4096;
+
+struct OtherTable {
+	std::vector<double> charge;
+	OtherTable() : charge(2 * maxOtherId + 1) {
+		for (int id = -maxOtherId; id <= maxOtherId; id++)
+			charge[id + maxOtherId] = isNucleus(id) ? std::nan("")
+					: HepPID::charge(id) * eplus;
+	}
+};
+
+const OtherTable &otherTable() {
+	static const OtherTable table;
+	return table;
+}
+
+}
+
 ParticleState::ParticleState(int id, double E, Vector3d pos, Vector3d dir): id(0), energy(0.), position(0.), direction(0.), pmass(0.), charge(0.)
 {
 	setId(id);
@@ -49,6 +106,23 @@ double ParticleState::getRigidity() const {
 
 void ParticleState::setId(int newId) {
 	id = newId;
+	int i = nucleusIndex(abs(id));
+	if (i >= 0) {
+		const NucleusTable &t = nucleusTable();
+		pmass = t.mass[i];
+		charge = (id < 0) ? -t.charge[i] : t.charge[i];
+		return;
+	}
+	if (abs(id) <= maxOtherId) {
+		double q = otherTable().charge[id + maxOtherId];
+		if (!std::isnan(q)) {
+			if (abs(id) == 11)
+				pmass = mass_electron;
+			charge = q;
+			return;
+		}
+	}
+
 	if (isNucleus(id)) {
 		pmass = nuclearMass(id);
 		charge = chargeNumber(id) * eplus;
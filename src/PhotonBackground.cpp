@@ -1,7 +1,10 @@
 #include "crpropa/PhotonBackground.h"
+#include "crpropa/Common.h"
+#include "crpropa/Diagnostics.h"
 #include "crpropa/Units.h"
 #include "crpropa/Random.h"
 
+#include <algorithm>
 #include <fstream>
 #include <stdexcept>
 #include <limits>
@@ -9,6 +12,28 @@
 
 namespace crpropa {
 
+double PhotonField::getMinimumPhotonEnergy(double z) const {
+	return 1e-10 * eV; // radio
+}
+
+double PhotonField::getMaximumPhotonEnergy(double z) const {
+	return 1e3 * eV; // X-ray
+}
+
+void PhotonField::getPhotonDensities(size_t n, const double *ePhoton, double z,
+		double *density) const {
+	for (size_t i = 0; i < n; i++)
+		density[i] = getPhotonDensity(ePhoton[i], z);
+}
+
+std::vector<double> PhotonField::getPhotonDensities(
+		const std::vector<double> &ePhoton, double z) const {
+	std::vector<double> density(ePhoton.size());
+	if (not ePhoton.empty())
+		getPhotonDensities(ePhoton.size(), &ePhoton[0], z, &density[0]);
+	return density;
+}
+
 TabularPhotonField::TabularPhotonField(std::string fieldName, bool isRedshiftDependent) {
 	this->fieldName = fieldName;
 	this->isRedshiftDependent = isRedshiftDependent;
@@ -18,17 +43,142 @@ TabularPhotonField::TabularPhotonField(std::string fieldName, bool isRedshiftDep
 	if (this->isRedshiftDependent)
 		readRedshift(getDataPath("") + "Scaling/" + this->fieldName + "_redshift.txt");
 
+	init();
+}
+
+TabularPhotonField::TabularPhotonField(const std::string fieldName,
+		const std::vector<double> &photonEnergies,
+		const std::vector<double> &photonDensity,
+		const std::vector<double> &redshifts) {
+	this->fieldName = fieldName;
+	this->isRedshiftDependent = not redshifts.empty();
+	this->photonEnergies = photonEnergies;
+	this->photonDensity = photonDensity;
+	this->redshifts = redshifts;
+
+	init();
+}
+
+void TabularPhotonField::init() {
 	checkInputData();
+	photonEnergyAxis.assign(this->photonEnergies);
+	redshiftAxis.assign(this->redshifts);
 
 	if (this->isRedshiftDependent)
 		initRedshiftScaling();
+	resample();
+}
+
+// number of uniform steps that resolve the smallest step of the points
+static size_t uniformSteps(const std::vector<double> &x) {
+	size_t n = x.size() - 1;
+	double minStep = x.back() - x.front();
+	for (size_t i = 0; i < n; i++)
+		minStep = std::min(minStep, x[i + 1] - x[i]);
+	double steps = std::ceil((x.back() - x.front()) / minStep * (1 - 1e-9));
+	// finer than 16 times the number of points only for badly spaced input
+	return std::max(n, std::min(static_cast<size_t>(steps), 16 * n));
+}
+
+void TabularPhotonField::resample() {
+	if (this->photonEnergies.size() < 2)
+		throw std::runtime_error("TabularPhotonField::resample: at least two photon energies needed");
+	if (this->isRedshiftDependent and (this->redshifts.size() < 2))
+		throw std::runtime_error("TabularPhotonField::resample: at least two redshifts needed");
+	std::vector<double> lgE(this->photonEnergies.size());
+	for (size_t i = 0; i < lgE.size(); i++)
+		lgE[i] = std::log10(this->photonEnergies[i]);
+	gridEnergies = uniformSteps(lgE) + 1;
+	gridLogEnergyMin = lgE.front();
+	gridLogEnergyInvStep = (gridEnergies - 1) / (lgE.back() - lgE.front());
+
+	gridRedshifts = this->isRedshiftDependent ? uniformSteps(this->redshifts) + 1 : 1;
+	gridRedshiftInvStep = this->isRedshiftDependent ?
+			(gridRedshifts - 1) / this->redshifts.back() : 0;
+
+	// the grid points, the ends exactly the tabulated ones
+	std::vector<double> e(gridEnergies), z(gridRedshifts, 0.);
+	for (size_t i = 0; i < gridEnergies; i++)
+		e[i] = std::min(std::max(std::pow(10, gridLogEnergyMin + i / gridLogEnergyInvStep),
+				this->photonEnergies.front()), this->photonEnergies.back());
+	e.back() = this->photonEnergies.back();
+	for (size_t j = 1; j < gridRedshifts; j++)
+		z[j] = std::min(j / gridRedshiftInvStep, this->redshifts.back());
+	if (this->isRedshiftDependent)
+		z.back() = this->redshifts.back();
+
+	gridDensity.resize(gridEnergies * gridRedshifts);
+	for (size_t i = 0; i < gridEnergies; i++)
+		for (size_t j = 0; j < gridRedshifts; j++)
+			gridDensity[j + i * gridRedshifts] = this->isRedshiftDependent ?
+					interpolate2d(e[i], z[j], this->photonEnergyAxis, this->redshiftAxis, this->photonDensity) :
+					interpolate(e[i], this->photonEnergyAxis, this->photonDensity);
+	gridSlope.assign(gridDensity.size(), 0.);
+	for (size_t k = 0; k + gridRedshifts < gridDensity.size(); k++)
+		gridSlope[k] = gridDensity[k + gridRedshifts] - gridDensity[k];
+
+	gridScaling.assign(gridRedshifts, 1.);
+	if (this->isRedshiftDependent)
+		for (size_t j = 0; j < gridRedshifts; j++)
+			gridScaling[j] = interpolate(z[j], this->redshiftAxis, this->redshiftScalings);
 }
 
 double TabularPhotonField::getPhotonDensity(double ePhoton, double z) const {
-	if (this->isRedshiftDependent) {
-		return interpolate2d(ePhoton, z, this->photonEnergies, this->redshifts, this->photonDensity);
-	} else {
-		return interpolate(ePhoton, this->photonEnergies, this->photonDensity);
+	double density;
+	getPhotonDensities(1, &ePhoton, z, &density);
+	return density;
+}
+
+void TabularPhotonField::getPhotonDensities(size_t n, const double *ePhoton,
+		double z, double *density) const {
+	const double eMin = this->photonEnergies.front();
+	const double eMax = this->photonEnergies.back();
+
+	// the logarithms in blocks, vectorized with the selected MathAccuracy
+	const size_t block = 64;
+	double lgE[block];
+
+	if (not this->isRedshiftDependent) {
+		for (size_t k0 = 0; k0 < n; k0 += block) {
+			size_t m = std::min(block, n - k0);
+			mathLog10(m, ePhoton + k0, lgE);
+			for (size_t l = 0; l < m; l++) {
+				size_t k = k0 + l;
+				double fe;
+				size_t i = gridCell((lgE[l] - gridLogEnergyMin)
+						* gridLogEnergyInvStep, gridEnergies, fe);
+				density[k] = std::fma(gridSlope[i], fe, gridDensity[i]);
+				if (not (ePhoton[k] > eMin))
+					density[k] = this->photonDensity.front();
+				if (not (ePhoton[k] < eMax))
+					density[k] = this->photonDensity.back();
+			}
+		}
+		return;
+	}
+
+	// zero outside of the tabulated range, as interpolate2d
+	if ((z < this->redshifts.front()) or (z > this->redshifts.back())) {
+		std::fill(density, density + n, 0.);
+		return;
+	}
+	double fz;
+	const size_t j = gridCell(z * gridRedshiftInvStep, gridRedshifts, fz);
+	for (size_t k0 = 0; k0 < n; k0 += block) {
+		size_t m = std::min(block, n - k0);
+		mathLog10(m, ePhoton + k0, lgE);
+		for (size_t l = 0; l < m; l++) {
+			size_t k = k0 + l;
+			double fe;
+			size_t i = gridCell((lgE[l] - gridLogEnergyMin)
+					* gridLogEnergyInvStep, gridEnergies, fe);
+			size_t c = j + i * gridRedshifts;
+			double r1 = std::fma(gridSlope[c], fe, gridDensity[c]);
+			double r2 = std::fma(gridSlope[c + 1], fe, gridDensity[c + 1]);
+			density[k] = std::fma(r2 - r1, fz, r1);
+			if ((ePhoton[k] < eMin) or (ePhoton[k] > eMax))
+				density[k] = 0.;
+		}
 	}
 }
 
@@ -39,13 +189,23 @@ double TabularPhotonField::getRedshiftScaling(double z) const {
 		} else if (z < this->redshifts.front()) {
 			return 1.;
 		} else {
-			return interpolate(z, this->redshifts, this->redshiftScalings);
+			double fz;
+			size_t j = gridCell(z * gridRedshiftInvStep, gridRedshifts, fz);
+			return std::fma(gridScaling[j + 1] - gridScaling[j], fz, gridScaling[j]);
 		}
 	} else {
 		return 1.;
 	}
 }
 
+double TabularPhotonField::getMinimumPhotonEnergy(double z) const {
+	return this->photonEnergies.front();
+}
+
+double TabularPhotonField::getMaximumPhotonEnergy(double z) const {
+	return this->photonEnergies.back();
+}
+
 void TabularPhotonField::readPhotonEnergy(std::string filePath) {
 	std::ifstream infile(filePath.c_str());
 	if (!infile.good())
@@ -86,15 +246,16 @@ void TabularPhotonField::readRedshift(std::string filePath) {
 }
 
 void TabularPhotonField::initRedshiftScaling() {
+	// sums of the tabulated densities, the grid is not resampled yet
+	const size_t nz = this->redshifts.size();
 	double n0 = 0.;
-	for (int i = 0; i < this->redshifts.size(); ++i) {
+	for (int i = 0; i < nz; ++i) {
 		double z = this->redshifts[i];
 		double n = 0.;
 		for (int j = 0; j < this->photonEnergies.size(); ++j) {
-			double e = this->photonEnergies[j];
 			if (z == 0.)
-				n0 += getPhotonDensity(e, z);
-			n += getPhotonDensity(e, z);
+				n0 += this->photonDensity[i + j * nz];
+			n += this->photonDensity[i + j * nz];
 		}
 		this->redshiftScalings.push_back(n / n0);
 	}
@@ -155,20 +316,282 @@ double BlackbodyPhotonField::getPhotonDensity(double ePhoton, double z) const {
 	return 8 * M_PI * pow_integer<3>(ePhoton / (h_planck * c_light)) / std::expm1(ePhoton / (k_boltzmann * this->blackbodyTemperature));
 }
 
+double BlackbodyPhotonField::getMinimumPhotonEnergy(double z) const {
+	return 1e-6 * k_boltzmann * this->blackbodyTemperature;
+}
+
+double BlackbodyPhotonField::getMaximumPhotonEnergy(double z) const {
+	return 100 * k_boltzmann * this->blackbodyTemperature; // density suppressed by exp(-100)
+}
+
+SpatialPhotonField::SpatialPhotonField(std::string fieldName,
+		const Vector3d &origin, const Vector3d &spacing, size_t nx, size_t ny,
+		size_t nz) : origin(origin), spacing(spacing), nx(nx), ny(ny), nz(nz) {
+	if ((nx == 0) or (ny == 0) or (nz == 0))
+		throw std::runtime_error("SpatialPhotonField: no cells");
+	if ((spacing.x <= 0) or (spacing.y <= 0) or (spacing.z <= 0))
+		throw std::runtime_error("SpatialPhotonField: cell size must be positive");
+	this->fieldName = fieldName;
+	this->isRedshiftDependent = false;
+	cells.resize(nx * ny * nz);
+}
+
+size_t SpatialPhotonField::cellIndex(size_t ix, size_t iy, size_t iz) const {
+	if ((ix >= nx) or (iy >= ny) or (iz >= nz))
+		throw std::runtime_error("SpatialPhotonField: cell out of range");
+	return ix * ny * nz + iy * nz + iz;
+}
+
+void SpatialPhotonField::setCellField(size_t ix, size_t iy, size_t iz,
+		ref_ptr<PhotonField> field) {
+	if (not field)
+		throw std::runtime_error("SpatialPhotonField: no photon field");
+	if (dynamic_cast<SpatialPhotonField*>(field.get()))
+		throw std::runtime_error("SpatialPhotonField: cells can not be spatial fields");
+	cells[cellIndex(ix, iy, iz)] = field;
+	if (field->hasRedshiftDependence())
+		this->isRedshiftDependent = true;
+}
+
+size_t SpatialPhotonField::getNumberOfCells() const {
+	return cells.size();
+}
+
+PhotonField *SpatialPhotonField::getCellField(size_t index) const {
+	if (index >= cells.size())
+		throw std::runtime_error("SpatialPhotonField: cell out of range");
+	checkCells();
+	return cells[index];
+}
+
+Vector3d SpatialPhotonField::getCellCenter(size_t index) const {
+	if (index >= cells.size())
+		throw std::runtime_error("SpatialPhotonField: cell out of range");
+	size_t ix = index / (ny * nz);
+	size_t iy = (index / nz) % ny;
+	size_t iz = index % nz;
+	return origin + (Vector3d(ix, iy, iz) + Vector3d(0.5)) * spacing;
+}
+
+void SpatialPhotonField::checkCells() const {
+	for (size_t i = 0; i < cells.size(); i++)
+		if (not cells[i])
+			throw std::runtime_error("SpatialPhotonField: cell without photon field");
+}
+
+void SpatialPhotonField::getCellWeights(const Vector3d &position,
+		size_t index[8], double weight[8]) const {
+	// position in units of the cells, relative to the first cell center
+	Vector3d r = (position - origin) / spacing - Vector3d(0.5);
+	size_t n[3] = {nx, ny, nz};
+	size_t lo[3], hi[3];
+	double f[3];
+	for (int a = 0; a < 3; a++) {
+		double x = std::min(std::max(r.data[a], 0.), (double)(n[a] - 1));
+		lo[a] = std::min(static_cast<size_t>(x), n[a] - 1);
+		hi[a] = std::min(lo[a] + 1, n[a] - 1);
+		f[a] = x - lo[a];
+	}
+	for (int k = 0; k < 8; k++) {
+		size_t ix = (k & 4) ? hi[0] : lo[0];
+		size_t iy = (k & 2) ? hi[1] : lo[1];
+		size_t iz = (k & 1) ? hi[2] : lo[2];
+		index[k] = ix * ny * nz + iy * nz + iz;
+		weight[k] = ((k & 4) ? f[0] : 1 - f[0]) * ((k & 2) ? f[1] : 1 - f[1])
+				* ((k & 1) ? f[2] : 1 - f[2]);
+	}
+}
+
+double SpatialPhotonField::getPhotonDensity(double ePhoton,
+		const Vector3d &position, double z) const {
+	checkCells();
+	size_t index[8];
+	double weight[8];
+	getCellWeights(position, index, weight);
+	double density = 0;
+	for (int k = 0; k < 8; k++)
+		if (weight[k] > 0)
+			density += weight[k] * cells[index[k]]->getPhotonDensity(ePhoton, z);
+	return density;
+}
+
+double SpatialPhotonField::getPhotonDensity(double ePhoton, double z) const {
+	checkCells();
+	double density = 0;
+	for (size_t i = 0; i < cells.size(); i++)
+		density += cells[i]->getPhotonDensity(ePhoton, z);
+	return density / cells.size();
+}
+
+double SpatialPhotonField::getRedshiftScaling(double z) const {
+	// mean of the cell scalings
+	checkCells();
+	double scaling = 0;
+	for (size_t i = 0; i < cells.size(); i++)
+		scaling += cells[i]->getRedshiftScaling(z);
+	return scaling / cells.size();
+}
+
+double SpatialPhotonField::getMinimumPhotonEnergy(double z) const {
+	checkCells();
+	double e = cells[0]->getMinimumPhotonEnergy(z);
+	for (size_t i = 1; i < cells.size(); i++)
+		e = std::min(e, cells[i]->getMinimumPhotonEnergy(z));
+	return e;
+}
+
+double SpatialPhotonField::getMaximumPhotonEnergy(double z) const {
+	checkCells();
+	double e = cells[0]->getMaximumPhotonEnergy(z);
+	for (size_t i = 1; i < cells.size(); i++)
+		e = std::max(e, cells[i]->getMaximumPhotonEnergy(z));
+	return e;
+}
+
 PhotonFieldSampling::PhotonFieldSampling() {
 	bgFlag = 0;
+	tabNodeMin = 0;
+	tabNodeStep = 1;
+	tabNodes = 0;
 }
 
 PhotonFieldSampling::PhotonFieldSampling(int flag) {
 	if (flag != 1 && flag != 2)
 		throw std::runtime_error("error: incorrect background flag. Must be 1 (CMB) or 2 (IRB_Kneiske04).");
 	bgFlag = flag;
+	initTables();
+}
+
+void PhotonFieldSampling::initTables() {
+	if (bgFlag == 1) {
+		tabNodeMin = 8;
+		tabNodeStep = 0.1;
+		tabNodes = 61;
+	} else {
+		tabNodeMin = 0;
+		tabNodeStep = 0.05;
+		tabNodes = 101;
+	}
+
+	for (int k = 0; k < 2; k++) {
+		const bool onProton = (k == 0);
+		const double mass = onProton? 0.93827 : 0.93947;  // Gev/c^2
+		tabLogEps[k].assign(tabNodes * tabPoints, 0.);
+		tabCDF[k].assign(tabNodes * tabPoints, 0.);
+
+		for (size_t i = 0; i < tabNodes; i++) {
+			const double node = tabNodeMin + i * tabNodeStep;
+			double epsMin, epsMax;
+			if (bgFlag == 1) {
+				// CMB: the photon density does not depend on the redshift, the
+				// redshift dependent upper bound is applied when sampling.
+				// Above 0.007 eV * 2.73 (1 + 10) the density is below exp(-900).
+				const double E_in = std::pow(10., node);
+				const double P_in = std::sqrt(E_in * E_in - mass * mass);
+				epsMin = (1.1646 - mass * mass) / 2. / (E_in + P_in) * 1.e9;
+				epsMax = 0.007 * 2.73 * 11.;
+			} else {
+				// IRB: the lower bound of the nucleon energy is applied when sampling
+				epsMin = 0.00395;
+				epsMax = 12.2;
+			}
+			if (epsMin >= epsMax)
+				continue; // below threshold, rejection sampling reports it
+
+			double *x = &tabLogEps[k][i * tabPoints];
+			double *F = &tabCDF[k][i * tabPoints];
+			const double dx = std::log(epsMax / epsMin) / (tabPoints - 1);
+			double previous = 0.;
+			for (size_t j = 0; j < tabPoints; j++) {
+				x[j] = std::log(epsMin) + j * dx;
+				const double eps = std::exp(x[j]);
+				// distribution per ln(eps) of the respective SOPHIA sampler
+				double p;
+				if (bgFlag == 1)
+					p = eps * prob_eps(eps, onProton, std::pow(10., node), 0.);
+				else
+					p = getPhotonDensity(eps, node) / eps;
+				F[j] = (j == 0) ? 0. : F[j - 1] + 0.5 * (p + previous) * dx;
+				previous = p;
+			}
+			const double total = F[tabPoints - 1];
+			for (size_t j = 0; j < tabPoints; j++)
+				F[j] = (total > 0.) ? F[j] / total : 0.;
+		}
+	}
+}
+
+double PhotonFieldSampling::nodeCDF(int k, size_t node, double logEps) const {
+	const double *x = &tabLogEps[k][node * tabPoints];
+	const double *F = &tabCDF[k][node * tabPoints];
+	if (logEps <= x[0])
+		return 0.;
+	if (logEps >= x[tabPoints - 1])
+		return F[tabPoints - 1];
+	size_t j = std::upper_bound(x, x + tabPoints, logEps) - x;
+	return F[j - 1] + (F[j] - F[j - 1]) * (logEps - x[j - 1]) / (x[j] - x[j - 1]);
+}
+
+double PhotonFieldSampling::nodeInverseCDF(int k, size_t node, double u) const {
+	const double *x = &tabLogEps[k][node * tabPoints];
+	const double *F = &tabCDF[k][node * tabPoints];
+	size_t j = std::upper_bound(F, F + tabPoints, u) - F;
+	if (j == 0)
+		return x[0];
+	if (j == tabPoints)
+		return x[tabPoints - 1];
+	return x[j - 1] + (x[j] - x[j - 1]) * (u - F[j - 1]) / (F[j] - F[j - 1]);
+}
+
+double PhotonFieldSampling::sampleTable(bool onProton, double E_in, double z_in) const {
+	const double mass = onProton? 0.93827 : 0.93947;  // Gev/c^2
+	const double P_in = sqrt(E_in * E_in - mass * mass);  // GeV/c
+	const double epsThreshold = (1.1646 - mass * mass) / 2. / (E_in + P_in) * 1.e9;  // eV
+
+	double epsMin, epsMax, node;
+	if (bgFlag == 1) {
+		epsMin = epsThreshold;
+		epsMax = 0.007 * 2.73 * (1. + z_in);
+		node = std::log10(E_in);
+	} else {
+		epsMin = std::max(0.00395, epsThreshold);
+		epsMax = 12.2;
+		node = z_in;
+	}
+	if (epsMin > epsMax)
+		return -1.;
+
+	const double position = (node - tabNodeMin) / tabNodeStep;
+	if (not (position >= 0.) or position > tabNodes - 1)
+		return -1.;
+	const size_t i = std::min(static_cast<size_t>(position), tabNodes - 2);
+	const double w = position - i;
+	const int k = onProton? 0 : 1;
+
+	// same quantile of the bounded distributions of both nodes, interpolated in ln(eps)
+	const double u = Random::instance().rand();
+	double logEps = 0.;
+	for (size_t n = 0; n < 2; n++) {
+		double lo = (bgFlag == 1) ? 0. : nodeCDF(k, i + n, std::log(epsMin));
+		double hi = nodeCDF(k, i + n, std::log(epsMax));
+		if (hi <= lo)
+			return -1.;
+		logEps += ((n == 0) ? 1. - w : w) * nodeInverseCDF(k, i + n, lo + u * (hi - lo));
+	}
+	return std::exp(logEps);
 }
 
 double PhotonFieldSampling::sample_eps(bool onProton, double E_in, double z_in) const {
 	if (bgFlag == 0)
 		throw std::runtime_error("error: select photon field first: 1 (CMB) or 2 (IRB_Kneiske04)");
 
+	double eps = sampleTable(onProton, E_in, z_in);
+	if (eps < 0.)
+		eps = sampleRejection(onProton, E_in, z_in);
+	return eps * eV;
+}
+
+double PhotonFieldSampling::sampleRejection(bool onProton, double E_in, double z_in) const {
 	const double mass = onProton? 0.93827 : 0.93947;  // Gev/c^2
 	const double P_in = sqrt(E_in * E_in - mass * mass);  // GeV/c
 
@@ -179,7 +602,7 @@ double PhotonFieldSampling::sample_eps(bool onProton, double E_in, double z_in)
 		const double epsMin = (1.1646 - mass * mass) / 2. / (E_in + P_in) * 1.e9;
 		const double epsMax = 0.007 * tbb;
 		if (epsMin > epsMax) {
-			std::cout << "sample_eps (CMB): CMF energy is below threshold for nucleon energy " << E_in << " GeV !" << std::endl;
+			CRPROPA_DIAGNOSTIC("sample_eps (CMB): CMF energy below threshold", "nucleon energy " << E_in << " GeV");
 			return 0.;
 		}
 
@@ -204,7 +627,7 @@ double PhotonFieldSampling::sample_eps(bool onProton, double E_in, double z_in)
 		const double epsMin = std::max(0.00395, 1.e9 * (1.1646 - mass * mass) / 2. / (E_in + P_in));  // eV
 		const double epsMax = 12.2;  // eV
 		if (epsMin > epsMax) {
-			std::cout << "sample_eps (IRB): CMF energy is below threshold for nucleon energy " << E_in << " GeV !" << std::endl;
+			CRPROPA_DIAGNOSTIC("sample_eps (IRB): CMF energy below threshold", "nucleon energy " << E_in << " GeV");
 			return 0.;
 		}
 		const int i_max = static_cast<int>(10. * std::log(epsMax / epsMin)) + 1;
@@ -235,7 +658,7 @@ double PhotonFieldSampling::sample_eps(bool onProton, double E_in, double z_in)
 				keepTrying = false;
 		} while (keepTrying);
 	}
-	return eps * eV;
+	return eps;
 }
 
 double PhotonFieldSampling::prob_eps(double eps, bool onProton, double E_in, double z_in) const {
@@ -2,7 +2,10 @@
 #include "crpropa/Common.h"
 #include "crpropa/Units.h"
 #include "crpropa/Cosmology.h"
+#include "crpropa/Diagnostics.h"
+#include "crpropa/DintOperator.h"
 #include "crpropa/ProgressBar.h"
+#include "crpropa/module/PhotonOutput1D.h"
 
 #include "EleCa/Propagation.h"
 #include "EleCa/Particle.h"
@@ -20,8 +23,85 @@
 #include <limits>
 #include <cmath>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 namespace crpropa {
 
+typedef struct _Secondary {
+	double D, E, E0, E1, X1;
+	int ID, ID0, ID1;
+	double W; // weight
+} _Secondary;
+
+// reads the particles of an input file: PhotonOutput1D in the text or the
+// binary format, or Event1D with the additional columns
+class _SecondaryReader {
+	std::istream &in;
+	bool binary, photonOutput;
+	std::vector<PhotonOutput1D::Record> records;
+	size_t nRecords, iRecord;
+public:
+	_SecondaryReader(std::istream &in, const std::string &caller) :
+			in(in), binary(false), photonOutput(true), nRecords(0), iRecord(0) {
+		if (PhotonOutput1D::readBinaryHeader(in)) {
+			binary = true;
+			records.resize(65536);
+			return;
+		}
+		std::string line;
+		std::getline(in, line);
+		if (line == "#ID	E	D	pID	pE	iID	iE	iD") {
+			photonOutput = true;
+		} else if (line == "#	D	ID	E	ID0	E0	ID1	E1	X1") {
+			photonOutput = false;
+		} else {
+			throw std::runtime_error(caller + ": Wrong header of input file. Use PhotonOutput1D or Event1D with additional columns enabled.");
+		}
+	}
+
+	// read the next particle, false at the end of the file
+	bool next(_Secondary &s) {
+		s.W = 1;
+		if (binary) {
+			if (iRecord == nRecords) {
+				nRecords = PhotonOutput1D::readRecords(in, &records[0], records.size());
+				iRecord = 0;
+				if (nRecords == 0)
+					return false;
+			}
+			const PhotonOutput1D::Record &r = records[iRecord++];
+			s.ID = r.id;
+			s.E = r.energy;
+			s.X1 = r.distance;
+			s.ID1 = r.createdId;
+			s.E1 = r.createdEnergy;
+			s.ID0 = r.sourceId;
+			s.E0 = r.sourceEnergy;
+			s.D = r.sourceDistance;
+			return true;
+		}
+
+		while (in.good()) {
+			if (in.peek() == '#') {
+				in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+				continue;
+			}
+			if (photonOutput) {
+				in >> s.ID >> s.E >> s.X1 >> s.ID1 >> s.E1 >> s.ID0 >> s.E0 >> s.D;
+			} else {
+				in >> s.D >> s.ID >> s.E >> s.ID0 >> s.E0 >> s.ID1 >> s.E1 >> s.X1;
+			}
+			bool good = !in.fail();
+			in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+			if (good)
+				return true;
+		}
+		return false;
+	}
+};
+
 void ElecaPropagation(
 		const std::string &inputfile,
 		const std::string &outputfile,
@@ -30,7 +110,7 @@ void ElecaPropagation(
 		double magneticFieldStrength,
 		const std::string &background) {
 
-	std::ifstream infile(inputfile.c_str());
+	std::ifstream infile(inputfile.c_str(), std::ios::binary);
 	std::streampos startPosition = infile.tellg();
 
 	infile.seekg(0, std::ios::end);
@@ -47,16 +127,7 @@ void ElecaPropagation(
 		throw std::runtime_error(
 				"ElecaPropagation: could not open file " + inputfile);
 
-	bool PhotonOutput1D;
-	std::string line;
-	std::getline(infile, line);
-	if (line == "#ID	E	D	pID	pE	iID	iE	iD") {
-		PhotonOutput1D = true;
-	} else if (line == "#	D	ID	E	ID0	E0	ID1	E1	X1") { 
-		PhotonOutput1D = false;
-	} else {
-		throw std::runtime_error("ElecaPropagation: Wrong header of input file. Use PhotonOutput1D or Event1D with additional columns enabled.");
-	}
+	_SecondaryReader reader(infile, "ElecaPropagation");
 
 	eleca::setSeed();
 	eleca::Propagation propagation;
@@ -74,68 +145,50 @@ void ElecaPropagation(
 	output << "# iE          Energy [EeV] of source particle\n";
 	output << "# Generation  number of interactions during propagation before particle is created\n";
 
-	while (infile.good()) {
-		if (infile.peek() != '#') {
-			double D, E, E0, E1, X1;
-			int ID, ID0, ID1;
-			if (PhotonOutput1D) {
-				infile >> ID >> E >> X1 >> ID1 >> E1 >> ID0 >> E0 >> D;
-			} else {
-				infile >> D >> ID >> E >> ID0 >> E0 >> ID1 >> E1 >> X1;
-			}
-			if (showProgress) {
-				progressbar.setPosition(infile.tellg());
-			}
-
-			if (infile) {
-
-				double z = eleca::Mpc2z(X1);
-				eleca::Particle p0(ID, E * 1e18, z);
+	_Secondary s;
+	while (reader.next(s)) {
+		if (showProgress) {
+			progressbar.setPosition(infile.tellg());
+		}
 
-				std::vector<eleca::Particle> ParticleAtMatrix;
-				std::vector<eleca::Particle> ParticleAtGround;
-				ParticleAtMatrix.push_back(p0);
+		double z = eleca::Mpc2z(s.X1);
+		eleca::Particle p0(s.ID, s.E * 1e18, z);
 
-				while (ParticleAtMatrix.size() > 0) {
+		std::vector<eleca::Particle> ParticleAtMatrix;
+		std::vector<eleca::Particle> ParticleAtGround;
+		ParticleAtMatrix.push_back(p0);
 
-					eleca::Particle p1 = ParticleAtMatrix.back();
-					ParticleAtMatrix.pop_back();
+		while (ParticleAtMatrix.size() > 0) {
 
-					if (p1.IsGood()) {
-						propagation.Propagate(p1, ParticleAtMatrix,
-								ParticleAtGround);
-					}
-				}
+			eleca::Particle p1 = ParticleAtMatrix.back();
+			ParticleAtMatrix.pop_back();
 
-				for (int i = 0; i < ParticleAtGround.size(); ++i) {
-					eleca::Particle &p = ParticleAtGround[i];
-					if (p.GetType() != 22)
-						continue;
-					char buffer[256];
-					size_t bufferPos = 0;
-					bufferPos += std::sprintf(buffer + bufferPos, "%i\t", p.GetType());
-					bufferPos += std::sprintf(buffer + bufferPos, "%.4E\t", p.GetEnergy() / 1E18 );
-					bufferPos += std::sprintf(buffer + bufferPos, "%i\t", ID0);
-					bufferPos += std::sprintf(buffer + bufferPos, "%.4E\t", E0 );
-					bufferPos += std::sprintf(buffer + bufferPos, "%i", p.Generation());
-					bufferPos += std::sprintf(buffer + bufferPos, "\n");
-
-					output.write(buffer, bufferPos);
-				}
+			if (p1.IsGood()) {
+				propagation.Propagate(p1, ParticleAtMatrix,
+						ParticleAtGround);
 			}
 		}
 
-		infile.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+		for (int i = 0; i < ParticleAtGround.size(); ++i) {
+			eleca::Particle &p = ParticleAtGround[i];
+			if (p.GetType() != 22)
+				continue;
+			char buffer[256];
+			size_t bufferPos = 0;
+			bufferPos += std::sprintf(buffer + bufferPos, "%i\t", p.GetType());
+			bufferPos += std::sprintf(buffer + bufferPos, "%.4E\t", p.GetEnergy() / 1E18 );
+			bufferPos += std::sprintf(buffer + bufferPos, "%i\t", s.ID0);
+			bufferPos += std::sprintf(buffer + bufferPos, "%.4E\t", s.E0 );
+			bufferPos += std::sprintf(buffer + bufferPos, "%i", p.Generation());
+			bufferPos += std::sprintf(buffer + bufferPos, "\n");
+
+			output.write(buffer, bufferPos);
+		}
 	}
 	infile.close();
 	output.close();
 }
 
-typedef struct _Secondary {
-	double D, E, E0, E1, X1;
-	int ID, ID0, ID1;
-} _Secondary;
-
 bool _SecondarySortPredicate(const _Secondary& s1, const _Secondary& s2) {
 	return s1.X1 < s2.X1;
 }
@@ -144,21 +197,64 @@ void FillInSpectrum(Spectrum *a, const _Secondary &s) {
 	double logE = log10(s.E) + 18;  // log10(E/eV)
 	int iBin = floor((logE - MIN_ENERGY_EXP) / 0.1);  // bin number from 0 - NUM_MAIN_BINS-1
 	if (iBin >= NUM_MAIN_BINS) {
-		std::cout << "DintPropagation: Energy too high " << logE << std::endl;
+		CRPROPA_DIAGNOSTIC("DintPropagation: energy too high", "log10(E/eV) = " << logE);
 		return;
 	}
 	if (iBin < 0) {
-		std::cout << "DintPropagation: Energy too low " << logE << std::endl;
+		CRPROPA_DIAGNOSTIC("DintPropagation: energy too low", "log10(E/eV) = " << logE);
 		return;
 	}
 	if (s.ID == 22)
-		a->spectrum[PHOTON][iBin] += 1.;
+		a->spectrum[PHOTON][iBin] += s.W;
 	else if (s.ID == 11)
-		a->spectrum[ELECTRON][iBin] += 1.;
+		a->spectrum[ELECTRON][iBin] += s.W;
 	else if (s.ID == -11)
-		a->spectrum[POSITRON][iBin] += 1.;
+		a->spectrum[POSITRON][iBin] += s.W;
 	else
-		std::cout << "DintPropagation: Unhandled particle ID " << s.ID << std::endl;
+		CRPROPA_DIAGNOSTIC("DintPropagation: unhandled particle id", s.ID);
+}
+
+// propagate secondaries sorted by distance to D = 0 and add them to the final spectrum
+void PropagateSecondaries(DintEMCascade &dint, std::vector<_Secondary> &secondaries,
+		Spectrum *finalSpectrum, double aCutcascade_Magfield) {
+	const double dMargin = 0.1;  // distance bin width in [Mpc]
+
+	Spectrum inputSpectrum, outputSpectrum;
+	NewSpectrum(&inputSpectrum, NUM_MAIN_BINS);
+	NewSpectrum(&outputSpectrum, NUM_MAIN_BINS);
+	InitializeSpectrum(&inputSpectrum);
+
+	// process secondaries
+	while ((secondaries.size() > 0 ) && (secondaries.back().X1 > 0)) {
+		double Dmax = secondaries.back().X1;  // upper bound of distance bin
+		double Dmin = max(Dmax - dMargin, 0.);  // lower bound of distance bin
+
+		// add all secondaries within the current distance bin
+		while ((secondaries.size() > 0) && (secondaries.back().X1 > Dmin)) {
+			FillInSpectrum(&inputSpectrum, secondaries.back());
+			secondaries.pop_back();
+		}
+
+		// propagate to next closest particle or to D=0
+		double D = 0;
+		if (secondaries.size() > 0)
+			D = secondaries.back().X1;
+
+		// propagate distance step and make the output the new input spectrum
+		InitializeSpectrum(&outputSpectrum);
+		dint.propagate(Dmax, D, &inputSpectrum, &outputSpectrum, aCutcascade_Magfield);
+		SetSpectrum(&inputSpectrum, &outputSpectrum);
+	}
+
+	// add remaining secondaries at D=0 to output spectrum
+	while (secondaries.size() > 0) {
+		FillInSpectrum(&inputSpectrum, secondaries.back());
+		secondaries.pop_back();
+	}
+
+	AddSpectrum(finalSpectrum, &inputSpectrum);
+	DeleteSpectrum(&outputSpectrum);
+	DeleteSpectrum(&inputSpectrum);
 }
 
 void DintPropagation(
@@ -180,52 +276,30 @@ void DintPropagation(
 		throw std::runtime_error(
 				"DintPropagation: could not open file " + outputfile);
 
-	std::ifstream infile(inputfile.c_str());
+	std::ifstream infile(inputfile.c_str(), std::ios::binary);
 	if (!infile.good())
 		throw std::runtime_error(
 				"DintPropagation: could not open file " + inputfile);
 
-	bool PhotonOutput1D;
-	std::string line;
-	std::getline(infile, line);
-	if (line == "#ID	E	D	pID	pE	iID	iE	iD") {
-		PhotonOutput1D = true;
-	} else if (line == "#	D	ID	E	ID0	E0	ID1	E1	X1") { 
-		PhotonOutput1D = false;
-	} else {
-		throw std::runtime_error("DintPropagation: Wrong header of input file. Use PhotonOutput1D or Event1D with additional columns enabled.");
-	}
+	_SecondaryReader reader(infile, "DintPropagation");
 
 	// initialize the spectrum
 	Spectrum finalSpectrum;
 	NewSpectrum(&finalSpectrum, NUM_MAIN_BINS);
 	InitializeSpectrum(&finalSpectrum);
 
-	std::string dataPath = getDataPath("dint");
-	double B = magneticFieldStrength / gauss;
-	double h = H0() * Mpc / 1000;
-	DintEMCascade dint(IRBFlag, RadioFlag, dataPath, B, h, omegaM(), omegaL());
+	DintInstance dint(IRBFlag, RadioFlag, magneticFieldStrength);
 
 	const size_t nBuffer = 7.5E7;  // maximum number of simultaneously processed particles, keep memory requirement < 1GB
-	const double dMargin = 0.1;  // distance bin width in [Mpc]
 
-	while (infile.good()) {
+	while (true) {
 		// read up to nBuffer secondaries from input file
 		std::vector<_Secondary> secondaries;
 		secondaries.reserve(nBuffer);
-		while (infile.good() && (secondaries.size() < nBuffer)) {
-			if (infile.peek() != '#') {
-				_Secondary s;
-				if (PhotonOutput1D) {
-					infile >> s.ID >> s.E >> s.X1 >> s.ID1 >> s.E1 >> s.ID0 >> s.E0 >> s.D;
-				} else {
-					infile >> s.D >> s.ID >> s.E >> s.ID0 >> s.E0 >> s.ID1 >> s.E1 >> s.X1;
-				}
-				s.X1 = comoving2LightTravelDistance(s.X1 * Mpc) / Mpc;  // DintEMCascade expects light travel distance
-				if (infile)
-					secondaries.push_back(s);
-			}
-			infile.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+		_Secondary s;
+		while ((secondaries.size() < nBuffer) && reader.next(s)) {
+			s.X1 = comoving2LightTravelDistance(s.X1 * Mpc) / Mpc;  // DintEMCascade expects light travel distance
+			secondaries.push_back(s);
 		}
 
 		if (secondaries.empty())
@@ -235,42 +309,7 @@ void DintPropagation(
 		std::sort(secondaries.begin(), secondaries.end(),
 				_SecondarySortPredicate);
 
-		Spectrum inputSpectrum, outputSpectrum;
-		NewSpectrum(&inputSpectrum, NUM_MAIN_BINS);
-		NewSpectrum(&outputSpectrum, NUM_MAIN_BINS);
-		InitializeSpectrum(&inputSpectrum);
-
-		// process secondaries
-		while ((secondaries.size() > 0 ) && (secondaries.back().X1 > 0)) {
-			double Dmax = secondaries.back().X1;  // upper bound of distance bin
-			double Dmin = max(Dmax - dMargin, 0.);  // lower bound of distance bin
-
-			// add all secondaries within the current distance bin
-			while ((secondaries.size() > 0) && (secondaries.back().X1 > Dmin)) {
-				FillInSpectrum(&inputSpectrum, secondaries.back());
-				secondaries.pop_back();
-			}
-
-			// propagate to next closest particle or to D=0
-			double D = 0;
-			if (secondaries.size() > 0)
-				D = secondaries.back().X1;
-
-			// propagate distance step and make the output the new input spectrum
-			InitializeSpectrum(&outputSpectrum);
-			dint.propagate(Dmax, D, &inputSpectrum, &outputSpectrum, aCutcascade_Magfield);
-			SetSpectrum(&inputSpectrum, &outputSpectrum);
-		}
-
-		// add remaining secondaries at D=0 to output spectrum
-		while (secondaries.size() > 0) {
-			FillInSpectrum(&inputSpectrum, secondaries.back());
-			secondaries.pop_back();
-		}
-
-		AddSpectrum(&finalSpectrum, &inputSpectrum);
-		DeleteSpectrum(&outputSpectrum);
-		DeleteSpectrum(&inputSpectrum);
+		PropagateSecondaries(*dint, secondaries, &finalSpectrum, aCutcascade_Magfield);
 	}
 
 	// output
@@ -294,6 +333,130 @@ void DintPropagation(
 
 
 
+std::vector<double> DintPropagation(
+		const std::vector<int> &ids,
+		const std::vector<double> &energies,
+		const std::vector<double> &distances,
+		const std::vector<double> &weights,
+		int IRBFlag,
+		int RadioFlag,
+		double magneticFieldStrength,
+		double aCutcascade_Magfield) {
+	size_t n = ids.size();
+	if ((energies.size() != n) or (distances.size() != n) or (!weights.empty() and (weights.size() != n)))
+		throw std::runtime_error("DintPropagation: particle arrays of different length");
+
+	std::vector<_Secondary> secondaries;
+	secondaries.reserve(n);
+	for (size_t i = 0; i < n; i++) {
+		if ((ids[i] != 22) and (ids[i] != 11) and (ids[i] != -11))
+			continue;
+		_Secondary s = _Secondary();
+		s.ID = ids[i];
+		s.E = energies[i] / EeV;
+		s.X1 = comoving2LightTravelDistance(distances[i]) / Mpc;  // DintEMCascade expects light travel distance
+		s.W = weights.empty() ? 1 : weights[i];
+		secondaries.push_back(s);
+	}
+	n = secondaries.size();
+	std::sort(secondaries.begin(), secondaries.end(), _SecondarySortPredicate);
+
+	Spectrum finalSpectrum;
+	NewSpectrum(&finalSpectrum, NUM_MAIN_BINS);
+	InitializeSpectrum(&finalSpectrum);
+
+	// the cascade is linear in the injected particles: groups of neighbouring
+	// distances are propagated independently, each thread with its own DINT state
+	size_t nGroups = 1;
+#ifdef _OPENMP
+	nGroups = omp_get_max_threads();
+#endif
+	nGroups = std::max<size_t>(std::min(nGroups, n), 1);
+
+#pragma omp parallel num_threads(nGroups)
+	{
+		DintInstance dint(IRBFlag, RadioFlag, magneticFieldStrength);
+		Spectrum threadSpectrum;
+		NewSpectrum(&threadSpectrum, NUM_MAIN_BINS);
+		InitializeSpectrum(&threadSpectrum);
+
+#pragma omp for schedule(dynamic, 1)
+		for (int g = 0; g < (int)nGroups; g++) {
+			std::vector<_Secondary> group(secondaries.begin() + g * n / nGroups,
+					secondaries.begin() + (g + 1) * n / nGroups);
+			PropagateSecondaries(*dint, group, &threadSpectrum, aCutcascade_Magfield);
+		}
+
+#pragma omp critical(DintPropagation)
+		AddSpectrum(&finalSpectrum, &threadSpectrum);
+		DeleteSpectrum(&threadSpectrum);
+	}
+
+	std::vector<double> spectrum(3 * NUM_MAIN_BINS);
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < NUM_MAIN_BINS; j++)
+			spectrum[i * NUM_MAIN_BINS + j] = finalSpectrum.spectrum[i][j];
+	DeleteSpectrum(&finalSpectrum);
+	return spectrum;
+}
+
+std::vector<double> DintPropagation(
+		const ParticleCollector &collector,
+		int IRBFlag,
+		int RadioFlag,
+		double magneticFieldStrength,
+		double aCutcascade_Magfield) {
+	std::vector<int> ids;
+	std::vector<double> energies, distances, weights;
+	for (ParticleCollector::const_iterator i = collector.begin(); i != collector.end(); ++i) {
+		const Candidate *c = i->get();
+		ids.push_back(c->current.getId());
+		energies.push_back(c->current.getEnergy());
+		distances.push_back(c->current.getPosition().getR());
+		weights.push_back(c->getWeight());
+	}
+	return DintPropagation(ids, energies, distances, weights, IRBFlag, RadioFlag,
+			magneticFieldStrength, aCutcascade_Magfield);
+}
+
+std::vector<double> DintPropagation(
+		const std::vector<int> &ids,
+		const std::vector<double> &energies,
+		const std::vector<double> &distances,
+		const std::vector<double> &weights,
+		const DintOperator &op) {
+	size_t n = ids.size();
+	if ((energies.size() != n) or (distances.size() != n) or (!weights.empty() and (weights.size() != n)))
+		throw std::runtime_error("DintPropagation: particle arrays of different length");
+
+	// distance and energy histograms as in EMCascade
+	int nD = op.getNumberOfDistanceBins();
+	int nE = op.getNumberOfEnergyBins();
+	double dD = op.getMaximumDistance() / nD;
+	std::vector<double> injection(3 * nD * nE, 0);
+	for (size_t i = 0; i < n; i++) {
+		int s;
+		if (ids[i] == 22)
+			s = 0;
+		else if (ids[i] == 11)
+			s = 1;
+		else if (ids[i] == -11)
+			s = 2;
+		else
+			continue;
+		double logE = log10(energies[i] / eV);
+		if ((logE < 7) or (logE >= 7 + 0.1 * nE))
+			continue;
+		if ((distances[i] < 0) or (distances[i] >= op.getMaximumDistance()))
+			continue;
+		int iE = std::min(int((logE - 7) / 0.1), nE - 1);
+		int iD = std::min(int(distances[i] / dD), nD - 1);
+		injection[(s * nD + iD) * nE + iE] += weights.empty() ? 1 : weights[i];
+	}
+	return op.fold(injection);
+}
+
+
 bool _ParticlesAtGroundSortPredicate(const eleca::Particle& p1, const eleca::Particle& p2) {
 	return p1.Getz() < p2.Getz();
 }
@@ -308,7 +471,7 @@ void DintElecaPropagation(
 
 	////////////////////////////////////////////////////////////////////////
 	//Initialize EleCa
-	std::ifstream infile(inputfile.c_str());
+	std::ifstream infile(inputfile.c_str(), std::ios::binary);
 	std::streampos startPosition = infile.tellg();
 
 	infile.seekg(0, std::ios::end);
@@ -324,16 +487,7 @@ void DintElecaPropagation(
 		throw std::runtime_error(
 				"EleCaPropagation: could not open file " + inputfile);
 
-	bool PhotonOutput1D;
-	std::string line;
-	std::getline(infile, line);
-	if (line == "#ID	E	D	pID	pE	iID	iE	iD") {
-		PhotonOutput1D = true;
-	} else if (line == "#	D	ID	E	ID0	E0	ID1	E1	X1") { 
-		PhotonOutput1D = false;
-	} else {
-		throw std::runtime_error("DintElecaPropagation: Wrong header of input file. Use PhotonOutput1D or Event1D with additional columns enabled.");
-	}
+	_SecondaryReader reader(infile, "DintElecaPropagation");
 
 	eleca::setSeed();
 	eleca::Propagation propagation;
@@ -360,35 +514,22 @@ void DintElecaPropagation(
 	NewSpectrum(&finalSpectrum, NUM_MAIN_BINS);
 	InitializeSpectrum(&finalSpectrum);
 
-	std::string dataPath = getDataPath("dint");
-	double h = H0() * Mpc / 1000;
-	double ol = omegaL();
-	double om = omegaM();
-	DintEMCascade dint(4, 4, dataPath, magneticFieldStrength/gauss, h, om, ol);
+	DintInstance dint(4, 4, magneticFieldStrength);
 
 	////////////////////////////////////////////////////////////////////////
 	// Loop over infile
 
-	while (infile.good()) {
+	_Secondary s;
+	bool more = true;
+	while (more) {
 		/// Eleca Propagation
-		if (infile.peek() == '#') {
-			infile.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-			continue;
-		}
-
-		double D, E, E0, E1, X1;
-		int ID, ID0, ID1;
-		if (PhotonOutput1D) {
-			infile >> ID >> E >> X1 >> ID1 >> E1 >> ID0 >> E0 >> D;
-		} else {
-			infile >> D >> ID >> E >> ID0 >> E0 >> ID1 >> E1 >> X1;
-		}
-		if (showProgress) {
-			progressbar.setPosition(infile.tellg());
-		}
-		if (infile) { // stop at last line
-			double z = eleca::Mpc2z(X1);
-			eleca::Particle p0(ID, E * 1e18, z);
+		more = reader.next(s);
+		if (more) { // stop at last line
+			if (showProgress) {
+				progressbar.setPosition(infile.tellg());
+			}
+			double z = eleca::Mpc2z(s.X1);
+			eleca::Particle p0(s.ID, s.E * 1e18, z);
 
 			std::vector<eleca::Particle> ParticleAtMatrix;
 			ParticleAtMatrix.push_back(p0);
@@ -405,7 +546,7 @@ void DintElecaPropagation(
 		}
 
 		// The vector is larger than ~1GB, or the infile is completely read - better call DINT.
-		if (ParticleAtGround.size() > 1000000 || !infile) {
+		if (ParticleAtGround.size() > 1000000 || !more) {
 			const double dMargin = 0.1 * Mpc;
 
 			std::sort(ParticleAtGround.begin(), ParticleAtGround.end(), _ParticlesAtGroundSortPredicate);
@@ -426,15 +567,14 @@ void DintElecaPropagation(
 						int maxBin = (int) ((log10(criticalEnergy * ELECTRON_MASS) - MIN_ENERGY_EXP) * BINS_PER_DECADE + 0.5 + 1); // +1 line before to avoid conversion error to int for negative values (int(-0.7) = 0)
 						maxBin -= 1; // remove the additional 1 from line before
 						if (maxBin >= NUM_MAIN_BINS) {
-							std::cout << "DintPropagation: Energy too high " <<
-								ParticleAtGround.back().GetEnergy() << " eV"  <<
-								std::endl;
+							CRPROPA_DIAGNOSTIC("DintPropagation: energy too high",
+									ParticleAtGround.back().GetEnergy() << " eV");
 							ParticleAtGround.pop_back();
 							continue;
 						}
 						if (maxBin < 0) {
-							std::cout << "DintPropagation: Energy too low " <<
-								ParticleAtGround.back().GetEnergy() << " eV"  << std::endl;
+							CRPROPA_DIAGNOSTIC("DintPropagation: energy too low",
+									ParticleAtGround.back().GetEnergy() << " eV");
 							ParticleAtGround.pop_back();
 							continue;
 						}
@@ -446,8 +586,7 @@ void DintElecaPropagation(
 						else if (Id == -11)
 							inputSpectrum.spectrum[POSITRON][maxBin] += 1.;
 						else {
-							std::cout << "DintPropagation: Unhandled particle ID " << Id
-								<< std::endl;
+							CRPROPA_DIAGNOSTIC("DintPropagation: unhandled particle id", Id);
 						}
 						ParticleAtGround.pop_back();
 					} else
@@ -460,7 +599,7 @@ void DintElecaPropagation(
 					D = redshift2LightTravelDistance(ParticleAtGround.back().Getz());
 
 				InitializeSpectrum(&outputSpectrum);
-				dint.propagate(currentDistance / Mpc, D / Mpc, &inputSpectrum,
+				dint->propagate(currentDistance / Mpc, D / Mpc, &inputSpectrum,
 						&outputSpectrum, aCutcascade_Magfield);
 				SetSpectrum(&inputSpectrum, &outputSpectrum);
 			} // while (secondaries.size() > 0)
@@ -0,0 +1,242 @@
+#include "crpropa/QuantizedGrid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace crpropa {
+
+// file header, the values follow at offset 128 so that they are aligned
+struct QuantizedGridHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t components;
+	uint64_t Nx, Ny, Nz;
+	double origin[3];
+	double spacing[3];
+	uint32_t reflective;
+	float scale;
+	uint32_t encoding; // GridEncoding, 0 (GridInt16) in files without it
+};
+
+static const char quantizedGridMagic[8] = {'C', 'R', 'P', 'Q', 'G', 'R', 'I', 'D'};
+static const size_t quantizedGridOffset = 128;
+
+uint16_t floatToHalf(float f) {
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+	uint16_t sign = (bits >> 16) & 0x8000;
+	uint32_t absBits = bits & 0x7fffffff;
+	if (absBits >= 0x7f800000) // infinity and NaN
+		return sign | 0x7c00 | ((absBits > 0x7f800000) ? 0x200 : 0);
+	if (absBits >= 0x477ff000) // rounds above 65504
+		return sign | 0x7c00;
+	if (absBits < 0x38800000) { // subnormal below 2^-14, steps of 2^-24
+		float a;
+		memcpy(&a, &absBits, sizeof(a));
+		return sign | uint16_t(nearbyint(a * 16777216.f));
+	}
+	// rebias the exponent and round the mantissa to nearest even, a carry
+	// increments the exponent
+	uint32_t h = (absBits - 0x38000000) >> 13;
+	uint32_t rest = absBits & 0x1fff;
+	if ((rest > 0x1000) or ((rest == 0x1000) and (h & 1)))
+		h++;
+	return sign | uint16_t(h);
+}
+
+// smallest power of two with maxAbs / scale <= 32767
+static float powerOfTwoScale(float maxAbs) {
+	if (not std::isfinite(maxAbs))
+		throw std::runtime_error("QuantizedGrid: grid contains non-finite values");
+	if (maxAbs == 0)
+		return 1;
+	float scale = ldexp(1.f, int(ceil(log2(maxAbs / 32767.))));
+	while (maxAbs / scale > 32767)
+		scale *= 2;
+	return scale;
+}
+
+// offset of the block scales behind the values, aligned to 8 bytes
+static size_t blockScaleOffset(size_t valueBytes) {
+	return quantizedGridOffset + (valueBytes + 7) / 8 * 8;
+}
+
+template<typename T>
+QuantizedGrid<T>::QuantizedGrid(const Grid<T> &grid, GridEncoding encoding) :
+		blockScaleData(0), mapping(0), mappingSize(0), encoding(encoding),
+		Nx(grid.getNx()), Ny(grid.getNy()), Nz(grid.getNz()),
+		NBy((grid.getNy() + 7) / 8), NBz((grid.getNz() + 7) / 8),
+		origin(grid.getOrigin()), spacing(grid.getSpacing()),
+		reflective(grid.isReflective()) {
+	gridOrigin = origin + spacing / 2;
+	const int C = QuantizedValue<T>::components;
+	values.resize(C * Nx * Ny * Nz);
+	data = values.empty() ? 0 : &values[0];
+
+	if (encoding == GridBlockInt16) {
+		// one scale per block of 8^3 grid points
+		size_t NBx = (Nx + 7) / 8;
+		blockScales.resize(NBx * NBy * NBz);
+		blockScaleData = blockScales.empty() ? 0 : &blockScales[0];
+		scale = 0;
+		for (size_t bx = 0; bx < NBx; bx++)
+			for (size_t by = 0; by < NBy; by++)
+				for (size_t bz = 0; bz < NBz; bz++) {
+					size_t xEnd = std::min(Nx, 8 * bx + 8);
+					size_t yEnd = std::min(Ny, 8 * by + 8);
+					size_t zEnd = std::min(Nz, 8 * bz + 8);
+					float maxAbs = 0;
+					for (size_t ix = 8 * bx; ix < xEnd; ix++)
+						for (size_t iy = 8 * by; iy < yEnd; iy++)
+							for (size_t iz = 8 * bz; iz < zEnd; iz++)
+								maxAbs = std::max(maxAbs, QuantizedValue<T>::maxAbs(grid.get(ix, iy, iz)));
+					float s = powerOfTwoScale(maxAbs);
+					blockScales[(bx * NBy + by) * NBz + bz] = s;
+					scale = std::max(scale, s);
+					for (size_t ix = 8 * bx; ix < xEnd; ix++)
+						for (size_t iy = 8 * by; iy < yEnd; iy++)
+							for (size_t iz = 8 * bz; iz < zEnd; iz++)
+								QuantizedValue<T>::toQuantized(grid.get(ix, iy, iz), 1 / s,
+										&values[C * (ix * Ny * Nz + iy * Nz + iz)]);
+				}
+		return;
+	}
+
+	float maxAbs = 0;
+	for (size_t ix = 0; ix < Nx; ix++)
+		for (size_t iy = 0; iy < Ny; iy++)
+			for (size_t iz = 0; iz < Nz; iz++)
+				maxAbs = std::max(maxAbs, QuantizedValue<T>::maxAbs(grid.get(ix, iy, iz)));
+	scale = powerOfTwoScale(maxAbs);
+
+	for (size_t ix = 0; ix < Nx; ix++)
+		for (size_t iy = 0; iy < Ny; iy++)
+			for (size_t iz = 0; iz < Nz; iz++) {
+				int16_t *q = &values[C * (ix * Ny * Nz + iy * Nz + iz)];
+				if (encoding == GridFloat16)
+					QuantizedValue<T>::toHalf(grid.get(ix, iy, iz), 1 / scale, q);
+				else
+					QuantizedValue<T>::toQuantized(grid.get(ix, iy, iz), 1 / scale, q);
+			}
+}
+
+template<typename T>
+QuantizedGrid<T>::QuantizedGrid(const std::string &filename) :
+		data(0), mapping(0), mappingSize(0) {
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("QuantizedGrid: could not open " + filename);
+
+	QuantizedGridHeader header;
+	struct stat st;
+	if ((fstat(fd, &st) != 0) or (size_t(st.st_size) < quantizedGridOffset)
+			or (pread(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header)))
+			or (memcmp(header.magic, quantizedGridMagic, 8) != 0)) {
+		close(fd);
+		throw std::runtime_error("QuantizedGrid: " + filename + " is not a quantized grid");
+	}
+	if ((header.version != 1) or (int(header.components) != QuantizedValue<T>::components)
+			or (header.encoding > GridFloat16)) {
+		close(fd);
+		throw std::runtime_error("QuantizedGrid: " + filename + " has a different version or type");
+	}
+
+	Nx = header.Nx;
+	Ny = header.Ny;
+	Nz = header.Nz;
+	origin = Vector3d(header.origin[0], header.origin[1], header.origin[2]);
+	spacing = Vector3d(header.spacing[0], header.spacing[1], header.spacing[2]);
+	gridOrigin = origin + spacing / 2;
+	NBy = (Ny + 7) / 8;
+	NBz = (Nz + 7) / 8;
+	reflective = header.reflective;
+	scale = header.scale;
+	encoding = GridEncoding(header.encoding);
+
+	size_t valueBytes = sizeof(int16_t) * QuantizedValue<T>::components * Nx * Ny * Nz;
+	mappingSize = quantizedGridOffset + valueBytes;
+	if (encoding == GridBlockInt16)
+		mappingSize = blockScaleOffset(valueBytes) + sizeof(float) * getNumberOfBlocks();
+	if (size_t(st.st_size) != mappingSize) {
+		close(fd);
+		throw std::runtime_error("QuantizedGrid: size of " + filename + " does not match the grid");
+	}
+
+	// private mapping: the pages are shared with all processes mapping the file
+	void *m = mmap(0, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		throw std::runtime_error("QuantizedGrid: could not map " + filename);
+	mapping = m;
+	data = reinterpret_cast<const int16_t*>(static_cast<char*>(m) + quantizedGridOffset);
+	blockScaleData = 0;
+	if (encoding == GridBlockInt16)
+		blockScaleData = reinterpret_cast<const float*>(static_cast<char*>(m) + blockScaleOffset(valueBytes));
+}
+
+template<typename T>
+QuantizedGrid<T>::~QuantizedGrid() {
+	if (mapping)
+		munmap(mapping, mappingSize);
+}
+
+template<typename T>
+void QuantizedGrid<T>::save(const std::string &filename) const {
+	QuantizedGridHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, quantizedGridMagic, 8);
+	header.version = 1;
+	header.components = QuantizedValue<T>::components;
+	header.Nx = Nx;
+	header.Ny = Ny;
+	header.Nz = Nz;
+	for (int i = 0; i < 3; i++) {
+		header.origin[i] = origin.data[i];
+		header.spacing[i] = spacing.data[i];
+	}
+	header.reflective = reflective;
+	header.scale = scale;
+	header.encoding = encoding;
+
+	char head[quantizedGridOffset];
+	memset(head, 0, quantizedGridOffset);
+	memcpy(head, &header, sizeof(header));
+
+	std::ofstream fout(filename.c_str(), std::ios::binary);
+	if (!fout)
+		throw std::runtime_error("QuantizedGrid: could not write " + filename);
+	fout.write(head, quantizedGridOffset);
+	size_t valueBytes = sizeof(int16_t) * QuantizedValue<T>::components * Nx * Ny * Nz;
+	fout.write(reinterpret_cast<const char*>(data), valueBytes);
+	if (encoding == GridBlockInt16) {
+		char padding[8] = {0};
+		fout.write(padding, blockScaleOffset(valueBytes) - quantizedGridOffset - valueBytes);
+		fout.write(reinterpret_cast<const char*>(blockScaleData), sizeof(float) * getNumberOfBlocks());
+	}
+	if (!fout)
+		throw std::runtime_error("QuantizedGrid: could not write " + filename);
+}
+
+template<typename T>
+ref_ptr<Grid<T> > QuantizedGrid<T>::toGrid() const {
+	ref_ptr<Grid<T> > grid = new Grid<T>(origin, Nx, Ny, Nz, spacing);
+	grid->setReflective(reflective);
+	for (size_t ix = 0; ix < Nx; ix++)
+		for (size_t iy = 0; iy < Ny; iy++)
+			for (size_t iz = 0; iz < Nz; iz++)
+				grid->get(ix, iy, iz) = get(ix, iy, iz);
+	return grid;
+}
+
+template class QuantizedGrid<float>;
+template class QuantizedGrid<Vector3f>;
+
+} // namespace crpropa
@@ -65,18 +65,183 @@
 
 namespace crpropa {
 
-Random::Random(const uint32_t& oneSeed) {
+Random::Random(const uint32_t& oneSeed) : counterBased(false), streamKey(0), streamCounter(0), streamLeft(0) {
 	seed(oneSeed);
 }
 
-Random::Random(uint32_t * const bigSeed, const uint32_t seedLength) {
+Random::Random(uint32_t * const bigSeed, const uint32_t seedLength) : counterBased(false), streamKey(0), streamCounter(0), streamLeft(0) {
 	seed(bigSeed, seedLength);
 }
 
-Random::Random() {
+Random::Random() : counterBased(false), streamKey(0), streamCounter(0), streamLeft(0) {
 	seed();
 }
 
+void Random::setStream(uint64_t key, uint64_t counter) {
+	counterBased = true;
+	streamKey = key;
+	streamCounter = counter;
+	streamLeft = 0;
+}
+
+void Random::clearStream() {
+	counterBased = false;
+}
+
+bool Random::hasStream() const {
+	return counterBased;
+}
+
+uint64_t Random::getStreamKey() const {
+	return streamKey;
+}
+
+uint64_t Random::getStreamCounter() const {
+	return streamCounter;
+}
+
+uint64_t Random::deriveStreamKey(uint64_t key, uint64_t index) {
+	// splitmix64 finalizer
+	uint64_t z = key + 0x9e3779b97f4a7c15ULL * (index + 1);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+// Philox4x32-10, J. K. Salmon et al., "Parallel random numbers: as easy as
+// 1, 2, 3", SC '11
+static inline void philox4x32(uint64_t counter, uint64_t key, uint32_t *out) {
+	uint32_t c[4] = {uint32_t(counter), uint32_t(counter >> 32), 0, 0};
+	uint32_t k[2] = {uint32_t(key), uint32_t(key >> 32)};
+	for (int round = 0; round < 10; round++) {
+		uint64_t p0 = uint64_t(0xD2511F53UL) * c[0];
+		uint64_t p1 = uint64_t(0xCD9E8D57UL) * c[2];
+		uint32_t n[4] = {uint32_t(p1 >> 32) ^ c[1] ^ k[0], uint32_t(p1),
+				uint32_t(p0 >> 32) ^ c[3] ^ k[1], uint32_t(p0)};
+		c[0] = n[0]; c[1] = n[1]; c[2] = n[2]; c[3] = n[3];
+		k[0] += 0x9E3779B9UL;
+		k[1] += 0xBB67AE85UL;
+	}
+	for (int i = 0; i < 4; i++)
+		out[i] = c[i];
+}
+
+uint32_t Random::streamInt() {
+	if (streamLeft == 0) {
+		philox4x32(streamCounter, streamKey, streamBlock);
+		streamCounter++;
+		streamLeft = 4;
+	}
+	return streamBlock[4 - streamLeft--];
+}
+
+void Random::fillInt(uint32_t *values, size_t n) {
+	size_t i = 0;
+	if (counterBased) {
+		while (i < n && streamLeft > 0)
+			values[i++] = streamInt();
+		// whole blocks are independent of each other
+		for (; i + 4 <= n; i += 4)
+			philox4x32(streamCounter++, streamKey, values + i);
+		while (i < n)
+			values[i++] = streamInt();
+		return;
+	}
+
+	while (i < n) {
+		if (left == 0)
+			reload();
+		size_t m = std::min(size_t(left), n - i);
+		const uint32_t *s = pNext;
+		uint32_t *v = values + i;
+		for (size_t j = 0; j < m; j++) {
+			uint32_t s1 = s[j];
+			s1 ^= (s1 >> 11);
+			s1 ^= (s1 << 7) & 0x9d2c5680UL;
+			s1 ^= (s1 << 15) & 0xefc60000UL;
+			v[j] = s1 ^ (s1 >> 18);
+		}
+		pNext += m;
+		left -= int(m);
+		i += m;
+	}
+}
+
+void Random::fillUniform(double *values, size_t n, double min, double max) {
+	const size_t chunk = 256;
+	uint32_t ints[chunk];
+	double scale = (max - min) * (1.0 / 4294967296.0);
+	for (size_t i = 0; i < n; i += chunk) {
+		size_t m = std::min(chunk, n - i);
+		fillInt(ints, m);
+		for (size_t j = 0; j < m; j++)
+			values[i + j] = min + double(ints[j]) * scale;
+	}
+}
+
+void Random::fillNormal(double *values, size_t n, double mean, double sigma) {
+	const size_t chunk = 256;
+	uint32_t ints[chunk];
+	for (size_t i = 0; i < n; i += chunk) {
+		size_t m = std::min(chunk, n - i);
+		size_t pairs = (m + 1) / 2;
+		fillInt(ints, 2 * pairs);
+		for (size_t j = 0; j < pairs; j++) {
+			// u1 in (0,1) for the logarithm, u2 in [0,1)
+			double u1 = (double(ints[2 * j]) + 0.5) * (1.0 / 4294967296.0);
+			double u2 = double(ints[2 * j + 1]) * (1.0 / 4294967296.0);
+			double r = sqrt(-2.0 * log(u1)) * sigma;
+			double phi = 2.0 * M_PI * u2;
+			values[i + 2 * j] = mean + r * cos(phi);
+			if (2 * j + 1 < m)
+				values[i + 2 * j + 1] = mean + r * sin(phi);
+		}
+	}
+}
+
+void Random::fillUnitVectors(Vector3d *values, size_t n) {
+	const size_t chunk = 128;
+	uint32_t ints[2 * chunk];
+	for (size_t i = 0; i < n; i += chunk) {
+		size_t m = std::min(chunk, n - i);
+		fillInt(ints, 2 * m);
+		for (size_t j = 0; j < m; j++) {
+			double z = -1.0 + 2.0 * double(ints[2 * j]) * (1.0 / 4294967295.0);
+			double t = -M_PI + 2.0 * M_PI * double(ints[2 * j + 1]) * (1.0 / 4294967295.0);
+			double r = sqrt(1 - z * z);
+			values[i + j] = Vector3d(r * cos(t), r * sin(t), z);
+		}
+	}
+}
+
+void Random::fillPowerLaw(double *values, size_t n, double index, double min, double max) {
+	if ((min < 0) || (max < min)) {
+		throw std::runtime_error(
+				"Power law distribution only possible for 0 <= min <= max");
+	}
+	// the uniform numbers of rand(), in [0,1]
+	const size_t chunk = 256;
+	uint32_t ints[chunk];
+	for (size_t i = 0; i < n; i += chunk) {
+		size_t m = std::min(chunk, n - i);
+		fillInt(ints, m);
+		for (size_t j = 0; j < m; j++)
+			values[i + j] = double(ints[j]) * (1.0 / 4294967295.0);
+	}
+	if ((std::abs(index + 1.0)) < std::numeric_limits<double>::epsilon()) {
+		double part1 = log(max);
+		double part2 = log(min);
+		for (size_t i = 0; i < n; i++)
+			values[i] = exp((part1 - part2) * values[i] + part2);
+	} else {
+		double part1 = pow(max, index + 1);
+		double part2 = pow(min, index + 1);
+		double ex = 1 / (index + 1);
+		for (size_t i = 0; i < n; i++)
+			values[i] = pow((part1 - part2) * values[i] + part2, ex);
+	}
+}
+
 double Random::rand() {
 	return double(randInt()) * (1.0 / 4294967295.0);
 }
@@ -147,9 +312,10 @@ Vector3d Random::randVector() {
 
 Vector3d Random::randVectorAroundMean(const Vector3d &meanDirection,
 		double angle) {
+	// getRotated expects a unit axis, otherwise the angle is not kept
 	Vector3d axis = meanDirection.cross(randVector());
 	Vector3d v = meanDirection;
-	return v.getRotated(axis, angle);
+	return v.getRotated(axis / axis.getR(), angle);
 }
 
 Vector3d Random::randFisherVector(const Vector3d &meanDirection, double kappa) {
@@ -247,6 +413,9 @@ double Random::randExponential() {
 }
 
 uint32_t Random::randInt() {
+	if (counterBased)
+		return streamInt();
+
 	if (left == 0)
 		reload();
 	--left;
@@ -387,7 +556,16 @@ void Random::initialize(const uint32_t seed) {
 	}
 }
 
+#ifdef _OPENMP
+// generator of a thread beyond MAX_THREAD, see instance
+static thread_local Random *overflowRandom = 0;
+#endif
+
 void Random::reload() {
+#ifdef _OPENMP
+	if (this == overflowRandom)
+		throw std::runtime_error("crpropa::Random: more than MAX_THREAD threads, which only support counter-based streams");
+#endif
 	uint32_t *p = state;
 	int i;
 	for (i = N - M; i--; ++p)
@@ -479,9 +657,17 @@ __attribute__ ((aligned(64))) static RANDOM_TLS_ITEM _tls[MAX_THREAD];
 
 Random &Random::instance() {
 	int i = omp_get_thread_num();
-	if (i >= MAX_THREAD)
-	throw std::runtime_error("crpropa::Random: more than MAX_THREAD threads!");
-	return _tls[i].r;
+	if (i < MAX_THREAD)
+		return _tls[i].r;
+	// Threads beyond MAX_THREAD get a generator of their own, which is only
+	// reproducible with counter-based streams, see setStream. Its Mersenne
+	// Twister state throws at the first draw.
+	static thread_local Random extra(1);
+	if (overflowRandom == 0) {
+		extra.left = 0;
+		overflowRandom = &extra;
+	}
+	return extra;
 }
 
 void Random::seedThreads(const uint32_t oneSeed) {
@@ -497,6 +683,29 @@ std::vector< std::vector<uint32_t> > Random::getSeedThreads()
 	return seeds;
 }
 
+std::vector< std::vector<uint32_t> > Random::getStateThreads()
+{
+	std::vector< std::vector<uint32_t> > states;
+	for(size_t i = 0; i < omp_get_max_threads(); ++i) {
+		std::vector<uint32_t> state(SAVE);
+		_tls[i].r.save(&state[0]);
+		states.push_back(state);
+	}
+	return states;
+}
+
+void Random::setStateThreads(const std::vector< std::vector<uint32_t> > &states)
+{
+	if (states.size() > MAX_THREAD)
+		throw std::runtime_error("crpropa::Random: more than MAX_THREAD states!");
+	for(size_t i = 0; i < states.size(); ++i) {
+		if (states[i].size() != SAVE)
+			throw std::runtime_error("crpropa::Random: invalid generator state");
+		std::vector<uint32_t> state(states[i]);
+		_tls[i].r.load(&state[0]);
+	}
+}
+
 #else
 static Random _random;
 Random &Random::instance() {
@@ -511,6 +720,21 @@ std::vector< std::vector<uint32_t> > Random::getSeedThreads()
 		seeds.push_back(_random.getSeed() ); 
 	return seeds;
 }
+std::vector< std::vector<uint32_t> > Random::getStateThreads()
+{
+	std::vector< std::vector<uint32_t> > states(1, std::vector<uint32_t>(SAVE));
+	_random.save(&states[0][0]);
+	return states;
+}
+void Random::setStateThreads(const std::vector< std::vector<uint32_t> > &states)
+{
+	if (states.size() == 0)
+		return;
+	if (states[0].size() != SAVE)
+		throw std::runtime_error("crpropa::Random: invalid generator state");
+	std::vector<uint32_t> state(states[0]);
+	_random.load(&state[0]);
+}
 #endif
 
 const std::string Random::getSeed_base64() const
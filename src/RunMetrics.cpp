@@ -0,0 +1,354 @@
+#include "crpropa/RunMetrics.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace crpropa {
+
+namespace {
+
+enum Counter {
+	Primaries, Steps, Secondaries, Detections, OutputBytes, NumberOfCounters
+};
+
+// counters of one thread, only written by their thread and kept after it
+// ends, so that the reporter can sum them without locking the threads
+struct ThreadCounters {
+	std::atomic<uint64_t> value[NumberOfCounters];
+	char padding[64];
+	ThreadCounters() {
+		for (int i = 0; i < NumberOfCounters; i++)
+			value[i].store(0, std::memory_order_relaxed);
+	}
+};
+
+struct CounterRegistry {
+	std::mutex mutex;
+	std::vector<ThreadCounters *> threads;
+};
+
+CounterRegistry &registry() {
+	static CounterRegistry *r = new CounterRegistry(); // alive for counts at exit
+	return *r;
+}
+
+thread_local ThreadCounters *threadCounters = NULL;
+
+void add(Counter c, uint64_t n) {
+	if (!threadCounters) {
+		CounterRegistry &r = registry();
+		std::lock_guard<std::mutex> lock(r.mutex);
+		threadCounters = new ThreadCounters();
+		r.threads.push_back(threadCounters);
+	}
+	std::atomic<uint64_t> &v = threadCounters->value[c];
+	v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+RunMetrics::Counts zeroCounts() {
+	RunMetrics::Counts c = {0, 0, 0, 0, 0};
+	return c;
+}
+
+std::vector<RunMetrics::Counts> threadCounts() {
+	CounterRegistry &r = registry();
+	std::lock_guard<std::mutex> lock(r.mutex);
+	std::vector<RunMetrics::Counts> counts(r.threads.size());
+	for (size_t i = 0; i < r.threads.size(); i++) {
+		const std::atomic<uint64_t> *v = r.threads[i]->value;
+		counts[i].primaries = v[Primaries].load(std::memory_order_relaxed);
+		counts[i].steps = v[Steps].load(std::memory_order_relaxed);
+		counts[i].secondaries = v[Secondaries].load(std::memory_order_relaxed);
+		counts[i].detections = v[Detections].load(std::memory_order_relaxed);
+		counts[i].outputBytes = v[OutputBytes].load(std::memory_order_relaxed);
+	}
+	return counts;
+}
+
+// counts of a thread since the start, threads started later begin at 0
+RunMetrics::Counts since(const std::vector<RunMetrics::Counts> &current,
+		const std::vector<RunMetrics::Counts> &start, size_t i) {
+	RunMetrics::Counts c = current[i];
+	if (i < start.size()) {
+		c.primaries -= start[i].primaries;
+		c.steps -= start[i].steps;
+		c.secondaries -= start[i].secondaries;
+		c.detections -= start[i].detections;
+		c.outputBytes -= start[i].outputBytes;
+	}
+	return c;
+}
+
+void accumulate(RunMetrics::Counts &total, const RunMetrics::Counts &c) {
+	total.primaries += c.primaries;
+	total.steps += c.steps;
+	total.secondaries += c.secondaries;
+	total.detections += c.detections;
+	total.outputBytes += c.outputBytes;
+}
+
+double steadyTime() {
+	return std::chrono::duration<double>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+RunMetrics::RunMetrics(const std::string &filename, double interval, Format format) :
+		filename(filename), interval(interval), format(format), expected(0),
+		running(false), startTime(0), lastTime(0), rate(0), stopping(false) {
+	if (interval <= 0)
+		throw std::runtime_error("RunMetrics: the interval has to be positive");
+}
+
+RunMetrics::~RunMetrics() {
+	if (running)
+		stop();
+}
+
+void RunMetrics::start(size_t primaries) {
+	if (running)
+		stop();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		expected = primaries;
+		startCounts = threadCounts();
+		lastCounts = startCounts;
+		startTime = lastTime = steadyTime();
+		rate = 0;
+		stalled.clear();
+		stopping = false;
+		running = true;
+	}
+	write();
+	reporter = std::thread(&RunMetrics::report, this);
+}
+
+void RunMetrics::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wakeup.notify_all();
+	if (reporter.joinable())
+		reporter.join();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		running = false;
+	}
+	write();
+}
+
+bool RunMetrics::isRunning() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return running;
+}
+
+void RunMetrics::report() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (not stopping) {
+		wakeup.wait_for(lock, std::chrono::duration<double>(interval));
+		if (stopping)
+			break;
+		lock.unlock();
+		try {
+			write();
+		} catch (std::exception &e) {
+			std::cerr << "crpropa::RunMetrics: " << e.what() << std::endl;
+		}
+		lock.lock();
+	}
+}
+
+RunMetrics::Counts RunMetrics::getCounts() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::vector<Counts> current = threadCounts();
+	Counts total = zeroCounts();
+	for (size_t i = 0; i < current.size(); i++)
+		accumulate(total, since(current, startCounts, i));
+	return total;
+}
+
+RunMetrics::Counts RunMetrics::getTotals() {
+	std::vector<Counts> current = threadCounts();
+	Counts total = zeroCounts();
+	for (size_t i = 0; i < current.size(); i++)
+		accumulate(total, current[i]);
+	return total;
+}
+
+std::string RunMetrics::getStatus() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return status(false);
+}
+
+void RunMetrics::write() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::string s = status(true);
+	std::string tmp = filename + ".tmp";
+	{
+		std::ofstream out(tmp.c_str());
+		out << s;
+		if (!out)
+			throw std::runtime_error("RunMetrics: could not write " + tmp);
+	}
+	if (std::rename(tmp.c_str(), filename.c_str()) != 0)
+		throw std::runtime_error("RunMetrics: could not replace " + filename);
+}
+
+// needs the lock, update starts a new interval for the rates and stalls
+std::string RunMetrics::status(bool update) const {
+	std::vector<Counts> current = threadCounts();
+	double now = steadyTime();
+	double elapsed = now - startTime;
+	double dt = now - lastTime;
+
+	Counts total = zeroCounts(), previous = zeroCounts();
+	std::vector<size_t> threads; // threads that counted during the run
+	std::vector<bool> threadStalled;
+	size_t nStalled = 0;
+	for (size_t i = 0; i < current.size(); i++) {
+		Counts c = since(current, startCounts, i);
+		accumulate(total, c);
+		if (i < lastCounts.size())
+			accumulate(previous, since(lastCounts, startCounts, i));
+		bool stall = (i < stalled.size()) and stalled[i];
+		if (update) {
+			uint64_t before = (i < lastCounts.size()) ? lastCounts[i].steps : current[i].steps;
+			stall = running and (c.steps > 0) and (current[i].steps == before);
+		}
+		threadStalled.push_back(stall);
+		if ((c.steps > 0) or (c.primaries > 0)) {
+			threads.push_back(i);
+			if (stall)
+				nStalled++;
+		}
+	}
+
+	double primaryRate = (dt > 0) ? (total.primaries - previous.primaries) / dt : rate;
+	double stepRate = (dt > 0) ? (total.steps - previous.steps) / dt : 0;
+	double averageRate = (elapsed > 0) ? total.primaries / elapsed : 0;
+	double eta = -1;
+	if (total.primaries >= expected)
+		eta = 0;
+	else if (averageRate > 0)
+		eta = (expected - total.primaries) / averageRate;
+	if (update) {
+		lastCounts = current;
+		lastTime = now;
+		rate = primaryRate;
+		stalled = threadStalled;
+	}
+
+	std::stringstream ss;
+	if (format == JSON) {
+		ss << "{\"running\": " << (running ? "true" : "false");
+		ss << ", \"time\": " << (long long) time(NULL);
+		ss << ", \"elapsed\": " << elapsed;
+		ss << ", \"expected\": " << expected;
+		ss << ", \"primaries\": " << total.primaries;
+		ss << ", \"steps\": " << total.steps;
+		ss << ", \"secondaries\": " << total.secondaries;
+		ss << ", \"detections\": " << total.detections;
+		ss << ", \"outputBytes\": " << total.outputBytes;
+		ss << ", \"primariesPerSecond\": " << primaryRate;
+		ss << ", \"stepsPerSecond\": " << stepRate;
+		ss << ", \"averagePrimariesPerSecond\": " << averageRate;
+		ss << ", \"eta\": ";
+		if (eta < 0)
+			ss << "null";
+		else
+			ss << eta;
+		ss << ", \"stalledThreads\": " << nStalled;
+		ss << ", \"threads\": [";
+		for (size_t k = 0; k < threads.size(); k++) {
+			size_t i = threads[k];
+			Counts c = since(current, startCounts, i);
+			ss << (k > 0 ? ", " : "") << "{\"thread\": " << i;
+			ss << ", \"primaries\": " << c.primaries << ", \"steps\": " << c.steps;
+			ss << ", \"stalled\": " << (threadStalled[i] ? "true" : "false") << "}";
+		}
+		ss << "]}\n";
+		return ss.str();
+	}
+
+	struct Metric {
+		const char *name, *type, *help;
+		double value;
+	} metrics[] = {
+		{"running", "gauge", "1 while the run is in progress", running ? 1. : 0.},
+		{"primaries_expected", "gauge", "primaries of the run", double(expected)},
+		{"primaries_total", "counter", "primaries run", double(total.primaries)},
+		{"steps_total", "counter", "steps through the module list", double(total.steps)},
+		{"secondaries_total", "counter", "secondaries created", double(total.secondaries)},
+		{"detections_total", "counter", "detections of the observers", double(total.detections)},
+		{"output_bytes_total", "counter", "bytes of the output rows", double(total.outputBytes)},
+		{"elapsed_seconds", "gauge", "time since the start of the run", elapsed},
+		{"primaries_per_second", "gauge", "primaries per second in the last interval", primaryRate},
+		{"steps_per_second", "gauge", "steps per second in the last interval", stepRate},
+		{"stalled_threads", "gauge", "threads without steps in the last interval", double(nStalled)}
+	};
+	for (size_t m = 0; m < sizeof(metrics) / sizeof(Metric); m++) {
+		ss << "# HELP crpropa_run_" << metrics[m].name << " " << metrics[m].help << "\n";
+		ss << "# TYPE crpropa_run_" << metrics[m].name << " " << metrics[m].type << "\n";
+		ss << "crpropa_run_" << metrics[m].name << " " << metrics[m].value << "\n";
+	}
+	ss << "# HELP crpropa_run_eta_seconds estimated time to completion\n";
+	ss << "# TYPE crpropa_run_eta_seconds gauge\n";
+	ss << "crpropa_run_eta_seconds ";
+	if (eta < 0)
+		ss << "NaN\n";
+	else
+		ss << eta << "\n";
+	ss << "# HELP crpropa_run_thread_primaries_total primaries run by a thread\n";
+	ss << "# TYPE crpropa_run_thread_primaries_total counter\n";
+	for (size_t k = 0; k < threads.size(); k++)
+		ss << "crpropa_run_thread_primaries_total{thread=\"" << threads[k] << "\"} "
+				<< since(current, startCounts, threads[k]).primaries << "\n";
+	ss << "# HELP crpropa_run_thread_steps_total steps of a thread\n";
+	ss << "# TYPE crpropa_run_thread_steps_total counter\n";
+	for (size_t k = 0; k < threads.size(); k++)
+		ss << "crpropa_run_thread_steps_total{thread=\"" << threads[k] << "\"} "
+				<< since(current, startCounts, threads[k]).steps << "\n";
+	return ss.str();
+}
+
+const std::string &RunMetrics::getFilename() const {
+	return filename;
+}
+
+double RunMetrics::getInterval() const {
+	return interval;
+}
+
+RunMetrics::Format RunMetrics::getFormat() const {
+	return format;
+}
+
+void RunMetrics::countPrimaries(uint64_t n) {
+	add(Primaries, n);
+}
+
+void RunMetrics::countSteps(uint64_t n) {
+	add(Steps, n);
+}
+
+void RunMetrics::countSecondary() {
+	add(Secondaries, 1);
+}
+
+void RunMetrics::countDetection() {
+	add(Detections, 1);
+}
+
+void RunMetrics::countOutputBytes(uint64_t bytes) {
+	add(OutputBytes, bytes);
+}
+
+} // namespace crpropa
@@ -0,0 +1,93 @@
+#include "crpropa/SecondaryAdmission.h"
+
+namespace crpropa {
+
+static thread_local const SecondaryAdmission *currentAdmission = 0;
+
+SecondaryAdmission::SecondaryAdmission() : minimumEnergy(0) {
+}
+
+SecondaryAdmission::~SecondaryAdmission() {
+}
+
+void SecondaryAdmission::setMinimumEnergy(int id, double energy) {
+	minimumEnergies[id] = energy;
+}
+
+void SecondaryAdmission::setMinimumEnergy(double energy) {
+	minimumEnergy = energy;
+}
+
+void SecondaryAdmission::allow(int id) {
+	allowed.insert(id);
+}
+
+void SecondaryAdmission::deny(int id) {
+	denied.insert(id);
+}
+
+void SecondaryAdmission::setRejectedOutput(Module *output) {
+	rejectedOutput = output;
+}
+
+bool SecondaryAdmission::admit(int id, double energy, double weight) const {
+	if (denied.count(id))
+		return false;
+	if (not allowed.empty() and not allowed.count(id))
+		return false;
+	std::map<int, double>::const_iterator i = minimumEnergies.find(id);
+	if (i != minimumEnergies.end())
+		return energy >= i->second;
+	return energy >= minimumEnergy;
+}
+
+Candidate *SecondaryAdmission::rejected(Candidate *parent, int id, double energy, double weight) const {
+	// one candidate per thread, filled as in Candidate::addSecondary
+	static thread_local Candidate secondary;
+	secondary.setRedshift(parent->getRedshift());
+	secondary.setTrajectoryLength(parent->getTrajectoryLength());
+	secondary.setWeight(weight);
+	secondary.source = parent->source;
+	secondary.previous = parent->previous;
+	secondary.created = parent->previous;
+	secondary.current = parent->current;
+	secondary.current.setId(id);
+	secondary.current.setEnergy(energy);
+	secondary.setActive(true);
+	secondary.parent = parent;
+	return &secondary;
+}
+
+void SecondaryAdmission::reject(Candidate *parent, int id, double energy, double weight) const {
+	if (not rejectedOutput)
+		return;
+	Candidate *secondary = rejected(parent, id, energy, weight);
+	rejectedOutput->process(secondary);
+	secondary->parent = 0;
+}
+
+void SecondaryAdmission::reject(Candidate *parent, int id, double energy, const Vector3d &position, double weight) const {
+	if (not rejectedOutput)
+		return;
+	Candidate *secondary = rejected(parent, id, energy, weight);
+	secondary->setTrajectoryLength(parent->getTrajectoryLength() - (parent->current.getPosition() - position).getR());
+	secondary->current.setPosition(position);
+	secondary->created.setPosition(position);
+	rejectedOutput->process(secondary);
+	secondary->parent = 0;
+}
+
+const SecondaryAdmission *SecondaryAdmission::current() {
+	return currentAdmission;
+}
+
+SecondaryAdmission::Scope::Scope(const SecondaryAdmission *admission) : previous(currentAdmission) {
+	if (admission)
+		currentAdmission = admission;
+}
+
+SecondaryAdmission::Scope::~Scope() {
+	currentAdmission = previous;
+}
+
+} // namespace crpropa
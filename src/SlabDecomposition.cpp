@@ -0,0 +1,25 @@
+#include "crpropa/SlabDecomposition.h"
+
+#include <cmath>
+#include <stdexcept>
+
+namespace crpropa {
+
+SlabDecomposition::SlabDecomposition(double originX, double spacingX, size_t Nx, int nRanks) :
+		originX(originX), spacingX(spacingX), Nx(Nx), nRanks(nRanks) {
+	if (spacingX <= 0)
+		throw std::runtime_error("SlabDecomposition: spacing must be positive");
+	if ((nRanks < 1) or (size_t(nRanks) > Nx))
+		throw std::runtime_error("SlabDecomposition: number of ranks must be in [1, Nx]");
+}
+
+size_t SlabDecomposition::getCell(double x) const {
+	double r = floor((x - originX) / spacingX);
+	double n = Nx;
+	r -= floor(r / n) * n;
+	// rounding of the periodic wrap can give exactly Nx
+	size_t ix = r;
+	return (ix < Nx) ? ix : 0;
+}
+
+} // namespace crpropa
@@ -0,0 +1,123 @@
+#include "crpropa/SobolSequence.h"
+
+#include <stdexcept>
+
+namespace crpropa {
+
+// primitive polynomials and initial direction numbers of the dimensions
+// 2 .. 21 (new-joe-kuo-6.21201): degree s, coefficients a, m_1 .. m_s
+struct SobolInitialNumbers {
+	unsigned int s, a, m[7];
+};
+
+static const SobolInitialNumbers sobolInitialNumbers[SobolSequence::maxDimensions - 1] = {
+	{1, 0, {1}},
+	{2, 1, {1, 3}},
+	{3, 1, {1, 3, 1}},
+	{3, 2, {1, 1, 1}},
+	{4, 1, {1, 1, 3, 3}},
+	{4, 4, {1, 3, 5, 13}},
+	{5, 2, {1, 1, 5, 5, 17}},
+	{5, 4, {1, 1, 5, 5, 5}},
+	{5, 7, {1, 1, 7, 11, 19}},
+	{5, 11, {1, 1, 5, 1, 1}},
+	{5, 13, {1, 1, 1, 3, 11}},
+	{5, 14, {1, 3, 5, 5, 31}},
+	{6, 1, {1, 3, 3, 9, 7, 49}},
+	{6, 13, {1, 1, 1, 15, 21, 21}},
+	{6, 16, {1, 3, 1, 13, 27, 49}},
+	{6, 19, {1, 1, 1, 15, 7, 5}},
+	{6, 22, {1, 3, 1, 15, 13, 25}},
+	{6, 25, {1, 1, 5, 5, 19, 61}},
+	{7, 1, {1, 3, 7, 11, 23, 15, 103}},
+	{7, 4, {1, 3, 7, 13, 13, 15, 69}}
+};
+
+static uint32_t reverseBits(uint32_t x) {
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// permutation of the bit-reversed digits in which every bit only depends on
+// the lower bits, i.e. on the preceding digits (Burley 2020)
+static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+	x = reverseBits(x);
+	x ^= x * 0x3d20adeau;
+	x += seed;
+	x *= (seed >> 16) | 1;
+	x ^= x * 0x05526c56u;
+	x ^= x * 0x53a22864u;
+	return reverseBits(x);
+}
+
+static uint64_t splitMix64(uint64_t &state) {
+	uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+SobolSequence::SobolSequence(size_t dimensions, uint64_t seed, bool scrambled) :
+		dimensions(dimensions), scrambled(scrambled) {
+	if (dimensions < 1)
+		throw std::runtime_error("SobolSequence: at least one dimension is needed");
+	if (dimensions > maxDimensions)
+		throw std::runtime_error("SobolSequence: too many dimensions");
+
+	directions.resize(dimensions * 32);
+	for (size_t k = 0; k < 32; k++)
+		directions[k] = 1u << (31 - k); // van der Corput
+	for (size_t d = 1; d < dimensions; d++) {
+		const SobolInitialNumbers &init = sobolInitialNumbers[d - 1];
+		uint32_t *v = &directions[d * 32];
+		for (size_t k = 0; k < 32; k++) {
+			if (k < init.s) {
+				v[k] = init.m[k] << (31 - k);
+				continue;
+			}
+			v[k] = v[k - init.s] ^ (v[k - init.s] >> init.s);
+			for (size_t j = 1; j < init.s; j++)
+				if ((init.a >> (init.s - 1 - j)) & 1)
+					v[k] ^= v[k - j];
+		}
+	}
+
+	seeds.resize(dimensions);
+	for (size_t d = 0; d < dimensions; d++)
+		seeds[d] = uint32_t(splitMix64(seed));
+}
+
+void SobolSequence::getPoint(uint64_t index, double *u) const {
+	if (index >> 32)
+		throw std::runtime_error("SobolSequence: index beyond 2^32 points");
+	uint32_t i = uint32_t(index);
+	for (size_t d = 0; d < dimensions; d++) {
+		const uint32_t *v = &directions[d * 32];
+		uint32_t x = 0;
+		for (uint32_t j = i, k = 0; j != 0; j >>= 1, k++)
+			if (j & 1)
+				x ^= v[k];
+		if (scrambled)
+			x = nestedUniformScramble(x, seeds[d]);
+		u[d] = (x + 0.5) / 4294967296.; // center of the interval of the digits
+	}
+}
+
+std::vector<double> SobolSequence::getPoint(uint64_t index) const {
+	std::vector<double> u(dimensions);
+	getPoint(index, u.data());
+	return u;
+}
+
+size_t SobolSequence::getDimensions() const {
+	return dimensions;
+}
+
+bool SobolSequence::isScrambled() const {
+	return scrambled;
+}
+
+} // namespace crpropa
@@ -9,23 +9,124 @@
 #include "muParser.h"
 #endif
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <sstream>
 #include <stdexcept>
 
 namespace crpropa {
 
+// the source state of a candidate prepared in bulk is its initial state
+static void setInitialState(Candidate *candidate) {
+	candidate->created = candidate->source;
+	candidate->current = candidate->source;
+	candidate->previous = candidate->source;
+}
+
+// the power law E^index in [min, max] at the probability u, as Random::randPowerLaw
+static double powerLawQuantile(double u, double index, double min, double max) {
+	if ((min < 0) || (max < min))
+		throw std::runtime_error("Power law distribution only possible for 0 <= min <= max");
+	if ((std::abs(index + 1.0)) < std::numeric_limits<double>::epsilon())
+		return exp((log(max) - log(min)) * u + log(min));
+	double part1 = pow(max, index + 1);
+	double part2 = pow(min, index + 1);
+	return pow((part1 - part2) * u + part2, 1 / (index + 1));
+}
+
+// the isotropic direction of two uniform numbers, as Random::randVector
+static Vector3d isotropicDirection(double u, double v) {
+	double z = 2 * u - 1;
+	double t = (2 * v - 1) * M_PI;
+	double r = sqrt(1 - z * z);
+	return Vector3d(r * cos(t), r * sin(t), z);
+}
+
 // Source ---------------------------------------------------------------------
+Source::Source() : seed(0), nextPoint(0) {
+}
+
 void Source::add(SourceFeature* property) {
 	features.push_back(property);
+	if (sequence)
+		allocateDimensions();
+}
+
+void Source::allocateDimensions() {
+	offsets.resize(features.size());
+	size_t dimensions = 0;
+	for (size_t i = 0; i < features.size(); i++) {
+		offsets[i] = dimensions;
+		dimensions += features[i]->getQuasiRandomDimensions();
+	}
+	if (dimensions > SobolSequence::maxDimensions)
+		throw std::runtime_error("Source: too many quasi-random dimensions for the Sobol sequence");
+	sequence = new SobolSequence(std::max(dimensions, size_t(1)), seed);
+}
+
+void Source::setQuasiRandom(bool quasiRandom, uint64_t seed, uint64_t firstPoint) {
+	this->seed = seed;
+	nextPoint = firstPoint;
+	if (quasiRandom)
+		allocateDimensions();
+	else
+		sequence = NULL;
+}
+
+bool Source::isQuasiRandom() const {
+	return sequence.valid();
+}
+
+size_t Source::getQuasiRandomDimensions() const {
+	size_t dimensions = 0;
+	for (size_t i = 0; i < features.size(); i++)
+		dimensions += features[i]->getQuasiRandomDimensions();
+	return dimensions;
+}
+
+uint64_t Source::getNextPoint() const {
+	return nextPoint;
 }
 
 ref_ptr<Candidate> Source::getCandidate() const {
 	ref_ptr<Candidate> candidate = new Candidate();
+	if (sequence) {
+		double u[SobolSequence::maxDimensions];
+		sequence->getPoint(nextPoint++, u);
+		for (size_t i = 0; i < features.size(); i++)
+			features[i]->prepareQuasiRandom(*candidate, u + offsets[i]);
+		return candidate;
+	}
 	for (int i = 0; i < features.size(); i++)
 		(*features[i]).prepareCandidate(*candidate);
 	return candidate;
 }
 
+void Source::getCandidates(size_t count, std::vector<ref_ptr<Candidate> > &out) const {
+	std::vector<Candidate*> block(count);
+	out.reserve(out.size() + count);
+	for (size_t i = 0; i < count; i++) {
+		block[i] = new Candidate();
+		out.push_back(block[i]);
+	}
+	if (count == 0)
+		return;
+	if (sequence) {
+		// consecutive points, the features candidate by candidate
+		uint64_t first = nextPoint.fetch_add(count);
+		double u[SobolSequence::maxDimensions];
+		for (size_t j = 0; j < count; j++) {
+			sequence->getPoint(first + j, u);
+			for (size_t i = 0; i < features.size(); i++)
+				features[i]->prepareQuasiRandom(*block[j], u + offsets[i]);
+		}
+		return;
+	}
+	for (size_t i = 0; i < features.size(); i++)
+		features[i]->prepareCandidates(block.data(), count);
+}
+
 std::string Source::getDescription() const {
 	std::stringstream ss;
 	ss << "Cosmic ray source\n";
@@ -34,6 +135,10 @@ std::string Source::getDescription() const {
 	return ss.str();
 }
 
+const std::vector<ref_ptr<SourceFeature> > &Source::getFeatures() const {
+	return features;
+}
+
 // SourceList------------------------------------------------------------------
 void SourceList::add(Source* source, double weight) {
 	sources.push_back(source);
@@ -49,6 +154,25 @@ ref_ptr<Candidate> SourceList::getCandidate() const {
 	return (sources[i])->getCandidate();
 }
 
+void SourceList::getCandidates(size_t count, std::vector<ref_ptr<Candidate> > &out) const {
+	if (sources.size() == 0)
+		throw std::runtime_error("SourceList: no sources set");
+	Random &random = Random::instance();
+	std::vector<size_t> drawn(count), counts(sources.size(), 0);
+	for (size_t i = 0; i < count; i++)
+		counts[drawn[i] = random.randBin(cdf)]++;
+
+	// each source prepares all its candidates at once, in the drawn order
+	std::vector<std::vector<ref_ptr<Candidate> > > prepared(sources.size());
+	for (size_t j = 0; j < sources.size(); j++)
+		if (counts[j] > 0)
+			sources[j]->getCandidates(counts[j], prepared[j]);
+	std::vector<size_t> next(sources.size(), 0);
+	out.reserve(out.size() + count);
+	for (size_t i = 0; i < count; i++)
+		out.push_back(prepared[drawn[i]][next[drawn[i]]++]);
+}
+
 std::string SourceList::getDescription() const {
 	std::stringstream ss;
 	ss << "List of cosmic ray sources\n";
@@ -57,6 +181,13 @@ std::string SourceList::getDescription() const {
 	return ss.str();
 }
 
+// SourceInterface-------------------------------------------------------------
+void SourceInterface::getCandidates(size_t count, std::vector<ref_ptr<Candidate> > &out) const {
+	out.reserve(out.size() + count);
+	for (size_t i = 0; i < count; i++)
+		out.push_back(getCandidate());
+}
+
 // SourceFeature---------------------------------------------------------------
 void SourceFeature::prepareCandidate(Candidate& candidate) const {
 	ParticleState &source = candidate.source;
@@ -66,6 +197,19 @@ void SourceFeature::prepareCandidate(Candidate& candidate) const {
 	candidate.previous = source;
 }
 
+void SourceFeature::prepareCandidates(Candidate **candidates, size_t count) const {
+	for (size_t i = 0; i < count; i++)
+		prepareCandidate(*candidates[i]);
+}
+
+size_t SourceFeature::getQuasiRandomDimensions() const {
+	return 0;
+}
+
+void SourceFeature::prepareQuasiRandom(Candidate &candidate, const double *u) const {
+	prepareCandidate(candidate);
+}
+
 std::string SourceFeature::getDescription() const {
 	return description;
 }
@@ -86,6 +230,10 @@ void SourceParticleType::setDescription() {
 	description = ss.str();
 }
 
+int SourceParticleType::getId() const {
+	return id;
+}
+
 // ----------------------------------------------------------------------------
 SourceMultipleParticleTypes::SourceMultipleParticleTypes() {
 	setDescription();
@@ -106,6 +254,18 @@ void SourceMultipleParticleTypes::prepareParticle(ParticleState& particle) const
 	particle.setId(particleTypes[i]);
 }
 
+size_t SourceMultipleParticleTypes::getQuasiRandomDimensions() const {
+	return 1;
+}
+
+void SourceMultipleParticleTypes::prepareQuasiRandom(Candidate &candidate, const double *u) const {
+	if (particleTypes.size() == 0)
+		throw std::runtime_error("SourceMultipleParticleTypes: no nuclei set");
+	size_t i = std::lower_bound(cdf.begin(), cdf.end(), u[0] * cdf.back()) - cdf.begin();
+	candidate.source.setId(particleTypes[std::min(i, particleTypes.size() - 1)]);
+	setInitialState(&candidate);
+}
+
 void SourceMultipleParticleTypes::setDescription() {
 	std::stringstream ss;
 	ss << "SourceMultipleParticleTypes: Random particle type\n";
@@ -114,6 +274,17 @@ void SourceMultipleParticleTypes::setDescription() {
 	description = ss.str();
 }
 
+const std::vector<int> &SourceMultipleParticleTypes::getParticleTypes() const {
+	return particleTypes;
+}
+
+std::vector<double> SourceMultipleParticleTypes::getFractions() const {
+	std::vector<double> fractions(cdf.size());
+	for (size_t i = 0; i < cdf.size(); i++)
+		fractions[i] = (cdf[i] - (i > 0 ? cdf[i - 1] : 0)) / cdf.back();
+	return fractions;
+}
+
 // ----------------------------------------------------------------------------
 SourceEnergy::SourceEnergy(double energy) :
 		E(energy) {
@@ -143,6 +314,24 @@ void SourcePowerLawSpectrum::prepareParticle(ParticleState& particle) const {
 	particle.setEnergy(E);
 }
 
+void SourcePowerLawSpectrum::prepareCandidates(Candidate **candidates, size_t count) const {
+	std::vector<double> E(count);
+	Random::instance().fillPowerLaw(E.data(), count, index, Emin, Emax);
+	for (size_t i = 0; i < count; i++) {
+		candidates[i]->source.setEnergy(E[i]);
+		setInitialState(candidates[i]);
+	}
+}
+
+size_t SourcePowerLawSpectrum::getQuasiRandomDimensions() const {
+	return 1;
+}
+
+void SourcePowerLawSpectrum::prepareQuasiRandom(Candidate &candidate, const double *u) const {
+	candidate.source.setEnergy(powerLawQuantile(u[0], index, Emin, Emax));
+	setInitialState(&candidate);
+}
+
 void SourcePowerLawSpectrum::setDescription() {
 	std::stringstream ss;
 	ss << "SourcePowerLawSpectrum: Random energy ";
@@ -151,6 +340,18 @@ void SourcePowerLawSpectrum::setDescription() {
 	description = ss.str();
 }
 
+double SourcePowerLawSpectrum::getMinEnergy() const {
+	return Emin;
+}
+
+double SourcePowerLawSpectrum::getMaxEnergy() const {
+	return Emax;
+}
+
+double SourcePowerLawSpectrum::getIndex() const {
+	return index;
+}
+
 // ----------------------------------------------------------------------------
 SourceComposition::SourceComposition(double Emin, double Rmax, double index) :
 		Emin(Emin), Rmax(Rmax), index(index) {
@@ -206,6 +407,163 @@ void SourceComposition::setDescription() {
 	description = ss.str();
 }
 
+double SourceComposition::getMinEnergy() const {
+	return Emin;
+}
+
+double SourceComposition::getMaxRigidity() const {
+	return Rmax;
+}
+
+double SourceComposition::getIndex() const {
+	return index;
+}
+
+const std::vector<int> &SourceComposition::getNuclei() const {
+	return nuclei;
+}
+
+std::vector<double> SourceComposition::getFractions() const {
+	std::vector<double> fractions(cdf.size());
+	for (size_t i = 0; i < cdf.size(); i++)
+		fractions[i] = (cdf[i] - (i > 0 ? cdf[i - 1] : 0)) / cdf.back();
+	return fractions;
+}
+
+// ----------------------------------------------------------------------------
+SourceRigidityComposition::SourceRigidityComposition(double Rmin, double Rmax, double index,
+		double Rcut, size_t bins) : Emin(0) {
+	if ((Rmin <= 0) or (Rmax <= Rmin) or (bins == 0))
+		throw std::runtime_error("SourceRigidityComposition: 0 < Rmin < Rmax and bins > 0 required");
+	std::vector<double> rigidities(bins + 1), values(bins + 1);
+	for (size_t j = 0; j <= bins; j++) {
+		double R = Rmin * pow(Rmax / Rmin, double(j) / bins);
+		rigidities[j] = R;
+		// relative to Rmin, the absolute scale does not matter
+		values[j] = pow(R / Rmin, index);
+		if (Rcut > 0)
+			values[j] *= exp(-(R - Rmin) / Rcut);
+	}
+	rigidities.back() = Rmax;
+	setSpectrum(rigidities, values);
+}
+
+SourceRigidityComposition::SourceRigidityComposition(const std::vector<double> &rigidities,
+		const std::vector<double> &values) : Emin(0) {
+	setSpectrum(rigidities, values);
+}
+
+void SourceRigidityComposition::setSpectrum(const std::vector<double> &rigidities,
+		const std::vector<double> &values) {
+	if ((rigidities.size() < 2) or (rigidities.size() != values.size()))
+		throw std::runtime_error("SourceRigidityComposition: at least two rigidities and values required");
+	for (size_t j = 0; j < rigidities.size(); j++) {
+		if ((rigidities[j] <= 0) or ((j > 0) and (rigidities[j] <= rigidities[j - 1])))
+			throw std::runtime_error("SourceRigidityComposition: rigidities must be positive and increasing");
+		if (values[j] < 0)
+			throw std::runtime_error("SourceRigidityComposition: negative spectrum");
+	}
+	rigidity = rigidities;
+	spectrum = values;
+	slope.assign(rigidity.size() - 1, 0.);
+	for (size_t j = 0; j < slope.size(); j++)
+		if ((spectrum[j] > 0) and (spectrum[j + 1] > 0))
+			slope[j] = log(spectrum[j + 1] / spectrum[j]) / log(rigidity[j + 1] / rigidity[j]);
+	// a rounded index of -1 makes the power law inversion inaccurate
+	for (size_t j = 0; j < slope.size(); j++)
+		if (std::abs(slope[j] + 1) < 1e-9)
+			slope[j] = -1;
+	setDescription();
+}
+
+bool SourceRigidityComposition::binRange(size_t j, int Z, double &lower, double &upper) const {
+	lower = std::max(rigidity[j], Emin / Z);
+	upper = rigidity[j + 1];
+	return (lower < upper) and (spectrum[j] > 0) and (spectrum[j + 1] > 0);
+}
+
+// integral of f (R / R0)^s from lower to upper
+static double powerLawIntegral(double f, double R0, double s, double lower, double upper) {
+	if (std::abs(s + 1) < std::numeric_limits<double>::epsilon())
+		return f * R0 * log(upper / lower);
+	return f * R0 * (pow(upper / R0, s + 1) - pow(lower / R0, s + 1)) / (s + 1);
+}
+
+void SourceRigidityComposition::update() {
+	size_t bins = slope.size();
+	std::vector<double> weights(nuclei.size() * bins, 0.);
+
+	// integrals of the full range, the abundances refer to them
+	double full = 0;
+	for (size_t j = 0; j < bins; j++)
+		if ((spectrum[j] > 0) and (spectrum[j + 1] > 0))
+			full += powerLawIntegral(spectrum[j], rigidity[j], slope[j], rigidity[j], rigidity[j + 1]);
+	if (full <= 0)
+		throw std::runtime_error("SourceRigidityComposition: the spectrum vanishes");
+
+	for (size_t i = 0; i < nuclei.size(); i++) {
+		int Z = chargeNumber(nuclei[i]);
+		for (size_t j = 0; j < bins; j++) {
+			double lower, upper;
+			if (binRange(j, Z, lower, upper))
+				weights[i * bins + j] = abundances[i] / full
+						* powerLawIntegral(spectrum[j], rigidity[j], slope[j], lower, upper);
+		}
+	}
+	table.setWeights(weights);
+}
+
+void SourceRigidityComposition::add(int id, double abundance) {
+	int Z = chargeNumber(id);
+	if (Z < 1)
+		throw std::runtime_error("SourceRigidityComposition: only nuclei can be added");
+	nuclei.push_back(id);
+	abundances.push_back(abundance);
+	update();
+	setDescription();
+}
+
+void SourceRigidityComposition::add(int A, int Z, double abundance) {
+	add(nucleusId(A, Z), abundance);
+}
+
+void SourceRigidityComposition::setMinEnergy(double Emin) {
+	this->Emin = Emin;
+	if (nuclei.size() > 0)
+		update();
+	setDescription();
+}
+
+void SourceRigidityComposition::prepareParticle(ParticleState& particle) const {
+	if (nuclei.size() == 0)
+		throw std::runtime_error("SourceRigidityComposition: No source isotope set");
+
+	Random &random = Random::instance();
+	size_t k = table.sample(random);
+	size_t bins = slope.size();
+	int id = nuclei[k / bins];
+	size_t j = k % bins;
+	int Z = chargeNumber(id);
+	double lower, upper;
+	if (not binRange(j, Z, lower, upper))
+		throw std::runtime_error("SourceRigidityComposition: no particles above the minimum energy");
+
+	particle.setId(id);
+	particle.setEnergy(Z * random.randPowerLaw(slope[j], lower, upper));
+}
+
+void SourceRigidityComposition::setDescription() {
+	std::stringstream ss;
+	ss << "SourceRigidityComposition: Random element and energy, ";
+	ss << "R = " << rigidity.front() / EeV << " - " << rigidity.back() / EeV << " EeV";
+	if (Emin > 0)
+		ss << ", E > " << Emin / EeV << " EeV";
+	ss << "\n";
+	for (size_t i = 0; i < nuclei.size(); i++)
+		ss << "      ID = " << nuclei[i] << ", abundance " << abundances[i] << "\n";
+	description = ss.str();
+}
+
 // ----------------------------------------------------------------------------
 SourcePosition::SourcePosition(Vector3d position) :
 		position(position) {
@@ -266,6 +624,27 @@ void SourceUniformSphere::prepareParticle(ParticleState& particle) const {
 	particle.setPosition(center + random.randVector() * r);
 }
 
+void SourceUniformSphere::prepareCandidates(Candidate **candidates, size_t count) const {
+	Random &random = Random::instance();
+	std::vector<double> u(count);
+	std::vector<Vector3d> directions(count);
+	random.fillUniform(u.data(), count);
+	random.fillUnitVectors(directions.data(), count);
+	for (size_t i = 0; i < count; i++) {
+		candidates[i]->source.setPosition(center + directions[i] * (cbrt(u[i]) * radius));
+		setInitialState(candidates[i]);
+	}
+}
+
+size_t SourceUniformSphere::getQuasiRandomDimensions() const {
+	return 3;
+}
+
+void SourceUniformSphere::prepareQuasiRandom(Candidate &candidate, const double *u) const {
+	candidate.source.setPosition(center + isotropicDirection(u[1], u[2]) * (cbrt(u[0]) * radius));
+	setInitialState(&candidate);
+}
+
 void SourceUniformSphere::setDescription() {
 	std::stringstream ss;
 	ss << "SourceUniformSphere: Random position within a sphere at ";
@@ -310,6 +689,24 @@ void SourceUniformShell::prepareParticle(ParticleState& particle) const {
 	particle.setPosition(center + random.randVector() * radius);
 }
 
+void SourceUniformShell::prepareCandidates(Candidate **candidates, size_t count) const {
+	std::vector<Vector3d> directions(count);
+	Random::instance().fillUnitVectors(directions.data(), count);
+	for (size_t i = 0; i < count; i++) {
+		candidates[i]->source.setPosition(center + directions[i] * radius);
+		setInitialState(candidates[i]);
+	}
+}
+
+size_t SourceUniformShell::getQuasiRandomDimensions() const {
+	return 2;
+}
+
+void SourceUniformShell::prepareQuasiRandom(Candidate &candidate, const double *u) const {
+	candidate.source.setPosition(center + isotropicDirection(u[0], u[1]) * radius);
+	setInitialState(&candidate);
+}
+
 void SourceUniformShell::setDescription() {
 	std::stringstream ss;
 	ss << "SourceUniformShell: Random position on a spherical shell at ";
@@ -330,6 +727,25 @@ void SourceUniformBox::prepareParticle(ParticleState& particle) const {
 	particle.setPosition(pos * size + origin);
 }
 
+void SourceUniformBox::prepareCandidates(Candidate **candidates, size_t count) const {
+	std::vector<double> u(3 * count);
+	Random::instance().fillUniform(u.data(), u.size());
+	for (size_t i = 0; i < count; i++) {
+		Vector3d pos(u[3 * i], u[3 * i + 1], u[3 * i + 2]);
+		candidates[i]->source.setPosition(pos * size + origin);
+		setInitialState(candidates[i]);
+	}
+}
+
+size_t SourceUniformBox::getQuasiRandomDimensions() const {
+	return 3;
+}
+
+void SourceUniformBox::prepareQuasiRandom(Candidate &candidate, const double *u) const {
+	candidate.source.setPosition(Vector3d(u[0], u[1], u[2]) * size + origin);
+	setInitialState(&candidate);
+}
+
 void SourceUniformBox::setDescription() {
 	std::stringstream ss;
 	ss << "SourceUniformBox: Random uniform position in box with ";
@@ -361,6 +777,43 @@ void SourceUniformCylinder::setDescription() {
 }
 
 // ---------------------------------------------------------------------------
+// Galactic radius r in [0, rMax] at equidistant probabilities of the density
+// r^2 exp(-beta r / rEarth), the Galactic distributions draw r from it
+static std::vector<double> galacticRadiusTable(double rEarth, double beta, double rMax) {
+	const size_t nPoints = 16384, nTable = 4096;
+	double dr = rMax / (nPoints - 1);
+	std::vector<double> cdf(nPoints, 0.);
+	double previous = 0;
+	for (size_t i = 1; i < nPoints; i++) {
+		double x = i * dr / rEarth;
+		double f = x * x * exp(-beta * x);
+		cdf[i] = cdf[i - 1] + 0.5 * (previous + f);
+		previous = f;
+	}
+	std::vector<double> table(nTable + 1, 0.);
+	size_t j = 0;
+	for (size_t k = 1; k < nTable; k++) {
+		double target = cdf.back() * k / nTable;
+		while (cdf[j + 1] < target)
+			j++;
+		table[k] = (j + (target - cdf[j]) / (cdf[j + 1] - cdf[j])) * dr;
+	}
+	table[nTable] = rMax;
+	return table;
+}
+
+static double lookupTable(const std::vector<double> &table, double u) {
+	double t = u * (table.size() - 1);
+	size_t i = std::min(size_t(t), table.size() - 2);
+	return table[i] + (t - i) * (table[i + 1] - table[i]);
+}
+
+// |z| of the exponential distribution with scale height zg, cut at zMax, with random sign
+static double randGalacticHeight(Random &random, double zg, double zMax) {
+	double z = -zg * log(1 - random.rand() * (1 - exp(-zMax / zg)));
+	return (random.rand() < 0.5) ? -z : z;
+}
+
 SourceSNRDistribution::SourceSNRDistribution() :
     R_earth(8.5*kpc), beta(3.53), Zg(0.3*kpc) {
 	set_frMax(8.5*kpc, 3.53);
@@ -379,24 +832,8 @@ SourceSNRDistribution::SourceSNRDistribution(double R_earth, double beta, double
 
 void SourceSNRDistribution::prepareParticle(ParticleState& particle) const {
   	Random &random = Random::instance();
-	double RPos;
-	while (true){
-		RPos = random.rand()*R_max;
-		double fTest = random.rand()*frMax;
-		double fR=f_r(RPos);
-		if (fTest<=fR) {
-			break;
-		}
-	}
-	double ZPos;
-	while (true){
-		ZPos = (random.rand()-0.5)*2*Z_max;
-		double fTest = random.rand()*fzMax;
-		double fz=f_z(ZPos);
-		if (fTest<=fz) {
-			break;
-		}
-	}
+	double RPos = lookupTable(rTable, random.rand());
+	double ZPos = randGalacticHeight(random, Zg, Z_max);
 	double phi = random.rand()*2*M_PI;
 	Vector3d pos(cos(phi)*RPos, sin(phi)*RPos, ZPos);
 	particle.setPosition(pos);
@@ -428,6 +865,7 @@ void SourceSNRDistribution::set_fzMax(double Zg) {
 
 void SourceSNRDistribution::set_RMax(double R_m) {
 	R_max = R_m;
+	rTable = galacticRadiusTable(R_earth, beta, R_max);
 	return;
 }
 
@@ -486,24 +924,8 @@ SourcePulsarDistribution::SourcePulsarDistribution(double R_earth, double beta,
 
 void SourcePulsarDistribution::prepareParticle(ParticleState& particle) const {
   	Random &random = Random::instance();
-	double Rtilde;
-	while (true){
-		Rtilde = random.rand()*R_max;
-		double fTest = random.rand()*frMax;
-		double fR=f_r(Rtilde);
-		if (fTest<=fR) {
-			break;
-		}
-	}
-	double ZPos;
-	while (true){
-		ZPos = (random.rand()-0.5)*2*Z_max;
-		double fTest = random.rand()*fzMax;
-		double fz=f_z(ZPos);
-		if (fTest<=fz) {
-			break;
-		}
-	}
+	double Rtilde = lookupTable(rTable, random.rand());
+	double ZPos = randGalacticHeight(random, Zg, Z_max);
 
 	int i = random.randInt(3);
 	double theta_tilde = f_theta(i, Rtilde);
@@ -566,6 +988,7 @@ void SourcePulsarDistribution::set_fzMax(double Zg) {
 
 void SourcePulsarDistribution::set_RMax(double R_m) {
 	R_max = R_m;
+	rTable = galacticRadiusTable(R_earth, beta, R_max);
 	return;
 }
 
@@ -641,6 +1064,18 @@ void SourceUniform1D::prepareParticle(ParticleState& particle) const {
 	particle.setPosition(Vector3d(d, 0, 0));
 }
 
+size_t SourceUniform1D::getQuasiRandomDimensions() const {
+	return 1;
+}
+
+void SourceUniform1D::prepareQuasiRandom(Candidate &candidate, const double *u) const {
+	double d = u[0] * (maxD - minD) + minD;
+	if (withCosmology)
+		d = lightTravel2ComovingDistance(d);
+	candidate.source.setPosition(Vector3d(d, 0, 0));
+	setInitialState(&candidate);
+}
+
 void SourceUniform1D::setDescription() {
 	std::stringstream ss;
 	ss << "SourceUniform1D: Random uniform position in D = ";
@@ -651,18 +1086,137 @@ void SourceUniform1D::setDescription() {
 	description = ss.str();
 }
 
+double SourceUniform1D::getMinDistance() const {
+	return withCosmology ? lightTravel2ComovingDistance(minD) : minD;
+}
+
+double SourceUniform1D::getMaxDistance() const {
+	return withCosmology ? lightTravel2ComovingDistance(maxD) : maxD;
+}
+
+bool SourceUniform1D::isWithCosmology() const {
+	return withCosmology;
+}
+
+// ----------------------------------------------------------------------------
+SourceEvolution1D::SourceEvolution1D(double m, double minD, double maxD,
+		Distribution distribution, bool comovingVolume, size_t bins) :
+		m(m), minD(minD), maxD(maxD), distribution(distribution), comovingVolume(comovingVolume) {
+	if ((minD < 0) or (maxD <= minD))
+		throw std::runtime_error("SourceEvolution1D: invalid distance range");
+	if (bins < 1)
+		throw std::runtime_error("SourceEvolution1D: at least one bin is needed");
+
+	// cumulative distribution on a fine grid in D, trapezoidal rule
+	size_t n = 8 * bins + 1;
+	std::vector<double> d(n), cdf(n, 0.);
+	double previous = 0;
+	for (size_t i = 0; i < n; i++) {
+		d[i] = minD + (maxD - minD) * i / (n - 1);
+		double density = getDensity(d[i]);
+		if (i > 0)
+			cdf[i] = cdf[i - 1] + 0.5 * (previous + density) * (d[i] - d[i - 1]);
+		previous = density;
+	}
+	if (not (cdf[n - 1] > 0))
+		throw std::runtime_error("SourceEvolution1D: density vanishes in the distance range");
+
+	// inverse at equidistant probabilities
+	distances.resize(bins + 1);
+	redshifts.resize(bins + 1);
+	size_t k = 0;
+	for (size_t j = 0; j <= bins; j++) {
+		double c = cdf[n - 1] * j / bins;
+		while ((k < n - 2) and (cdf[k + 1] < c))
+			k++;
+		double dc = cdf[k + 1] - cdf[k];
+		double f = (dc > 0) ? std::min(1., std::max(0., (c - cdf[k]) / dc)) : 0.;
+		distances[j] = d[k] + f * (d[k + 1] - d[k]);
+		redshifts[j] = comovingDistance2Redshift(distances[j]);
+	}
+	distances[0] = minD;
+	distances[bins] = maxD;
+	setDescription();
+}
+
+double SourceEvolution1D::getDensity(double distance) const {
+	double z = comovingDistance2Redshift(distance);
+	double density = pow(1 + z, m);
+	if (distribution == UniformLightTravel)
+		density /= 1 + z; // dT/dD = 1 / (1 + z)
+	else if (distribution == UniformRedshift)
+		density *= hubbleRate(z) / c_light; // dz/dD = H(z) / c
+	if (comovingVolume)
+		density *= distance * distance;
+	return density;
+}
+
+void SourceEvolution1D::prepareCandidate(Candidate& candidate) const {
+	double u = Random::instance().rand();
+	prepareQuasiRandom(candidate, &u);
+}
+
+size_t SourceEvolution1D::getQuasiRandomDimensions() const {
+	return 1;
+}
+
+void SourceEvolution1D::prepareQuasiRandom(Candidate& candidate, const double *probability) const {
+	size_t bins = distances.size() - 1;
+	double u = probability[0] * bins;
+	size_t i = std::min(size_t(u), bins - 1);
+	double f = u - i;
+	double d = distances[i] + f * (distances[i + 1] - distances[i]);
+	double z = redshifts[i] + f * (redshifts[i + 1] - redshifts[i]);
+
+	candidate.source.setPosition(Vector3d(d, 0, 0));
+	candidate.created.setPosition(Vector3d(d, 0, 0));
+	candidate.previous.setPosition(Vector3d(d, 0, 0));
+	candidate.current.setPosition(Vector3d(d, 0, 0));
+	candidate.setRedshift(z);
+}
+
+double SourceEvolution1D::getIndex() const {
+	return m;
+}
+
+double SourceEvolution1D::getMinDistance() const {
+	return minD;
+}
+
+double SourceEvolution1D::getMaxDistance() const {
+	return maxD;
+}
+
+SourceEvolution1D::Distribution SourceEvolution1D::getDistribution() const {
+	return distribution;
+}
+
+bool SourceEvolution1D::hasComovingVolume() const {
+	return comovingVolume;
+}
+
+void SourceEvolution1D::setDescription() {
+	std::stringstream ss;
+	ss << "SourceEvolution1D: (1+z)^m, m = " << m << ", D = ";
+	ss << minD / Mpc << " - " << maxD / Mpc << " Mpc, uniform in the ";
+	if (distribution == UniformComoving)
+		ss << "comoving distance";
+	else if (distribution == UniformLightTravel)
+		ss << "light travel distance";
+	else
+		ss << "redshift";
+	if (comovingVolume)
+		ss << ", with the comoving volume";
+	ss << "\n";
+	description = ss.str();
+}
+
 // ----------------------------------------------------------------------------
 SourceDensityGrid::SourceDensityGrid(ref_ptr<Grid1f> grid) :
 		grid(grid) {
-	float sum = 0;
-	for (int ix = 0; ix < grid->getNx(); ix++) {
-		for (int iy = 0; iy < grid->getNy(); iy++) {
-			for (int iz = 0; iz < grid->getNz(); iz++) {
-				sum += grid->get(ix, iy, iz);
-				grid->get(ix, iy, iz) = sum;
-			}
-		}
-	}
+	// the values in the order of the layout, padding of the bricked layout is zero
+	const std::vector<float> &density = grid->getGrid();
+	table.setWeights(std::vector<double>(density.begin(), density.end()));
 	setDescription();
 }
 
@@ -670,7 +1224,7 @@ void SourceDensityGrid::prepareParticle(ParticleState& particle) const {
 	Random &random = Random::instance();
 
 	// draw random bin
-	size_t i = random.randBin(grid->getGrid());
+	size_t i = table.sample(random);
 	Vector3d pos = grid->positionFromIndex(i);
 
 	// draw uniform position within bin
@@ -694,11 +1248,8 @@ SourceDensityGrid1D::SourceDensityGrid1D(ref_ptr<Grid1f> grid) :
 	if (grid->getNz() != 1)
 		throw std::runtime_error("SourceDensityGrid1D: Nz != 1");
 
-	float sum = 0;
-	for (int ix = 0; ix < grid->getNx(); ix++) {
-		sum += grid->get(ix, 0, 0);
-		grid->get(ix, 0, 0) = sum;
-	}
+	const std::vector<float> &density = grid->getGrid();
+	table.setWeights(std::vector<double>(density.begin(), density.end()));
 	setDescription();
 }
 
@@ -706,7 +1257,7 @@ void SourceDensityGrid1D::prepareParticle(ParticleState& particle) const {
 	Random &random = Random::instance();
 
 	// draw random bin
-	size_t i = random.randBin(grid->getGrid());
+	size_t i = table.sample(random);
 	Vector3d pos = grid->positionFromIndex(i);
 
 	// draw uniform position within bin
@@ -730,6 +1281,24 @@ void SourceIsotropicEmission::prepareParticle(ParticleState& particle) const {
 	particle.setDirection(random.randVector());
 }
 
+void SourceIsotropicEmission::prepareCandidates(Candidate **candidates, size_t count) const {
+	std::vector<Vector3d> directions(count);
+	Random::instance().fillUnitVectors(directions.data(), count);
+	for (size_t i = 0; i < count; i++) {
+		candidates[i]->source.setDirection(directions[i]);
+		setInitialState(candidates[i]);
+	}
+}
+
+size_t SourceIsotropicEmission::getQuasiRandomDimensions() const {
+	return 2;
+}
+
+void SourceIsotropicEmission::prepareQuasiRandom(Candidate &candidate, const double *u) const {
+	candidate.source.setDirection(isotropicDirection(u[0], u[1]));
+	setInitialState(&candidate);
+}
+
 void SourceIsotropicEmission::setDescription() {
 	description = "SourceIsotropicEmission: Random isotropic direction\n";
 }
@@ -793,6 +1362,45 @@ void SourceEmissionMap::setEmissionMap(EmissionMap *emissionMap) {
 	this->emissionMap = emissionMap;
 }
 
+// ----------------------------------------------------------------------------
+SourceTargetedEmission::SourceTargetedEmission(EmissionMap *emissionMap) : emissionMap(emissionMap) {
+	setDescription();
+}
+
+void SourceTargetedEmission::prepareCandidate(Candidate &candidate) const {
+	ParticleState &source = candidate.source;
+	const EmissionMap::map_t &maps = emissionMap->getMaps();
+	EmissionMap::map_t::const_iterator i = maps.find(EmissionMap::key_t(source.getId(),
+			emissionMap->binFromEnergy(source.getEnergy())));
+	if (i == maps.end() or not i->second.valid()) {
+		candidate.setActive(false);
+		return;
+	}
+	const CylindricalProjectionMap &map = *i->second;
+	Vector3d direction = map.drawDirection();
+	source.setDirection(direction);
+	candidate.setWeight(candidate.getWeight() * getWeight(map, map.binFromDirection(direction)));
+	candidate.created = source;
+	candidate.current = source;
+	candidate.previous = source;
+}
+
+double SourceTargetedEmission::getWeight(const CylindricalProjectionMap &map, size_t bin) {
+	const std::vector<double> &pdf = map.getPdf();
+	if (bin >= pdf.size() or pdf[bin] <= 0)
+		return 0;
+	// all bins cover the same solid angle
+	return map.getSum() / (pdf[bin] * pdf.size());
+}
+
+void SourceTargetedEmission::setEmissionMap(EmissionMap *emissionMap) {
+	this->emissionMap = emissionMap;
+}
+
+void SourceTargetedEmission::setDescription() {
+	description = "SourceTargetedEmission: weighted emission drawn from emission map\n";
+}
+
 // ----------------------------------------------------------------------------
 SourceEmissionCone::SourceEmissionCone(Vector3d direction, double aperture) :
 	aperture(aperture) {
@@ -822,6 +1430,53 @@ void SourceEmissionCone::setDescription() {
 	description = ss.str();
 }
 
+// ----------------------------------------------------------------------------
+SourceBiasedEmission::SourceBiasedEmission(Vector3d observer, double parameter, Shape shape) :
+		observer(observer), parameter(parameter), shape(shape) {
+	if ((shape == Fisher) and not (parameter > 0))
+		throw std::runtime_error("SourceBiasedEmission: kappa must be positive");
+	if ((shape == Cone) and not ((parameter > 0) and (parameter <= M_PI)))
+		throw std::runtime_error("SourceBiasedEmission: the half-opening angle must be in (0, pi]");
+	setDescription();
+}
+
+void SourceBiasedEmission::prepareCandidate(Candidate& candidate) const {
+	Random &random = Random::instance();
+	ParticleState &source = candidate.source;
+	Vector3d axis = observer - source.getPosition();
+	if (axis.getR() == 0) {
+		// at the observer every direction reaches it
+		source.setDirection(random.randVector());
+	} else {
+		axis = axis.getUnitVector();
+		Vector3d direction = (shape == Fisher) ? random.randFisherVector(axis, parameter)
+				: random.randConeVector(axis, parameter);
+		source.setDirection(direction);
+		candidate.setWeight(candidate.getWeight() * getWeight(direction.dot(axis)));
+	}
+	candidate.created = source;
+	candidate.current = source;
+	candidate.previous = source;
+}
+
+double SourceBiasedEmission::getWeight(double cosTheta) const {
+	if (shape == Cone)
+		return (cosTheta >= cos(parameter)) ? (1 - cos(parameter)) / 2 : 0;
+	// 1 / (4 pi) over kappa exp(kappa (cos(theta) - 1)) / (2 pi (1 - exp(-2 kappa)))
+	return -expm1(-2 * parameter) / (2 * parameter) * exp(parameter * (1 - cosTheta));
+}
+
+void SourceBiasedEmission::setDescription() {
+	std::stringstream ss;
+	ss << "SourceBiasedEmission: Weighted emission towards the observer at ";
+	ss << observer / Mpc << " Mpc, ";
+	if (shape == Fisher)
+		ss << "von Mises-Fisher distribution with kappa = " << parameter << "\n";
+	else
+		ss << "cone with half-opening angle = " << parameter << " rad\n";
+	description = ss.str();
+}
+
 // ----------------------------------------------------------------------------
 SourceRedshift::SourceRedshift(double z) :
 		z(z) {
@@ -879,6 +1534,18 @@ void SourceRedshiftEvolution::prepareCandidate(Candidate& candidate) const {
 	candidate.setRedshift(z);
 }
 
+double SourceRedshiftEvolution::getIndex() const {
+	return m;
+}
+
+double SourceRedshiftEvolution::getMinRedshift() const {
+	return zmin;
+}
+
+double SourceRedshiftEvolution::getMaxRedshift() const {
+	return zmax;
+}
+
 // ----------------------------------------------------------------------------
 SourceRedshift1D::SourceRedshift1D() {
 	setDescription();
@@ -0,0 +1,71 @@
+#include "crpropa/SourceArray.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+namespace crpropa {
+
+SourceArray::SourceArray(size_t count, const int32_t *id, const double *energy,
+		const double *position, const double *direction, const double *redshift,
+		const double *weight) : n(count), id(id), energy(energy), position(position),
+		direction(direction), redshift(redshift), weight(weight), next(0) {
+	if ((count > 0) and (!id or !energy or !position))
+		throw std::runtime_error("SourceArray: ids, energies and positions are required");
+}
+
+size_t SourceArray::size() const {
+	return n;
+}
+
+size_t SourceArray::getRemaining() const {
+	size_t taken = next.load();
+	return (taken < n) ? n - taken : 0;
+}
+
+void SourceArray::rewind() {
+	next = 0;
+}
+
+void SourceArray::setOwner(Referenced *o) {
+	owner = o;
+}
+
+ref_ptr<Candidate> SourceArray::getCandidate(size_t i) const {
+	if (i >= n)
+		throw std::runtime_error("SourceArray: index out of range");
+	const double *x = position + 3 * i;
+	Vector3d dir(-1, 0, 0);
+	if (direction)
+		dir = Vector3d(direction[3 * i], direction[3 * i + 1], direction[3 * i + 2]);
+	ref_ptr<Candidate> candidate = new Candidate(id[i], energy[i],
+			Vector3d(x[0], x[1], x[2]), dir, redshift ? redshift[i] : 0);
+	if (weight)
+		candidate->setWeight(weight[i]);
+	return candidate;
+}
+
+ref_ptr<Candidate> SourceArray::getCandidate() const {
+	size_t i = next++;
+	if (i >= n)
+		throw std::runtime_error("SourceArray: all rows are handed out");
+	return getCandidate(i);
+}
+
+void SourceArray::getCandidates(size_t count, std::vector<ref_ptr<Candidate> > &out) const {
+	size_t first = next.fetch_add(count);
+	size_t last = (first < n) ? std::min(n, first + count) : first;
+	out.reserve(out.size() + count);
+	for (size_t i = first; i < last; i++)
+		out.push_back(getCandidate(i));
+	if (last - first < count)
+		throw std::runtime_error("SourceArray: all rows are handed out");
+}
+
+std::string SourceArray::getDescription() const {
+	std::stringstream ss;
+	ss << "Source of " << n << " given candidates\n";
+	return ss.str();
+}
+
+} // namespace crpropa
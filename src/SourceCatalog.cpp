@@ -0,0 +1,293 @@
+#include "crpropa/SourceCatalog.h"
+#include "crpropa/Random.h"
+#include "crpropa/Units.h"
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef CRPROPA_HAVE_HDF5
+#include <hdf5.h>
+#endif
+
+namespace crpropa {
+
+static const char catalogMagic[8] = {'C', 'R', 'P', 'C', 'A', 'T', '0', '1'};
+static const size_t catalogHeaderSize = 64;
+
+struct CatalogHeader {
+	char magic[8];
+	uint64_t n;
+	uint32_t columns;
+	char pad[catalogHeaderSize - 20];
+};
+
+// number of float columns of the binary format
+static int floatColumns(uint32_t columns) {
+	return ((columns & SourceCatalog::Weight) ? 1 : 0) + ((columns & SourceCatalog::Redshift) ? 1 : 0)
+			+ ((columns & SourceCatalog::Spectrum) ? 2 : 0);
+}
+
+SourceCatalog::SourceCatalog(const std::string &filename, double lengthUnit, double energyUnit) :
+		n(0), x(NULL), y(NULL), z(NULL), weight(NULL), redshift(NULL), index(NULL), eMax(NULL),
+		lengthUnit(lengthUnit), energyUnit(energyUnit), minEnergy(1 * EeV), mapping(NULL),
+		mappingSize(0) {
+	std::ifstream in(filename.c_str(), std::ios::binary);
+	if (!in)
+		throw std::runtime_error("SourceCatalog: could not open " + filename);
+	char magic[8] = {0};
+	in.read(magic, sizeof(magic));
+	in.close();
+
+	if (memcmp(magic, catalogMagic, sizeof(magic)) == 0)
+		map(filename);
+	else
+		loadHDF5(filename);
+	init();
+}
+
+SourceCatalog::~SourceCatalog() {
+	if (mapping)
+		munmap(mapping, mappingSize);
+}
+
+void SourceCatalog::map(const std::string &filename) {
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("SourceCatalog: could not open " + filename);
+	CatalogHeader h;
+	struct stat st;
+	if ((read(fd, &h, sizeof(h)) != ssize_t(sizeof(h))) or (fstat(fd, &st) != 0)) {
+		close(fd);
+		throw std::runtime_error("SourceCatalog: could not read " + filename);
+	}
+	mappingSize = catalogHeaderSize + h.n * (3 * sizeof(double) + floatColumns(h.columns) * sizeof(float));
+	if (size_t(st.st_size) != mappingSize) {
+		close(fd);
+		throw std::runtime_error("SourceCatalog: size of " + filename + " does not match its header");
+	}
+
+	// private mapping: the pages are shared with all processes mapping the file
+	void *m = mmap(0, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		throw std::runtime_error("SourceCatalog: could not map " + filename);
+	mapping = m;
+
+	n = h.n;
+	const char *p = static_cast<const char*>(m) + catalogHeaderSize;
+	x = reinterpret_cast<const double*>(p);
+	y = x + n;
+	z = y + n;
+	const float *column = reinterpret_cast<const float*>(z + n);
+	if (h.columns & Weight) {
+		weight = column;
+		column += n;
+	}
+	if (h.columns & Redshift) {
+		redshift = column;
+		column += n;
+	}
+	if (h.columns & Spectrum) {
+		index = column;
+		eMax = column + n;
+	}
+}
+
+#ifdef CRPROPA_HAVE_HDF5
+// reads a dataset of n values, converted by HDF5, returns false if it does not exist
+template<typename T>
+static bool readCatalogDataset(hid_t file, const char *name, hid_t type, std::vector<T> &data,
+		size_t &n) {
+	if (H5Lexists(file, name, H5P_DEFAULT) <= 0)
+		return false;
+	hid_t dset = H5Dopen2(file, name, H5P_DEFAULT);
+	hid_t space = H5Dget_space(dset);
+	size_t count = H5Sget_simple_extent_npoints(space);
+	bool sizeMatches = (n == 0) or (count == n);
+	herr_t status = -1;
+	if (sizeMatches) {
+		n = count;
+		data.resize(count);
+		status = H5Dread(dset, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, &data[0]);
+	}
+	H5Sclose(space);
+	H5Dclose(dset);
+	if (not sizeMatches)
+		throw std::runtime_error(std::string("SourceCatalog: dataset ") + name + " has a different size");
+	if (status < 0)
+		throw std::runtime_error(std::string("SourceCatalog: could not read ") + name);
+	return true;
+}
+#endif
+
+void SourceCatalog::loadHDF5(const std::string &filename) {
+#ifdef CRPROPA_HAVE_HDF5
+	hid_t file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+	if (file < 0)
+		throw std::runtime_error("SourceCatalog: " + filename + " is neither a catalog nor an HDF5 file");
+	std::vector<double> px, py, pz;
+	std::vector<float> w, r, i, e;
+	bool hasW, hasR, hasI, hasE;
+	try {
+		bool hasPositions = readCatalogDataset(file, "x", H5T_NATIVE_DOUBLE, px, n)
+				and readCatalogDataset(file, "y", H5T_NATIVE_DOUBLE, py, n)
+				and readCatalogDataset(file, "z", H5T_NATIVE_DOUBLE, pz, n);
+		if (not hasPositions)
+			throw std::runtime_error("SourceCatalog: no datasets x, y and z in " + filename);
+		hasW = readCatalogDataset(file, "weight", H5T_NATIVE_FLOAT, w, n);
+		hasR = readCatalogDataset(file, "redshift", H5T_NATIVE_FLOAT, r, n);
+		hasI = readCatalogDataset(file, "index", H5T_NATIVE_FLOAT, i, n);
+		hasE = readCatalogDataset(file, "Emax", H5T_NATIVE_FLOAT, e, n);
+	} catch (...) {
+		H5Fclose(file);
+		throw;
+	}
+	H5Fclose(file);
+	if (hasI != hasE)
+		throw std::runtime_error("SourceCatalog: the spectrum needs both index and Emax in " + filename);
+
+	// the same column layout as the binary format
+	positionData.reserve(3 * n);
+	positionData.insert(positionData.end(), px.begin(), px.end());
+	positionData.insert(positionData.end(), py.begin(), py.end());
+	positionData.insert(positionData.end(), pz.begin(), pz.end());
+	columnData.reserve(n * ((hasW ? 1 : 0) + (hasR ? 1 : 0) + (hasI ? 2 : 0)));
+	columnData.insert(columnData.end(), w.begin(), w.end());
+	columnData.insert(columnData.end(), r.begin(), r.end());
+	columnData.insert(columnData.end(), i.begin(), i.end());
+	columnData.insert(columnData.end(), e.begin(), e.end());
+
+	x = &positionData[0];
+	y = x + n;
+	z = y + n;
+	const float *column = columnData.empty() ? NULL : &columnData[0];
+	if (hasW) {
+		weight = column;
+		column += n;
+	}
+	if (hasR) {
+		redshift = column;
+		column += n;
+	}
+	if (hasI) {
+		index = column;
+		eMax = column + n;
+	}
+#else
+	throw std::runtime_error("SourceCatalog: " + filename + " is not a catalog, HDF5 files need CRPropa with HDF5");
+#endif
+}
+
+void SourceCatalog::init() {
+	if (n == 0)
+		throw std::runtime_error("SourceCatalog: no sources");
+	std::vector<double> weights(n, 1.);
+	if (weight)
+		weights.assign(weight, weight + n);
+	table.setWeights(weights);
+	setDescription();
+}
+
+void SourceCatalog::save(const std::string &filename, const std::vector<Vector3d> &positions,
+		const std::vector<double> &weights, const std::vector<double> &redshifts,
+		const std::vector<double> &indices, const std::vector<double> &maxEnergies) {
+	size_t n = positions.size();
+	if ((not weights.empty() and (weights.size() != n)) or (not redshifts.empty() and (redshifts.size() != n))
+			or (indices.size() != maxEnergies.size()) or (not indices.empty() and (indices.size() != n)))
+		throw std::runtime_error("SourceCatalog: the columns differ in size");
+
+	CatalogHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, catalogMagic, sizeof(h.magic));
+	h.n = n;
+	h.columns = (weights.empty() ? 0 : Weight) | (redshifts.empty() ? 0 : Redshift)
+			| (indices.empty() ? 0 : Spectrum);
+
+	std::ofstream fout(filename.c_str(), std::ios::binary);
+	if (!fout)
+		throw std::runtime_error("SourceCatalog: could not write " + filename);
+	fout.write(reinterpret_cast<const char*>(&h), sizeof(h));
+	for (int d = 0; d < 3; d++)
+		for (size_t i = 0; i < n; i++)
+			fout.write(reinterpret_cast<const char*>(&positions[i].data[d]), sizeof(double));
+	const std::vector<double> *columns[4] = {&weights, &redshifts, &indices, &maxEnergies};
+	for (int c = 0; c < 4; c++)
+		for (size_t i = 0; i < columns[c]->size(); i++) {
+			float v = (*columns[c])[i];
+			fout.write(reinterpret_cast<const char*>(&v), sizeof(float));
+		}
+	if (!fout)
+		throw std::runtime_error("SourceCatalog: could not write " + filename);
+}
+
+void SourceCatalog::setMinEnergy(double energy) {
+	minEnergy = energy;
+	setDescription();
+}
+
+double SourceCatalog::getMinEnergy() const {
+	return minEnergy;
+}
+
+size_t SourceCatalog::size() const {
+	return n;
+}
+
+Vector3d SourceCatalog::getPosition(size_t i) const {
+	return Vector3d(x[i], y[i], z[i]) * lengthUnit;
+}
+
+double SourceCatalog::getWeight(size_t i) const {
+	return weight ? weight[i] : 1.;
+}
+
+bool SourceCatalog::hasRedshifts() const {
+	return redshift != NULL;
+}
+
+bool SourceCatalog::hasSpectra() const {
+	return eMax != NULL;
+}
+
+void SourceCatalog::prepareParticle(ParticleState &particle) const {
+	Random &random = Random::instance();
+	size_t i = table.sample(random);
+	particle.setPosition(getPosition(i));
+	if (eMax)
+		particle.setEnergy(random.randPowerLaw(index[i], minEnergy, eMax[i] * energyUnit));
+}
+
+void SourceCatalog::prepareCandidate(Candidate &candidate) const {
+	Random &random = Random::instance();
+	size_t i = table.sample(random);
+	ParticleState &source = candidate.source;
+	source.setPosition(getPosition(i));
+	if (eMax)
+		source.setEnergy(random.randPowerLaw(index[i], minEnergy, eMax[i] * energyUnit));
+	candidate.created = source;
+	candidate.current = source;
+	candidate.previous = source;
+	if (redshift)
+		candidate.setRedshift(redshift[i]);
+}
+
+void SourceCatalog::setDescription() {
+	std::stringstream ss;
+	ss << "SourceCatalog: Random source from a catalog of " << n << " sources";
+	if (redshift)
+		ss << ", with redshifts";
+	if (eMax)
+		ss << ", with power law spectra from " << minEnergy / EeV << " EeV";
+	ss << "\n";
+	description = ss.str();
+}
+
+} // namespace crpropa
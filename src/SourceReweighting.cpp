@@ -0,0 +1,617 @@
+#include "crpropa/SourceReweighting.h"
+#include "crpropa/Cosmology.h"
+#include "crpropa/ParticleID.h"
+#include "crpropa/Units.h"
+
+#include "kiss/string.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+#ifdef CRPROPA_HAVE_ZLIB
+#include <izstream.hpp>
+#endif
+
+#ifdef CRPROPA_HAVE_HDF5
+#include <hdf5.h>
+#endif
+
+namespace crpropa {
+
+// integral of f over [a, b] by Simpson's rule with n (even) intervals
+template<typename F>
+static double simpson(F f, double a, double b, int n) {
+	double h = (b - a) / n;
+	double sum = f(a) + f(b);
+	for (int i = 1; i < n; i++)
+		sum += f(a + i * h) * ((i % 2) ? 4 : 2);
+	return sum * h / 3;
+}
+
+SourceModel::SourceModel() : spectrum(false), index(0), minEnergy(0), maxEnergy(0),
+		maxRigidity(0), cutoffRigidity(0), distances(NoDistance), minDistance(0),
+		maxDistance(0), evolution(0), distanceNorm(1) {
+}
+
+SourceModel::SourceModel(const Source &source) : spectrum(false), index(0), minEnergy(0),
+		maxEnergy(0), maxRigidity(0), cutoffRigidity(0), distances(NoDistance), minDistance(0),
+		maxDistance(0), evolution(0), distanceNorm(1) {
+	const std::vector<ref_ptr<SourceFeature> > &features = source.getFeatures();
+	for (size_t i = 0; i < features.size(); i++) {
+		const SourceFeature *f = features[i];
+		if (const SourceParticleType *type = dynamic_cast<const SourceParticleType*>(f)) {
+			isotopes.assign(1, type->getId());
+			fractions.assign(1, 1.);
+		} else if (const SourceMultipleParticleTypes *types = dynamic_cast<const SourceMultipleParticleTypes*>(f)) {
+			isotopes = types->getParticleTypes();
+			fractions = types->getFractions();
+		} else if (const SourcePowerLawSpectrum *power = dynamic_cast<const SourcePowerLawSpectrum*>(f)) {
+			setSpectrum(power->getIndex(), power->getMinEnergy(), power->getMaxEnergy());
+			maxRigidity = 0;
+		} else if (const SourceComposition *composition = dynamic_cast<const SourceComposition*>(f)) {
+			isotopes = composition->getNuclei();
+			fractions = composition->getFractions();
+			setSpectrum(composition->getIndex(), composition->getMinEnergy(),
+					std::numeric_limits<double>::max());
+			maxRigidity = composition->getMaxRigidity();
+		} else if (const SourceUniform1D *uniform = dynamic_cast<const SourceUniform1D*>(f)) {
+			setDistances(uniform->isWithCosmology() ? UniformLightTravel : UniformComoving,
+					uniform->getMinDistance(), uniform->getMaxDistance());
+		} else if (const SourceRedshiftEvolution *redshift = dynamic_cast<const SourceRedshiftEvolution*>(f)) {
+			setRedshifts(redshift->getMinRedshift(), redshift->getMaxRedshift());
+			evolution = redshift->getIndex();
+		} else if (const SourceEvolution1D *evolution1D = dynamic_cast<const SourceEvolution1D*>(f)) {
+			if (evolution1D->hasComovingVolume())
+				throw std::runtime_error("SourceModel: SourceEvolution1D with the comoving volume cannot be reweighted");
+			DistanceDistribution distribution = UniformComoving;
+			if (evolution1D->getDistribution() == SourceEvolution1D::UniformLightTravel)
+				distribution = UniformLightTravel;
+			else if (evolution1D->getDistribution() == SourceEvolution1D::UniformRedshift)
+				distribution = UniformRedshift;
+			setDistances(distribution, evolution1D->getMinDistance(), evolution1D->getMaxDistance());
+			evolution = evolution1D->getIndex();
+		} else if (dynamic_cast<const SourceEnergy*>(f)) {
+			throw std::runtime_error("SourceModel: SourceEnergy cannot be reweighted");
+		}
+	}
+	update();
+}
+
+void SourceModel::addIsotope(int id, double fraction) {
+	if (fraction < 0)
+		throw std::runtime_error("SourceModel: negative fraction");
+	isotopes.push_back(id);
+	fractions.push_back(fraction);
+}
+
+void SourceModel::setSpectrum(double index, double minEnergy, double maxEnergy) {
+	if ((minEnergy <= 0) or (maxEnergy <= minEnergy))
+		throw std::runtime_error("SourceModel: 0 < minEnergy < maxEnergy required");
+	spectrum = true;
+	this->index = index;
+	this->minEnergy = minEnergy;
+	this->maxEnergy = maxEnergy;
+	update();
+}
+
+void SourceModel::setMaxRigidity(double Rmax) {
+	maxRigidity = Rmax;
+	update();
+}
+
+void SourceModel::setCutoffRigidity(double Rcut) {
+	cutoffRigidity = Rcut;
+	update();
+}
+
+void SourceModel::setDistances(DistanceDistribution distribution, double minDistance, double maxDistance) {
+	if ((distribution != NoDistance) and ((minDistance < 0) or (maxDistance <= minDistance)))
+		throw std::runtime_error("SourceModel: 0 <= minDistance < maxDistance required");
+	distances = distribution;
+	this->minDistance = minDistance;
+	this->maxDistance = maxDistance;
+	update();
+}
+
+void SourceModel::setRedshifts(double minRedshift, double maxRedshift) {
+	if ((minRedshift < 0) or (maxRedshift <= minRedshift))
+		throw std::runtime_error("SourceModel: 0 <= minRedshift < maxRedshift required");
+	setDistances(UniformRedshift, redshift2ComovingDistance(minRedshift),
+			redshift2ComovingDistance(maxRedshift));
+}
+
+void SourceModel::setEvolution(double m) {
+	evolution = m;
+	update();
+}
+
+bool SourceModel::hasComposition() const {
+	return not isotopes.empty();
+}
+
+bool SourceModel::hasSpectrum() const {
+	return spectrum;
+}
+
+bool SourceModel::hasDistances() const {
+	return distances != NoDistance;
+}
+
+double SourceModel::distanceBase(double distance) const {
+	double z = comovingDistance2Redshift(distance);
+	double base = 1;
+	if (distances == UniformLightTravel)
+		base = 1 / (1 + z); // d(light travel distance) / dD
+	else if (distances == UniformRedshift)
+		base = hubbleRate(z) / c_light; // dz / dD
+	return base * pow(1 + z, evolution);
+}
+
+double SourceModel::energyShape(double energy, int Z) const {
+	double Emax = (maxRigidity > 0) ? std::min(maxEnergy, Z * maxRigidity) : maxEnergy;
+	if ((energy < minEnergy) or (energy > Emax))
+		return 0;
+	double shape = pow(energy, index);
+	if (cutoffRigidity > 0) {
+		double x = energy / (Z * cutoffRigidity);
+		if (x > 1)
+			shape *= exp(1 - x);
+	}
+	return shape;
+}
+
+double SourceModel::energyNormalization(int Z) const {
+	std::map<int, double>::const_iterator it = energyNorm.find(Z);
+	if (it != energyNorm.end())
+		return it->second;
+
+	double Emax = (maxRigidity > 0) ? std::min(maxEnergy, Z * maxRigidity) : maxEnergy;
+	double norm;
+	if (Emax <= minEnergy) {
+		norm = 0;
+	} else if (cutoffRigidity > 0) {
+		// integrated in ln(E), where the spectrum is smooth
+		norm = simpson([this, Z](double lnE) {
+			double E = exp(lnE);
+			return energyShape(E, Z) * E;
+		}, log(minEnergy), log(Emax), 512);
+	} else if (std::abs(index + 1) < 1e-12) {
+		norm = log(Emax / minEnergy);
+	} else {
+		norm = (pow(Emax, index + 1) - pow(minEnergy, index + 1)) / (index + 1);
+	}
+	energyNorm[Z] = norm;
+	return norm;
+}
+
+void SourceModel::update() {
+	energyNorm.clear();
+	distanceNorm = 1;
+	if (distances != NoDistance)
+		distanceNorm = simpson([this](double D) {
+			return distanceBase(D);
+		}, minDistance, maxDistance, 512);
+}
+
+double SourceModel::getDensity(int id, double energy, double distance) const {
+	double density = 1;
+	if (not isotopes.empty()) {
+		double total = 0, fraction = 0;
+		for (size_t i = 0; i < isotopes.size(); i++) {
+			total += fractions[i];
+			if (isotopes[i] == id)
+				fraction += fractions[i];
+		}
+		density *= fraction / total;
+	}
+	if (spectrum) {
+		int Z = isNucleus(id) ? chargeNumber(id) : 1;
+		double norm = energyNormalization(Z);
+		density *= (norm > 0) ? energyShape(energy, Z) / norm : 0;
+	}
+	if (distances != NoDistance) {
+		if ((distance < minDistance) or (distance > maxDistance))
+			return 0;
+		density *= distanceBase(distance) / distanceNorm;
+	}
+	return density;
+}
+
+// ----------------------------------------------------------------------------
+SourceReweighting::SourceReweighting(ref_ptr<SourceModel> original) : original(original) {
+	if (not original.valid())
+		throw std::runtime_error("SourceReweighting: no original model");
+}
+
+size_t SourceReweighting::addTarget(ref_ptr<SourceModel> target) {
+	if ((target->hasComposition() != original->hasComposition())
+			or (target->hasSpectrum() != original->hasSpectrum())
+			or (target->hasDistances() != original->hasDistances()))
+		throw std::runtime_error("SourceReweighting: the target model must set the same parts as the original");
+	targets.push_back(target);
+	weights.resize(targets.size());
+	return targets.size() - 1;
+}
+
+size_t SourceReweighting::getNumberOfTargets() const {
+	return targets.size();
+}
+
+double SourceReweighting::getFactor(size_t target, int id, double energy, double distance) const {
+	double p = original->getDensity(id, energy, distance);
+	if (p <= 0)
+		return 0; // could not have been drawn
+	return targets.at(target)->getDensity(id, energy, distance) / p;
+}
+
+void SourceReweighting::addEvent(int id, double energy, double distance, double weight) {
+	double p = original->getDensity(id, energy, distance);
+	for (size_t t = 0; t < targets.size(); t++)
+		weights[t].push_back((p > 0) ? weight * targets[t]->getDensity(id, energy, distance) / p : 0);
+}
+
+void SourceReweighting::reweight(const std::string &filename) {
+	if (targets.empty())
+		throw std::runtime_error("SourceReweighting: no target model");
+	for (size_t t = 0; t < targets.size(); t++)
+		weights[t].clear();
+	if (kiss::ends_with(filename, ".h5") or kiss::ends_with(filename, ".hdf5"))
+		reweightHDF5(filename);
+	else
+		reweightText(filename);
+}
+
+const std::vector<double> &SourceReweighting::getWeights(size_t target) const {
+	return weights.at(target);
+}
+
+// ----------------------------------------------------------------------------
+/** Rows of a TextOutput file, with the source columns and the units of the header */
+class SourceTextReader {
+	std::ifstream file;
+	std::istream *in;
+	std::unique_ptr<std::istream> unzipped;
+	double energyScale, lengthScale;
+	std::map<std::string, size_t> columns;
+	std::vector<std::string> fields;
+
+public:
+	std::string line;
+
+	SourceTextReader(const std::string &filename) : energyScale(EeV), lengthScale(Mpc) {
+		file.open(filename.c_str());
+		if (!file.good())
+			throw std::runtime_error("SourceReweighting: could not open file " + filename);
+		in = &file;
+		if (kiss::ends_with(filename, ".gz")) {
+#ifdef CRPROPA_HAVE_ZLIB
+			unzipped.reset(new zstream::igzstream(file));
+			in = unzipped.get();
+#else
+			throw std::runtime_error("CRPropa was build without Zlib compression!");
+#endif
+		}
+	}
+
+	/** Next line, comments are parsed for the columns and units */
+	bool next(bool &comment) {
+		if (!std::getline(*in, line))
+			return false;
+		comment = (not line.empty()) and (line[0] == '#');
+		if (not comment) {
+			split();
+			return true;
+		}
+		if (columns.empty() and (line.size() > 1) and (line[1] == '\t')) {
+			std::stringstream names(line.substr(2));
+			std::string name;
+			for (size_t i = 0; std::getline(names, name, '\t'); i++)
+				columns[name] = i;
+		}
+		size_t unit = line.find("Energy [");
+		if ((line.compare(0, 5, "# E/E") == 0) and (unit != std::string::npos))
+			energyScale = atof(line.c_str() + unit + 8) * EeV;
+		unit = line.find("Position [");
+		if ((line.compare(0, 5, "# X/X") == 0) and (unit != std::string::npos))
+			lengthScale = atof(line.c_str() + unit + 10) * Mpc;
+		return true;
+	}
+
+	void split() {
+		fields.clear();
+		size_t begin = 0;
+		while (true) {
+			size_t end = line.find('\t', begin);
+			fields.push_back(line.substr(begin, end - begin));
+			if (end == std::string::npos)
+				break;
+			begin = end + 1;
+		}
+	}
+
+	bool has(const std::string &name) const {
+		return columns.count(name) > 0;
+	}
+
+	size_t column(const std::string &name) const {
+		std::map<std::string, size_t>::const_iterator it = columns.find(name);
+		if (it == columns.end())
+			throw std::runtime_error("SourceReweighting: no column " + name);
+		return it->second;
+	}
+
+	size_t numberOfColumns() const {
+		return columns.size();
+	}
+
+	double value(const std::string &name) const {
+		size_t i = column(name);
+		if (i >= fields.size())
+			throw std::runtime_error("SourceReweighting: missing value of column " + name);
+		return atof(fields[i].c_str());
+	}
+
+	/** Source state of the current row and its weight */
+	void source(bool distance, int &id, double &energy, double &D, double &weight) const {
+		id = int(value("ID0"));
+		energy = value("E0") * energyScale;
+		D = 0;
+		if (distance) {
+			Vector3d position(value("X0"), has("Y0") ? value("Y0") : 0, has("Z0") ? value("Z0") : 0);
+			D = position.getR() * lengthScale;
+		}
+		weight = has("W") ? value("W") : 1;
+	}
+
+	/** The current row with the weight in the column W */
+	std::string withWeight(double weight) const {
+		std::ostringstream out;
+		out.imbue(std::locale::classic());
+		out.precision(17);
+		size_t w = has("W") ? column("W") : fields.size();
+		for (size_t i = 0; i < fields.size(); i++) {
+			if (i > 0)
+				out << '\t';
+			if (i == w)
+				out << weight;
+			else
+				out << fields[i];
+		}
+		if (w == fields.size())
+			out << '\t' << weight;
+		return out.str();
+	}
+};
+
+void SourceReweighting::reweightText(const std::string &filename) {
+	SourceTextReader reader(filename);
+	bool comment;
+	while (reader.next(comment)) {
+		if (comment or reader.line.empty())
+			continue;
+		int id;
+		double E, D, w;
+		reader.source(original->hasDistances(), id, E, D, w);
+		addEvent(id, E, D, w);
+	}
+}
+
+void SourceReweighting::writeText(const std::string &input, const std::string &output, size_t target) const {
+	if (target >= targets.size())
+		throw std::runtime_error("SourceReweighting: no such target model");
+	SourceTextReader reader(input);
+	std::ofstream out(output.c_str());
+	if (!out)
+		throw std::runtime_error("SourceReweighting: could not open file " + output);
+
+	bool comment, header = true;
+	while (reader.next(comment)) {
+		if (comment or reader.line.empty()) {
+			// the list of columns is the first line
+			if (header and not reader.has("W") and (reader.numberOfColumns() > 0))
+				out << reader.line << "\tW\n";
+			else
+				out << reader.line << "\n";
+			header = false;
+			continue;
+		}
+		int id;
+		double E, D, w;
+		reader.source(original->hasDistances(), id, E, D, w);
+		out << reader.withWeight(w * getFactor(target, id, E, D)) << "\n";
+	}
+	if (!out)
+		throw std::runtime_error("SourceReweighting: could not write file " + output);
+}
+
+// ----------------------------------------------------------------------------
+#ifdef CRPROPA_HAVE_HDF5
+
+/** Numeric columns of a compound dataset or of the datasets of a group, read as double */
+class SourceHDF5Table {
+	hid_t object;
+	bool columnar;
+	hsize_t rows;
+
+public:
+	SourceHDF5Table(hid_t parent, const char *name) : object(-1), rows(0) {
+		if (H5Lexists(parent, name, H5P_DEFAULT) <= 0)
+			return;
+		object = H5Oopen(parent, name, H5P_DEFAULT);
+		columnar = (H5Iget_type(object) == H5I_GROUP);
+		hid_t dset = object;
+		if (columnar) {
+			// all columns have the same length
+			H5G_info_t info;
+			H5Gget_info(object, &info);
+			if (info.nlinks == 0)
+				return;
+			char first[256];
+			H5Lget_name_by_idx(object, ".", H5_INDEX_NAME, H5_ITER_INC, 0, first, sizeof(first), H5P_DEFAULT);
+			dset = H5Dopen2(object, first, H5P_DEFAULT);
+		}
+		hid_t space = H5Dget_space(dset);
+		rows = H5Sget_simple_extent_npoints(space);
+		H5Sclose(space);
+		if (columnar)
+			H5Dclose(dset);
+	}
+
+	~SourceHDF5Table() {
+		if (object >= 0)
+			H5Oclose(object);
+	}
+
+	bool valid() const {
+		return object >= 0;
+	}
+
+	hsize_t size() const {
+		return rows;
+	}
+
+	bool has(const std::string &name) const {
+		if (columnar)
+			return H5Lexists(object, name.c_str(), H5P_DEFAULT) > 0;
+		hid_t type = H5Dget_type(object);
+		bool found = H5Tget_member_index(type, name.c_str()) >= 0;
+		H5Tclose(type);
+		return found;
+	}
+
+	double attribute(const char *name, double value) const {
+		if (H5Aexists(object, name) > 0) {
+			hid_t attr = H5Aopen(object, name, H5P_DEFAULT);
+			H5Aread(attr, H5T_NATIVE_DOUBLE, &value);
+			H5Aclose(attr);
+		}
+		return value;
+	}
+
+	/** Values of the columns in the rows [offset, offset + count) */
+	void read(const std::vector<std::string> &names, hsize_t offset, hsize_t count,
+			std::vector<std::vector<double> > &values) const {
+		values.resize(names.size());
+		hsize_t start[1] = {offset}, cnt[1] = {count};
+		hid_t memspace = H5Screate_simple(1, cnt, NULL);
+		herr_t status = 0;
+		for (size_t i = 0; (i < names.size()) and (status >= 0); i++) {
+			values[i].resize(count);
+			hid_t dset = columnar ? H5Dopen2(object, names[i].c_str(), H5P_DEFAULT) : object;
+			hid_t type = H5T_NATIVE_DOUBLE;
+			if (not columnar) {
+				// a compound of the single member, converted by name
+				type = H5Tcreate(H5T_COMPOUND, sizeof(double));
+				H5Tinsert(type, names[i].c_str(), 0, H5T_NATIVE_DOUBLE);
+			}
+			hid_t space = H5Dget_space(dset);
+			H5Sselect_hyperslab(space, H5S_SELECT_SET, start, NULL, cnt, NULL);
+			status = H5Dread(dset, type, memspace, space, H5P_DEFAULT, values[i].data());
+			H5Sclose(space);
+			if (not columnar)
+				H5Tclose(type);
+			else
+				H5Dclose(dset);
+		}
+		H5Sclose(memspace);
+		if (status < 0)
+			throw std::runtime_error("SourceReweighting: cannot read HDF5 file");
+	}
+};
+
+void SourceReweighting::reweightHDF5(const std::string &filename) {
+	hid_t file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+	if (file < 0)
+		throw std::runtime_error("SourceReweighting: cannot open file " + filename);
+	try {
+		SourceHDF5Table events(file, "CRPROPA3");
+		if (not events.valid())
+			throw std::runtime_error("SourceReweighting: no CRPROPA3 dataset in file " + filename);
+		double energyScale = events.attribute("EnergyScale", EeV);
+		double lengthScale = events.attribute("LengthScale", Mpc);
+
+		// the source columns, in the normalized layout by SN0 from SOURCES
+		std::vector<std::string> names;
+		names.push_back("ID0");
+		names.push_back("E0");
+		if (original->hasDistances()) {
+			names.push_back("X0");
+			names.push_back("Y0");
+			names.push_back("Z0");
+		}
+		SourceHDF5Table sources(file, "SOURCES");
+		const SourceHDF5Table &table = sources.valid() ? sources : events;
+		for (size_t i = 0; i < names.size(); i++)
+			if ((i < 3) and not table.has(names[i]))
+				throw std::runtime_error("SourceReweighting: no column " + names[i] + " in file " + filename);
+		bool threeD = original->hasDistances() and table.has("Y0");
+		if (original->hasDistances() and not threeD)
+			names.resize(3);
+
+		const hsize_t block = 65536;
+		std::vector<std::vector<double> > values;
+		std::unordered_map<uint64_t, std::vector<double> > sourceStates;
+		if (sources.valid()) {
+			std::vector<std::string> sn(1, "SN0");
+			std::vector<std::vector<double> > keys;
+			for (hsize_t offset = 0; offset < sources.size(); offset += block) {
+				hsize_t count = std::min(block, sources.size() - offset);
+				sources.read(names, offset, count, values);
+				sources.read(sn, offset, count, keys);
+				for (hsize_t j = 0; j < count; j++) {
+					std::vector<double> &state = sourceStates[uint64_t(keys[0][j])];
+					for (size_t i = 0; i < names.size(); i++)
+						state.push_back(values[i][j]);
+				}
+			}
+			names.assign(1, "SN0");
+		}
+		bool weighted = events.has("weight");
+		if (weighted)
+			names.push_back("weight");
+
+		std::vector<double> state;
+		for (hsize_t offset = 0; offset < events.size(); offset += block) {
+			hsize_t count = std::min(block, events.size() - offset);
+			events.read(names, offset, count, values);
+			for (hsize_t j = 0; j < count; j++) {
+				state.clear();
+				if (sources.valid()) {
+					std::unordered_map<uint64_t, std::vector<double> >::const_iterator it =
+							sourceStates.find(uint64_t(values[0][j]));
+					if (it == sourceStates.end())
+						throw std::runtime_error("SourceReweighting: missing source state in file " + filename);
+					state = it->second;
+				} else {
+					for (size_t i = 0; i < names.size() - weighted; i++)
+						state.push_back(values[i][j]);
+				}
+				double D = 0;
+				if (original->hasDistances())
+					D = Vector3d(state[2], threeD ? state[3] : 0, threeD ? state[4] : 0).getR() * lengthScale;
+				addEvent(int(state[0]), state[1] * energyScale, D, weighted ? values.back()[j] : 1);
+			}
+		}
+	} catch (...) {
+		H5Fclose(file);
+		throw;
+	}
+	H5Fclose(file);
+}
+
+#else
+
+void SourceReweighting::reweightHDF5(const std::string &filename) {
+	throw std::runtime_error("SourceReweighting: CRPropa was build without HDF5");
+}
+
+#endif // CRPROPA_HAVE_HDF5
+
+} // namespace crpropa
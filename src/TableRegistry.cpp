@@ -0,0 +1,74 @@
+#include "crpropa/TableRegistry.h"
+
+#include <map>
+
+namespace crpropa {
+
+typedef std::map<std::string, ref_ptr<Referenced> > RegistryMap;
+
+static RegistryMap &registry() {
+	static RegistryMap tables;
+	return tables;
+}
+
+// inside the TableRegistry critical section
+static size_t releaseUnusedEntries() {
+	RegistryMap &tables = registry();
+	size_t n = 0;
+	for (RegistryMap::iterator i = tables.begin(); i != tables.end();) {
+		if (i->second->getReferenceCount() == 1) {
+			tables.erase(i++);
+			n++;
+		} else
+			++i;
+	}
+	return n;
+}
+
+std::string TableRegistry::key(const std::string &module, const std::string &field,
+		const std::string &files) {
+	return module + "|" + field + "|" + files;
+}
+
+ref_ptr<Referenced> TableRegistry::findEntry(const std::string &key) {
+	ref_ptr<Referenced> table;
+#pragma omp critical(TableRegistry)
+	{
+		RegistryMap::const_iterator i = registry().find(key);
+		if (i != registry().end())
+			table = i->second;
+	}
+	return table;
+}
+
+ref_ptr<Referenced> TableRegistry::insertEntry(const std::string &key, ref_ptr<Referenced> table) {
+	ref_ptr<Referenced> registered;
+#pragma omp critical(TableRegistry)
+	{
+		releaseUnusedEntries();
+		// another thread may have registered the same tables meanwhile
+		registered = registry().insert(std::make_pair(key, table)).first->second;
+	}
+	return registered;
+}
+
+size_t TableRegistry::releaseUnused() {
+	size_t n;
+#pragma omp critical(TableRegistry)
+	n = releaseUnusedEntries();
+	return n;
+}
+
+size_t TableRegistry::size() {
+	size_t n;
+#pragma omp critical(TableRegistry)
+	n = registry().size();
+	return n;
+}
+
+void TableRegistry::clear() {
+#pragma omp critical(TableRegistry)
+	registry().clear();
+}
+
+} // namespace crpropa
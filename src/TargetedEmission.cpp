@@ -0,0 +1,164 @@
+#include "crpropa/TargetedEmission.h"
+#include "crpropa/ParticleID.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace crpropa {
+
+/** Detection action that fills the emission maps of the thread */
+class TargetedEmissionRecorder: public Module {
+public:
+	TargetedEmission *workflow; // reset when the workflow is deleted
+
+	TargetedEmissionRecorder(TargetedEmission *workflow) : workflow(workflow) {
+		setDescription("TargetedEmission recorder");
+	}
+
+	void process(Candidate *candidate) const {
+		if (workflow)
+			workflow->record(candidate);
+	}
+};
+
+TargetedEmission::TargetedEmission(size_t nPhi, size_t nTheta, size_t nEnergy,
+		double minEnergy, double maxEnergy, Direction direction) :
+		emissionMap(new EmissionMap(nPhi, nTheta, nEnergy, minEnergy, maxEnergy)),
+		counts(new EmissionMap(nPhi, nTheta, nEnergy, minEnergy, maxEnergy)),
+		direction(direction), smoothing(1), isotropicFraction(0) {
+	recorder = new TargetedEmissionRecorder(this);
+	createThreadMaps();
+}
+
+TargetedEmission::~TargetedEmission() {
+	static_cast<TargetedEmissionRecorder *>(recorder.get())->workflow = 0;
+}
+
+void TargetedEmission::createThreadMaps() {
+	size_t nThreads = 1;
+#ifdef _OPENMP
+	nThreads = omp_get_max_threads();
+#endif
+	while (threadMaps.size() < nThreads)
+		threadMaps.push_back(new EmissionMap(counts->getNPhi(), counts->getNTheta(),
+				counts->getNEnergy(), counts->getMinimumEnergy(), counts->getMaximumEnergy()));
+}
+
+void TargetedEmission::record(const Candidate *candidate) {
+	ParticleState state = candidate->source;
+	if (direction == Backward) {
+		// the antiparticle detected at the source, emitted towards the observer
+		state = candidate->current;
+		state.setDirection(state.getDirection() * -1.);
+		if (chargeNumber(state.getId()) != 0)
+			state.setId(-state.getId());
+	}
+
+	size_t thread = 0;
+#ifdef _OPENMP
+	thread = omp_get_thread_num();
+#endif
+	if (thread < threadMaps.size()) {
+		threadMaps[thread]->fillMap(state, candidate->getWeight());
+	} else {
+		// more threads than at the start of the run
+#pragma omp critical(TargetedEmission)
+		counts->fillMap(state, candidate->getWeight());
+	}
+}
+
+ref_ptr<Module> TargetedEmission::getRecorder() const {
+	return recorder;
+}
+
+void TargetedEmission::setSmoothing(size_t bins) {
+	smoothing = bins;
+}
+
+size_t TargetedEmission::getSmoothing() const {
+	return smoothing;
+}
+
+void TargetedEmission::setIsotropicFraction(double fraction) {
+	if ((fraction < 0) or (fraction > 1))
+		throw std::runtime_error("TargetedEmission: the isotropic fraction must be in [0, 1]");
+	isotropicFraction = fraction;
+}
+
+double TargetedEmission::getIsotropicFraction() const {
+	return isotropicFraction;
+}
+
+void TargetedEmission::runPilot(ModuleList *simulation, SourceInterface *source, size_t count) {
+	createThreadMaps();
+	simulation->run(source, count);
+	finish();
+}
+
+void TargetedEmission::finish() {
+	for (size_t i = 0; i < threadMaps.size(); i++) {
+		counts->merge(threadMaps[i]);
+		threadMaps[i]->getMaps().clear();
+	}
+
+	size_t nPhi = counts->getNPhi(), nTheta = counts->getNTheta();
+	size_t nBins = nPhi * nTheta;
+	int radius = smoothing;
+	EmissionMap::map_t &maps = emissionMap->getMaps();
+	maps.clear();
+	EmissionMap::map_t::const_iterator m;
+	for (m = counts->getMaps().begin(); m != counts->getMaps().end(); m++) {
+		if (not m->second.valid())
+			continue;
+		const std::vector<double> &pdf = m->second->getPdf();
+
+		// box of the bins within the radius, periodic in phi
+		std::vector<double> smoothed(nBins, 0.);
+		double sum = 0;
+		for (size_t iTheta = 0; iTheta < nTheta; iTheta++) {
+			for (size_t iPhi = 0; iPhi < nPhi; iPhi++) {
+				double value = pdf[iTheta * nPhi + iPhi];
+				if (value <= 0)
+					continue;
+				int t0 = std::max<int>(0, (int)iTheta - radius);
+				int t1 = std::min<int>(nTheta - 1, (int)iTheta + radius);
+				int p0 = (int)iPhi - std::min<int>(radius, (nPhi - 1) / 2);
+				int p1 = (int)iPhi + std::min<int>(radius, nPhi / 2);
+				for (int t = t0; t <= t1; t++)
+					for (int p = p0; p <= p1; p++)
+						smoothed[t * nPhi + (p + (int)nPhi) % (int)nPhi] += value;
+			}
+		}
+		for (size_t i = 0; i < nBins; i++)
+			sum += smoothed[i];
+		if (sum <= 0)
+			continue;
+
+		ref_ptr<CylindricalProjectionMap> map = new CylindricalProjectionMap(nPhi, nTheta);
+		for (size_t i = 0; i < nBins; i++) {
+			double value = (1 - isotropicFraction) * smoothed[i] / sum + isotropicFraction / nBins;
+			if (value > 0)
+				map->fillBin(i, value);
+		}
+		map->finalize();
+		maps[m->first] = map;
+	}
+}
+
+ref_ptr<EmissionMap> TargetedEmission::getEmissionMap() const {
+	return emissionMap;
+}
+
+ref_ptr<SourceFeature> TargetedEmission::getSourceFeature() const {
+	return new SourceTargetedEmission(emissionMap);
+}
+
+void TargetedEmission::configure(Source *source) const {
+	source->add(getSourceFeature());
+}
+
+} // namespace crpropa
@@ -0,0 +1,204 @@
+#include "crpropa/Trace.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
+
+namespace crpropa {
+
+std::atomic<bool> Trace::enabled(false);
+
+namespace {
+
+struct TraceEvent {
+	const char *name, *category;
+	uint64_t begin, end;
+	bool mangled;
+};
+
+// spans of one thread, kept after the thread ends
+struct ThreadBuffer {
+	std::vector<TraceEvent> events;
+	size_t dropped;
+	size_t generation;
+	int tid;
+};
+
+struct TraceState {
+	std::mutex mutex;
+	std::vector<ThreadBuffer *> buffers;
+	std::atomic<size_t> generation;
+	size_t maxEvents;
+	uint64_t origin;
+	TraceState() : generation(0), maxEvents(0), origin(0) {
+	}
+};
+
+TraceState &state() {
+	static TraceState *s = new TraceState(); // alive for spans at exit
+	return *s;
+}
+
+thread_local ThreadBuffer *threadBuffer = NULL;
+
+ThreadBuffer *getThreadBuffer() {
+	if (!threadBuffer) {
+		TraceState &s = state();
+		std::lock_guard<std::mutex> lock(s.mutex);
+		threadBuffer = new ThreadBuffer();
+		threadBuffer->dropped = 0;
+		threadBuffer->generation = s.generation;
+		threadBuffer->tid = s.buffers.size();
+		s.buffers.push_back(threadBuffer);
+	}
+	return threadBuffer;
+}
+
+std::string demangle(const char *name) {
+#ifdef __GNUG__
+	int status = 0;
+	char *d = abi::__cxa_demangle(name, NULL, NULL, &status);
+	if (status == 0 and d) {
+		std::string s(d);
+		free(d);
+		return s;
+	}
+#endif
+	return name;
+}
+
+std::string escape(const std::string &s) {
+	std::string out;
+	for (size_t i = 0; i < s.size(); i++) {
+		if ((s[i] == '"') or (s[i] == '\\'))
+			out += '\\';
+		out += s[i];
+	}
+	return out;
+}
+
+std::string traceFile;
+
+void writeTraceAtExit() {
+	try {
+		Trace::write(traceFile);
+	} catch (std::exception &e) {
+		fprintf(stderr, "crpropa::Trace: %s\n", e.what());
+	}
+}
+
+// traces the whole process if CRPROPA_TRACE is set
+struct TraceFromEnvironment {
+	TraceFromEnvironment() {
+		const char *filename = getenv("CRPROPA_TRACE");
+		if (!filename or (filename[0] == 0))
+			return;
+		traceFile = filename;
+		Trace::start();
+		atexit(writeTraceAtExit);
+	}
+} traceFromEnvironment;
+
+} // namespace
+
+void Trace::start(size_t maxEvents) {
+	TraceState &s = state();
+	std::lock_guard<std::mutex> lock(s.mutex);
+	s.maxEvents = maxEvents;
+	s.origin = now();
+	s.generation++;
+	enabled = true;
+}
+
+void Trace::stop() {
+	enabled = false;
+}
+
+uint64_t Trace::now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::record(const char *name, const char *category, uint64_t begin,
+		uint64_t end, bool mangled) {
+	if (!isEnabled())
+		return;
+	ThreadBuffer *b = getThreadBuffer();
+	TraceState &s = state();
+	if (b->generation != s.generation) {
+		b->events.clear();
+		b->dropped = 0;
+		b->generation = s.generation;
+	}
+	if (begin < s.origin) // begun before the trace
+		return;
+	if (b->events.size() >= s.maxEvents) {
+		b->dropped++;
+		return;
+	}
+	TraceEvent e = {name, category, begin, end, mangled};
+	b->events.push_back(e);
+}
+
+size_t Trace::getEventCount() {
+	TraceState &s = state();
+	std::lock_guard<std::mutex> lock(s.mutex);
+	size_t n = 0;
+	for (size_t i = 0; i < s.buffers.size(); i++)
+		if (s.buffers[i]->generation == s.generation)
+			n += s.buffers[i]->events.size();
+	return n;
+}
+
+size_t Trace::getDroppedCount() {
+	TraceState &s = state();
+	std::lock_guard<std::mutex> lock(s.mutex);
+	size_t n = 0;
+	for (size_t i = 0; i < s.buffers.size(); i++)
+		if (s.buffers[i]->generation == s.generation)
+			n += s.buffers[i]->dropped;
+	return n;
+}
+
+void Trace::write(const std::string &filename) {
+	stop();
+	TraceState &s = state();
+	std::lock_guard<std::mutex> lock(s.mutex);
+	std::ofstream out(filename.c_str());
+	if (!out)
+		throw std::runtime_error("Trace: could not open " + filename);
+	out << "{\"traceEvents\": [\n";
+	bool first = true;
+	char line[64];
+	for (size_t i = 0; i < s.buffers.size(); i++) {
+		const ThreadBuffer &b = *s.buffers[i];
+		if (b.generation != s.generation)
+			continue;
+		out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+				<< b.tid << ", \"args\": {\"name\": \"thread " << b.tid << "\"}}";
+		first = false;
+		for (size_t j = 0; j < b.events.size(); j++) {
+			const TraceEvent &e = b.events[j];
+			std::string name = e.mangled ? demangle(e.name) : std::string(e.name);
+			snprintf(line, sizeof(line), "\"ts\": %.3f, \"dur\": %.3f",
+					(e.begin - s.origin) * 1e-3, (e.end - e.begin) * 1e-3);
+			out << ",\n{\"name\": \"" << escape(name) << "\", \"cat\": \"" << e.category
+					<< "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << b.tid << ", " << line << "}";
+		}
+		if (b.dropped > 0)
+			fprintf(stderr, "crpropa::Trace: thread %d dropped %zu spans\n", b.tid, b.dropped);
+	}
+	out << "\n]}\n";
+	if (!out)
+		throw std::runtime_error("Trace: could not write " + filename);
+}
+
+} // namespace crpropa
@@ -0,0 +1,440 @@
+#include "crpropa/TransferMatrix.h"
+#include "crpropa/Cosmology.h"
+#include "crpropa/ParticleID.h"
+#include "crpropa/Random.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace crpropa {
+
+/** Detection action that counts the detected nuclei in their cell */
+class TransferMatrixRecorder: public Module {
+public:
+	TransferMatrix *matrix; // reset when the matrix is deleted
+
+	TransferMatrixRecorder(TransferMatrix *matrix) : matrix(matrix) {
+		setDescription("TransferMatrix recorder");
+	}
+
+	void process(Candidate *candidate) const {
+		if (matrix)
+			matrix->record(candidate);
+	}
+};
+
+static const char transferMatrixMagic[8] = {'C', 'R', 'P', 'T', 'M', 'A', 'T', '1'};
+static const uint32_t transferMatrixVersion = 1;
+
+template<typename T>
+static void writeBinary(std::ostream &out, const T &value) {
+	out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+static T readBinary(std::istream &in, const std::string &filename) {
+	T value;
+	if (!in.read(reinterpret_cast<char*>(&value), sizeof(T)))
+		throw std::runtime_error("TransferMatrix: truncated file " + filename);
+	return value;
+}
+
+// integral of f over [a, b] by Simpson's rule with n (even) intervals
+template<typename F>
+static double simpson(F f, double a, double b, int n) {
+	double h = (b - a) / n;
+	double sum = f(a) + f(b);
+	for (int i = 1; i < n; i++)
+		sum += f(a + i * h) * ((i % 2) ? 4 : 2);
+	return sum * h / 3;
+}
+
+TransferMatrix::TransferMatrix(ref_ptr<ModuleList> simulation, const std::vector<int> &isotopes,
+		size_t nEnergy, double minEnergy, double maxEnergy,
+		const std::vector<double> &distanceEdges) :
+		simulation(simulation), isotopes(isotopes), nEnergy(nEnergy), minEnergy(minEnergy),
+		maxEnergy(maxEnergy), distanceEdges(distanceEdges), seed(0), checkpointInterval(60) {
+	recorder = new TransferMatrixRecorder(this);
+	initAxes();
+}
+
+TransferMatrix::TransferMatrix(const std::string &filename) : nEnergy(0), minEnergy(0),
+		maxEnergy(0), seed(0), checkpointInterval(60) {
+	recorder = new TransferMatrixRecorder(this);
+	readFile(filename, true);
+}
+
+TransferMatrix::~TransferMatrix() {
+	static_cast<TransferMatrixRecorder*>(recorder.get())->matrix = 0;
+}
+
+void TransferMatrix::initAxes() {
+	if (isotopes.empty())
+		throw std::runtime_error("TransferMatrix: no isotopes");
+	if ((nEnergy == 0) or (minEnergy <= 0) or (maxEnergy <= minEnergy))
+		throw std::runtime_error("TransferMatrix: invalid energy bins");
+	if ((distanceEdges.size() < 2) or (distanceEdges[0] < 0))
+		throw std::runtime_error("TransferMatrix: invalid distance bins");
+	for (size_t k = 1; k < distanceEdges.size(); k++)
+		if (distanceEdges[k] <= distanceEdges[k - 1])
+			throw std::runtime_error("TransferMatrix: distance edges must increase");
+
+	isotopeIndex.clear();
+	maxMassNumber = 0;
+	for (size_t i = 0; i < isotopes.size(); i++) {
+		if (not isNucleus(isotopes[i]))
+			throw std::runtime_error("TransferMatrix: isotopes must be nuclei");
+		if (not isotopeIndex.insert(std::make_pair(isotopes[i], i)).second)
+			throw std::runtime_error("TransferMatrix: duplicate isotope");
+		maxMassNumber = std::max(maxMassNumber, massNumber(isotopes[i]));
+	}
+
+	size_t n = getNumberOfCells();
+	rows.assign(n, std::vector<Entry>());
+	done.assign(n, false);
+	primaries.assign(n, 0);
+	pending.assign(n, std::map<uint32_t, double>());
+}
+
+ref_ptr<Module> TransferMatrix::getRecorder() const {
+	return recorder;
+}
+
+void TransferMatrix::setSeed(uint64_t seed) {
+	this->seed = seed;
+}
+
+void TransferMatrix::setCheckpointInterval(double seconds) {
+	checkpointInterval = seconds;
+}
+
+size_t TransferMatrix::energyBin(double energy) const {
+	double x = log(energy / minEnergy) / log(maxEnergy / minEnergy) * nEnergy;
+	if ((x < 0) or (x >= nEnergy))
+		return nEnergy;
+	return x;
+}
+
+void TransferMatrix::record(const Candidate *candidate) {
+	int id = candidate->current.getId();
+	if (not isNucleus(id))
+		return;
+	int A = massNumber(id);
+	size_t observed = energyBin(candidate->current.getEnergy());
+	if ((A > maxMassNumber) or (observed == nEnergy))
+		return;
+
+	// cell of the primary
+	std::map<int, size_t>::const_iterator isotope = isotopeIndex.find(candidate->source.getId());
+	size_t injected = energyBin(candidate->source.getEnergy());
+	double distance = candidate->source.getPosition().x;
+	size_t k = std::upper_bound(distanceEdges.begin(), distanceEdges.end(), distance) - distanceEdges.begin();
+	if ((isotope == isotopeIndex.end()) or (injected == nEnergy) or (k == 0) or (k == distanceEdges.size()))
+		return;
+
+	size_t cell = getCell(isotope->second, injected, k - 1);
+	uint32_t column = (A - 1) * nEnergy + observed;
+#pragma omp critical(TransferMatrixRecord)
+	pending[cell][column] += candidate->getWeight();
+}
+
+ref_ptr<Candidate> TransferMatrix::primary(size_t cell, size_t index) const {
+	size_t nDistance = distanceEdges.size() - 1;
+	size_t k = cell % nDistance;
+	size_t j = (cell / nDistance) % nEnergy;
+	size_t i = cell / (nDistance * nEnergy);
+
+	// energy and distance from the stream of the primary, inside the bins
+	Random &random = Random::instance();
+	uint64_t key = Random::deriveStreamKey(Random::deriveStreamKey(seed, cell), index);
+	random.setStream(key);
+	double E = minEnergy * pow(maxEnergy / minEnergy, (j + random.randDblExc()) / nEnergy);
+	double D = distanceEdges[k] + random.randDblExc() * (distanceEdges[k + 1] - distanceEdges[k]);
+	ref_ptr<Candidate> candidate = new Candidate(isotopes[i], E, Vector3d(D, 0, 0),
+			Vector3d(-1, 0, 0), comovingDistance2Redshift(D));
+	candidate->setRandomStream(key, random.getStreamCounter());
+	random.clearStream();
+	return candidate;
+}
+
+void TransferMatrix::build(size_t primariesPerCell, const std::string &checkpoint) {
+	if (not simulation.valid())
+		throw std::runtime_error("TransferMatrix: no simulation to build with");
+	if (primariesPerCell == 0)
+		throw std::runtime_error("TransferMatrix: no primaries per cell");
+	if ((not checkpoint.empty()) and std::ifstream(checkpoint.c_str()).good())
+		load(checkpoint);
+
+	std::vector<size_t> todo;
+	for (size_t cell = 0; cell < done.size(); cell++)
+		if (not done[cell])
+			todo.push_back(cell);
+	simulation->prepare();
+
+	typedef std::chrono::steady_clock clock;
+	clock::time_point lastWrite = clock::now();
+	std::string error;
+	int failed = 0;
+#pragma omp parallel for schedule(dynamic, 1)
+	for (long t = 0; t < long(todo.size()); t++) {
+		int stop;
+#pragma omp atomic read
+		stop = failed;
+		if (stop)
+			continue;
+
+		size_t cell = todo[t];
+		try {
+			for (size_t n = 0; n < primariesPerCell; n++) {
+				ref_ptr<Candidate> candidate = primary(cell, n);
+				simulation->run(candidate, true);
+			}
+		} catch (std::exception &e) {
+#pragma omp critical(TransferMatrixRecord)
+			error = e.what();
+#pragma omp atomic write
+			failed = 1;
+			continue;
+		}
+
+		// mean weights per primary, sorted by column
+#pragma omp critical(TransferMatrixRecord)
+		{
+			std::vector<Entry> &row = rows[cell];
+			row.clear();
+			std::map<uint32_t, double>::const_iterator it;
+			for (it = pending[cell].begin(); it != pending[cell].end(); it++) {
+				Entry entry = {it->first, float(it->second / primariesPerCell)};
+				row.push_back(entry);
+			}
+			pending[cell].clear();
+			primaries[cell] = primariesPerCell;
+			done[cell] = true;
+
+			clock::time_point now = clock::now();
+			if ((not checkpoint.empty())
+					and (std::chrono::duration<double>(now - lastWrite).count() >= checkpointInterval)) {
+				writeFile(checkpoint);
+				lastWrite = now;
+			}
+		}
+	}
+
+	if (not checkpoint.empty())
+		writeFile(checkpoint);
+	if (failed)
+		throw std::runtime_error("TransferMatrix: " + error);
+}
+
+void TransferMatrix::save(const std::string &filename) const {
+	writeFile(filename);
+}
+
+void TransferMatrix::load(const std::string &filename) {
+	readFile(filename, false);
+}
+
+void TransferMatrix::writeFile(const std::string &filename) const {
+	// written aside and renamed, so that an interrupted write keeps the old file
+	std::string tmp = filename + ".tmp";
+	{
+		std::ofstream out(tmp.c_str(), std::ios::binary);
+		if (!out)
+			throw std::runtime_error("TransferMatrix: could not open " + tmp);
+		out.write(transferMatrixMagic, sizeof(transferMatrixMagic));
+		writeBinary<uint32_t>(out, transferMatrixVersion);
+		writeBinary<uint32_t>(out, isotopes.size());
+		for (size_t i = 0; i < isotopes.size(); i++)
+			writeBinary<int32_t>(out, isotopes[i]);
+		writeBinary<uint32_t>(out, nEnergy);
+		writeBinary(out, minEnergy);
+		writeBinary(out, maxEnergy);
+		writeBinary<uint32_t>(out, distanceEdges.size());
+		for (size_t k = 0; k < distanceEdges.size(); k++)
+			writeBinary(out, distanceEdges[k]);
+
+		writeBinary<uint64_t>(out, getNumberOfDoneCells());
+		for (size_t cell = 0; cell < done.size(); cell++) {
+			if (not done[cell])
+				continue;
+			const std::vector<Entry> &row = rows[cell];
+			writeBinary<uint64_t>(out, cell);
+			writeBinary<uint64_t>(out, primaries[cell]);
+			writeBinary<uint32_t>(out, row.size());
+			for (size_t e = 0; e < row.size(); e++) {
+				writeBinary(out, row[e].column);
+				writeBinary(out, row[e].value);
+			}
+		}
+		if (!out)
+			throw std::runtime_error("TransferMatrix: could not write " + tmp);
+	}
+	if (std::rename(tmp.c_str(), filename.c_str()) != 0)
+		throw std::runtime_error("TransferMatrix: could not write " + filename);
+}
+
+void TransferMatrix::readFile(const std::string &filename, bool axes) {
+	std::ifstream in(filename.c_str(), std::ios::binary);
+	char magic[8];
+	if (!in.read(magic, sizeof(magic)) or (memcmp(magic, transferMatrixMagic, sizeof(magic)) != 0))
+		throw std::runtime_error("TransferMatrix: " + filename + " is not a transfer matrix");
+	if (readBinary<uint32_t>(in, filename) != transferMatrixVersion)
+		throw std::runtime_error("TransferMatrix: unknown version of " + filename);
+
+	std::vector<int> isotopes_(readBinary<uint32_t>(in, filename));
+	for (size_t i = 0; i < isotopes_.size(); i++)
+		isotopes_[i] = readBinary<int32_t>(in, filename);
+	size_t nEnergy_ = readBinary<uint32_t>(in, filename);
+	double minEnergy_ = readBinary<double>(in, filename);
+	double maxEnergy_ = readBinary<double>(in, filename);
+	std::vector<double> distanceEdges_(readBinary<uint32_t>(in, filename));
+	for (size_t k = 0; k < distanceEdges_.size(); k++)
+		distanceEdges_[k] = readBinary<double>(in, filename);
+
+	if (axes) {
+		isotopes = isotopes_;
+		nEnergy = nEnergy_;
+		minEnergy = minEnergy_;
+		maxEnergy = maxEnergy_;
+		distanceEdges = distanceEdges_;
+		initAxes();
+	} else if ((isotopes_ != isotopes) or (nEnergy_ != nEnergy) or (minEnergy_ != minEnergy)
+			or (maxEnergy_ != maxEnergy) or (distanceEdges_ != distanceEdges)) {
+		throw std::runtime_error("TransferMatrix: bins of " + filename + " do not match");
+	}
+
+	uint64_t n = readBinary<uint64_t>(in, filename);
+	size_t columns = maxMassNumber * nEnergy;
+	for (uint64_t r = 0; r < n; r++) {
+		uint64_t cell = readBinary<uint64_t>(in, filename);
+		if (cell >= done.size())
+			throw std::runtime_error("TransferMatrix: invalid cell in " + filename);
+		primaries[cell] = readBinary<uint64_t>(in, filename);
+		std::vector<Entry> &row = rows[cell];
+		row.resize(readBinary<uint32_t>(in, filename));
+		for (size_t e = 0; e < row.size(); e++) {
+			row[e].column = readBinary<uint32_t>(in, filename);
+			row[e].value = readBinary<float>(in, filename);
+			if (row[e].column >= columns)
+				throw std::runtime_error("TransferMatrix: invalid column in " + filename);
+		}
+		done[cell] = true;
+	}
+}
+
+const std::vector<int> &TransferMatrix::getIsotopes() const {
+	return isotopes;
+}
+
+size_t TransferMatrix::getNumberOfEnergyBins() const {
+	return nEnergy;
+}
+
+double TransferMatrix::getMinimumEnergy() const {
+	return minEnergy;
+}
+
+double TransferMatrix::getMaximumEnergy() const {
+	return maxEnergy;
+}
+
+const std::vector<double> &TransferMatrix::getDistanceEdges() const {
+	return distanceEdges;
+}
+
+int TransferMatrix::getMaximumMassNumber() const {
+	return maxMassNumber;
+}
+
+size_t TransferMatrix::getCell(size_t isotope, size_t energyBin, size_t distanceBin) const {
+	return (isotope * nEnergy + energyBin) * (distanceEdges.size() - 1) + distanceBin;
+}
+
+size_t TransferMatrix::getNumberOfCells() const {
+	return isotopes.size() * nEnergy * (distanceEdges.size() - 1);
+}
+
+size_t TransferMatrix::getNumberOfDoneCells() const {
+	return std::count(done.begin(), done.end(), true);
+}
+
+bool TransferMatrix::isDone(size_t cell) const {
+	return done.at(cell);
+}
+
+const std::vector<TransferMatrix::Entry> &TransferMatrix::getRow(size_t cell) const {
+	return rows.at(cell);
+}
+
+double TransferMatrix::getValue(size_t cell, int massNumber, size_t energyBin) const {
+	const std::vector<Entry> &row = rows.at(cell);
+	uint32_t column = (massNumber - 1) * nEnergy + energyBin;
+	for (size_t lo = 0, hi = row.size(); lo < hi;) {
+		size_t mid = (lo + hi) / 2;
+		if (row[mid].column == column)
+			return row[mid].value;
+		if (row[mid].column < column)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return 0;
+}
+
+std::vector<double> TransferMatrix::getInjection(const std::vector<double> &fractions,
+		double alpha, double maxRigidity, double evolution) const {
+	if (fractions.size() != isotopes.size())
+		throw std::runtime_error("TransferMatrix: one fraction per isotope required");
+
+	// energy spectrum integrated over the bins, in ln(E)
+	double dlnE = log(maxEnergy / minEnergy) / nEnergy;
+	std::vector<double> spectrum(isotopes.size() * nEnergy);
+	for (size_t i = 0; i < isotopes.size(); i++) {
+		double cutoff = chargeNumber(isotopes[i]) * maxRigidity;
+		for (size_t j = 0; j < nEnergy; j++) {
+			double a = log(minEnergy) + j * dlnE;
+			spectrum[i * nEnergy + j] = simpson([alpha, cutoff](double lnE) {
+				double E = exp(lnE);
+				double cut = (E > cutoff) ? exp(1 - E / cutoff) : 1;
+				return pow(E, 1 - alpha) * cut;
+			}, a, a + dlnE, 16);
+		}
+	}
+
+	// source density integrated over the distance bins
+	size_t nDistance = distanceEdges.size() - 1;
+	std::vector<double> density(nDistance);
+	for (size_t k = 0; k < nDistance; k++)
+		density[k] = simpson([evolution](double D) {
+			return pow(1 + comovingDistance2Redshift(D), evolution);
+		}, distanceEdges[k], distanceEdges[k + 1], 16);
+
+	std::vector<double> injected(getNumberOfCells());
+	for (size_t i = 0; i < isotopes.size(); i++)
+		for (size_t j = 0; j < nEnergy; j++)
+			for (size_t k = 0; k < nDistance; k++)
+				injected[getCell(i, j, k)] = fractions[i] * spectrum[i * nEnergy + j] * density[k];
+	return injected;
+}
+
+std::vector<double> TransferMatrix::fold(const std::vector<double> &injected) const {
+	if (injected.size() != getNumberOfCells())
+		throw std::runtime_error("TransferMatrix: one injected number per cell required");
+	std::vector<double> observed(maxMassNumber * nEnergy, 0.);
+	for (size_t cell = 0; cell < rows.size(); cell++) {
+		if ((injected[cell] == 0) or not done[cell])
+			continue;
+		const std::vector<Entry> &row = rows[cell];
+		for (size_t e = 0; e < row.size(); e++)
+			observed[row[e].column] += injected[cell] * row[e].value;
+	}
+	return observed;
+}
+
+} // namespace crpropa
@@ -0,0 +1,525 @@
+#include "crpropa/TransportSolver1D.h"
+#include "crpropa/module/Redshift.h"
+#include "crpropa/module/SimplePropagation.h"
+#include "crpropa/Cosmology.h"
+#include "crpropa/Common.h"
+#include "crpropa/ParticleID.h"
+#include "crpropa/ParticleMass.h"
+#include "crpropa/Units.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <set>
+#include <stdexcept>
+
+namespace crpropa {
+
+namespace {
+
+// channel of a species before the species are ordered
+struct ChannelSpec {
+	int kind; // 0 photodisintegration, 1 decay, 2 pion production
+	size_t module; // index of the module of its kind
+	std::vector<int> products;
+	int ejected; // nucleon ejected by pion production, 0 if none
+	double parameter; // rest frame rate of a decay, 1 for pion production on protons
+};
+
+void addNucleus(std::vector<int> &products, int A, int Z) {
+	if (A > 0)
+		products.push_back(nucleusId(A, Z));
+}
+
+} // namespace
+
+// kinds of channels
+static const int disintegrationKind = 0, decayKind = 1, pionKind = 2;
+
+TransportSolver1D::TransportSolver1D(size_t nBins, double minLorentzFactor, double maxLorentzFactor) :
+		redshift(false), nBins(nBins), minLorentzFactor(minLorentzFactor),
+		maxLorentzFactor(maxLorentzFactor), step(1 * Mpc), redshiftTolerance(1e-3),
+		emEnergy(0), neutrinoEnergy(0) {
+	if (nBins < 2)
+		throw std::runtime_error("TransportSolver1D: at least two bins are needed");
+	if ((minLorentzFactor <= 0) or (maxLorentzFactor <= minLorentzFactor))
+		throw std::runtime_error("TransportSolver1D: 0 < minLorentzFactor < maxLorentzFactor required");
+}
+
+void TransportSolver1D::add(Module *module) {
+	if (PhotoDisintegration *m = dynamic_cast<PhotoDisintegration*>(module))
+		disintegration.push_back(m);
+	else if (PhotoPionProduction *m = dynamic_cast<PhotoPionProduction*>(module))
+		pionProduction.push_back(m);
+	else if (ElectronPairProduction *m = dynamic_cast<ElectronPairProduction*>(module))
+		pairProduction.push_back(m);
+	else if (NuclearDecay *m = dynamic_cast<NuclearDecay*>(module))
+		decay = m;
+	else if (dynamic_cast<Redshift*>(module))
+		redshift = true;
+	else if (SimplePropagation *m = dynamic_cast<SimplePropagation*>(module))
+		setStep(m->getMaximumStep());
+	else
+		throw std::runtime_error("TransportSolver1D: module not supported: " + module->getDescription());
+	species.clear();
+}
+
+void TransportSolver1D::setStep(double step) {
+	if (step <= 0)
+		throw std::runtime_error("TransportSolver1D: the step must be positive");
+	this->step = step;
+}
+
+double TransportSolver1D::getStep() const {
+	return step;
+}
+
+void TransportSolver1D::setRedshiftTolerance(double dz) {
+	redshiftTolerance = dz;
+}
+
+double TransportSolver1D::getRedshiftTolerance() const {
+	return redshiftTolerance;
+}
+
+void TransportSolver1D::inject(int id, double energy, double distance, double weight) {
+	if (not isNucleus(id))
+		throw std::runtime_error("TransportSolver1D: only nuclei can be injected");
+	double gamma = energy / (nuclearMass(id) * c_squared);
+	double p = log(gamma / minLorentzFactor) / log(maxLorentzFactor / minLorentzFactor) * nBins;
+	if ((p < 0) or (p >= nBins))
+		throw std::runtime_error("TransportSolver1D: energy outside of the grid");
+	Injection injection = {id, size_t(p), distance, weight};
+	injections.push_back(injection);
+	species.clear();
+}
+
+void TransportSolver1D::injectPowerLaw(int id, double index, double minEnergy, double maxEnergy,
+		double minDistance, double maxDistance, double evolution, double maxRigidity, double weight) {
+	if (not isNucleus(id))
+		throw std::runtime_error("TransportSolver1D: only nuclei can be injected");
+	if ((minEnergy <= 0) or (maxEnergy <= minEnergy))
+		throw std::runtime_error("TransportSolver1D: 0 < minEnergy < maxEnergy required");
+	if ((minDistance < 0) or (maxDistance <= minDistance))
+		throw std::runtime_error("TransportSolver1D: 0 <= minDistance < maxDistance required");
+
+	// dN / dlnE, integrated numerically in lnE
+	double cutoff = chargeNumber(id) * maxRigidity;
+	struct Spectrum {
+		double index, cutoff;
+		double operator()(double E) const {
+			double f = pow(E, index + 1);
+			if ((cutoff > 0) and (E > cutoff))
+				f *= exp(1 - E / cutoff);
+			return f;
+		}
+		double integral(double E0, double E1, size_t n) const {
+			double sum = 0, dlnE = log(E1 / E0) / n;
+			for (size_t i = 0; i < n; i++)
+				sum += (*this)(E0 * exp((i + 0.5) * dlnE)) * dlnE;
+			return sum;
+		}
+	} spectrum = {index, cutoff};
+	double norm = spectrum.integral(minEnergy, maxEnergy, 10000);
+
+	std::vector<double> energyWeights(nBins, 0.);
+	double mc2 = nuclearMass(id) * c_squared;
+	for (size_t k = 0; k < nBins; k++) {
+		double E0 = std::max(minEnergy, mc2 * minLorentzFactor * pow(maxLorentzFactor / minLorentzFactor, double(k) / nBins));
+		double E1 = std::min(maxEnergy, mc2 * minLorentzFactor * pow(maxLorentzFactor / minLorentzFactor, double(k + 1) / nBins));
+		if (E1 > E0)
+			energyWeights[k] = spectrum.integral(E0, E1, 8) / norm;
+	}
+
+	// source density per comoving distance at the middle of the intervals
+	size_t n = ceil((maxDistance - minDistance) / step);
+	std::vector<double> distances(n), distanceWeights(n);
+	double sum = 0;
+	for (size_t j = 0; j < n; j++) {
+		double d0 = minDistance + j * step;
+		double d1 = std::min(maxDistance, d0 + step);
+		distances[j] = (d0 + d1) / 2;
+		distanceWeights[j] = pow(1 + comovingDistance2Redshift(distances[j]), evolution) * (d1 - d0);
+		sum += distanceWeights[j];
+	}
+
+	for (size_t j = 0; j < n; j++) {
+		for (size_t k = 0; k < nBins; k++) {
+			if (energyWeights[k] == 0)
+				continue;
+			Injection injection = {id, k, distances[j], weight * energyWeights[k] * distanceWeights[j] / sum};
+			injections.push_back(injection);
+		}
+	}
+	species.clear();
+}
+
+void TransportSolver1D::clear() {
+	injections.clear();
+	species.clear();
+	numbers.clear();
+	emEnergy = 0;
+	neutrinoEnergy = 0;
+}
+
+void TransportSolver1D::buildSpecies() {
+	// closure of the injected nuclei under all channels
+	std::map<int, std::vector<ChannelSpec> > specs;
+	std::vector<int> queue;
+	for (size_t i = 0; i < injections.size(); i++)
+		queue.push_back(injections[i].id);
+	std::vector<int> codes;
+	std::vector<double> rates;
+	while (not queue.empty()) {
+		int id = queue.back();
+		queue.pop_back();
+		if (specs.count(id))
+			continue;
+		std::vector<ChannelSpec> &list = specs[id];
+		int A = massNumber(id);
+		int Z = chargeNumber(id);
+
+		for (size_t m = 0; m < disintegration.size(); m++) {
+			disintegration[m]->getChannelRates(id, minLorentzFactor, 0, codes, rates);
+			for (size_t c = 0; c < codes.size(); c++) {
+				int nN = digit(codes[c], 100000), nP = digit(codes[c], 10000);
+				int nH2 = digit(codes[c], 1000), nH3 = digit(codes[c], 100);
+				int nHe3 = digit(codes[c], 10), nHe4 = digit(codes[c], 1);
+				ChannelSpec spec = {disintegrationKind, m, std::vector<int>(), 0, 0};
+				spec.products.insert(spec.products.end(), nN, nucleusId(1, 0));
+				spec.products.insert(spec.products.end(), nP, nucleusId(1, 1));
+				spec.products.insert(spec.products.end(), nH2, nucleusId(2, 1));
+				spec.products.insert(spec.products.end(), nH3, nucleusId(3, 1));
+				spec.products.insert(spec.products.end(), nHe3, nucleusId(3, 2));
+				spec.products.insert(spec.products.end(), nHe4, nucleusId(4, 2));
+				addNucleus(spec.products, A - nN - nP - 2 * nH2 - 3 * nH3 - 3 * nHe3 - 4 * nHe4,
+						Z - nP - nH2 - nH3 - 2 * nHe3 - 2 * nHe4);
+				list.push_back(spec);
+			}
+		}
+
+		if (decay.valid()) {
+			decay->getDecayChannels(id, codes, rates);
+			for (size_t c = 0; c < codes.size(); c++) {
+				int nBetaMinus = digit(codes[c], 10000), nBetaPlus = digit(codes[c], 1000);
+				int nAlpha = digit(codes[c], 100), nP = digit(codes[c], 10), nN = digit(codes[c], 1);
+				ChannelSpec spec = {decayKind, 0, std::vector<int>(), 0, rates[c]};
+				spec.products.insert(spec.products.end(), nAlpha, nucleusId(4, 2));
+				spec.products.insert(spec.products.end(), nP, nucleusId(1, 1));
+				spec.products.insert(spec.products.end(), nN, nucleusId(1, 0));
+				addNucleus(spec.products, A - 4 * nAlpha - nP - nN,
+						Z + nBetaMinus - nBetaPlus - 2 * nAlpha - nP);
+				list.push_back(spec);
+			}
+		}
+
+		// nucleons only lose energy continuously
+		if (A > 1) {
+			for (size_t m = 0; m < pionProduction.size(); m++) {
+				for (int onProton = 1; onProton >= 0; onProton--) {
+					if ((onProton ? Z : A - Z) == 0)
+						continue;
+					ChannelSpec spec = {pionKind, m, std::vector<int>(), nucleusId(1, onProton), double(onProton)};
+					addNucleus(spec.products, A - 1, Z - onProton);
+					list.push_back(spec);
+					queue.push_back(spec.ejected);
+				}
+			}
+		}
+
+		for (size_t c = 0; c < list.size(); c++)
+			queue.insert(queue.end(), list[c].products.begin(), list[c].products.end());
+	}
+
+	// order parents before products, heavy nuclei first
+	std::map<int, int> parents;
+	std::map<int, std::vector<ChannelSpec> >::const_iterator it;
+	for (it = specs.begin(); it != specs.end(); it++) {
+		parents[it->first];
+		for (size_t c = 0; c < it->second.size(); c++)
+			for (size_t p = 0; p < it->second[c].products.size(); p++)
+				parents[it->second[c].products[p]]++;
+	}
+	std::set<std::pair<int, int> > ready;
+	for (std::map<int, int>::const_iterator p = parents.begin(); p != parents.end(); p++)
+		if (p->second == 0)
+			ready.insert(std::make_pair(-massNumber(p->first), p->first));
+	species.clear();
+	speciesIndex.clear();
+	while (not ready.empty()) {
+		int id = ready.begin()->second;
+		ready.erase(ready.begin());
+		speciesIndex[id] = species.size();
+		species.push_back(id);
+		const std::vector<ChannelSpec> &list = specs[id];
+		for (size_t c = 0; c < list.size(); c++)
+			for (size_t p = 0; p < list[c].products.size(); p++)
+				if (--parents[list[c].products[p]] == 0)
+					ready.insert(std::make_pair(-massNumber(list[c].products[p]), list[c].products[p]));
+	}
+	if (species.size() != parents.size())
+		throw std::runtime_error("TransportSolver1D: the channels of the nuclei form a cycle");
+
+	channels.clear();
+	channelBegin.assign(1, 0);
+	for (size_t s = 0; s < species.size(); s++) {
+		const std::vector<ChannelSpec> &list = specs[species[s]];
+		for (size_t c = 0; c < list.size(); c++) {
+			Channel channel;
+			channel.source = s;
+			for (size_t p = 0; p < list[c].products.size(); p++)
+				channel.products.push_back(speciesIndex[list[c].products[p]]);
+			channel.ejected = list[c].ejected ? speciesIndex[list[c].ejected] : -1;
+			channel.rate = channels.size() * nBins;
+			channel.kind = list[c].kind;
+			channel.module = list[c].module;
+			channel.parameter = list[c].parameter;
+			channels.push_back(channel);
+		}
+		channelBegin.push_back(channels.size());
+	}
+	channelRates.assign(channels.size() * nBins, 0.);
+	totalRates.assign(species.size() * nBins, 0.);
+	lossRates.assign(species.size() * nBins, 0.);
+	emLossRates.assign(species.size() * nBins, 0.);
+	neutrinoLossRates.assign(species.size() * nBins, 0.);
+}
+
+double TransportSolver1D::getLorentzFactor(size_t bin) const {
+	return minLorentzFactor * pow(maxLorentzFactor / minLorentzFactor, (bin + 0.5) / nBins);
+}
+
+void TransportSolver1D::computeRates(double z) {
+	double adiabatic = redshift ? hubbleRate(z) / c_light / (1 + z) : 0;
+
+#pragma omp parallel for schedule(dynamic)
+	for (size_t s = 0; s < species.size(); s++) {
+		int id = species[s];
+		int A = massNumber(id);
+		int Z = chargeNumber(id);
+		double mc2 = nuclearMass(id) * c_squared;
+		std::vector<int> codes;
+		std::vector<double> rates;
+
+		for (size_t k = 0; k < nBins; k++) {
+			double gamma = getLorentzFactor(k);
+			double EpA = gamma * mc2 / A;
+
+			// channels in the order of buildSpecies: per module of a kind
+			for (size_t m = 0; m < disintegration.size(); m++) {
+				disintegration[m]->getChannelRates(id, gamma, z, codes, rates);
+				size_t j = 0;
+				for (size_t c = channelBegin[s]; c < channelBegin[s + 1]; c++)
+					if ((channels[c].kind == disintegrationKind) and (channels[c].module == m))
+						channelRates[channels[c].rate + k] = rates[j++];
+			}
+			double total = 0;
+			for (size_t c = channelBegin[s]; c < channelBegin[s + 1]; c++) {
+				const Channel &channel = channels[c];
+				double &rate = channelRates[channel.rate + k];
+				if (channel.kind == decayKind) {
+					// time dilation, rate per comoving distance
+					rate = channel.parameter / gamma / (1 + z);
+				} else if (channel.kind == pionKind) {
+					const PhotoPionProduction &ppp = *pionProduction[channel.module];
+					bool onProton = channel.parameter > 0;
+					rate = 0;
+					if (EpA * (1 + z) >= ppp.getThresholdEnergy())
+						rate = ppp.nucleiModification(A, onProton ? Z : A - Z) / ppp.nucleonMFP(gamma, z, onProton);
+				}
+				total += rate;
+			}
+			totalRates[s * nBins + k] = total;
+
+			// relative continuous losses per comoving distance
+			double em = 0, neutrino = 0;
+			for (size_t m = 0; m < pairProduction.size(); m++) {
+				double length = pairProduction[m]->lossLength(id, gamma, z);
+				if (length < std::numeric_limits<double>::max())
+					em += 1 / length / (1 + z);
+			}
+			if (A == 1) {
+				for (size_t m = 0; m < pionProduction.size(); m++) {
+					const PhotoPionProduction &ppp = *pionProduction[m];
+					if (EpA * (1 + z) < ppp.getThresholdEnergy())
+						continue;
+					double rate = Z ? 1 / ppp.nucleonMFP(gamma, z, true) : 1 / ppp.nucleonMFP(gamma, z, false);
+					double loss = ppp.getMeanInelasticity() * rate;
+					em += 0.75 * loss; // pi0 photons and the positron
+					neutrino += 0.25 * loss;
+				}
+			}
+			lossRates[s * nBins + k] = adiabatic + em + neutrino;
+			emLossRates[s * nBins + k] = em;
+			neutrinoLossRates[s * nBins + k] = neutrino;
+		}
+	}
+}
+
+void TransportSolver1D::interact(double dx, double z) {
+	size_t nSpecies = species.size();
+	double inelasticity = pionProduction.empty() ? 0 : pionProduction[0]->getMeanInelasticity();
+	std::vector<double> ejected(nSpecies * nBins, 0.); // nucleons ejected from bin k
+	double em = 0, neutrino = 0;
+
+#pragma omp parallel reduction(+: em, neutrino)
+	{
+		std::vector<double> gain(nSpecies, 0.);
+#pragma omp for schedule(static)
+		for (size_t k = 0; k < nBins; k++) {
+			double gamma = getLorentzFactor(k);
+			for (size_t s = 0; s < nSpecies; s++) {
+				size_t i = s * nBins + k;
+				double N = numbers[i] + gain[s];
+				gain[s] = 0;
+				double total = totalRates[i];
+				if ((N == 0) or (total == 0)) {
+					numbers[i] = N;
+					continue;
+				}
+				double removed = -N * expm1(-total * dx);
+				numbers[i] = N - removed;
+				for (size_t c = channelBegin[s]; c < channelBegin[s + 1]; c++) {
+					double share = removed * channelRates[channels[c].rate + k] / total;
+					if (share == 0)
+						continue;
+					const std::vector<size_t> &products = channels[c].products;
+					for (size_t p = 0; p < products.size(); p++)
+						gain[products[p]] += share;
+					if (channels[c].ejected >= 0) {
+						ejected[channels[c].ejected * nBins + k] += share;
+						double pions = share * inelasticity * gamma * mass_proton * c_squared / (1 + z);
+						em += 0.75 * pions;
+						neutrino += 0.25 * pions;
+					}
+				}
+			}
+		}
+	}
+	emEnergy += em;
+	neutrinoEnergy += neutrino;
+
+	// ejected nucleons keep 1 - inelasticity of the energy per nucleon
+	if (pionProduction.empty())
+		return;
+	double shift = log(1 - inelasticity) / log(maxLorentzFactor / minLorentzFactor) * nBins;
+#pragma omp parallel for schedule(static)
+	for (size_t s = 0; s < nSpecies; s++) {
+		for (size_t k = 0; k < nBins; k++) {
+			double n = ejected[s * nBins + k];
+			if (n == 0)
+				continue;
+			double q = k + shift;
+			double lower = floor(q);
+			double w = q - lower;
+			if ((lower >= 0) and (lower < nBins))
+				numbers[s * nBins + size_t(lower)] += (1 - w) * n;
+			if ((lower + 1 >= 0) and (lower + 1 < nBins))
+				numbers[s * nBins + size_t(lower) + 1] += w * n;
+		}
+	}
+}
+
+void TransportSolver1D::loseEnergy(double dx, double z) {
+	double h = log(maxLorentzFactor / minLorentzFactor) / nBins;
+	double em = 0, neutrino = 0;
+
+	// implicit upwind scheme in ln(Lorentz factor), from the highest bin down
+#pragma omp parallel for schedule(dynamic) reduction(+: em, neutrino)
+	for (size_t s = 0; s < species.size(); s++) {
+		double mc2 = nuclearMass(species[s]) * c_squared;
+		double inflow = 0;
+		for (size_t k = nBins; k-- > 0;) {
+			size_t i = s * nBins + k;
+			double b = lossRates[i];
+			double N = (numbers[i] + inflow) / (1 + dx * b / h);
+			numbers[i] = N;
+			inflow = dx * b / h * N;
+			double E = getLorentzFactor(k) * mc2 / (1 + z);
+			em += dx * emLossRates[i] * E * N;
+			neutrino += dx * neutrinoLossRates[i] * E * N;
+		}
+	}
+	emEnergy += em;
+	neutrinoEnergy += neutrino;
+}
+
+void TransportSolver1D::solve() {
+	buildSpecies();
+	numbers.assign(species.size() * nBins, 0.);
+	emEnergy = 0;
+	neutrinoEnergy = 0;
+	if (injections.empty())
+		return;
+
+	// march from the farthest injection to the observer
+	std::vector<Injection> sorted(injections);
+	struct Farther {
+		bool operator()(const Injection &a, const Injection &b) const {
+			return a.distance > b.distance;
+		}
+	};
+	std::stable_sort(sorted.begin(), sorted.end(), Farther());
+	size_t next = 0;
+	double x = sorted[0].distance;
+	double ratesRedshift = std::numeric_limits<double>::quiet_NaN();
+	while (x > 0) {
+		double dx = std::min(step, x);
+		for (; (next < sorted.size()) and (sorted[next].distance > x - dx); next++)
+			numbers[speciesIndex[sorted[next].id] * nBins + sorted[next].bin] += sorted[next].weight;
+		double z = comovingDistance2Redshift(x - dx / 2);
+		if (not (std::fabs(z - ratesRedshift) <= redshiftTolerance)) {
+			computeRates(z);
+			ratesRedshift = z;
+		}
+		interact(dx, z);
+		loseEnergy(dx, z);
+		x -= dx;
+	}
+	for (; next < sorted.size(); next++)
+		numbers[speciesIndex[sorted[next].id] * nBins + sorted[next].bin] += sorted[next].weight;
+}
+
+const std::vector<int> &TransportSolver1D::getSpecies() const {
+	return species;
+}
+
+size_t TransportSolver1D::getNumberOfBins() const {
+	return nBins;
+}
+
+std::vector<double> TransportSolver1D::getSpectrum(int id) const {
+	std::map<int, size_t>::const_iterator it = speciesIndex.find(id);
+	if ((it == speciesIndex.end()) or numbers.empty())
+		return std::vector<double>(nBins, 0.);
+	return std::vector<double>(numbers.begin() + it->second * nBins,
+			numbers.begin() + (it->second + 1) * nBins);
+}
+
+std::vector<double> TransportSolver1D::getEnergySpectrum(const std::vector<double> &edges, int massNumber) const {
+	std::vector<double> spectrum(edges.size() > 0 ? edges.size() - 1 : 0, 0.);
+	if (numbers.empty())
+		return spectrum;
+	for (size_t s = 0; s < species.size(); s++) {
+		if ((massNumber > 0) and (crpropa::massNumber(species[s]) != massNumber))
+			continue;
+		double mc2 = nuclearMass(species[s]) * c_squared;
+		for (size_t k = 0; k < nBins; k++) {
+			double E = getLorentzFactor(k) * mc2;
+			size_t i = std::upper_bound(edges.begin(), edges.end(), E) - edges.begin();
+			if ((i > 0) and (i < edges.size()))
+				spectrum[i - 1] += numbers[s * nBins + k];
+		}
+	}
+	return spectrum;
+}
+
+double TransportSolver1D::getElectromagneticEnergy() const {
+	return emEnergy;
+}
+
+double TransportSolver1D::getNeutrinoEnergy() const {
+	return neutrinoEnergy;
+}
+
+} // namespace crpropa
@@ -6,10 +6,15 @@
 #include "crpropa/Variant.h"
 
 #include <algorithm>
+#include <utility>
 
 namespace crpropa
 {
 
+// the union is aligned for its 8 byte members
+static_assert(alignof(std::string) <= alignof(uint64_t),
+		"Variant: storage of std::string is not aligned");
+
 Variant::Variant() :
 		type(TYPE_NONE)
 {
@@ -26,23 +31,48 @@ Variant::Variant(const Variant& a) :
 	copy(a);
 }
 
+Variant::Variant(Variant &&a) noexcept :
+		type(TYPE_NONE)
+{
+	*this = std::move(a);
+}
+
 Variant::Variant(const char *s)
 {
-	data._String = new std::string(s);
+	new (data._String) std::string(s);
 	type = TYPE_STRING;
 }
 
+Variant &Variant::operator =(Variant &&a) noexcept
+{
+	if (this == &a)
+		return *this;
+	if (a.type != TYPE_STRING)
+	{
+		clear();
+		data = a.data;
+		type = a.type;
+	}
+	else if (type == TYPE_STRING)
+	{
+		valueString().swap(a.valueString());
+	}
+	else
+	{
+		clear();
+		new (data._String) std::string(std::move(a.valueString()));
+		type = TYPE_STRING;
+	}
+	return *this;
+}
+
 
 void Variant::clear()
 {
 	if (type == TYPE_STRING)
 	{
-		if(data._String)
-		{
-			delete data._String;
-			data._String = NULL;
-		}
-
+		typedef std::string string_type;
+		valueString().~string_type();
 	}
 
 	type = TYPE_NONE;
@@ -62,7 +92,7 @@ void Variant::check(const Type t)
 		switch (t)
 		{
 		case TYPE_STRING:
-			data._String = new std::string;
+			new (data._String) std::string;
 			break;
 		default:
 			break;
@@ -134,7 +164,7 @@ const std::type_info& Variant::getTypeInfo() const
 	}
 	else if (type == TYPE_STRING)
 	{
-		const std::type_info &ti = typeid(*data._String);
+		const std::type_info &ti = typeid(valueString());
 		return ti;
 	}
 	else
@@ -315,7 +345,7 @@ bool Variant::operator ==(const Variant &a) const
 	}
 	else if (type == TYPE_STRING)
 	{
-		return (*data._String == *a.data._String);
+		return (valueString() == a.valueString());
 	}
 	else
 	{
@@ -324,11 +354,17 @@ bool Variant::operator ==(const Variant &a) const
 }
 
 std::string Variant::toString() const
+{
+	return toString(std::locale());
+}
+
+std::string Variant::toString(const std::locale &locale) const
 {
 	if (type == TYPE_STRING)
-		return *data._String;
+		return valueString();
 
 	std::stringstream sstr;
+	sstr.imbue(locale);
 	if (type == TYPE_BOOL)
 	{
 		sstr << data._Bool;
@@ -501,7 +537,7 @@ bool Variant::operator !=(const Variant &a) const
 	case TYPE_DOUBLE:
 		return (data._Double == a.data._Double);
 	case TYPE_STRING:
-		return (*data._String == *a.data._String);
+		return (valueString() == a.valueString());
 	default:
 		throw std::runtime_error("compare operator not implemented");
 	}
@@ -557,11 +593,11 @@ void Variant::copy(const Variant &a)
 	}
 	else if (t == TYPE_STRING)
 	{
-		operator =(*a.data._String);
+		operator =(a.valueString());
 	}
 	else
 	{
-		type = TYPE_NONE;
+		clear();
 	}
 }
 
@@ -598,7 +634,7 @@ bool Variant::toBool() const
 		break;
 	case TYPE_STRING:
 	{
-		std::string upperstr(*data._String);
+		std::string upperstr(valueString());
 		std::transform(upperstr.begin(), upperstr.end(), upperstr.begin(),
 				(int(*)(int))toupper);if
 (		upperstr == "YES")
@@ -652,7 +688,7 @@ to Variant::fun() const { \
 	INT_CASE(Double, TYPE_DOUBLE, to_type, to) \
 	case Variant::TYPE_STRING: \
 		{ \
-		long l = atol(data._String->c_str()); \
+		long l = atol(valueString().c_str()); \
 		if (l < std::numeric_limits<to>::min() || l > std::numeric_limits<to>::max()) \
 			throw bad_conversion(type, to_type); \
 		else \
@@ -767,7 +803,7 @@ float Variant::toFloat() const
 	}
 	else if (type == TYPE_STRING)
 	{
-		return static_cast<float>(std::atof(data._String->c_str()));
+		return static_cast<float>(std::atof(valueString().c_str()));
 	}
 	else if (type == TYPE_BOOL)
 	{
@@ -823,7 +859,7 @@ double Variant::toDouble() const
 	}
 	else if (type == TYPE_STRING)
 	{
-		return std::atof(data._String->c_str());
+		return std::atof(valueString().c_str());
 	}
 	else if (type == TYPE_BOOL)
 	{
@@ -840,7 +876,7 @@ double Variant::toDouble() const
 	memcpy(buffer, &VAR, sizeof( VAR) );\
   return sizeof( VAR );
 
-size_t Variant::copyToBuffer(void* buffer)
+size_t Variant::copyToBuffer(void* buffer) const
 {
   if (type == TYPE_CHAR)
 	{
@@ -884,8 +920,8 @@ size_t Variant::copyToBuffer(void* buffer)
 	}
 	else if (type == TYPE_STRING)
 	{
-		size_t len = data._String->size();
-		memcpy(buffer, data._String->c_str(), len);
+		size_t len = valueString().size();
+		memcpy(buffer, valueString().c_str(), len);
 		return len;
 	}
 	else if (type == TYPE_BOOL)
@@ -943,8 +979,7 @@ size_t Variant::getSize() const
 	}
 	else if (type == TYPE_STRING)
 	{
-		size_t len = strlen(data._String->c_str()+1);
-		return len;
+		return valueString().size();
 	}
 	else if (type == TYPE_BOOL)
 	{
@@ -1,5 +1,7 @@
 #include "crpropa/advectionField/AdvectionField.h"
 
+#include <algorithm>
+
 
 namespace crpropa {
 
@@ -24,6 +26,40 @@ double AdvectionFieldList::getDivergence(const Vector3d &position) const {
 	return D;
 }
 
+void AdvectionFieldList::getFieldAndDivergence(const Vector3d &position,
+		Vector3d &field, double &divergence) const {
+	field = Vector3d(0.);
+	divergence = 0.;
+	for (int i = 0; i < fields.size(); i++) {
+		Vector3d f;
+		double d;
+		fields[i]->getFieldAndDivergence(position, f, d);
+		field += f;
+		divergence += d;
+	}
+}
+
+void AdvectionFieldList::getFieldsAndDivergences(const Vector3d *positions,
+		Vector3d *f, double *d, size_t count) const {
+	for (size_t j = 0; j < count; j++) {
+		f[j] = Vector3d(0.);
+		d[j] = 0.;
+	}
+	// each field evaluates a block of positions at once
+	Vector3d bufferF[32];
+	double bufferD[32];
+	for (size_t j = 0; j < count; j += 32) {
+		size_t n = std::min(count - j, size_t(32));
+		for (int i = 0; i < fields.size(); i++) {
+			fields[i]->getFieldsAndDivergences(positions + j, bufferF, bufferD, n);
+			for (size_t k = 0; k < n; k++) {
+				f[j + k] += bufferF[k];
+				d[j + k] += bufferD[k];
+			}
+		}
+	}
+}
+
 
 //----------------------------------------------------------------
 UniformAdvectionField::UniformAdvectionField(const Vector3d &value) :
@@ -61,6 +97,14 @@ double ConstantSphericalAdvectionField::getDivergence(const Vector3d &position)
 	return 2*vWind/R;
 }
 
+void ConstantSphericalAdvectionField::getFieldAndDivergence(
+		const Vector3d &position, Vector3d &field, double &divergence) const {
+	Vector3d Pos = position-origin;
+	double R = Pos.getR();
+	field = vWind * Pos.getUnitVector();
+	divergence = 2*vWind/R;
+}
+
 void ConstantSphericalAdvectionField::setOrigin(const Vector3d o) {
 	origin=o;
 	return;
@@ -117,6 +161,21 @@ double SphericalAdvectionField::getDivergence(const Vector3d &position) const {
 	return D;
 }
 
+void SphericalAdvectionField::getFieldAndDivergence(const Vector3d &position,
+		Vector3d &field, double &divergence) const {
+	Vector3d Pos = position-origin;
+	double R = Pos.getR();
+	if (R>radius) {
+		field = Vector3d(0.);
+		divergence = 0.;
+		return;
+	}
+	double Ra = pow(R, alpha);
+	double e = exp(-(Ra/tau));
+	field = vMax * (1-e) * Pos.getUnitVector();
+	divergence = 2*vMax/R * ( 1-( 1-alpha*(Ra/(2*tau)) )*e );
+}
+
 double SphericalAdvectionField::getV(const double &r) const {
 	double f = vMax * (1-exp(-(pow(r, alpha)/tau)));
 	return f;
@@ -212,6 +271,23 @@ double SphericalAdvectionShock::getDivergence(const Vector3d &pos) const {
 	return v_0 * (d1+d2);
 }
 
+void SphericalAdvectionShock::getFieldAndDivergence(const Vector3d &pos,
+		Vector3d &field, double &divergence) const {
+	Vector3d R = pos-origin;
+	double r = R.getR();
+
+	// g = 1/(1+e) and g' = e g^2 / lambda share e = exp(-a)
+	double e = exp(-(r-r_0)/lambda);
+	double g = 1. / (1+e);
+	double g_p = std::isinf(e) ? 0. : e*g*g / lambda;
+	double s = pow(r_0/(2*r), 2.) - 1;
+
+	double v_r = v_0 * (1 + s*g);
+	double v_p = v_phi * (r_rot/r);
+	field = v_r * R.getUnitVector() + v_p * R.getUnitVectorPhi();
+	divergence = v_0 * (2./r*(1-g) + s*g_p);
+}
+
 
 double SphericalAdvectionShock::g(double r) const {
 	double a = (r-r_0)/lambda;
@@ -0,0 +1,96 @@
+#include "crpropa/advectionField/AdvectionFieldGrid.h"
+#include "crpropa/GridTools.h"
+
+#include <sstream>
+#include <stdexcept>
+
+namespace crpropa {
+
+AdvectionFieldGrid::AdvectionFieldGrid(ref_ptr<Grid3f> grid) {
+	setGrid(grid);
+}
+
+AdvectionFieldGrid::AdvectionFieldGrid(ref_ptr<Grid3f> grid, ref_ptr<Grid1f> divergenceGrid) {
+	setGrids(grid, divergenceGrid);
+}
+
+void AdvectionFieldGrid::setGrid(ref_ptr<Grid3f> grid) {
+	if (not grid.valid())
+		throw std::runtime_error("AdvectionFieldGrid: no velocity grid");
+	GridProperties p(grid->getOrigin(), grid->getNx(), grid->getNy(), grid->getNz(),
+			grid->getSpacing());
+	p.setReflective(grid->isReflective());
+	ref_ptr<Grid1f> divergence = new Grid1f(p);
+	divergence->setLayout(grid->getLayout());
+	computeDivergence(grid, divergence);
+	this->grid = grid;
+	divergenceGrid = divergence;
+}
+
+void AdvectionFieldGrid::setGrids(ref_ptr<Grid3f> grid, ref_ptr<Grid1f> divergenceGrid) {
+	if (not grid.valid() or not divergenceGrid.valid())
+		throw std::runtime_error("AdvectionFieldGrid: no velocity or divergence grid");
+	if ((grid->getNx() != divergenceGrid->getNx()) or (grid->getNy() != divergenceGrid->getNy())
+			or (grid->getNz() != divergenceGrid->getNz())
+			or not (grid->getOrigin() == divergenceGrid->getOrigin())
+			or not (grid->getSpacing() == divergenceGrid->getSpacing()))
+		throw std::runtime_error("AdvectionFieldGrid: the velocity and divergence grids differ in geometry");
+	this->grid = grid;
+	this->divergenceGrid = divergenceGrid;
+}
+
+ref_ptr<Grid3f> AdvectionFieldGrid::getGrid() {
+	return grid;
+}
+
+ref_ptr<Grid1f> AdvectionFieldGrid::getDivergenceGrid() {
+	return divergenceGrid;
+}
+
+Vector3d AdvectionFieldGrid::getField(const Vector3d &position) const {
+	return grid->interpolate(position);
+}
+
+double AdvectionFieldGrid::getDivergence(const Vector3d &position) const {
+	return divergenceGrid->interpolate(position);
+}
+
+void AdvectionFieldGrid::getFieldAndDivergence(const Vector3d &position,
+		Vector3d &field, double &divergence) const {
+	const Grid3f &v = *grid;
+	const Grid1f &d = *divergenceGrid;
+	bool fused = (v.getLayout() == d.getLayout()) and (v.isReflective() == d.isReflective())
+			and not v.isTricubic() and not d.isTricubic();
+	if (not fused) {
+		field = v.interpolate(position);
+		divergence = d.interpolate(position);
+		return;
+	}
+
+	// one set of indices and weights for both grids
+	size_t index[8];
+	double weight[8];
+	v.getNeighbors(position, index, weight);
+	const Vector3f *vs = &grid->getGrid()[0];
+	const float *ds = &divergenceGrid->getGrid()[0];
+	double fx = 0, fy = 0, fz = 0, div = 0;
+	for (int k = 0; k < 8; k++) {
+		const Vector3f &f = vs[index[k]];
+		fx += f.x * weight[k];
+		fy += f.y * weight[k];
+		fz += f.z * weight[k];
+		div += ds[index[k]] * weight[k];
+	}
+	field = Vector3d(fx, fy, fz);
+	divergence = div;
+}
+
+std::string AdvectionFieldGrid::getDescription() const {
+	std::stringstream s;
+	s << "Advection field grid: " << grid->getNx() << " x " << grid->getNy() << " x "
+			<< grid->getNz() << " points, spacing " << grid->getSpacing() / kpc << " kpc, "
+			<< "origin " << grid->getOrigin() / kpc << " kpc";
+	return s.str();
+}
+
+} // namespace crpropa
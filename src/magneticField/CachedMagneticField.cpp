@@ -0,0 +1,244 @@
+#include "crpropa/magneticField/CachedMagneticField.h"
+
+#include "kiss/logger.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace crpropa {
+
+static const char cacheMagic[8] = {'C', 'R', 'P', 'F', 'C', 'A', 'C', '1'};
+
+CachedMagneticField::CachedMagneticField(ref_ptr<MagneticField> field, Vector3d origin,
+		size_t Nx, size_t Ny, size_t Nz, Vector3d blockSize, double tolerance,
+		int maxLevel, const std::string &cacheFile, const std::string &key) :
+		field(field), origin(origin), blockSize(blockSize), Nx(Nx), Ny(Ny), Nz(Nz),
+		tolerance(tolerance), maxLevel(maxLevel) {
+	if (not field.valid())
+		throw std::runtime_error("CachedMagneticField: no field given");
+	if (tolerance <= 0)
+		throw std::runtime_error("CachedMagneticField: tolerance must be positive");
+	if ((maxLevel < 0) or (maxLevel > 30))
+		throw std::runtime_error("CachedMagneticField: maximum level out of range");
+	grid = new AMRGrid3f(origin, Nx, Ny, Nz, blockSize);
+	extent = blockSize * Vector3d(Nx, Ny, Nz);
+
+	std::vector<Leaf> leaves;
+	std::vector<Vector3f> values;
+	if (cacheFile.empty() or not load(cacheFile, key, leaves, values)) {
+		sample(leaves, values);
+		if (not cacheFile.empty())
+			save(cacheFile, key, leaves, values);
+	}
+
+	const size_t n = AMRGrid3f::cells * AMRGrid3f::cells * AMRGrid3f::cells;
+	for (size_t i = 0; i < leaves.size(); i++)
+		grid->setBlock(leaves[i].level, leaves[i].ix, leaves[i].iy, leaves[i].iz, &values[i * n]);
+	grid->fillGhostCells();
+}
+
+double CachedMagneticField::sampleBlock(const Leaf &b, Vector3f *values) const {
+	const int C = AMRGrid3f::cells;
+	Vector3d size = blockSize / double(1 << b.level);
+	Vector3d cell = size / C;
+	Vector3d lower = origin + Vector3d(b.ix, b.iy, b.iz) * size;
+
+	// cell centres, z fastest as in AMRGrid::setBlock
+	for (int ix = 0; ix < C; ix++)
+		for (int iy = 0; iy < C; iy++)
+			for (int iz = 0; iz < C; iz++)
+				values[(ix * C + iy) * C + iz] = Vector3f(field->getField(
+						lower + (Vector3d(ix, iy, iz) + Vector3d(0.5)) * cell));
+
+	// the interior cell corners are farthest from the samples, their
+	// interpolation is the mean of the 8 surrounding cells
+	double error = 0;
+	for (int ix = 1; ix < C; ix++)
+		for (int iy = 1; iy < C; iy++)
+			for (int iz = 1; iz < C; iz++) {
+				Vector3d b(0.);
+				for (int c = 0; c < 8; c++)
+					b += Vector3d(values[((ix - ((c >> 2) & 1)) * C + iy - ((c >> 1) & 1)) * C
+							+ iz - (c & 1)]);
+				b /= 8;
+				Vector3d exact = field->getField(lower + Vector3d(ix, iy, iz) * cell);
+				error = std::max(error, (b - exact).getR());
+			}
+	return error;
+}
+
+void CachedMagneticField::sample(std::vector<Leaf> &leaves, std::vector<Vector3f> &values) const {
+	const size_t n = AMRGrid3f::cells * AMRGrid3f::cells * AMRGrid3f::cells;
+	std::vector<Leaf> blocks;
+	for (size_t ix = 0; ix < Nx; ix++)
+		for (size_t iy = 0; iy < Ny; iy++)
+			for (size_t iz = 0; iz < Nz; iz++) {
+				Leaf root = {0, ix, iy, iz};
+				blocks.push_back(root);
+			}
+
+	// one level after the other, the blocks of a level in parallel
+	while (not blocks.empty()) {
+		std::vector<Vector3f> v(blocks.size() * n);
+		std::vector<char> refine(blocks.size());
+#pragma omp parallel for schedule(dynamic)
+		for (long i = 0; i < long(blocks.size()); i++) {
+			double error = sampleBlock(blocks[i], &v[i * n]);
+			refine[i] = (error > tolerance) and (blocks[i].level < maxLevel);
+		}
+
+		std::vector<Leaf> next;
+		for (size_t i = 0; i < blocks.size(); i++) {
+			const Leaf &b = blocks[i];
+			if (not refine[i]) {
+				leaves.push_back(b);
+				values.insert(values.end(), v.begin() + i * n, v.begin() + (i + 1) * n);
+				continue;
+			}
+			for (int c = 0; c < 8; c++) {
+				Leaf child = {b.level + 1, 2 * b.ix + ((c >> 2) & 1),
+						2 * b.iy + ((c >> 1) & 1), 2 * b.iz + (c & 1)};
+				next.push_back(child);
+			}
+		}
+		blocks.swap(next);
+	}
+}
+
+// the cache file starts with the magic, the key and the parameters of the
+// sampling, followed by the leaves with their values
+template<typename T>
+static void writeValue(std::ofstream &out, const T &value) {
+	out.write((const char *) &value, sizeof(T));
+}
+
+template<typename T>
+static bool readValue(std::ifstream &in, T &value) {
+	return bool(in.read((char *) &value, sizeof(T)));
+}
+
+void CachedMagneticField::save(const std::string &filename, const std::string &key,
+		const std::vector<Leaf> &leaves, const std::vector<Vector3f> &values) const {
+	std::ofstream out(filename.c_str(), std::ios::binary);
+	if (not out)
+		throw std::runtime_error("CachedMagneticField: could not write " + filename);
+	out.write(cacheMagic, sizeof(cacheMagic));
+	writeValue(out, uint64_t(key.size()));
+	out.write(key.data(), key.size());
+	for (int d = 0; d < 3; d++)
+		writeValue(out, origin.data[d]);
+	for (int d = 0; d < 3; d++)
+		writeValue(out, blockSize.data[d]);
+	writeValue(out, uint64_t(Nx));
+	writeValue(out, uint64_t(Ny));
+	writeValue(out, uint64_t(Nz));
+	writeValue(out, tolerance);
+	writeValue(out, int32_t(maxLevel));
+	writeValue(out, uint64_t(leaves.size()));
+	const size_t n = AMRGrid3f::cells * AMRGrid3f::cells * AMRGrid3f::cells;
+	for (size_t i = 0; i < leaves.size(); i++) {
+		writeValue(out, leaves[i]);
+		out.write((const char *) &values[i * n], n * sizeof(Vector3f));
+	}
+	if (not out)
+		throw std::runtime_error("CachedMagneticField: could not write " + filename);
+}
+
+bool CachedMagneticField::load(const std::string &filename, const std::string &key,
+		std::vector<Leaf> &leaves, std::vector<Vector3f> &values) const {
+	std::ifstream in(filename.c_str(), std::ios::binary);
+	if (not in)
+		return false;
+
+	char magic[sizeof(cacheMagic)];
+	uint64_t keySize = 0;
+	if (not in.read(magic, sizeof(magic)) or (memcmp(magic, cacheMagic, sizeof(magic)) != 0)
+			or not readValue(in, keySize) or (keySize != key.size())) {
+		KISS_LOG_WARNING << "CachedMagneticField: " << filename
+				<< " is not a cache of this field, resampling" << std::endl;
+		return false;
+	}
+	std::string k(keySize, ' ');
+	in.read(&k[0], keySize);
+	Vector3d o, s;
+	uint64_t nx = 0, ny = 0, nz = 0, count = 0;
+	double tol = 0;
+	int32_t level = -1;
+	for (int d = 0; d < 3; d++)
+		readValue(in, o.data[d]);
+	for (int d = 0; d < 3; d++)
+		readValue(in, s.data[d]);
+	readValue(in, nx);
+	readValue(in, ny);
+	readValue(in, nz);
+	readValue(in, tol);
+	readValue(in, level);
+	bool same = in and (k == key) and (o == origin) and (s == blockSize) and (nx == Nx)
+			and (ny == Ny) and (nz == Nz) and (tol == tolerance) and (level == maxLevel);
+	if (not same or not readValue(in, count)) {
+		KISS_LOG_WARNING << "CachedMagneticField: " << filename
+				<< " is not a cache of this field, resampling" << std::endl;
+		return false;
+	}
+
+	const size_t n = AMRGrid3f::cells * AMRGrid3f::cells * AMRGrid3f::cells;
+	leaves.resize(count);
+	values.resize(count * n);
+	for (size_t i = 0; i < count; i++) {
+		readValue(in, leaves[i]);
+		in.read((char *) &values[i * n], n * sizeof(Vector3f));
+	}
+	if (not in) {
+		KISS_LOG_WARNING << "CachedMagneticField: " << filename
+				<< " is truncated, resampling" << std::endl;
+		leaves.clear();
+		values.clear();
+		return false;
+	}
+	return true;
+}
+
+ref_ptr<MagneticField> CachedMagneticField::getCachedField() const {
+	return field;
+}
+
+ref_ptr<AMRGrid3f> CachedMagneticField::getGrid() const {
+	return grid;
+}
+
+double CachedMagneticField::getTolerance() const {
+	return tolerance;
+}
+
+Vector3d CachedMagneticField::getField(const Vector3d &position) const {
+	Vector3d r = position - origin;
+	if ((r.x < 0) or (r.y < 0) or (r.z < 0) or (r.x > extent.x) or (r.y > extent.y)
+			or (r.z > extent.z))
+		return field->getField(position);
+
+	// the ghost cells at the faces of the region are periodic images, the
+	// positions within half a cell of the faces are evaluated directly
+	Vector3d half = blockSize / (2 * AMRGrid3f::cells);
+	Vector3d distance(std::min(r.x, extent.x - r.x), std::min(r.y, extent.y - r.y),
+			std::min(r.z, extent.z - r.z));
+	if ((distance.x < half.x) or (distance.y < half.y) or (distance.z < half.z)) {
+		half /= double(1 << grid->getLevel(position));
+		if ((distance.x < half.x) or (distance.y < half.y) or (distance.z < half.z))
+			return field->getField(position);
+	}
+	return grid->interpolate(position);
+}
+
+void CachedMagneticField::getFields(const Vector3d *positions, const double *z,
+		Vector3d *fields, size_t count) const {
+	for (size_t i = 0; i < count; i++)
+		fields[i] = getField(positions[i]);
+}
+
+bool CachedMagneticField::getBoundingBox(Vector3d &lower, Vector3d &upper) const {
+	return field->getBoundingBox(lower, upper);
+}
+
+} // namespace crpropa
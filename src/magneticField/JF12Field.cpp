@@ -3,6 +3,8 @@
 #include "crpropa/magneticField/turbulentField/SimpleGridTurbulence.h"
 #include "crpropa/Random.h"
 
+#include <algorithm>
+
 namespace crpropa {
 
 JF12Field::JF12Field() {
@@ -20,6 +22,7 @@ JF12Field::JF12Field() {
 	tanPitch = tan(pitch);
 	cotPitch =  1. / tanPitch;
 	tan90MinusPitch = tan(M_PI / 2 - pitch);
+	spiralTurn = exp(-2 * M_PI / tan90MinusPitch);
 
 	rArms[0] = 5.1 * kpc;
 	rArms[1] = 6.3 * kpc;
@@ -85,6 +88,7 @@ void JF12Field::randomStriated(int seed) {
 	useStriatedField = true;
 	int N = 100;
 	striatedGrid = new Grid1f(Vector3d(0.), N, 0.1 * kpc);
+	quantizedStriatedGrid = 0;
 
 	Random random;
 	if (seed != 0)
@@ -103,6 +107,7 @@ void JF12Field::randomTurbulent(int seed) {
 	useTurbulentField = true;
 	// turbulent field with Kolmogorov spectrum, B_rms = 1 and Lc = 60 parsec
 	turbulentGrid = new Grid3f(Vector3d(0.), 256, 4 * parsec);
+	quantizedTurbulentGrid = 0;
 	initTurbulence(turbulentGrid, 1, 8 * parsec, 272 * parsec, -11./3., seed);
 }
 #endif
@@ -110,11 +115,36 @@ void JF12Field::randomTurbulent(int seed) {
 void JF12Field::setStriatedGrid(ref_ptr<Grid1f> grid) {
 	useStriatedField = true;
 	striatedGrid = grid;
+	quantizedStriatedGrid = 0;
 }
 
 void JF12Field::setTurbulentGrid(ref_ptr<Grid3f> grid) {
 	useTurbulentField = true;
 	turbulentGrid = grid;
+	quantizedTurbulentGrid = 0;
+}
+
+void JF12Field::setStriatedGrid(ref_ptr<QuantizedGrid1f> grid) {
+	useStriatedField = true;
+	quantizedStriatedGrid = grid;
+	striatedGrid = 0;
+}
+
+void JF12Field::setTurbulentGrid(ref_ptr<QuantizedGrid3f> grid) {
+	useTurbulentField = true;
+	quantizedTurbulentGrid = grid;
+	turbulentGrid = 0;
+}
+
+void JF12Field::quantizeGrids(GridEncoding turbulentEncoding) {
+	if (striatedGrid.valid()) {
+		quantizedStriatedGrid = new QuantizedGrid1f(*striatedGrid);
+		striatedGrid = 0;
+	}
+	if (turbulentGrid.valid()) {
+		quantizedTurbulentGrid = new QuantizedGrid3f(*turbulentGrid, turbulentEncoding);
+		turbulentGrid = 0;
+	}
 }
 
 ref_ptr<Grid1f> JF12Field::getStriatedGrid() {
@@ -125,6 +155,14 @@ ref_ptr<Grid3f> JF12Field::getTurbulentGrid() {
 	return turbulentGrid;
 }
 
+ref_ptr<QuantizedGrid1f> JF12Field::getQuantizedStriatedGrid() {
+	return quantizedStriatedGrid;
+}
+
+ref_ptr<QuantizedGrid3f> JF12Field::getQuantizedTurbulentGrid() {
+	return quantizedTurbulentGrid;
+}
+
 void JF12Field::setUseRegularField(bool use) {
 	useRegularField = use;
 }
@@ -185,6 +223,18 @@ double JF12Field::logisticFunction(const double& x, const double& x0, const doub
 	return 1. / (1. + exp(-2. * (fabs(x) - x0) / w));
 }
 
+int JF12Field::getArmIndex(const double& r, const double& phi) const {
+	// the radius at the negative x-axis, one turn further out if beyond the
+	// outermost arm; a single exp, the further turns are a constant factor
+	double r_negx = r * exp(-(phi - M_PI) / tan90MinusPitch);
+	if (r_negx > rArms[7])
+		r_negx *= spiralTurn;
+	if (r_negx > rArms[7])
+		r_negx *= spiralTurn;
+	// first arm with r_negx < rArms[i], the arm radii are ascending
+	return std::upper_bound(rArms, rArms + 8, r_negx) - rArms;
+}
+
 Vector3d JF12Field::getRegularField(const Vector3d& pos) const {
 	Vector3d b(0.);
 
@@ -193,8 +243,9 @@ Vector3d JF12Field::getRegularField(const Vector3d& pos) const {
 	if (d < 20 * kpc) {
 		double r = sqrt(pos.x * pos.x + pos.y * pos.y); // in-plane radius
 		double phi = pos.getPhi(); // azimuth
-		double sinPhi = sin(phi);
-		double cosPhi = cos(phi);
+		// sin and cos of the azimuth from the position, without evaluating them
+		double sinPhi = (r > 0) ? pos.y / r : 0;
+		double cosPhi = (r > 0) ? pos.x / r : 1;
 
 		b += getDiskField(r, pos.z, phi, sinPhi, cosPhi);
 		b += getToroidalHaloField(r, pos.z, sinPhi, cosPhi);
@@ -217,16 +268,8 @@ Vector3d JF12Field::getDiskField(const double& r, const double& z, const double&
 				b.y += bMag * cosPhi;
 			} else {
 				// spiral region
-				double r_negx = r * exp(-(phi - M_PI) / tan90MinusPitch);
-				if (r_negx > rArms[7])
-					r_negx = r * exp(-(phi + M_PI) / tan90MinusPitch);
-				if (r_negx > rArms[7])
-					r_negx = r * exp(-(phi + 3 * M_PI) / tan90MinusPitch);
-
-				for (int i = 7; i >= 0; i--)
-					if (r_negx < rArms[i])
-						bMag = bDisk[i];
-
+				int i = getArmIndex(r, phi);
+				bMag = (i < 8) ? bDisk[i] : 0;
 				bMag *= (5 * kpc / r) * (1 - lfDisk);
 				b.x += bMag * (sinPitch * cosPhi - cosPitch * sinPhi);
 				b.y += bMag * (sinPitch * sinPhi + cosPitch * cosPhi);
@@ -265,12 +308,16 @@ Vector3d JF12Field::getXField(const double& r, const double& z, const double& si
 		if (r < rc) {
 			// varying elevation region
 			rp = r * rXc / rc;
-			bMagX = bX * exp(-1 * rp / rX) * pow(rXc / rc, 2.);
-			double thetaX = atan2(fabs(z), (r - rp));
-			if (z == 0)
-				thetaX = M_PI / 2.;
-			sinThetaX = sin(thetaX);
-			cosThetaX = cos(thetaX);
+			bMagX = bX * exp(-1 * rp / rX) * (rXc / rc) * (rXc / rc);
+			// elevation atan2(|z|, r - rp), pi / 2 in the plane
+			if (z == 0) {
+				sinThetaX = 1;
+				cosThetaX = 0;
+			} else {
+				double l = sqrt(z * z + (r - rp) * (r - rp));
+				sinThetaX = fabs(z) / l;
+				cosThetaX = (r - rp) / l;
+			}
 		} else {
 			// constant elevation region
 			rp = r - fabs(z) / tanThetaX0;
@@ -287,8 +334,9 @@ Vector3d JF12Field::getXField(const double& r, const double& z, const double& si
 }
 
 Vector3d JF12Field::getStriatedField(const Vector3d& pos) const {
-	return (getRegularField(pos)
-			* (1. + sqrtbeta * striatedGrid->closestValue(pos)));
+	double s = quantizedStriatedGrid.valid() ? quantizedStriatedGrid->closestValue(pos)
+			: striatedGrid->closestValue(pos);
+	return (getRegularField(pos) * (1. + sqrtbeta * s));
 }
 
 double JF12Field::getTurbulentStrength(const Vector3d& pos) const {
@@ -304,30 +352,27 @@ double JF12Field::getTurbulentStrength(const Vector3d& pos) const {
 		bDisk = bDiskTurb5;
 	} else {
 		// spiral region
-		double r_negx = r * exp(-(phi - M_PI) / tan90MinusPitch);
-		if (r_negx > rArms[7])
-			r_negx = r * exp(-(phi + M_PI) / tan90MinusPitch);
-		if (r_negx > rArms[7])
-			r_negx = r * exp(-(phi + 3 * M_PI) / tan90MinusPitch);
-
-		for (int i = 7; i >= 0; i--)
-			if (r_negx < rArms[i])
-				bDisk = bDiskTurb[i];
+		int i = getArmIndex(r, phi);
+		if (i < 8)
+			bDisk = bDiskTurb[i];
 
 		bDisk *= (5 * kpc) / r;
 	}
-	bDisk *= exp(-0.5 * pow(pos.z / zDiskTurb, 2));
+	double zd = pos.z / zDiskTurb;
+	bDisk *= exp(-0.5 * zd * zd);
 
 	// halo
-	double bHalo = bHaloTurb * exp(-r / rHaloTurb)
-			* exp(-0.5 * pow(pos.z / zHaloTurb, 2));
+	double zh = pos.z / zHaloTurb;
+	double bHalo = bHaloTurb * exp(-r / rHaloTurb - 0.5 * zh * zh);
 
 	// modulate turbulent field
-	return sqrt(pow(bDisk, 2) + pow(bHalo, 2));
+	return sqrt(bDisk * bDisk + bHalo * bHalo);
 }
 
 Vector3d JF12Field::getTurbulentField(const Vector3d& pos) const {
-	return (turbulentGrid->interpolate(pos) * getTurbulentStrength(pos));
+	Vector3f b = quantizedTurbulentGrid.valid() ? quantizedTurbulentGrid->interpolate(pos)
+			: turbulentGrid->interpolate(pos);
+	return (b * getTurbulentStrength(pos));
 }
 
 Vector3d JF12Field::getField(const Vector3d& pos) const {
@@ -341,6 +386,17 @@ Vector3d JF12Field::getField(const Vector3d& pos) const {
 	return b;
 }
 
+void JF12Field::getFields(const Vector3d *positions, const double *z, Vector3d *fields, size_t count) const {
+	for (size_t i = 0; i < count; i++)
+		fields[i] = JF12Field::getField(positions[i]);
+}
+
+bool JF12Field::getBoundingBox(Vector3d &lower, Vector3d &upper) const {
+	lower = Vector3d(-20 * kpc);
+	upper = Vector3d(20 * kpc);
+	return true;
+}
+
 
 
 PlanckJF12bField::PlanckJF12bField() : JF12Field::JF12Field(){
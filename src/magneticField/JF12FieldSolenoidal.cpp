@@ -3,6 +3,9 @@
 #include "crpropa/GridTools.h"
 #include "crpropa/Random.h"
 
+#include <algorithm>
+#include <functional>
+
 namespace crpropa {
 
 JF12FieldSolenoidal::JF12FieldSolenoidal(double delta, double zs) {
@@ -110,12 +113,15 @@ Vector3d JF12FieldSolenoidal::getDiskField(const double& r, const double& z, con
 	Vector3d b(0.);
 
 	if (useDiskField){
-		double lfDisk = logisticFunction(z, hDisk, wDisk); // for vertical scaling as in initial JF12
+		if ((r1 < r) && (r < r2)) {
+			double lfDisk = logisticFunction(z, hDisk, wDisk); // for vertical scaling as in initial JF12
 
-		double hint = getHPhiIntegral(r, phi); // phi integral to restore solenoidality in transition region, only enters if r is in [r1,r1s] or [r2s,r2]
-		double mag1 = getSpiralFieldStrengthConstant(r, phi); // returns bDisk[j] for the current spiral arm
+			// the spiral arm is found once for the field strength and the phi integral
+			double phi1;
+			int idx = getSpiralArm(r, phi, phi1);
+			double hint = phi1 * bDisk[idx] + phiCoeff[idx]; // phi integral to restore solenoidality in transition region, only enters if r is in [r1,r1s] or [r2s,r2]
+			double mag1 = bDisk[idx]; // field strength at r1 of the current spiral arm
 
-		if ((r1 < r) && (r < r2)) {
 			double pdelta = getDiskTransitionPolynomial(r);
 			double qdelta = getDiskTransitionPolynomialDerivative(r);
 			double br = pdelta * mag1 * sinPitch;
@@ -154,13 +160,15 @@ Vector3d JF12FieldSolenoidal::getXField(const double& r, const double& z, const
 				rp = r * rXc / rc;
 				bMagX = bX * exp(-1 * rp / rX) * (rXc / rc) * (rXc / rc);
 
-				double thetaX = atan(fabs(z) / (r - rp));
-
-				if (z == 0)
-					thetaX = M_PI / 2.;
-
-				sinThetaX = sin(thetaX);
-				cosThetaX = cos(thetaX);
+				// elevation atan(|z| / (r - rp)), pi / 2 in the plane
+				if (z == 0) {
+					sinThetaX = 1;
+					cosThetaX = 0;
+				} else {
+					double l = sqrt(z * z + (r - rp) * (r - rp));
+					sinThetaX = fabs(z) / l;
+					cosThetaX = (r - rp) / l;
+				}
 			}
 			else {
 			// outer constant elevation region
@@ -194,17 +202,20 @@ Vector3d JF12FieldSolenoidal::getXField(const double& r, const double& z, const
 				// field strength at that position
 				if (r0 < r0c){
 					 rp = r0 * rXc / r0c;
-					 double thetaX = atan(zS / (r0 - rp));
+					 // elevation atan(zS / (r0 - rp))
+					 double l = sqrt(zS * zS + (r0 - rp) * (r0 - rp));
 
 					 // field strength at (r0,zS) for inner region
-					 br0 = bX * exp(- rp / rX) * (rXc/ r0c) * (rXc/ r0c) * cos(thetaX);
-					 bz0 = bX * exp(- rp / rX) * (rXc/ r0c) * (rXc/ r0c) * sin(thetaX);
+					 double bMag0 = bX * exp(- rp / rX) * (rXc/ r0c) * (rXc/ r0c);
+					 br0 = bMag0 * (r0 - rp) / l;
+					 bz0 = bMag0 * zS / l;
 				 }
 				 else {
 					 // field strength at (r0,zS) for outer region
 					 rp = r0 - zS / tanThetaX0;
-					 br0 =  bX * exp(- rp / rX) * (rp/r0) * cosThetaX0;
-					 bz0 =  bX * exp(- rp / rX) * (rp/r0) * sinThetaX0;
+					 double bMag0 = bX * exp(- rp / rX) * (rp/r0);
+					 br0 = bMag0 * cosThetaX0;
+					 bz0 = bMag0 * sinThetaX0;
 				 }
 
 				 double br = z / zS * f * br0;
@@ -262,6 +273,14 @@ double JF12FieldSolenoidal::getDiskTransitionPolynomialDerivative(const double&
 	return (r1/r_b) * (2. - 2. * r/r_b + fakt * (3. * r * r - 4. * r * r_b + r_b * r_b));
 }
 
+int JF12FieldSolenoidal::getSpiralArm(const double& r, const double& phi, double& phi1) const {
+	phi1 = phi - log(r/r1) * cotPitch; // map the position (r, phi) to (5 kpc, phi1) along the logarithmic spiral field line
+	phi1 -= 2 * M_PI * floor((phi1 + M_PI) / (2 * M_PI)); // map this angle to [-pi,+pi)
+	// run clockwise through the spiral arms to the first idx with phi0Arms[idx] <= phi1; the cyclic closure
+	// of phi0Arms[9] = phi0Arms[1] - 2 pi is needed if -pi <= phi1 <= phi0Arms[8].
+	return std::lower_bound(phi0Arms + 1, phi0Arms + 10, phi1, std::greater<double>()) - phi0Arms;
+}
+
 double JF12FieldSolenoidal::getHPhiIntegral(const double& r, const double& phi) const {
 	// Evaluates the H(phi1) integral for solenoidality for the position (r,phi) which is mapped back to (r1=5kpc,phi1)
 	// along the spiral field line.
@@ -269,12 +288,8 @@ double JF12FieldSolenoidal::getHPhiIntegral(const double& r, const double& phi)
 
 	if ((r1 < r) && (r < r2)){
 		// find index of the correct spiral arm for (r1,phi1) just like in getSpiralFieldStrengthConstant
-		int idx = 1;
-		double phi1 = phi - log(r/r1) * cotPitch;
-		phi1 = atan2(sin(phi1), cos(phi1));
-		while (phi1 < phi0Arms[idx]){
-			idx += 1;
-		}
+		double phi1;
+		int idx = getSpiralArm(r, phi, phi1);
 		H_ret = phi1 * bDisk[idx] + phiCoeff[idx];
 	}
 	return H_ret;
@@ -288,14 +303,9 @@ double JF12FieldSolenoidal::getSpiralFieldStrengthConstant(const double& r, cons
 	// such that phi0Arms[idx] < phi1 < phi0Arms[idx-1]. The correct field strength of the respective spiral arm
 	// where (r, phi) is located is then given as bDisk[idx].
 	double b_ret = 0.;
-	int idx = 1;
 	if ((r1 < r) && (r < r2)){
-		double phi1 = phi - log(r/r1) * cotPitch; // map the position (r, phi) to (5 kpc, phi1) along the logarithmic spiral field line
-		phi1 = atan2(sin(phi1), cos(phi1)); // map this angle to [-pi,+pi]
-		while (phi1 < phi0Arms[idx]){
-			idx += 1; // run clockwise through the spiral arms; the cyclic closure of phi0Arms[9] = phi0Arms[1] - 2 pi is needed if -pi <= phi1 <= phi0Arms[8].
-		}
-		b_ret = bDisk[idx];
+		double phi1;
+		b_ret = bDisk[getSpiralArm(r, phi, phi1)];
 	}
 	return b_ret;
 }
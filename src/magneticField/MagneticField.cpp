@@ -1,7 +1,19 @@
 #include "crpropa/magneticField/MagneticField.h"
 
+#include <limits>
+
 namespace crpropa {
 
+static size_t offloadThreshold = 4096;
+
+void MagneticField::setOffloadThreshold(size_t count) {
+	offloadThreshold = count;
+}
+
+size_t MagneticField::getOffloadThreshold() {
+	return offloadThreshold;
+}
+
 PeriodicMagneticField::PeriodicMagneticField(ref_ptr<MagneticField> field,
 		const Vector3d &extends) :
 		field(field), extends(extends), origin(0, 0, 0), reflective(false) {
@@ -57,17 +69,141 @@ Vector3d PeriodicMagneticField::getField(const Vector3d &position) const {
 	return field->getField(p);
 }
 
+size_t PeriodicMagneticField::getMemoryUsage() const {
+	return field->getMemoryUsage();
+}
+
 void MagneticFieldList::addField(ref_ptr<MagneticField> field) {
+	Vector3d lo, up;
+	if (field->getBoundingBox(lo, up)) {
+		addField(field, lo, up);
+		return;
+	}
 	fields.push_back(field);
+	bounded.push_back(false);
+	lower.push_back(Vector3d(0.));
+	upper.push_back(Vector3d(0.));
+	updateIndex();
+}
+
+void MagneticFieldList::addField(ref_ptr<MagneticField> field, const Vector3d &lo, const Vector3d &up) {
+	fields.push_back(field);
+	bounded.push_back(true);
+	lower.push_back(lo);
+	upper.push_back(up);
+	updateIndex();
+}
+
+void MagneticFieldList::updateIndex() {
+	unbounded.clear();
+	index.clear();
+	Vector3d lo(std::numeric_limits<double>::max());
+	Vector3d up(-std::numeric_limits<double>::max());
+	for (size_t f = 0; f < fields.size(); f++) {
+		if (not bounded[f]) {
+			unbounded.push_back(f);
+			continue;
+		}
+		for (int d = 0; d < 3; d++) {
+			lo.data[d] = std::min(lo.data[d], lower[f].data[d]);
+			up.data[d] = std::max(up.data[d], upper[f].data[d]);
+		}
+	}
+	if (unbounded.size() == fields.size())
+		return;
+
+	// cells over the union of the boxes, each listing the fields in the order
+	// of addition
+	indexLower = lo;
+	indexCell = (up - lo) / indexCells;
+	for (int d = 0; d < 3; d++)
+		if (not (indexCell.data[d] > 0))
+			indexCell.data[d] = 1;
+	index.resize(indexCells * indexCells * indexCells);
+	for (int ix = 0; ix < indexCells; ix++)
+		for (int iy = 0; iy < indexCells; iy++)
+			for (int iz = 0; iz < indexCells; iz++) {
+				Vector3d cLo = indexLower + Vector3d(ix, iy, iz) * indexCell;
+				Vector3d cUp = cLo + indexCell;
+				std::vector<size_t> &cell = index[(ix * indexCells + iy) * indexCells + iz];
+				for (size_t f = 0; f < fields.size(); f++) {
+					bool overlap = (not bounded[f]) or ((lower[f].x <= cUp.x) and (upper[f].x >= cLo.x)
+							and (lower[f].y <= cUp.y) and (upper[f].y >= cLo.y)
+							and (lower[f].z <= cUp.z) and (upper[f].z >= cLo.z));
+					if (overlap)
+						cell.push_back(f);
+				}
+			}
 }
 
 Vector3d MagneticFieldList::getField(const Vector3d &position) const {
+	return getField(position, 0);
+}
+
+Vector3d MagneticFieldList::getField(const Vector3d &position, double z) const {
+	const std::vector<size_t> *candidates = &unbounded;
+	if (not index.empty()) {
+		Vector3d r = (position - indexLower) / indexCell;
+		if ((r.x >= 0) and (r.y >= 0) and (r.z >= 0) and (r.x <= indexCells)
+				and (r.y <= indexCells) and (r.z <= indexCells)) {
+			int ix = std::min(int(r.x), indexCells - 1);
+			int iy = std::min(int(r.y), indexCells - 1);
+			int iz = std::min(int(r.z), indexCells - 1);
+			candidates = &index[(ix * indexCells + iy) * indexCells + iz];
+		}
+	}
+
 	Vector3d b;
-	for (int i = 0; i < fields.size(); i++)
-		b += fields[i]->getField(position);
+	for (size_t i = 0; i < candidates->size(); i++) {
+		size_t f = (*candidates)[i];
+		if (inside(f, position))
+			b += fields[f]->getField(position, z);
+	}
 	return b;
 }
 
+void MagneticFieldList::getFields(const Vector3d *positions, const double *z, Vector3d *out, size_t count) const {
+	for (size_t j = 0; j < count; j++)
+		out[j] = Vector3d(0.);
+	// each field evaluates a chunk of positions at once, the bounded fields
+	// only the positions inside of their box
+	Vector3d buffer[64], inPositions[64];
+	double inZ[64];
+	size_t inIndex[64];
+	for (size_t i = 0; i < count; i += 64) {
+		size_t n = std::min(count - i, size_t(64));
+		for (size_t f = 0; f < fields.size(); f++) {
+			if (not bounded[f]) {
+				fields[f]->getFields(positions + i, z + i, buffer, n);
+				for (size_t j = 0; j < n; j++)
+					out[i + j] += buffer[j];
+				continue;
+			}
+			size_t m = 0;
+			for (size_t j = 0; j < n; j++) {
+				if (not inside(f, positions[i + j]))
+					continue;
+				inPositions[m] = positions[i + j];
+				inZ[m] = z ? z[i + j] : 0;
+				inIndex[m] = i + j;
+				m++;
+			}
+			if (m == 0)
+				continue;
+			fields[f]->getFields(inPositions, inZ, buffer, m);
+			for (size_t j = 0; j < m; j++)
+				out[inIndex[j]] += buffer[j];
+		}
+	}
+}
+
+size_t MagneticFieldList::getMemoryUsage() const {
+	size_t bytes = 0;
+	for (size_t f = 0; f < fields.size(); f++)
+		bytes += fields[f]->getMemoryUsage();
+	return bytes;
+}
+
 MagneticFieldEvolution::MagneticFieldEvolution(ref_ptr<MagneticField> field,
 	double m) :
 	field(field), m(m) {
@@ -78,6 +214,10 @@ Vector3d MagneticFieldEvolution::getField(const Vector3d &position,
 	return field->getField(position) * pow(1+z, m);
 }
 
+size_t MagneticFieldEvolution::getMemoryUsage() const {
+	return field->getMemoryUsage();
+}
+
 Vector3d MagneticDipoleField::getField(const Vector3d &position) const {
 		Vector3d r = (position - origin);
 		Vector3d unit_r = r.getUnitVector();
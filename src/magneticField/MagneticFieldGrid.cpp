@@ -1,23 +1,519 @@
 #include "crpropa/magneticField/MagneticFieldGrid.h"
+#include "crpropa/Random.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <stdexcept>
 
 namespace crpropa {
 
-MagneticFieldGrid::MagneticFieldGrid(ref_ptr<Grid3f> grid) {
+#ifdef CRPROPA_HAVE_OFFLOAD
+// Trilinear interpolation of a periodic, linear grid on the offload device, in
+// chunks that are transferred and evaluated asynchronously, so that the
+// transfers of one chunk overlap with the evaluation of the others
+static void offloadFields(const Grid3f &grid, const float *g, size_t nValues,
+		const Vector3d *positions, Vector3d *fields, size_t count) {
+	const int Nx = grid.getNx(), Ny = grid.getNy(), Nz = grid.getNz();
+	const Vector3d spacing = grid.getSpacing();
+	const Vector3d gridOrigin = grid.getOrigin() + spacing / 2;
+	const double o[3] = {gridOrigin.x, gridOrigin.y, gridOrigin.z};
+	const double s[3] = {spacing.x, spacing.y, spacing.z};
+	const double *p = positions[0].data;
+	double *f = fields[0].data;
+	const size_t chunk = 16384;
+	for (size_t j0 = 0; j0 < count; j0 += chunk) {
+		size_t m = std::min(chunk, count - j0);
+#pragma omp target teams distribute parallel for nowait \
+		map(to: g[0:nValues], p[3 * j0:3 * m], o[0:3], s[0:3]) map(from: f[3 * j0:3 * m])
+		for (size_t j = j0; j < j0 + m; j++) {
+			const int N[3] = {Nx, Ny, Nz};
+			int lo[3], hi[3];
+			double w[3];
+			for (int d = 0; d < 3; d++) {
+				double r = (p[3 * j + d] - o[d]) / s[d];
+				double fl = floor(r);
+				w[d] = r - fl;
+				lo[d] = ((int(fl) % N[d]) + N[d]) % N[d];
+				hi[d] = (lo[d] + 1) % N[d];
+			}
+			double b[3] = {0, 0, 0};
+			for (int c = 0; c < 8; c++) {
+				int cx = (c >> 2) & 1, cy = (c >> 1) & 1, cz = c & 1;
+				size_t i = ((size_t(cx ? hi[0] : lo[0]) * Ny + (cy ? hi[1] : lo[1])) * Nz
+						+ (cz ? hi[2] : lo[2])) * 3;
+				double wc = (cx ? w[0] : 1 - w[0]) * (cy ? w[1] : 1 - w[1])
+						* (cz ? w[2] : 1 - w[2]);
+				for (int d = 0; d < 3; d++)
+					b[d] += g[i + d] * wc;
+			}
+			for (int d = 0; d < 3; d++)
+				f[3 * j + d] = b[d];
+		}
+	}
+#pragma omp taskwait
+}
+
+// whether offloadFields interpolates the grid as Grid::interpolate
+static bool offloadable(const Grid3f &grid) {
+	return (grid.getLayout() == GridLinear) and (not grid.isTricubic())
+			and (not grid.isReflective());
+}
+#endif // CRPROPA_HAVE_OFFLOAD
+
+MagneticFieldGrid::MagneticFieldGrid(ref_ptr<Grid3f> grid) : deviceData(0), deviceSize(0),
+		numaReplicas(false) {
 	setGrid(grid);
 }
 
+MagneticFieldGrid::~MagneticFieldGrid() {
+	unmapDevice();
+}
+
+void MagneticFieldGrid::unmapDevice() {
+#ifdef CRPROPA_HAVE_OFFLOAD
+	if (deviceData) {
+		const float *g = deviceData;
+		size_t n = deviceSize;
+#pragma omp target exit data map(delete: g[0:n])
+	}
+#endif
+	deviceData = 0;
+	deviceSize = 0;
+}
+
 void MagneticFieldGrid::setGrid(ref_ptr<Grid3f> grid) {
+	unmapDevice();
 	this->grid = grid;
+#ifdef CRPROPA_HAVE_OFFLOAD
+	if (grid.valid() and offloadable(*grid) and not grid->getGrid().empty()) {
+		const float *g = &grid->getGrid()[0].x;
+		size_t n = 3 * grid->getGrid().size();
+#pragma omp target enter data map(to: g[0:n])
+		deviceData = g;
+		deviceSize = n;
+	}
+#endif
+	makeReplicas();
 }
 
 ref_ptr<Grid3f> MagneticFieldGrid::getGrid() {
 	return grid;
 }
 
+void MagneticFieldGrid::setNumaReplicas(bool b) {
+	numaReplicas = b;
+	makeReplicas();
+}
+
+bool MagneticFieldGrid::getNumaReplicas() const {
+	return numaReplicas;
+}
+
+void MagneticFieldGrid::makeReplicas() {
+	replicas.clear();
+	std::vector<int> nodes = getNumaNodes();
+	if ((not numaReplicas) or (not grid.valid()) or (nodes.size() < 2))
+		return;
+	replicas.resize(*std::max_element(nodes.begin(), nodes.end()) + 1);
+	for (size_t i = 0; i < nodes.size(); i++) {
+		ref_ptr<Grid3f> replica = new Grid3f(*grid);
+		std::vector<Vector3f> &values = replica->getGrid();
+		if (not values.empty())
+			placeMemoryOnNode(&values[0], values.size() * sizeof(Vector3f), nodes[i]);
+		replicas[nodes[i]] = replica;
+	}
+}
+
+const Grid3f &MagneticFieldGrid::localGrid() const {
+	if (replicas.empty())
+		return *grid;
+	size_t node = currentNumaNode();
+	if ((node < replicas.size()) and replicas[node].valid())
+		return *replicas[node];
+	return *grid;
+}
+
 Vector3d MagneticFieldGrid::getField(const Vector3d &pos) const {
+	return localGrid().interpolate(pos);
+}
+
+void MagneticFieldGrid::getFields(const Vector3d *positions, const double *z, Vector3d *fields, size_t count) const {
+#ifdef CRPROPA_HAVE_OFFLOAD
+	// values that are not resident any more (e.g. after a resize of the grid)
+	// are transferred with each call
+	if ((count > 0) and (count >= getOffloadThreshold()) and offloadable(*grid)) {
+		offloadFields(*grid, &grid->getGrid()[0].x, 3 * grid->getGrid().size(),
+				positions, fields, count);
+		return;
+	}
+#endif
+	// batched interpolation in chunks, converted to double precision
+	const Grid3f &local = localGrid();
+	const size_t chunk = 64;
+	Vector3f b[chunk];
+	for (size_t offset = 0; offset < count; offset += chunk) {
+		size_t n = std::min(chunk, count - offset);
+		local.interpolate(positions + offset, b, n);
+		for (size_t i = 0; i < n; i++)
+			fields[offset + i] = b[i];
+	}
+}
+
+void MagneticFieldGrid::getFieldsFloat(const Vector3d *positions, const double *z, Vector3f *fields, size_t count) const {
+	localGrid().interpolate(positions, fields, count);
+}
+
+size_t MagneticFieldGrid::getMemoryUsage() const {
+	size_t bytes = grid.valid() ? grid->getSizeOf() : 0;
+	for (size_t i = 0; i < replicas.size(); i++)
+		if (replicas[i].valid())
+			bytes += replicas[i]->getSizeOf();
+	return bytes;
+}
+
+MappedMagneticFieldGrid::MappedMagneticFieldGrid(ref_ptr<MappedGrid3f> grid) {
+	setGrid(grid);
+}
+
+void MappedMagneticFieldGrid::setGrid(ref_ptr<MappedGrid3f> grid) {
+	this->grid = grid;
+}
+
+ref_ptr<MappedGrid3f> MappedMagneticFieldGrid::getGrid() {
+	return grid;
+}
+
+Vector3d MappedMagneticFieldGrid::getField(const Vector3d &pos) const {
 	return grid->interpolate(pos);
 }
 
+void MappedMagneticFieldGrid::getFields(const Vector3d *positions, const double *z, Vector3d *fields, size_t count) const {
+	const MappedGrid3f &g = *grid;
+	for (size_t i = 0; i < count; i++)
+		fields[i] = g.interpolate(positions[i]);
+}
+
+SnapshotMagneticFieldGrid::SnapshotMagneticFieldGrid(double factor, size_t memoryBudget) :
+		factor(factor), memoryBudget(memoryBudget), prefetching(true), uses(0), prefetched(false) {
+}
+
+SnapshotMagneticFieldGrid::~SnapshotMagneticFieldGrid() {
+	joinPrefetcher();
+}
+
+void SnapshotMagneticFieldGrid::joinPrefetcher() const {
+	if (prefetcher.joinable())
+		prefetcher.join();
+}
+
+void SnapshotMagneticFieldGrid::addSnapshot(double z, const std::string &filename) {
+	std::ifstream fin(filename.c_str(), std::ios::binary);
+	if (!fin)
+		throw std::runtime_error("SnapshotMagneticFieldGrid: could not open " + filename);
+	joinPrefetcher();
+	std::lock_guard<std::mutex> lock(mutex);
+	Snapshot snapshot;
+	snapshot.z = z;
+	snapshot.filename = filename;
+	snapshot.lastUse = 0;
+	size_t i = 0;
+	while ((i < snapshots.size()) and (snapshots[i].z < z))
+		i++;
+	if ((i < snapshots.size()) and (snapshots[i].z == z))
+		throw std::runtime_error("SnapshotMagneticFieldGrid: two snapshots at the same redshift");
+	snapshots.insert(snapshots.begin() + i, snapshot);
+}
+
+size_t SnapshotMagneticFieldGrid::getNumberOfSnapshots() const {
+	return snapshots.size();
+}
+
+double SnapshotMagneticFieldGrid::getSnapshotRedshift(size_t i) const {
+	return snapshots.at(i).z;
+}
+
+void SnapshotMagneticFieldGrid::setMemoryBudget(size_t bytes) {
+	memoryBudget = bytes;
+}
+
+size_t SnapshotMagneticFieldGrid::getMemoryBudget() const {
+	return memoryBudget;
+}
+
+void SnapshotMagneticFieldGrid::setPrefetching(bool b) {
+	prefetching = b;
+}
+
+bool SnapshotMagneticFieldGrid::isPrefetching() const {
+	return prefetching;
+}
+
+size_t SnapshotMagneticFieldGrid::getNumberOfMappedSnapshots() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	size_t n = 0;
+	for (size_t i = 0; i < snapshots.size(); i++)
+		n += snapshots[i].grid.valid();
+	return n;
+}
+
+size_t SnapshotMagneticFieldGrid::getMemoryUsage() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	size_t bytes = 0;
+	for (size_t i = 0; i < snapshots.size(); i++)
+		if (snapshots[i].grid.valid())
+			bytes += snapshots[i].grid->getSizeOf();
+	return bytes;
+}
+
+void SnapshotMagneticFieldGrid::bracket(double z, size_t &i, size_t &j, double &w) const {
+	size_t n = snapshots.size();
+	if (n == 0)
+		throw std::runtime_error("SnapshotMagneticFieldGrid: no snapshots");
+	w = 0;
+	if (z <= snapshots.front().z) {
+		i = j = 0;
+		return;
+	}
+	if (z >= snapshots.back().z) {
+		i = j = n - 1;
+		return;
+	}
+	j = 1;
+	while (snapshots[j].z <= z)
+		j++;
+	i = j - 1;
+	w = (z - snapshots[i].z) / (snapshots[j].z - snapshots[i].z);
+}
+
+ref_ptr<MappedGrid3f> SnapshotMagneticFieldGrid::acquire(size_t i) const {
+	Snapshot &s = snapshots[i];
+	if (!s.grid.valid())
+		s.grid = new MappedGrid3f(s.filename, factor);
+	s.lastUse = ++uses;
+	return s.grid;
+}
+
+void SnapshotMagneticFieldGrid::evict(size_t i, size_t j) const {
+	if (memoryBudget == 0)
+		return;
+	size_t bytes = 0;
+	for (size_t k = 0; k < snapshots.size(); k++)
+		if (snapshots[k].grid.valid())
+			bytes += snapshots[k].grid->getSizeOf();
+
+	// least recently used first, threads using them keep their reference
+	while (bytes > memoryBudget) {
+		size_t oldest = snapshots.size();
+		for (size_t k = 0; k < snapshots.size(); k++) {
+			if ((k == i) or (k == j) or !snapshots[k].grid.valid())
+				continue;
+			if ((oldest == snapshots.size()) or (snapshots[k].lastUse < snapshots[oldest].lastUse))
+				oldest = k;
+		}
+		if (oldest == snapshots.size())
+			return;
+		bytes -= snapshots[oldest].grid->getSizeOf();
+		snapshots[oldest].grid = 0;
+	}
+}
+
+void SnapshotMagneticFieldGrid::prefetch(size_t i) const {
+	if (!prefetching or snapshots[i].grid.valid())
+		return;
+	// one snapshot at a time, the finished thread is joined without waiting
+	if (prefetcher.joinable()) {
+		if (!prefetched)
+			return;
+		prefetcher.join();
+	}
+	prefetched = false;
+	prefetcher = std::thread(&SnapshotMagneticFieldGrid::load, this, i);
+}
+
+void SnapshotMagneticFieldGrid::load(size_t i) const {
+	try {
+		ref_ptr<MappedGrid3f> grid = new MappedGrid3f(snapshots[i].filename, factor);
+		grid->prefetch();
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!snapshots[i].grid.valid()) {
+			snapshots[i].grid = grid;
+			snapshots[i].lastUse = uses;
+			evict(i, i);
+		}
+	} catch (std::exception &) {
+		// errors are reported when the snapshot is used
+	}
+	prefetched = true;
+}
+
+Vector3d SnapshotMagneticFieldGrid::getField(const Vector3d &position) const {
+	return getField(position, 0);
+}
+
+Vector3d SnapshotMagneticFieldGrid::getField(const Vector3d &position, double z) const {
+	Vector3d b;
+	getFields(&position, &z, &b, 1);
+	return b;
+}
+
+void SnapshotMagneticFieldGrid::getFields(const Vector3d *positions, const double *z, Vector3d *fields, size_t count) const {
+	// the grids are acquired when the bracketing snapshots change
+	ref_ptr<MappedGrid3f> lower, upper;
+	size_t lowerIndex = snapshots.size(), upperIndex = snapshots.size();
+	for (size_t k = 0; k < count; k++) {
+		size_t i, j;
+		double w;
+		bracket(z[k], i, j, w);
+		if ((i != lowerIndex) or (j != upperIndex)) {
+			std::lock_guard<std::mutex> lock(mutex);
+			lower = acquire(i);
+			upper = (j == i) ? lower : acquire(j);
+			evict(i, j);
+			if (i > 0)
+				prefetch(i - 1);
+			lowerIndex = i;
+			upperIndex = j;
+		}
+		Vector3d b(lower->interpolate(positions[k]));
+		if (w > 0)
+			b = b * (1 - w) + Vector3d(upper->interpolate(positions[k])) * w;
+		fields[k] = b;
+	}
+}
+
+AMRMagneticFieldGrid::AMRMagneticFieldGrid(ref_ptr<AMRGrid3f> grid) {
+	setGrid(grid);
+}
+
+void AMRMagneticFieldGrid::setGrid(ref_ptr<AMRGrid3f> grid) {
+	this->grid = grid;
+}
+
+ref_ptr<AMRGrid3f> AMRMagneticFieldGrid::getGrid() {
+	return grid;
+}
+
+Vector3d AMRMagneticFieldGrid::getField(const Vector3d &pos) const {
+	return grid->interpolate(pos);
+}
+
+void AMRMagneticFieldGrid::getFields(const Vector3d *positions, const double *z, Vector3d *fields, size_t count) const {
+	const AMRGrid3f &g = *grid;
+	for (size_t i = 0; i < count; i++)
+		fields[i] = g.interpolate(positions[i]);
+}
+
+size_t AMRMagneticFieldGrid::getMemoryUsage() const {
+	return grid.valid() ? grid->getSizeOf() : 0;
+}
+
+DistributedMagneticFieldGrid::DistributedMagneticFieldGrid(const std::string &filename,
+		const GridProperties &p, int rank, int nRanks, size_t ghostLayers, double c) :
+		rank(rank), ghostLayers(ghostLayers) {
+	size_t first = init(p, nRanks);
+	std::ifstream fin(filename.c_str(), std::ios::binary);
+	if (!fin)
+		throw std::runtime_error("DistributedMagneticFieldGrid: could not open " + filename);
+	size_t plane = p.Ny * p.Nz;
+	fin.seekg(0, fin.end);
+	if (size_t(fin.tellg()) != 3 * sizeof(float) * p.Nx * plane)
+		throw std::runtime_error("DistributedMagneticFieldGrid: file and grid size do not match");
+
+	// the planes of the slab are contiguous in the file, x is slowest
+	std::vector<Vector3f> values(plane);
+	for (size_t ix = 0; ix < grid->getNx(); ix++) {
+		size_t gx = periodicIndex(int(first + ix), p.Nx);
+		fin.seekg(3 * sizeof(float) * gx * plane);
+		fin.read(reinterpret_cast<char*>(&values[0]), 3 * sizeof(float) * plane);
+		if (!fin)
+			throw std::runtime_error("DistributedMagneticFieldGrid: could not read " + filename);
+		for (size_t iy = 0; iy < p.Ny; iy++)
+			for (size_t iz = 0; iz < p.Nz; iz++)
+				grid->get(ix, iy, iz) = values[iy * p.Nz + iz] * c;
+	}
+}
+
+DistributedMagneticFieldGrid::DistributedMagneticFieldGrid(ref_ptr<Grid3f> global, int rank,
+		int nRanks, size_t ghostLayers) : rank(rank), ghostLayers(ghostLayers) {
+	GridProperties p(global->getOrigin(), global->getNx(), global->getNy(), global->getNz(),
+			global->getSpacing());
+	p.setReflective(global->isReflective());
+	size_t first = init(p, nRanks);
+	for (size_t ix = 0; ix < grid->getNx(); ix++) {
+		size_t gx = periodicIndex(int(first + ix), p.Nx);
+		for (size_t iy = 0; iy < p.Ny; iy++)
+			for (size_t iz = 0; iz < p.Nz; iz++)
+				grid->get(ix, iy, iz) = global->get(gx, iy, iz);
+	}
+}
+
+size_t DistributedMagneticFieldGrid::init(const GridProperties &p, int nRanks) {
+	if (p.reflective)
+		throw std::runtime_error("DistributedMagneticFieldGrid: only periodic grids can be distributed");
+	decomposition = new SlabDecomposition(p.origin.x, p.spacing.x, p.Nx, nRanks);
+	if ((rank < 0) or (rank >= nRanks))
+		throw std::runtime_error("DistributedMagneticFieldGrid: rank out of range");
+
+	// first plane of the slab including the ghost layers, may be negative
+	long first = long(decomposition->getLower(rank)) - long(ghostLayers);
+	size_t n = decomposition->getUpper(rank) - decomposition->getLower(rank) + 2 * ghostLayers;
+	Vector3d origin = p.origin + Vector3d(first * p.spacing.x, 0, 0);
+	grid = new Grid3f(origin, n, p.Ny, p.Nz, p.spacing);
+	lengthX = p.Nx * p.spacing.x;
+	lowerX = origin.x;
+	return periodicIndex(int(first), p.Nx);
+}
+
+double DistributedMagneticFieldGrid::localX(double x) const {
+	// periodic image of the position next to the slab
+	return x - floor((x - lowerX) / lengthX) * lengthX;
+}
+
+ref_ptr<SlabDecomposition> DistributedMagneticFieldGrid::getDecomposition() const {
+	return decomposition;
+}
+
+ref_ptr<Grid3f> DistributedMagneticFieldGrid::getLocalGrid() const {
+	return grid;
+}
+
+int DistributedMagneticFieldGrid::getRank() const {
+	return rank;
+}
+
+size_t DistributedMagneticFieldGrid::getGhostLayers() const {
+	return ghostLayers;
+}
+
+bool DistributedMagneticFieldGrid::isLocal(const Vector3d &position) const {
+	return decomposition->getOwner(position) == rank;
+}
+
+Vector3d DistributedMagneticFieldGrid::getField(const Vector3d &pos) const {
+	return grid->interpolate(Vector3d(localX(pos.x), pos.y, pos.z));
+}
+
+void DistributedMagneticFieldGrid::getFields(const Vector3d *positions, const double *z, Vector3d *fields, size_t count) const {
+	const size_t chunk = 64;
+	Vector3d r[chunk];
+	Vector3f b[chunk];
+	for (size_t offset = 0; offset < count; offset += chunk) {
+		size_t n = std::min(chunk, count - offset);
+		for (size_t i = 0; i < n; i++) {
+			const Vector3d &p = positions[offset + i];
+			r[i] = Vector3d(localX(p.x), p.y, p.z);
+		}
+		grid->interpolate(r, b, n);
+		for (size_t i = 0; i < n; i++)
+			fields[offset + i] = b[i];
+	}
+}
+
+size_t DistributedMagneticFieldGrid::getMemoryUsage() const {
+	return grid->getSizeOf();
+}
+
 ModulatedMagneticFieldGrid::ModulatedMagneticFieldGrid(ref_ptr<Grid3f> grid,
 		ref_ptr<Grid1f> modGrid) {
 	grid->setReflective(false);
@@ -48,10 +544,157 @@ void ModulatedMagneticFieldGrid::setReflective(bool gridReflective,
 	modGrid->setReflective(modGridReflective);
 }
 
+size_t ModulatedMagneticFieldGrid::getMemoryUsage() const {
+	size_t bytes = grid.valid() ? grid->getSizeOf() : 0;
+	if (modGrid.valid())
+		bytes += modGrid->getSizeOf();
+	return bytes;
+}
+
+// The trilinear lookups of two grids can be fused if they share the neighbors
+// of a position. A periodic and a reflective grid, as set by the constructor,
+// share them away from the outer half cells.
+static bool sameNeighbors(const Grid3f &a, const Grid1f &b, const Vector3d &pos) {
+	bool same = (a.getNx() == b.getNx()) and (a.getNy() == b.getNy()) and (a.getNz() == b.getNz())
+			and (a.getSpacing() == b.getSpacing()) and (a.getOrigin() == b.getOrigin())
+			and (a.getLayout() == b.getLayout()) and not a.isTricubic() and not b.isTricubic();
+	if (not same or (a.isReflective() == b.isReflective()))
+		return same;
+	const double margin = 0.5 + 1e-6;
+	Vector3d r = (pos - a.getOrigin()) / a.getSpacing();
+	return (r.x > margin) and (r.x < a.getNx() - margin) and (r.y > margin)
+			and (r.y < a.getNy() - margin) and (r.z > margin) and (r.z < a.getNz() - margin);
+}
+
 Vector3d ModulatedMagneticFieldGrid::getField(const Vector3d &pos) const {
-	float m = modGrid->interpolate(pos);
-	Vector3d b = grid->interpolate(pos);
-	return b * m;
+	if (not sameNeighbors(*grid, *modGrid, pos)) {
+		float m = modGrid->interpolate(pos);
+		Vector3d b = grid->interpolate(pos);
+		return b * m;
+	}
+
+	// one set of indices and weights for both grids
+	size_t index[8];
+	double weight[8];
+	grid->getNeighbors(pos, index, weight);
+	const Vector3f *b = &grid->getGrid()[0];
+	const float *m = &modGrid->getGrid()[0];
+	double bx = 0, by = 0, bz = 0, mod = 0;
+	for (int k = 0; k < 8; k++) {
+		const Vector3f &v = b[index[k]];
+		bx += v.x * weight[k];
+		by += v.y * weight[k];
+		bz += v.z * weight[k];
+		mod += m[index[k]] * weight[k];
+	}
+	return Vector3d(bx, by, bz) * mod;
+}
+
+EnsembleMagneticFieldGrid::EnsembleMagneticFieldGrid(ref_ptr<Grid3f> grid, uint64_t seed,
+		bool reflections) : grid(grid), seed(seed), reflections(reflections) {
+	init();
+}
+
+void EnsembleMagneticFieldGrid::init() {
+	translation = Vector3d(0.);
+	for (int i = 0; i < 3; i++) {
+		axes[i] = i;
+		signs[i] = 1;
+	}
+	if ((seed == 0) or not grid.valid())
+		return;
+
+	uint32_t words[2] = {uint32_t(seed), uint32_t(seed >> 32)};
+	Random random(words, 2);
+	Vector3d extents = grid->getSpacing() * Vector3d(grid->getNx(), grid->getNy(), grid->getNz());
+	translation = Vector3d(random.rand(), random.rand(), random.rand()) * extents;
+
+	// the axes are only permuted if the cell is a cube
+	double L = extents.x;
+	bool cubic = (std::fabs(extents.y - L) <= 1e-9 * L) and (std::fabs(extents.z - L) <= 1e-9 * L);
+	if (cubic)
+		for (int i = 2; i > 0; i--)
+			std::swap(axes[i], axes[random.randInt(i)]);
+	if (reflections)
+		for (int i = 0; i < 3; i++)
+			signs[i] = (random.rand() < 0.5) ? -1 : 1;
+}
+
+void EnsembleMagneticFieldGrid::setGrid(ref_ptr<Grid3f> grid) {
+	this->grid = grid;
+	init();
+}
+
+ref_ptr<Grid3f> EnsembleMagneticFieldGrid::getGrid() {
+	return grid;
+}
+
+void EnsembleMagneticFieldGrid::setSeed(uint64_t seed) {
+	this->seed = seed;
+	init();
+}
+
+uint64_t EnsembleMagneticFieldGrid::getSeed() const {
+	return seed;
+}
+
+void EnsembleMagneticFieldGrid::setReflections(bool reflections) {
+	this->reflections = reflections;
+	init();
+}
+
+bool EnsembleMagneticFieldGrid::getReflections() const {
+	return reflections;
+}
+
+Vector3d EnsembleMagneticFieldGrid::getTranslation() const {
+	return translation;
+}
+
+int EnsembleMagneticFieldGrid::getAxis(int i) const {
+	return axes[i];
+}
+
+double EnsembleMagneticFieldGrid::getSign(int i) const {
+	return signs[i];
+}
+
+Vector3d EnsembleMagneticFieldGrid::toGrid(const Vector3d &position) const {
+	const Vector3d origin = grid->getOrigin();
+	Vector3d r = position - origin;
+	Vector3d p;
+	for (int i = 0; i < 3; i++)
+		p.data[axes[i]] = signs[i] * r.data[i];
+	return p + origin + translation;
+}
+
+Vector3d EnsembleMagneticFieldGrid::fromGrid(const Vector3f &field) const {
+	return Vector3d(signs[0] * field.data[axes[0]], signs[1] * field.data[axes[1]],
+			signs[2] * field.data[axes[2]]);
+}
+
+Vector3d EnsembleMagneticFieldGrid::getField(const Vector3d &position) const {
+	return fromGrid(grid->interpolate(toGrid(position)));
+}
+
+void EnsembleMagneticFieldGrid::getFields(const Vector3d *positions, const double *z, Vector3d *fields,
+		size_t count) const {
+	// batched interpolation of the transformed positions in chunks
+	const size_t chunk = 64;
+	Vector3d p[chunk];
+	Vector3f b[chunk];
+	for (size_t offset = 0; offset < count; offset += chunk) {
+		size_t n = std::min(chunk, count - offset);
+		for (size_t i = 0; i < n; i++)
+			p[i] = toGrid(positions[offset + i]);
+		grid->interpolate(p, b, n);
+		for (size_t i = 0; i < n; i++)
+			fields[offset + i] = fromGrid(b[i]);
+	}
+}
+
+size_t EnsembleMagneticFieldGrid::getMemoryUsage() const {
+	return grid.valid() ? grid->getSizeOf() : 0;
 }
 
 } // namespace crpropa
@@ -1,11 +1,27 @@
 #include "crpropa/magneticField/turbulentField/GridTurbulence.h"
 #include "crpropa/GridTools.h"
 #include "crpropa/Random.h"
+#include "crpropa/Trace.h"
 
 #ifdef CRPROPA_HAVE_FFTW3F
 
+#include "crpropa/MappedGrid.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+
+#if _OPENMP
+#include <omp.h>
+#endif
+
 namespace crpropa {
 
+// the FFTW planner is not thread-safe
+static std::mutex plannerMutex;
+static std::string wisdomFile;
+
 
 GridTurbulence::GridTurbulence(const TurbulenceSpectrum &spectrum,
                                const GridProperties &gridProp,
@@ -26,97 +42,112 @@ Vector3d GridTurbulence::getField(const Vector3d &pos) const {
 
 const ref_ptr<Grid3f> &GridTurbulence::getGrid() const { return gridPtr; }
 
+size_t GridTurbulence::getMemoryUsage() const { return gridPtr->getSizeOf(); }
+
+// Set the modes of the row (ix, iy) of the x, y and z components, the modes
+// of a component are spaced by stride
+static void setModeRow(const TurbulenceSpectrum &spectrum, double spacing, size_t n,
+                       size_t ix, size_t iy, const double *uniform,
+                       fftwf_complex *const *B, size_t stride) {
+	size_t n2 = (size_t)floor(n / 2) +
+	            1; // size array in z-direction in configuration space
+
+	// the n possible discrete wave numbers
+	double Kx = ((double)ix / n - ix / (n / 2));
+	double Ky = ((double)iy / n - iy / (n / 2));
+
+	// double kMin = 2*M_PI / lMax; // * 2 * spacing.x; // spacing.x / lMax;
+	// double kMax = 2*M_PI / lMin; // * 2 * spacing.x; // spacing.x / lMin;
+	double kMin = spacing / spectrum.getLmax();
+	double kMax = spacing / spectrum.getLmin();
+	auto lambda = spectrum.getLbendover() / spacing * 2 * M_PI;
+
+	Vector3f n0(1, 1, 1); // arbitrary vector to construct orthogonal base
+
+	for (size_t iz = 0; iz < n2; iz++) {
+
+		Vector3f ek, e1, e2;  // orthogonal base
+
+		float *bx = B[0][iz * stride], *by = B[1][iz * stride], *bz = B[2][iz * stride];
+		ek.setXYZ(Kx, Ky, ((double)iz / n - iz / (n / 2)));
+		double k = ek.getR();
+
+		// wave outside of turbulent range -> B(k) = 0
+		if ((k < kMin) || (k > kMax)) {
+			bx[0] = 0;
+			bx[1] = 0;
+			by[0] = 0;
+			by[1] = 0;
+			bz[0] = 0;
+			bz[1] = 0;
+			continue;
+		}
+
+		// construct an orthogonal base ek, e1, e2
+		if (ek.isParallelTo(n0, float(1e-3))) {
+			// ek parallel to (1,1,1)
+			e1.setXYZ(-1., 1., 0);
+			e2.setXYZ(1., 1., -2.);
+		} else {
+			// ek not parallel to (1,1,1)
+			e1 = n0.cross(ek);
+			e2 = ek.cross(e1);
+		}
+		e1 /= e1.getR();
+		e2 /= e2.getR();
+
+		// random orientation perpendicular to k
+		double theta = 2 * M_PI * uniform[2 * iz];
+		Vector3f b = e1 * std::cos(theta) + e2 * std::sin(theta); // real b-field vector
+
+		// normal distributed amplitude with mean = 0
+		b *= std::sqrt(spectrum.energySpectrum(k*lambda));
+
+		// uniform random phase
+		double phase = 2 * M_PI * uniform[2 * iz + 1];
+		double cosPhase = std::cos(phase); // real part
+		double sinPhase = std::sin(phase); // imaginary part
+
+		bx[0] = b.x * cosPhase;
+		bx[1] = b.x * sinPhase;
+		by[0] = b.y * cosPhase;
+		by[1] = b.y * sinPhase;
+		bz[0] = b.z * cosPhase;
+		bz[1] = b.z * sinPhase;
+	} // for iz
+}
+
 void GridTurbulence::initTurbulence() {
+	CRPROPA_TRACE_SPAN("GridTurbulence::initTurbulence", "fft");
 
 	Vector3d spacing = gridPtr->getSpacing();
 	size_t n = gridPtr->getNx(); // size of array
 	size_t n2 = (size_t)floor(n / 2) +
 	            1; // size array in z-direction in configuration space
 
-	// arrays to hold the complex vector components of the B(k)-field
-	fftwf_complex *Bkx, *Bky, *Bkz;
-	Bkx = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * n * n * n2);
-	Bky = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * n * n * n2);
-	Bkz = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * n * n * n2);
+	// complex vector components of the B(k)-field, one after another
+	size_t nModes = n * n * n2;
+	fftwf_complex *Bk = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * 3 * nModes);
+	fftwf_plan plan = planInverseFFT(gridPtr, Bk);
 
 	Random random;
 	if (seed != 0)
 		random.seed(seed); // use given seed
 
-	// calculate the n possible discrete wave numbers
-	double K[n];
-	for (size_t i = 0; i < n; i++)
-		K[i] = ((double)i / n - i / (n / 2));
-
-	// double kMin = 2*M_PI / lMax; // * 2 * spacing.x; // spacing.x / lMax;
-	// double kMax = 2*M_PI / lMin; // * 2 * spacing.x; // spacing.x / lMin;
-	double kMin = spacing.x / spectrum.getLmax();
-	double kMax = spacing.x / spectrum.getLmin();
-	auto lambda = spectrum.getLbendover() / spacing.x * 2 * M_PI;
-
-	Vector3f n0(1, 1, 1); // arbitrary vector to construct orthogonal base
+	// uniform numbers for the orientation and phase of the modes of a row
+	std::vector<double> uniform(2 * n2);
 
 	for (size_t ix = 0; ix < n; ix++) {
 		for (size_t iy = 0; iy < n; iy++) {
-			for (size_t iz = 0; iz < n2; iz++) {
-	
-				Vector3f ek, e1, e2;  // orthogonal base
-
-				size_t i = ix * n * n2 + iy * n2 + iz;
-				ek.setXYZ(K[ix], K[iy], K[iz]);
-				double k = ek.getR();
-
-				// wave outside of turbulent range -> B(k) = 0
-				if ((k < kMin) || (k > kMax)) {
-					Bkx[i][0] = 0;
-					Bkx[i][1] = 0;
-					Bky[i][0] = 0;
-					Bky[i][1] = 0;
-					Bkz[i][0] = 0;
-					Bkz[i][1] = 0;
-					continue;
-				}
-
-				// construct an orthogonal base ek, e1, e2
-				if (ek.isParallelTo(n0, float(1e-3))) {
-					// ek parallel to (1,1,1)
-					e1.setXYZ(-1., 1., 0);
-					e2.setXYZ(1., 1., -2.);
-				} else {
-					// ek not parallel to (1,1,1)
-					e1 = n0.cross(ek);
-					e2 = ek.cross(e1);
-				}
-				e1 /= e1.getR();
-				e2 /= e2.getR();
-
-				// random orientation perpendicular to k
-				double theta = 2 * M_PI * random.rand();
-				Vector3f b = e1 * std::cos(theta) + e2 * std::sin(theta); // real b-field vector
-
-				// normal distributed amplitude with mean = 0
-				b *= std::sqrt(spectrum.energySpectrum(k*lambda));
-				
-				// uniform random phase
-				double phase = 2 * M_PI * random.rand();
-				double cosPhase = std::cos(phase); // real part
-				double sinPhase = std::sin(phase); // imaginary part
-
-				Bkx[i][0] = b.x * cosPhase;
-				Bkx[i][1] = b.x * sinPhase;
-				Bky[i][0] = b.y * cosPhase;
-				Bky[i][1] = b.y * sinPhase;
-				Bkz[i][0] = b.z * cosPhase;
-				Bkz[i][1] = b.z * sinPhase;
-			} // for iz
+			random.fillUniform(uniform.data(), uniform.size());
+			size_t i = ix * n * n2 + iy * n2;
+			fftwf_complex *row[3] = {Bk + i, Bk + nModes + i, Bk + 2 * nModes + i};
+			setModeRow(spectrum, spacing.x, n, ix, iy, uniform.data(), row, 1);
 		}     // for iy
 	}         // for ix
 
-	executeInverseFFTInplace(gridPtr, Bkx, Bky, Bkz);
-
-	fftwf_free(Bkx);
-	fftwf_free(Bky);
-	fftwf_free(Bkz);
+	executeInverseFFT(plan);
+	fftwf_free(Bk);
 
 	scaleGrid(gridPtr, spectrum.getBrms() /
 	                       rmsFieldStrength(gridPtr)); // normalize to Brms
@@ -125,10 +156,16 @@ void GridTurbulence::initTurbulence() {
 // Check the grid properties before the FFT procedure
 void GridTurbulence::checkGridRequirements(ref_ptr<Grid3f> grid, double lMin,
                                            double lMax) {
-	size_t Nx = grid->getNx();
-	size_t Ny = grid->getNy();
-	size_t Nz = grid->getNz();
-	Vector3d spacing = grid->getSpacing();
+	checkGridRequirements(GridProperties(grid->getOrigin(), grid->getNx(), grid->getNy(),
+	                                     grid->getNz(), grid->getSpacing()), lMin, lMax);
+}
+
+void GridTurbulence::checkGridRequirements(const GridProperties &p, double lMin,
+                                           double lMax) {
+	size_t Nx = p.Nx;
+	size_t Ny = p.Ny;
+	size_t Nz = p.Nz;
+	Vector3d spacing = p.spacing;
 
 	if ((Nx != Ny) or (Ny != Nz))
 		throw std::runtime_error("turbulentField: only cubic grid supported");
@@ -140,46 +177,252 @@ void GridTurbulence::checkGridRequirements(ref_ptr<Grid3f> grid, double lMin,
 		throw std::runtime_error("turbulentField: lMax > size");
 }
 
-// Execute inverse discrete FFT in-place for a 3D grid, from complex to real
-// space
+// Serializes the planning, sets the number of threads and loads and stores
+// the wisdom around the planning of one transform
+class Planner {
+	std::lock_guard<std::mutex> lock;
+public:
+	Planner() : lock(plannerMutex) {
+#ifdef CRPROPA_HAVE_FFTW3F_THREADS
+		static bool threads = (fftwf_init_threads() != 0);
+		if (threads) {
+#if _OPENMP
+			fftwf_plan_with_nthreads(omp_get_max_threads());
+#else
+			fftwf_plan_with_nthreads(1);
+#endif
+		}
+#endif
+		if (!wisdomFile.empty())
+			fftwf_import_wisdom_from_filename(wisdomFile.c_str());
+	}
+	unsigned flags() const {
+		return wisdomFile.empty() ? FFTW_ESTIMATE : FFTW_MEASURE;
+	}
+	fftwf_plan done(fftwf_plan plan) const {
+		if (!plan)
+			throw std::runtime_error("turbulentField: could not plan the FFT");
+		if (!wisdomFile.empty())
+			fftwf_export_wisdom_to_filename(wisdomFile.c_str());
+		return plan;
+	}
+};
+
+// Plan the complex to real transform of howmany components of B(k), spaced
+// by n * n * n2 modes, into the interleaved components of the grid
+static fftwf_plan planComponents(ref_ptr<Grid3f> grid, fftwf_complex *Bk, float *out,
+                                 int howmany, bool estimate) {
+	if (grid->getLayout() != GridLinear)
+		throw std::runtime_error("turbulentField: only the linear grid layout is supported");
+	ptrdiff_t n = grid->getNx();
+	ptrdiff_t n2 = n / 2 + 1;
+
+	// 64 bit strides, the modes of one component exceed 2^31 for n = 2048
+	fftwf_iodim64 dims[3] = {{n, n * n2, 3 * n * n}, {n, n2, 3 * n}, {n, 1, 3}};
+	fftwf_iodim64 batch = {howmany, n * n2 * n, 1};
+
+	// including the wait for the planner
+	CRPROPA_TRACE_SPAN("GridTurbulence::planFFT", "fft");
+	Planner planner;
+	unsigned flags = estimate ? FFTW_ESTIMATE : planner.flags();
+	return planner.done(fftwf_plan_guru64_dft_c2r(3, dims, 1, &batch, Bk, out, flags));
+}
+
+// Execute inverse discrete FFT for a 3D grid, from complex to real space
 void GridTurbulence::executeInverseFFTInplace(ref_ptr<Grid3f> grid,
                                               fftwf_complex *Bkx,
                                               fftwf_complex *Bky,
                                               fftwf_complex *Bkz) {
+	// the modes are already set, estimating does not touch them
+	fftwf_complex *Bk[3] = {Bkx, Bky, Bkz};
+	for (int c = 0; c < 3; c++) {
+		fftwf_plan plan = planComponents(grid, Bk[c], &grid->get(0, 0, 0).x + c, 1, true);
+		executeInverseFFT(plan);
+	}
+}
 
-	size_t n = grid->getNx(); // size of array
-	size_t n2 = (size_t)floor(n / 2) +
-	            1; // size array in z-direction in configuration space
+fftwf_plan GridTurbulence::planInverseFFT(ref_ptr<Grid3f> grid, fftwf_complex *Bk) {
+	return planComponents(grid, Bk, &grid->get(0, 0, 0).x, 3, false);
+}
 
-	// in-place, complex to real, inverse Fourier transformation on each
-	// component note that the last elements of B(x) are unused now
-	float *Bx = (float *)Bkx;
-	fftwf_plan plan_x = fftwf_plan_dft_c2r_3d(n, n, n, Bkx, Bx, FFTW_ESTIMATE);
-	fftwf_execute(plan_x);
-	fftwf_destroy_plan(plan_x);
+void GridTurbulence::executeInverseFFT(fftwf_plan plan) {
+	CRPROPA_TRACE_SPAN("GridTurbulence::executeFFT", "fft");
+	fftwf_execute(plan);
+	std::lock_guard<std::mutex> lock(plannerMutex);
+	fftwf_destroy_plan(plan);
+}
 
-	float *By = (float *)Bky;
-	fftwf_plan plan_y = fftwf_plan_dft_c2r_3d(n, n, n, Bky, By, FFTW_ESTIMATE);
-	fftwf_execute(plan_y);
-	fftwf_destroy_plan(plan_y);
+void GridTurbulence::setWisdomFile(const std::string &filename) {
+	std::lock_guard<std::mutex> lock(plannerMutex);
+	wisdomFile = filename;
+}
 
-	float *Bz = (float *)Bkz;
-	fftwf_plan plan_z = fftwf_plan_dft_c2r_3d(n, n, n, Bkz, Bz, FFTW_ESTIMATE);
-	fftwf_execute(plan_z);
-	fftwf_destroy_plan(plan_z);
+std::string GridTurbulence::getWisdomFile() {
+	std::lock_guard<std::mutex> lock(plannerMutex);
+	return wisdomFile;
+}
 
-	// save to grid
-	for (size_t ix = 0; ix < n; ix++) {
-		for (size_t iy = 0; iy < n; iy++) {
-			for (size_t iz = 0; iz < n; iz++) {
-				size_t i = ix * n * 2 * n2 + iy * 2 * n2 + iz;
-				Vector3f &b = grid->get(ix, iy, iz);
-				b.x = Bx[i];
-				b.y = By[i];
-				b.z = Bz[i];
+namespace {
+// owner of a buffer of FFTW
+struct FFTWBuffer {
+	void *data;
+	FFTWBuffer(size_t bytes) : data(fftwf_malloc(bytes)) {
+		if (!data)
+			throw std::runtime_error("turbulentField: could not allocate " +
+			                         std::to_string(bytes) + " bytes");
+	}
+	~FFTWBuffer() {
+		fftwf_free(data);
+	}
+};
+
+// owner of a plan that is executed repeatedly
+struct FFTWPlan {
+	fftwf_plan plan;
+	FFTWPlan() : plan(0) {
+	}
+	~FFTWPlan() {
+		reset(0);
+	}
+	void reset(fftwf_plan p) {
+		if (plan) {
+			std::lock_guard<std::mutex> lock(plannerMutex);
+			fftwf_destroy_plan(plan);
+		}
+		plan = p;
+	}
+};
+} // namespace
+
+// In-place inverse transforms of length n along an axis with the given
+// stride, for all stride contiguous rows
+static fftwf_plan planAxis(fftwf_complex *data, ptrdiff_t n, ptrdiff_t stride) {
+	fftwf_iodim64 dim = {n, stride, stride};
+	fftwf_iodim64 batch = {stride, 1, 1};
+	Planner planner;
+	return planner.done(fftwf_plan_guru64_dft(1, &dim, 1, &batch, data, data,
+	                                          FFTW_BACKWARD, planner.flags()));
+}
+
+// Complex to real transforms along z of rows of three interleaved components
+static fftwf_plan planRows(fftwf_complex *in, float *out, ptrdiff_t n, ptrdiff_t rows) {
+	ptrdiff_t n2 = n / 2 + 1;
+	fftwf_iodim64 dim = {n, 3, 3};
+	fftwf_iodim64 batch[2] = {{rows, 3 * n2, 3 * n}, {3, 1, 1}};
+	Planner planner;
+	return planner.done(fftwf_plan_guru64_dft_c2r(1, &dim, 2, batch, in, out, planner.flags()));
+}
+
+void GridTurbulence::generateToFile(const TurbulenceSpectrum &spectrum,
+                                    const GridProperties &p,
+                                    const std::string &filename, unsigned int seed,
+                                    size_t memoryLimit) {
+	CRPROPA_TRACE_SPAN("GridTurbulence::generateToFile", "fft");
+	checkGridRequirements(p, spectrum.getLmin(), spectrum.getLmax());
+	ptrdiff_t n = p.Nx;
+	ptrdiff_t n2 = n / 2 + 1;
+	ptrdiff_t rowModes = 3 * n2; // modes of a row, the components interleaved
+	const size_t complexSize = sizeof(fftwf_complex);
+
+	std::string scratchFile = filename + ".scratch";
+	std::fstream scratch(scratchFile.c_str(), std::ios::in | std::ios::out |
+	                     std::ios::binary | std::ios::trunc);
+	if (!scratch)
+		throw std::runtime_error("turbulentField: could not create " + scratchFile);
+
+	try {
+		// transforms along y of every x-plane, the modes are drawn in the
+		// order of initTurbulence
+		{
+			FFTWBuffer plane(complexSize * n * rowModes);
+			fftwf_complex *P = (fftwf_complex *)plane.data;
+			FFTWPlan planY;
+			planY.reset(planAxis(P, n, rowModes));
+
+			Random random;
+			if (seed != 0)
+				random.seed(seed); // use given seed
+			std::vector<double> uniform(2 * n2);
+			for (ptrdiff_t ix = 0; ix < n; ix++) {
+				for (ptrdiff_t iy = 0; iy < n; iy++) {
+					random.fillUniform(uniform.data(), uniform.size());
+					fftwf_complex *row = P + iy * rowModes;
+					fftwf_complex *B[3] = {row, row + 1, row + 2};
+					setModeRow(spectrum, p.spacing.x, n, ix, iy, uniform.data(), B, 3);
+				}
+				fftwf_execute(planY.plan);
+				scratch.write((const char *)P, complexSize * n * rowModes);
+			}
+			if (!scratch)
+				throw std::runtime_error("turbulentField: could not write " + scratchFile);
+		}
+
+		// transforms along x and z of blocks of y-rows
+		MappedGrid3f::create(filename, p);
+		std::fstream out(filename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+		if (!out)
+			throw std::runtime_error("turbulentField: could not open " + filename);
+		size_t rowBytes = n * (complexSize * rowModes + 3 * sizeof(float) * n);
+		ptrdiff_t Y = std::max(ptrdiff_t(1), std::min(n, ptrdiff_t(memoryLimit / rowBytes)));
+		FFTWBuffer blockModes(complexSize * n * Y * rowModes);
+		FFTWBuffer blockValues(3 * sizeof(float) * n * Y * n);
+		fftwf_complex *Q = (fftwf_complex *)blockModes.data;
+		float *R = (float *)blockValues.data;
+		FFTWPlan planX, planZ;
+		ptrdiff_t planned = 0;
+		double sumB2 = 0;
+		for (ptrdiff_t y0 = 0; y0 < n; y0 += Y) {
+			ptrdiff_t ny = std::min(Y, n - y0);
+			if (ny != planned) {
+				// planning may overwrite the buffers, so it precedes the reading
+				planX.reset(planAxis(Q, n, ny * rowModes));
+				planZ.reset(planRows(Q, R, n, n * ny));
+				planned = ny;
 			}
+			for (ptrdiff_t ix = 0; ix < n; ix++) {
+				scratch.seekg(complexSize * (ix * n + y0) * rowModes);
+				scratch.read((char *)(Q + ix * ny * rowModes), complexSize * ny * rowModes);
+			}
+			if (!scratch)
+				throw std::runtime_error("turbulentField: could not read " + scratchFile);
+			fftwf_execute(planX.plan);
+			fftwf_execute(planZ.plan);
+
+			long nValues = 3 * n * ny * n;
+#pragma omp parallel for reduction(+:sumB2)
+			for (long i = 0; i < nValues; i++)
+				sumB2 += double(R[i]) * R[i];
+			for (ptrdiff_t ix = 0; ix < n; ix++) {
+				out.seekp(MappedGrid3f::dataOffset + 3 * sizeof(float) * (ix * n + y0) * n);
+				out.write((const char *)(R + 3 * ix * ny * n), 3 * sizeof(float) * ny * n);
+			}
+			if (!out)
+				throw std::runtime_error("turbulentField: could not write " + filename);
+		}
+
+		// normalize to Brms
+		float scale = spectrum.getBrms() / std::sqrt(sumB2 / n / n / n);
+		size_t total = 3 * n * n * n, chunk = 3 * n * Y * n;
+		for (size_t offset = 0; offset < total; offset += chunk) {
+			size_t m = std::min(chunk, total - offset);
+			std::streamoff position = MappedGrid3f::dataOffset + sizeof(float) * offset;
+			out.seekg(position);
+			out.read((char *)R, sizeof(float) * m);
+#pragma omp parallel for
+			for (long i = 0; i < long(m); i++)
+				R[i] *= scale;
+			out.seekp(position);
+			out.write((const char *)R, sizeof(float) * m);
 		}
+		if (!out)
+			throw std::runtime_error("turbulentField: could not write " + filename);
+	} catch (...) {
+		scratch.close();
+		std::remove(scratchFile.c_str());
+		throw;
 	}
+	scratch.close();
+	std::remove(scratchFile.c_str());
 }
 
 Vector3f GridTurbulence::getMeanFieldVector() const {
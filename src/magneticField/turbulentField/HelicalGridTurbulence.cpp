@@ -26,11 +26,11 @@ void HelicalGridTurbulence::initTurbulence(ref_ptr<Grid3f> grid, double Brms,
 	size_t n2 = (size_t)floor(n / 2) +
 	            1; // size array in z-direction in configuration space
 
-	// arrays to hold the complex vector components of the B(k)-field
-	fftwf_complex *Bkx, *Bky, *Bkz;
-	Bkx = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * n * n * n2);
-	Bky = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * n * n * n2);
-	Bkz = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * n * n * n2);
+	// complex vector components of the B(k)-field, one after another
+	size_t nModes = n * n * n2;
+	fftwf_complex *Bk = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * 3 * nModes);
+	fftwf_complex *Bkx = Bk, *Bky = Bk + nModes, *Bkz = Bk + 2 * nModes;
+	fftwf_plan plan = planInverseFFT(grid, Bk);
 
 	Random random;
 	if (seed != 0)
@@ -120,7 +120,8 @@ void HelicalGridTurbulence::initTurbulence(ref_ptr<Grid3f> grid, double Brms,
 		}     // for iy
 	}         // for ix
 
-	executeInverseFFTInplace(grid, Bkx, Bky, Bkz);
+	executeInverseFFT(plan);
+	fftwf_free(Bk);
 
 	scaleGrid(grid, Brms / rmsFieldStrength(grid)); // normalize to Brms
 }
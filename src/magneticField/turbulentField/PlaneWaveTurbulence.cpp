@@ -46,17 +46,93 @@
 
 #include "kiss/logger.h"
 
+#include <algorithm>
 #include <iostream>
-
-#ifdef FAST_WAVES
+#include <memory>
+
+// The SIMD kernels are compiled with target attributes instead of global
+// compiler flags and selected at run time, so that the library runs on every
+// CPU of its architecture.
+#if defined(FAST_WAVES) && (defined(__GNUC__) || defined(__clang__)) &&        \
+    (defined(__x86_64__) || defined(__i386__))
+#define SIMD_WAVES_X86
 #include <immintrin.h>
 #endif
+#if defined(FAST_WAVES) && defined(__aarch64__) && defined(__ARM_NEON)
+#define SIMD_WAVES_NEON
+#include <arm_neon.h>
+#endif
+#if defined(SIMD_WAVES_X86) || defined(SIMD_WAVES_NEON)
+#define SIMD_WAVES
+#endif
 
 namespace crpropa {
-#ifdef FAST_WAVES
+
+// Index bases into the SIMD data array. Since each subarray has simd_Nm
+// elements, the start offset of each subarray can be computed by multiplying
+// the two, and then adding on the alignment offset.
+enum {
+	// iAxi is a combined array containing the product of Ak * xi
+	iAxi0,
+	iAxi1,
+	iAxi2,
+	// ikkappa is a combined array containing the product of k * kappa / pi
+	ikkappa0,
+	ikkappa1,
+	ikkappa2,
+	// ibeta contains beta / pi
+	ibeta,
+	itotal
+};
+
+// The kernels sum the n modes of the arrays at data + n * index. They
+// evaluate cos(pi * x) as a polynomial in the reduced argument s = x - round(x),
+// with the sign flipped for odd round(x).
+
+// coefficients of the polynomial in s^2, generated using sleefs gencoef.c
+static const double cosCoefficients[5] = {
+    +0.2211852080653743946e+0, -0.1332560668688523853e+1,
+    +0.4058509506474178075e+1, -0.4934797516664651162e+1, 1.};
+
+#ifdef SIMD_WAVES
+// Modes per block of getFields, the 7 arrays of a block stay in the L1 cache
+// while the field is summed for all positions
+static const int modeBlock = 256;
+
+// Adds the modes [i0, i1) of the n modes to the fields at P positions
+typedef void (*WaveBlock)(const double *data, int n, int i0, int i1,
+                          const Vector3d *positions, Vector3d *fields);
+
+template <WaveBlock block>
+static Vector3d singleField(const double *data, int n, const Vector3d &pos) {
+	Vector3d B(0.);
+	block(data, n, 0, n, &pos, &B);
+	return B;
+}
+
+// Loops over the blocks of modes and, within a block, over groups of four
+// positions, the mode data is loaded once per group and the four positions
+// are evaluated from the registers
+template <WaveBlock block1, WaveBlock block4>
+static void blockedFields(const double *data, int n, const Vector3d *positions,
+                          Vector3d *fields, size_t count) {
+	for (size_t j = 0; j < count; j++)
+		fields[j] = Vector3d(0.);
+	for (int i0 = 0; i0 < n; i0 += modeBlock) {
+		int i1 = std::min(n, i0 + modeBlock);
+		size_t j = 0;
+		for (; j + 4 <= count; j += 4)
+			block4(data, n, i0, i1, positions + j, fields + j);
+		for (; j < count; j++)
+			block1(data, n, i0, i1, positions + j, fields + j);
+	}
+}
+#endif // SIMD_WAVES
+
+#ifdef SIMD_WAVES_X86
 // see
 // https://stackoverflow.com/questions/49941645/get-sum-of-values-stored-in-m256d-with-sse-avx
-double hsum_double_avx(__m256d v) {
+__attribute__((target("avx"))) static double hsum_double_avx(__m256d v) {
 	__m128d vlow = _mm256_castpd256_pd128(v);
 	__m128d vhigh = _mm256_extractf128_pd(v, 1); // high 128
 	vlow = _mm_add_pd(vlow, vhigh);              // reduce down to 128
@@ -65,53 +141,344 @@ double hsum_double_avx(__m256d v) {
 	return _mm_cvtsd_f64(_mm_add_sd(vlow, high64)); // reduce to scalar
 }
 
-// code for hsum_float_avx taken from:
-// https://stackoverflow.com/questions/13219146/how-to-sum-m256-horizontally
-
-// x = ( x7, x6, x5, x4, x3, x2, x1, x0 )
-float hsum_float_avx(__m256 x) {
-	// hiQuad = ( x7, x6, x5, x4 )
-	const __m128 hiQuad = _mm256_extractf128_ps(x, 1);
-	// loQuad = ( x3, x2, x1, x0 )
-	const __m128 loQuad = _mm256_castps256_ps128(x);
-	// sumQuad = ( x3 + x7, x2 + x6, x1 + x5, x0 + x4 )
-	const __m128 sumQuad = _mm_add_ps(loQuad, hiQuad);
-	// loDual = ( -, -, x1 + x5, x0 + x4 )
-	const __m128 loDual = sumQuad;
-	// hiDual = ( -, -, x3 + x7, x2 + x6 )
-	const __m128 hiDual = _mm_movehl_ps(sumQuad, sumQuad);
-	// sumDual = ( -, -, x1 + x3 + x5 + x7, x0 + x2 + x4 + x6 )
-	const __m128 sumDual = _mm_add_ps(loDual, hiDual);
-	// lo = ( -, -, -, x0 + x2 + x4 + x6 )
-	const __m128 lo = sumDual;
-	// hi = ( -, -, -, x1 + x3 + x5 + x7 )
-	const __m128 hi = _mm_shuffle_ps(sumDual, sumDual, 0x1);
-	// sum = ( -, -, -, x0 + x1 + x2 + x3 + x4 + x5 + x6 + x7 )
-	const __m128 sum = _mm_add_ss(lo, hi);
-	return _mm_cvtss_f32(sum);
+// cos(pi * x) of four doubles
+__attribute__((target("avx"))) static inline __m256d cosPiAvx(__m256d x) {
+	// ********
+	// * Computing the cosine
+	// *
+	// * argument reduction
+	// step 1: compute round(x), and store it in q
+	__m256d q = _mm256_round_pd(
+	    x, (_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+
+	// we now compute s, which will be the input parameter to our polynomial
+	// approximation of cos(pi/2*x) between 0 and 1 the andnot_pd is just a
+	// fast way of taking the absolute value
+	__m256d s = _mm256_sub_pd(x, q);
+
+	// the following based on the int extraction process described here:
+	// https://stackoverflow.com/questions/41144668/how-to-efficiently-perform-double-int64-conversions-with-sse-avx/41223013
+	// we assume -2^51 <= q < 2^51 for this, which is unproblematic, as
+	// double precision has decayed far enough at that point that the cosine
+	// would be useless anyway.
+
+	// we now want to check whether q is even or odd, because the cosine is
+	// negative for odd qs, so we'll have to flip the final result. on an
+	// int, this is as simple as checking the 0th bit.
+	// => manipulate the double in such a way that we can do this.
+	// so, we add 2^52, such that the last digit of the mantissa is actually
+	// in the ones position. since q may be negative, we'll also add 2^51 to
+	// make sure it's positive. note that 2^51 is even and thus leaves
+	// evenness invariant, which is the only thing we care about here.
+
+	q = _mm256_add_pd(q, _mm256_set1_pd(0x0018000000000000));
+
+	// unfortunately, integer comparisons were only introduced in avx2, so
+	// we'll have to make do with a floating point comparison to check
+	// whether the last bit is set. however, masking out all but the last
+	// bit will result in a denormal float, which may either result in
+	// performance problems or just be rounded down to zero, neither of
+	// which is what we want here. To fix this, we'll mask in not only bit
+	// 0, but also the exponent (and sign, but that doesn't matter) of q.
+	// Luckily, the exponent of q is guaranteed to have the fixed value of
+	// 1075 (corresponding to 2^52) after our addition.
+
+	__m256d invert = _mm256_and_pd(
+	    q, _mm256_castsi256_pd(_mm256_set1_epi64x(0xfff0000000000001)));
+
+	// if we did have a one in bit 0, our result will be equal to 2^52 + 1
+	invert = _mm256_cmp_pd(
+	    invert, _mm256_castsi256_pd(_mm256_set1_epi64x(0x4330000000000001)),
+	    _CMP_EQ_OQ);
+
+	// finally, we need to turn invert and right_invert into masks for the
+	// sign bit on each final double, ie
+	invert = _mm256_and_pd(invert, _mm256_set1_pd(-0.0));
+
+	// TODO: clamp floats between 0 and 1? This would ensure that we never
+	// see inf's, but maybe we want that, so that things dont just fail
+	// silently...
+
+	// * end of argument reduction
+	// *******
+
+	// ******
+	// * evaluate the cosine using a polynomial approximation
+	// * the coefficients for this were generated using sleefs gencoef.c
+	// * These coefficients are probably far from optimal.
+	// * However, they should be sufficient for this case.
+	s = _mm256_mul_pd(s, s);
+
+	__m256d u = _mm256_set1_pd(cosCoefficients[0]);
+	for (int c = 1; c < 5; c++)
+		u = _mm256_add_pd(_mm256_mul_pd(u, s),
+		                  _mm256_set1_pd(cosCoefficients[c]));
+
+	// then, flip the sign of each double for which invert is not zero.
+	// since invert has only zero bits except for a possible one in bit 63,
+	// we can xor it onto our result to selectively invert the 63st (sign)
+	// bit in each double where invert is set.
+	u = _mm256_xor_pd(u, invert);
+
+	// * end computation of cosine
+	// **********
+	return u;
+}
+
+// The AVX kernel, with P positions per pass over the modes.
+template <int P>
+__attribute__((target("avx"))) static void
+avxBlock(const double *data, int n, int i0, int i1, const Vector3d *pos,
+         Vector3d *fields) {
+	// Initialize accumulators
+	//
+	// There is one accumulator per component of the result vector and
+	// position. Note that each accumulator contains four numbers. At the end
+	// of the loop, each of these number will contain the sum of every
+	// fourth wavemodes, starting at a different offset. In the end, all
+	// of the accumulator's numbers are added together (using
+	// hsum_double_avx), resulting in the total sum.
+	__m256d acc0[P], acc1[P], acc2[P];
+	for (int p = 0; p < P; p++) {
+		acc0[p] = _mm256_setzero_pd();
+		acc1[p] = _mm256_setzero_pd();
+		acc2[p] = _mm256_setzero_pd();
+	}
+
+	for (int i = i0; i < i1; i += 4) {
+		// load data from memory into AVX registers
+		__m256d Axi0 = _mm256_load_pd(data + i + n * iAxi0);
+		__m256d Axi1 = _mm256_load_pd(data + i + n * iAxi1);
+		__m256d Axi2 = _mm256_load_pd(data + i + n * iAxi2);
+
+		__m256d kkappa0 = _mm256_load_pd(data + i + n * ikkappa0);
+		__m256d kkappa1 = _mm256_load_pd(data + i + n * ikkappa1);
+		__m256d kkappa2 = _mm256_load_pd(data + i + n * ikkappa2);
+
+		__m256d beta = _mm256_load_pd(data + i + n * ibeta);
+
+		for (int p = 0; p < P; p++) {
+			// this is the scalar product between k*kappa and pos
+			__m256d z = _mm256_add_pd(
+			    _mm256_mul_pd(_mm256_set1_pd(pos[p].x), kkappa0),
+			    _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(pos[p].y), kkappa1),
+			                  _mm256_mul_pd(_mm256_set1_pd(pos[p].z), kkappa2)));
+
+			// here, the phase is added on. this is the argument of the cosine.
+			__m256d u = cosPiAvx(_mm256_add_pd(z, beta));
+
+			// Finally, Ak*xi is multiplied on. Since this is a vector, the
+			// multiplication needs to be done for each of the three
+			// components, so it happens separately.
+			acc0[p] = _mm256_add_pd(_mm256_mul_pd(u, Axi0), acc0[p]);
+			acc1[p] = _mm256_add_pd(_mm256_mul_pd(u, Axi1), acc1[p]);
+			acc2[p] = _mm256_add_pd(_mm256_mul_pd(u, Axi2), acc2[p]);
+		}
+	}
+
+	for (int p = 0; p < P; p++)
+		fields[p] += Vector3d(hsum_double_avx(acc0[p]), hsum_double_avx(acc1[p]),
+		                      hsum_double_avx(acc2[p]));
+}
+
+// As cosPiAvx, with fused multiply-adds and the sign from the integer bit 0
+// of round(x) + 1.5 * 2^52.
+__attribute__((target("avx2,fma"))) static inline __m256d cosPiAvx2(__m256d x) {
+	__m256d q =
+	    _mm256_round_pd(x, (_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+	__m256d s = _mm256_sub_pd(x, q);
+	__m256i invert = _mm256_slli_epi64(
+	    _mm256_castpd_si256(_mm256_add_pd(q, _mm256_set1_pd(0x0018000000000000))),
+	    63);
+
+	s = _mm256_mul_pd(s, s);
+	__m256d u = _mm256_set1_pd(cosCoefficients[0]);
+	for (int c = 1; c < 5; c++)
+		u = _mm256_fmadd_pd(u, s, _mm256_set1_pd(cosCoefficients[c]));
+	return _mm256_castsi256_pd(_mm256_xor_si256(_mm256_castpd_si256(u), invert));
+}
+
+template <int P>
+__attribute__((target("avx2,fma"))) static void
+avx2Block(const double *data, int n, int i0, int i1, const Vector3d *pos,
+          Vector3d *fields) {
+	__m256d acc0[P], acc1[P], acc2[P];
+	for (int p = 0; p < P; p++) {
+		acc0[p] = _mm256_setzero_pd();
+		acc1[p] = _mm256_setzero_pd();
+		acc2[p] = _mm256_setzero_pd();
+	}
+
+	for (int i = i0; i < i1; i += 4) {
+		const double *d = data + i;
+		__m256d kkappa0 = _mm256_load_pd(d + n * ikkappa0);
+		__m256d kkappa1 = _mm256_load_pd(d + n * ikkappa1);
+		__m256d kkappa2 = _mm256_load_pd(d + n * ikkappa2);
+		__m256d beta = _mm256_load_pd(d + n * ibeta);
+		__m256d Axi0 = _mm256_load_pd(d + n * iAxi0);
+		__m256d Axi1 = _mm256_load_pd(d + n * iAxi1);
+		__m256d Axi2 = _mm256_load_pd(d + n * iAxi2);
+		for (int p = 0; p < P; p++) {
+			__m256d x = _mm256_fmadd_pd(
+			    _mm256_set1_pd(pos[p].x), kkappa0,
+			    _mm256_fmadd_pd(_mm256_set1_pd(pos[p].y), kkappa1,
+			                    _mm256_fmadd_pd(_mm256_set1_pd(pos[p].z), kkappa2, beta)));
+			__m256d u = cosPiAvx2(x);
+			acc0[p] = _mm256_fmadd_pd(u, Axi0, acc0[p]);
+			acc1[p] = _mm256_fmadd_pd(u, Axi1, acc1[p]);
+			acc2[p] = _mm256_fmadd_pd(u, Axi2, acc2[p]);
+		}
+	}
+
+	for (int p = 0; p < P; p++)
+		fields[p] += Vector3d(hsum_double_avx(acc0[p]), hsum_double_avx(acc1[p]),
+		                      hsum_double_avx(acc2[p]));
+}
+
+// As cosPiAvx2, for eight doubles
+__attribute__((target("avx512f"))) static inline __m512d cosPiAvx512(__m512d x) {
+	__m512d q =
+	    _mm512_roundscale_pd(x, (_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+	__m512d s = _mm512_sub_pd(x, q);
+	__m512i invert = _mm512_slli_epi64(
+	    _mm512_castpd_si512(_mm512_add_pd(q, _mm512_set1_pd(0x0018000000000000))),
+	    63);
+
+	s = _mm512_mul_pd(s, s);
+	__m512d u = _mm512_set1_pd(cosCoefficients[0]);
+	for (int c = 1; c < 5; c++)
+		u = _mm512_fmadd_pd(u, s, _mm512_set1_pd(cosCoefficients[c]));
+	return _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(u), invert));
+}
+
+template <int P>
+__attribute__((target("avx512f"))) static void
+avx512Block(const double *data, int n, int i0, int i1, const Vector3d *pos,
+            Vector3d *fields) {
+	__m512d acc0[P], acc1[P], acc2[P];
+	for (int p = 0; p < P; p++) {
+		acc0[p] = _mm512_setzero_pd();
+		acc1[p] = _mm512_setzero_pd();
+		acc2[p] = _mm512_setzero_pd();
+	}
+
+	for (int i = i0; i < i1; i += 8) {
+		const double *d = data + i;
+		__m512d kkappa0 = _mm512_load_pd(d + n * ikkappa0);
+		__m512d kkappa1 = _mm512_load_pd(d + n * ikkappa1);
+		__m512d kkappa2 = _mm512_load_pd(d + n * ikkappa2);
+		__m512d beta = _mm512_load_pd(d + n * ibeta);
+		__m512d Axi0 = _mm512_load_pd(d + n * iAxi0);
+		__m512d Axi1 = _mm512_load_pd(d + n * iAxi1);
+		__m512d Axi2 = _mm512_load_pd(d + n * iAxi2);
+		for (int p = 0; p < P; p++) {
+			__m512d x = _mm512_fmadd_pd(
+			    _mm512_set1_pd(pos[p].x), kkappa0,
+			    _mm512_fmadd_pd(_mm512_set1_pd(pos[p].y), kkappa1,
+			                    _mm512_fmadd_pd(_mm512_set1_pd(pos[p].z), kkappa2, beta)));
+			__m512d u = cosPiAvx512(x);
+			acc0[p] = _mm512_fmadd_pd(u, Axi0, acc0[p]);
+			acc1[p] = _mm512_fmadd_pd(u, Axi1, acc1[p]);
+			acc2[p] = _mm512_fmadd_pd(u, Axi2, acc2[p]);
+		}
+	}
+
+	for (int p = 0; p < P; p++)
+		fields[p] += Vector3d(_mm512_reduce_add_pd(acc0[p]),
+		                      _mm512_reduce_add_pd(acc1[p]),
+		                      _mm512_reduce_add_pd(acc2[p]));
+}
+#endif // SIMD_WAVES_X86
+
+#ifdef SIMD_WAVES_NEON
+// As cosPiAvx2, for two doubles
+static inline float64x2_t cosPiNeon(float64x2_t x) {
+	float64x2_t q = vrndnq_f64(x);
+	float64x2_t s = vsubq_f64(x, q);
+	uint64x2_t invert = vshlq_n_u64(vreinterpretq_u64_s64(vcvtq_s64_f64(q)), 63);
+
+	s = vmulq_f64(s, s);
+	float64x2_t u = vdupq_n_f64(cosCoefficients[0]);
+	for (int c = 1; c < 5; c++)
+		u = vfmaq_f64(vdupq_n_f64(cosCoefficients[c]), u, s);
+	return vreinterpretq_f64_u64(veorq_u64(vreinterpretq_u64_f64(u), invert));
+}
+
+template <int P>
+static void neonBlock(const double *data, int n, int i0, int i1,
+                      const Vector3d *pos, Vector3d *fields) {
+	float64x2_t acc0[P], acc1[P], acc2[P];
+	for (int p = 0; p < P; p++) {
+		acc0[p] = vdupq_n_f64(0.);
+		acc1[p] = vdupq_n_f64(0.);
+		acc2[p] = vdupq_n_f64(0.);
+	}
+
+	for (int i = i0; i < i1; i += 2) {
+		const double *d = data + i;
+		float64x2_t kkappa0 = vld1q_f64(d + n * ikkappa0);
+		float64x2_t kkappa1 = vld1q_f64(d + n * ikkappa1);
+		float64x2_t kkappa2 = vld1q_f64(d + n * ikkappa2);
+		float64x2_t beta = vld1q_f64(d + n * ibeta);
+		float64x2_t Axi0 = vld1q_f64(d + n * iAxi0);
+		float64x2_t Axi1 = vld1q_f64(d + n * iAxi1);
+		float64x2_t Axi2 = vld1q_f64(d + n * iAxi2);
+		for (int p = 0; p < P; p++) {
+			float64x2_t x = vfmaq_n_f64(beta, kkappa2, pos[p].z);
+			x = vfmaq_n_f64(x, kkappa1, pos[p].y);
+			x = vfmaq_n_f64(x, kkappa0, pos[p].x);
+			float64x2_t u = cosPiNeon(x);
+			acc0[p] = vfmaq_f64(acc0[p], u, Axi0);
+			acc1[p] = vfmaq_f64(acc1[p], u, Axi1);
+			acc2[p] = vfmaq_f64(acc2[p], u, Axi2);
+		}
+	}
+
+	for (int p = 0; p < P; p++)
+		fields[p] += Vector3d(vaddvq_f64(acc0[p]), vaddvq_f64(acc1[p]),
+		                      vaddvq_f64(acc2[p]));
 }
-#endif // defined(FAST_WAVES)
+#endif // SIMD_WAVES_NEON
+
+#ifdef CRPROPA_HAVE_OFFLOAD
+// Sum of the modes on the offload device with the exact cosine, in chunks
+// that are transferred and evaluated asynchronously, so that the transfers of
+// one chunk overlap with the evaluation of the others
+static void offloadFields(const double *data, int n, const Vector3d *positions,
+                          Vector3d *fields, size_t count) {
+	const double *p = positions[0].data;
+	double *f = fields[0].data;
+	const size_t nData = itotal * size_t(n);
+	const size_t chunk = 16384;
+	for (size_t j0 = 0; j0 < count; j0 += chunk) {
+		size_t m = std::min(chunk, count - j0);
+#pragma omp target teams distribute parallel for nowait                       \
+    map(to : data[0:nData], p[3 * j0:3 * m]) map(from : f[3 * j0:3 * m])
+		for (size_t j = j0; j < j0 + m; j++) {
+			double b0 = 0, b1 = 0, b2 = 0;
+			for (int i = 0; i < n; i++) {
+				double x = p[3 * j] * data[n * ikkappa0 + i] +
+				           p[3 * j + 1] * data[n * ikkappa1 + i] +
+				           p[3 * j + 2] * data[n * ikkappa2 + i] +
+				           data[n * ibeta + i];
+				double u = cos(M_PI * x);
+				b0 += u * data[n * iAxi0 + i];
+				b1 += u * data[n * iAxi1 + i];
+				b2 += u * data[n * iAxi2 + i];
+			}
+			f[3 * j] = b0;
+			f[3 * j + 1] = b1;
+			f[3 * j + 2] = b2;
+		}
+	}
+#pragma omp taskwait
+}
+#endif // CRPROPA_HAVE_OFFLOAD
 
 PlaneWaveTurbulence::PlaneWaveTurbulence(const TurbulenceSpectrum &spectrum,
                                          int Nm, int seed)
-    : TurbulentField(spectrum), Nm(Nm) {
-
-#ifdef FAST_WAVES
-	KISS_LOG_INFO << "PlaneWaveTurbulence: Using SIMD TD13 implementation"
-	              << std::endl;
-
-	// In principle, we could dynamically dispatch to the non-SIMD version in
-	// this case. However, this complicates the code, incurs runtime overhead,
-	// and is unlikely to happen since SSE3 is quite well supported.
-	// TODO: this is currently uncommented b/c sleef seems to fail to provide
-	// the cpuid function
-	// if (!check_sse()) {
-	//  throw std::runtime_error("TD13Field: This code was compiled with SIMD
-	//  support (SSE1-3), but it is running on a CPU that does not support these
-	//  instructions. Please set USE_SIMD to OFF in CMake and recompile
-	//  CRPropa.");
-	//}
-#endif
+    : TurbulentField(spectrum), Nm(Nm), simd_Nm(0), align_offset(0),
+      kernel(0), fieldsKernel(0) {
 
 	if (Nm <= 1) {
 		throw std::runtime_error(
@@ -145,6 +512,10 @@ PlaneWaveTurbulence::PlaneWaveTurbulence(const TurbulenceSpectrum &spectrum,
 	// on second thought, this is probably unnecessary since it's just a factor
 	// and will get normalized out anyways.
 
+	// uniform numbers for phi, costheta, alpha and beta of all modes
+	std::vector<double> uniform(4 * Nm);
+	random.fillUniform(uniform.data(), uniform.size());
+
 	double Ak2_sum = 0; // sum of Ak^2 over all k
 	// for this loop, the Ak array actually contains Gk*delta_k (ie
 	// non-normalized Ak^2)
@@ -160,12 +531,12 @@ PlaneWaveTurbulence::PlaneWaveTurbulence(const TurbulenceSpectrum &spectrum,
 		// z is costheta, and r is sintheta. Our kappa is equivalent to
 		// the return value of randVector(); however, TD13 then reuse
 		// these values to generate a random vector perpendicular to kappa.
-		double phi = random.randUniform(-M_PI, M_PI);
-		double costheta = random.randUniform(-1., 1.);
+		double phi = -M_PI + 2 * M_PI * uniform[4 * i];
+		double costheta = -1. + 2. * uniform[4 * i + 1];
 		double sintheta = sqrt(1 - costheta * costheta);
 
-		double alpha = random.randUniform(0, 2 * M_PI);
-		double beta = random.randUniform(0, 2 * M_PI);
+		double alpha = 2 * M_PI * uniform[4 * i + 2];
+		double beta = 2 * M_PI * uniform[4 * i + 3];
 
 		Vector3d kappa =
 		    Vector3d(sintheta * cos(phi), sintheta * sin(phi), costheta);
@@ -188,10 +559,11 @@ PlaneWaveTurbulence::PlaneWaveTurbulence(const TurbulenceSpectrum &spectrum,
 		Ak[i] = sqrt(2 * Ak[i] / Ak2_sum) * spectrum.getBrms();
 	}
 
-#ifdef FAST_WAVES
-	// * copy data into AVX-compatible arrays *
-	// AVX requires all data to be aligned to 256 bit, or 32 bytes, which is the
-	// same as 4 double precision floating point numbers. Since support for
+#if defined(SIMD_WAVES) || defined(CRPROPA_HAVE_OFFLOAD)
+	// * copy data into SIMD-compatible arrays *
+	// The aligned loads of AVX-512 require all data to be aligned to 512 bit,
+	// or 64 bytes, which is the same as 8 double precision floating point
+	// numbers. Since support for
 	// alignments this big seems to be somewhat tentative in C++ allocators,
 	// we're aligning them manually by allocating a normal double array, and
 	// then computing the offset to the first value with the correct alignment.
@@ -199,200 +571,160 @@ PlaneWaveTurbulence::PlaneWaveTurbulence(const TurbulenceSpectrum &spectrum,
 	// of the individual data arrays, we're doing it once for one big array that
 	// all of the component arrays get packed into.
 	//
-	// The other thing to keep in mind is that AVX always reads in units of 256
-	// bits, or 4 doubles. This means that our number of wavemodes must be
-	// divisible by 4. If it isn't, we simply pad it out with zeros. Since the
+	// The other thing to keep in mind is that AVX-512 always reads in units of
+	// 512 bits, or 8 doubles. This means that our number of wavemodes must be
+	// divisible by 8. If it isn't, we simply pad it out with zeros. Since the
 	// final step of the computation of each wavemode is multiplication by the
 	// amplitude, which will be set to 0, these padding wavemodes won't affect
 	// the result.
-	avx_Nm = ((Nm + 4 - 1) / 4) * 4; // round up to next larger multiple of 4:
-	                                 // align is 256 = 4 * sizeof(double) bit
-	avx_data = std::vector<double>(itotal * avx_Nm + 3, 0.);
+	simd_Nm = ((Nm + 8 - 1) / 8) * 8; // round up to next larger multiple of 8:
+	                                  // align is 512 = 8 * sizeof(double) bit
+	simd_data = std::vector<double>(itotal * simd_Nm + 7, 0.);
 
-	// get the first 256-bit aligned element
-	size_t size = avx_data.size() * sizeof(double);
-	void *pointer = avx_data.data();
+	// get the first 512-bit aligned element
+	size_t size = simd_data.size() * sizeof(double);
+	void *pointer = simd_data.data();
 	align_offset =
-	    (double *)std::align(32, 32, pointer, size) - avx_data.data();
+	    (double *)std::align(64, 64, pointer, size) - simd_data.data();
 
 	// copy
 	for (int i = 0; i < Nm; i++) {
-		avx_data[i + align_offset + avx_Nm * iAxi0] = Ak[i] * xi[i].x;
-		avx_data[i + align_offset + avx_Nm * iAxi1] = Ak[i] * xi[i].y;
-		avx_data[i + align_offset + avx_Nm * iAxi2] = Ak[i] * xi[i].z;
+		simd_data[i + align_offset + simd_Nm * iAxi0] = Ak[i] * xi[i].x;
+		simd_data[i + align_offset + simd_Nm * iAxi1] = Ak[i] * xi[i].y;
+		simd_data[i + align_offset + simd_Nm * iAxi2] = Ak[i] * xi[i].z;
 
 		// the cosine implementation computes cos(pi*x), so we'll divide out the
 		// pi here
-		avx_data[i + align_offset + avx_Nm * ikkappa0] =
+		simd_data[i + align_offset + simd_Nm * ikkappa0] =
 		    k[i] / M_PI * kappa[i].x;
-		avx_data[i + align_offset + avx_Nm * ikkappa1] =
+		simd_data[i + align_offset + simd_Nm * ikkappa1] =
 		    k[i] / M_PI * kappa[i].y;
-		avx_data[i + align_offset + avx_Nm * ikkappa2] =
+		simd_data[i + align_offset + simd_Nm * ikkappa2] =
 		    k[i] / M_PI * kappa[i].z;
 
 		// we also need to divide beta by pi, since that goes into the argument
 		// as well
-		avx_data[i + align_offset + avx_Nm * ibeta] = beta[i] / M_PI;
+		simd_data[i + align_offset + simd_Nm * ibeta] = beta[i] / M_PI;
+	}
+#endif // SIMD_WAVES || CRPROPA_HAVE_OFFLOAD
+
+#ifdef CRPROPA_HAVE_OFFLOAD
+	// the modes stay resident on the offload device
+	const double *d = simd_data.data() + align_offset;
+	size_t nData = itotal * size_t(simd_Nm);
+#pragma omp target enter data map(to: d[0:nData])
+#endif
+
+	setKernel(getSupportedKernels().back());
+	KISS_LOG_INFO << "PlaneWaveTurbulence: Using the " << kernelName
+	              << " kernel" << std::endl;
+}
+
+PlaneWaveTurbulence::~PlaneWaveTurbulence() {
+#ifdef CRPROPA_HAVE_OFFLOAD
+	const double *d = simd_data.data() + align_offset;
+	size_t nData = itotal * size_t(simd_Nm);
+#pragma omp target exit data map(delete : d[0:nData])
+#endif
+}
+
+std::vector<std::string> PlaneWaveTurbulence::getSupportedKernels() {
+	std::vector<std::string> kernels(1, "scalar");
+#ifdef SIMD_WAVES_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx"))
+		kernels.push_back("avx");
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		kernels.push_back("avx2");
+	if (__builtin_cpu_supports("avx512f"))
+		kernels.push_back("avx512");
+#endif
+#ifdef SIMD_WAVES_NEON
+	kernels.push_back("neon");
+#endif
+	return kernels;
+}
+
+void PlaneWaveTurbulence::setKernel(const std::string &name) {
+	std::vector<std::string> kernels = getSupportedKernels();
+	if (std::find(kernels.begin(), kernels.end(), name) == kernels.end())
+		throw std::runtime_error("PlaneWaveTurbulence: kernel " + name +
+		                         " is not supported by this build or CPU");
+	kernel = 0;
+	fieldsKernel = 0;
+#ifdef SIMD_WAVES_X86
+	if (name == "avx") {
+		kernel = singleField<avxBlock<1> >;
+		fieldsKernel = blockedFields<avxBlock<1>, avxBlock<4> >;
+	}
+	if (name == "avx2") {
+		kernel = singleField<avx2Block<1> >;
+		fieldsKernel = blockedFields<avx2Block<1>, avx2Block<4> >;
+	}
+	if (name == "avx512") {
+		kernel = singleField<avx512Block<1> >;
+		fieldsKernel = blockedFields<avx512Block<1>, avx512Block<4> >;
+	}
+#endif
+#ifdef SIMD_WAVES_NEON
+	if (name == "neon") {
+		kernel = singleField<neonBlock<1> >;
+		fieldsKernel = blockedFields<neonBlock<1>, neonBlock<4> >;
 	}
-#endif // FAST_WAVES
+#endif
+	kernelName = name;
+}
+
+std::string PlaneWaveTurbulence::getKernel() const {
+	return kernelName;
 }
 
 Vector3d PlaneWaveTurbulence::getField(const Vector3d &pos) const {
+	if (kernel)
+		return kernel(simd_data.data() + align_offset, simd_Nm, pos);
 
-#ifndef FAST_WAVES
 	Vector3d B(0.);
 	for (int i = 0; i < Nm; i++) {
 		double z_ = pos.dot(kappa[i]);
 		B += xi[i] * Ak[i] * cos(k[i] * z_ + beta[i]);
 	}
 	return B;
+}
 
-#else  // FAST_WAVES
-
-	// Initialize accumulators
-	//
-	// There is one accumulator per component of the result vector.
-	// Note that each accumulator contains four numbers. At the end of
-	// the loop, each of these number will contain the sum of every
-	// fourth wavemodes, starting at a different offset. In the end, all
-	// of the accumulator's numbers are added together (using
-	// hsum_double_avx), resulting in the total sum.
-
-	__m256d acc0 = _mm256_setzero_pd();
-	__m256d acc1 = _mm256_setzero_pd();
-	__m256d acc2 = _mm256_setzero_pd();
-
-	// broadcast position into AVX registers
-	__m256d pos0 = _mm256_set1_pd(pos.x);
-	__m256d pos1 = _mm256_set1_pd(pos.y);
-	__m256d pos2 = _mm256_set1_pd(pos.z);
-
-	for (int i = 0; i < avx_Nm; i += 4) {
-
-		// load data from memory into AVX registers
-		__m256d Axi0 =
-		    _mm256_load_pd(avx_data.data() + i + align_offset + avx_Nm * iAxi0);
-		__m256d Axi1 =
-		    _mm256_load_pd(avx_data.data() + i + align_offset + avx_Nm * iAxi1);
-		__m256d Axi2 =
-		    _mm256_load_pd(avx_data.data() + i + align_offset + avx_Nm * iAxi2);
-
-		__m256d kkappa0 = _mm256_load_pd(avx_data.data() + i + align_offset +
-		                                 avx_Nm * ikkappa0);
-		__m256d kkappa1 = _mm256_load_pd(avx_data.data() + i + align_offset +
-		                                 avx_Nm * ikkappa1);
-		__m256d kkappa2 = _mm256_load_pd(avx_data.data() + i + align_offset +
-		                                 avx_Nm * ikkappa2);
-
-		__m256d beta =
-		    _mm256_load_pd(avx_data.data() + i + align_offset + avx_Nm * ibeta);
-
-		// Do the computation
-
-		// this is the scalar product between k*kappa and pos
-		__m256d z = _mm256_add_pd(_mm256_mul_pd(pos0, kkappa0),
-		                          _mm256_add_pd(_mm256_mul_pd(pos1, kkappa1),
-		                                        _mm256_mul_pd(pos2, kkappa2)));
-
-		// here, the phase is added on. this is the argument of the cosine.
-		__m256d cos_arg = _mm256_add_pd(z, beta);
-
-		// ********
-		// * Computing the cosine
-		// *
-		// * argument reduction
-		// step 1: compute round(x), and store it in q
-		__m256d q = _mm256_round_pd(
-		    cos_arg, (_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
-
-		// we now compute s, which will be the input parameter to our polynomial
-		// approximation of cos(pi/2*x) between 0 and 1 the andnot_pd is just a
-		// fast way of taking the absolute value
-		__m256d s = _mm256_sub_pd(cos_arg, q);
-
-		// the following based on the int extraction process described here:
-		// https://stackoverflow.com/questions/41144668/how-to-efficiently-perform-double-int64-conversions-with-sse-avx/41223013
-		// we assume -2^51 <= q < 2^51 for this, which is unproblematic, as
-		// double precision has decayed far enough at that point that the cosine
-		// would be useless anyway.
-
-		// we now want to check whether q is even or odd, because the cosine is
-		// negative for odd qs, so we'll have to flip the final result. on an
-		// int, this is as simple as checking the 0th bit.
-		// => manipulate the double in such a way that we can do this.
-		// so, we add 2^52, such that the last digit of the mantissa is actually
-		// in the ones position. since q may be negative, we'll also add 2^51 to
-		// make sure it's positive. note that 2^51 is even and thus leaves
-		// evenness invariant, which is the only thing we care about here.
-
-		q = _mm256_add_pd(q, _mm256_set1_pd(0x0018000000000000));
-
-		// unfortunately, integer comparisons were only introduced in avx2, so
-		// we'll have to make do with a floating point comparison to check
-		// whether the last bit is set. however, masking out all but the last
-		// bit will result in a denormal float, which may either result in
-		// performance problems or just be rounded down to zero, neither of
-		// which is what we want here. To fix this, we'll mask in not only bit
-		// 0, but also the exponent (and sign, but that doesn't matter) of q.
-		// Luckily, the exponent of q is guaranteed to have the fixed value of
-		// 1075 (corresponding to 2^52) after our addition.
-
-		__m256d invert = _mm256_and_pd(
-		    q, _mm256_castsi256_pd(_mm256_set1_epi64x(0xfff0000000000001)));
-
-		// if we did have a one in bit 0, our result will be equal to 2^52 + 1
-		invert = _mm256_cmp_pd(
-		    invert, _mm256_castsi256_pd(_mm256_set1_epi64x(0x4330000000000001)),
-		    _CMP_EQ_OQ);
-
-		// finally, we need to turn invert and right_invert into masks for the
-		// sign bit on each final double, ie
-		invert = _mm256_and_pd(invert, _mm256_set1_pd(-0.0));
-
-		// TODO: clamp floats between 0 and 1? This would ensure that we never
-		// see inf's, but maybe we want that, so that things dont just fail
-		// silently...
-
-		// * end of argument reduction
-		// *******
-
-		// ******
-		// * evaluate the cosine using a polynomial approximation
-		// * the coefficients for this were generated using sleefs gencoef.c
-		// * These coefficients are probably far from optimal.
-		// * However, they should be sufficient for this case.
-		s = _mm256_mul_pd(s, s);
-
-		__m256d u = _mm256_set1_pd(+0.2211852080653743946e+0);
-
-		u = _mm256_add_pd(_mm256_mul_pd(u, s),
-		                  _mm256_set1_pd(-0.1332560668688523853e+1));
-		u = _mm256_add_pd(_mm256_mul_pd(u, s),
-		                  _mm256_set1_pd(+0.4058509506474178075e+1));
-		u = _mm256_add_pd(_mm256_mul_pd(u, s),
-		                  _mm256_set1_pd(-0.4934797516664651162e+1));
-		u = _mm256_add_pd(_mm256_mul_pd(u, s), _mm256_set1_pd(1.));
-
-		// then, flip the sign of each double for which invert is not zero.
-		// since invert has only zero bits except for a possible one in bit 63,
-		// we can xor it onto our result to selectively invert the 63st (sign)
-		// bit in each double where invert is set.
-		u = _mm256_xor_pd(u, invert);
-
-		// * end computation of cosine
-		// **********
-
-		// Finally, Ak*xi is multiplied on. Since this is a vector, the
-		// multiplication needs to be done for each of the three
-		// components, so it happens separately.
-		acc0 = _mm256_add_pd(_mm256_mul_pd(u, Axi0), acc0);
-		acc1 = _mm256_add_pd(_mm256_mul_pd(u, Axi1), acc1);
-		acc2 = _mm256_add_pd(_mm256_mul_pd(u, Axi2), acc2);
+void PlaneWaveTurbulence::getFields(const Vector3d *positions, const double *z,
+                                    Vector3d *fields, size_t count) const {
+#ifdef CRPROPA_HAVE_OFFLOAD
+	// modes that are not resident (e.g. of a copy) are transferred per call
+	if ((count > 0) && (count >= getOffloadThreshold())) {
+		offloadFields(simd_data.data() + align_offset, simd_Nm, positions,
+		              fields, count);
+		return;
+	}
+#endif
+	if (fieldsKernel) {
+		fieldsKernel(simd_data.data() + align_offset, simd_Nm, positions, fields,
+		             count);
+		return;
 	}
 
-	return Vector3d(hsum_double_avx(acc0), hsum_double_avx(acc1),
-	                hsum_double_avx(acc2));
-#endif // FAST_WAVES
+	// same order of the operations as in getField, in chunks of positions
+	// that stay in the cache while the modes are looped over
+	const size_t chunk = 256;
+	for (size_t j0 = 0; j0 < count; j0 += chunk) {
+		size_t j1 = std::min(count, j0 + chunk);
+		for (size_t j = j0; j < j1; j++)
+			fields[j] = Vector3d(0.);
+		for (int i = 0; i < Nm; i++) {
+			const Vector3d Axi = xi[i] * Ak[i];
+			const Vector3d kappa_ = kappa[i];
+			const double k_ = k[i];
+			const double beta_ = beta[i];
+			for (size_t j = j0; j < j1; j++) {
+				double z_ = positions[j].dot(kappa_);
+				fields[j] += Axi * cos(k_ * z_ + beta_);
+			}
+		}
+	}
 }
 
 } // namespace crpropa
@@ -0,0 +1,99 @@
+#include "crpropa/magneticLens/GalacticLensing.h"
+#include "crpropa/ParticleID.h"
+#include "crpropa/RunMetrics.h"
+
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+
+namespace crpropa {
+
+GalacticLensing::GalacticLensing(MagneticLens *lens, const Vector3d &center,
+		double radius, const Vector3d &observer) :
+		clone(false), makeInactive(true) {
+	setLens(lens);
+	setBoundary(center, radius);
+	setObserverPosition(observer);
+}
+
+void GalacticLensing::setLens(MagneticLens *l) {
+	if (!l)
+		throw std::runtime_error("GalacticLensing: no lens");
+	lens = l;
+}
+
+void GalacticLensing::setBoundary(const Vector3d &c, double r) {
+	if (r <= 0)
+		throw std::runtime_error("GalacticLensing: radius has to be positive");
+	center = c;
+	radius = r;
+}
+
+void GalacticLensing::setObserverPosition(const Vector3d &position) {
+	observer = position;
+}
+
+Vector3d GalacticLensing::getCenter() const {
+	return center;
+}
+
+double GalacticLensing::getRadius() const {
+	return radius;
+}
+
+Vector3d GalacticLensing::getObserverPosition() const {
+	return observer;
+}
+
+void GalacticLensing::onDetection(Module *action, bool clone_) {
+	detectionAction = action;
+	clone = clone_;
+}
+
+void GalacticLensing::setDeactivateOnDetection(bool deactivate) {
+	makeInactive = deactivate;
+}
+
+void GalacticLensing::process(Candidate *candidate) const {
+	// entering the boundary sphere in this step
+	if ((candidate->current.getPosition() - center).getR2() > radius * radius)
+		return;
+	if ((candidate->previous.getPosition() - center).getR2() <= radius * radius)
+		return;
+
+	Vector3d direction = candidate->current.getDirection();
+	int Z = std::abs(chargeNumber(candidate->current.getId()));
+	if (Z > 0) {
+		// rigidity in Joule, the energy of a proton of the same rigidity
+		if (!lens->transformCosmicRay(candidate->current.getEnergy() / Z, direction)) {
+			candidate->setActive(false);
+			return;
+		}
+	}
+
+	Vector3d entry = candidate->current.getPosition();
+	candidate->setTrajectoryLength(candidate->getTrajectoryLength() + (observer - entry).getR());
+	candidate->current.setPosition(observer);
+	candidate->current.setDirection(direction);
+
+	RunMetrics::countDetection();
+	if (detectionAction.valid()) {
+		if (clone)
+			detectionAction->process(candidate->clone(false));
+		else
+			detectionAction->process(candidate);
+	}
+	if (makeInactive)
+		candidate->setActive(false);
+}
+
+std::string GalacticLensing::getDescription() const {
+	std::stringstream ss;
+	ss << "GalacticLensing: boundary sphere at " << center / kpc << " kpc, radius "
+			<< radius / kpc << " kpc, observer at " << observer / kpc << " kpc";
+	if (detectionAction.valid())
+		ss << ", action: " << detectionAction->getDescription();
+	return ss.str();
+}
+
+} // namespace crpropa
@@ -0,0 +1,453 @@
+#include "crpropa/magneticLens/LensBuilder.h"
+#include "crpropa/Candidate.h"
+#include "crpropa/ParticleID.h"
+#include "crpropa/Random.h"
+#include "crpropa/Units.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include <Eigen/Core>
+
+namespace crpropa
+{
+
+// LensAccumulator ------------------------------------------------------------
+// file: Char[8] "CRPLACC1", Double (rigidityMin), Double (rigidityMax),
+// UInt64 (pixels), UInt64 (non zero counts), Double[pixels] (launched),
+// (UInt32, UInt32, Double) : (row, column, count) triples ...
+static const char accumulatorMagic[8] = {'C', 'R', 'P', 'L', 'A', 'C', 'C', '1'};
+
+LensAccumulator::LensAccumulator() :
+		rigidityMin(0), rigidityMax(0)
+{
+}
+
+LensAccumulator::LensAccumulator(uint32_t nPix, double rigidityMin, double rigidityMax) :
+		counts(nPix, nPix), launched(nPix, 0), rigidityMin(rigidityMin), rigidityMax(rigidityMax)
+{
+	if (nPix == 0)
+		throw std::runtime_error("LensAccumulator: no pixels");
+	if (not (rigidityMin < rigidityMax))
+		throw std::runtime_error("LensAccumulator: empty rigidity range");
+}
+
+LensAccumulator::LensAccumulator(const std::string &filename) :
+		rigidityMin(0), rigidityMax(0)
+{
+	std::ifstream infile(filename.c_str(), std::ios::binary);
+	if (!infile)
+		throw std::runtime_error("LensAccumulator: can't read file " + filename);
+	char magic[8];
+	uint64_t nPix, nnz;
+	infile.read(magic, sizeof(magic));
+	if (!infile or memcmp(magic, accumulatorMagic, sizeof(magic)) != 0)
+		throw std::runtime_error("LensAccumulator: not an accumulator file " + filename);
+	infile.read((char*) &rigidityMin, sizeof(double));
+	infile.read((char*) &rigidityMax, sizeof(double));
+	infile.read((char*) &nPix, sizeof(uint64_t));
+	infile.read((char*) &nnz, sizeof(uint64_t));
+	launched.resize(nPix);
+	infile.read((char*) &launched[0], nPix * sizeof(double));
+
+	std::vector< Eigen::Triplet<double> > triplets(nnz);
+	for (size_t i = 0; i < nnz; i++)
+	{
+		uint32_t row, column;
+		double count;
+		infile.read((char*) &row, sizeof(uint32_t));
+		infile.read((char*) &column, sizeof(uint32_t));
+		infile.read((char*) &count, sizeof(double));
+		triplets[i] = Eigen::Triplet<double>(row, column, count);
+	}
+	if (!infile)
+		throw std::runtime_error("LensAccumulator: error reading file " + filename);
+	counts.resize(nPix, nPix);
+	counts.setFromTriplets(triplets.begin(), triplets.end());
+}
+
+bool LensAccumulator::empty() const
+{
+	return launched.empty();
+}
+
+uint32_t LensAccumulator::getNumberOfPixels() const
+{
+	return launched.size();
+}
+
+double LensAccumulator::getMinimumRigidity() const
+{
+	return rigidityMin;
+}
+
+double LensAccumulator::getMaximumRigidity() const
+{
+	return rigidityMax;
+}
+
+double LensAccumulator::getLaunched(uint32_t pixel) const
+{
+	if (pixel >= launched.size())
+		throw std::runtime_error("LensAccumulator: pixel out of range");
+	return launched[pixel];
+}
+
+double LensAccumulator::getTotalLaunched() const
+{
+	double total = 0;
+	for (size_t i = 0; i < launched.size(); i++)
+		total += launched[i];
+	return total;
+}
+
+const ModelMatrixType& LensAccumulator::getCounts() const
+{
+	return counts;
+}
+
+void LensAccumulator::add(const ModelMatrixType &c, const std::vector<double> &l)
+{
+	if (empty())
+		throw std::runtime_error("LensAccumulator: the size and rigidity range are not set");
+	if (c.rows() != counts.rows() or c.cols() != counts.cols() or l.size() != launched.size())
+		throw std::runtime_error("LensAccumulator: counts of a different pixelization");
+	counts += c;
+	for (size_t i = 0; i < launched.size(); i++)
+		launched[i] += l[i];
+}
+
+void LensAccumulator::merge(const LensAccumulator &other)
+{
+	if (other.empty())
+		return;
+	if (empty())
+	{
+		*this = other;
+		return;
+	}
+	if (other.rigidityMin != rigidityMin or other.rigidityMax != rigidityMax)
+		throw std::runtime_error("LensAccumulator: counts of a different rigidity range");
+	add(other.counts, other.launched);
+}
+
+void LensAccumulator::merge(const std::string &filename)
+{
+	merge(LensAccumulator(filename));
+}
+
+void LensAccumulator::save(const std::string &filename) const
+{
+	std::ofstream outfile(filename.c_str(), std::ios::binary);
+	if (!outfile)
+		throw std::runtime_error("LensAccumulator: can't write file " + filename);
+	uint64_t nPix = launched.size();
+	uint64_t nnz = counts.nonZeros();
+	outfile.write(accumulatorMagic, sizeof(accumulatorMagic));
+	outfile.write((const char*) &rigidityMin, sizeof(double));
+	outfile.write((const char*) &rigidityMax, sizeof(double));
+	outfile.write((const char*) &nPix, sizeof(uint64_t));
+	outfile.write((const char*) &nnz, sizeof(uint64_t));
+	if (nPix > 0)
+		outfile.write((const char*) &launched[0], nPix * sizeof(double));
+	for (size_t col = 0; col < (size_t) counts.cols(); col++)
+	{
+		for (ModelMatrixType::InnerIterator it(counts, col); it; ++it)
+		{
+			uint32_t row = it.row(), column = it.col();
+			double count = it.value();
+			outfile.write((const char*) &row, sizeof(uint32_t));
+			outfile.write((const char*) &column, sizeof(uint32_t));
+			outfile.write((const char*) &count, sizeof(double));
+		}
+	}
+	if (outfile.fail())
+		throw std::runtime_error("LensAccumulator: error writing file " + filename);
+}
+
+void LensAccumulator::getLensPart(ModelMatrixType &M) const
+{
+	// the rows are the observed pixels
+	Eigen::VectorXd scale(launched.size());
+	for (size_t i = 0; i < launched.size(); i++)
+		scale[i] = (launched[i] > 0) ? 1. / launched[i] : 0.;
+	M = scale.asDiagonal() * counts;
+	M.makeCompressed();
+}
+
+// rigidity range of an accumulator file, without reading the counts
+struct AccumulatorRange
+{
+	double rigidityMin, rigidityMax;
+	std::string filename;
+	bool operator<(const AccumulatorRange &other) const
+	{
+		return rigidityMin < other.rigidityMin;
+	}
+};
+
+static AccumulatorRange readAccumulatorRange(const std::string &filename)
+{
+	std::ifstream infile(filename.c_str(), std::ios::binary);
+	char magic[8];
+	AccumulatorRange range;
+	range.filename = filename;
+	infile.read(magic, sizeof(magic));
+	infile.read((char*) &range.rigidityMin, sizeof(double));
+	infile.read((char*) &range.rigidityMax, sizeof(double));
+	if (!infile or memcmp(magic, accumulatorMagic, sizeof(magic)) != 0)
+		throw std::runtime_error("LensAccumulator: not an accumulator file " + filename);
+	return range;
+}
+
+void writeLens(const std::string &filename, const std::vector<std::string> &accumulators)
+{
+	std::string stem = filename;
+	size_t dot = stem.find_last_of(".");
+	if (dot != std::string::npos and dot > stem.find_last_of("/") + 1)
+		stem = stem.substr(0, dot);
+	size_t sp = stem.find_last_of("/");
+	std::string basename = (sp == std::string::npos) ? stem : stem.substr(sp + 1);
+
+	std::vector<AccumulatorRange> ranges;
+	for (size_t i = 0; i < accumulators.size(); i++)
+		ranges.push_back(readAccumulatorRange(accumulators[i]));
+	std::stable_sort(ranges.begin(), ranges.end());
+	for (size_t i = 1; i < ranges.size(); i++)
+		if (ranges[i].rigidityMin < ranges[i - 1].rigidityMax)
+			throw std::runtime_error("LensBuilder: overlapping rigidity ranges of "
+					+ ranges[i - 1].filename + " and " + ranges[i].filename);
+
+	std::stringstream lens;
+	lens << "# lens file, built from " << ranges.size() << " accumulators\n";
+	lens << "# filename log10(Rmin / eV) log10(Rmax / eV)\n";
+	for (size_t i = 0; i < ranges.size(); i++)
+	{
+		std::stringstream part;
+		part << "_" << i << ".mldat";
+		lens << basename << part.str() << " " << log10(ranges[i].rigidityMin / eV)
+				<< " " << log10(ranges[i].rigidityMax / eV) << "\n";
+
+		// one accumulator in memory at a time
+		ModelMatrixType M;
+		LensAccumulator(ranges[i].filename).getLensPart(M);
+		serialize(stem + part.str(), M);
+	}
+
+	std::ofstream outfile(filename.c_str());
+	if (!outfile)
+		throw std::runtime_error("LensBuilder: could not write " + filename);
+	// no new line after the last part, as loadLens warns about empty lines
+	std::string content = lens.str();
+	outfile << content.substr(0, content.size() - 1);
+}
+
+// LensBuilder ----------------------------------------------------------------
+LensBuilder::LensBuilder(ref_ptr<MagneticField> field,
+		const std::vector<double> &rigidities, uint8_t healpixOrder) :
+		pixelization(healpixOrder), rigidities(rigidities),
+		observer(-8.5 * kpc, 0, 0), center(0, 0, 0), radius(20 * kpc),
+		maxTrajectoryLength(1 * Mpc), particlesPerPixel(100), seed(0)
+{
+	if (rigidities.size() < 2)
+		throw std::runtime_error("LensBuilder: at least two rigidity bin edges required");
+	for (size_t i = 1; i < rigidities.size(); i++)
+		if (rigidities[i] <= rigidities[i - 1])
+			throw std::runtime_error("LensBuilder: rigidity bin edges not in ascending order");
+	propagation = new PropagationCK(field, 1e-4, 0.1 * pc, 1 * kpc);
+}
+
+void LensBuilder::setObserverPosition(const Vector3d &position)
+{
+	observer = position;
+}
+
+void LensBuilder::setBoundary(const Vector3d &c, double r)
+{
+	if (r <= 0)
+		throw std::runtime_error("LensBuilder: boundary radius <= 0");
+	center = c;
+	radius = r;
+}
+
+void LensBuilder::setMaximumTrajectoryLength(double length)
+{
+	maxTrajectoryLength = length;
+}
+
+void LensBuilder::setParticlesPerPixel(size_t n)
+{
+	if (n == 0)
+		throw std::runtime_error("LensBuilder: particlesPerPixel must be larger than 0");
+	particlesPerPixel = n;
+}
+
+void LensBuilder::setSeed(uint64_t s)
+{
+	seed = s;
+}
+
+ref_ptr<PropagationCK> LensBuilder::getPropagation() const
+{
+	return propagation;
+}
+
+size_t LensBuilder::getNumberOfParts() const
+{
+	return rigidities.size() - 1;
+}
+
+size_t LensBuilder::getParticlesPerPixel() const
+{
+	return particlesPerPixel;
+}
+
+Vector3d LensBuilder::backtrack(const Vector3d &direction, double rigidity) const
+{
+	Candidate candidate(-nucleusId(1, 1), rigidity, observer, direction);
+	Candidate *c = &candidate;
+	backtrack(&c, 1);
+	return candidate.isActive() ? candidate.current.getDirection() : Vector3d(0, 0, 0);
+}
+
+void LensBuilder::backtrack(Candidate **candidates, size_t count) const
+{
+	// the candidates inside the boundary are propagated together, so that the
+	// field is evaluated for all of them in one call
+	std::vector<Candidate*> inside(candidates, candidates + count);
+	while (not inside.empty())
+	{
+		size_t k = 0;
+		for (size_t i = 0; i < inside.size(); i++)
+		{
+			Candidate *c = inside[i];
+			if ((c->current.getPosition() - center).getR() >= radius)
+				continue;
+			if (c->getTrajectoryLength() > maxTrajectoryLength)
+			{
+				c->setActive(false);
+				continue;
+			}
+			inside[k++] = c;
+		}
+		inside.resize(k);
+		if (k > 0)
+			propagation->processBatch(&inside[0], k);
+	}
+}
+
+void LensBuilder::buildLensPart(size_t bin, ModelMatrixType &M) const
+{
+	LensAccumulator accumulator;
+	accumulateLensPart(bin, accumulator);
+	accumulator.getLensPart(M);
+}
+
+void LensBuilder::accumulateLensPart(size_t bin, LensAccumulator &accumulator, uint64_t job) const
+{
+	if (bin >= getNumberOfParts())
+		throw std::runtime_error("LensBuilder: rigidity bin out of range");
+
+	const uint32_t nPix = pixelization.nPix();
+	const double logRmin = log(rigidities[bin]);
+	const double logRmax = log(rigidities[bin + 1]);
+	const uint64_t jobKey = Random::deriveStreamKey(Random::deriveStreamKey(seed, bin), job);
+	if (accumulator.empty())
+		accumulator = LensAccumulator(nPix, rigidities[bin], rigidities[bin + 1]);
+	else if (accumulator.getMinimumRigidity() != rigidities[bin]
+			or accumulator.getMaximumRigidity() != rigidities[bin + 1])
+		throw std::runtime_error("LensBuilder: accumulator of a different rigidity bin");
+
+	std::vector< Eigen::Triplet<double> > triplets;
+
+#pragma omp parallel
+	{
+		Random random(uint32_t(0));
+		std::vector< Eigen::Triplet<double> > local;
+
+#pragma omp for schedule(dynamic, 16)
+		for (size_t i = 0; i < nPix; i++)
+		{
+			random.setStream(Random::deriveStreamKey(jobKey, i));
+			std::vector< ref_ptr<Candidate> > particles(particlesPerPixel);
+			std::vector<Candidate*> batch(particlesPerPixel);
+			for (size_t k = 0; k < particlesPerPixel; k++)
+			{
+				double lon, lat;
+				pixelization.getRandomDirectionInPixel(i, lon, lat, random);
+				double rigidity = exp(logRmin + random.rand() * (logRmax - logRmin));
+
+				// launched into the arrival direction of the cosmic ray
+				Vector3d u(cos(lon) * cos(lat), sin(lon) * cos(lat), sin(lat));
+				particles[k] = new Candidate(-nucleusId(1, 1), rigidity, observer, u);
+				batch[k] = particles[k];
+			}
+
+			backtrack(&batch[0], particlesPerPixel);
+			for (size_t k = 0; k < particlesPerPixel; k++)
+			{
+				if (not batch[k]->isActive())
+					continue;
+				Vector3d v = batch[k]->current.getDirection();
+				uint32_t j = pixelization.direction2Pix(atan2(v.y, v.x), asin(v.z));
+				local.push_back(Eigen::Triplet<double>(i, j, 1));
+			}
+		}
+
+#pragma omp critical
+		triplets.insert(triplets.end(), local.begin(), local.end());
+	}
+
+	ModelMatrixType counts(nPix, nPix);
+	counts.setFromTriplets(triplets.begin(), triplets.end());
+	accumulator.add(counts, std::vector<double>(nPix, particlesPerPixel));
+}
+
+void LensBuilder::buildLens(const std::string &filename) const
+{
+	std::string stem = filename;
+	size_t dot = stem.find_last_of(".");
+	if (dot != std::string::npos and dot > stem.find_last_of("/") + 1)
+		stem = stem.substr(0, dot);
+	size_t sp = stem.find_last_of("/");
+	std::string basename = (sp == std::string::npos) ? stem : stem.substr(sp + 1);
+
+	std::stringstream lens;
+	lens << "# lens file, healpix order " << int(pixelization.getOrder()) << ", "
+			<< particlesPerPixel << " particles per pixel\n";
+	lens << "# filename log10(Rmin / eV) log10(Rmax / eV)\n";
+
+	for (size_t bin = 0; bin < getNumberOfParts(); bin++)
+	{
+		std::stringstream part;
+		part << "_" << bin << ".mldat";
+		lens << basename << part.str() << " " << log10(rigidities[bin] / eV)
+				<< " " << log10(rigidities[bin + 1] / eV) << "\n";
+
+		// parts are renamed once complete, so existing files are final
+		std::string partfile = stem + part.str();
+		if (std::ifstream(partfile.c_str()).good())
+			continue;
+
+		ModelMatrixType M;
+		buildLensPart(bin, M);
+		std::string tmpfile = partfile + ".tmp";
+		serialize(tmpfile, M);
+		if (std::rename(tmpfile.c_str(), partfile.c_str()) != 0)
+			throw std::runtime_error("LensBuilder: could not write " + partfile);
+	}
+
+	std::ofstream outfile(filename.c_str());
+	if (!outfile)
+		throw std::runtime_error("LensBuilder: could not write " + filename);
+	// no new line after the last part, as loadLens warns about empty lines
+	std::string content = lens.str();
+	outfile << content.substr(0, content.size() - 1);
+}
+
+} // namespace
@@ -22,11 +22,13 @@
 
 #include "crpropa/magneticLens/MagneticLens.h"
 
+#include "crpropa/Diagnostics.h"
 #include "crpropa/Random.h"
 #include "crpropa/Units.h"
 
 // needed for memcpy in gcc 4.3.2
 #include <cstring>
+#include <stdexcept>
 
 namespace crpropa 
 {
@@ -80,34 +82,20 @@ bool MagneticLens::transformCosmicRay(double rigidity, double& phi,
 	LensPart *lenspart = getLensPart(rigidity);
 	if (!lenspart)
 	{
-		std::cerr << "Warning. Trying to transform cosmic ray with rigidity " << rigidity / eV << " eV which is not covered by this lens!.\n";
-		std::cerr << " This lens covers the range " << _minimumRigidity /eV << " eV - " << _maximumRigidity << " eV.\n";
+		CRPROPA_DIAGNOSTIC("MagneticLens: cosmic ray rigidity not covered by the lens",
+				rigidity / eV << " eV, the lens covers " << _minimumRigidity / eV << " eV - "
+				<< _maximumRigidity / eV << " eV");
 		return false;
 	}
 
-	ModelVectorType v = lenspart->getMatrix().col(c);
-
-	uint32_t r;
-
 	// the random number to compare with
 	double rn = Random::instance().rand();
 
-	ModelVectorType::InnerIterator i(v);
-  double cpv = 0;
-  while (i)
-  {
-		cpv += i.value();
-		if (rn < cpv)
-		{
-			_pixelization->pix2Direction(i.index(), phi, theta);
-			return true;
-    }
-    else
-    {
-			++i;
-    }
-   }
-  return false;
+	int r = lenspart->sampleColumn(c, rn);
+	if (r < 0)
+		return false;
+	_pixelization->pix2Direction(r, phi, theta);
+	return true;
 }
 
 bool MagneticLens::transformCosmicRay(double rigidity, Vector3d &p){
@@ -128,33 +116,40 @@ void MagneticLens::loadLensPart(const string &filename, double rigidityMin,
 {
 	updateRigidityBounds(rigidityMin, rigidityMax);
 
-	LensPart *p = new LensPart(filename, rigidityMin, rigidityMax);
-	p->loadMatrixFromFile();
-	_checkMatrix(p->getMatrix());
+	// only the size is read, the matrix is read on first use
+	uint32_t rows, cols;
+	readMatrixSize(filename, rows, cols);
+	_checkMatrixSize(rows, cols);
 
+	LensPart *p = new LensPart(filename, rigidityMin, rigidityMax);
 	_lensParts.push_back(p);
 }
 
 void MagneticLens::_checkMatrix(const ModelMatrixType &M)
 {
-	if (M.rows() != M.cols())
+	_checkMatrixSize(M.rows(), M.cols());
+}
+
+void MagneticLens::_checkMatrixSize(uint32_t rows, uint32_t cols)
+{
+	if (rows != cols)
 	{
 		throw std::runtime_error("Not a square Matrix!");
 	}
 
 	if (_pixelization)
 	{
-		if (_pixelization->nPix() != M.cols())
+		if (_pixelization->nPix() != cols)
 		{
 			std::cerr << "*** ERROR ***" << endl;
 			std::cerr << "  Pixelization: " << _pixelization->nPix() << endl;
-			std::cerr << "  Matrix Size : " << M.cols() << endl;
+			std::cerr << "  Matrix Size : " << cols << endl;
 			throw std::runtime_error("Matrix doesn't fit into Lense");
 		}
 	}
 	else
 	{
-		uint32_t morder = Pixelization::pix2Order(M.cols());
+		uint32_t morder = Pixelization::pix2Order(cols);
 		if (morder == 0)
 		{
 			throw std::runtime_error(
@@ -175,7 +170,7 @@ void MagneticLens::updateRigidityBounds(double rigidityMin, double rigidityMax)
 		_minimumRigidity = rigidityMin;
 	}
 
-	if (_maximumRigidity < rigidityMin)
+	if (_maximumRigidity < rigidityMax)
 	{
 		_maximumRigidity = rigidityMax;
 	}
@@ -194,6 +189,14 @@ void MagneticLens::setLensPart(const ModelMatrixType &M, double rigidityMin,
 }
 
 LensPart* MagneticLens::getLensPart(double rigidity) const
+{
+	LensPart *part = _findLensPart(rigidity);
+	if (part)
+		_acquire(part);
+	return part;
+}
+
+LensPart* MagneticLens::_findLensPart(double rigidity) const
 {
 	const_LensPartIter i = _lensParts.begin();
 	while (i != _lensParts.end())
@@ -208,9 +211,63 @@ LensPart* MagneticLens::getLensPart(double rigidity) const
 	return NULL;
 }
 
+void MagneticLens::_acquire(LensPart *part) const
+{
+	std::lock_guard<std::mutex> lock(*_mutex);
+	part->setLastAccess(++_accessCounter);
+	if (!part->isLoaded())
+	{
+		part->loadMatrixFromFile();
+		_evict(part);
+	}
+}
+
+void MagneticLens::_evict(const LensPart *keep) const
+{
+	if (_memoryBudget == 0)
+		return;
+	size_t usage = 0;
+	for (const_LensPartIter i = _lensParts.begin(); i != _lensParts.end(); ++i)
+	{
+		if (!(*i)->isPersistent())
+			usage += (*i)->getMemoryUsage();
+	}
+	while (usage > _memoryBudget)
+	{
+		LensPart *oldest = NULL;
+		for (const_LensPartIter i = _lensParts.begin(); i != _lensParts.end(); ++i)
+		{
+			if ((*i) == keep or (*i)->isPersistent() or !(*i)->isLoaded())
+				continue;
+			if (!oldest or (*i)->getLastAccess() < oldest->getLastAccess())
+				oldest = *i;
+		}
+		if (!oldest)
+			break;
+		usage -= oldest->getMemoryUsage();
+		oldest->unloadMatrix();
+	}
+}
+
+void MagneticLens::setMemoryBudget(size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(*_mutex);
+	_memoryBudget = bytes;
+	_evict(NULL);
+}
+
+size_t MagneticLens::getMemoryUsage() const
+{
+	std::lock_guard<std::mutex> lock(*_mutex);
+	size_t usage = 0;
+	for (const_LensPartIter i = _lensParts.begin(); i != _lensParts.end(); ++i)
+		usage += (*i)->getMemoryUsage();
+	return usage;
+}
+
 bool MagneticLens::rigidityCovered(double rigidity) const
 {
-	if (getLensPart(rigidity))
+	if (_findLensPart(rigidity))
 		return true;
 	else
 		return false;
@@ -222,7 +279,7 @@ void MagneticLens::normalizeMatrixColumns()
 	for (LensPartIter iter = _lensParts.begin(); iter != _lensParts.end();
 			++iter)
 	{
-		normalizeColumns((*iter)->getMatrix());
+		(*iter)->normalizeMatrixColumns();
 	}
 }
 
@@ -234,6 +291,7 @@ void MagneticLens::normalizeLens()
 	for (LensPartIter iter = _lensParts.begin(); iter != _lensParts.end();
 			++iter)
 	{
+		_acquire(*iter);
 		if ((*iter)->getMaximumOfSumsOfColumns() > norm)
 		{
 			norm = (*iter)->getMaximumOfSumsOfColumns();
@@ -242,7 +300,7 @@ void MagneticLens::normalizeLens()
 	for (LensPartIter iter = _lensParts.begin(); iter != _lensParts.end();
 			++iter)
 	{
-		normalizeMatrix((*iter)->getMatrix(), norm);
+		(*iter)->normalizeMatrix(norm);
 	}
   _norm = norm;
 }
@@ -252,8 +310,9 @@ void MagneticLens::normalizeLensparts()
 	for (LensPartIter iter = _lensParts.begin(); iter != _lensParts.end();
 			++iter)
 	{
+		_acquire(*iter);
 		double norm = (*iter)->getMaximumOfSumsOfColumns();
-		normalizeMatrix((*iter)->getMatrix(), norm);
+		(*iter)->normalizeMatrix(norm);
 	}
 }
 
@@ -263,7 +322,9 @@ void MagneticLens::transformModelVector(double* model, double rigidity) const
 	
 	if (!lenspart)
 	{
-		std::cerr << "Warning. Trying to transform vector with rigidity " << rigidity / eV << "eV which is not covered by this lens!.\n" << std::endl;
+		CRPROPA_DIAGNOSTIC("MagneticLens: model vector rigidity not covered by the lens",
+				rigidity / eV << " eV, the lens covers " << _minimumRigidity / eV << " eV - "
+				<< _maximumRigidity / eV << " eV");
 		return;
 	}
 
@@ -271,6 +332,67 @@ void MagneticLens::transformModelVector(double* model, double rigidity) const
 
 }
 
+void MagneticLens::transformModelVectors(const std::vector<double*> &models,
+		const std::vector<double> &rigidities) const
+{
+	if (models.size() != rigidities.size())
+		throw std::runtime_error("MagneticLens: different number of models and rigidities");
+
+	std::vector<LensPart*> parts(models.size());
+	for (size_t i = 0; i < models.size(); i++)
+		parts[i] = _findLensPart(rigidities[i]);
+
+	// models per lens part, in blocks of a few models per product
+	const size_t blockSize = 8;
+	std::vector<LensPart*> blockParts;
+	std::vector<std::vector<double*> > blocks;
+	for (size_t p = 0; p < _lensParts.size(); p++)
+	{
+		std::vector<double*> block;
+		for (size_t i = 0; i < models.size(); i++)
+		{
+			if (parts[i] != _lensParts[p])
+				continue;
+			block.push_back(models[i]);
+			if (block.size() == blockSize)
+			{
+				blockParts.push_back(_lensParts[p]);
+				blocks.push_back(block);
+				block.clear();
+			}
+		}
+		if (!block.empty())
+		{
+			blockParts.push_back(_lensParts[p]);
+			blocks.push_back(block);
+		}
+	}
+
+	// with a memory budget the lens parts are transformed one after the
+	// other, so that no part is unloaded while it is used
+	size_t first = 0;
+	while (first < blocks.size())
+	{
+		size_t last = blocks.size();
+		if (_memoryBudget > 0)
+		{
+			last = first + 1;
+			while (last < blocks.size() && blockParts[last] == blockParts[first])
+				last++;
+		}
+		for (size_t b = first; b < last; b++)
+		{
+			if (b == first || blockParts[b] != blockParts[b - 1])
+				_acquire(blockParts[b]);
+		}
+
+#pragma omp parallel for schedule(dynamic, 1)
+		for (int b = (int)first; b < (int)last; b++)
+			prod_up(blockParts[b]->getMatrix(), blocks[b]);
+		first = last;
+	}
+}
+
 
 
 } // namespace parsec
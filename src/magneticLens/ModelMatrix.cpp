@@ -22,11 +22,37 @@
 
 #include "crpropa/magneticLens/ModelMatrix.h"
 #include <ctime>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <Eigen/Core>
 namespace crpropa 
 {
 
+static const char CSCMagic[8] = {'C', 'R', 'P', 'C', 'S', 'C', '1', '\0'};
+
+struct CSCHeader
+{
+	char magic[8];
+	uint64_t rows;
+	uint64_t cols;
+	uint64_t nnz;
+};
+
+static bool isCSCFile(ifstream &infile)
+{
+	char magic[8];
+	infile.read(magic, sizeof(magic));
+	bool csc = infile.good() and memcmp(magic, CSCMagic, sizeof(magic)) == 0;
+	infile.clear();
+	infile.seekg(0);
+	return csc;
+}
+
 void serialize(const string &filename, const ModelMatrixType& matrix)
 {
 	ofstream outfile(filename.c_str(), ios::binary);
@@ -77,6 +103,12 @@ void deserialize(const string &filename, ModelMatrixType& matrix)
 	{
 		throw runtime_error("Can't read file: " + filename);
 	}
+	if (isCSCFile(infile))
+	{
+		infile.close();
+		deserializeCSC(filename, matrix);
+		return;
+	}
 
 	uint32_t nnz, nRows, nColumns;
 	infile.read((char*) &nnz, sizeof(uint32_t));
@@ -102,6 +134,121 @@ void deserialize(const string &filename, ModelMatrixType& matrix)
 }
 
 
+void serializeCSC(const string &filename, const ModelMatrixType& matrix)
+{
+	ModelMatrixType compressed;
+	const ModelMatrixType *m = &matrix;
+	if (!matrix.isCompressed())
+	{
+		compressed = matrix;
+		compressed.makeCompressed();
+		m = &compressed;
+	}
+
+	ofstream outfile(filename.c_str(), ios::binary);
+	if (!outfile)
+	{
+		throw runtime_error("Can't write file: " + filename);
+	}
+
+	CSCHeader header;
+	memcpy(header.magic, CSCMagic, sizeof(CSCMagic));
+	header.rows = m->rows();
+	header.cols = m->cols();
+	header.nnz = m->nonZeros();
+	outfile.write((char*) &header, sizeof(header));
+
+	// the values come first to keep them aligned in the mapped file
+	outfile.write((const char*) m->valuePtr(), header.nnz * sizeof(double));
+	for (size_t i = 0; i <= header.cols; i++)
+	{
+		int32_t C = (int32_t) m->outerIndexPtr()[i];
+		outfile.write((char*) &C, sizeof(int32_t));
+	}
+	for (size_t i = 0; i < header.nnz; i++)
+	{
+		int32_t C = (int32_t) m->innerIndexPtr()[i];
+		outfile.write((char*) &C, sizeof(int32_t));
+	}
+	if (outfile.fail())
+	{
+		throw runtime_error("Error writing file: " + filename);
+	}
+	outfile.close();
+}
+
+void deserializeCSC(const string &filename, ModelMatrixType& matrix)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		throw runtime_error("Can't read file: " + filename);
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 or (size_t) st.st_size < sizeof(CSCHeader))
+	{
+		close(fd);
+		throw runtime_error("Not a CSC matrix file: " + filename);
+	}
+	size_t size = st.st_size;
+	void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		throw runtime_error("Can't map file: " + filename);
+	}
+
+	CSCHeader header;
+	memcpy(&header, data, sizeof(header));
+	size_t expected = sizeof(CSCHeader) + header.nnz * sizeof(double)
+			+ (header.cols + 1 + header.nnz) * sizeof(int32_t);
+	if (memcmp(header.magic, CSCMagic, sizeof(CSCMagic)) != 0 or size != expected)
+	{
+		munmap(data, size);
+		throw runtime_error("Not a CSC matrix file: " + filename);
+	}
+
+	const char *p = (const char*) data + sizeof(CSCHeader);
+	const double *values = (const double*) p;
+	const int32_t *outer = (const int32_t*) (p + header.nnz * sizeof(double));
+	const int32_t *inner = outer + header.cols + 1;
+
+	// the mapped arrays are the compressed storage of the matrix and are
+	// copied in one pass
+	Eigen::Map<const Eigen::SparseMatrix<double, Eigen::ColMajor, int32_t> > mapped(
+			header.rows, header.cols, header.nnz, outer, inner, values);
+	matrix = mapped;
+	matrix.makeCompressed();
+	munmap(data, size);
+}
+
+void readMatrixSize(const string &filename, uint32_t &rows, uint32_t &cols)
+{
+	ifstream infile(filename.c_str(), ios::binary);
+	if (!infile)
+	{
+		throw runtime_error("Can't read file: " + filename);
+	}
+	if (isCSCFile(infile))
+	{
+		CSCHeader header;
+		infile.read((char*) &header, sizeof(header));
+		rows = header.rows;
+		cols = header.cols;
+	}
+	else
+	{
+		uint32_t nnz;
+		infile.read((char*) &nnz, sizeof(uint32_t));
+		infile.read((char*) &rows, sizeof(uint32_t));
+		infile.read((char*) &cols, sizeof(uint32_t));
+	}
+	if (!infile)
+	{
+		throw runtime_error("Error reading file: " + filename);
+	}
+}
+
 double norm_1(const ModelVectorType &v)
 {
 	return v.cwiseAbs().sum();
@@ -157,5 +304,23 @@ double maximumOfSumsOfColumns(const ModelMatrixType &matrix)
 	delete[] origVectorStorage;
 }
 
+	void prod_up(const ModelMatrixType& matrix, const std::vector<double*> &models)
+{
+	const size_t mSize = matrix.cols();
+	const size_t n = models.size();
+	if (n == 0)
+		return;
+
+	// the models are the columns of a dense matrix
+	Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic> orig(mSize, n);
+	for (size_t i = 0; i < n; i++)
+		memcpy(orig.col(i).data(), models[i], mSize * sizeof(double));
+
+	Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic> result = matrix * orig;
+
+	for (size_t i = 0; i < n; i++)
+		memcpy(models[i], result.col(i).data(), mSize * sizeof(double));
+}
+
 
 } // namespace parsec
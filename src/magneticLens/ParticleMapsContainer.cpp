@@ -1,22 +1,18 @@
 #include "HepPID/ParticleIDMethods.hh"
 #include "crpropa/Random.h"
 #include "crpropa/magneticLens/ParticleMapsContainer.h"
+#include "crpropa/Diagnostics.h"
 #include "crpropa/Units.h"
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <stdexcept>
 namespace crpropa 
 {
 
 ParticleMapsContainer::~ParticleMapsContainer()
 {
-	for(std::map<int, std::map<int, double*> >::iterator pid_iter = _data.begin(); 
-			pid_iter != _data.end(); ++pid_iter) {
-		for(std::map<int, double*>::iterator energy_iter = pid_iter->second.begin();
-			energy_iter != pid_iter->second.end(); ++energy_iter) {
-				delete[] (energy_iter->second);
-		}
-	}
 }
 
 int ParticleMapsContainer::energy2Idx(double energy) const
@@ -31,42 +27,123 @@ double ParticleMapsContainer::idx2Energy(int idx) const
 }
 
 		
+ParticleMapsContainer::ParticleMap *ParticleMapsContainer::findMap(int particleId, int energyIdx)
+{
+	std::map<int, std::map<int, size_t> >::iterator pid_iter = _index.find(particleId);
+	if (pid_iter == _index.end())
+		return NULL;
+	std::map<int, size_t>::iterator energy_iter = pid_iter->second.find(energyIdx);
+	if (energy_iter == pid_iter->second.end())
+		return NULL;
+	return &_maps[energy_iter->second];
+}
+
+
+void ParticleMapsContainer::compactMap(ParticleMap &m)
+{
+	if (m.sorted == m.entries.size())
+		return;
+	std::sort(m.entries.begin(), m.entries.end());
+	size_t n = 0;
+	for (size_t i = 0; i < m.entries.size(); i++)
+	{
+		if (n > 0 && m.entries[n - 1].first == m.entries[i].first)
+			m.entries[n - 1].second += m.entries[i].second;
+		else
+			m.entries[n++] = m.entries[i];
+	}
+	m.entries.resize(n);
+	m.sorted = n;
+
+	// a pixel entry needs twice the memory of a dense pixel
+	if (2 * n > _pixelization.getNumberOfPixels())
+		densifyMap(m);
+	else
+		std::vector<std::pair<uint32_t, double> >(m.entries).swap(m.entries);
+}
+
+
+void ParticleMapsContainer::densifyMap(ParticleMap &m)
+{
+	if (!m.dense.empty())
+		return;
+	m.dense.assign(_pixelization.getNumberOfPixels(), 0);
+	for (size_t i = 0; i < m.entries.size(); i++)
+		m.dense[m.entries[i].first] += m.entries[i].second;
+	std::vector<std::pair<uint32_t, double> >().swap(m.entries);
+	m.sorted = 0;
+}
+
+		
 double* ParticleMapsContainer::getMap(const int particleId, double energy)
 {
 	_weightsUpToDate = false;
-	if (_data.find(particleId) == _data.end())
+	if (_index.find(particleId) == _index.end())
 	{
-		std::cerr << "No map for ParticleID " << particleId << std::endl;
+		CRPROPA_DIAGNOSTIC("ParticleMapsContainer: no map for the particle id", particleId);
 		return NULL;
 	}
-	int energyIdx	= energy2Idx(energy);
-	if (_data[particleId].find(energyIdx) == _data[particleId].end())
+	ParticleMap *m = findMap(particleId, energy2Idx(energy));
+	if (!m)
 	{
-		std::cerr << "No map for ParticleID and energy" << energy / eV << " eV" << std::endl;
+		CRPROPA_DIAGNOSTIC("ParticleMapsContainer: no map for the particle id and energy",
+				particleId << ", " << energy / eV << " eV");
 		return NULL;
 	}
-	return _data[particleId][energy2Idx(energy)];
+	densifyMap(*m);
+	return &m->dense[0];
 }
 			
 			
 void ParticleMapsContainer::addParticle(const int particleId, double energy, double galacticLongitude, double galacticLatitude, double weight)
+{
+	uint32_t pixel = _pixelization.direction2Pix(galacticLongitude, galacticLatitude);
+	addToMap(particleId, energy2Idx(energy), pixel, weight);
+}
+
+
+void ParticleMapsContainer::addToMap(int particleId, int energyIdx, uint32_t pixel, double weight)
 {
 	_weightsUpToDate = false;
-	if (_data.find(particleId) == _data.end())
+	ParticleMap *m = findMap(particleId, energyIdx);
+	if (!m)
 	{
-		map<int, double*> M;
-		_data[particleId] = M;
+		_index[particleId][energyIdx] = _maps.size();
+		_maps.push_back(ParticleMap());
+		m = &_maps.back();
+		m->energyIdx = energyIdx;
 	}
 
-	int energyIdx	= energy2Idx(energy);
-	if (_data[particleId].find(energyIdx) == _data[particleId].end())
+	if (!m->dense.empty())
 	{
-		_data[particleId][energyIdx] = new double[_pixelization.getNumberOfPixels()];
-		std::fill(_data[particleId][energyIdx], _data[particleId][energyIdx] + _pixelization.getNumberOfPixels(), 0);
+		m->dense[pixel] += weight;
+		return;
 	}
+	// the new entries are summed up once they outnumber the sorted ones
+	m->entries.push_back(std::make_pair(pixel, weight));
+	if (m->entries.size() > 2 * std::max(m->sorted, (size_t) 1024))
+		compactMap(*m);
+}
 
-	uint32_t pixel = _pixelization.direction2Pix(galacticLongitude, galacticLatitude);
-	_data[particleId][energyIdx][pixel] += weight;
+
+void ParticleMapsContainer::addParticles(const std::vector<int> &particleIds,
+		const std::vector<double> &energies,
+		const std::vector<double> &galacticLongitudes,
+		const std::vector<double> &galacticLatitudes,
+		const std::vector<double> &weights)
+{
+	size_t n = particleIds.size();
+	if (energies.size() != n || galacticLongitudes.size() != n
+			|| galacticLatitudes.size() != n || (!weights.empty() && weights.size() != n))
+		throw std::runtime_error("ParticleMapsContainer::addParticles: arrays of different size");
+	if (n == 0)
+		return;
+
+	std::vector<uint32_t> pixels(n);
+	_pixelization.directions2Pix(n, &galacticLongitudes[0], &galacticLatitudes[0], &pixels[0]);
+	for (size_t i = 0; i < n; i++)
+		addToMap(particleIds[i], energy2Idx(energies[i]), pixels[i],
+				weights.empty() ? 1. : weights[i]);
 }
 
 
@@ -82,8 +159,8 @@ void ParticleMapsContainer::addParticle(const int particleId, double energy, con
 std::vector<int> ParticleMapsContainer::getParticleIds()
 {
 	std::vector<int> ids;
-	for(std::map<int, std::map<int, double*> >::iterator pid_iter = _data.begin(); 
-			pid_iter != _data.end(); ++pid_iter) 
+	for(std::map<int, std::map<int, size_t> >::iterator pid_iter = _index.begin(); 
+			pid_iter != _index.end(); ++pid_iter) 
 	{
 		ids.push_back(pid_iter->first);
 	}
@@ -94,10 +171,10 @@ std::vector<int> ParticleMapsContainer::getParticleIds()
 std::vector<double> ParticleMapsContainer::getEnergies(int pid)
 {
 	std::vector<double> energies;
-	if (_data.find(pid) != _data.end())
+	if (_index.find(pid) != _index.end())
 	{
-		for(std::map<int, double*>::iterator iter = _data[pid].begin(); 
-			iter != _data[pid].end(); ++iter) 
+		for(std::map<int, size_t>::iterator iter = _index[pid].begin(); 
+			iter != _index[pid].end(); ++iter) 
 		{
 			energies.push_back( idx2Energy(iter->first) / eV );
 		}
@@ -111,26 +188,39 @@ void ParticleMapsContainer::applyLens(MagneticLens &lens)
 	// if lens is normalized, this should not be necessary.
 	_weightsUpToDate = false;
 
-	for(std::map<int, std::map<int, double*> >::iterator pid_iter = _data.begin(); 
-			pid_iter != _data.end(); ++pid_iter) {
-		for(std::map<int, double*>::iterator energy_iter = pid_iter->second.begin();
+	// the maps of nuclei covered by the lens are transformed together
+	std::vector<double*> models, unchanged;
+	std::vector<double> rigidities;
+	for(std::map<int, std::map<int, size_t> >::iterator pid_iter = _index.begin(); 
+			pid_iter != _index.end(); ++pid_iter) {
+		for(std::map<int, size_t>::iterator energy_iter = pid_iter->second.begin();
 			energy_iter != pid_iter->second.end(); ++energy_iter) {
+			// the lens fills the maps
+			ParticleMap &m = _maps[energy_iter->second];
+			densifyMap(m);
 		//	// transform only nuclei
 			double energy = idx2Energy(energy_iter->first);
 			int chargeNumber = HepPID::Z(pid_iter->first);
 			if (chargeNumber != 0 && lens.rigidityCovered(energy / chargeNumber))
 			{
-				lens.transformModelVector(energy_iter->second, energy / chargeNumber);
+				models.push_back(&m.dense[0]);
+				rigidities.push_back(energy / chargeNumber);
 			}
 			else
-			{ // still normalize the vectors 
-				for(size_t j=0; j< _pixelization.getNumberOfPixels() ; j++)
-				{
-					energy_iter->second[j]/=lens.getNorm();
-				}
+			{
+				unchanged.push_back(&m.dense[0]);
 			}
 		}
 	}
+	lens.transformModelVectors(models, rigidities);
+
+	// still normalize the vectors 
+	double norm = lens.getNorm();
+	size_t nPixels = _pixelization.getNumberOfPixels();
+#pragma omp parallel for
+	for (int i = 0; i < (int)unchanged.size(); i++)
+		for(size_t j=0; j< nPixels ; j++)
+			unchanged[i][j] /= norm;
 }
 
 
@@ -139,25 +229,64 @@ void ParticleMapsContainer::_updateWeights()
 	if (_weightsUpToDate)
 		return;
 
-	for(std::map<int, std::map<int, double*> >::iterator pid_iter = _data.begin(); 
-			pid_iter != _data.end(); ++pid_iter) 
+	// the pixels of every map
+	std::vector<double> weights;
+	for (size_t k = 0; k < _maps.size(); k++)
 	{
-		_weightsPID[pid_iter->first] = 0;
-
-		for(std::map<int, double*>::iterator energy_iter = pid_iter->second.begin();
-			energy_iter != pid_iter->second.end(); ++energy_iter) 
+		ParticleMap &m = _maps[k];
+		compactMap(m);
+		m.pixels.clear();
+		weights.clear();
+		if (m.dense.empty())
 		{
-
-			_weights_pidEnergy[pid_iter->first][energy_iter->first] = 0;
-			for(size_t j=0; j< _pixelization.getNumberOfPixels() ; j++)
+			for (size_t i = 0; i < m.entries.size(); i++)
 			{
-				_weights_pidEnergy[pid_iter->first][energy_iter->first] +=energy_iter->second[j];
-					
-				_weightsPID[pid_iter->first]+=energy_iter->second[j];
+				if (m.entries[i].second <= 0)
+					continue;
+				m.pixels.push_back(m.entries[i].first);
+				weights.push_back(m.entries[i].second);
 			}
-		_sumOfWeights+=_weights_pidEnergy[pid_iter->first][energy_iter->first];
 		}
+		else
+		{
+			for (size_t j = 0; j < m.dense.size(); j++)
+			{
+				if (m.dense[j] <= 0)
+					continue;
+				m.pixels.push_back(j);
+				weights.push_back(m.dense[j]);
+			}
+		}
+		m.weight = 0;
+		for (size_t i = 0; i < weights.size(); i++)
+			m.weight += weights[i];
+		m.table = weights.empty() ? AliasTable() : AliasTable(weights);
 	}
+
+	// the maps of every particle id, and the particle ids
+	_particles.clear();
+	_sumOfWeights = 0;
+	std::vector<double> particleWeights;
+	for(std::map<int, std::map<int, size_t> >::iterator pid_iter = _index.begin(); 
+			pid_iter != _index.end(); ++pid_iter) 
+	{
+		ParticleMaps p;
+		p.particleId = pid_iter->first;
+		p.weight = 0;
+		weights.clear();
+		for(std::map<int, size_t>::iterator energy_iter = pid_iter->second.begin();
+			energy_iter != pid_iter->second.end(); ++energy_iter) 
+		{
+			p.maps.push_back(energy_iter->second);
+			weights.push_back(_maps[energy_iter->second].weight);
+			p.weight += weights.back();
+		}
+		p.table = AliasTable(weights);
+		_particles.push_back(p);
+		particleWeights.push_back(p.weight);
+		_sumOfWeights += p.weight;
+	}
+	_particleTable = particleWeights.empty() ? AliasTable() : AliasTable(particleWeights);
 	_weightsUpToDate = true;
 }
 
@@ -167,34 +296,32 @@ void ParticleMapsContainer::getRandomParticles(size_t N, vector<int> &particleId
 	vector<double> &galacticLatitudes)
 {
 	_updateWeights();
+	if (_sumOfWeights <= 0)
+		throw std::runtime_error("ParticleMapsContainer: no particles to draw");
 
 	particleId.resize(N);
 	energy.resize(N);
 	galacticLongitudes.resize(N);
 	galacticLatitudes.resize(N);
 
+	Random &random = Random::instance();
+	std::vector<uint32_t> pixels(N);
 	for(size_t i=0; i< N; i++)
 	{
 		//get particle
-		double r = Random::instance().rand() * _sumOfWeights;
-		std::map<int, double>::iterator iter = _weightsPID.begin();
-		while ((r-= iter->second) > 0)
-		{
-		 ++iter; 
-		}
-		particleId[i] = iter->first;
+		const ParticleMaps &p = _particles[_particleTable.sample(random)];
+		particleId[i] = p.particleId;
 	
 		//get energy
-		r = Random::instance().rand() * iter->second;
-		iter = _weights_pidEnergy[particleId[i]].begin();
-		while ((r-= iter->second) > 0)
-		{
-		 ++iter; 
-		}
-		energy[i] = idx2Energy(iter->first) / eV;
+		const ParticleMap &m = _maps[p.maps[p.table.sample(random)]];
+		energy[i] = idx2Energy(m.energyIdx) / eV;
 
-		placeOnMap(particleId[i], energy[i] * eV, galacticLongitudes[i], galacticLatitudes[i]);
+		//get pixel, the directions are drawn together
+		pixels[i] = m.pixels[m.table.sample(random)];
 	}
+	if (N > 0)
+		_pixelization.getRandomDirectionsInPixels(N, &pixels[0],
+				&galacticLongitudes[0], &galacticLatitudes[0], random);
 }
 
 
@@ -202,28 +329,30 @@ bool ParticleMapsContainer::placeOnMap(int pid, double energy, double &galacticL
 {
 	_updateWeights();
 
-	if (_data.find(pid) == _data.end())
-	{
-		return false;
-	}
-	int energyIdx	= energy2Idx(energy);
-	if (_data[pid].find(energyIdx) == _data[pid].end())
+	ParticleMap *m = findMap(pid, energy2Idx(energy));
+	if (!m || m->pixels.empty())
 	{
 		return false;
 	}
 
-	double r = Random::instance().rand() * _weights_pidEnergy[pid][energyIdx];
+	_pixelization.getRandomDirectionInPixel(m->pixels[m->table.sample(Random::instance())],
+			galacticLongitude, galacticLatitude);
+	return true;
+}
+
 
-	for(size_t j=0; j< _pixelization.getNumberOfPixels(); j++)
+size_t ParticleMapsContainer::getMemoryUsage() const
+{
+	size_t usage = 0;
+	for (size_t k = 0; k < _maps.size(); k++)
 	{
-		r-= _data[pid][energyIdx][j];
-		if (r <=0)
-		{
-			_pixelization.getRandomDirectionInPixel(j, galacticLongitude, galacticLatitude );
-			return true;
-		}
+		const ParticleMap &m = _maps[k];
+		usage += m.entries.capacity() * sizeof(std::pair<uint32_t, double>)
+				+ m.dense.capacity() * sizeof(double)
+				+ m.pixels.capacity() * sizeof(uint32_t)
+				+ m.table.size() * (sizeof(double) + sizeof(uint32_t));
 	}
-	return false;
+	return usage;
 }
 
 
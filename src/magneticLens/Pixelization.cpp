@@ -23,11 +23,39 @@
 #include "crpropa/magneticLens/Pixelization.h"
 #include "crpropa/Random.h"
 
+#include <algorithm>
+#include <stdexcept>
+
 namespace crpropa 
 {
 
-	healpix::T_Healpix_Base<healpix::int64> Pixelization::_healpix_nest = healpix::T_Healpix_Base<healpix::int64>(29, healpix::NEST);
+	Pixelization::HealpixBase<healpix::int64> Pixelization::_healpix_nest(29, healpix::NEST);
+
+// number of directions converted per block
+static const size_t blockSize = 256;
 
+// 1 / ((2k) (2k + 1)) and 1 / ((2k - 1) (2k)) of the Taylor series of sine
+// and cosine
+static const double sinFactors[10] = {1. / (2 * 3), 1. / (4 * 5), 1. / (6 * 7),
+		1. / (8 * 9), 1. / (10 * 11), 1. / (12 * 13), 1. / (14 * 15), 1. / (16 * 17),
+		1. / (18 * 19), 1. / (20 * 21)};
+static const double cosFactors[11] = {1. / (1 * 2), 1. / (3 * 4), 1. / (5 * 6),
+		1. / (7 * 8), 1. / (9 * 10), 1. / (11 * 12), 1. / (13 * 14), 1. / (15 * 16),
+		1. / (17 * 18), 1. / (19 * 20), 1. / (21 * 22)};
+
+// sin(x) and cos(x) for |x| <= pi/2 by their Taylor series to x^22, exact up
+// to the rounding of doubles in this range. Free of calls to be vectorized.
+static inline void sinCosHalfPi(double x, double &s, double &c)
+{
+	double x2 = x * x;
+	double ps = 1, pc = 1;
+	for (int k = 10; k > 0; k--)
+		ps = 1. - ps * x2 * sinFactors[k - 1];
+	for (int k = 11; k > 0; k--)
+		pc = 1. - pc * x2 * cosFactors[k - 1];
+	s = x * ps;
+	c = pc;
+}
 
 uint8_t Pixelization::pix2Order(uint32_t pix)
 {
@@ -70,6 +98,51 @@ uint32_t Pixelization::direction2Pix(double longitude, double latitude) const
 	}
 }
 
+void Pixelization::directions2Pix(size_t n, const double *longitude,
+		const double *latitude, uint32_t *pixel) const
+{
+	// z = sin(latitude) and sin(theta) = cos(latitude) of a block first, then
+	// the pixels, skipping the conversion to vectors
+	double z[blockSize], sth[blockSize];
+	for (size_t first = 0; first < n; first += blockSize)
+	{
+		size_t m = std::min(blockSize, n - first);
+		const double *lat = latitude + first;
+#pragma omp simd
+		for (size_t i = 0; i < m; i++)
+			sinCosHalfPi(lat[i], z[i], sth[i]);
+		for (size_t i = 0; i < m; i++)
+		{
+			if (!(std::abs(lat[i]) <= M_PI / 2))
+				throw std::runtime_error("Pixelization::directions2Pix: latitude out of range");
+			pixel[first + i] = (uint32_t) _healpix->loc2pix(z[i], longitude[first + i],
+					sth[i], std::abs(z[i]) > 0.99);
+		}
+	}
+}
+
+void Pixelization::loc2Direction(double z, double phi, double sth,
+		bool have_sth, double &longitude, double &latitude)
+{
+	latitude = have_sth ? atan2(z, sth) : asin(z);
+	// phi in [0, 2 pi), as safe_atan2 in (-pi, pi]
+	longitude = (phi > M_PI) ? phi - 2 * M_PI : phi;
+}
+
+void Pixelization::pix2Directions(size_t n, const uint32_t *pixel,
+		double *longitude, double *latitude) const
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		if (pixel[i] >= nPix())
+			throw std::runtime_error("Pixelization::pix2Directions: invalid pixel");
+		double z, phi, sth;
+		bool have_sth;
+		_healpix->pix2loc(pixel[i], z, phi, sth, have_sth);
+		loc2Direction(z, phi, sth, have_sth, longitude[i], latitude[i]);
+	}
+}
+
 void Pixelization::pix2Direction(uint32_t i, double &longitude,
 		double &latitude) const
 {
@@ -116,14 +189,34 @@ double Pixelization::angularDistance(uint32_t i, uint32_t j) const
 
 void Pixelization::getRandomDirectionInPixel(uint32_t i, double &longitude, double &latitude) 
 {
-	
+	getRandomDirectionInPixel(i, longitude, latitude, Random::instance());
+}
+
+void Pixelization::getRandomDirectionInPixel(uint32_t i, double &longitude, double &latitude, Random &random) const
+{
 	uint64_t inest = _healpix->ring2nest(i);
 	uint64_t nUp = 29 - _healpix->Order();
 	uint64_t iUp = inest * pow(4, nUp);
-	iUp += Random::instance().randInt64(pow(4, nUp));
+	iUp += random.randInt64(pow(4, nUp));
 
 	healpix::vec3 v = _healpix_nest.pix2vec(iUp);
 	
 	vec2SphereCo(longitude, latitude, v);
 }
+
+void Pixelization::getRandomDirectionsInPixels(size_t n, const uint32_t *pixel,
+		double *longitude, double *latitude, Random &random) const
+{
+	uint64_t nUp = 29 - _healpix->Order();
+	uint64_t nSub = uint64_t(1) << (2 * nUp);
+	for (size_t i = 0; i < n; i++)
+	{
+		uint64_t iUp = uint64_t(_healpix->ring2nest(pixel[i])) * nSub
+				+ random.randInt64(nSub - 1);
+		double z, phi, sth;
+		bool have_sth;
+		_healpix_nest.pix2loc(iUp, z, phi, sth, have_sth);
+		loc2Direction(z, phi, sth, have_sth, longitude[i], latitude[i]);
+	}
+}
 } // namespace
@@ -0,0 +1,164 @@
+#include "crpropa/massDistribution/DensityGrid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+namespace crpropa {
+
+DensityGrid::DensityGrid(ref_ptr<Density> density,
+		const GridProperties &properties) : model(density) {
+	if (!density)
+		throw std::runtime_error("DensityGrid: no density model");
+	isHI = density->getIsForHI();
+	isHII = density->getIsForHII();
+	isH2 = density->getIsForH2();
+
+	ref_ptr<Grid1f> grids[5];
+	for (int i = 0; i < 5; i++) {
+		grids[i] = new Grid1f(properties);
+		// the edges of the volume are clamped to the outer grid points
+		grids[i]->setReflective(true);
+	}
+	HIGrid = grids[0];
+	HIIGrid = grids[1];
+	H2Grid = grids[2];
+	totalGrid = grids[3];
+	nucleonGrid = grids[4];
+
+	Vector3d origin = properties.origin;
+	Vector3d spacing = properties.spacing;
+	size_t Ny = properties.Ny, Nz = properties.Nz;
+	long rows = properties.Nx * Ny;
+	const Density &d = *density;
+#pragma omp parallel for schedule(dynamic)
+	for (long r = 0; r < rows; r++) {
+		size_t ix = r / Ny, iy = r % Ny;
+		for (size_t iz = 0; iz < Nz; iz++) {
+			Vector3d pos = Vector3d(ix + 0.5, iy + 0.5, iz + 0.5) * spacing + origin;
+			HIGrid->get(ix, iy, iz) = d.getHIDensity(pos);
+			HIIGrid->get(ix, iy, iz) = d.getHIIDensity(pos);
+			H2Grid->get(ix, iy, iz) = d.getH2Density(pos);
+			totalGrid->get(ix, iy, iz) = d.getDensity(pos);
+			nucleonGrid->get(ix, iy, iz) = d.getNucleonDensity(pos);
+		}
+	}
+
+	lower = origin;
+	upper = origin + Vector3d(properties.Nx, Ny, Nz) * spacing;
+}
+
+DensityGrid::DensityGrid(ref_ptr<Grid1f> HI, ref_ptr<Grid1f> HII,
+		ref_ptr<Grid1f> H2) : HIGrid(HI), HIIGrid(HII), H2Grid(H2) {
+	isHI = HI.valid();
+	isHII = HII.valid();
+	isH2 = H2.valid();
+	Grid1f *grid = isHI ? HI.get() : (isHII ? HII.get() : H2.get());
+	if (!grid)
+		throw std::runtime_error("DensityGrid: no component grid");
+	lower = grid->getOrigin();
+	upper = lower + Vector3d(grid->getNx(), grid->getNy(), grid->getNz())
+			* grid->getSpacing();
+}
+
+bool DensityGrid::isInside(const Vector3d &position) const {
+	return (position.x >= lower.x) and (position.x < upper.x)
+			and (position.y >= lower.y) and (position.y < upper.y)
+			and (position.z >= lower.z) and (position.z < upper.z);
+}
+
+double DensityGrid::value(const ref_ptr<Grid1f> &grid,
+		const Vector3d &position) const {
+	if (!grid or !isInside(position))
+		return 0;
+	return grid->interpolate(position);
+}
+
+double DensityGrid::getDensity(const Vector3d &position) const {
+	if (totalGrid)
+		return value(totalGrid, position);
+	return value(HIGrid, position) + value(HIIGrid, position)
+			+ value(H2Grid, position);
+}
+
+double DensityGrid::getHIDensity(const Vector3d &position) const {
+	return value(HIGrid, position);
+}
+
+double DensityGrid::getHIIDensity(const Vector3d &position) const {
+	return value(HIIGrid, position);
+}
+
+double DensityGrid::getH2Density(const Vector3d &position) const {
+	return value(H2Grid, position);
+}
+
+double DensityGrid::getNucleonDensity(const Vector3d &position) const {
+	if (nucleonGrid)
+		return value(nucleonGrid, position);
+	return value(HIGrid, position) + value(HIIGrid, position)
+			+ 2 * value(H2Grid, position);
+}
+
+bool DensityGrid::getIsForHI() {
+	return isHI;
+}
+
+bool DensityGrid::getIsForHII() {
+	return isHII;
+}
+
+bool DensityGrid::getIsForH2() {
+	return isH2;
+}
+
+ref_ptr<Grid1f> DensityGrid::getHIGrid() {
+	return HIGrid;
+}
+
+ref_ptr<Grid1f> DensityGrid::getHIIGrid() {
+	return HIIGrid;
+}
+
+ref_ptr<Grid1f> DensityGrid::getH2Grid() {
+	return H2Grid;
+}
+
+// index of the k-th of n sample points between the N grid points of an axis,
+// halfway to the next grid point, or on the grid point for a single one
+static double midpoint(size_t k, size_t n, size_t N) {
+	if (N < 2)
+		return 0.5;
+	size_t i = std::min(k * (N - 1) / n, N - 2);
+	return i + 1.;
+}
+
+double DensityGrid::estimateError(size_t n) const {
+	if (!model)
+		throw std::runtime_error("DensityGrid: no density model to compare to");
+	if (n == 0)
+		throw std::runtime_error("DensityGrid: no sample points");
+
+	Vector3d spacing = totalGrid->getSpacing();
+	size_t Nx = totalGrid->getNx(), Ny = totalGrid->getNy(), Nz = totalGrid->getNz();
+	const Density &d = *model;
+	double maxDifference = 0, maxDensity = 0;
+	long rows = n * n;
+#pragma omp parallel for reduction(max: maxDifference, maxDensity)
+	for (long r = 0; r < rows; r++) {
+		double x = midpoint(r / n, n, Nx), y = midpoint(r % n, n, Ny);
+		for (size_t k = 0; k < n; k++) {
+			Vector3d pos = Vector3d(x, y, midpoint(k, n, Nz)) * spacing + lower;
+			double exact = d.getDensity(pos);
+			maxDifference = std::max(maxDifference,
+					std::fabs(value(totalGrid, pos) - exact));
+			maxDensity = std::max(maxDensity, std::fabs(exact));
+		}
+	}
+	if (maxDensity == 0)
+		return maxDifference == 0 ? 0 : std::numeric_limits<double>::infinity();
+	return maxDifference / maxDensity;
+}
+
+}  // namespace crpropa
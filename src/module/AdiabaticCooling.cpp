@@ -39,6 +39,22 @@ void AdiabaticCooling::process(Candidate *c) const {
 	c->limitNextStep(limit * E / fabs(dEdt) *c_light);
 }
 
+bool AdiabaticCooling::hasEnergyLossRate() const {
+	return true;
+}
+
+double AdiabaticCooling::getEnergyLossRate(const Candidate *candidate, double E, double z) const {
+	double Div = 0.;
+	try {
+		Div += advectionField->getDivergence(candidate->current.getPosition());
+	}
+	catch (std::exception &e) {
+		KISS_LOG_ERROR 	<< "AdiabaticCooling: Exception in getDivergence.\n"
+				<< e.what();
+	}
+	return E / 3. * Div / c_light; // -dE/dt = p/3 * div(V_wind), per distance
+}
+
 void AdiabaticCooling::setLimit(double l) {
 	limit = l;
 }
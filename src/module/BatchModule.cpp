@@ -0,0 +1,79 @@
+#include "crpropa/module/BatchModule.h"
+
+#include <stdexcept>
+
+namespace crpropa {
+
+void CandidateBatch::fill(Candidate **c, size_t count) {
+	candidates.assign(c, c + count);
+	energy.resize(count);
+	position.resize(3 * count);
+	direction.resize(3 * count);
+	id.resize(count);
+	redshift.resize(count);
+	active.resize(count);
+	nextStep.resize(count);
+	trajectoryLength.resize(count);
+	currentStep.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		const ParticleState &p = c[i]->current;
+		energy[i] = p.getEnergy();
+		const Vector3d &x = p.getPosition(), &u = p.getDirection();
+		for (int k = 0; k < 3; k++) {
+			position[3 * i + k] = x.data[k];
+			direction[3 * i + k] = u.data[k];
+		}
+		id[i] = p.getId();
+		redshift[i] = c[i]->getRedshift();
+		active[i] = c[i]->isActive();
+		nextStep[i] = c[i]->getNextStep();
+		trajectoryLength[i] = c[i]->getTrajectoryLength();
+		currentStep[i] = c[i]->getCurrentStep();
+	}
+}
+
+void CandidateBatch::apply() const {
+	for (size_t i = 0; i < candidates.size(); i++) {
+		Candidate *c = candidates[i];
+		ParticleState &p = c->current;
+		if (id[i] != p.getId())
+			p.setId(id[i]);
+		if (energy[i] != p.getEnergy())
+			p.setEnergy(energy[i]);
+		Vector3d x(&position[3 * i]), u(&direction[3 * i]);
+		if (!(x == p.getPosition()))
+			p.setPosition(x);
+		if (!(u == p.getDirection()))
+			p.setDirection(u);
+		if (redshift[i] != c->getRedshift())
+			c->setRedshift(redshift[i]);
+		if (bool(active[i]) != c->isActive())
+			c->setActive(active[i]);
+		c->limitNextStep(nextStep[i]);
+	}
+}
+
+size_t CandidateBatch::size() const {
+	return candidates.size();
+}
+
+Candidate *CandidateBatch::getCandidate(size_t i) const {
+	if (i >= candidates.size())
+		throw std::runtime_error("CandidateBatch: index out of range");
+	return candidates[i];
+}
+
+void BatchModule::process(Candidate *candidate) const {
+	processBatch(&candidate, 1);
+}
+
+void BatchModule::processBatch(Candidate **candidates, size_t count) const {
+	if (count == 0)
+		return;
+	CandidateBatch batch;
+	batch.fill(candidates, count);
+	processCandidates(batch);
+	batch.apply();
+}
+
+} // namespace crpropa
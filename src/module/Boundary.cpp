@@ -1,7 +1,9 @@
 #include "crpropa/module/Boundary.h"
 #include "crpropa/Units.h"
+#include "crpropa/Geometry.h"
 
 #include <sstream>
+#include <stdexcept>
 
 namespace crpropa {
 
@@ -110,11 +112,11 @@ std::string ReflectiveBox::getDescription() const {
 }
 
 CubicBoundary::CubicBoundary() :
-		origin(Vector3d(0, 0, 0)), size(0), limitStep(true), margin(0.1 * kpc) {
+		origin(Vector3d(0, 0, 0)), size(0), limitStep(true), margin(0.1 * kpc), eventDriven(false) {
 }
 
 CubicBoundary::CubicBoundary(Vector3d o, double s) :
-		origin(o), size(s), limitStep(true), margin(0.1 * kpc) {
+		origin(o), size(s), limitStep(true), margin(0.1 * kpc), eventDriven(false) {
 }
 
 void CubicBoundary::process(Candidate *c) const {
@@ -124,7 +126,12 @@ void CubicBoundary::process(Candidate *c) const {
 	if ((lo <= 0) or (hi >= size)) {
 		reject(c);
 	}
-	if (limitStep) {
+	if (not limitStep)
+		return;
+	if (eventDriven and c->current.getCharge() == 0) {
+		ParaxialBox box(origin, Vector3d(size));
+		c->limitNextStep(box.distanceAlong(c->current.getPosition(), c->current.getDirection()) + margin);
+	} else {
 		c->limitNextStep(lo + margin);
 		c->limitNextStep(size - hi + margin);
 	}
@@ -142,6 +149,29 @@ void CubicBoundary::setMargin(double m) {
 void CubicBoundary::setLimitStep(bool b) {
 	limitStep = b;
 }
+void CubicBoundary::setEventDriven(bool b) {
+	eventDriven = b;
+}
+
+Vector3d CubicBoundary::getOrigin() const {
+	return origin;
+}
+
+double CubicBoundary::getSize() const {
+	return size;
+}
+
+double CubicBoundary::getMargin() const {
+	return margin;
+}
+
+bool CubicBoundary::getLimitStep() const {
+	return limitStep;
+}
+
+bool CubicBoundary::isEventDriven() const {
+	return eventDriven;
+}
 
 std::string CubicBoundary::getDescription() const {
 	std::stringstream s;
@@ -155,11 +185,11 @@ std::string CubicBoundary::getDescription() const {
 }
 
 SphericalBoundary::SphericalBoundary() :
-		center(Vector3d(0, 0, 0)), radius(0), limitStep(true), margin(0.1 * kpc) {
+		center(Vector3d(0, 0, 0)), radius(0), limitStep(true), margin(0.1 * kpc), eventDriven(false) {
 }
 
 SphericalBoundary::SphericalBoundary(Vector3d c, double r) :
-		center(c), radius(r), limitStep(true), margin(0.1 * kpc) {
+		center(c), radius(r), limitStep(true), margin(0.1 * kpc), eventDriven(false) {
 }
 
 void SphericalBoundary::process(Candidate *c) const {
@@ -167,7 +197,12 @@ void SphericalBoundary::process(Candidate *c) const {
 	if (d >= radius) {
 		reject(c);
 	}
-	if (limitStep)
+	if (not limitStep)
+		return;
+	if (eventDriven and c->current.getCharge() == 0) {
+		Sphere sphere(center, radius);
+		c->limitNextStep(sphere.distanceAlong(c->current.getPosition(), c->current.getDirection()) + margin);
+	} else
 		c->limitNextStep(radius - d + margin);
 }
 
@@ -184,6 +219,30 @@ void SphericalBoundary::setLimitStep(bool b) {
 	limitStep = b;
 }
 
+void SphericalBoundary::setEventDriven(bool b) {
+	eventDriven = b;
+}
+
+Vector3d SphericalBoundary::getCenter() const {
+	return center;
+}
+
+double SphericalBoundary::getRadius() const {
+	return radius;
+}
+
+double SphericalBoundary::getMargin() const {
+	return margin;
+}
+
+bool SphericalBoundary::getLimitStep() const {
+	return limitStep;
+}
+
+bool SphericalBoundary::isEventDriven() const {
+	return eventDriven;
+}
+
 std::string SphericalBoundary::getDescription() const {
 	std::stringstream s;
 	s << "Spherical Boundary: radius " << radius / Mpc << " Mpc, ";
@@ -291,4 +350,45 @@ std::string CylindricalBoundary::getDescription() const {
 	return s.str();
 }
 
+SurfaceBoundary::SurfaceBoundary(Surface *s) :
+		surface(s), margin(0.1 * kpc), limitStep(true), eventDriven(false) {
+	if (not s)
+		throw std::runtime_error("SurfaceBoundary: no surface");
+}
+
+void SurfaceBoundary::process(Candidate *c) const {
+	Vector3d position = c->current.getPosition();
+	if (surface->distance(position) >= 0) {
+		reject(c);
+	}
+	if (not limitStep)
+		return;
+	if (eventDriven and c->current.getCharge() == 0)
+		c->limitNextStep(surface->distanceAlong(position, c->current.getDirection()) + margin);
+	else
+		c->limitNextStep(surface->nearestDistance(position) + margin);
+}
+
+void SurfaceBoundary::setMargin(double m) {
+	margin = m;
+}
+
+void SurfaceBoundary::setLimitStep(bool b) {
+	limitStep = b;
+}
+
+void SurfaceBoundary::setEventDriven(bool b) {
+	eventDriven = b;
+}
+
+std::string SurfaceBoundary::getDescription() const {
+	std::stringstream s;
+	s << "Surface Boundary: " << surface->getDescription();
+	s << "Flag: '" << rejectFlagKey << "' -> '" << rejectFlagValue << "', ";
+	s << "MakeInactive: " << (makeRejectedInactive ? "yes" : "no");
+	if (rejectAction.valid())
+		s << ", Action: " << rejectAction->getDescription();
+	return s.str();
+}
+
 } // namespace crpropa
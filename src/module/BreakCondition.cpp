@@ -1,8 +1,13 @@
 #include "crpropa/module/BreakCondition.h"
+#include "crpropa/Candidate.h"
+#include "crpropa/Common.h"
 #include "crpropa/ParticleID.h"
 #include "crpropa/Units.h"
 
+#include <cmath>
+#include <limits>
 #include <sstream>
+#include <stdexcept>
 
 namespace crpropa {
 
@@ -19,11 +24,15 @@ double MaximumTrajectoryLength::getMaximumTrajectoryLength() const {
 }
 
 void MaximumTrajectoryLength::addObserverPosition(const Vector3d& position) {
-	observerPositions.push_back(position);
+	observerPositions.add(position);
 }
 
 const std::vector<Vector3d>& MaximumTrajectoryLength::getObserverPositions() const {
-	return observerPositions;
+	return observerPositions.getPoints();
+}
+
+double MaximumTrajectoryLength::getNearestObserverDistance(const Vector3d &position) const {
+	return observerPositions.nearestDistance(position);
 }
 
 std::string MaximumTrajectoryLength::getDescription() const {
@@ -35,7 +44,7 @@ std::string MaximumTrajectoryLength::getDescription() const {
 		s << ", Action: " << rejectAction->getDescription();
 	s << "\n  Observer positions: \n";
 	for (size_t i = 0; i < observerPositions.size(); i++)
-		s << "    - " << observerPositions[i] / Mpc << " Mpc\n";
+		s << "    - " << observerPositions.getPoint(i) / Mpc << " Mpc\n";
 	return s.str();
 }
 
@@ -43,14 +52,10 @@ void MaximumTrajectoryLength::process(Candidate *c) const {
 	double length = c->getTrajectoryLength();
 	Vector3d position = c->current.getPosition();
 
-	if(observerPositions.size()) {
-		bool inRange = false;
-		for (size_t i = 0; i < observerPositions.size(); i++) {
-			double distance = position.getDistanceTo(observerPositions[i]);
-			if (distance + length < maxLength)
-				inRange = true;
-		}
-		if (!inRange) {
+	if (not observerPositions.empty()) {
+		// in range if the nearest observer can still be reached
+		double distance = observerPositions.nearestDistance(position);
+		if (not (distance + length < maxLength)) {
 			reject(c);
 			return;
 		}
@@ -182,13 +187,57 @@ std::string MinimumChargeNumber::getDescription() const {
 }
 
 //*****************************************************************************
-MinimumEnergyPerParticleId::MinimumEnergyPerParticleId(double minEnergyOthers) {
+// index Z * 31 + N of nuclei in their ground state up to Z = 26, N = 30,
+// -1 for all other ids
+static int nucleusIndex(int id) {
+	if ((id < 1000000000) or (id % 10 != 0))
+		return -1;
+	int Z = (id / 10000) % 1000;
+	int A = (id / 10) % 1000;
+	if ((id / 10000000) != 100 or (Z > 26) or (A < Z) or (A - Z > 30))
+		return -1;
+	return Z * 31 + (A - Z);
+}
+
+MinimumEnergyPerParticleId::MinimumEnergyPerParticleId(double minEnergyOthers) :
+		elementaryMinEnergies(200, std::numeric_limits<double>::quiet_NaN()),
+		nucleusMinEnergies(27 * 31, std::numeric_limits<double>::quiet_NaN()) {
 	setMinimumEnergyOthers(minEnergyOthers);
 }
 
 void MinimumEnergyPerParticleId::add(int id, double energy) {
 	particleIds.push_back(id);
 	minEnergies.push_back(energy);
+
+	// the first threshold given for an id applies
+	if (findMinimumEnergy(id))
+		return;
+	if ((id > -100) and (id < 100)) {
+		elementaryMinEnergies[id + 100] = energy;
+		return;
+	}
+	int i = nucleusIndex(id);
+	if (i >= 0)
+		nucleusMinEnergies[i] = energy;
+	else
+		otherMinEnergies[id] = energy;
+}
+
+const double *MinimumEnergyPerParticleId::findMinimumEnergy(int id) const {
+	const double *e = NULL;
+	if ((id > -100) and (id < 100)) {
+		e = &elementaryMinEnergies[id + 100];
+	} else {
+		int i = nucleusIndex(id);
+		if (i >= 0)
+			e = &nucleusMinEnergies[i];
+	}
+	if (e)
+		return std::isnan(*e) ? NULL : e;
+	if (otherMinEnergies.empty())
+		return NULL;
+	std::map<int, double>::const_iterator i = otherMinEnergies.find(id);
+	return (i == otherMinEnergies.end()) ? NULL : &i->second;
 }
 
 void MinimumEnergyPerParticleId::setMinimumEnergyOthers(double energy) {
@@ -199,20 +248,14 @@ double MinimumEnergyPerParticleId::getMinimumEnergyOthers() const {
 	return minEnergyOthers;
 }
 
-void MinimumEnergyPerParticleId::process(Candidate *c) const {
-	for (int i = 0; i < particleIds.size(); i++) {
-		if (c->current.getId() == particleIds[i]) {
-			if (c->current.getEnergy() < minEnergies[i])
-				reject(c);
-			else
-				return;
-		}
-	}
+double MinimumEnergyPerParticleId::getMinimumEnergy(int id) const {
+	const double *e = findMinimumEnergy(id);
+	return e ? *e : minEnergyOthers;
+}
 
-	if (c->current.getEnergy() < minEnergyOthers)
+void MinimumEnergyPerParticleId::process(Candidate *c) const {
+	if (c->current.getEnergy() < getMinimumEnergy(c->current.getId()))
 		reject(c);
-	else
-		return;
 }
 
 std::string MinimumEnergyPerParticleId::getDescription() const {
@@ -228,6 +271,211 @@ std::string MinimumEnergyPerParticleId::getDescription() const {
 	return s.str();
 }
 
+//*****************************************************************************
+// range tables in 20 bins per decade of the energy up to 1e24 eV
+static const double pruningBinsPerDecade = 20;
+static const double pruningMaximumEnergy = 1e24 * eV;
+
+ReachabilityPruning::ReachabilityPruning(double minEnergy) :
+		redshift(0), classes(AllParticleClasses), compactTables(200 + 27 * 31),
+		prunedCount(0), prunedWeight(0) {
+	setMinimumEnergy(minEnergy);
+}
+
+ReachabilityPruning::~ReachabilityPruning() {
+}
+
+void ReachabilityPruning::clearTables() {
+	for (size_t i = 0; i < compactTables.size(); i++)
+		compactTables[i].store(NULL);
+	otherTables.clear();
+	tableStorage.clear();
+}
+
+void ReachabilityPruning::setMinimumEnergy(double energy) {
+	thresholds = new MinimumEnergyPerParticleId(energy);
+	clearTables();
+}
+
+void ReachabilityPruning::setMinimumEnergies(MinimumEnergyPerParticleId *thresholds) {
+	if (thresholds == NULL)
+		throw std::runtime_error("ReachabilityPruning: no minimum energies");
+	this->thresholds = thresholds;
+	clearTables();
+}
+
+void ReachabilityPruning::add(Module *module) {
+	if (not module->hasEnergyLossRate())
+		throw std::runtime_error("ReachabilityPruning: " + module->getDescription() + " has no energy loss rate");
+	losses.push_back(module);
+	lossClasses.push_back(module->getParticleClasses());
+	clearTables();
+}
+
+void ReachabilityPruning::addObserverPosition(const Vector3d &position) {
+	observerPositions.add(position);
+}
+
+void ReachabilityPruning::addObserverSurface(Surface *surface) {
+	observerSurfaces.push_back(surface);
+}
+
+void ReachabilityPruning::setRedshift(double z) {
+	redshift = z;
+	clearTables();
+}
+
+double ReachabilityPruning::getRedshift() const {
+	return redshift;
+}
+
+void ReachabilityPruning::setParticleClasses(unsigned int classes) {
+	this->classes = classes;
+}
+
+unsigned int ReachabilityPruning::getParticleClasses() const {
+	return classes;
+}
+
+double ReachabilityPruning::getNearestObserverDistance(const Vector3d &position) const {
+	double distance = std::numeric_limits<double>::max();
+	if (not observerPositions.empty())
+		distance = observerPositions.nearestDistance(position);
+	for (size_t i = 0; i < observerSurfaces.size(); i++)
+		distance = std::min(distance, observerSurfaces[i]->nearestDistance(position));
+	return distance;
+}
+
+ReachabilityPruning::RangeTable *ReachabilityPruning::buildTable(int id) const {
+	RangeTable *table = new RangeTable;
+	table->threshold = thresholds->getMinimumEnergy(id);
+	if (not (table->threshold > 0))
+		return table; // no range without a threshold
+
+	unsigned int cls = particleClass(id);
+	Candidate candidate(id, table->threshold);
+	candidate.setRedshift(redshift);
+	size_t n = 1;
+	if (table->threshold < pruningMaximumEnergy)
+		n += std::ceil(pruningBinsPerDecade * std::log10(pruningMaximumEnergy / table->threshold));
+
+	// the smallest loss rate at the bin edges bounds the time spent in a bin
+	table->range.resize(n, 0);
+	double E0 = table->threshold, rate0 = 0;
+	for (size_t i = 0; i < n; i++) {
+		double E1 = table->threshold * std::pow(10, i / pruningBinsPerDecade);
+		candidate.current.setEnergy(E1);
+		double rate1 = 0;
+		for (size_t j = 0; j < losses.size(); j++)
+			if (lossClasses[j] & cls)
+				rate1 += losses[j]->getEnergyLossRate(&candidate, E1, redshift);
+		if (i > 0) {
+			double rate = std::min(rate0, rate1);
+			if (rate > 0)
+				table->range[i] = table->range[i - 1] + (E1 - E0) / rate;
+			else
+				table->range[i] = std::numeric_limits<double>::infinity();
+		}
+		E0 = E1;
+		rate0 = rate1;
+	}
+	return table;
+}
+
+const ReachabilityPruning::RangeTable *ReachabilityPruning::getTable(int id) const {
+	std::atomic<const RangeTable*> *slot = NULL;
+	if ((id > -100) and (id < 100)) {
+		slot = &compactTables[id + 100];
+	} else {
+		int i = nucleusIndex(id);
+		if (i >= 0)
+			slot = &compactTables[200 + i];
+	}
+	if (slot) {
+		const RangeTable *table = slot->load(std::memory_order_acquire);
+		if (table)
+			return table;
+	}
+
+	// built once under the lock, other ids are looked up under the lock
+	std::lock_guard<std::mutex> lock(tableMutex);
+	if (slot) {
+		const RangeTable *table = slot->load(std::memory_order_relaxed);
+		if (table)
+			return table;
+	} else {
+		std::map<int, const RangeTable*>::const_iterator i = otherTables.find(id);
+		if (i != otherTables.end())
+			return i->second;
+	}
+	RangeTable *table = buildTable(id);
+	tableStorage.push_back(std::unique_ptr<RangeTable>(table));
+	if (slot)
+		slot->store(table, std::memory_order_release);
+	else
+		otherTables[id] = table;
+	return table;
+}
+
+double ReachabilityPruning::getMaximumRange(int id, double E) const {
+	const RangeTable *table = getTable(id);
+	if (table->range.empty())
+		return std::numeric_limits<double>::infinity();
+	if (E < table->threshold)
+		return 0;
+
+	// upper edge of the bin of E
+	double x = pruningBinsPerDecade * mathLog10(E / table->threshold);
+	if (not (x < table->range.size() - 1))
+		return std::numeric_limits<double>::infinity();
+	return table->range[size_t(x) + 1];
+}
+
+unsigned long long ReachabilityPruning::getPrunedCount() const {
+	return prunedCount;
+}
+
+double ReachabilityPruning::getPrunedWeight() const {
+	return prunedWeight;
+}
+
+void ReachabilityPruning::resetCounters() {
+	prunedCount = 0;
+	prunedWeight = 0;
+}
+
+std::string ReachabilityPruning::getDescription() const {
+	std::stringstream s;
+	s << "Reachability pruning: " << losses.size() << " loss modules at z = " << redshift
+			<< ", " << observerPositions.size() << " observer positions, "
+			<< observerSurfaces.size() << " observer surfaces, ";
+	s << "Flag: '" << rejectFlagKey << "' -> '" << rejectFlagValue << "', ";
+	s << "MakeInactive: " << (makeRejectedInactive ? "yes" : "no");
+	if (rejectAction.valid())
+		s << ", Action: " << rejectAction->getDescription();
+	s << "\n  " << thresholds->getDescription();
+	for (size_t i = 0; i < losses.size(); i++)
+		s << "\n  " << losses[i]->getDescription();
+	return s.str();
+}
+
+void ReachabilityPruning::process(Candidate *c) const {
+	double distance = getNearestObserverDistance(c->current.getPosition());
+	if (not (distance > getMaximumRange(c->current.getId(), c->current.getEnergy())))
+		return;
+
+	// flagged candidates that stay active are counted once
+	if ((not makeRejectedInactive) and (not rejectFlagKey.empty()) and c->hasProperty(rejectFlagKey))
+		return;
+
+	double weight = c->getWeight();
+#pragma omp atomic
+	prunedCount++;
+#pragma omp atomic
+	prunedWeight += weight;
+	reject(c);
+}
+
 //*****************************************************************************
 DetectionLength::DetectionLength(double detLength) :
 		detLength(detLength) {
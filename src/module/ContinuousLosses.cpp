@@ -0,0 +1,153 @@
+#include "crpropa/module/ContinuousLosses.h"
+#include "crpropa/module/Redshift.h"
+#include "crpropa/Cosmology.h"
+#include "crpropa/Diagnostics.h"
+#include "crpropa/Units.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+namespace crpropa {
+
+// Runge-Kutta sub-steps per step, reached when the energy is lost within the step
+static const int maxSubSteps = 10000;
+
+ContinuousLosses::ContinuousLosses(double limit, double tolerance) :
+		updateRedshift(false), limit(limit), tolerance(tolerance) {
+}
+
+void ContinuousLosses::add(Module *module) {
+	if (not module->hasEnergyLossRate())
+		throw std::runtime_error("ContinuousLosses: " + module->getDescription() + " has no energy loss rate");
+	losses.push_back(module);
+	lossClasses.push_back(module->getParticleClasses());
+	if (dynamic_cast<Redshift*>(module))
+		updateRedshift = true;
+}
+
+void ContinuousLosses::setLimit(double limit) {
+	this->limit = limit;
+}
+
+double ContinuousLosses::getLimit() const {
+	return limit;
+}
+
+void ContinuousLosses::setTolerance(double tolerance) {
+	if (tolerance <= 0)
+		throw std::runtime_error("ContinuousLosses: tolerance must be positive");
+	this->tolerance = tolerance;
+}
+
+double ContinuousLosses::getTolerance() const {
+	return tolerance;
+}
+
+size_t ContinuousLosses::size() const {
+	return losses.size();
+}
+
+bool ContinuousLosses::updatesRedshift() const {
+	return updateRedshift;
+}
+
+void ContinuousLosses::prepare() {
+	prepareModules(std::vector<Module *>(losses.begin(), losses.end()));
+}
+
+double ContinuousLosses::lossRate(const Candidate *candidate, unsigned int particleClass, double E, double z) const {
+	double rate = 0;
+	for (size_t i = 0; i < losses.size(); i++)
+		if (lossClasses[i] & particleClass)
+			rate += losses[i]->getEnergyLossRate(candidate, E, z);
+	return rate;
+}
+
+double ContinuousLosses::getLossRate(const Candidate *candidate, double E, double z) const {
+	return lossRate(candidate, particleClass(candidate->current.getId()), E, z);
+}
+
+void ContinuousLosses::process(Candidate *candidate) const {
+	double E = candidate->current.getEnergy();
+	double z = candidate->getRedshift();
+	double step = candidate->getCurrentStep();
+	double integrated = integrate(candidate, step, E, z);
+	if (integrated < step)
+		candidate->limitNextStep(integrated);
+
+	candidate->current.setEnergy(E);
+	if (updateRedshift)
+		candidate->setRedshift(z);
+
+	// limit next step to a fraction of the total energy loss length
+	double rate = getLossRate(candidate, E, z);
+	if (rate != 0)
+		candidate->limitNextStep(limit * E / fabs(rate));
+}
+
+double ContinuousLosses::integrate(const Candidate *candidate, double step, double &E, double &z) const {
+	unsigned int cls = particleClass(candidate->current.getId());
+
+	// redshift along the step: dz / ds = -H(z) / c
+	bool evolveRedshift = updateRedshift and (z > std::numeric_limits<double>::min());
+
+	// fourth order Runge-Kutta for dE/ds = -b(E, z) and dz/ds = -H(z) / c
+	double s = 0;
+	int n = 0;
+	while (s < step) {
+		if (n == maxSubSteps) {
+			CRPROPA_DIAGNOSTIC("ContinuousLosses: sub-step limit reached, step only partly integrated",
+					"integrated " << s << " m of " << step << " m at E = " << E << " J");
+			return s;
+		}
+		double b1 = lossRate(candidate, cls, E, z);
+		if (b1 == 0 and not evolveRedshift)
+			break;
+		double h = step - s;
+		if (b1 != 0)
+			h = std::min(h, tolerance * E / fabs(b1));
+
+		double dz1 = 0, dz2 = 0, dz3 = 0, dz4 = 0;
+		if (evolveRedshift)
+			dz1 = -hubbleRate(z) / c_light;
+		double b2 = lossRate(candidate, cls, E - h / 2 * b1, std::max(z + h / 2 * dz1, 0.));
+		if (evolveRedshift)
+			dz2 = -hubbleRate(std::max(z + h / 2 * dz1, 0.)) / c_light;
+		double b3 = lossRate(candidate, cls, E - h / 2 * b2, std::max(z + h / 2 * dz2, 0.));
+		if (evolveRedshift)
+			dz3 = -hubbleRate(std::max(z + h / 2 * dz2, 0.)) / c_light;
+		double b4 = lossRate(candidate, cls, E - h * b3, std::max(z + h * dz3, 0.));
+		if (evolveRedshift)
+			dz4 = -hubbleRate(std::max(z + h * dz3, 0.)) / c_light;
+
+		E -= h / 6 * (b1 + 2 * b2 + 2 * b3 + b4);
+		if (evolveRedshift) {
+			z = std::max(z + h / 6 * (dz1 + 2 * dz2 + 2 * dz3 + dz4), 0.);
+			evolveRedshift = z > std::numeric_limits<double>::min();
+		}
+		s += h;
+		n++;
+	}
+	return step;
+}
+
+unsigned int ContinuousLosses::getParticleClasses() const {
+	unsigned int classes = 0;
+	for (size_t i = 0; i < lossClasses.size(); i++)
+		classes |= lossClasses[i];
+	return classes;
+}
+
+std::string ContinuousLosses::getDescription() const {
+	std::stringstream s;
+	s << "ContinuousLosses: " << losses.size() << " modules, limit " << limit
+			<< ", tolerance " << tolerance;
+	for (size_t i = 0; i < losses.size(); i++)
+		s << "\n    " << losses[i]->getDescription();
+	return s.str();
+}
+
+} // namespace crpropa
@@ -1,4 +1,5 @@
 #include "crpropa/module/DiffusionSDE.h"
+#include "crpropa/GridTools.h"
 
 
 using namespace crpropa;
@@ -29,6 +30,7 @@ DiffusionSDE::DiffusionSDE(ref_ptr<MagneticField> magneticField, double toleranc
   	setEpsilon(epsilon);
   	setScale(1.);
   	setAlpha(1./3.);
+  	setScheme(EulerMaruyama);
 	}
 
 DiffusionSDE::DiffusionSDE(ref_ptr<MagneticField> magneticField, ref_ptr<AdvectionField> advectionField, double tolerance, double minStep, double maxStep, double epsilon) :
@@ -42,9 +44,27 @@ DiffusionSDE::DiffusionSDE(ref_ptr<MagneticField> magneticField, ref_ptr<Advecti
 	setEpsilon(epsilon);
 	setScale(1.);
 	setAlpha(1./3.);
+	setScheme(EulerMaruyama);
   	}
 
 void DiffusionSDE::process(Candidate *candidate) const {
+	// Generate random numbers
+	double eta[] = {0., 0., 0.};
+	if (candidate->current.getCharge() != 0)
+		Random::instance().fillNormal(eta, 3);
+	integrate(candidate, eta);
+}
+
+void DiffusionSDE::processBatch(Candidate **candidates, size_t count) const {
+	// draw the Gaussians of all pseudo-particles in bulk
+	static thread_local std::vector<double> eta;
+	eta.resize(3 * count);
+	Random::instance().fillNormal(eta.data(), 3 * count);
+	for (size_t i = 0; i < count; i++)
+		integrate(candidates[i], &eta[3 * i]);
+}
+
+void DiffusionSDE::integrate(Candidate *candidate, const double eta[]) const {
 
     // save the new previous particle state
 
@@ -81,12 +101,6 @@ void DiffusionSDE::process(Candidate *candidate) const {
 	calculateBTensor(rig, BTensor, PosIn, DirIn, z);
 
 
-    // Generate random numbers
-	double eta[] = {0., 0., 0.};
-	for(size_t i=0; i < 3; i++) {
-	  	eta[i] =  Random::instance().randNorm();
-	}
-
 	double TStep = BTensor[0] * eta[0];
 	double NStep = BTensor[4] * eta[1];
 	double BStep = BTensor[8] * eta[2];
@@ -130,6 +144,8 @@ void DiffusionSDE::process(Candidate *candidate) const {
     // Exception: If the magnetic field vanishes: Use only advection.
     // If an advection field is not provided --> rectilinear propagation.
 	double tTest = TVec.getR();
+	if (statistics.isEnabled())
+		recordStep(candidate, counter, stepNumber, r > 1);
 	if (tTest != tTest) {
 	  	Vector3d dir = current.getDirection();
 		Vector3d Pos = current.getPosition();
@@ -162,14 +178,23 @@ void DiffusionSDE::process(Candidate *candidate) const {
     // Calculate the Binormal-vector
 	BVec = (TVec.cross(NVec)).getUnitVector();
 
+    // Diffusive displacement: along the field line and perpendicular to it
+	Vector3d Diffusion = PosOut - PosIn + (NVec * NStep + BVec * BStep) * sqrt(h);
+
     // Calculate the advection step
 	Vector3d LinProp(0.);
 	if (advectionField){
 		driftStep(PosIn, LinProp, h);
+		if (scheme == WeakOrder2) {
+			// predictor-corrector: average of the drift at the start and at the Euler estimate
+			Vector3d LinPred(0.);
+			driftStep(PosIn + LinProp + Diffusion, LinPred, h);
+			LinProp = (LinProp + LinPred) * 0.5;
+		}
 	}
 
     // Integration of the SDE with a Mayorama-Euler-method
-	Vector3d PO = PosOut + LinProp + (NVec * NStep + BVec * BStep) * sqrt(h) ;
+	Vector3d PO = PosIn + Diffusion + LinProp;
 
     // Throw error message if something went wrong with propagation.
     // Deactivate candidate.
@@ -213,7 +238,7 @@ void DiffusionSDE::process(Candidate *candidate) const {
 	// of the propagation along a magnetic field line.
 
 /*
-	const std::string AL = "arcLength";
+	static const Candidate::PropertyKey AL = Candidate::getPropertyKey("arcLength");
 	if (candidate->hasProperty(AL) == false){
 	  double arcLen = (TStep + NStep + BStep) * sqrt(h);
 	  candidate->setProperty(AL, arcLen);
@@ -229,6 +254,37 @@ void DiffusionSDE::process(Candidate *candidate) const {
 }
 
 
+void DiffusionSDE::recordStep(Candidate *candidate, size_t tries, size_t substeps, bool minimum) const {
+	IntegratorStatistics s;
+	s.acceptedSteps = 1;
+	s.rejectedSteps = tries - 1;
+	s.fieldEvaluations = 6 * (tries + substeps);
+	s.minimumSteps = minimum;
+	statistics.record(candidate, s);
+}
+
+void DiffusionSDE::setRecordStatistics(bool record, bool asProperties) {
+	statistics.enable("DiffusionSDE", record, asProperties);
+}
+
+bool DiffusionSDE::getIntegratorStatistics(IntegratorStatistics &s) const {
+	if (not statistics.isEnabled())
+		return false;
+	s = statistics.getTotal();
+	return true;
+}
+
+void DiffusionSDE::resetStatistics() {
+	statistics.reset();
+}
+
+size_t DiffusionSDE::getMemoryUsage() const {
+	size_t bytes = magneticField.valid() ? magneticField->getMemoryUsage() : 0;
+	if (directionGrid.valid())
+		bytes += directionGrid->getSizeOf();
+	return bytes;
+}
+
 void DiffusionSDE::tryStep(const Vector3d &PosIn, Vector3d &POut, Vector3d &PosErr,double z, double propStep) const {
 
 	Vector3d k[] = {Vector3d(0.),Vector3d(0.),Vector3d(0.),Vector3d(0.),Vector3d(0.),Vector3d(0.)};
@@ -241,16 +297,7 @@ void DiffusionSDE::tryStep(const Vector3d &PosIn, Vector3d &POut, Vector3d &PosE
 		  y_n += k[j] * a[i * 6 + j] * propStep;
 
 		// update k_i = direction of the regular magnetic mean field
-		Vector3d BField(0.);
-		try {
-		  	BField = magneticField->getField(y_n, z);
-		}
-		catch (std::exception &e) {
-			KISS_LOG_ERROR 	<< "DiffusionSDE: Exception in magneticField::getField.\n"
-					<< e.what();
-		}
-
-		k[i] = BField.getUnitVector() * c_light;
+		k[i] = fieldDirection(y_n, z) * c_light;
 
 		POut += k[i] * b[i] * propStep;
 		PosErr +=  (k[i] * (b[i] - bs[i])) * propStep / kpc;
@@ -258,6 +305,23 @@ void DiffusionSDE::tryStep(const Vector3d &PosIn, Vector3d &POut, Vector3d &PosE
 	}
 }
 
+Vector3d DiffusionSDE::fieldDirection(const Vector3d &pos, double z) const {
+	if (directionGrid.valid() and pos.x >= gridMin.x and pos.y >= gridMin.y
+			and pos.z >= gridMin.z and pos.x < gridMax.x and pos.y < gridMax.y
+			and pos.z < gridMax.z)
+		return Vector3d(directionGrid->interpolate(pos)).getUnitVector();
+
+	Vector3d BField(0.);
+	try {
+	  	BField = magneticField->getField(pos, z);
+	}
+	catch (std::exception &e) {
+		KISS_LOG_ERROR 	<< "DiffusionSDE: Exception in magneticField::getField.\n"
+				<< e.what();
+	}
+	return BField.getUnitVector();
+}
+
 void DiffusionSDE::driftStep(const Vector3d &Pos, Vector3d &LinProp, double h) const {
 	Vector3d AdvField(0.);
 	try {
@@ -326,14 +390,41 @@ void DiffusionSDE::setScale(double s) {
 	scale = s;
 }
 
+void DiffusionSDE::setScheme(Scheme s) {
+	scheme = s;
+}
+
 void DiffusionSDE::setMagneticField(ref_ptr<MagneticField> f) {
 	magneticField = f;
+	directionGrid = NULL; // precomputed for the previous field
 }
 
 void DiffusionSDE::setAdvectionField(ref_ptr<AdvectionField> f) {
 	advectionField = f;
 }
 
+void DiffusionSDE::setFieldDirectionGrid(ref_ptr<Grid3f> grid) {
+	directionGrid = grid;
+	if (not grid.valid())
+		return;
+	// interpolation is periodic beyond the outer grid points, use the field there
+	Vector3d spacing = grid->getSpacing();
+	gridMin = grid->getOrigin() + spacing / 2;
+	gridMax = grid->getOrigin() + Vector3d(grid->getNx() - 0.5, grid->getNy() - 0.5, grid->getNz() - 0.5) * spacing;
+}
+
+void DiffusionSDE::precomputeFieldDirection(Vector3d origin, size_t N, double spacing) {
+	if (not magneticField.valid())
+		throw std::runtime_error("DiffusionSDE: no magnetic field to precompute");
+	ref_ptr<Grid3f> grid = new Grid3f(origin, N, spacing);
+	fromMagneticFieldDirection(grid, magneticField);
+	setFieldDirectionGrid(grid);
+}
+
+ref_ptr<Grid3f> DiffusionSDE::getFieldDirectionGrid() const {
+	return directionGrid;
+}
+
 double DiffusionSDE::getMinimumStep() const {
 	return minStep;
 }
@@ -358,6 +449,10 @@ double DiffusionSDE::getScale() const {
 	return scale;
 }
 
+DiffusionSDE::Scheme DiffusionSDE::getScheme() const {
+	return scheme;
+}
+
 
 
 std::string DiffusionSDE::getDescription() const {
@@ -378,5 +473,13 @@ std::string DiffusionSDE::getDescription() const {
 	  s << "D_0: " << scale*6.1e24 << " m^2/s" << "\n";
 	  }
 
+	if (scheme == WeakOrder2) {
+	  s << "weak order 2 advection scheme" << "\n";
+	  }
+
+	if (directionGrid.valid()) {
+	  s << "precomputed field directions" << "\n";
+	  }
+
 	return s.str();
 }
@@ -1,8 +1,10 @@
 #include "crpropa/module/EMCascade.h"
 #include "crpropa/Cosmology.h"
+#include "crpropa/DintOperator.h"
 #include "crpropa/Units.h"
 
 #include "dint/DintEMCascade.h"
+#include "kiss/convert.h"
 
 #include <fstream>
 #include <sstream>
@@ -10,10 +12,16 @@
 #include <iomanip>
 #include <stdexcept>
 #include <cmath>
+#include <limits>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace crpropa {
 
-EMCascade::EMCascade() : nE(170), logEmin(7), logEmax(24), dlogE(0.1) {
+EMCascade::EMCascade() : nE(170), logEmin(7), logEmax(24), dlogE(0.1),
+		energyThreshold(std::numeric_limits<double>::max()) {
 	setDistanceBinning(1000 * Mpc, 1000);
 }
 
@@ -24,6 +32,14 @@ void EMCascade::setDistanceBinning(double Dmax, int nD) {
 	init();
 }
 
+void EMCascade::setEnergyThreshold(double threshold) {
+	energyThreshold = threshold;
+}
+
+double EMCascade::getEnergyThreshold() const {
+	return energyThreshold;
+}
+
 void EMCascade::init() {
 	photonHist.reserve(nD * nE);
 	photonHist.assign(nD * nE, 0);
@@ -31,41 +47,82 @@ void EMCascade::init() {
 	electronHist.assign(nD * nE, 0);
 	positronHist.reserve(nD * nE);
 	positronHist.assign(nD * nE, 0);
+	threadHist.clear();
+	allocated.reset(new std::once_flag);
+}
+
+void EMCascade::allocate() const {
+	size_t nThreads = 1;
+#ifdef _OPENMP
+	nThreads = omp_in_parallel() ? omp_get_num_threads() : omp_get_max_threads();
+#endif
+	threadHist.assign(nThreads + 1, std::vector<double>(3 * nD * nE, 0));
+}
+
+void EMCascade::reduce() {
+	size_t n = nD * nE;
+	for (size_t t = 0; t < threadHist.size(); t++) {
+		std::vector<double> &hist = threadHist[t];
+		for (size_t i = 0; i < n; i++) {
+			photonHist[i] += hist[i];
+			electronHist[i] += hist[n + i];
+			positronHist[i] += hist[2 * n + i];
+		}
+		hist.assign(3 * n, 0);
+	}
 }
 
 std::string EMCascade::getDescription() const {
 	std::stringstream s;
 	s << "EMCascade";
+	if (energyThreshold < std::numeric_limits<double>::max())
+		s << " below E = " << energyThreshold / EeV << " EeV";
 	return s.str();
 }
 
+unsigned int EMCascade::getParticleClasses() const {
+	return PhotonClass | ElectronClass;
+}
+
 void EMCascade::process(Candidate *candidate) const {
 	int id = candidate->current.getId();
 	if ((id != 22) and (id != 11) and (id != -11))
 		return;
 
+	double E = candidate->current.getEnergy();
+	if (E >= energyThreshold)
+		return; // left to the Monte Carlo modules
+
 	candidate->setActive(false);
 
-	double logE = log10(candidate->current.getEnergy() / eV);
+	double logE = log10(E / eV);
 	double D = candidate->current.getPosition().getR();  // distance to (0,0,0)
 
-	if ((logE < logEmin) or (logE > logEmax))
+	if ((logE < logEmin) or (logE >= logEmax))
 		return;
-	if (D > Dmax)
+	if (D >= Dmax)
 		return;
 
 	int iE = (logE - logEmin) / dlogE;
 	int iD = D / dD;
 	int i = (iD * nE) + iE;
+	if (id == 11)
+		i += nD * nE;
+	else if (id == -11)
+		i += 2 * nD * nE;
+	double w = candidate->getWeight();
 
-#pragma omp critical
-	{
-	if (id == 22)
-		photonHist[i] += 1;
-	else if (id == 11)
-		electronHist[i] += 1;
-	else
-		positronHist[i] += 1;
+	std::call_once(*allocated, &EMCascade::allocate, this);
+	size_t t = 0;
+#ifdef _OPENMP
+	t = omp_get_thread_num();
+#endif
+	if (t + 1 < threadHist.size()) {
+		threadHist[t][i] += w;
+	} else {
+		// more threads than at the first candidate
+		std::lock_guard<std::mutex> lock(sharedMutex);
+		threadHist.back()[i] += w;
 	}
 }
 
@@ -76,7 +133,8 @@ void EMCascade::save(const std::string &filename) {
 		s << "EMCascade: could not open " << filename;
 		throw std::runtime_error(s.str());
 	}
-	outfile << "# D/Mpc log10(E/eV) nPhotons nElectrons nPositrons\n";
+	reduce();
+	outfile << "# D/Mpc log10(E/eV) nPhotons nElectrons nPositrons (weighted)\n";
 	for (int i = 0; i < (nD * nE); i++) {
 		div_t divresult = div(i, nE);
 		double D = (divresult.quot + 0.5) * dD / Mpc;
@@ -113,12 +171,10 @@ void EMCascade::load(const std::string &filename) {
 
 void EMCascade::runCascade(const std::string &filename, int IRBFlag,
 		int RadioFlag, double Bfield, double cutCascade) {
+	reduce();
 
-	// set up DINT
-	std::string dataPath = getDataPath("dint");
-	double B = Bfield / gauss;
-	double h = H0() * Mpc / 1000;
-	DintEMCascade dint(IRBFlag, RadioFlag, dataPath, B, h, omegaM(), omegaL());
+	// set up DINT, or reuse the instance of an earlier run
+	DintInstance dint(IRBFlag, RadioFlag, Bfield);
 
 	Spectrum inputSpectrum, outputSpectrum;
 	NewSpectrum(&inputSpectrum, nE);
@@ -151,32 +207,69 @@ void EMCascade::runCascade(const std::string &filename, int IRBFlag,
 		double D0 = comoving2LightTravelDistance( std::max((iD - 0.5) * dD, 0.) );
 
 		// propagate distance step
-		dint.propagate(D1/Mpc, D0/Mpc, &inputSpectrum, &outputSpectrum, cutCascade);
+		dint->propagate(D1/Mpc, D0/Mpc, &inputSpectrum, &outputSpectrum, cutCascade);
 	}
 
+	for (int s = 0; s < 3; s++)
+		cascadeSpectrum[s].assign(outputSpectrum.spectrum[s], outputSpectrum.spectrum[s] + nE);
+
+	DeleteSpectrum(&outputSpectrum);
+	DeleteSpectrum(&inputSpectrum);
+
+	writeCascade(filename);
+}
+
+void EMCascade::runCascade(const DintOperator &op, const std::string &filename) {
+	if ((op.getNumberOfDistanceBins() != nD) or (op.getNumberOfEnergyBins() != nE)
+			or (std::fabs(op.getMaximumDistance() - Dmax) > 1e-9 * Dmax))
+		throw std::runtime_error("EMCascade: the operator has a different distance binning");
+	reduce();
+
+	std::vector<double> injection;
+	injection.reserve(3 * nD * nE);
+	injection.insert(injection.end(), photonHist.begin(), photonHist.end());
+	injection.insert(injection.end(), electronHist.begin(), electronHist.end());
+	injection.insert(injection.end(), positronHist.begin(), positronHist.end());
+	std::vector<double> spectrum = op.fold(injection);
+	for (int s = 0; s < 3; s++)
+		cascadeSpectrum[s].assign(spectrum.begin() + s * nE, spectrum.begin() + (s + 1) * nE);
+
+	writeCascade(filename);
+}
+
+void EMCascade::writeCascade(const std::string &filename) {
 	// write output
-	std::ofstream outfile(filename.c_str());
-	if (!outfile) {
-		std::stringstream s;
-		s << "EMCascade: could not open " << filename;
-		throw std::runtime_error(s.str());
-	}
-	outfile << "# log10(E/eV) photons electrons positrons\n";
-	for (int iE = 0; iE < nE; iE++) {
-		outfile << std::setw(5) << logEmin + (iE + 0.5) * dlogE;
-		for (int s = 0; s < 3; s++)
-			outfile << std::setw(13) << outputSpectrum.spectrum[s][iE];
-		outfile << "\n";
+	if (!filename.empty()) {
+		std::ofstream outfile(filename.c_str());
+		if (!outfile) {
+			std::stringstream s;
+			s << "EMCascade: could not open " << filename;
+			throw std::runtime_error(s.str());
+		}
+		outfile << "# log10(E/eV) photons electrons positrons\n";
+		for (int iE = 0; iE < nE; iE++) {
+			outfile << std::setw(5) << logEmin + (iE + 0.5) * dlogE;
+			for (int s = 0; s < 3; s++)
+				outfile << std::setw(13) << cascadeSpectrum[s][iE];
+			outfile << "\n";
+		}
+		outfile.close();
 	}
-	outfile.close();
 
-	// clear the histogram
+	// clear the histogram, the thread histograms are cleared by reduce
 	photonHist.assign(nD * nE, 0);
 	electronHist.assign(nD * nE, 0);
 	positronHist.assign(nD * nE, 0);
+}
 
-	DeleteSpectrum(&outputSpectrum);
-	DeleteSpectrum(&inputSpectrum);
+const std::vector<double> &EMCascade::getCascadeSpectrum(int id) const {
+	if (id == 22)
+		return cascadeSpectrum[PHOTON];
+	if (id == 11)
+		return cascadeSpectrum[ELECTRON];
+	if (id == -11)
+		return cascadeSpectrum[POSITRON];
+	throw std::runtime_error("EMCascade: no spectrum for particle id " + kiss::str(id));
 }
 
 } // namespace crpropa
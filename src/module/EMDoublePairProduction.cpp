@@ -1,24 +1,40 @@
 #include "crpropa/module/EMDoublePairProduction.h"
 #include "crpropa/Units.h"
+#include "crpropa/Common.h"
 #include "crpropa/Random.h"
+#include "crpropa/NumericTable.h"
+#include "crpropa/Trace.h"
 
-#include <fstream>
-#include <limits>
 #include <stdexcept>
 
 namespace crpropa {
 
-EMDoublePairProduction::EMDoublePairProduction(ref_ptr<PhotonField> photonField, bool haveElectrons, double limit) {
+EMDoublePairProduction::EMDoublePairProduction(ref_ptr<PhotonField> photonField, bool haveElectrons, double limit, double thinning) {
 	setPhotonField(photonField);
 	this->haveElectrons = haveElectrons;
 	this->limit = limit;
+	this->thinning = thinning;
 }
 
 void EMDoublePairProduction::setPhotonField(ref_ptr<PhotonField> photonField) {
 	this->photonField = photonField;
-	std::string fname = photonField->getFieldName();
-	setDescription("EMDoublePairProduction: " + fname);
-	initRate(getDataPath("EMDoublePairProduction/rate_" + fname + ".txt"));
+	setDescription("EMDoublePairProduction: " + photonField->getFieldName());
+	tabEnergy.clear();
+	tabRate.clear();
+	prepared.reset(new std::once_flag);
+}
+
+void EMDoublePairProduction::loadTables() {
+	if (tabEnergy.empty())
+		initRate(getDataPath("EMDoublePairProduction/rate_" + photonField->getFieldName() + ".txt"));
+}
+
+void EMDoublePairProduction::requireTables() const {
+	std::call_once(*prepared, &EMDoublePairProduction::loadTables, const_cast<EMDoublePairProduction*>(this));
+}
+
+void EMDoublePairProduction::prepare() {
+	requireTables();
 }
 
 void EMDoublePairProduction::setHaveElectrons(bool haveElectrons) {
@@ -29,28 +45,31 @@ void EMDoublePairProduction::setLimit(double limit) {
 	this->limit = limit;
 }
 
-void EMDoublePairProduction::initRate(std::string filename) {
-	std::ifstream infile(filename.c_str());
+void EMDoublePairProduction::setThinning(double thinning) {
+	this->thinning = thinning;
+}
 
-	if (!infile.good())
-		throw std::runtime_error("EMDoublePairProduction: could not open file " + filename);
+double EMDoublePairProduction::getThinning() const {
+	return thinning;
+}
+
+void EMDoublePairProduction::initRate(std::string filename) {
+	CRPROPA_TRACE_SPAN("EMDoublePairProduction::initRate", "tables");
+	ref_ptr<NumericTable> table = NumericTable::load(filename);
 
 	// clear previously loaded interaction rates
 	tabEnergy.clear();
 	tabRate.clear();
 
-	while (infile.good()) {
-		if (infile.peek() != '#') {
-			double a, b;
-			infile >> a >> b;
-			if (infile) {
-				tabEnergy.push_back(pow(10, a) * eV);
-				tabRate.push_back(b / Mpc);
-			}
-		}
-		infile.ignore(std::numeric_limits < std::streamsize > ::max(), '\n');
+	// rows: log10(E/eV), rate [1/Mpc]
+	for (size_t i = 0; i < table->rows(); i++) {
+		if (table->rowSize(i) < 2)
+			continue;
+		const double *row = table->row(i);
+		tabEnergy.push_back(pow(10, row[0]) * eV);
+		tabRate.push_back(row[1] / Mpc);
 	}
-	infile.close();
+	energyAxis.assign(tabEnergy);
 }
 
 void EMDoublePairProduction::performInteraction(Candidate *candidate) const {
@@ -69,14 +88,31 @@ void EMDoublePairProduction::performInteraction(Candidate *candidate) const {
 	Random &random = Random::instance();
 	Vector3d pos = random.randomInterpolatedPosition(candidate->previous.getPosition(), candidate->current.getPosition());
 
-	candidate->addSecondary( 11, Ee, pos);
-	candidate->addSecondary(-11, Ee, pos);
+	double f = Ee / E;
+	double w = 1 / pow(f, thinning);
+	if (thinning == 0 or random.rand() < pow(f, thinning))
+		candidate->addSecondary( 11, Ee, pos, w);
+	if (thinning == 0 or random.rand() < pow(f, thinning))
+		candidate->addSecondary(-11, Ee, pos, w);
 }
 
-void EMDoublePairProduction::process(Candidate *candidate) const {
+unsigned int EMDoublePairProduction::getParticleClasses() const {
+	return PhotonClass;
+}
+
+size_t EMDoublePairProduction::getMemoryUsage() const {
+	return memoryUsage(tabEnergy) + memoryUsage(tabRate);
+}
+
+bool EMDoublePairProduction::hasInteractionRate() const {
+	return true;
+}
+
+double EMDoublePairProduction::getInteractionRate(const Candidate *candidate) const {
 	// check if photon
 	if (candidate->current.getId() != 22)
-		return;
+		return 0;
+	requireTables();
 
 	// scale the electron energy instead of background photons
 	double z = candidate->getRedshift();
@@ -84,11 +120,22 @@ void EMDoublePairProduction::process(Candidate *candidate) const {
 
 	// check if in tabulated energy range
 	if (E < tabEnergy.front() or (E > tabEnergy.back()))
-		return;
+		return 0;
 
 	// interaction rate
-	double rate = interpolate(E, tabEnergy, tabRate);
+	double rate = interpolate(E, energyAxis, tabRate);
 	rate *= pow_integer<2>(1 + z) * photonField->getRedshiftScaling(z);
+	return rate;
+}
+
+void EMDoublePairProduction::performStochasticInteraction(Candidate *candidate) const {
+	performInteraction(candidate);
+}
+
+void EMDoublePairProduction::process(Candidate *candidate) const {
+	double rate = getInteractionRate(candidate);
+	if (rate == 0)
+		return;
 
 	// check for interaction
 	Random &random = Random::instance();
@@ -1,28 +1,105 @@
 #include "crpropa/module/EMInverseComptonScattering.h"
 #include "crpropa/Units.h"
 #include "crpropa/Random.h"
+#include "crpropa/NumericTable.h"
+#include "crpropa/TableRegistry.h"
 #include "crpropa/Common.h"
+#include "crpropa/Trace.h"
 
-#include <fstream>
-#include <limits>
+#include <map>
 #include <stdexcept>
 
 namespace crpropa {
 
 static const double mec2 = mass_electron * c_squared;
 
-EMInverseComptonScattering::EMInverseComptonScattering(ref_ptr<PhotonField> photonField, bool havePhotons, double limit) {
+EMInverseComptonScattering::EMInverseComptonScattering(ref_ptr<PhotonField> photonField, bool havePhotons, double limit, double thinning) {
 	setPhotonField(photonField);
 	this->havePhotons = havePhotons;
 	this->limit = limit;
+	this->thinning = thinning;
 }
 
 void EMInverseComptonScattering::setPhotonField(ref_ptr<PhotonField> photonField) {
 	this->photonField = photonField;
-	std::string fname = photonField->getFieldName();
-	setDescription("EMInverseComptonScattering: " + fname);
-	initRate(getDataPath("EMInverseComptonScattering/rate_" + fname + ".txt"));
-	initCumulativeRate(getDataPath("EMInverseComptonScattering/cdf_" + fname + ".txt"));
+	setDescription("EMInverseComptonScattering: " + photonField->getFieldName());
+	spatialField = dynamic_cast<const SpatialPhotonField*>(photonField.get());
+	tabEnergy.clear();
+	tabRate.clear();
+	tables = 0;
+	cellRates.clear();
+	cellRateIndex.clear();
+	prepared.reset(new std::once_flag);
+}
+
+void EMInverseComptonScattering::loadTables() {
+	CRPROPA_TRACE_SPAN("EMInverseComptonScattering::loadTables", "tables");
+	if (not spatialField) {
+		std::string fname = photonField->getFieldName();
+		if (tabEnergy.empty())
+			initRate(getDataPath("EMInverseComptonScattering/rate_" + fname + ".txt"));
+		if (!tables)
+			tables = loadCumulativeRate(fname);
+		return;
+	}
+
+	// tables of each distinct cell field
+	if (cellRates.empty()) {
+		std::map<std::string, size_t> loaded;
+		for (size_t i = 0; i < spatialField->getNumberOfCells(); i++) {
+			PhotonField *cell = spatialField->getCellField(i);
+			std::map<std::string, size_t>::iterator it = loaded.find(cell->getFieldName());
+			if (it == loaded.end()) {
+				initRate(getDataPath("EMInverseComptonScattering/rate_" + cell->getFieldName() + ".txt"));
+				CellRates rates;
+				rates.field = cell;
+				rates.tabEnergy.swap(tabEnergy);
+				rates.tabRate.swap(tabRate);
+				rates.energyAxis.assign(rates.tabEnergy);
+				it = loaded.insert(std::make_pair(cell->getFieldName(), cellRates.size())).first;
+				cellRates.push_back(rates);
+			}
+			cellRateIndex.push_back(it->second);
+		}
+		energyAxis.assign(tabEnergy);
+	}
+	for (size_t i = 0; i < cellRates.size(); i++)
+		if (!cellRates[i].tables)
+			cellRates[i].tables = loadCumulativeRate(cellRates[i].field->getFieldName());
+	tables = 0;
+}
+
+ref_ptr<EMInverseComptonScattering::Tables> EMInverseComptonScattering::loadCumulativeRate(const std::string &fieldName) {
+	std::string cdfFile = getDataPath("EMInverseComptonScattering/cdf_" + fieldName + ".txt");
+	// share the cumulative rates with other instances for the same field
+	std::string key = TableRegistry::key("EMInverseComptonScattering", fieldName, cdfFile);
+	ref_ptr<Tables> shared = TableRegistry::find<Tables>(key);
+	if (shared)
+		return shared;
+	initCumulativeRate(cdfFile);
+	return TableRegistry::insert(key, tables);
+}
+
+void EMInverseComptonScattering::requireTables() const {
+	std::call_once(*prepared, &EMInverseComptonScattering::loadTables, const_cast<EMInverseComptonScattering*>(this));
+}
+
+void EMInverseComptonScattering::prepare() {
+	requireTables();
+}
+
+const EMInverseComptonScattering::Tables &EMInverseComptonScattering::getTables(const Candidate *candidate) const {
+	if (not spatialField)
+		return *tables;
+	// secondaries from the tables of the cell with the largest weight
+	size_t index[8];
+	double weight[8];
+	spatialField->getCellWeights(candidate->current.getPosition(), index, weight);
+	int best = 0;
+	for (int k = 1; k < 8; k++)
+		if (weight[k] > weight[best])
+			best = k;
+	return *cellRates[cellRateIndex[index[best]]].tables;
 }
 
 void EMInverseComptonScattering::setHavePhotons(bool havePhotons) {
@@ -33,67 +110,57 @@ void EMInverseComptonScattering::setLimit(double limit) {
 	this->limit = limit;
 }
 
-void EMInverseComptonScattering::initRate(std::string filename) {
-	std::ifstream infile(filename.c_str());
+void EMInverseComptonScattering::setThinning(double thinning) {
+	this->thinning = thinning;
+}
+
+double EMInverseComptonScattering::getThinning() const {
+	return thinning;
+}
 
-	if (!infile.good())
-		throw std::runtime_error("EMInverseComptonScattering: could not open file " + filename);
+void EMInverseComptonScattering::initRate(std::string filename) {
+	ref_ptr<NumericTable> table = NumericTable::load(filename);
 
-	// clear previously loaded tables
+	// clear previously loaded interaction rates
 	tabEnergy.clear();
 	tabRate.clear();
 
-	while (infile.good()) {
-		if (infile.peek() != '#') {
-			double a, b;
-			infile >> a >> b;
-			if (infile) {
-				tabEnergy.push_back(pow(10, a) * eV);
-				tabRate.push_back(b / Mpc);
-			}
-		}
-		infile.ignore(std::numeric_limits < std::streamsize > ::max(), '\n');
+	// rows: log10(E/eV), rate [1/Mpc]
+	for (size_t i = 0; i < table->rows(); i++) {
+		if (table->rowSize(i) < 2)
+			continue;
+		const double *row = table->row(i);
+		tabEnergy.push_back(pow(10, row[0]) * eV);
+		tabRate.push_back(row[1] / Mpc);
 	}
-	infile.close();
+	energyAxis.assign(tabEnergy);
 }
 
 void EMInverseComptonScattering::initCumulativeRate(std::string filename) {
-	std::ifstream infile(filename.c_str());
-
-	if (!infile.good())
-		throw std::runtime_error("EMInverseComptonScattering: could not open file " + filename);
-
-	// clear previously loaded tables
-	tabE.clear();
-	tabs.clear();
-	tabCDF.clear();
-	
-	// skip header
-	while (infile.peek() == '#')
-		infile.ignore(std::numeric_limits < std::streamsize > ::max(), '\n');
-
-	// read s values in first line
-	double a;
-	infile >> a; // skip first value
-	while (infile.good() and (infile.peek() != '\n')) {
-		infile >> a;
-		tabs.push_back(pow(10, a) * eV * eV);
-	}
-
-	// read all following lines: E, cdf values
-	while (infile.good()) {
-		infile >> a;
-		if (!infile)
-			break;  // end of file
-		tabE.push_back(pow(10, a) * eV);
-		std::vector<double> cdf;
-		for (int i = 0; i < tabs.size(); i++) {
-			infile >> a;
-			cdf.push_back(a / Mpc);
-		}
-		tabCDF.push_back(cdf);
+	ref_ptr<NumericTable> table = NumericTable::load(filename);
+	if (table->rows() == 0)
+		throw std::runtime_error("EMInverseComptonScattering: no data in file " + filename);
+
+	// new tables, shared ones are never modified
+	tables = new Tables();
+
+	// s values in the first row, after a placeholder
+	const double *row = table->row(0);
+	for (size_t j = 1; j < table->rowSize(0); j++)
+		tables->tabs.push_back(pow(10, row[j]) * eV * eV);
+
+	// all following rows: E, cdf values
+	for (size_t i = 1; i < table->rows(); i++) {
+		if (table->rowSize(i) < tables->tabs.size() + 1)
+			throw std::runtime_error("EMInverseComptonScattering: incomplete row in " + filename);
+		row = table->row(i);
+		tables->tabE.push_back(pow(10, row[0]) * eV);
+		std::vector<double> cdf(tables->tabs.size());
+		for (size_t j = 0; j < tables->tabs.size(); j++)
+			cdf[j] = row[j + 1] / Mpc;
+		tables->tabCDF.push_back(cdf);
 	}
-	infile.close();
+	tables->tabAlias = cumulativeAliasTables(tables->tabCDF);
 }
 
 // Class to calculate the energy distribution of the ICS photon and to sample from it
@@ -168,15 +235,17 @@ void EMInverseComptonScattering::performInteraction(Candidate *candidate) const
 	// scale the particle energy instead of background photons
 	double z = candidate->getRedshift();
 	double E = candidate->current.getEnergy() * (1 + z);
+	requireTables();
+	const Tables &t = getTables(candidate);
 
-	if (E < tabE.front() or E > tabE.back())
+	if (E < t.tabE.front() or E > t.tabE.back())
 		return;
 
 	// sample the value of s
 	Random &random = Random::instance();
-	size_t i = closestIndex(E, tabE);
-	size_t j = random.randBin(tabCDF[i]);
-	double s_kin = pow(10, log10(tabs[j]) + (random.rand() - 0.5) * 0.1);
+	size_t i = closestIndex(E, t.tabE);
+	size_t j = t.tabAlias[i].sample(random);
+	double s_kin = pow(10, log10(t.tabs[j]) + (random.rand() - 0.5) * 0.1);
 	double s = s_kin + mec2 * mec2;
 
 	// sample electron energy after scattering
@@ -185,31 +254,87 @@ void EMInverseComptonScattering::performInteraction(Candidate *candidate) const
 
 	// add up-scattered photon
 	double Esecondary = E - Enew;
-	if (havePhotons) {
+	double f = Esecondary / E;
+	if (havePhotons and (thinning == 0 or random.rand() < pow(f, thinning))) {
 		Vector3d pos = random.randomInterpolatedPosition(candidate->previous.getPosition(), candidate->current.getPosition());
-		candidate->addSecondary(22, Esecondary / (1 + z), pos);
+		candidate->addSecondary(22, Esecondary / (1 + z), pos, 1 / pow(f, thinning));
 	}
 
 	// update the primary particle energy; do this after adding the secondary to correctly set the secondary's parent
 	candidate->current.setEnergy(Enew / (1 + z));
 }
 
-void EMInverseComptonScattering::process(Candidate *candidate) const {
+unsigned int EMInverseComptonScattering::getParticleClasses() const {
+	return ElectronClass;
+}
+
+// bytes of the shared tables, counted by every instance holding them
+template <class Tables>
+static size_t tableMemoryUsage(const ref_ptr<Tables> &tables) {
+	if (!tables.valid())
+		return 0;
+	return memoryUsage(tables->tabE) + memoryUsage(tables->tabs)
+			+ memoryUsage(tables->tabCDF) + memoryUsage(tables->tabAlias);
+}
+
+size_t EMInverseComptonScattering::getMemoryUsage() const {
+	size_t bytes = memoryUsage(tabEnergy) + memoryUsage(tabRate) + tableMemoryUsage(tables)
+			+ memoryUsage(cellRateIndex);
+	for (size_t i = 0; i < cellRates.size(); i++)
+		bytes += memoryUsage(cellRates[i].tabEnergy) + memoryUsage(cellRates[i].tabRate)
+				+ tableMemoryUsage(cellRates[i].tables);
+	return bytes;
+}
+
+bool EMInverseComptonScattering::hasInteractionRate() const {
+	return true;
+}
+
+double EMInverseComptonScattering::getInteractionRate(const Candidate *candidate) const {
 	// check if electron / positron
 	int id = candidate->current.getId();
 	if (id != 11 && id != -11)
-		return;
+		return 0;
+	requireTables();
 
 	// scale the particle energy instead of background photons
 	double z = candidate->getRedshift();
 	double E = (1 + z) * candidate->current.getEnergy();
 
+	if (spatialField) {
+		// rates of the neighbouring cells, weighted by position
+		size_t index[8];
+		double weight[8];
+		spatialField->getCellWeights(candidate->current.getPosition(), index, weight);
+		double rate = 0;
+		for (int k = 0; k < 8; k++) {
+			if (weight[k] == 0)
+				continue;
+			const CellRates &r = cellRates[cellRateIndex[index[k]]];
+			if (E < r.tabEnergy.front() or (E > r.tabEnergy.back()))
+				continue;
+			rate += weight[k] * interpolate(E, r.energyAxis, r.tabRate) * r.field->getRedshiftScaling(z);
+		}
+		return rate * pow_integer<2>(1 + z);
+	}
+
 	if (E < tabEnergy.front() or (E > tabEnergy.back()))
-		return;
+		return 0;
 
 	// interaction rate
-	double rate = interpolate(E, tabEnergy, tabRate);
+	double rate = interpolate(E, energyAxis, tabRate);
 	rate *= pow_integer<2>(1 + z) * photonField->getRedshiftScaling(z);
+	return rate;
+}
+
+void EMInverseComptonScattering::performStochasticInteraction(Candidate *candidate) const {
+	performInteraction(candidate);
+}
+
+void EMInverseComptonScattering::process(Candidate *candidate) const {
+	double rate = getInteractionRate(candidate);
+	if (rate == 0)
+		return;
 
 	// check for interaction
 	Random &random = Random::instance();
@@ -1,9 +1,12 @@
 #include "crpropa/module/EMPairProduction.h"
 #include "crpropa/Units.h"
+#include "crpropa/Common.h"
 #include "crpropa/Random.h"
+#include "crpropa/NumericTable.h"
+#include "crpropa/TableRegistry.h"
+#include "crpropa/Trace.h"
 
-#include <fstream>
-#include <limits>
+#include <map>
 #include <stdexcept>
 
 
@@ -11,87 +14,153 @@ namespace crpropa {
 
 static const double mec2 = mass_electron * c_squared;
 
-EMPairProduction::EMPairProduction(ref_ptr<PhotonField> photonField, bool haveElectrons, double limit) : haveElectrons(haveElectrons), limit(limit) {
+EMPairProduction::EMPairProduction(ref_ptr<PhotonField> photonField, bool haveElectrons, double limit, double thinning) : haveElectrons(haveElectrons), limit(limit), thinning(thinning) {
 	setPhotonField(photonField);
 }
 
 void EMPairProduction::setPhotonField(ref_ptr<PhotonField> photonField) {
 	this->photonField = photonField;
-	std::string fname = photonField->getFieldName();
-	setDescription("EMPairProduction: " + fname);
-	initRate(getDataPath("EMPairProduction/rate_" + fname + ".txt"));
-	initCumulativeRate(getDataPath("EMPairProduction/cdf_" + fname + ".txt"));
+	setDescription("EMPairProduction: " + photonField->getFieldName());
+	spatialField = dynamic_cast<const SpatialPhotonField*>(photonField.get());
+	tabEnergy.clear();
+	tabRate.clear();
+	tables = 0;
+	cellRates.clear();
+	cellRateIndex.clear();
+	prepared.reset(new std::once_flag);
+}
+
+void EMPairProduction::loadTables() {
+	CRPROPA_TRACE_SPAN("EMPairProduction::loadTables", "tables");
+	// the cumulative rates are only needed to sample the electrons
+	if (not spatialField) {
+		std::string fname = photonField->getFieldName();
+		if (tabEnergy.empty())
+			initRate(getDataPath("EMPairProduction/rate_" + fname + ".txt"));
+		if (haveElectrons and !tables)
+			tables = loadCumulativeRate(fname);
+		return;
+	}
+
+	// tables of each distinct cell field
+	if (cellRates.empty()) {
+		std::map<std::string, size_t> loaded;
+		for (size_t i = 0; i < spatialField->getNumberOfCells(); i++) {
+			PhotonField *cell = spatialField->getCellField(i);
+			std::map<std::string, size_t>::iterator it = loaded.find(cell->getFieldName());
+			if (it == loaded.end()) {
+				initRate(getDataPath("EMPairProduction/rate_" + cell->getFieldName() + ".txt"));
+				CellRates rates;
+				rates.field = cell;
+				rates.tabEnergy.swap(tabEnergy);
+				rates.tabRate.swap(tabRate);
+				rates.energyAxis.assign(rates.tabEnergy);
+				it = loaded.insert(std::make_pair(cell->getFieldName(), cellRates.size())).first;
+				cellRates.push_back(rates);
+			}
+			cellRateIndex.push_back(it->second);
+		}
+		energyAxis.assign(tabEnergy);
+	}
+	for (size_t i = 0; i < cellRates.size(); i++)
+		if (haveElectrons and !cellRates[i].tables)
+			cellRates[i].tables = loadCumulativeRate(cellRates[i].field->getFieldName());
+	tables = 0;
+}
+
+ref_ptr<EMPairProduction::Tables> EMPairProduction::loadCumulativeRate(const std::string &fieldName) {
+	std::string cdfFile = getDataPath("EMPairProduction/cdf_" + fieldName + ".txt");
+	// share the cumulative rates with other instances for the same field
+	std::string key = TableRegistry::key("EMPairProduction", fieldName, cdfFile);
+	ref_ptr<Tables> shared = TableRegistry::find<Tables>(key);
+	if (shared)
+		return shared;
+	initCumulativeRate(cdfFile);
+	return TableRegistry::insert(key, tables);
+}
+
+void EMPairProduction::requireTables() const {
+	std::call_once(*prepared, &EMPairProduction::loadTables, const_cast<EMPairProduction*>(this));
+}
+
+void EMPairProduction::prepare() {
+	requireTables();
+}
+
+const EMPairProduction::Tables &EMPairProduction::getTables(const Candidate *candidate) const {
+	if (not spatialField)
+		return *tables;
+	// secondaries from the tables of the cell with the largest weight
+	size_t index[8];
+	double weight[8];
+	spatialField->getCellWeights(candidate->current.getPosition(), index, weight);
+	int best = 0;
+	for (int k = 1; k < 8; k++)
+		if (weight[k] > weight[best])
+			best = k;
+	return *cellRates[cellRateIndex[index[best]]].tables;
 }
 
 void EMPairProduction::setHaveElectrons(bool haveElectrons) {
 	this->haveElectrons = haveElectrons;
+	prepared.reset(new std::once_flag); // the cumulative rates may be needed
 }
 
 void EMPairProduction::setLimit(double limit) {
 	this->limit = limit;
 }
 
-void EMPairProduction::initRate(std::string filename) {
-	std::ifstream infile(filename.c_str());
+void EMPairProduction::setThinning(double thinning) {
+	this->thinning = thinning;
+}
+
+double EMPairProduction::getThinning() const {
+	return thinning;
+}
 
-	if (!infile.good())
-		throw std::runtime_error("EMPairProduction: could not open file " + filename);
+void EMPairProduction::initRate(std::string filename) {
+	ref_ptr<NumericTable> table = NumericTable::load(filename);
 
 	// clear previously loaded interaction rates
 	tabEnergy.clear();
 	tabRate.clear();
 
-	while (infile.good()) {
-		if (infile.peek() != '#') {
-			double a, b;
-			infile >> a >> b;
-			if (infile) {
-				tabEnergy.push_back(pow(10, a) * eV);
-				tabRate.push_back(b / Mpc);
-			}
-		}
-		infile.ignore(std::numeric_limits < std::streamsize > ::max(), '\n');
+	// rows: log10(E/eV), rate [1/Mpc]
+	for (size_t i = 0; i < table->rows(); i++) {
+		if (table->rowSize(i) < 2)
+			continue;
+		const double *row = table->row(i);
+		tabEnergy.push_back(pow(10, row[0]) * eV);
+		tabRate.push_back(row[1] / Mpc);
 	}
-	infile.close();
+	energyAxis.assign(tabEnergy);
 }
 
 void EMPairProduction::initCumulativeRate(std::string filename) {
-	std::ifstream infile(filename.c_str());
-
-	if (!infile.good())
-		throw std::runtime_error("EMPairProduction: could not open file " + filename);
-
-	// clear previously loaded tables
-	tabE.clear();
-	tabs.clear();
-	tabCDF.clear();
-	
-	// skip header
-	while (infile.peek() == '#')
-		infile.ignore(std::numeric_limits < std::streamsize > ::max(), '\n');
-
-	// read s values in first line
-	double a;
-	infile >> a; // skip first value
-	while (infile.good() and (infile.peek() != '\n')) {
-		infile >> a;
-		tabs.push_back(pow(10, a) * eV * eV);
+	ref_ptr<NumericTable> table = NumericTable::load(filename);
+	if (table->rows() == 0)
+		throw std::runtime_error("EMPairProduction: no data in file " + filename);
+
+	// new tables, shared ones are never modified
+	tables = new Tables();
+
+	// s values in the first row, after a placeholder
+	const double *row = table->row(0);
+	for (size_t j = 1; j < table->rowSize(0); j++)
+		tables->tabs.push_back(pow(10, row[j]) * eV * eV);
+
+	// all following rows: E, cdf values
+	for (size_t i = 1; i < table->rows(); i++) {
+		if (table->rowSize(i) < tables->tabs.size() + 1)
+			throw std::runtime_error("EMPairProduction: incomplete row in " + filename);
+		row = table->row(i);
+		tables->tabE.push_back(pow(10, row[0]) * eV);
+		std::vector<double> cdf(tables->tabs.size());
+		for (size_t j = 0; j < tables->tabs.size(); j++)
+			cdf[j] = row[j + 1] / Mpc;
+		tables->tabCDF.push_back(cdf);
 	}
-
-	// read all following lines: E, cdf values
-	while (infile.good()) {
-		infile >> a;
-		if (!infile)
-			break;  // end of file
-		tabE.push_back(pow(10, a) * eV);
-		std::vector<double> cdf;
-		for (int i = 0; i < tabs.size(); i++) {
-			infile >> a;
-			cdf.push_back(a / Mpc);
-		}
-		tabCDF.push_back(cdf);
-	}
-	infile.close();
+	tables->tabAlias = cumulativeAliasTables(tables->tabCDF);
 }
 
 // Hold an data array to interpolate the energy distribution on
@@ -173,17 +242,19 @@ void EMPairProduction::performInteraction(Candidate *candidate) const {
 	// check if secondary electron pair needs to be produced
 	if (not haveElectrons)
 		return;
+	requireTables();
+	const Tables &t = getTables(candidate);
 
 	// check if in tabulated energy range
-	if (E < tabE.front() or (E > tabE.back()))
+	if (E < t.tabE.front() or (E > t.tabE.back()))
 		return;
 
 	// sample the value of s
 	Random &random = Random::instance();
-	size_t i = closestIndex(E, tabE);  // find closest tabulation point
-	size_t j = random.randBin(tabCDF[i]);
-	double lo = std::max(4 * mec2 * mec2, tabs[j-1]);  // first s-tabulation point below min(s_kin) = (2 me c^2)^2; ensure physical value
-	double hi = tabs[j];
+	size_t i = closestIndex(E, t.tabE);  // find closest tabulation point
+	size_t j = t.tabAlias[i].sample(random);
+	double lo = std::max(4 * mec2 * mec2, t.tabs[j-1]);  // first s-tabulation point below min(s_kin) = (2 me c^2)^2; ensure physical value
+	double hi = t.tabs[j];
 	double s = lo + random.rand() * (hi - lo);
 
 	// sample electron / positron energy
@@ -193,26 +264,85 @@ void EMPairProduction::performInteraction(Candidate *candidate) const {
 
 	// sample random position along current step
 	Vector3d pos = random.randomInterpolatedPosition(candidate->previous.getPosition(), candidate->current.getPosition());
-	candidate->addSecondary(-11, Ee / (1 + z), pos);
-	candidate->addSecondary(11, Ep / (1 + z), pos);
+	double f = Ep / E;
+	if (thinning == 0 or random.rand() < pow(1 - f, thinning))
+		candidate->addSecondary(-11, Ee / (1 + z), pos, 1 / pow(1 - f, thinning));
+	if (thinning == 0 or random.rand() < pow(f, thinning))
+		candidate->addSecondary(11, Ep / (1 + z), pos, 1 / pow(f, thinning));
 }
 
-void EMPairProduction::process(Candidate *candidate) const {
+unsigned int EMPairProduction::getParticleClasses() const {
+	return PhotonClass;
+}
+
+// bytes of the shared tables, counted by every instance holding them
+template <class Tables>
+static size_t tableMemoryUsage(const ref_ptr<Tables> &tables) {
+	if (!tables.valid())
+		return 0;
+	return memoryUsage(tables->tabE) + memoryUsage(tables->tabs)
+			+ memoryUsage(tables->tabCDF) + memoryUsage(tables->tabAlias);
+}
+
+size_t EMPairProduction::getMemoryUsage() const {
+	size_t bytes = memoryUsage(tabEnergy) + memoryUsage(tabRate) + tableMemoryUsage(tables)
+			+ memoryUsage(cellRateIndex);
+	for (size_t i = 0; i < cellRates.size(); i++)
+		bytes += memoryUsage(cellRates[i].tabEnergy) + memoryUsage(cellRates[i].tabRate)
+				+ tableMemoryUsage(cellRates[i].tables);
+	return bytes;
+}
+
+bool EMPairProduction::hasInteractionRate() const {
+	return true;
+}
+
+double EMPairProduction::getInteractionRate(const Candidate *candidate) const {
 	// check if photon
 	if (candidate->current.getId() != 22)
-		return;
+		return 0;
+	requireTables();
 
 	// scale particle energy instead of background photon energy
 	double z = candidate->getRedshift();
 	double E = candidate->current.getEnergy() * (1 + z);
 
 	// check if in tabulated energy range
+
+	if (spatialField) {
+		// rates of the neighbouring cells, weighted by position
+		size_t index[8];
+		double weight[8];
+		spatialField->getCellWeights(candidate->current.getPosition(), index, weight);
+		double rate = 0;
+		for (int k = 0; k < 8; k++) {
+			if (weight[k] == 0)
+				continue;
+			const CellRates &r = cellRates[cellRateIndex[index[k]]];
+			if (E < r.tabEnergy.front() or (E > r.tabEnergy.back()))
+				continue;
+			rate += weight[k] * interpolate(E, r.energyAxis, r.tabRate) * r.field->getRedshiftScaling(z);
+		}
+		return rate * pow_integer<2>(1 + z);
+	}
+
 	if (E < tabEnergy.front() or (E > tabEnergy.back()))
-		return;
+		return 0;
 
 	// interaction rate
-	double rate = interpolate(E, tabEnergy, tabRate);
+	double rate = interpolate(E, energyAxis, tabRate);
 	rate *= pow_integer<2>(1 + z) * photonField->getRedshiftScaling(z);
+	return rate;
+}
+
+void EMPairProduction::performStochasticInteraction(Candidate *candidate) const {
+	performInteraction(candidate);
+}
+
+void EMPairProduction::process(Candidate *candidate) const {
+	double rate = getInteractionRate(candidate);
+	if (rate == 0)
+		return;
 
 	// check for interaction
 	Random &random = Random::instance();
@@ -1,27 +1,55 @@
 #include "crpropa/module/EMTripletPairProduction.h"
 #include "crpropa/Units.h"
+#include "crpropa/Common.h"
 #include "crpropa/Random.h"
+#include "crpropa/NumericTable.h"
+#include "crpropa/TableRegistry.h"
+#include "crpropa/Trace.h"
 
-#include <fstream>
-#include <limits>
 #include <stdexcept>
 
 namespace crpropa {
 
 static const double mec2 = mass_electron * c_squared;
 
-EMTripletPairProduction::EMTripletPairProduction(ref_ptr<PhotonField> photonField, bool haveElectrons, double limit) {
+EMTripletPairProduction::EMTripletPairProduction(ref_ptr<PhotonField> photonField, bool haveElectrons, double limit, double thinning) {
 	setPhotonField(photonField);
 	this->haveElectrons = haveElectrons;
 	this->limit = limit;
+	this->thinning = thinning;
 }
 
 void EMTripletPairProduction::setPhotonField(ref_ptr<PhotonField> photonField) {
 	this->photonField = photonField;
+	setDescription("EMTripletPairProduction: " + photonField->getFieldName());
+	tabEnergy.clear();
+	tabRate.clear();
+	tables = 0;
+	prepared.reset(new std::once_flag);
+}
+
+void EMTripletPairProduction::loadTables() {
 	std::string fname = photonField->getFieldName();
-	setDescription("EMTripletPairProduction: " + fname);
-	initRate(getDataPath("EMTripletPairProduction/rate_" + fname + ".txt"));
-	initCumulativeRate(getDataPath("EMTripletPairProduction/cdf_" + fname + ".txt"));
+	if (tabEnergy.empty())
+		initRate(getDataPath("EMTripletPairProduction/rate_" + fname + ".txt"));
+	if (tables)
+		return;
+	std::string cdfFile = getDataPath("EMTripletPairProduction/cdf_" + fname + ".txt");
+	// share the cumulative rates with other instances for the same field
+	std::string key = TableRegistry::key("EMTripletPairProduction", fname, cdfFile);
+	tables = TableRegistry::find<Tables>(key);
+	if (!tables) {
+		initCumulativeRate(cdfFile);
+		tables = TableRegistry::insert(key, tables);
+	}
+}
+
+void EMTripletPairProduction::requireTables() const {
+	std::call_once(*prepared, &EMTripletPairProduction::loadTables, const_cast<EMTripletPairProduction*>(this));
+}
+
+void EMTripletPairProduction::prepare() {
+	requireTables();
 }
 
 void EMTripletPairProduction::setHaveElectrons(bool haveElectrons) {
@@ -32,83 +60,75 @@ void EMTripletPairProduction::setLimit(double limit) {
 	this->limit = limit;
 }
 
-void EMTripletPairProduction::initRate(std::string filename) {
-	std::ifstream infile(filename.c_str());
+void EMTripletPairProduction::setThinning(double thinning) {
+	this->thinning = thinning;
+}
 
-	if (!infile.good())
-		throw std::runtime_error("EMTripletPairProduction: could not open file " + filename);
+double EMTripletPairProduction::getThinning() const {
+	return thinning;
+}
+
+void EMTripletPairProduction::initRate(std::string filename) {
+	CRPROPA_TRACE_SPAN("EMTripletPairProduction::initRate", "tables");
+	ref_ptr<NumericTable> table = NumericTable::load(filename);
 
 	// clear previously loaded interaction rates
 	tabEnergy.clear();
 	tabRate.clear();
 
-	while (infile.good()) {
-		if (infile.peek() != '#') {
-			double a, b;
-			infile >> a >> b;
-			if (infile) {
-				tabEnergy.push_back(pow(10, a) * eV);
-				tabRate.push_back(b / Mpc);
-			}
-		}
-		infile.ignore(std::numeric_limits < std::streamsize > ::max(), '\n');
+	// rows: log10(E/eV), rate [1/Mpc]
+	for (size_t i = 0; i < table->rows(); i++) {
+		if (table->rowSize(i) < 2)
+			continue;
+		const double *row = table->row(i);
+		tabEnergy.push_back(pow(10, row[0]) * eV);
+		tabRate.push_back(row[1] / Mpc);
 	}
-	infile.close();
+	energyAxis.assign(tabEnergy);
 }
 
 void EMTripletPairProduction::initCumulativeRate(std::string filename) {
-	std::ifstream infile(filename.c_str());
-
-	if (!infile.good())
-		throw std::runtime_error(
-				"EMTripletPairProduction: could not open file " + filename);
-
-	// clear previously loaded tables
-	tabE.clear();
-	tabs.clear();
-	tabCDF.clear();
-	
-	// skip header
-	while (infile.peek() == '#')
-		infile.ignore(std::numeric_limits < std::streamsize > ::max(), '\n');
-
-	// read s values in first line
-	double a;
-	infile >> a; // skip first value
-	while (infile.good() and (infile.peek() != '\n')) {
-		infile >> a;
-		tabs.push_back(pow(10, a) * eV * eV);
-	}
-
-	// read all following lines: E, cdf values
-	while (infile.good()) {
-		infile >> a;
-		if (!infile)
-			break;  // end of file
-		tabE.push_back(pow(10, a) * eV);
-		std::vector<double> cdf;
-		for (int i = 0; i < tabs.size(); i++) {
-			infile >> a;
-			cdf.push_back(a / Mpc);
-		}
-		tabCDF.push_back(cdf);
+	CRPROPA_TRACE_SPAN("EMTripletPairProduction::initCumulativeRate", "tables");
+	ref_ptr<NumericTable> table = NumericTable::load(filename);
+	if (table->rows() == 0)
+		throw std::runtime_error("EMTripletPairProduction: no data in file " + filename);
+
+	// new tables, shared ones are never modified
+	tables = new Tables();
+
+	// s values in the first row, after a placeholder
+	const double *row = table->row(0);
+	for (size_t j = 1; j < table->rowSize(0); j++)
+		tables->tabs.push_back(pow(10, row[j]) * eV * eV);
+
+	// all following rows: E, cdf values
+	for (size_t i = 1; i < table->rows(); i++) {
+		if (table->rowSize(i) < tables->tabs.size() + 1)
+			throw std::runtime_error("EMTripletPairProduction: incomplete row in " + filename);
+		row = table->row(i);
+		tables->tabE.push_back(pow(10, row[0]) * eV);
+		std::vector<double> cdf(tables->tabs.size());
+		for (size_t j = 0; j < tables->tabs.size(); j++)
+			cdf[j] = row[j + 1] / Mpc;
+		tables->tabCDF.push_back(cdf);
 	}
-	infile.close();
+	tables->tabAlias = cumulativeAliasTables(tables->tabCDF);
 }
 
 void EMTripletPairProduction::performInteraction(Candidate *candidate) const {
 	// scale the particle energy instead of background photons
 	double z = candidate->getRedshift();
 	double E = candidate->current.getEnergy() * (1 + z);
+	requireTables();
 
-	if (E < tabE.front() or E > tabE.back())
+	if (E < tables->tabE.front() or E > tables->tabE.back())
 		return;
 
 	// sample the value of eps
 	Random &random = Random::instance();
-	size_t i = closestIndex(E, tabE);
-	size_t j = random.randBin(tabCDF[i]);
-	double s_kin = pow(10, log10(tabs[j]) + (random.rand() - 0.5) * 0.1);
+	size_t i = closestIndex(E, tables->tabE);
+	size_t j = tables->tabAlias[i].sample(random);
+	double s_kin = pow(10, log10(tables->tabs[j]) + (random.rand() - 0.5) * 0.1);
 	double eps = s_kin / 4 / E; // random background photon energy
 
 	// Use approximation from A. Mastichiadis et al., Astroph. Journ. 300:178-189 (1986), eq. 30.
@@ -118,19 +138,39 @@ void EMTripletPairProduction::performInteraction(Candidate *candidate) const {
 
 	if (haveElectrons) {
 		Vector3d pos = random.randomInterpolatedPosition(candidate->previous.getPosition(), candidate->current.getPosition());
-		candidate->addSecondary( 11, Epp, pos);
-		candidate->addSecondary(-11, Epp, pos);
+		double w = 1 / pow(Epp / E, thinning);
+		if (thinning == 0 or random.rand() < pow(Epp / E, thinning))
+			candidate->addSecondary( 11, Epp, pos, w);
+		if (thinning == 0 or random.rand() < pow(Epp / E, thinning))
+			candidate->addSecondary(-11, Epp, pos, w);
 	}
 
 	// update the primary particle energy; do this after adding the secondaries to correctly set the secondaries parent
 	candidate->current.setEnergy((E - 2 * Epp));
 }
 
-void EMTripletPairProduction::process(Candidate *candidate) const {
+unsigned int EMTripletPairProduction::getParticleClasses() const {
+	return ElectronClass;
+}
+
+size_t EMTripletPairProduction::getMemoryUsage() const {
+	size_t bytes = memoryUsage(tabEnergy) + memoryUsage(tabRate);
+	if (tables.valid())
+		bytes += memoryUsage(tables->tabE) + memoryUsage(tables->tabs)
+				+ memoryUsage(tables->tabCDF) + memoryUsage(tables->tabAlias);
+	return bytes;
+}
+
+bool EMTripletPairProduction::hasInteractionRate() const {
+	return true;
+}
+
+double EMTripletPairProduction::getInteractionRate(const Candidate *candidate) const {
 	// check if electron / positron
 	int id = candidate->current.getId();
 	if (abs(id) != 11)
-		return;
+		return 0;
+	requireTables();
 
 	// scale the particle energy instead of background photons
 	double z = candidate->getRedshift();
@@ -138,11 +178,22 @@ void EMTripletPairProduction::process(Candidate *candidate) const {
 
 	// check if in tabulated energy range
 	if (E < tabEnergy.front() or (E > tabEnergy.back()))
-		return;
+		return 0;
 
 	// cosmological scaling of interaction distance (comoving)
 	double scaling = pow_integer<2>(1 + z) * photonField->getRedshiftScaling(z);
-	double rate = scaling * interpolate(E, tabEnergy, tabRate);
+	double rate = scaling * interpolate(E, energyAxis, tabRate);
+	return rate;
+}
+
+void EMTripletPairProduction::performStochasticInteraction(Candidate *candidate) const {
+	performInteraction(candidate);
+}
+
+void EMTripletPairProduction::process(Candidate *candidate) const {
+	double rate = getInteractionRate(candidate);
+	if (rate == 0)
+		return;
 
 	// check for interaction
 	Random &random = Random::instance();
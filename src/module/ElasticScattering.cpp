@@ -1,13 +1,14 @@
 #include "crpropa/module/ElasticScattering.h"
 #include "crpropa/Units.h"
+#include "crpropa/Common.h"
 #include "crpropa/ParticleID.h"
 #include "crpropa/ParticleMass.h"
 #include "crpropa/Random.h"
+#include "crpropa/NumericTable.h"
+#include "crpropa/TableRegistry.h"
+#include "crpropa/Trace.h"
 
 #include <cmath>
-#include <limits>
-#include <sstream>
-#include <fstream>
 #include <stdexcept>
 
 namespace crpropa {
@@ -25,100 +26,144 @@ ElasticScattering::ElasticScattering(ref_ptr<PhotonField> f) {
 
 void ElasticScattering::setPhotonField(ref_ptr<PhotonField> photonField) {
 	this->photonField = photonField;
+	setDescription("ElasticScattering: " + photonField->getFieldName());
+	tables = 0;
+	prepared.reset(new std::once_flag);
+}
+
+void ElasticScattering::loadTables() {
 	std::string fname = photonField->getFieldName();
-	setDescription("ElasticScattering: " + fname);
-	initRate(getDataPath("ElasticScattering/rate_" + fname.substr(0,3) + ".txt"));
-	initCDF(getDataPath("ElasticScattering/cdf_" + fname.substr(0,3) + ".txt"));
+	std::string rateFile = getDataPath("ElasticScattering/rate_" + fname.substr(0,3) + ".txt");
+	std::string cdfFile = getDataPath("ElasticScattering/cdf_" + fname.substr(0,3) + ".txt");
+
+	// share the tables with other instances for the same field, unless
+	// some were loaded with initRate or initCDF
+	bool shared = !tables;
+	std::string key = TableRegistry::key("ElasticScattering", fname.substr(0,3),
+			rateFile + ";" + cdfFile);
+	if (shared) {
+		tables = TableRegistry::find<Tables>(key);
+		if (tables)
+			return;
+	}
+	if (!tables or tables->tabRate.empty())
+		initRate(rateFile);
+	if (tables->tabCDF.empty())
+		initCDF(cdfFile);
+	if (shared)
+		tables = TableRegistry::insert(key, tables);
+}
+
+void ElasticScattering::requireTables() const {
+	std::call_once(*prepared, &ElasticScattering::loadTables, const_cast<ElasticScattering*>(this));
+}
+
+void ElasticScattering::prepare() {
+	requireTables();
+}
+
+void ElasticScattering::detachTables() {
+	if (!tables)
+		tables = new Tables();
+	else if (tables->getReferenceCount() > 1)
+		tables = new Tables(*tables);
 }
 
 void ElasticScattering::initRate(std::string filename) {
-	std::ifstream infile(filename.c_str());
-	if (not infile.good())
-		throw std::runtime_error("ElasticScattering: could not open file " + filename);
-
-	tabRate.clear();
-
-	while (infile.good()) {
-		if (infile.peek() == '#') {
-			infile.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-			continue;
-		}
-		double r;
-		infile >> r;
-		if (!infile)
-			break;
-		tabRate.push_back(r / Mpc);
-	}
+	CRPROPA_TRACE_SPAN("ElasticScattering::initRate", "tables");
+	ref_ptr<NumericTable> table = NumericTable::load(filename);
+	detachTables();
 
-	infile.close();
+	tables->tabRate.resize(table->size());
+	for (size_t i = 0; i < table->size(); i++)
+		tables->tabRate[i] = table->begin()[i] / Mpc;
 }
 
 void ElasticScattering::initCDF(std::string filename) {
-	std::ifstream infile(filename.c_str());
-	if (not infile.good())
-		throw std::runtime_error("ElasticScattering: could not open file " + filename);
-
-	tabCDF.clear();
-	std::string line;
-	double a;
-	while (std::getline(infile, line)) {
-		if (line[0] == '#')
-			continue;
-
-		std::stringstream lineStream(line);
-		lineStream >> a;
-
-		std::vector<double> cdf(neps);
-		for (size_t i = 0; i < neps; i++) {
-			lineStream >> a;
-			cdf[i] = a;
-		}
-		tabCDF.push_back(cdf);
+	ref_ptr<NumericTable> table = NumericTable::load(filename);
+	detachTables();
+
+	// rows: log10(Lorentz factor), cdf values
+	tables->tabCDF.clear();
+	for (size_t i = 0; i < table->rows(); i++) {
+		if (table->rowSize(i) < neps + 1)
+			throw std::runtime_error("ElasticScattering: incomplete row in " + filename);
+		const double *row = table->row(i);
+		tables->tabCDF.push_back(std::vector<double>(row + 1, row + 1 + neps));
 	}
+}
 
-	infile.close();
+unsigned int ElasticScattering::getParticleClasses() const {
+	return NucleusClass;
 }
 
-void ElasticScattering::process(Candidate *candidate) const {
+size_t ElasticScattering::getMemoryUsage() const {
+	if (!tables.valid())
+		return 0;
+	return memoryUsage(tables->tabRate) + memoryUsage(tables->tabCDF);
+}
+
+bool ElasticScattering::hasInteractionRate() const {
+	return true;
+}
+
+double ElasticScattering::getInteractionRate(const Candidate *candidate) const {
 	int id = candidate->current.getId();
 	double z = candidate->getRedshift();
 
 	if (not isNucleus(id))
-		return;
+		return 0;
+	requireTables();
 
 	double lg = log10(candidate->current.getLorentzFactor() * (1 + z));
 	if ((lg < lgmin) or (lg > lgmax))
-		return;
+		return 0;
 
 	int A = massNumber(id);
 	int Z = chargeNumber(id);
 	int N = A - Z;
 
-	double step = candidate->getCurrentStep();
-	while (step > 0) {
+	double rate = interpolateEquidistant(lg, lgmin, lgmax, tables->tabRate);
+	rate *= Z * N / double(A);  // TRK scaling
+	rate *= pow_integer<2>(1 + z) * photonField->getRedshiftScaling(z);  // cosmological scaling
+	return rate;
+}
 
-		double rate = interpolateEquidistant(lg, lgmin, lgmax, tabRate);
-		rate *= Z * N / double(A);  // TRK scaling
-		rate *= pow_integer<2>(1 + z) * photonField->getRedshiftScaling(z);  // cosmological scaling
+void ElasticScattering::performStochasticInteraction(Candidate *candidate) const {
+	requireTables();
+	Random &random = Random::instance();
+	double z = candidate->getRedshift();
+	double lg = log10(candidate->current.getLorentzFactor() * (1 + z));
+
+	// draw random background photon energy from CDF
+	size_t i = floor((lg - lgmin) / (lgmax - lgmin) * (nlg - 1)); // index of closest gamma tabulation point
+	size_t j = random.randBin(tables->tabCDF[i]) - 1; // index of next lower tabulated eps value
+	double binWidth = (epsmax - epsmin) / (neps - 1); // logarithmic bin width
+	double eps = pow(10, epsmin + (j + random.rand()) * binWidth);
 
+	// boost to lab frame
+	double cosTheta = 2 * random.rand() - 1;
+	double E = eps * candidate->current.getLorentzFactor() * (1. - cosTheta);
+
+	Vector3d pos = random.randomInterpolatedPosition(candidate->previous.getPosition(), candidate->current.getPosition());
+	candidate->addSecondary(22, E, pos);
+}
+
+void ElasticScattering::process(Candidate *candidate) const {
+	// the rate does not change, the nucleus only emits photons
+	double rate = getInteractionRate(candidate);
+	if (rate == 0)
+		return;
+
+	double step = candidate->getCurrentStep();
+	while (step > 0) {
 		// check for interaction
 		Random &random = Random::instance();
 		double randDist = -log(random.rand()) / rate;
 		if (step < randDist)
 			return;
 
-		// draw random background photon energy from CDF
-		size_t i = floor((lg - lgmin) / (lgmax - lgmin) * (nlg - 1)); // index of closest gamma tabulation point
-		size_t j = random.randBin(tabCDF[i]) - 1; // index of next lower tabulated eps value
-		double binWidth = (epsmax - epsmin) / (neps - 1); // logarithmic bin width
-		double eps = pow(10, epsmin + (j + random.rand()) * binWidth);
-
-		// boost to lab frame
-		double cosTheta = 2 * random.rand() - 1;
-		double E = eps * candidate->current.getLorentzFactor() * (1. - cosTheta);
-
-		Vector3d pos = random.randomInterpolatedPosition(candidate->previous.getPosition(), candidate->current.getPosition());
-		candidate->addSecondary(22, E, pos);
+		performStochasticInteraction(candidate);
 
 		// repeat with remaining step
 		step -= randDist;
@@ -1,10 +1,12 @@
 #include "crpropa/module/ElectronPairProduction.h"
 #include "crpropa/Units.h"
+#include "crpropa/Common.h"
 #include "crpropa/ParticleID.h"
 #include "crpropa/ParticleMass.h"
 #include "crpropa/Random.h"
+#include "crpropa/NumericTable.h"
+#include "crpropa/Trace.h"
 
-#include <fstream>
 #include <limits>
 #include <stdexcept>
 
@@ -19,14 +21,34 @@ ElectronPairProduction::ElectronPairProduction(ref_ptr<PhotonField> photonField,
 
 void ElectronPairProduction::setPhotonField(ref_ptr<PhotonField> photonField) {
 	this->photonField = photonField;
+	setDescription("ElectronPairProduction: " + photonField->getFieldName());
+	tabLorentzFactor.clear();
+	tabLossRate.clear();
+	tabSpectrum.clear();
+	tabSpectrumAlias.clear();
+	prepared.reset(new std::once_flag);
+}
+
+void ElectronPairProduction::loadTables() {
 	std::string fname = photonField->getFieldName();
-	setDescription("ElectronPairProduction: " + fname);
-	initRate(getDataPath("ElectronPairProduction/lossrate_" + fname + ".txt"));
-	initSpectrum(getDataPath("ElectronPairProduction/spectrum_" + fname.substr(0,3) + ".txt"));
+	if (tabLorentzFactor.empty())
+		initRate(getDataPath("ElectronPairProduction/lossrate_" + fname + ".txt"));
+	// the spectrum is only needed to sample the electrons
+	if (haveElectrons and tabSpectrum.empty())
+		initSpectrum(getDataPath("ElectronPairProduction/spectrum_" + fname.substr(0,3) + ".txt"));
+}
+
+void ElectronPairProduction::requireTables() const {
+	std::call_once(*prepared, &ElectronPairProduction::loadTables, const_cast<ElectronPairProduction*>(this));
+}
+
+void ElectronPairProduction::prepare() {
+	requireTables();
 }
 
 void ElectronPairProduction::setHaveElectrons(bool haveElectrons) {
 	this->haveElectrons = haveElectrons;
+	prepared.reset(new std::once_flag); // the spectrum may be needed
 }
 
 void ElectronPairProduction::setLimit(double limit) {
@@ -34,50 +56,45 @@ void ElectronPairProduction::setLimit(double limit) {
 }
 
 void ElectronPairProduction::initRate(std::string filename) {
-	std::ifstream infile(filename.c_str());
-
-	if (!infile.good())
-		throw std::runtime_error("ElectronPairProduction: could not open file " + filename);
+	CRPROPA_TRACE_SPAN("ElectronPairProduction::initRate", "tables");
+	ref_ptr<NumericTable> table = NumericTable::load(filename);
 
 	// clear previously loaded interaction rates
 	tabLorentzFactor.clear();
 	tabLossRate.clear();
 
-	while (infile.good()) {
-		if (infile.peek() != '#') {
-			double a, b;
-			infile >> a >> b;
-			if (infile) {
-				tabLorentzFactor.push_back(pow(10, a));
-				tabLossRate.push_back(b / Mpc);
-			}
-		}
-		infile.ignore(std::numeric_limits < std::streamsize > ::max(), '\n');
+	// rows: log10(Lorentz factor), energy loss rate [1/Mpc]
+	for (size_t i = 0; i < table->rows(); i++) {
+		if (table->rowSize(i) < 2)
+			continue;
+		const double *row = table->row(i);
+		tabLorentzFactor.push_back(pow(10, row[0]));
+		tabLossRate.push_back(row[1] / Mpc);
 	}
-	infile.close();
+	lorentzFactorAxis.assign(tabLorentzFactor);
 }
 
 void ElectronPairProduction::initSpectrum(std::string filename) {
-	std::ifstream infile(filename.c_str());
-	if (!infile.good())
-		throw std::runtime_error("ElectronPairProduction: could not open file " + filename);
+	ref_ptr<NumericTable> table = NumericTable::load(filename);
+	if (table->size() < 70 * 170)
+		throw std::runtime_error("ElectronPairProduction: incomplete spectrum in " + filename);
 
-	double dNdE;
+	const double *dNdE = table->begin();
 	tabSpectrum.resize(70);
 	for (size_t i = 0; i < 70; i++) {
 		tabSpectrum[i].resize(170);
 		for (size_t j = 0; j < 170; j++) {
-			infile >> dNdE;
-			tabSpectrum[i][j] = dNdE * pow(10, (7 + 0.1 * j)); // read electron distribution pdf(Ee) ~ dN/dEe * Ee
+			tabSpectrum[i][j] = dNdE[i * 170 + j] * pow(10, (7 + 0.1 * j)); // read electron distribution pdf(Ee) ~ dN/dEe * Ee
 		}
 		for (size_t j = 1; j < 170; j++) {
 			tabSpectrum[i][j] += tabSpectrum[i][j - 1]; // cdf(Ee), unnormalized
 		}
 	}
-	infile.close();
+	tabSpectrumAlias = cumulativeAliasTables(tabSpectrum);
 }
 
 double ElectronPairProduction::lossLength(int id, double lf, double z) const {
+	requireTables();
 	double Z = chargeNumber(id);
 	if (Z == 0)
 		return std::numeric_limits<double>::max(); // no pair production on uncharged particles
@@ -88,39 +105,49 @@ double ElectronPairProduction::lossLength(int id, double lf, double z) const {
 
 	double rate;
 	if (lf < tabLorentzFactor.back())
-		rate = interpolate(lf, tabLorentzFactor, tabLossRate); // interpolation
+		rate = interpolate(lf, lorentzFactorAxis, tabLossRate); // interpolation
 	else
-		rate = tabLossRate.back() * pow(lf / tabLorentzFactor.back(), -0.6); // extrapolation
+		rate = tabLossRate.back() * mathPow(lf / tabLorentzFactor.back(), -0.6); // extrapolation
 
 	double A = nuclearMass(id) / mass_proton; // more accurate than massNumber(Id)
 	rate *= Z * Z / A * pow_integer<3>(1 + z) * photonField->getRedshiftScaling(z);
 	return 1. / rate;
 }
 
+unsigned int ElectronPairProduction::getParticleClasses() const {
+	return NucleusClass;
+}
+
+size_t ElectronPairProduction::getMemoryUsage() const {
+	return memoryUsage(tabLossRate) + memoryUsage(tabLorentzFactor)
+			+ memoryUsage(tabSpectrum) + memoryUsage(tabSpectrumAlias);
+}
+
 void ElectronPairProduction::process(Candidate *c) const {
 	int id = c->current.getId();
 	if (not (isNucleus(id)))
 		return; // only nuclei
 
-	double lf = c->current.getLorentzFactor();
+	const Candidate::Kinematics &kin = c->getKinematics();
+	double lf = kin.lorentzFactor;
 	double z = c->getRedshift();
 	double losslen = lossLength(id, lf, z);  // energy loss length
 	if (losslen >= std::numeric_limits<double>::max())
 		return;
 
-	double step = c->getCurrentStep() / (1 + z); // step size in local frame
+	double step = c->getCurrentStep() / kin.redshiftFactor; // step size in local frame
 	double loss = step / losslen;  // relative energy loss
 
 	if (haveElectrons) {
 		double dE = c->current.getEnergy() * loss;  // energy loss
-		int i = round((log10(lf) - 6.05) * 10);  // find closest cdf(Ee|log10(gamma))
+		int i = round((mathLog10(lf) - 6.05) * 10);  // find closest cdf(Ee|log10(gamma))
 		i = std::min(std::max(i, 0), 69);
 		Random &random = Random::instance();
 
 		// draw pairs as long as their energy is smaller than the pair production energy loss
 		while (dE > 0) {
-			size_t j = random.randBin(tabSpectrum[i]);
-			double Ee = pow(10, 6.95 + (j + random.rand()) * 0.1) * eV;
+			size_t j = tabSpectrumAlias[i].sample(random);
+			double Ee = mathExp10(6.95 + (j + random.rand()) * 0.1) * eV;
 			double Epair = 2 * Ee; // NOTE: electron and positron in general don't have same lab frame energy, but averaged over many draws the result is consistent
 			// if the remaining energy is not sufficient check for random accepting
 			if (Epair > dE)
@@ -139,4 +166,19 @@ void ElectronPairProduction::process(Candidate *c) const {
 	c->limitNextStep(limit * losslen);
 }
 
+bool ElectronPairProduction::hasEnergyLossRate() const {
+	return true;
+}
+
+double ElectronPairProduction::getEnergyLossRate(const Candidate *candidate, double E, double z) const {
+	int id = candidate->current.getId();
+	if (not (isNucleus(id)))
+		return 0;
+	double lf = E / (nuclearMass(id) * c_squared);
+	double losslen = lossLength(id, lf, z);
+	if (losslen >= std::numeric_limits<double>::max())
+		return 0;
+	return E / losslen / (1 + z); // loss length in local frame -> per comoving distance
+}
+
 } // namespace crpropa
@@ -2,14 +2,27 @@
 
 #include "crpropa/module/HDF5Output.h"
 #include "crpropa/Version.h"
+#include "crpropa/Common.h"
 #include "crpropa/Random.h"
+#include "crpropa/RunMetrics.h"
+#include "crpropa/Trace.h"
 #include "kiss/logger.h"
 
 #include <hdf5.h>
 #include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <limits>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 const hsize_t RANK = 1;
 const hsize_t BUFFER_SIZE = 1024 * 16;
+const size_t THREAD_BUFFER_SIZE = 64;
+// registered id of the zstd filter plugin
+const H5Z_filter_t H5Z_FILTER_ZSTD = 32015;
 
 namespace crpropa {
 
@@ -48,17 +61,18 @@ hid_t variantTypeToH5T_NATIVE(Variant::Type type) {
 	}
 }
 
-HDF5Output::HDF5Output() :  Output(), filename(), file(-1), sid(-1), dset(-1), dataspace(-1), candidatesSinceFlush(0), flushLimit(std::numeric_limits<unsigned int>::max()) {
+HDF5Output::HDF5Output() :  Output(), filename(), file(-1), sid(-1), dset(-1), dataspace(-1), opened(new std::once_flag), columnar(false), normalized(false), stateSid{-1, -1}, stateDset{-1, -1}, chunkSize(BUFFER_SIZE), compression(Deflate), compressionLevel(5), shuffle(false), candidatesSinceFlush(0), flushLimit(std::numeric_limits<unsigned int>::max()), async(false), asyncCapacity(4096) {
 }
 
-HDF5Output::HDF5Output(const std::string& filename) :  Output(), filename(filename), file(-1), sid(-1), dset(-1), dataspace(-1), candidatesSinceFlush(0), flushLimit(std::numeric_limits<unsigned int>::max()) {
+HDF5Output::HDF5Output(const std::string& filename) :  Output(), filename(filename), file(-1), sid(-1), dset(-1), dataspace(-1), opened(new std::once_flag), columnar(false), normalized(false), stateSid{-1, -1}, stateDset{-1, -1}, chunkSize(BUFFER_SIZE), compression(Deflate), compressionLevel(5), shuffle(false), candidatesSinceFlush(0), flushLimit(std::numeric_limits<unsigned int>::max()), async(false), asyncCapacity(4096) {
 }
 
-HDF5Output::HDF5Output(const std::string& filename, OutputType outputtype) :  Output(outputtype), filename(filename), file(-1), sid(-1), dset(-1), dataspace(-1), candidatesSinceFlush(0), flushLimit(std::numeric_limits<unsigned int>::max()) {
+HDF5Output::HDF5Output(const std::string& filename, OutputType outputtype) :  Output(outputtype), filename(filename), file(-1), sid(-1), dset(-1), dataspace(-1), opened(new std::once_flag), columnar(false), normalized(false), stateSid{-1, -1}, stateDset{-1, -1}, chunkSize(BUFFER_SIZE), compression(Deflate), compressionLevel(5), shuffle(false), candidatesSinceFlush(0), flushLimit(std::numeric_limits<unsigned int>::max()), async(false), asyncCapacity(4096) {
 	outputtype = outputtype;
 }
 
 HDF5Output::~HDF5Output() {
+	async = false;
 	close();
 }
 
@@ -97,106 +111,110 @@ herr_t HDF5Output::insertDoubleAttribute(const std::string &key, const double &v
 
 
 
-void HDF5Output::open(const std::string& filename) {
-	file = H5Fcreate(filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
-	if (file < 0)
-		throw std::runtime_error(std::string("Cannot create file: ") + filename);
+bool HDF5Output::hasSourceColumns() const {
+	return fields.test(SourceIdColumn) or fields.test(SourceEnergyColumn)
+			or fields.test(SourcePositionColumn)
+			or (fields.test(SourceDirectionColumn) and not oneDimensional);
+}
 
+bool HDF5Output::hasCreatedColumns() const {
+	return fields.test(CreatedIdColumn) or fields.test(CreatedEnergyColumn)
+			or fields.test(CreatedPositionColumn)
+			or (fields.test(CreatedDirectionColumn) and not oneDimensional);
+}
 
-	sid = H5Tcreate(H5T_COMPOUND, sizeof(OutputRow));
-	if (fields.test(TrajectoryLengthColumn))
-		H5Tinsert(sid, "D", HOFFSET(OutputRow, D), H5T_NATIVE_DOUBLE);
-	if (fields.test(RedshiftColumn))
-		H5Tinsert(sid, "z", HOFFSET(OutputRow, z), H5T_NATIVE_DOUBLE);
-	if (fields.test(SerialNumberColumn))
-		H5Tinsert(sid, "SN", HOFFSET(OutputRow, SN), H5T_NATIVE_UINT64);
-	if (fields.test(CurrentIdColumn))
-		H5Tinsert(sid, "ID", HOFFSET(OutputRow, ID), H5T_NATIVE_INT32);
-	if (fields.test(CurrentEnergyColumn))
-		H5Tinsert(sid, "E", HOFFSET(OutputRow, E), H5T_NATIVE_DOUBLE);
-	if (fields.test(CurrentPositionColumn) && oneDimensional)
-		H5Tinsert(sid, "X", HOFFSET(OutputRow, X), H5T_NATIVE_DOUBLE);
-	if (fields.test(CurrentPositionColumn) && not oneDimensional) {
-		H5Tinsert(sid, "X", HOFFSET(OutputRow, X), H5T_NATIVE_DOUBLE);
-		H5Tinsert(sid, "Y", HOFFSET(OutputRow, Y), H5T_NATIVE_DOUBLE);
-		H5Tinsert(sid, "Z", HOFFSET(OutputRow, Z), H5T_NATIVE_DOUBLE);
-	}
-	if (fields.test(CurrentDirectionColumn) && not oneDimensional) {
-		H5Tinsert(sid, "Px", HOFFSET(OutputRow, Px), H5T_NATIVE_DOUBLE);
-		H5Tinsert(sid, "Py", HOFFSET(OutputRow, Py), H5T_NATIVE_DOUBLE);
-		H5Tinsert(sid, "Pz", HOFFSET(OutputRow, Pz), H5T_NATIVE_DOUBLE);
-	}
-	if (fields.test(SerialNumberColumn))
-		H5Tinsert(sid, "SN0", HOFFSET(OutputRow, SN0), H5T_NATIVE_UINT64);
+void HDF5Output::insertSourceColumns(hid_t type) const {
 	if (fields.test(SourceIdColumn))
-		H5Tinsert(sid, "ID0", HOFFSET(OutputRow, ID0), H5T_NATIVE_INT32);
+		H5Tinsert(type, "ID0", HOFFSET(OutputRow, ID0), H5T_NATIVE_INT32);
 	if (fields.test(SourceEnergyColumn))
-		H5Tinsert(sid, "E0", HOFFSET(OutputRow, E0), H5T_NATIVE_DOUBLE);
+		H5Tinsert(type, "E0", HOFFSET(OutputRow, E0), H5T_NATIVE_DOUBLE);
 	if (fields.test(SourcePositionColumn) && oneDimensional)
-		H5Tinsert(sid, "X0", HOFFSET(OutputRow, X0), H5T_NATIVE_DOUBLE);
+		H5Tinsert(type, "X0", HOFFSET(OutputRow, X0), H5T_NATIVE_DOUBLE);
 	if (fields.test(SourcePositionColumn) && not oneDimensional){
-		H5Tinsert(sid, "X0", HOFFSET(OutputRow, X0), H5T_NATIVE_DOUBLE);
-		H5Tinsert(sid, "Y0", HOFFSET(OutputRow, Y0), H5T_NATIVE_DOUBLE);
-		H5Tinsert(sid, "Z0", HOFFSET(OutputRow, Z0), H5T_NATIVE_DOUBLE);
+		H5Tinsert(type, "X0", HOFFSET(OutputRow, X0), H5T_NATIVE_DOUBLE);
+		H5Tinsert(type, "Y0", HOFFSET(OutputRow, Y0), H5T_NATIVE_DOUBLE);
+		H5Tinsert(type, "Z0", HOFFSET(OutputRow, Z0), H5T_NATIVE_DOUBLE);
 	}
 	if (fields.test(SourceDirectionColumn) && not oneDimensional) {
-		H5Tinsert(sid, "P0x", HOFFSET(OutputRow, P0x), H5T_NATIVE_DOUBLE);
-		H5Tinsert(sid, "P0y", HOFFSET(OutputRow, P0y), H5T_NATIVE_DOUBLE);
-		H5Tinsert(sid, "P0z", HOFFSET(OutputRow, P0z), H5T_NATIVE_DOUBLE);
+		H5Tinsert(type, "P0x", HOFFSET(OutputRow, P0x), H5T_NATIVE_DOUBLE);
+		H5Tinsert(type, "P0y", HOFFSET(OutputRow, P0y), H5T_NATIVE_DOUBLE);
+		H5Tinsert(type, "P0z", HOFFSET(OutputRow, P0z), H5T_NATIVE_DOUBLE);
 	}
-	if (fields.test(SerialNumberColumn))
-		H5Tinsert(sid, "SN1", HOFFSET(OutputRow, SN1), H5T_NATIVE_UINT64);
+}
+
+void HDF5Output::insertCreatedColumns(hid_t type) const {
 	if (fields.test(CreatedIdColumn))
-		H5Tinsert(sid, "ID1", HOFFSET(OutputRow, ID1), H5T_NATIVE_INT32);
+		H5Tinsert(type, "ID1", HOFFSET(OutputRow, ID1), H5T_NATIVE_INT32);
 	if (fields.test(CreatedEnergyColumn))
-		H5Tinsert(sid, "E1", HOFFSET(OutputRow, E1), H5T_NATIVE_DOUBLE);
+		H5Tinsert(type, "E1", HOFFSET(OutputRow, E1), H5T_NATIVE_DOUBLE);
 	if (fields.test(CreatedPositionColumn) && oneDimensional)
-		H5Tinsert(sid, "X1", HOFFSET(OutputRow, X1), H5T_NATIVE_DOUBLE);
+		H5Tinsert(type, "X1", HOFFSET(OutputRow, X1), H5T_NATIVE_DOUBLE);
 	if (fields.test(CreatedPositionColumn) && not oneDimensional) {
-		H5Tinsert(sid, "X1", HOFFSET(OutputRow, X1), H5T_NATIVE_DOUBLE);
-		H5Tinsert(sid, "Y1", HOFFSET(OutputRow, Y1), H5T_NATIVE_DOUBLE);
-		H5Tinsert(sid, "Z1", HOFFSET(OutputRow, Z1), H5T_NATIVE_DOUBLE);
+		H5Tinsert(type, "X1", HOFFSET(OutputRow, X1), H5T_NATIVE_DOUBLE);
+		H5Tinsert(type, "Y1", HOFFSET(OutputRow, Y1), H5T_NATIVE_DOUBLE);
+		H5Tinsert(type, "Z1", HOFFSET(OutputRow, Z1), H5T_NATIVE_DOUBLE);
 	}
 	if (fields.test(CreatedDirectionColumn) && not oneDimensional) {
-		H5Tinsert(sid, "P1x", HOFFSET(OutputRow, P1x), H5T_NATIVE_DOUBLE);
-		H5Tinsert(sid, "P1y", HOFFSET(OutputRow, P1y), H5T_NATIVE_DOUBLE);
-		H5Tinsert(sid, "P1z", HOFFSET(OutputRow, P1z), H5T_NATIVE_DOUBLE);
+		H5Tinsert(type, "P1x", HOFFSET(OutputRow, P1x), H5T_NATIVE_DOUBLE);
+		H5Tinsert(type, "P1y", HOFFSET(OutputRow, P1y), H5T_NATIVE_DOUBLE);
+		H5Tinsert(type, "P1z", HOFFSET(OutputRow, P1z), H5T_NATIVE_DOUBLE);
 	}
-	if (fields.test(WeightColumn))
-		H5Tinsert(sid, "weight", HOFFSET(OutputRow, weight), H5T_NATIVE_DOUBLE);
+}
 
-	size_t pos = 0;
-	for(std::vector<Output::Property>::const_iterator iter = properties.begin();
-			iter != properties.end(); ++iter)
-	{
-			hid_t type = variantTypeToH5T_NATIVE((*iter).defaultValue.getType());
-			if (type == H5T_C_S1)
-			{ // set size of string field to size of default value!
-				type = H5Tcopy(H5T_C_S1);
-				H5Tset_size(type, (*iter).defaultValue.toString().size());
-			}
+void HDF5Output::open(const std::string& filename) {
+	// the chunk extrema of the columns need the dense attribute storage
+	hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+	if (columnar)
+		H5Pset_libver_bounds(fapl, H5F_LIBVER_V18, H5F_LIBVER_LATEST);
+	file = H5Fcreate(filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+	H5Pclose(fapl);
+	if (file < 0)
+		throw std::runtime_error(std::string("Cannot create file: ") + filename);
 
-			H5Tinsert(sid, (*iter).name.c_str(), HOFFSET(OutputRow, propertyBuffer) + pos, type);
-		  pos += (*iter).defaultValue.getSize();
-	}
-	if (pos >= propertyBufferSize)
-	{
-		KISS_LOG_ERROR << "Using " << pos << " bytes for properties output. Maximum is " << propertyBufferSize << " bytes.";
-		throw std::runtime_error("Size of property buffer exceeded");
-	}
+
+	createRowType();
 
 	// chunked prop
 	hid_t plist = H5Pcreate(H5P_DATASET_CREATE);
 	H5Pset_layout(plist, H5D_CHUNKED);
-	hsize_t chunk_dims[RANK] = {BUFFER_SIZE};
+	hsize_t chunk_dims[RANK] = {chunkSize};
 	H5Pset_chunk(plist, RANK, chunk_dims);
-	H5Pset_deflate(plist, 5);
+	if (shuffle)
+		H5Pset_shuffle(plist);
+	if (compression == Deflate)
+		H5Pset_deflate(plist, compressionLevel);
+	if (compression == Zstd) {
+		unsigned int level = compressionLevel;
+		H5Pset_filter(plist, H5Z_FILTER_ZSTD, H5Z_FLAG_MANDATORY, 1, &level);
+	}
 
 	hsize_t dims[RANK] = {0};
 	hsize_t max_dims[RANK] = {H5S_UNLIMITED};
 	dataspace = H5Screate_simple(RANK, dims, max_dims);
 
-	dset = H5Dcreate2(file, "CRPROPA3", sid, dataspace, H5P_DEFAULT, plist, H5P_DEFAULT);
+	if (columnar) {
+		H5Pset_attr_phase_change(plist, 0, 0);
+		dset = H5Gcreate2(file, "CRPROPA3", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+	} else {
+		dset = H5Dcreate2(file, "CRPROPA3", sid, dataspace, H5P_DEFAULT, plist, H5P_DEFAULT);
+	}
+	createColumns(plist);
+
+	if (normalized) {
+		const char *names[2] = {"SOURCES", "CREATED"};
+		for (int i = 0; i < 2; i++) {
+			stateSid[i] = H5Tcreate(H5T_COMPOUND, sizeof(OutputRow));
+			if (i == 0) {
+				H5Tinsert(stateSid[i], "SN0", HOFFSET(OutputRow, SN0), H5T_NATIVE_UINT64);
+				insertSourceColumns(stateSid[i]);
+			} else {
+				H5Tinsert(stateSid[i], "SN1", HOFFSET(OutputRow, SN1), H5T_NATIVE_UINT64);
+				insertCreatedColumns(stateSid[i]);
+			}
+			stateDset[i] = H5Dcreate2(file, names[i], stateSid[i], dataspace, H5P_DEFAULT,
+					plist, H5P_DEFAULT);
+		}
+	}
 
 	insertStringAttribute("OutputType", outputName);
 	insertStringAttribute("Version", g_GIT_DESC);
@@ -228,30 +246,196 @@ void HDF5Output::open(const std::string& filename) {
 
 
 	H5Pclose(plist);
+	initBuffers();
+}
+
+void HDF5Output::createRowType() {
+	sid = H5Tcreate(H5T_COMPOUND, sizeof(OutputRow));
+	if (fields.test(TrajectoryLengthColumn))
+		H5Tinsert(sid, "D", HOFFSET(OutputRow, D), H5T_NATIVE_DOUBLE);
+	if (fields.test(RedshiftColumn))
+		H5Tinsert(sid, "z", HOFFSET(OutputRow, z), H5T_NATIVE_DOUBLE);
+	if (fields.test(SerialNumberColumn))
+		H5Tinsert(sid, "SN", HOFFSET(OutputRow, SN), H5T_NATIVE_UINT64);
+	if (fields.test(CurrentIdColumn))
+		H5Tinsert(sid, "ID", HOFFSET(OutputRow, ID), H5T_NATIVE_INT32);
+	if (fields.test(CurrentEnergyColumn))
+		H5Tinsert(sid, "E", HOFFSET(OutputRow, E), H5T_NATIVE_DOUBLE);
+	if (fields.test(CurrentPositionColumn) && oneDimensional)
+		H5Tinsert(sid, "X", HOFFSET(OutputRow, X), H5T_NATIVE_DOUBLE);
+	if (fields.test(CurrentPositionColumn) && not oneDimensional) {
+		H5Tinsert(sid, "X", HOFFSET(OutputRow, X), H5T_NATIVE_DOUBLE);
+		H5Tinsert(sid, "Y", HOFFSET(OutputRow, Y), H5T_NATIVE_DOUBLE);
+		H5Tinsert(sid, "Z", HOFFSET(OutputRow, Z), H5T_NATIVE_DOUBLE);
+	}
+	if (fields.test(CurrentDirectionColumn) && not oneDimensional) {
+		H5Tinsert(sid, "Px", HOFFSET(OutputRow, Px), H5T_NATIVE_DOUBLE);
+		H5Tinsert(sid, "Py", HOFFSET(OutputRow, Py), H5T_NATIVE_DOUBLE);
+		H5Tinsert(sid, "Pz", HOFFSET(OutputRow, Pz), H5T_NATIVE_DOUBLE);
+	}
+	if (not normalized) {
+		if (fields.test(SerialNumberColumn))
+			H5Tinsert(sid, "SN0", HOFFSET(OutputRow, SN0), H5T_NATIVE_UINT64);
+		insertSourceColumns(sid);
+		if (fields.test(SerialNumberColumn))
+			H5Tinsert(sid, "SN1", HOFFSET(OutputRow, SN1), H5T_NATIVE_UINT64);
+		insertCreatedColumns(sid);
+	} else {
+		// references to the states
+		if (fields.test(SerialNumberColumn) or hasSourceColumns())
+			H5Tinsert(sid, "SN0", HOFFSET(OutputRow, SN0), H5T_NATIVE_UINT64);
+		if (fields.test(SerialNumberColumn))
+			H5Tinsert(sid, "SN1", HOFFSET(OutputRow, SN1), H5T_NATIVE_UINT64);
+		if (hasCreatedColumns())
+			H5Tinsert(sid, "C1", HOFFSET(OutputRow, C1), H5T_NATIVE_UINT64);
+	}
+	if (fields.test(WeightColumn))
+		H5Tinsert(sid, "weight", HOFFSET(OutputRow, weight), H5T_NATIVE_DOUBLE);
+
+	for(std::vector<Output::Property>::const_iterator iter = properties.begin();
+			iter != properties.end(); ++iter)
+	{
+			hid_t type = variantTypeToH5T_NATIVE((*iter).type);
+			if (type == H5T_C_S1)
+			{ // set size of string field to size of default value!
+				type = H5Tcopy(H5T_C_S1);
+				H5Tset_size(type, (*iter).size);
+			}
+
+			H5Tinsert(sid, (*iter).name.c_str(), HOFFSET(OutputRow, propertyBuffer) + (*iter).offset, type);
+	}
+	size_t pos = getPropertyRowSize();
+	if (pos >= propertyBufferSize)
+	{
+		KISS_LOG_ERROR << "Using " << pos << " bytes for properties output. Maximum is " << propertyBufferSize << " bytes.";
+		throw std::runtime_error("Size of property buffer exceeded");
+	}
+}
 
+void HDF5Output::initBuffers() {
 	buffer.reserve(BUFFER_SIZE);
+	writeBuffer.reserve(BUFFER_SIZE);
+	size_t nThreads = 1;
+#ifdef _OPENMP
+	nThreads = omp_in_parallel() ? omp_get_num_threads() : omp_get_max_threads();
+#endif
+	threadBuffers.assign(nThreads, std::vector<OutputRow>());
+	if (ordered)
+		spill.reset(new OrderedRowSpill<OutputRow>(nThreads, orderedBufferRows));
 	time(&lastFlush);
 }
 
+bool HDF5Output::reopen() {
+	// only the compound layout can be continued, the columnar and normalized
+	// layouts have per-chunk extrema and shared states of the discarded rows
+	if (columnar or normalized or not std::ifstream(filename.c_str()).good())
+		return false;
+	file = H5Fopen(filename.c_str(), H5F_ACC_RDWR, H5P_DEFAULT);
+	if (file < 0)
+		return false;
+	createRowType();
+	dset = H5Dopen2(file, "CRPROPA3", H5P_DEFAULT);
+	hsize_t dims[RANK] = {0};
+	hsize_t max_dims[RANK] = {H5S_UNLIMITED};
+	dataspace = H5Screate_simple(RANK, dims, max_dims);
+	initBuffers();
+
+	// the rows of the file have to have the columns of this output
+	bool same = false;
+	if (dset >= 0) {
+		hid_t type = H5Dget_type(dset);
+		same = (H5Tequal(type, sid) > 0);
+		H5Tclose(type);
+	}
+	if (not same) {
+		if (dset >= 0)
+			H5Dclose(dset);
+		H5Tclose(sid);
+		H5Sclose(dataspace);
+		H5Fclose(file);
+		file = -1;
+	}
+	return same;
+}
+
+bool HDF5Output::rewind(size_t rows, uint64_t position) {
+	// the marker of the HDF5Output is the number of rows
+	if (position != rows)
+		return false;
+	if (rows == count)
+		return true;
+	stopWriter();
+	bool rewound = false;
+	if (file == -1) {
+		// the file of an earlier process, continued at the marker
+		rewound = reopen();
+	} else if (not spill) {
+		flushThreadBuffers();
+		flushBuffer();
+		rewound = true;
+	}
+	if (rewound) {
+		hid_t space = H5Dget_space(dset);
+		hsize_t n = H5Sget_simple_extent_npoints(space);
+		H5Sclose(space);
+		rewound = (n >= rows);
+	}
+	if (rewound) {
+		hsize_t size[RANK] = {rows};
+		H5Dset_extent(dset, size);
+		H5Fflush(file, H5F_SCOPE_GLOBAL);
+		count = rows;
+	}
+	if (async)
+		startWriter();
+	return rewound;
+}
+
+const std::string &HDF5Output::getFilename() const {
+	return filename;
+}
+
 void HDF5Output::close() {
+	stopWriter();
 	if (file >= 0) {
-		flush();
-		H5Dclose(dset);
+		writeOrdered();
+		flushThreadBuffers();
+		flushBuffer();
+		closeColumns();
+		if (columnar)
+			H5Gclose(dset);
+		else
+			H5Dclose(dset);
+		for (int i = 0; i < 2; i++) {
+			if (stateDset[i] >= 0) {
+				H5Dclose(stateDset[i]);
+				H5Tclose(stateSid[i]);
+			}
+			stateDset[i] = stateSid[i] = -1;
+		}
+		writtenSources.clear();
+		createdIndex.clear();
 		H5Tclose(sid);
 		H5Sclose(dataspace);
 		H5Fclose(file);
 		file = -1;
 	}
+	opened.reset(new std::once_flag);
+	if (async)
+		startWriter();
 }
 
 void HDF5Output::process(Candidate* candidate) const {
-	#pragma omp critical
-	{
-	if (file == -1)
-		// This is ugly, but necesary as otherwise the user has to manually open the
-		// file before processing the first candidate
-		const_cast<HDF5Output*>(this)->open(filename);
-	}
+	// with the writer thread the file is opened by the writer
+	if (!writer)
+		std::call_once(*opened, [this]() {
+			// This is ugly, but necesary as otherwise the user has to manually open the
+			// file before processing the first candidate
+			if (file == -1)
+				const_cast<HDF5Output*>(this)->open(filename);
+		});
+	if (not passesFilter(candidate))
+		return;
 
 	OutputRow r;
 	r.D = candidate->getTrajectoryLength() / lengthScale;
@@ -295,67 +479,175 @@ void HDF5Output::process(Candidate* candidate) const {
 
 	r.weight= candidate->getWeight();
 
-	size_t pos = 0;
 	for(std::vector<Output::Property>::const_iterator iter = properties.begin();
 			iter != properties.end(); ++iter)
-	{
-		  Variant v;
-			if (candidate->hasProperty((*iter).name))
-			{
-				v = candidate->getProperty((*iter).name);
-			}
-			else
-			{
-				v = (*iter).defaultValue;
-			}
-			pos += v.copyToBuffer(&r.propertyBuffer[pos]);
+		writeProperty(candidate, *iter, r.propertyBuffer);
+
+#pragma omp atomic
+	count++;
+	RunMetrics::countOutputBytes(sizeof(OutputRow));
+
+	if (spill) {
+		spill->push(getOrderKey(candidate), r);
+		return;
+	}
+	if (writer) {
+		writer->push(r);
+		return;
 	}
 
-	#pragma omp critical
+	size_t i = 0;
+#ifdef _OPENMP
+	i = omp_get_thread_num();
+#endif
+	if (i >= threadBuffers.size()) {
+		// more threads than at opening the file
+		appendRows(&r, 1);
+		return;
+	}
+	std::vector<OutputRow> &rows = threadBuffers[i];
+	rows.push_back(r);
+	if (rows.size() >= std::min<size_t>(THREAD_BUFFER_SIZE, flushLimit)) {
+		appendRows(rows.data(), rows.size());
+		rows.clear();
+	}
+}
+
+void HDF5Output::appendRows(const OutputRow *rows, size_t n) const {
 	{
-		const_cast<HDF5Output*>(this)->candidatesSinceFlush++;
-		Output::process(candidate);
+		std::lock_guard<std::mutex> lock(bufferMutex);
+		buffer.insert(buffer.end(), rows, rows + n);
+		const_cast<HDF5Output*>(this)->candidatesSinceFlush += n;
+		if ((buffer.size() < BUFFER_SIZE) and (candidatesSinceFlush < flushLimit)
+				and (difftime(time(NULL), lastFlush) <= 60*10))
+			return;
+	}
+	flushBuffer(true);
+}
 
-		buffer.push_back(r);
+void HDF5Output::writeOrdered() const {
+	if (not spill)
+		return;
+	std::vector<OutputRow> rows;
+	rows.reserve(BUFFER_SIZE);
+	spill->merge([this, &rows](const OutputRow &row) {
+		rows.push_back(row);
+		if (rows.size() == BUFFER_SIZE) {
+			writeRows(rows);
+			rows.clear();
+		}
+	});
+	writeRows(rows);
+	spill.reset();
+}
 
+void HDF5Output::flush() const {
+	CRPROPA_TRACE_SPAN("HDF5Output::flush", "output");
+	if (writer) {
+		writer->sync();
+		return;
+	}
+	flushThreadBuffers();
+	flushBuffer();
+}
 
-		if (buffer.size() >= buffer.capacity())
-		{
-			KISS_LOG_DEBUG << "HDF5Output: Flush due to buffer capacity exceeded";
-			flush();
-		}
-		else if (candidatesSinceFlush >= flushLimit)
-		{
-			KISS_LOG_DEBUG << "HDF5Output: Flush due to number of candidates";
-			flush();
-		}
-		else if (difftime(time(NULL), lastFlush) > 60*10)
-		{
-			KISS_LOG_DEBUG << "HDF5Output: Flush due to time exceeded";
-			flush();
-		}
+void HDF5Output::flushThreadBuffers() const {
+	for (size_t i = 0; i < threadBuffers.size(); i++) {
+#ifdef _OPENMP
+		// the buffers of the other threads are in use
+		if (omp_in_parallel() and (i != size_t(omp_get_thread_num())))
+			continue;
+#endif
+		std::vector<OutputRow> &rows = threadBuffers[i];
+		if (rows.empty())
+			continue;
+		appendRows(rows.data(), rows.size());
+		rows.clear();
 	}
 }
 
-void HDF5Output::flush() const {
-	const_cast<HDF5Output*>(this)->lastFlush = time(NULL);
-	const_cast<HDF5Output*>(this)->candidatesSinceFlush = 0;
+void HDF5Output::flushBuffer(bool ifFull) const {
+	// the rows are written without holding the buffer, which the other
+	// threads continue to fill
+	std::unique_lock<std::mutex> writeLock(writeMutex, std::defer_lock);
+	{
+		CRPROPA_TRACE_SPAN("HDF5Output::wait", "lock");
+		writeLock.lock();
+	}
+	{
+		std::lock_guard<std::mutex> lock(bufferMutex);
+		// another thread may have written the full buffer meanwhile
+		if (ifFull and (buffer.size() < BUFFER_SIZE) and (candidatesSinceFlush < flushLimit)
+				and (difftime(time(NULL), lastFlush) <= 60*10))
+			return;
+		KISS_LOG_DEBUG << "HDF5Output: Flush of " << buffer.size() << " rows";
+		const_cast<HDF5Output*>(this)->lastFlush = time(NULL);
+		const_cast<HDF5Output*>(this)->candidatesSinceFlush = 0;
+		buffer.swap(writeBuffer);
+	}
+	writeRows(writeBuffer);
+	writeBuffer.clear();
+}
 
-	hsize_t n = buffer.size();
+void HDF5Output::writeRows(std::vector<OutputRow> &rows) const {
+	CRPROPA_TRACE_SPAN("HDF5Output::writeRows", "output");
+	hsize_t n = rows.size();
 
 	if (n == 0)
 		return;
+	if (normalized)
+		writeStates(rows);
+	if (columnar) {
+		writeColumns(rows);
+		return;
+	}
+
+	appendToDataset(dset, sid, rows.data(), n);
+	H5Fflush(file, H5F_SCOPE_GLOBAL);
+}
 
-	hid_t file_space = H5Dget_space(dset);
+void HDF5Output::writeStates(std::vector<OutputRow> &rows) const {
+	// the new sources
+	stateRows.clear();
+	if (hasSourceColumns())
+		for (size_t i = 0; i < rows.size(); i++)
+			if (writtenSources.insert(rows[i].SN0).second)
+				stateRows.push_back(rows[i]);
+	appendToDataset(stateDset[0], stateSid[0], stateRows.data(), stateRows.size());
+
+	// the new creation states, the key holds all members of the state
+	stateRows.clear();
+	if (hasCreatedColumns()) {
+		std::string key(sizeof(uint64_t) + sizeof(int32_t) + 7 * sizeof(double), '\0');
+		for (size_t i = 0; i < rows.size(); i++) {
+			OutputRow &r = rows[i];
+			char *k = &key[0];
+			memcpy(k, &r.SN1, sizeof(uint64_t));
+			memcpy(k + 8, &r.ID1, sizeof(int32_t));
+			memcpy(k + 12, &r.E1, 7 * sizeof(double)); // E1 to P1z
+			std::pair<std::unordered_map<std::string, uint64_t>::iterator, bool> inserted =
+					createdIndex.insert(std::make_pair(key, createdIndex.size()));
+			r.C1 = inserted.first->second;
+			if (inserted.second)
+				stateRows.push_back(r);
+		}
+	}
+	appendToDataset(stateDset[1], stateSid[1], stateRows.data(), stateRows.size());
+}
+
+void HDF5Output::appendToDataset(hid_t dataset, hid_t type, const OutputRow *rows, hsize_t n) const {
+	if (n == 0)
+		return;
+	hid_t file_space = H5Dget_space(dataset);
 	hsize_t count = H5Sget_simple_extent_npoints(file_space);
 
 	// resize dataset
 	hsize_t new_size[RANK] = {count + n};
-	H5Dset_extent(dset, new_size);
+	H5Dset_extent(dataset, new_size);
 
 	// get updated filespace
 	H5Sclose(file_space);
-	file_space = H5Dget_space(dset);
+	file_space = H5Dget_space(dataset);
 
 	hsize_t offset[RANK] = {count};
 	hsize_t cnt[RANK] = {n};
@@ -363,25 +655,307 @@ void HDF5Output::flush() const {
 	H5Sselect_hyperslab(file_space, H5S_SELECT_SET, offset, NULL, cnt, NULL);
 	hid_t mspace_id = H5Screate_simple(RANK, cnt, NULL);
 
-	H5Dwrite(dset, sid, mspace_id, file_space, H5P_DEFAULT, buffer.data());
+	H5Dwrite(dataset, type, mspace_id, file_space, H5P_DEFAULT, rows);
 
 	H5Sclose(mspace_id);
 	H5Sclose(file_space);
+}
 
-	buffer.clear();
+void HDF5Output::createColumns(hid_t plist) {
+	columns.clear();
+	for (int i = 0; i < H5Tget_nmembers(sid); i++) {
+		Column c;
+		char *name = H5Tget_member_name(sid, i);
+		c.name = name;
+		H5free_memory(name);
+		c.offset = H5Tget_member_offset(sid, i);
+		c.type = H5Tget_member_type(sid, i);
+		c.size = H5Tget_size(c.type);
+		H5T_class_t typeClass = H5Tget_class(c.type);
+		c.numeric = (typeClass == H5T_INTEGER) or (typeClass == H5T_FLOAT);
+		c.dset = -1;
+		if (columnar)
+			c.dset = H5Dcreate2(dset, c.name.c_str(), c.type, dataspace, H5P_DEFAULT, plist,
+					H5P_DEFAULT);
+		columns.push_back(c);
+	}
+}
 
+void HDF5Output::writeColumns(const std::vector<OutputRow> &rows) const {
+	hsize_t n = rows.size();
+	std::vector<char> data;
+	std::vector<double> values;
+	for (size_t i = 0; i < columns.size(); i++) {
+		Column &c = columns[i];
+		data.resize(n * c.size);
+		for (size_t j = 0; j < n; j++)
+			memcpy(&data[j * c.size], reinterpret_cast<const char*>(&rows[j]) + c.offset, c.size);
+
+		hid_t file_space = H5Dget_space(c.dset);
+		hsize_t count = H5Sget_simple_extent_npoints(file_space);
+		H5Sclose(file_space);
+		hsize_t new_size[RANK] = {count + n};
+		H5Dset_extent(c.dset, new_size);
+		file_space = H5Dget_space(c.dset);
+		hsize_t offset[RANK] = {count};
+		hsize_t cnt[RANK] = {n};
+		H5Sselect_hyperslab(file_space, H5S_SELECT_SET, offset, NULL, cnt, NULL);
+		hid_t mspace_id = H5Screate_simple(RANK, cnt, NULL);
+		H5Dwrite(c.dset, c.type, mspace_id, file_space, H5P_DEFAULT, data.data());
+		H5Sclose(mspace_id);
+		H5Sclose(file_space);
+
+		if (not c.numeric)
+			continue;
+		// extrema of the chunks, the values are converted in place
+		values.resize(n);
+		memcpy(values.data(), data.data(), data.size());
+		H5Tconvert(c.type, H5T_NATIVE_DOUBLE, n, values.data(), NULL, H5P_DEFAULT);
+		for (size_t j = 0; j < n; j++) {
+			size_t chunk = (count + j) / chunkSize;
+			if (chunk >= c.min.size()) {
+				c.min.resize(chunk + 1, std::numeric_limits<double>::infinity());
+				c.max.resize(chunk + 1, -std::numeric_limits<double>::infinity());
+			}
+			c.min[chunk] = std::min(c.min[chunk], values[j]);
+			c.max[chunk] = std::max(c.max[chunk], values[j]);
+		}
+	}
 	H5Fflush(file, H5F_SCOPE_GLOBAL);
 }
 
+void HDF5Output::closeColumns() {
+	for (size_t i = 0; i < columns.size(); i++) {
+		Column &c = columns[i];
+		if (c.dset >= 0) {
+			hsize_t nChunks = c.min.size();
+			for (int m = 0; c.numeric and (nChunks > 0) and (m < 2); m++) {
+				hid_t space = H5Screate_simple(1, &nChunks, NULL);
+				hid_t attr = H5Acreate2(c.dset, m ? "max" : "min", H5T_NATIVE_DOUBLE, space,
+						H5P_DEFAULT, H5P_DEFAULT);
+				H5Awrite(attr, H5T_NATIVE_DOUBLE, m ? c.max.data() : c.min.data());
+				H5Aclose(attr);
+				H5Sclose(space);
+			}
+			H5Dclose(c.dset);
+		}
+		H5Tclose(c.type);
+	}
+	columns.clear();
+}
+
+void HDF5Output::checkClosed() const {
+	if (file >= 0)
+		throw std::runtime_error("HDF5Output: the layout has to be set before the file is opened");
+}
+
+void HDF5Output::setColumnar(bool columnar) {
+	checkClosed();
+	this->columnar = columnar;
+}
+
+bool HDF5Output::isColumnar() const {
+	return columnar;
+}
+
+void HDF5Output::setNormalized(bool normalized) {
+	checkClosed();
+	this->normalized = normalized;
+}
+
+bool HDF5Output::isNormalized() const {
+	return normalized;
+}
+
+void HDF5Output::setChunkSize(size_t rows) {
+	checkClosed();
+	if (rows == 0)
+		throw std::runtime_error("HDF5Output: the chunk size has to be positive");
+	chunkSize = rows;
+}
+
+size_t HDF5Output::getChunkSize() const {
+	return chunkSize;
+}
+
+void HDF5Output::setCompression(Compression method, int level, bool shuffle) {
+	checkClosed();
+	if ((method == Zstd) and (H5Zfilter_avail(H5Z_FILTER_ZSTD) <= 0))
+		throw std::runtime_error("HDF5Output: the zstd filter plugin of HDF5 is not available");
+	compression = method;
+	compressionLevel = level;
+	this->shuffle = shuffle;
+}
+
+void HDF5Output::merge(const std::string &filename) {
+	stopWriter();
+	try {
+		mergeFile(filename);
+	} catch (...) {
+		if (async)
+			startWriter();
+		throw;
+	}
+	if (async)
+		startWriter();
+}
+
+void HDF5Output::mergeFile(const std::string &filename) {
+	if (normalized)
+		throw std::runtime_error("HDF5Output: files of the normalized layout cannot be merged");
+	if (file == -1)
+		open(this->filename);
+	flushThreadBuffers();
+	flushBuffer();
+
+	hid_t mergeFile = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+	if (mergeFile < 0)
+		throw std::runtime_error(std::string("HDF5Output: cannot open file: ") + filename);
+	hid_t mergeObject = H5Oopen(mergeFile, "CRPROPA3", H5P_DEFAULT);
+	if (mergeObject < 0) {
+		H5Fclose(mergeFile);
+		throw std::runtime_error(std::string("HDF5Output: no CRPROPA3 dataset in file: ") + filename);
+	}
+	// either layout can be merged into either layout
+	bool mergeColumnar = H5Iget_type(mergeObject) == H5I_GROUP;
+
+	// the rows are converted by member name, which requires identical columns
+	bool compatible;
+	std::vector<hid_t> mergeColumns;
+	if (mergeColumnar) {
+		H5G_info_t info;
+		H5Gget_info(mergeObject, &info);
+		compatible = info.nlinks == columns.size();
+		for (size_t i = 0; compatible && i < columns.size(); i++) {
+			compatible = H5Lexists(mergeObject, columns[i].name.c_str(), H5P_DEFAULT) > 0;
+			if (compatible)
+				mergeColumns.push_back(H5Dopen2(mergeObject, columns[i].name.c_str(), H5P_DEFAULT));
+		}
+	} else {
+		hid_t mergeType = H5Dget_type(mergeObject);
+		compatible = H5Tget_nmembers(mergeType) == H5Tget_nmembers(sid);
+		for (int i = 0; compatible && i < H5Tget_nmembers(sid); i++) {
+			char *name = H5Tget_member_name(sid, i);
+			compatible = H5Tget_member_index(mergeType, name) >= 0;
+			H5free_memory(name);
+		}
+		H5Tclose(mergeType);
+	}
+	if (!compatible) {
+		for (size_t i = 0; i < mergeColumns.size(); i++)
+			H5Dclose(mergeColumns[i]);
+		H5Oclose(mergeObject);
+		H5Fclose(mergeFile);
+		throw std::runtime_error(std::string("HDF5Output: incompatible columns in file: ") + filename);
+	}
+
+	hsize_t n = 0;
+	if (not mergeColumnar or not mergeColumns.empty()) {
+		hid_t mergeSpace = H5Dget_space(mergeColumnar ? mergeColumns[0] : mergeObject);
+		n = H5Sget_simple_extent_npoints(mergeSpace);
+		H5Sclose(mergeSpace);
+	}
+
+	herr_t status = 0;
+	std::vector<char> data;
+	for (hsize_t i = 0; (i < n) && (status >= 0); i += BUFFER_SIZE) {
+		hsize_t offset[RANK] = {i};
+		hsize_t cnt[RANK] = {std::min(BUFFER_SIZE, n - i)};
+		hid_t mspace_id = H5Screate_simple(RANK, cnt, NULL);
+		writeBuffer.resize(cnt[0]);
+		if (mergeColumnar) {
+			for (size_t c = 0; (c < columns.size()) && (status >= 0); c++) {
+				hid_t mergeSpace = H5Dget_space(mergeColumns[c]);
+				H5Sselect_hyperslab(mergeSpace, H5S_SELECT_SET, offset, NULL, cnt, NULL);
+				data.resize(cnt[0] * columns[c].size);
+				status = H5Dread(mergeColumns[c], columns[c].type, mspace_id, mergeSpace,
+						H5P_DEFAULT, data.data());
+				H5Sclose(mergeSpace);
+				for (size_t j = 0; (j < cnt[0]) && (status >= 0); j++)
+					memcpy(reinterpret_cast<char*>(&writeBuffer[j]) + columns[c].offset,
+							&data[j * columns[c].size], columns[c].size);
+			}
+		} else {
+			hid_t mergeSpace = H5Dget_space(mergeObject);
+			H5Sselect_hyperslab(mergeSpace, H5S_SELECT_SET, offset, NULL, cnt, NULL);
+			status = H5Dread(mergeObject, sid, mspace_id, mergeSpace, H5P_DEFAULT,
+					writeBuffer.data());
+			H5Sclose(mergeSpace);
+		}
+		H5Sclose(mspace_id);
+		if (status < 0)
+			break;
+		count += cnt[0];
+		writeRows(writeBuffer);
+	}
+	writeBuffer.clear();
+
+	for (size_t i = 0; i < mergeColumns.size(); i++)
+		H5Dclose(mergeColumns[i]);
+	H5Oclose(mergeObject);
+	H5Fclose(mergeFile);
+	if (status < 0)
+		throw std::runtime_error(std::string("HDF5Output: cannot read file: ") + filename);
+}
+
 std::string HDF5Output::getDescription() const  {
 	return "HDF5Output";
 }
 
+size_t HDF5Output::getMemoryUsage() const {
+	size_t bytes = memoryUsage(writeBuffer) + memoryUsage(stateRows) + memoryUsage(threadBuffers);
+	{
+		std::lock_guard<std::mutex> lock(bufferMutex);
+		bytes += memoryUsage(buffer);
+	}
+	for (size_t i = 0; i < columns.size(); i++)
+		bytes += memoryUsage(columns[i].min) + memoryUsage(columns[i].max);
+	bytes += writtenSources.size() * (sizeof(uint64_t) + sizeof(void*)); // nodes of the hash set
+	if (writer)
+		bytes += writer->getMemoryUsage();
+	return bytes;
+}
+
 void HDF5Output::setFlushLimit(unsigned int N)
 {
 	flushLimit = N;
 }
 
+void HDF5Output::setAsync(bool async, size_t capacity) {
+	stopWriter();
+	this->async = async;
+	asyncCapacity = capacity;
+	if (async)
+		startWriter();
+}
+
+bool HDF5Output::isAsync() const {
+	return async;
+}
+
+void HDF5Output::startWriter() {
+	// only the writer thread accesses the file while it is running
+	writer.reset(new AsyncRowWriter<OutputRow>(asyncCapacity,
+			[this](const OutputRow &r) {
+				if (file == -1)
+					open(filename);
+				appendRows(&r, 1);
+			},
+			[this]() {
+				if (file >= 0)
+					flushBuffer();
+			}));
+}
+
+void HDF5Output::stopWriter() {
+	if (!writer)
+		return;
+	writer->stop();
+	if (writer->hasFailed())
+		KISS_LOG_ERROR << "HDF5Output: " << writer->getError();
+	writer.reset();
+}
+
 } // namespace crpropa
 
 #endif // CRPROPA_HAVE_HDF5
@@ -0,0 +1,468 @@
+#include "crpropa/module/HistogramOutput.h"
+#include "crpropa/ParticleID.h"
+#include "crpropa/Random.h"
+#include "crpropa/Units.h"
+
+#include "kiss/logger.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <locale>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace crpropa {
+
+static const char *quantityName(HistogramOutput::Quantity quantity) {
+	switch (quantity) {
+	case HistogramOutput::Energy:
+		return "Energy";
+	case HistogramOutput::SourceEnergy:
+		return "SourceEnergy";
+	case HistogramOutput::CreatedEnergy:
+		return "CreatedEnergy";
+	case HistogramOutput::Id:
+		return "Id";
+	case HistogramOutput::MassNumber:
+		return "MassNumber";
+	case HistogramOutput::ChargeNumber:
+		return "ChargeNumber";
+	case HistogramOutput::Redshift:
+		return "Redshift";
+	case HistogramOutput::TrajectoryLength:
+		return "TrajectoryLength";
+	case HistogramOutput::Direction:
+		return "Direction";
+	}
+	return "";
+}
+
+// scale of the quantity in the saved file, EeV and Mpc as in the other outputs
+static double quantityScale(HistogramOutput::Quantity quantity) {
+	switch (quantity) {
+	case HistogramOutput::Energy:
+	case HistogramOutput::SourceEnergy:
+	case HistogramOutput::CreatedEnergy:
+		return EeV;
+	case HistogramOutput::TrajectoryLength:
+		return Mpc;
+	default:
+		return 1;
+	}
+}
+
+size_t healpixRingPixel(size_t nSide, const Vector3d &direction) {
+	// ang2pix_ring of HEALPix, Gorski et al. 2005
+	double z = direction.z / direction.getR();
+	double phi = std::atan2(direction.y, direction.x);
+	if (phi < 0)
+		phi += 2 * M_PI;
+	double za = std::fabs(z);
+	double tt = phi / (0.5 * M_PI); // in [0, 4)
+	long ns = nSide;
+
+	if (za <= 2. / 3) {
+		// equatorial region
+		double t1 = ns * (0.5 + tt);
+		double t2 = ns * z * 0.75;
+		long jp = long(t1 - t2); // ascending edge line
+		long jm = long(t1 + t2); // descending edge line
+		long ir = ns + 1 + jp - jm; // ring number counted from z = 2/3
+		long kshift = 1 - (ir & 1);
+		long ip = (jp + jm - ns + kshift + 1) / 2;
+		ip = ip % (4 * ns);
+		return 2 * ns * (ns - 1) + (ir - 1) * 4 * ns + ip;
+	}
+
+	// polar caps
+	double tp = tt - long(tt);
+	double tmp = ns * std::sqrt(3 * (1 - za));
+	long jp = long(tp * tmp);
+	long jm = long((1 - tp) * tmp);
+	long ir = jp + jm + 1; // ring number counted from the closest pole
+	long ip = long(tt * ir);
+	ip = ip % (4 * ir);
+	if (z > 0)
+		return 2 * ir * (ir - 1) + ip;
+	return 12 * ns * ns - 2 * ir * (ir + 1) + ip;
+}
+
+HistogramOutput::HistogramOutput() :
+		nStored(0), allocated(new std::once_flag), count(0), eventFraction(1) {
+	updateDescription();
+}
+
+HistogramOutput::HistogramOutput(const std::string &filename) :
+		nStored(0), allocated(new std::once_flag), count(0), filename(filename),
+		eventFraction(1) {
+	updateDescription();
+}
+
+HistogramOutput::~HistogramOutput() {
+	if (filename.empty())
+		return;
+	try {
+		save(filename);
+	} catch (std::exception &e) {
+		KISS_LOG_ERROR << e.what();
+	}
+}
+
+void HistogramOutput::allocate() const {
+	size_t nThreads = 1;
+#ifdef _OPENMP
+	nThreads = omp_in_parallel() ? omp_get_num_threads() : omp_get_max_threads();
+#endif
+	threadStorage.assign(nThreads + 1, std::vector<double>(2 * nStored, 0.));
+	std::lock_guard<std::mutex> lock(totalMutex);
+	total.assign(2 * nStored, 0.);
+}
+
+void HistogramOutput::process(Candidate *candidate) const {
+	std::call_once(*allocated, &HistogramOutput::allocate, this);
+
+	size_t i = 0;
+#ifdef _OPENMP
+	i = omp_get_thread_num();
+#endif
+	if (i + 1 < threadStorage.size()) {
+		fill(threadStorage[i], candidate);
+	} else {
+		// more threads than at the first candidate
+		std::lock_guard<std::mutex> lock(sharedMutex);
+		fill(threadStorage.back(), candidate);
+	}
+
+#pragma omp atomic
+	count++;
+
+	if (eventOutput.valid() and ((eventFraction >= 1) or (Random::instance().rand() < eventFraction)))
+		eventOutput->process(candidate);
+}
+
+void HistogramOutput::fill(std::vector<double> &storage, const Candidate *candidate) const {
+	double w = candidate->getWeight();
+	for (size_t h = 0; h < histograms.size(); h++) {
+		long bin = getBin(h, candidate);
+		if (bin < 0)
+			continue;
+		size_t j = 2 * (histograms[h].offset + bin);
+		storage[j] += w;
+		storage[j + 1] += w * w;
+	}
+}
+
+long HistogramOutput::getBin(size_t histogram, const Candidate *candidate) const {
+	const Histogram &hist = histograms[histogram];
+	if (hist.axes.empty())
+		return -1;
+	const ParticleState &current = candidate->current;
+	long bin = 0;
+	for (size_t a = 0; a < hist.axes.size(); a++) {
+		const Axis &axis = hist.axes[a];
+		long k = -1;
+		double v = 0;
+		switch (axis.quantity) {
+		case Direction:
+			k = healpixRingPixel(axis.nSide, current.getDirection() * -1.);
+			break;
+		case Id:
+			k = std::find(axis.edges.begin(), axis.edges.end(), double(current.getId())) - axis.edges.begin();
+			if (k == long(axis.nBins))
+				return -1;
+			break;
+		case Energy:
+			v = current.getEnergy();
+			break;
+		case SourceEnergy:
+			v = candidate->source.getEnergy();
+			break;
+		case CreatedEnergy:
+			v = candidate->created.getEnergy();
+			break;
+		case MassNumber:
+			v = massNumber(current.getId());
+			break;
+		case ChargeNumber:
+			v = chargeNumber(current.getId());
+			break;
+		case Redshift:
+			v = candidate->getRedshift();
+			break;
+		case TrajectoryLength:
+			v = candidate->getTrajectoryLength();
+			break;
+		}
+
+		if ((axis.quantity != Direction) and (axis.quantity != Id)) {
+			if (axis.uniform) {
+				// direct index of the equidistant bins
+				if (axis.logarithmic) {
+					if (not (v > 0))
+						return -1;
+					v = std::log(v);
+				}
+				double f = (v - axis.lower) / (axis.upper - axis.lower) * axis.nBins;
+				if (not (f >= 0) or (f >= axis.nBins))
+					return -1;
+				k = long(f);
+			} else {
+				k = std::upper_bound(axis.edges.begin(), axis.edges.end(), v) - axis.edges.begin() - 1;
+				if ((k < 0) or (k >= long(axis.nBins)))
+					return -1;
+			}
+		}
+		bin = bin * axis.nBins + k;
+	}
+	return bin;
+}
+
+void HistogramOutput::reduce() const {
+	std::lock_guard<std::mutex> lock(totalMutex);
+	if (total.empty())
+		return;
+	for (size_t i = 0; i < threadStorage.size(); i++) {
+		bool shared = (i + 1 == threadStorage.size());
+#ifdef _OPENMP
+		// the storage of the other threads is in use
+		if (not shared and omp_in_parallel() and (i != size_t(omp_get_thread_num())))
+			continue;
+#endif
+		std::unique_lock<std::mutex> sharedLock(sharedMutex, std::defer_lock);
+		if (shared)
+			sharedLock.lock();
+		std::vector<double> &storage = threadStorage[i];
+		for (size_t j = 0; j < storage.size(); j++) {
+			total[j] += storage[j];
+			storage[j] = 0;
+		}
+	}
+}
+
+void HistogramOutput::checkHistogram(size_t histogram) const {
+	if (histogram >= histograms.size())
+		throw std::runtime_error("HistogramOutput: no histogram " + std::to_string(histogram));
+}
+
+void HistogramOutput::checkNotFilled() const {
+	std::lock_guard<std::mutex> lock(totalMutex);
+	if (not total.empty())
+		throw std::runtime_error("HistogramOutput: histograms cannot be changed after the first candidate");
+}
+
+size_t HistogramOutput::addHistogram(const std::string &name) {
+	checkNotFilled();
+	Histogram hist;
+	hist.name = name;
+	hist.nBins = 0;
+	hist.offset = nStored;
+	histograms.push_back(hist);
+	updateDescription();
+	return histograms.size() - 1;
+}
+
+void HistogramOutput::addAxis(size_t histogram, const Axis &axis) {
+	checkNotFilled();
+	checkHistogram(histogram);
+	// the bins of the later histograms move
+	Histogram &hist = histograms[histogram];
+	size_t nBins = hist.axes.empty() ? axis.nBins : hist.nBins * axis.nBins;
+	hist.axes.push_back(axis);
+	hist.nBins = nBins;
+	nStored = 0;
+	for (size_t h = 0; h < histograms.size(); h++) {
+		histograms[h].offset = nStored;
+		nStored += histograms[h].nBins;
+	}
+	updateDescription();
+}
+
+void HistogramOutput::addAxis(size_t histogram, Quantity quantity, size_t nBins,
+		double lower, double upper, bool logarithmic) {
+	if ((quantity == Direction) or (quantity == Id))
+		throw std::runtime_error("HistogramOutput: use addDirectionAxis or addIdAxis");
+	if ((nBins == 0) or not (upper > lower))
+		throw std::runtime_error("HistogramOutput: an axis needs bins and upper > lower");
+	if (logarithmic and not (lower > 0))
+		throw std::runtime_error("HistogramOutput: a logarithmic axis needs lower > 0");
+	Axis axis;
+	axis.quantity = quantity;
+	axis.nBins = nBins;
+	axis.uniform = true;
+	axis.logarithmic = logarithmic;
+	axis.lower = logarithmic ? std::log(lower) : lower;
+	axis.upper = logarithmic ? std::log(upper) : upper;
+	axis.nSide = 0;
+	for (size_t i = 0; i <= nBins; i++) {
+		double edge = axis.lower + (axis.upper - axis.lower) * i / nBins;
+		axis.edges.push_back(logarithmic ? std::exp(edge) : edge);
+	}
+	addAxis(histogram, axis);
+}
+
+void HistogramOutput::addAxis(size_t histogram, Quantity quantity, const std::vector<double> &edges) {
+	if ((quantity == Direction) or (quantity == Id))
+		throw std::runtime_error("HistogramOutput: use addDirectionAxis or addIdAxis");
+	if (edges.size() < 2)
+		throw std::runtime_error("HistogramOutput: an axis needs at least two edges");
+	for (size_t i = 1; i < edges.size(); i++)
+		if (not (edges[i] > edges[i - 1]))
+			throw std::runtime_error("HistogramOutput: the edges must be increasing");
+	Axis axis;
+	axis.quantity = quantity;
+	axis.edges = edges;
+	axis.nBins = edges.size() - 1;
+	axis.uniform = false;
+	axis.logarithmic = false;
+	axis.lower = edges.front();
+	axis.upper = edges.back();
+	axis.nSide = 0;
+	addAxis(histogram, axis);
+}
+
+void HistogramOutput::addIdAxis(size_t histogram, const std::vector<int> &ids) {
+	if (ids.empty())
+		throw std::runtime_error("HistogramOutput: an Id axis needs ids");
+	Axis axis;
+	axis.quantity = Id;
+	axis.edges.assign(ids.begin(), ids.end());
+	axis.nBins = ids.size();
+	axis.uniform = false;
+	axis.logarithmic = false;
+	axis.lower = 0;
+	axis.upper = 0;
+	axis.nSide = 0;
+	addAxis(histogram, axis);
+}
+
+void HistogramOutput::addDirectionAxis(size_t histogram, size_t nSide) {
+	if (nSide == 0)
+		throw std::runtime_error("HistogramOutput: a Direction axis needs nSide > 0");
+	Axis axis;
+	axis.quantity = Direction;
+	axis.nBins = 12 * nSide * nSide;
+	axis.uniform = false;
+	axis.logarithmic = false;
+	axis.lower = 0;
+	axis.upper = 0;
+	axis.nSide = nSide;
+	addAxis(histogram, axis);
+}
+
+void HistogramOutput::setEventOutput(Module *output, double fraction) {
+	eventOutput = output;
+	eventFraction = fraction;
+	updateDescription();
+}
+
+size_t HistogramOutput::getNumberOfHistograms() const {
+	return histograms.size();
+}
+
+size_t HistogramOutput::getNumberOfAxes(size_t histogram) const {
+	checkHistogram(histogram);
+	return histograms[histogram].axes.size();
+}
+
+size_t HistogramOutput::getNumberOfBins(size_t histogram) const {
+	checkHistogram(histogram);
+	return histograms[histogram].nBins;
+}
+
+std::vector<double> HistogramOutput::getWeights(size_t histogram) const {
+	checkHistogram(histogram);
+	reduce();
+	const Histogram &hist = histograms[histogram];
+	std::vector<double> weights(hist.nBins, 0.);
+	std::lock_guard<std::mutex> lock(totalMutex);
+	if (not total.empty())
+		for (size_t i = 0; i < hist.nBins; i++)
+			weights[i] = total[2 * (hist.offset + i)];
+	return weights;
+}
+
+std::vector<double> HistogramOutput::getSquaredWeights(size_t histogram) const {
+	checkHistogram(histogram);
+	reduce();
+	const Histogram &hist = histograms[histogram];
+	std::vector<double> weights(hist.nBins, 0.);
+	std::lock_guard<std::mutex> lock(totalMutex);
+	if (not total.empty())
+		for (size_t i = 0; i < hist.nBins; i++)
+			weights[i] = total[2 * (hist.offset + i) + 1];
+	return weights;
+}
+
+size_t HistogramOutput::size() const {
+	return count;
+}
+
+void HistogramOutput::clear() {
+	std::lock_guard<std::mutex> lock(totalMutex);
+	std::fill(total.begin(), total.end(), 0.);
+	for (size_t i = 0; i < threadStorage.size(); i++)
+		std::fill(threadStorage[i].begin(), threadStorage[i].end(), 0.);
+	count = 0;
+}
+
+void HistogramOutput::save(const std::string &filename) const {
+	reduce();
+	std::ofstream out(filename.c_str());
+	if (!out)
+		throw std::runtime_error("HistogramOutput: could not write " + filename);
+	out.imbue(std::locale::classic());
+	out.precision(8);
+	out << "# CRPropa histogram output of " << count << " candidates\n";
+	out << "# energies in EeV, lengths in Mpc\n";
+
+	std::lock_guard<std::mutex> lock(totalMutex);
+	for (size_t h = 0; h < histograms.size(); h++) {
+		const Histogram &hist = histograms[h];
+		out << "# histogram " << hist.name << " " << hist.nBins << "\n";
+		for (size_t a = 0; a < hist.axes.size(); a++) {
+			const Axis &axis = hist.axes[a];
+			out << "# axis " << quantityName(axis.quantity);
+			if (axis.quantity == Direction) {
+				out << " nside " << axis.nSide;
+			} else if (axis.quantity == Id) {
+				out << " ids";
+				for (size_t i = 0; i < axis.edges.size(); i++)
+					out << " " << int(axis.edges[i]);
+			} else {
+				out << " edges";
+				double scale = quantityScale(axis.quantity);
+				for (size_t i = 0; i < axis.edges.size(); i++)
+					out << " " << axis.edges[i] / scale;
+			}
+			out << "\n";
+		}
+		// only the non-empty bins
+		out << "# bin\tweight\tweight^2\n";
+		for (size_t i = 0; (i < hist.nBins) and not total.empty(); i++) {
+			size_t j = 2 * (hist.offset + i);
+			if (total[j] == 0 and total[j + 1] == 0)
+				continue;
+			out << i << "\t" << total[j] << "\t" << total[j + 1] << "\n";
+		}
+	}
+	if (!out)
+		throw std::runtime_error("HistogramOutput: could not write " + filename);
+}
+
+void HistogramOutput::updateDescription() {
+	std::stringstream ss;
+	ss << "HistogramOutput: " << histograms.size() << " histograms of " << nStored << " bins";
+	if (not filename.empty())
+		ss << ", saved to " << filename;
+	if (eventOutput.valid())
+		ss << ", passing a fraction " << eventFraction << " of the candidates to\n  " << eventOutput->getDescription();
+	ss << "\n";
+	setDescription(ss.str());
+}
+
+} // namespace crpropa
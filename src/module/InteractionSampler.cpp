@@ -0,0 +1,181 @@
+#include "crpropa/module/InteractionSampler.h"
+#include "crpropa/Random.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+namespace crpropa {
+
+InteractionSampler::InteractionSampler(double limit) : limit(limit), eventDriven(false) {
+}
+
+void InteractionSampler::add(Module *module) {
+	if (module->hasInteractionRate()) {
+		interactions.push_back(module);
+		interactionClasses.push_back(module->getParticleClasses());
+	} else {
+		continuous.push_back(module);
+	}
+}
+
+void InteractionSampler::setLimit(double limit) {
+	this->limit = limit;
+}
+
+double InteractionSampler::getLimit() const {
+	return limit;
+}
+
+void InteractionSampler::setEventDriven(bool b) {
+	eventDriven = b;
+}
+
+bool InteractionSampler::isEventDriven() const {
+	return eventDriven;
+}
+
+size_t InteractionSampler::getNumberOfInteractions() const {
+	return interactions.size();
+}
+
+void InteractionSampler::prepare() {
+	std::vector<Module *> modules(interactions.begin(), interactions.end());
+	modules.insert(modules.end(), continuous.begin(), continuous.end());
+	prepareModules(modules);
+}
+
+double InteractionSampler::rate(size_t i, const Candidate *candidate, unsigned int particleClass) const {
+	if ((interactionClasses[i] & particleClass) == 0)
+		return 0;
+	return interactions[i]->getInteractionRate(candidate);
+}
+
+void InteractionSampler::process(Candidate *candidate) const {
+	for (size_t i = 0; i < continuous.size(); i++)
+		continuous[i]->process(candidate);
+
+	if (eventDriven and candidate->current.getCharge() == 0) {
+		processEvents(candidate);
+		return;
+	}
+
+	Random &random = Random::instance();
+	double step = candidate->getCurrentStep();
+	// the loop is processed at least once for limiting the next step
+	do {
+		unsigned int cls = particleClass(candidate->current.getId());
+		double totalRate = 0;
+		for (size_t i = 0; i < interactions.size(); i++)
+			totalRate += rate(i, candidate, cls);
+		if (totalRate <= 0)
+			return;
+
+		// check if any interaction happens in this step
+		double randDistance = -log(random.rand()) / totalRate;
+		if (step < randDistance) {
+			candidate->limitNextStep(limit / totalRate);
+			return;
+		}
+
+		interact(candidate, cls, totalRate);
+		if (not candidate->isActive())
+			return;
+
+		// repeat with remaining step
+		step -= randDistance;
+	} while (step > 0);
+}
+
+double InteractionSampler::getTotalRate(const Candidate *candidate) const {
+	unsigned int cls = particleClass(candidate->current.getId());
+	double totalRate = 0;
+	for (size_t i = 0; i < interactions.size(); i++)
+		totalRate += rate(i, candidate, cls);
+	return totalRate;
+}
+
+void InteractionSampler::performInteraction(Candidate *candidate, double totalRate) const {
+	interact(candidate, particleClass(candidate->current.getId()), totalRate);
+}
+
+void InteractionSampler::interact(Candidate *candidate, unsigned int cls, double totalRate) const {
+	// select the interacting module by its share of the total rate
+	double cmp = Random::instance().rand() * totalRate;
+	size_t i = 0;
+	for (; i + 1 < interactions.size(); i++) {
+		double r = rate(i, candidate, cls);
+		if (cmp < r)
+			break;
+		cmp -= r;
+	}
+	// skip trailing modules without interaction due to rounding
+	while (rate(i, candidate, cls) == 0)
+		i--;
+	interactions[i]->performStochasticInteraction(candidate);
+}
+
+void InteractionSampler::processEvents(Candidate *candidate) const {
+	static const Candidate::PropertyKey depthKey = Candidate::getPropertyKey("InteractionSampler.opticalDepth");
+	double step = candidate->getCurrentStep();
+	while (true) {
+		unsigned int cls = particleClass(candidate->current.getId());
+		double totalRate = 0;
+		for (size_t i = 0; i < interactions.size(); i++)
+			totalRate += rate(i, candidate, cls);
+		if (totalRate <= 0)
+			return;
+		if (candidate->current.getCharge() != 0) {
+			// charged after an interaction, rates change with the continuous losses
+			candidate->limitNextStep(limit / totalRate);
+			return;
+		}
+
+		// remaining optical depth to the next interaction
+		double depth;
+		if (candidate->hasProperty(depthKey))
+			depth = candidate->getProperty(depthKey).asDouble();
+		else
+			depth = -log(Random::instance().rand());
+
+		// (almost) reaching the interaction, as the step was limited to it
+		if (step * totalRate < depth * (1 - 1e-9)) {
+			depth -= step * totalRate;
+			candidate->setProperty(depthKey, Variant::fromDouble(depth));
+			candidate->limitNextStep(depth / totalRate);
+			return;
+		}
+
+		candidate->removeProperty(depthKey);
+		interact(candidate, cls, totalRate);
+		if (not candidate->isActive())
+			return;
+
+		// continue with remaining step
+		step = std::max(0., step - depth / totalRate);
+	}
+}
+
+unsigned int InteractionSampler::getParticleClasses() const {
+	unsigned int classes = 0;
+	for (size_t i = 0; i < interactions.size(); i++)
+		classes |= interactionClasses[i];
+	for (size_t i = 0; i < continuous.size(); i++)
+		classes |= continuous[i]->getParticleClasses();
+	return classes;
+}
+
+std::string InteractionSampler::getDescription() const {
+	std::stringstream s;
+	s << "InteractionSampler: " << interactions.size() << " interactions, "
+			<< continuous.size() << " continuous, limit " << limit;
+	if (eventDriven)
+		s << ", event-driven for neutral particles";
+	for (size_t i = 0; i < continuous.size(); i++)
+		s << "\n    " << continuous[i]->getDescription();
+	for (size_t i = 0; i < interactions.size(); i++)
+		s << "\n    " << interactions[i]->getDescription();
+	return s.str();
+}
+
+} // namespace crpropa
@@ -0,0 +1,428 @@
+#include "crpropa/module/NetworkOutput.h"
+#include "crpropa/Units.h"
+#include "crpropa/RunMetrics.h"
+
+#include "kiss/logger.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace crpropa {
+
+// quantities of the columns
+enum NetworkQuantity {
+	ND, Nz, NSN, NID, NE, NX, NY, NZ, NPx, NPy, NPz,
+	NSN0, NID0, NE0, NX0, NY0, NZ0, NP0x, NP0y, NP0z,
+	NSN1, NID1, NE1, NX1, NY1, NZ1, NP1x, NP1y, NP1z,
+	NW, NProperty
+};
+
+static const char networkMagic[8] = "CRPNET1";
+
+// numpy type string of a property column
+static std::string numpyType(Variant::Type type, size_t size) {
+	switch (type) {
+	case Variant::TYPE_BOOL:
+		return "?";
+	case Variant::TYPE_CHAR:
+		return "i1";
+	case Variant::TYPE_UCHAR:
+		return "u1";
+	case Variant::TYPE_INT16:
+		return "<i2";
+	case Variant::TYPE_UINT16:
+		return "<u2";
+	case Variant::TYPE_INT32:
+		return "<i4";
+	case Variant::TYPE_UINT32:
+		return "<u4";
+	case Variant::TYPE_INT64:
+		return "<i8";
+	case Variant::TYPE_UINT64:
+		return "<u8";
+	case Variant::TYPE_FLOAT:
+		return "<f4";
+	case Variant::TYPE_DOUBLE:
+		return "<f8";
+	case Variant::TYPE_STRING: {
+		std::stringstream s;
+		s << "S" << size;
+		return s.str();
+	}
+	default:
+		throw std::runtime_error("NetworkOutput: no record type for Variant type "
+				+ std::string(Variant::getTypeName(type)));
+	}
+}
+
+NetworkOutput::NetworkOutput(const std::string &host, int port) :
+		Output(), host(host), port(port), connection(-1), batchSize(1024),
+		queueCapacity(64), policy(Drop), recordSize(0), started(new std::once_flag),
+		dropped(0) {
+}
+
+NetworkOutput::NetworkOutput(const std::string &host, int port, OutputType outputtype) :
+		Output(outputtype), host(host), port(port), connection(-1), batchSize(1024),
+		queueCapacity(64), policy(Drop), recordSize(0), started(new std::once_flag),
+		dropped(0) {
+}
+
+NetworkOutput::~NetworkOutput() {
+	close();
+}
+
+void NetworkOutput::compileColumns() const {
+	columns.clear();
+	std::stringstream s;
+	size_t offset = 0;
+	auto add = [&](const char *name, NetworkQuantity quantity, const char *type, size_t size) {
+		Column c = {quantity, 0, offset};
+		columns.push_back(c);
+		s << name << "\t" << type << "\n";
+		offset += size;
+	};
+	auto addVector = [&](const char *x, const char *y, const char *z, NetworkQuantity qx) {
+		add(x, qx, "<f8", 8);
+		add(y, NetworkQuantity(qx + 1), "<f8", 8);
+		add(z, NetworkQuantity(qx + 2), "<f8", 8);
+	};
+
+	// the columns and names of HDF5Output
+	if (fields.test(TrajectoryLengthColumn))
+		add("D", ND, "<f8", 8);
+	if (fields.test(RedshiftColumn))
+		add("z", Nz, "<f8", 8);
+	if (fields.test(SerialNumberColumn))
+		add("SN", NSN, "<u8", 8);
+	if (fields.test(CurrentIdColumn))
+		add("ID", NID, "<i4", 4);
+	if (fields.test(CurrentEnergyColumn))
+		add("E", NE, "<f8", 8);
+	if (fields.test(CurrentPositionColumn) && oneDimensional)
+		add("X", NX, "<f8", 8);
+	if (fields.test(CurrentPositionColumn) && not oneDimensional)
+		addVector("X", "Y", "Z", NX);
+	if (fields.test(CurrentDirectionColumn) && not oneDimensional)
+		addVector("Px", "Py", "Pz", NPx);
+	if (fields.test(SerialNumberColumn))
+		add("SN0", NSN0, "<u8", 8);
+	if (fields.test(SourceIdColumn))
+		add("ID0", NID0, "<i4", 4);
+	if (fields.test(SourceEnergyColumn))
+		add("E0", NE0, "<f8", 8);
+	if (fields.test(SourcePositionColumn) && oneDimensional)
+		add("X0", NX0, "<f8", 8);
+	if (fields.test(SourcePositionColumn) && not oneDimensional)
+		addVector("X0", "Y0", "Z0", NX0);
+	if (fields.test(SourceDirectionColumn) && not oneDimensional)
+		addVector("P0x", "P0y", "P0z", NP0x);
+	if (fields.test(SerialNumberColumn))
+		add("SN1", NSN1, "<u8", 8);
+	if (fields.test(CreatedIdColumn))
+		add("ID1", NID1, "<i4", 4);
+	if (fields.test(CreatedEnergyColumn))
+		add("E1", NE1, "<f8", 8);
+	if (fields.test(CreatedPositionColumn) && oneDimensional)
+		add("X1", NX1, "<f8", 8);
+	if (fields.test(CreatedPositionColumn) && not oneDimensional)
+		addVector("X1", "Y1", "Z1", NX1);
+	if (fields.test(CreatedDirectionColumn) && not oneDimensional)
+		addVector("P1x", "P1y", "P1z", NP1x);
+	if (fields.test(WeightColumn))
+		add("weight", NW, "<f8", 8);
+
+	// the property columns in the layout of Output
+	for (size_t i = 0; i < properties.size(); i++) {
+		Column c = {NProperty, i, offset + properties[i].offset};
+		columns.push_back(c);
+		s << properties[i].name << "\t" << numpyType(properties[i].type, properties[i].size) << "\n";
+	}
+	recordSize = offset + getPropertyRowSize();
+	schema = s.str();
+}
+
+void NetworkOutput::writeRecord(const Candidate *c, unsigned char *record) const {
+	const ParticleState *state[3] = {&c->current, &c->source, &c->created};
+	for (size_t i = 0; i < columns.size(); i++) {
+		const Column &column = columns[i];
+		unsigned char *p = record + column.offset;
+		if (column.quantity == NProperty) {
+			// the property columns start at the offset of the first
+			const Property &property = properties[column.property];
+			writeProperty(c, property, p - property.offset);
+			continue;
+		}
+
+		double value;
+		if (column.quantity == ND)
+			value = c->getTrajectoryLength() / lengthScale;
+		else if (column.quantity == Nz)
+			value = c->getRedshift();
+		else if (column.quantity == NW)
+			value = c->getWeight();
+		else {
+			// the three blocks of the current, source and created state
+			int q = column.quantity - NSN;
+			int block = q / (NSN0 - NSN);
+			const ParticleState &s = *state[block];
+			switch (q % (NSN0 - NSN)) {
+			case 0: {
+				uint64_t sn = (block == 0) ? c->getSerialNumber() :
+						((block == 1) ? c->getSourceSerialNumber() : c->getCreatedSerialNumber());
+				std::memcpy(p, &sn, sizeof(sn));
+				continue;
+			}
+			case 1: {
+				int32_t id = s.getId();
+				std::memcpy(p, &id, sizeof(id));
+				continue;
+			}
+			case 2:
+				value = s.getEnergy() / energyScale;
+				break;
+			case 3:
+				value = s.getPosition().x / lengthScale;
+				break;
+			case 4:
+				value = s.getPosition().y / lengthScale;
+				break;
+			case 5:
+				value = s.getPosition().z / lengthScale;
+				break;
+			case 6:
+				value = s.getDirection().x;
+				break;
+			case 7:
+				value = s.getDirection().y;
+				break;
+			default:
+				value = s.getDirection().z;
+			}
+		}
+		std::memcpy(p, &value, sizeof(value));
+	}
+}
+
+void NetworkOutput::start() const {
+	compileColumns();
+	size_t nThreads = 1;
+#ifdef _OPENMP
+	nThreads = omp_in_parallel() ? omp_get_num_threads() : omp_get_max_threads();
+#endif
+	batches.assign(nThreads + 1, std::string());
+
+	// the sender connects at the first batch, such that a missing server
+	// does not delay the simulation
+	NetworkOutput *self = const_cast<NetworkOutput*>(this);
+	writer.reset(new AsyncRowWriter<std::string>(queueCapacity,
+			[self](const std::string &batch) {
+				if (self->connection < 0)
+					self->connect();
+				self->send(batch);
+			},
+			[]() {}));
+}
+
+void NetworkOutput::process(Candidate *candidate) const {
+	std::call_once(*started, &NetworkOutput::start, this);
+	if (not passesFilter(candidate))
+		return;
+
+	unsigned char buffer[512];
+	std::vector<unsigned char> large;
+	unsigned char *record = buffer;
+	if (recordSize > sizeof(buffer)) {
+		large.resize(recordSize);
+		record = large.data();
+	}
+	writeRecord(candidate, record);
+
+#pragma omp atomic
+	count++;
+	RunMetrics::countOutputBytes(recordSize);
+
+	size_t i = 0;
+#ifdef _OPENMP
+	i = omp_get_thread_num();
+#endif
+	if (i + 1 < batches.size()) {
+		append(batches[i], record);
+	} else {
+		// more threads than at the first candidate
+		std::lock_guard<std::mutex> lock(sharedMutex);
+		append(batches.back(), record);
+	}
+}
+
+void NetworkOutput::append(std::string &batch, const unsigned char *record) const {
+	if (batch.empty()) {
+		batch.reserve(sizeof(uint32_t) + batchSize * recordSize);
+		batch.append(sizeof(uint32_t), '\0'); // number of records
+	}
+	batch.append((const char *) record, recordSize);
+	if (batch.size() >= sizeof(uint32_t) + batchSize * recordSize)
+		queue(batch);
+}
+
+void NetworkOutput::queue(std::string &batch) const {
+	if (batch.empty())
+		return;
+	uint32_t n = (batch.size() - sizeof(uint32_t)) / std::max<size_t>(recordSize, 1);
+	std::memcpy(&batch[0], &n, sizeof(n));
+	if (policy == Block)
+		writer->push(batch);
+	else if (not writer->tryPush(batch))
+		dropped += n;
+	batch.clear();
+}
+
+void NetworkOutput::flush() const {
+	if (not writer)
+		return;
+#ifdef _OPENMP
+	if (omp_in_parallel()) {
+		size_t i = omp_get_thread_num();
+		if (i + 1 < batches.size())
+			queue(batches[i]);
+		return;
+	}
+#endif
+	{
+		std::lock_guard<std::mutex> lock(sharedMutex);
+		for (size_t i = 0; i < batches.size(); i++)
+			queue(batches[i]);
+	}
+	if (not writer->hasFailed())
+		writer->sync();
+}
+
+void NetworkOutput::close() {
+	if (not writer)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(sharedMutex);
+		for (size_t i = 0; i < batches.size(); i++)
+			queue(batches[i]);
+	}
+	writer->stop();
+	if (writer->hasFailed())
+		KISS_LOG_ERROR << "NetworkOutput: " << writer->getError();
+	writer.reset();
+	disconnect();
+	if (dropped > 0)
+		KISS_LOG_WARNING << "NetworkOutput: " << dropped << " records were dropped";
+	started.reset(new std::once_flag);
+}
+
+void NetworkOutput::connect() {
+	struct addrinfo hints, *addresses;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	std::stringstream service;
+	service << port;
+	int status = getaddrinfo(host.c_str(), service.str().c_str(), &hints, &addresses);
+	if (status != 0)
+		throw std::runtime_error("cannot resolve " + host + ": " + gai_strerror(status));
+
+	for (struct addrinfo *a = addresses; a != NULL; a = a->ai_next) {
+		connection = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (connection < 0)
+			continue;
+		if (::connect(connection, a->ai_addr, a->ai_addrlen) == 0)
+			break;
+		::close(connection);
+		connection = -1;
+	}
+	freeaddrinfo(addresses);
+	if (connection < 0)
+		throw std::runtime_error("cannot connect to " + host + ":" + service.str());
+#ifdef SO_NOSIGPIPE
+	int on = 1;
+	setsockopt(connection, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+	std::string header(networkMagic, sizeof(networkMagic));
+	uint32_t sizes[2] = {uint32_t(recordSize), uint32_t(schema.size())};
+	header.append((const char *) sizes, sizeof(sizes));
+	header += schema;
+	send(header);
+}
+
+void NetworkOutput::send(const std::string &data) {
+	int flags = 0;
+#ifdef MSG_NOSIGNAL
+	flags = MSG_NOSIGNAL;
+#endif
+	size_t sent = 0;
+	while (sent < data.size()) {
+		ssize_t n = ::send(connection, data.data() + sent, data.size() - sent, flags);
+		if (n < 0)
+			throw std::runtime_error("connection to " + host + " lost: " + std::strerror(errno));
+		sent += n;
+	}
+}
+
+void NetworkOutput::disconnect() {
+	if (connection >= 0)
+		::close(connection);
+	connection = -1;
+}
+
+void NetworkOutput::setBatchSize(size_t records) {
+	modify();
+	if (records == 0)
+		throw std::runtime_error("NetworkOutput: the batch size has to be positive");
+	batchSize = records;
+}
+
+size_t NetworkOutput::getBatchSize() const {
+	return batchSize;
+}
+
+void NetworkOutput::setQueueCapacity(size_t batches) {
+	modify();
+	queueCapacity = batches;
+}
+
+size_t NetworkOutput::getQueueCapacity() const {
+	return queueCapacity;
+}
+
+void NetworkOutput::setPolicy(Policy policy) {
+	modify();
+	this->policy = policy;
+}
+
+NetworkOutput::Policy NetworkOutput::getPolicy() const {
+	return policy;
+}
+
+size_t NetworkOutput::getDropped() const {
+	return dropped;
+}
+
+size_t NetworkOutput::getRecordSize() const {
+	if (not writer)
+		compileColumns();
+	return recordSize;
+}
+
+std::string NetworkOutput::getDescription() const {
+	std::stringstream s;
+	s << "NetworkOutput: " << host << ":" << port;
+	return s.str();
+}
+
+} // namespace crpropa
@@ -1,8 +1,10 @@
 #include "crpropa/module/NuclearDecay.h"
 #include "crpropa/Units.h"
+#include "crpropa/Common.h"
 #include "crpropa/ParticleID.h"
 #include "crpropa/ParticleMass.h"
 #include "crpropa/Random.h"
+#include "crpropa/Trace.h"
 
 #include <fstream>
 #include <limits>
@@ -19,37 +21,79 @@ NuclearDecay::NuclearDecay(bool electrons, bool photons, bool neutrinos, double
 	haveNeutrinos = neutrinos;
 	limit = l;
 	setDescription("NuclearDecay");
+	prepared.reset(new std::once_flag);
+}
 
-	// load decay table
+void NuclearDecay::loadTables() {
+	CRPROPA_TRACE_SPAN("NuclearDecay::loadTables", "tables");
 	std::string filename = getDataPath("nuclear_decay.txt");
 	std::ifstream infile(filename.c_str());
 	if (!infile.good())
 		throw std::runtime_error(
 				"crpropa::NuclearDecay: could not open file " + filename);
 
-	decayTable.resize(27 * 31);
+	// collect the decay modes per nucleus
+	struct Mode {
+		int channel;
+		double rate;
+		std::vector<double> gamma;
+	};
+	std::vector<std::vector<Mode> > modes(27 * 31);
 	std::string line;
 	while (std::getline(infile,line)) {
 		std::stringstream stream(line);
 		if (stream.peek() == '#')
 			continue;
-		DecayMode decay;
+		Mode decay;
 		int Z, N;
 		double lifetime;
 		stream >> Z >> N >> decay.channel >> lifetime;
+		if (isotopes and not isotopes->contains(Z, N))
+			continue;
 		decay.rate = 1. / lifetime / c_light; // decay rate in [1/m]
-		std::vector<double> gamma;
 		double val;
 		while (stream >> val)
-			gamma.push_back(val);
-		for (int i = 0; i < gamma.size(); i += 2) {
-			decay.energy.push_back(gamma[i] * keV);
-			decay.intensity.push_back(gamma[i+1]);
-		}
+			decay.gamma.push_back(val);
 		if (infile)
-			decayTable[Z * 31 + N].push_back(decay);
+			modes[Z * 31 + N].push_back(decay);
 	}
 	infile.close();
+
+	// flatten into total rates, cumulative channel tables and one gamma pool
+	totalRate.assign(modes.size(), 0);
+	modeOffset.assign(modes.size() + 1, 0);
+	decayModes.clear();
+	gammaEnergy.clear();
+	gammaIntensity.clear();
+	for (size_t i = 0; i < modes.size(); i++) {
+		modeOffset[i] = decayModes.size();
+		for (size_t j = 0; j < modes[i].size(); j++)
+			totalRate[i] += modes[i][j].rate;
+		double cumulativeRate = 0;
+		for (size_t j = 0; j < modes[i].size(); j++) {
+			const Mode &m = modes[i][j];
+			cumulativeRate += m.rate;
+			DecayMode decay;
+			decay.channel = m.channel;
+			decay.cdf = cumulativeRate / totalRate[i];
+			decay.gammaBegin = gammaEnergy.size();
+			for (size_t k = 0; k + 1 < m.gamma.size(); k += 2) {
+				gammaEnergy.push_back(m.gamma[k] * keV);
+				gammaIntensity.push_back(m.gamma[k + 1]);
+			}
+			decay.gammaEnd = gammaEnergy.size();
+			decayModes.push_back(decay);
+		}
+	}
+	modeOffset.back() = decayModes.size();
+}
+
+void NuclearDecay::requireTables() const {
+	std::call_once(*prepared, &NuclearDecay::loadTables, const_cast<NuclearDecay*>(this));
+}
+
+void NuclearDecay::prepare() {
+	requireTables();
 }
 
 void NuclearDecay::setHaveElectrons(bool b) {
@@ -64,14 +108,32 @@ void NuclearDecay::setHaveNeutrinos(bool b) {
 	haveNeutrinos = b;
 }
 
+void NuclearDecay::setIsotopeSelection(ref_ptr<IsotopeSelection> isotopes) {
+	this->isotopes = isotopes;
+	prepared.reset(new std::once_flag);
+}
+
+ref_ptr<IsotopeSelection> NuclearDecay::getIsotopeSelection() const {
+	return isotopes;
+}
+
 void NuclearDecay::setLimit(double l) {
 	limit = l;
 }
 
+unsigned int NuclearDecay::getParticleClasses() const {
+	return NucleusClass;
+}
+
+size_t NuclearDecay::getMemoryUsage() const {
+	return memoryUsage(totalRate) + memoryUsage(modeOffset) + memoryUsage(decayModes)
+			+ memoryUsage(gammaEnergy) + memoryUsage(gammaIntensity);
+}
+
 void NuclearDecay::process(Candidate *candidate) const {
 	// the loop should be processed at least once for limiting the next step
 	double step = candidate->getCurrentStep();
-	double z = candidate->getRedshift();
+	requireTables();
 	do {
 		// check if nucleus
 		int id = candidate->current.getId();
@@ -83,42 +145,66 @@ void NuclearDecay::process(Candidate *candidate) const {
 		int N = A - Z;
 
 		// check if particle can decay
-		const std::vector<DecayMode> &decays = decayTable[Z * 31 + N];
-		if (decays.size() == 0)
+		double rate = totalRate[Z * 31 + N];
+		if (rate == 0)
 			return;
+		// relativistic time dilation, rate per light travel distance -> rate per comoving distance
+		rate /= candidate->getKinematics().localLorentzFactor;
 
-		// find interaction mode with minimum random decay distance
+		// random decay distance
 		Random &random = Random::instance();
-		double randDistance = std::numeric_limits<double>::max();
-		int channel;
-		double totalRate = 0;
-
-		for (size_t i = 0; i < decays.size(); i++) {
-			double rate = decays[i].rate;
-			rate /= candidate->current.getLorentzFactor();  // relativistic time dilation
-			rate /= (1 + z);  // rate per light travel distance -> rate per comoving distance
-			totalRate += rate;
-			double d = -log(random.rand()) / rate;
-			if (d > randDistance)
-				continue;
-			randDistance = d;
-			channel = decays[i].channel;
-		}
+		double randDistance = -log(random.rand()) / rate;
 
 		// check if interaction doesn't happen
 		if (step < randDistance) {
 			// limit next step to a fraction of the mean free path
-			candidate->limitNextStep(limit / totalRate);
+			candidate->limitNextStep(limit / rate);
 			return;
 		}
 
 		// interact and repeat with remaining step
-		performInteraction(candidate, channel);
+		performInteraction(candidate, sampleChannel(Z * 31 + N));
 		step -= randDistance;
 	} while (step > 0);
 }
 
+bool NuclearDecay::hasInteractionRate() const {
+	return true;
+}
+
+double NuclearDecay::getInteractionRate(const Candidate *candidate) const {
+	int id = candidate->current.getId();
+	if (not (isNucleus(id)))
+		return 0;
+
+	requireTables();
+	int A = massNumber(id);
+	int Z = chargeNumber(id);
+
+	// relativistic time dilation, rate per light travel distance -> rate per comoving distance
+	return totalRate[Z * 31 + A - Z] / candidate->getKinematics().localLorentzFactor;
+}
+
+int NuclearDecay::sampleChannel(int index) const {
+	// select the decay mode by its share of the total rate
+	double cmp = Random::instance().rand();
+	size_t i = modeOffset[index];
+	size_t end = modeOffset[index + 1];
+	while ((i + 1 < end) and (cmp >= decayModes[i].cdf))
+		i++;
+	return decayModes[i].channel;
+}
+
+void NuclearDecay::performStochasticInteraction(Candidate *candidate) const {
+	requireTables();
+	int id = candidate->current.getId();
+	int A = massNumber(id);
+	int Z = chargeNumber(id);
+	performInteraction(candidate, sampleChannel(Z * 31 + A - Z));
+}
+
 void NuclearDecay::performInteraction(Candidate *candidate, int channel) const {
+	requireTables();
 	// interpret decay channel
 	int nBetaMinus = digit(channel, 10000);
 	int nBetaPlus = digit(channel, 1000);
@@ -147,30 +233,28 @@ void NuclearDecay::gammaEmission(Candidate *candidate, int channel) const {
 	int N = massNumber(id) - Z;
 
 	// get photon energies and emission probabilities for decay channel
-	const std::vector<DecayMode> &decays = decayTable[Z * 31 + N];
-	size_t idecay = decays.size();
-	while (idecay-- != 0) {
-		if (decays[idecay].channel == channel)
-			break;
-	}
-
-	const std::vector<double> &energy = decays[idecay].energy;
-	const std::vector<double> &intensity = decays[idecay].intensity;
+	size_t index = Z * 31 + N;
+	size_t idecay = modeOffset[index + 1];
+	while ((idecay > modeOffset[index]) and (decayModes[idecay - 1].channel != channel))
+		idecay--;
 
 	// check if photon emission available
-	if (energy.size() == 0)
+	if (idecay == modeOffset[index])
+		return;
+	const DecayMode &decay = decayModes[idecay - 1];
+	if (decay.gammaBegin == decay.gammaEnd)
 		return;
 
 	Random &random = Random::instance();
 	Vector3d pos = random.randomInterpolatedPosition(candidate->previous.getPosition(), candidate->current.getPosition());
 
-	for (int i = 0; i < energy.size(); ++i) {
+	for (size_t i = decay.gammaBegin; i < decay.gammaEnd; ++i) {
 		// check if photon of specific energy is emitted
-		if (random.rand() > intensity[i])
+		if (random.rand() > gammaIntensity[i])
 			continue;
 		// create secondary photon; boost to lab frame
 		double cosTheta = 2 * random.rand() - 1;
-		double E = energy[i] * candidate->current.getLorentzFactor() * (1. - cosTheta);
+		double E = gammaEnergy[i] * candidate->current.getLorentzFactor() * (1. - cosTheta);
 		candidate->addSecondary(22, E, pos);
 	}
 }
@@ -279,6 +363,28 @@ void NuclearDecay::nucleonEmission(Candidate *candidate, int dA, int dZ) const {
 
 }
 
+void NuclearDecay::getDecayChannels(int id, std::vector<int> &channels, std::vector<double> &rates) const {
+	channels.clear();
+	rates.clear();
+	if (not (isNucleus(id)))
+		return;
+	requireTables();
+	int Z = chargeNumber(id);
+	int N = massNumber(id) - Z;
+	if ((Z > 26) or (N > 30))
+		return;
+	size_t index = Z * 31 + N;
+	double rate = totalRate[index];
+	if (rate == 0)
+		return;
+	double cdf = 0;
+	for (size_t i = modeOffset[index]; i < modeOffset[index + 1]; i++) {
+		channels.push_back(decayModes[i].channel);
+		rates.push_back(rate * (decayModes[i].cdf - cdf));
+		cdf = decayModes[i].cdf;
+	}
+}
+
 double NuclearDecay::meanFreePath(int id, double gamma) {
 	if (not (isNucleus(id)))
 		return std::numeric_limits<double>::max();
@@ -288,19 +394,12 @@ double NuclearDecay::meanFreePath(int id, double gamma) {
 	int N = A - Z;
 
 	// check if particle can decay
-	const std::vector<DecayMode> &decays = decayTable[Z * 31 + N];
-	if (decays.size() == 0)
+	requireTables();
+	double rate = totalRate[Z * 31 + N];
+	if (rate == 0)
 		return std::numeric_limits<double>::max();
 
-	double totalRate = 0;
-
-	for (size_t i = 0; i < decays.size(); i++) {
-		double rate = decays[i].rate;
-		rate /= gamma;
-		totalRate += rate;
-	}
-
-	return 1. / totalRate;
+	return gamma / rate;
 }
 
 } // namespace crpropa
@@ -2,11 +2,14 @@
 #include "crpropa/Units.h"
 #include "crpropa/ParticleID.h"
 #include "crpropa/Cosmology.h"
+#include "crpropa/RunMetrics.h"
 
 #include "kiss/logger.h"
 
-#include <iostream>
+#include <algorithm>
 #include <cmath>
+#include <iostream>
+#include <stdexcept>
 
 namespace crpropa {
 
@@ -24,7 +27,16 @@ void Observer::onDetection(Module *action, bool clone_) {
 	clone = clone_;
 }
 
+Module *Observer::getDetectionAction() const {
+	return detectionAction;
+}
+
 void Observer::process(Candidate *candidate) const {
+	if (checkDetection(candidate) == DETECTED)
+		detect(candidate);
+}
+
+DetectionState Observer::checkDetection(Candidate *candidate) const {
 	// loop over all features and have them check the particle
 	DetectionState state = NOTHING;
 	for (int i = 0; i < features.size(); i++) {
@@ -34,25 +46,27 @@ void Observer::process(Candidate *candidate) const {
 		else if ((s == DETECTED) && (state != VETO))
 			state = DETECTED;
 	}
+	return state;
+}
 
-	if (state == DETECTED) {
-		for (int i = 0; i < features.size(); i++) {
-			features[i]->onDetection(candidate);
-		}
+void Observer::detect(Candidate *candidate) const {
+	RunMetrics::countDetection();
+	for (int i = 0; i < features.size(); i++) {
+		features[i]->onDetection(candidate);
+	}
 
-		if (detectionAction.valid()) {
-			if (clone)
-				detectionAction->process(candidate->clone(false));
-			else
-				detectionAction->process(candidate);
-		}
+	if (detectionAction.valid()) {
+		if (clone)
+			detectionAction->process(candidate->clone(false));
+		else
+			detectionAction->process(candidate);
+	}
 
-		if (!flagKey.empty())
-			candidate->setProperty(flagKey, flagValue);
+	if (!flagKey.empty())
+		candidate->setProperty(flagKey, flagValue);
 
-		if (makeInactive)
-			candidate->setActive(false);
-	}
+	if (makeInactive)
+		candidate->setActive(false);
 }
 
 void Observer::setFlag(std::string key, std::string value) {
@@ -77,6 +91,10 @@ void Observer::setDeactivateOnDetection(bool deactivate) {
 	makeInactive = deactivate;
 }
 
+bool Observer::getDeactivateOnDetection() const {
+	return makeInactive;
+}
+
 // ObserverFeature ------------------------------------------------------------
 DetectionState ObserverFeature::checkDetection(Candidate *candidate) const {
 	return NOTHING;
@@ -98,6 +116,190 @@ std::string ObserverDetectAll::getDescription() const {
 	return description;
 }
 
+// ObserverSphereArray --------------------------------------------------------
+ObserverSphereArray::ObserverSphereArray() :
+		indexProperty(0), origin(0.), cellSize(1) {
+	cells[0] = cells[1] = cells[2] = 0;
+}
+
+void ObserverSphereArray::add(const Vector3d &center, double radius) {
+	if (not (radius > 0))
+		throw std::runtime_error("ObserverSphereArray: the radius must be positive");
+	if (centers.size() >= std::numeric_limits<uint32_t>::max())
+		throw std::runtime_error("ObserverSphereArray: too many spheres");
+	centers.push_back(center);
+	radii.push_back(radius);
+	updateIndex();
+}
+
+size_t ObserverSphereArray::size() const {
+	return centers.size();
+}
+
+void ObserverSphereArray::setIndexKey(const std::string &key) {
+	indexKey = key;
+	if (not key.empty())
+		indexProperty = Candidate::getPropertyKey(key);
+}
+
+void ObserverSphereArray::updateIndex() {
+	// bounding box of all spheres
+	size_t n = centers.size();
+	Vector3d lower = centers[0] - Vector3d(radii[0]), upper = centers[0] + Vector3d(radii[0]);
+	double maxRadius = 0;
+	for (size_t i = 0; i < n; i++) {
+		for (int d = 0; d < 3; d++) {
+			lower.data[d] = std::min(lower.data[d], centers[i].data[d] - radii[i]);
+			upper.data[d] = std::max(upper.data[d], centers[i].data[d] + radii[i]);
+		}
+		maxRadius = std::max(maxRadius, radii[i]);
+	}
+
+	// about one sphere per cell, but the cells not smaller than the spheres
+	Vector3d extent = upper - lower;
+	double volume = std::max(extent.x, 2 * maxRadius) * std::max(extent.y, 2 * maxRadius)
+			* std::max(extent.z, 2 * maxRadius);
+	cellSize = std::max(2 * maxRadius, cbrt(volume / n));
+	origin = lower;
+	for (int d = 0; d < 3; d++)
+		cells[d] = std::max(1, int(ceil(extent.data[d] / cellSize)));
+	while (double(cells[0]) * cells[1] * cells[2] > 8. * n + 64) {
+		// very flat or elongated arrays: coarser cells
+		cellSize *= 2;
+		for (int d = 0; d < 3; d++)
+			cells[d] = std::max(1, int(ceil(extent.data[d] / cellSize)));
+	}
+
+	// count, then fill the spheres of each cell
+	size_t nCells = size_t(cells[0]) * cells[1] * cells[2];
+	std::vector<int> first(3 * n), last(3 * n);
+	cellStart.assign(nCells + 1, 0);
+	for (size_t i = 0; i < n; i++) {
+		for (int d = 0; d < 3; d++) {
+			first[3 * i + d] = std::max(0, int(floor((centers[i].data[d] - radii[i] - origin.data[d]) / cellSize)));
+			last[3 * i + d] = std::min(cells[d] - 1, int(floor((centers[i].data[d] + radii[i] - origin.data[d]) / cellSize)));
+		}
+		for (int ix = first[3 * i]; ix <= last[3 * i]; ix++)
+			for (int iy = first[3 * i + 1]; iy <= last[3 * i + 1]; iy++)
+				for (int iz = first[3 * i + 2]; iz <= last[3 * i + 2]; iz++)
+					cellStart[cellIndex(ix, iy, iz) + 1]++;
+	}
+	for (size_t c = 0; c < nCells; c++)
+		cellStart[c + 1] += cellStart[c];
+	cellSpheres.resize(cellStart.back());
+	std::vector<uint32_t> fill(cellStart.begin(), cellStart.end() - 1);
+	for (size_t i = 0; i < n; i++)
+		for (int ix = first[3 * i]; ix <= last[3 * i]; ix++)
+			for (int iy = first[3 * i + 1]; iy <= last[3 * i + 1]; iy++)
+				for (int iz = first[3 * i + 2]; iz <= last[3 * i + 2]; iz++)
+					cellSpheres[fill[cellIndex(ix, iy, iz)]++] = i;
+}
+
+size_t ObserverSphereArray::cellIndex(int ix, int iy, int iz) const {
+	return (size_t(ix) * cells[1] + iy) * cells[2] + iz;
+}
+
+bool ObserverSphereArray::cellOf(const Vector3d &position, int cell[3]) const {
+	bool inside = true;
+	for (int d = 0; d < 3; d++) {
+		double c = floor((position.data[d] - origin.data[d]) / cellSize);
+		// clamped to avoid overflows far from the array
+		c = std::max(-1e9, std::min(c, 1e9));
+		cell[d] = int(c);
+		inside = inside and (cell[d] >= 0) and (cell[d] < cells[d]);
+	}
+	return inside;
+}
+
+double ObserverSphereArray::nearestDistance(const Vector3d &position, double maxDistance) const {
+	double best = maxDistance;
+	if (centers.empty())
+		return best;
+	int c[3];
+	cellOf(position, c);
+
+	// the first shell of cells around the cell of the position that reaches the grid
+	int k = 0;
+	for (int d = 0; d < 3; d++)
+		k = std::max(k, std::max(-c[d], c[d] - (cells[d] - 1)));
+	for (;; k++) {
+		// unvisited spheres only overlap cells of this or later shells
+		if ((k - 1) * cellSize >= best)
+			break;
+		bool reachesGrid = false;
+		int lo[3], hi[3];
+		for (int d = 0; d < 3; d++) {
+			lo[d] = std::max(0, c[d] - k);
+			hi[d] = std::min(cells[d] - 1, c[d] + k);
+			reachesGrid = reachesGrid or (c[d] - k > 0) or (c[d] + k < cells[d] - 1);
+		}
+		for (int ix = lo[0]; ix <= hi[0]; ix++)
+			for (int iy = lo[1]; iy <= hi[1]; iy++) {
+				// only the cells on the shell: all z on the faces, the two ends otherwise
+				bool face = (std::abs(ix - c[0]) == k) or (std::abs(iy - c[1]) == k);
+				for (int iz = lo[2]; iz <= hi[2]; iz++) {
+					if (not face and (std::abs(iz - c[2]) != k)) {
+						if (iz < c[2] + k)
+							iz = std::min(c[2] + k, hi[2] + 1) - 1; // skip to the upper end
+						continue;
+					}
+					size_t cell = cellIndex(ix, iy, iz);
+					for (uint32_t j = cellStart[cell]; j < cellStart[cell + 1]; j++) {
+						uint32_t i = cellSpheres[j];
+						double d = fabs((position - centers[i]).getR() - radii[i]);
+						best = std::min(best, d);
+					}
+				}
+			}
+		if (not reachesGrid)
+			break; // the shell enclosed the whole grid
+	}
+	return best;
+}
+
+long ObserverSphereArray::crossedSphere(const Vector3d &previous, const Vector3d &current) const {
+	// a crossed sphere contains one of the positions, and with it one of their cells
+	const Vector3d *positions[2] = {&current, &previous};
+	for (int p = 0; p < 2; p++) {
+		int c[3];
+		if (not cellOf(*positions[p], c))
+			continue;
+		size_t cell = cellIndex(c[0], c[1], c[2]);
+		for (uint32_t j = cellStart[cell]; j < cellStart[cell + 1]; j++) {
+			uint32_t i = cellSpheres[j];
+			double dCurrent = (current - centers[i]).getR() - radii[i];
+			double dPrevious = (previous - centers[i]).getR() - radii[i];
+			if ((dCurrent * dPrevious <= 0) and (dPrevious != 0))
+				return i;
+		}
+	}
+	return -1;
+}
+
+DetectionState ObserverSphereArray::checkDetection(Candidate *candidate) const {
+	if (centers.empty())
+		return NOTHING;
+	const Vector3d &current = candidate->current.getPosition();
+	candidate->limitNextStep(nearestDistance(current, candidate->getNextStep()));
+
+	long i = crossedSphere(candidate->previous.getPosition(), current);
+	if (i < 0)
+		return NOTHING;
+	if (not indexKey.empty())
+		candidate->setProperty(indexProperty, Variant(int64_t(i)));
+	return DETECTED;
+}
+
+std::string ObserverSphereArray::getDescription() const {
+	std::stringstream ss;
+	ss << "ObserverSphereArray: " << centers.size() << " spheres, index with ";
+	ss << cells[0] << " x " << cells[1] << " x " << cells[2] << " cells of ";
+	ss << cellSize / Mpc << " Mpc";
+	if (not indexKey.empty())
+		ss << ", detecting sphere in property " << indexKey;
+	return ss.str();
+}
+
 // ObserverSmallSphere --------------------------------------------------------
 ObserverSmallSphere::ObserverSmallSphere(Vector3d center, double radius) :
 		center(center), radius(radius) {
@@ -321,91 +523,155 @@ std::string ObserverParticleIdVeto::getDescription() const {
 
 
 // ObserverTimeEvolution --------------------------------------------------------
-ObserverTimeEvolution::ObserverTimeEvolution() {}
+ObserverTimeEvolution::ObserverTimeEvolution() :
+		scaling(List), tMin(0), tStep(0), nTimes(0) {
+}
 
-ObserverTimeEvolution::ObserverTimeEvolution(double min, double dist, double numb) {
-  for (size_t i = 0; i < numb; i++) {
-    addTime(min + i * dist);
-  }
+ObserverTimeEvolution::ObserverTimeEvolution(double min, double dist, double numb) :
+		scaling(Linear), tMin(min), tStep(dist), nTimes(numb > 0 ? size_t(numb) : 0) {
 }
 
+ObserverTimeEvolution::ObserverTimeEvolution(double min, double max, size_t numb, bool log) :
+		scaling(log ? Logarithmic : Linear), tMin(min), tStep(0), nTimes(numb) {
+	if (max < min)
+		throw std::runtime_error("ObserverTimeEvolution: max < min");
+	if (log and (min <= 0))
+		throw std::runtime_error("ObserverTimeEvolution: a logarithmic grid needs min > 0");
+	if (numb > 1)
+		tStep = log ? std::log(max / min) / (numb - 1) : (max - min) / (numb - 1);
+}
 
-DetectionState ObserverTimeEvolution::checkDetection(Candidate *c) const {
+double ObserverTimeEvolution::getTime(size_t i) const {
+	if (scaling == Linear)
+		return tMin + i * tStep;
+	if (scaling == Logarithmic)
+		return tMin * std::exp(i * tStep);
+	return detList[i];
+}
 
-	if (detList.size()) {
-		double length = c->getTrajectoryLength();
-		size_t index;
-		const std::string DI = "DetectionIndex";
-		std::string value;
+// number of detection times <= length
+size_t ObserverTimeEvolution::countTimes(double length) const {
+	if (scaling == List)
+		return std::upper_bound(detList.begin(), detList.end(), length) - detList.begin();
+	if ((nTimes == 0) or not (length >= tMin))
+		return 0;
+	if (tStep <= 0)
+		return nTimes;
 
-		// Load the last detection index
-		if (c->hasProperty(DI)) {
-			index = c->getProperty(DI).asUInt64();
-		}
-		else {
-			index = 0;
-		}
+	double x = (scaling == Linear) ? (length - tMin) / tStep : std::log(length / tMin) / tStep;
+	size_t k = (x < nTimes) ? size_t(x) + 1 : nTimes;
+	// correct the rounding of the guess against the times themselves
+	while ((k > 0) and (getTime(k - 1) > length))
+		k--;
+	while ((k < nTimes) and (getTime(k) <= length))
+		k++;
+	return k;
+}
 
-		// Break if the particle has been detected once for all detList entries.
-		if (index > detList.size()) {
-			return NOTHING;
-		}
+DetectionState ObserverTimeEvolution::checkDetection(Candidate *c) const {
+	size_t n = getNumberOfTimes();
+	if (n == 0)
+		return NOTHING;
 
-		// Calculate the distance to next detection
-		double distance = length - detList[index];
+	double length = c->getTrajectoryLength();
+	static const Candidate::PropertyKey DI = Candidate::getPropertyKey("DetectionIndex");
 
-		// Limit next Step and detect candidate
-		// Increase the index by one in case of detection
-		if (distance < 0.) {
-			c->limitNextStep(-distance);
-			return NOTHING;
-		}
-		else {
+	// number of times passed so far and at the last detection
+	size_t index = countTimes(length);
+	size_t detected = c->hasProperty(DI) ? c->getProperty(DI).asUInt64() : 0;
 
-			if (index < detList.size()-1) {
-				c->limitNextStep(detList[index+1]-length);
-			}
-			c->setProperty(DI, Variant::fromUInt64(index+1));
-
-			return DETECTED;
-		}
+	// limit the next step to the next detection time
+	if (index < n)
+		c->limitNextStep(getTime(index) - length);
 
+	// detect once when one or more times were passed
+	if (index > detected) {
+		c->setProperty(DI, Variant::fromUInt64(index));
+		return DETECTED;
 	}
 	return NOTHING;
-
 }
 
 void ObserverTimeEvolution::addTime(const double& t) {
-	detList.push_back(t);
+	if (scaling != List) {
+		detList = getTimes();
+		scaling = List;
+	}
+	detList.insert(std::upper_bound(detList.begin(), detList.end(), t), t);
 }
 
-const std::vector<double>& ObserverTimeEvolution::getTimes() const {
-	return detList;
+size_t ObserverTimeEvolution::getNumberOfTimes() const {
+	return (scaling == List) ? detList.size() : nTimes;
+}
+
+ObserverTimeEvolution::Scaling ObserverTimeEvolution::getScaling() const {
+	return scaling;
+}
+
+std::vector<double> ObserverTimeEvolution::getTimes() const {
+	if (scaling == List)
+		return detList;
+	std::vector<double> times(nTimes);
+	for (size_t i = 0; i < nTimes; i++)
+		times[i] = getTime(i);
+	return times;
 }
 
 std::string ObserverTimeEvolution::getDescription() const {
 	std::stringstream s;
 	s << "List of Detection lengths in kpc";
-	for (size_t i = 0; i < detList.size(); i++)
-	  s << "  - " << detList[i] / kpc;
+	for (size_t i = 0; i < getNumberOfTimes(); i++)
+	  s << "  - " << getTime(i) / kpc;
 	return s.str();
 }
 
 // ObserverSurface--------------------------------------------------------------
-ObserverSurface::ObserverSurface(Surface* _surface) : surface(_surface) { };
+ObserverSurface::ObserverSurface(Surface* _surface) : surface(_surface), eventDriven(false) { };
+
+void ObserverSurface::setDenseOutput(PropagationDP *propagation) {
+	this->propagation = propagation;
+}
+
+void ObserverSurface::setEventDriven(bool b) {
+	eventDriven = b;
+}
 
 DetectionState ObserverSurface::checkDetection(Candidate *candidate) const
 {
-		double currentDistance = surface->distance(candidate->current.getPosition());
-		double previousDistance = surface->distance(candidate->previous.getPosition());
-		candidate->limitNextStep(fabs(currentDistance));
+		Vector3d previousPosition = candidate->previous.getPosition();
+		if (not propagation) {
+			// neutral particles move on straight lines up to the crossing
+			if (eventDriven and candidate->current.getCharge() == 0)
+				candidate->limitNextStep(surface->distanceAlong(candidate->current.getPosition(), candidate->current.getDirection()));
+			else
+				candidate->limitNextStep(surface->nearestDistance(candidate->current.getPosition()));
+		}
 
-		if (currentDistance * previousDistance > 0)
-			return NOTHING;
-		else if (previousDistance == 0)
+		if (not surface->crossed(previousPosition, candidate->current.getPosition()))
 			return NOTHING;
-		else
+		if (not propagation)
 			return DETECTED;
+
+		// bisect the dense output for the crossing
+		Vector3d position, direction;
+		double lo = 0, hi = 1;
+		if (not propagation->getDenseOutput(candidate, hi, position, direction))
+			return DETECTED; // step not available, detected at the end of the step
+		for (int i = 0; i < 50; i++) {
+			double mid = 0.5 * (lo + hi);
+			propagation->getDenseOutput(candidate, mid, position, direction);
+			if (not surface->crossed(previousPosition, position))
+				lo = mid;
+			else
+				hi = mid;
+		}
+		propagation->getDenseOutput(candidate, hi, position, direction);
+		double step = candidate->getCurrentStep();
+		candidate->current.setPosition(position);
+		candidate->current.setDirection(direction);
+		candidate->setTrajectoryLength(candidate->getTrajectoryLength() - step);
+		candidate->setCurrentStep(hi * step); // adds to the trajectory length
+		return DETECTED;
 };
 
 std::string ObserverSurface::getDescription() const {
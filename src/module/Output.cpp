@@ -1,15 +1,20 @@
 #include "crpropa/module/Output.h"
 #include "crpropa/Units.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <locale>
+#include <sstream>
 #include <stdexcept>
 
 namespace crpropa {
 
-Output::Output() : outputName(OutputTypeName(Everything)), lengthScale(Mpc), energyScale(EeV), oneDimensional(false), count(0) {
+Output::Output() : outputName(OutputTypeName(Everything)), lengthScale(Mpc), energyScale(EeV), oneDimensional(false), count(0), ordered(false), orderedBufferRows(16384) {
 	enableAll();
 }
 
-Output::Output(OutputType outputtype) : outputName(OutputTypeName(outputtype)), lengthScale(Mpc), energyScale(EeV), oneDimensional(false), count(0) {
+Output::Output(OutputType outputtype) : outputName(OutputTypeName(outputtype)), lengthScale(Mpc), energyScale(EeV), oneDimensional(false), count(0), ordered(false), orderedBufferRows(16384) {
 	setOutputType(outputtype);
 }
 
@@ -31,6 +36,8 @@ void Output::modify() {
 }
 
 void Output::process(Candidate *c) const {
+	if (not passesFilter(c))
+		return;
 	count++;
 }
 
@@ -119,17 +126,305 @@ void Output::disableAll() {
 	fields.reset();
 }
 
+void Output::copyConfiguration(const Output &other) {
+	modify();
+	lengthScale = other.lengthScale;
+	energyScale = other.energyScale;
+	fields = other.fields;
+	properties = other.properties;
+	oneDimensional = other.oneDimensional;
+	filter = other.filter;
+	filterExpression = other.filterExpression;
+}
+
 size_t Output::size() const {
 	return count;
 }
 
+void Output::setOrdered(bool ordered, size_t bufferRows) {
+	modify();
+	this->ordered = ordered;
+	orderedBufferRows = bufferRows;
+}
+
+bool Output::isOrdered() const {
+	return ordered;
+}
+
+RowOrderKey Output::getOrderKey(const Candidate *candidate) {
+	static const Candidate::PropertyKey primaryIndexKey = Candidate::getPropertyKey("PrimaryIndex");
+	const Candidate *primary = candidate;
+	while (primary->parent)
+		primary = primary->parent;
+	RowOrderKey key;
+	const Variant *index = primary->findProperty(primaryIndexKey);
+	key.primary = index ? index->toUInt64() : primary->getSerialNumber();
+	key.lineage = candidate->getRandomStream();
+	return key;
+}
+
+void Output::flush() const {
+}
+
+uint64_t Output::getCheckpointPosition() const {
+	return count;
+}
+
+bool Output::rewind(size_t rows, uint64_t position) {
+	return (rows == count) and (position == count);
+}
+
 void Output::enableProperty(const std::string &property, const Variant &defaultValue, const std::string &comment) {
 	modify();
 	Property prop;
 	prop.name = property;
 	prop.comment = comment;
 	prop.defaultValue = defaultValue;
+	prop.key = Candidate::getPropertyKey(property);
+	prop.type = defaultValue.getType();
+	prop.offset = getPropertyRowSize();
+	prop.size = defaultValue.getSize();
 	properties.push_back(prop);
 }
+
+size_t Output::getPropertyRowSize() const {
+	if (properties.empty())
+		return 0;
+	return properties.back().offset + properties.back().size;
+}
+
+const Variant &Output::getPropertyValue(const Candidate *candidate, const Property &property) const {
+	const Variant *value = candidate->findProperty(property.key);
+	return value ? *value : property.defaultValue;
+}
+
+// value converted to the type of a column
+static Variant convertVariant(const Variant &v, Variant::Type type) {
+	switch (type) {
+	case Variant::TYPE_BOOL:
+		return Variant(v.toBool());
+	case Variant::TYPE_CHAR:
+		return Variant(v.toChar());
+	case Variant::TYPE_UCHAR:
+		return Variant(v.toUChar());
+	case Variant::TYPE_INT16:
+		return Variant(v.toInt16());
+	case Variant::TYPE_UINT16:
+		return Variant(v.toUInt16());
+	case Variant::TYPE_INT32:
+		return Variant(v.toInt32());
+	case Variant::TYPE_UINT32:
+		return Variant(v.toUInt32());
+	case Variant::TYPE_INT64:
+		return Variant(v.toInt64());
+	case Variant::TYPE_UINT64:
+		return Variant(v.toUInt64());
+	case Variant::TYPE_FLOAT:
+		return Variant(v.toFloat());
+	case Variant::TYPE_DOUBLE:
+		return Variant(v.toDouble());
+	case Variant::TYPE_STRING:
+		return Variant(v.toString(std::locale::classic()));
+	default:
+		return v;
+	}
+}
+
+void Output::writeProperty(const Candidate *candidate, const Property &property, unsigned char *row) const {
+	const Variant &value = getPropertyValue(candidate, property);
+	unsigned char *p = row + property.offset;
+	if (property.type == Variant::TYPE_STRING) {
+		// fixed length, truncated or padded with zeros
+		std::memset(p, 0, property.size);
+		if (value.isString()) {
+			const std::string &s = value.asString();
+			std::memcpy(p, s.data(), std::min(s.size(), property.size));
+		} else {
+			std::string s = value.toString(std::locale::classic());
+			std::memcpy(p, s.data(), std::min(s.size(), property.size));
+		}
+	} else if (value.getType() == property.type) {
+		value.copyToBuffer(p);
+	} else {
+		convertVariant(value, property.type).copyToBuffer(p);
+	}
+}
+// quantities of the filter conditions
+enum FilterQuantity {
+	FilterEnergy, FilterSourceEnergy, FilterCreatedEnergy, FilterId,
+	FilterSourceId, FilterCreatedId, FilterRedshift, FilterTrajectoryLength,
+	FilterWeight, FilterProperty
+};
+
+enum FilterComparison {
+	FilterLess, FilterLessEqual, FilterGreater, FilterGreaterEqual,
+	FilterEqual, FilterNotEqual
+};
+
+static std::string trim(const std::string &s) {
+	size_t first = s.find_first_not_of(" \t");
+	if (first == std::string::npos)
+		return "";
+	size_t last = s.find_last_not_of(" \t");
+	return s.substr(first, last - first + 1);
+}
+
+void Output::setFilter(const std::string &expression) {
+	modify();
+	std::string s = expression;
+	for (size_t i = s.find("&&"); i != std::string::npos; i = s.find("&&"))
+		s.replace(i, 2, " and ");
+
+	// split into the terms between the words "and"
+	std::vector<std::string> terms(1);
+	std::istringstream words(s);
+	std::string word;
+	while (words >> word) {
+		if (word == "and")
+			terms.push_back("");
+		else
+			terms.back() += word;
+	}
+	if (terms.size() == 1 and terms[0].empty()) {
+		filter.clear();
+		filterExpression.clear();
+		return;
+	}
+
+	std::vector<FilterCondition> conditions;
+	for (size_t i = 0; i < terms.size(); i++) {
+		const std::string &term = terms[i];
+		size_t pos = term.find_first_of("<>=!");
+		if (term.empty() or pos == std::string::npos or pos == 0)
+			throw std::runtime_error("Output: invalid filter condition '" + term + "' in '" + expression + "'");
+
+		FilterCondition condition;
+		std::string op = term.substr(pos, 2);
+		size_t opLength = 2;
+		if (op == "<=")
+			condition.comparison = FilterLessEqual;
+		else if (op == ">=")
+			condition.comparison = FilterGreaterEqual;
+		else if (op == "==")
+			condition.comparison = FilterEqual;
+		else if (op == "!=")
+			condition.comparison = FilterNotEqual;
+		else if (op[0] == '<') {
+			condition.comparison = FilterLess;
+			opLength = 1;
+		} else if (op[0] == '>') {
+			condition.comparison = FilterGreater;
+			opLength = 1;
+		} else
+			throw std::runtime_error("Output: invalid comparison in filter condition '" + term + "'");
+
+		std::string number = term.substr(pos + opLength);
+		char *end;
+		condition.value = std::strtod(number.c_str(), &end);
+		if (number.empty() or *end != '\0')
+			throw std::runtime_error("Output: invalid number in filter condition '" + term + "'");
+
+		std::string name = term.substr(0, pos);
+		condition.key = 0;
+		if (name == "E") {
+			condition.quantity = FilterEnergy;
+			condition.value *= energyScale;
+		} else if (name == "E0") {
+			condition.quantity = FilterSourceEnergy;
+			condition.value *= energyScale;
+		} else if (name == "E1") {
+			condition.quantity = FilterCreatedEnergy;
+			condition.value *= energyScale;
+		} else if (name == "ID")
+			condition.quantity = FilterId;
+		else if (name == "ID0")
+			condition.quantity = FilterSourceId;
+		else if (name == "ID1")
+			condition.quantity = FilterCreatedId;
+		else if (name == "z")
+			condition.quantity = FilterRedshift;
+		else if (name == "D") {
+			condition.quantity = FilterTrajectoryLength;
+			condition.value *= lengthScale;
+		} else if (name == "W")
+			condition.quantity = FilterWeight;
+		else {
+			condition.quantity = FilterProperty;
+			condition.key = Candidate::getPropertyKey(name);
+		}
+		conditions.push_back(condition);
+	}
+	filter.swap(conditions);
+	filterExpression = trim(expression);
+}
+
+const std::string &Output::getFilter() const {
+	return filterExpression;
+}
+
+bool Output::evaluateFilter(const Candidate *c) const {
+	for (size_t i = 0; i < filter.size(); i++) {
+		const FilterCondition &condition = filter[i];
+		double x;
+		switch (condition.quantity) {
+		case FilterEnergy:
+			x = c->current.getEnergy();
+			break;
+		case FilterSourceEnergy:
+			x = c->source.getEnergy();
+			break;
+		case FilterCreatedEnergy:
+			x = c->created.getEnergy();
+			break;
+		case FilterId:
+			x = c->current.getId();
+			break;
+		case FilterSourceId:
+			x = c->source.getId();
+			break;
+		case FilterCreatedId:
+			x = c->created.getId();
+			break;
+		case FilterRedshift:
+			x = c->getRedshift();
+			break;
+		case FilterTrajectoryLength:
+			x = c->getTrajectoryLength();
+			break;
+		case FilterWeight:
+			x = c->getWeight();
+			break;
+		default:
+			const Variant *value = c->findProperty(condition.key);
+			if (not value)
+				return false;
+			x = value->toDouble();
+		}
+
+		bool pass;
+		switch (condition.comparison) {
+		case FilterLess:
+			pass = x < condition.value;
+			break;
+		case FilterLessEqual:
+			pass = x <= condition.value;
+			break;
+		case FilterGreater:
+			pass = x > condition.value;
+			break;
+		case FilterGreaterEqual:
+			pass = x >= condition.value;
+			break;
+		case FilterEqual:
+			pass = x == condition.value;
+			break;
+		default:
+			pass = x != condition.value;
+		}
+		if (not pass)
+			return false;
+	}
+	return true;
+}
 ;
 } // namespace crpropa
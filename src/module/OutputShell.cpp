@@ -42,11 +42,12 @@ std::string ShellOutput1D::getDescription() const {
 }
 
 void ShellPropertyOutput::process(Candidate* c) const {
-	Candidate::PropertyMap::const_iterator i = c->properties.begin();
+	const Candidate::PropertyMap &properties = c->getProperties();
+	Candidate::PropertyMap::const_iterator i = properties.begin();
 #pragma omp critical
 	{
-		for ( ; i != c->properties.end(); i++) {
-			std::cout << "  " << i->first << ", " << i->second << std::endl;
+		for ( ; i != properties.end(); i++) {
+			std::cout << "  " << Candidate::getPropertyName(i->first) << ", " << i->second << std::endl;
 		}
 	}
 }
@@ -0,0 +1,371 @@
+#ifdef CRPROPA_HAVE_PARQUET
+
+#include "crpropa/module/ParquetOutput.h"
+#include "crpropa/Version.h"
+
+#include <arrow/api.h>
+#include <arrow/io/file.h>
+#include <arrow/util/key_value_metadata.h>
+#include <parquet/arrow/writer.h>
+#include <parquet/properties.h>
+
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace crpropa {
+
+// quantities of the columns
+enum ParquetQuantity {
+	QD, Qz, QSN, QID, QE, QX, QY, QZ, QPx, QPy, QPz,
+	QSN0, QID0, QE0, QX0, QY0, QZ0, QP0x, QP0y, QP0z,
+	QSN1, QID1, QE1, QX1, QY1, QZ1, QP1x, QP1y, QP1z,
+	QW, QProperty
+};
+
+struct ParquetOutput::Impl {
+	struct Column {
+		ParquetQuantity quantity;
+		size_t property; // index of the property
+		Variant::Type type; // of the property
+	};
+	std::vector<Column> columns;
+	std::shared_ptr<arrow::Schema> schema;
+	std::shared_ptr<arrow::io::FileOutputStream> stream;
+	std::unique_ptr<parquet::arrow::FileWriter> writer;
+	std::mutex writeMutex;
+
+	// builders of every thread and of the threads that were not known at
+	// opening the file, which share the last one
+	std::vector<std::vector<std::unique_ptr<arrow::ArrayBuilder> > > builders;
+	std::vector<size_t> rows;
+	std::mutex sharedMutex;
+};
+
+static void check(const arrow::Status &status, const std::string &what) {
+	if (not status.ok())
+		throw std::runtime_error("ParquetOutput: " + what + ": " + status.ToString());
+}
+
+static std::shared_ptr<arrow::DataType> arrowType(Variant::Type type) {
+	switch (type) {
+	case Variant::TYPE_BOOL:
+		return arrow::boolean();
+	case Variant::TYPE_CHAR:
+		return arrow::int8();
+	case Variant::TYPE_UCHAR:
+		return arrow::uint8();
+	case Variant::TYPE_INT16:
+		return arrow::int16();
+	case Variant::TYPE_UINT16:
+		return arrow::uint16();
+	case Variant::TYPE_INT32:
+		return arrow::int32();
+	case Variant::TYPE_UINT32:
+		return arrow::uint32();
+	case Variant::TYPE_INT64:
+		return arrow::int64();
+	case Variant::TYPE_UINT64:
+		return arrow::uint64();
+	case Variant::TYPE_FLOAT:
+		return arrow::float32();
+	case Variant::TYPE_DOUBLE:
+		return arrow::float64();
+	case Variant::TYPE_STRING:
+		return arrow::utf8();
+	default:
+		throw std::runtime_error("ParquetOutput: no matching Arrow type for Variant type "
+				+ std::string(Variant::getTypeName(type)));
+	}
+}
+
+// converted to the type of the default value of the property
+static arrow::Status appendVariant(arrow::ArrayBuilder *builder, const Variant &v,
+		Variant::Type type) {
+	switch (type) {
+	case Variant::TYPE_BOOL:
+		return static_cast<arrow::BooleanBuilder*>(builder)->Append(v.toBool());
+	case Variant::TYPE_CHAR:
+		return static_cast<arrow::Int8Builder*>(builder)->Append(v.toChar());
+	case Variant::TYPE_UCHAR:
+		return static_cast<arrow::UInt8Builder*>(builder)->Append(v.toUChar());
+	case Variant::TYPE_INT16:
+		return static_cast<arrow::Int16Builder*>(builder)->Append(v.toInt16());
+	case Variant::TYPE_UINT16:
+		return static_cast<arrow::UInt16Builder*>(builder)->Append(v.toUInt16());
+	case Variant::TYPE_INT32:
+		return static_cast<arrow::Int32Builder*>(builder)->Append(v.toInt32());
+	case Variant::TYPE_UINT32:
+		return static_cast<arrow::UInt32Builder*>(builder)->Append(v.toUInt32());
+	case Variant::TYPE_INT64:
+		return static_cast<arrow::Int64Builder*>(builder)->Append(v.toInt64());
+	case Variant::TYPE_UINT64:
+		return static_cast<arrow::UInt64Builder*>(builder)->Append(v.toUInt64());
+	case Variant::TYPE_FLOAT:
+		return static_cast<arrow::FloatBuilder*>(builder)->Append(v.toFloat());
+	case Variant::TYPE_DOUBLE:
+		return static_cast<arrow::DoubleBuilder*>(builder)->Append(v.toDouble());
+	default:
+		return static_cast<arrow::StringBuilder*>(builder)->Append(v.toString());
+	}
+}
+
+ParquetOutput::ParquetOutput(const std::string &filename) :
+		Output(), filename(filename), opened(new std::once_flag), rowGroupSize(65536),
+		compressionLevel(3) {
+}
+
+ParquetOutput::ParquetOutput(const std::string &filename, OutputType outputtype) :
+		Output(outputtype), filename(filename), opened(new std::once_flag),
+		rowGroupSize(65536), compressionLevel(3) {
+}
+
+ParquetOutput::~ParquetOutput() {
+	close();
+}
+
+void ParquetOutput::open() {
+	impl.reset(new Impl);
+	std::vector<Impl::Column> &columns = impl->columns;
+	arrow::FieldVector schemaFields;
+	std::vector<std::string> idColumns;
+	auto add = [&](const char *name, ParquetQuantity quantity,
+			const std::shared_ptr<arrow::DataType> &type) {
+		Impl::Column c = {quantity, 0, Variant::TYPE_NONE};
+		columns.push_back(c);
+		schemaFields.push_back(arrow::field(name, type, false));
+		if (type->id() == arrow::Type::INT32)
+			idColumns.push_back(name);
+	};
+	auto addVector = [&](const char *x, const char *y, const char *z, ParquetQuantity qx) {
+		add(x, qx, arrow::float64());
+		add(y, ParquetQuantity(qx + 1), arrow::float64());
+		add(z, ParquetQuantity(qx + 2), arrow::float64());
+	};
+
+	// the columns and names of HDF5Output
+	if (fields.test(TrajectoryLengthColumn))
+		add("D", QD, arrow::float64());
+	if (fields.test(RedshiftColumn))
+		add("z", Qz, arrow::float64());
+	if (fields.test(SerialNumberColumn))
+		add("SN", QSN, arrow::uint64());
+	if (fields.test(CurrentIdColumn))
+		add("ID", QID, arrow::int32());
+	if (fields.test(CurrentEnergyColumn))
+		add("E", QE, arrow::float64());
+	if (fields.test(CurrentPositionColumn) && oneDimensional)
+		add("X", QX, arrow::float64());
+	if (fields.test(CurrentPositionColumn) && not oneDimensional)
+		addVector("X", "Y", "Z", QX);
+	if (fields.test(CurrentDirectionColumn) && not oneDimensional)
+		addVector("Px", "Py", "Pz", QPx);
+	if (fields.test(SerialNumberColumn))
+		add("SN0", QSN0, arrow::uint64());
+	if (fields.test(SourceIdColumn))
+		add("ID0", QID0, arrow::int32());
+	if (fields.test(SourceEnergyColumn))
+		add("E0", QE0, arrow::float64());
+	if (fields.test(SourcePositionColumn) && oneDimensional)
+		add("X0", QX0, arrow::float64());
+	if (fields.test(SourcePositionColumn) && not oneDimensional)
+		addVector("X0", "Y0", "Z0", QX0);
+	if (fields.test(SourceDirectionColumn) && not oneDimensional)
+		addVector("P0x", "P0y", "P0z", QP0x);
+	if (fields.test(SerialNumberColumn))
+		add("SN1", QSN1, arrow::uint64());
+	if (fields.test(CreatedIdColumn))
+		add("ID1", QID1, arrow::int32());
+	if (fields.test(CreatedEnergyColumn))
+		add("E1", QE1, arrow::float64());
+	if (fields.test(CreatedPositionColumn) && oneDimensional)
+		add("X1", QX1, arrow::float64());
+	if (fields.test(CreatedPositionColumn) && not oneDimensional)
+		addVector("X1", "Y1", "Z1", QX1);
+	if (fields.test(CreatedDirectionColumn) && not oneDimensional)
+		addVector("P1x", "P1y", "P1z", QP1x);
+	if (fields.test(WeightColumn))
+		add("weight", QW, arrow::float64());
+	for (size_t i = 0; i < properties.size(); i++) {
+		Variant::Type type = properties[i].defaultValue.getType();
+		Impl::Column c = {QProperty, i, type};
+		columns.push_back(c);
+		schemaFields.push_back(arrow::field(properties[i].name, arrowType(type), false));
+	}
+
+	std::stringstream lengthScale, energyScale;
+	lengthScale << this->lengthScale;
+	energyScale << this->energyScale;
+	impl->schema = arrow::schema(schemaFields, arrow::key_value_metadata(
+			{"OutputType", "Version", "LengthScale", "EnergyScale"},
+			{outputName, g_GIT_DESC, lengthScale.str(), energyScale.str()}));
+
+	arrow::Result<std::shared_ptr<arrow::io::FileOutputStream> > stream =
+			arrow::io::FileOutputStream::Open(filename);
+	if (not stream.ok())
+		throw std::runtime_error(std::string("Cannot create file: ") + filename);
+	impl->stream = stream.ValueOrDie();
+
+	parquet::WriterProperties::Builder writerProperties;
+	writerProperties.compression(parquet::Compression::ZSTD);
+	writerProperties.compression_level(compressionLevel);
+	writerProperties.disable_dictionary();
+	for (size_t i = 0; i < idColumns.size(); i++)
+		writerProperties.enable_dictionary(idColumns[i]);
+	arrow::Result<std::unique_ptr<parquet::arrow::FileWriter> > writer =
+			parquet::arrow::FileWriter::Open(*impl->schema, arrow::default_memory_pool(),
+					impl->stream, writerProperties.build(), parquet::default_arrow_writer_properties());
+	check(writer.status(), "cannot write " + filename);
+	impl->writer = std::move(writer).ValueOrDie();
+
+	size_t nThreads = 1;
+#ifdef _OPENMP
+	nThreads = omp_in_parallel() ? omp_get_num_threads() : omp_get_max_threads();
+#endif
+	impl->builders.resize(nThreads + 1);
+	impl->rows.assign(nThreads + 1, 0);
+	for (size_t t = 0; t <= nThreads; t++)
+		for (size_t i = 0; i < schemaFields.size(); i++) {
+			arrow::Result<std::unique_ptr<arrow::ArrayBuilder> > builder =
+					arrow::MakeBuilder(schemaFields[i]->type());
+			check(builder.status(), "cannot create a builder");
+			impl->builders[t].push_back(std::move(builder).ValueOrDie());
+		}
+}
+
+void ParquetOutput::process(Candidate *c) const {
+	std::call_once(*opened, [this]() { const_cast<ParquetOutput*>(this)->open(); });
+	if (not passesFilter(c))
+		return;
+
+	size_t t = 0;
+#ifdef _OPENMP
+	t = omp_get_thread_num();
+#endif
+	std::unique_lock<std::mutex> shared(impl->sharedMutex, std::defer_lock);
+	if (t + 1 >= impl->builders.size()) {
+		t = impl->builders.size() - 1;
+		shared.lock();
+	}
+
+	std::vector<std::unique_ptr<arrow::ArrayBuilder> > &builders = impl->builders[t];
+	const ParticleState *states[3] = {&c->current, &c->source, &c->created};
+	const uint64_t serials[3] = {c->getSerialNumber(), c->getSourceSerialNumber(),
+			c->getCreatedSerialNumber()};
+	for (size_t i = 0; i < impl->columns.size(); i++) {
+		const Impl::Column &column = impl->columns[i];
+		arrow::ArrayBuilder *builder = builders[i].get();
+		arrow::Status status;
+		if (column.quantity == QD) {
+			status = static_cast<arrow::DoubleBuilder*>(builder)->Append(
+					c->getTrajectoryLength() / lengthScale);
+		} else if (column.quantity == Qz) {
+			status = static_cast<arrow::DoubleBuilder*>(builder)->Append(c->getRedshift());
+		} else if (column.quantity == QW) {
+			status = static_cast<arrow::DoubleBuilder*>(builder)->Append(c->getWeight());
+		} else if (column.quantity == QProperty) {
+			const Property &property = properties[column.property];
+			status = appendVariant(builder, getPropertyValue(c, property), column.type);
+		} else {
+			// the quantities of the current, source and created state
+			int s = (column.quantity - QSN) / (QSN0 - QSN);
+			int q = (column.quantity - QSN) % (QSN0 - QSN);
+			const ParticleState &state = *states[s];
+			if (q == 0)
+				status = static_cast<arrow::UInt64Builder*>(builder)->Append(serials[s]);
+			else if (q == 1)
+				status = static_cast<arrow::Int32Builder*>(builder)->Append(state.getId());
+			else if (q == 2)
+				status = static_cast<arrow::DoubleBuilder*>(builder)->Append(
+						state.getEnergy() / energyScale);
+			else if (q < 6)
+				status = static_cast<arrow::DoubleBuilder*>(builder)->Append(
+						state.getPosition().data[q - 3] / lengthScale);
+			else
+				status = static_cast<arrow::DoubleBuilder*>(builder)->Append(
+						state.getDirection().data[q - 6]);
+		}
+		check(status, "cannot append a value");
+	}
+
+#pragma omp atomic
+	count++;
+
+	if (++impl->rows[t] >= rowGroupSize)
+		writeBatch(t);
+}
+
+void ParquetOutput::writeBatch(size_t t) const {
+	if (impl->rows[t] == 0)
+		return;
+	// the arrays are built by the calling thread, only the writing is serialized
+	std::vector<std::shared_ptr<arrow::Array> > arrays(impl->columns.size());
+	for (size_t i = 0; i < arrays.size(); i++)
+		check(impl->builders[t][i]->Finish(&arrays[i]), "cannot build a column");
+	std::shared_ptr<arrow::Table> table = arrow::Table::Make(impl->schema, arrays);
+	impl->rows[t] = 0;
+
+	std::lock_guard<std::mutex> lock(impl->writeMutex);
+	check(impl->writer->WriteTable(*table, table->num_rows()), "cannot write a row group");
+}
+
+void ParquetOutput::flush() const {
+	if (not impl)
+		return;
+	for (size_t t = 0; t < impl->builders.size(); t++) {
+#ifdef _OPENMP
+		// the builders of the other threads are in use
+		if (omp_in_parallel() and (t != size_t(omp_get_thread_num())))
+			continue;
+#endif
+		writeBatch(t);
+	}
+	std::lock_guard<std::mutex> lock(impl->writeMutex);
+	check(impl->stream->Flush(), "cannot flush " + filename);
+}
+
+void ParquetOutput::close() {
+	if (not impl)
+		return;
+	for (size_t t = 0; t < impl->builders.size(); t++)
+		writeBatch(t);
+	check(impl->writer->Close(), "cannot close " + filename);
+	check(impl->stream->Close(), "cannot close " + filename);
+	impl.reset();
+	opened.reset(new std::once_flag);
+}
+
+void ParquetOutput::setRowGroupSize(size_t rows) {
+	if (rows == 0)
+		throw std::runtime_error("ParquetOutput: the row group size has to be positive");
+	rowGroupSize = rows;
+}
+
+size_t ParquetOutput::getRowGroupSize() const {
+	return rowGroupSize;
+}
+
+void ParquetOutput::setCompressionLevel(int level) {
+	modify();
+	compressionLevel = level;
+}
+
+int ParquetOutput::getCompressionLevel() const {
+	return compressionLevel;
+}
+
+const std::string &ParquetOutput::getFilename() const {
+	return filename;
+}
+
+std::string ParquetOutput::getDescription() const {
+	return "ParquetOutput";
+}
+
+} // namespace crpropa
+
+#endif // CRPROPA_HAVE_PARQUET
@@ -1,40 +1,183 @@
 #include "crpropa/module/ParticleCollector.h"
 #include "crpropa/module/TextOutput.h"
 #include "crpropa/Units.h"
+#include "crpropa/Common.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace crpropa {
 
-ParticleCollector::ParticleCollector() : nBuffer(10e6), clone(false), recursive(false)  {
+ParticleCollector::ParticleCollector() : nBuffer(10e6), clone(false), recursive(false),
+		compact(false), allocated(new std::once_flag) {
         container.reserve(nBuffer); // for 1e6 candidates ~ 500MB of RAM
 }
 
-ParticleCollector::ParticleCollector(const std::size_t nBuffer) : clone(false), recursive(false)  {
+ParticleCollector::ParticleCollector(const std::size_t nBuffer) : nBuffer(nBuffer), clone(false),
+		recursive(false), compact(false), allocated(new std::once_flag) {
 	container.reserve(nBuffer);
 }
 
-ParticleCollector::ParticleCollector(const std::size_t nBuffer, const bool clone) : recursive(false) {
+ParticleCollector::ParticleCollector(const std::size_t nBuffer, const bool clone) : nBuffer(nBuffer),
+		clone(clone), recursive(false), compact(false), allocated(new std::once_flag) {
 	container.reserve(nBuffer);
 }
 
-ParticleCollector::ParticleCollector(const std::size_t nBuffer, const bool clone, const bool recursive) {
+ParticleCollector::ParticleCollector(const std::size_t nBuffer, const bool clone, const bool recursive) :
+		nBuffer(nBuffer), clone(clone), recursive(recursive), compact(false),
+		allocated(new std::once_flag) {
 	container.reserve(nBuffer);
 }
 
+void ParticleCollector::allocate() const {
+	size_t nThreads = 1;
+#ifdef _OPENMP
+	nThreads = omp_get_num_threads();
+#endif
+	threadContainers.resize(nThreads);
+}
+
+void ParticleCollector::store(tContainer &candidates, std::vector<CompactCandidate> &records,
+		Candidate *c) const {
+	if (compact)
+		records.push_back(toRecord(c));
+	else if (clone)
+		candidates.push_back(c->clone(recursive));
+	else
+		candidates.push_back(c);
+}
+
 void ParticleCollector::process(Candidate *c) const {
-#pragma omp critical
-        {
-		if(clone)
-		       	container.push_back(c->clone(recursive));
-		else
-			container.push_back(c);
-        }
+#ifdef _OPENMP
+	if (omp_in_parallel()) {
+		std::call_once(*allocated, &ParticleCollector::allocate, this);
+		size_t i = omp_get_thread_num();
+		if (i < threadContainers.size()) {
+			ThreadContainer &t = threadContainers[i];
+			store(t.candidates, t.records, c);
+			return;
+		}
+	}
+#endif
+	// outside of a parallel section or more threads than at the first candidate
+	std::lock_guard<std::mutex> lock(mergeMutex);
+	store(container, records, c);
+}
+
+void ParticleCollector::merge() const {
+	std::lock_guard<std::mutex> lock(mergeMutex);
+	for (size_t i = 0; i < threadContainers.size(); i++) {
+#ifdef _OPENMP
+		// the containers of the other threads are in use
+		if (omp_in_parallel() and (i != size_t(omp_get_thread_num())))
+			continue;
+#endif
+		ThreadContainer &t = threadContainers[i];
+		container.insert(container.end(), t.candidates.begin(), t.candidates.end());
+		records.insert(records.end(), t.records.begin(), t.records.end());
+		tContainer().swap(t.candidates);
+		std::vector<CompactCandidate>().swap(t.records);
+	}
+}
+
+static void toCompactState(const ParticleState &state, CompactParticleState &compact) {
+	compact.energy = state.getEnergy();
+	const Vector3d &position = state.getPosition();
+	const Vector3d &direction = state.getDirection();
+	for (int i = 0; i < 3; i++) {
+		compact.position[i] = position.data[i];
+		compact.direction[i] = direction.data[i];
+	}
+	compact.id = state.getId();
+}
+
+static void fromCompactState(const CompactParticleState &compact, ParticleState &state) {
+	state.setId(compact.id);
+	state.setEnergy(compact.energy);
+	state.setPosition(Vector3d(compact.position[0], compact.position[1], compact.position[2]));
+	state.setDirection(Vector3d(compact.direction[0], compact.direction[1], compact.direction[2]));
+}
+
+CompactCandidate ParticleCollector::toRecord(const Candidate *candidate) {
+	CompactCandidate record;
+	toCompactState(candidate->current, record.current);
+	toCompactState(candidate->source, record.source);
+	toCompactState(candidate->created, record.created);
+	record.weight = candidate->getWeight();
+	record.trajectoryLength = candidate->getTrajectoryLength();
+	record.redshift = candidate->getRedshift();
+	record.reserved = 0;
+	record.serialNumber = candidate->getSerialNumber();
+	record.sourceSerialNumber = candidate->getSourceSerialNumber();
+	record.createdSerialNumber = candidate->getCreatedSerialNumber();
+	record.randomStream = candidate->randomStream;
+	record.randomStart = candidate->randomStart;
+	return record;
+}
+
+ref_ptr<Candidate> ParticleCollector::toCandidate(const CompactCandidate &record) {
+	ref_ptr<Candidate> candidate = new Candidate;
+	fromCompactState(record.source, candidate->source);
+	fromCompactState(record.created, candidate->created);
+	fromCompactState(record.current, candidate->current);
+	candidate->previous = candidate->current;
+	candidate->setWeight(record.weight);
+	candidate->setRedshift(record.redshift);
+	candidate->setTrajectoryLength(record.trajectoryLength);
+	candidate->setActive(false);
+	candidate->serialNumber = record.serialNumber;
+	candidate->sourceSerialNumber = record.sourceSerialNumber;
+	candidate->createdSerialNumber = record.createdSerialNumber;
+	candidate->detached = true;
+	candidate->setRandomStream(record.randomStream, record.randomStart);
+	return candidate;
 }
 
 void ParticleCollector::process(ref_ptr<Candidate> c) const {
 	ParticleCollector::process((Candidate*) c);
 }
 
-void ParticleCollector::reprocess(Module *action) const {
+void ParticleCollector::reprocess(Module *action, std::size_t segmentSize, ModuleList *settings) const {
+	merge();
+	ref_ptr<ModuleList> list = settings;
+	if (not list.valid()) {
+		ModuleListRunner *runner = dynamic_cast<ModuleListRunner *>(action);
+		if (runner)
+			list = runner->getModuleList();
+	}
+	if (not list.valid())
+		list = new ModuleList();
+
+	if (compact) {
+		list->apply(action, records.size(), [this](size_t i) {
+			return toCandidate(records[i]);
+		}, segmentSize);
+		return;
+	}
+	list->apply(action, container.size(), [this](size_t i) {
+		return clone ? container[i]->clone(false) : container[i];
+	}, segmentSize);
+}
+
+// in the order of the candidates
+void ParticleCollector::reprocessSerial(Module *action) const {
+	merge();
+	if (compact) {
+		for (size_t i = 0; i < records.size(); i++)
+			action->process(toCandidate(records[i]));
+		return;
+	}
 	for (ParticleCollector::iterator itr = container.begin(); itr != container.end(); ++itr){
 		if (clone)
 			action->process((*(itr->get())).clone(false));
@@ -45,12 +188,361 @@ void ParticleCollector::reprocess(Module *action) const {
 
 void ParticleCollector::dump(const std::string &filename) const {
 	TextOutput output(filename.c_str(), Output::Everything);
-	reprocess(&output);
+	reprocessSerial(&output);
 	output.close();
 }
 
+static const char dumpMagic[8] = {'C', 'R', 'P', 'C', 'O', 'L', '0', '1'};
+static const uint32_t dumpVersion = 1;
+static const size_t dumpHeaderSize = 64;
+static const size_t dumpChunkSize = 65536; // records encoded at once
+
+struct DumpHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	uint64_t n;
+	uint64_t propertiesSize;
+	char pad[dumpHeaderSize - 32];
+};
+
+struct DumpState {
+	double energy;
+	double position[3];
+	double direction[3];
+	int32_t id;
+	uint32_t reserved;
+};
+
+struct ParticleCollector::DumpRecord {
+	DumpState current, previous, source, created;
+	double weight, redshift, trajectoryLength, currentStep, nextStep;
+	uint64_t serialNumber, sourceSerialNumber, createdSerialNumber;
+	uint64_t randomStream, randomCounter, randomStart, createdSecondaries;
+	uint64_t properties; // offset in the properties
+	uint32_t nProperties;
+	uint32_t active;
+};
+
+// read-only mapping of a binary dump
+class ParticleCollector::DumpMapping {
+	void *mapping;
+	size_t mappingSize;
+public:
+	const DumpRecord *records;
+	const char *properties;
+	size_t n, propertiesSize;
+
+	DumpMapping(const std::string &filename) : mapping(NULL), mappingSize(0) {
+		int fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw std::runtime_error("ParticleCollector: could not open " + filename);
+		DumpHeader h;
+		struct stat st;
+		if ((read(fd, &h, sizeof(h)) != ssize_t(sizeof(h))) or (fstat(fd, &st) != 0)) {
+			close(fd);
+			throw std::runtime_error("ParticleCollector: could not read " + filename);
+		}
+		if ((memcmp(h.magic, dumpMagic, sizeof(dumpMagic)) != 0) or (h.version != dumpVersion)
+				or (h.recordSize != sizeof(DumpRecord))) {
+			close(fd);
+			throw std::runtime_error("ParticleCollector: " + filename + " is not a binary dump of this version");
+		}
+		mappingSize = dumpHeaderSize + h.n * sizeof(DumpRecord) + h.propertiesSize;
+		if (size_t(st.st_size) != mappingSize) {
+			close(fd);
+			throw std::runtime_error("ParticleCollector: size of " + filename + " does not match its header");
+		}
+		void *m = mmap(0, mappingSize, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (m == MAP_FAILED)
+			throw std::runtime_error("ParticleCollector: could not map " + filename);
+		mapping = m;
+		n = h.n;
+		propertiesSize = h.propertiesSize;
+		records = reinterpret_cast<const DumpRecord*>(static_cast<const char*>(m) + dumpHeaderSize);
+		properties = reinterpret_cast<const char*>(records + n);
+	}
+
+	~DumpMapping() {
+		munmap(mapping, mappingSize);
+	}
+
+	static bool isDump(const std::string &filename) {
+		std::ifstream in(filename.c_str(), std::ios::binary);
+		char magic[8] = {0};
+		in.read(magic, sizeof(magic));
+		return in and (memcmp(magic, dumpMagic, sizeof(magic)) == 0);
+	}
+};
+
+static void toDumpState(const ParticleState &state, DumpState &dump) {
+	dump.energy = state.getEnergy();
+	const Vector3d &position = state.getPosition();
+	const Vector3d &direction = state.getDirection();
+	for (int i = 0; i < 3; i++) {
+		dump.position[i] = position.data[i];
+		dump.direction[i] = direction.data[i];
+	}
+	dump.id = state.getId();
+	dump.reserved = 0;
+}
+
+static void fromDumpState(const DumpState &dump, ParticleState &state) {
+	state.setId(dump.id);
+	state.setEnergy(dump.energy);
+	state.setPosition(Vector3d(dump.position[0], dump.position[1], dump.position[2]));
+	state.setDirection(Vector3d(dump.direction[0], dump.direction[1], dump.direction[2]));
+}
+
+static void toCompactState(const DumpState &dump, CompactParticleState &compact) {
+	compact.energy = dump.energy;
+	for (int i = 0; i < 3; i++) {
+		compact.position[i] = dump.position[i];
+		compact.direction[i] = dump.direction[i];
+	}
+	compact.id = dump.id;
+}
+
+static void appendUInt32(std::string &buffer, uint32_t value) {
+	buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static uint32_t readUInt32(const char *&p, const char *end) {
+	uint32_t value;
+	if (p + sizeof(value) > end)
+		throw std::runtime_error("ParticleCollector: truncated properties in binary dump");
+	memcpy(&value, p, sizeof(value));
+	p += sizeof(value);
+	return value;
+}
+
+template<typename T>
+static Variant readValue(const char *p, size_t size) {
+	if (size != sizeof(T))
+		throw std::runtime_error("ParticleCollector: property of wrong size in binary dump");
+	T value;
+	memcpy(&value, p, sizeof(T));
+	return Variant(value);
+}
+
+static Variant readVariant(Variant::Type type, const char *p, size_t size) {
+	switch (type) {
+	case Variant::TYPE_NONE:
+		return Variant();
+	case Variant::TYPE_BOOL:
+		return readValue<bool>(p, size);
+	case Variant::TYPE_CHAR:
+		return readValue<char>(p, size);
+	case Variant::TYPE_UCHAR:
+		return readValue<unsigned char>(p, size);
+	case Variant::TYPE_INT16:
+		return readValue<int16_t>(p, size);
+	case Variant::TYPE_UINT16:
+		return readValue<uint16_t>(p, size);
+	case Variant::TYPE_INT32:
+		return readValue<int32_t>(p, size);
+	case Variant::TYPE_UINT32:
+		return readValue<uint32_t>(p, size);
+	case Variant::TYPE_INT64:
+		return readValue<int64_t>(p, size);
+	case Variant::TYPE_UINT64:
+		return readValue<uint64_t>(p, size);
+	case Variant::TYPE_FLOAT:
+		return readValue<float>(p, size);
+	case Variant::TYPE_DOUBLE:
+		return readValue<double>(p, size);
+	case Variant::TYPE_STRING:
+		return Variant(std::string(p, size));
+	}
+	throw std::runtime_error("ParticleCollector: unknown property type in binary dump");
+}
+
+void ParticleCollector::toDump(const Candidate *candidate, DumpRecord &record, std::string &properties) {
+	toDumpState(candidate->current, record.current);
+	toDumpState(candidate->previous, record.previous);
+	toDumpState(candidate->source, record.source);
+	toDumpState(candidate->created, record.created);
+	record.weight = candidate->weight;
+	record.redshift = candidate->redshift;
+	record.trajectoryLength = candidate->trajectoryLength;
+	record.currentStep = candidate->currentStep;
+	record.nextStep = candidate->nextStep;
+	record.serialNumber = candidate->getSerialNumber();
+	record.sourceSerialNumber = candidate->getSourceSerialNumber();
+	record.createdSerialNumber = candidate->getCreatedSerialNumber();
+	record.randomStream = candidate->randomStream;
+	record.randomCounter = candidate->randomCounter;
+	record.randomStart = candidate->randomStart;
+	record.createdSecondaries = candidate->createdSecondaries;
+	record.active = candidate->active;
+
+	const Candidate::PropertyMap &map = candidate->getProperties();
+	record.properties = properties.size();
+	record.nProperties = map.size();
+	std::vector<char> value;
+	for (Candidate::PropertyMap::const_iterator i = map.begin(); i != map.end(); ++i) {
+		const std::string &name = Candidate::getPropertyName(i->first);
+		appendUInt32(properties, name.size());
+		properties.append(name);
+		appendUInt32(properties, i->second.getType());
+		size_t size = i->second.getSize();
+		value.resize(size);
+		if (size > 0)
+			i->second.copyToBuffer(&value[0]);
+		appendUInt32(properties, size);
+		properties.append(value.begin(), value.end());
+	}
+}
+
+ref_ptr<Candidate> ParticleCollector::fromDump(const DumpRecord &record, const char *properties,
+		size_t propertiesSize) {
+	ref_ptr<Candidate> candidate = new Candidate;
+	fromDumpState(record.current, candidate->current);
+	fromDumpState(record.previous, candidate->previous);
+	fromDumpState(record.source, candidate->source);
+	fromDumpState(record.created, candidate->created);
+	candidate->weight = record.weight;
+	candidate->redshift = record.redshift;
+	candidate->trajectoryLength = record.trajectoryLength;
+	candidate->currentStep = record.currentStep;
+	candidate->nextStep = record.nextStep;
+	candidate->serialNumber = record.serialNumber;
+	candidate->sourceSerialNumber = record.sourceSerialNumber;
+	candidate->createdSerialNumber = record.createdSerialNumber;
+	candidate->detached = true;
+	candidate->randomStream = record.randomStream;
+	candidate->randomCounter = record.randomCounter;
+	candidate->randomStart = record.randomStart;
+	candidate->createdSecondaries = record.createdSecondaries;
+	candidate->setActive(record.active);
+
+	if (record.properties > propertiesSize)
+		throw std::runtime_error("ParticleCollector: truncated properties in binary dump");
+	const char *p = properties + record.properties, *end = properties + propertiesSize;
+	for (uint32_t k = 0; k < record.nProperties; k++) {
+		uint32_t length = readUInt32(p, end);
+		if (p + length > end)
+			throw std::runtime_error("ParticleCollector: truncated properties in binary dump");
+		std::string name(p, length);
+		p += length;
+		Variant::Type type = Variant::Type(readUInt32(p, end));
+		uint32_t size = readUInt32(p, end);
+		if (p + size > end)
+			throw std::runtime_error("ParticleCollector: truncated properties in binary dump");
+		candidate->setProperty(Candidate::getPropertyKey(name), readVariant(type, p, size));
+		p += size;
+	}
+	return candidate;
+}
+
+CompactCandidate ParticleCollector::toRecord(const DumpRecord &dump) {
+	CompactCandidate record;
+	toCompactState(dump.current, record.current);
+	toCompactState(dump.source, record.source);
+	toCompactState(dump.created, record.created);
+	record.weight = dump.weight;
+	record.trajectoryLength = dump.trajectoryLength;
+	record.redshift = dump.redshift;
+	record.reserved = 0;
+	record.serialNumber = dump.serialNumber;
+	record.sourceSerialNumber = dump.sourceSerialNumber;
+	record.createdSerialNumber = dump.createdSerialNumber;
+	record.randomStream = dump.randomStream;
+	record.randomStart = dump.randomStart;
+	return record;
+}
+
+void ParticleCollector::dumpBinary(const std::string &filename) const {
+	size_t n = size();
+	std::ofstream out(filename.c_str(), std::ios::binary);
+	if (!out)
+		throw std::runtime_error("ParticleCollector: could not open " + filename);
+
+	DumpHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, dumpMagic, sizeof(dumpMagic));
+	header.version = dumpVersion;
+	header.recordSize = sizeof(DumpRecord);
+	header.n = n;
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	// the records are written in chunks, the properties follow them
+	std::string properties;
+	std::vector<DumpRecord> chunk(std::min(n, dumpChunkSize));
+	for (size_t begin = 0; begin < n; begin += dumpChunkSize) {
+		size_t end = std::min(begin + dumpChunkSize, n);
+		for (size_t i = begin; i < end; i++) {
+			DumpRecord &record = chunk[i - begin];
+			memset(&record, 0, sizeof(record));
+			if (compact)
+				toDump(toCandidate(records[i]), record, properties);
+			else
+				toDump(container[i], record, properties);
+		}
+		out.write(reinterpret_cast<const char*>(&chunk[0]), (end - begin) * sizeof(DumpRecord));
+	}
+	out.write(properties.data(), properties.size());
+
+	header.propertiesSize = properties.size();
+	out.seekp(0);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	if (!out)
+		throw std::runtime_error("ParticleCollector: could not write " + filename);
+}
+
 void ParticleCollector::load(const std::string &filename){
-	TextOutput::load(filename.c_str(), this);
+	if (not DumpMapping::isDump(filename)) {
+		TextOutput::load(filename.c_str(), this);
+		return;
+	}
+
+	DumpMapping dump(filename);
+	merge();
+	std::lock_guard<std::mutex> lock(mergeMutex);
+	size_t offset = compact ? records.size() : container.size();
+	if (compact)
+		records.resize(offset + dump.n);
+	else
+		container.resize(offset + dump.n);
+
+	std::string error;
+#pragma omp parallel for schedule(static, 1024)
+	for (size_t i = 0; i < dump.n; i++) {
+		try {
+			if (compact)
+				records[offset + i] = toRecord(dump.records[i]);
+			else
+				container[offset + i] = fromDump(dump.records[i], dump.properties, dump.propertiesSize);
+		} catch (std::exception &e) {
+#pragma omp critical(ParticleCollectorLoad)
+			error = e.what();
+		}
+	}
+	if (not error.empty()) {
+		if (compact)
+			records.resize(offset);
+		else
+			container.resize(offset);
+		throw std::runtime_error(error);
+	}
+}
+
+void ParticleCollector::reprocessDump(const std::string &filename, Module *action) {
+	DumpMapping dump(filename);
+	std::string error;
+#pragma omp parallel for schedule(static, 1024)
+	for (size_t i = 0; i < dump.n; i++) {
+		try {
+			ref_ptr<Candidate> candidate = fromDump(dump.records[i], dump.properties, dump.propertiesSize);
+			action->process(candidate);
+		} catch (std::exception &e) {
+#pragma omp critical(ParticleCollectorLoad)
+			error = e.what();
+		}
+	}
+	if (not error.empty())
+		throw std::runtime_error("ParticleCollector::reprocessDump: " + error);
 }
 
 ParticleCollector::~ParticleCollector() {
@@ -58,18 +550,39 @@ ParticleCollector::~ParticleCollector() {
 }
 
 std::size_t ParticleCollector::size() const {
-        return container.size();
+	merge();
+	return compact ? records.size() : container.size();
 }
 
 ref_ptr<Candidate> ParticleCollector::operator[](const std::size_t i) const {
+	merge();
+	if (compact)
+		return toCandidate(records[i]);
 	return container[i];
 }
 
+const CompactCandidate &ParticleCollector::getRecord(const std::size_t i) const {
+	if (not compact)
+		throw std::runtime_error("ParticleCollector: records are only kept in compact mode");
+	merge();
+	return records.at(i);
+}
+
+const std::vector<CompactCandidate> &ParticleCollector::getRecords() const {
+	if (not compact)
+		throw std::runtime_error("ParticleCollector: records are only kept in compact mode");
+	merge();
+	return records;
+}
+
 void ParticleCollector::clearContainer() {
+	merge();
         container.clear();
+	records.clear();
 }
 
 std::vector<ref_ptr<Candidate> >& ParticleCollector::getContainer() const {
+	merge();
         return container;
 }
 
@@ -81,28 +594,53 @@ bool ParticleCollector::getClone() const {
         return clone;
 }
 
+void ParticleCollector::setCompact(bool b) {
+	if ((b != compact) and (size() > 0))
+		throw std::runtime_error("ParticleCollector: the mode cannot be changed while collecting");
+	compact = b;
+}
+
+bool ParticleCollector::getCompact() const {
+	return compact;
+}
+
 std::string ParticleCollector::getDescription() const {
         return "ParticleCollector";
 }
 
+size_t ParticleCollector::getMemoryUsage() const {
+	size_t bytes = memoryUsage(container) + container.size() * sizeof(Candidate)
+			+ memoryUsage(records) + memoryUsage(threadContainers);
+	for (size_t i = 0; i < threadContainers.size(); i++) {
+		const ThreadContainer &t = threadContainers[i];
+		bytes += memoryUsage(t.candidates) + t.candidates.size() * sizeof(Candidate)
+				+ memoryUsage(t.records);
+	}
+	return bytes;
+}
+
 ParticleCollector::iterator ParticleCollector::begin() {
+	merge();
 	return container.begin();
 }
 
 ParticleCollector::const_iterator ParticleCollector::begin() const {
+	merge();
 	return container.begin();
 }
 
 ParticleCollector::iterator ParticleCollector::end() {
+	merge();
 	return container.end();
 }
 
 ParticleCollector::const_iterator ParticleCollector::end() const {
+	merge();
 	return container.end();
 }
 
 void ParticleCollector::getTrajectory(ModuleList* mlist, std::size_t i, Module *output) const {
-	ref_ptr<Candidate> c_tmp = container[i]->clone();
+	ref_ptr<Candidate> c_tmp = (*this)[i]->clone();
 
 	c_tmp->restart();
 
@@ -115,4 +653,76 @@ void ParticleCollector::getTrajectory(ref_ptr<ModuleList> mlist, std::size_t i,
 	ParticleCollector::getTrajectory((ModuleList*) mlist, i, (Module*) output);
 }
 
+std::vector<ref_ptr<Candidate> > ParticleCollector::restartCandidates(
+		const std::vector<std::size_t> &indices) const {
+	// copied before the parallel section, the reruns may be collected again
+	size_t n = size();
+	std::vector<ref_ptr<Candidate> > candidates(indices.size());
+	for (size_t k = 0; k < indices.size(); k++) {
+		if (indices[k] >= n)
+			throw std::runtime_error("ParticleCollector::getTrajectories: no candidate " + std::to_string(indices[k]));
+		candidates[k] = compact ? toCandidate(records[indices[k]]) : container[indices[k]]->clone();
+		candidates[k]->restart();
+	}
+	return candidates;
+}
+
+void ParticleCollector::getTrajectories(ModuleList *mlist, const std::vector<std::size_t> &indices,
+		const std::vector<ref_ptr<Module> > &outputs) const {
+	if (outputs.empty())
+		throw std::runtime_error("ParticleCollector::getTrajectories: no outputs");
+	std::vector<ref_ptr<Candidate> > candidates = restartCandidates(indices);
+
+	std::string error;
+	// the modules of mlist are shared, the outputs are per thread
+#pragma omp parallel num_threads(outputs.size())
+	{
+		size_t thread = 0;
+#ifdef _OPENMP
+		thread = omp_get_thread_num();
+#endif
+		ModuleList traced;
+		traced.add(mlist);
+		traced.add(outputs[thread]);
+
+#pragma omp for schedule(dynamic)
+		for (size_t k = 0; k < indices.size(); k++) {
+			try {
+				traced.run(candidates[k], false);
+			} catch (std::exception &e) {
+#pragma omp critical(getTrajectoriesError)
+				error = e.what();
+			}
+		}
+	}
+	if (not error.empty())
+		throw std::runtime_error("ParticleCollector::getTrajectories: " + error);
+}
+
+std::vector<ref_ptr<ParticleCollector> > ParticleCollector::getTrajectories(ModuleList *mlist,
+		const std::vector<std::size_t> &indices) const {
+	std::vector<ref_ptr<Candidate> > candidates = restartCandidates(indices);
+
+	std::vector<ref_ptr<ParticleCollector> > trajectories(indices.size());
+	for (size_t k = 0; k < indices.size(); k++)
+		trajectories[k] = new ParticleCollector(0, true);
+
+	std::string error;
+#pragma omp parallel for schedule(dynamic)
+	for (size_t k = 0; k < indices.size(); k++) {
+		try {
+			ModuleList traced;
+			traced.add(mlist);
+			traced.add(trajectories[k]);
+			traced.run(candidates[k], false);
+		} catch (std::exception &e) {
+#pragma omp critical(getTrajectoriesError)
+			error = e.what();
+		}
+	}
+	if (not error.empty())
+		throw std::runtime_error("ParticleCollector::getTrajectories: " + error);
+	return trajectories;
+}
+
 } // namespace crpropa
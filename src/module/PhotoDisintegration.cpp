@@ -1,14 +1,18 @@
 #include "crpropa/module/PhotoDisintegration.h"
 #include "crpropa/Units.h"
+#include "crpropa/Common.h"
 #include "crpropa/ParticleID.h"
 #include "crpropa/ParticleMass.h"
 #include "crpropa/Random.h"
+#include "crpropa/NumericTable.h"
+#include "crpropa/TableRegistry.h"
+#include "crpropa/Trace.h"
 #include "kiss/logger.h"
 
+#include <algorithm>
 #include <cmath>
 #include <limits>
-#include <sstream>
-#include <fstream>
+#include <memory>
 #include <stdexcept>
 
 namespace crpropa {
@@ -16,164 +20,365 @@ namespace crpropa {
 const double PhotoDisintegration::lgmin = 6;  // minimum log10(Lorentz-factor)
 const double PhotoDisintegration::lgmax = 14; // maximum log10(Lorentz-factor)
 const size_t PhotoDisintegration::nlg = 201;  // number of Lorentz-factor steps
+const size_t PhotoDisintegration::nlgStride = 208; // 201 doubles padded to 64 bytes
+
+// change of mass and charge number in a disintegration channel
+static void channelLoss(int channel, int &dA, int &dZ) {
+	int nNeutron = digit(channel, 100000);
+	int nProton = digit(channel, 10000);
+	int nH2 = digit(channel, 1000);
+	int nH3 = digit(channel, 100);
+	int nHe3 = digit(channel, 10);
+	int nHe4 = digit(channel, 1);
+	dA = -nNeutron - nProton - 2 * nH2 - 3 * nH3 - 3 * nHe3 - 4 * nHe4;
+	dZ = -nProton - nH2 - nH3 - 2 * nHe3 - 2 * nHe4;
+}
+
+// number of doubles rounded up to a multiple of a cache line
+static size_t padToCacheLine(size_t n) {
+	return (n + 7) / 8 * 8;
+}
+
+PhotoDisintegration::AlignedTable::AlignedTable() : offset(0) {
+}
+
+PhotoDisintegration::AlignedTable::AlignedTable(const AlignedTable &other) : offset(0) {
+	*this = other;
+}
+
+PhotoDisintegration::AlignedTable &PhotoDisintegration::AlignedTable::operator=(const AlignedTable &other) {
+	// realign, the copied storage may start elsewhere in the cache line
+	if (this != &other)
+		assign(std::vector<double>(other.data(), other.data() + other.size()));
+	return *this;
+}
+
+void PhotoDisintegration::AlignedTable::assign(const std::vector<double> &values) {
+	storage.assign(values.size() + 8, 0);
+	void *pointer = storage.data();
+	size_t space = storage.size() * sizeof(double);
+	offset = (double *)std::align(64, sizeof(double), pointer, space) - storage.data();
+	std::copy(values.begin(), values.end(), storage.begin() + offset);
+}
+
+const double *PhotoDisintegration::AlignedTable::data() const {
+	return storage.data() + offset;
+}
+
+size_t PhotoDisintegration::AlignedTable::size() const {
+	return storage.empty() ? 0 : storage.size() - 8;
+}
+
+PhotoDisintegration::Tables::Tables() : rateLoaded(false), branchingLoaded(false),
+		emissionLoaded(false), registered(false) {
+}
 
 PhotoDisintegration::PhotoDisintegration(ref_ptr<PhotonField> f, bool havePhotons, double limit) {
 	setPhotonField(f);
 	this->havePhotons = havePhotons;
 	this->limit = limit;
+	continuousLoss = false;
 }
 
 void PhotoDisintegration::setPhotonField(ref_ptr<PhotonField> photonField) {
 	this->photonField = photonField;
+	if (isotopes)
+		isotopes->addPhotonField(photonField);
+	setDescription("PhotoDisintegration: " + photonField->getFieldName());
+	tables = 0;
+	prepared.reset(new std::once_flag);
+}
+
+void PhotoDisintegration::loadTables() {
 	std::string fname = photonField->getFieldName();
-	setDescription("PhotoDisintegration: " + fname);
-	initRate(getDataPath("Photodisintegration/rate_" + fname + ".txt"));
-	initBranching(getDataPath("Photodisintegration/branching_" + fname + ".txt"));
-	initPhotonEmission(getDataPath("Photodisintegration/photon_emission_" + fname.substr(0,3) + ".txt"));
+	std::string rateFile = getDataPath("Photodisintegration/rate_" + fname + ".txt");
+	std::string branchingFile = getDataPath("Photodisintegration/branching_" + fname + ".txt");
+	std::string emissionFile = getDataPath("Photodisintegration/photon_emission_" + fname.substr(0,3) + ".txt");
+
+	// share the tables with other instances for the same field and files
+	bool shared = !tables or tables->registered;
+	std::string files = rateFile + ";" + branchingFile + (havePhotons ? ";" + emissionFile : "");
+	if (isotopes)
+		files += ";" + isotopes->getKey();
+	std::string key = TableRegistry::key("PhotoDisintegration", fname, files);
+	if (shared) {
+		ref_ptr<Tables> registered = TableRegistry::find<Tables>(key);
+		if (registered) {
+			tables = registered;
+			return;
+		}
+	}
+
+	// parse only the files of the tables not loaded yet
+	if (!tables or !tables->rateLoaded)
+		initRate(rateFile);
+	if (!tables->branchingLoaded)
+		initBranching(branchingFile);
+	if (havePhotons and !tables->emissionLoaded)
+		initPhotonEmission(emissionFile);
+	if (shared) {
+		tables->registered = true;
+		tables = TableRegistry::insert(key, tables);
+	}
+}
+
+void PhotoDisintegration::requireTables() const {
+	std::call_once(*prepared, &PhotoDisintegration::loadTables, const_cast<PhotoDisintegration*>(this));
+}
+
+void PhotoDisintegration::prepare() {
+	requireTables();
+}
+
+void PhotoDisintegration::detachTables() {
+	if (!tables) {
+		tables = new Tables();
+		Nucleus empty = {-1, 0, 0, 0};
+		tables->pdNucleus.resize(27 * 31, empty);
+	} else if (tables->getReferenceCount() > 1)
+		tables = new Tables(*tables);
+	tables->registered = false;
 }
 
 void PhotoDisintegration::setHavePhotons(bool havePhotons) {
 	this->havePhotons = havePhotons;
+	prepared.reset(new std::once_flag); // the photon emission tables may be needed
 }
 
 void PhotoDisintegration::setLimit(double limit) {
 	this->limit = limit;
 }
 
-void PhotoDisintegration::initRate(std::string filename) {
-	std::ifstream infile(filename.c_str());
-	if (not infile.good())
-		throw std::runtime_error("PhotoDisintegration: could not open file " + filename);
+void PhotoDisintegration::setIsotopeSelection(ref_ptr<IsotopeSelection> isotopes) {
+	this->isotopes = isotopes;
+	if (isotopes)
+		isotopes->addPhotonField(photonField);
+	tables = 0;
+	prepared.reset(new std::once_flag);
+}
 
-	// clear previously loaded interaction rates
-	pdRate.clear();
-	pdRate.resize(27 * 31);
+ref_ptr<IsotopeSelection> PhotoDisintegration::getIsotopeSelection() const {
+	return isotopes;
+}
 
-	std::string line;
-	while (std::getline(infile, line)) {
-		if (line[0] == '#')
-			continue;
-		std::stringstream lineStream(line);
+void PhotoDisintegration::setContinuousLoss(bool b) {
+	continuousLoss = b;
+}
 
-		int Z, N;
-		lineStream >> Z;
-		lineStream >> N;
+bool PhotoDisintegration::getContinuousLoss() const {
+	return continuousLoss;
+}
 
-		double r;
-		for (size_t i = 0; i < nlg; i++) {
-			lineStream >> r;
-			pdRate[Z * 31 + N].push_back(r / Mpc);
-		}
-	}
-	infile.close();
+// table rows of a data file, with at least the given number of columns
+static ref_ptr<NumericTable> loadTable(const std::string &filename, size_t minColumns) {
+	ref_ptr<NumericTable> table = NumericTable::load(filename);
+	for (size_t r = 0; r < table->rows(); r++)
+		if (table->rowSize(r) < minColumns)
+			throw std::runtime_error("PhotoDisintegration: incomplete row in " + filename);
+	return table;
 }
 
-void PhotoDisintegration::initBranching(std::string filename) {
-	std::ifstream infile(filename.c_str());
-	if (not infile.good())
-		throw std::runtime_error("PhotoDisintegration: could not open file " + filename);
+void PhotoDisintegration::initRate(std::string filename) {
+	CRPROPA_TRACE_SPAN("PhotoDisintegration::initRate", "tables");
+	ref_ptr<NumericTable> table = loadTable(filename, 2 + nlg);
+	detachTables();
 
 	// clear previously loaded interaction rates
-	pdBranch.clear();
-	pdBranch.resize(27 * 31);
-
-	std::string line;
-	while (std::getline(infile, line)) {
-		if (line[0] == '#')
+	for (size_t i = 0; i < tables->pdNucleus.size(); i++)
+		tables->pdNucleus[i].rate = -1;
+	std::vector<double> rates;
+
+	for (size_t r = 0; r < table->rows(); r++) {
+		const double *row = table->row(r);
+		int Z = row[0];
+		int N = row[1];
+		if (isotopes and not isotopes->contains(Z, N))
 			continue;
 
-		std::stringstream lineStream(line);
-
-		int Z, N;
-		lineStream >> Z;
-		lineStream >> N;
-
-		Branch branch;
-		lineStream >> branch.channel;
-
-		double r;
-		for (size_t i = 0; i < nlg; i++) {
-			lineStream >> r;
-			branch.branchingRatio.push_back(r);
-		}
+		size_t offset = rates.size();
+		rates.resize(offset + nlgStride, 0);
+		for (size_t i = 0; i < nlg; i++)
+			rates[offset + i] = row[2 + i] / Mpc;
+		tables->pdNucleus[Z * 31 + N].rate = offset;
+	}
+	tables->pdRate.assign(rates);
+	tables->rateLoaded = true;
+}
 
-		pdBranch[Z * 31 + N].push_back(branch);
+void PhotoDisintegration::initBranching(std::string filename) {
+	CRPROPA_TRACE_SPAN("PhotoDisintegration::initBranching", "tables");
+	ref_ptr<NumericTable> file = loadTable(filename, 3 + nlg);
+	detachTables();
+
+	// branches of each nucleus in the order of the file
+	std::vector<std::vector<int> > channels(tables->pdNucleus.size());
+	std::vector<std::vector<const double*> > ratios(tables->pdNucleus.size());
+
+	for (size_t r = 0; r < file->rows(); r++) {
+		const double *row = file->row(r);
+		int Z = row[0];
+		int N = row[1];
+		int channel = row[2];
+		if (isotopes and not isotopes->contains(Z, N))
+			continue;
+		channels[Z * 31 + N].push_back(channel);
+		ratios[Z * 31 + N].push_back(row + 3);
 	}
 
-	infile.close();
+	// flatten, the ratios of one nucleus are stored by Lorentz factor bin
+	// so that the channel selection reads consecutive values
+	tables->pdChannel.clear();
+	std::vector<double> table;
+	for (size_t idx = 0; idx < tables->pdNucleus.size(); idx++) {
+		Nucleus &nucleus = tables->pdNucleus[idx];
+		size_t n = channels[idx].size();
+		nucleus.firstBranch = tables->pdChannel.size();
+		nucleus.nBranch = n;
+		nucleus.branching = table.size();
+		if (n == 0)
+			continue;
+		tables->pdChannel.insert(tables->pdChannel.end(), channels[idx].begin(), channels[idx].end());
+		table.resize(table.size() + padToCacheLine(n * nlg), 0);
+		for (size_t l = 0; l < nlg; l++)
+			for (size_t b = 0; b < n; b++)
+				table[nucleus.branching + l * n + b] = ratios[idx][b][l];
+	}
+	tables->pdBranching.assign(table);
+	tables->branchingLoaded = true;
+	linkPhotonEmission();
 }
 
 void PhotoDisintegration::initPhotonEmission(std::string filename) {
-	std::ifstream infile(filename.c_str());
-	if (not infile.good())
-		throw std::runtime_error("PhotoDisintegration: could not open file " + filename);
+	CRPROPA_TRACE_SPAN("PhotoDisintegration::initPhotonEmission", "tables");
+	ref_ptr<NumericTable> table = loadTable(filename, 5 + nlg);
+	detachTables();
 
 	// clear previously loaded emission probabilities
-	pdPhoton.clear();
-
-	std::string line;
-	while (std::getline(infile, line)) {
-		if (line[0] == '#')
+	tables->photonEmissions.clear();
+
+	for (size_t r = 0; r < table->rows(); r++) {
+		const double *row = table->row(r);
+		int Z = row[0];
+		int N = row[1];
+		int Zd = row[2];
+		int Nd = row[3];
+		if (isotopes and not isotopes->contains(Z, N))
 			continue;
 
-		std::stringstream lineStream(line);
-
-		int Z, N, Zd, Nd;
-		lineStream >> Z;
-		lineStream >> N;
-		lineStream >> Zd;
-		lineStream >> Nd;
-
 		PhotonEmission em;
-		lineStream >> em.energy;
-		em.energy *= eV;
-
-		double r;
-		for (size_t i = 0; i < nlg; i++) {
-			lineStream >> r;
-			em.emissionProbability.push_back(r);
-		}
+		em.energy = row[4] * eV;
+		em.emissionProbability.assign(row + 5, row + 5 + nlg);
 
 		int key = Z * 1000000 + N * 10000 + Zd * 100 + Nd;
-		if (pdPhoton.find(key) == pdPhoton.end()) {
-			std::vector<PhotonEmission> emissions;
-			pdPhoton[key] = emissions;
+		tables->photonEmissions[key].push_back(em);
+	}
+	tables->emissionLoaded = true;
+
+	linkPhotonEmission();
+}
+
+void PhotoDisintegration::linkPhotonEmission() {
+	tables->pdPhotonOffset.assign(1, 0);
+	tables->pdPhotonEnergy.clear();
+	std::vector<double> table;
+	for (size_t idx = 0; idx < tables->pdNucleus.size(); idx++) {
+		const Nucleus &nucleus = tables->pdNucleus[idx];
+		int Z = idx / 31;
+		int N = idx % 31;
+		for (int b = nucleus.firstBranch; b < nucleus.firstBranch + nucleus.nBranch; b++) {
+			int dA, dZ;
+			channelLoss(tables->pdChannel[b], dA, dZ);
+			int key = Z * 1000000 + N * 10000 + (Z + dZ) * 100 + (N + dA - dZ);
+			std::map<int, std::vector<PhotonEmission> >::const_iterator it = tables->photonEmissions.find(key);
+			if (it != tables->photonEmissions.end()) {
+				for (size_t i = 0; i < it->second.size(); i++) {
+					const PhotonEmission &em = it->second[i];
+					tables->pdPhotonEnergy.push_back(em.energy);
+					table.insert(table.end(), em.emissionProbability.begin(), em.emissionProbability.end());
+					table.resize(table.size() + nlgStride - nlg, 0);
+				}
+			}
+			tables->pdPhotonOffset.push_back(tables->pdPhotonEnergy.size());
 		}
-		pdPhoton[key].push_back(em);
 	}
+	tables->pdPhotonProbability.assign(table);
+}
 
-	infile.close();
+unsigned int PhotoDisintegration::getParticleClasses() const {
+	return NucleusClass;
+}
+
+size_t PhotoDisintegration::getMemoryUsage() const {
+	if (!tables.valid())
+		return 0;
+	const Tables &t = *tables;
+	size_t bytes = memoryUsage(t.pdNucleus) + memoryUsage(t.pdChannel)
+			+ memoryUsage(t.pdPhotonOffset) + memoryUsage(t.pdPhotonEnergy)
+			+ (t.pdRate.size() + t.pdBranching.size() + t.pdPhotonProbability.size()) * sizeof(double);
+	std::map<int, std::vector<PhotonEmission> >::const_iterator it;
+	for (it = t.photonEmissions.begin(); it != t.photonEmissions.end(); ++it)
+		for (size_t i = 0; i < it->second.size(); i++)
+			bytes += sizeof(PhotonEmission) + memoryUsage(it->second[i].emissionProbability);
+	return bytes;
+}
+
+double PhotoDisintegration::interactionRate(const Candidate *candidate, const Nucleus *&nucleus, double &p) const {
+	requireTables();
+	// check if nucleus
+	int id = candidate->current.getId();
+	if (not isNucleus(id))
+		return 0;
+
+	int A = massNumber(id);
+	int Z = chargeNumber(id);
+	int N = A - Z;
+
+	// check if disintegration data available
+	if ((Z > 26) or (N > 30))
+		return 0;
+	nucleus = &tables->pdNucleus[Z * 31 + N];
+	if ((nucleus->rate < 0) or (nucleus->nBranch == 0))
+		return 0;
+
+	// position in the equidistant log10(Lorentz factor) tabulation, 0 outside
+	const Candidate::Kinematics &kin = candidate->getKinematics();
+	size_t i;
+	double f;
+	if (not kin.locate(lgmin, lgmax, nlg, i, f))
+		return 0;
+	p = i + f;
+	const double *rates = tables->pdRate.data() + nucleus->rate;
+	double rate = rates[i] + f * (rates[i + 1] - rates[i]);
+	double z = candidate->getRedshift();
+	return rate * pow_integer<2>(kin.redshiftFactor) * photonField->getRedshiftScaling(z); // cosmological scaling, rate per comoving distance
+}
+
+int PhotoDisintegration::selectBranch(const Nucleus &nucleus, double p) const {
+	int l = round(p); // index of closest tabulation point
+	const double *ratio = tables->pdBranching.data() + nucleus.branching + l * nucleus.nBranch;
+	double cmp = Random::instance().rand();
+	int b = 0;
+	while ((b < nucleus.nBranch) and (cmp > 0)) {
+		cmp -= ratio[b];
+		b++;
+	}
+	return nucleus.firstBranch + b - 1;
 }
 
 void PhotoDisintegration::process(Candidate *candidate) const {
+	if (continuousLoss) {
+		processContinuous(candidate);
+		return;
+	}
 	// execute the loop at least once for limiting the next step
 	double step = candidate->getCurrentStep();
 	do {
-		// check if nucleus
-		int id = candidate->current.getId();
-		if (not isNucleus(id))
+		const Nucleus *nucleus;
+		double p;
+		double rate = interactionRate(candidate, nucleus, p);
+		if (rate == 0)
 			return;
 
-		int A = massNumber(id);
-		int Z = chargeNumber(id);
-		int N = A - Z;
-		size_t idx = Z * 31 + N;
-
-		// check if disintegration data available
-		if ((Z > 26) or (N > 30))
-			return;
-		if (pdRate[idx].size() == 0)
-			return;
-
-		// check if in tabulated energy range
-		double z = candidate->getRedshift();
-		double lg = log10(candidate->current.getLorentzFactor() * (1 + z));
-		if ((lg <= lgmin) or (lg >= lgmax))
-			return;
-
-		double rate = interpolateEquidistant(lg, lgmin, lgmax, pdRate[idx]);
-		rate *= pow_integer<2>(1 + z) * photonField->getRedshiftScaling(z); // cosmological scaling, rate per comoving distance
-
 		// check if interaction occurs in this step
 		// otherwise limit next step to a fraction of the mean free path
 		Random &random = Random::instance();
@@ -184,22 +389,104 @@ void PhotoDisintegration::process(Candidate *candidate) const {
 		}
 
 		// select channel and interact
-		const std::vector<Branch> &branches = pdBranch[idx];
-		double cmp = random.rand();
-		int l = round((lg - lgmin) / (lgmax - lgmin) * (nlg - 1)); // index of closest tabulation point
-		size_t i = 0;
-		while ((i < branches.size()) and (cmp > 0)) {
-			cmp -= branches[i].branchingRatio[l];
-			i++;
-		}
-		performInteraction(candidate, branches[i-1].channel);
+		interact(candidate, selectBranch(*nucleus, p));
 
 		// repeat with remaining step
 		step -= randDist;
 	} while (step > 0);
 }
 
+void PhotoDisintegration::processContinuous(Candidate *candidate) const {
+	static const Candidate::PropertyKey lostKey[2] = {
+		Candidate::getPropertyKey("ContinuousLoss.protons"),
+		Candidate::getPropertyKey("ContinuousLoss.neutrons")};
+	const Nucleus *nucleus;
+	double p;
+	double rate = interactionRate(candidate, nucleus, p);
+	if (rate == 0)
+		return;
+	candidate->limitNextStep(limit / rate);
+
+	// mean numbers of protons and neutrons lost per interaction
+	size_t i = floor(p);
+	const double *ratio = tables->pdBranching.data() + nucleus->branching;
+	double meanLoss[2] = {0, 0};
+	for (int b = 0; b < nucleus->nBranch; b++) {
+		int dA, dZ;
+		channelLoss(tables->pdChannel[nucleus->firstBranch + b], dA, dZ);
+		double br0 = ratio[i * nucleus->nBranch + b];
+		double br1 = ratio[(i + 1) * nucleus->nBranch + b];
+		double br = br0 + (p - i) * (br1 - br0);
+		meanLoss[0] -= br * dZ;
+		meanLoss[1] -= br * (dA - dZ);
+	}
+
+	// emit a nucleon whenever its expected number reaches one
+	int id = candidate->current.getId();
+	int A = massNumber(id);
+	int Z = chargeNumber(id);
+	double EpA = candidate->current.getEnergy() / A;
+	double step = candidate->getCurrentStep();
+	Vector3d pos = (candidate->previous.getPosition() + candidate->current.getPosition()) / 2;
+	int lost = 0;
+	for (int k = 0; k < 2; k++) {
+		bool proton = (k == 0);
+		double expected = meanLoss[k] * rate * step;
+		if (candidate->hasProperty(lostKey[k]))
+			expected += candidate->getProperty(lostKey[k]).asDouble();
+		for (; (expected >= 1) and (A > 1) and (proton ? (Z > 0) : (A > Z)); expected -= 1) {
+			A -= 1;
+			Z -= int(proton);
+			lost++;
+			candidate->addSecondary(nucleusId(1, int(proton)), EpA, pos);
+		}
+		candidate->setProperty(lostKey[k], Variant::fromDouble(expected));
+	}
+	if (lost > 0) {
+		candidate->created = candidate->current;
+		candidate->current.setId(nucleusId(A, Z));
+		candidate->current.setEnergy(EpA * A);
+	}
+}
+
+bool PhotoDisintegration::hasInteractionRate() const {
+	return true;
+}
+
+double PhotoDisintegration::getInteractionRate(const Candidate *candidate) const {
+	const Nucleus *nucleus;
+	double p;
+	return interactionRate(candidate, nucleus, p);
+}
+
+void PhotoDisintegration::performStochasticInteraction(Candidate *candidate) const {
+	const Nucleus *nucleus;
+	double p;
+	if (interactionRate(candidate, nucleus, p) == 0)
+		throw std::runtime_error("PhotoDisintegration: no interaction for " + candidate->current.getDescription());
+	interact(candidate, selectBranch(*nucleus, p));
+}
+
 void PhotoDisintegration::performInteraction(Candidate *candidate, int channel) const {
+	int id = candidate->current.getId();
+	int A = massNumber(id);
+	int Z = chargeNumber(id);
+	int N = A - Z;
+	if ((Z > 26) or (N > 30))
+		throw std::runtime_error("PhotoDisintegration: no data for " + candidate->current.getDescription());
+	requireTables();
+	const Nucleus &nucleus = tables->pdNucleus[Z * 31 + N];
+	for (int b = nucleus.firstBranch; b < nucleus.firstBranch + nucleus.nBranch; b++) {
+		if (tables->pdChannel[b] == channel) {
+			interact(candidate, b);
+			return;
+		}
+	}
+	throw std::runtime_error("PhotoDisintegration: unknown channel for " + candidate->current.getDescription());
+}
+
+void PhotoDisintegration::interact(Candidate *candidate, int branch) const {
+	int channel = tables->pdChannel[branch];
 	KISS_LOG_DEBUG << "Photodisintegration::performInteraction. Channel " <<  channel << " on candidate " << candidate->getDescription(); 
 	// parse disintegration channel
 	int nNeutron = digit(channel, 100000);
@@ -209,8 +496,8 @@ void PhotoDisintegration::performInteraction(Candidate *candidate, int channel)
 	int nHe3 = digit(channel, 10);
 	int nHe4 = digit(channel, 1);
 
-	int dA = -nNeutron - nProton - 2 * nH2 - 3 * nH3 - 3 * nHe3 - 4 * nHe4;
-	int dZ = -nProton - nH2 - nH3 - 2 * nHe3 - 2 * nHe4;
+	int dA, dZ;
+	channelLoss(channel, dA, dZ);
 
 	int id = candidate->current.getId();
 	int A = massNumber(id);
@@ -251,26 +538,61 @@ void PhotoDisintegration::performInteraction(Candidate *candidate, int channel)
 		return;
 
 	// create photons
-	double z = candidate->getRedshift();
-	double lg = log10(candidate->current.getLorentzFactor() * (1 + z));
-	double lf = candidate->current.getLorentzFactor();
+	const Candidate::Kinematics &kin = candidate->getKinematics();
+	double lf = kin.lorentzFactor;
 
-	int l = round((lg - lgmin) / (lgmax - lgmin) * (nlg - 1));  // index of closest tabulation point
-	int key = Z*1e6 + (A-Z)*1e4 + (Z+dZ)*1e2 + (A+dA) - (Z+dZ);
+	int l = round((kin.lgLocalLorentzFactor - lgmin) / (lgmax - lgmin) * (nlg - 1));  // index of closest tabulation point
 
-	for (int i = 0; i < pdPhoton[key].size(); i++) {
+	for (size_t i = tables->pdPhotonOffset[branch]; i < tables->pdPhotonOffset[branch + 1]; i++) {
 		// check for random emission
-		if (random.rand() > pdPhoton[key][i].emissionProbability[l])
+		if (random.rand() > tables->pdPhotonProbability.data()[i * nlgStride + l])
 			continue;
 
 		// boost to lab frame
 		double cosTheta = 2 * random.rand() - 1;
-		double E = pdPhoton[key][i].energy * lf * (1 - cosTheta);
+		double E = tables->pdPhotonEnergy[i] * lf * (1 - cosTheta);
 		candidate->addSecondary(22, E, pos);
 	}
 }
 
+void PhotoDisintegration::getChannelRates(int id, double gamma, double z,
+		std::vector<int> &channels, std::vector<double> &rates) const {
+	requireTables();
+	channels.clear();
+	rates.clear();
+	if (not isNucleus(id))
+		return;
+	int Z = chargeNumber(id);
+	int N = massNumber(id) - Z;
+	if ((Z > 26) or (N > 30))
+		return;
+	const Nucleus &nucleus = tables->pdNucleus[Z * 31 + N];
+	if ((nucleus.rate < 0) or (nucleus.nBranch == 0))
+		return;
+
+	channels.assign(tables->pdChannel.begin() + nucleus.firstBranch,
+			tables->pdChannel.begin() + nucleus.firstBranch + nucleus.nBranch);
+	rates.assign(nucleus.nBranch, 0.);
+	double lg = log10(gamma * (1 + z));
+	if ((lg <= lgmin) or (lg >= lgmax))
+		return;
+
+	// total rate per comoving distance times the interpolated branching ratios
+	double p = (lg - lgmin) / (lgmax - lgmin) * (nlg - 1);
+	size_t i = floor(p);
+	const double *rate = tables->pdRate.data() + nucleus.rate;
+	double total = rate[i] + (p - i) * (rate[i + 1] - rate[i]);
+	total *= pow_integer<2>(1 + z) * photonField->getRedshiftScaling(z);
+	const double *ratio = tables->pdBranching.data() + nucleus.branching;
+	for (int b = 0; b < nucleus.nBranch; b++) {
+		double br0 = ratio[i * nucleus.nBranch + b];
+		double br1 = ratio[(i + 1) * nucleus.nBranch + b];
+		rates[b] = total * (br0 + (p - i) * (br1 - br0));
+	}
+}
+
 double PhotoDisintegration::lossLength(int id, double gamma, double z) {
+	requireTables();
 	// check if nucleus
 	if (not (isNucleus(id)))
 		return std::numeric_limits<double>::max();
@@ -278,13 +600,12 @@ double PhotoDisintegration::lossLength(int id, double gamma, double z) {
 	int A = massNumber(id);
 	int Z = chargeNumber(id);
 	int N = A - Z;
-	size_t idx = Z * 31 + N;
 
 	// check if disintegration data available
 	if ((Z > 26) or (N > 30))
 		return std::numeric_limits<double>::max();
-	const std::vector<double> &rate = pdRate[idx];
-	if (rate.size() == 0)
+	const Nucleus &nucleus = tables->pdNucleus[Z * 31 + N];
+	if (nucleus.rate < 0)
 		return std::numeric_limits<double>::max();
 
 	// check if in tabulated energy range
@@ -293,26 +614,23 @@ double PhotoDisintegration::lossLength(int id, double gamma, double z) {
 		return std::numeric_limits<double>::max();
 
 	// total interaction rate
-	double lossRate = interpolateEquidistant(lg, lgmin, lgmax, rate);
+	double p = (lg - lgmin) / (lgmax - lgmin) * (nlg - 1);
+	size_t i = floor(p);
+	const double *rates = tables->pdRate.data() + nucleus.rate;
+	double lossRate = rates[i] + (p - i) * (rates[i + 1] - rates[i]);
 
 	// comological scaling, rate per physical distance
 	lossRate *= pow_integer<3>(1 + z) * photonField->getRedshiftScaling(z);
 
 	// average number of nucleons lost for all disintegration channels
 	double avg_dA = 0;
-	const std::vector<Branch> &branches = pdBranch[idx];
-	for (size_t i = 0; i < branches.size(); i++) {
-		int channel = branches[i].channel;
-		int dA = 0;
-		dA += 1 * digit(channel, 100000);
-		dA += 1 * digit(channel, 10000);
-		dA += 2 * digit(channel, 1000);
-		dA += 3 * digit(channel, 100);
-		dA += 3 * digit(channel, 10);
-		dA += 4 * digit(channel, 1);
-
-		double br = interpolateEquidistant(lg, lgmin, lgmax, branches[i].branchingRatio);
-		avg_dA += br * dA;
+	const double *ratio = tables->pdBranching.data() + nucleus.branching;
+	for (int b = 0; b < nucleus.nBranch; b++) {
+		int dA, dZ;
+		channelLoss(tables->pdChannel[nucleus.firstBranch + b], dA, dZ);
+		double br0 = ratio[i * nucleus.nBranch + b];
+		double br1 = ratio[(i + 1) * nucleus.nBranch + b];
+		avg_dA -= (br0 + (p - i) * (br1 - br0)) * dA;
 	}
 
 	lossRate *= avg_dA / A;
@@ -1,26 +1,53 @@
 #include "crpropa/module/PhotoPionProduction.h"
 #include "crpropa/Units.h"
+#include "crpropa/Common.h"
 #include "crpropa/ParticleID.h"
 #include "crpropa/Random.h"
+#include "crpropa/NumericTable.h"
+#include "crpropa/Trace.h"
 
 #include "kiss/convert.h"
 #include "kiss/logger.h"
 #include "sophia.h"
 
+#include <atomic>
 #include <limits>
 #include <cmath>
 #include <sstream>
-#include <fstream>
 #include <stdexcept>
 
+// SOPHIA draws its random numbers from the generator of the calling thread
+extern "C" double sophia_rndm_() {
+	return crpropa::Random::instance().randDblExc();
+}
+
 namespace crpropa {
 
+namespace {
+// rates of the tables of one module interpolated to the redshift of a bin
+struct RateSlice {
+	uint64_t table;
+	int64_t bin; // at the redshift bin * tolerance
+	std::vector<double> rate[2]; // proton, neutron
+};
+// slices kept per thread, for candidates and modules at different redshifts
+const size_t maxRateSlices = 16;
+std::atomic<uint64_t> rateTableCounter(0);
+}
+
+// mean fraction of the energy of a nucleon lost per interaction: the nucleon
+// keeps the fraction of its mass to the mass of the Delta resonance
+static const double meanInelasticity = 1 - 938. / 1232.;
+
 PhotoPionProduction::PhotoPionProduction(ref_ptr<PhotonField> field, bool photons, bool neutrinos, bool electrons, bool antiNucleons, double l, bool redshift) {
 	havePhotons = photons;
 	haveNeutrinos = neutrinos;
 	haveElectrons = electrons;
 	haveAntiNucleons = antiNucleons;
 	haveRedshiftDependence = redshift;
+	redshiftTolerance = 1e-3;
+	rateTableId = 0;
+	continuousLoss = false;
 	limit = l;
 	setPhotonField(field);
 }
@@ -38,13 +65,32 @@ void PhotoPionProduction::setPhotonField(ref_ptr<PhotonField> field) {
 	}
 	std::string fname = photonField->getFieldName();
 	setDescription("PhotoPionProduction: " + fname);
+	tabLorentz.clear();
+	tabRedshifts.clear();
+	tabProtonRate.clear();
+	tabNeutronRate.clear();
+	prepared.reset(new std::once_flag);
+
+	int background = (fname == "CMB") ? 1 : 2; // photon background: 1 for CMB, 2 for Kneiske IRB
+	this->photonFieldSampling = PhotonFieldSampling(background);
+}
+
+void PhotoPionProduction::loadTables() {
+	if (not tabLorentz.empty())
+		return;
+	std::string fname = photonField->getFieldName();
 	if (haveRedshiftDependence)
 		initRate(getDataPath("PhotoPionProduction/rate_" + fname.replace(0, 3, "IRBz") + ".txt"));
 	else
 		initRate(getDataPath("PhotoPionProduction/rate_" + fname + ".txt"));
+}
 
-	int background = (fname == "CMB") ? 1 : 2; // photon background: 1 for CMB, 2 for Kneiske IRB
-	this->photonFieldSampling = PhotonFieldSampling(background);
+void PhotoPionProduction::requireTables() const {
+	std::call_once(*prepared, &PhotoPionProduction::loadTables, const_cast<PhotoPionProduction*>(this));
+}
+
+void PhotoPionProduction::prepare() {
+	requireTables();
 }
 
 void PhotoPionProduction::setHavePhotons(bool b) {
@@ -72,28 +118,50 @@ void PhotoPionProduction::setLimit(double l) {
 	limit = l;
 }
 
+void PhotoPionProduction::setRedshiftTolerance(double dz) {
+	if (dz < 0)
+		throw std::runtime_error("PhotoPionProduction: redshift tolerance must not be negative");
+	redshiftTolerance = dz;
+}
+
+double PhotoPionProduction::getRedshiftTolerance() const {
+	return redshiftTolerance;
+}
+
+void PhotoPionProduction::setEventLibrary(ref_ptr<SophiaEventLibrary> library) {
+	eventLibrary = library;
+}
+
+ref_ptr<SophiaEventLibrary> PhotoPionProduction::getEventLibrary() const {
+	return eventLibrary;
+}
+
+void PhotoPionProduction::setContinuousLoss(bool b) {
+	continuousLoss = b;
+}
+
+bool PhotoPionProduction::getContinuousLoss() const {
+	return continuousLoss;
+}
+
 void PhotoPionProduction::initRate(std::string filename) {
+	CRPROPA_TRACE_SPAN("PhotoPionProduction::initRate", "tables");
 	// clear previously loaded tables
 	tabLorentz.clear();
 	tabRedshifts.clear();
 	tabProtonRate.clear();
 	tabNeutronRate.clear();
 
-	std::ifstream infile(filename.c_str());
-	if (!infile.good())
-		throw std::runtime_error("PhotoPionProduction: could not open file " + filename);
+	ref_ptr<NumericTable> table = NumericTable::load(filename);
 
 	if (haveRedshiftDependence) {
+		// rows: z, log10(Lorentz factor), proton rate, neutron rate [1/Mpc]
 		double zOld = -1, aOld = -1;
-		while (infile.good()) {
-			if (infile.peek() == '#') {
-				infile.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+		for (size_t i = 0; i < table->rows(); i++) {
+			if (table->rowSize(i) < 4)
 				continue;
-			}
-			double z, a, b, c;
-			infile >> z >> a >> b >> c;
-			if (!infile)
-				break;
+			const double *row = table->row(i);
+			double z = row[0], a = row[1];
 			if (z > zOld) {
 				tabRedshifts.push_back(z);
 				zOld = z;
@@ -102,29 +170,66 @@ void PhotoPionProduction::initRate(std::string filename) {
 				tabLorentz.push_back(pow(10, a));
 				aOld = a;
 			}
-			tabProtonRate.push_back(b / Mpc);
-			tabNeutronRate.push_back(c / Mpc);
+			tabProtonRate.push_back(row[2] / Mpc);
+			tabNeutronRate.push_back(row[3] / Mpc);
 		}
 	} else {
-		while (infile.good()) {
-			if (infile.peek() == '#') {
-				infile.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+		// rows: log10(Lorentz factor), proton rate, neutron rate [1/Mpc]
+		for (size_t i = 0; i < table->rows(); i++) {
+			if (table->rowSize(i) < 3)
 				continue;
-			}
-			double a, b, c;
-			infile >> a >> b >> c;
-			if (!infile)
-				break;
-			tabLorentz.push_back(pow(10, a));
-			tabProtonRate.push_back(b / Mpc);
-			tabNeutronRate.push_back(c / Mpc);
+			const double *row = table->row(i);
+			tabLorentz.push_back(pow(10, row[0]));
+			tabProtonRate.push_back(row[1] / Mpc);
+			tabNeutronRate.push_back(row[2] / Mpc);
 		}
 	}
 
-	infile.close();
+	lorentzAxis.assign(tabLorentz);
+	redshiftAxis.assign(tabRedshifts);
+	rateTableId = ++rateTableCounter;
+}
+
+double PhotoPionProduction::sliceRate(double gamma, double z, bool onProton) const {
+	static thread_local std::vector<RateSlice> slices;
+	static thread_local size_t lastSlice = 0, nextSlice = 0;
+	int64_t bin = int64_t(std::floor(z / redshiftTolerance + 0.5));
+
+	RateSlice *slice = NULL;
+	if ((lastSlice < slices.size()) and (slices[lastSlice].table == rateTableId) and (slices[lastSlice].bin == bin))
+		slice = &slices[lastSlice];
+	for (size_t i = 0; (slice == NULL) and (i < slices.size()); i++)
+		if ((slices[i].table == rateTableId) and (slices[i].bin == bin)) {
+			slice = &slices[i];
+			lastSlice = i;
+		}
+
+	// bilinear interpolation at the Lorentz factors of the table, replacing
+	// the oldest slice if all are in use
+	if (slice == NULL) {
+		if (slices.size() < maxRateSlices) {
+			slices.push_back(RateSlice());
+			lastSlice = slices.size() - 1;
+		} else {
+			lastSlice = nextSlice;
+			nextSlice = (nextSlice + 1) % maxRateSlices;
+		}
+		slice = &slices[lastSlice];
+		slice->table = rateTableId;
+		slice->bin = bin;
+		double zBin = bin * redshiftTolerance;
+		for (int k = 0; k < 2; k++) {
+			const std::vector<double> &tabRate = (k == 0)? tabProtonRate : tabNeutronRate;
+			slice->rate[k].resize(lorentzAxis.size());
+			for (size_t j = 0; j < lorentzAxis.size(); j++)
+				slice->rate[k][j] = interpolate2d(zBin, lorentzAxis[j], redshiftAxis, lorentzAxis, tabRate);
+		}
+	}
+	return interpolate(gamma, lorentzAxis, slice->rate[onProton? 0 : 1]);
 }
 
 double PhotoPionProduction::nucleonMFP(double gamma, double z, bool onProton) const {
+	requireTables();
 	const std::vector<double> &tabRate = (onProton)? tabProtonRate : tabNeutronRate;
 
 	// scale nucleus energy instead of background photon energy
@@ -133,10 +238,12 @@ double PhotoPionProduction::nucleonMFP(double gamma, double z, bool onProton) co
 		return std::numeric_limits<double>::max();
 
 	double rate;
-	if (haveRedshiftDependence)
-		rate = interpolate2d(z, gamma, tabRedshifts, tabLorentz, tabRate);
+	if (haveRedshiftDependence and redshiftTolerance > 0)
+		rate = sliceRate(gamma, z, onProton);
+	else if (haveRedshiftDependence)
+		rate = interpolate2d(z, gamma, redshiftAxis, lorentzAxis, tabRate);
 	else
-		rate = interpolate(gamma, tabLorentz, tabRate) * photonField->getRedshiftScaling(z);
+		rate = interpolate(gamma, lorentzAxis, tabRate) * photonField->getRedshiftScaling(z);
 
 	// cosmological scaling
 	rate *= pow_integer<2>(1 + z);
@@ -144,15 +251,39 @@ double PhotoPionProduction::nucleonMFP(double gamma, double z, bool onProton) co
 	return 1. / rate;
 }
 
+double PhotoPionProduction::getMeanInelasticity() const {
+	return meanInelasticity;
+}
+
+double PhotoPionProduction::getThresholdEnergy() const {
+	return (photonField->getFieldName() == "CMB") ? 3.72e18 * eV : 5.83e15 * eV;
+}
+
 double PhotoPionProduction::nucleiModification(int A, int X) const {
 	if (A == 1)
 		return 1.;
 	if (A <= 8)
-		return 0.85 * pow(X, 2. / 3.);
+		return 0.85 * mathPow(X, 2. / 3.);
 	return 0.85 * X;
 }
 
+unsigned int PhotoPionProduction::getParticleClasses() const {
+	return NucleusClass;
+}
+
+size_t PhotoPionProduction::getMemoryUsage() const {
+	size_t bytes = memoryUsage(tabLorentz) + memoryUsage(tabRedshifts)
+			+ memoryUsage(tabProtonRate) + memoryUsage(tabNeutronRate);
+	if (eventLibrary.valid())
+		bytes += eventLibrary->getMemoryUsage();
+	return bytes;
+}
+
 void PhotoPionProduction::process(Candidate *candidate) const {
+	if (continuousLoss) {
+		processContinuous(candidate);
+		return;
+	}
 	double step = candidate->getCurrentStep();
 	double z = candidate->getRedshift();
 	// the loop is processed at least once for limiting the next step
@@ -172,7 +303,7 @@ void PhotoPionProduction::process(Candidate *candidate) const {
 		int A = massNumber(id);
 		int Z = chargeNumber(id);
 		int N = A - Z;
-		double gamma = candidate->current.getLorentzFactor();
+		double gamma = candidate->getKinematics().lorentzFactor;
 
 		// check for interaction on protons
 		if (Z > 0) {
@@ -204,6 +335,115 @@ void PhotoPionProduction::process(Candidate *candidate) const {
 	} while (step > 0);
 }
 
+void PhotoPionProduction::nucleonRates(const Candidate *candidate, double &protonRate, double &neutronRate) const {
+	protonRate = 0;
+	neutronRate = 0;
+	int id = candidate->current.getId();
+	if (!isNucleus(id))
+		return;
+
+	int A = massNumber(id);
+	int Z = chargeNumber(id);
+	int N = A - Z;
+	double gamma = candidate->getKinematics().lorentzFactor;
+	double z = candidate->getRedshift();
+	if (Z > 0)
+		protonRate = nucleiModification(A, Z) / nucleonMFP(gamma, z, true);
+	if (N > 0)
+		neutronRate = nucleiModification(A, N) / nucleonMFP(gamma, z, false);
+}
+
+void PhotoPionProduction::processContinuous(Candidate *candidate) const {
+	static const Candidate::PropertyKey lostKey[2] = {
+		Candidate::getPropertyKey("ContinuousLoss.protons"),
+		Candidate::getPropertyKey("ContinuousLoss.neutrons")};
+	double rate[2];
+	nucleonRates(candidate, rate[0], rate[1]);
+	if (rate[0] + rate[1] == 0)
+		return;
+
+	int id = candidate->current.getId();
+	int A = massNumber(id);
+	int Z = chargeNumber(id);
+	int sign = (id > 0) ? 1 : -1;
+	double E = candidate->current.getEnergy();
+	double step = candidate->getCurrentStep();
+	Vector3d pos = (candidate->previous.getPosition() + candidate->current.getPosition()) / 2;
+
+	// no interactions below the threshold of SOPHIA, as in performInteraction
+	double threshold = getThresholdEnergy();
+	if (E / A * (1 + candidate->getRedshift()) < threshold)
+		return;
+
+	// nucleons lose energy continuously
+	if (A == 1) {
+		double lossRate = meanInelasticity * (rate[0] + rate[1]);
+		candidate->limitNextStep(limit / lossRate);
+		double loss = E * (1 - mathExp(-lossRate * step));
+		candidate->current.setEnergy(E - loss);
+		emitMeanPionProducts(candidate, loss, pos, sign);
+		return;
+	}
+
+	// nuclei lose a nucleon carrying E / A whenever the expected number
+	// of interactions on protons or neutrons reaches one
+	candidate->limitNextStep(limit / (rate[0] + rate[1]));
+	double EpA = E / A;
+	int lost = 0;
+	for (int k = 0; k < 2; k++) {
+		bool onProton = (k == 0);
+		double expected = rate[k] * step;
+		if (candidate->hasProperty(lostKey[k]))
+			expected += candidate->getProperty(lostKey[k]).asDouble();
+		for (; (expected >= 1) and (A > 1) and (onProton ? (Z > 0) : (A > Z)); expected -= 1) {
+			A -= 1;
+			Z -= int(onProton);
+			lost++;
+			candidate->addSecondary(sign * nucleusId(1, int(onProton)), (1 - meanInelasticity) * EpA, pos);
+			emitMeanPionProducts(candidate, meanInelasticity * EpA, pos, sign);
+		}
+		candidate->setProperty(lostKey[k], Variant::fromDouble(expected));
+	}
+	if (lost > 0) {
+		candidate->current.setId(sign * nucleusId(A, Z));
+		candidate->current.setEnergy(EpA * A);
+	}
+}
+
+void PhotoPionProduction::emitMeanPionProducts(Candidate *candidate, double energy,
+		const Vector3d &pos, int sign) const {
+	if (energy <= 0)
+		return;
+	// p pi0 (2/3): two photons
+	if (havePhotons)
+		candidate->addSecondary(22, energy / 2, pos, 4. / 3);
+	// n pi+ (1/3): pi+ -> mu+ nu_mu, mu+ -> e+ nu_e anti-nu_mu
+	if (haveElectrons)
+		candidate->addSecondary(sign * -11, energy / 4, pos, 1. / 3);
+	if (haveNeutrinos) {
+		candidate->addSecondary(sign * 12, energy / 4, pos, 1. / 3);
+		candidate->addSecondary(sign * 14, energy / 4, pos, 1. / 3);
+		candidate->addSecondary(sign * -14, energy / 4, pos, 1. / 3);
+	}
+}
+
+bool PhotoPionProduction::hasInteractionRate() const {
+	return true;
+}
+
+double PhotoPionProduction::getInteractionRate(const Candidate *candidate) const {
+	double protonRate, neutronRate;
+	nucleonRates(candidate, protonRate, neutronRate);
+	return protonRate + neutronRate;
+}
+
+void PhotoPionProduction::performStochasticInteraction(Candidate *candidate) const {
+	double protonRate, neutronRate;
+	nucleonRates(candidate, protonRate, neutronRate);
+	bool onProton = Random::instance().rand() * (protonRate + neutronRate) < protonRate;
+	performInteraction(candidate, onProton);
+}
+
 void PhotoPionProduction::performInteraction(Candidate *candidate, bool onProton) const {
 	int id = candidate->current.getId();
 	int A = massNumber(id);
@@ -218,7 +458,7 @@ void PhotoPionProduction::performInteraction(Candidate *candidate, bool onProton
 	int sign = (id > 0) ? 1 : -1;
 
 	// check if below SOPHIA's energy threshold
-	double E_threshold = (photonField->getFieldName() == "CMB") ? 3.72e18 * eV : 5.83e15 * eV;
+	double E_threshold = getThresholdEnergy();
 	if (EpA * (1 + z) < E_threshold)
 		return;
 
@@ -232,8 +472,10 @@ void PhotoPionProduction::performInteraction(Candidate *candidate, bool onProton
 	int outPartID[2000];
 	int nParticles;
 
-#pragma omp critical
-	{
+	if (not (eventLibrary.valid() and eventLibrary->sample(nature, Ein, eps, outPartID, outputEnergy[3], nParticles))) {
+#ifndef CRPROPA_SOPHIA_REENTRANT
+#pragma omp critical(sophia)
+#endif
 		sophiaevent_(nature, Ein, eps, outputEnergy, outPartID, nParticles);
 	}
 
@@ -347,7 +589,7 @@ double PhotoPionProduction::lossLength(int id, double gamma, double z) {
 	// approximate the relative energy loss
 	// - nucleons keep the fraction of mass to delta-resonance mass
 	// - nuclei lose the energy 1/A the interacting nucleon is carrying
-	double relativeEnergyLoss = (A == 1) ? 1 - 938. / 1232. : 1. / A;
+	double relativeEnergyLoss = (A == 1) ? meanInelasticity : 1. / A;
 	lossRate *= relativeEnergyLoss;
 
 	// scaling factor: interaction rate --> energy loss rate
@@ -1,24 +1,57 @@
 #include "crpropa/module/PhotonEleCa.h"
 #include "crpropa/Units.h"
+#include "crpropa/Random.h"
 
 #include "EleCa/Propagation.h"
 #include "EleCa/Particle.h"
 #include "EleCa/Common.h"
 
 #include <vector>
+#include <sstream>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace crpropa {
 
+// EleCa draws from the thread-local generators of CRPropa
+static double elecaUniform(double min, double max) {
+	return Random::instance().randUniform(min, max);
+}
+
 PhotonEleCa::PhotonEleCa(const std::string background,
 		const std::string &outputFilename) :
 		propagation(new eleca::Propagation), saveOnlyPhotonEnergies(false) {
 	//propagation->ReadTables(getDataPath("eleca_lee.txt"));
 	propagation->ReadTables(getDataPath("EleCa/eleca.dat"));
 	propagation->InitBkgArray(background);
+	eleca::setUniformCallback(elecaUniform);
 	output.open(outputFilename.c_str());
+	size_t nThreads = 1;
+#ifdef _OPENMP
+	nThreads = omp_get_max_threads();
+#endif
+	buffers.resize(nThreads);
 }
 
 PhotonEleCa::~PhotonEleCa() {
+	flush();
+}
+
+void PhotonEleCa::flush() const {
+#pragma omp critical(PhotonEleCa)
+	{
+		for (size_t i = 0; i < buffers.size(); i++) {
+			output << buffers[i];
+			buffers[i].clear();
+		}
+		output.flush();
+	}
+}
+
+unsigned int PhotonEleCa::getParticleClasses() const {
+	return PhotonClass;
 }
 
 void PhotonEleCa::process(Candidate *candidate) const {
@@ -45,18 +78,35 @@ void PhotonEleCa::process(Candidate *candidate) const {
 		}
 	}
 
-#pragma omp critical
-	{
-		if (saveOnlyPhotonEnergies) {
-			for (int i = 0; i < ParticleAtGround.size(); ++i) {
-				eleca::Particle &p = ParticleAtGround[i];
-				if (p.GetType() != 22)
-					continue;
-				output << p.GetEnergy() << "\n";
-			}
-		} else {
-			propagation->WriteOutput(output, p0, ParticleAtGround);
+	// format outside of the critical section into the buffer of this thread
+	std::ostringstream out;
+	if (saveOnlyPhotonEnergies) {
+		for (int i = 0; i < ParticleAtGround.size(); ++i) {
+			eleca::Particle &p = ParticleAtGround[i];
+			if (p.GetType() != 22)
+				continue;
+			out << p.GetEnergy() << "\n";
+		}
+	} else {
+		propagation->WriteOutput(out, p0, ParticleAtGround);
+	}
+
+	size_t iThread = 0;
+#ifdef _OPENMP
+	iThread = omp_get_thread_num();
+#endif
+	if (iThread < buffers.size()) {
+		std::string &buffer = buffers[iThread];
+		buffer += out.str();
+		if (buffer.size() >= bufferSize) {
+#pragma omp critical(PhotonEleCa)
+			output << buffer;
+			buffer.clear();
 		}
+	} else {
+		// more threads than at construction
+#pragma omp critical(PhotonEleCa)
+		output << out.str();
 	}
 
 	candidate->setActive(false);
@@ -4,6 +4,7 @@
 #include <iostream>
 #include <sstream>
 #include <cstdio>
+#include <cstring>
 #include <stdexcept>
 
 #include "kiss/string.h"
@@ -13,24 +14,53 @@
 #include <ozstream.hpp>
 #endif
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 using namespace std;
 
 namespace crpropa {
 
-PhotonOutput1D::PhotonOutput1D() : out(&std::cout) {
-	KISS_LOG_WARNING << "PhotonOutput1D is deprecated and will be removed in the future. Replace with TextOutput or HDF5Output with features ObserverNucleusVeto + ObserverDetectAll";
+// header of the binary format: magic string, version and record size
+static const char binaryMagic[8] = "CRPPH1D";
+static const uint32_t binaryVersion = 1;
+
+PhotonOutput1D::PhotonOutput1D() : out(&std::cout), binary(false) {
+	init();
 }
 
-PhotonOutput1D::PhotonOutput1D(std::ostream &out) : out(&out) {
-	KISS_LOG_WARNING << "PhotonOutput1D is deprecated and will be removed in the future. Replace with TextOutput or HDF5Output with features ObserverNucleusVeto + ObserverDetectAll";
+PhotonOutput1D::PhotonOutput1D(std::ostream &out) : out(&out), binary(false) {
+	init();
 }
 
 PhotonOutput1D::PhotonOutput1D(const std::string &filename) : outfile(
-	filename.c_str(), std::ios::binary), out(&outfile), filename(filename) {
+	filename.c_str(), std::ios::binary), out(&outfile), filename(filename), binary(false) {
+	init();
+}
+
+PhotonOutput1D::PhotonOutput1D(const std::string &filename, bool binary) : outfile(
+	filename.c_str(), std::ios::binary), out(&outfile), filename(filename), binary(binary) {
+	init();
+}
+
+void PhotonOutput1D::init() {
 	KISS_LOG_WARNING << "PhotonOutput1D is deprecated and will be removed in the future. Replace with TextOutput or HDF5Output with features ObserverNucleusVeto + ObserverDetectAll";
+	bufferSize = 1 << 20;
+	allocated.reset(new std::once_flag);
+	if (filename.empty())
+		return;
+
 	if (kiss::ends_with(filename, ".gz"))
 		gzip();
 
+	if (binary) {
+		uint32_t header[2] = {binaryVersion, sizeof(Record)};
+		out->write(binaryMagic, sizeof(binaryMagic));
+		out->write((const char *) header, sizeof(header));
+		return;
+	}
+
 	*out << "#ID\tE\tD\tpID\tpE\tiID\tiE\tiD\n";
 	*out << "#\n";
 	*out << "# ID          Id of particle (photon, electron, positron)\n";
@@ -44,6 +74,18 @@ PhotonOutput1D::PhotonOutput1D(const std::string &filename) : outfile(
 	*out << "#\n";
 }
 
+unsigned int PhotonOutput1D::getParticleClasses() const {
+	return PhotonClass | ElectronClass;
+}
+
+void PhotonOutput1D::allocate() const {
+	size_t nThreads = 1;
+#ifdef _OPENMP
+	nThreads = omp_in_parallel() ? omp_get_num_threads() : omp_get_max_threads();
+#endif
+	buffers.resize(nThreads + 1);
+}
+
 void PhotonOutput1D::process(Candidate *candidate) const {
 	int pid = candidate->current.getId();
 	if ((pid != 22) and (abs(pid) != 11))
@@ -52,26 +94,90 @@ void PhotonOutput1D::process(Candidate *candidate) const {
 	char buffer[1024];
 	size_t p = 0;
 
-	p += std::sprintf(buffer + p, "%4i\t", pid);
-	p += std::sprintf(buffer + p, "%g\t", candidate->current.getEnergy() / EeV);
-	p += std::sprintf(buffer + p, "%8.4f\t", candidate->current.getPosition().getR() / Mpc);
+	if (binary) {
+		Record r;
+		r.energy = candidate->current.getEnergy() / EeV;
+		r.distance = candidate->current.getPosition().getR() / Mpc;
+		r.createdEnergy = candidate->created.getEnergy() / EeV;
+		r.sourceEnergy = candidate->source.getEnergy() / EeV;
+		r.sourceDistance = candidate->source.getPosition().getR() / Mpc;
+		r.id = pid;
+		r.createdId = candidate->created.getId();
+		r.sourceId = candidate->source.getId();
+		r.padding = 0;
+		std::memcpy(buffer, &r, sizeof(r));
+		p = sizeof(r);
+	} else {
+		p += std::sprintf(buffer + p, "%4i\t", pid);
+		p += std::sprintf(buffer + p, "%g\t", candidate->current.getEnergy() / EeV);
+		p += std::sprintf(buffer + p, "%8.4f\t", candidate->current.getPosition().getR() / Mpc);
+
+		p += std::sprintf(buffer + p, "%10i\t", candidate->created.getId());
+		p += std::sprintf(buffer + p, "%8.4f\t", candidate->created.getEnergy() / EeV);
+
+		p += std::sprintf(buffer + p, "%10i\t", candidate->source.getId());
+		p += std::sprintf(buffer + p, "%8.4f\t", candidate->source.getEnergy() / EeV);
+		p += std::sprintf(buffer + p, "%8.4f\n", candidate->source.getPosition().getR() / Mpc);
+	}
 
-	p += std::sprintf(buffer + p, "%10i\t", candidate->created.getId());
-	p += std::sprintf(buffer + p, "%8.4f\t", candidate->created.getEnergy() / EeV);
+	std::call_once(*allocated, &PhotonOutput1D::allocate, this);
+	size_t i = 0;
+#ifdef _OPENMP
+	i = omp_get_thread_num();
+#endif
+	if (i + 1 < buffers.size()) {
+		append(buffers[i], buffer, p);
+	} else {
+		// more threads than at the first candidate
+		std::lock_guard<std::mutex> lock(sharedMutex);
+		append(buffers.back(), buffer, p);
+	}
 
-	p += std::sprintf(buffer + p, "%10i\t", candidate->source.getId());
-	p += std::sprintf(buffer + p, "%8.4f\t", candidate->source.getEnergy() / EeV);
-	p += std::sprintf(buffer + p, "%8.4f\n", candidate->source.getPosition().getR() / Mpc);
+	candidate->setActive(false);
+}
+
+void PhotonOutput1D::append(std::string &buffer, const char *row, size_t size) const {
+	buffer.append(row, size);
+	if (buffer.size() >= bufferSize)
+		write(buffer);
+}
 
-#pragma omp critical
-	{
-		out->write(buffer, p);
+void PhotonOutput1D::write(std::string &buffer) const {
+	if (buffer.empty() or not out)
+		return;
+	std::lock_guard<std::mutex> lock(writeMutex);
+	out->write(buffer.data(), buffer.size());
+	buffer.clear();
+}
+
+void PhotonOutput1D::flush() const {
+#ifdef _OPENMP
+	if (omp_in_parallel()) {
+		size_t i = omp_get_thread_num();
+		if (i + 1 < buffers.size())
+			write(buffers[i]);
+		return;
 	}
+#endif
+	std::lock_guard<std::mutex> lock(sharedMutex);
+	for (size_t i = 0; i < buffers.size(); i++)
+		write(buffers[i]);
+}
 
-	candidate->setActive(false);
+bool PhotonOutput1D::isBinary() const {
+	return binary;
+}
+
+void PhotonOutput1D::setBufferSize(size_t bytes) {
+	bufferSize = bytes;
+}
+
+size_t PhotonOutput1D::getBufferSize() const {
+	return bufferSize;
 }
 
 void PhotonOutput1D::close() {
+	flush();
 	#ifdef CRPROPA_HAVE_ZLIB
 		zstream::ogzstream *zs = dynamic_cast<zstream::ogzstream *>(out);
 		if (zs) {
@@ -86,6 +192,8 @@ void PhotonOutput1D::close() {
 string PhotonOutput1D::getDescription() const {
 	std::stringstream s;
 	s << "PhotonOutput1D: Output file = " << filename;
+	if (binary)
+		s << " (binary)";
 	return s.str();
 }
 
@@ -101,4 +209,26 @@ void PhotonOutput1D::gzip() {
 	#endif
 }
 
+bool PhotonOutput1D::readBinaryHeader(std::istream &in) {
+	std::streampos start = in.tellg();
+	char magic[sizeof(binaryMagic)];
+	if (not in.read(magic, sizeof(magic)) or std::memcmp(magic, binaryMagic, sizeof(magic)) != 0) {
+		in.clear();
+		in.seekg(start);
+		return false;
+	}
+
+	uint32_t header[2];
+	if (not in.read((char *) header, sizeof(header)))
+		throw std::runtime_error("PhotonOutput1D: incomplete header of binary file");
+	if ((header[0] != binaryVersion) or (header[1] != sizeof(Record)))
+		throw std::runtime_error("PhotonOutput1D: unsupported version of the binary format");
+	return true;
+}
+
+size_t PhotonOutput1D::readRecords(std::istream &in, Record *records, size_t n) {
+	in.read((char *) records, n * sizeof(Record));
+	return in.gcount() / sizeof(Record);
+}
+
 } // namespace crpropa
@@ -96,6 +96,8 @@ namespace crpropa {
 			candidate->current.setPosition(yOut.x);
 			candidate->setCurrentStep(step);
 			candidate->setNextStep(step);
+			if (statistics.isEnabled())
+				recordStep(candidate, 1, 1, false);
 			return;
 		}
 
@@ -104,10 +106,12 @@ namespace crpropa {
 		double r = 42;  // arbitrary value > 1
 		Y yIn(current.getPosition(), current.getDirection());
 		Y yOut, yErr;
+		size_t tries = 0;
 
 		// try performing step until the target error (tolerance) or the minimum step size has been reached
 		while (true) {
 			tryStep(yIn, yOut, yErr, step, current, z, m, q);
+			tries++;
 			r = yErr.u.getR() / tolerance;  // ratio of absolute direction error and tolerance
 			if (r > 1) {  // large direction error relative to tolerance, try to decrease step size
 				if (step == minStep)  // already minimum step size
@@ -132,6 +136,41 @@ namespace crpropa {
 		current.setDirection(yOut.u.getUnitVector());
 		candidate->setCurrentStep(step);
 		candidate->setNextStep(newStep);
+		if (statistics.isEnabled())
+			recordStep(candidate, tries, 3 * tries, r > 1);
+	}
+
+
+	void PropagationBP::recordStep(Candidate *candidate, size_t tries, size_t fieldEvaluations, bool minimum) const {
+		IntegratorStatistics s;
+		s.acceptedSteps = 1;
+		s.rejectedSteps = tries - 1;
+		s.fieldEvaluations = fieldEvaluations;
+		s.minimumSteps = minimum;
+		statistics.record(candidate, s);
+	}
+
+
+	void PropagationBP::setRecordStatistics(bool record, bool asProperties) {
+		statistics.enable("PropagationBP", record, asProperties);
+	}
+
+
+	bool PropagationBP::getIntegratorStatistics(IntegratorStatistics &s) const {
+		if (not statistics.isEnabled())
+			return false;
+		s = statistics.getTotal();
+		return true;
+	}
+
+
+	void PropagationBP::resetStatistics() {
+		statistics.reset();
+	}
+
+
+	size_t PropagationBP::getMemoryUsage() const {
+		return field.valid() ? field->getMemoryUsage() : 0;
 	}
 
 
@@ -1,4 +1,5 @@
 #include "crpropa/module/PropagationCK.h"
+#include "crpropa/Diagnostics.h"
 
 #include <limits>
 #include <sstream>
@@ -25,10 +26,26 @@ const double cash_karp_bs[] = {
 	2825. / 27648., 0., 18575. / 48384., 13525. / 55296., 277. / 14336., 1. / 4.
 };
 
+// number of candidates integrated together in processBatch, twice as many in single precision
+static const size_t batchLanes = 8;
+static const size_t mixedPrecisionLanes = 16;
+
+// smallest tolerance for the single-precision stages, below the double-precision lanes are used
+static const double mixedPrecisionMinTolerance = 1e-6;
+
+static void getFieldsOf(const MagneticField *field, const Vector3d *positions,
+		const double *z, Vector3d *fields, size_t count) {
+	field->getFields(positions, z, fields, count);
+}
+
+static void getFieldsOf(const MagneticField *field, const Vector3d *positions,
+		const double *z, Vector3f *fields, size_t count) {
+	field->getFieldsFloat(positions, z, fields, count);
+}
+
 void PropagationCK::tryStep(const Y &y, Y &out, Y &error, double h,
 		ParticleState &particle, double z) const {
-	std::vector<Y> k;
-	k.reserve(6);
+	Y k[6];
 
 	out = y;
 	error = Y(0);
@@ -55,8 +72,7 @@ PropagationCK::Y PropagationCK::dYdt(const Y &y, ParticleState &p, double z) con
 	try {
 		B = field->getField(y.x, z);
 	} catch (std::exception &e) {
-		std::cerr << "PropagationCK: Exception in getField." << std::endl;
-		std::cerr << e.what() << std::endl;
+		CRPROPA_DIAGNOSTIC("PropagationCK: exception in getField", e.what());
 	}
 	// Lorentz force: du/dt = q*c/E * (v x B)
 	Vector3d dudt = p.getCharge() * c_light / p.getEnergy() * velocity.cross(B);
@@ -65,7 +81,7 @@ PropagationCK::Y PropagationCK::dYdt(const Y &y, ParticleState &p, double z) con
 
 PropagationCK::PropagationCK(ref_ptr<MagneticField> field, double tolerance,
 		double minStep, double maxStep) :
-		minStep(0) {
+		minStep(0), mixedPrecision(false) {
 	setField(field);
 	setTolerance(tolerance);
 	setMaximumStep(maxStep);
@@ -100,10 +116,13 @@ void PropagationCK::process(Candidate *candidate) const {
 	double r = 42;  // arbitrary value > 1
 	double z = candidate->getRedshift();
 
+	size_t tries = 0;
+
 	// try performing step until the target error (tolerance) or the minimum step size has been reached
 	while (r > 1) {
 		step = newStep;
 		tryStep(yIn, yOut, yErr, step / c_light, current, z);
+		tries++;
 
 		r = yErr.u.getR() / tolerance;  // ratio of absolute direction error and tolerance
 		newStep = step * 0.95 * pow(r, -0.2);  // update step size to keep error close to tolerance
@@ -118,6 +137,172 @@ void PropagationCK::process(Candidate *candidate) const {
 	current.setDirection(yOut.u.getUnitVector());
 	candidate->setCurrentStep(step);
 	candidate->setNextStep(newStep);
+	if (statistics.isEnabled())
+		recordStep(candidate, tries, r > 1);
+}
+
+void PropagationCK::recordStep(Candidate *candidate, size_t tries, bool minimum) const {
+	IntegratorStatistics s;
+	s.acceptedSteps = 1;
+	s.rejectedSteps = tries - 1;
+	s.fieldEvaluations = 6 * tries;
+	s.minimumSteps = minimum;
+	statistics.record(candidate, s);
+}
+
+void PropagationCK::processBatch(Candidate **candidates, size_t count) const {
+	if (mixedPrecision and tolerance >= mixedPrecisionMinTolerance)
+		processBatchLanes<float, mixedPrecisionLanes>(candidates, count);
+	else
+		processBatchLanes<double, batchLanes>(candidates, count);
+}
+
+template<typename T, size_t L>
+void PropagationCK::processBatchLanes(Candidate **candidates, size_t count) const {
+	Candidate *lanes[L];
+	size_t n = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (candidates[i]->current.getCharge() == 0) {
+			PropagationCK::process(candidates[i]);
+			continue;
+		}
+		lanes[n++] = candidates[i];
+		if (n == L) {
+			processLanes<T, L>(lanes, n);
+			n = 0;
+		}
+	}
+	if (n > 0)
+		processLanes<T, L>(lanes, n);
+}
+
+template<typename T, size_t L>
+void PropagationCK::processLanes(Candidate **candidates, size_t n) const {
+	// phase points, stages and results per lane, the arithmetic is the same as in tryStep
+	// the stages and fields are of type T, positions and sums stay in double precision
+	// lanes 0 to nActive - 1 are the candidates still trying their step
+	double x[3][L], u[3][L], z[L], step[L], newStep[L], h[L];
+	T qcE[L], kx[6][3][L], ku[6][3][L];
+	double outx[3][L], outu[3][L], erru[3][L];
+	double ynx[3][L], ynu[3][L];
+	Vector3d positions[L];
+	Vector3<T> B[L];
+	Candidate *lane[L];
+	size_t tries[L];
+	size_t nActive = n;
+
+	for (size_t l = 0; l < n; l++) {
+		Candidate *c = candidates[l];
+		ParticleState &current = c->current;
+		c->previous = current;
+		const Vector3d &pos = current.getPosition();
+		const Vector3d &dir = current.getDirection();
+		x[0][l] = pos.x;
+		x[1][l] = pos.y;
+		x[2][l] = pos.z;
+		u[0][l] = dir.x;
+		u[1][l] = dir.y;
+		u[2][l] = dir.z;
+		qcE[l] = current.getCharge() * c_light / current.getEnergy();
+		z[l] = c->getRedshift();
+		step[l] = clip(c->getNextStep(), minStep, maxStep);
+		newStep[l] = step[l];
+		lane[l] = c;
+		tries[l] = 0;
+	}
+
+	// try performing steps until the lanes reach their target error or minimum step size
+	while (nActive > 0) {
+		const size_t m = nActive;
+		for (size_t l = 0; l < m; l++) {
+			step[l] = newStep[l];
+			h[l] = step[l] / c_light;
+			tries[l]++;
+			for (size_t d = 0; d < 3; d++) {
+				outx[d][l] = x[d][l];
+				outu[d][l] = u[d][l];
+				erru[d][l] = 0;
+			}
+		}
+
+		for (size_t i = 0; i < 6; i++) {
+			for (size_t d = 0; d < 3; d++) {
+				for (size_t l = 0; l < m; l++) {
+					ynx[d][l] = x[d][l];
+					ynu[d][l] = u[d][l];
+				}
+				for (size_t j = 0; j < i; j++) {
+					double aij = a[i * 6 + j];
+					for (size_t l = 0; l < m; l++) {
+						ynx[d][l] += kx[j][d][l] * aij * h[l];
+						ynu[d][l] += ku[j][d][l] * aij * h[l];
+					}
+				}
+			}
+
+			// one field evaluation for the active lanes
+			for (size_t l = 0; l < m; l++)
+				positions[l] = Vector3d(ynx[0][l], ynx[1][l], ynx[2][l]);
+			try {
+				getFieldsOf(field, positions, z, B, m);
+			} catch (std::exception &e) {
+				CRPROPA_DIAGNOSTIC("PropagationCK: exception in getField", e.what());
+				for (size_t l = 0; l < m; l++)
+					B[l] = Vector3<T>(0, 0, 0);
+			}
+
+			// derivative of the phase point, see dYdt
+			double bi = b[i], ei = b[i] - bs[i];
+			for (size_t l = 0; l < m; l++) {
+				double r = std::sqrt(ynu[0][l] * ynu[0][l] + ynu[1][l] * ynu[1][l] + ynu[2][l] * ynu[2][l]);
+				T vx = ynu[0][l] / r * c_light;
+				T vy = ynu[1][l] / r * c_light;
+				T vz = ynu[2][l] / r * c_light;
+				kx[i][0][l] = vx;
+				kx[i][1][l] = vy;
+				kx[i][2][l] = vz;
+				ku[i][0][l] = qcE[l] * (vy * B[l].z - B[l].y * vz);
+				ku[i][1][l] = qcE[l] * (vz * B[l].x - B[l].z * vx);
+				ku[i][2][l] = qcE[l] * (vx * B[l].y - B[l].x * vy);
+				for (size_t d = 0; d < 3; d++) {
+					outx[d][l] += kx[i][d][l] * bi * h[l];
+					outu[d][l] += ku[i][d][l] * bi * h[l];
+					erru[d][l] += ku[i][d][l] * ei * h[l];
+				}
+			}
+		}
+
+		// error control, lanes within the tolerance are finished and the others moved to the front
+		size_t nRemaining = 0;
+		for (size_t l = 0; l < m; l++) {
+			double r = std::sqrt(erru[0][l] * erru[0][l] + erru[1][l] * erru[1][l] + erru[2][l] * erru[2][l]) / tolerance;
+			newStep[l] = step[l] * 0.95 * pow(r, -0.2);
+			newStep[l] = clip(newStep[l], 0.1 * step[l], 5 * step[l]);
+			newStep[l] = clip(newStep[l], minStep, maxStep);
+
+			if (r > 1 and step[l] != minStep) {
+				size_t k = nRemaining++;
+				for (size_t d = 0; d < 3; d++) {
+					x[d][k] = x[d][l];
+					u[d][k] = u[d][l];
+				}
+				qcE[k] = qcE[l];
+				z[k] = z[l];
+				newStep[k] = newStep[l];
+				lane[k] = lane[l];
+				tries[k] = tries[l];
+				continue;
+			}
+			Candidate *c = lane[l];
+			c->current.setPosition(Vector3d(outx[0][l], outx[1][l], outx[2][l]));
+			c->current.setDirection(Vector3d(outu[0][l], outu[1][l], outu[2][l]).getUnitVector());
+			c->setCurrentStep(step[l]);
+			c->setNextStep(newStep[l]);
+			if (statistics.isEnabled())
+				recordStep(c, tries[l], r > 1);
+		}
+		nActive = nRemaining;
+	}
 }
 
 void PropagationCK::setField(ref_ptr<MagneticField> f) {
@@ -145,6 +330,29 @@ void PropagationCK::setMaximumStep(double max) {
 	maxStep = max;
 }
 
+void PropagationCK::setRecordStatistics(bool record, bool asProperties) {
+	statistics.enable("PropagationCK", record, asProperties);
+}
+
+bool PropagationCK::getIntegratorStatistics(IntegratorStatistics &s) const {
+	if (not statistics.isEnabled())
+		return false;
+	s = statistics.getTotal();
+	return true;
+}
+
+void PropagationCK::resetStatistics() {
+	statistics.reset();
+}
+
+size_t PropagationCK::getMemoryUsage() const {
+	return field.valid() ? field->getMemoryUsage() : 0;
+}
+
+void PropagationCK::setMixedPrecision(bool mixed) {
+	mixedPrecision = mixed;
+}
+
 double PropagationCK::getTolerance() const {
 	return tolerance;
 }
@@ -157,12 +365,18 @@ double PropagationCK::getMaximumStep() const {
 	return maxStep;
 }
 
+bool PropagationCK::isMixedPrecision() const {
+	return mixedPrecision;
+}
+
 std::string PropagationCK::getDescription() const {
 	std::stringstream s;
 	s << "Propagation in magnetic fields using the Cash-Karp method.";
 	s << " Target error: " << tolerance;
 	s << ", Minimum Step: " << minStep / kpc << " kpc";
 	s << ", Maximum Step: " << maxStep / kpc << " kpc";
+	if (mixedPrecision)
+		s << ", mixed precision";
 	return s.str();
 }
 
@@ -0,0 +1,262 @@
+#include "crpropa/module/PropagationDP.h"
+#include "crpropa/Diagnostics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+
+namespace crpropa {
+
+// Dormand-Prince coefficients, the last row holds the 5th order weights
+static const double dp_a[7][6] = {
+	{0., 0., 0., 0., 0., 0.},
+	{1. / 5., 0., 0., 0., 0., 0.},
+	{3. / 40., 9. / 40., 0., 0., 0., 0.},
+	{44. / 45., -56. / 15., 32. / 9., 0., 0., 0.},
+	{19372. / 6561., -25360. / 2187., 64448. / 6561., -212. / 729., 0., 0.},
+	{9017. / 3168., -355. / 33., 46732. / 5247., 49. / 176., -5103. / 18656., 0.},
+	{35. / 384., 0., 500. / 1113., 125. / 192., -2187. / 6784., 11. / 84.}
+};
+
+// difference of the 5th and 4th order weights
+static const double dp_e[] = {
+	71. / 57600., 0., -71. / 16695., 71. / 1920., -17253. / 339200., 22. / 525., -1. / 40.
+};
+
+// continuous extension (Hairer, Norsett & Wanner, Solving ODE I, DOPRI5)
+static const double dp_d[] = {
+	-12715105075. / 11282082432., 0., 87487479700. / 32700410799., -10690763975. / 1880347072.,
+	701980252875. / 199316789632., -1453857185. / 822651844., 69997945. / 29380423.
+};
+
+namespace {
+// last step of a candidate in this thread
+struct DPStep {
+	const Candidate *candidate;
+	uint64_t serialNumber; // of the candidate, whose address may be reused
+	const PropagationDP *module;
+	uint64_t fieldGeneration; // of the module, changed by setField
+	double z;
+	Vector3d xEnd; // position at the end of the step
+	Vector3d B; // field at the end of the step
+	double errOld; // error ratio of the last accepted step, for the PI controller
+	bool dense;
+	PropagationCK::Y r[5]; // coefficients of the dense output
+};
+
+const size_t dpSlots = 256;
+
+DPStep &stepSlot(const Candidate *candidate) {
+	static thread_local DPStep steps[dpSlots];
+	uintptr_t key = reinterpret_cast<uintptr_t>(candidate);
+	return steps[(key >> 4) % dpSlots];
+}
+}
+
+PropagationDP::PropagationDP(ref_ptr<MagneticField> field, double tolerance,
+		double minStep, double maxStep) :
+		minStep(0) {
+	setField(field);
+	setTolerance(tolerance);
+	setMaximumStep(maxStep);
+	setMinimumStep(minStep);
+}
+
+Vector3d PropagationDP::getField(const Vector3d &position, double z) const {
+	Vector3d B(0, 0, 0);
+	try {
+		B = field->getField(position, z);
+	} catch (std::exception &e) {
+		CRPROPA_DIAGNOSTIC("PropagationDP: exception in getField", e.what());
+	}
+	return B;
+}
+
+PropagationDP::Y PropagationDP::dYdt(const Y &y, const ParticleState &p, const Vector3d &B) const {
+	// normalize direction vector to prevent numerical losses
+	Vector3d velocity = y.u.getUnitVector() * c_light;
+	// Lorentz force: du/dt = q*c/E * (v x B)
+	Vector3d dudt = p.getCharge() * c_light / p.getEnergy() * velocity.cross(B);
+	return Y(velocity, dudt);
+}
+
+void PropagationDP::process(Candidate *candidate) const {
+	// save the new previous particle state
+	ParticleState &current = candidate->current;
+	candidate->previous = current;
+
+	double step = clip(candidate->getNextStep(), minStep, maxStep);
+	DPStep &last = stepSlot(candidate);
+
+	// rectilinear propagation for neutral particles
+	if (current.getCharge() == 0) {
+		Vector3d pos = current.getPosition();
+		Vector3d dir = current.getDirection();
+		current.setPosition(pos + dir * step);
+		candidate->setCurrentStep(step);
+		candidate->setNextStep(maxStep);
+		if (last.candidate == candidate)
+			last.candidate = NULL;
+		return;
+	}
+
+	double z = candidate->getRedshift();
+	Y y0(current.getPosition(), current.getDirection());
+
+	// first same as last: the field at the end of the previous step
+	bool reuse = (last.candidate == candidate)
+			and (last.serialNumber == candidate->getSerialNumber()) and (last.module == this)
+			and (last.fieldGeneration == fieldGeneration) and (last.z == z)
+			and last.dense and (last.xEnd == y0.x);
+	Vector3d B = reuse ? last.B : getField(y0.x, z);
+	double errOld = reuse ? last.errOld : 1e-4;
+
+	Y k[7];
+	k[0] = dYdt(y0, current, B);
+	Y y1;
+	double r = 42;  // arbitrary value > 1
+	double newStep = step;
+
+	// try performing step until the target error (tolerance) or the minimum step size has been reached
+	while (true) {
+		step = newStep;
+		double h = step / c_light;
+		for (size_t i = 1; i < 7; i++) {
+			Y y_n = y0;
+			for (size_t j = 0; j < i; j++)
+				y_n += k[j] * (dp_a[i][j] * h);
+			B = getField(y_n.x, z);
+			k[i] = dYdt(y_n, current, B);
+			if (i == 6)
+				y1 = y_n; // the last stage is evaluated at the 5th order solution
+		}
+		Y error(0);
+		for (size_t i = 0; i < 7; i++)
+			error += k[i] * (dp_e[i] * h);
+		r = std::max(error.u.getR() / tolerance, 1e-10);  // ratio of absolute direction error and tolerance
+
+		if (r <= 1 or step == minStep)
+			break;
+
+		// rejected: reduce the step size
+		newStep = step * std::max(0.9 * pow(r, -0.2), 0.1);
+		newStep = clip(newStep, minStep, maxStep);
+	}
+
+	// PI controller for the next step
+	const double beta = 0.04;
+	double factor = 0.9 * pow(r, -0.2 + 0.75 * beta) * pow(errOld, beta);
+	newStep = clip(step * factor, 0.1 * step, 5 * step);  // limit the step size change
+	newStep = clip(newStep, minStep, maxStep);
+
+	// store the step for the dense output and the next step
+	double h = step / c_light;
+	Y dy = y1;
+	dy += y0 * -1;
+	Y spline = k[0] * h;
+	spline += dy * -1;
+	last.r[0] = y0;
+	last.r[1] = dy;
+	last.r[2] = spline;
+	last.r[3] = dy;
+	last.r[3] += k[6] * -h;
+	last.r[3] += spline * -1;
+	last.r[4] = Y(0);
+	for (size_t i = 0; i < 7; i++)
+		last.r[4] += k[i] * (dp_d[i] * h);
+	last.candidate = candidate;
+	last.serialNumber = candidate->getSerialNumber();
+	last.module = this;
+	last.fieldGeneration = fieldGeneration;
+	last.z = z;
+	last.xEnd = y1.x;
+	last.B = B;
+	last.errOld = std::max(r, 1e-4);
+	last.dense = true;
+
+	current.setPosition(y1.x);
+	current.setDirection(y1.u.getUnitVector());
+	candidate->setCurrentStep(step);
+	candidate->setNextStep(newStep);
+}
+
+bool PropagationDP::getDenseOutput(const Candidate *candidate, double theta, Vector3d &position, Vector3d &direction) const {
+	const DPStep &last = stepSlot(candidate);
+	const Vector3d &x0 = candidate->previous.getPosition();
+	const Vector3d &x1 = candidate->current.getPosition();
+	if ((last.candidate == candidate) and (last.serialNumber == candidate->getSerialNumber())
+			and (last.module == this) and last.dense
+			and (last.r[0].x == x0) and (last.xEnd == x1)) {
+		// y(theta) = r0 + theta (r1 + (1 - theta) (r2 + theta (r3 + (1 - theta) r4)))
+		double t1 = 1 - theta;
+		Y y = last.r[4] * t1;
+		y += last.r[3];
+		y = y * theta;
+		y += last.r[2];
+		y = y * t1;
+		y += last.r[1];
+		y = y * theta;
+		y += last.r[0];
+		position = y.x;
+		direction = y.u.getUnitVector();
+		return true;
+	}
+
+	position = x0 * (1 - theta) + x1 * theta;
+	direction = (candidate->previous.getDirection() * (1 - theta) + candidate->current.getDirection() * theta).getUnitVector();
+	return false;
+}
+
+void PropagationDP::setField(ref_ptr<MagneticField> f) {
+	// unique over all modules, as a module may be allocated at the address of a deleted one
+	static std::atomic<uint64_t> generations(0);
+	field = f;
+	fieldGeneration = ++generations;
+}
+
+void PropagationDP::setTolerance(double tol) {
+	if ((tol > 1) or (tol < 0))
+		throw std::runtime_error(
+				"PropagationDP: target error not in range 0-1");
+	tolerance = tol;
+}
+
+void PropagationDP::setMinimumStep(double min) {
+	if (min < 0)
+		throw std::runtime_error("PropagationDP: minStep < 0 ");
+	if (min > maxStep)
+		throw std::runtime_error("PropagationDP: minStep > maxStep");
+	minStep = min;
+}
+
+void PropagationDP::setMaximumStep(double max) {
+	if (max < minStep)
+		throw std::runtime_error("PropagationDP: maxStep < minStep");
+	maxStep = max;
+}
+
+double PropagationDP::getTolerance() const {
+	return tolerance;
+}
+
+double PropagationDP::getMinimumStep() const {
+	return minStep;
+}
+
+double PropagationDP::getMaximumStep() const {
+	return maxStep;
+}
+
+std::string PropagationDP::getDescription() const {
+	std::stringstream s;
+	s << "Propagation in magnetic fields using the Dormand-Prince method.";
+	s << " Target error: " << tolerance;
+	s << ", Minimum Step: " << minStep / kpc << " kpc";
+	s << ", Maximum Step: " << maxStep / kpc << " kpc";
+	return s.str();
+}
+
+} // namespace crpropa
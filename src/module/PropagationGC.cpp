@@ -0,0 +1,206 @@
+#include "crpropa/module/PropagationGC.h"
+
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+namespace crpropa {
+
+PropagationGC::PropagationGC(ref_ptr<MagneticField> field, double tolerance,
+		double minStep, double maxStep) :
+		minStep(0) {
+	fullOrbit = new PropagationBP(field, 1e-4, minStep, maxStep);
+	setField(field);
+	setTolerance(tolerance);
+	setMaximumStep(maxStep);
+	setMinimumStep(minStep);
+	setMaximumLarmorRatio(0.1);
+}
+
+Vector3d PropagationGC::getField(const Vector3d &pos, double z) const {
+	if (field.valid())
+		return field->getField(pos, z);
+	return Vector3d(0, 0, 0);
+}
+
+bool PropagationGC::fieldGeometry(const Vector3d &pos, double z, double delta,
+		FieldGeometry &g) const {
+	Vector3d B = getField(pos, z);
+	g.B = B.getR();
+	if (g.B == 0)
+		return false;
+	g.b = B / g.B;
+
+	// gradient of the field strength by central differences
+	for (int i = 0; i < 3; i++) {
+		Vector3d d(0, 0, 0);
+		d.data[i] = delta;
+		g.gradB.data[i] = (getField(pos + d, z).getR() - getField(pos - d, z).getR()) / (2 * delta);
+	}
+
+	// curvature (b.grad) b, differences along the field line
+	Vector3d Bp = getField(pos + g.b * delta, z);
+	Vector3d Bm = getField(pos - g.b * delta, z);
+	Vector3d bp = (Bp.getR() > 0) ? Bp.getUnitVector() : g.b;
+	Vector3d bm = (Bm.getR() > 0) ? Bm.getUnitVector() : g.b;
+	g.curvature = (bp - bm) / (2 * delta);
+	return true;
+}
+
+Vector3d PropagationGC::driftVelocity(const FieldGeometry &g, double p,
+		double mu, double q) const {
+	// v_gradB = p_perp v_perp / (2 q B^2) b x grad B
+	// v_curv  = p_par v_par / (q B) b x (b.grad) b
+	double rg = p / q / g.B;
+	Vector3d vGrad = g.b.cross(g.gradB) * (rg * (1 - mu * mu) / 2 / g.B);
+	Vector3d vCurv = g.b.cross(g.curvature) * (rg * mu * mu);
+	return g.b * mu + vGrad + vCurv;
+}
+
+void PropagationGC::process(Candidate *candidate) const {
+	// save the new previous particle state
+	ParticleState &current = candidate->current;
+	candidate->previous = current;
+
+	double step = clip(candidate->getNextStep(), minStep, maxStep);
+	double q = current.getCharge();
+
+	// rectilinear propagation for neutral particles
+	if (q == 0) {
+		current.setPosition(current.getPosition() + current.getDirection() * step);
+		candidate->setCurrentStep(step);
+		candidate->setNextStep(maxStep);
+		return;
+	}
+
+	double z = candidate->getRedshift();
+	double p = current.getMomentum().getR();
+	double delta = 1e-2 * step;
+	Vector3d x0 = current.getPosition();
+	Vector3d u0 = current.getDirection();
+
+	FieldGeometry g0;
+	if (not fieldGeometry(x0, z, delta, g0)) {
+		fullOrbit->process(candidate);
+		return;
+	}
+
+	// smallest scale of the field: gradient scale and curvature radius
+	double scale = std::numeric_limits<double>::max();
+	if (g0.gradB.getR() > 0)
+		scale = std::min(scale, g0.B / g0.gradB.getR());
+	if (g0.curvature.getR() > 0)
+		scale = std::min(scale, 1 / g0.curvature.getR());
+
+	// drift approximation requires the Larmor radius to be small compared to this scale
+	double rL = p / fabs(q) / g0.B;
+	if (rL > maxLarmorRatio * scale) {
+		fullOrbit->process(candidate);
+		return;
+	}
+
+	// midpoint step of the guiding centre, the magnetic moment sin^2(pitch) / B is conserved
+	double mu0 = u0.dot(g0.b);
+	double sin2 = 1 - mu0 * mu0;
+	double sign = (mu0 < 0) ? -1 : 1;
+	Vector3d v0 = driftVelocity(g0, p, mu0, q);
+
+	FieldGeometry gm;
+	if (not fieldGeometry(x0 + v0 * (step / 2), z, delta, gm)) {
+		fullOrbit->process(candidate);
+		return;
+	}
+	double muM = sign * sqrt(std::max(0., 1 - sin2 * gm.B / g0.B));
+	Vector3d x1 = x0 + driftVelocity(gm, p, muM, q) * step;
+
+	// pitch angle at the new position, reflected beyond a magnetic mirror
+	Vector3d B1 = getField(x1, z);
+	double b1 = B1.getR();
+	Vector3d e1 = (b1 > 0) ? B1 / b1 : g0.b;
+	double mu1 = -mu0;
+	if (b1 > 0 and sin2 * b1 / g0.B < 1)
+		mu1 = sign * sqrt(1 - sin2 * b1 / g0.B);
+
+	// keep the gyration phase: perpendicular part of the direction, turned into the new field
+	Vector3d perp = u0 - g0.b * mu0;
+	perp -= e1 * perp.dot(e1);
+	if (perp.getR() < 1e-12)
+		perp = e1.cross(fabs(e1.x) < 0.9 ? Vector3d(1, 0, 0) : Vector3d(0, 1, 0));
+	Vector3d u1 = e1 * mu1 + perp.getUnitVector() * sqrt(std::max(0., 1 - mu1 * mu1));
+
+	current.setPosition(x1);
+	current.setDirection(u1.getUnitVector());
+	candidate->setCurrentStep(step);
+	candidate->setNextStep(clip(tolerance * scale, minStep, maxStep));
+}
+
+void PropagationGC::setField(ref_ptr<MagneticField> f) {
+	field = f;
+	fullOrbit->setField(f);
+}
+
+ref_ptr<MagneticField> PropagationGC::getField() const {
+	return field;
+}
+
+ref_ptr<PropagationBP> PropagationGC::getFullOrbitPropagation() const {
+	return fullOrbit;
+}
+
+void PropagationGC::setTolerance(double tol) {
+	if ((tol > 1) or (tol <= 0))
+		throw std::runtime_error(
+				"PropagationGC: tolerance not in range 0-1");
+	tolerance = tol;
+}
+
+void PropagationGC::setMinimumStep(double min) {
+	if (min < 0)
+		throw std::runtime_error("PropagationGC: minStep < 0 ");
+	if (min > maxStep)
+		throw std::runtime_error("PropagationGC: minStep > maxStep");
+	minStep = min;
+	fullOrbit->setMinimumStep(min);
+}
+
+void PropagationGC::setMaximumStep(double max) {
+	if (max < minStep)
+		throw std::runtime_error("PropagationGC: maxStep < minStep");
+	maxStep = max;
+	fullOrbit->setMaximumStep(max);
+}
+
+void PropagationGC::setMaximumLarmorRatio(double ratio) {
+	if (ratio <= 0)
+		throw std::runtime_error("PropagationGC: Larmor ratio <= 0");
+	maxLarmorRatio = ratio;
+}
+
+double PropagationGC::getTolerance() const {
+	return tolerance;
+}
+
+double PropagationGC::getMinimumStep() const {
+	return minStep;
+}
+
+double PropagationGC::getMaximumStep() const {
+	return maxStep;
+}
+
+double PropagationGC::getMaximumLarmorRatio() const {
+	return maxLarmorRatio;
+}
+
+std::string PropagationGC::getDescription() const {
+	std::stringstream s;
+	s << "Guiding-centre propagation in magnetic fields.";
+	s << " Tolerance: " << tolerance;
+	s << ", Minimum Step: " << minStep / kpc << " kpc";
+	s << ", Maximum Step: " << maxStep / kpc << " kpc";
+	s << ", full orbits above Larmor radius / gradient scale " << maxLarmorRatio;
+	return s.str();
+}
+
+} // namespace crpropa
@@ -0,0 +1,126 @@
+#include "crpropa/module/PropagationSmallAngle.h"
+#include "crpropa/module/PropagationCK.h"
+#include "crpropa/Random.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+namespace crpropa {
+
+PropagationSmallAngle::PropagationSmallAngle(ref_ptr<TurbulentField> field, double steps,
+		double maxDeflection) : field(field) {
+	if (not field.valid())
+		throw std::runtime_error("PropagationSmallAngle: no turbulent field");
+	correlationLength = field->getCorrelationLength();
+	brms = field->getBrms();
+	if (not (correlationLength > 0))
+		throw std::runtime_error("PropagationSmallAngle: the correlation length must be positive");
+	setSteps(steps);
+	setMaximumDeflection(maxDeflection);
+	fallback = new PropagationCK(field, 1e-4, 0.01 * correlationLength, steps * correlationLength);
+}
+
+double PropagationSmallAngle::getLarmorRadius(const Candidate *candidate) const {
+	if (brms == 0)
+		return std::numeric_limits<double>::infinity();
+	return candidate->current.getRigidity() / (c_light * brms);
+}
+
+bool PropagationSmallAngle::isSmallAngle(const Candidate *candidate) const {
+	return correlationLength < maxDeflection * getLarmorRadius(candidate);
+}
+
+void PropagationSmallAngle::process(Candidate *candidate) const {
+	ParticleState &current = candidate->current;
+	double step = std::min(steps * correlationLength, candidate->getNextStep());
+
+	if (current.getCharge() == 0) {
+		candidate->previous = current;
+		current.setPosition(current.getPosition() + current.getDirection() * step);
+		candidate->setCurrentStep(step);
+		candidate->setNextStep(steps * correlationLength);
+		return;
+	}
+	if (not isSmallAngle(candidate)) {
+		fallback->process(candidate);
+		return;
+	}
+	candidate->previous = current;
+
+	// the rms deflection of the step is at most maxDeflection
+	double rL = getLarmorRadius(candidate);
+	double diffusion = correlationLength / (2 * rL * rL); // angular variance per length and component
+	step = std::min(step, maxDeflection * maxDeflection / (2 * diffusion));
+
+	// orthonormal basis perpendicular to the direction
+	Vector3d dir = current.getDirection();
+	Vector3d axis = (std::fabs(dir.x) < 0.9) ? Vector3d(1, 0, 0) : Vector3d(0, 1, 0);
+	Vector3d e1 = dir.cross(axis).getUnitVector();
+	Vector3d e2 = dir.cross(e1);
+
+	// deflection and transverse offset of the diffusing direction
+	Random &random = Random::instance();
+	double sigmaAngle = std::sqrt(diffusion * step);
+	double sigmaOffset = std::sqrt(diffusion * step * step * step / 12);
+	double theta1 = sigmaAngle * random.randNorm();
+	double theta2 = sigmaAngle * random.randNorm();
+	double offset1 = theta1 * step / 2 + sigmaOffset * random.randNorm();
+	double offset2 = theta2 * step / 2 + sigmaOffset * random.randNorm();
+
+	double theta = std::sqrt(theta1 * theta1 + theta2 * theta2);
+	Vector3d newDir = dir;
+	if (theta > 0)
+		newDir = dir * std::cos(theta) + (e1 * theta1 + e2 * theta2) * (std::sin(theta) / theta);
+	current.setPosition(current.getPosition() + dir * step + e1 * offset1 + e2 * offset2);
+	current.setDirection(newDir.getUnitVector());
+	candidate->setCurrentStep(step);
+	candidate->setNextStep(steps * correlationLength);
+}
+
+void PropagationSmallAngle::setFallback(Module *propagation) {
+	if (propagation == 0)
+		throw std::runtime_error("PropagationSmallAngle: no fallback propagation");
+	fallback = propagation;
+}
+
+Module *PropagationSmallAngle::getFallback() const {
+	return fallback;
+}
+
+void PropagationSmallAngle::setSteps(double steps) {
+	if (not (steps > 0))
+		throw std::runtime_error("PropagationSmallAngle: the number of correlation lengths per step must be positive");
+	this->steps = steps;
+}
+
+double PropagationSmallAngle::getSteps() const {
+	return steps;
+}
+
+void PropagationSmallAngle::setMaximumDeflection(double maxDeflection) {
+	if (not (maxDeflection > 0))
+		throw std::runtime_error("PropagationSmallAngle: the maximum deflection must be positive");
+	this->maxDeflection = maxDeflection;
+}
+
+double PropagationSmallAngle::getMaximumDeflection() const {
+	return maxDeflection;
+}
+
+ref_ptr<TurbulentField> PropagationSmallAngle::getField() const {
+	return field;
+}
+
+std::string PropagationSmallAngle::getDescription() const {
+	std::stringstream s;
+	s << "Propagation by random small-angle deflections in a turbulent field: Brms = "
+			<< brms / nG << " nG, correlation length = " << correlationLength / kpc << " kpc, "
+			<< steps << " correlation lengths per step, maximum deflection " << maxDeflection
+			<< " rad per step";
+	return s.str();
+}
+
+} // namespace crpropa
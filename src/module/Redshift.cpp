@@ -27,6 +27,17 @@ void Redshift::process(Candidate *c) const {
 	c->current.setEnergy(E * (1 - dz / (1 + z)));
 }
 
+bool Redshift::hasEnergyLossRate() const {
+	return true;
+}
+
+double Redshift::getEnergyLossRate(const Candidate *candidate, double E, double z) const {
+	if (z <= std::numeric_limits<double>::min())
+		return 0;
+	// dE / dz = E / (1 + z) with dz / ds = H(z) / c
+	return E / (1 + z) * hubbleRate(z) / c_light;
+}
+
 std::string Redshift::getDescription() const {
 	std::stringstream s;
 	s << "Redshift: h0 = " << hubbleRate() / 1e5 * Mpc << ", omegaL = "
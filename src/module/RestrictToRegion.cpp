@@ -5,6 +5,10 @@ namespace crpropa {
 
   RestrictToRegion::RestrictToRegion(Module* _module, Surface* _surface) : module(_module), surface(_surface) { };
 
+void RestrictToRegion::prepare() {
+	module->prepare();
+}
+
 void RestrictToRegion::process(Candidate *candidate) const
 {
 if (surface->distance(candidate->current.getPosition()) <=0)
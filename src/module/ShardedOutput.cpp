@@ -0,0 +1,219 @@
+#include "crpropa/module/ShardedOutput.h"
+#include "crpropa/module/TextOutput.h"
+#include "kiss/logger.h"
+#ifdef CRPROPA_HAVE_HDF5
+#include "crpropa/module/HDF5Output.h"
+#endif
+#ifdef CRPROPA_HAVE_PARQUET
+#include "crpropa/module/ParquetOutput.h"
+#endif
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef CRPROPA_HAVE_MPI
+#include <mpi.h>
+#endif
+
+namespace crpropa {
+
+static std::string jsonString(const std::string &s) {
+	std::string quoted = "\"";
+	for (size_t i = 0; i < s.size(); i++) {
+		if ((s[i] == '"') or (s[i] == '\\'))
+			quoted += '\\';
+		quoted += s[i];
+	}
+	return quoted + "\"";
+}
+
+ShardedOutput::ShardedOutput(const std::string &filename, OutputType outputType, Format format) :
+		Output(outputType), filename(filename), outputType(outputType), format(format),
+		rank(0), nRanks(1), closed(false) {
+#ifndef CRPROPA_HAVE_HDF5
+	if (format == HDF5)
+		throw std::runtime_error("ShardedOutput: CRPropa was built without HDF5");
+#endif
+#ifndef CRPROPA_HAVE_PARQUET
+	if (format == Parquet)
+		throw std::runtime_error("ShardedOutput: CRPropa was built without Parquet");
+#endif
+	size_t nThreads = 1;
+#ifdef _OPENMP
+	nThreads = std::max(omp_get_max_threads(), omp_get_num_procs());
+#endif
+	shards.resize(nThreads + 1);
+}
+
+ShardedOutput::~ShardedOutput() {
+	try {
+		close();
+	} catch (std::exception &e) {
+		KISS_LOG_ERROR << "ShardedOutput: " << e.what();
+	}
+}
+
+void ShardedOutput::detectRank() const {
+#ifdef CRPROPA_HAVE_MPI
+	int initialized = 0, finalized = 0;
+	MPI_Initialized(&initialized);
+	MPI_Finalized(&finalized);
+	if (initialized and not finalized) {
+		MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+		MPI_Comm_size(MPI_COMM_WORLD, &nRanks);
+	}
+#endif
+}
+
+std::string ShardedOutput::getShardName(int r, size_t thread) const {
+	size_t slash = filename.rfind('/');
+	size_t dot = filename.rfind('.');
+	if ((dot == std::string::npos) or ((slash != std::string::npos) and (dot < slash)))
+		dot = filename.size();
+	std::stringstream ss;
+	ss << filename.substr(0, dot) << ".r" << r << ".t" << thread << filename.substr(dot);
+	return ss.str();
+}
+
+std::string ShardedOutput::getManifestName() const {
+	return filename + ".json";
+}
+
+const std::vector<std::string> &ShardedOutput::getShardFiles() const {
+	return closedFiles;
+}
+
+ref_ptr<Output> ShardedOutput::createShard(const std::string &name) const {
+#ifdef CRPROPA_HAVE_HDF5
+	if (format == HDF5)
+		return new HDF5Output(name, outputType);
+#endif
+#ifdef CRPROPA_HAVE_PARQUET
+	if (format == Parquet)
+		return new ParquetOutput(name, outputType);
+#endif
+	return new TextOutput(name, outputType);
+}
+
+Output *ShardedOutput::getShard(size_t i) const {
+	// only the thread of the shard creates it
+	if (!shards[i].valid()) {
+		ref_ptr<Output> shard = createShard(getShardName(rank, i));
+		shard->copyConfiguration(*this);
+		shards[i] = shard;
+	}
+	return shards[i];
+}
+
+void ShardedOutput::process(Candidate *candidate) const {
+	if (closed)
+		throw std::runtime_error("ShardedOutput: output is closed");
+	std::call_once(rankDetected, &ShardedOutput::detectRank, this);
+	size_t i = 0;
+#ifdef _OPENMP
+	i = omp_get_thread_num();
+#endif
+	if (i + 1 < shards.size()) {
+		getShard(i)->process(candidate);
+		return;
+	}
+	// more threads than processors, the last shard is shared
+	std::lock_guard<std::mutex> lock(overflowMutex);
+	getShard(shards.size() - 1)->process(candidate);
+}
+
+void ShardedOutput::flush() const {
+#ifdef _OPENMP
+	if (omp_in_parallel()) {
+		size_t i = omp_get_thread_num();
+		if ((i + 1 < shards.size()) and shards[i].valid())
+			shards[i]->flush();
+		return;
+	}
+#endif
+	for (size_t i = 0; i < shards.size(); i++)
+		if (shards[i].valid())
+			shards[i]->flush();
+}
+
+void ShardedOutput::close() {
+	if (closed)
+		return;
+	closed = true;
+	std::call_once(rankDetected, &ShardedOutput::detectRank, this);
+
+	// the outputs close their files when released
+	std::stringstream entries;
+	count = 0;
+	for (size_t i = 0; i < shards.size(); i++) {
+		if (!shards[i].valid())
+			continue;
+		std::string name = getShardName(rank, i);
+		size_t slash = name.rfind('/');
+		if (slash != std::string::npos)
+			name = name.substr(slash + 1);
+		size_t rows = shards[i]->size();
+		shards[i] = 0;
+		closedFiles.push_back(getShardName(rank, i));
+		count += rows;
+		entries << (entries.tellp() > 0 ? ",\n" : "") << "    {\"file\": " << jsonString(name)
+				<< ", \"rank\": " << rank << ", \"thread\": " << i << ", \"rows\": " << rows << "}";
+	}
+
+#ifdef CRPROPA_HAVE_MPI
+	int finalized = 0;
+	MPI_Finalized(&finalized);
+	if ((nRanks > 1) and not finalized) {
+		// the entries of all ranks are gathered by rank 0
+		std::string local = entries.str();
+		int size = local.size();
+		std::vector<int> sizes(nRanks), offsets(nRanks, 0);
+		MPI_Gather(&size, 1, MPI_INT, &sizes[0], 1, MPI_INT, 0, MPI_COMM_WORLD);
+		for (int r = 1; r < nRanks; r++)
+			offsets[r] = offsets[r - 1] + sizes[r - 1];
+		std::vector<char> all(offsets[nRanks - 1] + sizes[nRanks - 1] + 1);
+		MPI_Gatherv(local.empty() ? NULL : &local[0], size, MPI_CHAR, &all[0], &sizes[0],
+				&offsets[0], MPI_CHAR, 0, MPI_COMM_WORLD);
+		if (rank != 0)
+			return;
+		std::string joined;
+		for (int r = 0; r < nRanks; r++) {
+			if (sizes[r] == 0)
+				continue;
+			if (!joined.empty())
+				joined += ",\n";
+			joined.append(&all[offsets[r]], sizes[r]);
+		}
+		writeManifest(joined);
+		return;
+	}
+#endif
+	writeManifest(entries.str());
+}
+
+void ShardedOutput::writeManifest(const std::string &entries) const {
+	static const char *formats[] = {"TextOutput", "HDF5Output", "ParquetOutput"};
+	std::ofstream out(getManifestName().c_str());
+	if (!out)
+		throw std::runtime_error("ShardedOutput: could not write " + getManifestName());
+	out << "{\n  \"format\": \"CRPropa sharded output\",\n  \"version\": 1,\n"
+			<< "  \"output\": " << jsonString(formats[format]) << ",\n"
+			<< "  \"outputType\": " << jsonString(outputName) << ",\n"
+			<< "  \"shards\": [\n" << entries << (entries.empty() ? "" : "\n") << "  ]\n}\n";
+}
+
+std::string ShardedOutput::getDescription() const {
+	static const char *formats[] = {"TextOutput", "HDF5Output", "ParquetOutput"};
+	std::stringstream ss;
+	ss << "ShardedOutput: " << formats[format] << " shards of " << filename
+			<< ", manifest " << getManifestName();
+	return ss.str();
+}
+
+} // namespace crpropa
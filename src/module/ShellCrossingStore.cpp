@@ -0,0 +1,501 @@
+#include "crpropa/module/ShellCrossingStore.h"
+#include "crpropa/Units.h"
+#include "kiss/logger.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace crpropa {
+
+// store:  Char[8] "CRPSXST1", UInt32 nShells, Double[4] (center, radius) per
+//         shell, UInt32 nShards, per shard UInt32 length, Char[] name
+//         (relative to the store) and UInt64 records
+// shard:  Char[8] "CRPSXSH1", records, footer
+// record: UInt32 size of the rest, UInt32 shell, UInt8 outward, UInt32 n,
+//         UInt64[n] lineage, Double[n] creation lengths, Candidate::serialize
+// footer: per record UInt64 offset, UInt64 source serial, Double trajectory
+//         length, UInt32 shell, then UInt64 records, Char[8] "CRPSXIX1"
+static const char storeMagic[8] = {'C', 'R', 'P', 'S', 'X', 'S', 'T', '1'};
+static const char shardMagic[8] = {'C', 'R', 'P', 'S', 'X', 'S', 'H', '1'};
+static const char indexMagic[8] = {'C', 'R', 'P', 'S', 'X', 'I', 'X', '1'};
+static const size_t indexEntrySize = 3 * 8 + 4;
+
+template<typename T>
+static void append(std::vector<char> &buffer, const T &value) {
+	const char *p = (const char *) &value;
+	buffer.insert(buffer.end(), p, p + sizeof(T));
+}
+
+template<typename T>
+static T extract(const std::vector<char> &buffer, size_t &offset) {
+	if (offset + sizeof(T) > buffer.size())
+		throw std::runtime_error("ShellCrossingStore: record too short");
+	T value;
+	memcpy(&value, &buffer[offset], sizeof(T));
+	offset += sizeof(T);
+	return value;
+}
+
+template<typename T>
+static T readValue(std::istream &in) {
+	T value;
+	in.read((char *) &value, sizeof(T));
+	return value;
+}
+
+// ShellCrossingRecorder ------------------------------------------------------
+ShellCrossingRecorder::Shard::Shard() : records(0), offset(0) {
+}
+
+ShellCrossingRecorder::ShellCrossingRecorder(const std::string &filename) :
+		filename(filename), limitStep(true), closed(false) {
+	creationKey = Candidate::getPropertyKey("ShellCrossingCreation");
+	size_t nThreads = 1;
+#ifdef _OPENMP
+	nThreads = std::max(omp_get_max_threads(), omp_get_num_procs());
+#endif
+	shards.resize(nThreads + 1);
+}
+
+ShellCrossingRecorder::~ShellCrossingRecorder() {
+	try {
+		close();
+	} catch (std::exception &e) {
+		KISS_LOG_ERROR << "ShellCrossingRecorder: " << e.what();
+	}
+}
+
+void ShellCrossingRecorder::addShell(const Vector3d &center, double radius) {
+	if (not (radius > 0))
+		throw std::runtime_error("ShellCrossingRecorder: the radius must be positive");
+	centers.push_back(center);
+	radii.push_back(radius);
+}
+
+size_t ShellCrossingRecorder::getNumberOfShells() const {
+	return radii.size();
+}
+
+void ShellCrossingRecorder::setLimitStep(bool limitStep) {
+	this->limitStep = limitStep;
+}
+
+std::string ShellCrossingRecorder::getShardName(size_t thread) const {
+	size_t slash = filename.rfind('/');
+	size_t dot = filename.rfind('.');
+	if ((dot == std::string::npos) or ((slash != std::string::npos) and (dot < slash)))
+		dot = filename.size();
+	std::stringstream ss;
+	ss << filename.substr(0, dot) << ".t" << thread << filename.substr(dot);
+	return ss.str();
+}
+
+const std::vector<std::string> &ShellCrossingRecorder::getShardFiles() const {
+	return closedFiles;
+}
+
+void ShellCrossingRecorder::process(Candidate *candidate) const {
+	if (closed)
+		throw std::runtime_error("ShellCrossingRecorder: store is closed");
+
+	// secondaries: trajectory length at creation, at their first step
+	if ((candidate->getCreatedSerialNumber() != candidate->getSerialNumber())
+			and not candidate->hasProperty(creationKey))
+		candidate->setProperty(creationKey,
+				candidate->getTrajectoryLength() - candidate->getCurrentStep());
+
+	// crossed shells, in the order of the crossings along the step
+	Vector3d from = candidate->previous.getPosition();
+	Vector3d to = candidate->current.getPosition();
+	double nearest = std::numeric_limits<double>::max();
+	std::vector<std::pair<double, size_t> > crossed;
+	for (size_t i = 0; i < radii.size(); i++) {
+		double d0 = (from - centers[i]).getR() - radii[i];
+		double d1 = (to - centers[i]).getR() - radii[i];
+		nearest = std::min(nearest, std::fabs(d1));
+		if ((d0 != 0) and (d0 * d1 <= 0))
+			crossed.push_back(std::make_pair(d0 / (d0 - d1), i));
+	}
+	if (limitStep)
+		candidate->limitNextStep(nearest);
+	if (crossed.empty())
+		return;
+	std::sort(crossed.begin(), crossed.end());
+
+	size_t t = 0;
+#ifdef _OPENMP
+	t = omp_get_thread_num();
+#endif
+	for (size_t k = 0; k < crossed.size(); k++) {
+		size_t i = crossed[k].second;
+		bool outward = (from - centers[i]).getR() < radii[i];
+		if (t + 1 < shards.size()) {
+			write(shards[t], candidate, i, outward);
+		} else {
+			// more threads than processors, the last shard is shared
+			std::lock_guard<std::mutex> lock(overflowMutex);
+			write(shards.back(), candidate, i, outward);
+		}
+	}
+}
+
+void ShellCrossingRecorder::write(Shard &shard, const Candidate *candidate, size_t shell,
+		bool outward) const {
+	if (not shard.file) {
+		// only the thread of the shard creates it
+		size_t i = &shard - &shards[0];
+		shard.file.reset(new std::ofstream(getShardName(i).c_str(), std::ios::binary));
+		if (not *shard.file)
+			throw std::runtime_error("ShellCrossingRecorder: could not open " + getShardName(i));
+		shard.file->write(shardMagic, sizeof(shardMagic));
+		shard.offset = sizeof(shardMagic);
+	}
+
+	// lineage up to the primary, or the parent a detached candidate was created by
+	std::vector<uint64_t> lineage;
+	std::vector<double> creation;
+	for (const Candidate *c = candidate; c; c = c->parent) {
+		lineage.push_back(c->getSerialNumber());
+		creation.push_back(c->hasProperty(creationKey) ? c->getProperty(creationKey).toDouble() : 0.);
+		if (not c->parent and (c->getCreatedSerialNumber() != c->getSerialNumber())) {
+			lineage.push_back(c->getCreatedSerialNumber());
+			creation.push_back(0);
+		}
+	}
+
+	std::vector<char> &buffer = shard.buffer;
+	size_t start = buffer.size();
+	append<uint32_t>(buffer, 0); // size, set below
+	append<uint32_t>(buffer, shell);
+	append<uint8_t>(buffer, outward);
+	append<uint32_t>(buffer, lineage.size());
+	for (size_t k = 0; k < lineage.size(); k++)
+		append(buffer, lineage[k]);
+	for (size_t k = 0; k < creation.size(); k++)
+		append(buffer, creation[k]);
+	candidate->serialize(buffer);
+	uint32_t size = buffer.size() - start - sizeof(uint32_t);
+	memcpy(&buffer[start], &size, sizeof(size));
+
+	append<uint64_t>(shard.index, shard.offset);
+	append<uint64_t>(shard.index, candidate->getSourceSerialNumber());
+	append<double>(shard.index, candidate->getTrajectoryLength());
+	append<uint32_t>(shard.index, shell);
+	shard.offset += buffer.size() - start;
+	shard.records++;
+
+	if (buffer.size() > (1 << 20))
+		flush(shard);
+}
+
+void ShellCrossingRecorder::flush(Shard &shard) const {
+	if (shard.buffer.empty())
+		return;
+	shard.file->write(&shard.buffer[0], shard.buffer.size());
+	shard.buffer.clear();
+	if (shard.file->fail())
+		throw std::runtime_error("ShellCrossingRecorder: error writing a shard of " + filename);
+}
+
+void ShellCrossingRecorder::close() {
+	if (closed)
+		return;
+	closed = true;
+
+	std::ofstream store(filename.c_str(), std::ios::binary);
+	if (not store)
+		throw std::runtime_error("ShellCrossingRecorder: could not open " + filename);
+	store.write(storeMagic, sizeof(storeMagic));
+	uint32_t nShells = radii.size();
+	store.write((const char *) &nShells, sizeof(nShells));
+	for (size_t i = 0; i < radii.size(); i++) {
+		double shell[4] = {centers[i].x, centers[i].y, centers[i].z, radii[i]};
+		store.write((const char *) shell, sizeof(shell));
+	}
+
+	uint32_t nShards = 0;
+	for (size_t i = 0; i < shards.size(); i++)
+		if (shards[i].file)
+			nShards++;
+	store.write((const char *) &nShards, sizeof(nShards));
+
+	for (size_t i = 0; i < shards.size(); i++) {
+		Shard &shard = shards[i];
+		if (not shard.file)
+			continue;
+		flush(shard);
+		if (not shard.index.empty())
+			shard.file->write(&shard.index[0], shard.index.size());
+		shard.file->write((const char *) &shard.records, sizeof(shard.records));
+		shard.file->write(indexMagic, sizeof(indexMagic));
+		shard.file->close();
+		if (shard.file->fail())
+			throw std::runtime_error("ShellCrossingRecorder: error writing " + getShardName(i));
+		shard.file.reset();
+		std::vector<char>().swap(shard.index);
+		closedFiles.push_back(getShardName(i));
+
+		std::string name = getShardName(i);
+		size_t slash = name.rfind('/');
+		if (slash != std::string::npos)
+			name = name.substr(slash + 1);
+		uint32_t length = name.size();
+		store.write((const char *) &length, sizeof(length));
+		store.write(name.data(), length);
+		store.write((const char *) &shard.records, sizeof(shard.records));
+	}
+	store.close();
+	if (store.fail())
+		throw std::runtime_error("ShellCrossingRecorder: error writing " + filename);
+}
+
+std::string ShellCrossingRecorder::getDescription() const {
+	std::stringstream ss;
+	ss << "ShellCrossingRecorder: " << radii.size() << " shells, recording to " << filename;
+	for (size_t i = 0; i < radii.size(); i++)
+		ss << "\n    shell " << i << ": center " << centers[i] / Mpc << " Mpc, radius "
+				<< radii[i] / Mpc << " Mpc";
+	return ss.str();
+}
+
+// ShellCrossingStore ---------------------------------------------------------
+ShellCrossingStore::ShellCrossingStore(const std::string &filename) {
+	std::ifstream store(filename.c_str(), std::ios::binary);
+	if (not store)
+		throw std::runtime_error("ShellCrossingStore: could not open " + filename);
+	char magic[8];
+	store.read(magic, sizeof(magic));
+	if (not store or (memcmp(magic, storeMagic, sizeof(magic)) != 0))
+		throw std::runtime_error("ShellCrossingStore: not a shell crossing store " + filename);
+
+	uint32_t nShells = readValue<uint32_t>(store);
+	for (uint32_t i = 0; store and (i < nShells); i++) {
+		double shell[4];
+		store.read((char *) shell, sizeof(shell));
+		centers.push_back(Vector3d(shell[0], shell[1], shell[2]));
+		radii.push_back(shell[3]);
+	}
+
+	// shards relative to the store
+	std::string directory;
+	size_t slash = filename.rfind('/');
+	if (slash != std::string::npos)
+		directory = filename.substr(0, slash + 1);
+	uint32_t nShards = readValue<uint32_t>(store);
+	for (uint32_t i = 0; store and (i < nShards); i++) {
+		uint32_t length = readValue<uint32_t>(store);
+		std::string name(length, ' ');
+		if (length > 0)
+			store.read(&name[0], length);
+		readValue<uint64_t>(store); // records, also in the index of the shard
+		shardFiles.push_back(directory + name);
+	}
+	if (not store)
+		throw std::runtime_error("ShellCrossingStore: error reading " + filename);
+
+	for (uint32_t i = 0; i < shardFiles.size(); i++)
+		indexShard(i);
+
+	// by primary, then along the trajectory in the order of the records
+	struct Order {
+		bool operator()(const Entry &a, const Entry &b) const {
+			if (a.sourceSerial != b.sourceSerial)
+				return a.sourceSerial < b.sourceSerial;
+			if (a.trajectoryLength != b.trajectoryLength)
+				return a.trajectoryLength < b.trajectoryLength;
+			if (a.shard != b.shard)
+				return a.shard < b.shard;
+			return a.offset < b.offset;
+		}
+	};
+	std::sort(entries.begin(), entries.end(), Order());
+}
+
+void ShellCrossingStore::indexShard(uint32_t shard) {
+	const std::string &name = shardFiles[shard];
+	std::ifstream file(name.c_str(), std::ios::binary);
+	if (not file)
+		throw std::runtime_error("ShellCrossingStore: could not open " + name);
+	char magic[8];
+	file.read(magic, sizeof(magic));
+	if (not file or (memcmp(magic, shardMagic, sizeof(magic)) != 0))
+		throw std::runtime_error("ShellCrossingStore: not a shell crossing shard " + name);
+
+	// index written on close
+	file.seekg(0, std::ios::end);
+	uint64_t fileSize = file.tellg();
+	if (fileSize >= 2 * sizeof(magic) + sizeof(uint64_t)) {
+		file.seekg(fileSize - sizeof(magic) - sizeof(uint64_t));
+		uint64_t records = readValue<uint64_t>(file);
+		file.read(magic, sizeof(magic));
+		uint64_t indexSize = records * indexEntrySize;
+		if (file and (memcmp(magic, indexMagic, sizeof(magic)) == 0)
+				and (indexSize + sizeof(uint64_t) + 2 * sizeof(magic) <= fileSize)) {
+			file.seekg(fileSize - sizeof(magic) - sizeof(uint64_t) - indexSize);
+			for (uint64_t i = 0; i < records; i++) {
+				Entry e;
+				e.shard = shard;
+				e.offset = readValue<uint64_t>(file);
+				e.sourceSerial = readValue<uint64_t>(file);
+				e.trajectoryLength = readValue<double>(file);
+				e.shell = readValue<uint32_t>(file);
+				entries.push_back(e);
+			}
+			if (not file)
+				throw std::runtime_error("ShellCrossingStore: error reading the index of " + name);
+			return;
+		}
+	}
+
+	// not closed: read the complete records
+	KISS_LOG_WARNING << "ShellCrossingStore: " << name << " has no index, reading the records";
+	file.clear();
+	uint64_t offset = sizeof(magic);
+	while (offset + sizeof(uint32_t) <= fileSize) {
+		file.seekg(offset);
+		Entry e;
+		e.shard = shard;
+		e.offset = offset;
+		uint32_t size = readValue<uint32_t>(file);
+		if (not file or (offset + sizeof(uint32_t) + size > fileSize))
+			break; // incomplete last record
+		file.seekg(offset);
+		ShellCrossing crossing = read(file, e);
+		e.shell = crossing.shell;
+		e.sourceSerial = crossing.candidate->getSourceSerialNumber();
+		e.trajectoryLength = crossing.candidate->getTrajectoryLength();
+		entries.push_back(e);
+		offset += sizeof(uint32_t) + size;
+	}
+}
+
+ShellCrossing ShellCrossingStore::read(std::ifstream &file, const Entry &entry) const {
+	file.seekg(entry.offset);
+	uint32_t size = readValue<uint32_t>(file);
+	std::vector<char> buffer(size);
+	if (size > 0)
+		file.read(&buffer[0], size);
+	if (not file)
+		throw std::runtime_error("ShellCrossingStore: error reading " + shardFiles[entry.shard]);
+
+	ShellCrossing crossing;
+	size_t offset = 0;
+	crossing.shell = extract<uint32_t>(buffer, offset);
+	crossing.outward = extract<uint8_t>(buffer, offset);
+	uint32_t n = extract<uint32_t>(buffer, offset);
+	for (uint32_t k = 0; k < n; k++)
+		crossing.lineage.push_back(extract<uint64_t>(buffer, offset));
+	for (uint32_t k = 0; k < n; k++)
+		crossing.creationLengths.push_back(extract<double>(buffer, offset));
+	crossing.candidate = Candidate::deserialize(buffer, offset);
+	return crossing;
+}
+
+size_t ShellCrossingStore::size() const {
+	return entries.size();
+}
+
+size_t ShellCrossingStore::getNumberOfShells() const {
+	return radii.size();
+}
+
+Vector3d ShellCrossingStore::getShellCenter(size_t shell) const {
+	if (shell >= radii.size())
+		throw std::runtime_error("ShellCrossingStore: shell out of range");
+	return centers[shell];
+}
+
+double ShellCrossingStore::getShellRadius(size_t shell) const {
+	if (shell >= radii.size())
+		throw std::runtime_error("ShellCrossingStore: shell out of range");
+	return radii[shell];
+}
+
+const std::vector<std::string> &ShellCrossingStore::getShardFiles() const {
+	return shardFiles;
+}
+
+ShellCrossing ShellCrossingStore::getCrossing(size_t i) const {
+	if (i >= entries.size())
+		throw std::runtime_error("ShellCrossingStore: crossing out of range");
+	std::ifstream file(shardFiles[entries[i].shard].c_str(), std::ios::binary);
+	if (not file)
+		throw std::runtime_error("ShellCrossingStore: could not open " + shardFiles[entries[i].shard]);
+	return read(file, entries[i]);
+}
+
+size_t ShellCrossingStore::evaluate(Observer *observer) const {
+	// the crossings of a primary and its secondaries
+	std::vector<size_t> groups;
+	for (size_t i = 0; i < entries.size(); i++)
+		if ((i == 0) or (entries[i].sourceSerial != entries[i - 1].sourceSerial))
+			groups.push_back(i);
+	groups.push_back(entries.size());
+
+	bool deactivate = observer->getDeactivateOnDetection();
+	size_t detections = 0;
+	std::string error;
+
+#pragma omp parallel reduction(+:detections)
+	{
+		std::vector<std::unique_ptr<std::ifstream> > files(shardFiles.size());
+
+#pragma omp for schedule(dynamic, 16)
+		for (long g = 0; g < (long) groups.size() - 1; g++) {
+			try {
+				// detected candidates and their trajectory lengths at detection
+				std::map<uint64_t, double> detected;
+				for (size_t i = groups[g]; i < groups[g + 1]; i++) {
+					const Entry &entry = entries[i];
+					if (not files[entry.shard]) {
+						files[entry.shard].reset(new std::ifstream(shardFiles[entry.shard].c_str(),
+								std::ios::binary));
+						if (not *files[entry.shard])
+							throw std::runtime_error("ShellCrossingStore: could not open "
+									+ shardFiles[entry.shard]);
+					}
+					ShellCrossing crossing = read(*files[entry.shard], entry);
+
+					// not there after its own detection, or created after that of an ancestor
+					const std::vector<uint64_t> &lineage = crossing.lineage;
+					bool exists = detected.find(lineage[0]) == detected.end();
+					for (size_t k = 1; exists and (k < lineage.size()); k++) {
+						std::map<uint64_t, double>::const_iterator d = detected.find(lineage[k]);
+						if ((d != detected.end()) and (crossing.creationLengths[k - 1] > d->second))
+							exists = false;
+					}
+					if (not exists)
+						continue;
+
+					Candidate *candidate = crossing.candidate;
+					candidate->setActive(true);
+					if (observer->checkDetection(candidate) != DETECTED)
+						continue;
+					observer->detect(candidate);
+					detections++;
+					if (deactivate)
+						detected[lineage[0]] = entry.trajectoryLength;
+				}
+			} catch (std::exception &e) {
+#pragma omp critical(ShellCrossingStore)
+				if (error.empty())
+					error = e.what();
+			}
+		}
+	}
+
+	if (not error.empty())
+		throw std::runtime_error(error);
+	return detections;
+}
+
+} // namespace crpropa
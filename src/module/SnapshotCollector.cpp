@@ -0,0 +1,54 @@
+#include "crpropa/module/SnapshotCollector.h"
+#include "crpropa/module/TextOutput.h"
+
+namespace crpropa {
+
+SnapshotCollector::SnapshotCollector() {
+}
+
+SnapshotCollector::SnapshotCollector(const std::size_t nBuffer) {
+	container.reserve(nBuffer);
+}
+
+void SnapshotCollector::process(Candidate *c) const {
+	CandidateSnapshot snapshot(c, keys);
+#pragma omp critical(SnapshotCollector)
+	container.push_back(snapshot);
+}
+
+void SnapshotCollector::reprocess(Module *action) const {
+	for (size_t i = 0; i < container.size(); i++)
+		action->process(container[i].toCandidate());
+}
+
+void SnapshotCollector::dump(const std::string &filename) const {
+	TextOutput output(filename.c_str(), Output::Everything);
+	reprocess(&output);
+	output.close();
+}
+
+void SnapshotCollector::enableProperty(const std::string &name) {
+	keys.push_back(Candidate::getPropertyKey(name));
+}
+
+std::size_t SnapshotCollector::size() const {
+	return container.size();
+}
+
+const CandidateSnapshot &SnapshotCollector::operator[](const std::size_t i) const {
+	return container[i];
+}
+
+void SnapshotCollector::clearContainer() {
+	container.clear();
+}
+
+const std::vector<CandidateSnapshot> &SnapshotCollector::getContainer() const {
+	return container;
+}
+
+std::string SnapshotCollector::getDescription() const {
+	return "SnapshotCollector";
+}
+
+} // namespace crpropa
@@ -0,0 +1,209 @@
+#include "crpropa/module/SophiaEventLibrary.h"
+#include "crpropa/Random.h"
+
+#include "kiss/convert.h"
+#include "sophia.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace crpropa {
+
+static const char libraryMagic[8] = {'C', 'R', 'P', 'S', 'O', 'P', 'H', 'L'};
+static const uint32_t libraryVersion = 1;
+
+// nucleon energy in GeV at which the events are tabulated
+static const double tabulationEnergy = 1e10;
+
+SophiaEventLibrary::SophiaEventLibrary() :
+		lgMin(0), lgMax(0), nBins(0) {
+}
+
+SophiaEventLibrary::SophiaEventLibrary(const std::string &filename) :
+		lgMin(0), lgMax(0), nBins(0) {
+	load(filename);
+}
+
+void SophiaEventLibrary::generate(unsigned int eventsPerBin, unsigned int n,
+		double lgmin, double lgmax) {
+	if ((eventsPerBin == 0) or (n == 0) or (lgmax <= lgmin))
+		throw std::runtime_error("SophiaEventLibrary: invalid binning");
+
+	std::vector<std::vector<int8_t> > types(2 * n);
+	std::vector<std::vector<float> > fractions(2 * n);
+	std::vector<std::vector<uint32_t> > sizes(2 * n);
+	double dlg = (lgmax - lgmin) / n;
+
+#ifdef CRPROPA_SOPHIA_REENTRANT
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int k = 0; k < 2 * static_cast<int>(n); k++) {
+		int nature = k / n;
+		int bin = k % n;
+		Random &random = Random::instance();
+		double outputEnergy[5][2000];
+		int outPartID[2000];
+		int nParticles;
+		unsigned int attempts = 0;
+		while ((sizes[k].size() < eventsPerBin) and (attempts < 10 * eventsPerBin)) {
+			attempts++;
+			double Ein = tabulationEnergy;
+			double eps = pow(10, lgmin + (bin + random.rand()) * dlg) / Ein;
+			sophiaevent_(nature, Ein, eps, outputEnergy, outPartID, nParticles);
+			if (nParticles == 0)
+				continue;
+			for (int i = 0; i < nParticles; i++) {
+				types[k].push_back(outPartID[i]);
+				fractions[k].push_back(outputEnergy[3][i] / Ein);
+			}
+			sizes[k].push_back(nParticles);
+		}
+	}
+
+	for (size_t k = 0; k < sizes.size(); k++)
+		if (sizes[k].empty())
+			throw std::runtime_error("SophiaEventLibrary: no events in bin " + kiss::str(k % n) + ", lgMin below threshold?");
+
+	lgMin = lgmin;
+	lgMax = lgmax;
+	nBins = n;
+	binEvents.assign(1, 0);
+	eventParticles.assign(1, 0);
+	particleType.clear();
+	particleFraction.clear();
+	for (size_t k = 0; k < sizes.size(); k++) {
+		for (size_t e = 0; e < sizes[k].size(); e++)
+			eventParticles.push_back(eventParticles.back() + sizes[k][e]);
+		binEvents.push_back(binEvents.back() + sizes[k].size());
+		particleType.insert(particleType.end(), types[k].begin(), types[k].end());
+		particleFraction.insert(particleFraction.end(), fractions[k].begin(), fractions[k].end());
+	}
+}
+
+template<typename T>
+static void writeArray(std::ofstream &out, const std::vector<T> &v) {
+	out.write(reinterpret_cast<const char*>(&v[0]), v.size() * sizeof(T));
+}
+
+template<typename T>
+static void readArray(std::ifstream &in, std::vector<T> &v, size_t n) {
+	v.resize(n);
+	in.read(reinterpret_cast<char*>(&v[0]), n * sizeof(T));
+}
+
+void SophiaEventLibrary::save(const std::string &filename) const {
+	if (empty())
+		throw std::runtime_error("SophiaEventLibrary: nothing to save");
+	std::ofstream out(filename.c_str(), std::ios::binary);
+	if (!out.good())
+		throw std::runtime_error("SophiaEventLibrary: could not open file " + filename);
+
+	uint32_t nEvents = eventParticles.size() - 1;
+	uint32_t nParticles = particleType.size();
+	out.write(libraryMagic, sizeof(libraryMagic));
+	out.write(reinterpret_cast<const char*>(&libraryVersion), sizeof(libraryVersion));
+	out.write(reinterpret_cast<const char*>(&lgMin), sizeof(lgMin));
+	out.write(reinterpret_cast<const char*>(&lgMax), sizeof(lgMax));
+	out.write(reinterpret_cast<const char*>(&nBins), sizeof(nBins));
+	out.write(reinterpret_cast<const char*>(&nEvents), sizeof(nEvents));
+	out.write(reinterpret_cast<const char*>(&nParticles), sizeof(nParticles));
+	writeArray(out, binEvents);
+	writeArray(out, eventParticles);
+	writeArray(out, particleType);
+	writeArray(out, particleFraction);
+	if (!out.good())
+		throw std::runtime_error("SophiaEventLibrary: error writing file " + filename);
+}
+
+void SophiaEventLibrary::load(const std::string &filename) {
+	std::ifstream in(filename.c_str(), std::ios::binary);
+	if (!in.good())
+		throw std::runtime_error("SophiaEventLibrary: could not open file " + filename);
+
+	char magic[8];
+	uint32_t version, nEvents, nParticles;
+	in.read(magic, sizeof(magic));
+	in.read(reinterpret_cast<char*>(&version), sizeof(version));
+	if (!in.good() or memcmp(magic, libraryMagic, sizeof(magic)) != 0)
+		throw std::runtime_error("SophiaEventLibrary: " + filename + " is not an event library");
+	if (version != libraryVersion)
+		throw std::runtime_error("SophiaEventLibrary: unsupported format version " + kiss::str(version));
+	in.read(reinterpret_cast<char*>(&lgMin), sizeof(lgMin));
+	in.read(reinterpret_cast<char*>(&lgMax), sizeof(lgMax));
+	in.read(reinterpret_cast<char*>(&nBins), sizeof(nBins));
+	in.read(reinterpret_cast<char*>(&nEvents), sizeof(nEvents));
+	in.read(reinterpret_cast<char*>(&nParticles), sizeof(nParticles));
+	if (!in.good() or (nBins == 0) or (nEvents == 0) or (nParticles == 0))
+		throw std::runtime_error("SophiaEventLibrary: corrupt header in " + filename);
+	readArray(in, binEvents, 2 * nBins + 1);
+	readArray(in, eventParticles, nEvents + 1);
+	readArray(in, particleType, nParticles);
+	readArray(in, particleFraction, nParticles);
+	if (!in.good() or (binEvents.back() != nEvents) or (eventParticles.back() != nParticles)) {
+		nBins = 0;
+		binEvents.clear();
+		throw std::runtime_error("SophiaEventLibrary: truncated file " + filename);
+	}
+}
+
+bool SophiaEventLibrary::sample(int nature, double Ein, double eps,
+		int outPartID[2000], double outEnergy[2000], int &nParticles) const {
+	double lg = log10(Ein * eps);
+	if ((nBins == 0) or (lg < lgMin) or (lg >= lgMax))
+		return false;
+
+	// interpolate between the neighbouring bin centers
+	Random &random = Random::instance();
+	double x = (lg - lgMin) / (lgMax - lgMin) * nBins - 0.5;
+	int bin = std::floor(x);
+	if (random.rand() < x - bin)
+		bin++;
+	bin = std::min(std::max(bin, 0), static_cast<int>(nBins) - 1);
+
+	size_t k = nature * nBins + bin;
+	size_t first = binEvents[k];
+	size_t n = binEvents[k + 1] - first;
+	size_t event = first + std::min(n - 1, static_cast<size_t>(random.rand() * n));
+
+	nParticles = 0;
+	for (size_t i = eventParticles[event]; i < eventParticles[event + 1]; i++) {
+		outPartID[nParticles] = particleType[i];
+		outEnergy[nParticles] = particleFraction[i] * Ein;
+		nParticles++;
+	}
+	return true;
+}
+
+bool SophiaEventLibrary::empty() const {
+	return nBins == 0;
+}
+
+unsigned int SophiaEventLibrary::getNumberOfBins() const {
+	return nBins;
+}
+
+size_t SophiaEventLibrary::getNumberOfEvents() const {
+	return eventParticles.empty() ? 0 : eventParticles.size() - 1;
+}
+
+size_t SophiaEventLibrary::getNumberOfParticles() const {
+	return particleType.size();
+}
+
+double SophiaEventLibrary::getLgMin() const {
+	return lgMin;
+}
+
+double SophiaEventLibrary::getLgMax() const {
+	return lgMax;
+}
+
+size_t SophiaEventLibrary::getMemoryUsage() const {
+	return binEvents.capacity() * sizeof(uint32_t) + eventParticles.capacity() * sizeof(uint32_t)
+			+ particleType.capacity() * sizeof(int8_t) + particleFraction.capacity() * sizeof(float);
+}
+
+} // namespace crpropa
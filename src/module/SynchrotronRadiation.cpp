@@ -1,27 +1,33 @@
 #include "crpropa/module/SynchrotronRadiation.h"
 #include "crpropa/Units.h"
+#include "crpropa/Common.h"
 #include "crpropa/Random.h"
 
+#include <algorithm>
 #include <fstream>
 #include <limits>
 #include <stdexcept>
 
 namespace crpropa {
 
-SynchrotronRadiation::SynchrotronRadiation(ref_ptr<MagneticField> field, bool havePhotons, double limit) {
+SynchrotronRadiation::SynchrotronRadiation(ref_ptr<MagneticField> field, bool havePhotons, double limit, double thinning) {
 	Brms = 0.;
+	binsPerDecade = 0;
 	setField(field);
 	initSpectrum();
 	this->havePhotons = havePhotons;
 	this->limit = limit;
+	this->thinning = thinning;
 	secondaryThreshold = 1e7 * eV;
 }
 
-SynchrotronRadiation::SynchrotronRadiation(double Brms, bool havePhotons, double limit) {
+SynchrotronRadiation::SynchrotronRadiation(double Brms, bool havePhotons, double limit, double thinning) {
 	this->Brms = Brms;
+	binsPerDecade = 0;
 	initSpectrum();
 	this->havePhotons = havePhotons;
 	this->limit = limit;
+	this->thinning = thinning;
 	secondaryThreshold = 1e7 * eV;
 }
 
@@ -65,6 +71,54 @@ double SynchrotronRadiation::getSecondaryThreshold() const {
 	return secondaryThreshold;
 }
 
+void SynchrotronRadiation::setThinning(double thinning) {
+	this->thinning = thinning;
+}
+
+double SynchrotronRadiation::getThinning() const {
+	return thinning;
+}
+
+void SynchrotronRadiation::setBinnedEmission(int binsPerDecade) {
+	if (binsPerDecade < 0)
+		throw std::runtime_error("SynchrotronRadiation: number of bins per decade must not be negative");
+	this->binsPerDecade = binsPerDecade;
+	initBinnedEmission();
+}
+
+int SynchrotronRadiation::getBinnedEmission() const {
+	return binsPerDecade;
+}
+
+void SynchrotronRadiation::initBinnedEmission() {
+	tabBinX.clear();
+	tabBinN.clear();
+	if (binsPerDecade == 0)
+		return;
+
+	// photon number and energy per bin of the tabulated spectrum, merged into bins in log10(x)
+	double logxMin = log10(tabx.front());
+	size_t nBins = ceil((log10(tabx.back()) - logxMin) * binsPerDecade);
+	std::vector<double> number(nBins, 0), energy(nBins, 0);
+	double meanX = 0;
+	for (size_t i = 1; i < tabx.size(); i++) {
+		double p = tabCDF[i] - tabCDF[i-1];
+		double x = (tabx[i] + tabx[i-1]) / 2;
+		size_t j = std::min(size_t((log10(x) - logxMin) * binsPerDecade), nBins - 1);
+		number[j] += p;
+		energy[j] += p * x;
+		meanX += p * x;
+	}
+
+	// photons per radiated energy dE/E_critical: p / <x>
+	for (size_t j = 0; j < nBins; j++) {
+		if (number[j] == 0)
+			continue;
+		tabBinX.push_back(energy[j] / number[j]);
+		tabBinN.push_back(number[j] / meanX);
+	}
+}
+
 void SynchrotronRadiation::initSpectrum() {
 	std::string filename = getDataPath("Synchrotron/spectrum.txt");
 	std::ifstream infile(filename.c_str());
@@ -89,15 +143,18 @@ void SynchrotronRadiation::initSpectrum() {
 		infile.ignore(std::numeric_limits < std::streamsize > ::max(), '\n');
 	}
 	infile.close();
+	initBinnedEmission();
 }
 
-void SynchrotronRadiation::process(Candidate *candidate) const {
-	double charge = fabs(candidate->current.getCharge());
-	if (charge == 0)
-		return; // only charged particles
+unsigned int SynchrotronRadiation::getParticleClasses() const {
+	return ElectronClass | NucleusClass | OtherClass;
+}
 
-	// calculate gyroradius, evaluated at the current position
-	double z = candidate->getRedshift();
+size_t SynchrotronRadiation::getMemoryUsage() const {
+	return memoryUsage(tabx) + memoryUsage(tabCDF) + memoryUsage(tabBinX) + memoryUsage(tabBinN);
+}
+
+double SynchrotronRadiation::perpendicularField(const Candidate *candidate, double z) const {
 	double B;
 	if (field.valid()) {
 		Vector3d Bvec = field->getField(candidate->current.getPosition(), z);
@@ -105,12 +162,38 @@ void SynchrotronRadiation::process(Candidate *candidate) const {
 	} else {
 		B = sqrt(2. / 3) * Brms; // average perpendicular field component
 	}
-	B *= pow(1 + z, 2); // cosmological scaling
+	return B * pow_integer<2>(1 + z); // cosmological scaling
+}
+
+bool SynchrotronRadiation::hasEnergyLossRate() const {
+	return true;
+}
+
+double SynchrotronRadiation::getEnergyLossRate(const Candidate *candidate, double E, double z) const {
+	double charge = fabs(candidate->current.getCharge());
+	if (charge == 0)
+		return 0;
+	double B = perpendicularField(candidate, z);
+	double mc2 = candidate->current.getMass() * c_squared;
+	double lf = E / mc2;
+	double Rg = sqrt(E * E - mc2 * mc2) / c_light / charge / B;
+	double dEdx = 1. / 6 / M_PI / epsilon0 * pow_integer<2>(lf * lf - 1) * pow_integer<2>(eplus / Rg); // Jackson p. 770 (14.31)
+	return dEdx / (1 + z); // local frame -> per comoving distance
+}
+
+void SynchrotronRadiation::process(Candidate *candidate) const {
+	double charge = fabs(candidate->current.getCharge());
+	if (charge == 0)
+		return; // only charged particles
+
+	// calculate gyroradius, evaluated at the current position
+	double z = candidate->getRedshift();
+	double B = perpendicularField(candidate, z);
 	double Rg = candidate->current.getMomentum().getR() / charge / B;
 
 	// calculate energy loss
-	double lf = candidate->current.getLorentzFactor();
-	double dEdx = 1. / 6 / M_PI / epsilon0 * pow(lf * lf - 1, 2) * pow(eplus / Rg, 2); // Jackson p. 770 (14.31)
+	double lf = candidate->getKinematics().lorentzFactor;
+	double dEdx = 1. / 6 / M_PI / epsilon0 * pow_integer<2>(lf * lf - 1) * pow_integer<2>(eplus / Rg); // Jackson p. 770 (14.31)
 	double step = candidate->getCurrentStep() / (1 + z); // step size in local frame
 	double dE = step * dEdx;
 
@@ -124,12 +207,24 @@ void SynchrotronRadiation::process(Candidate *candidate) const {
 		return;
 
 	// check if photons with energies > 14 * Ecrit are possible
-	double Ecrit = 3. / 4 * h_planck / M_PI * c_light * pow(lf, 3) / Rg;
+	double Ecrit = 3. / 4 * h_planck / M_PI * c_light * pow_integer<3>(lf) / Rg;
 	if (14 * Ecrit < secondaryThreshold)
 		return;
 
-	// draw photons up to the total energy loss
 	Random &random = Random::instance();
+	if (binsPerDecade > 0) {
+		// one secondary per energy bin, weighted with the number of photons
+		for (size_t i = 0; i < tabBinX.size(); i++) {
+			double Egamma = tabBinX[i] * Ecrit;
+			if (Egamma <= secondaryThreshold)
+				continue;
+			Vector3d pos = random.randomInterpolatedPosition(candidate->previous.getPosition(), candidate->current.getPosition());
+			candidate->addSecondary(22, Egamma, pos, tabBinN[i] * dE / Ecrit);
+		}
+		return;
+	}
+
+	// draw photons up to the total energy loss
 	while (dE > 0) {
 		// draw random value between 0 and maximum of corresponding cdf
 		// choose bin of s where cdf(x) = cdf_rand -> x_rand
@@ -146,8 +241,12 @@ void SynchrotronRadiation::process(Candidate *candidate) const {
 		// create synchrotron photon and repeat with remaining energy
 		dE -= Egamma;
 		Vector3d pos = random.randomInterpolatedPosition(candidate->previous.getPosition(), candidate->current.getPosition());
-		if (Egamma > secondaryThreshold) // create only photons with energies above threshold
-			candidate->addSecondary(22, Egamma, pos);
+		if (Egamma <= secondaryThreshold) // create only photons with energies above threshold
+			continue;
+		double f = Egamma / E;
+		double p = mathPow(f, thinning);
+		if (thinning == 0 or random.rand() < p)
+			candidate->addSecondary(22, Egamma, pos, 1 / p);
 	}
 }
 
@@ -158,9 +257,11 @@ std::string SynchrotronRadiation::getDescription() const {
 		s << " for specified magnetic field";
 	else
 		s << " for Brms = " << Brms / nG << " nG";
-	if (havePhotons)
+	if (havePhotons) {
 		s << ", synchrotron photons E > " << secondaryThreshold / eV << " eV";
-	else
+		if (binsPerDecade > 0)
+			s << " in " << binsPerDecade << " bins per decade";
+	} else
 		s << ", no synchrotron photons";
 	return s.str();
 }
@@ -0,0 +1,186 @@
+#include "crpropa/module/TerminationConditions.h"
+#include "crpropa/module/Boundary.h"
+#include "crpropa/module/BreakCondition.h"
+#include "crpropa/Geometry.h"
+#include "crpropa/ParticleID.h"
+
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+namespace crpropa {
+
+TerminationConditions::TerminationConditions() {
+}
+
+void TerminationConditions::add(AbstractCondition *module) {
+	if (not module)
+		throw std::runtime_error("TerminationConditions: no condition");
+
+	Condition c;
+	c.type = Other;
+	c.value = 0;
+	c.margin = 0;
+	c.limitStep = false;
+	c.eventDriven = false;
+	c.module = module;
+
+	if (MaximumTrajectoryLength *m = dynamic_cast<MaximumTrajectoryLength*>(module)) {
+		c.type = TrajectoryLength;
+		c.value = m->getMaximumTrajectoryLength();
+		c.observers.setPoints(m->getObserverPositions());
+	} else if (MinimumEnergy *m = dynamic_cast<MinimumEnergy*>(module)) {
+		c.type = Energy;
+		c.value = m->getMinimumEnergy();
+	} else if (MinimumRigidity *m = dynamic_cast<MinimumRigidity*>(module)) {
+		c.type = Rigidity;
+		c.value = m->getMinimumRigidity();
+	} else if (MinimumRedshift *m = dynamic_cast<MinimumRedshift*>(module)) {
+		c.type = Redshift;
+		c.value = m->getMinimumRedshift();
+	} else if (MinimumChargeNumber *m = dynamic_cast<MinimumChargeNumber*>(module)) {
+		c.type = ChargeNumber;
+		c.value = m->getMinimumChargeNumber();
+	} else if (SphericalBoundary *m = dynamic_cast<SphericalBoundary*>(module)) {
+		c.type = Sphere;
+		c.point = m->getCenter();
+		c.value = m->getRadius();
+		c.margin = m->getMargin();
+		c.limitStep = m->getLimitStep();
+		c.eventDriven = m->isEventDriven();
+	} else if (CubicBoundary *m = dynamic_cast<CubicBoundary*>(module)) {
+		c.type = Cube;
+		c.point = m->getOrigin();
+		c.value = m->getSize();
+		c.margin = m->getMargin();
+		c.limitStep = m->getLimitStep();
+		c.eventDriven = m->isEventDriven();
+	}
+
+	conditions.push_back(c);
+	rejections.push_back(0);
+}
+
+size_t TerminationConditions::size() const {
+	return conditions.size();
+}
+
+AbstractCondition *TerminationConditions::get(size_t i) const {
+	if (i >= conditions.size())
+		throw std::runtime_error("TerminationConditions: index out of range");
+	return conditions[i].module;
+}
+
+bool TerminationConditions::isFused(size_t i) const {
+	if (i >= conditions.size())
+		throw std::runtime_error("TerminationConditions: index out of range");
+	return conditions[i].type != Other;
+}
+
+uint64_t TerminationConditions::getRejections(size_t i) const {
+	if (i >= rejections.size())
+		throw std::runtime_error("TerminationConditions: index out of range");
+	uint64_t n;
+#pragma omp atomic read
+	n = rejections[i];
+	return n;
+}
+
+void TerminationConditions::resetRejections() {
+	std::fill(rejections.begin(), rejections.end(), 0);
+}
+
+void TerminationConditions::process(Candidate *candidate) const {
+	const double length = candidate->getTrajectoryLength();
+	const double energy = candidate->current.getEnergy();
+	const double redshift = candidate->getRedshift();
+	const Vector3d position = candidate->current.getPosition();
+	const int id = candidate->current.getId();
+	const bool neutral = candidate->current.getCharge() == 0;
+	double limit = std::numeric_limits<double>::max();
+
+	for (size_t i = 0; i < conditions.size(); i++) {
+		const Condition &c = conditions[i];
+		bool rejected = false;
+		switch (c.type) {
+		case TrajectoryLength:
+			if (not c.observers.empty()
+					and not (c.observers.nearestDistance(position) + length < c.value))
+				rejected = true;
+			else if (length >= c.value)
+				rejected = true;
+			else
+				limit = std::min(limit, c.value - length);
+			break;
+		case Energy:
+			rejected = not (energy > c.value);
+			break;
+		case Rigidity:
+			rejected = candidate->current.getRigidity() < c.value;
+			break;
+		case Redshift:
+			rejected = not (redshift > c.value);
+			break;
+		case ChargeNumber:
+			rejected = not (chargeNumber(id) > c.value);
+			break;
+		case Sphere: {
+			double d = (position - c.point).getR();
+			rejected = d >= c.value;
+			if (not c.limitStep)
+				break;
+			if (c.eventDriven and neutral)
+				limit = std::min(limit, crpropa::Sphere(c.point, c.value).distanceAlong(
+						position, candidate->current.getDirection()) + c.margin);
+			else
+				limit = std::min(limit, c.value - d + c.margin);
+			break;
+		}
+		case Cube: {
+			Vector3d r = position - c.point;
+			double lo = r.min();
+			double hi = r.max();
+			rejected = (lo <= 0) or (hi >= c.value);
+			if (not c.limitStep)
+				break;
+			if (c.eventDriven and neutral)
+				limit = std::min(limit, ParaxialBox(c.point, Vector3d(c.value)).distanceAlong(
+						position, candidate->current.getDirection()) + c.margin);
+			else
+				limit = std::min(limit, std::min(lo, c.value - hi) + c.margin);
+			break;
+		}
+		case Other: {
+			bool active = candidate->isActive();
+			c.module->process(candidate);
+			if (active and not candidate->isActive()) {
+#pragma omp atomic
+				rejections[i]++;
+			}
+			break;
+		}
+		}
+		if (rejected) {
+#pragma omp atomic
+			rejections[i]++;
+			c.module->reject(candidate);
+		}
+	}
+
+	if (limit < std::numeric_limits<double>::max())
+		candidate->limitNextStep(limit);
+}
+
+std::string TerminationConditions::getDescription() const {
+	std::stringstream s;
+	s << "TerminationConditions: " << conditions.size() << " conditions\n";
+	for (size_t i = 0; i < conditions.size(); i++) {
+		s << "  " << (conditions[i].type == Other ? "processed: " : "fused: ")
+			<< conditions[i].module->getDescription()
+			<< ", rejections: " << getRejections(i) << "\n";
+	}
+	return s.str();
+}
+
+} // namespace crpropa
@@ -3,38 +3,194 @@
 #include "crpropa/Units.h"
 #include "crpropa/Version.h"
 #include "crpropa/Random.h"
+#include "crpropa/RunMetrics.h"
 #include "crpropa/base64.h"
 
 #include "kiss/string.h"
 
+#include <cmath>
+#include <clocale>
+#include <cstddef>
 #include <cstdio>
+#include <cstring>
 #include <stdexcept>
 #include <iostream>
 
+#include <unistd.h>
+
 #ifdef CRPROPA_HAVE_ZLIB
 #include <izstream.hpp>
-#include <ozstream.hpp>
+#include <zlib.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
 #endif
 
 namespace crpropa {
 
-TextOutput::TextOutput() : Output(), out(&std::cout), storeRandomSeeds(false) {
+const size_t FILE_BLOCK_SIZE = 1 << 20;
+
+// Locale independent replacements of the printf conversions of the columns,
+// which give the same text. They return the end of the written text.
+
+// %8.5E, the rare values close to a rounding tie are left to printf
+static char *formatScientific(char *p, double x) {
+	static const long double powers[28] = {1e0L, 1e1L, 1e2L, 1e3L, 1e4L, 1e5L, 1e6L,
+			1e7L, 1e8L, 1e9L, 1e10L, 1e11L, 1e12L, 1e13L, 1e14L, 1e15L, 1e16L, 1e17L,
+			1e18L, 1e19L, 1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L};
+	long double ax = std::fabs(x);
+	int e = 0;
+	unsigned long m = 0;
+	bool exact = std::isfinite(x);
+	if (exact and (ax != 0)) {
+		e = int(std::floor(std::log10(std::fabs(x))));
+		exact = false;
+		for (int attempt = 0; attempt < 3; attempt++) {
+			// six significant digits before the point
+			int k = 5 - e;
+			long double scaled;
+			if (k >= 0)
+				scaled = (k < 28) ? ax * powers[k] : ax * powl(10.L, k);
+			else
+				scaled = (-k < 28) ? ax / powers[-k] : ax / powl(10.L, -k);
+			if (scaled >= 999999.5L) {
+				e++;
+				continue;
+			}
+			if (scaled < 99999.5L) {
+				e--;
+				continue;
+			}
+			long double fraction = scaled - floorl(scaled);
+			if (fabsl(fraction - 0.5L) < 1e-7L)
+				break;
+			m = (unsigned long) floorl(scaled + 0.5L);
+			exact = true;
+			break;
+		}
+	}
+	if (not exact) {
+		int n = std::snprintf(p, 32, "%8.5E", x);
+		// with the decimal point of the C locale
+		const char *point = std::localeconv()->decimal_point;
+		size_t length = std::strlen(point);
+		char *q = std::strstr(p, point);
+		if (q and ((length != 1) or (*point != '.'))) {
+			*q = '.';
+			std::memmove(q + 1, q + length, p + n - (q + length) + 1);
+			n -= length - 1;
+		}
+		return p + n;
+	}
+
+	if (std::signbit(x))
+		*p++ = '-';
+	*p++ = '0' + m / 100000;
+	*p++ = '.';
+	for (unsigned long d = 10000; d > 0; d /= 10)
+		*p++ = '0' + (m / d) % 10;
+	*p++ = 'E';
+	*p++ = (e < 0) ? '-' : '+';
+	unsigned int ae = std::abs(e);
+	if (ae >= 100)
+		*p++ = '0' + ae / 100;
+	*p++ = '0' + (ae / 10) % 10;
+	*p++ = '0' + ae % 10;
+	return p;
+}
+
+// %10lu and %10i followed by a tab
+static char *formatInteger(char *p, unsigned long long value, bool negative = false) {
+	char digits[24];
+	int n = 0;
+	do {
+		digits[n++] = '0' + value % 10;
+		value /= 10;
+	} while (value > 0);
+	if (negative)
+		digits[n++] = '-';
+	for (int i = n; i < 10; i++)
+		*p++ = ' ';
+	while (n > 0)
+		*p++ = digits[--n];
+	*p++ = '\t';
+	return p;
+}
+
+static char *formatInteger(char *p, int value) {
+	unsigned long long a = (value < 0) ? -(long long) value : value;
+	return formatInteger(p, a, value < 0);
+}
+
+// a number followed by a tab
+static char *formatColumn(char *p, double x) {
+	p = formatScientific(p, x);
+	*p++ = '\t';
+	return p;
+}
+
+static char *formatColumns(char *p, const Vector3d &v) {
+	p = formatColumn(p, v.x);
+	p = formatColumn(p, v.y);
+	return formatColumn(p, v.z);
+}
+
+#ifdef CRPROPA_HAVE_ZLIB
+static void startGzip(std::ostream &out) {
+	static const char header[10] = {'\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, 3};
+	out.write(header, sizeof(header));
+}
+
+// raw deflate of a block, which ends byte aligned and not final with a sync
+// flush, such that the blocks of all threads form one stream
+static std::string deflateBlock(const std::string &text) {
+	z_stream zs;
+	std::memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+			Z_DEFAULT_STRATEGY) != Z_OK)
+		throw std::runtime_error("TextOutput: could not initialize zlib");
+	std::string compressed(deflateBound(&zs, text.size()) + 16, '\0');
+	zs.next_in = (Bytef *) text.data();
+	zs.avail_in = text.size();
+	size_t written = 0;
+	do {
+		if (written == compressed.size())
+			compressed.resize(2 * compressed.size());
+		zs.next_out = (Bytef *) &compressed[written];
+		zs.avail_out = compressed.size() - written;
+		deflate(&zs, Z_SYNC_FLUSH);
+		written = compressed.size() - zs.avail_out;
+	} while (zs.avail_out == 0);
+	deflateEnd(&zs);
+	compressed.resize(written);
+	return compressed;
+}
+
+static void writeLittleEndian(std::ostream &out, unsigned long value) {
+	char bytes[4] = {char(value & 0xff), char((value >> 8) & 0xff),
+			char((value >> 16) & 0xff), char((value >> 24) & 0xff)};
+	out.write(bytes, 4);
+}
+#endif
+
+TextOutput::TextOutput() : Output(), out(&std::cout), storeRandomSeeds(false), async(false), asyncCapacity(4096), blockSize(0), compress(false), headerPresent(false), gzipStarted(false), gzipCrc(0), gzipSize(0) {
 }
 
-TextOutput::TextOutput(OutputType outputtype) : Output(outputtype), out(&std::cout), storeRandomSeeds(false) {
+TextOutput::TextOutput(OutputType outputtype) : Output(outputtype), out(&std::cout), storeRandomSeeds(false), async(false), asyncCapacity(4096), blockSize(0), compress(false), headerPresent(false), gzipStarted(false), gzipCrc(0), gzipSize(0) {
 }
 
-TextOutput::TextOutput(std::ostream &out) : Output(), out(&out), storeRandomSeeds(false) {
+TextOutput::TextOutput(std::ostream &out) : Output(), out(&out), storeRandomSeeds(false), async(false), asyncCapacity(4096), blockSize(0), compress(false), headerPresent(false), gzipStarted(false), gzipCrc(0), gzipSize(0) {
 
 }
 
 TextOutput::TextOutput(std::ostream &out,
-		OutputType outputtype) : Output(outputtype), out(&out), storeRandomSeeds(false) {
+		OutputType outputtype) : Output(outputtype), out(&out), storeRandomSeeds(false), async(false), asyncCapacity(4096), blockSize(0), compress(false), headerPresent(false), gzipStarted(false), gzipCrc(0), gzipSize(0) {
 }
 
 TextOutput::TextOutput(const std::string &filename) :  Output(), outfile(filename.c_str(),
 				std::ios::binary), out(&outfile),  filename(
-				filename), storeRandomSeeds(false) {
+				filename), storeRandomSeeds(false), async(false), asyncCapacity(4096), blockSize(FILE_BLOCK_SIZE), compress(false), headerPresent(false), gzipStarted(false), gzipCrc(0), gzipSize(0) {
 	if (!outfile.is_open())
 		throw std::runtime_error(std::string("Cannot create file: ") + filename);
 	if (kiss::ends_with(filename, ".gz"))
@@ -44,106 +200,125 @@ TextOutput::TextOutput(const std::string &filename) :  Output(), outfile(filenam
 TextOutput::TextOutput(const std::string &filename,
 				OutputType outputtype) : Output(outputtype), outfile(filename.c_str(),
 				std::ios::binary), out(&outfile), filename(
-				filename), storeRandomSeeds(false) {
+				filename), storeRandomSeeds(false), async(false), asyncCapacity(4096), blockSize(FILE_BLOCK_SIZE), compress(false), headerPresent(false), gzipStarted(false), gzipCrc(0), gzipSize(0) {
+	if (!outfile.is_open())
+		throw std::runtime_error(std::string("Cannot create file: ") + filename);
+	if (kiss::ends_with(filename, ".gz"))
+		gzip();
+}
+
+TextOutput::TextOutput(const std::string &filename, OutputType outputtype,
+		bool append) : Output(outputtype), out(&outfile), filename(filename),
+		storeRandomSeeds(false), async(false), asyncCapacity(4096), blockSize(FILE_BLOCK_SIZE), compress(false), headerPresent(false), gzipStarted(false), gzipCrc(0), gzipSize(0) {
+	if (append and kiss::ends_with(filename, ".gz"))
+		throw std::runtime_error("TextOutput: cannot append to compressed file " + filename);
+	if (append)
+		outfile.open(filename.c_str(), std::ios::binary | std::ios::in | std::ios::out);
+	if (!outfile.is_open())
+		outfile.open(filename.c_str(), std::ios::binary);
 	if (!outfile.is_open())
 		throw std::runtime_error(std::string("Cannot create file: ") + filename);
+	outfile.seekp(0, std::ios::end);
+	headerPresent = (outfile.tellp() > 0);
 	if (kiss::ends_with(filename, ".gz"))
 		gzip();
 }
 
-void TextOutput::printHeader() const {
-	*out << "#";
+void TextOutput::printHeader(std::ostream &os) const {
+	os << "#";
 	if (fields.test(TrajectoryLengthColumn))
-		*out << "\tD";
+		os << "\tD";
 	if (fields.test(RedshiftColumn))
-		*out << "\tz";
+		os << "\tz";
 	if (fields.test(SerialNumberColumn))
-		*out << "\tSN";
+		os << "\tSN";
 	if (fields.test(CurrentIdColumn))
-		*out << "\tID";
+		os << "\tID";
 	if (fields.test(CurrentEnergyColumn))
-		*out << "\tE";
+		os << "\tE";
 	if (fields.test(CurrentPositionColumn) && oneDimensional)
-		*out << "\tX";
+		os << "\tX";
 	if (fields.test(CurrentPositionColumn) && not oneDimensional)
-		*out << "\tX\tY\tZ";
+		os << "\tX\tY\tZ";
 	if (fields.test(CurrentDirectionColumn) && not oneDimensional)
-		*out << "\tPx\tPy\tPz";
+		os << "\tPx\tPy\tPz";
 	if (fields.test(SerialNumberColumn))
-		*out << "\tSN0";
+		os << "\tSN0";
 	if (fields.test(SourceIdColumn))
-		*out << "\tID0";
+		os << "\tID0";
 	if (fields.test(SourceEnergyColumn))
-		*out << "\tE0";
+		os << "\tE0";
 	if (fields.test(SourcePositionColumn) && oneDimensional) 
-		*out << "\tX0";
+		os << "\tX0";
 	if (fields.test(SourcePositionColumn) && not oneDimensional)
-		*out << "\tX0\tY0\tZ0";
+		os << "\tX0\tY0\tZ0";
 	if (fields.test(SourceDirectionColumn) && not oneDimensional)
-		*out << "\tP0x\tP0y\tP0z";
+		os << "\tP0x\tP0y\tP0z";
 	if (fields.test(SerialNumberColumn))
-		*out << "\tSN1";
+		os << "\tSN1";
 	if (fields.test(CreatedIdColumn))
-		*out << "\tID1";
+		os << "\tID1";
 	if (fields.test(CreatedEnergyColumn))
-		*out << "\tE1";
+		os << "\tE1";
 	if (fields.test(CreatedPositionColumn) && oneDimensional)
-		*out << "\tX1";
+		os << "\tX1";
 	if (fields.test(CreatedPositionColumn) && not oneDimensional)
-		*out << "\tX1\tY1\tZ1";
+		os << "\tX1\tY1\tZ1";
 	if (fields.test(CreatedDirectionColumn) && not oneDimensional)
-		*out << "\tP1x\tP1y\tP1z";
+		os << "\tP1x\tP1y\tP1z";
 	if (fields.test(WeightColumn))
-		*out << "\tW";
+		os << "\tW";
 	for(std::vector<Property>::const_iterator iter = properties.begin();
 			iter != properties.end(); ++iter)
 	{
-		*out << "\t" << (*iter).name;
+		os << "\t" << (*iter).name;
 	}
 
-	*out << "\n#\n";
+	os << "\n#\n";
 	if (fields.test(TrajectoryLengthColumn))
-		*out << "# D             Trajectory length [" << lengthScale / Mpc
+		os << "# D             Trajectory length [" << lengthScale / Mpc
 				<< " Mpc]\n";
 	if (fields.test(RedshiftColumn))
-		*out << "# z             Redshift\n";
+		os << "# z             Redshift\n";
 	if (fields.test(SerialNumberColumn))
-		*out << "# SN/SN0/SN1    Serial number. Unique (within this run) id of the particle.\n";
+		os << "# SN/SN0/SN1    Serial number. Unique (within this run) id of the particle.\n";
 	if (fields.test(CurrentIdColumn) || fields.test(CreatedIdColumn)
 			|| fields.test(SourceIdColumn))
-		*out << "# ID/ID0/ID1    Particle type (PDG MC numbering scheme)\n";
+		os << "# ID/ID0/ID1    Particle type (PDG MC numbering scheme)\n";
 	if (fields.test(CurrentEnergyColumn) || fields.test(CreatedEnergyColumn)
 			|| fields.test(SourceEnergyColumn))
-		*out << "# E/E0/E1       Energy [" << energyScale / EeV << " EeV]\n";
+		os << "# E/E0/E1       Energy [" << energyScale / EeV << " EeV]\n";
 	if (fields.test(CurrentPositionColumn) || fields.test(CreatedPositionColumn)
 			|| fields.test(SourcePositionColumn))
-		*out << "# X/X0/X1...    Position [" << lengthScale / Mpc << " Mpc]\n";
+		os << "# X/X0/X1...    Position [" << lengthScale / Mpc << " Mpc]\n";
 	if (fields.test(CurrentDirectionColumn)
 			|| fields.test(CreatedDirectionColumn)
 			|| fields.test(SourceDirectionColumn))
-		*out << "# Px/P0x/P1x... Heading (unit vector of momentum)\n";
+		os << "# Px/P0x/P1x... Heading (unit vector of momentum)\n";
 	if (fields.test(WeightColumn))
-		*out << "# W             Weights" << " \n";
+		os << "# W             Weights" << " \n";
 	for(std::vector<Property>::const_iterator iter = properties.begin();
 			iter != properties.end(); ++iter)
 	{
-			*out << "# " << (*iter).name << " " << (*iter).comment << "\n";
+			os << "# " << (*iter).name << " " << (*iter).comment << "\n";
 	}
 
-	*out << "# no index = current, 0 = at source, 1 = at point of creation\n#\n";
-	*out << "# CRPropa version: " << g_GIT_DESC << "\n#\n";
+	os << "# no index = current, 0 = at source, 1 = at point of creation\n#\n";
+	os << "# CRPropa version: " << g_GIT_DESC << "\n#\n";
+	if (not filterExpression.empty())
+		os << "# Filter: " << filterExpression << "\n#\n";
 
 	if (storeRandomSeeds)
 	{
-		*out << "# Random seeds:\n";
+		os << "# Random seeds:\n";
 		std::vector< std::vector<uint32_t> > seeds = Random::getSeedThreads();
 
 		for (size_t i =0; i < seeds.size(); i++)
 		{
 			std::string encoded_data = Base64::encode((unsigned char*) &seeds[i][0], sizeof(seeds[i][0]) * seeds[i].size() / sizeof(unsigned char));
-			*out << "#   Thread " << i << ": ";
-			*out << encoded_data;
-			*out << "\n";
+			os << "#   Thread " << i << ": ";
+			os << encoded_data;
+			os << "\n";
 		}
 	}
 }
@@ -152,126 +327,189 @@ void TextOutput::process(Candidate *c) const {
 	if (fields.none() && properties.empty())
 		return;
 
-	char buffer[1024];
-	size_t p = 0;
+	std::call_once(headerWritten, [this]() { writeHeader(); });
+	if (not passesFilter(c))
+		return;
 
-	std::locale old_locale = std::locale::global(std::locale::classic());
+	char buffer[1024];
+	char *p = buffer;
 
 	if (fields.test(TrajectoryLengthColumn))
-		p += std::sprintf(buffer + p, "%8.5E\t",
-				c->getTrajectoryLength() / lengthScale);
+		p = formatColumn(p, c->getTrajectoryLength() / lengthScale);
 
 	if (fields.test(RedshiftColumn))
-		p += std::sprintf(buffer + p, "%1.5E\t", c->getRedshift());
+		p = formatColumn(p, c->getRedshift());
 
 	if (fields.test(SerialNumberColumn))
-		p += std::sprintf(buffer + p, "%10lu\t",
-				c->getSerialNumber());
+		p = formatInteger(p, (unsigned long long) c->getSerialNumber());
 	if (fields.test(CurrentIdColumn))
-		p += std::sprintf(buffer + p, "%10i\t", c->current.getId());
+		p = formatInteger(p, c->current.getId());
 	if (fields.test(CurrentEnergyColumn))
-		p += std::sprintf(buffer + p, "%8.5E\t",
-				c->current.getEnergy() / energyScale);
+		p = formatColumn(p, c->current.getEnergy() / energyScale);
 	if (fields.test(CurrentPositionColumn)) {
-		if (oneDimensional) {
-			p += std::sprintf(buffer + p, "%8.5E\t",
-					c->current.getPosition().x / lengthScale);
-		} else {
-			const Vector3d pos = c->current.getPosition() / lengthScale;
-			p += std::sprintf(buffer + p, "%8.5E\t%8.5E\t%8.5E\t", pos.x, pos.y,
-					pos.z);
-		}
-	}
-	if (fields.test(CurrentDirectionColumn)) {
-		if (not oneDimensional) {
-			const Vector3d pos = c->current.getDirection();
-			p += std::sprintf(buffer + p, "%8.5E\t%8.5E\t%8.5E\t", pos.x, pos.y,
-					pos.z);
-		}
+		if (oneDimensional)
+			p = formatColumn(p, c->current.getPosition().x / lengthScale);
+		else
+			p = formatColumns(p, c->current.getPosition() / lengthScale);
 	}
+	if (fields.test(CurrentDirectionColumn) and not oneDimensional)
+		p = formatColumns(p, c->current.getDirection());
 
 	if (fields.test(SerialNumberColumn))
-		p += std::sprintf(buffer + p, "%10lu\t", c->getSourceSerialNumber());
+		p = formatInteger(p, (unsigned long long) c->getSourceSerialNumber());
 	if (fields.test(SourceIdColumn))
-		p += std::sprintf(buffer + p, "%10i\t", c->source.getId());
+		p = formatInteger(p, c->source.getId());
 	if (fields.test(SourceEnergyColumn))
-		p += std::sprintf(buffer + p, "%8.5E\t",
-				c->source.getEnergy() / energyScale);
+		p = formatColumn(p, c->source.getEnergy() / energyScale);
 	if (fields.test(SourcePositionColumn)) {
-		if (oneDimensional) {
-			p += std::sprintf(buffer + p, "%8.5E\t",
-					c->source.getPosition().x / lengthScale);
-		} else {
-			const Vector3d pos = c->source.getPosition() / lengthScale;
-			p += std::sprintf(buffer + p, "%8.5E\t%8.5E\t%8.5E\t", pos.x, pos.y,
-					pos.z);
-		}
-	}
-	if (fields.test(SourceDirectionColumn)) {
-		if (not oneDimensional) {
-			const Vector3d pos = c->source.getDirection();
-			p += std::sprintf(buffer + p, "%8.5E\t%8.5E\t%8.5E\t", pos.x, pos.y,
-					pos.z);
-		}
-
+		if (oneDimensional)
+			p = formatColumn(p, c->source.getPosition().x / lengthScale);
+		else
+			p = formatColumns(p, c->source.getPosition() / lengthScale);
 	}
+	if (fields.test(SourceDirectionColumn) and not oneDimensional)
+		p = formatColumns(p, c->source.getDirection());
 
 	if (fields.test(SerialNumberColumn))
-		p += std::sprintf(buffer + p, "%10lu\t",
-				c->getCreatedSerialNumber());
+		p = formatInteger(p, (unsigned long long) c->getCreatedSerialNumber());
 	if (fields.test(CreatedIdColumn))
-		p += std::sprintf(buffer + p, "%10i\t", c->created.getId());
+		p = formatInteger(p, c->created.getId());
 	if (fields.test(CreatedEnergyColumn))
-		p += std::sprintf(buffer + p, "%8.5E\t",
-				c->created.getEnergy() / energyScale);
+		p = formatColumn(p, c->created.getEnergy() / energyScale);
 	if (fields.test(CreatedPositionColumn)) {
-		if (oneDimensional) {
-			p += std::sprintf(buffer + p, "%8.5E\t",
-					c->created.getPosition().x / lengthScale);
-		} else {
-			const Vector3d pos = c->created.getPosition() / lengthScale;
-			p += std::sprintf(buffer + p, "%8.5E\t%8.5E\t%8.5E\t", pos.x, pos.y,
-					pos.z);
-		}
-	}
-	if (fields.test(CreatedDirectionColumn)) {
-		if (not oneDimensional) {
-			const Vector3d pos = c->created.getDirection();
-			p += std::sprintf(buffer + p, "%8.5E\t%8.5E\t%8.5E\t", pos.x, pos.y,
-					pos.z);
-		}
-	}
-	if (fields.test(WeightColumn)) {
-		p += std::sprintf(buffer + p, "%8.5E\t", c->getWeight());
+		if (oneDimensional)
+			p = formatColumn(p, c->created.getPosition().x / lengthScale);
+		else
+			p = formatColumns(p, c->created.getPosition() / lengthScale);
 	}
+	if (fields.test(CreatedDirectionColumn) and not oneDimensional)
+		p = formatColumns(p, c->created.getDirection());
+	if (fields.test(WeightColumn))
+		p = formatColumn(p, c->getWeight());
 
 	for(std::vector<Output::Property>::const_iterator iter = properties.begin();
 			iter != properties.end(); ++iter)
 	{
-		  Variant v;
-			if (c->hasProperty((*iter).name))
-			{
-				v = c->getProperty((*iter).name);
-			}
-			else
-			{
-				v = (*iter).defaultValue;
-			}
-			p += std::sprintf(buffer + p, "%s", v.toString().c_str());
-			p += std::sprintf(buffer + p, "\t");
+		const Variant &v = getPropertyValue(c, *iter);
+		std::string text;
+		if (not v.isString())
+			text = v.toString(std::locale::classic());
+		const std::string &value = v.isString() ? v.asString() : text;
+		if (p + value.size() + 1 > buffer + sizeof(buffer))
+			throw std::runtime_error("TextOutput: line exceeds 1024 characters");
+		std::memcpy(p, value.data(), value.size());
+		p += value.size();
+		*p++ = '\t';
 	}
-	buffer[p - 1] = '\n';
+	p[-1] = '\n';
+	size_t size = p - buffer;
+
+#pragma omp atomic
+	count++;
+	RunMetrics::countOutputBytes(size);
+
+	if (spill) {
+		TextRow row;
+		row.size = size;
+		std::memcpy(row.line, buffer, size);
+		spill->push(getOrderKey(c), row);
+		return;
+	}
+	if (writer) {
+		TextRow row;
+		row.size = size;
+		std::memcpy(row.line, buffer, size);
+		writer->push(row);
+		return;
+	}
+
+	size_t i = 0;
+#ifdef _OPENMP
+	i = omp_get_thread_num();
+#endif
+	if (i >= threadBuffers.size()) {
+		// more threads than at the first line
+		std::string line(buffer, size);
+		writeBlock(line);
+		return;
+	}
+	std::string &text = threadBuffers[i];
+	text.append(buffer, size);
+	if (text.size() >= blockSize)
+		writeBlock(text);
+}
 
-	std::locale::global(old_locale);
+void TextOutput::writeHeader() const {
+	size_t nThreads = 1;
+#ifdef _OPENMP
+	nThreads = omp_in_parallel() ? omp_get_num_threads() : omp_get_max_threads();
+#endif
+	threadBuffers.resize(nThreads);
+	if (ordered)
+		spill.reset(new OrderedRowSpill<TextRow>(nThreads, orderedBufferRows,
+				[](const TextRow &row) {
+					return offsetof(TextRow, line) + row.size;
+				}));
+
+	if (headerPresent)
+		return;
+	std::ostringstream header;
+	header.imbue(std::locale::classic());
+	printHeader(header);
+	std::string text = header.str();
+	writeBlock(text);
+}
 
-#pragma omp critical
-	{
-		if (count == 0)
-			printHeader();
-		Output::process(c);
-		out->write(buffer, p);
+void TextOutput::writeBlock(std::string &text) const {
+	if (text.empty())
+		return;
+#ifdef CRPROPA_HAVE_ZLIB
+	if (compress) {
+		// compressed by the calling thread, only the writing is serialized
+		std::string compressed = deflateBlock(text);
+		unsigned long crc = crc32(0L, (const Bytef *) text.data(), text.size());
+		std::lock_guard<std::mutex> lock(writeMutex);
+		if (not gzipStarted) {
+			startGzip(*out);
+			gzipStarted = true;
+			gzipCrc = 0;
+			gzipSize = 0;
+		}
+		out->write(compressed.data(), compressed.size());
+		gzipCrc = crc32_combine(gzipCrc, crc, text.size());
+		gzipSize += text.size();
+		text.clear();
+		return;
 	}
+#endif
+	std::lock_guard<std::mutex> lock(writeMutex);
+	out->write(text.data(), text.size());
+	text.clear();
+}
 
+void TextOutput::writeBuffers() const {
+	for (size_t i = 0; i < threadBuffers.size(); i++) {
+#ifdef _OPENMP
+		// the buffers of the other threads are in use
+		if (omp_in_parallel() and (i != size_t(omp_get_thread_num())))
+			continue;
+#endif
+		writeBlock(threadBuffers[i]);
+	}
+}
+
+void TextOutput::finishGzip() const {
+#ifdef CRPROPA_HAVE_ZLIB
+	std::lock_guard<std::mutex> lock(writeMutex);
+	if (not gzipStarted)
+		return;
+	// final empty block and trailer
+	static const char last[2] = {3, 0};
+	out->write(last, sizeof(last));
+	writeLittleEndian(*out, gzipCrc);
+	writeLittleEndian(*out, gzipSize);
+	gzipStarted = false;
+#endif
 }
 
 void TextOutput::load(const std::string &filename, ParticleCollector *collector){
@@ -348,24 +586,140 @@ std::string TextOutput::getDescription() const {
 }
 
 void TextOutput::close() {
-#ifdef CRPROPA_HAVE_ZLIB
-	zstream::ogzstream *zs = dynamic_cast<zstream::ogzstream *>(out);
-	if (zs) {
-		zs->close();
-		delete out;
-		out = 0;
-	}
-#endif
+	stopWriter();
+	writeOrdered();
+	writeBuffers();
+	if (compress)
+		finishGzip();
+	if (out)
+		out->flush();
 	outfile.flush();
+	if (async && out)
+		startWriter();
+}
+
+void TextOutput::writeOrdered() const {
+	if (not spill)
+		return;
+	std::string text;
+	spill->merge([this, &text](const TextRow &row) {
+		text.append(row.line, row.size);
+		if (text.size() >= blockSize)
+			writeBlock(text);
+	});
+	writeBlock(text);
+	spill.reset();
+}
+
+void TextOutput::flush() const {
+	if (writer) {
+		writer->sync();
+		return;
+	}
+	writeBuffers();
+	std::lock_guard<std::mutex> lock(writeMutex);
+	if (out)
+		out->flush();
+}
+
+uint64_t TextOutput::getCheckpointPosition() const {
+	if (not out)
+		return 0;
+	std::lock_guard<std::mutex> lock(writeMutex);
+	std::streampos position = out->tellp();
+	return (position < 0) ? 0 : uint64_t(position);
+}
+
+bool TextOutput::rewind(size_t rows, uint64_t position) {
+	// a header written after the rewind would end up within the rows
+	if (not (fields.none() && properties.empty()))
+		std::call_once(headerWritten, [this]() { writeHeader(); });
+	flush();
+	if ((rows == count) and (position == getCheckpointPosition()))
+		return true;
+	if (compress or spill or filename.empty())
+		return false;
+	if (position > getCheckpointPosition())
+		return false;
+
+	stopWriter();
+	writeBuffers();
+	outfile.close();
+	bool truncated = (::truncate(filename.c_str(), position) == 0);
+	outfile.open(filename.c_str(), std::ios::binary | std::ios::in | std::ios::out);
+	if (not outfile.is_open())
+		throw std::runtime_error("TextOutput: cannot reopen " + filename);
+	outfile.seekp(0, std::ios::end);
+	out = &outfile;
+	if (truncated)
+		count = rows;
+	if (async)
+		startWriter();
+	return truncated;
 }
 
 TextOutput::~TextOutput() {
+	async = false;
 	close();
 }
 
+void TextOutput::setAsync(bool async, size_t capacity) {
+	stopWriter();
+	this->async = async;
+	asyncCapacity = capacity;
+	if (async)
+		startWriter();
+}
+
+bool TextOutput::isAsync() const {
+	return async;
+}
+
+void TextOutput::setBlockSize(size_t bytes) {
+	blockSize = bytes;
+}
+
+size_t TextOutput::getBlockSize() const {
+	return blockSize;
+}
+
+void TextOutput::startWriter() {
+	// only the writer thread accesses the stream while it is running
+	writer.reset(new AsyncRowWriter<TextRow>(asyncCapacity,
+			[this](const TextRow &row) {
+				writerBuffer.append(row.line, row.size);
+				if (writerBuffer.size() >= blockSize)
+					writeBlock(writerBuffer);
+			},
+			[this]() {
+				writeBlock(writerBuffer);
+				std::lock_guard<std::mutex> lock(writeMutex);
+				if (out)
+					out->flush();
+			}));
+}
+
+void TextOutput::stopWriter() {
+	if (!writer)
+		return;
+	writer->stop();
+	if (writer->hasFailed())
+		std::cerr << "TextOutput: " << writer->getError() << std::endl;
+	writer.reset();
+}
+
 void TextOutput::gzip() {
 #ifdef CRPROPA_HAVE_ZLIB
-	out = new zstream::ogzstream(*out);
+	compress = true;
+	// single lines would not compress
+	if (blockSize == 0)
+		blockSize = FILE_BLOCK_SIZE;
+	// files without lines are empty gzip streams
+	std::lock_guard<std::mutex> lock(writeMutex);
+	startGzip(*out);
+	gzipStarted = true;
+	gzipCrc = 0;
+	gzipSize = 0;
 #else
 	throw std::runtime_error("CRPropa was build without Zlib compression!");
 #endif
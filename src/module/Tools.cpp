@@ -4,6 +4,10 @@
 #include <iostream>
 #include <sstream>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 using namespace std;
 
 namespace crpropa {
@@ -30,6 +34,13 @@ void PerformanceModule::add(Module *module) {
 	modules.push_back(info);
 }
 
+void PerformanceModule::prepare() {
+	std::vector<Module *> list;
+	for (size_t i = 0; i < modules.size(); i++)
+		list.push_back(modules[i].module);
+	prepareModules(list);
+}
+
 void PerformanceModule::process(Candidate *candidate) const {
 	vector<double> times(modules.size());
 	for (size_t i = 0; i < modules.size(); i++) {
@@ -100,19 +111,55 @@ string ParticleFilter::getDescription() const {
 
 // ----------------------------------------------------------------------------
 EmissionMapFiller::EmissionMapFiller(EmissionMap *emissionMap) : emissionMap(emissionMap) {
+	createThreadMaps();
+}
+
+EmissionMapFiller::~EmissionMapFiller() {
+	flush();
+}
 
+void EmissionMapFiller::createThreadMaps() {
+	threadMaps.clear();
+	if (not emissionMap)
+		return;
+	size_t nThreads = 1;
+#ifdef _OPENMP
+	nThreads = omp_get_max_threads();
+#endif
+	for (size_t i = 0; i < nThreads; i++)
+		threadMaps.push_back(new EmissionMap(emissionMap->getNPhi(), emissionMap->getNTheta(),
+				emissionMap->getNEnergy(), emissionMap->getMinimumEnergy(), emissionMap->getMaximumEnergy()));
 }
 
 void EmissionMapFiller::setEmissionMap(EmissionMap *emissionMap) {
+	flush();
 	this->emissionMap = emissionMap;
+	createThreadMaps();
+}
+
+void EmissionMapFiller::flush() const {
+	if (not emissionMap)
+		return;
+#pragma omp critical(EmissionMapFiller)
+	for (size_t i = 0; i < threadMaps.size(); i++) {
+		emissionMap->merge(threadMaps[i]);
+		threadMaps[i]->getMaps().clear();
+	}
 }
 
 void EmissionMapFiller::process(Candidate* candidate) const {
-	if (emissionMap) {
-		#pragma omp critical
-		{
-			emissionMap->fillMap(candidate->source);
-		}
+	if (not emissionMap)
+		return;
+	size_t iThread = 0;
+#ifdef _OPENMP
+	iThread = omp_get_thread_num();
+#endif
+	if (iThread < threadMaps.size()) {
+		threadMaps[iThread]->fillMap(candidate->source);
+	} else {
+		// more threads than at construction
+#pragma omp critical(EmissionMapFiller)
+		emissionMap->fillMap(candidate->source);
 	}
 }
 
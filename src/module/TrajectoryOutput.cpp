@@ -0,0 +1,477 @@
+#include "crpropa/module/TrajectoryOutput.h"
+#include "crpropa/Common.h"
+#include "crpropa/RunMetrics.h"
+#include "crpropa/Trace.h"
+#include "crpropa/Units.h"
+
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef CRPROPA_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace crpropa {
+
+static const char trajectoryMagic[8] = "CRPTRJ1";
+static const uint32_t trajectoryVersion = 1;
+static const double directionScale = 32767;
+// skipped steps after which a point is kept regardless of the tolerances
+static const size_t maxSkipped = 1024;
+
+// record tags of the block data
+enum TrajectoryTag {
+	TrajectoryHeaderTag, TrajectoryIdTag, TrajectoryPointTag
+};
+
+static void putVarint(std::string &out, uint64_t value) {
+	while (value >= 0x80) {
+		out.push_back(char((value & 0x7f) | 0x80));
+		value >>= 7;
+	}
+	out.push_back(char(value));
+}
+
+static void putSigned(std::string &out, int64_t value) {
+	putVarint(out, (uint64_t(value) << 1) ^ uint64_t(value >> 63));
+}
+
+static uint64_t getVarint(const unsigned char *&p, const unsigned char *end) {
+	uint64_t value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (p == end)
+			throw std::runtime_error("TrajectoryOutput: truncated block");
+		unsigned char byte = *p++;
+		value |= uint64_t(byte & 0x7f) << shift;
+		if (not (byte & 0x80))
+			return value;
+	}
+	throw std::runtime_error("TrajectoryOutput: invalid integer in block");
+}
+
+static int64_t getSigned(const unsigned char *&p, const unsigned char *end) {
+	uint64_t value = getVarint(p, end);
+	return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+// octahedral projection of a direction onto the unit square
+static void encodeDirection(const Vector3d &v, int64_t &u, int64_t &w) {
+	double s = fabs(v.x) + fabs(v.y) + fabs(v.z);
+	if (s == 0) {
+		u = w = 0;
+		return;
+	}
+	double x = v.x / s, y = v.y / s;
+	if (v.z < 0) {
+		double fx = (1 - fabs(y)) * ((x >= 0) ? 1 : -1);
+		double fy = (1 - fabs(x)) * ((y >= 0) ? 1 : -1);
+		x = fx;
+		y = fy;
+	}
+	u = llround(x * directionScale);
+	w = llround(y * directionScale);
+}
+
+static Vector3d decodeDirection(int64_t u, int64_t w) {
+	double x = u / directionScale, y = w / directionScale;
+	double z = 1 - fabs(x) - fabs(y);
+	if (z < 0) {
+		double fx = (1 - fabs(y)) * ((x >= 0) ? 1 : -1);
+		double fy = (1 - fabs(x)) * ((y >= 0) ? 1 : -1);
+		x = fx;
+		y = fy;
+	}
+	return Vector3d(x, y, z).getUnitVector();
+}
+
+TrajectoryOutput::TrajectoryOutput(const std::string &filename) :
+		Output(Trajectory3D), filename(filename), outfile(filename.c_str(), std::ios::binary),
+		positionPrecision(1e-3 * pc), energyPrecision(1e-6), angleTolerance(0),
+		lengthTolerance(0), bufferSize(1 << 20),
+		headerWritten(false), allocated(new std::once_flag) {
+	if (not outfile.is_open())
+		throw std::runtime_error("TrajectoryOutput: could not open file " + filename);
+#ifdef CRPROPA_HAVE_ZLIB
+	compress = true;
+#else
+	compress = false;
+#endif
+}
+
+TrajectoryOutput::~TrajectoryOutput() {
+	close();
+}
+
+void TrajectoryOutput::allocate() const {
+	size_t nThreads = 1;
+#ifdef _OPENMP
+	nThreads = omp_in_parallel() ? omp_get_num_threads() : omp_get_max_threads();
+#endif
+	streams.resize(nThreads + 1);
+	for (size_t i = 0; i < streams.size(); i++) {
+		streams[i].open = false;
+		streams[i].pending = false;
+	}
+}
+
+void TrajectoryOutput::process(Candidate *candidate) const {
+	if (not passesFilter(candidate))
+		return;
+	std::call_once(*allocated, &TrajectoryOutput::allocate, this);
+
+#pragma omp atomic
+	count++;
+
+	size_t i = 0;
+#ifdef _OPENMP
+	i = omp_get_thread_num();
+#endif
+	if (i + 1 < streams.size()) {
+		encode(streams[i], candidate);
+	} else {
+		// more threads than at the first candidate
+		std::lock_guard<std::mutex> lock(sharedMutex);
+		encode(streams.back(), candidate);
+	}
+}
+
+void TrajectoryOutput::encode(Stream &stream, const Candidate *candidate) const {
+	std::string &out = stream.buffer;
+	int32_t id = candidate->current.getId();
+	uint64_t serialNumber = candidate->getSerialNumber();
+	uint64_t secondaries = candidate->getNumberOfCreatedSecondaries();
+	bool keep = true;
+	if (not stream.open or (serialNumber != stream.serialNumber)) {
+		writePending(stream);
+		out.push_back(char(TrajectoryHeaderTag));
+		putVarint(out, serialNumber);
+		putVarint(out, candidate->getCreatedSerialNumber());
+		putSigned(out, candidate->source.getId());
+		out.push_back(char(TrajectoryIdTag));
+		putSigned(out, id);
+		stream.open = true;
+		stream.serialNumber = serialNumber;
+		stream.id = id;
+		std::fill(stream.last, stream.last + 7, 0);
+	} else if (id != stream.id) {
+		// interaction, the point before it is kept with the previous id
+		writePending(stream);
+		out.push_back(char(TrajectoryIdTag));
+		putSigned(out, id);
+		stream.id = id;
+	} else if (secondaries != stream.secondaries) {
+		writePending(stream);
+	} else if ((angleTolerance > 0) or (lengthTolerance > 0)) {
+		keep = false;
+	}
+	stream.secondaries = secondaries;
+
+	const Vector3d &x = candidate->current.getPosition();
+	const Vector3d &p = candidate->current.getDirection();
+	double E = std::max(candidate->current.getEnergy(), DBL_MIN);
+	int64_t q[7];
+	q[0] = llround(candidate->getTrajectoryLength() / positionPrecision);
+	q[1] = llround(x.x / positionPrecision);
+	q[2] = llround(x.y / positionPrecision);
+	q[3] = llround(x.z / positionPrecision);
+	q[4] = llround(log10(E) / energyPrecision);
+	encodeDirection(p, q[5], q[6]);
+
+	if (keep or not skip(stream, x, p)) {
+		writePoint(stream, q);
+		stream.anchorPosition = x;
+		stream.anchorDirection = p;
+		stream.skipped.clear();
+	} else {
+		std::copy(q, q + 7, stream.pendingPoint);
+		stream.pendingDirection = p;
+		stream.pending = true;
+	}
+
+	if (out.size() >= bufferSize)
+		write(stream);
+}
+
+// whether the step at position and direction can be skipped, else the
+// pending point is kept and the step is tested against it
+bool TrajectoryOutput::skip(Stream &stream, const Vector3d &position, const Vector3d &direction) const {
+	for (int attempt = 0; attempt < 2; attempt++) {
+		bool within = (stream.skipped.size() < maxSkipped);
+		if (within and (angleTolerance > 0))
+			within = stream.anchorDirection.getAngleTo(direction) <= angleTolerance;
+		if (within and (lengthTolerance > 0)) {
+			// distance of the skipped positions to the segment anchor - position
+			Vector3d d = position - stream.anchorPosition;
+			double d2 = d.getR2();
+			for (size_t i = 0; within and (i < stream.skipped.size()); i++) {
+				Vector3d r = stream.skipped[i] - stream.anchorPosition;
+				double t = (d2 > 0) ? std::min(std::max(r.dot(d) / d2, 0.), 1.) : 0;
+				within = (r - d * t).getR() <= lengthTolerance;
+			}
+		}
+		if (within) {
+			stream.skipped.push_back(position);
+			return true;
+		}
+		if (not stream.pending)
+			return false;
+		stream.anchorPosition = stream.skipped.back();
+		stream.anchorDirection = stream.pendingDirection;
+		writePending(stream);
+	}
+	return false;
+}
+
+void TrajectoryOutput::writePoint(Stream &stream, const int64_t *point) const {
+	stream.buffer.push_back(char(TrajectoryPointTag));
+	for (size_t k = 0; k < 7; k++) {
+		putSigned(stream.buffer, point[k] - stream.last[k]);
+		stream.last[k] = point[k];
+	}
+}
+
+void TrajectoryOutput::writePending(Stream &stream) const {
+	if (stream.pending)
+		writePoint(stream, stream.pendingPoint);
+	stream.pending = false;
+	stream.skipped.clear();
+}
+
+void TrajectoryOutput::writeHeader() const {
+	uint32_t version[2] = {trajectoryVersion, compress ? 1u : 0u};
+	double precision[2] = {positionPrecision, energyPrecision};
+	uint32_t scale[2] = {uint32_t(directionScale), 0};
+	outfile.write(trajectoryMagic, sizeof(trajectoryMagic));
+	outfile.write((const char *) version, sizeof(version));
+	outfile.write((const char *) precision, sizeof(precision));
+	outfile.write((const char *) scale, sizeof(scale));
+	headerWritten = true;
+}
+
+void TrajectoryOutput::write(Stream &stream) const {
+	// the next block starts with the header of the open trajectory
+	writePending(stream);
+	stream.open = false;
+	std::string &data = stream.buffer;
+	if (data.empty())
+		return;
+	CRPROPA_TRACE_SPAN("TrajectoryOutput::write", "output");
+
+	std::string compressed;
+	const std::string *stored = &data;
+#ifdef CRPROPA_HAVE_ZLIB
+	if (compress) {
+		uLongf length = compressBound(data.size());
+		compressed.resize(length);
+		if (compress2((Bytef *) &compressed[0], &length, (const Bytef *) data.data(),
+				data.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+			throw std::runtime_error("TrajectoryOutput: compression failed");
+		compressed.resize(length);
+		stored = &compressed;
+	}
+#endif
+
+	uint32_t sizes[2] = {uint32_t(data.size()), uint32_t(stored->size())};
+	{
+		std::lock_guard<std::mutex> lock(writeMutex);
+		if (not headerWritten)
+			writeHeader();
+		outfile.write((const char *) sizes, sizeof(sizes));
+		outfile.write(stored->data(), stored->size());
+	}
+	RunMetrics::countOutputBytes(sizeof(sizes) + stored->size());
+	data.clear();
+}
+
+void TrajectoryOutput::flush() const {
+#ifdef _OPENMP
+	if (omp_in_parallel()) {
+		size_t i = omp_get_thread_num();
+		if (i + 1 < streams.size())
+			write(streams[i]);
+		return;
+	}
+#endif
+	std::lock_guard<std::mutex> lock(sharedMutex);
+	for (size_t i = 0; i < streams.size(); i++)
+		write(streams[i]);
+}
+
+void TrajectoryOutput::close() {
+	if (not outfile.is_open())
+		return;
+	flush();
+	if (not headerWritten)
+		writeHeader();
+	outfile.close();
+}
+
+void TrajectoryOutput::setPositionPrecision(double length) {
+	modify();
+	if (not (length > 0))
+		throw std::runtime_error("TrajectoryOutput: the position precision must be positive");
+	positionPrecision = length;
+}
+
+double TrajectoryOutput::getPositionPrecision() const {
+	return positionPrecision;
+}
+
+void TrajectoryOutput::setEnergyPrecision(double precision) {
+	modify();
+	if (not (precision > 0))
+		throw std::runtime_error("TrajectoryOutput: the energy precision must be positive");
+	energyPrecision = precision;
+}
+
+double TrajectoryOutput::getEnergyPrecision() const {
+	return energyPrecision;
+}
+
+void TrajectoryOutput::setDecimation(double angle, double length) {
+	modify();
+	if (not (angle >= 0) or not (length >= 0))
+		throw std::runtime_error("TrajectoryOutput: the decimation tolerances must not be negative");
+	angleTolerance = angle;
+	lengthTolerance = length;
+}
+
+double TrajectoryOutput::getAngleTolerance() const {
+	return angleTolerance;
+}
+
+double TrajectoryOutput::getLengthTolerance() const {
+	return lengthTolerance;
+}
+
+void TrajectoryOutput::setBufferSize(size_t bytes) {
+	bufferSize = bytes;
+}
+
+size_t TrajectoryOutput::getBufferSize() const {
+	return bufferSize;
+}
+
+void TrajectoryOutput::setCompression(bool compress) {
+	modify();
+#ifndef CRPROPA_HAVE_ZLIB
+	if (compress)
+		throw std::runtime_error("CRPropa was build without Zlib compression!");
+#endif
+	this->compress = compress;
+}
+
+bool TrajectoryOutput::getCompression() const {
+	return compress;
+}
+
+std::string TrajectoryOutput::getDescription() const {
+	std::stringstream s;
+	s << "TrajectoryOutput: Output file = " << filename
+			<< ", position precision = " << positionPrecision / pc << " pc"
+			<< ", energy precision = " << energyPrecision << " dex";
+	if ((angleTolerance > 0) or (lengthTolerance > 0))
+		s << ", decimated to " << angleTolerance << " rad and " << lengthTolerance / pc << " pc";
+	if (compress)
+		s << " (compressed)";
+	return s.str();
+}
+
+size_t TrajectoryOutput::getMemoryUsage() const {
+	std::lock_guard<std::mutex> lock(sharedMutex);
+	size_t bytes = memoryUsage(streams);
+	for (size_t i = 0; i < streams.size(); i++)
+		bytes += streams[i].buffer.capacity() + memoryUsage(streams[i].skipped);
+	return bytes;
+}
+
+std::vector<TrajectoryOutput::Trajectory> TrajectoryOutput::read(const std::string &filename) {
+	std::ifstream in(filename.c_str(), std::ios::binary);
+	if (not in.is_open())
+		throw std::runtime_error("TrajectoryOutput: could not open file " + filename);
+
+	char magic[sizeof(trajectoryMagic)];
+	uint32_t version[2];
+	double precision[2];
+	uint32_t scale[2];
+	in.read(magic, sizeof(magic));
+	in.read((char *) version, sizeof(version));
+	in.read((char *) precision, sizeof(precision));
+	in.read((char *) scale, sizeof(scale));
+	if (not in or std::memcmp(magic, trajectoryMagic, sizeof(magic)) != 0)
+		throw std::runtime_error("TrajectoryOutput: not a trajectory file: " + filename);
+	if ((version[0] != trajectoryVersion) or (scale[0] != uint32_t(directionScale)))
+		throw std::runtime_error("TrajectoryOutput: unsupported version of the trajectory format");
+#ifndef CRPROPA_HAVE_ZLIB
+	if (version[1])
+		throw std::runtime_error("CRPropa was build without Zlib compression!");
+#endif
+
+	std::vector<Trajectory> trajectories;
+	std::map<uint64_t, size_t> index;
+	std::string stored, data;
+	uint32_t sizes[2];
+	while (in.read((char *) sizes, sizeof(sizes))) {
+		stored.resize(sizes[1]);
+		if (not in.read(&stored[0], sizes[1]))
+			throw std::runtime_error("TrajectoryOutput: truncated file " + filename);
+		if (version[1]) {
+#ifdef CRPROPA_HAVE_ZLIB
+			data.resize(sizes[0]);
+			uLongf length = sizes[0];
+			if ((uncompress((Bytef *) &data[0], &length, (const Bytef *) stored.data(),
+					stored.size()) != Z_OK) or (length != sizes[0]))
+				throw std::runtime_error("TrajectoryOutput: corrupt block in " + filename);
+#endif
+		} else {
+			data.swap(stored);
+		}
+
+		const unsigned char *p = (const unsigned char *) data.data();
+		const unsigned char *end = p + data.size();
+		Trajectory *trajectory = 0;
+		int32_t id = 0;
+		int64_t last[7];
+		while (p < end) {
+			unsigned char tag = *p++;
+			if (tag == TrajectoryHeaderTag) {
+				uint64_t serialNumber = getVarint(p, end);
+				std::map<uint64_t, size_t>::iterator it = index.find(serialNumber);
+				if (it == index.end()) {
+					it = index.insert(std::make_pair(serialNumber, trajectories.size())).first;
+					trajectories.push_back(Trajectory());
+					trajectories.back().serialNumber = serialNumber;
+				}
+				trajectory = &trajectories[it->second];
+				trajectory->createdSerialNumber = getVarint(p, end);
+				trajectory->sourceId = getSigned(p, end);
+				std::fill(last, last + 7, 0);
+			} else if (tag == TrajectoryIdTag) {
+				id = getSigned(p, end);
+			} else if ((tag == TrajectoryPointTag) and trajectory) {
+				for (size_t k = 0; k < 7; k++)
+					last[k] += getSigned(p, end);
+				Point point;
+				point.trajectoryLength = last[0] * precision[0];
+				point.position = Vector3d(last[1], last[2], last[3]) * precision[0];
+				point.energy = pow(10, last[4] * precision[1]);
+				point.direction = decodeDirection(last[5], last[6]);
+				point.id = id;
+				trajectory->points.push_back(point);
+			} else {
+				throw std::runtime_error("TrajectoryOutput: corrupt block in " + filename);
+			}
+		}
+	}
+	return trajectories;
+}
+
+} // namespace crpropa
@@ -0,0 +1,130 @@
+#include "crpropa/module/WeightWindow.h"
+#include "crpropa/Random.h"
+#include "crpropa/Units.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <stdexcept>
+
+namespace crpropa {
+
+WeightWindow::WeightWindow(double lower, double upper, double survival) : maxSplitting(100) {
+	setWindow(lower, upper, survival);
+}
+
+WeightWindow::Window WeightWindow::makeWindow(double lower, double upper, double survival) {
+	if ((lower < 0) or not (upper > lower))
+		throw std::runtime_error("WeightWindow: the bounds must satisfy 0 <= lower < upper");
+	if (survival == 0)
+		survival = std::isinf(upper) ? lower : 0.5 * (lower + upper);
+	if ((survival < lower) or (survival > upper))
+		throw std::runtime_error("WeightWindow: the survival weight must be within the bounds");
+	Window w;
+	w.lower = lower;
+	w.upper = upper;
+	w.survival = survival;
+	return w;
+}
+
+void WeightWindow::setWindow(double lower, double upper, double survival) {
+	window = makeWindow(lower, upper, survival);
+}
+
+void WeightWindow::setWindow(int id, double minEnergy, double lower, double upper, double survival) {
+	windows[id][minEnergy] = makeWindow(lower, upper, survival);
+}
+
+WeightWindow::Window WeightWindow::getWindow(int id, double energy) const {
+	std::map<int, std::map<double, Window> >::const_iterator i = windows.find(id);
+	if (i == windows.end())
+		return window;
+	// the window with the largest minimum energy below the energy
+	std::map<double, Window>::const_iterator j = i->second.upper_bound(energy);
+	if (j == i->second.begin())
+		return window;
+	return (--j)->second;
+}
+
+void WeightWindow::addImportanceRegion(ref_ptr<Surface> region, double importance) {
+	if (not (importance > 0))
+		throw std::runtime_error("WeightWindow: the importance must be positive");
+	regions.push_back(region);
+	importances.push_back(importance);
+}
+
+double WeightWindow::getImportance(const Vector3d &position) const {
+	double importance = 0;
+	for (size_t i = 0; i < regions.size(); i++)
+		if ((importances[i] > importance) and (regions[i]->distance(position) < 0))
+			importance = importances[i];
+	return (importance > 0) ? importance : 1;
+}
+
+void WeightWindow::setMaximumSplitting(size_t n) {
+	if (n < 1)
+		throw std::runtime_error("WeightWindow: the maximum splitting must be at least 1");
+	maxSplitting = n;
+}
+
+size_t WeightWindow::getMaximumSplitting() const {
+	return maxSplitting;
+}
+
+void WeightWindow::process(Candidate *candidate) const {
+	if (not candidate->isActive())
+		return;
+	const ParticleState &state = candidate->current;
+	Window w = getWindow(state.getId(), state.getEnergy());
+	if (not regions.empty()) {
+		double importance = getImportance(state.getPosition());
+		w.lower /= importance;
+		w.upper /= importance;
+		w.survival /= importance;
+	}
+
+	double weight = candidate->getWeight();
+	if (weight < w.lower) {
+		// Russian roulette
+		if (Random::instance().rand() * w.survival < weight)
+			candidate->setWeight(w.survival);
+		else
+			reject(candidate);
+		return;
+	}
+
+	if (weight > w.upper) {
+		size_t n = std::min<double>(std::ceil(weight / w.upper), maxSplitting);
+		if (n < 2)
+			return;
+		candidate->setWeight(weight / n);
+		for (size_t i = 1; i < n; i++) {
+			ref_ptr<Candidate> copy = candidate->clone(false);
+			copy->created = candidate->current;
+			copy->parent = candidate;
+			copy->setRandomStream(0, 0); // derived by addSecondary
+			candidate->addSecondary(copy);
+		}
+	}
+}
+
+std::string WeightWindow::getDescription() const {
+	std::stringstream s;
+	s << "WeightWindow: [" << window.lower << ", " << window.upper << "], survival weight "
+			<< window.survival;
+	std::map<int, std::map<double, Window> >::const_iterator i;
+	for (i = windows.begin(); i != windows.end(); i++) {
+		std::map<double, Window>::const_iterator j;
+		for (j = i->second.begin(); j != i->second.end(); j++)
+			s << "\n  particle " << i->first << " from " << j->first / eV << " eV: [" << j->second.lower
+					<< ", " << j->second.upper << "], survival weight " << j->second.survival;
+	}
+	s << "\n  " << regions.size() << " importance regions, maximum splitting " << maxSplitting;
+	s << "\n  Flag: '" << rejectFlagKey << "' -> '" << rejectFlagValue << "', ";
+	s << "MakeInactive: " << (makeRejectedInactive ? "yes" : "no");
+	if (rejectAction.valid())
+		s << ", Action: " << rejectAction->getDescription();
+	return s.str();
+}
+
+} // namespace crpropa
@@ -0,0 +1,23 @@
+// Converts the text tables of the CRPropa data directory to binary tables,
+// which the interaction modules map instead of parsing the text.
+// Usage: crpropa-convert-tables <data directory>
+
+#include "crpropa/NumericTable.h"
+
+#include <iostream>
+#include <stdexcept>
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		std::cerr << "usage: " << argv[0] << " <data directory>" << std::endl;
+		return 1;
+	}
+	try {
+		size_t n = crpropa::convertDataDirectory(argv[1]);
+		std::cout << "crpropa-convert-tables: converted " << n << " tables in " << argv[1] << std::endl;
+	} catch (std::exception &e) {
+		std::cerr << "crpropa-convert-tables: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
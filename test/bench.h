@@ -0,0 +1,188 @@
+// Command line, JSON output and baseline comparison shared by the benchmarks.
+//
+// The results are written as JSON with one benchmark per line, which is the
+// format readResults expects of a baseline given with --compare.
+
+#ifndef CRPROPA_BENCH_H
+#define CRPROPA_BENCH_H
+
+#include "crpropa/Version.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace bench {
+
+inline int maxThreads() {
+#ifdef _OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+struct Options {
+	std::string filter, out, compare;
+	double minTime, scale, tolerance;
+	std::vector<int> threads;
+	Options() : minTime(0.2), scale(1), tolerance(0.1) {
+	}
+};
+
+/**
+ Parse the arguments of a benchmark, which accepts only the options listed in
+ its usage, e.g. "[--filter text] [--out file.json]".
+ Returns -1 to run the benchmark, otherwise the exit code.
+ Without --threads, 1, 2, 4, ... and all threads are used.
+ */
+inline int parseArguments(int argc, char **argv, const std::string &program,
+		const std::string &usage, Options &options) {
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--help" || usage.find("[" + arg + " ") == std::string::npos) {
+			std::cerr << "usage: " << program << " " << usage << std::endl;
+			return (arg == "--help") ? 0 : 2;
+		}
+		if (i + 1 == argc) {
+			std::cerr << program << ": missing value of " << arg << std::endl;
+			return 2;
+		}
+		if (arg == "--filter")
+			options.filter = argv[++i];
+		else if (arg == "--min-time")
+			options.minTime = atof(argv[++i]);
+		else if (arg == "--scale")
+			options.scale = atof(argv[++i]);
+		else if (arg == "--out")
+			options.out = argv[++i];
+		else if (arg == "--compare")
+			options.compare = argv[++i];
+		else if (arg == "--tolerance")
+			options.tolerance = atof(argv[++i]);
+		else if (arg == "--threads") {
+			std::stringstream ss(argv[++i]);
+			std::string t;
+			while (std::getline(ss, t, ','))
+				options.threads.push_back(atoi(t.c_str()));
+		}
+	}
+	if (options.threads.empty()) {
+		for (int t = 1; t < maxThreads(); t *= 2)
+			options.threads.push_back(t);
+		options.threads.push_back(maxThreads());
+	}
+	return -1;
+}
+
+struct Result {
+	std::string name;
+	int threads;
+	double nsPerEval, evalsPerSecond, scaling;
+	std::string fields; // further JSON fields of the benchmark
+
+	Result(const std::string &name = "", int threads = 1, double nsPerEval = 0) :
+			name(name), threads(threads), nsPerEval(nsPerEval),
+			evalsPerSecond(nsPerEval > 0 ? 1e9 / nsPerEval * threads : 0), scaling(1) {
+	}
+
+	template<typename T>
+	void add(const std::string &key, const T &value) {
+		std::stringstream ss;
+		ss << ", \"" << key << "\": " << value;
+		fields += ss.str();
+	}
+
+	std::string toJSON() const {
+		std::stringstream ss;
+		ss << "{\"name\": \"" << name << "\", \"threads\": " << threads
+				<< ", \"ns_per_eval\": " << nsPerEval
+				<< ", \"evals_per_second\": " << evalsPerSecond
+				<< ", \"scaling\": " << scaling << fields << "}";
+		return ss.str();
+	}
+};
+
+/**
+ Write the results to the file of --out or to stdout. The context holds the
+ JSON fields that describe the run, besides the date and the version.
+ */
+inline void writeResults(const Options &options, const std::string &context,
+		const std::vector<Result> &results) {
+	std::stringstream json;
+	char date[32];
+	time_t now = time(NULL);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+	json << "{\n\"context\": {\"date\": \"" << date << "\", \"version\": \"" << g_GIT_DESC
+			<< "\"" << context << "},\n\"benchmarks\": [\n";
+	for (size_t i = 0; i < results.size(); i++)
+		json << results[i].toJSON() << ((i + 1 < results.size()) ? ",\n" : "\n");
+	json << "]\n}\n";
+	if (options.out.empty())
+		std::cout << json.str();
+	else
+		std::ofstream(options.out.c_str()) << json.str();
+}
+
+// ns per evaluation of an earlier run, keyed by name and number of threads
+inline std::map<std::pair<std::string, int>, double> readResults(const std::string &program,
+		const std::string &filename) {
+	std::map<std::pair<std::string, int>, double> results;
+	std::ifstream in(filename.c_str());
+	if (!in) {
+		std::cerr << program << ": could not open " << filename << std::endl;
+		exit(2);
+	}
+	std::string line;
+	while (std::getline(in, line)) {
+		size_t name = line.find("\"name\": \"");
+		size_t threads = line.find("\"threads\": ");
+		size_t ns = line.find("\"ns_per_eval\": ");
+		if ((name == std::string::npos) || (threads == std::string::npos) || (ns == std::string::npos))
+			continue;
+		name += 9;
+		std::string key = line.substr(name, line.find('"', name) - name);
+		int t = atoi(line.c_str() + threads + 11);
+		results[std::make_pair(key, t)] = atof(line.c_str() + ns + 15);
+	}
+	return results;
+}
+
+/**
+ Compare the results to the baseline of --compare, if given.
+ Returns 1 if any benchmark became slower by more than the tolerance, otherwise 0.
+ */
+inline int compareResults(const std::string &program, const Options &options,
+		const std::vector<Result> &results) {
+	if (options.compare.empty())
+		return 0;
+	int status = 0;
+	std::map<std::pair<std::string, int>, double> baseline = readResults(program, options.compare);
+	for (size_t i = 0; i < results.size(); i++) {
+		std::map<std::pair<std::string, int>, double>::iterator it =
+				baseline.find(std::make_pair(results[i].name, results[i].threads));
+		if (it == baseline.end())
+			continue;
+		double change = results[i].nsPerEval / it->second - 1;
+		bool slower = change > options.tolerance;
+		fprintf(stderr, "%-40s %3d threads %+7.1f %%%s\n", results[i].name.c_str(),
+				results[i].threads, 100 * change, slower ? "  SLOWER" : "");
+		if (slower)
+			status = 1;
+	}
+	return status;
+}
+
+} // namespace bench
+
+#endif // CRPROPA_BENCH_H
@@ -0,0 +1,172 @@
+// Throughput of the magnetic field evaluation, single and multi-threaded.
+//
+// bench_fields [--filter text] [--min-time seconds] [--threads n,...]
+//              [--out file.json] [--compare baseline.json] [--tolerance fraction]
+//
+// Every benchmark evaluates getField at precomputed positions in its domain,
+// each thread on its own positions, and reports the nanoseconds per
+// evaluation of one thread and the total evaluations per second. The results
+// are written as JSON, one benchmark per line. With --compare the results
+// are checked against those of an earlier run and the exit code is 1 if any
+// benchmark became slower by more than the tolerance (default 0.1).
+
+#include "crpropa/magneticField/MagneticField.h"
+#include "crpropa/magneticField/MagneticFieldGrid.h"
+#include "crpropa/magneticField/JF12Field.h"
+#include "crpropa/magneticField/PT11Field.h"
+#include "crpropa/magneticField/TF17Field.h"
+#include "crpropa/magneticField/turbulentField/PlaneWaveTurbulence.h"
+#include "crpropa/Random.h"
+#include "crpropa/Units.h"
+
+#include "bench.h"
+
+#include <chrono>
+#include <sstream>
+
+using namespace crpropa;
+using bench::Result;
+
+struct Benchmark {
+	std::string name;
+	ref_ptr<MagneticField> field;
+	Vector3d lower, upper; // domain of the positions
+};
+
+static ref_ptr<MagneticFieldGrid> gridField(size_t n, bool reflective) {
+	ref_ptr<Grid3f> grid = new Grid3f(Vector3d(0.), n, 1 * kpc);
+	Random random(n);
+	std::vector<Vector3f> &values = grid->getGrid();
+	for (size_t i = 0; i < values.size(); i++)
+		values[i] = Vector3f(random.randNorm(), random.randNorm(), random.randNorm()) * muG;
+	grid->setReflective(reflective);
+	return new MagneticFieldGrid(grid);
+}
+
+static std::vector<Benchmark> benchmarks(const std::string &filter) {
+	std::vector<Benchmark> list;
+	Vector3d galaxy(20 * kpc), lowerGalaxy(-20 * kpc);
+	// only the fields that pass the filter are constructed
+	#define BENCHMARK_FIELD(NAME, LOWER, UPPER, CREATE) \
+		if (std::string(NAME).find(filter) != std::string::npos) { \
+			Benchmark b = {NAME, CREATE, LOWER, UPPER}; \
+			list.push_back(b); \
+		}
+
+	BENCHMARK_FIELD("UniformMagneticField", lowerGalaxy, galaxy,
+			new UniformMagneticField(Vector3d(1, 2, 3) * muG));
+
+	size_t sizes[3] = {32, 128, 256};
+	for (int i = 0; i < 3; i++)
+		for (int reflective = 0; reflective < 2; reflective++) {
+			std::stringstream name;
+			name << "MagneticFieldGrid/" << sizes[i] << (reflective ? "/reflective" : "/periodic");
+			// positions beyond the grid exercise the wrapping
+			BENCHMARK_FIELD(name.str(), Vector3d(-0.5 * sizes[i] * kpc),
+					Vector3d(1.5 * sizes[i] * kpc), gridField(sizes[i], reflective));
+		}
+
+	std::vector<std::string> kernels = PlaneWaveTurbulence::getSupportedKernels();
+	std::vector<std::string> used(1, kernels.front());
+	if (kernels.size() > 1)
+		used.push_back(kernels.back());
+	for (size_t i = 0; i < used.size(); i++) {
+		std::string name = "PlaneWaveTurbulence/256/" + used[i];
+		if (name.find(filter) == std::string::npos)
+			continue;
+		ref_ptr<PlaneWaveTurbulence> field = new PlaneWaveTurbulence(
+				TurbulenceSpectrum(1 * muG, 10 * pc, 1 * kpc), 256, 42);
+		field->setKernel(used[i]);
+		BENCHMARK_FIELD(name, lowerGalaxy, galaxy, field);
+	}
+
+	BENCHMARK_FIELD("JF12Field", lowerGalaxy, galaxy, new JF12Field());
+	BENCHMARK_FIELD("TF17Field", lowerGalaxy, galaxy, new TF17Field());
+	BENCHMARK_FIELD("PT11Field", lowerGalaxy, galaxy, new PT11Field());
+
+	if (std::string("MagneticFieldList").find(filter) != std::string::npos) {
+		ref_ptr<MagneticFieldList> field = new MagneticFieldList();
+		field->addField(new JF12Field());
+		field->addField(new UniformMagneticField(Vector3d(0, 0, 0.1) * muG));
+		BENCHMARK_FIELD("MagneticFieldList", lowerGalaxy, galaxy, field);
+	}
+	#undef BENCHMARK_FIELD
+	return list;
+}
+
+// nanoseconds per evaluation of one thread, with threads evaluating concurrently
+static double measure(const Benchmark &b, int threads, double minTime) {
+	const size_t n = 4096;
+	std::vector<std::vector<Vector3d> > positions(threads);
+	for (int t = 0; t < threads; t++) {
+		Random random(1000 + t);
+		positions[t].resize(n);
+		for (size_t i = 0; i < n; i++)
+			positions[t][i] = b.lower + Vector3d(random.rand(), random.rand(), random.rand())
+					* (b.upper - b.lower);
+	}
+
+	std::vector<double> times(threads);
+	std::vector<size_t> evals(threads);
+	double sink = 0;
+#pragma omp parallel num_threads(threads) reduction(+:sink)
+	{
+		int t = 0;
+#ifdef _OPENMP
+		t = omp_get_thread_num();
+#endif
+		const std::vector<Vector3d> &p = positions[t];
+		for (size_t i = 0; i < n / 8; i++) // warm up
+			sink += b.field->getField(p[i]).x;
+#pragma omp barrier
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		double elapsed = 0;
+		size_t count = 0;
+		while (elapsed < minTime) {
+			for (size_t i = 0; i < n; i++)
+				sink += b.field->getField(p[i]).x;
+			count += n;
+			elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+		times[t] = elapsed;
+		evals[t] = count;
+	}
+	// keeps the evaluations
+	volatile double result = sink;
+	(void) result;
+
+	double ns = 0;
+	for (int t = 0; t < threads; t++)
+		ns += times[t] / evals[t] * 1e9;
+	return ns / threads;
+}
+
+int main(int argc, char **argv) {
+	bench::Options options;
+	int status = bench::parseArguments(argc, argv, "bench_fields", "[--filter text]"
+			" [--min-time seconds] [--threads n,...] [--out file.json]"
+			" [--compare baseline.json] [--tolerance fraction]", options);
+	if (status >= 0)
+		return status;
+
+	std::vector<Result> results;
+	std::vector<Benchmark> list = benchmarks(options.filter);
+	const std::vector<int> &threads = options.threads;
+	for (size_t i = 0; i < list.size(); i++) {
+		double single = 0;
+		for (size_t j = 0; j < threads.size(); j++) {
+			Result r(list[i].name, threads[j], measure(list[i], threads[j], options.minTime));
+			if (j == 0)
+				single = r.evalsPerSecond / threads[j];
+			r.scaling = r.evalsPerSecond / single;
+			results.push_back(r);
+			fprintf(stderr, "%-40s %3d threads %10.1f ns/eval %8.2f scaling\n", r.name.c_str(),
+					r.threads, r.nsPerEval, r.scaling);
+		}
+	}
+
+	std::stringstream context;
+	context << ", \"max_threads\": " << bench::maxThreads() << ", \"min_time\": " << options.minTime;
+	bench::writeResults(options, context.str(), results);
+	return bench::compareResults("bench_fields", options, results);
+}
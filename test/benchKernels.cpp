@@ -0,0 +1,264 @@
+// Throughput of the core numerical kernels, single-threaded.
+//
+// bench_kernels [--filter text] [--min-time seconds] [--out file.json]
+//               [--compare baseline.json] [--tolerance fraction]
+//
+// Every benchmark runs its kernel on precomputed random inputs and reports
+// the nanoseconds per evaluation, as JSON with one benchmark per line in the
+// format of bench_fields: the interpolation routines, Grid::interpolate with
+// periodic and reflective boundaries, the random number generator, a step of
+// PropagationCK and PropagationBP, Candidate::addSecondary and the process of
+// the interaction modules. The interaction benchmarks reset the candidate
+// before every call, which is included in the time, and are skipped if the
+// data files of the module are not installed.
+
+#include "crpropa/Candidate.h"
+#include "crpropa/Common.h"
+#include "crpropa/Grid.h"
+#include "crpropa/magneticField/MagneticField.h"
+#include "crpropa/module/EMDoublePairProduction.h"
+#include "crpropa/module/EMInverseComptonScattering.h"
+#include "crpropa/module/EMPairProduction.h"
+#include "crpropa/module/EMTripletPairProduction.h"
+#include "crpropa/module/ElectronPairProduction.h"
+#include "crpropa/module/NuclearDecay.h"
+#include "crpropa/module/PhotoDisintegration.h"
+#include "crpropa/module/PhotoPionProduction.h"
+#include "crpropa/module/PropagationBP.h"
+#include "crpropa/module/PropagationCK.h"
+#include "crpropa/module/SynchrotronRadiation.h"
+#include "crpropa/ParticleID.h"
+#include "crpropa/PhotonBackground.h"
+#include "crpropa/Random.h"
+#include "crpropa/Units.h"
+
+#include "bench.h"
+
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <string>
+#include <vector>
+
+using namespace crpropa;
+using bench::Result;
+
+static const size_t n = 4096;
+
+typedef std::function<double(size_t)> Kernel;
+
+struct Benchmark {
+	std::string name;
+	Kernel kernel;
+};
+
+struct Tables {
+	std::vector<double> X, Y, X2, Y2, Z2, x, y;
+	Tables() : X(1000), Y(1000), X2(100), Y2(100), Z2(100 * 100), x(n), y(n) {
+		Random random(42);
+		for (size_t i = 0; i < X.size(); i++) {
+			X[i] = std::pow(10., 16 + 6. * i / (X.size() - 1));
+			Y[i] = random.rand();
+		}
+		for (size_t i = 0; i < X2.size(); i++) {
+			X2[i] = i;
+			Y2[i] = i;
+		}
+		for (size_t i = 0; i < Z2.size(); i++)
+			Z2[i] = random.rand();
+		for (size_t i = 0; i < n; i++) {
+			x[i] = random.rand();
+			y[i] = random.rand();
+		}
+	}
+};
+
+static void addInterpolation(std::vector<Benchmark> &list) {
+	static Tables t;
+	list.push_back({"interpolate", [](size_t i) {
+		return interpolate(std::pow(10., 16 + 6 * t.x[i]), t.X, t.Y);
+	}});
+	list.push_back({"interpolate2d", [](size_t i) {
+		return interpolate2d(99 * t.x[i], 99 * t.y[i], t.X2, t.Y2, t.Z2);
+	}});
+	list.push_back({"interpolateEquidistant", [](size_t i) {
+		return interpolateEquidistant(t.x[i], 0, 1, t.Y);
+	}});
+}
+
+static void addGrids(std::vector<Benchmark> &list) {
+	static std::vector<Vector3d> positions(n);
+	static ref_ptr<Grid3f> periodic, reflective;
+	Random random(42);
+	GridProperties properties(Vector3d(0.), 64, 1.);
+	periodic = new Grid3f(properties);
+	reflective = new Grid3f(properties);
+	reflective->setReflective(true);
+	for (size_t ix = 0; ix < 64; ix++)
+		for (size_t iy = 0; iy < 64; iy++)
+			for (size_t iz = 0; iz < 64; iz++) {
+				Vector3f b(random.randVector());
+				periodic->get(ix, iy, iz) = b;
+				reflective->get(ix, iy, iz) = b;
+			}
+	// a third of the positions are outside of the grid
+	for (size_t i = 0; i < n; i++)
+		positions[i] = Vector3d(random.rand(), random.rand(), random.rand()) * 96 - Vector3d(16.);
+	list.push_back({"Grid3f/interpolate/periodic", [](size_t i) {
+		return periodic->interpolate(positions[i]).x;
+	}});
+	list.push_back({"Grid3f/interpolate/reflective", [](size_t i) {
+		return reflective->interpolate(positions[i]).x;
+	}});
+}
+
+static void addRandom(std::vector<Benchmark> &list) {
+	list.push_back({"Random/rand", [](size_t i) {
+		return Random::instance().rand();
+	}});
+	list.push_back({"Random/randNorm", [](size_t i) {
+		return Random::instance().randNorm();
+	}});
+	list.push_back({"Random/randVector", [](size_t i) {
+		return Random::instance().randVector().x;
+	}});
+}
+
+static void addPropagation(std::vector<Benchmark> &list) {
+	static std::vector<Vector3d> x(n), u(n);
+	static ref_ptr<MagneticField> field = new UniformMagneticField(Vector3d(1, 2, 3) * muG);
+	static ParticleState p(-11, 1 * EeV); // positron, needs no data files
+	Random random(42);
+	for (size_t i = 0; i < n; i++) {
+		x[i] = random.randVector() * (1 + random.rand()) * kpc;
+		u[i] = random.randVector();
+	}
+	list.push_back({"PropagationCK/tryStep", [](size_t i) {
+		static PropagationCK propagation(field);
+		PropagationCK::Y out, error;
+		propagation.tryStep(PropagationCK::Y(x[i], u[i]), out, error, 1 * kpc / c_light, p, 0);
+		return out.x.x + error.u.y;
+	}});
+	list.push_back({"PropagationBP/tryStep", [](size_t i) {
+		static PropagationBP propagation(field, 1e-4, 1 * pc, 1 * Mpc);
+		PropagationBP::Y out, error;
+		propagation.tryStep(PropagationBP::Y(x[i], u[i]), out, error, 1 * kpc, p, 0,
+				p.getEnergy() / (c_light * c_light), p.getCharge());
+		return out.x.x + error.u.y;
+	}});
+}
+
+static void addSecondaries(std::vector<Benchmark> &list) {
+	list.push_back({"Candidate/addSecondary", [](size_t i) {
+		static Candidate c(nucleusId(56, 26), 100 * EeV);
+		if (i == 0)
+			c.secondaries.clear();
+		c.addSecondary(nucleusId(1, 1), 1 * EeV);
+		return c.secondaries.size();
+	}});
+}
+
+// process of an interaction module on a candidate of the given particle,
+// reset before every call
+static void addInteraction(std::vector<Benchmark> &list, const std::string &name,
+		std::function<Module *()> create, int id, double energy, double step) {
+	ref_ptr<Module> module;
+	try {
+		module = create();
+	} catch (std::exception &e) {
+		fprintf(stderr, "%-40s skipped: %s\n", name.c_str(), e.what());
+		return;
+	}
+	ref_ptr<Candidate> candidate = new Candidate(id, energy, Vector3d(0.), Vector3d(1, 0, 0));
+	ParticleState initial = candidate->current;
+	list.push_back({name, [=](size_t i) {
+		Candidate &c = *candidate;
+		c.current = initial;
+		c.setActive(true);
+		c.setCurrentStep(step);
+		c.setNextStep(step);
+		c.secondaries.clear();
+		module->process(&c);
+		return c.current.getEnergy() + c.getNextStep();
+	}});
+}
+
+static void addInteractions(std::vector<Benchmark> &list) {
+	ref_ptr<PhotonField> cmb = new CMB();
+	int proton = nucleusId(1, 1), iron = nucleusId(56, 26), electron = 11;
+	addInteraction(list, "PhotoPionProduction/CMB", [=]() {
+		return new PhotoPionProduction(cmb, true, true, true);
+	}, proton, 100 * EeV, 10 * Mpc);
+	addInteraction(list, "ElectronPairProduction/CMB", [=]() {
+		return new ElectronPairProduction(cmb, false);
+	}, proton, 10 * EeV, 10 * Mpc);
+	addInteraction(list, "PhotoDisintegration/IRB", []() {
+		return new PhotoDisintegration(new IRB_Gilmore12(), true);
+	}, iron, 100 * EeV, 10 * Mpc);
+	addInteraction(list, "NuclearDecay", []() {
+		return new NuclearDecay(true, true, true);
+	}, nucleusId(14, 6), 1 * EeV, 1 * Mpc);
+	addInteraction(list, "EMPairProduction/CMB", [=]() {
+		return new EMPairProduction(cmb, true);
+	}, 22, 1 * EeV, 1 * Mpc);
+	addInteraction(list, "EMInverseComptonScattering/CMB", [=]() {
+		return new EMInverseComptonScattering(cmb, true);
+	}, electron, 1 * EeV, 1 * Mpc);
+	addInteraction(list, "EMDoublePairProduction/CMB", [=]() {
+		return new EMDoublePairProduction(cmb, true);
+	}, 22, 1 * EeV, 1 * Mpc);
+	addInteraction(list, "EMTripletPairProduction/CMB", [=]() {
+		return new EMTripletPairProduction(cmb, true);
+	}, electron, 1 * EeV, 1 * Mpc);
+	addInteraction(list, "SynchrotronRadiation", []() {
+		return new SynchrotronRadiation(1 * muG, true);
+	}, electron, 1 * EeV, 1 * kpc);
+}
+
+static double measure(const Benchmark &b, double minTime) {
+	double sink = 0;
+	for (size_t i = 0; i < n / 8; i++) // warm up
+		sink += b.kernel(i);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	double elapsed = 0;
+	size_t count = 0;
+	while (elapsed < minTime) {
+		for (size_t i = 0; i < n; i++)
+			sink += b.kernel(i);
+		count += n;
+		elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	volatile double result = sink;
+	(void) result;
+	return elapsed / count * 1e9;
+}
+
+int main(int argc, char **argv) {
+	bench::Options options;
+	int status = bench::parseArguments(argc, argv, "bench_kernels", "[--filter text]"
+			" [--min-time seconds] [--out file.json] [--compare baseline.json]"
+			" [--tolerance fraction]", options);
+	if (status >= 0)
+		return status;
+
+	std::vector<Benchmark> list;
+	addInterpolation(list);
+	addGrids(list);
+	addRandom(list);
+	addPropagation(list);
+	addSecondaries(list);
+	addInteractions(list);
+
+	std::vector<Result> results;
+	for (size_t i = 0; i < list.size(); i++) {
+		if (list[i].name.find(options.filter) == std::string::npos)
+			continue;
+		results.push_back(Result(list[i].name, 1, measure(list[i], options.minTime)));
+		fprintf(stderr, "%-40s %10.2f ns/eval\n", list[i].name.c_str(), results.back().nsPerEval);
+	}
+
+	std::stringstream context;
+	context << ", \"min_time\": " << options.minTime;
+	bench::writeResults(options, context.str(), results);
+	return bench::compareResults("bench_kernels", options, results);
+}
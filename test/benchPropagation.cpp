@@ -0,0 +1,205 @@
+// Throughput of the Vector3d arithmetic and of the derivatives of the
+// propagation modules, single-threaded.
+//
+// bench_propagation [--filter text] [--min-time seconds] [--out file.json]
+//                   [--compare baseline.json] [--tolerance fraction]
+//
+// Every benchmark runs its kernel on precomputed random inputs and reports
+// the nanoseconds per evaluation, as JSON with one benchmark per line in the
+// format of bench_fields. Comparing a build with FAST_VECTORS to one without
+// shows the effect of the AVX specialization of Vector3d.
+//
+// PropagationCK/processBatch/double and /mixed propagate a batch of protons
+// through a MagneticFieldGrid with fixed steps and report the nanoseconds per
+// step. The mixed entry adds the largest deviation of the positions from the
+// double-precision batch after 50 steps, relative to the trajectory length.
+
+#include "crpropa/magneticField/MagneticField.h"
+#include "crpropa/magneticField/MagneticFieldGrid.h"
+#include "crpropa/Candidate.h"
+#include "crpropa/Grid.h"
+#include "crpropa/ParticleID.h"
+#include "crpropa/module/PropagationBP.h"
+#include "crpropa/module/PropagationCK.h"
+#include "crpropa/ParticleState.h"
+#include "crpropa/Random.h"
+#include "crpropa/Units.h"
+
+#include "bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <vector>
+
+using namespace crpropa;
+using bench::Result;
+
+static const size_t n = 4096;
+
+struct Inputs {
+	std::vector<Vector3d> a, b;
+	Inputs() : a(n), b(n) {
+		Random random(42);
+		for (size_t i = 0; i < n; i++) {
+			a[i] = random.randVector() * (1 + random.rand()) * kpc;
+			b[i] = random.randVector() * (1 + random.rand());
+		}
+	}
+};
+
+// the kernels return a value of each evaluation to keep them
+static double vectorArithmetic(const Inputs &in, size_t i) {
+	const Vector3d &a = in.a[i], &b = in.b[i];
+	Vector3d c = (a + b * 2.) - a.cross(b) / 3.;
+	c += b;
+	return c.dot(a) + c.getUnitVector().x + c.getR();
+}
+
+static ref_ptr<MagneticField> field() {
+	static ref_ptr<MagneticField> f = new UniformMagneticField(Vector3d(1, 2, 3) * muG);
+	return f;
+}
+
+static double propagationCK(const Inputs &in, size_t i) {
+	static PropagationCK propagation(field());
+	static ParticleState p(-11, 1 * EeV); // positron, needs no data files
+	PropagationCK::Y y = propagation.dYdt(PropagationCK::Y(in.a[i], in.b[i]), p, 0);
+	return y.u.x + y.x.y;
+}
+
+static double propagationBP(const Inputs &in, size_t i) {
+	static PropagationBP propagation(field());
+	PropagationBP::Y y = propagation.dY(in.a[i], in.b[i].getUnitVector(), 1 * kpc, 0,
+			eplus, mass_proton);
+	return y.u.x + y.x.y;
+}
+
+struct Benchmark {
+	std::string name;
+	double (*kernel)(const Inputs &, size_t);
+};
+
+static double measure(const Benchmark &b, const Inputs &in, double minTime) {
+	double sink = 0;
+	for (size_t i = 0; i < n / 8; i++) // warm up
+		sink += b.kernel(in, i);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	double elapsed = 0;
+	size_t count = 0;
+	while (elapsed < minTime) {
+		for (size_t i = 0; i < n; i++)
+			sink += b.kernel(in, i);
+		count += n;
+		elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	volatile double result = sink;
+	(void) result;
+	return elapsed / count * 1e9;
+}
+
+// batch of protons through a 64^3 grid, steps fixed to 100 kpc
+struct Batch {
+	std::vector<ref_ptr<Candidate> > candidates;
+	std::vector<Candidate*> pointers;
+	Batch() {
+		for (size_t i = 0; i < 256; i++) {
+			Vector3d direction(cos(i), sin(i), 0.01 * i);
+			candidates.push_back(new Candidate(nucleusId(1, 1), (1 + i % 100) * EeV,
+					Vector3d(0.), direction));
+			pointers.push_back(candidates.back());
+		}
+	}
+};
+
+static ref_ptr<PropagationCK> batchPropagation(bool mixed) {
+	static ref_ptr<MagneticField> grid;
+	if (!grid) {
+		ref_ptr<Grid3f> g = new Grid3f(Vector3d(0.), 64, 10 * kpc);
+		for (int ix = 0; ix < 64; ix++)
+			for (int iy = 0; iy < 64; iy++)
+				for (int iz = 0; iz < 64; iz++)
+					g->get(ix, iy, iz) = Vector3f(sin(M_PI * iz / 16), cos(M_PI * ix / 16),
+							sin(M_PI * iy / 16)) * nG;
+		grid = new MagneticFieldGrid(g);
+	}
+	ref_ptr<PropagationCK> propagation = new PropagationCK(grid, 1e-4, 100 * kpc, 100 * kpc);
+	propagation->setMixedPrecision(mixed);
+	return propagation;
+}
+
+// nanoseconds per step of processBatch
+static double measureBatch(bool mixed, double minTime) {
+	ref_ptr<PropagationCK> propagation = batchPropagation(mixed);
+	Batch batch;
+	size_t size = batch.pointers.size();
+	propagation->processBatch(&batch.pointers[0], size); // warm up
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	double elapsed = 0;
+	size_t count = 0;
+	while (elapsed < minTime) {
+		for (size_t i = 0; i < 10; i++)
+			propagation->processBatch(&batch.pointers[0], size);
+		count += 10 * size;
+		elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	return elapsed / count * 1e9;
+}
+
+// largest deviation of the mixed-precision positions relative to the trajectory length
+static double batchDeviation() {
+	ref_ptr<PropagationCK> reference = batchPropagation(false), mixed = batchPropagation(true);
+	Batch a, b;
+	size_t size = a.pointers.size();
+	for (size_t k = 0; k < 50; k++) {
+		reference->processBatch(&a.pointers[0], size);
+		mixed->processBatch(&b.pointers[0], size);
+	}
+	double deviation = 0;
+	for (size_t i = 0; i < size; i++) {
+		double d = (a.candidates[i]->current.getPosition()
+				- b.candidates[i]->current.getPosition()).getR();
+		deviation = std::max(deviation, d / a.candidates[i]->getTrajectoryLength());
+	}
+	return deviation;
+}
+
+int main(int argc, char **argv) {
+	bench::Options options;
+	int status = bench::parseArguments(argc, argv, "bench_propagation", "[--filter text]"
+			" [--min-time seconds] [--out file.json] [--compare baseline.json]"
+			" [--tolerance fraction]", options);
+	if (status >= 0)
+		return status;
+
+	Benchmark list[] = {
+		{"Vector3d/arithmetic", vectorArithmetic},
+		{"PropagationCK/dYdt", propagationCK},
+		{"PropagationBP/dY", propagationBP}
+	};
+	Inputs in;
+	std::vector<Result> results;
+	for (size_t i = 0; i < sizeof(list) / sizeof(list[0]); i++) {
+		if (list[i].name.find(options.filter) == std::string::npos)
+			continue;
+		results.push_back(Result(list[i].name, 1, measure(list[i], in, options.minTime)));
+		fprintf(stderr, "%-40s %10.2f ns/eval\n", list[i].name.c_str(), results.back().nsPerEval);
+	}
+	for (int mixed = 0; mixed < 2; mixed++) {
+		std::string name = mixed ? "PropagationCK/processBatch/mixed"
+				: "PropagationCK/processBatch/double";
+		if (name.find(options.filter) == std::string::npos)
+			continue;
+		Result r(name, 1, measureBatch(mixed, options.minTime));
+		double deviation = mixed ? batchDeviation() : 0;
+		r.add("deviation", deviation);
+		results.push_back(r);
+		fprintf(stderr, "%-40s %10.2f ns/step  deviation %.2e\n", name.c_str(), r.nsPerEval, deviation);
+	}
+
+	std::stringstream context;
+	context << ", \"vector3d_bytes\": " << sizeof(Vector3d) << ", \"min_time\": " << options.minTime;
+	bench::writeResults(options, context.str(), results);
+	return bench::compareResults("bench_propagation", options, results);
+}
@@ -0,0 +1,260 @@
+// End-to-end simulation scenarios with fixed seeds and their strong scaling.
+//
+// bench_scenarios [--filter text] [--scale factor] [--threads n,...]
+//                 [--out file.json] [--compare baseline.json] [--tolerance fraction]
+//
+// Every scenario runs a fixed number of primaries (times the scale) with
+// counter based random streams, so the simulated particles do not depend on
+// the number of threads. For every number of threads the primaries and steps
+// per second, the peak resident memory of the run, the speedup over the
+// first number of threads and the parallel efficiency are reported, together
+// with the load imbalance of the threads and the serial fraction
+// (Karp-Flatt metric). The serial fraction is the share of the run that did
+// not scale, which includes the time spent waiting at critical sections of
+// outputs and caches. The results are written as JSON in the format of
+// bench_fields, where ns_per_eval is the wall time per primary, and can be
+// compared to an earlier run in the same way. Scenarios with interactions are
+// skipped if their data files are not installed.
+
+#include "crpropa/Geometry.h"
+#include "crpropa/Grid.h"
+#include "crpropa/magneticField/JF12Field.h"
+#include "crpropa/magneticField/MagneticFieldGrid.h"
+#include "crpropa/magneticField/turbulentField/PlaneWaveTurbulence.h"
+#include "crpropa/module/BreakCondition.h"
+#include "crpropa/module/Boundary.h"
+#include "crpropa/module/EMInverseComptonScattering.h"
+#include "crpropa/module/EMPairProduction.h"
+#include "crpropa/module/ElectronPairProduction.h"
+#include "crpropa/module/NuclearDecay.h"
+#include "crpropa/module/Observer.h"
+#include "crpropa/module/PhotoDisintegration.h"
+#include "crpropa/module/PhotoPionProduction.h"
+#include "crpropa/module/PropagationCK.h"
+#include "crpropa/module/Redshift.h"
+#include "crpropa/module/SimplePropagation.h"
+#include "crpropa/ModuleList.h"
+#include "crpropa/ParticleID.h"
+#include "crpropa/PhotonBackground.h"
+#include "crpropa/Source.h"
+#include "crpropa/Units.h"
+
+#include "bench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+#include <sys/resource.h>
+
+using namespace crpropa;
+using bench::Result;
+
+static const uint64_t seed = 42;
+
+struct Scenario {
+	std::string name;
+	size_t primaries;
+	// modules and source of a run, throws if data files are missing
+	void (*setup)(ModuleList &modules, Source &source);
+};
+
+// a run of a scenario
+struct Run {
+	double elapsed, stepsPerSecond, loadImbalance;
+	long peakRSS;
+};
+
+// 1D propagation of UHECR nuclei with interactions with the CMB and IRB
+static void nuclei1D(ModuleList &modules, Source &source) {
+	ref_ptr<PhotonField> cmb = new CMB(), irb = new IRB_Gilmore12();
+	modules.add(new SimplePropagation(10 * kpc, 10 * Mpc));
+	modules.add(new Redshift());
+	modules.add(new PhotoPionProduction(cmb));
+	modules.add(new PhotoPionProduction(irb));
+	modules.add(new PhotoDisintegration(cmb));
+	modules.add(new PhotoDisintegration(irb));
+	modules.add(new ElectronPairProduction(cmb));
+	modules.add(new ElectronPairProduction(irb));
+	modules.add(new NuclearDecay());
+	modules.add(new MinimumEnergy(1 * EeV));
+	ref_ptr<Observer> observer = new Observer();
+	observer->add(new ObserverPoint());
+	modules.add(observer);
+
+	source.add(new SourceUniform1D(1 * Mpc, 1000 * Mpc));
+	source.add(new SourceRedshift1D());
+	ref_ptr<SourceComposition> composition = new SourceComposition(1 * EeV, 100 * EeV, -1);
+	composition->add(nucleusId(1, 1), 1);
+	composition->add(nucleusId(4, 2), 1);
+	composition->add(nucleusId(14, 7), 1);
+	composition->add(nucleusId(56, 26), 1);
+	source.add(composition);
+}
+
+// 3D propagation of protons in a turbulent grid towards a small sphere, with
+// ObserverSurface that replaces the deprecated ObserverSmallSphere
+static void turbulentGrid3D(ModuleList &modules, Source &source) {
+	static ref_ptr<MagneticField> field;
+	if (!field) {
+		const size_t N = 64;
+		double spacing = 100 * kpc;
+		PlaneWaveTurbulence turbulence(TurbulenceSpectrum(10 * nG, 2 * spacing, N * spacing,
+				N * spacing / 4), 64, seed);
+		ref_ptr<Grid3f> grid = new Grid3f(GridProperties(Vector3d(0.), N, spacing));
+		for (size_t ix = 0; ix < N; ix++)
+			for (size_t iy = 0; iy < N; iy++)
+				for (size_t iz = 0; iz < N; iz++)
+					grid->get(ix, iy, iz) = Vector3f(turbulence.getField(
+							Vector3d(ix, iy, iz) * spacing));
+		field = new MagneticFieldGrid(grid);
+	}
+	modules.add(new PropagationCK(field, 1e-4, 10 * kpc, 1 * Mpc));
+	modules.add(new MaximumTrajectoryLength(100 * Mpc));
+	ref_ptr<Observer> observer = new Observer();
+	observer->add(new ObserverSurface(new Sphere(Vector3d(5, 0, 0) * Mpc, 1 * Mpc)));
+	modules.add(observer);
+
+	source.add(new SourcePosition(Vector3d(0.)));
+	source.add(new SourceIsotropicEmission());
+	source.add(new SourceParticleType(nucleusId(1, 1)));
+	source.add(new SourcePowerLawSpectrum(1 * EeV, 100 * EeV, -1));
+}
+
+// backtracking of antiprotons from Earth out of the Galaxy in the JF12 field
+static void galacticBacktracking(ModuleList &modules, Source &source) {
+	static ref_ptr<JF12Field> field;
+	if (!field)
+		field = new JF12Field();
+	modules.add(new PropagationCK(field, 1e-4, 0.1 * pc, 100 * pc));
+	modules.add(new SphericalBoundary(Vector3d(0.), 20 * kpc));
+	modules.add(new MaximumTrajectoryLength(1 * Mpc));
+
+	source.add(new SourcePosition(Vector3d(-8.5, 0, 0) * kpc));
+	source.add(new SourceIsotropicEmission());
+	source.add(new SourceParticleType(-nucleusId(1, 1)));
+	source.add(new SourcePowerLawSpectrum(1 * EeV, 100 * EeV, -1));
+}
+
+// 1D electromagnetic cascade of photons on the CMB and IRB
+static void emCascade(ModuleList &modules, Source &source) {
+	ref_ptr<PhotonField> cmb = new CMB(), irb = new IRB_Gilmore12();
+	modules.add(new SimplePropagation(1 * kpc, 10 * Mpc));
+	modules.add(new EMPairProduction(cmb, true));
+	modules.add(new EMPairProduction(irb, true));
+	modules.add(new EMInverseComptonScattering(cmb, true));
+	modules.add(new EMInverseComptonScattering(irb, true));
+	modules.add(new MinimumEnergy(10 * TeV));
+	ref_ptr<Observer> observer = new Observer();
+	observer->add(new ObserverPoint());
+	modules.add(observer);
+
+	source.add(new SourcePosition(100 * Mpc));
+	source.add(new SourceDirection());
+	source.add(new SourceParticleType(22));
+	source.add(new SourcePowerLawSpectrum(1 * PeV, 1 * EeV, -1));
+}
+
+// resident memory peak since the last reset, in kB
+static void resetPeakRSS() {
+	std::ofstream("/proc/self/clear_refs") << "5";
+}
+
+static long peakRSS() {
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while (std::getline(status, line))
+		if (line.compare(0, 6, "VmHWM:") == 0)
+			return atol(line.c_str() + 6);
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+// run of a scenario, false if it cannot be set up
+static bool measure(const Scenario &s, int threads, size_t primaries, Run &r) {
+	ModuleList modules;
+	Source source;
+	try {
+		s.setup(modules, source);
+	} catch (std::exception &e) {
+		fprintf(stderr, "%-40s skipped: %s\n", s.name.c_str(), e.what());
+		return false;
+	}
+	modules.setShowProgress(false);
+	modules.setCounterBasedRandom(true, seed);
+	modules.setProfiling(true);
+
+#ifdef _OPENMP
+	omp_set_num_threads(threads);
+#endif
+	// the run reports to stdout, which holds the JSON
+	std::stringstream discard;
+	std::streambuf *previous = std::cout.rdbuf(discard.rdbuf());
+	resetPeakRSS();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	modules.run(&source, primaries, true);
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout.rdbuf(previous);
+
+	r.elapsed = elapsed;
+	r.stepsPerSecond = modules.getProfiledSteps() / elapsed;
+	r.loadImbalance = modules.getLoadImbalance();
+	r.peakRSS = peakRSS();
+	return true;
+}
+
+int main(int argc, char **argv) {
+	bench::Options options;
+	int status = bench::parseArguments(argc, argv, "bench_scenarios", "[--filter text]"
+			" [--scale factor] [--threads n,...] [--out file.json]"
+			" [--compare baseline.json] [--tolerance fraction]", options);
+	if (status >= 0)
+		return status;
+
+	Scenario list[] = {
+		{"1D/nuclei/CMB+IRB", 2000, nuclei1D},
+		{"3D/turbulentGrid/ObserverSphere", 200, turbulentGrid3D},
+		{"JF12/backtracking", 200, galacticBacktracking},
+		{"1D/EMCascade/CMB+IRB", 50, emCascade}
+	};
+	const std::vector<int> &threads = options.threads;
+	std::vector<Result> results;
+	for (size_t i = 0; i < sizeof(list) / sizeof(list[0]); i++) {
+		if (list[i].name.find(options.filter) == std::string::npos)
+			continue;
+		size_t primaries = std::max(size_t(1), size_t(list[i].primaries * options.scale));
+		double single = 0;
+		for (size_t j = 0; j < threads.size(); j++) {
+			Run run;
+			if (!measure(list[i], threads[j], primaries, run))
+				break;
+			// ns_per_eval is the wall time per primary
+			Result r(list[i].name, threads[j], run.elapsed / primaries * 1e9);
+			r.evalsPerSecond = primaries / run.elapsed;
+			if (j == 0)
+				single = r.evalsPerSecond / threads[j];
+			r.scaling = r.evalsPerSecond / single;
+			double efficiency = r.scaling / threads[j];
+			// Karp-Flatt: (1 / speedup - 1 / p) / (1 - 1 / p) relative to one thread
+			double p = threads[j] / double(threads[0]);
+			double speedup = r.scaling / threads[0];
+			double serialFraction = (p > 1) ? (1 / speedup - 1 / p) / (1 - 1 / p) : 0;
+			r.add("steps_per_second", run.stepsPerSecond);
+			r.add("efficiency", efficiency);
+			r.add("serial_fraction", serialFraction);
+			r.add("load_imbalance", run.loadImbalance);
+			r.add("peak_rss_kb", run.peakRSS);
+			results.push_back(r);
+			fprintf(stderr, "%-40s %3d threads %10.1f primaries/s %12.4g steps/s %8.2f scaling"
+					" %6.2f efficiency %8ld kB\n", r.name.c_str(), r.threads, r.evalsPerSecond,
+					run.stepsPerSecond, r.scaling, efficiency, run.peakRSS);
+		}
+	}
+
+	std::stringstream context;
+	context << ", \"max_threads\": " << bench::maxThreads() << ", \"seed\": " << seed
+			<< ", \"scale\": " << options.scale;
+	bench::writeResults(options, context.str(), results);
+	return bench::compareResults("bench_scenarios", options, results);
+}
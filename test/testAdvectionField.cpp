@@ -1,10 +1,13 @@
 #include "crpropa/advectionField/AdvectionField.h"
+#include "crpropa/advectionField/AdvectionFieldGrid.h"
 #include "crpropa/Units.h"
 #include "crpropa/Common.h"
+#include "crpropa/GridTools.h"
 
 #include "gtest/gtest.h"
 #include <stdexcept>
 #include <cmath>
+#include <vector>
 
 namespace crpropa {
 
@@ -166,4 +169,115 @@ TEST(testSphericalAdvectionShock, SimpleTest) {
 	
 }
 
+TEST(testAdvectionField, fieldAndDivergence) {
+	// the combined evaluation matches getField and getDivergence
+	SphericalAdvectionShock *shock = new SphericalAdvectionShock(Vector3d(0.), 10, 1000, 0.1);
+	shock->setAzimuthalSpeed(100);
+	AdvectionFieldList list;
+	list.addField(shock);
+	list.addField(new SphericalAdvectionField(Vector3d(1, 0, 0), 20, 1000, 3, 2));
+	list.addField(new ConstantSphericalAdvectionField(Vector3d(0, 1, 0), 10));
+	list.addField(new UniformAdvectionField(Vector3d(1, 2, 3)));
+
+	std::vector<Vector3d> positions;
+	for (int i = 0; i < 40; i++)
+		positions.push_back(Vector3d(0.5 * i + 0.3, 0.2 * i - 3, 0.1 * i));
+	std::vector<Vector3d> fields(positions.size());
+	std::vector<double> divergences(positions.size());
+	list.getFieldsAndDivergences(&positions[0], &fields[0], &divergences[0], positions.size());
+
+	for (size_t i = 0; i < positions.size(); i++) {
+		Vector3d f = list.getField(positions[i]);
+		double d = list.getDivergence(positions[i]);
+		EXPECT_NEAR(fields[i].x, f.x, 1e-9 * f.getR());
+		EXPECT_NEAR(fields[i].y, f.y, 1e-9 * f.getR());
+		EXPECT_NEAR(fields[i].z, f.z, 1e-9 * f.getR());
+		EXPECT_NEAR(divergences[i], d, 1e-9 * fabs(d) + 1e-12);
+	}
+
+	// far outside of the shock
+	Vector3d f;
+	double d;
+	shock->getFieldAndDivergence(Vector3d(1e4, 0, 0), f, d);
+	EXPECT_NEAR(d, shock->getDivergence(Vector3d(1e4, 0, 0)), 1e-12);
+	EXPECT_FALSE(std::isnan(d));
+}
+
+TEST(testAdvectionFieldGrid, divergence) {
+	// v = (x^2, 2 y, -z) has the divergence 2 x + 1
+	size_t N = 20;
+	double h = 0.1;
+	ref_ptr<Grid3f> grid = new Grid3f(Vector3d(0.), N, h);
+	grid->setReflective(true);
+	for (size_t ix = 0; ix < N; ix++)
+		for (size_t iy = 0; iy < N; iy++)
+			for (size_t iz = 0; iz < N; iz++) {
+				Vector3d r = Vector3d(ix + 0.5, iy + 0.5, iz + 0.5) * h;
+				grid->get(ix, iy, iz) = Vector3f(r.x * r.x, 2 * r.y, -r.z);
+			}
+	AdvectionFieldGrid field(grid);
+	ref_ptr<Grid1f> divergence = field.getDivergenceGrid();
+	EXPECT_TRUE(divergence->isReflective());
+
+	// exact for central differences, first order at the edges
+	for (size_t ix = 1; ix < N - 1; ix++)
+		EXPECT_NEAR(2 * (ix + 0.5) * h + 1, divergence->get(ix, 5, 7), 1e-5);
+	EXPECT_NEAR(2 * h + 1, divergence->get(0, 5, 7), 1e-5);
+
+	Vector3d position(0.73, 0.41, 1.12);
+	EXPECT_NEAR(2 * 0.73 + 1, field.getDivergence(position), 1e-5);
+	Vector3d f;
+	double d;
+	field.getFieldAndDivergence(position, f, d);
+	EXPECT_NEAR(field.getDivergence(position), d, 1e-6);
+	Vector3d g = field.getField(position);
+	EXPECT_NEAR(g.x, f.x, 1e-6);
+	EXPECT_NEAR(g.y, f.y, 1e-6);
+	EXPECT_NEAR(g.z, f.z, 1e-6);
+	EXPECT_NEAR(0.82, f.y, 1e-5);
+
+	// periodic grid of a periodic field
+	ref_ptr<Grid3f> periodic = new Grid3f(Vector3d(0.), 32, 1. / 32);
+	for (size_t ix = 0; ix < 32; ix++)
+		for (size_t iy = 0; iy < 32; iy++)
+			for (size_t iz = 0; iz < 32; iz++)
+				periodic->get(ix, iy, iz) = Vector3f(sin(2 * M_PI * (ix + 0.5) / 32), 0, 0);
+	field.setGrid(periodic);
+	for (size_t ix = 0; ix < 32; ix++)
+		EXPECT_NEAR(2 * M_PI * cos(2 * M_PI * (ix + 0.5) / 32),
+				field.getDivergenceGrid()->get(ix, 3, 4), 0.05);
+
+	// divergence grids of another geometry
+	EXPECT_THROW(field.setGrids(periodic, new Grid1f(Vector3d(0.), 16, 1. / 16)), std::runtime_error);
+}
+
+TEST(testAdvectionFieldGrid, fromAdvectionField) {
+	ref_ptr<SphericalAdvectionField> analytic = new SphericalAdvectionField(Vector3d(0.), 20, 1000, 3, 2);
+	ref_ptr<Grid3f> grid = new Grid3f(Vector3d(-8.), 64, 0.25);
+	ref_ptr<Grid1f> divergence = new Grid1f(Vector3d(-8.), 64, 0.25);
+	fromAdvectionField(grid, analytic);
+	fromAdvectionFieldDivergence(divergence, analytic);
+
+	// the grid points hold the analytic field
+	Vector3d r = Vector3d(10.5, 20.5, 40.5) * 0.25 - Vector3d(8.);
+	Vector3d v = analytic->getField(r);
+	Vector3f g = grid->get(10, 20, 40);
+	EXPECT_NEAR(v.x, g.x, 1e-4 * v.getR());
+	EXPECT_NEAR(v.y, g.y, 1e-4 * v.getR());
+	EXPECT_NEAR(analytic->getDivergence(r), divergence->get(10, 20, 40),
+			1e-5 * fabs(analytic->getDivergence(r)));
+
+	// baked with the analytic divergence and with finite differences
+	AdvectionFieldGrid baked(grid, divergence);
+	AdvectionFieldGrid differences(grid);
+	Vector3d position(1.3, -2.1, 0.7);
+	EXPECT_NEAR(analytic->getDivergence(position), baked.getDivergence(position),
+			0.02 * fabs(analytic->getDivergence(position)));
+	EXPECT_NEAR(analytic->getDivergence(position), differences.getDivergence(position),
+			0.05 * fabs(analytic->getDivergence(position)));
+	Vector3d f = baked.getField(position);
+	EXPECT_NEAR(analytic->getField(position).getR(), f.getR(),
+			0.02 * analytic->getField(position).getR());
+}
+
 } //namespace crpropa
@@ -5,8 +5,12 @@
 #include "crpropa/module/Boundary.h"
 #include "crpropa/module/Tools.h"
 #include "crpropa/module/RestrictToRegion.h"
+#include "crpropa/module/TerminationConditions.h"
+#include "crpropa/module/WeightWindow.h"
 #include "crpropa/ParticleID.h"
 #include "crpropa/Geometry.h"
+#include "crpropa/Random.h"
+#include "crpropa/Units.h"
 
 #include "gtest/gtest.h"
 
@@ -96,6 +100,29 @@ TEST(MinimumEnergyPerParticleId, test) {
 	EXPECT_TRUE(c.hasProperty("Rejected"));
 }
 
+TEST(MinimumEnergyPerParticleId, lookup) {
+	MinimumEnergyPerParticleId minEnergy(1);
+	minEnergy.add(nucleusId(56, 26), 50);
+	minEnergy.add(nucleusId(4, 2), 8);
+	minEnergy.add(nucleusId(4, 2), 9); // first one applies
+	minEnergy.add(nucleusId(238, 92), 100);
+	minEnergy.add(-11, 3);
+
+	EXPECT_EQ(50, minEnergy.getMinimumEnergy(nucleusId(56, 26)));
+	EXPECT_EQ(8, minEnergy.getMinimumEnergy(nucleusId(4, 2)));
+	EXPECT_EQ(100, minEnergy.getMinimumEnergy(nucleusId(238, 92)));
+	EXPECT_EQ(3, minEnergy.getMinimumEnergy(-11));
+	EXPECT_EQ(1, minEnergy.getMinimumEnergy(11));
+	EXPECT_EQ(1, minEnergy.getMinimumEnergy(nucleusId(56, 25)));
+	EXPECT_EQ(1, minEnergy.getMinimumEnergy(2212));
+	minEnergy.setMinimumEnergyOthers(2);
+	EXPECT_EQ(2, minEnergy.getMinimumEnergy(nucleusId(1, 1)));
+
+	Candidate c(nucleusId(4, 2), 7);
+	minEnergy.process(&c);
+	EXPECT_FALSE(c.isActive());
+}
+
 TEST(MaximumTrajectoryLength, test) {
 	MaximumTrajectoryLength maxLength(10);
 	Candidate c;
@@ -125,6 +152,107 @@ TEST(MaximumTrajectoryLength, observer) {
 	EXPECT_FALSE(c.isActive());
 }
 
+// constant energy loss rate of nuclei for ReachabilityPruning
+class ConstantNucleusLoss: public Module {
+	double rate;
+public:
+	ConstantNucleusLoss(double rate) : rate(rate) {
+	}
+	void process(Candidate *candidate) const {
+	}
+	unsigned int getParticleClasses() const {
+		return NucleusClass;
+	}
+	bool hasEnergyLossRate() const {
+		return true;
+	}
+	double getEnergyLossRate(const Candidate *candidate, double E, double z) const {
+		return rate;
+	}
+};
+
+TEST(ReachabilityPruning, range) {
+	// 1 EeV per Mpc down to 10 EeV
+	ReachabilityPruning pruning(10 * EeV);
+	pruning.add(new ConstantNucleusLoss(EeV / Mpc));
+	EXPECT_THROW(pruning.add(new MinimumEnergy()), std::runtime_error);
+
+	int id = nucleusId(1, 1);
+	EXPECT_EQ(0, pruning.getMaximumRange(id, 9 * EeV));
+	for (int i = 0; i < 100; i++) {
+		double E = 10 * EeV * pow(10, 0.03 * i);
+		double range = pruning.getMaximumRange(id, E);
+		EXPECT_LE((E - 10 * EeV) / (EeV / Mpc), range * (1 + 1e-12));
+		EXPECT_GE((E * pow(10, 0.05) - 10 * EeV) / (EeV / Mpc), range * (1 - 1e-12));
+	}
+	// no losses for photons, no threshold
+	EXPECT_EQ(std::numeric_limits<double>::infinity(), pruning.getMaximumRange(22, 20 * EeV));
+	EXPECT_EQ(0, pruning.getMaximumRange(22, 5 * EeV));
+	pruning.setMinimumEnergy(0);
+	EXPECT_EQ(std::numeric_limits<double>::infinity(), pruning.getMaximumRange(id, 5 * EeV));
+	// beyond the tables
+	pruning.setMinimumEnergy(10 * EeV);
+	EXPECT_EQ(std::numeric_limits<double>::infinity(), pruning.getMaximumRange(id, 1e25 * eV));
+}
+
+TEST(ReachabilityPruning, process) {
+	ReachabilityPruning pruning(10 * EeV);
+	pruning.add(new ConstantNucleusLoss(EeV / Mpc));
+	pruning.addObserverPosition(Vector3d(100, 0, 0) * Mpc);
+	pruning.addObserverSurface(new Plane(Vector3d(0.), Vector3d(1, 0, 0)));
+	EXPECT_DOUBLE_EQ(20 * Mpc, pruning.getNearestObserverDistance(Vector3d(80, 0, 0) * Mpc));
+	EXPECT_DOUBLE_EQ(30 * Mpc, pruning.getNearestObserverDistance(Vector3d(-30, 0, 0) * Mpc));
+
+	// 30 EeV reach 20 Mpc but not 30 Mpc
+	Candidate c(nucleusId(1, 1), 30 * EeV, Vector3d(80, 0, 0) * Mpc);
+	pruning.process(&c);
+	EXPECT_TRUE(c.isActive());
+	c.current.setPosition(Vector3d(-30, 0, 0) * Mpc);
+	c.setWeight(2);
+	pruning.process(&c);
+	EXPECT_FALSE(c.isActive());
+	EXPECT_TRUE(c.hasProperty("Rejected"));
+	EXPECT_EQ(1, pruning.getPrunedCount());
+	EXPECT_EQ(2, pruning.getPrunedWeight());
+
+	// photons without losses are not pruned above the threshold
+	Candidate photon(22, 30 * EeV, Vector3d(-30, 0, 0) * Mpc);
+	pruning.process(&photon);
+	EXPECT_TRUE(photon.isActive());
+
+	// flagged once without deactivation
+	pruning.resetCounters();
+	pruning.setMakeRejectedInactive(false);
+	pruning.setRejectFlag("Pruned", "yes");
+	Candidate d(nucleusId(1, 1), 30 * EeV, Vector3d(-30, 0, 0) * Mpc);
+	pruning.process(&d);
+	pruning.process(&d);
+	EXPECT_TRUE(d.isActive());
+	EXPECT_TRUE(d.hasProperty("Pruned"));
+	EXPECT_EQ(1, pruning.getPrunedCount());
+}
+
+TEST(ReachabilityPruning, minimumEnergies) {
+	MinimumEnergyPerParticleId *thresholds = new MinimumEnergyPerParticleId(10 * EeV);
+	thresholds->add(nucleusId(4, 2), 40 * EeV);
+	ReachabilityPruning pruning;
+	pruning.setMinimumEnergies(thresholds);
+	pruning.add(new ConstantNucleusLoss(EeV / Mpc));
+	pruning.addObserverPosition(Vector3d(0.));
+
+	// 50 EeV reach 20 Mpc above 10 EeV, but not above 40 EeV
+	Candidate proton(nucleusId(1, 1), 50 * EeV, Vector3d(20, 0, 0) * Mpc);
+	Candidate helium(nucleusId(4, 2), 50 * EeV, Vector3d(20, 0, 0) * Mpc);
+	pruning.process(&proton);
+	pruning.process(&helium);
+	EXPECT_TRUE(proton.isActive());
+	EXPECT_FALSE(helium.isActive());
+	EXPECT_EQ(unsigned(NucleusClass | PhotonClass | ElectronClass | NeutrinoClass | OtherClass),
+			pruning.getParticleClasses());
+	pruning.setParticleClasses(NucleusClass);
+	EXPECT_EQ(unsigned(NucleusClass), pruning.getParticleClasses());
+}
+
 TEST(MinimumRedshift, test) {
 	MinimumRedshift minZ; // default minimum redshift of 0
 	Candidate c;
@@ -180,6 +308,95 @@ TEST(ObserverFeature, SmallSphere) {
 	EXPECT_FALSE(c.isActive());
 }
 
+TEST(ObserverFeature, SphereArray) {
+	// the indexed search agrees with testing all spheres
+	Random random(42);
+	ref_ptr<ObserverSphereArray> array = new ObserverSphereArray();
+	std::vector<Vector3d> centers;
+	std::vector<double> radii;
+	for (int i = 0; i < 500; i++) {
+		centers.push_back(Vector3d(random.rand(), random.rand(), 0.1 * random.rand()) * 100);
+		radii.push_back(0.2 + random.rand());
+		array->add(centers.back(), radii.back());
+	}
+	EXPECT_EQ(500, array->size());
+
+	for (int n = 0; n < 2000; n++) {
+		// also positions outside of the array
+		Vector3d current = Vector3d(random.rand(), random.rand(), random.rand()) * 140 - Vector3d(20);
+		Vector3d previous = current + random.randVector() * random.rand() * 3;
+		double nearest = std::numeric_limits<double>::max();
+		bool crossed = false;
+		for (size_t i = 0; i < centers.size(); i++) {
+			double dCurrent = (current - centers[i]).getR() - radii[i];
+			double dPrevious = (previous - centers[i]).getR() - radii[i];
+			nearest = std::min(nearest, fabs(dCurrent));
+			crossed = crossed or (dCurrent * dPrevious <= 0);
+		}
+		EXPECT_DOUBLE_EQ(nearest, array->nearestDistance(current));
+		EXPECT_DOUBLE_EQ(std::min(nearest, 5.), array->nearestDistance(current, 5));
+		long i = array->crossedSphere(previous, current);
+		EXPECT_EQ(crossed, i >= 0);
+		if (i >= 0)
+			EXPECT_GE(0, ((current - centers[i]).getR() - radii[i]) * ((previous - centers[i]).getR() - radii[i]));
+	}
+
+	// detection with the index of the sphere
+	array->setIndexKey("Station");
+	Observer obs;
+	obs.add(array);
+	Candidate c;
+	c.setNextStep(100);
+	c.previous.setPosition(centers[7] + Vector3d(radii[7] + 0.01, 0, 0));
+	c.current.setPosition(centers[7]);
+	obs.process(&c);
+	EXPECT_FALSE(c.isActive());
+	ASSERT_TRUE(c.hasProperty("Station"));
+	EXPECT_EQ(7, c.getProperty("Station").asInt64());
+	EXPECT_NEAR(radii[7], c.getNextStep(), 1e-12);
+}
+
+TEST(ObserverFeature, SurfaceEventDriven) {
+	// neutral particles moving away from the surface are not limited
+	ref_ptr<ObserverSurface> surface = new ObserverSurface(new Plane(Vector3d(0, 0, 10), Vector3d(0, 0, 1)));
+	surface->setEventDriven(true);
+	Observer obs;
+	obs.add(surface);
+	Candidate c(22);
+	c.current.setPosition(Vector3d(0, 0, 0));
+	c.previous.setPosition(Vector3d(0, 0, -1));
+	c.current.setDirection(Vector3d(0, 0, -1));
+	c.setNextStep(100);
+	obs.process(&c);
+	EXPECT_DOUBLE_EQ(100, c.getNextStep());
+
+	// and heading for it limited to the crossing
+	c.current.setDirection(Vector3d(0.6, 0, 0.8));
+	obs.process(&c);
+	EXPECT_DOUBLE_EQ(12.5, c.getNextStep());
+}
+
+TEST(ObserverFeature, SurfaceCollection) {
+	// particles crossing any of the surfaces are detected
+	ref_ptr<SurfaceCollection> shells = new SurfaceCollection();
+	shells->add(new Sphere(Vector3d(0.), 10));
+	shells->add(new Sphere(Vector3d(0.), 5));
+	Observer obs;
+	obs.add(new ObserverSurface(shells));
+	Candidate c;
+	c.setNextStep(100);
+	c.previous.setPosition(Vector3d(3, 0, 0));
+	c.current.setPosition(Vector3d(4, 0, 0));
+	obs.process(&c);
+	EXPECT_TRUE(c.isActive());
+	EXPECT_DOUBLE_EQ(1, c.getNextStep());
+
+	c.previous.setPosition(Vector3d(4, 0, 0));
+	c.current.setPosition(Vector3d(6, 0, 0));
+	obs.process(&c);
+	EXPECT_FALSE(c.isActive());
+}
+
 TEST(ObserverFeature, LargeSphere) {
 	// detect if the current position is outside and the previous inside of the sphere
 	Observer obs;
@@ -267,6 +484,44 @@ TEST(ObserverFeature, TimeEvolution) {
   EXPECT_TRUE(c.hasProperty("Detected"));
 }
 
+TEST(ObserverFeature, TimeEvolutionGrid) {
+	// the grids give the same detections as the list of their times
+	ObserverTimeEvolution linear(1, 10, 10, false);
+	ObserverTimeEvolution log(1, 1000, 31, true);
+	EXPECT_EQ(ObserverTimeEvolution::Logarithmic, log.getScaling());
+	EXPECT_DOUBLE_EQ(10, linear.getTime(9));
+	EXPECT_NEAR(1000, log.getTime(30), 1e-9);
+
+	ObserverTimeEvolution *grids[2] = {&linear, &log};
+	for (int g = 0; g < 2; g++) {
+		ObserverTimeEvolution list;
+		std::vector<double> times = grids[g]->getTimes();
+		for (size_t i = times.size(); i > 0; i--)
+			list.addTime(times[i - 1]); // sorted on insertion
+		EXPECT_EQ(ObserverTimeEvolution::List, list.getScaling());
+		EXPECT_TRUE(list.getTimes() == times);
+
+		Candidate a, b;
+		for (double length = 0.5; length < 1100; length *= 1.07) {
+			a.setTrajectoryLength(length);
+			b.setTrajectoryLength(length);
+			a.setNextStep(1e4);
+			b.setNextStep(1e4);
+			EXPECT_EQ(list.checkDetection(&a), grids[g]->checkDetection(&b));
+			EXPECT_DOUBLE_EQ(a.getNextStep(), b.getNextStep());
+		}
+		// detected at the exact times only once
+		Candidate c;
+		c.setTrajectoryLength(times[3]);
+		c.setNextStep(1e4);
+		EXPECT_EQ(DETECTED, grids[g]->checkDetection(&c));
+		EXPECT_EQ(NOTHING, grids[g]->checkDetection(&c));
+		EXPECT_DOUBLE_EQ(times[4] - times[3], c.getNextStep());
+	}
+
+	EXPECT_THROW(ObserverTimeEvolution(0, 1, 10, true), std::runtime_error);
+}
+
 //** ========================= Boundaries =================================== */
 TEST(PeriodicBox, high) {
 	// Tests if the periodical boundaries place the particle back inside the box and translate the initial position accordingly.
@@ -395,6 +650,35 @@ TEST(CubicBoundary, limitStepUpper) {
 	EXPECT_DOUBLE_EQ(1.5, c.getNextStep());
 }
 
+TEST(SurfaceBoundary, collection) {
+	// the inside is the union of the insides of the surfaces
+	ref_ptr<SurfaceCollection> zones = new SurfaceCollection();
+	zones->add(new Sphere(Vector3d(0.), 10));
+	zones->add(new ParaxialBox(Vector3d(5, -1, -1), Vector3d(10, 2, 2)));
+	SurfaceBoundary boundary(zones);
+	boundary.setMargin(1);
+	Candidate c;
+	c.setNextStep(100);
+	c.current.setPosition(Vector3d(12, 0, 0));
+	boundary.process(&c);
+	EXPECT_TRUE(c.isActive());
+	EXPECT_DOUBLE_EQ(2, c.getNextStep());
+
+	c.current.setPosition(Vector3d(0, 11, 0));
+	boundary.process(&c);
+	EXPECT_FALSE(c.isActive());
+	EXPECT_TRUE(c.hasProperty("Rejected"));
+
+	// neutral particles: limited to the next surface along the straight line
+	boundary.setEventDriven(true);
+	Candidate p(22);
+	p.setNextStep(100);
+	p.current.setPosition(Vector3d(12, 0, 0));
+	p.current.setDirection(Vector3d(1, 0, 0));
+	boundary.process(&p);
+	EXPECT_DOUBLE_EQ(4, p.getNextStep());
+}
+
 TEST(SphericalBoundary, inside) {
 	SphericalBoundary sphere(Vector3d(0, 0, 0), 10);
 	Candidate c;
@@ -425,6 +709,27 @@ TEST(SphericalBoundary, limitStep) {
 	EXPECT_DOUBLE_EQ(1.5, c.getNextStep());
 }
 
+TEST(SphericalBoundary, eventDriven) {
+	// neutral particles: limited to the exit along the straight line
+	SphericalBoundary sphere(Vector3d(0, 0, 0), 10);
+	sphere.setMargin(1);
+	sphere.setEventDriven(true);
+	Candidate c(22);
+	c.setNextStep(100);
+	c.current.setPosition(Vector3d(0, 0, 9.5));
+	c.current.setDirection(Vector3d(1, 0, 0));
+	sphere.process(&c);
+	EXPECT_DOUBLE_EQ(sqrt(100 - 9.5 * 9.5) + 1, c.getNextStep());
+
+	// charged particles as before
+	Candidate p(nucleusId(1, 1));
+	p.setNextStep(100);
+	p.current.setPosition(Vector3d(0, 0, 9.5));
+	p.current.setDirection(Vector3d(1, 0, 0));
+	sphere.process(&p);
+	EXPECT_DOUBLE_EQ(1.5, p.getNextStep());
+}
+
 TEST(EllipsoidalBoundary, inside) {
 	EllipsoidalBoundary ellipsoid(Vector3d(-5, 0, 0), Vector3d(5, 0, 0), 15);
 	Candidate c;
@@ -499,6 +804,160 @@ TEST(RestrictToRegion, RestrictToRegion) {
 	EXPECT_FALSE(c.isActive());
 }
 
+TEST(WeightWindow, roulette) {
+	// the expected weight is conserved, low weights are mostly killed
+	WeightWindow window(0.5, 2);
+	EXPECT_EQ(1.25, window.getWindow(1, 1 * EeV).survival);
+	double weight = 0;
+	int survived = 0;
+	for (int i = 0; i < 10000; i++) {
+		Candidate c;
+		c.setWeight(0.1);
+		window.process(&c);
+		if (c.isActive()) {
+			survived++;
+			weight += c.getWeight();
+			EXPECT_EQ(1.25, c.getWeight());
+		} else {
+			EXPECT_TRUE(c.hasProperty("Rejected"));
+		}
+	}
+	EXPECT_NEAR(10000 * 0.1 / 1.25, survived, 100);
+	EXPECT_NEAR(1000, weight, 125);
+
+	// weights inside of the window are unchanged
+	Candidate c;
+	window.process(&c);
+	EXPECT_TRUE(c.isActive());
+	EXPECT_EQ(1, c.getWeight());
+	EXPECT_EQ(0, c.secondaries.size());
+}
+
+TEST(WeightWindow, splitting) {
+	WeightWindow window(0.5, 2);
+	Candidate c(nucleusId(1, 1), 1 * EeV, Vector3d(1, 2, 3));
+	c.setWeight(7);
+	window.process(&c);
+	ASSERT_EQ(3, c.secondaries.size());
+	EXPECT_DOUBLE_EQ(7. / 4, c.getWeight());
+	for (size_t i = 0; i < c.secondaries.size(); i++) {
+		Candidate *copy = c.secondaries[i];
+		EXPECT_DOUBLE_EQ(7. / 4, copy->getWeight());
+		EXPECT_EQ(c.current.getPosition(), copy->current.getPosition());
+		EXPECT_EQ(c.current.getId(), copy->created.getId());
+		EXPECT_EQ(c.getSerialNumber(), copy->getCreatedSerialNumber());
+		EXPECT_NE(c.getRandomStream(), copy->getRandomStream());
+	}
+
+	window.setMaximumSplitting(2);
+	Candidate heavy;
+	heavy.setWeight(100);
+	window.process(&heavy);
+	EXPECT_EQ(1, heavy.secondaries.size());
+	EXPECT_EQ(50, heavy.getWeight());
+}
+
+TEST(WeightWindow, windowsAndRegions) {
+	WeightWindow window(0.5, 2);
+	window.setWindow(22, 1 * EeV, 0.01, 0.1);
+	window.setWindow(22, 10 * EeV, 1, 10);
+	EXPECT_EQ(0.5, window.getWindow(22, 0.1 * EeV).lower);
+	EXPECT_EQ(0.01, window.getWindow(22, 5 * EeV).lower);
+	EXPECT_EQ(1, window.getWindow(22, 20 * EeV).lower);
+	EXPECT_EQ(0.5, window.getWindow(11, 20 * EeV).lower);
+	EXPECT_THROW(window.setWindow(2, 1), std::runtime_error);
+
+	// at the upper bound, entering a region of importance 4 splits into 4 copies
+	window.addImportanceRegion(new Sphere(Vector3d(0.), 1 * Mpc), 4);
+	EXPECT_EQ(4, window.getImportance(Vector3d(0.)));
+	EXPECT_EQ(1, window.getImportance(Vector3d(2 * Mpc, 0, 0)));
+	Candidate c(nucleusId(1, 1), 1 * EeV, Vector3d(0.5 * Mpc, 0, 0));
+	c.setWeight(2);
+	window.process(&c);
+	EXPECT_EQ(3, c.secondaries.size());
+	EXPECT_EQ(0.5, c.getWeight());
+}
+
+TEST(TerminationConditions, sameAsModules) {
+	// the fused conditions reject and limit as the modules on their own
+	ref_ptr<MinimumEnergy> minE = new MinimumEnergy(5 * EeV);
+	ref_ptr<MaximumTrajectoryLength> maxL = new MaximumTrajectoryLength(80 * Mpc);
+	ref_ptr<SphericalBoundary> sphere = new SphericalBoundary(Vector3d(0.), 50 * Mpc);
+	ref_ptr<CubicBoundary> cube = new CubicBoundary(Vector3d(-40 * Mpc), 80 * Mpc);
+	cube->setRejectFlag("Outside", "cube");
+	ref_ptr<DetectionLength> detection = new DetectionLength(30 * Mpc);
+
+	TerminationConditions fused;
+	fused.add(minE);
+	fused.add(maxL);
+	fused.add(sphere);
+	fused.add(cube);
+	fused.add(detection);
+	EXPECT_EQ(5, fused.size());
+	EXPECT_TRUE(fused.isFused(3));
+	EXPECT_FALSE(fused.isFused(4));
+
+	Random random(1);
+	size_t rejected = 0;
+	for (int i = 0; i < 200; i++) {
+		double E = random.rand(10) * EeV;
+		Vector3d position = random.randVector() * random.rand(60) * Mpc;
+		double length = random.rand(100) * Mpc;
+		Candidate a(nucleusId(1, 1), E, position);
+		Candidate b(nucleusId(1, 1), E, position);
+		a.setTrajectoryLength(length);
+		b.setTrajectoryLength(length);
+		a.setNextStep(1000 * Mpc);
+		b.setNextStep(1000 * Mpc);
+
+		minE->process(&a);
+		maxL->process(&a);
+		sphere->process(&a);
+		cube->process(&a);
+		detection->process(&a);
+		fused.process(&b);
+
+		EXPECT_EQ(a.isActive(), b.isActive());
+		EXPECT_EQ(a.hasProperty("Outside"), b.hasProperty("Outside"));
+		EXPECT_DOUBLE_EQ(a.getNextStep(), b.getNextStep());
+		if (not a.isActive())
+			rejected++;
+	}
+
+	uint64_t counted = 0;
+	for (size_t i = 0; i < fused.size(); i++)
+		counted += fused.getRejections(i);
+	EXPECT_GE(counted, rejected);
+	EXPECT_GT(fused.getRejections(0), 0);
+	EXPECT_GT(fused.getRejections(3), 0);
+	fused.resetRejections();
+	EXPECT_EQ(0, fused.getRejections(0));
+	EXPECT_THROW(fused.getRejections(5), std::runtime_error);
+}
+
+TEST(TerminationConditions, observerPositions) {
+	ref_ptr<MaximumTrajectoryLength> maxL = new MaximumTrajectoryLength(10 * Mpc);
+	maxL->addObserverPosition(Vector3d(-5, 0, 0) * Mpc);
+	maxL->addObserverPosition(Vector3d(5, 0, 0) * Mpc);
+	TerminationConditions fused;
+	fused.add(maxL);
+	EXPECT_TRUE(fused.isFused(0));
+
+	Candidate c;
+	c.setNextStep(100 * Mpc);
+	c.setTrajectoryLength(3 * Mpc);
+	c.current.setPosition(Vector3d(10, 0, 0) * Mpc);
+	fused.process(&c);
+	EXPECT_TRUE(c.isActive());
+	EXPECT_DOUBLE_EQ(7 * Mpc, c.getNextStep());
+
+	c.current.setPosition(Vector3d(0, 8, 0) * Mpc);
+	EXPECT_DOUBLE_EQ(sqrt(89.) * Mpc, maxL->getNearestObserverDistance(c.current.getPosition()));
+	fused.process(&c);
+	EXPECT_FALSE(c.isActive());
+	EXPECT_EQ(1, fused.getRejections(0));
+}
+
 
 int main(int argc, char **argv) {
 	::testing::InitGoogleTest(&argc, argv);
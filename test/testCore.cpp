@@ -5,21 +5,46 @@
   	Common functions
  */
 
+#include "crpropa/AliasTable.h"
+#include "crpropa/KdTree.h"
+#include "crpropa/AMRGrid.h"
 #include "crpropa/Candidate.h"
+#include "crpropa/CandidateSnapshot.h"
 #include "crpropa/base64.h"
 #include "crpropa/Common.h"
+#include "crpropa/Cosmology.h"
+#include "crpropa/Diagnostics.h"
 #include "crpropa/Units.h"
 #include "crpropa/ParticleID.h"
 #include "crpropa/ParticleMass.h"
 #include "crpropa/Random.h"
 #include "crpropa/Grid.h"
 #include "crpropa/GridTools.h"
+#include "crpropa/MappedGrid.h"
+#include "crpropa/QuantizedGrid.h"
+#include "crpropa/SlabDecomposition.h"
 #include "crpropa/Geometry.h"
 #include "crpropa/EmissionMap.h"
+#include "crpropa/NumericTable.h"
+#include "crpropa/module/Tools.h"
 
 #include <HepPID/ParticleIDMethods.hh>
 #include "gtest/gtest.h"
 
+#ifdef CRPROPA_HAVE_HDF5
+#include <hdf5.h>
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 namespace crpropa {
 
 TEST(ParticleState, position) {
@@ -89,6 +114,37 @@ TEST(ParticleState, Charge) {
 	EXPECT_DOUBLE_EQ(0, particle.getCharge());
 }
 
+TEST(ParticleState, idTable) {
+	// the tabulated masses and charges match the direct computation
+	ParticleState particle;
+	for (int Z = 0; Z <= 26; Z++)
+		for (int A = std::max(Z, 1); A <= Z + 30; A++) {
+			int id = nucleusId(A, Z);
+			particle.setId(id);
+			EXPECT_EQ(nuclearMass(id), particle.getMass());
+			EXPECT_EQ(chargeNumber(id) * eplus, particle.getCharge());
+			particle.setId(-id);
+			EXPECT_EQ(nuclearMass(A, Z), particle.getMass());
+			EXPECT_EQ(-chargeNumber(id) * eplus, particle.getCharge());
+		}
+
+	particle.setId(22); // photon
+	EXPECT_DOUBLE_EQ(0, particle.getCharge());
+	particle.setId(13); // muon
+	EXPECT_DOUBLE_EQ(-eplus, particle.getCharge());
+	particle.setId(-211); // pi-
+	EXPECT_DOUBLE_EQ(-eplus, particle.getCharge());
+	particle.setId(2212); // proton in the PDG numbering
+	EXPECT_DOUBLE_EQ(eplus, particle.getCharge());
+	EXPECT_EQ(nuclearMass(1, 1), particle.getMass());
+
+	// outside of the tables
+	particle.setId(nucleusId(238, 92));
+	EXPECT_DOUBLE_EQ(92 * eplus, particle.getCharge());
+	particle.setId(3222); // Sigma+
+	EXPECT_DOUBLE_EQ(eplus, particle.getCharge());
+}
+
 TEST(ParticleState, Rigidity) {
 	ParticleState particle;
 
@@ -182,6 +238,36 @@ TEST(Candidate, limitNextStep) {
 	EXPECT_DOUBLE_EQ(candidate.getNextStep(), 2 * Mpc);
 }
 
+TEST(Candidate, kinematics) {
+	Candidate c(nucleusId(4, 2), 100 * EeV);
+	c.setRedshift(1);
+	const Candidate::Kinematics &kin = c.getKinematics();
+	double lf = c.current.getLorentzFactor();
+	EXPECT_DOUBLE_EQ(lf, kin.lorentzFactor);
+	EXPECT_DOUBLE_EQ(2, kin.redshiftFactor);
+	EXPECT_DOUBLE_EQ(2 * lf, kin.localLorentzFactor);
+	EXPECT_DOUBLE_EQ(log10(2 * lf), kin.lgLocalLorentzFactor);
+	EXPECT_DOUBLE_EQ(c.current.getRigidity(), kin.rigidity);
+
+	// invalidated by changes of energy, ID and redshift
+	c.current.setEnergy(50 * EeV);
+	EXPECT_DOUBLE_EQ(lf / 2, c.getKinematics().lorentzFactor);
+	c.current.setId(nucleusId(1, 1));
+	EXPECT_DOUBLE_EQ(c.current.getLorentzFactor(), c.getKinematics().lorentzFactor);
+	c.setRedshift(0);
+	EXPECT_DOUBLE_EQ(c.current.getLorentzFactor(), c.getKinematics().localLorentzFactor);
+
+	// equidistant tabulation of log10(Lorentz factor) in [6, 14] with 201 points
+	size_t i;
+	double f;
+	c.current.setLorentzFactor(pow(10, 10.1));
+	EXPECT_TRUE(c.getKinematics().locate(6, 14, 201, i, f));
+	EXPECT_EQ(102, i);
+	EXPECT_NEAR(0.5, f, 1e-9);
+	c.current.setLorentzFactor(1e15);
+	EXPECT_FALSE(c.getKinematics().locate(6, 14, 201, i, f));
+}
+
 TEST(Candidate, isActive) {
 	Candidate candidate;
 	EXPECT_TRUE(candidate.isActive());
@@ -197,6 +283,43 @@ TEST(Candidate, property) {
 	EXPECT_EQ("bar", value);
 }
 
+TEST(Candidate, propertyKey) {
+	Candidate candidate;
+	Candidate::PropertyKey key = Candidate::getPropertyKey("foo");
+	EXPECT_EQ(key, Candidate::getPropertyKey("foo"));
+	EXPECT_EQ("foo", Candidate::getPropertyName(key));
+	EXPECT_NE(key, Candidate::getPropertyKey("foo2"));
+
+	candidate.setProperty(key, "bar");
+	EXPECT_TRUE(candidate.hasProperty("foo"));
+	std::string value = candidate.getProperty("foo");
+	EXPECT_EQ("bar", value);
+
+	candidate.setProperty("foo", 5);
+	EXPECT_EQ(5, candidate.getProperty(key).toInt32());
+	EXPECT_TRUE(candidate.removeProperty(key));
+	EXPECT_FALSE(candidate.hasProperty("foo"));
+	EXPECT_FALSE(candidate.hasProperty("neverRegistered"));
+}
+
+TEST(Candidate, propertyKeyConcurrent) {
+	// threads register and look up the same names at the same time
+	const int n = 64;
+	std::vector<Candidate::PropertyKey> keys(4 * n);
+	#pragma omp parallel for
+	for (int i = 0; i < 4 * n; i++) {
+		std::string name = "concurrentKey" + std::to_string(i % n);
+		keys[i] = Candidate::getPropertyKey(name);
+		Candidate::PropertyKey found;
+		EXPECT_TRUE(Candidate::findPropertyKey(name, found));
+		EXPECT_EQ(keys[i], found);
+	}
+	for (int i = 0; i < 4 * n; i++) {
+		EXPECT_EQ(keys[i % n], keys[i]);
+		EXPECT_EQ("concurrentKey" + std::to_string(i % n), Candidate::getPropertyName(keys[i]));
+	}
+}
+
 TEST(Candidate, addSecondary) {
 	Candidate c;
 	c.setRedshift(5);
@@ -217,12 +340,215 @@ TEST(Candidate, addSecondary) {
 	EXPECT_EQ(1000, s.created.getEnergy());
 	EXPECT_TRUE(Vector3d(1,2,3) == s.created.getPosition());
 	EXPECT_TRUE(Vector3d(0,0,1) == s.created.getDirection());
+
+	// the weights are relative to the parent
+	c.setWeight(4);
+	c.addSecondary(22, 100, 0.5);
+	c.secondaries[1]->addSecondary(22, 50, Vector3d(0.), 0.25);
+	EXPECT_EQ(2, c.secondaries[1]->getWeight());
+	EXPECT_EQ(0.5, c.secondaries[1]->secondaries[0]->getWeight());
 }
 
 TEST(Candidate, serialNumber) {
 	Candidate::setNextSerialNumber(42);
 	Candidate c;
 	EXPECT_EQ(43, c.getSourceSerialNumber());
+
+	// the last serial number of a block equals the counter
+	uint64_t last = 0;
+	for (uint64_t i = 1; i < Candidate::serialNumberBlockSize; i++)
+		last = Candidate().getSerialNumber();
+	EXPECT_EQ(Candidate::getNextSerialNumber(), last);
+	EXPECT_EQ(last + 1, Candidate().getSerialNumber());
+}
+
+TEST(Candidate, serialNumberBlocks) {
+	// unique across threads, consecutive within a thread
+	Candidate::setNextSerialNumber(0);
+	std::vector<uint64_t> serials(20000);
+#pragma omp parallel for schedule(static, 1000)
+	for (size_t i = 0; i < serials.size(); i++)
+		serials[i] = Candidate().getSerialNumber();
+	for (size_t i = 1; i < 1000; i++)
+		EXPECT_EQ(serials[i - 1] + 1, serials[i]);
+	std::sort(serials.begin(), serials.end());
+	EXPECT_TRUE(std::adjacent_find(serials.begin(), serials.end()) == serials.end());
+	EXPECT_LE(serials.back(), Candidate::getNextSerialNumber());
+
+	// no serial number of the run is above a checkpointed counter, and
+	// setting it discards the blocks of the threads
+	uint64_t next = Candidate::getNextSerialNumber();
+	Candidate::setNextSerialNumber(next);
+	EXPECT_EQ(next + 1, Candidate().getSerialNumber());
+	EXPECT_EQ(next + Candidate::serialNumberBlockSize, Candidate::getNextSerialNumber());
+}
+
+TEST(Candidate, detachFromParent) {
+	Candidate::setNextSerialNumber(10);
+	ref_ptr<Candidate> c = new Candidate();
+	c->addSecondary(22, 1);
+	c->secondaries[0]->addSecondary(22, 1);
+	ref_ptr<Candidate> s1 = c->secondaries[0];
+	ref_ptr<Candidate> s2 = s1->secondaries[0];
+	uint64_t sourceSerial = c->getSerialNumber();
+
+	s2->detachFromParent();
+	s1->detachFromParent();
+	c = NULL;
+	s1->secondaries.clear();
+	EXPECT_TRUE(s2->parent == NULL);
+	EXPECT_EQ(sourceSerial, s2->getSourceSerialNumber());
+	EXPECT_EQ(s1->getSerialNumber(), s2->getCreatedSerialNumber());
+	EXPECT_EQ(sourceSerial, s1->getCreatedSerialNumber());
+}
+
+TEST(Candidate, serialize) {
+	ref_ptr<Candidate> c = new Candidate(nucleusId(4, 2), 5 * EeV, Vector3d(1, 2, 3), Vector3d(0, 1, 0));
+	c->addSecondary(22, 1 * EeV);
+	ref_ptr<Candidate> s = c->secondaries[0];
+	s->setWeight(0.5);
+	s->setTrajectoryLength(7);
+	s->setNextStep(3);
+	s->setRandomStream(11, 12);
+	s->setProperty("number", 4.5);
+	s->setProperty("name", std::string("photon"));
+
+	std::vector<char> buffer;
+	s->serialize(buffer);
+	c->serialize(buffer);
+	size_t offset = 0;
+	ref_ptr<Candidate> r = Candidate::deserialize(buffer, offset);
+	ref_ptr<Candidate> p = Candidate::deserialize(buffer, offset);
+	EXPECT_EQ(buffer.size(), offset);
+
+	EXPECT_TRUE(r->parent == NULL);
+	EXPECT_EQ(22, r->current.getId());
+	EXPECT_EQ(nucleusId(4, 2), r->source.getId());
+	EXPECT_EQ(Vector3d(1, 2, 3), r->created.getPosition());
+	EXPECT_EQ(Vector3d(0, 1, 0), r->current.getDirection());
+	EXPECT_DOUBLE_EQ(0.5, r->getWeight());
+	EXPECT_DOUBLE_EQ(7, r->getTrajectoryLength());
+	EXPECT_DOUBLE_EQ(3, r->getNextStep());
+	EXPECT_EQ(11, r->getRandomStream());
+	EXPECT_EQ(12, r->getRandomCounter());
+	EXPECT_EQ(s->getSerialNumber(), r->getSerialNumber());
+	EXPECT_EQ(c->getSerialNumber(), r->getSourceSerialNumber());
+	EXPECT_EQ(c->getSerialNumber(), r->getCreatedSerialNumber());
+	EXPECT_DOUBLE_EQ(4.5, r->getProperty("number").toDouble());
+	EXPECT_EQ("photon", r->getProperty("name").toString());
+
+	EXPECT_TRUE(p->secondaries.empty());
+	EXPECT_EQ(5 * EeV, p->current.getEnergy());
+	offset = buffer.size() - 1;
+	EXPECT_THROW(Candidate::deserialize(buffer, offset), std::runtime_error);
+}
+
+TEST(Candidate, pooledAllocation) {
+	ref_ptr<Candidate> c = new Candidate();
+	Candidate *address = c.get();
+	c = NULL;
+	// the released memory is reused for the next candidate of this thread
+	c = new Candidate(nucleusId(1, 1), 1);
+	EXPECT_EQ(address, c.get());
+	EXPECT_EQ(1, c->current.getEnergy());
+
+	size_t capacity = Candidate::getPoolCapacity();
+	Candidate::setPoolCapacity(0);
+	c = NULL;
+	c = new Candidate();
+	EXPECT_TRUE(c.valid());
+	Candidate::setPoolCapacity(capacity);
+}
+
+TEST(Candidate, liveCount) {
+	size_t live = Candidate::getLiveCount();
+	Candidate::resetPeakLiveCounts();
+	{
+		std::vector<ref_ptr<Candidate> > candidates;
+		for (int i = 0; i < 10; i++)
+			candidates.push_back(new Candidate());
+		EXPECT_EQ(live + 10, Candidate::getLiveCount());
+	}
+	EXPECT_EQ(live, Candidate::getLiveCount());
+	EXPECT_LT(0, Candidate::getPooledCount());
+
+	// the peak of this thread includes the 10 released candidates
+	std::vector<size_t> peaks = Candidate::getPeakLiveCounts();
+	ASSERT_LT(0, peaks.size());
+	EXPECT_LE(10, *std::max_element(peaks.begin(), peaks.end()));
+}
+
+TEST(Candidate, copyOnWriteProperties) {
+	ref_ptr<Candidate> c = new Candidate();
+	c->setProperty("foo", 1);
+	ref_ptr<Candidate> clone = c->clone();
+	// the clone shares the map until it is modified
+	EXPECT_EQ(&c->getProperties(), &clone->getProperties());
+
+	clone->setProperty("foo", 2);
+	EXPECT_NE(&c->getProperties(), &clone->getProperties());
+	EXPECT_EQ(1, c->getProperty("foo").toInt32());
+	EXPECT_EQ(2, clone->getProperty("foo").toInt32());
+
+	clone = c->clone();
+	EXPECT_TRUE(c->removeProperty("foo"));
+	EXPECT_FALSE(c->hasProperty("foo"));
+	EXPECT_TRUE(clone->hasProperty("foo"));
+	EXPECT_EQ(0, Candidate().getProperties().size());
+}
+
+TEST(CandidateSnapshot, fromCandidate) {
+	ref_ptr<Candidate> c = new Candidate(nucleusId(1, 1), 10, Vector3d(1, 2, 3));
+	c->current.setEnergy(5);
+	c->setWeight(2);
+	c->setRedshift(0.5);
+	c->setTrajectoryLength(7);
+	c->setProperty("kept", 1);
+	c->setProperty("dropped", 2);
+	c->addSecondary(22, 1);
+	ref_ptr<Candidate> s = c->secondaries[0];
+
+	std::vector<Candidate::PropertyKey> keys;
+	keys.push_back(Candidate::getPropertyKey("kept"));
+	CandidateSnapshot snapshot(c, keys);
+	EXPECT_EQ(10, snapshot.getSource().getEnergy());
+	EXPECT_EQ(5, snapshot.getCurrent().getEnergy());
+	EXPECT_EQ(2, snapshot.getWeight());
+	EXPECT_EQ(0.5, snapshot.getRedshift());
+	EXPECT_EQ(7, snapshot.getTrajectoryLength());
+	EXPECT_EQ(c->getSerialNumber(), snapshot.getSerialNumber());
+	EXPECT_TRUE(snapshot.hasProperty("kept"));
+	EXPECT_FALSE(snapshot.hasProperty("dropped"));
+	EXPECT_EQ(1, snapshot.getProperty("kept").toInt32());
+
+	// unknown names are not registered
+	Candidate::PropertyKey key;
+	EXPECT_FALSE(snapshot.hasProperty("neverSetSnapshotProperty"));
+	EXPECT_THROW(snapshot.getProperty("neverSetSnapshotProperty"), std::runtime_error);
+	EXPECT_FALSE(Candidate::findPropertyKey("neverSetSnapshotProperty", key));
+
+	CandidateSnapshot secondary(s);
+	ref_ptr<Candidate> rebuilt = secondary.toCandidate();
+	EXPECT_FALSE(rebuilt->isActive());
+	EXPECT_EQ(22, rebuilt->current.getId());
+	EXPECT_EQ(s->getSerialNumber(), rebuilt->getSerialNumber());
+	EXPECT_EQ(c->getSerialNumber(), rebuilt->getSourceSerialNumber());
+	EXPECT_EQ(c->getSerialNumber(), rebuilt->getCreatedSerialNumber());
+}
+
+TEST(Referenced, localRefPtr) {
+	ref_ptr<Candidate> c = new Candidate();
+	EXPECT_EQ(1, c->getReferenceCount());
+	{
+		local_ref_ptr<Candidate> l1 = c.get();
+		local_ref_ptr<Candidate> l2 = l1;
+		EXPECT_EQ(3, c->getReferenceCount());
+		l2 = NULL;
+		EXPECT_EQ(2, c->getReferenceCount());
+	}
+	EXPECT_EQ(1, c->getReferenceCount());
+	c->addSecondary(22, 1);
+	EXPECT_EQ(1, c->secondaries[0]->getReferenceCount());
 }
 
 TEST(common, digit) {
@@ -286,6 +612,51 @@ TEST(common, interpolateEquidistant) {
 	EXPECT_EQ(9, interpolateEquidistant(3.1, 1, 3, yD));
 }
 
+TEST(common, equidistantAxis) {
+	// index lookup and interpolation identical to the generic versions
+	std::vector<double> xLog, xZero, xIrregular, y;
+	xZero.push_back(0);
+	for (int i = 0; i < 50; i++) {
+		xLog.push_back(pow(10, 6 + 0.1 * i));
+		xZero.push_back(1e-4 * pow(10, 0.1 * i));
+		xIrregular.push_back(i * i + 1);
+		y.push_back(sin(i));
+	}
+	LogAxis log(xLog), zero(xZero);
+	LinearAxis irregular(xIrregular);
+	EXPECT_TRUE(log.isEquidistant());
+	EXPECT_TRUE(zero.isEquidistant());
+	EXPECT_FALSE(irregular.isEquidistant());
+
+	Random random(7);
+	for (int k = 0; k < 1000; k++) {
+		double x = pow(10, random.randUniform(5.5, 11.5));
+		EXPECT_EQ(std::upper_bound(xLog.begin(), xLog.end(), x) - xLog.begin(), log.upperBound(x));
+		EXPECT_EQ(interpolate(x, xLog, y), interpolate(x, log, y));
+		x = (k % 10 == 0) ? 0 : pow(10, random.randUniform(-5, 1));
+		EXPECT_EQ(std::upper_bound(xZero.begin(), xZero.end(), x) - xZero.begin(), zero.upperBound(x));
+		x = random.randUniform(0, 2500);
+		EXPECT_EQ(std::upper_bound(xIrregular.begin(), xIrregular.end(), x) - xIrregular.begin(), irregular.upperBound(x));
+	}
+	// irregular points of a logarithmic axis, with a leading zero
+	std::vector<double> xCumulative(1, 0);
+	for (int i = 1; i < 200; i++)
+		xCumulative.push_back(xCumulative.back() + 1e-3 * pow(10, 0.02 * i) / (1 + 1e-3 * i * i));
+	LogAxis cumulative(xCumulative);
+	EXPECT_FALSE(cumulative.isEquidistant());
+	for (int k = 0; k < 1000; k++) {
+		double x = (k % 10 == 0) ? xCumulative[k / 10] : random.randUniform(0, 1.1 * xCumulative.back());
+		EXPECT_EQ(std::upper_bound(xCumulative.begin(), xCumulative.end(), x) - xCumulative.begin(), cumulative.upperBound(x));
+	}
+	// tabulation points themselves
+	for (size_t i = 0; i < xLog.size(); i++)
+		EXPECT_EQ(i + 1, log.upperBound(xLog[i]));
+	LogTable table(xLog, y);
+	EXPECT_EQ(y.front(), table(1));
+	EXPECT_EQ(y.back(), table(1e20));
+	EXPECT_DOUBLE_EQ(y[3], table(xLog[3]));
+}
+
 TEST(common, pow_integer)
 {
 	EXPECT_EQ(pow_integer<0>(1.23), 1);
@@ -294,6 +665,100 @@ TEST(common, pow_integer)
 	EXPECT_FLOAT_EQ(pow_integer<3>(1.234), pow(1.234, 3));
 }
 
+TEST(common, fastMath) {
+	// polynomial kernels against the standard library
+	Random random(11);
+	for (int k = 0; k < 10000; k++) {
+		double x = random.randUniform(-700, 700);
+		EXPECT_NEAR(1, fastExp(x) / std::exp(x), 1e-15);
+		double y = pow(10, random.randUniform(-300, 300));
+		EXPECT_NEAR(std::log(y), fastLog(y), 1e-15 * std::fabs(std::log(y)) + 1e-15);
+		EXPECT_NEAR(std::log10(y), fastLog10(y), 1e-15 * std::fabs(std::log10(y)) + 1e-15);
+		double u = random.randUniform(-300, 300);
+		EXPECT_NEAR(1, fastExp10(u) / std::pow(10., u), 1e-12);
+		double b = random.randUniform(0.01, 100), e = random.randUniform(-10, 10);
+		EXPECT_NEAR(1, fastPow(b, e) / std::pow(b, e), 1e-13);
+	}
+	EXPECT_EQ(1, fastExp(0));
+	EXPECT_EQ(0, fastLog(1));
+
+	// special values as the standard library
+	double inf = std::numeric_limits<double>::infinity();
+	double nan = std::numeric_limits<double>::quiet_NaN();
+	EXPECT_EQ(inf, fastExp(1000));
+	EXPECT_EQ(0, fastExp(-1000));
+	EXPECT_EQ(0, fastExp(-inf));
+	EXPECT_TRUE(std::isnan(fastExp(nan)));
+	EXPECT_EQ(-inf, fastLog(0));
+	EXPECT_TRUE(std::isnan(fastLog(-1)));
+	EXPECT_TRUE(std::isnan(fastLog(nan)));
+	EXPECT_EQ(inf, fastLog(inf));
+	EXPECT_DOUBLE_EQ(std::log(1e-310), fastLog(1e-310));
+	EXPECT_EQ(-inf, fastLog10(0));
+	EXPECT_EQ(inf, fastExp10(400));
+	EXPECT_EQ(std::pow(-2., 3.), fastPow(-2, 3));
+	EXPECT_EQ(0, fastPow(0, 2));
+}
+
+TEST(common, mathAccuracy) {
+	EXPECT_EQ(IEEEMath, getMathAccuracy());
+	EXPECT_EQ(std::exp(0.3), mathExp(0.3));
+	EXPECT_EQ(std::pow(1.7, 0.6), mathPow(1.7, 0.6));
+
+	std::vector<double> x, y(300), z(300);
+	for (int i = 0; i < 300; i++)
+		x.push_back(pow(10, -5 + 0.05 * i));
+	x[7] = 0;
+	x[100] = -1;
+
+	MathAccuracy accuracies[2] = {IEEEMath, FastMath};
+	for (int a = 0; a < 2; a++) {
+		setMathAccuracy(accuracies[a]);
+		EXPECT_EQ(accuracies[a], getMathAccuracy());
+
+		// batch versions equal the scalar ones, also in place
+		mathLog10(x.size(), &x[0], &y[0]);
+		for (size_t i = 0; i < x.size(); i++) {
+			if (std::isnan(mathLog10(x[i])))
+				EXPECT_TRUE(std::isnan(y[i]));
+			else
+				EXPECT_EQ(mathLog10(x[i]), y[i]);
+		}
+		mathExp10(y.size(), &y[0], &y[0]);
+		for (size_t i = 0; i < x.size(); i++)
+			if (x[i] > 0)
+				EXPECT_NEAR(1, y[i] / x[i], 1e-13);
+		mathLog(x.size(), &x[0], &y[0]);
+		mathExp(y.size(), &y[0], &z[0]);
+		for (size_t i = 0; i < x.size(); i++) {
+			if (x[i] < 0)
+				continue;
+			EXPECT_EQ(mathLog(x[i]), y[i]);
+			if (x[i] > 0)
+				EXPECT_NEAR(1, z[i] / x[i], 1e-13);
+		}
+		mathPow(x.size(), &x[0], -0.6, &y[0]);
+		mathSqrt(x.size(), &x[0], &z[0]);
+		for (size_t i = 0; i < x.size(); i++) {
+			if (x[i] < 0)
+				continue;
+			EXPECT_EQ(mathPow(x[i], -0.6), y[i]);
+			EXPECT_EQ(std::sqrt(x[i]), z[i]);
+		}
+
+		// the axis lookup stays exact
+		std::vector<double> xLog;
+		for (int i = 0; i < 50; i++)
+			xLog.push_back(pow(10, 6 + 0.1 * i));
+		LogAxis axis(xLog);
+		for (size_t i = 0; i < xLog.size(); i++) {
+			EXPECT_EQ(i + 1, axis.upperBound(xLog[i]));
+			EXPECT_EQ(i, axis.upperBound(std::nextafter(xLog[i], 0.)));
+		}
+	}
+	setMathAccuracy(IEEEMath);
+}
+
 TEST(common, gaussInt)
 {
 	EXPECT_NEAR(gaussInt(([](double x){ return x*x; }), 0, 10), 1000/3., 1e-4);
@@ -394,6 +859,273 @@ TEST(Random, base64Seed) {
 }
 
 
+TEST(Random, counterBasedStream) {
+	// known answer of Philox4x32-10 for counter 0 and key 0
+	Random a(1);
+	a.setStream(0);
+	EXPECT_TRUE(a.hasStream());
+	EXPECT_EQ(0x6627e8d5u, a.randInt());
+	EXPECT_EQ(0xe169c58du, a.randInt());
+	EXPECT_EQ(0xbc57ac4cu, a.randInt());
+	EXPECT_EQ(0x9b00dbd8u, a.randInt());
+	EXPECT_EQ(1, a.getStreamCounter());
+
+	// independent of previous draws, continued at the block counter
+	Random b(2);
+	b.randInt();
+	uint64_t key = Random::deriveStreamKey(42, 7);
+	a.setStream(key, 5);
+	b.setStream(key, 5);
+	for (size_t i = 0; i < 10; i++)
+		EXPECT_EQ(a.rand(), b.rand());
+	EXPECT_NE(key, Random::deriveStreamKey(42, 8));
+
+	// back to the untouched Mersenne Twister state
+	a.clearStream();
+	Random d(1);
+	EXPECT_EQ(d.randInt(), a.randInt());
+}
+
+#ifdef _OPENMP
+TEST(Random, streamsBeyondMaxThread) {
+	// threads beyond the 256 generators draw counter-based streams only
+	const int n = 260;
+	std::vector<uint32_t> values(n, 0);
+	std::vector<int> thrown(n, 0);
+	int threads = 0;
+	#pragma omp parallel num_threads(n)
+	{
+		int i = omp_get_thread_num();
+		#pragma omp single
+		threads = omp_get_num_threads();
+		Random &random = Random::instance();
+		random.setStream(Random::deriveStreamKey(1, i));
+		values[i] = random.randInt();
+		random.clearStream();
+		if (i >= 256) {
+			try {
+				random.randInt();
+			} catch (std::runtime_error &) {
+				thrown[i] = 1;
+			}
+		}
+	}
+	for (int i = 0; i < threads; i++) {
+		Random reference(1);
+		reference.setStream(Random::deriveStreamKey(1, i));
+		EXPECT_EQ(reference.randInt(), values[i]);
+		EXPECT_EQ(i >= 256, thrown[i] == 1);
+	}
+}
+#endif
+
+TEST(Random, bulkGeneration) {
+	// bulk integers are the numbers of repeated single draws
+	Random a(42), b(42);
+	std::vector<uint32_t> ints(2000);
+	a.fillInt(ints.data(), ints.size());
+	for (size_t i = 0; i < ints.size(); i++)
+		EXPECT_EQ(b.randInt(), ints[i]);
+	a.setStream(7);
+	b.setStream(7);
+	b.randInt();
+	a.randInt();
+	a.fillInt(ints.data(), 11);
+	for (size_t i = 0; i < 11; i++)
+		EXPECT_EQ(b.randInt(), ints[i]);
+
+	std::vector<double> values(10001);
+	a.fillUniform(values.data(), values.size(), 2, 4);
+	double mean = 0;
+	for (size_t i = 0; i < values.size(); i++) {
+		EXPECT_GE(values[i], 2);
+		EXPECT_LT(values[i], 4);
+		mean += values[i] / values.size();
+	}
+	EXPECT_NEAR(3, mean, 0.05);
+
+	a.fillNormal(values.data(), values.size(), 1, 2);
+	mean = 0;
+	double variance = 0;
+	for (size_t i = 0; i < values.size(); i++)
+		mean += values[i] / values.size();
+	for (size_t i = 0; i < values.size(); i++)
+		variance += pow(values[i] - mean, 2) / values.size();
+	EXPECT_NEAR(1, mean, 0.1);
+	EXPECT_NEAR(4, variance, 0.2);
+
+	std::vector<Vector3d> vectors(1000);
+	a.fillUnitVectors(vectors.data(), vectors.size());
+	Vector3d sum(0.);
+	for (size_t i = 0; i < vectors.size(); i++) {
+		EXPECT_NEAR(1, vectors[i].getR(), 1e-12);
+		sum += vectors[i];
+	}
+	EXPECT_LT(sum.getR() / vectors.size(), 0.1);
+
+	// power law: uniform in log E for index -1
+	a.fillPowerLaw(values.data(), values.size(), -1, 1, 100);
+	mean = 0;
+	for (size_t i = 0; i < values.size(); i++) {
+		EXPECT_GE(values[i], 1);
+		EXPECT_LE(values[i], 100);
+		mean += log10(values[i]) / values.size();
+	}
+	EXPECT_NEAR(1, mean, 0.02);
+	EXPECT_THROW(a.fillPowerLaw(values.data(), 1, -2, 2, 1), std::runtime_error);
+	Random c(7), d(7);
+	c.fillPowerLaw(values.data(), 300, -2.5, 1, 100);
+	for (size_t i = 0; i < 300; i++)
+		EXPECT_DOUBLE_EQ(d.randPowerLaw(-2.5, 1, 100), values[i]);
+}
+
+TEST(AliasTable, distribution) {
+	// draws follow the cumulative distribution as Random::randBin
+	std::vector<double> cdf;
+	cdf.push_back(0);
+	cdf.push_back(1);
+	cdf.push_back(1);
+	cdf.push_back(4);
+	cdf.push_back(10);
+	AliasTable table;
+	table.setCumulative(cdf);
+	EXPECT_EQ(5, table.size());
+
+	Random random(42);
+	std::vector<double> counts(5, 0);
+	int n = 100000;
+	for (int i = 0; i < n; i++)
+		counts[table.sample(random)] += 1. / n;
+	// bins without weight are never drawn
+	EXPECT_EQ(0, counts[0]);
+	EXPECT_EQ(0, counts[2]);
+	EXPECT_NEAR(0.1, counts[1], 0.005);
+	EXPECT_NEAR(0.3, counts[3], 0.005);
+	EXPECT_NEAR(0.6, counts[4], 0.005);
+
+	EXPECT_THROW(AliasTable(std::vector<double>()), std::runtime_error);
+}
+
+TEST(Cosmology, conversions) {
+	// distance to redshift conversions invert the redshift to distance ones
+	Random random(3);
+	for (int i = 0; i < 500; i++) {
+		double z = pow(10, random.randUniform(-4, 2));
+		EXPECT_NEAR(z, comovingDistance2Redshift(redshift2ComovingDistance(z)), 1e-6 * z);
+		EXPECT_NEAR(z, luminosityDistance2Redshift(redshift2LuminosityDistance(z)), 1e-6 * z);
+		EXPECT_NEAR(z, lightTravelDistance2Redshift(redshift2LightTravelDistance(z)), 1e-6 * z);
+		double d = redshift2ComovingDistance(z);
+		EXPECT_NEAR(d, lightTravel2ComovingDistance(comoving2LightTravelDistance(d)), 1e-6 * d);
+	}
+	EXPECT_EQ(0, comovingDistance2Redshift(0));
+	EXPECT_THROW(comovingDistance2Redshift(-1), std::runtime_error);
+	EXPECT_THROW(redshift2ComovingDistance(101), std::runtime_error);
+
+	// parameters are replaced as a whole
+	double d = redshift2ComovingDistance(1);
+	setCosmologyParameters(0.7, 0.3);
+	EXPECT_DOUBLE_EQ(0.7, H0() * Mpc / 1e5);
+	EXPECT_DOUBLE_EQ(0.7, omegaL());
+	EXPECT_LT(redshift2ComovingDistance(1), d);
+	setCosmologyParameters(0.673, 0.315);
+	EXPECT_NEAR(d, redshift2ComovingDistance(1), 1e-10 * d);
+
+	// readers see either the old or the new parameters while they are replaced
+	int wrong = 0;
+#pragma omp parallel num_threads(4) reduction(+:wrong)
+	for (int i = 0; i < 200; i++) {
+#ifdef _OPENMP
+		if (omp_get_thread_num() == 0)
+			setCosmologyParameters((i % 2) ? 0.7 : 0.673, (i % 2) ? 0.3 : 0.315);
+#endif
+		double h = H0() * Mpc / 1e5;
+		if ((fabs(h - 0.7) > 1e-12) and (fabs(h - 0.673) > 1e-12))
+			wrong++;
+	}
+	EXPECT_EQ(0, wrong);
+	setCosmologyParameters(0.673, 0.315);
+}
+
+TEST(KdTree, nearestPoint) {
+	// the nearest point is the one found by comparing all
+	KdTree tree;
+	EXPECT_EQ(-1, tree.nearestPoint(Vector3d(0.)));
+
+	Random random(7);
+	std::vector<Vector3d> points;
+	for (int i = 0; i < 500; i++)
+		points.push_back(random.randVector() * random.rand(10));
+	points.push_back(points[3]); // duplicates are allowed
+	tree.setPoints(points);
+	EXPECT_EQ(points.size(), tree.size());
+
+	for (int i = 0; i < 200; i++) {
+		Vector3d p = random.randVector() * random.rand(12);
+		double best = std::numeric_limits<double>::max();
+		for (size_t j = 0; j < points.size(); j++)
+			best = std::min(best, p.getDistanceTo(points[j]));
+		long n = tree.nearestPoint(p);
+		ASSERT_GE(n, 0);
+		EXPECT_DOUBLE_EQ(best, p.getDistanceTo(points[n]));
+		EXPECT_DOUBLE_EQ(best, tree.nearestDistance(p));
+	}
+
+	tree.add(Vector3d(100, 0, 0));
+	EXPECT_EQ(points.size(), tree.nearestPoint(Vector3d(99, 0, 0)));
+	EXPECT_THROW(tree.getPoint(tree.size()), std::runtime_error);
+}
+
+TEST(NumericTable, textAndBinary) {
+	std::ofstream out("numeric_table_test.txt");
+	out << "# comment\n";
+	out << "1 2.5 3\n";
+	out << "\n";
+	out << "  # indented comment\n";
+	out << "4 -5e-3 6 # trailing\n";
+	out.close();
+
+	ref_ptr<NumericTable> text = NumericTable::load("numeric_table_test.txt");
+	EXPECT_FALSE(text->isMapped());
+	EXPECT_EQ(2, text->rows());
+	EXPECT_EQ(3, text->columns());
+	EXPECT_DOUBLE_EQ(-5e-3, (*text)(1, 1));
+
+	// the binary table is preferred and mapped
+	EXPECT_TRUE(convertTextTable("numeric_table_test.txt", "numeric_table_test.bin"));
+	ref_ptr<NumericTable> binary = NumericTable::load("numeric_table_test.txt");
+	EXPECT_TRUE(binary->isMapped());
+	EXPECT_EQ(2, binary->rows());
+	EXPECT_EQ(3, binary->columns());
+	for (size_t i = 0; i < text->size(); i++)
+		EXPECT_EQ(text->begin()[i], binary->begin()[i]);
+
+	// rows of different length stay text
+	out.open("numeric_table_test.txt");
+	out << "1 2\n3\n";
+	out.close();
+	std::remove("numeric_table_test.bin");
+	ref_ptr<NumericTable> ragged = NumericTable::load("numeric_table_test.txt");
+	EXPECT_EQ(0, ragged->columns());
+	EXPECT_EQ(1, ragged->rowSize(1));
+	EXPECT_EQ(3, ragged->row(1)[0]);
+	EXPECT_FALSE(convertTextTable("numeric_table_test.txt", "numeric_table_test.bin"));
+	std::remove("numeric_table_test.txt");
+
+	EXPECT_THROW(NumericTable::load("numeric_table_test.txt"), std::runtime_error);
+}
+
+TEST(Candidate, secondaryRandomStream) {
+	Candidate c;
+	c.setRandomStream(42);
+	c.addSecondary(22, 1 * EeV);
+	c.addSecondary(22, 1 * EeV);
+	EXPECT_EQ(Random::deriveStreamKey(42, 0), c.secondaries[0]->getRandomStream());
+	EXPECT_EQ(Random::deriveStreamKey(42, 1), c.secondaries[1]->getRandomStream());
+	c.clearSecondaries();
+	c.addSecondary(22, 1 * EeV);
+	EXPECT_EQ(Random::deriveStreamKey(42, 2), c.secondaries[0]->getRandomStream());
+}
+
 
 TEST(Grid, PeriodicClamp) {
 	// Test correct determination of lower and upper neighbor
@@ -537,6 +1269,47 @@ TEST(VectordGrid, Scale) {
 				EXPECT_FLOAT_EQ(5, grid->interpolate(Vector3d(0.7, 0, 0.1)).x);
 }
 
+TEST(VectordGrid, Reductions) {
+	// the parallel reductions match serial sums, also with the padding of the bricked layout
+	for (int variant = 0; variant < 2; variant++) {
+		ref_ptr<Grid3f> grid = new Grid3f(Vector3d(0.), 9, 5, 300, Vector3d(1.));
+		ref_ptr<Grid1f> strength = new Grid1f(Vector3d(0.), 9, 5, 300, Vector3d(1.));
+		if (variant == 1) {
+			grid->setLayout(GridBricked);
+			strength->setLayout(GridBricked);
+		}
+		fromMagneticField(grid, new MagneticDipoleField(Vector3d(-1.), Vector3d(1, 2, 3), 1));
+		fromMagneticFieldStrength(strength, new MagneticDipoleField(Vector3d(-1.), Vector3d(1, 2, 3), 1));
+
+		Vector3d sum(0.), sum2(0.);
+		double sumB = 0;
+		for (int ix = 0; ix < 9; ix++)
+			for (int iy = 0; iy < 5; iy++)
+				for (int iz = 0; iz < 300; iz++) {
+					Vector3d b(grid->get(ix, iy, iz));
+					sum += b;
+					sum2 += b * b;
+					sumB += b.getR();
+					EXPECT_NEAR(b.getR(), strength->get(ix, iy, iz), 1e-6 * b.getR());
+				}
+		double N = 9 * 5 * 300;
+		Vector3f mean = meanFieldVector(grid);
+		EXPECT_NEAR(sum.x / N, mean.x, 1e-6 * std::abs(sum.x / N));
+		EXPECT_NEAR(sum.z / N, mean.z, 1e-6 * std::abs(sum.z / N));
+		EXPECT_NEAR(sumB / N, meanFieldStrength(grid), 1e-9 * sumB / N);
+		EXPECT_NEAR(sumB / N, meanFieldStrength(strength), 1e-6 * sumB / N);
+		double rms = std::sqrt((sum2.x + sum2.y + sum2.z) / N);
+		EXPECT_NEAR(rms, rmsFieldStrength(grid), 1e-9 * rms);
+		std::array<float, 3> axes = rmsFieldStrengthPerAxis(grid);
+		EXPECT_FLOAT_EQ(std::sqrt(sum2.y / N), axes[1]);
+
+		scaleGrid(grid, 2);
+		EXPECT_NEAR(2 * rms, rmsFieldStrength(grid), 1e-9 * rms);
+		if (variant == 1)
+			EXPECT_EQ(Vector3f(0.), grid->getGrid().back());
+	}
+}
+
 TEST(Grid3f, Periodicity) {
 	// Test for periodic boundaries: grid(x+a*n) = grid(x)
 	size_t n = 3;
@@ -566,6 +1339,148 @@ TEST(Grid3f, Periodicity) {
 	EXPECT_FLOAT_EQ(b.z, b2.z);
 }
 
+TEST(Grid3f, BrickedLayout) {
+	// same values and interpolation in both layouts, also across bricks
+	Grid3f linear(Vector3d(-1, 2, 0), 10, 13, 9, Vector3d(1, 0.5, 2));
+	for (int ix = 0; ix < 10; ix++)
+		for (int iy = 0; iy < 13; iy++)
+			for (int iz = 0; iz < 9; iz++)
+				linear.get(ix, iy, iz) = Vector3f(ix, iy + 0.5 * iz, sin(ix * iy - iz));
+	Grid3f bricked = linear;
+	bricked.setLayout(GridBricked);
+	EXPECT_EQ(GridBricked, bricked.getLayout());
+	EXPECT_EQ(2 * 2 * 2 * 512, bricked.getGrid().size());
+
+	Random random(uint32_t(5));
+	for (int reflective = 0; reflective < 2; reflective++) {
+		linear.setReflective(reflective);
+		bricked.setReflective(reflective);
+		for (int i = 0; i < 100; i++) {
+			Vector3d pos = random.randVector() * 30;
+			EXPECT_EQ(linear.interpolate(pos), bricked.interpolate(pos));
+			EXPECT_EQ(linear.closestValue(pos), bricked.closestValue(pos));
+		}
+	}
+
+	// positions of the values in getGrid
+	size_t i = &bricked.get(9, 4, 8) - &bricked.getGrid()[0];
+	EXPECT_EQ(linear.positionFromIndex(9 * 13 * 9 + 4 * 9 + 8), bricked.positionFromIndex(i));
+
+	bricked.setLayout(GridLinear);
+	EXPECT_EQ(10 * 13 * 9, bricked.getGrid().size());
+	EXPECT_EQ(linear.get(7, 12, 3), bricked.get(7, 12, 3));
+}
+
+TEST(Grid3f, BatchedInterpolation) {
+	Grid3f grid(Vector3d(-1, 2, 0), 10, 13, 9, Vector3d(1, 0.5, 2));
+	for (int ix = 0; ix < 10; ix++)
+		for (int iy = 0; iy < 13; iy++)
+			for (int iz = 0; iz < 9; iz++)
+				grid.get(ix, iy, iz) = Vector3f(ix, iy + 0.5 * iz, sin(ix * iy - iz));
+
+	// blocks of the vector kernel and a remainder
+	Random random(uint32_t(3));
+	Vector3d positions[21];
+	for (int i = 0; i < 21; i++)
+		positions[i] = random.randVector() * 40 * random.rand();
+	for (int variant = 0; variant < 3; variant++) {
+		grid.setReflective(variant == 1);
+		grid.setLayout((variant == 2) ? GridBricked : GridLinear);
+		Vector3f b[21];
+		grid.interpolate(positions, b, 21);
+		for (int i = 0; i < 21; i++) {
+			Vector3f expected = grid.interpolate(positions[i]);
+			EXPECT_NEAR(expected.x, b[i].x, 1e-5);
+			EXPECT_NEAR(expected.y, b[i].y, 1e-5);
+			EXPECT_NEAR(expected.z, b[i].z, 1e-5);
+		}
+	}
+}
+
+TEST(Grid3f, Placement) {
+	// a grid of several huge pages keeps its values when placed
+	Grid3f grid(Vector3d(0.), 64, 64, 96, 1.);
+	std::vector<Vector3f> &values = grid.getGrid();
+	for (size_t i = 0; i < values.size(); i++)
+		values[i] = Vector3f(i, -0.5 * i, i % 7);
+	std::vector<Vector3f> expected = values;
+
+	grid.setHugePages(true);
+	EXPECT_TRUE(grid.getHugePages());
+	grid.setPlacement(GridFirstTouch);
+	EXPECT_EQ(GridFirstTouch, grid.getPlacement());
+	EXPECT_TRUE(expected == grid.getGrid());
+	grid.setPlacement(GridInterleaved);
+	EXPECT_TRUE(expected == grid.getGrid());
+
+	// applied again to reallocated values
+	grid.setPlacement(GridFirstTouch);
+	grid.setLayout(GridBricked);
+	grid.setLayout(GridLinear);
+	EXPECT_TRUE(expected == grid.getGrid());
+
+	EXPECT_LE(1u, getNumaNodes().size());
+	EXPECT_LE(0, currentNumaNode());
+}
+
+TEST(Grid1f, Tricubic) {
+	// smooth periodic function on a coarse grid
+	Grid1f grid(Vector3d(0.), 12, 1);
+	for (int ix = 0; ix < 12; ix++)
+		for (int iy = 0; iy < 12; iy++)
+			for (int iz = 0; iz < 12; iz++) {
+				Vector3d p = grid.positionFromIndex(ix * 144 + iy * 12 + iz);
+				grid.get(ix, iy, iz) = sin(2 * M_PI * p.x / 12) * cos(2 * M_PI * (p.y + p.z) / 12);
+			}
+
+	double errorLinear = 0, errorCubic = 0;
+	Random random(uint32_t(7));
+	for (int i = 0; i < 200; i++) {
+		Vector3d p = random.randVector() * 30;
+		double exact = sin(2 * M_PI * p.x / 12) * cos(2 * M_PI * (p.y + p.z) / 12);
+		errorLinear = std::max(errorLinear, fabs(grid.interpolate(p) - exact));
+		grid.setTricubic(true);
+		errorCubic = std::max(errorCubic, fabs(grid.interpolate(p) - exact));
+		grid.setTricubic(false);
+	}
+	EXPECT_LT(errorCubic, 0.3 * errorLinear);
+
+	// interpolating, also at the reflective boundary
+	grid.setTricubic(true);
+	EXPECT_FLOAT_EQ(grid.get(3, 11, 0), grid.interpolate(grid.positionFromIndex(3 * 144 + 11 * 12)));
+	grid.setReflective(true);
+	EXPECT_FLOAT_EQ(grid.get(0, 11, 5), grid.interpolate(grid.positionFromIndex(11 * 12 + 5)));
+}
+
+TEST(AMRGrid1f, Refinement) {
+	// two root blocks with cells of 1, half of the first refined
+	AMRGrid1f grid(Vector3d(0.), 2, 1, 1, Vector3d(8.));
+	std::vector<float> v(512);
+	for (int b = 0; b < 2; b++) {
+		for (int i = 0; i < 512; i++)
+			v[i] = (8 * b + i / 64 + 0.5) + 2 * ((i / 8) % 8 + 0.5) + 3 * (i % 8 + 0.5);
+		grid.setBlock(0, b, 0, 0, &v[0]);
+	}
+	for (int i = 0; i < 512; i++)
+		v[i] = 0.5 * ((i / 64 + 0.5) + 2 * ((i / 8) % 8 + 0.5) + 3 * (i % 8 + 0.5));
+	grid.setBlock(1, 0, 0, 0, &v[0]);
+	grid.fillGhostCells();
+
+	EXPECT_EQ(10, grid.getNumberOfBlocks());
+	EXPECT_EQ(1, grid.getMaximumLevel());
+	EXPECT_EQ(1, grid.getLevel(Vector3d(1, 2, 3)));
+	EXPECT_EQ(0, grid.getLevel(Vector3d(9, 2, 3)));
+	EXPECT_FLOAT_EQ(0.25 + 2 * 0.25 + 3 * 0.75, grid.closestValue(Vector3d(0.1, 0.2, 0.6)));
+	// inherited from the parent
+	EXPECT_FLOAT_EQ(6.5 + 2 * 0.5 + 3 * 0.5, grid.closestValue(Vector3d(6.2, 0.2, 0.1)));
+
+	// linear inside the blocks and across the root blocks, periodic outside
+	EXPECT_NEAR(1.3 + 2 * 2.2 + 3 * 3.1, grid.interpolate(Vector3d(1.3, 2.2, 3.1)), 1e-4);
+	EXPECT_NEAR(8.1 + 2 * 2.2 + 3 * 3.1, grid.interpolate(Vector3d(8.1, 2.2, 3.1)), 1e-4);
+	EXPECT_NEAR(12.4 + 2 * 5.5 + 3 * 1.7, grid.interpolate(Vector3d(-3.6, 13.5, 9.7)), 1e-4);
+	EXPECT_THROW(grid.setBlock(1, 4, 0, 0, &v[0]), std::runtime_error);
+}
+
 TEST(Grid3f, DumpLoad) {
 	// Dump and load a field grid
 	ref_ptr<Grid3f> grid1 = new Grid3f(Vector3d(0.), 3, 1);
@@ -618,6 +1533,245 @@ TEST(Grid3f, DumpLoadTxt) {
 	}
 }
 
+TEST(Grid3f, WriteRead) {
+	// self-describing grid file with several tiles along each axis
+	ref_ptr<Grid3f> grid = new Grid3f(Vector3d(1, 0, -2), 70, 65, 130, Vector3d(1, 2, 0.5));
+	grid->setReflective(true);
+	for (int ix = 0; ix < 70; ix++)
+		for (int iy = 0; iy < 65; iy++)
+			for (int iz = 0; iz < 130; iz++)
+				grid->get(ix, iy, iz) = Vector3f(ix, iy, iz * 0.25);
+	writeGrid(grid, "testDump.raw", 2);
+
+	ref_ptr<Grid3f> read = readGrid3f("testDump.raw", 0.5);
+	EXPECT_EQ(70, read->getNx());
+	EXPECT_EQ(65, read->getNy());
+	EXPECT_EQ(130, read->getNz());
+	EXPECT_EQ(grid->getOrigin(), read->getOrigin());
+	EXPECT_EQ(grid->getSpacing(), read->getSpacing());
+	EXPECT_TRUE(read->isReflective());
+	EXPECT_EQ(grid->getGrid(), read->getGrid());
+	EXPECT_THROW(readGrid1f("testDump.raw"), std::runtime_error);
+
+	// a region across the tile boundaries
+	ref_ptr<Grid3f> region = readGrid3f("testDump.raw", 60, 1, 63, 10, 64, 3, 0.5);
+	EXPECT_EQ(Vector3d(61, 2, 29.5), region->getOrigin());
+	EXPECT_EQ(grid->get(65, 63, 64), region->get(5, 62, 1));
+	EXPECT_THROW(readGrid3f("testDump.raw", 61, 0, 0, 10, 1, 1), std::runtime_error);
+
+	// a damaged tile is detected
+	std::fstream f("testDump.raw", std::ios::in | std::ios::out | std::ios::binary);
+	f.seekp(-10, std::ios::end);
+	f.put(42);
+	f.close();
+	EXPECT_THROW(readGrid3f("testDump.raw"), std::runtime_error);
+
+	ref_ptr<Grid1f> scalar = new Grid1f(Vector3d(0.), 5, 1.);
+	scalar->get(1, 2, 3) = 7;
+	writeGrid(scalar, "testDump.raw", 1, 0);
+	EXPECT_EQ(7, readGrid1f("testDump.raw")->get(1, 2, 3));
+	remove("testDump.raw");
+}
+
+#ifdef CRPROPA_HAVE_HDF5
+TEST(Grid3f, DumpLoadHDF5) {
+	// more than one slab of planes, compressed chunks
+	ref_ptr<Grid3f> grid = new Grid3f(Vector3d(1, 0, -2), 40, 6, 7, Vector3d(1, 2, 0.5));
+	for (int ix = 0; ix < 40; ix++)
+		for (int iy = 0; iy < 6; iy++)
+			for (int iz = 0; iz < 7; iz++)
+				grid->get(ix, iy, iz) = Vector3f(ix, iy, iz * 0.25);
+	dumpGridHDF5(grid, "testDump.h5", "B", 2, 4);
+
+	ref_ptr<Grid3f> loaded = new Grid3f(Vector3d(0.), 40, 6, 7, 1.);
+	loaded->setLayout(GridBricked);
+	loadGridHDF5(loaded, "testDump.h5", "B", 0.5);
+	for (int ix = 0; ix < 40; ix++)
+		for (int iy = 0; iy < 6; iy++)
+			for (int iz = 0; iz < 7; iz++)
+				EXPECT_EQ(grid->get(ix, iy, iz), loaded->get(ix, iy, iz));
+
+	// a sub-volume, and a region outside of the dataset
+	ref_ptr<Grid3f> region = new Grid3f(Vector3d(0.), 3, 2, 4, 1.);
+	loadGridHDF5(region, "testDump.h5", "B", 35, 4, 3, 0.5);
+	EXPECT_EQ(grid->get(37, 5, 6), region->get(2, 1, 3));
+	EXPECT_THROW(loadGridHDF5(region, "testDump.h5", "B", 38, 0, 0), std::runtime_error);
+	EXPECT_THROW(loadGridHDF5(new Grid1f(Vector3d(0.), 40, 6, 7, 1.), "testDump.h5", "B"), std::runtime_error);
+	EXPECT_THROW(loadGridHDF5(loaded, "testDump.h5", "missing"), std::runtime_error);
+
+	// a scalar dataset in double precision, as written by simulation codes
+	std::vector<double> values(4 * 4 * 4);
+	for (size_t i = 0; i < values.size(); i++)
+		values[i] = i;
+	hsize_t dims[3] = {4, 4, 4};
+	hid_t file = H5Fcreate("testDump.h5", H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+	hid_t space = H5Screate_simple(3, dims, NULL);
+	hid_t dset = H5Dcreate2(file, "rho", H5T_NATIVE_DOUBLE, space, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+	H5Dwrite(dset, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, &values[0]);
+	H5Dclose(dset);
+	H5Sclose(space);
+	H5Fclose(file);
+	ref_ptr<Grid1f> rho = new Grid1f(Vector3d(0.), 4, 1.);
+	loadGridHDF5(rho, "testDump.h5", "rho");
+	EXPECT_EQ((1 * 4 + 2) * 4 + 3, rho->get(1, 2, 3));
+	remove("testDump.h5");
+}
+#endif // CRPROPA_HAVE_HDF5
+
+TEST(MappedGrid3f, DumpMap) {
+	// map a raw dump and a saved grid, the factor is applied lazily
+	ref_ptr<Grid3f> grid = new Grid3f(Vector3d(1, 0, -2), 4, 3, 5, Vector3d(1, 2, 0.5));
+	for (int ix = 0; ix < 4; ix++)
+		for (int iy = 0; iy < 3; iy++)
+			for (int iz = 0; iz < 5; iz++)
+				grid->get(ix, iy, iz) = Vector3f(ix, iy * iz, sin(ix + iy + iz));
+	dumpGrid(grid, "testMappedGrid.raw");
+	MappedGrid3f::save(*grid, "testMappedGrid.dat");
+
+	GridProperties properties(Vector3d(1, 0, -2), 4, 3, 5, Vector3d(1, 2, 0.5));
+	ref_ptr<MappedGrid3f> raw = new MappedGrid3f("testMappedGrid.raw", properties, 2);
+	ref_ptr<MappedGrid3f> saved = new MappedGrid3f("testMappedGrid.dat", 2);
+	EXPECT_EQ(5, saved->getNz());
+	EXPECT_EQ(Vector3d(1, 2, 0.5), saved->getSpacing());
+	EXPECT_EQ(grid->get(3, 2, 1) * 2, raw->get(3, 2, 1));
+	EXPECT_EQ(grid->get(3, 2, 1) * 2, saved->get(3, 2, 1));
+	Vector3d pos(-3.3, 4.1, 1.2);
+	Vector3f b = grid->interpolate(pos) * 2;
+	EXPECT_FLOAT_EQ(b.y, raw->interpolate(pos).y);
+	EXPECT_FLOAT_EQ(b.z, saved->interpolate(pos).z);
+	EXPECT_EQ(grid->closestValue(pos) * 2, saved->closestValue(pos));
+
+	// geometry and type do not match the files
+	GridProperties wrong(Vector3d(0.), 4, 1.);
+	EXPECT_THROW(MappedGrid3f("testMappedGrid.raw", wrong), std::runtime_error);
+	EXPECT_THROW(MappedGrid3f("testMappedGrid.raw"), std::runtime_error);
+	EXPECT_THROW(MappedGrid1f("testMappedGrid.dat"), std::runtime_error);
+	raw = 0;
+	saved = 0;
+	std::remove("testMappedGrid.raw");
+	std::remove("testMappedGrid.dat");
+}
+
+TEST(SlabDecomposition, Owner) {
+	// 10 cells of 2 m starting at 1 m in 3 slabs [0, 3), [3, 6), [6, 10)
+	SlabDecomposition d(1, 2, 10, 3);
+	EXPECT_EQ(3, d.getUpper(0));
+	EXPECT_EQ(6, d.getLower(2));
+	EXPECT_EQ(10, d.getUpper(2));
+	for (size_t ix = 0; ix < 10; ix++) {
+		int r = d.getOwnerOfCell(ix);
+		EXPECT_TRUE((d.getLower(r) <= ix) and (ix < d.getUpper(r)));
+	}
+	EXPECT_EQ(0, d.getOwner(Vector3d(1, 5, 5)));
+	EXPECT_EQ(1, d.getOwner(Vector3d(7.5, 0, 0)));
+	EXPECT_EQ(2, d.getOwner(Vector3d(20.9, 0, 0)));
+	// periodically continued
+	EXPECT_EQ(0, d.getOwner(Vector3d(21, 0, 0)));
+	EXPECT_EQ(2, d.getOwner(Vector3d(0.5, 0, 0)));
+	EXPECT_EQ(9, d.getCell(-19.5));
+	EXPECT_THROW(SlabDecomposition(0, 1, 2, 3), std::runtime_error);
+}
+
+TEST(QuantizedGrid3f, Interpolation) {
+	// quantized values and interpolation within the quantization error
+	ref_ptr<Grid3f> grid = new Grid3f(Vector3d(0.), 4, 2, 3, 1.5);
+	for (int ix = 0; ix < 4; ix++)
+		for (int iy = 0; iy < 2; iy++)
+			for (int iz = 0; iz < 3; iz++)
+				grid->get(ix, iy, iz) = Vector3f(sin(ix + 2 * iy), iz - 1.3, 0.1 * ix * iz);
+	QuantizedGrid3f quantized(*grid);
+	float scale = quantized.getScale();
+	EXPECT_FLOAT_EQ(pow(2, -14), scale);
+	EXPECT_EQ(4 * 2 * 3 * 3 * 2, quantized.getSizeOf());
+	EXPECT_FALSE(quantized.isMapped());
+
+	for (int i = 0; i < 100; i++) {
+		Vector3d pos(0.37 * i - 3, 0.11 * i, 7.1 - 0.23 * i);
+		Vector3f b = grid->interpolate(pos);
+		Vector3f q = quantized.interpolate(pos);
+		EXPECT_NEAR(b.x, q.x, scale);
+		EXPECT_NEAR(b.y, q.y, scale);
+		EXPECT_NEAR(b.z, q.z, scale);
+		EXPECT_NEAR(grid->closestValue(pos).y, quantized.closestValue(pos).y, scale);
+	}
+}
+
+TEST(QuantizedGrid1f, SaveMap) {
+	// +-1 are stored exactly, the saved grid is mapped
+	ref_ptr<Grid1f> grid = new Grid1f(Vector3d(1, 2, 3), 5, 2);
+	grid->setReflective(true);
+	for (int ix = 0; ix < 5; ix++)
+		for (int iy = 0; iy < 5; iy++)
+			for (int iz = 0; iz < 5; iz++)
+				grid->get(ix, iy, iz) = ((ix + iy * iz) % 2) ? 1 : -1;
+	QuantizedGrid1f(*grid).save("testQuantizedGrid.dat");
+
+	ref_ptr<QuantizedGrid1f> mapped = new QuantizedGrid1f("testQuantizedGrid.dat");
+	EXPECT_TRUE(mapped->isMapped());
+	EXPECT_TRUE(mapped->isReflective());
+	EXPECT_EQ(Vector3d(1, 2, 3), mapped->getOrigin());
+	EXPECT_EQ(5, mapped->getNz());
+	for (int ix = 0; ix < 5; ix++)
+		for (int iy = 0; iy < 5; iy++)
+			for (int iz = 0; iz < 5; iz++)
+				EXPECT_EQ(grid->get(ix, iy, iz), mapped->get(ix, iy, iz));
+	Vector3d pos(-3.3, 4.1, 17.2);
+	EXPECT_FLOAT_EQ(grid->interpolate(pos), mapped->interpolate(pos));
+	EXPECT_THROW(QuantizedGrid3f("testQuantizedGrid.dat"), std::runtime_error);
+	mapped = 0;
+	std::remove("testQuantizedGrid.dat");
+}
+
+TEST(QuantizedGrid1f, Encodings) {
+	// field strength over several orders of magnitude
+	ref_ptr<Grid1f> grid = new Grid1f(Vector3d(0.), 20, 1);
+	for (int ix = 0; ix < 20; ix++)
+		for (int iy = 0; iy < 20; iy++)
+			for (int iz = 0; iz < 20; iz++)
+				grid->get(ix, iy, iz) = pow(10, -0.3 * ix) * sin(0.7 * iy + 0.3 * iz);
+
+	QuantizedGrid1f half(*grid, GridFloat16);
+	QuantizedGrid1f block(*grid, GridBlockInt16);
+	EXPECT_EQ(GridFloat16, half.getEncoding());
+	EXPECT_EQ(0, half.getNumberOfBlocks());
+	EXPECT_EQ(27, block.getNumberOfBlocks());
+	for (int ix = 0; ix < 20; ix++)
+		for (int iy = 0; iy < 20; iy++)
+			for (int iz = 0; iz < 20; iz++) {
+				float v = grid->get(ix, iy, iz);
+				EXPECT_NEAR(v, half.get(ix, iy, iz), fabs(v) / 2048);
+			}
+	// the last blocks along x are scaled to their much smaller values
+	Vector3d pos(17.2, 4.7, 11.1);
+	float v = grid->interpolate(pos);
+	EXPECT_NEAR(v, half.interpolate(pos), 1e-3 * fabs(v));
+	EXPECT_NEAR(v, block.interpolate(pos), 1e-3 * fabs(v));
+	EXPECT_GT(fabs(v - QuantizedGrid1f(*grid).interpolate(pos)), 1e-2 * fabs(v));
+
+	block.save("testQuantizedGrid.dat");
+	ref_ptr<QuantizedGrid1f> mapped = new QuantizedGrid1f("testQuantizedGrid.dat");
+	EXPECT_EQ(GridBlockInt16, mapped->getEncoding());
+	EXPECT_EQ(block.getSizeOf(), mapped->getSizeOf());
+	for (int ix = 0; ix < 20; ix++)
+		EXPECT_EQ(block.get(ix, 3, 17), mapped->get(ix, 3, 17));
+	EXPECT_EQ(block.interpolate(pos), mapped->interpolate(pos));
+	mapped = 0;
+	std::remove("testQuantizedGrid.dat");
+}
+
+TEST(QuantizedGrid, halfPrecision) {
+	float values[] = {0, 1, -2.5, 65504, 1. / 3, 6.103515625e-05, 5.9604645e-08, 3e-06};
+	for (int i = 0; i < 8; i++)
+		EXPECT_NEAR(values[i], halfToFloat(floatToHalf(values[i])), fabs(values[i]) / 2048 + 3e-8);
+	EXPECT_EQ(0x3c00, floatToHalf(1));
+	EXPECT_EQ(0x7bff, floatToHalf(65504));
+	EXPECT_EQ(0x0001, floatToHalf(5.9604645e-08));
+	EXPECT_EQ(0x8000, floatToHalf(-0.));
+	EXPECT_EQ(0x7c00, floatToHalf(1e6));
+	EXPECT_EQ(0x3c00, floatToHalf(1 + 1. / 2048)); // tie to even
+	EXPECT_EQ(0x3c02, floatToHalf(1 + 3. / 2048));
+}
+
 TEST(Grid3f, Speed) {
 	// Dump and load a field grid
 	Grid3f grid(Vector3d(0.), 3, 3);
@@ -686,6 +1840,84 @@ TEST(EmissionMap, merge) {
 }
 
 
+TEST(EmissionMap, binary) {
+	EmissionMap em(36, 18, 10);
+	em.fillMap(1, 1 * EeV, Vector3d(1, 0, 0), 2);
+	em.fillMap(2, 10 * EeV, Vector3d(0, 1, 0));
+	// a dense map
+	ref_ptr<CylindricalProjectionMap> dense = em.getMap(3, 1 * EeV);
+	for (size_t k = 0; k < dense->getPdf().size(); k++)
+		dense->fillBin(k, k + 1);
+
+	std::vector<std::string> filenames;
+	for (int i = 0; i < 8; i++) {
+		filenames.push_back("testEmissionMap" + std::to_string(i) + ".bin");
+		em.saveBinary(filenames.back());
+	}
+
+	EmissionMap loaded(36, 18, 10);
+	loaded.load(filenames[0]);
+	EXPECT_EQ(3, loaded.getMaps().size());
+	EXPECT_EQ(em.getMap(1, 1 * EeV)->getPdf(), loaded.getMap(1, 1 * EeV)->getPdf());
+	EXPECT_EQ(dense->getPdf(), loaded.getMap(3, 1 * EeV)->getPdf());
+
+	// merged by several threads
+	EmissionMap merged(36, 18, 10);
+	merged.merge(filenames);
+	EXPECT_EQ(3, merged.getMaps().size());
+	ref_ptr<CylindricalProjectionMap> cpm = merged.getMap(1, 1 * EeV);
+	EXPECT_DOUBLE_EQ(16, cpm->getPdf()[cpm->binFromDirection(Vector3d(1, 0, 0))]);
+	EXPECT_DOUBLE_EQ(8 * 5, merged.getMap(3, 1 * EeV)->getPdf()[4]);
+
+	for (size_t i = 0; i < filenames.size(); i++)
+		std::remove(filenames[i].c_str());
+
+	// the energy binning has to match
+	EmissionMap other(36, 18, 20);
+	other.saveBinary(filenames[0]);
+	EXPECT_THROW(merged.merge(filenames[0]), std::runtime_error);
+	std::remove(filenames[0].c_str());
+}
+
+TEST(EmissionMap, finalize) {
+	EmissionMap em(36, 18, 10);
+	em.fillMap(1, 1 * EeV, Vector3d(1, 0, 0), 3);
+	em.fillMap(1, 1 * EeV, Vector3d(0, 1, 0), 1);
+	em.finalize();
+	ref_ptr<CylindricalProjectionMap> cpm = em.getMap(1, 1 * EeV);
+	EXPECT_TRUE(cpm->isFinalized());
+	EXPECT_THROW(cpm->fillBin(0), std::runtime_error);
+
+	// draws are shared 3:1 among the two filled bins
+	int n = 0, nx = 0;
+#pragma omp parallel for reduction(+:n,nx)
+	for (int i = 0; i < 4000; i++) {
+		Vector3d d;
+		if (em.drawDirection(1, 1 * EeV, d)) {
+			n++;
+			if (d.x > 0.5)
+				nx++;
+		}
+	}
+	EXPECT_EQ(4000, n);
+	EXPECT_NEAR(0.75, nx / 4000., 0.04);
+}
+
+TEST(EmissionMap, filler) {
+	ref_ptr<EmissionMap> em = new EmissionMap(36, 18, 10);
+	EmissionMapFiller filler(em);
+#pragma omp parallel for
+	for (int i = 0; i < 100; i++) {
+		Candidate c(1, 1 * EeV, Vector3d(0.), Vector3d(0, 1, 0));
+		filler.process(&c);
+	}
+	filler.flush();
+	ref_ptr<CylindricalProjectionMap> cpm = em->getMap(1, 1 * EeV);
+	size_t bin = cpm->binFromDirection(Vector3d(0, 1, 0));
+	EXPECT_DOUBLE_EQ(100, cpm->getPdf()[bin]);
+	EXPECT_EQ(1, em->getMaps().size());
+}
+
 TEST(Variant, copyToBuffer)
 {
 	double a = 23.42;
@@ -717,6 +1949,40 @@ TEST(Variant, stringConversion)
 	}
 }
 
+TEST(Variant, stringStorage)
+{
+	std::string longText(100, 'x');
+	Variant a("tag"), b(longText);
+	Variant c(a), d(b);
+	EXPECT_EQ("tag", c.asString());
+	EXPECT_EQ(longText, d.asString());
+
+	// assignment between strings and other types
+	c = 1.5;
+	EXPECT_DOUBLE_EQ(1.5, c.asDouble());
+	c = b;
+	EXPECT_EQ(longText, c.asString());
+	c = Variant();
+	EXPECT_FALSE(c.isValid());
+
+	// moves
+	Variant e(std::move(d));
+	EXPECT_EQ(longText, e.asString());
+	e = std::move(a);
+	EXPECT_EQ("tag", e.asString());
+	Variant f(int32_t(3));
+	f = std::move(e);
+	EXPECT_EQ("tag", f.asString());
+	f = Variant(int32_t(4));
+	EXPECT_EQ(4, f.asInt32());
+
+	std::vector<Variant> list(10, b);
+	list.insert(list.begin(), Variant("first"));
+	EXPECT_EQ("first", list[0].asString());
+	EXPECT_EQ(longText, list[10].asString());
+}
+
+
 
 TEST(Geometry, Plane)
 {
@@ -743,6 +2009,125 @@ TEST(Geometry, ParaxialBox)
 	EXPECT_NEAR(8., b.distance(Vector3d(-8., 0., 0.)), 1E-10);
 }
 
+TEST(Geometry, distanceAlong)
+{
+	double inf = std::numeric_limits<double>::infinity();
+	Plane p(Vector3d(0,0,1), Vector3d(0,0,1));
+	EXPECT_DOUBLE_EQ(1.25, p.distanceAlong(Vector3d(0, 0, 0), Vector3d(0, 0.6, 0.8)));
+	EXPECT_DOUBLE_EQ(inf, p.distanceAlong(Vector3d(0, 0, 0), Vector3d(0, 0, -1)));
+	EXPECT_DOUBLE_EQ(inf, p.distanceAlong(Vector3d(0, 0, 0), Vector3d(1, 0, 0)));
+
+	Sphere s(Vector3d(0,0,0), 1.);
+	EXPECT_DOUBLE_EQ(1., s.distanceAlong(Vector3d(0, 0, 0), Vector3d(1, 0, 0)));
+	EXPECT_DOUBLE_EQ(9., s.distanceAlong(Vector3d(10, 0, 0), Vector3d(-1, 0, 0)));
+	EXPECT_DOUBLE_EQ(inf, s.distanceAlong(Vector3d(10, 0, 0), Vector3d(1, 0, 0)));
+	EXPECT_DOUBLE_EQ(inf, s.distanceAlong(Vector3d(10, 2, 0), Vector3d(-1, 0, 0)));
+
+	ParaxialBox b(Vector3d(0,0,0), Vector3d(3,4,5));
+	EXPECT_NEAR(2.9, b.distanceAlong(Vector3d(0.1, 0.1, 0.1), Vector3d(1, 0, 0)), 1E-10);
+	EXPECT_NEAR(7., b.distanceAlong(Vector3d(10., 2., 1.), Vector3d(-1, 0, 0)), 1E-10);
+	EXPECT_NEAR(sqrt(2.), b.distanceAlong(Vector3d(1., 1., 1.), Vector3d(-1, -1, 0).getUnitVector()), 1E-10);
+	EXPECT_DOUBLE_EQ(inf, b.distanceAlong(Vector3d(10., 5., 1.), Vector3d(-1, 0, 0)));
+}
+
+TEST(Geometry, SurfaceCollection)
+{
+	// the hierarchy gives the same answers as testing every surface
+	Random random(7);
+	SurfaceCollection collection;
+	std::vector<ref_ptr<Surface> > surfaces;
+	for (int i = 0; i < 200; i++) {
+		Vector3d x(random.randUniform(-100, 100), random.randUniform(-100, 100), random.randUniform(-100, 100));
+		if (i % 2)
+			surfaces.push_back(new Sphere(x, random.randUniform(0.5, 5)));
+		else
+			surfaces.push_back(new ParaxialBox(x, Vector3d(random.randUniform(0.5, 5))));
+	}
+	surfaces.push_back(new Plane(Vector3d(0, 0, -90), Vector3d(0, 0, -1)));
+	for (size_t i = 0; i < surfaces.size(); i++)
+		collection.add(surfaces[i]);
+	EXPECT_EQ(surfaces.size(), collection.size());
+
+	Vector3d lower, upper;
+	EXPECT_FALSE(collection.getBoundingBox(lower, upper));
+
+	for (int n = 0; n < 200; n++) {
+		Vector3d x(random.randUniform(-120, 120), random.randUniform(-120, 120), random.randUniform(-120, 120));
+		Vector3d u = random.randVector();
+		Vector3d y = x + u * random.randUniform(0, 20);
+		double d = std::numeric_limits<double>::infinity();
+		double a = d, s = d, first = d;
+		long crossed = -1;
+		for (size_t i = 0; i < surfaces.size(); i++) {
+			d = std::min(d, surfaces[i]->distance(x));
+			a = std::min(a, fabs(surfaces[i]->distance(x)));
+			s = std::min(s, surfaces[i]->distanceAlong(x, u));
+			if (surfaces[i]->crossed(x, y) and surfaces[i]->distanceAlong(x, u) < first) {
+				first = surfaces[i]->distanceAlong(x, u);
+				crossed = i;
+			}
+		}
+		EXPECT_DOUBLE_EQ(d, collection.distance(x));
+		EXPECT_DOUBLE_EQ(a, collection.nearestDistance(x));
+		EXPECT_DOUBLE_EQ(s, collection.distanceAlong(x, u));
+		EXPECT_EQ(crossed, collection.crossedSurface(x, y));
+		EXPECT_EQ(crossed >= 0, collection.crossed(x, y));
+	}
+
+	// nested spheres: crossing the inner one is detected
+	SurfaceCollection shells;
+	shells.add(new Sphere(Vector3d(0.), 10));
+	shells.add(new Sphere(Vector3d(0.), 5));
+	EXPECT_DOUBLE_EQ(-10, shells.distance(Vector3d(0.)));
+	EXPECT_DOUBLE_EQ(1, shells.nearestDistance(Vector3d(4, 0, 0)));
+	EXPECT_EQ(1, shells.nearestSurface(Vector3d(4, 0, 0)));
+	EXPECT_EQ(1, shells.crossedSurface(Vector3d(4, 0, 0), Vector3d(6, 0, 0)));
+	EXPECT_EQ(-1, shells.crossedSurface(Vector3d(6, 0, 0), Vector3d(7, 0, 0)));
+	EXPECT_TRUE(shells.getBoundingBox(lower, upper));
+	EXPECT_DOUBLE_EQ(-10, lower.x);
+	EXPECT_DOUBLE_EQ(10, upper.z);
+}
+
+static int diagnosticMessages = 0;
+
+static int diagnosticMessage(int i) {
+	diagnosticMessages++;
+	return i;
+}
+
+static void diagnose(int i) {
+	CRPROPA_DIAGNOSTIC("testDiagnostics: site", "occurrence " << diagnosticMessage(i));
+}
+
+TEST(Diagnostics, rateLimit) {
+	std::ostringstream log;
+	kiss::Logger::setLogStream(log);
+	Diagnostics::setRateLimit(3, 1000);
+
+	for (int i = 0; i < 100; i++)
+		diagnose(i);
+	// the message is only evaluated when printed
+	EXPECT_EQ(3, diagnosticMessages);
+	EXPECT_EQ(100, Diagnostics::getOccurrences("testDiagnostics: site"));
+	EXPECT_NE(std::string::npos, log.str().find("occurrence 2 (further messages are rate limited)"));
+	EXPECT_EQ(std::string::npos, log.str().find("occurrence 3"));
+
+	std::string summary = Diagnostics::getSummary();
+	EXPECT_NE(std::string::npos, summary.find("testDiagnostics: site: 100 occurrences since the last summary, 100 in total, 3 printed"));
+	Diagnostics::printSummary();
+	EXPECT_EQ("", Diagnostics::getSummary());
+
+	// without interval every further occurrence is printed with the count
+	Diagnostics::setRateLimit(3, 0);
+	diagnose(100);
+	EXPECT_NE(std::string::npos, log.str().find("occurrence 100 (101 occurrences so far)"));
+
+	Diagnostics::reset();
+	EXPECT_EQ(0, Diagnostics::getOccurrences("testDiagnostics: site"));
+	Diagnostics::setRateLimit(10, 10);
+	kiss::Logger::setLogStream(std::cerr);
+}
+
 int main(int argc, char **argv) {
 	::testing::InitGoogleTest(&argc, argv);
 	return RUN_ALL_TESTS();
@@ -3,6 +3,7 @@
 #include "crpropa/massDistribution/Ferriere.h"
 #include "crpropa/massDistribution/Nakanishi.h"
 #include "crpropa/massDistribution/ConstantDensity.h"
+#include "crpropa/massDistribution/DensityGrid.h"
 #include "crpropa/Units.h"
 
 #include "gtest/gtest.h"
@@ -237,4 +238,42 @@ TEST(testFerriere, checkValueAtCertainPoints) {
 	std::string captured = testing::internal::GetCapturedStderr();
 	EXPECT_NE(captured.find("WARNING"), std::string::npos);
 }
+
+TEST(testDensityGrid, bakedModel) {
+	ref_ptr<DensityList> list = new DensityList();
+	list->addDensity(new ConstantDensity(1, 1, 2));
+	list->addDensity(new ConstantDensity(2, 3, 1));
+	DensityGrid grid(list, GridProperties(Vector3d(-1 * kpc), 4, 0.5 * kpc));
+
+	Vector3d p(50 * pc, 10 * pc, -30 * pc);
+	EXPECT_FLOAT_EQ(grid.getHIDensity(p), 3);
+	EXPECT_FLOAT_EQ(grid.getHIIDensity(p), 4);
+	EXPECT_FLOAT_EQ(grid.getH2Density(p), 3);
+	EXPECT_FLOAT_EQ(grid.getDensity(p), list->getDensity(p));
+	EXPECT_FLOAT_EQ(grid.getNucleonDensity(p), list->getNucleonDensity(p));
+	EXPECT_NEAR(grid.estimateError(), 0, 1e-6);
+
+	// zero outside of the grid volume
+	EXPECT_DOUBLE_EQ(grid.getDensity(Vector3d(1.5 * kpc, 0, 0)), 0);
+
+	// the error of an analytic model decreases with the grid spacing
+	ref_ptr<Nakanishi> nakanishi = new Nakanishi();
+	Vector3d origin(-10 * kpc, -10 * kpc, -1 * kpc);
+	DensityGrid coarse(nakanishi, GridProperties(origin, 20, 20, 4, Vector3d(1 * kpc, 1 * kpc, 0.5 * kpc)));
+	DensityGrid fine(nakanishi, GridProperties(origin, 80, 80, 40, Vector3d(0.25 * kpc, 0.25 * kpc, 0.05 * kpc)));
+	EXPECT_EQ(coarse.getIsForHI(), nakanishi->getIsForHI());
+	EXPECT_EQ(coarse.getIsForH2(), nakanishi->getIsForH2());
+	double coarseError = coarse.estimateError();
+	double fineError = fine.estimateError();
+	EXPECT_GT(coarseError, 0);
+	EXPECT_LT(fineError, coarseError);
+
+	// component grids
+	DensityGrid components(grid.getHIGrid(), NULL, grid.getH2Grid());
+	EXPECT_FALSE(components.getIsForHII());
+	EXPECT_FLOAT_EQ(components.getDensity(p), 6);
+	EXPECT_FLOAT_EQ(components.getNucleonDensity(p), 9);
+	EXPECT_THROW(components.estimateError(), std::runtime_error);
+}
+
 } //namespace crpropa
@@ -234,6 +234,45 @@ class DiffusionOneDirection(unittest.TestCase):
         # Step size is increased to maxStep
         self.assertAlmostEqual(c.getNextStep()/minStep, 5.) #AlmostEqual due to rounding error
 
+    def test_WeakOrder2Advection(self):
+
+        ConstAdvVec = crpropa.Vector3d(0., 1e6, 0.)
+        AdvField = crpropa.UniformAdvectionField(ConstAdvVec)
+
+        Dif = crpropa.DiffusionSDE(self.BField, AdvField, self.precision, self.minStep, self.maxStep, self.epsilon)
+        self.assertEqual(Dif.getScheme(), crpropa.DiffusionSDE.EulerMaruyama)
+        Dif.setScheme(crpropa.DiffusionSDE.WeakOrder2)
+        self.assertEqual(Dif.getScheme(), crpropa.DiffusionSDE.WeakOrder2)
+
+        c = crpropa.Candidate()
+        c.current.setId(crpropa.nucleusId(1,1))
+        c.current.setEnergy(10*TeV)
+        c.current.setDirection(crpropa.Vector3d(1,0,0))
+
+        # uniform advection: the corrector is exact, no perpendicular diffusion for epsilon = 0
+        Dif.process(c)
+        pos = c.current.getPosition()
+        self.assertAlmostEqual(pos.x, 0.)
+        self.assertAlmostEqual(pos.y, self.minStep/c_light*1e6)
+
+    def test_FieldDirectionGrid(self):
+        ConstMagVec = crpropa.Vector3d(1*nG, 0*nG, 0*nG)
+        BField = crpropa.UniformMagneticField(ConstMagVec)
+        Dif = crpropa.DiffusionSDE(BField, self.precision, self.minStep, self.maxStep, self.epsilon)
+        Dif.precomputeFieldDirection(crpropa.Vector3d(-10*pc), 8, 2.5*pc)
+        self.assertTrue(Dif.getFieldDirectionGrid() is not None)
+
+        c = crpropa.Candidate()
+        c.current.setId(crpropa.nucleusId(1,1))
+        c.current.setEnergy(10*TeV)
+
+        # parallel diffusion along the precomputed field direction only
+        Dif.process(c)
+        pos = c.current.getPosition()
+        self.assertNotEqual(pos.x, 0.)
+        self.assertAlmostEqual(pos.y, 0.)
+        self.assertAlmostEqual(pos.z, 0.)
+
     msg1 = "Note that this is a statistical test. It might fail by chance with a probabilty O(0.00001)! You should rerun the test to make sure there is a bug."
 
     def test_DiffusionEnergy10TeV(self):
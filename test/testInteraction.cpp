@@ -1,7 +1,15 @@
 #include "crpropa/Candidate.h"
 #include "crpropa/Units.h"
 #include "crpropa/ParticleID.h"
+#include "crpropa/Random.h"
 #include "crpropa/PhotonBackground.h"
+#include "crpropa/Cosmology.h"
+#include "crpropa/Diagnostics.h"
+#include "crpropa/DintOperator.h"
+#include "crpropa/InteractionRateEngine.h"
+#include "crpropa/IsotopeSelection.h"
+#include "crpropa/TableRegistry.h"
+#include "crpropa/PhotonPropagation.h"
 #include "crpropa/module/ElectronPairProduction.h"
 #include "crpropa/module/NuclearDecay.h"
 #include "crpropa/module/PhotoDisintegration.h"
@@ -12,8 +20,16 @@
 #include "crpropa/module/EMDoublePairProduction.h"
 #include "crpropa/module/EMTripletPairProduction.h"
 #include "crpropa/module/EMInverseComptonScattering.h"
+#include "crpropa/module/EMCascade.h"
+#include "crpropa/module/PhotonOutput1D.h"
+#include "crpropa/module/InteractionSampler.h"
+#include "crpropa/module/ContinuousLosses.h"
+#include "crpropa/module/SynchrotronRadiation.h"
+#include "sophia.h"
+#include "EleCa/Common.h"
 #include "gtest/gtest.h"
 
+#include <cstdio>
 #include <fstream>
 
 namespace crpropa {
@@ -22,23 +38,32 @@ namespace crpropa {
 TEST(ElectronPairProduction, allBackgrounds) {
 	// Test if interaction data files are loaded.
 	ref_ptr<PhotonField> CMB_instance = new CMB();
-	ElectronPairProduction epp(CMB_instance);
+	ElectronPairProduction epp(CMB_instance, true);
+	epp.prepare();
 	ref_ptr<PhotonField> IRB = new IRB_Kneiske04();
 	epp.setPhotonField(IRB);
+	epp.prepare();
 	IRB = new IRB_Stecker05();
 	epp.setPhotonField(IRB);
+	epp.prepare();
 	IRB = new IRB_Franceschini08();
 	epp.setPhotonField(IRB);
+	epp.prepare();
 	IRB = new IRB_Finke10();
 	epp.setPhotonField(IRB);
+	epp.prepare();
 	IRB = new IRB_Dominguez11();
 	epp.setPhotonField(IRB);
+	epp.prepare();
 	IRB = new IRB_Gilmore12();
 	epp.setPhotonField(IRB);
+	epp.prepare();
 	IRB = new IRB_Stecker16_upper();
 	epp.setPhotonField(IRB);
+	epp.prepare();
 	IRB = new IRB_Stecker16_lower();
 	epp.setPhotonField(IRB);
+	epp.prepare();
 }
 
 TEST(ElectronPairProduction, energyDecreasing) {
@@ -282,23 +307,32 @@ TEST(NuclearDecay, thisIsNotNucleonic) {
 TEST(PhotoDisintegration, allBackgrounds) {
 	// Test if interaction data files are loaded.
 	ref_ptr<PhotonField> CMB_instance = new CMB();
-	PhotoDisintegration pd(CMB_instance);
+	PhotoDisintegration pd(CMB_instance, true);
+	pd.prepare();
 	ref_ptr<PhotonField> IRB = new IRB_Kneiske04();
 	pd.setPhotonField(IRB);
+	pd.prepare();
 	IRB = new IRB_Stecker05();
 	pd.setPhotonField(IRB);
+	pd.prepare();
 	IRB = new IRB_Franceschini08();
 	pd.setPhotonField(IRB);
+	pd.prepare();
 	IRB = new IRB_Finke10();
 	pd.setPhotonField(IRB);
+	pd.prepare();
 	IRB = new IRB_Dominguez11();
 	pd.setPhotonField(IRB);
+	pd.prepare();
 	IRB = new IRB_Gilmore12();
 	pd.setPhotonField(IRB);
+	pd.prepare();
 	IRB = new IRB_Stecker16_upper();
 	pd.setPhotonField(IRB);
+	pd.prepare();
 	IRB = new IRB_Stecker16_lower();
 	pd.setPhotonField(IRB);
+	pd.prepare();
 }
 
 TEST(PhotoDisintegration, carbon) {
@@ -442,13 +476,112 @@ TEST(Photodisintegration, updateParticleParentProperties)
 }
 
 
+TEST(IsotopeSelection, closure) {
+	// protons only convert to neutrons and back
+	IsotopeSelection protons;
+	protons.addPrimary(nucleusId(1, 1));
+	EXPECT_EQ(2, protons.size());
+	EXPECT_TRUE(protons.contains(nucleusId(1, 0)));
+	EXPECT_FALSE(protons.contains(nucleusId(4, 2)));
+	EXPECT_FALSE(protons.contains(22)); // photons are not nuclei
+
+	ref_ptr<PhotonField> CMB_instance = new CMB();
+	ref_ptr<IsotopeSelection> helium = new IsotopeSelection();
+	helium->addPrimary(nucleusId(4, 2));
+	helium->addPhotonField(CMB_instance);
+	EXPECT_TRUE(helium->contains(nucleusId(3, 2)));
+	EXPECT_TRUE(helium->contains(nucleusId(3, 1)));
+	EXPECT_TRUE(helium->contains(nucleusId(2, 1)));
+	EXPECT_FALSE(helium->contains(nucleusId(7, 3)));
+	EXPECT_FALSE(helium->contains(nucleusId(12, 6)));
+
+	IsotopeSelection nitrogen(std::vector<int>(1, nucleusId(14, 7)));
+	EXPECT_TRUE(nitrogen.contains(nucleusId(12, 6)));
+	EXPECT_FALSE(nitrogen.contains(nucleusId(28, 14)));
+	EXPECT_NE(nitrogen.getKey(), helium->getKey());
+}
+
+TEST(PhotoDisintegration, isotopeSelection) {
+	// only the tables of the selected nuclei are loaded
+	ref_ptr<PhotonField> CMB_instance = new CMB();
+	PhotoDisintegration full(CMB_instance);
+	PhotoDisintegration pd(CMB_instance);
+	ref_ptr<IsotopeSelection> isotopes = new IsotopeSelection();
+	isotopes->addPrimary(nucleusId(14, 7));
+	pd.setIsotopeSelection(isotopes);
+	full.prepare();
+	pd.prepare();
+	EXPECT_LT(pd.getMemoryUsage(), full.getMemoryUsage());
+
+	Candidate c(nucleusId(12, 6), 100 * EeV);
+	EXPECT_GT(pd.getInteractionRate(&c), 0);
+	EXPECT_DOUBLE_EQ(full.getInteractionRate(&c), pd.getInteractionRate(&c));
+	c.current.setId(nucleusId(56, 26));
+	EXPECT_GT(full.getInteractionRate(&c), 0);
+	EXPECT_EQ(0, pd.getInteractionRate(&c));
+}
+
+TEST(PhotoDisintegration, continuousLoss) {
+	// tables of C-12 only: constant rate of 1 / Mpc, emitting a neutron or an
+	// alpha particle, i.e. 1 proton and 1.5 neutrons lost per interaction
+	{
+		std::ofstream rate("pd_continuous_rate.txt");
+		std::ofstream branching("pd_continuous_branching.txt");
+		rate << "6 6";
+		branching << "6 6 100000";
+		for (int i = 0; i < 201; i++) {
+			rate << " 1";
+			branching << " 0.5";
+		}
+		branching << "\n6 6 1";
+		for (int i = 0; i < 201; i++)
+			branching << " 0.5";
+		rate << "\n";
+		branching << "\n";
+	}
+	PhotoDisintegration pd(new CMB());
+	pd.initRate("pd_continuous_rate.txt");
+	pd.initBranching("pd_continuous_branching.txt");
+	std::remove("pd_continuous_rate.txt");
+	std::remove("pd_continuous_branching.txt");
+	pd.setContinuousLoss(true);
+	EXPECT_TRUE(pd.getContinuousLoss());
+
+	// 1.5 protons and 2.25 neutrons expected over 1.5 Mpc
+	Candidate c(nucleusId(12, 6), 120 * EeV);
+	c.setCurrentStep(1.5 * Mpc);
+	c.setNextStep(std::numeric_limits<double>::max());
+	pd.process(&c);
+	EXPECT_EQ(nucleusId(9, 5), c.current.getId());
+	EXPECT_DOUBLE_EQ(90 * EeV, c.current.getEnergy());
+	ASSERT_EQ(3, c.secondaries.size());
+	EXPECT_EQ(nucleusId(1, 1), c.secondaries[0]->current.getId());
+	EXPECT_EQ(nucleusId(1, 0), c.secondaries[2]->current.getId());
+	EXPECT_DOUBLE_EQ(10 * EeV, c.secondaries[2]->current.getEnergy());
+	EXPECT_NEAR(0.5, c.getProperty("ContinuousLoss.protons").asDouble(), 1e-9);
+	EXPECT_NEAR(0.25, c.getProperty("ContinuousLoss.neutrons").asDouble(), 1e-9);
+	EXPECT_DOUBLE_EQ(0.1 * Mpc, c.getNextStep());
+}
+
+TEST(NuclearDecay, isotopeSelection) {
+	// Sc-44 is not reachable from nitrogen and does not decay
+	NuclearDecay d;
+	d.setIsotopeSelection(new IsotopeSelection(std::vector<int>(1, nucleusId(14, 7))));
+	Candidate c(nucleusId(44, 21), 1E18 * eV);
+	c.setCurrentStep(100 * Mpc);
+	d.process(&c);
+	EXPECT_EQ(nucleusId(44, 21), c.current.getId());
+}
+
 // ElasticScattering ----------------------------------------------------------
 TEST(ElasticScattering, allBackgrounds) {
 	// Test if interaction data files are loaded.
 	ref_ptr<PhotonField> CMB_instance = new CMB();
 	ElasticScattering scattering(CMB_instance);
+	scattering.prepare();
 	ref_ptr<PhotonField> IRB = new IRB_Kneiske04();
 	scattering.setPhotonField(IRB);
+	scattering.prepare();
 }
 
 TEST(ElasticScattering, secondaries) {
@@ -475,26 +608,65 @@ TEST(ElasticScattering, secondaries) {
 }
 
 // PhotoPionProduction --------------------------------------------------------
+// exposes both photon samplers of PhotonFieldSampling
+class ComparePhotonSampling: public PhotonFieldSampling {
+public:
+	ComparePhotonSampling(int bgFlag) : PhotonFieldSampling(bgFlag) {}
+	using PhotonFieldSampling::sampleTable;
+	double meanLogEps(bool tabulated, bool onProton, double E, double z, int n) {
+		double sum = 0;
+		for (int i = 0; i < n; i++) {
+			double eps = tabulated ? sampleTable(onProton, E, z) : sampleRejection(onProton, E, z);
+			sum += std::log(eps);
+		}
+		return sum / n;
+	}
+};
+
+TEST(PhotonFieldSampling, tabulated) {
+	// the tabulated sampling reproduces SOPHIA's rejection sampling
+	Random::seedThreads(12345);
+	ComparePhotonSampling cmb(1);
+	EXPECT_NEAR(cmb.meanLogEps(false, true, 1e11, 0., 5000), cmb.meanLogEps(true, true, 1e11, 0., 5000), 0.02);
+	EXPECT_NEAR(cmb.meanLogEps(false, false, 3e10, 1., 5000), cmb.meanLogEps(true, false, 3e10, 1., 5000), 0.02);
+	ComparePhotonSampling irb(2);
+	EXPECT_NEAR(irb.meanLogEps(false, true, 1e8, 1., 5000), irb.meanLogEps(true, true, 1e8, 1., 5000), 0.03);
+
+	// below threshold and outside of the tables
+	EXPECT_EQ(0., cmb.sample_eps(true, 1e8, 0.));
+	EXPECT_LT(cmb.sampleTable(true, 1e15, 0.), 0.);
+	EXPECT_LT(irb.sampleTable(true, 1e10, 6.), 0.);
+}
+
 TEST(PhotoPionProduction, allBackgrounds) {
 	// Test if all interaction data files can be loaded.
 	ref_ptr<PhotonField> CMB_instance = new CMB();
 	PhotoPionProduction ppp(CMB_instance);
+	ppp.prepare();
 	ref_ptr<PhotonField> IRB = new IRB_Kneiske04();
 	ppp.setPhotonField(IRB);
+	ppp.prepare();
 	IRB = new IRB_Stecker05();
 	ppp.setPhotonField(IRB);
+	ppp.prepare();
 	IRB = new IRB_Franceschini08();
 	ppp.setPhotonField(IRB);
+	ppp.prepare();
 	IRB = new IRB_Finke10();
 	ppp.setPhotonField(IRB);
+	ppp.prepare();
 	IRB = new IRB_Dominguez11();
 	ppp.setPhotonField(IRB);
+	ppp.prepare();
 	IRB = new IRB_Gilmore12();
 	ppp.setPhotonField(IRB);
+	ppp.prepare();
 	IRB = new IRB_Stecker16_upper();
 	ppp.setPhotonField(IRB);
+	ppp.prepare();
 	IRB = new IRB_Stecker16_lower();
 	ppp.setPhotonField(IRB);
+	ppp.prepare();
 }
 
 TEST(PhotoPionProduction, proton) {
@@ -567,6 +739,662 @@ TEST(PhotoPionProduction, secondaries) {
 	EXPECT_GT(c.secondaries.size(), 1);
 }
 
+TEST(PhotoPionProduction, continuousLoss) {
+	// constant rates of 1 / Mpc on protons and neutrons
+	{
+		std::ofstream rate("ppp_continuous_rate.txt");
+		for (int i = 0; i <= 20; i++)
+			rate << 6 + 0.5 * i << " 1 1\n";
+	}
+	PhotoPionProduction ppp(new CMB(), true, true, true);
+	ppp.initRate("ppp_continuous_rate.txt");
+	std::remove("ppp_continuous_rate.txt");
+	ppp.setContinuousLoss(true);
+	EXPECT_TRUE(ppp.getContinuousLoss());
+
+	// a proton loses the mean fraction of its energy
+	double inelasticity = 1 - 938. / 1232.;
+	Candidate c(nucleusId(1, 1), 100 * EeV);
+	c.setCurrentStep(2 * Mpc);
+	c.setNextStep(std::numeric_limits<double>::max());
+	ppp.process(&c);
+	EXPECT_EQ(nucleusId(1, 1), c.current.getId());
+	EXPECT_NEAR(100 * EeV * exp(-2 * inelasticity), c.current.getEnergy(), 1e-6 * EeV);
+	EXPECT_NEAR(0.1 * Mpc / inelasticity, c.getNextStep(), 1e-9 * Mpc);
+
+	// which the averaged secondaries carry
+	EXPECT_EQ(5, c.secondaries.size());
+	double E = c.current.getEnergy();
+	for (size_t i = 0; i < c.secondaries.size(); i++)
+		E += c.secondaries[i]->current.getEnergy() * c.secondaries[i]->getWeight();
+	EXPECT_NEAR(100 * EeV, E, 1e-6 * EeV);
+
+	// helium loses a proton and a neutron of 1.35 expected each over 1 Mpc
+	Candidate he(nucleusId(4, 2), 400 * EeV);
+	he.setCurrentStep(1 * Mpc);
+	ppp.process(&he);
+	EXPECT_EQ(nucleusId(2, 1), he.current.getId());
+	EXPECT_DOUBLE_EQ(200 * EeV, he.current.getEnergy());
+	EXPECT_EQ(nucleusId(1, 1), he.secondaries[0]->current.getId());
+	EXPECT_DOUBLE_EQ((1 - inelasticity) * 100 * EeV, he.secondaries[0]->current.getEnergy());
+	double expected = 0.85 * pow(2, 2. / 3) - 1;
+	EXPECT_NEAR(expected, he.getProperty("ContinuousLoss.protons").asDouble(), 1e-9);
+	EXPECT_NEAR(expected, he.getProperty("ContinuousLoss.neutrons").asDouble(), 1e-9);
+}
+
+TEST(SynchrotronRadiation, binnedEmission) {
+	// electron of 100 TeV radiating photons of on average some keV
+	SynchrotronRadiation binned(1 * muG, true);
+	binned.setSecondaryThreshold(0);
+	binned.setBinnedEmission(4);
+	EXPECT_EQ(4, binned.getBinnedEmission());
+	SynchrotronRadiation unbinned(1 * muG, true);
+	unbinned.setSecondaryThreshold(0);
+
+	Candidate b(11, 100 * TeV), u(11, 100 * TeV);
+	b.setCurrentStep(1e-3 * pc);
+	u.setCurrentStep(1e-3 * pc);
+	binned.process(&b);
+	unbinned.process(&u);
+	double dE = 100 * TeV - b.current.getEnergy();
+	EXPECT_GT(dE, 0);
+	EXPECT_DOUBLE_EQ(dE, 100 * TeV - u.current.getEnergy());
+
+	// the radiated energy is that of the weighted secondaries, up to the
+	// rounding of the difference of the energies
+	double Eb = 0, Nb = 0, Eu = 0;
+	for (size_t i = 0; i < b.secondaries.size(); i++) {
+		Eb += b.secondaries[i]->current.getEnergy() * b.secondaries[i]->getWeight();
+		Nb += b.secondaries[i]->getWeight();
+	}
+	for (size_t i = 0; i < u.secondaries.size(); i++)
+		Eu += u.secondaries[i]->current.getEnergy() * u.secondaries[i]->getWeight();
+	EXPECT_NEAR(1, Eb / dE, 1e-7);
+	EXPECT_NEAR(1, Eu / dE, 0.01);
+
+	// one secondary per bin of the 8 decades of the spectrum instead of many
+	// photons, for as many photons
+	EXPECT_GT(b.secondaries.size(), 0);
+	EXPECT_LE(b.secondaries.size(), 8 * 4);
+	EXPECT_GT(u.secondaries.size(), 100 * b.secondaries.size());
+	EXPECT_NEAR(1, Nb / u.secondaries.size(), 0.05);
+
+	// in the same range, up to the width of a bin
+	double minB = b.secondaries[0]->current.getEnergy(), maxB = minB;
+	for (size_t i = 0; i < b.secondaries.size(); i++) {
+		minB = std::min(minB, b.secondaries[i]->current.getEnergy());
+		maxB = std::max(maxB, b.secondaries[i]->current.getEnergy());
+	}
+	for (size_t i = 0; i < u.secondaries.size(); i++) {
+		EXPECT_GE(u.secondaries[i]->current.getEnergy(), minB / 2);
+		EXPECT_LE(u.secondaries[i]->current.getEnergy(), maxB * 2);
+	}
+}
+
+// access to the rate slices and the bilinear interpolation of the tables
+class SliceRatePhotoPionProduction: public PhotoPionProduction {
+public:
+	SliceRatePhotoPionProduction() : PhotoPionProduction(new BlackbodyPhotonField("warm", 10), false, false, false, false, 0.1, true) {}
+	double slice(double gamma, double z) const {
+		return sliceRate(gamma, z, true);
+	}
+	double bilinear(double gamma, double z) const {
+		return interpolate2d(z, gamma, redshiftAxis, lorentzAxis, tabProtonRate);
+	}
+};
+
+TEST(PhotoPionProduction, sliceRate) {
+	// rates growing as (1 + z)^3 and with the Lorentz factor
+	{
+		std::ofstream rate("ppp_slice_rate.txt");
+		for (int i = 0; i <= 4; i++)
+			for (int j = 0; j <= 16; j++)
+				rate << 0.25 * i << " " << 6 + 0.5 * j << " " << pow(1 + 0.25 * i, 3) * (1 + j) << " 1\n";
+	}
+	SliceRatePhotoPionProduction ppp;
+	ppp.initRate("ppp_slice_rate.txt");
+	std::remove("ppp_slice_rate.txt");
+	double tolerance = 0.01;
+	ppp.setRedshiftTolerance(tolerance);
+
+	double gamma = 3.3e9;
+	double zBin = 37 * tolerance;
+	for (int k = 0; k < 2; k++) {
+		// at the redshift of a bin the rate is the bilinear interpolation
+		EXPECT_NEAR(1, ppp.slice(gamma, zBin) / ppp.bilinear(gamma, zBin), 1e-12);
+		// inside the bin and at its edge that of the bin, and so within the
+		// change of the rate over half the tolerance
+		double zInside = zBin + 0.3 * tolerance;
+		double zEdge = zBin + 0.4999 * tolerance;
+		EXPECT_DOUBLE_EQ(ppp.slice(gamma, zBin), ppp.slice(gamma, zInside));
+		EXPECT_DOUBLE_EQ(ppp.slice(gamma, zBin), ppp.slice(gamma, zEdge));
+		double change = ppp.bilinear(gamma, zEdge) - ppp.bilinear(gamma, zBin);
+		EXPECT_GT(change, 0);
+		EXPECT_LE(std::fabs(ppp.slice(gamma, zEdge) - ppp.bilinear(gamma, zEdge)), change * (1 + 1e-12));
+		// one tolerance away the rate of the next bin
+		EXPECT_NEAR(1, ppp.slice(gamma, zBin + tolerance) / ppp.bilinear(gamma, zBin + tolerance), 1e-12);
+		// the slices of other bins do not change the result, also when
+		// more bins are used than slices kept
+		for (int i = 0; i < 20; i++)
+			ppp.slice(gamma, 0.5 + i * tolerance);
+	}
+
+	// the mean free paths of the slices are within the tolerance
+	double slicedMFP = ppp.nucleonMFP(gamma, zBin + 0.4 * tolerance, true);
+	ppp.setRedshiftTolerance(0);
+	double bilinearMFP = ppp.nucleonMFP(gamma, zBin + 0.4 * tolerance, true);
+	EXPECT_NEAR(1, slicedMFP / bilinearMFP, 5 * tolerance);
+	EXPECT_NE(slicedMFP, bilinearMFP);
+}
+
+TEST(PhotoPionProduction, sophiaConcurrent) {
+	// SOPHIA events only depend on the random generator of the calling
+	// thread, also when called concurrently
+	const int n = 64;
+	std::vector<double> serial(n), parallel(n);
+	for (int k = 0; k < 2; k++) {
+		std::vector<double> &energy = k ? parallel : serial;
+#pragma omp parallel for if(k)
+		for (int i = 0; i < n; i++) {
+			Random::instance().seed(i);
+			int nature = i % 2;
+			double Ein = 1e11; // GeV
+			double eps = 1e-12; // GeV
+			double outputEnergy[5][2000];
+			int outPartID[2000];
+			int nParticles;
+			sophiaevent_(nature, Ein, eps, outputEnergy, outPartID, nParticles);
+			energy[i] = 0;
+			for (int j = 0; j < nParticles; j++)
+				energy[i] += outputEnergy[3][j];
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		EXPECT_NEAR(1e11, serial[i], 1e8); // energy conservation
+		EXPECT_EQ(serial[i], parallel[i]);
+	}
+}
+
+TEST(SophiaEventLibrary, generateSaveLoad) {
+	// Tabulated events conserve energy and survive a round trip to file
+	SophiaEventLibrary library;
+	library.generate(20, 4, 0, 2);
+	EXPECT_EQ(4, library.getNumberOfBins());
+	EXPECT_EQ(160, library.getNumberOfEvents());
+
+	std::string filename = "sophia_event_library_test.bin";
+	library.save(filename);
+	SophiaEventLibrary loaded(filename);
+	std::remove(filename.c_str());
+	EXPECT_EQ(library.getNumberOfEvents(), loaded.getNumberOfEvents());
+	EXPECT_EQ(library.getNumberOfParticles(), loaded.getNumberOfParticles());
+
+	double outEnergy[2000];
+	int outPartID[2000];
+	int nParticles;
+	double Ein = 1e11; // GeV
+	for (int i = 0; i < 50; i++) {
+		double eps = pow(10, 2. * (i + 0.5) / 50) / Ein;
+		EXPECT_TRUE(loaded.sample(i % 2, Ein, eps, outPartID, outEnergy, nParticles));
+		double energy = 0;
+		int nucleons = 0;
+		for (int j = 0; j < nParticles; j++) {
+			energy += outEnergy[j];
+			if ((outPartID[j] == 13) or (outPartID[j] == 14))
+				nucleons++;
+		}
+		EXPECT_NEAR(Ein, energy, 1e-3 * Ein);
+		EXPECT_GE(nucleons, 1);
+	}
+	// outside of the tabulated range
+	EXPECT_FALSE(loaded.sample(0, Ein, 1e3 / Ein, outPartID, outEnergy, nParticles));
+	EXPECT_THROW(SophiaEventLibrary("nonexistent_library.bin"), std::runtime_error);
+}
+
+// TabularPhotonField ---------------------------------------------------------
+TEST(TabularPhotonField, resampled) {
+	// a blackbody field tabulated at a few redshifts, evaluated on the
+	// resampled grid as the linear interpolation of the tabulated values
+	ref_ptr<PhotonField> blackbody = new BlackbodyPhotonField("Blackbody", 2.73);
+	std::vector<double> energies, redshifts, densities;
+	for (int i = 0; i < 100; i++)
+		energies.push_back(pow(10, -6 + 0.04 * i) * eV);
+	redshifts.push_back(0);
+	redshifts.push_back(0.5);
+	redshifts.push_back(2);
+	for (size_t i = 0; i < energies.size(); i++)
+		for (size_t j = 0; j < redshifts.size(); j++)
+			densities.push_back(blackbody->getPhotonDensity(energies[i]) / (1 + redshifts[j]));
+	ref_ptr<TabularPhotonField> field = new TabularPhotonField("Tabulated", energies, densities, redshifts);
+	EXPECT_TRUE(field->hasRedshiftDependence());
+
+	// tabulated points
+	for (size_t i = 0; i < energies.size(); i += 7)
+		for (size_t j = 0; j < redshifts.size(); j++)
+			EXPECT_NEAR(densities[j + i * 3], field->getPhotonDensity(energies[i], redshifts[j]),
+					1e-9 * densities[j + i * 3]);
+	// in between, close to the interpolation in energy and redshift
+	for (size_t i = 10; i < 90; i += 3) {
+		double e = sqrt(energies[i] * energies[i + 1]);
+		double n0 = (densities[i * 3] + densities[(i + 1) * 3]) / 2;
+		EXPECT_NEAR(n0, field->getPhotonDensity(e, 0), 0.01 * n0);
+		EXPECT_NEAR(n0 * (1 / 1.5 + 1 / 3.) / 2, field->getPhotonDensity(e, 1.25),
+				0.01 * n0);
+	}
+	// outside of the tabulated ranges
+	EXPECT_EQ(0, field->getPhotonDensity(energies.front() / 2, 0));
+	EXPECT_EQ(0, field->getPhotonDensity(energies.back() * 2, 0));
+	EXPECT_EQ(0, field->getPhotonDensity(energies[50], 2.1));
+	EXPECT_EQ(1, field->getRedshiftScaling(-1));
+	EXPECT_EQ(0, field->getRedshiftScaling(3));
+	EXPECT_NEAR(1 / 1.5, field->getRedshiftScaling(0.5), 1e-9);
+
+	// batched evaluation
+	std::vector<double> batch = field->getPhotonDensities(energies, 0.7);
+	for (size_t i = 0; i < energies.size(); i++)
+		EXPECT_EQ(field->getPhotonDensity(energies[i], 0.7), batch[i]);
+
+	// without redshift dependence the ends are continued
+	std::vector<double> densities0;
+	for (size_t i = 0; i < energies.size(); i++)
+		densities0.push_back(densities[i * 3]);
+	TabularPhotonField constant("Constant", energies, densities0);
+	EXPECT_EQ(densities0.front(), constant.getPhotonDensity(energies.front() / 2));
+	EXPECT_EQ(densities0.back(), constant.getPhotonDensity(energies.back() * 2, 5));
+	EXPECT_NEAR(densities0[20], constant.getPhotonDensity(energies[20]), 1e-9 * densities0[20]);
+	EXPECT_THROW(TabularPhotonField("Short", std::vector<double>(1, eV), std::vector<double>(1, 1)),
+			std::runtime_error);
+}
+
+// InteractionRateEngine ------------------------------------------------------
+TEST(InteractionRateEngine, blackbody) {
+	// Rates computed for a CMB-like field under a new name are found by the
+	// modules and agree with known values
+	ref_ptr<PhotonField> field = new BlackbodyPhotonField("RateEngineTest", 2.73);
+	InteractionRateEngine engine(field, "rate_engine_test_cache");
+	EXPECT_EQ(engine.getFieldHash(), InteractionRateEngine(field, "rate_engine_test_cache").getFieldHash());
+	ref_ptr<PhotonField> warmer = new BlackbodyPhotonField("RateEngineTest", 2.74);
+	EXPECT_NE(engine.getFieldHash(), InteractionRateEngine(warmer).getFieldHash());
+
+	engine.computeAll();
+	engine.install();
+
+	// Thomson limit: sigma_T * n_CMB
+	EMInverseComptonScattering ics(field);
+	Candidate electron(11, 1 * GeV);
+	EXPECT_NEAR(2.75e-20, ics.getInteractionRate(&electron), 0.03e-20);
+
+	// minimum photon mean free path of about 8 kpc at a few PeV
+	EMPairProduction pp(field);
+	Candidate photon(22, 3 * PeV);
+	double lambda = 1 / pp.getInteractionRate(&photon);
+	EXPECT_GT(lambda, 6 * kpc);
+	EXPECT_LT(lambda, 9 * kpc);
+
+	// GZK: mean free path of a few Mpc at 1e21 eV
+	PhotoPionProduction ppp(field);
+	double mfp = ppp.nucleonMFP(1e21 * eV / mass_proton / c_squared, 0, true);
+	EXPECT_GT(mfp, 3 * Mpc);
+	EXPECT_LT(mfp, 6 * Mpc);
+}
+
+TEST(InteractionRateEngine, spatialPhotonField) {
+	// the rates of a field varying with position interpolate those of its cells
+	ref_ptr<PhotonField> cold = new BlackbodyPhotonField("RateEngineCellCold", 2.73);
+	ref_ptr<PhotonField> warm = new BlackbodyPhotonField("RateEngineCellWarm", 5.46);
+	ref_ptr<SpatialPhotonField> field = new SpatialPhotonField("RateEngineSpatial",
+			Vector3d(0.), Vector3d(1 * kpc), 3, 1, 1);
+	field->setCellField(0, 0, 0, cold);
+	field->setCellField(1, 0, 0, warm);
+	field->setCellField(2, 0, 0, warm);
+	EXPECT_EQ(3, field->getNumberOfCells());
+	EXPECT_DOUBLE_EQ(1.5 * kpc, field->getCellCenter(1).x);
+	double e = 1e-3 * eV;
+	EXPECT_DOUBLE_EQ(cold->getPhotonDensity(e), field->getPhotonDensity(e, Vector3d(0.2, 5, 5) * kpc));
+	EXPECT_DOUBLE_EQ((cold->getPhotonDensity(e) + warm->getPhotonDensity(e)) / 2,
+			field->getPhotonDensity(e, Vector3d(1, 0, 0) * kpc));
+	EXPECT_DOUBLE_EQ((cold->getPhotonDensity(e) + 2 * warm->getPhotonDensity(e)) / 3,
+			field->getPhotonDensity(e));
+
+	InteractionRateEngine engine(field, "rate_engine_test_cache");
+	engine.computeEMInverseComptonScattering();
+	engine.install();
+
+	EMInverseComptonScattering spatial(field);
+	EMInverseComptonScattering ics1(cold), ics2(warm);
+	Candidate c(11, 1 * TeV, Vector3d(0.5, 0, 0) * kpc);
+	double rate1 = ics1.getInteractionRate(&c);
+	double rate2 = ics2.getInteractionRate(&c);
+	EXPECT_GT(rate2, 4 * rate1);
+	EXPECT_DOUBLE_EQ(rate1, spatial.getInteractionRate(&c));
+	c.current.setPosition(Vector3d(1.25, 0, 0) * kpc);
+	EXPECT_DOUBLE_EQ(0.25 * rate1 + 0.75 * rate2, spatial.getInteractionRate(&c));
+	c.current.setPosition(Vector3d(10, 0, 0) * kpc);
+	EXPECT_DOUBLE_EQ(rate2, spatial.getInteractionRate(&c));
+
+	// secondaries from the tables of the nearest cell
+	c.setCurrentStep(100 * Mpc);
+	spatial.performInteraction(&c);
+	EXPECT_LT(c.current.getEnergy(), 1 * TeV);
+
+	SpatialPhotonField incomplete("Incomplete", Vector3d(0.), Vector3d(1.), 2, 1, 1);
+	incomplete.setCellField(0, 0, 0, cold);
+	EXPECT_THROW(incomplete.getPhotonDensity(e), std::runtime_error);
+	EXPECT_THROW(incomplete.setCellField(2, 0, 0, cold), std::runtime_error);
+}
+
+TEST(TableRegistry, sharedModuleTables) {
+	// modules for the same field share their cumulative rate tables
+	ref_ptr<PhotonField> field = new BlackbodyPhotonField("RateEngineTest", 2.73);
+	InteractionRateEngine engine(field, "rate_engine_test_cache");
+	engine.computeEMPairProduction();
+	engine.install();
+
+	TableRegistry::releaseUnused();
+	size_t n = TableRegistry::size();
+	ref_ptr<EMPairProduction> pp1 = new EMPairProduction(field, true);
+	EXPECT_EQ(n, TableRegistry::size()); // loaded on first use
+	pp1->prepare();
+	EXPECT_EQ(n + 1, TableRegistry::size());
+	ref_ptr<EMPairProduction> pp2 = new EMPairProduction(field, true);
+	pp2->prepare();
+	EXPECT_EQ(n + 1, TableRegistry::size());
+
+	// tables stay registered while in use
+	pp1 = 0;
+	EXPECT_EQ(0, TableRegistry::releaseUnused());
+	pp2 = 0;
+	EXPECT_EQ(1, TableRegistry::releaseUnused());
+	EXPECT_EQ(n, TableRegistry::size());
+}
+
+TEST(TableRegistry, lazyModuleTables) {
+	// tables are loaded once on first use, and only those needed
+	ref_ptr<PhotonField> field = new BlackbodyPhotonField("RateEngineTest", 2.73);
+	InteractionRateEngine engine(field, "rate_engine_test_cache");
+	engine.computeEMPairProduction();
+	engine.computeElectronPairProduction();
+	engine.install();
+
+	TableRegistry::releaseUnused();
+	size_t n = TableRegistry::size();
+	EMPairProduction pp(field);
+	pp.setPhotonField(field);
+	EXPECT_EQ(0, pp.getMemoryUsage());
+	pp.prepare();
+	EXPECT_GT(pp.getMemoryUsage(), 0);
+	EXPECT_EQ(n, TableRegistry::size()); // no cumulative rates without electrons
+	pp.setHaveElectrons(true);
+	pp.prepare();
+	EXPECT_EQ(n + 1, TableRegistry::size());
+
+	// the pair spectrum is not computed by the engine, nor needed without electrons
+	ElectronPairProduction epp(field);
+	Candidate c(nucleusId(1, 1), 100 * EeV);
+	c.setCurrentStep(1 * Mpc);
+	EXPECT_NO_THROW(epp.process(&c));
+	EXPECT_LT(c.current.getEnergy(), 100 * EeV);
+	epp.setHaveElectrons(true);
+	EXPECT_THROW(epp.prepare(), std::runtime_error);
+
+	// the run prepares its modules
+	ref_ptr<EMPairProduction> module = new EMPairProduction(field);
+	ref_ptr<ModuleList> modules = new ModuleList();
+	modules->add(module);
+	ModuleList::candidate_vector_t candidates;
+	modules->run(&candidates);
+	EXPECT_GT(module->getMemoryUsage(), 0);
+}
+
+// EMCascade ------------------------------------------------------------------
+TEST(EMCascade, energyThreshold) {
+	// particles below the threshold are collected with their weights
+	EMCascade m;
+	m.setEnergyThreshold(1 * PeV);
+
+	Candidate above(22, 10 * PeV);
+	m.process(&above);
+	EXPECT_TRUE(above.isActive());
+
+	Candidate below(22, 100 * TeV, Vector3d(10.5, 0, 0) * Mpc);
+	below.setWeight(2);
+	m.process(&below);
+	EXPECT_FALSE(below.isActive());
+	Candidate electron(11, 100 * TeV, Vector3d(10.5, 0, 0) * Mpc);
+	electron.setWeight(0.5);
+	m.process(&electron);
+
+	m.save("em_cascade_test.txt");
+	std::ifstream in("em_cascade_test.txt");
+	in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+	double D, logE, nPhotons, nElectrons, nPositrons;
+	double sumPhotons = 0, sumElectrons = 0;
+	while (in >> D >> logE >> nPhotons >> nElectrons >> nPositrons) {
+		if (nPhotons > 0 or nElectrons > 0) {
+			EXPECT_NEAR(10.5, D, 0.5);
+			EXPECT_NEAR(14, logE, 0.1);
+		}
+		sumPhotons += nPhotons;
+		sumElectrons += nElectrons;
+	}
+	in.close();
+	std::remove("em_cascade_test.txt");
+	EXPECT_DOUBLE_EQ(2, sumPhotons);
+	EXPECT_DOUBLE_EQ(0.5, sumElectrons);
+
+	EXPECT_THROW(m.getCascadeSpectrum(2212), std::runtime_error);
+}
+
+TEST(EMCascade, threads) {
+	// the histograms of all threads are summed when saved
+	EMCascade m;
+#pragma omp parallel for
+	for (int i = 0; i < 1000; i++) {
+		Candidate c(i % 2 ? 22 : -11, 100 * TeV, Vector3d(10.5, 0, 0) * Mpc);
+		m.process(&c);
+	}
+
+	m.save("em_cascade_test.txt");
+	std::ifstream in("em_cascade_test.txt");
+	in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+	double D, logE, nPhotons, nElectrons, nPositrons;
+	double sumPhotons = 0, sumPositrons = 0;
+	while (in >> D >> logE >> nPhotons >> nElectrons >> nPositrons) {
+		sumPhotons += nPhotons;
+		sumPositrons += nPositrons;
+	}
+	in.close();
+	std::remove("em_cascade_test.txt");
+	EXPECT_DOUBLE_EQ(500, sumPhotons);
+	EXPECT_DOUBLE_EQ(500, sumPositrons);
+}
+
+TEST(DintPropagation, arraySizes) {
+	// particle arrays of different length are rejected before running DINT
+	std::vector<int> ids(2, 22);
+	std::vector<double> energies(2, 1 * EeV);
+	std::vector<double> distances(1, 10 * Mpc);
+	std::vector<double> weights;
+	EXPECT_THROW(DintPropagation(ids, energies, distances, weights), std::runtime_error);
+	distances.push_back(20 * Mpc);
+	weights.push_back(1);
+	EXPECT_THROW(DintPropagation(ids, energies, distances, weights), std::runtime_error);
+}
+
+TEST(DintPropagation, binaryInput) {
+	// the binary format of PhotonOutput1D is recognized, other versions are
+	// rejected before running DINT
+	const char *filename = "dint_binary_test.dat";
+	{
+		std::ofstream out(filename, std::ios::binary);
+		uint32_t header[2] = {99, sizeof(PhotonOutput1D::Record)};
+		out.write("CRPPH1D", 8);
+		out.write((const char *) header, sizeof(header));
+	}
+	EXPECT_THROW(DintPropagation(filename, "dint_binary_test.txt"), std::runtime_error);
+	std::remove(filename);
+	std::remove("dint_binary_test.txt");
+}
+
+// DintOperator ---------------------------------------------------------------
+static std::vector<double> dintTestIdentity(int nE) {
+	int n = 3 * nE;
+	std::vector<double> step(n * n, 0);
+	for (int k = 0; k < n; k++)
+		step[k * n + k] = 1;
+	return step;
+}
+
+TEST(DintOperator, fold) {
+	DintOperator op(40 * Mpc, 4);
+	int nE = op.getNumberOfEnergyBins();
+	EXPECT_EQ(170, nE);
+	std::vector<double> identity = dintTestIdentity(nE);
+	for (int iD = 0; iD < 4; iD++)
+		op.setStep(iD, identity);
+	EXPECT_TRUE(op.isBuilt());
+
+	// distance bin 2 turns photons into electrons of the same energy
+	std::vector<double> conversion(9 * nE * nE, 0);
+	for (int k = 0; k < nE; k++) {
+		conversion[k * 3 * nE + nE + k] = 1;
+		conversion[(nE + k) * 3 * nE + nE + k] = 1;
+		conversion[(2 * nE + k) * 3 * nE + 2 * nE + k] = 1;
+	}
+	op.setStep(2, conversion);
+
+	std::vector<double> injection(3 * 4 * nE, 0);
+	injection[3 * nE + 50] = 2; // photons in distance bin 3
+	injection[1 * nE + 60] = 1; // photons in distance bin 1
+	injection[(2 * 4 + 0) * nE + 70] = 0.5; // positrons in distance bin 0
+	std::vector<double> spectrum = op.fold(injection);
+	ASSERT_EQ(3 * nE, spectrum.size());
+	EXPECT_DOUBLE_EQ(0, spectrum[50]);
+	EXPECT_DOUBLE_EQ(2, spectrum[nE + 50]);
+	EXPECT_DOUBLE_EQ(1, spectrum[60]);
+	EXPECT_DOUBLE_EQ(0.5, spectrum[2 * nE + 70]);
+
+	std::vector<double> photons(3 * nE, 0);
+	photons[10] = 1;
+	EXPECT_DOUBLE_EQ(1, op.propagate(photons, 3)[nE + 10]);
+	EXPECT_DOUBLE_EQ(1, op.propagate(photons, 1)[10]);
+
+	// the operators of the bins passed on the way are needed
+	DintOperator partial(40 * Mpc, 4);
+	partial.setStep(0, identity);
+	EXPECT_FALSE(partial.isBuilt());
+	EXPECT_DOUBLE_EQ(1, partial.propagate(photons, 0)[10]);
+	EXPECT_THROW(partial.propagate(photons, 1), std::runtime_error);
+}
+
+TEST(DintOperator, save) {
+	DintOperator op(40 * Mpc, 4, 2, 3, 1 * nG, 0.5);
+	int nE = op.getNumberOfEnergyBins();
+	std::vector<double> step(9 * nE * nE);
+	for (size_t i = 0; i < step.size(); i++)
+		step[i] = i % 7;
+	op.setStep(1, step);
+	op.save("dint_operator_test.dat");
+
+	DintOperator loaded("dint_operator_test.dat");
+	std::remove("dint_operator_test.dat");
+	EXPECT_DOUBLE_EQ(40 * Mpc, loaded.getMaximumDistance());
+	EXPECT_EQ(4, loaded.getNumberOfDistanceBins());
+	EXPECT_EQ(2, loaded.getIRBFlag());
+	EXPECT_EQ(3, loaded.getRadioFlag());
+	EXPECT_DOUBLE_EQ(1 * nG, loaded.getMagneticField());
+	EXPECT_DOUBLE_EQ(0.5, loaded.getCutCascade());
+	EXPECT_TRUE(loaded.getStep(0).empty());
+	EXPECT_TRUE(loaded.getStep(1) == step);
+	EXPECT_FALSE(loaded.isBuilt());
+
+	std::ofstream out("dint_operator_test.dat");
+	out << "no operator";
+	out.close();
+	EXPECT_THROW(DintOperator("dint_operator_test.dat"), std::runtime_error);
+	std::remove("dint_operator_test.dat");
+}
+
+TEST(DintOperator, errors) {
+	EXPECT_THROW(DintOperator(0, 4), std::runtime_error);
+	EXPECT_THROW(DintOperator(40 * Mpc, 0), std::runtime_error);
+	DintOperator op(40 * Mpc, 4);
+	EXPECT_THROW(op.setStep(0, std::vector<double>(10)), std::runtime_error);
+	EXPECT_THROW(op.setStep(4, dintTestIdentity(170)), std::runtime_error);
+	EXPECT_THROW(op.getStep(-1), std::runtime_error);
+	EXPECT_THROW(op.fold(std::vector<double>(10)), std::runtime_error);
+	EXPECT_THROW(op.buildStep(4), std::runtime_error);
+}
+
+TEST(DintOperator, EMCascade) {
+	// with identity operators the cascade spectrum is the summed histogram
+	DintOperator op(40 * Mpc, 4);
+	for (int iD = 0; iD < 4; iD++)
+		op.setStep(iD, dintTestIdentity(170));
+
+	EMCascade m;
+	EXPECT_THROW(m.runCascade(op), std::runtime_error);
+	m.setDistanceBinning(40 * Mpc, 4);
+	Candidate photon(22, 1.05e14 * eV, Vector3d(25, 0, 0) * Mpc);
+	photon.setWeight(2);
+	m.process(&photon);
+	Candidate electron(11, 1.05e14 * eV, Vector3d(5, 0, 0) * Mpc);
+	m.process(&electron);
+
+	m.runCascade(op);
+	int iE = (14 - 7) * 10;
+	EXPECT_DOUBLE_EQ(2, m.getCascadeSpectrum(22)[iE]);
+	EXPECT_DOUBLE_EQ(1, m.getCascadeSpectrum(11)[iE]);
+	EXPECT_DOUBLE_EQ(0, m.getCascadeSpectrum(-11)[iE]);
+
+	// the histograms are cleared
+	m.runCascade(op);
+	EXPECT_DOUBLE_EQ(0, m.getCascadeSpectrum(22)[iE]);
+}
+
+TEST(DintOperator, DintPropagation) {
+	DintOperator op(40 * Mpc, 4);
+	for (int iD = 0; iD < 4; iD++)
+		op.setStep(iD, dintTestIdentity(170));
+
+	std::vector<int> ids;
+	std::vector<double> energies, distances, weights;
+	ids.push_back(22); energies.push_back(1.05e14 * eV); distances.push_back(25 * Mpc); weights.push_back(2);
+	ids.push_back(-11); energies.push_back(1.05e14 * eV); distances.push_back(5 * Mpc); weights.push_back(1);
+	ids.push_back(2212); energies.push_back(1.05e14 * eV); distances.push_back(5 * Mpc); weights.push_back(1);
+	ids.push_back(22); energies.push_back(1.05e14 * eV); distances.push_back(50 * Mpc); weights.push_back(1);
+	std::vector<double> spectrum = DintPropagation(ids, energies, distances, weights, op);
+	ASSERT_EQ(3 * 170, spectrum.size());
+	int iE = (14 - 7) * 10;
+	EXPECT_DOUBLE_EQ(2, spectrum[iE]);
+	EXPECT_DOUBLE_EQ(1, spectrum[2 * 170 + iE]);
+	double sum = 0;
+	for (size_t i = 0; i < spectrum.size(); i++)
+		sum += spectrum[i];
+	EXPECT_DOUBLE_EQ(3, sum);
+}
+
+// EleCa ----------------------------------------------------------------------
+static double elecaTestUniform(double min, double max) {
+	return min;
+}
+
+TEST(EleCa, uniformStreams) {
+	// each thread draws from a stream seeded with seed + thread number
+	eleca::setSeed(42);
+	double first = eleca::Uniform(0, 1);
+	eleca::setSeed(42);
+	EXPECT_DOUBLE_EQ(first, eleca::Uniform(0, 1));
+	eleca::setSeed(41);
+	EXPECT_NE(first, eleca::Uniform(0, 1));
+
+	// the callback replaces the generator until the next setSeed
+	eleca::setUniformCallback(elecaTestUniform);
+	EXPECT_DOUBLE_EQ(0.5, eleca::Uniform(0.5, 1));
+	eleca::setSeed(42);
+	EXPECT_DOUBLE_EQ(first, eleca::Uniform(0, 1));
+}
+
 // Redshift -------------------------------------------------------------------
 TEST(Redshift, simpleTest) {
 	// Test if redshift is decreased and adiabatic energy loss is applied.
@@ -650,6 +1478,40 @@ TEST(EMPairProduction, secondaries) {
 	}
 }
 
+TEST(EMPairProduction, thinning) {
+	// Thinned secondaries conserve the weighted energy on average
+	ref_ptr<PhotonField> field = new BlackbodyPhotonField("RateEngineTest", 2.73);
+	InteractionRateEngine engine(field, "rate_engine_test_cache");
+	engine.computeEMPairProduction();
+	engine.install();
+	EMPairProduction m(field, true, 0.1, 1);
+	EXPECT_EQ(1, m.getThinning());
+
+	double Ep = 1 * PeV;
+	double sumE = 0;
+	size_t nSecondaries = 0;
+	int n = 2000;
+	for (int i = 0; i < n; i++) {
+		Candidate c(22, Ep);
+		c.setWeight(2);
+		m.performInteraction(&c);
+		nSecondaries += c.secondaries.size();
+		for (size_t j = 0; j < c.secondaries.size(); j++)
+			sumE += c.secondaries[j]->getWeight() * c.secondaries[j]->current.getEnergy();
+	}
+	EXPECT_NEAR(2 * Ep, sumE / n, 0.05 * 2 * Ep);
+	EXPECT_NEAR(1, double(nSecondaries) / n, 0.05); // one secondary on average
+
+	// without thinning both secondaries carry the primary weight
+	m.setThinning(0);
+	Candidate c(22, Ep);
+	c.setWeight(2);
+	m.performInteraction(&c);
+	EXPECT_EQ(2, c.secondaries.size());
+	EXPECT_EQ(2, c.secondaries[0]->getWeight());
+	EXPECT_EQ(2, c.secondaries[1]->getWeight());
+}
+
 // EMDoublePairProduction -----------------------------------------------------
 TEST(EMDoublePairProduction, limitNextStep) {
 	// Test if the interaction limits the next propagation step.
@@ -821,6 +1683,173 @@ TEST(EMInverseComptonScattering, secondaries) {
 	}
 }
 
+// InteractionSampler --------------------------------------------------------
+class ConstantRate: public Module {
+	double rate;
+public:
+	mutable int interactions;
+	ConstantRate(double rate) : rate(rate), interactions(0) {
+	}
+	void process(Candidate *candidate) const {
+	}
+	bool hasInteractionRate() const {
+		return true;
+	}
+	double getInteractionRate(const Candidate *candidate) const {
+		return rate;
+	}
+	void performStochasticInteraction(Candidate *candidate) const {
+		interactions++;
+	}
+};
+
+class CountSteps: public Module {
+public:
+	mutable int steps;
+	CountSteps() : steps(0) {
+	}
+	void process(Candidate *candidate) const {
+		steps++;
+	}
+};
+
+TEST(InteractionSampler, competingRates) {
+	ref_ptr<ConstantRate> a = new ConstantRate(1 / Mpc);
+	ref_ptr<ConstantRate> b = new ConstantRate(3 / Mpc);
+	ref_ptr<CountSteps> continuous = new CountSteps();
+	InteractionSampler sampler(0.5);
+	sampler.add(a);
+	sampler.add(b);
+	sampler.add(continuous);
+	EXPECT_EQ(2, sampler.getNumberOfInteractions());
+
+	Random::instance().seed(1);
+	Candidate c;
+	int n = 10000;
+	for (int i = 0; i < n; i++) {
+		c.setCurrentStep(0.5 * Mpc);
+		c.setNextStep(10 * Mpc);
+		sampler.process(&c);
+		// limited to half the mean free path of the total rate
+		EXPECT_DOUBLE_EQ(0.125 * Mpc, c.getNextStep());
+	}
+	EXPECT_EQ(n, continuous->steps);
+
+	// expected 2 interactions per step, a quarter of them from the first module
+	int total = a->interactions + b->interactions;
+	EXPECT_NEAR(2 * n, total, 5 * sqrt(2 * n));
+	EXPECT_NEAR(0.25, a->interactions / double(total), 0.01);
+}
+
+TEST(InteractionSampler, eventDriven) {
+	// neutral particles jump from one interaction to the next
+	ref_ptr<ConstantRate> a = new ConstantRate(1 / Mpc);
+	InteractionSampler sampler;
+	sampler.add(a);
+	sampler.setEventDriven(true);
+
+	Random::instance().seed(1);
+	Candidate c(22, 1 * EeV);
+	c.setCurrentStep(0);
+	c.setNextStep(1 * Gpc);
+	sampler.process(&c);
+	EXPECT_EQ(0, a->interactions);
+
+	int n = 10000;
+	double length = 0;
+	for (int i = 0; i < n; i++) {
+		double step = c.getNextStep();
+		length += step;
+		c.setCurrentStep(step);
+		c.setNextStep(1 * Gpc);
+		sampler.process(&c);
+		EXPECT_EQ(i + 1, a->interactions);
+	}
+	// exponential distances with the mean free path
+	EXPECT_NEAR(1 * Mpc, length / n, 0.05 * Mpc);
+
+	// a shorter step uses up part of the optical depth
+	double step = c.getNextStep();
+	c.setCurrentStep(step / 2);
+	c.setNextStep(1 * Gpc);
+	sampler.process(&c);
+	EXPECT_EQ(n, a->interactions);
+	EXPECT_NEAR(step / 2, c.getNextStep(), 1e-9 * step);
+}
+
+TEST(InteractionSampler, noRate) {
+	InteractionSampler sampler;
+	sampler.add(new ConstantRate(0));
+	Candidate c;
+	c.setCurrentStep(1 * Mpc);
+	c.setNextStep(10 * Mpc);
+	sampler.process(&c);
+	EXPECT_DOUBLE_EQ(10 * Mpc, c.getNextStep());
+}
+
+// ContinuousLosses ----------------------------------------------------------
+class FractionalLoss: public Module {
+	double k;
+public:
+	FractionalLoss(double k) : k(k) {
+	}
+	void process(Candidate *candidate) const {
+	}
+	bool hasEnergyLossRate() const {
+		return true;
+	}
+	double getEnergyLossRate(const Candidate *candidate, double E, double z) const {
+		return k * E;
+	}
+};
+
+TEST(ContinuousLosses, combinedRate) {
+	// two losses dE/dx = -k E integrate to E0 exp(-(k1 + k2) x)
+	ContinuousLosses losses;
+	losses.add(new FractionalLoss(1 / Mpc));
+	losses.add(new FractionalLoss(2 / Mpc));
+	EXPECT_EQ(2, losses.size());
+	EXPECT_THROW(losses.add(new CountSteps()), std::runtime_error);
+
+	Candidate c(11, 100 * EeV);
+	c.setCurrentStep(1 * Mpc);
+	c.setNextStep(10 * Mpc);
+	losses.process(&c);
+	EXPECT_NEAR(100 * exp(-3.), c.current.getEnergy() / EeV, 1e-6);
+	// limited to the total loss length
+	EXPECT_DOUBLE_EQ(1 / 3. * Mpc, c.getNextStep());
+}
+
+TEST(ContinuousLosses, subStepLimit) {
+	// 20000 sub-steps of 0.05 loss lengths, half of the step is integrated
+	ContinuousLosses losses(1000);
+	losses.add(new FractionalLoss(1 / Mpc));
+	Candidate c(11, 100 * EeV);
+	c.setCurrentStep(1000 * Mpc);
+	c.setNextStep(10 * Gpc);
+	uint64_t reported = Diagnostics::getOccurrences("ContinuousLosses: sub-step limit reached, step only partly integrated");
+	losses.process(&c);
+	EXPECT_EQ(reported + 1, Diagnostics::getOccurrences("ContinuousLosses: sub-step limit reached, step only partly integrated"));
+	EXPECT_NEAR(500, c.getNextStep() / Mpc, 1e-6);
+
+	double E = 100 * EeV, z = 0;
+	EXPECT_NEAR(500, losses.integrate(&c, 1000 * Mpc, E, z) / Mpc, 1e-6);
+	EXPECT_DOUBLE_EQ(1 * Mpc, losses.integrate(&c, 1 * Mpc, E, z));
+}
+
+TEST(ContinuousLosses, redshift) {
+	// adiabatic loss E ~ 1 + z, with the redshift updated along
+	ContinuousLosses losses;
+	losses.add(new Redshift());
+	Candidate c(11, 100 * EeV);
+	c.setRedshift(1);
+	c.setCurrentStep(500 * Mpc);
+	losses.process(&c);
+	double z = c.getRedshift();
+	EXPECT_LT(z, 1);
+	EXPECT_NEAR(comovingDistance2Redshift(redshift2ComovingDistance(1) - 500 * Mpc), z, 1e-3);
+	EXPECT_NEAR(100 * (1 + z) / 2, c.current.getEnergy() / EeV, 1e-6);
+}
 
 int main(int argc, char **argv) {
 	::testing::InitGoogleTest(&argc, argv);
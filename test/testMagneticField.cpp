@@ -1,12 +1,22 @@
 #include <stdexcept>
+#include <cstdio>
 
 #include "crpropa/magneticField/MagneticFieldGrid.h"
+#include "crpropa/magneticField/CachedMagneticField.h"
+#include "crpropa/magneticField/JF12Field.h"
+#include "crpropa/magneticField/JF12FieldSolenoidal.h"
 #include "crpropa/Grid.h"
+#include "crpropa/GridTools.h"
 #include "crpropa/Units.h"
 #include "crpropa/Common.h"
+#include "crpropa/Random.h"
 
 #include "gtest/gtest.h"
 
+#ifdef CRPROPA_HAVE_HDF5
+#include <hdf5.h>
+#endif
+
 using namespace crpropa;
 
 TEST(testUniformMagneticField, SimpleTest) {
@@ -31,6 +41,98 @@ TEST(testMagneticDipoleField, SimpleTest) {
 	EXPECT_NEAR(b2.getZ(), -1 * mu0 / (4*M_PI), 1E-8);
 }
 
+TEST(DistributedMagneticFieldGrid, Slabs) {
+	// Bx = sin(2 pi x / 8), periodic on 8 x 4 x 4 grid points
+	ref_ptr<Grid3f> grid = new Grid3f(Vector3d(0.), 8, 4, 4, 1.);
+	for (int ix = 0; ix < 8; ix++)
+		for (int iy = 0; iy < 4; iy++)
+			for (int iz = 0; iz < 4; iz++)
+				grid->get(ix, iy, iz) = Vector3f(sin(M_PI * (ix + 0.5) / 4), iy, 1);
+	MagneticFieldGrid full(grid);
+	dumpGrid(grid, "testDistributed.raw");
+	GridProperties p(Vector3d(0.), 8, 4, 4, 1.);
+
+	for (int rank = 0; rank < 3; rank++) {
+		DistributedMagneticFieldGrid field("testDistributed.raw", p, rank, 3, 1);
+		ref_ptr<SlabDecomposition> d = field.getDecomposition();
+		EXPECT_EQ(d->getUpper(rank) - d->getLower(rank) + 2, field.getLocalGrid()->getNx());
+
+		// exact in the slab and its periodic images
+		for (int i = 0; i < 40; i++) {
+			Vector3d pos(-16 + i * 0.8, 0.3 * i, 1.7);
+			if (not field.isLocal(pos))
+				continue;
+			Vector3d b = field.getField(pos), b0 = full.getField(pos);
+			EXPECT_NEAR(b0.x, b.x, 1e-6);
+			EXPECT_NEAR(b0.y, b.y, 1e-6);
+		}
+	}
+	std::remove("testDistributed.raw");
+
+	DistributedMagneticFieldGrid field(grid, 1, 3, 1);
+	Vector3d pos[2] = {Vector3d(3.2, 1, 1), Vector3d(12.1, 2.5, 1)};
+	Vector3d b[2];
+	field.getFields(pos, NULL, b, 2);
+	for (int i = 0; i < 2; i++)
+		EXPECT_NEAR(full.getField(pos[i]).x, b[i].x, 1e-6);
+	grid->setReflective(true);
+	EXPECT_THROW(DistributedMagneticFieldGrid(grid, 0, 2), std::runtime_error);
+}
+
+#ifdef CRPROPA_HAVE_HDF5
+static void writeFLASHDataset(hid_t file, const char *name, hid_t type, int rank,
+		const hsize_t *dims, const void *data) {
+	hid_t space = H5Screate_simple(rank, dims, NULL);
+	hid_t dset = H5Dcreate2(file, name, type, space, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+	H5Dwrite(dset, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, data);
+	H5Dclose(dset);
+	H5Sclose(space);
+}
+
+TEST(AMRMagneticFieldGrid, loadFLASH) {
+	// a root block of 8 cm, refined into 8 blocks, with Bx = x / cm gauss
+	int levels[9] = {1, 2, 2, 2, 2, 2, 2, 2, 2};
+	double box[9][3][2];
+	std::vector<double> magx(9 * 512), magy(9 * 512, 1), magz(9 * 512, 0);
+	for (int b = 0; b < 9; b++) {
+		double size = (b == 0) ? 8 : 4;
+		int c = b - 1;
+		double lower[3] = {0, 0, 0};
+		if (b > 0) {
+			lower[0] = 4 * (c & 1);
+			lower[1] = 4 * ((c >> 1) & 1);
+			lower[2] = 4 * ((c >> 2) & 1);
+		}
+		for (int d = 0; d < 3; d++) {
+			box[b][d][0] = lower[d];
+			box[b][d][1] = lower[d] + size;
+		}
+		for (int i = 0; i < 512; i++)
+			magx[b * 512 + i] = lower[0] + (i % 8 + 0.5) * size / 8; // x fastest
+	}
+	hid_t file = H5Fcreate("testFLASH.h5", H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+	hsize_t dims[4] = {9, 8, 8, 8}, boxDims[3] = {9, 3, 2};
+	writeFLASHDataset(file, "refine level", H5T_NATIVE_INT, 1, dims, levels);
+	writeFLASHDataset(file, "bounding box", H5T_NATIVE_DOUBLE, 3, boxDims, box);
+	writeFLASHDataset(file, "magx", H5T_NATIVE_DOUBLE, 4, dims, &magx[0]);
+	writeFLASHDataset(file, "magy", H5T_NATIVE_DOUBLE, 4, dims, &magy[0]);
+	writeFLASHDataset(file, "magz", H5T_NATIVE_DOUBLE, 4, dims, &magz[0]);
+	H5Fclose(file);
+
+	ref_ptr<AMRGrid3f> grid = loadFLASHMagneticField("testFLASH.h5");
+	std::remove("testFLASH.h5");
+	EXPECT_EQ(1, grid->getNx());
+	EXPECT_DOUBLE_EQ(8 * cm, grid->getBlockSize().x);
+	EXPECT_EQ(1, grid->getLevel(Vector3d(6.1, 1, 5) * cm));
+
+	AMRMagneticFieldGrid field(grid);
+	Vector3d b = field.getField(Vector3d(5.3, 2.2, 6.1) * cm);
+	EXPECT_NEAR(5.3 * gauss, b.x, 1e-6 * gauss);
+	EXPECT_NEAR(1 * gauss, b.y, 1e-6 * gauss);
+	EXPECT_DOUBLE_EQ(0, b.z);
+}
+#endif // CRPROPA_HAVE_HDF5
+
 #ifdef CRPROPA_HAVE_MUPARSER
 TEST(testRenormalizeMagneticField, simpleTest) {
 	ref_ptr<UniformMagneticField> field = new UniformMagneticField(Vector3d(2*nG, 0, 0));
@@ -52,6 +154,300 @@ TEST(testMagneticFieldList, SimpleTest) {
 	EXPECT_DOUBLE_EQ(b.z, 3);
 }
 
+TEST(testMagneticFieldList, getFields) {
+	// the batched evaluation equals the evaluation at each position
+	ref_ptr<Grid3f> grid = new Grid3f(Vector3d(0.), 4, 1);
+	for (int ix = 0; ix < 4; ix++)
+		for (int iy = 0; iy < 4; iy++)
+			for (int iz = 0; iz < 4; iz++)
+				grid->get(ix, iy, iz) = Vector3f(ix, iy * iz, 1);
+	MagneticFieldList B;
+	B.addField(new UniformMagneticField(Vector3d(1, 0, 0)));
+	B.addField(new MagneticFieldGrid(grid));
+	B.addField(new MagneticFieldEvolution(new JF12Field(), 2));
+
+	std::vector<Vector3d> positions;
+	std::vector<double> z;
+	for (int i = 0; i < 100; i++) {
+		positions.push_back(Vector3d(0.37 * i, 1.2 - 0.11 * i, 2.5) * kpc);
+		z.push_back(0.01 * i);
+	}
+	std::vector<Vector3d> fields(100);
+	B.getFields(&positions[0], &z[0], &fields[0], 100);
+	for (int i = 0; i < 100; i++)
+		EXPECT_EQ(B.getField(positions[i], z[i]), fields[i]);
+}
+
+// uniform field in a box that counts its evaluations
+class BoxedField: public MagneticField {
+public:
+	mutable int calls;
+	Vector3d lower, upper;
+	BoxedField(Vector3d lower, Vector3d upper) : calls(0), lower(lower), upper(upper) {
+	}
+	Vector3d getField(const Vector3d &position) const {
+		calls++;
+		return Vector3d(1, 0, 0);
+	}
+	bool getBoundingBox(Vector3d &lo, Vector3d &up) const {
+		lo = lower;
+		up = upper;
+		return true;
+	}
+};
+
+TEST(testMagneticFieldList, boundingBoxes) {
+	// fields are only evaluated inside of their boxes
+	ref_ptr<BoxedField> a = new BoxedField(Vector3d(0.), Vector3d(1.));
+	ref_ptr<BoxedField> b = new BoxedField(Vector3d(10.), Vector3d(12.));
+	MagneticFieldList B;
+	B.addField(new UniformMagneticField(Vector3d(0, 0, 1)));
+	B.addField(a);
+	B.addField(b);
+	B.addField(new UniformMagneticField(Vector3d(0, 2, 0)), Vector3d(-5.), Vector3d(-4.));
+
+	EXPECT_EQ(Vector3d(1, 0, 1), B.getField(Vector3d(0.5)));
+	EXPECT_EQ(Vector3d(1, 0, 1), B.getField(Vector3d(11, 10, 12)));
+	EXPECT_EQ(Vector3d(0, 2, 1), B.getField(Vector3d(-4.5)));
+	EXPECT_EQ(Vector3d(0, 0, 1), B.getField(Vector3d(5.)));
+	EXPECT_EQ(Vector3d(0, 0, 1), B.getField(Vector3d(100.)));
+	EXPECT_EQ(1, a->calls);
+	EXPECT_EQ(1, b->calls);
+
+	Vector3d positions[4] = {Vector3d(0.5), Vector3d(5.), Vector3d(11.), Vector3d(-4.5)};
+	Vector3d fields[4];
+	B.getFields(positions, NULL, fields, 4);
+	for (int i = 0; i < 4; i++)
+		EXPECT_EQ(B.getField(positions[i]), fields[i]);
+	EXPECT_EQ(3, a->calls);
+
+	// the JF12 field ends at 20 kpc
+	Vector3d lo, up;
+	EXPECT_TRUE(JF12Field().getBoundingBox(lo, up));
+	EXPECT_DOUBLE_EQ(20 * kpc, up.x);
+}
+
+TEST(testMagneticFieldGrid, offloadThreshold) {
+	// batches at the offload threshold give the interpolation of Grid
+	ref_ptr<Grid3f> grid = new Grid3f(Vector3d(0.), 4, 1);
+	for (int ix = 0; ix < 4; ix++)
+		for (int iy = 0; iy < 4; iy++)
+			for (int iz = 0; iz < 4; iz++)
+				grid->get(ix, iy, iz) = Vector3f(ix, iy * iz, 1);
+	MagneticFieldGrid field(grid);
+	size_t threshold = MagneticField::getOffloadThreshold();
+	MagneticField::setOffloadThreshold(1);
+
+	std::vector<Vector3d> positions, fields(50);
+	for (int i = 0; i < 50; i++)
+		positions.push_back(Vector3d(0.37 * i, 1.2 - 0.11 * i, 2.5));
+	field.getFields(&positions[0], NULL, &fields[0], 50);
+	MagneticField::setOffloadThreshold(threshold);
+	for (int i = 0; i < 50; i++) {
+		Vector3d b = grid->interpolate(positions[i]);
+		EXPECT_NEAR(b.x, fields[i].x, 1e-6);
+		EXPECT_NEAR(b.y, fields[i].y, 1e-6);
+		EXPECT_NEAR(b.z, fields[i].z, 1e-6);
+	}
+}
+
+TEST(testMagneticFieldGrid, numaReplicas) {
+	// one copy per NUMA node, each interpolated as the grid
+	ref_ptr<Grid3f> grid = new Grid3f(Vector3d(0.), 4, 1);
+	for (int ix = 0; ix < 4; ix++)
+		for (int iy = 0; iy < 4; iy++)
+			for (int iz = 0; iz < 4; iz++)
+				grid->get(ix, iy, iz) = Vector3f(ix, iy * iz, 1);
+	MagneticFieldGrid field(grid);
+	size_t bytes = field.getMemoryUsage();
+	field.setNumaReplicas(true);
+	EXPECT_TRUE(field.getNumaReplicas());
+	size_t nodes = getNumaNodes().size();
+	EXPECT_EQ(((nodes > 1) ? nodes + 1 : 1) * bytes, field.getMemoryUsage());
+
+	Vector3d positions[3] = {Vector3d(0.3, 1.7, 2.2), Vector3d(3.9), Vector3d(-1.5, 0, 6)};
+	Vector3d fields[3];
+	field.getFields(positions, NULL, fields, 3);
+	for (int i = 0; i < 3; i++) {
+		EXPECT_EQ(Vector3d(grid->interpolate(positions[i])), field.getField(positions[i]));
+		EXPECT_EQ(field.getField(positions[i]), fields[i]);
+	}
+	field.setNumaReplicas(false);
+	EXPECT_EQ(bytes, field.getMemoryUsage());
+}
+
+TEST(testModulatedMagneticFieldGrid, fusedLookup) {
+	// the fused lookup matches the two separate interpolations, also at the edges
+	ref_ptr<Grid3f> grid = new Grid3f(Vector3d(1, 2, 3), 6, 5, 7, Vector3d(0.5));
+	ref_ptr<Grid1f> modGrid = new Grid1f(Vector3d(1, 2, 3), 6, 5, 7, Vector3d(0.5));
+	Random random(7);
+	for (int ix = 0; ix < 6; ix++)
+		for (int iy = 0; iy < 5; iy++)
+			for (int iz = 0; iz < 7; iz++) {
+				grid->get(ix, iy, iz) = Vector3f(random.randNorm(), random.randNorm(), random.randNorm());
+				modGrid->get(ix, iy, iz) = random.rand();
+			}
+	ModulatedMagneticFieldGrid field(grid, modGrid);
+
+	for (int variant = 0; variant < 4; variant++) {
+		if (variant == 1)
+			field.setReflective(true, true);
+		if (variant == 2) {
+			grid->setLayout(GridBricked);
+			modGrid->setLayout(GridBricked);
+		}
+		if (variant == 3)
+			modGrid->setOrigin(Vector3d(1.2, 2, 3));
+		for (int i = 0; i < 100; i++) {
+			Vector3d pos = Vector3d(1, 2, 3) + Vector3d(random.rand(), random.rand(), random.rand())
+					* Vector3d(5, 4, 5.5) - Vector3d(1);
+			Vector3d expected = Vector3d(grid->interpolate(pos)) * modGrid->interpolate(pos);
+			Vector3d b = field.getField(pos);
+			EXPECT_NEAR(0, (b - expected).getR(), 1e-5 * (1 + expected.getR()));
+		}
+	}
+}
+
+TEST(testEnsembleMagneticFieldGrid, realizations) {
+	ref_ptr<Grid3f> grid = new Grid3f(Vector3d(-4.), 8, 1.);
+	Random random(42);
+	for (size_t i = 0; i < grid->getGrid().size(); i++)
+		grid->getGrid()[i] = Vector3f(random.rand(), random.rand(), random.rand());
+	MagneticFieldGrid field(grid);
+	Vector3d position(0.3, -1.7, 2.2);
+
+	// seed 0 is the grid itself
+	EnsembleMagneticFieldGrid identity(grid);
+	EXPECT_EQ(field.getField(position), identity.getField(position));
+
+	EnsembleMagneticFieldGrid ensemble(grid, 7);
+	Vector3d t = ensemble.getTranslation();
+	EXPECT_GE(t.getR(), 0);
+	EXPECT_LT(t.x, 8);
+	bool distinct = false;
+	for (uint64_t seed = 1; seed < 6; seed++) {
+		ensemble.setSeed(seed);
+		// the field at the transformed position, rotated with it
+		Vector3d r = position - grid->getOrigin(), p;
+		for (int i = 0; i < 3; i++)
+			p.data[ensemble.getAxis(i)] = ensemble.getSign(i) * r.data[i];
+		Vector3d b = field.getField(p + grid->getOrigin() + ensemble.getTranslation());
+		Vector3d expected;
+		for (int i = 0; i < 3; i++)
+			expected.data[i] = ensemble.getSign(i) * b.data[ensemble.getAxis(i)];
+		Vector3d actual = ensemble.getField(position);
+		EXPECT_NEAR(expected.x, actual.x, 1e-6);
+		EXPECT_NEAR(expected.y, actual.y, 1e-6);
+		EXPECT_NEAR(expected.z, actual.z, 1e-6);
+		distinct = distinct or (actual.getDistanceTo(field.getField(position)) > 1e-3);
+
+		// batches as single evaluations
+		Vector3d positions[3] = {position, Vector3d(3.9, 0, -3.9), Vector3d(100, 20, -7)};
+		Vector3d fields[3];
+		ensemble.getFields(positions, NULL, fields, 3);
+		for (int k = 0; k < 3; k++)
+			EXPECT_NEAR(0, fields[k].getDistanceTo(ensemble.getField(positions[k])), 1e-6);
+	}
+	EXPECT_TRUE(distinct);
+
+	// without reflections only the axes are permuted
+	ensemble.setReflections(false);
+	for (int i = 0; i < 3; i++)
+		EXPECT_EQ(1, ensemble.getSign(i));
+	EXPECT_EQ(grid->getSizeOf(), ensemble.getMemoryUsage());
+}
+
+TEST(testJF12Field, referenceValues) {
+	// values of the regular field in muG in the ring, the spiral arms and the
+	// inner and outer X-field region, as given by the original implementation
+	ref_ptr<MagneticField> fields[3] = {new JF12Field(), new PlanckJF12bField(), new JF12FieldSolenoidal()};
+	const double positions[5][3] = {{-8.5, 0, 0.1}, {-2, -1, -0.5}, {-12, 9, -0.05}, {6, 0, 0}, {3.5, -1, 0.3}};
+	const double values[3][5][3] = {
+		{ // JF12Field
+			{0.047437068734007812, 0.90591222764983348, 0.18886843884557647},
+			{0.2907002283800233, 0.90317071806711602, 1.7879487441631763},
+			{0.036192729616696354, 0.029691843711502786, 0.019926717064785555},
+			{-0.282300638648456, -3.1924640252394623, 0.43852805951841328},
+			{0.78429226854227541, 0.31685020398644964, 1.0668874863079152}},
+		{ // PlanckJF12bField
+			{0.14737322556562543, 0.90591222764983348, 0.073905041287399484},
+			{-0.070760579403981463, 0.72244031417511367, 0.69963211728124308},
+			{0.027757653713500492, 0.036018150638899689, 0.0077974110253508713},
+			{-0.40375491049891726, -2.6489236254933841, 0.17159793633329218},
+			{0.39387237006921816, 0.42839874640732312, 0.41747771203353201}},
+		{ // JF12FieldSolenoidal
+			{0.1777380331720759, 0.90591222764983359, 0.19487162962797355},
+			{0.2907002283800233, 0.90317071806711602, 1.7879487441631763},
+			{0.023790258456657883, 0.038993697081531636, 0.020924533223130974},
+			{-0.3179305644542969, -2.9256044192570902, 0.4555337434362523},
+			{0.49815669788674372, 0.30186639351629219, 1.0629944921789416}}};
+	for (int k = 0; k < 3; k++)
+		for (int i = 0; i < 5; i++) {
+			Vector3d pos = Vector3d(positions[i][0], positions[i][1], positions[i][2]) * kpc;
+			Vector3d b = fields[k]->getField(pos) / muG;
+			for (int j = 0; j < 3; j++)
+				EXPECT_NEAR(values[k][i][j], b.data[j], 1e-12);
+		}
+}
+
+TEST(testJF12Field, quantizedGrids) {
+	// the +-1 of the striated grid are quantized exactly, the quantized grid can be shared
+	JF12Field field;
+	field.randomStriated(42);
+	Vector3d pos = Vector3d(-8.5, 1, 0.2) * kpc;
+	Vector3d b = field.getField(pos);
+	field.quantizeGrids();
+	EXPECT_FALSE(field.getStriatedGrid().valid());
+	ASSERT_TRUE(field.getQuantizedStriatedGrid().valid());
+	EXPECT_EQ(b, field.getField(pos));
+
+	JF12Field shared;
+	shared.setStriatedGrid(field.getQuantizedStriatedGrid());
+	EXPECT_TRUE(shared.isUsingStriatedField());
+	EXPECT_EQ(b, shared.getField(pos));
+}
+
+TEST(testCachedMagneticField, refinement) {
+	// dipole just outside of a corner of the region, unit field at unit distance
+	ref_ptr<MagneticDipoleField> dipole = new MagneticDipoleField(Vector3d(-0.5),
+			Vector3d(0, 0, 4 * M_PI / mu0), 1);
+	double tolerance = 1e-3;
+	std::string filename = "testCachedMagneticField.cache";
+	remove(filename.c_str());
+	CachedMagneticField cached(dipole, Vector3d(0.), 2, 2, 2, Vector3d(2.), tolerance, 3,
+			filename, "dipole");
+
+	// refined towards the dipole
+	ref_ptr<AMRGrid3f> grid = cached.getGrid();
+	EXPECT_LT(0, grid->getLevel(Vector3d(0.1)));
+	EXPECT_EQ(0, grid->getLevel(Vector3d(3.5)));
+
+	// interpolated where the field is resolved, exact outside of the region
+	Random random(42);
+	for (int i = 0; i < 200; i++) {
+		Vector3d pos(random.rand(4), random.rand(4), random.rand(4));
+		if ((pos - Vector3d(-0.5)).getR() < 2)
+			continue;
+		EXPECT_NEAR(0, (cached.getField(pos) - dipole->getField(pos)).getR(), 3 * tolerance);
+	}
+	Vector3d outside(4.5, 1, 1);
+	EXPECT_EQ(dipole->getField(outside), cached.getField(outside));
+
+	// the cache file is used for the same key, another key resamples
+	Vector3d pos(1.3, 2.1, 0.7);
+	CachedMagneticField loaded(dipole, Vector3d(0.), 2, 2, 2, Vector3d(2.), tolerance, 3,
+			filename, "dipole");
+	EXPECT_EQ(cached.getField(pos), loaded.getField(pos));
+	ref_ptr<MagneticDipoleField> other = new MagneticDipoleField(Vector3d(-0.5),
+			Vector3d(0, 0, 8 * M_PI / mu0), 1);
+	CachedMagneticField resampled(other, Vector3d(0.), 2, 2, 2, Vector3d(2.), tolerance, 3,
+			filename, "stronger dipole");
+	EXPECT_NEAR(2 * cached.getField(pos).z, resampled.getField(pos).z, 1e-6);
+	remove(filename.c_str());
+
+	EXPECT_THROW(CachedMagneticField(dipole, Vector3d(0.), 2, 2, 2, Vector3d(2.), 0), std::runtime_error);
+}
+
 TEST(testMagneticFieldEvolution, SimpleTest) {
 	// Test if this decorator scales the underlying field as (1+z)^m
 	ref_ptr<UniformMagneticField> B = new UniformMagneticField(Vector3d(1,0,0));
@@ -68,6 +464,55 @@ TEST(testMagneticFieldEvolution, SimpleTest) {
 	EXPECT_DOUBLE_EQ(b.x, 1);
 }
 
+TEST(testSnapshotMagneticFieldGrid, interpolation) {
+	// uniform snapshots of B = (1 + z) x at z = 0, 1, 2
+	std::vector<std::string> files;
+	for (int i = 0; i < 3; i++) {
+		ref_ptr<Grid3f> grid = new Grid3f(Vector3d(0.), 4, 1.);
+		for (size_t j = 0; j < grid->getGrid().size(); j++)
+			grid->getGrid()[j] = Vector3f(1 + i, 0, 0);
+		files.push_back("testSnapshot" + std::to_string(i) + ".dat");
+		MappedGrid3f::save(*grid, files.back());
+	}
+	size_t bytes = 4 * 4 * 4 * sizeof(Vector3f);
+
+	SnapshotMagneticFieldGrid field(gauss, 2 * bytes);
+	field.setPrefetching(false);
+	field.addSnapshot(2, files[2]);
+	field.addSnapshot(0, files[0]);
+	field.addSnapshot(1, files[1]);
+	EXPECT_EQ(3, field.getNumberOfSnapshots());
+	EXPECT_EQ(1, field.getSnapshotRedshift(1));
+	EXPECT_EQ(0, field.getNumberOfMappedSnapshots());
+
+	Vector3d pos(1.3, 2.2, 0.4);
+	EXPECT_NEAR(2.5 * gauss, field.getField(pos, 1.5).x, 1e-6 * gauss);
+	EXPECT_EQ(2, field.getNumberOfMappedSnapshots());
+	// the snapshot at z = 2 is evicted to stay within the budget
+	EXPECT_NEAR(1.25 * gauss, field.getField(pos, 0.25).x, 1e-6 * gauss);
+	EXPECT_EQ(2, field.getNumberOfMappedSnapshots());
+	EXPECT_EQ(2 * bytes, field.getMemoryUsage());
+	// outside of the snapshots
+	EXPECT_NEAR(3 * gauss, field.getField(pos, 5).x, 1e-6 * gauss);
+	EXPECT_NEAR(1 * gauss, field.getField(pos).x, 1e-6 * gauss);
+
+	// the snapshot below is prefetched, the fields are the same
+	SnapshotMagneticFieldGrid prefetched(gauss);
+	for (int i = 0; i < 3; i++)
+		prefetched.addSnapshot(i, files[i]);
+	Vector3d positions[2] = {pos, pos};
+	double redshifts[2] = {1.5, 0.5};
+	Vector3d b[2];
+	prefetched.getFields(positions, redshifts, b, 2);
+	EXPECT_NEAR(2.5 * gauss, b[0].x, 1e-6 * gauss);
+	EXPECT_NEAR(1.5 * gauss, b[1].x, 1e-6 * gauss);
+
+	EXPECT_THROW(field.addSnapshot(1, files[1]), std::runtime_error);
+	EXPECT_THROW(field.addSnapshot(3, "nonexistent.dat"), std::runtime_error);
+	for (int i = 0; i < 3; i++)
+		remove(files[i].c_str());
+}
+
 class EchoMagneticField: public MagneticField {
 public:
 	Vector3d getField(const Vector3d &position) const {
@@ -16,6 +16,11 @@
 #include "crpropa/magneticLens/ModelMatrix.h"
 #include "crpropa/magneticLens/Pixelization.h"
 #include "crpropa/magneticLens/ParticleMapsContainer.h"
+#include "crpropa/magneticLens/LensBuilder.h"
+#include "crpropa/magneticLens/GalacticLensing.h"
+#include "crpropa/module/ParticleCollector.h"
+#include "crpropa/ParticleID.h"
+#include "crpropa/magneticField/MagneticField.h"
 #include "crpropa/Common.h"
 
 using namespace std;
@@ -100,6 +105,147 @@ TEST(MagneticLens, OutOfBoundsEnergy)
 }
 
 
+TEST(MagneticLens, transformModelVectors)
+{
+	// the blocked products equal the single products
+	MagneticLens magneticLens(3);
+	Pixelization P(3);
+	ModelMatrixType M[2];
+	for (int k = 0; k < 2; k++)
+	{
+		M[k].resize(P.nPix(), P.nPix());
+		for (int i = 0; i < P.nPix(); i++)
+		{
+			M[k].insert(i, i) = 0.5;
+			M[k].insert((i + 7 * (k + 1)) % P.nPix(), i) = 0.5;
+		}
+	}
+	magneticLens.setLensPart(M[0], 1 * EeV, 10 * EeV);
+	magneticLens.setLensPart(M[1], 10 * EeV, 100 * EeV);
+
+	const int n = 19;
+	std::vector<std::vector<double> > expected(n), models(n);
+	std::vector<double*> pointers;
+	std::vector<double> rigidities;
+	for (int m = 0; m < n; m++)
+	{
+		for (int i = 0; i < P.nPix(); i++)
+			expected[m].push_back(cos(m + i));
+		models[m] = expected[m];
+		rigidities.push_back((m % 3 == 0) ? 200 * EeV : (m % 2 + 1) * 5 * EeV);
+		if (magneticLens.rigidityCovered(rigidities[m]))
+			magneticLens.transformModelVector(&expected[m][0], rigidities[m]);
+		pointers.push_back(&models[m][0]);
+	}
+	magneticLens.transformModelVectors(pointers, rigidities);
+
+	for (int m = 0; m < n; m++)
+		for (int i = 0; i < P.nPix(); i++)
+			EXPECT_NEAR(expected[m][i], models[m][i], 1e-12);
+	EXPECT_THROW(magneticLens.transformModelVectors(pointers, std::vector<double>()), std::runtime_error);
+}
+
+TEST(MagneticLens, sampleColumn)
+{
+	// the binary search draws the same rows as the walk along the column
+	Pixelization P(2);
+	ModelMatrixType M(P.nPix(), P.nPix());
+	for (int i = 0; i < P.nPix(); i++)
+		for (int j = 0; j < 10; j++)
+			M.insert((i + 3 * j) % P.nPix(), i) = 0.01 * (j + 1);
+	MagneticLens lens(2);
+	lens.setLensPart(M, 10 * EeV, 100 * EeV);
+	LensPart *part = lens.getLensPart(50 * EeV);
+
+	for (int c = 0; c < P.nPix(); c += 17)
+	{
+		for (double rn = 0; rn < 1; rn += 0.0123)
+		{
+			int expected = -1;
+			double cpv = 0;
+			for (ModelMatrixType::InnerIterator i(M, c); i; ++i)
+			{
+				cpv += i.value();
+				if (rn < cpv)
+				{
+					expected = i.row();
+					break;
+				}
+			}
+			EXPECT_EQ(expected, part->sampleColumn(c, rn));
+		}
+	}
+
+	// the sums follow the normalization, column 0 sums to 0.55 before
+	EXPECT_EQ(-1, part->sampleColumn(0, 0.999));
+	lens.normalizeLensparts();
+	EXPECT_EQ(27, part->sampleColumn(0, 0.999));
+}
+
+TEST(MagneticLens, lazyLoading)
+{
+	Pixelization P(3);
+	ModelMatrixType M[2];
+	for (int k = 0; k < 2; k++)
+	{
+		M[k].resize(P.nPix(), P.nPix());
+		for (int i = 0; i < P.nPix(); i++)
+			M[k].insert((i + k) % P.nPix(), i) = 1. + (i % 5);
+	}
+	serializeCSC("lazylens_test_0.mldat", M[0]);
+	serialize("lazylens_test_1.mldat", M[1]);
+	ofstream cfg("lazylens_test.cfg");
+	cfg << "lazylens_test_0.mldat 18 19\n";
+	cfg << "lazylens_test_1.mldat 19 20\n";
+	cfg.close();
+
+	// both formats are read
+	ModelMatrixType C;
+	deserialize("lazylens_test_0.mldat", C);
+	EXPECT_EQ(M[0].nonZeros(), C.nonZeros());
+	EXPECT_DOUBLE_EQ(0, (M[0] - C).norm());
+
+	// the matrices are read on first use
+	MagneticLens lens("lazylens_test.cfg");
+	EXPECT_EQ(2, lens.getLensParts().size());
+	EXPECT_EQ(0, lens.getMemoryUsage());
+	EXPECT_TRUE(lens.rigidityCovered(5 * EeV));
+	EXPECT_FALSE(lens.getLensParts()[0]->isLoaded());
+	LensPart *part = lens.getLensPart(5 * EeV);
+	EXPECT_TRUE(part->isLoaded());
+	EXPECT_FALSE(lens.getLensParts()[1]->isLoaded());
+	size_t partMemory = lens.getMemoryUsage();
+	EXPECT_GT(partMemory, 0);
+
+	// the least recently used part is unloaded, and normalized again when read
+	lens.normalizeLensparts();
+	EXPECT_EQ(2 * partMemory, lens.getMemoryUsage());
+	lens.setMemoryBudget(partMemory);
+	EXPECT_EQ(partMemory, lens.getMemoryUsage());
+	EXPECT_FALSE(lens.getLensParts()[0]->isLoaded());
+	EXPECT_TRUE(lens.getLensParts()[1]->isLoaded());
+	ModelMatrixType &N = lens.getLensPart(5 * EeV)->getMatrix();
+	EXPECT_DOUBLE_EQ(0, (N - M[0] / 5.).norm());
+	EXPECT_FALSE(lens.getLensParts()[1]->isLoaded());
+
+	// the blocked products load the lens parts in turn
+	std::vector<double> model(P.nPix(), 1.), rigidities(2);
+	std::vector<double> other = model;
+	std::vector<double*> models(2);
+	models[0] = &model[0];
+	models[1] = &other[0];
+	rigidities[0] = 5 * EeV;
+	rigidities[1] = 50 * EeV;
+	lens.transformModelVectors(models, rigidities);
+	EXPECT_EQ(partMemory, lens.getMemoryUsage());
+	EXPECT_NEAR((1. + (1 % 5)) / 5., model[1], 1e-12);
+	EXPECT_NEAR((1. + (0 % 5)) / 5., other[1], 1e-12);
+
+	remove("lazylens_test.cfg");
+	remove("lazylens_test_0.mldat");
+	remove("lazylens_test_1.mldat");
+}
+
 TEST(Pixelization, angularDistance)
 {
 	// test for correct angular distance in case of same vectors 
@@ -151,6 +297,64 @@ TEST(ParticleMapsContainer, getRandomParticles)
 
 }
 
+TEST(ParticleMapsContainer, sparseMaps)
+{
+  ParticleMapsContainer maps;
+  size_t nPix = maps.getNumberOfPixels();
+  for (int i = 0; i < 3000; i++)
+  {
+    maps.addParticle(1000010010, 1 * EeV, 0.1 * (i % 3), 0, 1);
+    maps.addParticle(1000020040, 10 * EeV, -0.2, 0.3, 3);
+  }
+
+  // the few filled pixels are stored sparsely
+  EXPECT_LT(maps.getMemoryUsage(), nPix * sizeof(double));
+  EXPECT_NEAR(3000, maps.getWeight(1000010010, 1 * EeV), 1e-9);
+  EXPECT_NEAR(9000, maps.getWeight(1000020040, 10 * EeV), 1e-9);
+  EXPECT_NEAR(12000, maps.getSumOfWeights(), 1e-9);
+
+  // the draws follow the weights
+  std::vector<double> energies, lons, lats;
+  std::vector<int> particleIds;
+  size_t N = 20000;
+  maps.getRandomParticles(N, particleIds, energies, lons, lats);
+  size_t nHelium = 0;
+  for (size_t i = 0; i < N; i++)
+  {
+    if (particleIds[i] == 1000020040)
+    {
+      nHelium++;
+      EXPECT_NEAR(log10(energies[i]), 19, 0.02);
+      EXPECT_NEAR(lons[i], -0.2, 2./180*M_PI);
+      EXPECT_NEAR(lats[i], 0.3, 2./180*M_PI);
+    }
+  }
+  EXPECT_NEAR(0.75, nHelium / double(N), 0.02);
+
+  // a map is dense once requested
+  double *map = maps.getMap(1000010010, 1 * EeV);
+  double sum = 0;
+  for (size_t j = 0; j < nPix; j++)
+    sum += map[j];
+  EXPECT_NEAR(3000, sum, 1e-9);
+  EXPECT_GT(maps.getMemoryUsage(), nPix * sizeof(double));
+
+  double lon, lat;
+  EXPECT_TRUE(maps.placeOnMap(1000010010, 1 * EeV, lon, lat));
+  EXPECT_FALSE(maps.placeOnMap(1000010010, 100 * EeV, lon, lat));
+
+  // the batched filling adds the same weights
+  ParticleMapsContainer batched;
+  std::vector<int> ids(1000, 1000020040);
+  std::vector<double> e(1000, 10 * EeV), bLons(1000, -0.2), bLats(1000, 0.3);
+  batched.addParticles(ids, e, bLons, bLats, std::vector<double>(1000, 3));
+  batched.addParticles(ids, e, bLons, bLats);
+  EXPECT_NEAR(4000, batched.getWeight(1000020040, 10 * EeV), 1e-9);
+  double *bMap = batched.getMap(1000020040, 10 * EeV);
+  EXPECT_NEAR(4000, bMap[Pixelization(6).direction2Pix(-0.2, 0.3)], 1e-9);
+  EXPECT_THROW(batched.addParticles(ids, e, bLons, std::vector<double>()), std::runtime_error);
+}
+
 TEST(Pixelization, randomDirectionInPixel)
 {
   Pixelization p(6);
@@ -170,3 +374,214 @@ TEST(Pixelization, randomDirectionInPixel)
   EXPECT_FALSE(lat0 == rlat);
 
 }
+
+TEST(Pixelization, batchedConversions)
+{
+  // the batched conversions agree with the single ones, also at the poles
+  Pixelization p(8);
+  Random random(42);
+  const size_t n = 1000;
+  std::vector<double> lons(n), lats(n);
+  for (size_t i = 0; i < n; i++)
+  {
+    lons[i] = random.randUniform(-M_PI, M_PI);
+    lats[i] = (i % 10 == 0) ? random.randUniform(1.5, M_PI / 2) : random.randUniform(-M_PI / 2, M_PI / 2);
+  }
+  lats[1] = M_PI / 2;
+  lats[2] = -M_PI / 2;
+
+  std::vector<uint32_t> pixels(n);
+  p.directions2Pix(n, &lons[0], &lats[0], &pixels[0]);
+  for (size_t i = 0; i < n; i++)
+    EXPECT_EQ(p.direction2Pix(lons[i], lats[i]), pixels[i]);
+
+  std::vector<double> clons(n), clats(n);
+  p.pix2Directions(n, &pixels[0], &clons[0], &clats[0]);
+  for (size_t i = 0; i < n; i++)
+  {
+    double lon, lat;
+    p.pix2Direction(pixels[i], lon, lat);
+    EXPECT_NEAR(lon, clons[i], 1e-12);
+    EXPECT_NEAR(lat, clats[i], 1e-12);
+  }
+
+  p.getRandomDirectionsInPixels(n, &pixels[0], &clons[0], &clats[0], random);
+  for (size_t i = 0; i < n; i++)
+    EXPECT_EQ(pixels[i], p.direction2Pix(clons[i], clats[i]));
+
+  lats[5] = 2;
+  EXPECT_THROW(p.directions2Pix(n, &lons[0], &lats[0], &pixels[0]), std::runtime_error);
+}
+
+TEST(LensBuilder, noDeflection)
+{
+  // without field every particle leaves in its launch direction
+  std::vector<double> rigidities;
+  rigidities.push_back(1 * EeV);
+  rigidities.push_back(10 * EeV);
+  rigidities.push_back(100 * EeV);
+  LensBuilder builder(new UniformMagneticField(Vector3d(0, 0, 0)), rigidities, 2);
+  builder.setParticlesPerPixel(5);
+  EXPECT_EQ(2, builder.getNumberOfParts());
+
+  ModelMatrixType M;
+  builder.buildLensPart(0, M);
+  uint32_t nPix = builder.getPixelization().nPix();
+  EXPECT_EQ(nPix, M.rows());
+  EXPECT_EQ(nPix, M.cols());
+  EXPECT_NEAR(nPix, M.sum(), 1e-9);
+  for (uint32_t i = 0; i < nPix; i++)
+    EXPECT_NEAR(1, M.coeff(i, i), 1e-12);
+}
+
+TEST(LensBuilder, buildLens)
+{
+  std::vector<double> rigidities;
+  rigidities.push_back(1 * EeV);
+  rigidities.push_back(10 * EeV);
+  rigidities.push_back(100 * EeV);
+  LensBuilder builder(new UniformMagneticField(Vector3d(0, 0, 1 * muG)), rigidities, 1);
+  builder.setParticlesPerPixel(4);
+  builder.setSeed(42);
+  builder.setBoundary(Vector3d(0, 0, 0), 10 * kpc);
+
+  // the matrix is reproducible
+  ModelMatrixType M1, M2;
+  builder.buildLensPart(1, M1);
+  builder.buildLensPart(1, M2);
+  EXPECT_EQ(M1.nonZeros(), M2.nonZeros());
+  EXPECT_DOUBLE_EQ(0, (M1 - M2).norm());
+
+  builder.buildLens("lensbuilder_test.cfg");
+  MagneticLens lens("lensbuilder_test.cfg");
+  EXPECT_EQ(2, lens.getLensParts().size());
+  EXPECT_NEAR(1e18, lens.getMinimumRigidity(), 1e9);
+  EXPECT_NEAR(1e20, lens.getMaximumRigidity(), 1e11);
+
+  ModelMatrixType &M = lens.getLensPart(50 * EeV)->getMatrix();
+  EXPECT_DOUBLE_EQ(0, (M - M1).norm());
+
+  remove("lensbuilder_test.cfg");
+  remove("lensbuilder_test_0.mldat");
+  remove("lensbuilder_test_1.mldat");
+}
+
+TEST(LensBuilder, accumulate)
+{
+  std::vector<double> rigidities;
+  rigidities.push_back(1 * EeV);
+  rigidities.push_back(10 * EeV);
+  rigidities.push_back(100 * EeV);
+  LensBuilder builder(new UniformMagneticField(Vector3d(0, 0, 1 * muG)), rigidities, 1);
+  builder.setParticlesPerPixel(4);
+  builder.setSeed(42);
+  builder.setBoundary(Vector3d(0, 0, 0), 10 * kpc);
+  uint32_t nPix = builder.getPixelization().nPix();
+
+  // job 0 is the lens part of buildLensPart
+  LensAccumulator job0, job1;
+  builder.accumulateLensPart(1, job0, 0);
+  builder.accumulateLensPart(1, job1, 1);
+  EXPECT_EQ(nPix, job0.getNumberOfPixels());
+  EXPECT_DOUBLE_EQ(4 * nPix, job0.getTotalLaunched());
+  ModelMatrixType M, M0;
+  builder.buildLensPart(1, M);
+  job0.getLensPart(M0);
+  EXPECT_NEAR(0, (M - M0).norm(), 1e-12);
+
+  // merging sums the counts, also through files
+  job0.save("lensaccumulator_test_0.lacc");
+  job1.save("lensaccumulator_test_1.lacc");
+  LensAccumulator merged("lensaccumulator_test_0.lacc");
+  merged.merge("lensaccumulator_test_1.lacc");
+  EXPECT_DOUBLE_EQ(8, merged.getLaunched(3));
+  EXPECT_DOUBLE_EQ(0, (merged.getCounts() - job0.getCounts() - job1.getCounts()).norm());
+
+  // refining an accumulator with another job is the same
+  LensAccumulator refined;
+  builder.accumulateLensPart(1, refined, 0);
+  builder.accumulateLensPart(1, refined, 1);
+  EXPECT_DOUBLE_EQ(0, (merged.getCounts() - refined.getCounts()).norm());
+  ModelMatrixType M01;
+  merged.getLensPart(M01);
+  EXPECT_NEAR(0, (8 * M01 - merged.getCounts()).norm(), 1e-12);
+
+  // another rigidity bin is not merged, but extends the lens
+  LensAccumulator low;
+  builder.accumulateLensPart(0, low, 0);
+  EXPECT_THROW(merged.merge(low), std::runtime_error);
+  EXPECT_THROW(builder.accumulateLensPart(0, merged, 2), std::runtime_error);
+  merged.save("lensaccumulator_test_1.lacc");
+  low.save("lensaccumulator_test_0.lacc");
+
+  std::vector<std::string> files;
+  files.push_back("lensaccumulator_test_1.lacc");
+  files.push_back("lensaccumulator_test_0.lacc");
+  writeLens("lensaccumulator_test.cfg", files);
+  MagneticLens lens("lensaccumulator_test.cfg");
+  EXPECT_EQ(2, lens.getLensParts().size());
+  EXPECT_NEAR(1e18, lens.getMinimumRigidity(), 1e9);
+  EXPECT_NEAR(1e20, lens.getMaximumRigidity(), 1e11);
+  EXPECT_NEAR(0, (lens.getLensPart(50 * EeV)->getMatrix() - M01).norm(), 1e-12);
+  lens.normalizeLens();
+  double norm = lens.getNorm();
+  EXPECT_LE(maximumOfSumsOfColumns(lens.getLensPart(50 * EeV)->getMatrix()), 1 + 1e-12);
+  EXPECT_NEAR(0, (lens.getLensPart(50 * EeV)->getMatrix() - M01 / norm).norm(), 1e-12);
+
+  // overlapping rigidity ranges are refused
+  files.push_back("lensaccumulator_test_1.lacc");
+  EXPECT_THROW(writeLens("lensaccumulator_test.cfg", files), std::runtime_error);
+
+  remove("lensaccumulator_test.cfg");
+  remove("lensaccumulator_test_0.mldat");
+  remove("lensaccumulator_test_1.mldat");
+  remove("lensaccumulator_test_0.lacc");
+  remove("lensaccumulator_test_1.lacc");
+}
+
+TEST(GalacticLensing, process)
+{
+	// lens mapping any direction (p, t) to (p, -t)
+	MagneticLens lens(5);
+	Pixelization P(5);
+	ModelMatrixType M;
+	M.resize(P.nPix(), P.nPix());
+	M.reserve(P.nPix());
+	for (int i = 0; i < P.nPix(); i++)
+	{
+		double theta, phi;
+		P.pix2Direction(i, phi, theta);
+		M.insert(i, P.direction2Pix(phi, -theta)) = 1;
+	}
+	lens.setLensPart(M, 10 * EeV, 100 * EeV);
+
+	GalacticLensing lensing(&lens);
+	ref_ptr<ParticleCollector> output = new ParticleCollector();
+	lensing.onDetection(output, true); // the candidates are on the stack
+
+	// proton of 40 EeV entering the sphere, arriving from a high latitude
+	Vector3d direction = Vector3d(-1, 0, -1) / sqrt(2);
+	Candidate c(nucleusId(1, 1), 40 * EeV, Vector3d(0, 0, 19.9 * kpc), direction);
+	c.previous.setPosition(Vector3d(0, 0, 20.1 * kpc));
+	lensing.process(&c);
+	EXPECT_FALSE(c.isActive());
+	EXPECT_EQ(1, output->size());
+	EXPECT_EQ(Vector3d(-8.5 * kpc, 0, 0), c.current.getPosition());
+	EXPECT_NEAR(-direction.z, c.current.getDirection().z, 0.05);
+
+	// helium of the same energy has half the rigidity, outside of the lens
+	Candidate he(nucleusId(4, 2), 10 * EeV, Vector3d(0, 0, 19.9 * kpc), direction);
+	he.previous.setPosition(Vector3d(0, 0, 20.1 * kpc));
+	lensing.process(&he);
+	EXPECT_FALSE(he.isActive());
+	EXPECT_EQ(1, output->size());
+
+	// candidates inside or outside are not processed
+	Candidate inside(nucleusId(1, 1), 40 * EeV, Vector3d(0, 0, 10 * kpc), direction);
+	lensing.process(&inside);
+	EXPECT_TRUE(inside.isActive());
+	Candidate outside(nucleusId(1, 1), 40 * EeV, Vector3d(0, 0, 30 * kpc), direction);
+	outside.previous.setPosition(Vector3d(0, 0, 20.1 * kpc));
+	lensing.process(&outside);
+	EXPECT_TRUE(outside.isActive());
+}
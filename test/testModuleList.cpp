@@ -1,11 +1,44 @@
 #include "crpropa/ModuleList.h"
+#include "crpropa/ModuleList1D.h"
+#include "crpropa/Cosmology.h"
 #include "crpropa/Source.h"
 #include "crpropa/ParticleID.h"
+#include "crpropa/ParticleMass.h"
+#include "crpropa/Random.h"
+#include "crpropa/StaticModuleChain.h"
+#include "crpropa/TargetedEmission.h"
+#include "crpropa/Trace.h"
+#include "crpropa/TransferMatrix.h"
+#include "crpropa/TransportSolver1D.h"
 #include "crpropa/module/SimplePropagation.h"
+#include "crpropa/module/PropagationCK.h"
+#include "crpropa/magneticField/MagneticFieldGrid.h"
+#include "crpropa/module/BatchModule.h"
 #include "crpropa/module/BreakCondition.h"
+#include "crpropa/module/HistogramOutput.h"
+#include "crpropa/module/InteractionSampler.h"
+#include "crpropa/module/Observer.h"
+#include "crpropa/module/ParticleCollector.h"
+#include "crpropa/module/Redshift.h"
+#include "crpropa/module/TextOutput.h"
+#ifdef CRPROPA_HAVE_HDF5
+#include "crpropa/module/HDF5Output.h"
+#include <hdf5.h>
+#endif
 
 #include "gtest/gtest.h"
 
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#if _OPENMP
+#include <omp.h>
+#endif
+
 namespace crpropa {
 
 TEST(ModuleList, process) {
@@ -55,8 +88,1102 @@ TEST(ModuleList, runSource) {
 	modules.run(&source, 100, false);
 }
 
+// splits every candidate into two secondaries until the energy is below 1 EeV
+class SplitCandidate: public Module {
+public:
+	mutable size_t count;
+	SplitCandidate() : count(0) {}
+	void process(Candidate *candidate) const {
+#pragma omp atomic
+		count++;
+		double E = candidate->current.getEnergy();
+		candidate->setActive(false);
+		if (E < 1 * EeV)
+			return;
+		candidate->addSecondary(22, E / 2);
+		candidate->addSecondary(22, E / 2);
+	}
+};
+
+TEST(ModuleList, runParallelSecondaries) {
+	ModuleList modules;
+	ref_ptr<SplitCandidate> split = new SplitCandidate();
+	modules.add(split);
+	EXPECT_FALSE(modules.getParallelSecondaries());
+
+	ref_ptr<Candidate> c = new Candidate(22, 1000 * EeV);
+	modules.run(c);
+	size_t serialCount = split->count;
+	EXPECT_EQ(2047, serialCount);
+
+	split->count = 0;
+	modules.setParallelSecondaries(true);
+	c = new Candidate(22, 1000 * EeV);
+	modules.run(c);
+	EXPECT_EQ(serialCount, split->count);
+
+	split->count = 0;
+	c = new Candidate(22, 1000 * EeV);
+	modules.run(c, true, true);
+	EXPECT_EQ(serialCount, split->count);
+}
+
+TEST(ModuleList, runStreamSecondaries) {
+	ModuleList modules;
+	ref_ptr<SplitCandidate> split = new SplitCandidate();
+	modules.add(split);
+	modules.setStreamSecondaries(true);
+
+	ref_ptr<Candidate> c = new Candidate(22, 1000 * EeV);
+	modules.run(c);
+	EXPECT_EQ(2047, split->count);
+	EXPECT_EQ(0, c->secondaries.size());
+
+	split->count = 0;
+	c = new Candidate(22, 1000 * EeV);
+	modules.run(c, true, true);
+	EXPECT_EQ(2047, split->count);
+}
+
+TEST(ModuleList, runBatch) {
+	ModuleList modules;
+	modules.add(new SimplePropagation(1 * kpc, 10 * kpc));
+	modules.add(new MaximumTrajectoryLength(1 * Mpc));
+	ModuleList::candidate_vector_t candidates;
+	for (size_t i = 0; i < 10; i++)
+		candidates.push_back(new Candidate(nucleusId(1, 1), 1 * EeV));
+	modules.runBatch(&candidates, 4);
+	for (size_t i = 0; i < candidates.size(); i++) {
+		EXPECT_DOUBLE_EQ(1 * Mpc, candidates[i]->getTrajectoryLength());
+		EXPECT_FALSE(candidates[i]->isActive());
+	}
+}
+
+TEST(ModuleList, runBatchSecondaries) {
+	ModuleList modules;
+	ref_ptr<SplitCandidate> split = new SplitCandidate();
+	modules.add(split);
+	ModuleList::candidate_vector_t candidates;
+	candidates.push_back(new Candidate(22, 1000 * EeV));
+	candidates.push_back(new Candidate(22, 1000 * EeV));
+	modules.runBatch(&candidates, 16);
+	EXPECT_EQ(2 * 2047, split->count);
+}
+
+TEST(ModuleList, profiling) {
+	ModuleList modules;
+	modules.add(new SplitCandidate());
+	modules.setParallelSecondaries(true);
+	modules.setProfiling();
+	EXPECT_TRUE(modules.getProfiling());
+
+	modules.run(new Candidate(22, 1000 * EeV));
+	std::vector<ModuleProfile> profile = modules.getProfile();
+	ASSERT_EQ(1, profile.size());
+	EXPECT_EQ(2047, profile[0].calls);
+	EXPECT_EQ(2046, profile[0].secondaries);
+	EXPECT_EQ(2047, modules.getProfiledSteps());
+	EXPECT_EQ(1, modules.getProfiledPrimaries());
+
+	std::string json = modules.getProfileReport(true);
+	EXPECT_NE(std::string::npos, json.find("\"calls\": 2047"));
+
+	modules.resetProfile();
+	EXPECT_EQ(0, modules.getProfiledSteps());
+	EXPECT_EQ(0, modules.getProfile()[0].calls);
+}
+
+TEST(ModuleList, profilingLimits) {
+	// the trajectory length limits the last step, the propagation changes
+	// the next step in the first step and after the limited one
+	ModuleList modules;
+	modules.add(new SimplePropagation(1 * Mpc, 1 * Mpc));
+	modules.add(new MaximumTrajectoryLength(10.5 * Mpc));
+	modules.setProfiling();
+	modules.run(new Candidate(nucleusId(1, 1), 1 * EeV));
+
+	std::vector<ModuleProfile> profile = modules.getProfile();
+	ASSERT_EQ(2, profile.size());
+	EXPECT_EQ(1, profile[1].limits);
+	EXPECT_EQ(2, profile[0].limits);
+	EXPECT_FALSE(profile[0].hasIntegrator);
+}
+
+// counts the calls and optionally changes the particle id
+class ClassCounter: public Module {
+public:
+	unsigned int classes;
+	int newId;
+	mutable size_t count;
+	ClassCounter(unsigned int classes, int newId = 0) :
+			classes(classes), newId(newId), count(0) {}
+	void process(Candidate *candidate) const {
+		count++;
+		if (newId != 0)
+			candidate->current.setId(newId);
+	}
+	unsigned int getParticleClasses() const {
+		return classes;
+	}
+};
+
+TEST(ModuleList, particleClassDispatch) {
+	EXPECT_EQ(PhotonClass, particleClass(22));
+	EXPECT_EQ(ElectronClass, particleClass(-11));
+	EXPECT_EQ(NucleusClass, particleClass(nucleusId(1, 1)));
+	EXPECT_EQ(NeutrinoClass, particleClass(-14));
+	EXPECT_EQ(OtherClass, particleClass(13));
+
+	ModuleList modules;
+	ref_ptr<ClassCounter> toElectron = new ClassCounter(PhotonClass, 11);
+	ref_ptr<ClassCounter> electrons = new ClassCounter(ElectronClass);
+	ref_ptr<ClassCounter> photons = new ClassCounter(PhotonClass);
+	ref_ptr<ClassCounter> all = new ClassCounter(AllParticleClasses);
+	modules.add(toElectron);
+	modules.add(electrons);
+	modules.add(photons);
+	modules.add(all);
+
+	// the photon becomes an electron in the first module
+	Candidate c(22);
+	modules.process(&c);
+	EXPECT_EQ(1, toElectron->count);
+	EXPECT_EQ(1, electrons->count);
+	EXPECT_EQ(0, photons->count);
+	EXPECT_EQ(1, all->count);
+
+	Candidate n(nucleusId(1, 1));
+	modules.process(&n);
+	EXPECT_EQ(1, toElectron->count);
+	EXPECT_EQ(1, electrons->count);
+	EXPECT_EQ(2, all->count);
+}
+
+// records the source energy and deactivates the candidate
+class RecordEnergy: public Module {
+public:
+	mutable std::vector<double> energies;
+	void process(Candidate *candidate) const {
+#pragma omp critical
+		energies.push_back(candidate->source.getEnergy());
+		candidate->setActive(false);
+	}
+};
+
+TEST(ModuleList, runSchedules) {
+	ModuleList modules;
+	ref_ptr<RecordEnergy> record = new RecordEnergy();
+	modules.add(record);
+	EXPECT_EQ(ModuleList::ScheduleDefault, modules.getSchedule());
+
+	Source source;
+	source.add(new SourceParticleType(22));
+	source.add(new SourcePowerLawSpectrum(1 * EeV, 1000 * EeV, -1));
+
+	ModuleList::Schedule schedules[] = {ModuleList::ScheduleDefault,
+			ModuleList::ScheduleStatic, ModuleList::ScheduleDynamic,
+			ModuleList::ScheduleGuided, ModuleList::ScheduleCostAware};
+	for (size_t i = 0; i < 5; i++) {
+		record->energies.clear();
+		modules.setSchedule(schedules[i], 4);
+		modules.run(&source, 100);
+		EXPECT_EQ(100, record->energies.size());
+#if _OPENMP
+		EXPECT_GE(modules.getLoadImbalance(), 1);
+#endif
+	}
+
+	// cost-aware schedule of a candidate vector, the most expensive first
+#if _OPENMP
+	int nThreads = omp_get_max_threads();
+	omp_set_num_threads(1);
+#endif
+	ModuleList::candidate_vector_t candidates;
+	for (size_t i = 1; i <= 10; i++)
+		candidates.push_back(new Candidate(22, i * EeV));
+	record->energies.clear();
+	modules.run(&candidates);
+	ASSERT_EQ(10, record->energies.size());
+	for (size_t i = 0; i < 10; i++)
+		EXPECT_DOUBLE_EQ((10 - i) * EeV, record->energies[i]);
+#if _OPENMP
+	omp_set_num_threads(nThreads);
+#endif
+}
+
+// records the source positions of every thread and deactivates the candidate
+class RecordPosition: public Module {
+public:
+	mutable std::vector<std::vector<Vector3d> > positions;
+	RecordPosition() : positions(256) {
+	}
+	void process(Candidate *candidate) const {
+		size_t thread = 0;
+#if _OPENMP
+		thread = omp_get_thread_num();
+#endif
+		positions[thread].push_back(candidate->source.getPosition());
+		candidate->setActive(false);
+	}
+	// mean distance of the consecutive primaries of each thread
+	double meanStep() const {
+		double sum = 0;
+		size_t n = 0;
+		for (size_t t = 0; t < positions.size(); t++)
+			for (size_t i = 1; i < positions[t].size(); i++, n++)
+				sum += positions[t][i].getDistanceTo(positions[t][i - 1]);
+		return sum / n;
+	}
+};
+
+TEST(ModuleList, localityOrder) {
+	ModuleList modules;
+	ref_ptr<RecordPosition> record = new RecordPosition();
+	modules.add(record);
+	modules.setSchedule(ModuleList::ScheduleStatic);
+	EXPECT_FALSE(modules.getLocalityOrder());
+
+	Source source;
+	source.add(new SourceParticleType(22));
+	source.add(new SourceUniformBox(Vector3d(0.), Vector3d(1 * Mpc)));
+	modules.run(&source, 20000);
+	double unordered = record->meanStep();
+
+	modules.setLocalityOrder(true, 5000);
+	EXPECT_TRUE(modules.getLocalityOrder());
+	record->positions.assign(256, std::vector<Vector3d>());
+	modules.run(&source, 20000);
+	size_t n = 0;
+	for (size_t t = 0; t < record->positions.size(); t++)
+		n += record->positions[t].size();
+	EXPECT_EQ(20000, n);
+	EXPECT_LT(record->meanStep(), 0.25 * unordered);
+}
+
+// random energy loss and random secondaries
+class RandomCascade: public Module {
+public:
+	mutable std::vector<double> values;
+	void process(Candidate *candidate) const {
+		Random &random = Random::instance();
+		double E = candidate->current.getEnergy() * random.rand();
+#pragma omp critical
+		values.push_back(E);
+		candidate->current.setEnergy(E);
+		if (E < 1 * EeV) {
+			candidate->setActive(false);
+			return;
+		}
+		if (random.rand() < 0.5)
+			candidate->addSecondary(22, E * random.rand());
+	}
+};
+
+TEST(ModuleList, counterBasedRandom) {
+#if _OPENMP
+	int nThreads = omp_get_max_threads();
+#endif
+	Source source;
+	source.add(new SourceParticleType(22));
+	source.add(new SourcePowerLawSpectrum(1 * EeV, 1000 * EeV, -1));
+
+	std::vector<double> results[2];
+	for (int threads = 1; threads <= 2; threads++) {
+#if _OPENMP
+		omp_set_num_threads(threads == 1 ? 1 : 3);
+#endif
+		ModuleList modules;
+		ref_ptr<RandomCascade> cascade = new RandomCascade();
+		modules.add(cascade);
+		modules.setCounterBasedRandom(true, 1234);
+		modules.setSchedule(ModuleList::ScheduleDynamic, 1);
+		modules.run(&source, 50);
+		results[threads - 1] = cascade->values;
+		std::sort(results[threads - 1].begin(), results[threads - 1].end());
+	}
+#if _OPENMP
+	omp_set_num_threads(nThreads);
+#endif
+	ASSERT_GT(results[0].size(), 50);
+	EXPECT_TRUE(results[0] == results[1]);
+	EXPECT_FALSE(Random::instance().hasStream());
+}
+
+TEST(ModuleList, checkpointResume) {
+#if _OPENMP
+	int nThreads = omp_get_max_threads();
+	omp_set_num_threads(1);
+#endif
+	Source source;
+	source.add(new SourcePowerLawSpectrum(1 * EeV, 100 * EeV, -2));
+	source.add(new SourceParticleType(22));
+
+	// reference run without interruption
+	Random::seedThreads(42);
+	ModuleList reference;
+	ref_ptr<RecordEnergy> all = new RecordEnergy();
+	reference.add(all);
+	reference.run(&source, 6);
+
+	// run the first half with checkpoints
+	Random::seedThreads(42);
+	ModuleList modules;
+	ref_ptr<RecordEnergy> part = new RecordEnergy();
+	modules.add(part);
+	modules.setCheckpoint("checkpoint.txt", 3);
+	modules.run(&source, 3);
+	EXPECT_EQ(3, part->energies.size());
+
+	// pretend the run was intended for 6 primaries and got interrupted
+	std::ifstream in("checkpoint.txt");
+	std::stringstream content;
+	content << in.rdbuf();
+	in.close();
+	std::string text = content.str();
+	text.replace(text.find("count 3"), 7, "count 6");
+	std::ofstream out("checkpoint.txt");
+	out << text;
+	out.close();
+
+	Random::seedThreads(1);
+	modules.resume(&source, "checkpoint.txt");
+	ASSERT_EQ(6, part->energies.size());
+	for (size_t i = 0; i < 6; i++)
+		EXPECT_DOUBLE_EQ(all->energies[i], part->energies[i]);
+	std::remove("checkpoint.txt");
+#if _OPENMP
+	omp_set_num_threads(nThreads);
+#endif
+}
+
+// raises SIGINT at the given primary, as a user interrupting the run
+class InterruptAt: public Module {
+public:
+	mutable size_t count;
+	size_t at;
+	InterruptAt(size_t at) : count(0), at(at) {}
+	void process(Candidate *candidate) const {
+		count++;
+		if (count == at)
+			std::raise(SIGINT);
+	}
+};
+
+static void ignoreSignal(int) {
+}
+
+static std::string readFile(const std::string &filename) {
+	std::ifstream in(filename.c_str());
+	std::stringstream content;
+	content << in.rdbuf();
+	return content.str();
+}
+
+TEST(ModuleList, checkpointResumeOutput) {
+#if _OPENMP
+	int nThreads = omp_get_max_threads();
+	omp_set_num_threads(1);
+#endif
+	// the run re-raises the interruption to this handler
+	void (*oldHandler)(int) = std::signal(SIGINT, ignoreSignal);
+	Source source;
+	source.add(new SourcePowerLawSpectrum(1 * EeV, 100 * EeV, -2));
+	source.add(new SourceParticleType(22));
+
+	// reference run without interruption
+	Random::seedThreads(42);
+	Candidate::setNextSerialNumber(1);
+	{
+		ModuleList reference;
+		ref_ptr<TextOutput> output = new TextOutput("resume_reference.txt", Output::Event1D);
+		reference.add(output);
+		reference.add(new RecordEnergy());
+		reference.run(&source, 6);
+		EXPECT_EQ(6, output->size());
+	}
+
+	// interrupted after the checkpoint at 3 primaries, within the 5th
+	Random::seedThreads(42);
+	Candidate::setNextSerialNumber(1);
+	ModuleList modules;
+	ref_ptr<InterruptAt> interrupt = new InterruptAt(5);
+	ref_ptr<TextOutput> output = new TextOutput("resume_output.txt", Output::Event1D);
+	modules.add(interrupt);
+	modules.add(output);
+	modules.add(new RecordEnergy());
+	modules.setCheckpoint("checkpoint_output.txt", 3);
+	modules.addCheckpointOutput(output);
+	modules.run(&source, 6);
+	EXPECT_EQ(5, output->size());
+
+	interrupt->at = 0;
+	Random::seedThreads(1);
+	modules.resume(&source, "checkpoint_output.txt");
+	EXPECT_EQ(6, output->size());
+	output->close();
+	EXPECT_EQ(readFile("resume_reference.txt"), readFile("resume_output.txt"));
+
+	// an output opened again has lost the rows of the marker
+	ModuleList reopened;
+	ref_ptr<TextOutput> truncated = new TextOutput("resume_output.txt", Output::Event1D);
+	reopened.add(truncated);
+	reopened.addCheckpointOutput(truncated);
+	EXPECT_THROW(reopened.resume(&source, "checkpoint_output.txt"), std::runtime_error);
+
+	std::remove("resume_reference.txt");
+	std::remove("resume_output.txt");
+	std::remove("checkpoint_output.txt");
+	std::signal(SIGINT, oldHandler);
+#if _OPENMP
+	omp_set_num_threads(nThreads);
+#endif
+}
+
+#ifdef CRPROPA_HAVE_HDF5
+static std::string readRows(const std::string &filename) {
+	hid_t file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+	hid_t dset = H5Dopen2(file, "CRPROPA3", H5P_DEFAULT);
+	// without the padding of the rows
+	hid_t fileType = H5Dget_type(dset);
+	hid_t type = H5Tcopy(fileType);
+	H5Tclose(fileType);
+	H5Tpack(type);
+	hid_t space = H5Dget_space(dset);
+	std::string rows(H5Sget_simple_extent_npoints(space) * H5Tget_size(type), '\0');
+	if (not rows.empty())
+		H5Dread(dset, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, &rows[0]);
+	H5Sclose(space);
+	H5Tclose(type);
+	H5Dclose(dset);
+	H5Fclose(file);
+	return rows;
+}
+#endif
+
+TEST(ModuleList, checkpointResumeNewProcess) {
+#if _OPENMP
+	int nThreads = omp_get_max_threads();
+	omp_set_num_threads(1);
+#endif
+	void (*oldHandler)(int) = std::signal(SIGINT, ignoreSignal);
+	Source source;
+	source.add(new SourcePowerLawSpectrum(1 * EeV, 100 * EeV, -2));
+	source.add(new SourceParticleType(22));
+
+	// reference run without interruption
+	Random::seedThreads(42);
+	Candidate::setNextSerialNumber(1);
+	{
+		ModuleList reference;
+		reference.add(new TextOutput("process_reference.txt", Output::Event1D));
+#ifdef CRPROPA_HAVE_HDF5
+		reference.add(new HDF5Output("process_reference.h5", Output::Event1D));
+#endif
+		reference.add(new RecordEnergy());
+		reference.run(&source, 6);
+	}
+
+	// interrupted after the checkpoint at 3 primaries, within the 5th, after
+	// which all objects of the process are gone
+	Random::seedThreads(42);
+	Candidate::setNextSerialNumber(1);
+	{
+		ModuleList modules;
+		modules.add(new InterruptAt(5));
+		ref_ptr<Output> text = new TextOutput("process_output.txt", Output::Event1D);
+		modules.add(text);
+		modules.addCheckpointOutput(text);
+#ifdef CRPROPA_HAVE_HDF5
+		ref_ptr<Output> hdf5 = new HDF5Output("process_output.h5", Output::Event1D);
+		modules.add(hdf5);
+		modules.addCheckpointOutput(hdf5);
+#endif
+		modules.add(new RecordEnergy());
+		modules.setCheckpoint("checkpoint_process.txt", 3);
+		modules.run(&source, 6);
+		EXPECT_EQ(5, text->size());
+	}
+
+	// a new process with other random generators, serial numbers, modules
+	// and outputs that continue the files
+	Random::seedThreads(1);
+	Candidate::setNextSerialNumber(1000);
+	{
+		ModuleList modules;
+		ref_ptr<Output> text = new TextOutput("process_output.txt", Output::Event1D, true);
+		modules.add(text);
+		modules.addCheckpointOutput(text);
+#ifdef CRPROPA_HAVE_HDF5
+		ref_ptr<Output> hdf5 = new HDF5Output("process_output.h5", Output::Event1D);
+		modules.add(hdf5);
+		modules.addCheckpointOutput(hdf5);
+#endif
+		modules.add(new RecordEnergy());
+		modules.resume(&source, "checkpoint_process.txt");
+		EXPECT_EQ(6, text->size());
+#ifdef CRPROPA_HAVE_HDF5
+		EXPECT_EQ(6, hdf5->size());
+#endif
+	}
+	EXPECT_EQ(readFile("process_reference.txt"), readFile("process_output.txt"));
+#ifdef CRPROPA_HAVE_HDF5
+	std::string rows = readRows("process_reference.h5");
+	EXPECT_FALSE(rows.empty());
+	EXPECT_TRUE(rows == readRows("process_output.h5"));
+	std::remove("process_reference.h5");
+	std::remove("process_output.h5");
+#endif
+
+	std::remove("process_reference.txt");
+	std::remove("process_output.txt");
+	std::remove("checkpoint_process.txt");
+	std::signal(SIGINT, oldHandler);
+#if _OPENMP
+	omp_set_num_threads(nThreads);
+#endif
+}
+
+// creates a neutrino, a low and a high energy photon
+class CreateSecondaries: public Module {
+public:
+	void process(Candidate *candidate) const {
+		candidate->addSecondary(12, 1 * EeV);
+		candidate->addSecondary(22, 1 * PeV);
+		candidate->addSecondary(22, 1 * EeV, Vector3d(1, 0, 0));
+	}
+};
+
+// counts the candidates passed to it
+class CountCandidates: public Module {
+public:
+	mutable size_t count;
+	mutable double energy;
+	CountCandidates() : count(0), energy(0) {}
+	void process(Candidate *candidate) const {
+		count++;
+		energy += candidate->current.getEnergy();
+	}
+};
+
+TEST(ModuleList, secondaryAdmission) {
+	ModuleList modules;
+	modules.add(new CreateSecondaries());
+
+	Candidate reference(11, 10 * EeV);
+	reference.setRandomStream(1);
+	modules.process(&reference);
+	ASSERT_EQ(3, reference.secondaries.size());
+
+	ref_ptr<SecondaryAdmission> admission = new SecondaryAdmission();
+	admission->deny(12);
+	admission->setMinimumEnergy(22, 10 * PeV);
+	ref_ptr<CountCandidates> rejected = new CountCandidates();
+	admission->setRejectedOutput(rejected);
+	modules.setSecondaryAdmission(admission);
+	EXPECT_EQ(admission, modules.getSecondaryAdmission());
+
+	Candidate c(11, 10 * EeV);
+	c.setRandomStream(1);
+	modules.process(&c);
+	ASSERT_EQ(1, c.secondaries.size());
+	EXPECT_EQ(22, c.secondaries[0]->current.getId());
+	EXPECT_DOUBLE_EQ(1 * EeV, c.secondaries[0]->current.getEnergy());
+	// the admitted secondary keeps its random stream
+	EXPECT_EQ(reference.secondaries[2]->getRandomStream(), c.secondaries[0]->getRandomStream());
+	EXPECT_EQ(2, rejected->count);
+	EXPECT_DOUBLE_EQ(1 * EeV + 1 * PeV, rejected->energy);
+
+	// no policy outside of the module list
+	EXPECT_TRUE(SecondaryAdmission::current() == 0);
+	c.addSecondary(12, 1 * EeV);
+	EXPECT_EQ(2, c.secondaries.size());
+
+	// allowed particles only
+	SecondaryAdmission photons;
+	photons.allow(22);
+	EXPECT_TRUE(photons.admit(22, 1 * eV, 1));
+	EXPECT_FALSE(photons.admit(11, 1 * EeV, 1));
+}
+
+// counts the flushes of the checkpoints
+class FlushCounter: public Output {
+public:
+	mutable int flushes;
+	FlushCounter() : flushes(0) {
+	}
+	void flush() const {
+		flushes++;
+	}
+};
+
+TEST(ModuleList, runConvergence) {
+	ModuleList modules;
+	modules.add(new SimplePropagation());
+	ref_ptr<HistogramOutput> histograms = new HistogramOutput();
+	size_t h = histograms->addHistogram("spectrum");
+	histograms->addAxis(h, HistogramOutput::Energy, 2, 1 * EeV, 100 * EeV, true);
+	ref_ptr<DetectionCounter> counter = new DetectionCounter(histograms);
+	ref_ptr<Observer> observer = new Observer();
+	observer->add(new ObserverDetectAll());
+	observer->onDetection(counter);
+	modules.add(observer);
+	Source source;
+	source.add(new SourceIsotropicEmission());
+	source.add(new SourcePowerLawSpectrum(1 * EeV, 100 * EeV, -1));
+	source.add(new SourceParticleType(nucleusId(1, 1)));
+
+	// every primary is detected: 1 / sqrt(N) after N primaries
+	ref_ptr<ConvergenceCriterion> criterion = new ConvergenceCriterion(10000, 0, 100);
+	criterion->addTarget(counter, 0.0501);
+	modules.run(&source, criterion);
+	EXPECT_TRUE(criterion->isConverged());
+	EXPECT_EQ(counter->getCount(), criterion->getPrimaries());
+	EXPECT_LE(399, criterion->getPrimaries());
+	EXPECT_GE(400, criterion->getPrimaries());
+	ASSERT_EQ(1, criterion->getRelativeUncertainties().size());
+	EXPECT_GE(0.0501, criterion->getRelativeUncertainties()[0]);
+	EXPECT_NE(std::string::npos, criterion->getReport().find("converged after"));
+
+	// the bins of the histogram hold about half of the primaries each
+	ref_ptr<HistogramBinObservable> bin = new HistogramBinObservable(histograms, h, 1);
+	EXPECT_NEAR(1 / sqrt(bin->getValue()), bin->getRelativeUncertainty(), 1e-12);
+	criterion = new ConvergenceCriterion(1000, 0, 100);
+	criterion->addTarget(histograms, h, 1, 1e-3);
+	criterion->addTarget(counter, 0.5);
+	modules.run(&source, criterion);
+	EXPECT_FALSE(criterion->isConverged());
+	EXPECT_EQ(1000, criterion->getPrimaries());
+	EXPECT_LT(1e-3, criterion->getRelativeUncertainties()[0]);
+	EXPECT_THROW(HistogramBinObservable(histograms, h, 2), std::runtime_error);
+	EXPECT_THROW(modules.run(&source, new ConvergenceCriterion(10)), std::runtime_error);
+
+	// the batches are split at the checkpoints, the report is printed only with the progress
+	ref_ptr<FlushCounter> flushes = new FlushCounter();
+	modules.setCheckpoint("convergence_checkpoint.txt", 50);
+	modules.addCheckpointOutput(flushes);
+	criterion = new ConvergenceCriterion(1000, 0, 100);
+	criterion->addTarget(counter, 1e-3);
+	std::stringstream printed;
+	std::streambuf *previous = std::cout.rdbuf(printed.rdbuf());
+	modules.run(&source, criterion);
+	std::cout.rdbuf(previous);
+	EXPECT_EQ(1000, criterion->getPrimaries());
+	EXPECT_EQ(20, flushes->flushes);
+	EXPECT_EQ(std::string::npos, printed.str().find(criterion->getReport()));
+	std::remove("convergence_checkpoint.txt");
+}
+
+ref_ptr<Observer> observer1D() {
+	ref_ptr<Observer> observer = new Observer();
+	observer->add(new ObserverPoint());
+	return observer;
+}
+
+// stochastic interactions with a constant rate, which are only counted
+class CountedInteraction: public Module {
+	double rate;
+public:
+	mutable size_t count;
+	CountedInteraction(double rate) : rate(rate), count(0) {
+	}
+	void process(Candidate *candidate) const {
+	}
+	bool hasInteractionRate() const {
+		return true;
+	}
+	double getInteractionRate(const Candidate *candidate) const {
+		return rate;
+	}
+	void performStochasticInteraction(Candidate *candidate) const {
+#pragma omp atomic
+		count++;
+	}
+};
+
+TEST(ModuleList1D, redshift) {
+	// same result as a ModuleList with the continuous losses
+	ModuleList modules;
+	modules.add(new SimplePropagation(1 * kpc, 10 * Mpc));
+	ref_ptr<ContinuousLosses> losses = new ContinuousLosses();
+	losses->add(new Redshift());
+	modules.add(losses);
+	modules.add(observer1D());
+
+	ModuleList1D modules1D(4);
+	modules1D.add(new SimplePropagation(1 * kpc, 10 * Mpc));
+	modules1D.add(new Redshift());
+	modules1D.add(observer1D());
+	EXPECT_EQ(1, modules1D.getContinuousLosses()->size());
+	EXPECT_EQ(1, modules1D.getModuleList()->size());
+
+	ModuleList::candidate_vector_t candidates, candidates1D;
+	for (size_t i = 0; i < 10; i++) {
+		double D = (i + 1) * 50 * Mpc;
+		ref_ptr<Candidate> c = new Candidate(nucleusId(1, 1), 10 * EeV, Vector3d(D, 0, 0), Vector3d(-1, 0, 0));
+		c->setRedshift(comovingDistance2Redshift(D));
+		candidates.push_back(c);
+		candidates1D.push_back(c->clone(false));
+	}
+	modules.runBatch(&candidates);
+	modules1D.run(&candidates1D);
+
+	for (size_t i = 0; i < candidates.size(); i++) {
+		EXPECT_FALSE(candidates1D[i]->isActive());
+		EXPECT_DOUBLE_EQ(candidates[i]->current.getEnergy(), candidates1D[i]->current.getEnergy());
+		EXPECT_DOUBLE_EQ(candidates[i]->getTrajectoryLength(), candidates1D[i]->getTrajectoryLength());
+		EXPECT_DOUBLE_EQ(candidates[i]->getRedshift(), candidates1D[i]->getRedshift());
+	}
+}
+
+TEST(ModuleList1D, interactions) {
+	ref_ptr<CountedInteraction> interaction = new CountedInteraction(1 / (10 * Mpc));
+	ModuleList1D modules1D;
+	modules1D.add(new SimplePropagation(1 * kpc, 10 * Mpc));
+	modules1D.add(interaction);
+	modules1D.add(observer1D());
+	EXPECT_EQ(1, modules1D.getInteractionSampler()->getNumberOfInteractions());
+
+	// 10 interactions per candidate expected
+	Random::seedThreads(1);
+	ModuleList::candidate_vector_t candidates;
+	for (size_t i = 0; i < 100; i++)
+		candidates.push_back(new Candidate(nucleusId(1, 1), 10 * EeV, Vector3d(100 * Mpc, 0, 0), Vector3d(-1, 0, 0)));
+	modules1D.run(&candidates);
+	EXPECT_NEAR(1000, interaction->count, 5 * sqrt(1000));
+
+	// only candidates on the x-axis are propagated
+	ModuleList::candidate_vector_t offAxis;
+	offAxis.push_back(new Candidate(nucleusId(1, 1), 10 * EeV, Vector3d(100 * Mpc, 0, 0), Vector3d(0, -1, 0)));
+	modules1D.run(&offAxis);
+	EXPECT_TRUE(offAxis[0]->isActive());
+}
+
+// halves the energy and limits the next step, counting its calls
+class HalveEnergy: public BatchModule {
+public:
+	mutable int calls;
+	HalveEnergy() : calls(0) {}
+	void processCandidates(CandidateBatch &batch) const {
+		calls++;
+		for (size_t i = 0; i < batch.size(); i++) {
+			batch.energy[i] /= 2;
+			batch.nextStep[i] = 1 * kpc;
+		}
+	}
+};
+
+// continuous losses depending on energy and redshift
+class PowerLawLoss: public Module {
+public:
+	void process(Candidate *candidate) const {
+	}
+	bool hasEnergyLossRate() const {
+		return true;
+	}
+	double getEnergyLossRate(const Candidate *candidate, double E, double z) const {
+		return E * sqrt(E / EeV) * pow(1 + z, 2) / (500 * Mpc);
+	}
+};
+
+TEST(ModuleList1D, lossTables) {
+	ModuleList1D exact(4), tabulated(4);
+	exact.add(new SimplePropagation(1 * kpc, 10 * Mpc));
+	exact.add(new Redshift());
+	exact.add(new PowerLawLoss());
+	exact.add(observer1D());
+	tabulated.add(new SimplePropagation(1 * kpc, 10 * Mpc));
+	tabulated.add(new Redshift());
+	tabulated.add(new PowerLawLoss());
+	tabulated.add(observer1D());
+	tabulated.setLossTables(1);
+
+	// within the tables, starting above them, at z = 0 and beyond zmax
+	ModuleList::candidate_vector_t candidates, candidatesTabulated;
+	for (size_t i = 0; i < 12; i++) {
+		double D = (i + 1) * 100 * Mpc;
+		double E = (i < 10) ? (i + 1) * 5 * EeV : 1e24 * eV;
+		double z = (i == 10) ? 0 : comovingDistance2Redshift(D);
+		if (i == 11)
+			z = 1.5;
+		ref_ptr<Candidate> c = new Candidate(nucleusId(1, 1), E, Vector3d(D, 0, 0), Vector3d(-1, 0, 0));
+		c->setRedshift(z);
+		candidates.push_back(c);
+		candidatesTabulated.push_back(c->clone(false));
+	}
+	exact.run(&candidates);
+	tabulated.run(&candidatesTabulated);
+	EXPECT_EQ(1, tabulated.getNumberOfLossTables());
+
+	for (size_t i = 0; i < candidates.size(); i++) {
+		const Candidate *c = candidates[i], *t = candidatesTabulated[i];
+		EXPECT_FALSE(t->isActive());
+		EXPECT_NEAR(c->current.getEnergy(), t->current.getEnergy(), 1e-3 * c->current.getEnergy());
+		EXPECT_NEAR(c->getRedshift(), t->getRedshift(), 1e-6);
+		EXPECT_NEAR(c->getTrajectoryLength(), t->getTrajectoryLength(), 1e-9 * c->getTrajectoryLength());
+	}
+
+	tabulated.setLossTables(0);
+	EXPECT_EQ(0, tabulated.getNumberOfLossTables());
+	EXPECT_THROW(tabulated.setLossTables(-1), std::runtime_error);
+	EXPECT_THROW(tabulated.setLossTables(1, 1 * EeV, 1 * EeV), std::runtime_error);
+}
+
+TEST(BatchModule, process) {
+	ref_ptr<HalveEnergy> module = new HalveEnergy();
+	Candidate c(nucleusId(1, 1), 10 * EeV, Vector3d(1, 2, 3) * Mpc);
+	c.setNextStep(1 * Mpc);
+	module->process(&c);
+	EXPECT_EQ(1, module->calls);
+	EXPECT_DOUBLE_EQ(5 * EeV, c.current.getEnergy());
+	EXPECT_DOUBLE_EQ(1 * kpc, c.getNextStep());
+	// unchanged columns are not written back
+	EXPECT_EQ(Vector3d(1, 2, 3) * Mpc, c.current.getPosition());
+	EXPECT_EQ(nucleusId(1, 1), c.current.getId());
+
+	CandidateBatch batch;
+	Candidate *p = &c;
+	batch.fill(&p, 1);
+	EXPECT_EQ(&c, batch.getCandidate(0));
+	EXPECT_THROW(batch.getCandidate(1), std::runtime_error);
+}
+
+TEST(BatchModule, runBatch) {
+	ref_ptr<HalveEnergy> module = new HalveEnergy();
+	ModuleList modules;
+	modules.add(module);
+	modules.add(new MinimumEnergy(1 * EeV));
+	ModuleList::candidate_vector_t candidates;
+	for (int i = 0; i < 8; i++)
+		candidates.push_back(new Candidate(nucleusId(1, 1), 10 * EeV));
+	modules.runBatch(&candidates, 8, false);
+	for (int i = 0; i < 8; i++) {
+		EXPECT_FALSE(candidates[i]->isActive());
+		EXPECT_DOUBLE_EQ(10 * EeV / 16, candidates[i]->current.getEnergy());
+	}
+	// one call per step of the batch, not per candidate
+	EXPECT_EQ(4, module->calls);
+}
+
+TEST(ModuleList, memoryReport) {
+	ref_ptr<Grid3f> grid = new Grid3f(Vector3d(0.), 8, 1 * kpc);
+	ref_ptr<ModuleList> modules = new ModuleList();
+	modules->add(new PropagationCK(new MagneticFieldGrid(grid)));
+	modules->add(new MaximumTrajectoryLength(10 * kpc));
+	EXPECT_EQ(grid->getSizeOf(), modules->getMemoryUsage());
+
+	std::string report = modules->getMemoryReport();
+	EXPECT_EQ(0, report.find("crpropa::ModuleList: Memory of 2 modules"));
+	EXPECT_NE(std::string::npos, report.find("peak live candidates per thread"));
+	std::string json = modules->getMemoryReport(true);
+	std::stringstream bytes;
+	bytes << "\"moduleBytes\": " << grid->getSizeOf();
+	EXPECT_NE(std::string::npos, json.find(bytes.str()));
+
+	// nested lists report the memory of their modules
+	ModuleList outer;
+	outer.add(modules);
+	EXPECT_EQ(grid->getSizeOf(), outer.getMemoryUsage());
+}
+
+TEST(ModuleList, metrics) {
+	ModuleList modules;
+	modules.add(new SimplePropagation(1 * kpc, 1 * kpc));
+	modules.add(new MaximumTrajectoryLength(10 * kpc));
+	Source source;
+	source.add(new SourceParticleType(nucleusId(1, 1)));
+
+	std::string filename = "testMetrics.json";
+	ref_ptr<RunMetrics> metrics = new RunMetrics(filename, 0.01);
+	modules.setMetrics(metrics);
+	modules.setProfiling(true);
+	modules.run(&source, 5, false);
+	EXPECT_FALSE(metrics->isRunning());
+	RunMetrics::Counts counts = metrics->getCounts();
+	EXPECT_EQ(5, counts.primaries);
+	EXPECT_EQ(modules.getProfiledSteps(), counts.steps);
+	EXPECT_EQ(0, counts.detections);
+
+	std::ifstream in(filename.c_str());
+	std::stringstream content;
+	content << in.rdbuf();
+	std::string json = content.str();
+	EXPECT_EQ(0, json.find("{\"running\": false"));
+	EXPECT_NE(std::string::npos, json.find("\"primaries\": 5,"));
+	EXPECT_NE(std::string::npos, json.find("\"eta\": 0,"));
+	std::remove(filename.c_str());
+
+	// the Prometheus text format
+	filename = "testMetrics.prom";
+	metrics = new RunMetrics(filename, 10, RunMetrics::Prometheus);
+	modules.setMetrics(metrics);
+	modules.run(&source, 3, false);
+	std::string status = metrics->getStatus();
+	EXPECT_NE(std::string::npos, status.find("# TYPE crpropa_run_primaries_total counter\n"));
+	EXPECT_NE(std::string::npos, status.find("crpropa_run_primaries_total 3\n"));
+	EXPECT_NE(std::string::npos, status.find("crpropa_run_running 0\n"));
+	std::remove(filename.c_str());
+}
+
+#ifdef CRPROPA_HAVE_TRACING
+TEST(ModuleList, trace) {
+	ModuleList modules;
+	modules.setShowProgress(false);
+	modules.add(new SimplePropagation(1 * kpc, 1 * kpc));
+	modules.add(new MaximumTrajectoryLength(10 * kpc));
+	Source source;
+	source.add(new SourceParticleType(nucleusId(1, 1)));
+
+	modules.run(&source, 2, false); // not traced
+	modules.setProfiling(true);
+	Trace::start();
+	modules.run(&source, 5, false);
+	Trace::stop();
+	// a run, 5 primaries drawn in one block and every step of the 2 modules
+	EXPECT_EQ(1 + 1 + 5 + 2 * modules.getProfiledSteps(), Trace::getEventCount());
+	EXPECT_EQ(0, Trace::getDroppedCount());
+
+	std::string filename = "testTrace.json";
+	Trace::write(filename);
+	std::ifstream in(filename.c_str());
+	std::stringstream content;
+	content << in.rdbuf();
+	std::string json = content.str();
+	EXPECT_EQ(0, json.find("{\"traceEvents\": ["));
+	EXPECT_NE(std::string::npos, json.find("\"name\": \"ModuleList::run\""));
+	EXPECT_NE(std::string::npos, json.find("\"name\": \"crpropa::SimplePropagation\""));
+	EXPECT_NE(std::string::npos, json.find("\"ph\": \"X\""));
+	std::remove(filename.c_str());
+
+	// the spans per thread are limited
+	Trace::start(3);
+	modules.run(&source, 5, false);
+	Trace::stop();
+	EXPECT_EQ(3, Trace::getEventCount());
+	EXPECT_LT(0, Trace::getDroppedCount());
+}
+#endif
+
+// counts the calls of prepare
+class PreparedModule: public Module {
+public:
+	std::atomic<int> prepared;
+	PreparedModule() : prepared(0) {
+	}
+	void prepare() {
+		prepared++;
+	}
+	void process(Candidate *candidate) const {
+	}
+};
+
+class FailingModule: public Module {
+public:
+	FailingModule(std::string description) {
+		setDescription(description);
+	}
+	void prepare() {
+		throw std::runtime_error("missing table");
+	}
+	void process(Candidate *candidate) const {
+	}
+};
+
+TEST(ModuleList, prepareModules) {
+	ref_ptr<PreparedModule> first = new PreparedModule();
+	ref_ptr<PreparedModule> nested = new PreparedModule();
+	ref_ptr<PreparedModule> interaction = new PreparedModule();
+	ref_ptr<ModuleList> inner = new ModuleList();
+	inner->add(nested);
+	ref_ptr<InteractionSampler> sampler = new InteractionSampler();
+	sampler->add(interaction);
+
+	ModuleList modules;
+	modules.setShowProgress(false);
+	modules.add(first);
+	modules.add(new ModuleListRunner(inner));
+	modules.add(sampler);
+	ModuleList::candidate_vector_t candidates;
+	modules.run(&candidates);
+	EXPECT_EQ(1, first->prepared);
+	EXPECT_EQ(1, nested->prepared);
+	EXPECT_EQ(1, interaction->prepared);
+
+	// all modules are prepared, the failed ones are reported together
+	modules.add(new FailingModule("FirstTable\nsecond line"));
+	modules.add(new FailingModule("SecondTable"));
+	try {
+		modules.run(&candidates);
+		FAIL() << "no error";
+	} catch (std::runtime_error &e) {
+		std::string message = e.what();
+		EXPECT_NE(std::string::npos, message.find("FirstTable: missing table"));
+		EXPECT_NE(std::string::npos, message.find("SecondTable: missing table"));
+		EXPECT_EQ(std::string::npos, message.find("second line"));
+	}
+	EXPECT_EQ(2, first->prepared);
+	EXPECT_EQ(2, nested->prepared);
+	EXPECT_EQ(2, interaction->prepared);
+}
+
+TEST(TransferMatrix, build) {
+	std::vector<int> isotopes;
+	isotopes.push_back(nucleusId(1, 1));
+	isotopes.push_back(nucleusId(4, 2));
+	std::vector<double> edges;
+	edges.push_back(0);
+	edges.push_back(10 * Mpc);
+	edges.push_back(20 * Mpc);
+
+	// without interactions every primary is detected in its own bin
+	ref_ptr<ModuleList> simulation = new ModuleList();
+	simulation->add(new SimplePropagation(1 * kpc, 1 * Mpc));
+	ref_ptr<TransferMatrix> matrix = new TransferMatrix(simulation, isotopes, 4, 1 * EeV, 100 * EeV, edges);
+	ref_ptr<Observer> observer = new Observer();
+	observer->add(new ObserverPoint());
+	observer->onDetection(matrix->getRecorder());
+	simulation->add(observer);
+	matrix->build(20, "transfer_checkpoint.bin");
+
+	EXPECT_EQ(16, matrix->getNumberOfCells());
+	EXPECT_EQ(16, matrix->getNumberOfDoneCells());
+	EXPECT_EQ(4, matrix->getMaximumMassNumber());
+	for (size_t j = 0; j < 4; j++) {
+		size_t cell = matrix->getCell(1, j, 1);
+		ASSERT_EQ(1, matrix->getRow(cell).size());
+		EXPECT_FLOAT_EQ(1, matrix->getValue(cell, 4, j));
+		EXPECT_EQ(0, matrix->getValue(cell, 1, j));
+	}
+
+	// folded spectrum of a saved matrix
+	std::vector<double> fractions(2, 0.5);
+	std::vector<double> injected = matrix->getInjection(fractions, 2, 10 * EeV, 3);
+	EXPECT_THROW(matrix->getInjection(std::vector<double>(1, 1), 2, 10 * EeV), std::runtime_error);
+	std::vector<double> observed = matrix->fold(injected);
+	ASSERT_EQ(16, observed.size());
+	EXPECT_GT(observed[0], observed[3]);
+	EXPECT_EQ(0, observed[4]);
+	matrix->save("transfer_matrix.bin");
+	TransferMatrix saved("transfer_matrix.bin");
+	std::vector<double> folded = saved.fold(injected);
+	for (size_t i = 0; i < observed.size(); i++)
+		EXPECT_NEAR(observed[i], folded[i], 1e-6 * observed[i]);
+
+	// a resumed build takes over the done cells of the checkpoint
+	ref_ptr<ModuleList> empty = new ModuleList();
+	TransferMatrix resumed(empty, isotopes, 4, 1 * EeV, 100 * EeV, edges);
+	resumed.build(20, "transfer_checkpoint.bin");
+	EXPECT_FLOAT_EQ(1, resumed.getValue(matrix->getCell(0, 2, 0), 1, 2));
+
+	// bins must match
+	edges.push_back(30 * Mpc);
+	TransferMatrix other(empty, isotopes, 4, 1 * EeV, 100 * EeV, edges);
+	EXPECT_THROW(other.load("transfer_matrix.bin"), std::runtime_error);
+
+	std::remove("transfer_checkpoint.bin");
+	std::remove("transfer_matrix.bin");
+}
+
 #if _OPENMP
-#include <omp.h>
 TEST(ModuleList, runOpenMP) {
 	ModuleList modules;
 	modules.add(new SimplePropagation());
@@ -71,6 +1198,231 @@ TEST(ModuleList, runOpenMP) {
 }
 #endif
 
+// emits a photon of a tenth of the energy of a nucleus at every step
+class PhotonEmitter: public Module {
+public:
+	void process(Candidate *candidate) const {
+		if (isNucleus(candidate->current.getId()))
+			candidate->addSecondary(22, candidate->current.getEnergy() / 10);
+	}
+};
+
+TEST(StaticModuleChain, particleClassDispatch) {
+	StaticModuleChain<ClassCounter, ClassCounter, ClassCounter, ClassCounter> chain(
+			ClassCounter(PhotonClass, 11), ClassCounter(ElectronClass),
+			ClassCounter(PhotonClass), ClassCounter(AllParticleClasses));
+	EXPECT_EQ(4, chain.size());
+	EXPECT_EQ(AllParticleClasses, chain.getParticleClasses());
+
+	// the photon becomes an electron in the first module
+	Candidate c(22);
+	chain.process(&c);
+	EXPECT_EQ(11, c.current.getId());
+	EXPECT_EQ(1, chain.get<0>().count);
+	EXPECT_EQ(1, chain.get<1>().count);
+	EXPECT_EQ(0, chain.get<2>().count);
+	EXPECT_EQ(1, chain.get<3>().count);
+}
+
+TEST(StaticModuleChain, run) {
+	typedef StaticModuleChain<SimplePropagation, MaximumTrajectoryLength> Chain;
+	ref_ptr<Chain> chain = new Chain(SimplePropagation(1 * Mpc, 1 * Mpc),
+			MaximumTrajectoryLength(10.5 * Mpc));
+	EXPECT_DOUBLE_EQ(10.5 * Mpc, chain->get<1>().getMaximumTrajectoryLength());
+
+	ModuleList modules;
+	modules.add(new SimplePropagation(1 * Mpc, 1 * Mpc));
+	modules.add(new MaximumTrajectoryLength(10.5 * Mpc));
+
+	ParticleState initial(nucleusId(1, 1), 1 * EeV, Vector3d(0.), Vector3d(1, 0, 0));
+	ref_ptr<Candidate> a = new Candidate(initial);
+	ref_ptr<Candidate> b = new Candidate(initial);
+	chain->run(a);
+	modules.run(b);
+	EXPECT_FALSE(a->isActive());
+	EXPECT_DOUBLE_EQ(b->getTrajectoryLength(), a->getTrajectoryLength());
+	EXPECT_DOUBLE_EQ(b->current.getPosition().x, a->current.getPosition().x);
+
+	// as a module of a list
+	ModuleList wrapped;
+	wrapped.add(chain);
+	ref_ptr<Candidate> c = new Candidate(initial);
+	wrapped.run(c);
+	EXPECT_DOUBLE_EQ(b->getTrajectoryLength(), c->getTrajectoryLength());
+
+	// secondaries after every step, the finished ones are not run again
+	typedef StaticModuleChain<ClassCounter, PhotonEmitter, SimplePropagation,
+			MaximumTrajectoryLength> EmittingChain;
+	EmittingChain emitting(ClassCounter(PhotonClass), PhotonEmitter(),
+			SimplePropagation(1 * Mpc, 1 * Mpc), MaximumTrajectoryLength(10.5 * Mpc));
+	ref_ptr<Candidate> d = new Candidate(initial);
+	emitting.run(d, true, true);
+	ASSERT_EQ(11, d->secondaries.size());
+	for (size_t i = 0; i < d->secondaries.size(); i++)
+		EXPECT_FALSE(d->secondaries[i]->isActive());
+	// the photon of step k starts at the trajectory length k - 1 Mpc and takes 12 - k steps
+	EXPECT_EQ(66, emitting.get<0>().count);
+}
+
+TEST(TargetedEmission, forward) {
+	// straight lines from the origin to a sphere of radius 2 Mpc at 10 Mpc
+	double isotropic = (1 - sqrt(1 - 0.04)) / 2;
+	ref_ptr<Source> source = new Source();
+	source->add(new SourceParticleType(nucleusId(1, 1)));
+	source->add(new SourceEnergy(1 * EeV));
+	source->add(new SourcePosition(Vector3d(0.)));
+
+	ref_ptr<TargetedEmission> targeted = new TargetedEmission(36, 18, 4);
+	ref_ptr<Observer> pilotObserver = new Observer();
+	pilotObserver->add(new ObserverSurface(new Sphere(Vector3d(10 * Mpc, 0, 0), 2 * Mpc)));
+	pilotObserver->onDetection(targeted->getRecorder());
+	ModuleList pilot;
+	pilot.add(new SimplePropagation(0.2 * Mpc, 0.2 * Mpc));
+	pilot.add(pilotObserver);
+	pilot.add(new MaximumTrajectoryLength(13 * Mpc));
+	ref_ptr<Source> isotropicSource = new Source();
+	isotropicSource->add(new SourceParticleType(nucleusId(1, 1)));
+	isotropicSource->add(new SourceEnergy(1 * EeV));
+	isotropicSource->add(new SourcePosition(Vector3d(0.)));
+	isotropicSource->add(new SourceIsotropicEmission());
+	targeted->runPilot(&pilot, isotropicSource, 20000);
+	EXPECT_EQ(1, targeted->getEmissionMap()->getMaps().size());
+
+	// the weighted hits of the targeted emission are those of isotropic emission
+	targeted->configure(source);
+	ref_ptr<ParticleCollector> detected = new ParticleCollector();
+	ref_ptr<Observer> observer = new Observer();
+	observer->add(new ObserverSurface(new Sphere(Vector3d(10 * Mpc, 0, 0), 2 * Mpc)));
+	observer->onDetection(detected);
+	ModuleList forward;
+	forward.add(new SimplePropagation(0.2 * Mpc, 0.2 * Mpc));
+	forward.add(observer);
+	forward.add(new MaximumTrajectoryLength(13 * Mpc));
+	size_t n = 2000;
+	forward.run(source, n);
+	double hits = 0;
+	for (size_t i = 0; i < detected->size(); i++)
+		hits += (*detected)[i]->getWeight() / n;
+	EXPECT_LT(0.25 * n, detected->size()); // isotropic emission hits in 1 % of the primaries
+	EXPECT_NEAR(isotropic, hits, 0.15 * isotropic); // this test can stochastically fail
+
+	EXPECT_THROW(targeted->setIsotropicFraction(2), std::runtime_error);
+}
+
+TEST(TransportSolver1D, disintegration) {
+	// tables of C-12 only: constant rate of 1 / Mpc, emitting a neutron or an alpha particle
+	{
+		std::ofstream rate("solver_pd_rate.txt");
+		std::ofstream branching("solver_pd_branching.txt");
+		rate << "6 6";
+		branching << "6 6 100000";
+		for (int i = 0; i < 201; i++) {
+			rate << " 1";
+			branching << " 0.5";
+		}
+		branching << "\n6 6 1";
+		for (int i = 0; i < 201; i++)
+			branching << " 0.5";
+		rate << "\n";
+		branching << "\n";
+	}
+	ref_ptr<PhotoDisintegration> pd = new PhotoDisintegration(new CMB());
+	pd->initRate("solver_pd_rate.txt");
+	pd->initBranching("solver_pd_branching.txt");
+	std::remove("solver_pd_rate.txt");
+	std::remove("solver_pd_branching.txt");
+
+	TransportSolver1D solver(60, 1e8, 1e11);
+	solver.add(pd);
+	solver.setStep(0.1 * Mpc);
+	EXPECT_THROW(solver.add(new Observer()), std::runtime_error);
+	solver.inject(nucleusId(12, 6), 120 * EeV, 3 * Mpc, 2);
+	solver.solve();
+
+	// parents before products
+	const std::vector<int> &species = solver.getSpecies();
+	ASSERT_EQ(5, species.size());
+	EXPECT_EQ(nucleusId(12, 6), species[0]);
+
+	// the fragments keep the Lorentz factor
+	double surviving = 2 * exp(-3 * pow(1 + comovingDistance2Redshift(1.5 * Mpc), 2));
+	std::vector<double> carbon = solver.getSpectrum(nucleusId(12, 6));
+	std::vector<double> neutrons = solver.getSpectrum(nucleusId(1, 0));
+	size_t bin = std::max_element(carbon.begin(), carbon.end()) - carbon.begin();
+	EXPECT_NEAR(surviving, carbon[bin], 1e-3);
+	EXPECT_NEAR((2 - surviving) / 2, neutrons[bin], 1e-3);
+	EXPECT_NEAR((2 - surviving) / 2, solver.getSpectrum(nucleusId(8, 4))[bin], 1e-3);
+
+	// nucleons are conserved
+	double nucleons = 0;
+	for (size_t s = 0; s < species.size(); s++) {
+		std::vector<double> spectrum = solver.getSpectrum(species[s]);
+		for (size_t k = 0; k < spectrum.size(); k++)
+			nucleons += massNumber(species[s]) * spectrum[k];
+	}
+	EXPECT_NEAR(24, nucleons, 1e-9);
+
+	std::vector<double> edges;
+	edges.push_back(1 * EeV);
+	edges.push_back(1000 * EeV);
+	EXPECT_NEAR(surviving, solver.getEnergySpectrum(edges, 12)[0], 1e-3);
+	EXPECT_NEAR((2 - surviving) / 2, solver.getEnergySpectrum(edges, 1)[0], 1e-3);
+}
+
+TEST(TransportSolver1D, pionProduction) {
+	// constant rates of 1 / Mpc on protons and neutrons
+	{
+		std::ofstream rate("solver_ppp_rate.txt");
+		for (int i = 0; i <= 20; i++)
+			rate << 6 + 0.5 * i << " 1 1\n";
+	}
+	ref_ptr<PhotoPionProduction> ppp = new PhotoPionProduction(new CMB());
+	ppp->initRate("solver_ppp_rate.txt");
+	std::remove("solver_ppp_rate.txt");
+	double inelasticity = ppp->getMeanInelasticity();
+
+	// protons lose the mean fraction continuously
+	TransportSolver1D solver(200, 1e9, 1e13);
+	solver.add(ppp);
+	solver.setStep(0.05 * Mpc);
+	solver.inject(nucleusId(1, 1), 200 * EeV, 2 * Mpc);
+	solver.solve();
+	std::vector<double> protons = solver.getSpectrum(nucleusId(1, 1));
+	double number = 0, lnGamma = 0;
+	for (size_t k = 0; k < protons.size(); k++) {
+		number += protons[k];
+		lnGamma += protons[k] * log(solver.getLorentzFactor(k));
+	}
+	double gamma0 = 200 * EeV / (nuclearMass(nucleusId(1, 1)) * c_squared);
+	double h = log(1e4) / 200;
+	EXPECT_NEAR(1, number, 1e-9);
+	EXPECT_NEAR(log(gamma0) - 2 * inelasticity, lnGamma, h);
+	double lost = 200 * EeV * (1 - exp(-2 * inelasticity));
+	EXPECT_NEAR(lost, solver.getElectromagneticEnergy() + solver.getNeutrinoEnergy(), 0.05 * lost);
+	EXPECT_NEAR(3 * solver.getNeutrinoEnergy(), solver.getElectromagneticEnergy(), 1e-6 * lost);
+
+	// helium loses nucleons, which keep the nucleon number
+	solver.clear();
+	solver.inject(nucleusId(4, 2), 400 * EeV, 1 * Mpc);
+	solver.solve();
+	double nucleons = 0;
+	for (size_t s = 0; s < solver.getSpecies().size(); s++) {
+		int id = solver.getSpecies()[s];
+		std::vector<double> spectrum = solver.getSpectrum(id);
+		for (size_t k = 0; k < spectrum.size(); k++)
+			nucleons += massNumber(id) * spectrum[k];
+	}
+	EXPECT_NEAR(4, nucleons, 1e-9);
+	EXPECT_EQ(nucleusId(4, 2), solver.getSpecies()[0]);
+
+	// the ejected protons are below the Lorentz factor of the nuclei
+	std::vector<double> helium = solver.getSpectrum(nucleusId(4, 2));
+	protons = solver.getSpectrum(nucleusId(1, 1));
+	size_t heliumBin = std::max_element(helium.begin(), helium.end()) - helium.begin();
+	size_t protonBin = std::max_element(protons.begin(), protons.end()) - protons.begin();
+	EXPECT_LT(protonBin, heliumBin);
+}
+
 int main(int argc, char **argv) {
 	::testing::InitGoogleTest(&argc, argv);
 	return RUN_ALL_TESTS();
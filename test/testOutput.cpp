@@ -1,20 +1,36 @@
 /** Unit tests for Output modules of CRPropa
     Output
     TextOutput
+    TrajectoryOutput
     ParticleCollector
+    SnapshotCollector
+    ShellCrossingRecorder
  */
 
 #include "CRPropa.h"
 
 #include "gtest/gtest.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 #include <string>
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #ifdef CRPROPA_HAVE_HDF5
 #include <hdf5.h>
 #endif
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 // compare two arrays (intead of using Google Mock)
 // https://stackoverflow.com/a/10062016/6819103
 template <typename T, size_t size>
@@ -43,6 +59,90 @@ TEST(Output, size) {
 	EXPECT_EQ(output.size(), 5);
 }
 
+// exposes the compiled property columns
+class PropertyRowOutput: public Output {
+public:
+	using Output::writeProperty;
+	using Output::getPropertyRowSize;
+	const Property &getProperty(size_t i) const {
+		return properties[i];
+	}
+};
+
+TEST(Output, propertyColumns) {
+	PropertyRowOutput output;
+	output.enableProperty("count", int32_t(-1));
+	output.enableProperty("label", std::string("none"));
+	output.enableProperty("value", 0.5);
+	EXPECT_EQ(0, output.getProperty(0).offset);
+	EXPECT_EQ(4, output.getProperty(1).offset);
+	EXPECT_EQ(8, output.getProperty(2).offset);
+	EXPECT_EQ(16, output.getPropertyRowSize());
+
+	unsigned char row[16];
+	Candidate c;
+	// defaults for missing properties
+	for (size_t i = 0; i < 3; i++)
+		output.writeProperty(&c, output.getProperty(i), row);
+	int32_t count;
+	double value;
+	std::memcpy(&count, row, 4);
+	std::memcpy(&value, row + 8, 8);
+	EXPECT_EQ(-1, count);
+	EXPECT_EQ("none", std::string((const char *) row + 4, 4));
+	EXPECT_EQ(0.5, value);
+
+	// values converted to the column type, strings truncated to the default length
+	c.setProperty("count", 42.);
+	c.setProperty("label", std::string("longer"));
+	c.setProperty("value", int32_t(3));
+	for (size_t i = 0; i < 3; i++)
+		output.writeProperty(&c, output.getProperty(i), row);
+	std::memcpy(&count, row, 4);
+	std::memcpy(&value, row + 8, 8);
+	EXPECT_EQ(42, count);
+	EXPECT_EQ("long", std::string((const char *) row + 4, 4));
+	EXPECT_EQ(3., value);
+}
+
+TEST(Output, filter) {
+	Output output;
+	output.setFilter("E >= 10 and E < 100 && ID == 1000010010 and flag != 0");
+	EXPECT_EQ("E >= 10 and E < 100 && ID == 1000010010 and flag != 0", output.getFilter());
+
+	Candidate c(nucleusId(1, 1), 50 * EeV);
+	output.process(&c); // no property
+	c.setProperty("flag", 1);
+	output.process(&c);
+	c.current.setEnergy(100 * EeV);
+	output.process(&c);
+	c.current.setEnergy(10 * EeV);
+	c.current.setId(nucleusId(4, 2));
+	output.process(&c);
+	c.current.setId(nucleusId(1, 1));
+	c.setProperty("flag", 0);
+	output.process(&c);
+	EXPECT_EQ(1, output.size());
+
+	// in the units of the columns
+	Output scaled;
+	scaled.setLengthScale(kpc);
+	scaled.setFilter("D<=5");
+	c.setTrajectoryLength(4 * kpc);
+	scaled.process(&c);
+	c.setTrajectoryLength(6 * kpc);
+	scaled.process(&c);
+	EXPECT_EQ(1, scaled.size());
+
+	Output invalid;
+	EXPECT_THROW(invalid.setFilter("E >"), std::runtime_error);
+	EXPECT_THROW(invalid.setFilter("E ~ 1"), std::runtime_error);
+	EXPECT_THROW(invalid.setFilter("E < 1 and"), std::runtime_error);
+	EXPECT_THROW(invalid.setFilter("< 1"), std::runtime_error);
+	invalid.setFilter("");
+	EXPECT_EQ("", invalid.getFilter());
+}
+
 //-- TextOutput
 
 TEST(TextOutput, printHeader_Trajectory1D) {
@@ -122,6 +222,245 @@ TEST(TextOutput, printProperty) {
 	EXPECT_EQ(captured.substr(0, captured.find("\n")), "#\tfoo");
 }
 
+TEST(TextOutput, async) {
+	std::stringstream ss;
+	TextOutput output(ss, Output::Event1D);
+	output.setAsync(true, 16);
+	EXPECT_TRUE(output.isAsync());
+
+	Candidate c;
+#pragma omp parallel for
+	for (int i = 0; i < 1000; i++)
+		output.process(&c);
+	output.flush();
+	EXPECT_EQ(1000, output.size());
+
+	size_t lines = 0, comments = 0;
+	std::string line;
+	while (std::getline(ss, line)) {
+		if (line[0] == '#')
+			comments++;
+		else
+			lines++;
+	}
+	EXPECT_EQ(1000, lines);
+	EXPECT_GT(comments, 0);
+}
+
+TEST(ShardedOutput, text) {
+	ShardedOutput output("testShardedOutput.txt", Output::Event1D);
+	output.setFilter("E >= 1");
+	EXPECT_EQ("testShardedOutput.r2.t3.txt", output.getShardName(2, 3));
+	EXPECT_EQ("testShardedOutput.txt.json", output.getManifestName());
+
+#pragma omp parallel for
+	for (int i = 0; i < 1000; i++) {
+		Candidate c(nucleusId(1, 1), (i % 2) * EeV);
+		output.process(&c);
+	}
+	output.close();
+	EXPECT_EQ(500, output.size());
+
+	// the shards have the configuration and the rows of all threads
+	size_t lines = 0;
+	const std::vector<std::string> &files = output.getShardFiles();
+	EXPECT_GE(files.size(), 1);
+	for (size_t i = 0; i < files.size(); i++) {
+		std::ifstream in(files[i].c_str());
+		std::string line;
+		while (std::getline(in, line))
+			if (line[0] != '#')
+				lines++;
+		std::remove(files[i].c_str());
+	}
+	EXPECT_EQ(500, lines);
+
+	std::ifstream in(output.getManifestName().c_str());
+	std::stringstream manifest;
+	manifest << in.rdbuf();
+	EXPECT_NE(std::string::npos, manifest.str().find("\"output\": \"TextOutput\""));
+	EXPECT_NE(std::string::npos, manifest.str().find("\"file\": \"testShardedOutput.r0.t"));
+	std::remove(output.getManifestName().c_str());
+
+	Candidate c;
+	EXPECT_THROW(output.process(&c), std::runtime_error);
+}
+
+#ifdef CRPROPA_HAVE_HDF5
+TEST(ShardedOutput, hdf5) {
+	ShardedOutput output("testShardedOutput.h5", Output::Event3D, ShardedOutput::HDF5);
+#pragma omp parallel for
+	for (int i = 0; i < 100; i++) {
+		Candidate c(nucleusId(1, 1), 1 * EeV);
+		output.process(&c);
+	}
+	output.close();
+	EXPECT_EQ(100, output.size());
+	for (size_t i = 0; i < output.getShardFiles().size(); i++)
+		std::remove(output.getShardFiles()[i].c_str());
+	std::remove(output.getManifestName().c_str());
+}
+#endif
+
+TEST(TextOutput, format) {
+	// the columns are formatted like printf in any locale
+	std::stringstream ss;
+	TextOutput output(ss);
+	output.disableAll();
+	output.enable(Output::CurrentIdColumn);
+	output.enable(Output::WeightColumn);
+	double weights[6] = {0, 1234565, -9.999995e-7, 5e-324, 3.3e300, 1. / 3};
+	Candidate c;
+	for (int i = 0; i < 6; i++) {
+		c.current.setId(-1000 * i);
+		c.setWeight(weights[i]);
+		output.process(&c);
+	}
+	std::string line;
+	for (int i = 0; i < 6; ) {
+		std::getline(ss, line);
+		if (line[0] == '#')
+			continue;
+		char expected[64];
+		std::sprintf(expected, "%10i\t%8.5E", -1000 * i, weights[i]);
+		EXPECT_EQ(expected, line);
+		i++;
+	}
+}
+
+// splits candidates above 10 EeV into two photons of random energy, each candidate takes one step
+class RandomSplit: public Module {
+public:
+	void process(Candidate *candidate) const {
+		double E = candidate->current.getEnergy();
+		if (E > 10 * EeV) {
+			candidate->addSecondary(22, Random::instance().rand() * E / 2);
+			candidate->addSecondary(22, Random::instance().rand() * E / 2);
+		}
+		candidate->setActive(false);
+	}
+};
+
+// runs the splits of 300 primaries with an ordered output
+static void runOrdered(Output *output, int threads) {
+	Source source;
+	source.add(new SourcePowerLawSpectrum(1 * EeV, 1000 * EeV, -1));
+	source.add(new SourceParticleType(nucleusId(1, 1)));
+	ModuleList modules;
+	modules.add(new RandomSplit());
+	modules.add(output);
+	modules.setCounterBasedRandom(true, 7);
+	modules.setShowProgress(false);
+#ifdef _OPENMP
+	int nThreads = omp_get_max_threads();
+	omp_set_num_threads(threads);
+#endif
+	modules.run(&source, 300, true);
+#ifdef _OPENMP
+	omp_set_num_threads(nThreads);
+#endif
+}
+
+TEST(TextOutput, ordered) {
+	// the same file for any number of threads, with spills of few rows
+	std::string text[2];
+	for (int t = 0; t < 2; t++) {
+		std::stringstream ss;
+		ref_ptr<TextOutput> output = new TextOutput(ss, Output::Event1D);
+		output->setOrdered(true, 16);
+		EXPECT_TRUE(output->isOrdered());
+		runOrdered(output, t ? 4 : 1);
+		EXPECT_GT(output->size(), 300);
+		output->close();
+		text[t] = ss.str();
+		EXPECT_THROW(output->setOrdered(false), std::runtime_error);
+	}
+	EXPECT_EQ(text[0], text[1]);
+
+	// the rows of the first primary come first
+	std::stringstream lines(text[0]);
+	std::string line;
+	while (std::getline(lines, line) and (line[0] == '#'));
+	std::stringstream first(line);
+	double D, E, E0;
+	int ID, ID0;
+	first >> D >> ID >> E >> ID0 >> E0;
+	Source source;
+	source.add(new SourcePowerLawSpectrum(1 * EeV, 1000 * EeV, -1));
+	Random &random = Random::instance();
+	random.setStream(Random::deriveStreamKey(7, 0));
+	ref_ptr<Candidate> primary = source.getCandidate();
+	random.clearStream();
+	EXPECT_NEAR(primary->source.getEnergy() / EeV, E0, 1e-5 * E0);
+}
+
+TEST(TextOutput, orderedPrimaryIndex) {
+	// only a module list holding an ordered output tags the primaries
+	for (int ordered = 0; ordered < 2; ordered++) {
+		std::stringstream ss;
+		ref_ptr<TextOutput> output = new TextOutput(ss, Output::Event1D);
+		output->setOrdered(ordered);
+		ref_ptr<Observer> observer = new Observer();
+		observer->add(new ObserverDetectAll());
+		observer->onDetection(output);
+		ModuleList modules;
+		modules.add(observer);
+		modules.setShowProgress(false);
+		ModuleList::candidate_vector_t candidates(1, new Candidate(nucleusId(1, 1), 1 * EeV));
+		modules.run(&candidates);
+		EXPECT_EQ(bool(ordered), candidates[0]->hasProperty("PrimaryIndex"));
+		output->close();
+		EXPECT_EQ(1, output->size());
+	}
+}
+
+TEST(OrderedRowSpill, variableRows) {
+	// the spilled rows keep only their bytes in use, also across the read pieces
+	struct Row {
+		size_t size;
+		char text[1000];
+	};
+	OrderedRowSpill<Row> spill(1, 16, [](const Row &row) {
+		return offsetof(Row, text) + row.size;
+	});
+	for (uint64_t i = 0; i < 200; i++) {
+		RowOrderKey key = {199 - i, 0};
+		Row row;
+		std::string text = "row " + std::to_string(key.primary);
+		row.size = text.size();
+		std::memcpy(row.text, text.data(), text.size());
+		spill.push(key, row);
+	}
+	EXPECT_EQ(200, spill.size());
+	std::vector<std::string> rows;
+	spill.merge([&rows](const Row &row) {
+		rows.push_back(std::string(row.text, row.size));
+	}, 64);
+	ASSERT_EQ(200, rows.size());
+	for (size_t i = 0; i < rows.size(); i++)
+		EXPECT_EQ("row " + std::to_string(i), rows[i]);
+	EXPECT_EQ(0, spill.size());
+}
+
+#ifdef CRPROPA_HAVE_ZLIB
+TEST(TextOutput, gzip) {
+	// the blocks of all threads form one gzip stream
+	std::string filename = "testTextOutput.txt.gz";
+	{
+		TextOutput output(filename, Output::Everything);
+		output.setBlockSize(4096);
+		Candidate c;
+#pragma omp parallel for
+		for (int i = 0; i < 1000; i++)
+			output.process(&c);
+	}
+	ParticleCollector collector;
+	TextOutput::load(filename, &collector);
+	EXPECT_EQ(1000, collector.size());
+	std::remove(filename.c_str());
+}
+#endif
+
 TEST(TextOutput, printHeader_Version) {
 	Candidate c;
 	TextOutput output(Output::Event1D);
@@ -152,8 +491,621 @@ TEST(HDF5Output, failOnIllegalOutputFile) {
 	EXPECT_THROW(out.open("THIS_FOLDER_MUST_NOT_EXISTS_12345+/FILE.h5"),
 	             std::runtime_error);
 }
+
+TEST(HDF5Output, threads) {
+	std::string filename = "testHDF5OutputThreads.h5";
+	Candidate c;
+	{
+		HDF5Output out(filename, Output::Event1D);
+#pragma omp parallel for
+		for (int i = 0; i < 1000; i++)
+			out.process(&c);
+		EXPECT_EQ(1000, out.size());
+		// the rows in the per-thread buffers are written by flush
+		out.setFlushLimit(1);
+		out.flush();
+		out.process(&c);
+	}
+
+	hid_t file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+	hid_t dset = H5Dopen2(file, "CRPROPA3", H5P_DEFAULT);
+	hid_t space = H5Dget_space(dset);
+	EXPECT_EQ(1001, H5Sget_simple_extent_npoints(space));
+	H5Sclose(space);
+	H5Dclose(dset);
+	H5Fclose(file);
+	std::remove(filename.c_str());
+}
+
+TEST(HDF5Output, async) {
+	std::string filename = "testHDF5OutputAsync.h5";
+	{
+		HDF5Output out(filename, Output::Event1D);
+		out.setAsync(true, 64);
+		Candidate c;
+#pragma omp parallel for
+		for (int i = 0; i < 1000; i++)
+			out.process(&c);
+		out.flush();
+		EXPECT_EQ(1000, out.size());
+	}
+
+	hid_t file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+	hid_t dset = H5Dopen2(file, "CRPROPA3", H5P_DEFAULT);
+	hid_t space = H5Dget_space(dset);
+	EXPECT_EQ(1000, H5Sget_simple_extent_npoints(space));
+	H5Sclose(space);
+	H5Dclose(dset);
+	H5Fclose(file);
+	std::remove(filename.c_str());
+}
+
+TEST(HDF5Output, merge) {
+	std::string part = "testHDF5OutputMerge.part.h5";
+	std::string merged = "testHDF5OutputMerge.h5";
+	Candidate c;
+	c.setProperty("foo", 1.);
+	{
+		HDF5Output out(part, Output::Event1D);
+		out.enableProperty("foo", 0.);
+		out.process(&c);
+		out.process(&c);
+		out.close();
+	}
+	HDF5Output out(merged, Output::Event1D);
+	out.enableProperty("foo", 0.);
+	out.process(&c);
+	out.merge(part);
+	EXPECT_EQ(3, out.size());
+	out.close();
+
+	hid_t file = H5Fopen(merged.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+	hid_t dset = H5Dopen2(file, "CRPROPA3", H5P_DEFAULT);
+	hid_t space = H5Dget_space(dset);
+	EXPECT_EQ(3, H5Sget_simple_extent_npoints(space));
+	H5Sclose(space);
+	H5Dclose(dset);
+	H5Fclose(file);
+
+	HDF5Output other(merged, Output::Event3D);
+	H5Eset_auto2(H5E_DEFAULT, NULL, NULL);
+	EXPECT_THROW(other.merge(part), std::runtime_error);
+	other.close();
+
+	std::remove(part.c_str());
+	std::remove(merged.c_str());
+}
+
+TEST(HDF5Output, columnar) {
+	std::string columnar = "testHDF5OutputColumnar.h5";
+	std::string compound = "testHDF5OutputCompound.h5";
+	Candidate c;
+	{
+		HDF5Output out(columnar, Output::Event1D);
+		out.setColumnar();
+		out.setChunkSize(4);
+		out.setCompression(HDF5Output::Deflate, 3, true);
+		for (int i = 0; i < 10; i++) {
+			c.current.setEnergy((i + 1) * EeV);
+			out.process(&c);
+		}
+		EXPECT_THROW(out.setChunkSize(8), std::runtime_error);
+	}
+
+	hid_t file = H5Fopen(columnar.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+	hid_t dset = H5Dopen2(file, "CRPROPA3/E", H5P_DEFAULT);
+	hid_t space = H5Dget_space(dset);
+	EXPECT_EQ(10, H5Sget_simple_extent_npoints(space));
+	std::vector<double> energies(10);
+	H5Dread(dset, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, energies.data());
+	EXPECT_DOUBLE_EQ(7, energies[6]);
+	// extrema of the chunks of 4 rows
+	double min[3], max[3];
+	hid_t attr = H5Aopen(dset, "min", H5P_DEFAULT);
+	H5Aread(attr, H5T_NATIVE_DOUBLE, min);
+	H5Aclose(attr);
+	attr = H5Aopen(dset, "max", H5P_DEFAULT);
+	H5Aread(attr, H5T_NATIVE_DOUBLE, max);
+	H5Aclose(attr);
+	EXPECT_DOUBLE_EQ(5, min[1]);
+	EXPECT_DOUBLE_EQ(8, max[1]);
+	EXPECT_DOUBLE_EQ(10, max[2]);
+	H5Sclose(space);
+	H5Dclose(dset);
+	EXPECT_GT(H5Aexists_by_name(file, "CRPROPA3", "Version", H5P_DEFAULT), 0);
+	H5Fclose(file);
+
+	// the layouts can be merged into each other
+	HDF5Output out(compound, Output::Event1D);
+	out.merge(columnar);
+	out.close();
+	HDF5Output back(columnar, Output::Event1D);
+	back.setColumnar();
+	back.merge(compound);
+	back.merge(compound);
+	EXPECT_EQ(20, back.size());
+	back.close();
+
+	file = H5Fopen(columnar.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+	dset = H5Dopen2(file, "CRPROPA3/E", H5P_DEFAULT);
+	space = H5Dget_space(dset);
+	EXPECT_EQ(20, H5Sget_simple_extent_npoints(space));
+	energies.resize(20);
+	H5Dread(dset, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, energies.data());
+	EXPECT_DOUBLE_EQ(3, energies[12]);
+	H5Sclose(space);
+	H5Dclose(dset);
+	H5Fclose(file);
+
+	if (H5Zfilter_avail(32015) <= 0)
+		EXPECT_THROW(out.setCompression(HDF5Output::Zstd), std::runtime_error);
+	std::remove(columnar.c_str());
+	std::remove(compound.c_str());
+}
+
+static hssize_t numberOfRows(hid_t file, const char *name) {
+	hid_t dset = H5Dopen2(file, name, H5P_DEFAULT);
+	hid_t space = H5Dget_space(dset);
+	hssize_t n = H5Sget_simple_extent_npoints(space);
+	H5Sclose(space);
+	H5Dclose(dset);
+	return n;
+}
+
+TEST(HDF5Output, normalized) {
+	std::string filename = "testHDF5OutputNormalized.h5";
+	{
+		HDF5Output out(filename, Output::Event3D);
+		out.enable(Output::CreatedIdColumn);
+		out.enable(Output::CreatedEnergyColumn);
+		out.setNormalized();
+		// a cascade: two secondaries of each of two interactions
+		Candidate primary(nucleusId(1, 1), 100 * EeV, Vector3d(1, 2, 3) * Mpc);
+		primary.created.setEnergy(200 * EeV);
+		for (int step = 0; step < 2; step++) {
+			primary.previous.setEnergy((100 - step) * EeV);
+			primary.addSecondary(22, 1 * EeV);
+			primary.addSecondary(11, 2 * EeV);
+		}
+		for (size_t i = 0; i < primary.secondaries.size(); i++)
+			out.process(primary.secondaries[i]);
+		out.process(&primary);
+		EXPECT_THROW(out.setNormalized(false), std::runtime_error);
+	}
+
+	hid_t file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+	EXPECT_EQ(5, numberOfRows(file, "CRPROPA3"));
+	EXPECT_EQ(1, numberOfRows(file, "SOURCES"));
+	// the states of the two interactions and of the primary
+	EXPECT_EQ(3, numberOfRows(file, "CREATED"));
+
+	hid_t dset = H5Dopen2(file, "CRPROPA3", H5P_DEFAULT);
+	hid_t type = H5Dget_type(dset);
+	EXPECT_LT(H5Tget_member_index(type, "E0"), 0);
+	EXPECT_GE(H5Tget_member_index(type, "SN0"), 0);
+	H5Tclose(type);
+	hid_t c1Type = H5Tcreate(H5T_COMPOUND, sizeof(uint64_t));
+	H5Tinsert(c1Type, "C1", 0, H5T_NATIVE_UINT64);
+	uint64_t c1[5];
+	H5Dread(dset, c1Type, H5S_ALL, H5S_ALL, H5P_DEFAULT, c1);
+	H5Tclose(c1Type);
+	H5Dclose(dset);
+	EXPECT_EQ(c1[0], c1[1]);
+	EXPECT_EQ(c1[2], c1[3]);
+	EXPECT_NE(c1[0], c1[2]);
+
+	dset = H5Dopen2(file, "CREATED", H5P_DEFAULT);
+	hid_t eType = H5Tcreate(H5T_COMPOUND, sizeof(double));
+	H5Tinsert(eType, "E1", 0, H5T_NATIVE_DOUBLE);
+	double e1[3];
+	H5Dread(dset, eType, H5S_ALL, H5S_ALL, H5P_DEFAULT, e1);
+	H5Tclose(eType);
+	H5Dclose(dset);
+	EXPECT_DOUBLE_EQ(99, e1[c1[2]]);
+	H5Fclose(file);
+	std::remove(filename.c_str());
+}
+
+TEST(HDF5Output, ordered) {
+	std::string filenames[2] = {"testHDF5OutputOrdered1.h5", "testHDF5OutputOrdered4.h5"};
+	std::vector<double> energies[2];
+	for (int t = 0; t < 2; t++) {
+		ref_ptr<HDF5Output> output = new HDF5Output(filenames[t], Output::Event1D);
+		output->setOrdered(true, 16);
+		runOrdered(output, t ? 4 : 1);
+		output->close();
+
+		hid_t file = H5Fopen(filenames[t].c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+		size_t n = numberOfRows(file, "CRPROPA3");
+		EXPECT_EQ(output->size(), n);
+		hid_t dset = H5Dopen2(file, "CRPROPA3", H5P_DEFAULT);
+		hid_t type = H5Tcreate(H5T_COMPOUND, sizeof(double));
+		H5Tinsert(type, "E", 0, H5T_NATIVE_DOUBLE);
+		energies[t].resize(n);
+		H5Dread(dset, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, energies[t].data());
+		H5Tclose(type);
+		H5Dclose(dset);
+		H5Fclose(file);
+		std::remove(filenames[t].c_str());
+	}
+	EXPECT_EQ(energies[0], energies[1]);
+}
+#endif
+
+TEST(HistogramOutput, fill) {
+	HistogramOutput out;
+	size_t h = out.addHistogram("spectrum");
+	out.addAxis(h, HistogramOutput::Energy, 3, 1 * EeV, 1000 * EeV, true);
+	std::vector<double> groups = {1, 2, 5, 23, 57};
+	out.addAxis(h, HistogramOutput::MassNumber, groups);
+	size_t ids = out.addHistogram("ids");
+	out.addIdAxis(ids, {nucleusId(1, 1), nucleusId(4, 2)});
+	EXPECT_EQ(12, out.getNumberOfBins(h));
+	EXPECT_EQ(2, out.getNumberOfBins(ids));
+
+	Candidate c(nucleusId(4, 2), 50 * EeV);
+	c.setWeight(2);
+	EXPECT_EQ(1 * 4 + 1, out.getBin(h, &c));
+	Candidate outside(nucleusId(56, 26), 5000 * EeV);
+	EXPECT_EQ(-1, out.getBin(h, &outside));
+
+#pragma omp parallel for
+	for (int i = 0; i < 1000; i++) {
+		out.process(&c);
+		out.process(&outside);
+	}
+	EXPECT_EQ(2000, out.size());
+	std::vector<double> w = out.getWeights(h);
+	std::vector<double> w2 = out.getSquaredWeights(h);
+	for (size_t i = 0; i < w.size(); i++) {
+		EXPECT_DOUBLE_EQ((i == 5) ? 2000 : 0, w[i]);
+		EXPECT_DOUBLE_EQ((i == 5) ? 4000 : 0, w2[i]);
+	}
+	EXPECT_DOUBLE_EQ(2000, out.getWeights(ids)[1]);
+
+	// the histograms are fixed at the first candidate
+	EXPECT_THROW(out.addHistogram("late"), std::runtime_error);
+	EXPECT_THROW(out.addAxis(h, HistogramOutput::Energy, 0, 1, 2), std::runtime_error);
+}
+
+TEST(HistogramOutput, direction) {
+	// the pixel of the arrival direction, opposite to the momentum
+	EXPECT_LT(healpixRingPixel(4, Vector3d(0, 0, 1)), 4);
+	EXPECT_GE(healpixRingPixel(4, Vector3d(0, 0, -1)), 12 * 16 - 4);
+
+	HistogramOutput out;
+	size_t h = out.addHistogram("sky");
+	out.addDirectionAxis(h, 4);
+	EXPECT_EQ(192, out.getNumberOfBins(h));
+	Random random(5);
+	Candidate c;
+	for (int i = 0; i < 192000; i++) {
+		c.current.setDirection(random.randVector());
+		out.process(&c);
+	}
+	// equal areas
+	std::vector<double> w = out.getWeights(h);
+	for (size_t i = 0; i < w.size(); i++)
+		EXPECT_NEAR(1000, w[i], 150);
+}
+
+TEST(HistogramOutput, save) {
+	std::string filename = "testHistogramOutput.txt";
+	ref_ptr<ParticleCollector> events = new ParticleCollector();
+	{
+		HistogramOutput out(filename);
+		size_t h = out.addHistogram("energy");
+		out.addAxis(h, HistogramOutput::Energy, 2, 1 * EeV, 3 * EeV);
+		out.setEventOutput(events, 1);
+		Candidate c(nucleusId(1, 1), 2.5 * EeV);
+		out.process(&c);
+		out.process(&c);
+	}
+	EXPECT_EQ(2, events->size());
+
+	std::ifstream in(filename.c_str());
+	std::string line, last;
+	std::getline(in, line);
+	EXPECT_EQ("# CRPropa histogram output of 2 candidates", line);
+	while (std::getline(in, line)) {
+		if (line.find("# axis") == 0)
+			EXPECT_EQ("# axis Energy edges 1 2 3", line);
+		last = line;
+	}
+	EXPECT_EQ("1\t2\t2", last);
+	in.close();
+	std::remove(filename.c_str());
+}
+
+#ifdef CRPROPA_HAVE_PARQUET
+TEST(ParquetOutput, threads) {
+	std::string filename = "testParquetOutput.parquet";
+	Candidate c;
+	ParquetOutput out(filename, Output::Event1D);
+	out.setRowGroupSize(100);
+#pragma omp parallel for
+	for (int i = 0; i < 1000; i++)
+		out.process(&c);
+	EXPECT_EQ(1000, out.size());
+	out.close();
+
+	// a parquet file starts and ends with the magic bytes
+	std::ifstream in(filename.c_str(), std::ios::binary);
+	char head[4], tail[4];
+	in.read(head, 4);
+	in.seekg(-4, std::ios::end);
+	in.read(tail, 4);
+	EXPECT_EQ("PAR1", std::string(head, 4));
+	EXPECT_EQ("PAR1", std::string(tail, 4));
+	in.close();
+	std::remove(filename.c_str());
+}
 #endif
 
+//-- NetworkOutput
+
+// listening socket on an ephemeral port of the loopback interface
+static int listenLoopback(int &port) {
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in address;
+	std::memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+	bind(s, (struct sockaddr *) &address, sizeof(address));
+	listen(s, 1);
+	socklen_t length = sizeof(address);
+	getsockname(s, (struct sockaddr *) &address, &length);
+	port = ntohs(address.sin_port);
+	return s;
+}
+
+TEST(NetworkOutput, stream) {
+	int port;
+	int server = listenLoopback(port);
+	NetworkOutput out("127.0.0.1", port, Output::Event1D);
+	out.enableProperty("flag", int32_t(0));
+	out.setBatchSize(4);
+	out.setPolicy(NetworkOutput::Block);
+	// D, ID, E, ID0, E0 and the property
+	EXPECT_EQ(8 + 4 + 8 + 4 + 8 + 4, out.getRecordSize());
+	for (int i = 0; i < 10; i++) {
+		Candidate c(22, (i + 1) * EeV);
+		c.setProperty("flag", i);
+		out.process(&c);
+	}
+	out.close();
+	EXPECT_EQ(0, out.getDropped());
+
+	int client = accept(server, NULL, NULL);
+	std::string data;
+	char buffer[4096];
+	ssize_t n;
+	while ((n = recv(client, buffer, sizeof(buffer), 0)) > 0)
+		data.append(buffer, n);
+	::close(client);
+	::close(server);
+
+	ASSERT_GT(data.size(), 16);
+	EXPECT_EQ(std::string("CRPNET1"), data.c_str());
+	uint32_t size, schemaLength;
+	std::memcpy(&size, &data[8], 4);
+	std::memcpy(&schemaLength, &data[12], 4);
+	EXPECT_EQ(36, size);
+	EXPECT_EQ("D\t<f8\nID\t<i4\nE\t<f8\nID0\t<i4\nE0\t<f8\nflag\t<i4\n",
+			data.substr(16, schemaLength));
+
+	// batches of 4, 4 and 2 records
+	size_t offset = 16 + schemaLength;
+	int records = 0;
+	while (offset < data.size()) {
+		uint32_t nRecords;
+		std::memcpy(&nRecords, &data[offset], 4);
+		offset += 4;
+		for (uint32_t i = 0; i < nRecords; i++, records++) {
+			double E;
+			int32_t flag;
+			std::memcpy(&E, &data[offset + i * size + 12], 8);
+			std::memcpy(&flag, &data[offset + i * size + 32], 4);
+			EXPECT_DOUBLE_EQ(records + 1, E);
+			EXPECT_EQ(records, flag);
+		}
+		offset += nRecords * size;
+	}
+	EXPECT_EQ(10, records);
+}
+
+TEST(NetworkOutput, noServer) {
+	// the simulation continues without a server
+	int port;
+	int server = listenLoopback(port);
+	::close(server);
+	NetworkOutput out("127.0.0.1", port);
+	out.setBatchSize(1);
+	out.setQueueCapacity(2);
+	Candidate c;
+	for (int i = 0; i < 100; i++)
+		out.process(&c);
+	EXPECT_NO_THROW(out.close());
+	EXPECT_GT(out.getDropped(), 0);
+}
+
+//-- PhotonOutput1D
+
+TEST(PhotonOutput1D, buffered) {
+	std::stringstream ss;
+	{
+		PhotonOutput1D output(ss);
+		Candidate c(22, 1 * EeV, Vector3d(10, 0, 0) * Mpc);
+		output.process(&c);
+		EXPECT_FALSE(c.isActive());
+		Candidate p(nucleusId(1, 1), 1 * EeV);
+		output.process(&p); // not an EM particle
+		EXPECT_TRUE(p.isActive());
+		// rows are written in blocks
+		EXPECT_EQ("", ss.str());
+		output.flush();
+		EXPECT_EQ("  22\t1\t 10.0000\t", ss.str().substr(0, 16));
+	}
+	std::string rows = ss.str();
+	EXPECT_EQ(1, std::count(rows.begin(), rows.end(), '\n'));
+}
+
+TEST(PhotonOutput1D, binary) {
+	std::string filename = "PhotonOutput1D_binary_test.dat";
+	{
+		PhotonOutput1D output(filename, true);
+		EXPECT_TRUE(output.isBinary());
+		output.setBufferSize(100); // blocks of 2 records
+		for (int i = 0; i < 5; i++) {
+			Candidate c(11, (i + 1) * EeV, Vector3d(0, i, 0) * Mpc);
+			c.source.setId(nucleusId(56, 26));
+			c.source.setEnergy(100 * EeV);
+			output.process(&c);
+		}
+	}
+
+	std::ifstream in(filename.c_str(), std::ios::binary);
+	ASSERT_TRUE(PhotonOutput1D::readBinaryHeader(in));
+	PhotonOutput1D::Record records[10];
+	EXPECT_EQ(5, PhotonOutput1D::readRecords(in, records, 10));
+	for (int i = 0; i < 5; i++) {
+		EXPECT_EQ(11, records[i].id);
+		EXPECT_DOUBLE_EQ(i + 1, records[i].energy);
+		EXPECT_DOUBLE_EQ(i, records[i].distance);
+		EXPECT_EQ(nucleusId(56, 26), records[i].sourceId);
+		EXPECT_DOUBLE_EQ(100, records[i].sourceEnergy);
+	}
+	in.close();
+	std::remove(filename.c_str());
+
+	// text is not read as binary
+	std::stringstream text("#ID\tE\tD\n");
+	EXPECT_FALSE(PhotonOutput1D::readBinaryHeader(text));
+	EXPECT_EQ('#', text.peek());
+}
+
+TEST(TrajectoryOutput, roundtrip) {
+	std::string filename = "TrajectoryOutput_test.dat";
+	{
+		TrajectoryOutput output(filename);
+		output.setBufferSize(64); // trajectories continue in further blocks
+		Candidate c1(nucleusId(4, 2), 10 * EeV, Vector3d(1, 2, 3) * Mpc, Vector3d(1, 0, 0));
+		Candidate c2(22, 1 * EeV, Vector3d(0.), Vector3d(0, 0.6, -0.8));
+		c1.source.setId(nucleusId(4, 2));
+		for (int i = 0; i < 20; i++) {
+			c1.setTrajectoryLength(i * kpc);
+			c1.current.setPosition(Vector3d(1, 2, 3) * Mpc + Vector3d(i, -i, 0.5 * i) * kpc);
+			c1.current.setEnergy((10 - 0.1 * i) * EeV);
+			if (i == 10)
+				c1.current.setId(nucleusId(3, 2));
+			output.process(&c1);
+			c2.setTrajectoryLength(i * pc);
+			c2.current.setPosition(Vector3d(0, 0.6, -0.8) * i * pc);
+			output.process(&c2);
+		}
+		EXPECT_EQ(40, output.size());
+		EXPECT_THROW(output.setPositionPrecision(1 * pc), std::runtime_error);
+	}
+
+	std::vector<TrajectoryOutput::Trajectory> t = TrajectoryOutput::read(filename);
+	std::remove(filename.c_str());
+	ASSERT_EQ(2, t.size());
+	ASSERT_EQ(20, t[0].points.size());
+	ASSERT_EQ(20, t[1].points.size());
+	EXPECT_EQ(nucleusId(4, 2), t[0].sourceId);
+	for (int i = 0; i < 20; i++) {
+		const TrajectoryOutput::Point &p = t[0].points[i];
+		EXPECT_NEAR(i * kpc, p.trajectoryLength, 1e-3 * pc);
+		EXPECT_NEAR(1 * Mpc + i * kpc, p.position.x, 1e-3 * pc);
+		EXPECT_NEAR(2 * Mpc - i * kpc, p.position.y, 1e-3 * pc);
+		EXPECT_NEAR(3 * Mpc + 0.5 * i * kpc, p.position.z, 1e-3 * pc);
+		EXPECT_NEAR((10 - 0.1 * i) * EeV, p.energy, 1e-5 * p.energy);
+		EXPECT_NEAR(1, p.direction.x, 1e-6);
+		EXPECT_EQ((i < 10) ? nucleusId(4, 2) : nucleusId(3, 2), p.id);
+
+		const TrajectoryOutput::Point &q = t[1].points[i];
+		EXPECT_EQ(22, q.id);
+		EXPECT_NEAR(-0.8 * i * pc, q.position.z, 1e-3 * pc);
+		EXPECT_NEAR(0.6, q.direction.y, 1e-4);
+		EXPECT_NEAR(-0.8, q.direction.z, 1e-4);
+	}
+}
+
+TEST(TrajectoryOutput, decimation) {
+	std::string filename = "TrajectoryOutput_decimation_test.dat";
+	// straight for 1 Mpc, then on a circle of 1 Mpc radius, 1 kpc steps
+	std::vector<Vector3d> positions;
+	{
+		TrajectoryOutput output(filename);
+		output.setDecimation(0.05, 100 * pc);
+		Candidate c(nucleusId(1, 1), 10 * EeV, Vector3d(0.), Vector3d(1, 0, 0));
+		for (int i = 0; i <= 2000; i++) {
+			Vector3d x(i * kpc, 0, 0), p(1, 0, 0);
+			if (i > 1000) {
+				double phi = (i - 1000) * kpc / Mpc;
+				x = Vector3d(1 + sin(phi), 1 - cos(phi), 0) * Mpc;
+				p = Vector3d(cos(phi), sin(phi), 0);
+			}
+			if (i == 500)
+				c.addSecondary(22, 1 * EeV); // interaction
+			c.setTrajectoryLength(i * kpc);
+			c.current.setPosition(x);
+			c.current.setDirection(p);
+			output.process(&c);
+			positions.push_back(x);
+		}
+		EXPECT_EQ(2001, output.size());
+	}
+
+	std::vector<TrajectoryOutput::Trajectory> t = TrajectoryOutput::read(filename);
+	std::remove(filename.c_str());
+	ASSERT_EQ(1, t.size());
+	const std::vector<TrajectoryOutput::Point> &points = t[0].points;
+	EXPECT_LT(points.size(), 100);
+	EXPECT_NEAR(0, points.front().trajectoryLength, 1e-3 * pc);
+	EXPECT_NEAR(2000 * kpc, points.back().trajectoryLength, 1e-3 * pc);
+
+	// the interaction and the step before it are kept, and all steps are
+	// within the length tolerance of the line through the kept points
+	size_t k = 0;
+	bool interaction = false;
+	for (size_t i = 0; i < positions.size(); i++) {
+		while ((k + 2 < points.size()) and (points[k + 1].trajectoryLength < (i - 0.5) * kpc))
+			k++;
+		if (fabs(points[k + 1].trajectoryLength - 500 * kpc) < 1 * pc)
+			interaction = fabs(points[k].trajectoryLength - 499 * kpc) < 1 * pc;
+		Vector3d a = points[k].position, d = points[k + 1].position - a;
+		double u = std::min(std::max((positions[i] - a).dot(d) / d.getR2(), 0.), 1.);
+		EXPECT_LT((positions[i] - a - d * u).getR(), 101 * pc);
+	}
+	EXPECT_TRUE(interaction);
+}
+
+TEST(TrajectoryOutput, compact) {
+	std::string filename = "TrajectoryOutput_compact_test.dat";
+	std::string textname = "TrajectoryOutput_compact_test.txt";
+	{
+		TrajectoryOutput output(filename);
+		TextOutput text(textname, Output::Trajectory3D);
+		Candidate c(nucleusId(1, 1), 100 * EeV, Vector3d(0.), Vector3d(1, 1, 0).getUnitVector());
+		for (int i = 0; i < 10000; i++) {
+			c.setTrajectoryLength(i * 10 * kpc);
+			c.current.setPosition(c.current.getDirection() * i * 10 * kpc);
+			c.current.setEnergy((100 - 1e-3 * i) * EeV);
+			output.process(&c);
+			text.process(&c);
+		}
+	}
+
+	std::ifstream binary(filename.c_str(), std::ios::binary | std::ios::ate);
+	std::ifstream text(textname.c_str(), std::ios::binary | std::ios::ate);
+	EXPECT_LT(10 * binary.tellg(), text.tellg());
+	EXPECT_EQ(10000, TrajectoryOutput::read(filename)[0].points.size());
+	std::remove(filename.c_str());
+	std::remove(textname.c_str());
+}
+
 //-- ParticleCollector
 
 TEST(ParticleCollector, size) {
@@ -186,6 +1138,45 @@ TEST(ParticleCollector, reprocess) {
 	EXPECT_EQ(output[0], c);
 }
 
+// doubles the energy, fails above a threshold
+class DoubleEnergy: public Module {
+public:
+	double maxEnergy;
+	DoubleEnergy(double maxEnergy) : maxEnergy(maxEnergy) {}
+	void process(Candidate *candidate) const {
+		double E = candidate->current.getEnergy();
+		if (E > maxEnergy)
+			throw std::runtime_error("energy too high");
+		candidate->current.setEnergy(2 * E);
+		candidate->setActive(false);
+	}
+};
+
+TEST(ParticleCollector, parallelReprocess) {
+	ParticleCollector collector(1000, true);
+	for (int i = 0; i < 1000; i++)
+		collector.process(new Candidate(nucleusId(1, 1), (i + 1) * EeV));
+
+	// through the list of a runner, in segments, the clones are modified
+	ref_ptr<ModuleList> galactic = new ModuleList();
+	galactic->add(new DoubleEnergy(1e4 * EeV));
+	galactic->setSchedule(ModuleList::ScheduleCostAware);
+	ref_ptr<ParticleCollector> output = new ParticleCollector();
+	galactic->add(output);
+	collector.reprocess(new ModuleListRunner(galactic), 64);
+	EXPECT_EQ(1000, output->size());
+	double sum = 0;
+	for (size_t i = 0; i < output->size(); i++)
+		sum += (*output)[i]->current.getEnergy();
+	EXPECT_NEAR(1000 * 1001 * EeV, sum, 1e-6 * sum);
+	EXPECT_DOUBLE_EQ(1 * EeV, collector[0]->current.getEnergy());
+
+	// the error of an action is rethrown
+	ref_ptr<ModuleList> failing = new ModuleList();
+	failing->add(new DoubleEnergy(500 * EeV));
+	EXPECT_THROW(collector.reprocess(new ModuleListRunner(failing)), std::runtime_error);
+}
+
 TEST(ParticleCollector, dumpload) {
 	ref_ptr<Candidate> c = new Candidate(nucleusId(1, 1), 1.234 * EeV);
 	c->current.setPosition(Vector3d(1, 2, 3));
@@ -211,6 +1202,112 @@ TEST(ParticleCollector, dumpload) {
 	EXPECT_EQ(output[3]->getRedshift(), c->getRedshift());
 }
 
+TEST(ParticleCollector, dumpBinary) {
+	std::string filename = "ParticleCollector_DumpTest.bin";
+	ParticleCollector input;
+	for (int i = 0; i < 3000; i++) {
+		ref_ptr<Candidate> c = new Candidate(nucleusId(4, 2), (i + 1) * EeV, Vector3d(i, 2, 3) * Mpc);
+		c->current.setDirection(Vector3d(0, 1, 0));
+		c->setWeight(0.5 * i);
+		c->setTrajectoryLength(i * kpc);
+		c->setRandomStream(17, i);
+		if (i % 2)
+			c->setProperty("index", i);
+		if (i % 3)
+			c->setProperty("name", std::string("candidate ") + std::to_string(i));
+		input.process(c);
+	}
+	input.dumpBinary(filename);
+
+	ParticleCollector output;
+	output.load(filename);
+	ASSERT_EQ(input.size(), output.size());
+	for (size_t i = 0; i < input.size(); i++) {
+		ref_ptr<Candidate> a = input[i], b = output[i];
+		EXPECT_EQ(a->current.getEnergy(), b->current.getEnergy());
+		EXPECT_EQ(a->current.getPosition(), b->current.getPosition());
+		EXPECT_EQ(a->source.getId(), b->source.getId());
+		EXPECT_EQ(a->getWeight(), b->getWeight());
+		EXPECT_EQ(a->getTrajectoryLength(), b->getTrajectoryLength());
+		EXPECT_EQ(a->getSerialNumber(), b->getSerialNumber());
+		EXPECT_EQ(a->getSourceSerialNumber(), b->getSourceSerialNumber());
+		EXPECT_EQ(a->getRandomStream(), b->getRandomStream());
+		EXPECT_EQ(a->getProperties().size(), b->getProperties().size());
+		if (i % 2)
+			EXPECT_EQ(int(i), b->getProperty("index").toInt32());
+		if (i % 3)
+			EXPECT_EQ(a->getProperty("name").asString(), b->getProperty("name").asString());
+	}
+
+	// compact records and reprocessing the mapped file
+	ParticleCollector compact;
+	compact.setCompact(true);
+	compact.load(filename);
+	EXPECT_EQ(input.size(), compact.size());
+	EXPECT_EQ(input[7]->getSerialNumber(), compact.getRecord(7).serialNumber);
+	ref_ptr<ParticleCollector> reprocessed = new ParticleCollector();
+	ParticleCollector::reprocessDump(filename, reprocessed);
+	EXPECT_EQ(input.size(), reprocessed->size());
+
+	std::remove(filename.c_str());
+	EXPECT_THROW(ParticleCollector::reprocessDump(filename, reprocessed), std::runtime_error);
+}
+
+TEST(ParticleCollector, threads) {
+	ParticleCollector collector(100, true);
+	EXPECT_TRUE(collector.getClone());
+	Candidate c(nucleusId(1, 1), 1 * EeV);
+#pragma omp parallel for
+	for (int i = 0; i < 1000; i++)
+		collector.process(&c);
+	EXPECT_EQ(1000, collector.size());
+	collector.process(&c);
+	EXPECT_EQ(1001, collector.getContainer().size());
+}
+
+TEST(ParticleCollector, compact) {
+	EXPECT_EQ(208, sizeof(CompactCandidate));
+	ref_ptr<Candidate> c = new Candidate(nucleusId(4, 2), 2 * EeV, Vector3d(1, 2, 3), Vector3d(0, 1, 0));
+	c->current.setEnergy(1 * EeV);
+	c->setWeight(0.5);
+	c->setRedshift(0.25);
+	c->setTrajectoryLength(3 * Mpc);
+
+	ParticleCollector collector;
+	collector.setCompact(true);
+#pragma omp parallel for
+	for (int i = 0; i < 100; i++)
+		collector.process(c);
+	EXPECT_EQ(100, collector.size());
+	EXPECT_THROW(collector.setCompact(false), std::runtime_error);
+	EXPECT_DOUBLE_EQ(2 * EeV, collector.getRecord(99).source.energy);
+	EXPECT_EQ(100, collector.getRecords().size());
+	// the layout of the NumPy dtype of the records
+	EXPECT_EQ(48, offsetof(CompactCandidate, source));
+	EXPECT_EQ(144, offsetof(CompactCandidate, weight));
+	EXPECT_EQ(160, offsetof(CompactCandidate, redshift));
+	EXPECT_EQ(200, offsetof(CompactCandidate, randomStart));
+
+	ParticleCollector output;
+	collector.reprocess(&output);
+	EXPECT_EQ(100, output.size());
+	ref_ptr<Candidate> r = output[0];
+	EXPECT_EQ(nucleusId(4, 2), r->current.getId());
+	EXPECT_DOUBLE_EQ(1 * EeV, r->current.getEnergy());
+	EXPECT_DOUBLE_EQ(2 * EeV, r->source.getEnergy());
+	EXPECT_EQ(Vector3d(1, 2, 3), r->current.getPosition());
+	EXPECT_EQ(Vector3d(0, 1, 0), r->current.getDirection());
+	EXPECT_DOUBLE_EQ(0.5, r->getWeight());
+	EXPECT_DOUBLE_EQ(0.25, r->getRedshift());
+	EXPECT_DOUBLE_EQ(3 * Mpc, r->getTrajectoryLength());
+	EXPECT_EQ(c->getSerialNumber(), r->getSerialNumber());
+	EXPECT_FALSE(r->isActive());
+
+	collector.clearContainer();
+	EXPECT_EQ(0, collector.size());
+	collector.setCompact(false);
+}
+
 // Just test if the trajectory is on a line for rectilinear propagation
 TEST(ParticleCollector, getTrajectory) {
 	int pos_x[10];
@@ -250,6 +1347,59 @@ TEST(ParticleCollector, getTrajectory) {
 	EXPECT_TRUE(ArraysMatch(pos_x_expected, pos_x));
 }
 
+// deflects the candidate in a random direction every step
+class RandomDeflection: public Module {
+public:
+	void process(Candidate *c) const {
+		c->current.setDirection(Random::instance().randVector());
+	}
+};
+
+TEST(ParticleCollector, getTrajectories) {
+	ref_ptr<ParticleCollector> detected = new ParticleCollector();
+	detected->setClone(true);
+	ref_ptr<MaximumTrajectoryLength> maxLength = new MaximumTrajectoryLength(10 * kpc);
+	maxLength->onReject(detected);
+
+	ref_ptr<ModuleList> mlist = new ModuleList();
+	mlist->setCounterBasedRandom(true, 7);
+	mlist->add(new SimplePropagation(1 * kpc, 1 * kpc));
+	mlist->add(new RandomDeflection());
+	mlist->add(maxLength);
+
+	ref_ptr<Source> source = new Source();
+	source->add(new SourceParticleType(nucleusId(1, 1)));
+	source->add(new SourceIsotropicEmission());
+	mlist->setShowProgress(false);
+	mlist->run(source.get(), 20, false);
+	ASSERT_EQ(20, detected->size());
+
+	std::vector<size_t> indices;
+	std::vector<Vector3d> positions;
+	for (size_t i = 0; i < 20; i++) {
+		indices.push_back(i);
+		positions.push_back((*detected)[i]->current.getPosition());
+	}
+
+	// the random streams are rewound, the reruns end at the same positions
+	std::vector<ref_ptr<ParticleCollector> > trajectories = detected->getTrajectories(mlist, indices);
+	ASSERT_EQ(20, trajectories.size());
+	for (size_t i = 0; i < 20; i++) {
+		size_t n = trajectories[i]->size();
+		ASSERT_EQ(11, n);
+		EXPECT_EQ(positions[i], (*trajectories[i])[n - 1]->current.getPosition());
+	}
+
+	// per-thread outputs
+	std::vector<ref_ptr<Module> > outputs;
+	ref_ptr<ParticleCollector> first = new ParticleCollector();
+	ref_ptr<ParticleCollector> second = new ParticleCollector();
+	outputs.push_back(first);
+	outputs.push_back(second);
+	detected->getTrajectories(mlist, indices, outputs);
+	EXPECT_EQ(220, first->size() + second->size());
+}
+
 TEST(ParticleCollector, runModuleList) {
 	ModuleList modules;
 	modules.add(new SimplePropagation());
@@ -269,6 +1419,162 @@ TEST(ParticleCollector, runModuleList) {
 	modules.run(&candidates);
 }
 
+TEST(SnapshotCollector, process) {
+	ref_ptr<SnapshotCollector> collector = new SnapshotCollector();
+	collector->enableProperty("kept");
+	ref_ptr<Candidate> c = new Candidate(nucleusId(1, 1), 1 * EeV);
+	c->setProperty("kept", 3);
+	c->setProperty("dropped", 4);
+	collector->process(c);
+	c->current.setEnergy(2 * EeV);
+	EXPECT_EQ(1, collector->size());
+	EXPECT_EQ(1 * EeV, (*collector)[0].getCurrent().getEnergy());
+	EXPECT_EQ(3, (*collector)[0].getProperty("kept").toInt32());
+	EXPECT_FALSE((*collector)[0].hasProperty("dropped"));
+
+	ref_ptr<ParticleCollector> candidates = new ParticleCollector();
+	collector->reprocess(candidates);
+	EXPECT_EQ(1, candidates->size());
+	EXPECT_EQ(c->getSerialNumber(), (*candidates)[0]->getSerialNumber());
+
+	collector->clearContainer();
+	EXPECT_EQ(0, collector->size());
+}
+
+TEST(ShellCrossingStore, evaluate) {
+	// radial trajectories cross both shells, the observers are evaluated afterwards
+	ref_ptr<ShellCrossingRecorder> recorder = new ShellCrossingRecorder("testShellCrossing.dat");
+	recorder->addShell(Vector3d(0.), 10 * Mpc);
+	recorder->addShell(Vector3d(0.), 20 * Mpc);
+	EXPECT_EQ(2, recorder->getNumberOfShells());
+	EXPECT_EQ("testShellCrossing.t3.dat", recorder->getShardName(3));
+
+	ModuleList modules;
+	modules.add(new SimplePropagation(0.1 * Mpc, 3 * Mpc));
+	modules.add(recorder);
+	modules.add(new MaximumTrajectoryLength(30 * Mpc));
+	modules.setShowProgress(false);
+	Random random(1);
+	std::vector<ref_ptr<Candidate> > candidates;
+	for (int i = 0; i < 50; i++) {
+		ParticleState p(nucleusId(1, 1), 1 * EeV, Vector3d(0.), random.randVector());
+		candidates.push_back(new Candidate(p));
+	}
+	modules.run(&candidates);
+	recorder->close();
+
+	ref_ptr<ShellCrossingStore> store = new ShellCrossingStore("testShellCrossing.dat");
+	EXPECT_EQ(2, store->getNumberOfShells());
+	EXPECT_DOUBLE_EQ(20 * Mpc, store->getShellRadius(1));
+	EXPECT_EQ(100, store->size());
+	ShellCrossing crossing = store->getCrossing(0);
+	EXPECT_EQ(0, crossing.shell);
+	EXPECT_TRUE(crossing.outward);
+	EXPECT_EQ(1, crossing.lineage.size());
+	EXPECT_NEAR(10 * Mpc, crossing.candidate->current.getPosition().getR(), 1e-6 * Mpc);
+
+	// a different observer radius
+	Observer outer;
+	outer.add(new ObserverSurface(new Sphere(Vector3d(0.), 20 * Mpc)));
+	ref_ptr<ParticleCollector> detected = new ParticleCollector();
+	outer.onDetection(detected);
+	EXPECT_EQ(50, store->evaluate(&outer));
+	EXPECT_EQ(50, detected->size());
+	for (size_t i = 0; i < detected->size(); i++)
+		EXPECT_NEAR(20 * Mpc, (*detected)[i]->current.getPosition().getR(), 1e-6 * Mpc);
+
+	// detected once at the first shell, unless not deactivated
+	Observer all;
+	all.add(new ObserverDetectAll());
+	EXPECT_EQ(50, store->evaluate(&all));
+	all.setDeactivateOnDetection(false);
+	EXPECT_EQ(100, store->evaluate(&all));
+
+	// a surface between the shells is not crossed by the stored steps
+	Observer between;
+	between.add(new ObserverSurface(new Sphere(Vector3d(0.), 15 * Mpc)));
+	EXPECT_EQ(0, store->evaluate(&between));
+
+	// shards without index are read completely
+	std::string shard = recorder->getShardFiles()[0];
+	std::ifstream in(shard.c_str(), std::ios::binary);
+	std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	in.close();
+	uint64_t records = 0;
+	memcpy(&records, &content[content.size() - 16], sizeof(records));
+	std::ofstream out(shard.c_str(), std::ios::binary);
+	out << content.substr(0, content.size() - 16 - records * 28);
+	out.close();
+	EXPECT_EQ(100, ShellCrossingStore("testShellCrossing.dat").size());
+
+	for (size_t i = 0; i < recorder->getShardFiles().size(); i++)
+		std::remove(recorder->getShardFiles()[i].c_str());
+	std::remove("testShellCrossing.dat");
+}
+
+TEST(ShellCrossingStore, lineage) {
+	// secondaries created after the detection of their parent are skipped
+	ref_ptr<ShellCrossingRecorder> recorder = new ShellCrossingRecorder("testShellCrossing.dat");
+	recorder->addShell(Vector3d(0.), 10 * Mpc);
+	recorder->addShell(Vector3d(0.), 20 * Mpc);
+	recorder->setLimitStep(false);
+
+	ref_ptr<Candidate> primary = new Candidate(nucleusId(1, 1), 1 * EeV);
+	primary->previous.setPosition(Vector3d(4, 0, 0) * Mpc);
+	primary->current.setPosition(Vector3d(5, 0, 0) * Mpc);
+	primary->setTrajectoryLength(5 * Mpc);
+	primary->addSecondary(22, 1 * EeV);
+	ref_ptr<Candidate> early = primary->secondaries.back();
+	recorder->process(primary);
+
+	primary->previous.setPosition(Vector3d(9.5, 0, 0) * Mpc);
+	primary->current.setPosition(Vector3d(10.5, 0, 0) * Mpc);
+	primary->setTrajectoryLength(11 * Mpc);
+	recorder->process(primary);
+
+	primary->previous.setPosition(Vector3d(14, 0, 0) * Mpc);
+	primary->current.setPosition(Vector3d(15, 0, 0) * Mpc);
+	primary->setTrajectoryLength(15 * Mpc);
+	primary->addSecondary(22, 1 * EeV);
+	ref_ptr<Candidate> late = primary->secondaries.back();
+	recorder->process(primary);
+
+	Candidate *secondaries[2] = {early, late};
+	for (int i = 0; i < 2; i++) {
+		recorder->process(secondaries[i]); // first step: creation length
+		secondaries[i]->previous.setPosition(Vector3d(19.5, 0, 0) * Mpc);
+		secondaries[i]->current.setPosition(Vector3d(20.5, 0, 0) * Mpc);
+		secondaries[i]->setTrajectoryLength(25 * Mpc);
+		recorder->process(secondaries[i]);
+	}
+	recorder->close();
+
+	ShellCrossingStore store("testShellCrossing.dat");
+	ASSERT_EQ(3, store.size());
+	ShellCrossing crossing = store.getCrossing(2);
+	ASSERT_EQ(2, crossing.lineage.size());
+	EXPECT_EQ(primary->getSerialNumber(), crossing.lineage[1]);
+	EXPECT_EQ(primary->getSerialNumber(), crossing.candidate->getCreatedSerialNumber());
+
+	Observer all;
+	all.add(new ObserverDetectAll());
+	ref_ptr<ParticleCollector> detected = new ParticleCollector();
+	all.onDetection(detected);
+	EXPECT_EQ(2, store.evaluate(&all));
+	ASSERT_EQ(2, detected->size());
+	EXPECT_EQ(primary->getSerialNumber(), (*detected)[0]->getSerialNumber());
+	EXPECT_EQ(early->getSerialNumber(), (*detected)[1]->getSerialNumber());
+
+	// without the detection of the primary both secondaries exist
+	Observer outer;
+	outer.add(new ObserverSurface(new Sphere(Vector3d(0.), 20 * Mpc)));
+	EXPECT_EQ(2, store.evaluate(&outer));
+
+	for (size_t i = 0; i < recorder->getShardFiles().size(); i++)
+		std::remove(recorder->getShardFiles()[i].c_str());
+	std::remove("testShellCrossing.dat");
+}
+
 int main(int argc, char **argv) {
 	::testing::InitGoogleTest(&argc, argv);
 	return RUN_ALL_TESTS();
@@ -3,10 +3,19 @@
 #include "crpropa/module/SimplePropagation.h"
 #include "crpropa/module/PropagationBP.h"
 #include "crpropa/module/PropagationCK.h"
+#include "crpropa/module/PropagationDP.h"
+#include "crpropa/module/PropagationGC.h"
+#include "crpropa/module/PropagationSmallAngle.h"
+#include "crpropa/magneticField/turbulentField/PlaneWaveTurbulence.h"
+#include "crpropa/module/Observer.h"
+#include "crpropa/magneticField/MagneticFieldGrid.h"
+
+#include "crpropa/Random.h"
 
 #include "gtest/gtest.h"
 
 #include <string>
+#include <vector>
 #include <iostream>
 
 namespace crpropa {
@@ -99,6 +108,110 @@ TEST(testPropagationCK, neutron) {
 }
 
 
+TEST(testPropagationCK, batch) {
+	// the batched lanes give the same steps as processing one by one
+	ref_ptr<MagneticField> field = new UniformMagneticField(Vector3d(0, 0, 1 * nG));
+	PropagationCK propa(field, 1e-4, 1 * kpc, 100 * Mpc);
+	std::vector<ref_ptr<Candidate> > single, batch;
+	for (int i = 0; i < 11; i++) {
+		int id = (i == 5) ? 22 : ((i % 2) ? 11 : -11);
+		double E = (1 + i) * 10 * EeV;
+		Vector3d direction(cos(i), sin(i), 0.1 * i);
+		single.push_back(new Candidate(id, E, Vector3d(0.), direction));
+		batch.push_back(new Candidate(id, E, Vector3d(0.), direction));
+		single.back()->setNextStep((1 + i) * Mpc);
+		batch.back()->setNextStep((1 + i) * Mpc);
+	}
+	std::vector<Candidate*> pointers;
+	for (size_t i = 0; i < batch.size(); i++)
+		pointers.push_back(batch[i]);
+
+	for (int k = 0; k < 20; k++) {
+		for (size_t i = 0; i < single.size(); i++)
+			propa.process(single[i]);
+		propa.processBatch(&pointers[0], pointers.size());
+	}
+	for (size_t i = 0; i < single.size(); i++) {
+		double d = (single[i]->current.getPosition() - batch[i]->current.getPosition()).getR();
+		EXPECT_NEAR(0, d, 1e-10 * single[i]->getTrajectoryLength());
+		EXPECT_NEAR(single[i]->getNextStep(), batch[i]->getNextStep(), 1e-10 * single[i]->getNextStep());
+		EXPECT_NEAR(0, (single[i]->current.getDirection() - batch[i]->current.getDirection()).getR(), 1e-10);
+	}
+}
+
+TEST(testPropagationCK, mixedPrecision) {
+	// at fixed steps the single-precision stages deviate far below the tolerance
+	ref_ptr<Grid3f> grid = new Grid3f(Vector3d(0.), 16, 100 * kpc);
+	for (int ix = 0; ix < 16; ix++)
+		for (int iy = 0; iy < 16; iy++)
+			for (int iz = 0; iz < 16; iz++)
+				grid->get(ix, iy, iz) = Vector3f(sin(M_PI * iz / 8), cos(M_PI * ix / 8), sin(M_PI * iy / 8)) * nG;
+	ref_ptr<MagneticField> field = new MagneticFieldGrid(grid);
+	PropagationCK propa(field, 1e-4, 100 * kpc, 100 * kpc);
+	PropagationCK mixed(field, 1e-4, 100 * kpc, 100 * kpc);
+	mixed.setMixedPrecision(true);
+	EXPECT_TRUE(mixed.isMixedPrecision());
+
+	std::vector<ref_ptr<Candidate> > reference, batch;
+	std::vector<Candidate*> pReference, pBatch;
+	for (int i = 0; i < 20; i++) {
+		Vector3d direction(cos(i), sin(i), 0.1 * i);
+		reference.push_back(new Candidate(nucleusId(1, 1), (1 + i) * EeV, Vector3d(0.), direction));
+		batch.push_back(new Candidate(nucleusId(1, 1), (1 + i) * EeV, Vector3d(0.), direction));
+		pReference.push_back(reference.back());
+		pBatch.push_back(batch.back());
+	}
+
+	for (int k = 0; k < 50; k++) {
+		propa.processBatch(&pReference[0], pReference.size());
+		mixed.processBatch(&pBatch[0], pBatch.size());
+	}
+	for (size_t i = 0; i < reference.size(); i++) {
+		double L = reference[i]->getTrajectoryLength();
+		double d = (reference[i]->current.getPosition() - batch[i]->current.getPosition()).getR();
+		EXPECT_NEAR(0, d, 1e-6 * L);
+		EXPECT_NEAR(0, (reference[i]->current.getDirection() - batch[i]->current.getDirection()).getR(), 1e-6);
+	}
+
+	// too small tolerances for single precision keep the double-precision lanes
+	mixed.setTolerance(1e-8);
+	propa.setTolerance(1e-8);
+	propa.processBatch(&pReference[0], pReference.size());
+	for (size_t i = 0; i < reference.size(); i++)
+		batch[i] = reference[i]->clone(false);
+	for (size_t i = 0; i < reference.size(); i++)
+		pBatch[i] = batch[i];
+	propa.processBatch(&pReference[0], pReference.size());
+	mixed.processBatch(&pBatch[0], pBatch.size());
+	for (size_t i = 0; i < reference.size(); i++)
+		EXPECT_EQ(reference[i]->current.getPosition(), batch[i]->current.getPosition());
+}
+
+TEST(testPropagationCK, statistics) {
+	PropagationCK propa(new UniformMagneticField(Vector3d(0, 0, 100 * nG)), 1e-15, 0.1 * kpc, 1 * Gpc);
+	IntegratorStatistics s;
+	EXPECT_FALSE(propa.getIntegratorStatistics(s));
+
+	propa.setRecordStatistics(true, true);
+	Candidate c(nucleusId(1, 1), 100 * TeV, Vector3d(0, 0, 0), Vector3d(0, 1, 0));
+	c.setNextStep(1 * Gpc);
+	for (int i = 0; i < 3; i++)
+		propa.process(&c);
+
+	// the tolerance is never met, the step is reduced down to the minimum step
+	ASSERT_TRUE(propa.getIntegratorStatistics(s));
+	EXPECT_EQ(3, s.acceptedSteps);
+	EXPECT_EQ(3, s.minimumSteps);
+	EXPECT_LT(0, s.rejectedSteps);
+	EXPECT_EQ(6 * (s.acceptedSteps + s.rejectedSteps), s.fieldEvaluations);
+	EXPECT_EQ(s.rejectedSteps, c.getProperty("PropagationCK.rejectedSteps").toUInt64());
+	EXPECT_EQ(3, c.getProperty("PropagationCK.acceptedSteps").toUInt64());
+
+	propa.resetStatistics();
+	propa.getIntegratorStatistics(s);
+	EXPECT_EQ(0, s.acceptedSteps);
+}
+
 TEST(testPropagationBP, zeroField) {
 	PropagationBP propa(new UniformMagneticField(Vector3d(0, 0, 0)), 1 * kpc);
 
@@ -245,6 +358,23 @@ TEST(testPropagationBP, increaseStep) {
 }
 
 
+TEST(testPropagationBP, statistics) {
+	PropagationBP propa(new UniformMagneticField(Vector3d(0, 0, 1 * nG)), 0.9, 0.001 * pc, 3.125 * pc);
+	propa.setRecordStatistics();
+	Candidate c(nucleusId(1, 1), 100 * EeV, Vector3d(0, 0, 0), Vector3d(0, 1, 0));
+	for (int i = 0; i < 5; i++)
+		propa.process(&c);
+
+	// the steps are increased without rejections
+	IntegratorStatistics s;
+	ASSERT_TRUE(propa.getIntegratorStatistics(s));
+	EXPECT_EQ(5, s.acceptedSteps);
+	EXPECT_EQ(0, s.rejectedSteps);
+	EXPECT_EQ(0, s.minimumSteps);
+	EXPECT_EQ(15, s.fieldEvaluations);
+	EXPECT_FALSE(c.hasProperty("PropagationBP.acceptedSteps"));
+}
+
 TEST(testPropagationBP, proton) {
 	PropagationBP propa(new UniformMagneticField(Vector3d(0, 0, 1 * nG)));
 
@@ -336,6 +466,280 @@ TEST(testPropagationBP, neutron) {
 }
 
 
+// counts the field evaluations
+class CountingField: public MagneticField {
+public:
+	Vector3d B;
+	mutable size_t count;
+	CountingField(const Vector3d &B) : B(B), count(0) {}
+	Vector3d getField(const Vector3d &position) const {
+		count++;
+		return B;
+	}
+};
+
+TEST(testPropagationDP, proton) {
+	PropagationDP propa(new UniformMagneticField(Vector3d(0, 0, 1 * nG)));
+
+	double minStep = 0.1 * kpc;
+	propa.setMinimumStep(minStep);
+
+	ParticleState p;
+	p.setId(nucleusId(1, 1));
+	p.setEnergy(100 * EeV);
+	p.setPosition(Vector3d(0, 0, 0));
+	p.setDirection(Vector3d(0, 1, 0));
+	Candidate c(p);
+	c.setNextStep(0);
+
+	propa.process(&c);
+
+	EXPECT_DOUBLE_EQ(minStep, c.getCurrentStep());  // perform minimum step
+	EXPECT_DOUBLE_EQ(5 * minStep, c.getNextStep());  // acceleration by factor 5
+}
+
+TEST(testPropagationDP, gyration) {
+	// 100 EeV positron in 1 nG: circle around (R, 0, 0)
+	ref_ptr<CountingField> field = new CountingField(Vector3d(0, 0, 1 * nG));
+	PropagationDP propa(field, 1e-6, 1 * kpc, 5 * Mpc);
+	Candidate c(-11, 100 * EeV, Vector3d(0, 0, 0), Vector3d(0, 1, 0));
+	double R = 100 * EeV / (c_light * eplus * 1 * nG);
+	Vector3d center(R, 0, 0);
+
+	for (int i = 0; i < 100; i++)
+		propa.process(&c);
+	EXPECT_NEAR(R, (c.current.getPosition() - center).getR(), 1e-6 * R);
+
+	// first same as last: 6 evaluations per step after the first
+	for (int i = 0; i < 10; i++) {
+		size_t before = field->count;
+		propa.process(&c);
+		EXPECT_EQ(6, field->count - before);
+	}
+
+	// dense output within the last step
+	Vector3d x, u;
+	EXPECT_TRUE(propa.getDenseOutput(&c, 0, x, u));
+	EXPECT_NEAR(0, (x - c.previous.getPosition()).getR(), 1e-9 * R);
+	EXPECT_TRUE(propa.getDenseOutput(&c, 1, x, u));
+	EXPECT_NEAR(0, (x - c.current.getPosition()).getR(), 1e-9 * R);
+	propa.getDenseOutput(&c, 0.5, x, u);
+	EXPECT_NEAR(R, (x - center).getR(), 1e-6 * R);
+	EXPECT_NEAR(0, u.dot(x - center), 1e-6 * R);
+}
+
+TEST(testPropagationDP, replacedField) {
+	// the field kept from the last step is not reused with another field
+	ref_ptr<CountingField> field = new CountingField(Vector3d(0, 0, 1 * nG));
+	PropagationDP propa(field, 1e-6, 1 * kpc, 5 * Mpc);
+	Candidate c(-11, 100 * EeV, Vector3d(0, 0, 0), Vector3d(0, 1, 0));
+	for (int i = 0; i < 10; i++)
+		propa.process(&c);
+
+	ref_ptr<CountingField> other = new CountingField(Vector3d(0, 0, 2 * nG));
+	propa.setField(other);
+	propa.process(&c);
+	EXPECT_EQ(7, other->count);
+	size_t before = other->count;
+	propa.process(&c);
+	EXPECT_EQ(6, other->count - before);
+
+	// nor for another candidate at the address of a deleted one, which the
+	// free list of the candidates hands out again
+	ref_ptr<Candidate> deleted = new Candidate(c);
+	propa.process(deleted);
+	const Candidate *address = deleted.get();
+	Vector3d position = deleted->current.getPosition();
+	Vector3d direction = deleted->current.getDirection();
+	deleted = NULL;
+	ref_ptr<Candidate> reused = new Candidate(-11, 100 * EeV, position, direction);
+	ASSERT_EQ(address, reused.get());
+	before = other->count;
+	propa.process(reused);
+	EXPECT_EQ(7, other->count - before);
+}
+
+TEST(testPropagationDP, observerSurface) {
+	// the crossing is located with the dense output instead of limiting the steps
+	ref_ptr<PropagationDP> propa = new PropagationDP(new UniformMagneticField(Vector3d(0, 0, 1 * nG)), 1e-4, 1 * kpc, 10 * Mpc);
+	ref_ptr<ObserverSurface> surface = new ObserverSurface(new Plane(Vector3d(0, 3 * Mpc, 0), Vector3d(0, 1, 0)));
+	surface->setDenseOutput(propa);
+	Observer obs;
+	obs.add(surface);
+
+	Candidate c(-11, 100 * EeV, Vector3d(0, 0, 0), Vector3d(0, 1, 0));
+	c.setNextStep(10 * Mpc);
+	propa->process(&c);
+	EXPECT_GT(c.current.getPosition().y, 3 * Mpc);
+	obs.process(&c);
+	EXPECT_FALSE(c.isActive());
+	EXPECT_NEAR(3 * Mpc, c.current.getPosition().y, 1e-6 * Mpc);
+	EXPECT_NEAR(3 * Mpc, c.getTrajectoryLength(), 0.01 * Mpc);
+	EXPECT_DOUBLE_EQ(c.getTrajectoryLength(), c.getCurrentStep());
+}
+
+// field along z, increasing in x with the gradient scale L
+class GradientField: public MagneticField {
+public:
+	double B0, L;
+	GradientField(double B0, double L) : B0(B0), L(L) {}
+	Vector3d getField(const Vector3d &position) const {
+		return Vector3d(0, 0, B0 * (1 + position.x / L));
+	}
+};
+
+TEST(testPropagationGC, parallelMotion) {
+	// uniform field: the guiding centre moves along the field line only
+	PropagationGC propa(new UniformMagneticField(Vector3d(0, 0, 1 * muG)), 0.1, 10 * kpc, 10 * kpc);
+	Candidate c(nucleusId(1, 1), 1 * EeV, Vector3d(0, 0, 0), Vector3d(1, 0, 1) / sqrt(2));
+	propa.process(&c);
+
+	Vector3d x = c.current.getPosition();
+	EXPECT_NEAR(0, x.x, 1e-9 * kpc);
+	EXPECT_NEAR(0, x.y, 1e-9 * kpc);
+	EXPECT_NEAR(10 * kpc / sqrt(2), x.z, 1e-9 * kpc);
+	EXPECT_NEAR(1 / sqrt(2), c.current.getDirection().z, 1e-9);
+	EXPECT_DOUBLE_EQ(10 * kpc, c.getTrajectoryLength());
+}
+
+TEST(testPropagationGC, gradientDrift) {
+	// grad-B drift of a proton with 90 degree pitch along B x grad B = +y
+	double L = 1 * Mpc;
+	PropagationGC propa(new GradientField(1 * muG, L), 0.1, 10 * kpc, 10 * kpc);
+	Candidate c(nucleusId(1, 1), 1 * EeV, Vector3d(0, 0, 0), Vector3d(1, 0, 0));
+	double rg = c.current.getMomentum().getR() / eplus / (1 * muG);
+	propa.process(&c);
+
+	Vector3d x = c.current.getPosition();
+	EXPECT_NEAR(10 * kpc * rg / 2 / L, x.y, 0.01 * 10 * kpc * rg / 2 / L);
+	EXPECT_NEAR(0, x.z, 1e-9 * kpc);
+	EXPECT_NEAR(0, c.current.getDirection().z, 1e-9);
+}
+
+TEST(testPropagationGC, fullOrbit) {
+	// Larmor radius comparable to the gradient scale: full orbit as with PropagationBP
+	ref_ptr<MagneticField> field = new GradientField(1 * muG, 1 * kpc);
+	PropagationGC propa(field, 0.1, 0.1 * kpc, 0.1 * kpc);
+	PropagationBP bp(field, 0.1 * kpc);
+	Candidate c1(nucleusId(1, 1), 1 * EeV, Vector3d(0, 0, 0), Vector3d(1, 0, 0));
+	Candidate c2(nucleusId(1, 1), 1 * EeV, Vector3d(0, 0, 0), Vector3d(1, 0, 0));
+	propa.process(&c1);
+	bp.process(&c2);
+	EXPECT_NEAR(0, (c1.current.getPosition() - c2.current.getPosition()).getR(), 1e-9 * kpc);
+	EXPECT_NEAR(0, (c1.current.getDirection() - c2.current.getDirection()).getR(), 1e-12);
+}
+
+// counts the steps and moves the candidate in a straight line
+class CountedPropagation: public Module {
+public:
+	mutable size_t count;
+	CountedPropagation() : count(0) {}
+	void process(Candidate *candidate) const {
+		count++;
+		candidate->previous = candidate->current;
+		candidate->current.setPosition(candidate->current.getPosition()
+				+ candidate->current.getDirection() * candidate->getNextStep());
+		candidate->setCurrentStep(candidate->getNextStep());
+	}
+};
+
+TEST(testPropagationSmallAngle, deflection) {
+	Random::seedThreads(42);
+	TurbulenceSpectrum spectrum(1 * muG, 1 * pc, 100 * pc, 20 * pc);
+	ref_ptr<PlaneWaveTurbulence> field = new PlaneWaveTurbulence(spectrum, 64, 1);
+	double lc = field->getCorrelationLength();
+	PropagationSmallAngle propagation(field, 4, 0.1);
+	EXPECT_DOUBLE_EQ(4, propagation.getSteps());
+
+	// 0.1 EeV protons in 1 muG: r_L = 108 pc, l_c / r_L = 0.09 below the maximum deflection
+	Candidate c(nucleusId(1, 1), 0.1 * EeV, Vector3d(0.), Vector3d(1, 0, 0));
+	double rL = propagation.getLarmorRadius(&c);
+	EXPECT_NEAR(108 * pc, rL, 1 * pc);
+	EXPECT_TRUE(propagation.isSmallAngle(&c));
+
+	// mean squared deflection L l_c / r_L^2 after the distance L
+	double distance = 20 * lc, meanSquared = 0, meanOffset = 0;
+	size_t n = 2000;
+	for (size_t i = 0; i < n; i++) {
+		Candidate candidate(nucleusId(1, 1), 0.1 * EeV, Vector3d(0.), Vector3d(1, 0, 0));
+		candidate.setNextStep(1 * kpc);
+		while (candidate.getTrajectoryLength() < distance) {
+			propagation.process(&candidate);
+			EXPECT_GE(0.01 * rL * rL / lc * (1 + 1e-9), candidate.getCurrentStep());
+		}
+		double angle = candidate.current.getDirection().getAngleTo(Vector3d(1, 0, 0));
+		meanSquared += angle * angle / n;
+		meanOffset += candidate.current.getPosition().y / n;
+		EXPECT_NEAR(1, candidate.current.getDirection().getR(), 1e-12);
+	}
+	EXPECT_NEAR(distance * lc / (rL * rL), meanSquared, 0.1 * distance * lc / (rL * rL));
+	EXPECT_NEAR(0, meanOffset, 0.1 * distance);
+
+	// the fallback below the small-angle condition, neutral particles in straight lines
+	ref_ptr<CountedPropagation> fallback = new CountedPropagation();
+	propagation.setFallback(fallback);
+	Candidate slow(nucleusId(1, 1), 1 * PeV, Vector3d(0.), Vector3d(1, 0, 0));
+	slow.setNextStep(lc);
+	EXPECT_FALSE(propagation.isSmallAngle(&slow));
+	propagation.process(&slow);
+	EXPECT_EQ(1, fallback->count);
+	Candidate photon(22, 1 * PeV, Vector3d(0.), Vector3d(1, 0, 0));
+	photon.setNextStep(1 * kpc);
+	propagation.process(&photon);
+	EXPECT_EQ(1, fallback->count);
+	EXPECT_DOUBLE_EQ(4 * lc, photon.current.getPosition().x);
+	EXPECT_THROW(PropagationSmallAngle(field, 0), std::runtime_error);
+}
+
+// plane waves of a narrow band of wavelengths, of which the correlation
+// length is pi / (2 k) (the correlation function is sin(kr) / kr)
+class NarrowBandTurbulence: public PlaneWaveTurbulence {
+	double wavelength;
+public:
+	NarrowBandTurbulence(const TurbulenceSpectrum &spectrum, int nModes, int seed) :
+			PlaneWaveTurbulence(spectrum, nModes, seed),
+			wavelength(0.5 * (spectrum.getLmin() + spectrum.getLmax())) {
+	}
+	double getCorrelationLength() const {
+		return wavelength / 4;
+	}
+};
+
+TEST(testPropagationSmallAngle, fullIntegration) {
+	// the deflections agree with the integration of the field, averaged over
+	// realizations of the field; the line integral only picks up the waves
+	// nearly perpendicular to the line, so many modes are needed
+	Random::seedThreads(7);
+	TurbulenceSpectrum spectrum(1 * muG, 10 * pc, 10.2 * pc);
+	double squared[2] = {0, 0};
+	size_t n = 400;
+	Random &random = Random::instance();
+	for (size_t i = 0; i < n; i++) {
+		ref_ptr<NarrowBandTurbulence> field = new NarrowBandTurbulence(spectrum, 1024, i + 1);
+		double lc = field->getCorrelationLength();
+		PropagationSmallAngle smallAngle(field, 4, 0.1);
+		PropagationCK full(field, 1e-6, 0.01 * lc, 0.2 * lc);
+		Vector3d dir = random.randVector();
+		for (int j = 0; j < 2; j++) {
+			Candidate c(nucleusId(1, 1), 0.1 * EeV, Vector3d(0.), dir);
+			while (c.getTrajectoryLength() < 40 * lc) {
+				if (j == 0)
+					smallAngle.process(&c);
+				else
+					full.process(&c);
+			}
+			double angle = c.current.getDirection().getAngleTo(dir);
+			squared[j] += angle * angle / n;
+		}
+	}
+	Candidate proton(nucleusId(1, 1), 0.1 * EeV);
+	double lc = 2.525 * pc; // a quarter of the mean wavelength
+	double rL = proton.current.getRigidity() / (c_light * spectrum.getBrms());
+	double expected = 40 * lc * lc / (rL * rL);
+	EXPECT_NEAR(expected, squared[0], 0.1 * expected);
+	EXPECT_NEAR(squared[1], squared[0], 0.2 * squared[1]);
+}
+
 int main(int argc, char **argv) {
 	::testing::InitGoogleTest(&argc, argv);
 	return RUN_ALL_TESTS();
@@ -195,6 +195,110 @@ class testParticleCollector(unittest.TestCase):
         collector[0].getTrajectoryLength(),
         3.14, places=2)
 
+  @unittest.skipIf(not numpy_available, "numpy not available")
+  def testParticleCollectorRecordArray(self):
+    lengths = [1*crp.pc, 10*crp.pc, 100*crp.pc]
+    for compact in [True, False]:
+        collector = crp.ParticleCollector()
+        collector.setCompact(compact)
+        for l in lengths:
+            c = crp.Candidate(crp.nucleusId(4, 2), 5 * crp.EeV)
+            c.setTrajectoryLength(l)
+            collector.process(c)
+        records = collector.getRecordArray()
+        self.assertEqual(len(records), len(lengths))
+        self.assertTrue(np.allclose(records['trajectoryLength'], lengths))
+        self.assertTrue(np.all(records['current']['id'] == crp.nucleusId(4, 2)))
+        self.assertTrue(np.allclose(records['source']['energy'], 5 * crp.EeV))
+        # the view keeps the collector alive
+        del collector
+        self.assertTrue(np.allclose(records['trajectoryLength'], lengths))
+
+class testBatchModule(unittest.TestCase):
+    def testHalveEnergy(self):
+        class HalveEnergy(crp.BatchModule):
+            def __init__(self):
+                crp.BatchModule.__init__(self)
+                self.calls = 0
+            def processCandidates(self, batch):
+                self.calls += 1
+                if numpy_available:
+                    batch.getEnergy()[:] /= 2
+                else:
+                    for i in range(batch.size()):
+                        c = batch.getCandidate(i)
+                        c.current.setEnergy(c.current.getEnergy() / 2)
+
+        module = HalveEnergy()
+        candidates = crp.CandidateVector()
+        for i in range(4):
+            candidates.append(crp.CandidateRefPtr(crp.Candidate(
+                crp.nucleusId(1, 1), 10 * crp.EeV)))
+        modules = crp.ModuleList()
+        modules.add(module)
+        modules.add(crp.MinimumEnergy(1 * crp.EeV))
+        modules.runBatch(candidates, 4, False)
+        self.assertEqual(module.calls, 4)
+        for c in candidates:
+            self.assertAlmostEqual(c.current.getEnergy() / crp.EeV, 10. / 16)
+
+class testNumpyFields(unittest.TestCase):
+    def setUp(self):
+        if not numpy_available:
+            self.skipTest('numpy not available')
+        self.positions = np.random.uniform(-10, 10, (100, 3)) * crp.kpc
+
+    def vectors(self, f):
+        return np.array([[v.x, v.y, v.z] for v in
+            (f(crp.Vector3d(*x)) for x in self.positions)])
+
+    def testMagneticField(self):
+        field = crp.JF12Field()
+        fields = field.getFields(self.positions)
+        self.assertEqual(fields.shape, (100, 3))
+        self.assertTrue(np.allclose(fields, self.vectors(field.getField),
+            rtol=1e-12, atol=0))
+
+    def testAdvectionField(self):
+        field = crp.SphericalAdvectionField(crp.Vector3d(0), 20 * crp.kpc,
+                1e5, 5 * crp.kpc, 1)
+        self.assertTrue(np.allclose(field.getFields(self.positions),
+            self.vectors(field.getField), rtol=1e-12, atol=0))
+        divergences = field.getDivergences(self.positions)
+        self.assertEqual(divergences.shape, (100,))
+        expected = [field.getDivergence(crp.Vector3d(*x)) for x in self.positions]
+        self.assertTrue(np.allclose(divergences, expected, rtol=1e-12, atol=0))
+
+    def testDensity(self):
+        density = crp.Cordes()
+        expected = [density.getDensity(crp.Vector3d(*x)) for x in self.positions]
+        self.assertTrue(np.allclose(density.getDensities(self.positions),
+            expected, rtol=1e-12, atol=0))
+        self.assertRaises(ValueError, density.getDensities, np.zeros((4, 2)))
+
+class testSourceArray(unittest.TestCase):
+    def testRun(self):
+        if not numpy_available:
+            self.skipTest('numpy not available')
+        n = 100
+        ids = np.full(n, crp.nucleusId(1, 1), dtype=np.int32)
+        energies = np.linspace(1, 10, n) * crp.EeV
+        positions = np.zeros((n, 3))
+        positions[:, 0] = 10 * crp.Mpc
+        source = crp.SourceArray(ids, energies, positions)
+        self.assertEqual(source.size(), n)
+        del energies # the source keeps the arrays alive
+        collector = crp.ParticleCollector()
+        modules = crp.ModuleList()
+        modules.add(crp.SimplePropagation())
+        modules.add(crp.MaximumTrajectoryLength(1 * crp.Mpc))
+        modules.add(collector)
+        modules.run(source, n, False)
+        self.assertEqual(len(collector), n)
+        self.assertEqual(source.getRemaining(), 0)
+        self.assertRaises(RuntimeError, crp.SourceArray, ids,
+                np.ones(n), np.zeros((n - 1, 3)))
+
 class testGrid(unittest.TestCase):
   def testGridPropertiesConstructor(self):
     N = 32
@@ -202,6 +306,69 @@ class testGrid(unittest.TestCase):
     grid = crp.Grid1f(gp)
     self.assertEqual(grid.getNx(), 32)
 
+class testPickle(unittest.TestCase):
+  def testModuleList(self):
+    import pickle
+    m = crp.ModuleList()
+    m.add(crp.SimplePropagation(1 * crp.kpc, 10 * crp.Mpc))
+    obs = crp.Observer()
+    obs.add(crp.ObserverPoint())
+    m.add(obs)
+    m.add(crp.MaximumTrajectoryLength(100 * crp.Mpc))
+    m.setShowProgress(False)
+    copy = pickle.loads(pickle.dumps(m))
+    self.assertEqual(copy.size(), m.size())
+    self.assertEqual(copy.getDescription(), m.getDescription())
+
+  def testSource(self):
+    import pickle
+    s = crp.Source()
+    s.add(crp.SourcePosition(crp.Vector3d(1, 2, 3) * crp.Mpc))
+    s.add(crp.SourceParticleType(crp.nucleusId(1, 1)))
+    s.add(crp.SourcePowerLawSpectrum(1 * crp.EeV, 100 * crp.EeV, -2))
+    copy = pickle.loads(pickle.dumps(s))
+    self.assertEqual(copy.getDescription(), s.getDescription())
+    c = copy.getCandidate()
+    self.assertAlmostEqual(c.source.getPosition().x, 1 * crp.Mpc)
+
+  def testVector3(self):
+    import pickle
+    v = pickle.loads(pickle.dumps(crp.Vector3d(1, 2, 3)))
+    self.assertEqual(v.y, 2)
+
+  def testReturnedFromCpp(self):
+    import pickle
+    c = crp.Candidate()
+    with self.assertRaises(TypeError):
+      pickle.dumps(c.current)
+
+  def testRepeatedSetters(self):
+    import pickle
+    p = crp.SimplePropagation()
+    for i in range(1, 1001):
+      p.setMaximumStep(i * crp.kpc)
+    p.setMinimumStep(1 * crp.pc)
+    calls = p._crpropa_configuration['calls']
+    self.assertEqual(len(calls), 2)
+    copy = pickle.loads(pickle.dumps(p))
+    self.assertAlmostEqual(copy.getMaximumStep(), 1000 * crp.kpc)
+    self.assertAlmostEqual(copy.getMinimumStep(), 1 * crp.pc)
+
+    # keyed setters keep one call per key
+    o = crp.TextOutput(crp.Output.Event1D)
+    o.set(crp.Output.SerialNumberColumn, True)
+    o.set(crp.Output.WeightColumn, True)
+    o.set(crp.Output.SerialNumberColumn, False)
+    self.assertEqual(len(o._crpropa_configuration['calls']), 2)
+
+  def testOtherClassesNotRecorded(self):
+    import pickle
+    c = crp.Candidate()
+    c.setTrajectoryLength(1)
+    self.assertFalse('_crpropa_configuration' in c.__dict__)
+    with self.assertRaises(TypeError):
+      pickle.dumps(c)
+
 if hasattr(crp, 'GridTurbulence'):
     class testTurbulentField(unittest.TestCase):
       def testGridTurbulence(self):
@@ -1,12 +1,81 @@
 #include "crpropa/Source.h"
+#include "crpropa/SourceArray.h"
+#include "crpropa/SourceCatalog.h"
+#include "crpropa/SourceReweighting.h"
+#include "crpropa/Cosmology.h"
+#include "crpropa/module/TextOutput.h"
+#include "crpropa/module/HDF5Output.h"
 #include "crpropa/Units.h"
 #include "crpropa/ParticleID.h"
+#include "crpropa/Random.h"
+#include "crpropa/SobolSequence.h"
 
 #include "gtest/gtest.h"
 #include <stdexcept>
+#include <cstdio>
+
+#ifdef CRPROPA_HAVE_HDF5
+#include <hdf5.h>
+#endif
 
 namespace crpropa {
 
+TEST(SourceRigidityComposition, simpleTest) {
+	// dN/dR ~ R^-1 is uniform in log(E)
+	SourceRigidityComposition source(1 * EeV, 100 * EeV, -1, 0, 64);
+	source.add(nucleusId(4, 2), 1);
+	double meanLogE = 0;
+	ParticleState p;
+	for (int i = 0; i < 10000; i++) {
+		source.prepareParticle(p);
+		EXPECT_EQ(nucleusId(4, 2), p.getId());
+		EXPECT_LE(2 * EeV * (1 - 1e-12), p.getEnergy());
+		EXPECT_GE(200 * EeV * (1 + 1e-12), p.getEnergy());
+		meanLogE += log10(p.getEnergy() / 2 / EeV) / 10000;
+	}
+	EXPECT_NEAR(1, meanLogE, 0.02); // this test can stochastically fail
+}
+
+TEST(SourceRigidityComposition, minEnergy) {
+	// with E > 10 EeV only 9 / 99 of the protons remain, but all iron
+	SourceRigidityComposition source(1 * EeV, 100 * EeV, -2);
+	source.add(nucleusId(1, 1), 1);
+	source.add(nucleusId(56, 26), 1);
+	source.setMinEnergy(10 * EeV);
+	double protons = 0, meanR = 0;
+	ParticleState p;
+	size_t n = 100000;
+	for (size_t i = 0; i < n; i++) {
+		source.prepareParticle(p);
+		EXPECT_LE(10 * EeV * (1 - 1e-12), p.getEnergy());
+		if (p.getId() == nucleusId(1, 1))
+			protons += 1. / n;
+		else
+			meanR += p.getEnergy() / 26 / EeV;
+	}
+	meanR /= n * (1 - protons);
+	EXPECT_NEAR(1. / 12, protons, 0.003); // these tests can stochastically fail
+	EXPECT_NEAR(log(100.) / 0.99, meanR, 0.1);
+
+	// the same spectrum from a table
+	std::vector<double> rigidities, values;
+	for (int i = 0; i < 3; i++) {
+		rigidities.push_back(pow(10, i) * EeV);
+		values.push_back(pow(10, -2 * i));
+	}
+	SourceRigidityComposition tabulated(rigidities, values);
+	tabulated.add(nucleusId(56, 26), 1);
+	meanR = 0;
+	for (size_t i = 0; i < n; i++) {
+		tabulated.prepareParticle(p);
+		meanR += p.getEnergy() / 26 / EeV / n;
+	}
+	EXPECT_NEAR(log(100.) / 0.99, meanR, 0.1);
+
+	values[1] = -1;
+	EXPECT_THROW(SourceRigidityComposition(rigidities, values), std::runtime_error);
+}
+
 TEST(SourcePosition, simpleTest) {
 	Vector3d position(1, 2, 3);
 	SourcePosition source(position);
@@ -113,6 +182,51 @@ TEST(SourceSNRDistribution, simpleTest) {
 	EXPECT_NEAR(0., Z_mean, 0.1);
 }
 
+TEST(SourceSNRDistribution, distribution) {
+	// radius and height follow f_r and f_z, with R_max = 10 kpc
+	SourceSNRDistribution snr;
+	snr.set_RMax(10 * kpc);
+	size_t n = 100000;
+	std::vector<double> counts(10, 0.);
+	double absZ = 0;
+	ParticleState ps;
+	for (size_t i = 0; i < n; i++) {
+		snr.prepareParticle(ps);
+		Vector3d pos = ps.getPosition();
+		double r = sqrt(pos.x * pos.x + pos.y * pos.y);
+		ASSERT_GE(10 * kpc, r);
+		ASSERT_GE(5 * kpc, fabs(pos.z));
+		counts[std::min(int(r / kpc), 9)] += 1. / n;
+		absZ += fabs(pos.z) / n;
+	}
+	EXPECT_NEAR(0.3 * kpc, absZ, 0.005 * kpc);
+
+	// expected fraction per kpc bin from the midpoint rule
+	std::vector<double> expected(10, 0.);
+	double total = 0;
+	for (int i = 0; i < 10000; i++) {
+		double r = (i + 0.5) * 1e-3 * kpc;
+		expected[i / 1000] += snr.f_r(r);
+		total += snr.f_r(r);
+	}
+	for (int i = 0; i < 10; i++)
+		EXPECT_NEAR(expected[i] / total, counts[i], 0.005); // this test can stochastically fail
+}
+
+TEST(SourcePulsarDistribution, simpleTest) {
+	SourcePulsarDistribution pulsar;
+	size_t n = 100000;
+	double meanZ = 0, absZ = 0;
+	ParticleState ps;
+	for (size_t i = 0; i < n; i++) {
+		pulsar.prepareParticle(ps);
+		meanZ += ps.getPosition().z / n;
+		absZ += fabs(ps.getPosition().z) / n;
+	}
+	EXPECT_NEAR(0, meanZ, 0.005 * kpc);
+	EXPECT_NEAR(0.3 * kpc, absZ, 0.005 * kpc);
+}
+
 TEST(SourceDensityGrid, withInRange) {
 	// Create a grid with 10^3 cells ranging from (0, 0, 0) to (10, 10, 10)
 	Vector3d origin(0, 0, 0);
@@ -179,6 +293,33 @@ TEST(SourceDensityGrid, OneAllowedCell) {
 	EXPECT_NEAR(1, mean.z, 0.2);
 }
 
+TEST(SourceDensityGrid, Frequencies) {
+	// the cells are drawn according to their density, the grid is not modified
+	ref_ptr<Grid1f> grid = new Grid1f(Vector3d(0.), 2, 1, 2, 1.);
+	grid->setLayout(GridBricked);
+	grid->get(0, 0, 0) = 1;
+	grid->get(0, 0, 1) = 2;
+	grid->get(1, 0, 0) = 3;
+	grid->get(1, 0, 1) = 4;
+
+	SourceDensityGrid source(grid);
+	EXPECT_EQ(3, grid->get(1, 0, 0));
+	ParticleState p;
+	int counts[2][2] = {{0, 0}, {0, 0}};
+	int n = 100000;
+	for (int i = 0; i < n; i++) {
+		source.prepareParticle(p);
+		Vector3d pos = p.getPosition();
+		EXPECT_LE(0, pos.y);
+		EXPECT_GE(1, pos.y);
+		counts[int(pos.x)][int(pos.z)]++;
+	}
+	EXPECT_NEAR(0.1, counts[0][0] / double(n), 0.01);
+	EXPECT_NEAR(0.2, counts[0][1] / double(n), 0.01);
+	EXPECT_NEAR(0.3, counts[1][0] / double(n), 0.01);
+	EXPECT_NEAR(0.4, counts[1][1] / double(n), 0.01);
+}
+
 TEST(SourceDensityGrid1D, withInRange) {
 	// Create a grid with 10 cells ranging from 0 to 10
 	Vector3d origin(0, 0, 0);
@@ -215,6 +356,7 @@ TEST(SourceDensityGrid1D, OneAllowedCell) {
 	grid->get(5, 0, 0) = 1;
 
 	SourceDensityGrid1D source(grid);
+	EXPECT_EQ(1, grid->get(5, 0, 0));
 	ParticleState p;
 
 	for (int i = 0; i < 100; i++) {
@@ -326,6 +468,66 @@ TEST(SourceRedshiftEvolution, testInRange) {
 	}
 }
 
+TEST(SourceBiasedEmission, weights) {
+	// the weighted fraction of directions that hit a sphere of radius 0.1
+	// at distance 1 is that of isotropic emission
+	Vector3d observer(0, 1, 0);
+	double cosHit = sqrt(1 - 0.01);
+	double isotropic = (1 - cosHit) / 2;
+	SourceBiasedEmission fisher(observer, 100);
+	SourceBiasedEmission cone(observer, 0.2, SourceBiasedEmission::Cone);
+	size_t n = 100000;
+	double hitsFisher = 0, hitsCone = 0;
+	for (size_t i = 0; i < n; i++) {
+		Candidate c;
+		fisher.prepareCandidate(c);
+		EXPECT_EQ(c.source.getDirection(), c.current.getDirection());
+		if (c.source.getDirection().y > cosHit)
+			hitsFisher += c.getWeight() / n;
+
+		Candidate d;
+		cone.prepareCandidate(d);
+		EXPECT_NEAR((1 - cos(0.2)) / 2, d.getWeight(), 1e-12);
+		if (d.source.getDirection().y > cosHit)
+			hitsCone += d.getWeight() / n;
+	}
+	EXPECT_NEAR(isotropic, hitsFisher, 0.02 * isotropic); // these tests can stochastically fail
+	EXPECT_NEAR(isotropic, hitsCone, 0.02 * isotropic);
+	EXPECT_NEAR(1. / 200, fisher.getWeight(1), 1e-15);
+	EXPECT_EQ(0, cone.getWeight(-1));
+	EXPECT_THROW(SourceBiasedEmission(observer, 0), std::runtime_error);
+}
+
+TEST(SourceTargetedEmission, weights) {
+	// emission into the northern hemisphere only
+	ref_ptr<EmissionMap> maps = new EmissionMap(36, 18, 8);
+	ref_ptr<CylindricalProjectionMap> map = maps->getMap(nucleusId(1, 1), 1 * EeV);
+	for (size_t i = 9 * 36; i < 18 * 36; i++)
+		map->fillBin(i, 1 + (i % 2));
+	maps->finalize();
+	SourceTargetedEmission targeted(maps);
+
+	double sum = 0;
+	size_t n = 10000;
+	for (size_t i = 0; i < n; i++) {
+		Candidate c(nucleusId(1, 1), 1 * EeV);
+		targeted.prepareCandidate(c);
+		EXPECT_TRUE(c.isActive());
+		EXPECT_LE(0, c.source.getDirection().z);
+		EXPECT_EQ(c.source.getDirection(), c.current.getDirection());
+		sum += c.getWeight() / n;
+	}
+	// the weights of the hemisphere sum to its fraction of the sphere
+	EXPECT_NEAR(0.5, sum, 0.02);
+	EXPECT_DOUBLE_EQ(0, SourceTargetedEmission::getWeight(*map, 0));
+	EXPECT_DOUBLE_EQ(486. / 648, SourceTargetedEmission::getWeight(*map, 9 * 36)); // sum / (1 * bins)
+
+	// no map for the energy
+	Candidate d(nucleusId(1, 1), 100 * EeV);
+	targeted.prepareCandidate(d);
+	EXPECT_FALSE(d.isActive());
+}
+
 TEST(Source, allPropertiesUsed) {
 	Source source;
 	source.add(new SourcePosition(Vector3d(10, 0, 0) * Mpc));
@@ -406,6 +608,413 @@ TEST(SourceList, luminosity) {
 	EXPECT_NEAR(80, meanE, 4); // this test can stochastically fail
 }
 
+TEST(Source, getCandidates) {
+	// block wise prepared candidates follow the same distributions
+	Source source;
+	source.add(new SourceParticleType(nucleusId(1, 1)));
+	source.add(new SourceUniformBox(Vector3d(1, 2, 3), Vector3d(2, 2, 2)));
+	source.add(new SourceIsotropicEmission());
+	source.add(new SourcePowerLawSpectrum(1, 100, -1));
+	std::vector<ref_ptr<Candidate> > candidates(1, source.getCandidate());
+	source.getCandidates(1000, candidates);
+	EXPECT_EQ(1001, candidates.size());
+
+	double meanLogE = 0;
+	Vector3d meanDirection(0.);
+	for (size_t i = 1; i < candidates.size(); i++) {
+		const Candidate *c = candidates[i];
+		EXPECT_NE(candidates[i - 1].get(), c);
+		Vector3d pos = c->source.getPosition();
+		for (int d = 0; d < 3; d++) {
+			EXPECT_LE(1 + d, pos.data[d]);
+			EXPECT_GE(3 + d, pos.data[d]);
+		}
+		EXPECT_NEAR(1, c->source.getDirection().getR(), 1e-12);
+		EXPECT_LE(1, c->source.getEnergy());
+		EXPECT_GE(100, c->source.getEnergy());
+		EXPECT_EQ(nucleusId(1, 1), c->current.getId());
+		EXPECT_EQ(pos, c->created.getPosition());
+		EXPECT_EQ(pos, c->current.getPosition());
+		EXPECT_EQ(c->source.getEnergy(), c->previous.getEnergy());
+		meanLogE += log10(c->source.getEnergy()) / 1000;
+		meanDirection += c->source.getDirection() / 1000;
+	}
+	EXPECT_NEAR(1, meanLogE, 0.1); // these tests can stochastically fail
+	EXPECT_GT(0.1, meanDirection.getR());
+}
+
+TEST(Source, quasiRandom) {
+	Source source;
+	source.add(new SourceParticleType(nucleusId(1, 1)));
+	source.add(new SourceUniformBox(Vector3d(1, 2, 3), Vector3d(2, 2, 2)));
+	source.add(new SourceIsotropicEmission());
+	source.add(new SourcePowerLawSpectrum(1, 100, -1));
+	EXPECT_FALSE(source.isQuasiRandom());
+	EXPECT_EQ(6, source.getQuasiRandomDimensions());
+	source.setQuasiRandom(true, 42);
+	EXPECT_TRUE(source.isQuasiRandom());
+
+	size_t n = 1024;
+	std::vector<ref_ptr<Candidate> > candidates(1, source.getCandidate());
+	source.getCandidates(n - 1, candidates);
+	EXPECT_EQ(n, source.getNextPoint());
+
+	// one energy in each of the n quantiles, mean positions exact to ~1/n
+	std::vector<int> quantiles(n, 0);
+	Vector3d meanPosition(0.), meanDirection(0.);
+	for (size_t i = 0; i < n; i++) {
+		const Candidate *c = candidates[i];
+		EXPECT_EQ(nucleusId(1, 1), c->current.getId());
+		EXPECT_EQ(c->source.getPosition(), c->current.getPosition());
+		EXPECT_NEAR(1, c->source.getDirection().getR(), 1e-12);
+		double u = log10(c->source.getEnergy()) / 2;
+		quantiles[std::min(size_t(u * n), n - 1)]++;
+		meanPosition += c->source.getPosition() / n;
+		meanDirection += c->source.getDirection() / n;
+	}
+	for (size_t i = 0; i < n; i++)
+		EXPECT_EQ(1, quantiles[i]);
+	EXPECT_NEAR(0, meanPosition.getDistanceTo(Vector3d(2, 3, 4)), 0.01);
+	EXPECT_GT(0.01, meanDirection.getR());
+
+	// the same points candidate by candidate
+	source.setQuasiRandom(true, 42, 1);
+	ref_ptr<Candidate> c = source.getCandidate();
+	EXPECT_EQ(candidates[1]->source.getPosition(), c->source.getPosition());
+	EXPECT_EQ(candidates[1]->source.getEnergy(), c->source.getEnergy());
+
+	// features without quasi-random numbers draw pseudo-random numbers
+	source.add(new SourceEmissionCone(Vector3d(1, 0, 0), 0.1));
+	EXPECT_EQ(6, source.getQuasiRandomDimensions());
+	EXPECT_NO_THROW(source.getCandidate());
+
+	source.setQuasiRandom(false);
+	EXPECT_FALSE(source.isQuasiRandom());
+	for (int i = 0; i < 6; i++)
+		source.add(new SourceUniformSphere(Vector3d(0.), 1));
+	EXPECT_NO_THROW(source.getCandidate());
+	EXPECT_THROW(source.setQuasiRandom(true), std::runtime_error);
+}
+
+TEST(SobolSequence, points) {
+	// the plain sequence starts with the van der Corput sequence in the first dimension
+	SobolSequence plain(2, 0, false);
+	double first[4] = {0, 0.5, 0.25, 0.75};
+	for (int i = 0; i < 4; i++)
+		EXPECT_NEAR(first[i], plain.getPoint(i)[0], 1e-9);
+
+	// scrambled, every 16 x 16 cell holds one of 256 points
+	SobolSequence sequence(SobolSequence::maxDimensions, 7);
+	std::vector<int> cells(256, 0);
+	for (size_t i = 0; i < 256; i++) {
+		std::vector<double> u = sequence.getPoint(i);
+		for (size_t d = 0; d < u.size(); d++) {
+			EXPECT_LT(0, u[d]);
+			EXPECT_GT(1, u[d]);
+		}
+		cells[int(u[0] * 16) * 16 + int(u[1] * 16)]++;
+	}
+	for (size_t i = 0; i < 256; i++)
+		EXPECT_EQ(1, cells[i]);
+
+	EXPECT_THROW(SobolSequence(SobolSequence::maxDimensions + 1), std::runtime_error);
+	EXPECT_THROW(sequence.getPoint(uint64_t(1) << 32), std::runtime_error);
+}
+
+TEST(SourceList, getCandidates) {
+	SourceList sourceList;
+	ref_ptr<Source> source1 = new Source;
+	source1->add(new SourceEnergy(100));
+	sourceList.add(source1, 80);
+	ref_ptr<Source> source2 = new Source;
+	source2->add(new SourceEnergy(0));
+	sourceList.add(source2, 20);
+
+	std::vector<ref_ptr<Candidate> > candidates;
+	sourceList.getCandidates(1000, candidates);
+	EXPECT_EQ(1000, candidates.size());
+	double meanE = 0;
+	for (size_t i = 0; i < candidates.size(); i++)
+		meanE += candidates[i]->created.getEnergy() / 1000;
+	EXPECT_NEAR(80, meanE, 4); // this test can stochastically fail
+}
+
+TEST(SourceArray, rows) {
+	int32_t id[3] = {nucleusId(1, 1), nucleusId(4, 2), 11};
+	double energy[3] = {1 * EeV, 2 * EeV, 3 * EeV};
+	double position[9] = {1, 2, 3, 4, 5, 6, 7, 8, 9};
+	double direction[9] = {0, 0, 1, 0, 1, 0, 1, 0, 0};
+	double weight[3] = {1, 0.5, 0.25};
+	SourceArray source(3, id, energy, position, direction, NULL, weight);
+	EXPECT_EQ(3, source.size());
+
+	ref_ptr<Candidate> c = source.getCandidate(1);
+	EXPECT_EQ(nucleusId(4, 2), c->source.getId());
+	EXPECT_EQ(2 * EeV, c->current.getEnergy());
+	EXPECT_EQ(Vector3d(4, 5, 6), c->created.getPosition());
+	EXPECT_EQ(Vector3d(0, 1, 0), c->current.getDirection());
+	EXPECT_EQ(0, c->getRedshift());
+	EXPECT_EQ(0.5, c->getWeight());
+	EXPECT_THROW(source.getCandidate(3), std::runtime_error);
+
+	// every row is handed out once
+	EXPECT_EQ(1 * EeV, source.getCandidate()->current.getEnergy());
+	std::vector<ref_ptr<Candidate> > candidates;
+	source.getCandidates(2, candidates);
+	ASSERT_EQ(2, candidates.size());
+	EXPECT_EQ(11, candidates[1]->current.getId());
+	EXPECT_EQ(0, source.getRemaining());
+	EXPECT_THROW(source.getCandidate(), std::runtime_error);
+	candidates.clear();
+	source.rewind();
+	EXPECT_THROW(source.getCandidates(4, candidates), std::runtime_error);
+	EXPECT_EQ(3, candidates.size());
+
+	// default direction and weight
+	SourceArray minimal(1, id, energy, position);
+	EXPECT_EQ(Vector3d(-1, 0, 0), minimal.getCandidate(0)->current.getDirection());
+	EXPECT_EQ(1, minimal.getCandidate(0)->getWeight());
+}
+
+TEST(SourceCatalog, binary) {
+	std::vector<Vector3d> positions;
+	std::vector<double> weights, redshifts, indices, maxEnergies;
+	for (int i = 0; i < 3; i++) {
+		positions.push_back(Vector3d(i, 2 * i, 3 * i));
+		weights.push_back(i);
+		redshifts.push_back(0.1 * i);
+		indices.push_back(-2);
+		maxEnergies.push_back(10 * (i + 1));
+	}
+	SourceCatalog::save("testCatalog.bin", positions, weights, redshifts, indices, maxEnergies);
+	ref_ptr<SourceCatalog> catalog = new SourceCatalog("testCatalog.bin", Mpc, EeV);
+	remove("testCatalog.bin"); // the mapping stays valid
+	EXPECT_EQ(3, catalog->size());
+	EXPECT_EQ(Vector3d(2, 4, 6) * Mpc, catalog->getPosition(2));
+	EXPECT_TRUE(catalog->hasRedshifts());
+	EXPECT_TRUE(catalog->hasSpectra());
+
+	// the sources are drawn according to their weights
+	int counts[3] = {0, 0, 0};
+	for (int i = 0; i < 10000; i++) {
+		Candidate c;
+		catalog->prepareCandidate(c);
+		int j = round(c.source.getPosition().x / Mpc);
+		counts[j]++;
+		EXPECT_NEAR(0.1 * j, c.getRedshift(), 1e-6);
+		EXPECT_LE(1 * EeV, c.source.getEnergy());
+		EXPECT_GE(10 * (j + 1) * EeV * (1 + 1e-6), c.source.getEnergy());
+		EXPECT_EQ(c.source.getPosition(), c.created.getPosition());
+	}
+	EXPECT_EQ(0, counts[0]);
+	EXPECT_NEAR(2. / 3, double(counts[2]) / 10000, 0.02); // this test can stochastically fail
+
+	EXPECT_THROW(SourceCatalog::save("testCatalog.bin", positions, weights, redshifts, indices),
+			std::runtime_error);
+	EXPECT_THROW(SourceCatalog("testCatalog.bin"), std::runtime_error);
+}
+
+TEST(SourceModel, density) {
+	Source source;
+	source.add(new SourceParticleType(nucleusId(1, 1)));
+	source.add(new SourcePowerLawSpectrum(1 * EeV, 100 * EeV, -1));
+	source.add(new SourceUniform1D(0, 100 * Mpc, false));
+	SourceModel original(source);
+	EXPECT_TRUE(original.hasComposition());
+	EXPECT_TRUE(original.hasSpectrum());
+	EXPECT_TRUE(original.hasDistances());
+	double p = original.getDensity(nucleusId(1, 1), 10 * EeV, 50 * Mpc);
+	EXPECT_NEAR(1 / (10 * EeV * log(100.)) / (100 * Mpc), p, 1e-6 * p);
+	EXPECT_EQ(0, original.getDensity(nucleusId(4, 2), 10 * EeV, 50 * Mpc));
+	EXPECT_EQ(0, original.getDensity(nucleusId(1, 1), 200 * EeV, 50 * Mpc));
+	EXPECT_EQ(0, original.getDensity(nucleusId(1, 1), 10 * EeV, 150 * Mpc));
+
+	// fractions of the drawn particles of SourceComposition, E^-1 at equal energy per nucleon
+	ref_ptr<SourceComposition> composition = new SourceComposition(1 * EeV, 10 * EeV, -1);
+	composition->add(nucleusId(1, 1), 1);
+	composition->add(nucleusId(4, 2), 1);
+	Source mixed;
+	mixed.add(composition);
+	SourceModel model(mixed);
+	EXPECT_FALSE(model.hasDistances());
+	double fH = log(10.), fHe = log(20.);
+	EXPECT_NEAR(fH / (fH + fHe) / (5 * EeV * fH), model.getDensity(nucleusId(1, 1), 5 * EeV, 0), 1e-6 / EeV);
+	EXPECT_EQ(0, model.getDensity(nucleusId(1, 1), 15 * EeV, 0));
+	EXPECT_GT(model.getDensity(nucleusId(4, 2), 15 * EeV, 0), 0);
+	mixed.add(new SourceEnergy(1 * EeV));
+	EXPECT_THROW(SourceModel invalid(mixed), std::runtime_error);
+}
+
+TEST(SourceEvolution1D, distribution) {
+	Random::seedThreads(5);
+	size_t n = 100000;
+
+	// uniform in the comoving distance, the redshifts of the distances
+	SourceEvolution1D uniform(0, 10 * Mpc, 1000 * Mpc, SourceEvolution1D::UniformComoving);
+	double mean = 0;
+	for (size_t i = 0; i < n; i++) {
+		Candidate c;
+		uniform.prepareCandidate(c);
+		double d = c.source.getPosition().x;
+		EXPECT_LE(10 * Mpc, d);
+		EXPECT_GE(1000 * Mpc, d);
+		EXPECT_EQ(d, c.current.getPosition().x);
+		EXPECT_NEAR(comovingDistance2Redshift(d), c.getRedshift(), 1e-4);
+		mean += d / n;
+	}
+	EXPECT_NEAR(505 * Mpc, mean, 3 * Mpc);
+
+	// comoving volume: mean = 3/4 maxD for minD = 0
+	SourceEvolution1D volume(0, 0, 1000 * Mpc, SourceEvolution1D::UniformComoving, true);
+	mean = 0;
+	for (size_t i = 0; i < n; i++) {
+		Candidate c;
+		volume.prepareCandidate(c);
+		mean += c.source.getPosition().x / n;
+	}
+	EXPECT_NEAR(750 * Mpc, mean, 3 * Mpc);
+
+	// evolution, mean of the density integrated numerically
+	SourceEvolution1D evolved(3, 10 * Mpc, 3000 * Mpc);
+	double norm = 0, expected = 0;
+	for (size_t i = 0; i < 10000; i++) {
+		double d = 10 * Mpc + (i + 0.5) * 2990 * Mpc / 10000;
+		norm += evolved.getDensity(d);
+		expected += evolved.getDensity(d) * d;
+	}
+	expected /= norm;
+	mean = 0;
+	for (size_t i = 0; i < n; i++) {
+		Candidate c;
+		evolved.prepareCandidate(c);
+		mean += c.source.getPosition().x / n;
+	}
+	EXPECT_NEAR(expected, mean, 10 * Mpc);
+
+	// reweighting model of the feature
+	Source source;
+	source.add(new SourceParticleType(nucleusId(1, 1)));
+	source.add(new SourcePowerLawSpectrum(1 * EeV, 100 * EeV, -1));
+	source.add(new SourceEvolution1D(3, 10 * Mpc, 3000 * Mpc));
+	SourceModel model(source);
+	EXPECT_TRUE(model.hasDistances());
+	Source withVolume;
+	withVolume.add(new SourceEvolution1D(3, 10 * Mpc, 3000 * Mpc, SourceEvolution1D::UniformLightTravel, true));
+	EXPECT_THROW(SourceModel invalid(withVolume), std::runtime_error);
+
+	EXPECT_THROW(SourceEvolution1D(0, 10 * Mpc, 1 * Mpc), std::runtime_error);
+}
+
+TEST(SourceReweighting, outputs) {
+	Source source;
+	source.add(new SourceParticleType(nucleusId(1, 1)));
+	source.add(new SourcePowerLawSpectrum(1 * EeV, 100 * EeV, -1));
+	source.add(new SourceUniform1D(1 * Mpc, 1000 * Mpc));
+	ref_ptr<SourceReweighting> reweighting = new SourceReweighting(new SourceModel(source));
+
+	ref_ptr<SourceModel> softer = new SourceModel();
+	softer->addIsotope(nucleusId(1, 1));
+	softer->setSpectrum(-2, 1 * EeV, 100 * EeV);
+	softer->setCutoffRigidity(50 * EeV);
+	softer->setDistances(SourceModel::UniformLightTravel, 1 * Mpc, 1000 * Mpc);
+	ref_ptr<SourceModel> evolved = new SourceModel();
+	evolved->addIsotope(nucleusId(1, 1));
+	evolved->setSpectrum(-1, 1 * EeV, 100 * EeV);
+	evolved->setDistances(SourceModel::UniformLightTravel, 1 * Mpc, 1000 * Mpc);
+	evolved->setEvolution(3);
+	EXPECT_EQ(0, reweighting->addTarget(softer));
+	EXPECT_EQ(1, reweighting->addTarget(evolved));
+	EXPECT_THROW(reweighting->addTarget(new SourceModel()), std::runtime_error);
+
+	// the same events of weight 2 in a text and an HDF5 file
+	Random::seedThreads(3);
+	size_t n = 20000;
+	ref_ptr<TextOutput> text = new TextOutput("testReweighting.txt", Output::Event1D);
+	text->enable(Output::SourcePositionColumn);
+	text->enable(Output::WeightColumn);
+#ifdef CRPROPA_HAVE_HDF5
+	ref_ptr<HDF5Output> hdf5 = new HDF5Output("testReweighting.h5", Output::Event3D);
+	hdf5->enable(Output::WeightColumn);
+#endif
+	for (size_t i = 0; i < n; i++) {
+		ref_ptr<Candidate> c = source.getCandidate();
+		c->setWeight(2);
+		text->process(c);
+#ifdef CRPROPA_HAVE_HDF5
+		hdf5->process(c);
+#endif
+	}
+	text->close();
+
+	// the weights keep the number of particles and follow the target spectrum
+	reweighting->reweight("testReweighting.txt");
+	const std::vector<double> &weights = reweighting->getWeights(0);
+	ASSERT_EQ(n, weights.size());
+	double sum = 0, sumEvolved = 0;
+	for (size_t i = 0; i < n; i++) {
+		sum += weights[i] / 2 / n;
+		sumEvolved += reweighting->getWeights(1)[i] / 2 / n;
+	}
+	EXPECT_NEAR(1, sum, 0.05); // this test can stochastically fail
+	EXPECT_NEAR(1, sumEvolved, 0.05);
+
+	// the rewritten text file
+	reweighting->writeText("testReweighting.txt", "testReweighted.txt", 1);
+	ref_ptr<SourceReweighting> again = new SourceReweighting(evolved);
+	again->addTarget(evolved);
+	again->reweight("testReweighted.txt");
+	for (size_t i = 0; i < 100; i++)
+		EXPECT_NEAR(reweighting->getWeights(1)[i], again->getWeights(0)[i], 1e-9 * again->getWeights(0)[i]);
+
+#ifdef CRPROPA_HAVE_HDF5
+	hdf5->close();
+	std::vector<double> fromText = reweighting->getWeights(0);
+	reweighting->reweight("testReweighting.h5");
+	ASSERT_EQ(n, reweighting->getWeights(0).size());
+	for (size_t i = 0; i < 100; i++)
+		EXPECT_NEAR(fromText[i], reweighting->getWeights(0)[i], 1e-4 * fromText[i]);
+	remove("testReweighting.h5");
+#endif
+	remove("testReweighting.txt");
+	remove("testReweighted.txt");
+}
+
+#ifdef CRPROPA_HAVE_HDF5
+TEST(SourceCatalog, HDF5) {
+	// positions only, the sources are equally likely
+	hid_t file = H5Fcreate("testCatalog.h5", H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+	hsize_t n = 2;
+	hid_t space = H5Screate_simple(1, &n, NULL);
+	const char *names[3] = {"x", "y", "z"};
+	double values[3][2] = {{1, 2}, {0, 0}, {-1, -1}};
+	for (int i = 0; i < 3; i++) {
+		hid_t dset = H5Dcreate2(file, names[i], H5T_NATIVE_DOUBLE, space, H5P_DEFAULT, H5P_DEFAULT,
+				H5P_DEFAULT);
+		H5Dwrite(dset, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, values[i]);
+		H5Dclose(dset);
+	}
+	H5Sclose(space);
+	H5Fclose(file);
+
+	SourceCatalog catalog("testCatalog.h5", kpc);
+	remove("testCatalog.h5");
+	EXPECT_EQ(2, catalog.size());
+	EXPECT_FALSE(catalog.hasRedshifts());
+	EXPECT_FALSE(catalog.hasSpectra());
+	EXPECT_EQ(Vector3d(2, 0, -1) * kpc, catalog.getPosition(1));
+
+	double meanX = 0;
+	for (int i = 0; i < 1000; i++) {
+		ParticleState p;
+		p.setEnergy(5 * EeV);
+		catalog.prepareParticle(p);
+		EXPECT_EQ(5 * EeV, p.getEnergy());
+		meanX += p.getPosition().x / kpc / 1000;
+	}
+	EXPECT_NEAR(1.5, meanX, 0.05); // this test can stochastically fail
+}
+#endif
+
 int main(int argc, char **argv) {
 	::testing::InitGoogleTest(&argc, argv);
 	return RUN_ALL_TESTS();
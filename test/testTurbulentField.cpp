@@ -1,9 +1,15 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
 #include <stdexcept>
 
 #include "crpropa/Grid.h"
 #include "crpropa/Units.h"
 #include "crpropa/Common.h"
 #include "crpropa/GridTools.h"
+#include "crpropa/MappedGrid.h"
+#include "crpropa/Random.h"
 #include "crpropa/magneticField/turbulentField/TurbulentField.h"
 #include "crpropa/magneticField/turbulentField/GridTurbulence.h"
 #include "crpropa/magneticField/turbulentField/PlaneWaveTurbulence.h"
@@ -22,6 +28,73 @@ TEST(testTurbulenceSpectrum, correlationLength) {
     EXPECT_NEAR(Lc, 0.498*lBo, 0.001*lBo);
 }
 
+TEST(testPlaneWaveTurbulence, getFields) {
+	// the modes are summed in the same order in getField and getFields
+	auto spectrum = TurbulenceSpectrum(1 * muG, 10 * kpc, 1 * Mpc);
+	ref_ptr<PlaneWaveTurbulence> field = new PlaneWaveTurbulence(spectrum, 32, 42);
+	std::vector<Vector3d> positions;
+	for (int i = 0; i < 50; i++)
+		positions.push_back(Vector3d(i, -2 * i, 0.5 * i * i) * kpc);
+	std::vector<double> z(50, 0);
+	std::vector<Vector3d> fields(50);
+	field->getFields(&positions[0], &z[0], &fields[0], 50);
+	for (int i = 0; i < 50; i++)
+		EXPECT_EQ(field->getField(positions[i]), fields[i]);
+
+	// the grid is filled row by row with getFields
+	ref_ptr<Grid3f> grid = new Grid3f(Vector3d(0.), 4, 1 * kpc);
+	fromMagneticField(grid, field);
+	Vector3d center = Vector3d(1.5, 2.5, 3.5) * kpc;
+	EXPECT_EQ(Vector3f(field->getField(center)), grid->get(1, 2, 3));
+}
+
+TEST(testPlaneWaveTurbulence, kernels) {
+	// every supported kernel agrees with the exact scalar evaluation
+	auto spectrum = TurbulenceSpectrum(1 * muG, 10 * kpc, 1 * Mpc);
+	ref_ptr<PlaneWaveTurbulence> field = new PlaneWaveTurbulence(spectrum, 300, 42);
+	std::vector<std::string> kernels = PlaneWaveTurbulence::getSupportedKernels();
+	EXPECT_EQ(kernels.back(), field->getKernel());
+	EXPECT_THROW(field->setKernel("unknown"), std::runtime_error);
+
+	Vector3d pos[3] = {Vector3d(0.), Vector3d(1, 2, 3) * kpc, Vector3d(-5, 70, 0.3) * Mpc};
+	Vector3d b[3];
+	field->setKernel("scalar");
+	for (int j = 0; j < 3; j++)
+		b[j] = field->getField(pos[j]);
+	for (size_t i = 0; i < kernels.size(); i++) {
+		field->setKernel(kernels[i]);
+		for (int j = 0; j < 3; j++) {
+			Vector3d d = field->getField(pos[j]) - b[j];
+			EXPECT_NEAR(0, d.getR(), 1e-5 * muG) << kernels[i];
+		}
+
+		// blocks of modes and groups of positions in getFields
+		std::vector<Vector3d> positions(7), fields(7);
+		for (size_t j = 0; j < positions.size(); j++)
+			positions[j] = pos[j % 3] + Vector3d(j) * kpc;
+		field->getFields(positions.data(), 0, fields.data(), positions.size());
+		for (size_t j = 0; j < positions.size(); j++) {
+			Vector3d d = fields[j] - field->getField(positions[j]);
+			EXPECT_NEAR(0, d.getR(), 1e-6 * muG) << kernels[i];
+		}
+	}
+}
+
+TEST(testPlaneWaveTurbulence, offloadThreshold) {
+	// batches at the offload threshold agree with getField
+	auto spectrum = TurbulenceSpectrum(1 * muG, 10 * kpc, 1 * Mpc);
+	ref_ptr<PlaneWaveTurbulence> field = new PlaneWaveTurbulence(spectrum, 100, 42);
+	size_t threshold = MagneticField::getOffloadThreshold();
+	MagneticField::setOffloadThreshold(1);
+	std::vector<Vector3d> positions(20), fields(20);
+	for (size_t j = 0; j < positions.size(); j++)
+		positions[j] = Vector3d(j, 2, -3. * j) * kpc;
+	field->getFields(positions.data(), 0, fields.data(), positions.size());
+	MagneticField::setOffloadThreshold(threshold);
+	for (size_t j = 0; j < positions.size(); j++)
+		EXPECT_NEAR(0, (fields[j] - field->getField(positions[j])).getR(), 1e-5 * muG);
+}
+
 #ifdef CRPROPA_HAVE_FFTW3F
 
 TEST(testSimpleGridTurbulence, oldFunctionForCrrelationLength) { //TODO: remove in future
@@ -115,6 +188,93 @@ TEST(testGridTurbulence, Turbulence_seed) {
 	Vector3d pos(22 * Mpc);
 	EXPECT_FLOAT_EQ(tf1.getField(pos).x, tf2.getField(pos).x);
 }
+
+TEST(testGridTurbulence, Wisdom) {
+	// measured plans from the wisdom file give the same field
+	size_t n = 32;
+	double spacing = 1 * Mpc;
+	auto spectrum = TurbulenceSpectrum(1, 2 * spacing, 8 * spacing, 8 * spacing / 6);
+	auto gp = GridProperties(Vector3d(0, 0, 0), n, spacing);
+	auto tf1 = GridTurbulence(spectrum, gp, 42);
+
+	GridTurbulence::setWisdomFile("testWisdom.fftw");
+	auto tf2 = GridTurbulence(spectrum, gp, 42);
+	auto tf3 = GridTurbulence(spectrum, gp, 42);
+	GridTurbulence::setWisdomFile("");
+	std::ifstream wisdom("testWisdom.fftw");
+	EXPECT_TRUE(wisdom.good());
+	wisdom.close();
+	std::remove("testWisdom.fftw");
+
+	Vector3d pos(5.5 * Mpc, 11 * Mpc, 17.2 * Mpc);
+	Vector3d b1 = tf1.getField(pos), b3 = tf3.getField(pos);
+	EXPECT_NEAR(b1.x, tf2.getField(pos).x, 1e-5);
+	EXPECT_NEAR(b1.x, b3.x, 1e-5);
+	EXPECT_NEAR(b1.y, b3.y, 1e-5);
+	EXPECT_NEAR(b1.z, b3.z, 1e-5);
+}
+TEST(testGridTurbulence, batchedInverseFFT) {
+	// the batched transform of the three components into the grid gives the
+	// transforms of the single components of the previous implementation
+	size_t n = 16, n2 = n / 2 + 1, nModes = n * n * n2;
+	ref_ptr<Grid3f> grid = new Grid3f(Vector3d(0, 0, 0), n, 1 * Mpc);
+	fftwf_complex *Bk = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * 3 * nModes);
+	fftwf_plan plan = GridTurbulence::planInverseFFT(grid, Bk);
+	Random random;
+	random.seed(42);
+	std::vector<float> modes(6 * nModes);
+	for (size_t i = 0; i < modes.size(); i++)
+		modes[i] = random.rand() - 0.5;
+	std::copy(modes.begin(), modes.end(), (float *)Bk);
+	GridTurbulence::executeInverseFFT(plan);
+	fftwf_free(Bk);
+
+	fftwf_complex *Ck = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * nModes);
+	std::vector<float> B(n * n * n);
+	for (int c = 0; c < 3; c++) {
+		std::copy(modes.begin() + 2 * c * nModes, modes.begin() + 2 * (c + 1) * nModes, (float *)Ck);
+		fftwf_plan single = fftwf_plan_dft_c2r_3d(n, n, n, Ck, B.data(), FFTW_ESTIMATE);
+		fftwf_execute(single);
+		fftwf_destroy_plan(single);
+		float scale = 0;
+		for (size_t i = 0; i < B.size(); i++)
+			scale = std::max(scale, std::fabs(B[i]));
+		for (size_t ix = 0; ix < n; ix++)
+			for (size_t iy = 0; iy < n; iy++)
+				for (size_t iz = 0; iz < n; iz++)
+					EXPECT_NEAR(B[(ix * n + iy) * n + iz], grid->get(ix, iy, iz).data[c], 1e-5 * scale);
+	}
+	fftwf_free(Ck);
+}
+
+TEST(testGridTurbulence, generateToFile) {
+	// the out-of-core generation gives the field of GridTurbulence
+	size_t n = 16;
+	double spacing = 1 * Mpc;
+	auto spectrum = TurbulenceSpectrum(1, 2 * spacing, 8 * spacing, 8 * spacing / 6);
+	auto gp = GridProperties(Vector3d(0, 0, 0), n, spacing);
+	auto tf = GridTurbulence(spectrum, gp, 42);
+
+	// memory for 3 of the 16 y-rows, so that the last block is shorter
+	size_t rowBytes = n * (8 * 3 * (n / 2 + 1) + 12 * n);
+	GridTurbulence::generateToFile(spectrum, gp, "testTurbulence.grid", 42, 3 * rowBytes);
+	std::ifstream scratch("testTurbulence.grid.scratch");
+	EXPECT_FALSE(scratch.good());
+	{
+		ref_ptr<MappedGrid3f> mapped = new MappedGrid3f("testTurbulence.grid");
+		EXPECT_EQ(n, mapped->getNx());
+		const ref_ptr<Grid3f> &grid = tf.getGrid();
+		for (size_t ix = 0; ix < n; ix++)
+			for (size_t iy = 0; iy < n; iy++)
+				for (size_t iz = 0; iz < n; iz++) {
+					Vector3f a = grid->get(ix, iy, iz), b = mapped->get(ix, iy, iz);
+					EXPECT_NEAR(a.x, b.x, 1e-4);
+					EXPECT_NEAR(a.y, b.y, 1e-4);
+					EXPECT_NEAR(a.z, b.z, 1e-4);
+				}
+	}
+	std::remove("testTurbulence.grid");
+}
 #endif // CRPROPA_HAVE_FFTW3F
 
 int main(int argc, char **argv) {
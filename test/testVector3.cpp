@@ -154,6 +154,19 @@ TEST(Vector3, parallelPerpendicular) {
 	EXPECT_DOUBLE_EQ(vperp.z, 1);
 }
 
+TEST(Vector3, paddingLane) {
+	// an element-wise division leaves any value in the padding lane of a
+	// padded Vector3d, which must not enter the sums
+	Vector3d v = Vector3d(1, 2, 3) / Vector3d(1, 1, 1);
+	EXPECT_DOUBLE_EQ(v.getR2(), 14);
+	EXPECT_DOUBLE_EQ(v.dot(Vector3d(1, 1, 1)), 6);
+	Vector3d c = v.cross(Vector3d(0, 0, 1));
+	EXPECT_DOUBLE_EQ(c.x, 2);
+	EXPECT_DOUBLE_EQ(c.y, -1);
+	EXPECT_DOUBLE_EQ(c.z, 0);
+	EXPECT_TRUE(v == Vector3d(1, 2, 3));
+}
+
 int main(int argc, char **argv) {
 	::testing::InitGoogleTest(&argc, argv);
 	return RUN_ALL_TESTS();